@@ -40,6 +40,12 @@ int start_read_name(struct co_drv* drv, struct example* self)
 	return r;
 }
 
+/* Event driven TPDO1 with an inhibit time of 10 ms, if the node has one */
+static const struct co_sdo_step config_[] = {
+	CO_SDO_WRITE_U8(0x1800, 2, 255),
+	{ CO_SDO_DOWNLOAD, 0x1800, 3, 2, 100, .on_failure = CO_SDO_IGNORE },
+};
+
 void on_pdo1(struct co_drv* drv, const void* data, size_t size)
 {
 	struct example* self = co_get_context(drv);
@@ -63,6 +69,8 @@ int co_drv_init(struct co_drv* drv)
 
 	co_set_pdo1_fn(drv, on_pdo1);
 
+	co_sdo_run_script(drv, config_, sizeof(config_) / sizeof(config_[0]),
+			  NULL);
 	start_read_name(drv, self);
 
 	return 0;
@@ -0,0 +1,181 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/**
+ * @file CanIOHandlerInterface2.h
+ *
+ * Second version of the C++ driver interface.
+ *
+ * The first version passes every PDO through one of four virtual functions
+ * with a mutable buffer, so the master has to cast away const and guard each
+ * call with a try block. Here the PDO path is a single noexcept function that
+ * takes a read-only view of the frame along with the time at which it was
+ * received, and the master hands the handler its own buffer.
+ *
+ * A driver opts in by exporting candriver_create_handler2() and
+ * candriver_delete_handler2() next to the symbols of the first version. Drivers
+ * that do not are wrapped in an adapter by the loader and keep working as
+ * before.
+ */
+
+#ifndef _can_handler_interface2__h
+#define _can_handler_interface2__h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "CanMasterInterface.h"
+
+namespace CanIOMapDriver
+{
+
+/**
+ * A read-only view of bytes owned by someone else. It is only valid for the
+ * duration of the call that it is passed to.
+ */
+struct ConstBytes
+{
+    const uint8_t* data;
+    size_t size;
+
+    const uint8_t* begin() const noexcept { return data; }
+    const uint8_t* end() const noexcept { return data + size; }
+    uint8_t operator[](size_t i) const noexcept { return data[i]; }
+    bool empty() const noexcept { return size == 0; }
+};
+
+/**
+ * A received PDO. n is 1 to 4 and the timestamp is in microseconds on the
+ * monotonic clock.
+ */
+struct PdoFrame
+{
+    int n;
+    const uint8_t* data;
+    size_t size;
+    uint64_t timestamp;
+
+    ConstBytes bytes() const noexcept { ConstBytes b = { data, size }; return b; }
+};
+
+/**
+ * What the master offers to second version handlers. The data passed to the
+ * send functions is copied before they return.
+ */
+class CanMasterInterface2 : public CanMasterInterface
+{
+    public:
+        /**
+         * @brief Sends RPDO n, 1 to 4
+         * @return 0 if successful or -1 if an error occurred
+         */
+        virtual int sendPdo(int n, const uint8_t* data, size_t size) noexcept = 0;
+
+        /**
+         * @brief Writes to the object dictionary of the node
+         * @return 0 if successful or -1 if an error occurred
+         */
+        virtual int sendSdo(int index, int subindex, const uint8_t* data,
+                            size_t size) noexcept = 0;
+
+        using CanMasterInterface::sendSdo;
+};
+
+class CanIOHandlerInterface2
+{
+    public:
+        CanIOHandlerInterface2() {}
+        virtual ~CanIOHandlerInterface2() {}
+
+        /**
+         * @brief Called when TPDO n, 1 to 4, is received from the node
+         * @param timestamp When the frame was received, in microseconds
+         * @return 0 if successful, 1 if nothing was done or -1 if an error occurred
+         * @note This must not throw and it should not block
+         */
+        virtual int processPdo(int n, const uint8_t* data, size_t size,
+                               uint64_t timestamp) noexcept = 0;
+
+        /**
+         * @brief Called with PDOs that were received together, in order
+         * @return The number of PDOs that were handled without errors
+         * @note Override this to amortise work that is the same for each
+         * frame; by default, each one is passed to processPdo()
+         */
+        virtual size_t processPdos(const PdoFrame* pdos, size_t n) noexcept
+        {
+            size_t n_ok = 0;
+            for (size_t i = 0; i < n; ++i)
+                if (processPdo(pdos[i].n, pdos[i].data, pdos[i].size,
+                               pdos[i].timestamp) >= 0)
+                    ++n_ok;
+            return n_ok;
+        }
+
+        /**
+         * @brief Called when an SDO upload from the node has finished
+         * @return 0 if successful, 1 if nothing was done or -1 if an error occurred
+         */
+        virtual int processSdo(int index, int subindex, ConstBytes data) = 0;
+
+        /**
+         * @brief Called when there is a new Emergency CAN message
+         * @return 0 if successful, 1 if nothing was done or -1 if an error occurred
+         */
+        virtual int processEmr(unsigned short emergencyErrorcode,
+                               unsigned char errorRegister,
+                               unsigned long long manufacturerError) = 0;
+
+        /**
+         * @brief Called when the node changes state
+         * @return 0 if successful, 1 if nothing was done or -1 if an error occurred
+         */
+        virtual int processNodeState(int state) = 0;
+
+        /**
+         * Initializes the handler
+         * @return 0 if successful, 1 if successful but with errors and -1 if failed
+         */
+        virtual int initialize() = 0;
+};
+
+} /* End of namespace */
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+    /**
+     * Like candriver_create_handler() but for second version handlers.
+     * Optional; the loader falls back to candriver_create_handler().
+     *
+     * @ingroup CANDriverInterface
+     */
+    typedef int candriver_create_handler2_t(const char* nodeName, int32_t profileNr,
+                                            CanIOMapDriver::CanMasterInterface2* cmi,
+                                            CanIOMapDriver::CanIOHandlerInterface2** chi);
+    /**
+     * Deletes a handler that was made by candriver_create_handler2(). Required
+     * if that is exported.
+     *
+     * @ingroup CANDriverInterface
+     */
+    typedef int candriver_delete_handler2_t(CanIOMapDriver::CanIOHandlerInterface2* chi);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _can_handler_interface2__h */
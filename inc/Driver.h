@@ -19,6 +19,7 @@
 #include <stdexcept>
 #include <dlfcn.h>
 #include "CanIOHandlerInterface.h"
+#include "CanIOHandlerInterface2.h"
 #include "StateFactory.h"
 
 class Driver
@@ -33,6 +34,8 @@ class Driver
     candriver_delete_handler_t* candriver_delete_handler;
     candriver_delete_all_handlers_t* candriver_delete_all_handlers;
     candriver_close_driver_t* candriver_close_driver;
+    candriver_create_handler2_t* candriver_create_handler2;
+    candriver_delete_handler2_t* candriver_delete_handler2;
     void *handle;
     std::string fileName;
 
@@ -46,6 +49,13 @@ class Driver
         return sym;
     }
 
+    template<typename T> T tryLoadOptionalSymbol(void* handle, const char* name)
+    {
+        T sym = reinterpret_cast<T>(dlsym(handle, name));
+        dlerror();
+        return sym;
+    }
+
 public:
 	Driver(const char *filename);
 	~Driver();
@@ -53,6 +63,11 @@ public:
             CanIOMapDriver::CanMasterInterface *cmi,
             CanIOMapDriver::CanIOHandlerInterface** chi);
 	int deleteHandler(CanIOMapDriver::CanIOHandlerInterface* chi );
+	/* Handlers of the first version are wrapped in an adapter */
+	int createHandler2(const char* nodeName, int32_t profileNr,
+            CanIOMapDriver::CanMasterInterface2 *cmi,
+            CanIOMapDriver::CanIOHandlerInterface2** chi);
+	int deleteHandler2(CanIOMapDriver::CanIOHandlerInterface2* chi);
 	int getFirstProfile();
 	int getNextProfile();
     std::string getFilename() { return fileName; }
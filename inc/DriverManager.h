@@ -21,11 +21,12 @@
 #include <vector>
 #include "CanMasterInterface.h"
 #include "CanIOHandlerInterface.h"
+#include "CanIOHandlerInterface2.h"
 
 class Driver;
 
 typedef std::map<std::string, Driver*> driver_t;
-typedef std::map<CanIOHandlerInterface*, Driver*> chi2driver_t;
+typedef std::map<CanIOHandlerInterface2*, Driver*> chi2driver_t;
 
 class DriverManager {
 private:
@@ -43,9 +44,9 @@ public:
     DriverManager();
     virtual ~DriverManager();
     int createHandler(const char* nodeName, int profileNr,
-            CanIOMapDriver::CanMasterInterface *cmi,
-            CanIOMapDriver::CanIOHandlerInterface** chi);
-    int deleteHandler(int profileNr, CanIOMapDriver::CanIOHandlerInterface* chi);
+            CanIOMapDriver::CanMasterInterface2 *cmi,
+            CanIOMapDriver::CanIOHandlerInterface2** chi);
+    int deleteHandler(int profileNr, CanIOMapDriver::CanIOHandlerInterface2* chi);
 
 
 };
@@ -0,0 +1,64 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef ASYNC_LOG_H_
+#define ASYNC_LOG_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* A front end for plog() that may be used on hot paths. Messages are
+ * formatted into a preallocated lock-free ring, and a thread of its own hands
+ * them to plog(). Any thread may log. Nothing ever blocks: when the ring is
+ * full, messages are dropped and counted, and the count is logged once there
+ * is room again.
+ *
+ * Each place that logs can be limited to some messages per second. Those
+ * that are held back are counted, and the count is added to the next message
+ * from that place that gets through.
+ *
+ * Until alog_start() is called, and after alog_stop(), messages are passed
+ * straight to plog().
+ */
+
+#define ALOG_TEXT_SIZE 256
+
+struct alog_site {
+	uint64_t window_start;
+	uint32_t n_in_window;
+	uint32_t n_suppressed;
+};
+
+/* The number of records is rounded up to a power of two. rate_limit is the
+ * number of messages per second from each place, or 0 for no limit.
+ */
+int alog_start(size_t n_records, unsigned int rate_limit);
+
+/* Logs what is left in the ring before returning */
+void alog_stop(void);
+
+uint64_t alog_get_n_dropped(void);
+
+void alog__write(struct alog_site* site, int prio, const char* fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+#define alog(prio, fmt, ...) \
+do { \
+	static struct alog_site alog__site_; \
+	alog__write(&alog__site_, prio, fmt, ## __VA_ARGS__); \
+} while (0)
+
+#endif /* ASYNC_LOG_H_ */
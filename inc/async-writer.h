@@ -0,0 +1,92 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ASYNC_WRITER_H_
+#define ASYNC_WRITER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Text that is formatted on one thread and written to a file descriptor on
+ * another. Records are formatted in place into a preallocated ring, and the
+ * writer thread copies whatever is in the ring into large blocks before writing
+ * them out. When the writer can't keep up and the ring is full, records are
+ * dropped and counted unless AW_BLOCK is given.
+ *
+ * There may be only one thread formatting records.
+ */
+
+#define AW_RECORD_SIZE 512
+#define AW_BLOCK_SIZE 65536
+
+enum aw_flags {
+	AW_BLOCK = 1, /* Wait for room instead of dropping records */
+};
+
+struct aw_record {
+	uint32_t length;
+	char text[AW_RECORD_SIZE - sizeof(uint32_t)];
+};
+
+struct async_writer {
+	int fd;
+	enum aw_flags flags;
+	struct aw_record* records;
+	size_t mask;
+	char* block;
+
+	/* Owned by the formatting thread */
+	struct aw_record* current;
+	struct aw_record scratch;
+
+	size_t head __attribute__((aligned(64)));
+	uint64_t n_dropped;
+
+	/* Owned by the writer thread */
+	size_t tail __attribute__((aligned(64)));
+	int error;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t has_records;
+	pthread_cond_t has_room;
+	int is_writer_waiting;
+	int is_formatter_waiting;
+	int is_stopping;
+};
+
+/* The number of records is rounded up to a power of two */
+int aw_init(struct async_writer* self, int fd, size_t n_records,
+	    enum aw_flags flags);
+
+/* Writes out what is left in the ring before returning */
+void aw_destroy(struct async_writer* self);
+
+/* Appends to the current record. Text that does not fit is cut off. */
+void aw_printf(struct async_writer* self, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/* Hands the current record over to the writer. Nothing happens if nothing has
+ * been formatted since the last call.
+ */
+void aw_commit(struct async_writer* self);
+
+uint64_t aw_get_n_dropped(const struct async_writer* self);
+
+/* Returns the errno of the first write that failed, or 0 */
+int aw_get_error(const struct async_writer* self);
+
+#endif /* ASYNC_WRITER_H_ */
@@ -0,0 +1,117 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _BOOTUP_TIMELINE_H
+#define _BOOTUP_TIMELINE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "co_atomic.h"
+#include "time-utils.h"
+
+/* The steps that a node goes through on its way to being started, in order.
+ * Each phase is named after the step that ends it and lasts from the step
+ * before, or from the start of the boot-up.
+ */
+#define BOOTUP_STEPS(X) \
+	X(PROBED,      "probe"     /* answered the probe */) \
+	X(SCHEDULED,   "wait"      /* the identity read was started */) \
+	X(IDENTIFIED,  "identity"  /* the identity was read or recalled */) \
+	X(DEQUEUED,    "queue"     /* a worker took up loading the driver */) \
+	X(EDS_FOUND,   "eds"       /* the EDS was resolved */) \
+	X(CONFIGURED,  "configure" /* heartbeat and SDO channels were set */) \
+	X(OPENED,      "dlopen"    /* the driver was opened */) \
+	X(LOADED,      "handoff"   /* the main loop took over again */) \
+	X(INITIALIZED, "init"      /* co_drv_init() returned */) \
+	X(STARTED,     "start"     /* NMT start was sent and the driver told */)
+
+enum bootup_step {
+#define X(step, name) BOOTUP_ ## step,
+	BOOTUP_STEPS(X)
+#undef X
+	BOOTUP_N_STEPS
+};
+
+/* Monotonic times in us, 0 for steps that were not reached. A node that is
+ * loaded outside of the boot-up of its bus starts a timeline of its own.
+ *
+ * Steps are marked on the main loop and on the workers, with relaxed atomics
+ * so that the timeline can be read while the boot-up is going on.
+ */
+struct bootup_timeline {
+	uint64_t start;
+	uint64_t time[BOOTUP_N_STEPS];
+};
+
+const char* bootup_phase_name(enum bootup_step step);
+
+void bootup_timeline_start(struct bootup_timeline* self, uint64_t start);
+
+static inline void bootup_timeline_set(struct bootup_timeline* self,
+				       enum bootup_step step, uint64_t time)
+{
+	co_atomic_store_relaxed(&self->time[step], time);
+}
+
+static inline void bootup_timeline_mark(struct bootup_timeline* self,
+					enum bootup_step step)
+{
+	bootup_timeline_set(self, step, gettime_us(CLOCK_MONOTONIC));
+}
+
+/* Copies what is there at the moment */
+void bootup_timeline_read(struct bootup_timeline* dst,
+			  const struct bootup_timeline* src);
+
+/* In us. 0 if the step was not reached. */
+uint64_t bootup_timeline_phase(const struct bootup_timeline* self,
+			       enum bootup_step step);
+
+/* From the start to the last step that was reached, in us */
+uint64_t bootup_timeline_total(const struct bootup_timeline* self);
+
+static inline int bootup_timeline_is_empty(const struct bootup_timeline* self)
+{
+	return bootup_timeline_total(self) == 0;
+}
+
+/* timelines is indexed by node id. The ids of the n nodes that took longest
+ * are put in nodeids, slowest first. Returns how many there were.
+ */
+size_t bootup_timeline_rank(const struct bootup_timeline* timelines,
+			    int* nodeids, size_t n);
+
+/* Writes the total and the longest phases of one node, longest first, e.g.
+ * "4012 ms (identity 3100 ms, init 800 ms, dlopen 52 ms)"
+ */
+void bootup_timeline_describe(char* buf, size_t size,
+			      const struct bootup_timeline* self);
+
+/* Writes the phases with the node that took longest in each, longest first,
+ * e.g. "identity 3100 ms (node 12), init 800 ms (node 7)"
+ */
+void bootup_timeline_describe_phases(char* buf, size_t size,
+				     const struct bootup_timeline* timelines);
+
+/* Writes the nodes of one bus that have a timeline. timelines is indexed by
+ * node id.
+ */
+void bootup_timeline_write_json(FILE* output,
+				const struct bootup_timeline* timelines);
+
+#endif /* _BOOTUP_TIMELINE_H */
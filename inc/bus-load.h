@@ -0,0 +1,150 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _BUS_LOAD_H
+#define _BUS_LOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/can.h>
+
+#include "co_atomic.h"
+
+/* How much of the bus time each COB-ID takes up. Counting a frame only touches
+ * the entry of its COB-ID, and everything else is summed up from those when a
+ * summary is made.
+ *
+ * Frame times are in bit times and include stuff bits, the CRC, the ACK slot,
+ * the end of frame and the interframe space. CAN FD frames are counted as if
+ * the data phase was sent at the nominal bit rate.
+ */
+
+/* The last entry is for all extended frames */
+#define BL_N_COB_IDS (CAN_SFF_MASK + 2)
+
+enum bl_group {
+	BL_GROUP_NMT = 0,
+	BL_GROUP_SYNC,
+	BL_GROUP_TIME,
+	BL_GROUP_EMCY,
+	BL_GROUP_PDO,
+	BL_GROUP_SDO,
+	BL_GROUP_HEARTBEAT,
+	BL_GROUP_OTHER,
+	BL_N_GROUPS
+};
+
+struct bl_counter {
+	uint64_t n_frames;
+	uint64_t n_bytes;
+	uint64_t n_bits;
+};
+
+struct bus_load {
+	struct bl_counter cob_ids[BL_N_COB_IDS];
+};
+
+struct bl_summary {
+	struct bl_counter total;
+	struct bl_counter groups[BL_N_GROUPS];
+	struct bl_counter nodes[128];
+};
+
+unsigned int bl_get_frame_bits(const struct can_frame* cf);
+
+/* FD frames have CANFD_FDF set where classic frames have padding */
+static inline void bl_count(struct bus_load* self, const struct can_frame* cf)
+{
+	unsigned int index = cf->can_id & CAN_EFF_FLAG
+			   ? BL_N_COB_IDS - 1 : cf->can_id & CAN_SFF_MASK;
+	struct bl_counter* counter = &self->cob_ids[index];
+
+	counter->n_frames++;
+	counter->n_bytes += cf->can_dlc;
+	counter->n_bits += bl_get_frame_bits(cf);
+}
+
+static inline void bl_reset(struct bus_load* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+/* Extended frames and anything that is not a CANopen object are "other" */
+enum bl_group bl_get_group(uint32_t cob_id);
+
+void bl_summarize(const struct bus_load* self, struct bl_summary* summary);
+
+/* An upper bound on the bit time of a classic frame, taking as many stuff bits
+ * as there could be. It is cheap enough to take for every frame on the bus. FD
+ * frames are counted exactly.
+ */
+static inline unsigned int bl_get_frame_bits_max(const struct can_frame* cf)
+{
+	if (((const struct canfd_frame*)cf)->flags & CANFD_FDF
+	 || cf->can_dlc > CAN_MAX_DLEN)
+		return bl_get_frame_bits(cf);
+
+	/* The bits from the start of frame to the end of the CRC that may be
+	 * stuffed, and the CRC delimiter, ACK, end of frame and interframe
+	 * space that may not.
+	 */
+	unsigned int n_stuffable = cf->can_id & CAN_EFF_FLAG ? 54 : 34;
+	unsigned int n_data = cf->can_id & CAN_RTR_FLAG ? 0 : 8 * cf->can_dlc;
+
+	n_stuffable += n_data;
+	return n_stuffable + (n_stuffable - 1) / 4 + 13;
+}
+
+/* How busy the bus has been lately, as a share of its bit rate. Frames may be
+ * counted and the estimate updated from any thread.
+ */
+#define BL_METER_PERIOD 10000 /* us between updates */
+#define BL_METER_TAU 100000 /* us for the estimate to follow a change */
+
+struct bl_meter {
+	uint64_t n_bits;
+	unsigned int bitrate;
+
+	/* Guards the estimate */
+	pthread_mutex_t lock;
+	uint64_t last_bits;
+	uint64_t last_time;
+	unsigned int load;
+};
+
+void bl_meter_init(struct bl_meter* self, unsigned int bitrate);
+void bl_meter_destroy(struct bl_meter* self);
+
+static inline void bl_meter_count(struct bl_meter* self,
+				  const struct can_frame* cf)
+{
+	co_atomic_add_relaxed(&self->n_bits, bl_get_frame_bits_max(cf));
+}
+
+/* Returns the load in per mille of the bit rate, smoothed over about
+ * BL_METER_TAU. now is monotonic time in us. It is 0 if the bit rate is not
+ * known.
+ */
+unsigned int bl_meter_update(struct bl_meter* self, uint64_t now);
+
+/* Prints the rates over the given interval. At most n_rows COB-IDs and nodes
+ * are shown, the busiest first.
+ */
+void bl_print(const struct bus_load* self, FILE* stream, uint64_t interval,
+	      unsigned int bitrate, size_t n_rows);
+
+#endif /* _BUS_LOAD_H */
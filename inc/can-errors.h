@@ -0,0 +1,111 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CAN_ERRORS_H
+#define _CAN_ERRORS_H
+
+#include <stdint.h>
+#include <linux/can.h>
+#include <linux/can/error.h>
+
+#include "co_atomic.h"
+
+/* The state of a CAN controller and its error counts, as told by the error
+ * frames that SocketCAN sends to sockets that subscribe to them.
+ *
+ * Traffic that can wait should be held back while the controller is error
+ * passive or off the bus, and for a while after each error, so that the
+ * errors do not pile up into a bus-off and the transmit queue does not fill
+ * while the controller cannot send. The hold also paces the traffic after a
+ * restart.
+ *
+ * Error frames are decoded on one thread. The state and the counts may be
+ * read from any thread, but they are not read together atomically.
+ */
+
+/* The error classes that are subscribed to. Bus errors are left out as they
+ * come with each damaged frame and may flood the socket.
+ */
+#define CAN_ERRORS_MASK \
+	(CAN_ERR_TX_TIMEOUT | CAN_ERR_LOSTARB | CAN_ERR_CRTL | CAN_ERR_PROT \
+	 | CAN_ERR_TRX | CAN_ERR_ACK | CAN_ERR_BUSOFF | CAN_ERR_RESTARTED)
+
+#ifndef CAN_ERR_CNT
+#define CAN_ERR_CNT 0x00000200U
+#endif
+
+/* In order of severity */
+enum can_errors_state {
+	CAN_ERRORS_ACTIVE = 0,
+	CAN_ERRORS_WARNING,
+	CAN_ERRORS_PASSIVE,
+	CAN_ERRORS_BUS_OFF,
+};
+
+struct can_errors {
+	enum can_errors_state state;
+
+	/* The controller's counters, where the driver reports them */
+	unsigned int tx_errors;
+	unsigned int rx_errors;
+
+	/* Monotonic time in us, 0 if never */
+	uint64_t last_error_time;
+	uint64_t bus_off_time;
+
+	/* How long traffic is held after an error, in us */
+	uint64_t hold_time;
+
+	uint64_t n_frames;
+	uint64_t n_warnings;
+	uint64_t n_passive;
+	uint64_t n_bus_off;
+	uint64_t n_restarts;
+	uint64_t n_tx_timeouts;
+	uint64_t n_lost_arbitration;
+	uint64_t n_overflows;
+	uint64_t n_protocol;
+	uint64_t n_transceiver;
+	uint64_t n_no_ack;
+	uint64_t n_bus_errors;
+};
+
+void can_errors_init(struct can_errors* self, uint64_t hold_time);
+
+/* Returns 1 if the state changed, 0 if it did not and -1 if the frame is not
+ * an error frame. now is monotonic time in us.
+ */
+int can_errors_on_frame(struct can_errors* self, const struct can_frame* cf,
+			uint64_t now);
+
+static inline enum can_errors_state
+can_errors_get_state(const struct can_errors* self)
+{
+	return co_atomic_load_relaxed(&self->state);
+}
+
+static inline int can_errors_is_bus_off(const struct can_errors* self)
+{
+	return can_errors_get_state(self) == CAN_ERRORS_BUS_OFF;
+}
+
+/* Returns the time at which traffic that can wait may go again: now if it may
+ * already, or UINT64_MAX while the controller is error passive or off the bus.
+ */
+uint64_t can_errors_hold_until(const struct can_errors* self, uint64_t now);
+
+const char* can_errors_state_to_string(enum can_errors_state state);
+
+#endif /* _CAN_ERRORS_H */
@@ -16,9 +16,57 @@
 #ifndef CAN_TCP_H_
 #define CAN_TCP_H_
 
+#include <stdio.h>
+
+#include "can-wire.h"
+
+/* What to do when a TCP client's send queue is full */
+enum can_tcp_overflow {
+	CAN_TCP_OVERFLOW_DROP_OLDEST = 0,
+	CAN_TCP_OVERFLOW_DROP_CLIENT,
+	CAN_TCP_OVERFLOW_BLOCK,
+};
+
 int can_tcp_open(const char* addr, int port);
+
+/* Frames are gathered per receiver and written out together. By default they
+ * are flushed after each batch that is read from a socket. A delay in
+ * microseconds lets them accumulate across reads, trading latency for fewer
+ * system calls. It applies to bridges that are created afterwards.
+ */
+void can_tcp_set_flush_delay(unsigned int us);
+
+/* TCP clients never hold up the bridge while there is room in their send
+ * queues. When a queue fills up, the oldest frame in it is dropped, the client
+ * is disconnected or the bridge waits for it, depending on the policy. Like the
+ * flush delay, it applies to bridges that are created afterwards.
+ */
+void can_tcp_set_overflow_policy(enum can_tcp_overflow policy);
+
+/* Bridge clients that are created afterwards ask the server to use the given
+ * wire format and CAN_WIRE_F_* flags. They fall back to the legacy format if
+ * it doesn't agree. Servers take whatever each client asks for.
+ */
+void can_tcp_set_wire_format(enum can_wire_format format, int flags);
+
+/* Bridge clients that are created afterwards subscribe to only the frames that
+ * pass these filters. See sock_subscribe().
+ */
+int can_tcp_set_filters(const struct can_filter* filters, size_t n);
+
+/* Print the current and highest number of frames waiting for each TCP client,
+ * and how many have been dropped.
+ */
+void can_tcp_print_stats(FILE* output);
+
 int can_tcp_bridge_server(const char* can, int port);
 int can_tcp_bridge_client(const char* can, const char* address, int port);
 
+/* Publish the CAN traffic to a multicast group, given as group[:port], and
+ * pass on what others publish there. Any number of subscribers can watch the
+ * bus this way at no cost to the bridge.
+ */
+int can_tcp_bridge_multicast(const char* can, const char* group);
+
 #endif /* CAN_TCP_H_ */
 
@@ -0,0 +1,133 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAN_WIRE_H_
+#define CAN_WIRE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/can.h>
+
+/* The legacy CAN-over-TCP format is a stream of struct can_frame with the ID
+ * in network byte order.
+ *
+ * In the compact format, each record starts with a big-endian 16 bit header:
+ * the 11 bit ID, the RTR flag and the DLC. Only the payload follows. DLCs that
+ * classic frames can't have mark other kinds of records:
+ *
+ *   CAN_WIRE_FULL       A legacy frame follows, for extended IDs and the like.
+ *   CAN_WIRE_TIMESTAMP  An absolute timestamp in us follows, in 8 bytes.
+ *   CAN_WIRE_DELTA      2 bytes follow, to be added to the current timestamp.
+ *
+ * A timestamp applies to the frames after it. Writers start each write with an
+ * absolute timestamp, so that deltas never depend on an earlier write.
+ *
+ * A client asks for the compact format by sending a legacy frame with
+ * CAN_WIRE_HELLO_ID, the format in the first data byte and the flags it wants
+ * in the second. A server that understands it answers in kind with the flags
+ * it agrees to, and uses the compact format for everything that follows the
+ * answer.
+ *
+ * Clients of a bridge server may subscribe to only some of the traffic. Each
+ * frame with CAN_WIRE_SUBSCRIBE_ID adds a filter with the semantics of
+ * CAN_RAW_FILTER: the ID and then the mask, big-endian, in the data. One
+ * without data removes all filters, and the client gets everything again.
+ */
+/* Multicast datagrams hold compact records after a header of three big-endian
+ * 32 bit words: CAN_WIRE_DATAGRAM_MAGIC, an ID that the sender picks at random
+ * and the sender's sequence number, which goes up by one for each datagram.
+ * The records start with an absolute timestamp, so that each datagram can be
+ * decoded on its own. A receiver counts the gaps in each sender's sequence as
+ * lost datagrams.
+ */
+#define CAN_WIRE_DATAGRAM_MAGIC 0x63616e31 /* "can1" */
+#define CAN_WIRE_DATAGRAM_HEADER_SIZE 12
+
+/* A datagram of this many records fits in an Ethernet frame */
+#define CAN_WIRE_DATAGRAM_MAX_FRAMES 64
+
+#define CAN_WIRE_HELLO_ID (CAN_ERR_FLAG | 0x00c0ffee)
+#define CAN_WIRE_SUBSCRIBE_ID (CAN_ERR_FLAG | 0x00c0ffef)
+
+#define CAN_WIRE_FULL 15
+#define CAN_WIRE_TIMESTAMP 14
+#define CAN_WIRE_DELTA 13
+
+#define CAN_WIRE_HEADER_SIZE 2
+#define CAN_WIRE_MAX_RECORD_SIZE \
+	(CAN_WIRE_HEADER_SIZE + sizeof(struct can_frame))
+
+#define CAN_WIRE_DATAGRAM_MAX_SIZE \
+	(CAN_WIRE_DATAGRAM_HEADER_SIZE + CAN_WIRE_HEADER_SIZE + 8 \
+	 + CAN_WIRE_DATAGRAM_MAX_FRAMES * CAN_WIRE_MAX_RECORD_SIZE)
+
+enum can_wire_format {
+	CAN_WIRE_LEGACY = 0,
+	CAN_WIRE_COMPACT = 1,
+};
+
+enum can_wire_flags {
+	CAN_WIRE_F_TIMESTAMPS = 1 << 0,
+};
+
+void can_wire_make_hello(struct can_frame* cf, enum can_wire_format format,
+			 int flags);
+
+static inline int can_wire_is_hello(const struct can_frame* cf)
+{
+	return cf->can_id == CAN_WIRE_HELLO_ID && cf->can_dlc >= 2;
+}
+
+/* A NULL filter removes all filters */
+void can_wire_make_subscription(struct can_frame* cf,
+				const struct can_filter* filter);
+
+static inline int can_wire_is_subscription(const struct can_frame* cf)
+{
+	return cf->can_id == CAN_WIRE_SUBSCRIBE_ID;
+}
+
+/* Returns 0 and sets the filter if the subscription adds one, or -1 if it
+ * removes them all.
+ */
+int can_wire_get_subscription(const struct can_frame* cf,
+			      struct can_filter* filter);
+
+size_t can_wire_encode_datagram_header(void* dst, uint32_t source,
+				       uint32_t seq);
+
+/* Returns 0 if the datagram starts with a valid header, or -1 otherwise */
+int can_wire_decode_datagram_header(const void* src, size_t size,
+				    uint32_t* source, uint32_t* seq);
+
+/* Encode a frame and return the size of the record */
+size_t can_wire_encode(void* dst, const struct can_frame* cf);
+
+/* Encode the smallest record that moves the current timestamp to t. Returns
+ * 0 if it is already there.
+ */
+size_t can_wire_encode_timestamp(void* dst, uint64_t* current, uint64_t t);
+
+/* Returns the size of the record at src, or 0 if there are too few bytes to
+ * tell.
+ */
+size_t can_wire_record_size(const void* src, size_t size);
+
+/* Decode a whole record. Returns 1 for a frame, 0 for a timestamp, which is
+ * applied to *current, and -1 if the record is invalid.
+ */
+int can_wire_decode(const void* src, struct can_frame* cf, uint64_t* current);
+
+#endif /* CAN_WIRE_H_ */
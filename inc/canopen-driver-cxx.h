@@ -0,0 +1,280 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_DRIVER_CXX_H
+#define _CANOPEN_DRIVER_CXX_H
+
+/* Typed PDO and SDO access for drivers that are written in C++.
+ *
+ * A PDO layout is declared as the list of the types that are mapped into it,
+ * in mapping order:
+ *
+ *	typedef co_pdo_layout<uint16_t, int32_t, uint8_t> status_pdo;
+ *
+ *	static void on_pdo1(struct co_drv* drv, const void* data, size_t size)
+ *	{
+ *		uint16_t status; int32_t position; uint8_t mode;
+ *		if (!status_pdo::unpack(data, size, status, position, mode))
+ *			return;
+ *		...
+ *	}
+ *
+ *	status_pdo::send<1>(drv, 0x000f, target, 1);
+ *
+ * The offsets are worked out when the driver is compiled, so each field is
+ * one load or store and, on big endian hosts, one byte swap.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+
+extern "C" {
+#include "canopen-driver.h"
+}
+
+namespace co_detail {
+
+template<size_t N> struct uint_of;
+template<> struct uint_of<1> { typedef uint8_t type; };
+template<> struct uint_of<2> { typedef uint16_t type; };
+template<> struct uint_of<4> { typedef uint32_t type; };
+template<> struct uint_of<8> { typedef uint64_t type; };
+
+inline uint8_t bswap(uint8_t v) noexcept { return v; }
+inline uint16_t bswap(uint16_t v) noexcept { return __builtin_bswap16(v); }
+inline uint32_t bswap(uint32_t v) noexcept { return __builtin_bswap32(v); }
+inline uint64_t bswap(uint64_t v) noexcept { return __builtin_bswap64(v); }
+
+/* CANopen puts the least significant byte first */
+template<typename T> inline T load_le(const uint8_t* p) noexcept
+{
+	typename uint_of<sizeof(T)>::type u;
+	memcpy(&u, p, sizeof(u));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	u = bswap(u);
+#endif
+	T value;
+	memcpy(&value, &u, sizeof(value));
+	return value;
+}
+
+template<typename T> inline void store_le(uint8_t* p, T value) noexcept
+{
+	typename uint_of<sizeof(T)>::type u;
+	memcpy(&u, &value, sizeof(u));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	u = bswap(u);
+#endif
+	memcpy(p, &u, sizeof(u));
+}
+
+template<typename T> struct is_value {
+	static const bool value = std::is_arithmetic<T>::value
+				  && !std::is_same<T, bool>::value
+				  && (sizeof(T) == 1 || sizeof(T) == 2
+				      || sizeof(T) == 4 || sizeof(T) == 8);
+};
+
+template<typename... Fields> struct size_of;
+template<> struct size_of<> { static const size_t value = 0; };
+template<typename F, typename... Rest> struct size_of<F, Rest...> {
+	static const size_t value = sizeof(F) + size_of<Rest...>::value;
+};
+
+template<size_t I, typename... Fields> struct field_at;
+template<typename F, typename... Rest> struct field_at<0, F, Rest...> {
+	typedef F type;
+	static const size_t offset = 0;
+};
+template<size_t I, typename F, typename... Rest>
+struct field_at<I, F, Rest...> {
+	typedef typename field_at<I - 1, Rest...>::type type;
+	static const size_t offset = sizeof(F) + field_at<I - 1, Rest...>::offset;
+};
+
+template<size_t Offset, typename... Fields> struct fields;
+template<size_t Offset> struct fields<Offset> {
+	static void unpack(const uint8_t*) noexcept {}
+	static void pack(uint8_t*) noexcept {}
+};
+template<size_t Offset, typename F, typename... Rest>
+struct fields<Offset, F, Rest...> {
+	static_assert(is_value<F>::value,
+		      "PDO fields must be integers or floating point numbers of 1, 2, 4 or 8 bytes");
+
+	typedef fields<Offset + sizeof(F), Rest...> next;
+
+	static void unpack(const uint8_t* p, F& f, Rest&... rest) noexcept
+	{
+		f = load_le<F>(p + Offset);
+		next::unpack(p, rest...);
+	}
+
+	static void pack(uint8_t* p, const F& f, const Rest&... rest) noexcept
+	{
+		store_le<F>(p + Offset, f);
+		next::pack(p, rest...);
+	}
+};
+
+template<typename T> struct sdo_read_context {
+	void (*fn)(struct co_drv*, enum co_sdo_status, T, void*);
+	void* context;
+};
+
+template<typename T>
+void on_sdo_read_done(struct co_drv* drv, struct co_sdo_req* req)
+{
+	sdo_read_context<T>* ctx =
+		static_cast<sdo_read_context<T>*>(co_sdo_req_get_context(req));
+	enum co_sdo_status status = co_sdo_req_get_status(req);
+	T value = T();
+
+	/* Expedited uploads that do not give a size come as 4 bytes */
+	if (status == CO_SDO_REQ_OK) {
+		if (co_sdo_req_get_size(req) >= sizeof(T))
+			value = load_le<T>(static_cast<const uint8_t*>(
+						co_sdo_req_get_data(req)));
+		else
+			status = CO_SDO_REQ_LOCAL_ABORT;
+	}
+
+	ctx->fn(drv, status, value, ctx->context);
+}
+
+} /* namespace co_detail */
+
+template<typename... Fields> struct co_pdo_layout {
+	static const size_t size = co_detail::size_of<Fields...>::value;
+	static_assert(size > 0, "A PDO must have at least one field");
+	static_assert(size <= 64, "A PDO can not be longer than 64 bytes");
+
+	template<size_t I> struct field {
+		static_assert(I < sizeof...(Fields), "No such field");
+		typedef typename co_detail::field_at<I, Fields...>::type type;
+		static const size_t offset = co_detail::field_at<I, Fields...>::offset;
+	};
+
+	/* Returns false if the PDO is shorter than the layout, in which case
+	 * the fields are left alone.
+	 */
+	static bool unpack(const void* data, size_t n, Fields&... out) noexcept
+	{
+		if (n < size)
+			return false;
+
+		co_detail::fields<0, Fields...>::unpack(
+			static_cast<const uint8_t*>(data), out...);
+		return true;
+	}
+
+	/* data must hold at least size bytes */
+	static void pack(void* data, const Fields&... in) noexcept
+	{
+		co_detail::fields<0, Fields...>::pack(
+			static_cast<uint8_t*>(data), in...);
+	}
+
+	template<size_t I>
+	static typename field<I>::type get(const void* data) noexcept
+	{
+		return co_detail::load_le<typename field<I>::type>(
+			static_cast<const uint8_t*>(data) + field<I>::offset);
+	}
+
+	template<size_t I>
+	static void set(void* data, typename field<I>::type value) noexcept
+	{
+		co_detail::store_le(static_cast<uint8_t*>(data)
+				    + field<I>::offset, value);
+	}
+
+	/* Pack the fields and send them as RPDO N (1-4) */
+	template<int N>
+	static int send(struct co_drv* drv, const Fields&... in) noexcept
+	{
+		static_assert(N >= 1 && N <= 4, "There are only four RPDOs");
+
+		uint8_t buffer[size];
+		pack(buffer, in...);
+
+		switch (N) {
+		case 1: return co_rpdo1(drv, buffer, size);
+		case 2: return co_rpdo2(drv, buffer, size);
+		case 3: return co_rpdo3(drv, buffer, size);
+		case 4: return co_rpdo4(drv, buffer, size);
+		}
+		return -1;
+	}
+};
+
+/* Write a value of type T to the node. The name is in parentheses so that it
+ * is not taken for the co_sdo_send() macro; co_sdo_send<uint16_t>(...) and
+ * co_sdo_send(...) both send the value in network byte order.
+ */
+template<typename T>
+inline int (co_sdo_send)(struct co_drv* drv, int index, int subindex,
+			 T value) noexcept
+{
+	static_assert(co_detail::is_value<T>::value,
+		      "SDO values must be integers or floating point numbers of 1, 2, 4 or 8 bytes");
+
+	uint8_t buffer[sizeof(T)];
+	co_detail::store_le(buffer, value);
+	return co_sdo_send_blob(drv, index, subindex, buffer, sizeof(buffer));
+}
+
+/* Read a value of type T from the node. fn is called when it is done. If
+ * the node sends fewer than sizeof(T) bytes, the status is
+ * CO_SDO_REQ_LOCAL_ABORT. The value is 0 unless the status is
+ * CO_SDO_REQ_OK.
+ */
+template<typename T>
+inline int co_sdo_read(struct co_drv* drv, int index, int subindex,
+		       void (*fn)(struct co_drv*, enum co_sdo_status, T, void*),
+		       void* context = NULL) noexcept
+{
+	static_assert(co_detail::is_value<T>::value,
+		      "SDO values must be integers or floating point numbers of 1, 2, 4 or 8 bytes");
+
+	co_detail::sdo_read_context<T>* ctx =
+		static_cast<co_detail::sdo_read_context<T>*>(
+			malloc(sizeof(*ctx)));
+	if (!ctx)
+		return -1;
+
+	ctx->fn = fn;
+	ctx->context = context;
+
+	struct co_sdo_req* req = co_sdo_req_new(drv);
+	if (!req) {
+		free(ctx);
+		return -1;
+	}
+
+	co_sdo_req_set_type(req, CO_SDO_UPLOAD);
+	co_sdo_req_set_indices(req, index, subindex);
+	co_sdo_req_set_context(req, ctx, free);
+	co_sdo_req_set_done_fn(req, co_detail::on_sdo_read_done<T>);
+
+	int rc = co_sdo_req_start(req);
+	co_sdo_req_unref(req);
+	return rc;
+}
+
+#endif /* _CANOPEN_DRIVER_CXX_H */
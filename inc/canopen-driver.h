@@ -30,12 +30,25 @@
 
 struct co_drv;
 struct co_sdo_req;
+struct co_sdo_batch;
 
 enum co_sdo_type {
 	CO_SDO_DOWNLOAD = 1,
 	CO_SDO_UPLOAD
 };
 
+/* See co_sdo_req_set_cache_max_age() */
+#define CO_SDO_CACHE_FOREVER (-1)
+
+/* Pending requests to a node are started in order of priority. The REST
+ * service uses the background priority.
+ */
+enum co_sdo_priority {
+	CO_SDO_PRIO_NORMAL = 0,
+	CO_SDO_PRIO_HIGH,
+	CO_SDO_PRIO_BACKGROUND,
+};
+
 enum co_sdo_status {
 	CO_SDO_REQ_PENDING = 0,
 	CO_SDO_REQ_OK,
@@ -48,6 +61,22 @@ enum co_sdo_status {
 enum co_options {
 	CO_OPT_UNSPEC = 0,
 	CO_OPT_INHIBIT_START = 1,
+
+	/* The driver's PDO callbacks accept CAN FD payloads of up to 64 bytes.
+	 * PDOs longer than 8 bytes are not delivered to drivers without this.
+	 */
+	CO_OPT_CAN_FD = 2,
+
+	/* Hold back the given RPDO until the next SYNC, when all such RPDOs on
+	 * the bus are sent together. If the driver sends again before that,
+	 * the newer value replaces the older one. This has no effect unless
+	 * the master sends SYNC, and payloads longer than 8 bytes are always
+	 * sent straight away.
+	 */
+	CO_OPT_SYNC_RPDO1 = 4,
+	CO_OPT_SYNC_RPDO2 = 8,
+	CO_OPT_SYNC_RPDO3 = 16,
+	CO_OPT_SYNC_RPDO4 = 32,
 };
 
 struct co_emcy {
@@ -58,7 +87,53 @@ struct co_emcy {
 
 typedef void (*co_free_fn)(void*);
 typedef void (*co_pdo_fn)(struct co_drv*, const void* data, size_t size);
+typedef void (*co_pdo_signal_fn)(struct co_drv*, const uint64_t* values,
+				 size_t n_values);
+
+/* A TPDO as it was received. data points into the receive buffer and is only
+ * valid during the call.
+ */
+struct co_pdo_frame {
+	uint32_t cob_id;
+	int n; /* 1-4 */
+	const uint8_t* data;
+	size_t size;
+
+	/* Time of arrival in microseconds since the epoch */
+	uint64_t timestamp;
+
+	/* The number of SYNCs that the master had sent by then, or 0 if it
+	 * does not send SYNC
+	 */
+	uint64_t sync_count;
+};
+
+typedef void (*co_tpdo_fn)(struct co_drv*, const struct co_pdo_frame* pdo);
+
+/* The TPDOs that a node sent in one SYNC cycle. Bit n - 1 of the masks stands
+ * for TPDO n, and pdo[n - 1] is only filled in if it was received.
+ */
+struct co_sync_cycle {
+	/* The number of SYNCs that the master had sent when the cycle began */
+	uint64_t sync_count;
+
+	unsigned int received;
+	unsigned int missing;
+
+	struct {
+		const uint8_t* data;
+		size_t size;
+		uint64_t timestamp;
+	} pdo[4];
+};
+
+typedef void (*co_sync_cycle_fn)(struct co_drv*,
+				 const struct co_sync_cycle* cycle);
 typedef void (*co_sdo_done_fn)(struct co_drv*, struct co_sdo_req* req);
+typedef int (*co_sdo_data_fn)(struct co_drv*, struct co_sdo_req* req,
+			      const void* data, size_t size);
+typedef void (*co_sdo_batch_done_fn)(struct co_drv*,
+				     struct co_sdo_batch* batch);
 typedef void (*co_emcy_fn)(struct co_drv*, struct co_emcy*);
 typedef void (*co_start_fn)(struct co_drv*);
 
@@ -70,6 +145,12 @@ uint32_t co_get_product_code(const struct co_drv* self);
 uint32_t co_get_revision_number(const struct co_drv* self);
 const char* co_get_name(const struct co_drv* self);
 
+/* Get the time of arrival of the frame that is currently being handled, in
+ * microseconds since the epoch. Only meaningful inside PDO and EMCY
+ * callbacks.
+ */
+uint64_t co_get_rx_timestamp(const struct co_drv* self);
+
 void co_set_context(struct co_drv* self, void* context, co_free_fn fn);
 void* co_get_context(const struct co_drv* self);
 
@@ -77,9 +158,61 @@ void co_set_pdo1_fn(struct co_drv* self, co_pdo_fn fn);
 void co_set_pdo2_fn(struct co_drv* self, co_pdo_fn fn);
 void co_set_pdo3_fn(struct co_drv* self, co_pdo_fn fn);
 void co_set_pdo4_fn(struct co_drv* self, co_pdo_fn fn);
+
+/* Have all four TPDOs passed to one function along with their time of
+ * arrival. It is called on whichever thread receives the frames, before the
+ * callbacks set by co_set_pdoN_fn() and co_set_tpdo_signal_fn().
+ */
+void co_set_tpdo_fn(struct co_drv* self, co_tpdo_fn fn);
+
 void co_set_emcy_fn(struct co_drv* self, co_emcy_fn fn);
+
+/* Have the TPDOs in mask (bit n - 1 for TPDO n), which the node sends on
+ * SYNC, collected over each SYNC cycle and passed to fn together once the
+ * next SYNC has been sent, including those that are missing. fn is called on
+ * the main thread. The PDO callbacks are still called as each TPDO arrives.
+ *
+ * Returns -1 if the master does not send SYNC.
+ */
+int co_set_sync_cycle_fn(struct co_drv* self, unsigned int mask,
+			 co_sync_cycle_fn fn);
+
+/* Have TPDO n (1-4) decoded according to its mapping. The values are passed
+ * to fn in mapping order, and signed values are sign extended. The mapping is
+ * read from the node, or taken from its EDS if the node does not allow it to
+ * be read. This blocks, so it must be called from co_drv_init().
+ *
+ * The callback is called in addition to the one set by co_set_pdoN_fn().
+ */
+int co_set_tpdo_signal_fn(struct co_drv* self, int n, co_pdo_signal_fn fn);
+
+/* Load the mapping of RPDO n (1-4) for use with co_rpdo_signals(). This
+ * blocks, so it must be called from co_drv_init().
+ */
+int co_map_rpdo(struct co_drv* self, int n);
+
+/* Get the position of an object within the values of a mapped PDO, or -1 if
+ * it is not mapped.
+ */
+int co_get_tpdo_signal_position(const struct co_drv* self, int n, int index,
+				int subindex);
+int co_get_rpdo_signal_position(const struct co_drv* self, int n, int index,
+				int subindex);
+
+/* Encode the values according to the mapping of RPDO n and send it.
+ * n_values must match the length of the mapping.
+ */
+int co_rpdo_signals(struct co_drv* self, int n, const uint64_t* values,
+		    size_t n_values);
 void co_set_start_fn(struct co_drv* self, co_start_fn fn);
 
+/* Payloads longer than 8 bytes are sent as CAN FD frames, which requires the
+ * master to be running with CAN FD enabled.
+ *
+ * Returns the size of the frame on success and -1 on failure. Frames may be
+ * sent after the call returns, so a later send failure is only counted in the
+ * CAN error statistics of the bus.
+ */
 int co_rpdo1(struct co_drv* self, const void* data, size_t size);
 int co_rpdo2(struct co_drv* self, const void* data, size_t size);
 int co_rpdo3(struct co_drv* self, const void* data, size_t size);
@@ -98,16 +231,172 @@ void co_sdo_req_set_done_fn(struct co_sdo_req* self, co_sdo_done_fn fn);
 void co_sdo_req_set_context(struct co_sdo_req* self, void* context,
 			    co_free_fn free_fn);
 void* co_sdo_req_get_context(const struct co_sdo_req* self);
+
+/* Transfer the data in blocks if the node supports it. This is much faster for
+ * large objects. Nodes that do not support it are accessed in the regular way.
+ */
+void co_sdo_req_set_block_transfer(struct co_sdo_req* self, int use_block);
+
+/* Let an upload be answered with a value that was read by an earlier upload
+ * with caching enabled, if that is no older than max_age ms. The request then
+ * completes within co_sdo_req_start(). Use CO_SDO_CACHE_FOREVER for constant
+ * objects. This is off by default. Cached values are dropped when the node
+ * boots up or the object is written through the master.
+ */
+void co_sdo_req_set_cache_max_age(struct co_sdo_req* self, int max_age);
+
+void co_sdo_req_set_priority(struct co_sdo_req* self,
+			     enum co_sdo_priority priority);
+
+/* Returned by a data function to hold the transfer */
+#define CO_SDO_PAUSE 1
+
+/* Pass an upload to the data function in chunks as it arrives, instead of
+ * collecting it in the request, so that large DOMAIN objects can be read with
+ * bounded memory. A chunk is only valid during the call. The function returns
+ * 0 to go on, -1 to abort the transfer or CO_SDO_PAUSE to hold it until
+ * co_sdo_req_resume() is called. The done function is called at the end as
+ * usual, and the transfer may still fail after data has been passed on.
+ */
+void co_sdo_req_set_data_fn(struct co_sdo_req* self, co_sdo_data_fn fn);
+
+/* Stream an upload into a file descriptor. This blocks the main loop while
+ * writing, so the descriptor should be a regular file or a pipe that is read
+ * quickly. The descriptor is not closed.
+ */
+void co_sdo_req_set_output_fd(struct co_sdo_req* self, int fd);
+
+/* Must be called from a done or data function, or from a timer */
+int co_sdo_req_resume(struct co_sdo_req* self);
+
 int co_sdo_req_start(struct co_sdo_req* self);
+
+/* The data belongs to the request and is valid for as long as it is
+ * referenced, so it can be read in place from the done function.
+ */
 const void* co_sdo_req_get_data(const struct co_sdo_req* self);
 size_t co_sdo_req_get_size(const struct co_sdo_req* self);
 int co_sdo_req_get_index(const struct co_sdo_req* self);
 int co_sdo_req_get_subindex(const struct co_sdo_req* self);
 enum co_sdo_status co_sdo_req_get_status(const struct co_sdo_req* self);
 
+/* A batch runs its reads and writes one after the other, in the order that
+ * they were added, and calls the done function once when all of them have
+ * been tried. A failed item does not stop the rest. The status of the batch
+ * is that of the first item that failed, if any.
+ *
+ * Items are numbered from 0 in the order that they were added, and they must
+ * not be added after the batch has been started.
+ */
+struct co_sdo_batch* co_sdo_batch_new(struct co_drv* drv);
+void co_sdo_batch_ref(struct co_sdo_batch* self);
+int co_sdo_batch_unref(struct co_sdo_batch* self);
+int co_sdo_batch_add_read(struct co_sdo_batch* self, int index, int subindex);
+int co_sdo_batch_add_write(struct co_sdo_batch* self, int index, int subindex,
+			   const void* data, size_t size);
+void co_sdo_batch_set_done_fn(struct co_sdo_batch* self,
+			      co_sdo_batch_done_fn fn);
+void co_sdo_batch_set_context(struct co_sdo_batch* self, void* context,
+			      co_free_fn free_fn);
+void* co_sdo_batch_get_context(const struct co_sdo_batch* self);
+void co_sdo_batch_set_block_transfer(struct co_sdo_batch* self, int use_block);
+void co_sdo_batch_set_priority(struct co_sdo_batch* self,
+			       enum co_sdo_priority priority);
+int co_sdo_batch_start(struct co_sdo_batch* self);
+enum co_sdo_status co_sdo_batch_get_status(const struct co_sdo_batch* self);
+size_t co_sdo_batch_get_length(const struct co_sdo_batch* self);
+enum co_sdo_status co_sdo_batch_get_item_status(const struct co_sdo_batch* self,
+						size_t i);
+const void* co_sdo_batch_get_item_data(const struct co_sdo_batch* self,
+				       size_t i);
+size_t co_sdo_batch_get_item_size(const struct co_sdo_batch* self, size_t i);
+
+/* A configuration script is a list of steps that is run as a batch, without
+ * calling back into the driver between the steps. It holds nothing that is
+ * specific to a node, so it is usually declared static const and run as is on
+ * every node that the driver handles:
+ *
+ *	static const struct co_sdo_step config[] = {
+ *		CO_SDO_EXPECT(0x1000, 0, 4, 0x00020192),
+ *		CO_SDO_WRITE_U16(0x1017, 0, 500),
+ *		CO_SDO_WRITE_U8(0x1a00, 0, 0),
+ *		CO_SDO_WRITE_U32(0x1a00, 1, 0x60410010),
+ *		CO_SDO_WRITE_U8(0x1a00, 0, 1),
+ *		{ CO_SDO_DOWNLOAD, 0x2100, 0, 1, 3, .on_failure = CO_SDO_IGNORE },
+ *	};
+ *
+ * Values are given in host byte order and sent in that of CANopen. A step that
+ * reads with a non-zero mask fails unless the object has the given size and
+ * is equal to the value in the bits that are set in the mask. A step that
+ * writes data instead of a value may be longer than 8 bytes, and it is sent
+ * in blocks if the node supports it.
+ *
+ * Items of the batch correspond to the steps of the script.
+ */
+enum co_sdo_on_failure {
+	/* Cancel the steps that follow. The script fails. */
+	CO_SDO_STOP = 0,
+
+	/* Go on with the next step. The script fails. */
+	CO_SDO_CONTINUE,
+
+	/* Go on with the next step as if nothing had happened */
+	CO_SDO_IGNORE,
+};
+
+struct co_sdo_step {
+	enum co_sdo_type type;
+	uint16_t index;
+	uint8_t subindex;
+	uint8_t size; /* 1 to 8, or the size of data */
+	uint64_t value;
+	uint64_t mask;
+	const void* data;
+	enum co_sdo_on_failure on_failure;
+};
+
+#define CO_SDO_WRITE(index_, subindex_, size_, value_) \
+	{ .type = CO_SDO_DOWNLOAD, .index = (index_), .subindex = (subindex_), \
+	  .size = (size_), .value = (value_) }
+
+#define CO_SDO_WRITE_U8(index_, subindex_, value_) \
+	CO_SDO_WRITE(index_, subindex_, 1, value_)
+#define CO_SDO_WRITE_U16(index_, subindex_, value_) \
+	CO_SDO_WRITE(index_, subindex_, 2, value_)
+#define CO_SDO_WRITE_U32(index_, subindex_, value_) \
+	CO_SDO_WRITE(index_, subindex_, 4, value_)
+
+#define CO_SDO_WRITE_DATA(index_, subindex_, data_, size_) \
+	{ .type = CO_SDO_DOWNLOAD, .index = (index_), .subindex = (subindex_), \
+	  .size = (size_), .data = (data_) }
+
+#define CO_SDO_READ(index_, subindex_) \
+	{ .type = CO_SDO_UPLOAD, .index = (index_), .subindex = (subindex_) }
+
+#define CO_SDO_EXPECT_MASKED(index_, subindex_, size_, value_, mask_) \
+	{ .type = CO_SDO_UPLOAD, .index = (index_), .subindex = (subindex_), \
+	  .size = (size_), .value = (value_), .mask = (mask_) }
+
+#define CO_SDO_EXPECT(index_, subindex_, size_, value_) \
+	CO_SDO_EXPECT_MASKED(index_, subindex_, size_, value_, ~0ULL)
+
+/* Make a batch of the steps. It is started and inspected like any other. */
+struct co_sdo_batch* co_sdo_batch_new_script(struct co_drv* drv,
+					     const struct co_sdo_step* steps,
+					     size_t n_steps);
+
+/* Make a batch of the steps and start it. fn may be NULL. */
+int co_sdo_run_script(struct co_drv* drv, const struct co_sdo_step* steps,
+		      size_t n_steps, co_sdo_batch_done_fn fn);
+
 int co_sdo_send_blob(struct co_drv* self, int index, int subindex,
 		     const void* payload, size_t size);
 
 void co_byteorder(void* dst, const void* src, size_t dst_size, size_t src_size);
 
+/* Convert n values of size (1, 2, 4 or 8) bytes each between network and host
+ * byte order, e.g. an array read as a DOMAIN.
+ */
+void co_byteorder_array(void* dst, const void* src, size_t size, size_t n);
+
 #endif /* _CANOPEN_DRIVER_H */
@@ -68,6 +68,8 @@ struct canopen_msg {
 
 int canopen_get_object_type(struct canopen_msg* msg,
 			    const struct can_frame* frame);
+const char* canopen_object_type_to_string(enum canopen_object obj);
+const char* canopen_object_type_to_string_exact(enum canopen_object obj);
 
 #endif /* _CANOPEN_H */
 
@@ -13,14 +13,28 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #ifndef _CANOPEN_BYTEORDER_H
 #define _CANOPEN_BYTEORDER_H
 
 #include <stdlib.h>
 
+/* Convert between host and network (little endian) byte order. size must be
+ * 0, 1, 2, 4 or 8.
+ */
 void byteorder(void* dst, const void* src, size_t size);
 void byteorder2(void* dst, const void* src, size_t dst_size, size_t src_size);
 
+/* Convert n values of size bytes each, e.g. an ARRAY or DOMAIN payload, in
+ * one go. dst and src may be the same, but must not otherwise overlap.
+ */
+void byteorder_array(void* dst, const void* src, size_t size, size_t n);
+
+/* Swap the bytes of n values of size bytes each, whatever the byte order of
+ * the host. This is what byteorder_array() does on big endian hosts.
+ */
+void byteorder__swap_array(void* dst, const void* src, size_t size, size_t n);
+
 #define BYTEORDER(dst, value) \
 ({ \
 	__typeof__(value) _value = value; \
@@ -29,4 +43,3 @@ void byteorder2(void* dst, const void* src, size_t dst_size, size_t src_size);
 
 
 #endif /* _CANOPEN_BYTEORDER_H */
-
@@ -0,0 +1,92 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_COB_TABLE_H
+#define _CANOPEN_COB_TABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/can.h>
+
+#include "co_atomic.h"
+
+/* A dispatch table indexed by 11-bit COB-ID. Each entry holds a handler that
+ * has been bound to its context ahead of time, so that routing a received
+ * frame is a single indexed call.
+ *
+ * Entries may be changed from any thread while frames are being dispatched.
+ */
+
+typedef void (*cob_table_fn)(void* context, const struct can_frame* cf,
+			     uint64_t timestamp);
+
+struct cob_table_entry {
+	cob_table_fn fn;
+	void* context;
+};
+
+struct cob_table {
+	struct cob_table_entry entry[CAN_SFF_MASK + 1];
+};
+
+static inline void cob_table_init(struct cob_table* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+/* The context must be set before the function, and it must not be changed
+ * while the function is set.
+ */
+static inline void cob_table_set_context(struct cob_table* self, uint32_t cob,
+					 void* context)
+{
+	co_atomic_store(&self->entry[cob & CAN_SFF_MASK].context, context);
+}
+
+/* Set to NULL to drop frames with the given COB-ID */
+static inline void cob_table_set_fn(struct cob_table* self, uint32_t cob,
+				    cob_table_fn fn)
+{
+	co_atomic_store(&self->entry[cob & CAN_SFF_MASK].fn, fn);
+}
+
+static inline int cob_table_is_bound(const struct cob_table* self,
+				     uint32_t cob)
+{
+	return co_atomic_load(&self->entry[cob & CAN_SFF_MASK].fn) != NULL;
+}
+
+/* Returns -1 if the frame was not handled. Extended, RTR and error frames are
+ * never handled.
+ */
+static inline int cob_table_dispatch(const struct cob_table* self,
+				     const struct can_frame* cf,
+				     uint64_t timestamp)
+{
+	if (cf->can_id & (CAN_RTR_FLAG | CAN_EFF_FLAG | CAN_ERR_FLAG))
+		return -1;
+
+	const struct cob_table_entry* entry;
+	entry = &self->entry[cf->can_id & CAN_SFF_MASK];
+
+	cob_table_fn fn = co_atomic_load(&entry->fn);
+	if (!fn)
+		return -1;
+
+	fn(entry->context, cf, timestamp);
+	return 0;
+}
+
+#endif /* _CANOPEN_COB_TABLE_H */
@@ -16,6 +16,8 @@
 #ifndef CANOPEN_DUMP_H_
 #define CANOPEN_DUMP_H_
 
+#include <stdint.h>
+
 #define CO_DUMP_FILTER_SHIFT 8
 #define CO_DUMP_PDO_FILTER_SHIFT 16
 #define CO_DUMP_FILTER_MASK 0x00ffff00
@@ -24,6 +26,11 @@ enum co_dump_options {
 	CO_DUMP_TCP = 1,
 	CO_DUMP_TIMESTAMP = 1 << 1,
 	CO_DUMP_FILE = 1 << 2,
+	CO_DUMP_ANALYZE = 1 << 3,
+	CO_DUMP_TOP = 1 << 4,
+	CO_DUMP_SDO_TRANSACTIONS = 1 << 5,
+	CO_DUMP_UDP = 1 << 6,
+	CO_DUMP_SHM = 1 << 7,
 
 	CO_DUMP_FILTER_NMT = 1 << (CO_DUMP_FILTER_SHIFT + 0),
 	CO_DUMP_FILTER_SYNC = 1 << (CO_DUMP_FILTER_SHIFT + 1),
@@ -39,8 +46,36 @@ enum co_dump_options {
 
 	CO_DUMP_FILTER_PDO = CO_DUMP_FILTER_PDO1 | CO_DUMP_FILTER_PDO2
 			   | CO_DUMP_FILTER_PDO3 | CO_DUMP_FILTER_PDO4,
+
+	/* Replay what the master sent instead of what the nodes sent */
+	CO_DUMP_REPLAY_MASTER = 1 << 24,
+
+	/* Write pcapng to stdout instead of text */
+	CO_DUMP_PCAP = 1 << 25,
+};
+
+/* Times are in us since the epoch and zero means no limit. Bit n of nodes
+ * selects node n, and if none are set, all nodes are selected. Files are
+ * analyzed on n_threads threads, or on one per CPU if it is zero. The bus load
+ * is relative to bitrate, in bit/s, or to 1 Mbit/s if it is zero.
+ */
+struct co_dump_selection {
+	uint64_t from, to;
+	uint64_t nodes[2];
+	unsigned int n_threads;
+	unsigned int bitrate;
 };
 
 int co_dump(const char* addr, enum co_dump_options options);
+int co_dump_select(const char* addr, enum co_dump_options options,
+		   const struct co_dump_selection* selection);
+
+/* Send the frames from a trace file that pass the selection on the bus at
+ * addr, with their recorded timing. Speed is a multiple of real time, and 0
+ * sends them as fast as possible. CO_DUMP_TCP and CO_DUMP_UDP select the kind
+ * of bus.
+ */
+int co_replay(const char* path, const char* addr, enum co_dump_options options,
+	      const struct co_dump_selection* selection, double speed);
 
 #endif /*  CANOPEN_DUMP_H_ */
@@ -16,8 +16,8 @@
 #ifndef CANOPEN_EDS_H_
 #define CANOPEN_EDS_H_
 
+#include <stddef.h>
 #include "canopen/types.h"
-#include "sys/tree.h"
 
 enum eds_obj_access {
 	EDS_OBJ_R = 1,
@@ -38,19 +38,36 @@ struct eds_obj {
 	const char* scaling;
 };
 
-struct eds_obj_node;
-
-RB_HEAD(eds_obj_tree, eds_obj_node);
-
 struct canopen_eds {
 	uint32_t vendor;
 	uint32_t product;
 	uint32_t revision;
 	char name[256];
 
-	struct eds_obj_tree obj_tree;
+	/* Sorted by key */
+	const struct eds_obj* objs;
+	size_t n_objs;
+
+	/* The positions of the objects in objs plus one, hashed by name. Names
+	 * are looked up by going through all the objects if this is missing.
+	 */
+	uint32_t* name_table;
+	size_t name_table_size;
 };
 
+/* The files are read by this many threads when the cache cannot be used. */
+void eds_db_set_n_threads(int n);
+
+/* Only read the identity of each file at first, and the rest of it the first
+ * time that eds_db_find() or eds_db_find_by_name() picks it.
+ */
+void eds_db_set_lazy(int is_lazy);
+
+/* Read the files under path and keep the cache in cache_path instead of the
+ * default locations. NULL selects the default. The strings are not copied.
+ */
+void eds_db_set_paths(const char* path, const char* cache_path);
+
 int eds_db_load(void);
 void eds_db_unload(void);
 
@@ -59,6 +76,8 @@ const struct canopen_eds* eds_db_find_by_name(const char* name);
 
 const struct eds_obj* eds_obj_find(const struct canopen_eds* eds,
 				   int index, int subindex);
+const struct eds_obj* eds_obj_find_by_name(const struct canopen_eds* eds,
+					   const char* name);
 
 static inline int eds_obj_index(const struct eds_obj* obj)
 {
@@ -0,0 +1,141 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_FIRMWARE_H
+#define _CANOPEN_FIRMWARE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "canopen.h"
+#include "canopen/sdo.h"
+#include "canopen/sdo_req_enums.h"
+#include "arc.h"
+
+/* Program download as described in CiA 302-3. For each node, the program is
+ * stopped and cleared through 0x1F51, the image is written to 0x1F50 and the
+ * program is started again.
+ *
+ * Jobs for different nodes run at the same time, each on the SDO queue of its
+ * node, and all of them download straight from one read-only mapping of the
+ * image. At most max_active of them are downloading at any time, so that the
+ * bus is not flooded; the others wait their turn in the pending state once
+ * their program has been cleared.
+ *
+ * Everything here runs on the main loop.
+ */
+
+#define FW_PROGRAM_DATA 0x1F50
+#define FW_PROGRAM_CONTROL 0x1F51
+
+enum fw_program_control {
+	FW_PROGRAM_STOP = 0,
+	FW_PROGRAM_START = 1,
+	FW_PROGRAM_RESET = 2,
+	FW_PROGRAM_CLEAR = 3,
+};
+
+/* Clearing and writing flash can take much longer than a regular round trip.
+ * Timeouts are in ms.
+ */
+#define FW_CLEAR_TIMEOUT 30000
+#define FW_DOWNLOAD_TIMEOUT 10000
+
+struct fw_image {
+	int ref;
+	void* data;
+	size_t size;
+	char path[256];
+};
+
+struct fw_image* fw_image_open(const char* path);
+ARC_PROTOTYPE(fw_image)
+
+enum fw_job_state {
+	FW_JOB_IDLE = 0,
+	FW_JOB_PENDING,
+	FW_JOB_STOPPING,
+	FW_JOB_CLEARING,
+	FW_JOB_DOWNLOADING,
+	FW_JOB_STARTING,
+	FW_JOB_DONE,
+	FW_JOB_FAILED,
+};
+
+struct sdo_req;
+struct sdo_req_queue;
+struct fw_updater;
+
+struct fw_job {
+	struct fw_updater* parent;
+	int nodeid;
+	int program;
+	enum fw_job_state state;
+
+	/* Released when the job is finished */
+	struct fw_image* image;
+	size_t size;
+
+	/* The request of the current step has not been referenced by the job.
+	 * It is cleared when the request is freed.
+	 */
+	struct sdo_req* req;
+	enum sdo_req_status req_status;
+
+	/* The step that failed, and why */
+	enum fw_job_state failed_state;
+	enum sdo_req_status status;
+	enum sdo_abort_code abort_code;
+
+	uint64_t start_time, pending_time, end_time;
+};
+
+struct fw_updater {
+	struct sdo_req_queue* queues;
+	unsigned int max_active;
+	unsigned int n_active;
+	struct fw_job job[CANOPEN_NODEID_MAX + 1];
+};
+
+/* The queues are indexed by node id, as in sdo_req_queues_init() */
+void fw_updater_init(struct fw_updater* self, struct sdo_req_queue* queues,
+		     unsigned int max_active);
+void fw_updater_destroy(struct fw_updater* self);
+
+/* Load the image into the given program number of the node. Returns -1 and
+ * sets errno to EBUSY if the node already has a job that is not finished.
+ */
+int fw_updater_start(struct fw_updater* self, int nodeid,
+		     struct fw_image* image, int program);
+
+/* Returns an image that is in use by a job if one was opened from the path */
+struct fw_image* fw_updater_find_image(struct fw_updater* self,
+				       const char* path);
+
+static inline const struct fw_job*
+fw_updater_get_job(const struct fw_updater* self, int nodeid)
+{
+	return &self->job[nodeid];
+}
+
+/* The number of bytes of the image that have been sent */
+size_t fw_job_get_progress(const struct fw_job* self);
+
+const char* fw_job_state_str(enum fw_job_state state);
+
+/* Why the job failed */
+const char* fw_job_strerror(const struct fw_job* self);
+
+#endif /* _CANOPEN_FIRMWARE_H */
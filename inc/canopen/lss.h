@@ -0,0 +1,78 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CANOPEN_LSS_H_
+#define CANOPEN_LSS_H_
+
+#include <stdint.h>
+
+struct sock;
+
+/* Layer setting services (CiA 305), with which the master finds nodes that
+ * have no node id yet and gives them one.
+ */
+#define R_LSS_SLAVE 0x7e4
+#define R_LSS_MASTER 0x7e5
+
+#define LSS_NODEID_UNCONFIGURED 255
+
+enum lss_cs {
+	LSS_CS_SWITCH_STATE_GLOBAL = 0x04,
+	LSS_CS_CONFIGURE_NODEID = 0x11,
+	LSS_CS_STORE_CONFIGURATION = 0x17,
+	LSS_CS_IDENTIFY_SLAVE = 0x4f,
+	LSS_CS_FASTSCAN = 0x51,
+};
+
+enum lss_mode {
+	LSS_MODE_WAITING = 0,
+	LSS_MODE_CONFIGURATION = 1,
+};
+
+/* The LSS address of a node: the identity object (0x1018) less the device
+ * type, in the order that the fast scan goes through it
+ */
+enum lss_field {
+	LSS_VENDOR_ID = 0,
+	LSS_PRODUCT_CODE,
+	LSS_REVISION_NUMBER,
+	LSS_SERIAL_NUMBER,
+	LSS_N_FIELDS,
+};
+
+struct lss_address {
+	uint32_t field[LSS_N_FIELDS];
+};
+
+int lss_switch_state_global(const struct sock* sock, enum lss_mode mode);
+
+/* Finds one node that has no node id by the fast scan, in at most 133
+ * requests, and leaves it in the configuration state. Each request that no
+ * node answers costs the timeout, in ms.
+ *
+ * Returns 1 if a node was found, 0 if there are none left, or -1 if a request
+ * could not be sent.
+ */
+int lss_fastscan(const struct sock* sock, struct lss_address* found,
+		 int timeout);
+
+/* These apply to the node in the configuration state. They return 0 when the
+ * node accepts, or the error code that it gave, or -1 if it did not answer.
+ * The new node id takes effect when the node is reset.
+ */
+int lss_configure_nodeid(const struct sock* sock, int nodeid, int timeout);
+int lss_store_configuration(const struct sock* sock, int timeout);
+
+#endif /* CANOPEN_LSS_H_ */
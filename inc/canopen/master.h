@@ -18,9 +18,32 @@
 
 #include <stddef.h>
 #include <assert.h>
+#include <pthread.h>
+#include <linux/can.h>
 #include "canopen.h"
 #include "canopen-driver.h"
+#include "canopen/sdo_req.h"
+#include "canopen/cob_table.h"
+#include "canopen/sync-producer.h"
+#include "canopen/sync-cycle.h"
+#include "canopen/sdo_throttle.h"
+#include "canopen/firmware.h"
 #include "type-macros.h"
+#include "sock.h"
+#include "trace-buffer.h"
+#include "trace-record.h"
+#include "frame-ring.h"
+#include "shm-ring.h"
+#include "process-image.h"
+#include "node-stats.h"
+#include "bootup-timeline.h"
+#include "emcy-history.h"
+#include "node-info.h"
+#include "bus-load.h"
+#include "can-errors.h"
+#include "cfg.h"
+
+#define CO_MASTER_MAX_BUSES 8
 
 enum co_master_driver_type {
 	CO_MASTER_DRIVER_NONE = 0,
@@ -30,62 +53,300 @@ enum co_master_driver_type {
 
 typedef int (*co_drv_init_fn)(struct co_drv*);
 
+struct pdo_map;
+struct canopen_eds;
+struct node_identity_cache;
+
+struct drv_dso;
+struct drv_exec;
+
+/* The first two cache lines hold what is used to hand a TPDO to the driver.
+ * They are kept apart from the rest of the node, in co_bus.drv, so that a
+ * stream of frames from many nodes stays within a few kilobytes.
+ */
 struct co_drv {
-	void* dso;
+	co_pdo_fn pdo_fn[4];
+	co_tpdo_fn tpdo_fn;
+	enum co_options options;
+	uint64_t rx_timestamp;
+	void* context;
+
+	co_pdo_signal_fn tpdo_signal_fn[4];
+	/* Compiled mappings of TPDOs and RPDOs 1-4, loaded on request */
+	struct pdo_map* tpdo_map[4];
+
+	struct co_master_node* node;
+
+	struct drv_dso* dso;
 	co_drv_init_fn init_fn;
 
 	struct sdo_req_queue* sdo_queue;
 
-	void* context;
 	co_free_fn free_fn;
 
-	co_pdo_fn pdo1_fn, pdo2_fn, pdo3_fn, pdo4_fn;
+	struct pdo_map* rpdo_map[4];
 	co_emcy_fn emcy_fn;
 	co_start_fn start_fn;
+	co_sync_cycle_fn sync_cycle_fn;
+} __attribute__((aligned(64)));
 
-	enum co_options options;
-
-	char iface[256];
-};
+struct co_bus;
 
 struct co_master_node {
+	struct co_bus* bus;
+	int nodeid;
+
 	enum co_master_driver_type driver_type;
+	int is_loading;
+	int is_initialized;
+
+	/* Runs the driver callbacks for received frames, if set */
+	struct drv_exec* exec;
+
+	/* Points into co_bus.drv */
+	struct co_drv* ndrv;
 
 	void* driver;
 	void* master_iface;
 
-	struct co_drv ndrv;
+	uint32_t ntimeouts;
 
+	struct mloop_timer* heartbeat_timer;
+
+	/* Monotonic time in us of the next guard ping, or 0 */
+	uint64_t next_ping;
+
+	/* Synchronous RPDOs waiting for the next SYNC */
+	struct can_frame sync_rpdo[4];
+	int is_sync_rpdo_latched[4];
+
+	/* Everything below is only read when the node boots up or is looked
+	 * at through REST.
+	 */
 	uint32_t device_type;
 	int is_heartbeat_supported;
 
-	uint32_t vendor_id, product_code, revision_number;
+	uint32_t vendor_id, product_code, revision_number, serial_number;
 
-	struct mloop_timer* heartbeat_timer;
-	struct mloop_timer* ping_timer;
+	/* Looked up when the driver is loaded */
+	const struct canopen_eds* eds;
+
+	/* The number of SDO channels that nodes of this type were seen to
+	 * answer on, or 0 if none has failed. It is learned rather than
+	 * configured, so it is kept apart from cfg.
+	 */
+	size_t learned_n_sdo_channels;
 
 	char name[64];
 	char hw_version[64];
 	char sw_version[64];
 
-	int is_loading;
-	int is_initialized;
+	/* Recent EMCYs, for logging them and for GET /emcy */
+	struct emcy_history emcy_history;
 
-	uint32_t ntimeouts;
+	/* A copy of the above for other threads, such as those of REST. See
+	 * co_master_get_node_info().
+	 */
+	struct node_info_slot info;
+
+	struct cfg_node cfg;
+};
+
+enum co_bus_state {
+	CO_BUS_STATE_STARTUP = 0,
+	CO_BUS_STATE_RUNNING,
+	CO_BUS_STATE_STOPPING,
+};
+
+/* Everything that the master keeps for one CAN interface. The EDS database,
+ * the worker pool and the REST service are shared between buses.
+ */
+struct co_bus {
+	int index;
+	char iface[256];
+
+	struct sock socket;
+	struct tracebuffer tracebuffer;
+
+	/* Set when the trace buffer is recorded to disk */
+	struct tr_recorder* recorder;
+
+	/* Set when only some frames are traced */
+	struct trace_filter* trace_filter;
+
+	enum co_bus_state state;
+
+	struct co_master_node node[CANOPEN_NODEID_MAX + 1];
+	struct co_drv drv[CANOPEN_NODEID_MAX + 1];
+	struct sdo_req_queue sdo_queue[CANOPEN_NODEID_MAX + 1];
+	/* Note: node[0], drv[0] and sdo_queue[0] are unused */
+
+	/* Indexed by node id. Counted as frames arrive, on whichever thread
+	 * receives them, and as SDO transfers end.
+	 */
+	struct node_stats stats[CANOPEN_NODEID_MAX + 1];
+
+	/* Indexed by node id. When each node got through each step of its
+	 * boot-up.
+	 */
+	struct bootup_timeline bootup[CANOPEN_NODEID_MAX + 1];
+
+	struct fw_updater firmware;
+
+	/* What was read from the nodes before, when cfg.state_path is set */
+	struct node_identity_cache* identities;
+
+	char nodes_seen[CANOPEN_NODEID_MAX + 1];
+	char nodes_seen_late[CANOPEN_NODEID_MAX + 1];
+
+	/* Set while a bus that was handed over by another process boots up.
+	 * The nodes that it had started are still running, so they are not
+	 * reset, probed or started again.
+	 */
+	int is_adopted;
+	char nodes_running[CANOPEN_NODEID_MAX + 1];
+
+	/* When cfg.heartbeat_scan_interval is set, the heartbeats are checked
+	 * against these by one timer instead of a timer for each node. Each is
+	 * the monotonic time in us at which the node times out, or 0.
+	 */
+	uint64_t heartbeat_deadline[CANOPEN_NODEID_MAX + 1];
+	struct mloop_timer* heartbeat_scanner;
+
+	/* Sends the guard pings of all nodes that do not support heartbeats */
+	struct mloop_timer* ping_timer;
+
+	unsigned int n_scheduled_bootups;
+	unsigned int n_inhibited_starts;
+	int is_waiting_for_drivers;
+
+	/* Nodes that are started in groups are started from here on */
+	struct mloop_timer* start_timer;
+	int next_start;
+
+	/* Monotonic time in us at which each boot-up phase ended */
+	struct {
+		uint64_t start;
+		uint64_t probe_done;
+		uint64_t drivers_loaded;
+		uint64_t nodes_started;
+	} bootup_time;
+
+	struct mloop_socket* mux_handler;
+
+	struct cob_table mux_table;
+	int mux_table_is_ready;
+
+	pthread_mutex_t mux_filter_mutex;
+	struct can_filter mux_filters[CAN_SFF_MASK + 1];
+
+	/* When cfg.pdo_thread_priority is set, a real-time thread owns the
+	 * receiving end of the socket and calls PDO handlers directly. All
+	 * other frames are passed on to the main loop through rx_ring. When
+	 * the CAN reactor is not the main loop, rx_handler does the same on
+	 * that reactor.
+	 */
+	int is_rx_forwarded;
+	int have_pdo_thread;
+	pthread_t pdo_thread;
+	struct mloop_socket* rx_handler;
+	pthread_mutex_t pdo_lock;
+	struct frame_ring rx_ring;
+	int rx_eventfd;
+
+	/* Whoever receives from the socket also shares the frames with local
+	 * tools through this, if cfg.shm_ring_size is set. The socket filters
+	 * are then left off, so that the tools get the whole bus.
+	 */
+	struct shm_ring shm_ring;
+
+	/* Also written by whoever receives, if cfg.process_image is set */
+	struct process_image process_image;
+
+	int have_sync_producer;
+	struct sync_producer sync_producer;
+
+	/* SYNCs sent by the producer, for the TPDO callbacks. Written on the
+	 * producer thread.
+	 */
+	uint64_t n_syncs;
+
+	/* The TPDOs that drivers want per SYNC cycle are collected here by
+	 * the receiving thread. Each cycle is ended on the producer thread and
+	 * handed to the drivers on the main loop by sync_cycle_job.
+	 */
+	struct sync_cycle sync_cycle;
+	struct sync_cycle_snapshot sync_cycle_snapshot;
+	struct mloop_idle* sync_cycle_job;
+	uint64_t last_sync_cycle;
+
+	/* Frames are counted here as they are sent and received, if
+	 * cfg.bitrate is set, and background SDOs are paced by the load.
+	 */
+	struct bl_meter meter;
+	struct sdo_throttle sdo_throttle;
+
+	/* The controller's error state, from the error frames received on
+	 * the main loop. Background SDOs are held while it is bad or was
+	 * lately, and RPDOs are dropped while the controller is off the bus.
+	 */
+	struct can_errors can_errors;
+	struct mloop_timer* can_error_timer;
+	uint64_t last_can_restart;
+	uint64_t n_rpdos_dropped;
+
+	/* Protects the synchronous RPDO slots of the nodes */
+	pthread_mutex_t sync_lock;
+	uint64_t last_sync_time;
+	uint64_t n_sync_rpdos_overwritten;
+	uint64_t n_sync_rpdos_late;
 };
 
-extern struct co_master_node co_master_node_[];
+extern struct co_bus co_bus_[];
+extern int co_master_n_buses_;
+
+static inline int co_master_get_n_buses(void)
+{
+	return co_master_n_buses_;
+}
+
+static inline struct co_bus* co_master_get_bus(int index)
+{
+	assert(0 <= index && index < co_master_n_buses_);
+	return &co_bus_[index];
+}
+
+struct co_bus* co_master_find_bus(const char* iface);
+
+const struct canopen_eds* co_master_find_eds(const struct co_master_node* node);
+
+/* Safe on any thread. Returns 0 if nothing is known of the node yet. */
+uint64_t co_master_get_node_info(const struct co_master_node* node,
+				 struct node_info* dst);
 
 static inline int co_master_get_node_id(const struct co_master_node* node)
 {
-	return ((char*)node - (char*)co_master_node_)
-		/ sizeof(struct co_master_node);
+	return node->nodeid;
+}
+
+static inline struct co_master_node* co_bus_get_node(struct co_bus* bus,
+						     int nodeid)
+{
+	assert(CANOPEN_NODEID_MIN <= nodeid && nodeid <= CANOPEN_NODEID_MAX);
+	return &bus->node[nodeid];
 }
 
-static inline struct co_master_node* co_master_get_node(int nodeid)
+static inline struct sdo_req_queue* co_bus_get_sdo_queue(struct co_bus* bus,
+							 int nodeid)
 {
 	assert(CANOPEN_NODEID_MIN <= nodeid && nodeid <= CANOPEN_NODEID_MAX);
-	return &co_master_node_[nodeid];
+	return &bus->sdo_queue[nodeid];
+}
+
+static inline
+struct sdo_req_queue* co_master_get_sdo_queue(struct co_master_node* node)
+{
+	return co_bus_get_sdo_queue(node->bus, node->nodeid);
 }
 
 int co_master_run(void);
@@ -94,12 +355,14 @@ int co_drv_load(struct co_drv* drv, const char* name);
 int co_drv_init(struct co_drv* drv);
 void co_drv_unload(struct co_drv* drv);
 
-int co__rpdox(int nodeid, int type, const void* data, size_t size);
-int co__start(int nodeid);
+int co__rpdox(struct co_master_node* node, int type, const void* data,
+	      size_t size);
+int co__start(struct co_master_node* node);
+void co__mux_update(struct co_master_node* node);
 
 static inline struct co_master_node* co_drv_node(const struct co_drv* drv)
 {
-	return container_of(drv, struct co_master_node, ndrv);
+	return drv->node;
 }
 
 static inline uint16_t
@@ -49,7 +49,48 @@ int co_net_probe(const struct sock* sock, char* nodes_seen, int start, int end,
 int co_net_probe_sdo(const struct sock* sock, char* nodes_seen, int start,
 		     int end, int timeout);
 
+/* A wait for responses ends when no new node has responded for a quiet
+ * period, or as soon as every node in nodes_expected has responded if that is
+ * given.
+ *
+ * The quiet period is the timeout until the first response. If timeout_min is
+ * lower, it then follows twice the longest gap between responses seen so far,
+ * within the two. All times are in ms.
+ */
+struct co_net_wait {
+	const char* nodes_expected; /* array of length 128, or NULL */
+	int timeout;
+	int timeout_min;
+
+	/* Array of length 128, or NULL. Set to the monotonic time in us at
+	 * which each node answered.
+	 */
+	uint64_t* seen_time;
+
+	/* Set by the wait */
+	int n_seen;
+	int gap_max;
+	int duration;
+	int is_complete;
+};
+
+/* Sets both timeouts to timeout, and expects nothing */
+void co_net_wait_init(struct co_net_wait* wait, int timeout);
+
+/* Like the above, but waiting as described by wait */
+int co_net_reset_wait(const struct sock* sock, char* nodes_seen,
+		      struct co_net_wait* wait);
+int co_net_reset_range_wait(const struct sock* sock, char* nodes_seen,
+			    int start, int end, struct co_net_wait* wait);
+int co_net_probe_wait(const struct sock* sock, char* nodes_seen, int start,
+		      int end, struct co_net_wait* wait);
+
 int co_net_send_nmt(const struct sock* sock, int cs, int nodeid);
+
+/* Like co_net_send_nmt(), but the frame goes through the socket's staging
+ * queue. See sock_stage().
+ */
+int co_net_stage_nmt(const struct sock* sock, int cs, int nodeid);
 int co_net__request_device_type(const struct sock* sock, int nodeid);
 
 int co_net__wait_for_bootup(const struct sock* sock, char* nodes_seen,
@@ -0,0 +1,81 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_PDO_MAP_H
+#define _CANOPEN_PDO_MAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Decoding and encoding of PDO payloads according to their mapping
+ * parameters (0x1600-0x17FF for RPDOs and 0x1A00-0x1BFF for TPDOs).
+ *
+ * Each mapped object is compiled into a step that holds its byte offset, bit
+ * shift and mask, so that unpacking a payload does not have to interpret the
+ * mapping again for every frame.
+ */
+
+#define PDO_MAP_MAX_LENGTH 64
+#define PDO_MAP_MAX_SIZE 64
+
+struct pdo_map_entry {
+	uint16_t index;
+	uint8_t subindex;
+	uint8_t bits;
+	uint8_t is_signed;
+};
+
+struct pdo_map_step {
+	uint16_t offset;
+	uint8_t shift;
+	uint8_t size;
+	uint64_t mask;
+	uint64_t sign;
+};
+
+struct pdo_map {
+	size_t length;
+	size_t bits;
+	size_t size;
+	struct pdo_map_entry entry[PDO_MAP_MAX_LENGTH];
+	struct pdo_map_step step[PDO_MAP_MAX_LENGTH];
+};
+
+void pdo_map_init(struct pdo_map* self);
+
+/* The value is the content of a mapping sub-object, i.e. the index in the
+ * upper 16 bits, then the subindex and then the length in bits. Returns -1 if
+ * the entry is invalid or if it does not fit.
+ */
+int pdo_map_add(struct pdo_map* self, uint32_t value, int is_signed);
+
+/* Returns the position of the object in the mapping or -1 if it is not
+ * mapped.
+ */
+int pdo_map_find(const struct pdo_map* self, int index, int subindex);
+
+/* Extracts self->length values from the payload. Signed values are sign
+ * extended. Returns -1 if the payload is shorter than self->size.
+ */
+int pdo_map_unpack(const struct pdo_map* self, uint64_t* values,
+		   const void* data, size_t size);
+
+/* The payload buffer must hold at least self->size bytes. Returns the number
+ * of bytes written.
+ */
+size_t pdo_map_pack(const struct pdo_map* self, void* data,
+		    const uint64_t* values);
+
+#endif /* _CANOPEN_PDO_MAP_H */
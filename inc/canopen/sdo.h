@@ -33,12 +33,21 @@
 #define SDO_MULTIPLEXER_IDX 1
 #define SDO_MULTIPLEXER_SIZE 3
 
+#define SDO_BLOCK_MAX_SIZE 127
+#define SDO_BLOCK_SIZE_IDX 4
+#define SDO_BLOCK_PST_IDX 5
+#define SDO_BLOCK_ACKSEQ_IDX 1
+#define SDO_BLOCK_NEXT_SIZE_IDX 2
+#define SDO_BLOCK_CRC_IDX 1
+
 enum sdo_ccs {
 	SDO_CCS_DL_SEG_REQ = 0,
 	SDO_CCS_DL_INIT_REQ = 1,
 	SDO_CCS_UL_INIT_REQ = 2,
 	SDO_CCS_UL_SEG_REQ = 3,
 	SDO_CCS_ABORT = 4,
+	SDO_CCS_BLK_UL_REQ = 5,
+	SDO_CCS_BLK_DL_REQ = 6,
 };
 
 enum sdo_scs {
@@ -47,6 +56,18 @@ enum sdo_scs {
 	SDO_SCS_UL_INIT_RES = 2,
 	SDO_SCS_DL_INIT_RES = 3,
 	SDO_SCS_ABORT = 4,
+	SDO_SCS_BLK_DL_RES = 5,
+	SDO_SCS_BLK_UL_RES = 6,
+};
+
+/* Sub-commands of block transfers. Requests from the client during download
+ * and responses from the server during upload only carry the lowest bit.
+ */
+enum sdo_block_cs {
+	SDO_BLOCK_INIT = 0,
+	SDO_BLOCK_END = 1,
+	SDO_BLOCK_ACK = 2,
+	SDO_BLOCK_START = 3,
 };
 
 enum sdo_abort_code {
@@ -224,6 +245,105 @@ static inline void sdo_set_subindex(struct can_frame* frame, uint8_t subindex)
 	frame->data[SDO_MULTIPLEXER_IDX+2] = subindex;
 }
 
+static inline int sdo_get_block_cs(const struct can_frame* frame)
+{
+	return frame->data[0] & 3;
+}
+
+static inline void sdo_set_block_cs(struct can_frame* frame,
+				    enum sdo_block_cs cs)
+{
+	frame->data[0] &= ~3;
+	frame->data[0] |= cs;
+}
+
+static inline int sdo_is_block_end(const struct can_frame* frame)
+{
+	return frame->data[0] & 1;
+}
+
+static inline int sdo_is_block_crc_supported(const struct can_frame* frame)
+{
+	return !!(frame->data[0] & 4);
+}
+
+static inline void sdo_set_block_crc_supported(struct can_frame* frame)
+{
+	frame->data[0] |= 4;
+}
+
+static inline int sdo_is_block_size_indicated(const struct can_frame* frame)
+{
+	return !!(frame->data[0] & 2);
+}
+
+static inline void sdo_indicate_block_size(struct can_frame* frame)
+{
+	frame->data[0] |= 2;
+}
+
+/* Number of bytes in the last segment that do not contain data */
+static inline size_t sdo_get_block_unused_size(const struct can_frame* frame)
+{
+	return (frame->data[0] >> 2) & 7;
+}
+
+static inline void sdo_set_block_unused_size(struct can_frame* frame,
+					     size_t size)
+{
+	frame->data[0] &= ~(7 << 2);
+	frame->data[0] |= size << 2;
+}
+
+static inline int sdo_get_block_seqno(const struct can_frame* frame)
+{
+	return frame->data[0] & 0x7f;
+}
+
+static inline void sdo_set_block_seqno(struct can_frame* frame, int seqno)
+{
+	frame->data[0] &= 0x80;
+	frame->data[0] |= seqno & 0x7f;
+}
+
+static inline int sdo_is_last_block_segment(const struct can_frame* frame)
+{
+	return !!(frame->data[0] & 0x80);
+}
+
+static inline void sdo_end_block_segment(struct can_frame* frame)
+{
+	frame->data[0] |= 0x80;
+}
+
+/* A block always has at least one segment, even if there is no data */
+static inline size_t sdo_block_unused_size(size_t size)
+{
+	size_t rest = size % SDO_SEGMENT_MAX_SIZE;
+	return size == 0 || rest ? SDO_SEGMENT_MAX_SIZE - rest : 0;
+}
+
+static inline uint16_t sdo_get_block_crc(const struct can_frame* frame)
+{
+	uint16_t crc;
+	byteorder(&crc, &frame->data[SDO_BLOCK_CRC_IDX], sizeof(crc));
+	return crc;
+}
+
+static inline void sdo_set_block_crc(struct can_frame* frame, uint16_t crc)
+{
+	byteorder(&frame->data[SDO_BLOCK_CRC_IDX], &crc, sizeof(crc));
+}
+
+/* Segments of a block carry a sequence number where other frames carry a
+ * command specifier, so only an exact match is an abort while a block is
+ * being transferred.
+ */
+static inline int sdo_is_block_abort(const struct can_frame* frame)
+{
+	return frame->data[0] == SDO_CCS_ABORT << 5;
+}
+
 static inline void sdo_clear_frame(struct can_frame* frame)
 {
 	memset(frame, 0, sizeof(*frame));
@@ -241,5 +361,8 @@ void sdo_abort(struct can_frame* frame, enum sdo_abort_code code, int index,
 
 const char* sdo_strerror(enum sdo_abort_code code);
 
+/* CRC-16-CCITT as used by block transfers. Start with crc = 0. */
+uint16_t sdo_crc16(uint16_t crc, const void* data, size_t size);
+
 #endif /* _CANOPEN_SDO_H */
 
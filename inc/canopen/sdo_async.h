@@ -20,6 +20,7 @@
 #include "vector.h"
 #include "canopen/sdo_req_enums.h"
 #include "canopen/sdo.h"
+#include "canopen/sdo_rtt.h"
 #include "sock.h"
 
 struct sdo_async;
@@ -28,10 +29,22 @@ struct can_frame;
 typedef void (*sdo_async_fn)(struct sdo_async* async);
 typedef void (*sdo_async_free_fn)(void* ptr);
 
+/* Returns 0 to go on, 1 to pause the transfer until sdo_async_resume() is
+ * called, or -1 to abort it.
+ */
+typedef int (*sdo_async_data_fn)(struct sdo_async* async, const void* data,
+				 size_t size);
+
+/* Streamed uploads are passed on in chunks of at least this many bytes */
+#define SDO_ASYNC_CHUNK_SIZE 4096
+
 enum sdo_async_comm_state {
 	SDO_ASYNC_COMM_START = 0,
 	SDO_ASYNC_COMM_INIT_RESPONSE,
 	SDO_ASYNC_COMM_SEG_RESPONSE,
+	SDO_ASYNC_COMM_BLOCK_INIT_RESPONSE,
+	SDO_ASYNC_COMM_BLOCK_RESPONSE,
+	SDO_ASYNC_COMM_BLOCK_END_RESPONSE,
 };
 
 enum sdo_async_quirks_flags {
@@ -41,14 +54,34 @@ enum sdo_async_quirks_flags {
 	SDO_ASYNC_QUIRK_ALL = 0xff,
 };
 
+/* What the server has been seen to do, for the master to learn from. It is
+ * only cleared by whoever reads it.
+ */
+struct sdo_async_seen {
+	unsigned int n_responses;
+	unsigned int n_timeouts;
+
+	/* Counted whether the quirk lets them through or not. The first
+	 * response after a timeout or an abort is left out of these, as it may
+	 * be a late answer to what was given up on.
+	 */
+	unsigned int n_mux_mismatches;
+	unsigned int n_mux_matches;
+
+	int is_block_accepted;
+};
+
 struct sdo_async {
 	struct sock sock;
 	unsigned int nodeid;
+	uint32_t request_cob, response_cob;
 	enum sdo_req_type type;
 	int is_running;
 	enum sdo_async_comm_state comm_state;
 	struct mloop_timer* timer;
 	struct vector buffer;
+	const void* dl_data;
+	size_t dl_size;
 	sdo_async_fn on_done;
 	int index, subindex;
 	int is_toggled;
@@ -59,6 +92,35 @@ struct sdo_async {
 	void* context;
 	sdo_async_free_fn free_fn;
 	int is_size_indicated;
+
+	/* Round trips are measured if this is set */
+	struct sdo_rtt* rtt;
+	uint64_t request_time;
+
+	/* Monotonic time in us at which the transfer was started */
+	uint64_t start_time;
+
+	/* Block transfer state */
+	int is_block;
+	int is_block_unsupported;
+	int is_crc_used;
+	int block_size;
+	int seqno;
+	int is_last_segment_sent;
+	size_t block_pos;
+
+	/* Streaming state */
+	sdo_async_data_fn on_data;
+	size_t chunk_size;
+	int is_paused;
+	uint16_t crc;
+
+	struct sdo_async_seen seen;
+
+	/* Set while a response to a transfer that was given up on may still
+	 * come in
+	 */
+	int is_late_response_possible;
 };
 
 struct sdo_async_info {
@@ -70,6 +132,27 @@ struct sdo_async_info {
 	sdo_async_fn on_done;
 	void* context;
 	sdo_async_free_fn free_fn;
+
+	/* Download the data in place rather than from a copy. It must then stay
+	 * valid until the transfer is done or stopped.
+	 */
+	int is_data_borrowed;
+
+	/* Use block transfer if the server supports it. Small uploads are
+	 * switched to expediated mode by the server and downloads of up to 4
+	 * bytes are always expediated.
+	 */
+	int use_block;
+
+	/* Stream an upload: the data is passed to on_data in chunks as it
+	 * arrives instead of being collected in the buffer, so that objects of
+	 * any size can be read with bounded memory. The last chunk is passed on
+	 * before on_done is called. Data that was passed on may still be
+	 * followed by a failed transfer. If chunk_size is 0,
+	 * SDO_ASYNC_CHUNK_SIZE is used.
+	 */
+	sdo_async_data_fn on_data;
+	size_t chunk_size;
 };
 
 int sdo_async_init(struct sdo_async* self, const struct sock* sock, int nodeid);
@@ -78,6 +161,19 @@ void sdo_async_destroy(struct sdo_async* self);
 int sdo_async_start(struct sdo_async* self, const struct sdo_async_info* info);
 int sdo_async_stop(struct sdo_async* self);
 
+/* Abort a running transfer with the given code. The server is told, and the
+ * transfer is done with SDO_REQ_LOCAL_ABORT. Returns -1 if nothing is running.
+ */
+int sdo_async_abort(struct sdo_async* self, enum sdo_abort_code code);
+
+/* Whether the server gets the multiplexer of every response wrong, rather
+ * than only some that were late
+ */
+int sdo_async_is_multiplexer_mixed_up(const struct sdo_async_seen* seen);
+
+/* Continue a streamed upload that was paused by its data function */
+int sdo_async_resume(struct sdo_async* self);
+
 int sdo_async_feed(struct sdo_async* self, const struct can_frame* frame);
 
 #endif /* SDO_ASYNC_H_ */
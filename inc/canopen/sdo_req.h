@@ -18,6 +18,7 @@
 
 #include <sys/queue.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <mloop.h>
 #include "vector.h"
 #include "canopen/sdo.h"
@@ -29,10 +30,15 @@
 
 struct sdo_req;
 struct sock;
+struct node_stats;
+struct sdo_throttle;
 
 typedef void (*sdo_req_fn)(struct sdo_req*);
 typedef void (*sdo_req_free_fn)(void*);
 
+/* See sdo_async_data_fn */
+typedef int (*sdo_req_data_fn)(struct sdo_req*, const void* data, size_t size);
+
 struct sdo_req_info {
 	enum sdo_req_type type;
 	int index, subindex;
@@ -40,64 +46,315 @@ struct sdo_req_info {
 	const void* dl_data;
 	size_t dl_size;
 	void* context;
+
+	/* Use dl_data in place instead of copying it. It must then stay valid
+	 * until the request has been freed.
+	 */
+	int is_dl_data_borrowed;
+
+	/* See sdo_async_info */
+	int use_block;
+
+	/* In ms. 0 uses the timeout of the queue. */
+	unsigned int timeout;
+
+	enum sdo_req_priority priority;
+
+	/* Stream the upload to on_data rather than collecting it in data. Such
+	 * uploads are never cached. See sdo_async_info.
+	 */
+	sdo_req_data_fn on_data;
+
+	/* Accept an upload from the cache if it is no older than this many ms.
+	 * 0 leaves the cache alone; see SDO_REQ_CACHE_FOREVER.
+	 */
+	int cache_max_age;
+
+	/* Whoever the request is made for, if anyone. All requests of an owner
+	 * can be cancelled at once; see sdo_req_queue_cancel().
+	 */
+	const void* owner;
 };
 
 struct sdo_req_queue;
 
+/* Channel 0 talks to the default SDO server of the node. The others talk to
+ * additional servers, as described by objects 0x1201-0x127F on the node.
+ */
+#define SDO_REQ_MAX_CHANNELS 8
+
+/* Data of up to this size is stored within the request */
+#define SDO_REQ_INLINE_SIZE 8
+
+/* An upload of an object that another upload of the queue is already waiting
+ * for or running is not sent again. It follows the one that is, and gets a
+ * copy of its answer, unless a download to the object is waiting or running
+ * as well. Streamed uploads and batches are always sent on their own. A
+ * follower that is more urgent than the one that it follows moves it up.
+ */
+
+/* Each queue keeps the results of uploads that were made with a cache max
+ * age. An upload that is answered from the cache completes within
+ * sdo_req_start(). Downloads through the queue drop the cached value of their
+ * object, and the whole cache should be cleared when the node boots up.
+ */
+#define SDO_REQ_CACHE_SIZE 32
+#define SDO_REQ_CACHE_FOREVER (-1)
+
 struct sdo_req {
 	int ref;
 	TAILQ_ENTRY(sdo_req) links;
+	struct sdo_req* intake_next;
 	enum sdo_req_type type;
 	int index, subindex;
 	struct vector data;
 	enum sdo_req_status status;
+	int n_waiters; /* In sdo_req_wait(), so the status must wake them */
 	enum sdo_abort_code abort_code;
 	sdo_req_fn on_done;
 	struct sdo_req_queue* parent;
 	void* context;
 	sdo_req_free_fn context_free_fn;
 	int is_size_indicated;
+	int use_block;
+	unsigned int timeout;
+	int cache_max_age;
+	enum sdo_req_priority priority;
+	sdo_req_data_fn on_data;
+	struct sdo_async* channel;
+	int is_pooled;
+	int is_batch;
+	const void* owner;
+
+	/* Set when a running request is aborted by sdo_req_queue_cancel() */
+	int is_cancelled;
+
+	/* Identical uploads that came in while this one was waiting or
+	 * running, which are completed with its answer
+	 */
+	struct sdo_req* followers;
+	struct sdo_req* next_follower;
+
+	char inline_data[SDO_REQ_INLINE_SIZE];
 };
 
 TAILQ_HEAD(sdo_req_list, sdo_req);
 
+/* A lower priority request is started after it has been passed over this many
+ * times, so that background requests cannot be starved.
+ */
+#define SDO_REQ_MAX_PASSED_OVER 16
+
+struct sdo_req_cache_entry {
+	int is_used;
+	int index, subindex;
+	uint64_t time;
+	int is_size_indicated;
+	struct vector data;
+	char inline_data[SDO_REQ_INLINE_SIZE];
+};
+
+/* Requests may be enqueued from any thread without locking. They are pushed
+ * onto the intake and later sorted into the lists by the main loop, which is
+ * the only thread that dequeues, flushes or otherwise touches the lists.
+ */
 struct sdo_req_queue {
+	/* Guards the channels and the cache */
 	pthread_mutex_t mutex;
 	size_t size;
 	size_t limit;
-	struct sdo_req_list list;
-	struct sdo_async sdo_client;
+	struct sdo_req* intake;
+	struct sdo_req_list list[SDO_REQ_N_PRIORITIES];
+	unsigned int n_passed_over[SDO_REQ_N_PRIORITIES];
+	struct sdo_async sdo_client[SDO_REQ_MAX_CHANNELS];
+	size_t n_channels;
 	struct mloop_idle* idle;
 	int nodeid;
+	struct sdo_req_cache_entry cache[SDO_REQ_CACHE_SIZE];
+	size_t cache_next;
+
+	/* Shared by all channels. Timeouts are in ms. */
+	struct sdo_rtt rtt;
+	unsigned int timeout_min, timeout_max;
+
+	/* Each finished transfer is counted here, if set */
+	struct node_stats* stats;
+
+	/* Background requests are paced by this, if set */
+	struct sdo_throttle* throttle;
+
+	/* The channels and the idle job are only made for nodes that are
+	 * used. Until then, there are no channels.
+	 */
+	int is_active;
+	const struct sock* sock;
+	enum sdo_async_quirks_flags quirks;
+
+	/* Set while the main loop is starting requests from the lists, so
+	 * that a request made from within that is left to the idle job
+	 */
+	int is_processing;
 };
 
 int sdo_req__queue_init(struct sdo_req_queue* self, const struct sock* sock,
 			int nodeid, size_t, enum sdo_async_quirks_flags quirks);
 void sdo_req__queue_destroy(struct sdo_req_queue* self);
 
-int sdo_req_queues_init(const struct sock* sock, size_t limit,
-			enum sdo_async_quirks_flags quirks);
-void sdo_req_queues_cleanup();
+int sdo_req_queues_init(struct sdo_req_queue* queues, const struct sock* sock,
+			size_t limit, enum sdo_async_quirks_flags quirks);
+void sdo_req_queues_cleanup(struct sdo_req_queue* queues);
+
+/* Makes the default channel if it is not there yet. Queues are activated by
+ * the first request or channel that is added to them. May be called from any
+ * thread.
+ */
+int sdo_req_queue_activate(struct sdo_req_queue* self);
 
-struct sdo_req_queue* sdo_req_queue_get(int nodeid);
+/* Cancel all pending requests. Must be called from the main loop. */
 void sdo_req_queue_flush(struct sdo_req_queue* self);
 
+/* Cancel the requests of an owner. Those that are waiting are taken out of the
+ * queue and completed as SDO_REQ_CANCELLED, and those that are running are
+ * aborted on the bus. Either way, their done functions are called. An upload
+ * that requests of others follow is left to finish for them. Returns the
+ * number of requests that were cancelled. Must be called from the main loop.
+ */
+size_t sdo_req_queue_cancel(struct sdo_req_queue* self, const void* owner);
+size_t sdo_req_queues_cancel(struct sdo_req_queue* queues, const void* owner);
+
+/* Pending requests are started on any idle channel, so requests that are not
+ * waited for may complete out of order once a queue has more than one channel.
+ */
+int sdo_req_queue_add_channel(struct sdo_req_queue* self, uint32_t request_cob,
+			      uint32_t response_cob);
+
+/* Stop and remove all but the default channel */
+void sdo_req_queue_remove_channels(struct sdo_req_queue* self);
+
+void sdo_req_queue_clear_cache(struct sdo_req_queue* self);
+
+/* The timeout follows the measured round-trip time of the node, within the
+ * given range. It is the maximum until a round trip has been measured.
+ */
+void sdo_req_queue_set_timeout_range(struct sdo_req_queue* self,
+				     unsigned int min, unsigned int max);
+unsigned int sdo_req_queue_get_timeout(const struct sdo_req_queue* self);
+
+/* Returns NULL if no channel receives on the given COB-ID */
+struct sdo_async* sdo_req_queue_find_channel(struct sdo_req_queue* self,
+					     uint32_t response_cob);
+
 struct sdo_req* sdo_req_new(struct sdo_req_info* info);
 void sdo_req_free(struct sdo_req* self);
 
+/* Requests, and the buffers that uploads are received into, are taken from
+ * pools. Whatever a pool could not supply came from the heap, so in a steady
+ * state n_allocated - n_reused should stay the same.
+ */
+struct sdo_req_alloc_stats {
+	uint64_t n_allocated;
+	uint64_t n_reused; /* Taken from the pool */
+	size_t n_cached;
+};
+
+/* Fill the pools with n requests and as many upload buffers as they keep,
+ * and let the request pool hold at least n from now on.
+ */
+int sdo_req_reserve(size_t n);
+void sdo_req_get_alloc_stats(struct sdo_req_alloc_stats* reqs,
+			     struct sdo_req_alloc_stats* buffers);
+
 int sdo_req_start(struct sdo_req* self, struct sdo_req_queue* queue);
 void sdo_req_wait(struct sdo_req* self);
 
+/* Wait for at most timeout ms, or forever if timeout is negative. Returns -1
+ * and sets errno to ETIMEDOUT if the request is still pending.
+ */
+int sdo_req_wait_timeout(struct sdo_req* self, int timeout);
+
+/* Continue a streamed upload that was paused by its data function. This must
+ * be called from the main loop.
+ */
+int sdo_req_resume(struct sdo_req* self);
+
 int sdo_req_queue__enqueue(struct sdo_req_queue* self, struct sdo_req* req);
 struct sdo_req* sdo_req_queue__dequeue(struct sdo_req_queue* self);
 
-static inline
-struct sdo_req_queue* sdo_req_queue__from_async(const struct sdo_async* async)
+ARC_PROTOTYPE(sdo_req)
+
+/* A batch is a request that holds a list of uploads and downloads. They are
+ * run back to back on one channel, in the order that they were added, and the
+ * batch is done when all of them have been tried. By default, items that fail
+ * do not stop the ones that follow.
+ *
+ * The status of the batch is that of the first item that failed, or
+ * SDO_REQ_OK. The batch is referenced, waited for and cancelled through req.
+ */
+enum sdo_batch_policy {
+	/* Go on with the next item */
+	SDO_BATCH_CONTINUE = 0,
+
+	/* Cancel the items that follow and finish the batch */
+	SDO_BATCH_STOP,
+
+	/* Go on, and leave the item out of the status of the batch */
+	SDO_BATCH_IGNORE,
+};
+
+struct sdo_batch_item {
+	enum sdo_req_type type;
+	int index, subindex;
+	struct vector data;
+	enum sdo_req_status status;
+	enum sdo_abort_code abort_code;
+	int is_size_indicated;
+
+	/* These may be changed until the batch is started */
+	enum sdo_batch_policy policy;
+	int use_block;
+
+	/* Only for items that were added by sdo_batch_add_check() */
+	size_t expected_size;
+	uint64_t expected_value;
+	uint64_t expected_mask;
+};
+
+struct sdo_batch {
+	struct sdo_req req;
+	struct vector items;
+	size_t n_finished;
+	size_t n_released;
+};
+
+void sdo_batch_init(struct sdo_batch* self, sdo_req_fn on_done, void* context);
+struct sdo_batch* sdo_batch_new(sdo_req_fn on_done, void* context);
+
+/* Items must not be added after the batch has been started */
+int sdo_batch_add_upload(struct sdo_batch* self, int index, int subindex);
+int sdo_batch_add_download(struct sdo_batch* self, int index, int subindex,
+			   const void* data, size_t size);
+
+/* Add an upload that fails as a local abort with SDO_ABORT_NVAL unless the
+ * value that is read is size bytes long and equal to the expected one in the
+ * bits that are set in mask. size is at most 8, and the value is in host byte
+ * order.
+ */
+int sdo_batch_add_check(struct sdo_batch* self, int index, int subindex,
+			size_t size, uint64_t expected, uint64_t mask);
+
+/* Returns -1 and sets errno to EINVAL if the batch is empty */
+int sdo_batch_start(struct sdo_batch* self, struct sdo_req_queue* queue);
+
+static inline size_t sdo_batch_length(const struct sdo_batch* self)
 {
-	return container_of(async, struct sdo_req_queue, sdo_client);
+	return self->items.index / sizeof(struct sdo_batch_item);
 }
 
-ARC_PROTOTYPE(sdo_req)
+static inline struct sdo_batch_item*
+sdo_batch_get_item(const struct sdo_batch* self, size_t i)
+{
+	return &((struct sdo_batch_item*)self->items.data)[i];
+}
 
 #endif /* SDO_REQ_H_ */
 
@@ -21,6 +21,15 @@ enum sdo_req_type {
 	SDO_REQ_DOWNLOAD
 };
 
+/* Pending requests of higher priority are started first */
+enum sdo_req_priority {
+	SDO_REQ_PRIO_NORMAL = 0,
+	SDO_REQ_PRIO_HIGH,
+	SDO_REQ_PRIO_BACKGROUND,
+};
+
+#define SDO_REQ_N_PRIORITIES 3
+
 enum sdo_req_status {
 	SDO_REQ_PENDING = 0,
 	SDO_REQ_OK,
@@ -0,0 +1,92 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _CANOPEN_SDO_RTT_H
+#define _CANOPEN_SDO_RTT_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Round-trip time estimate for the SDO server of a node, kept in the same way
+ * as the retransmission timer of TCP (RFC 6298). Times are in microseconds.
+ */
+
+/* The least margin that is added to the smoothed round-trip time */
+#define SDO_RTT_GRANULARITY 1000 /* us */
+
+/* The timeout is doubled for every SDO timeout in a row, up to 2^n times */
+#define SDO_RTT_MAX_BACKOFF 4
+
+struct sdo_rtt {
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t n_samples;
+	uint64_t n_timeouts;
+	unsigned int backoff;
+};
+
+static inline void sdo_rtt_init(struct sdo_rtt* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+static inline void sdo_rtt_add_sample(struct sdo_rtt* self, uint64_t rtt)
+{
+	if (self->n_samples++ == 0) {
+		self->srtt = rtt;
+		self->rttvar = rtt / 2;
+	} else {
+		uint64_t delta = self->srtt > rtt ? self->srtt - rtt
+						  : rtt - self->srtt;
+		self->rttvar = (3 * self->rttvar + delta) / 4;
+		self->srtt = (7 * self->srtt + rtt) / 8;
+	}
+
+	self->backoff = 0;
+}
+
+static inline void sdo_rtt_on_timeout(struct sdo_rtt* self)
+{
+	self->n_timeouts++;
+
+	if (self->backoff < SDO_RTT_MAX_BACKOFF)
+		self->backoff++;
+}
+
+/* Returns a timeout in ms between min and max. It is max until something has
+ * been measured.
+ */
+static inline unsigned int sdo_rtt_get_timeout(const struct sdo_rtt* self,
+					       unsigned int min,
+					       unsigned int max)
+{
+	if (self->n_samples == 0)
+		return max;
+
+	uint64_t margin = 4 * self->rttvar;
+	if (margin < SDO_RTT_GRANULARITY)
+		margin = SDO_RTT_GRANULARITY;
+
+	uint64_t timeout = (self->srtt + margin) << self->backoff;
+	timeout = (timeout + 999) / 1000;
+
+	if (timeout < min)
+		return min;
+
+	return timeout < max ? timeout : max;
+}
+
+#endif /* _CANOPEN_SDO_RTT_H */
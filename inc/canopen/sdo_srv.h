@@ -27,7 +27,12 @@ struct can_frame;
 enum sdo_srv_comm_state {
 	SDO_SRV_COMM_INIT_REQ = 0,
 	SDO_SRV_COMM_DL_SEG_REQ,
-	SDO_SRV_COMM_UL_SEG_REQ
+	SDO_SRV_COMM_UL_SEG_REQ,
+	SDO_SRV_COMM_BLK_DL_SEG_REQ,
+	SDO_SRV_COMM_BLK_DL_END_REQ,
+	SDO_SRV_COMM_BLK_UL_START_REQ,
+	SDO_SRV_COMM_BLK_UL_ACK_REQ,
+	SDO_SRV_COMM_BLK_UL_END_REQ,
 };
 
 typedef int (*sdo_srv_fn)(struct sdo_srv* srv);
@@ -45,6 +50,13 @@ struct sdo_srv {
 	int is_toggled;
 	enum sdo_req_status status;
 	enum sdo_abort_code abort_code;
+
+	/* Block transfer state */
+	int is_crc_used;
+	int block_size;
+	int seqno;
+	int is_last_segment_sent;
+	size_t block_pos;
 };
 
 int sdo_srv_init(struct sdo_srv* self, const struct sock* sock, int nodeid,
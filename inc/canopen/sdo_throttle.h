@@ -0,0 +1,83 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_SDO_THROTTLE_H
+#define _CANOPEN_SDO_THROTTLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Paces background SDO transfers on a bus so that they do not push the bus
+ * load past a ceiling and delay the PDOs. Other transfers are never held
+ * back, but they do count towards the load.
+ *
+ * Transfers are admitted from a bucket of bit times that fills at the rate
+ * that the bus has to spare below the ceiling, as measured by a bl_meter. The
+ * bucket may go into debt for a large transfer, and nothing more is admitted
+ * until it has been paid off. A queue that is turned away is notified when it
+ * is worth asking again.
+ *
+ * Background transfers may also be held back altogether, as while the CAN
+ * controller is recovering from errors. That works with any ceiling.
+ *
+ * Everything but the meter and the counts is only touched from the main loop.
+ */
+
+#define SDO_THROTTLE_MAX_WAITING 128
+
+struct bl_meter;
+struct mloop_idle;
+struct mloop_timer;
+
+struct sdo_throttle {
+	struct bl_meter* meter;
+
+	/* Per mille of the bit rate */
+	unsigned int ceiling;
+
+	/* In bit times */
+	int64_t tokens;
+	int64_t depth;
+	uint64_t last_time;
+
+	struct mloop_timer* timer;
+	struct mloop_idle* waiting[SDO_THROTTLE_MAX_WAITING];
+	size_t n_waiting;
+
+	int is_held;
+
+	uint64_t n_admitted;
+	uint64_t n_deferred;
+};
+
+/* A ceiling of 0 admits everything */
+int sdo_throttle_init(struct sdo_throttle* self, struct bl_meter* meter,
+		      unsigned int ceiling);
+void sdo_throttle_destroy(struct sdo_throttle* self);
+
+/* Returns 0 and takes n_bits from the bucket if a transfer of about that many
+ * bit times may start now. Otherwise, returns -1 and notifies waiter later.
+ * now is monotonic time in us.
+ */
+int sdo_throttle_admit(struct sdo_throttle* self, uint64_t now,
+		       unsigned int n_bits, struct mloop_idle* waiter);
+
+/* While held, nothing is admitted. The waiters are notified on release. */
+void sdo_throttle_hold(struct sdo_throttle* self, int is_held);
+
+/* Forget a waiter that is going away */
+void sdo_throttle_cancel(struct sdo_throttle* self, struct mloop_idle* waiter);
+
+#endif /* _CANOPEN_SDO_THROTTLE_H */
@@ -0,0 +1,114 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_SYNC_CYCLE_H
+#define _CANOPEN_SYNC_CYCLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define SYNC_CYCLE_N_NODES 128
+#define SYNC_CYCLE_DATA_SIZE 8
+
+struct sync_cycle_pdo {
+	/* Time of arrival in microseconds since the epoch */
+	uint64_t timestamp;
+	uint8_t size;
+	uint8_t data[SYNC_CYCLE_DATA_SIZE];
+};
+
+/* The synchronous TPDOs that were received between two SYNCs. Bit n - 1 of
+ * the masks stands for TPDO n. Index 0 is unused.
+ */
+struct sync_cycle_snapshot {
+	/* SYNCs sent before the one that ended the cycle */
+	uint64_t sync_count;
+
+	/* Monotonic time in us of the SYNCs at either end */
+	uint64_t start;
+	uint64_t end;
+
+	uint8_t expected[SYNC_CYCLE_N_NODES];
+	uint8_t received[SYNC_CYCLE_N_NODES];
+
+	/* Bit i % 64 of word i / 64 is set if node i missed a TPDO */
+	uint64_t missing_nodes[SYNC_CYCLE_N_NODES / 64];
+	unsigned int n_missing;
+
+	struct sync_cycle_pdo pdo[SYNC_CYCLE_N_NODES][4];
+};
+
+/* Collects the TPDOs that nodes send on SYNC, on whichever thread receives
+ * them, into one snapshot per cycle. The cycle is ended on the thread that
+ * sends SYNC, and the last complete snapshot can then be copied out from any
+ * thread while the next one is being filled.
+ */
+struct sync_cycle {
+	pthread_mutex_t lock;
+
+	struct sync_cycle_snapshot buffer[2];
+	int back;
+
+	/* Set by drivers, and read without the lock by the receiving thread */
+	uint8_t expected[SYNC_CYCLE_N_NODES];
+
+	uint64_t n_cycles;
+	uint64_t n_incomplete;
+};
+
+int sync_cycle_init(struct sync_cycle* self);
+void sync_cycle_destroy(struct sync_cycle* self);
+
+/* Only the TPDOs in mask are collected for the node, and they are counted as
+ * missing if they do not arrive within a cycle
+ */
+void sync_cycle_set_expected(struct sync_cycle* self, int nodeid,
+			     unsigned int mask);
+
+static inline int sync_cycle_is_expected(const struct sync_cycle* self,
+					 int nodeid, int n)
+{
+	return __atomic_load_n(&self->expected[nodeid], __ATOMIC_RELAXED)
+	       & (1 << (n - 1));
+}
+
+/* n is 1 to 4. Data beyond SYNC_CYCLE_DATA_SIZE is left out. A TPDO that
+ * comes more than once in a cycle replaces the earlier one.
+ */
+void sync_cycle_add(struct sync_cycle* self, int nodeid, int n,
+		    const void* data, size_t size, uint64_t timestamp);
+
+/* Called right after each SYNC. sync_count is the number of SYNCs that were
+ * sent before this one and now is its time. Returns the number of nodes that
+ * TPDOs were expected from.
+ */
+int sync_cycle_end(struct sync_cycle* self, uint64_t sync_count, uint64_t now);
+
+/* Copies the last complete cycle. Returns -1 if no cycle has ended yet. */
+int sync_cycle_read(struct sync_cycle* self, struct sync_cycle_snapshot* dst);
+
+/* The number of cycles that have ended, and of those that missed TPDOs */
+void sync_cycle_get_counts(struct sync_cycle* self, uint64_t* n_cycles,
+			   uint64_t* n_incomplete);
+
+static inline int sync_cycle_is_node_missing(
+		const struct sync_cycle_snapshot* snapshot, int nodeid)
+{
+	return !!(snapshot->missing_nodes[nodeid / 64]
+		  & (1ULL << (nodeid % 64)));
+}
+
+#endif /* _CANOPEN_SYNC_CYCLE_H */
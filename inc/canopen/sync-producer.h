@@ -0,0 +1,88 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _CANOPEN_SYNC_PRODUCER_H
+#define _CANOPEN_SYNC_PRODUCER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/can.h>
+
+struct sock;
+
+#define SYNC_HISTOGRAM_LENGTH 16
+
+/* Lateness of SYNC frames relative to their deadlines, in microseconds.
+ * Bucket 0 counts frames that were on time, bucket i counts lateness in
+ * [2^(i-1), 2^i) and the last bucket counts everything beyond that.
+ */
+struct sync_stats {
+	uint64_t n_cycles;
+	uint64_t n_skipped;
+	uint64_t max_lateness;
+	uint64_t histogram[SYNC_HISTOGRAM_LENGTH];
+};
+
+/* Called on the producer thread right after each SYNC frame */
+typedef void (*sync_producer_fn)(void* context);
+
+/* Sends SYNC from its own thread. Each cycle sleeps until an absolute
+ * deadline, so delays do not accumulate. If a whole period is missed, the
+ * missed cycles are skipped instead of being sent in a burst.
+ */
+struct sync_producer {
+	struct sock* sock;
+	uint64_t period;
+	unsigned int counter_overflow;
+	unsigned int counter;
+
+	sync_producer_fn fn;
+	void* context;
+
+	int is_running;
+	pthread_t thread;
+
+	pthread_mutex_t stats_lock;
+	struct sync_stats stats;
+};
+
+/* The period is in microseconds */
+int sync_producer_init(struct sync_producer* self, struct sock* sock,
+		       uint64_t period);
+void sync_producer_destroy(struct sync_producer* self);
+
+/* Set the synchronous counter overflow value (0x1019). Values above 1 make
+ * each SYNC carry a counter that runs from 1 up to and including it.
+ */
+void sync_producer_set_counter_overflow(struct sync_producer* self,
+					unsigned int value);
+void sync_producer_set_callback(struct sync_producer* self,
+				sync_producer_fn fn, void* context);
+
+/* The thread is scheduled as set for RT_THREAD_SYNC */
+int sync_producer_start(struct sync_producer* self);
+void sync_producer_stop(struct sync_producer* self);
+
+void sync_producer_get_stats(struct sync_producer* self,
+			     struct sync_stats* stats);
+
+void sync_producer_make_frame(struct sync_producer* self,
+			      struct can_frame* cf);
+
+unsigned int sync_stats_bucket(uint64_t lateness);
+void sync_stats_add(struct sync_stats* self, uint64_t lateness,
+		    uint64_t n_skipped);
+
+#endif /* _CANOPEN_SYNC_PRODUCER_H */
@@ -17,9 +17,20 @@
 #define CANOPEN_INFO_H_
 
 #include <stdint.h>
-#include <assert.h>
 
+#define CANOPEN_INFO_N_NODES 127
+
+/* One entry per node id, followed by a canopen_info_state, in shared memory.
+ *
+ * Each entry has a sequence number that is odd while the master is changing
+ * the entry and goes up by two with each change, so a reader that sees the
+ * same even number before and after copying an entry got all of it. The
+ * generation goes up by one with each change to any entry, and readers may
+ * sleep on it until it does; they then only need to copy the entries whose
+ * sequence numbers have moved.
+ */
 struct canopen_info {
+	uint32_t sequence;
 	uint32_t is_active;
 	uint32_t device_type;
 	uint32_t last_seen;
@@ -28,17 +39,51 @@ struct canopen_info {
 	char name[64];
 	char hw_version[64];
 	char sw_version[64];
+
+	/* Copied from the node's statistics on each heartbeat */
+	uint32_t rx_frames;
+	uint32_t rx_pdos;
+	uint32_t sdo_transfers;
+	uint32_t sdo_aborts;
+	uint32_t sdo_timeouts;
+	uint32_t sdo_latency_avg_us;
+	uint32_t heartbeat_jitter_max_us;
+};
+
+struct canopen_info_state {
+	uint32_t generation;
+	uint32_t n_waiters;
 };
 
 extern struct canopen_info* canopen_info_;
 
-static inline struct canopen_info* canopen_info_get(int nodeid)
+static inline struct canopen_info_state*
+canopen_info_get_state(struct canopen_info* nodes)
 {
-	assert(1 <= nodeid && nodeid <= 127);
-	return &canopen_info_[nodeid - 1];
+	return (struct canopen_info_state*)&nodes[CANOPEN_INFO_N_NODES];
 }
 
+/* Entries are changed between canopen_info_begin_update() and
+ * canopen_info_end_update(), from any thread of the master.
+ */
+struct canopen_info* canopen_info_begin_update(int nodeid);
+void canopen_info_end_update(struct canopen_info* info);
+
 int canopen_info_init(const char* iface);
 void canopen_info_cleanup(void);
 
+/* For readers, on their own mapping of the memory. Copies the entry into dst
+ * and returns 0, or returns -1 with errno set to EAGAIN if it kept changing
+ * while it was copied.
+ */
+int canopen_info_read(const struct canopen_info* info,
+		      struct canopen_info* dst);
+
+/* Waits until the generation is not the given one any more, or for at most
+ * timeout ms if timeout is not negative. Returns the current generation,
+ * which is still the given one if the wait timed out or was interrupted.
+ */
+uint32_t canopen_info_wait(struct canopen_info_state* state,
+			   uint32_t generation, int timeout);
+
 #endif /* CANOPEN_INFO_H_ */
@@ -20,30 +20,111 @@
 #include <stdint.h>
 #include <string.h>
 
+/* Where the master keeps what it has learned about the nodes by default. The
+ * build may put it somewhere else.
+ */
+#ifndef STATE_PATH
+#define STATE_PATH "/var/marel/canmaster"
+#endif
+
 #define CFG__PARAMETERS \
 	X(string, iface, "") \
+	X(string, main_sched, "fifo:25" /* policy[:priority][@cpus] */) \
 	X(uint, n_workers, 4) \
+	X(string, worker_sched, "" /* the same; "": as created */) \
+	X(uint, max_workers, 0 /* more while jobs wait; 0: n_workers */) \
+	X(uint, worker_grow_wait, 1000 /* us a job waits before one is added */) \
+	X(uint, worker_idle_timeout, 10000 /* ms before an added one exits */) \
 	X(uint, worker_stack_size, 0) \
 	X(uint, job_queue_length, 256) \
 	X(uint, sdo_queue_length, 1024) \
+	X(bool, lock_memory, 0 /* mlockall() and prefault stacks at startup */) \
+	X(uint, stack_prefault, 256 /* KiB of each thread's stack, with lock_memory */) \
+	X(uint, sdo_req_reserve, 0 /* SDO requests allocated at startup */) \
+	X(uint, mloop_reserve, 0 /* loop objects of each type allocated at startup */) \
+	X(uint, bitrate, 0 /* bit/s, for the bus load; 0: it is not measured */) \
+	/* Measuring the load turns the CAN socket filters off, so that frames \
+	 * that no driver takes, and those of other masters, are counted too */ \
+	X(uint, sdo_load_ceiling, 0 /* %; background SDOs wait above it */) \
+	X(uint, can_error_hold, 500 /* ms background SDOs wait after a CAN error */) \
+	X(uint, can_restart_delay, 0 /* ms after bus-off; 0: left to restart-ms */) \
 	X(uint, rest_port, 9191) \
+	X(uint, gateway_port, 0 /* CiA 309-3 ASCII gateway; 0: none */) \
 	X(bool, be_strict, 0) \
 	X(bool, use_tcp, 0) \
+	X(bool, compact_tcp, 0 /* ask the TCP service for compact frames */) \
+	X(bool, enable_can_fd, 0) \
+	X(bool, can_tx_classes, 0 /* SYNC, PDOs and SDOs on sockets of their own */) \
+	X(uint, pdo_thread_priority, 0) \
+	X(string, pdo_sched, "" /* fifo:pdo_thread_priority if empty */) \
+	X(uint, shm_ring_size, 0 /* frames shared with local tools; 0: none */) \
+	X(bool, process_image, 0 /* latest TPDOs shared with local tools */) \
 	X(uint, heartbeat_period, 0 /* ms */) \
 	X(uint, heartbeat_timeout, 0 /* ms */) \
 	X(uint, n_timeouts_max, 2) \
+	X(uint, heartbeat_scan_interval, 0 /* ms; 0: a timer for each node */) \
 	X(uint, range_start, 0) \
 	X(uint, range_stop, 0) \
+	X(string, expected_nodes, "" /* e.g. "1-12,20"; known nodes if empty */) \
+	X(uint, probe_timeout, 100 /* ms; quiet time that ends a probe */) \
+	X(uint, probe_timeout_min, 100 /* ms; lower it to adapt to the net */) \
+	X(bool, lss_commission, 0 /* give nodes without an id one from [lss] */) \
+	X(uint, lss_timeout, 10 /* ms; wait for each LSS answer */) \
+	X(bool, broadcast_start, 0 /* one NMT start for all nodes */) \
+	X(uint, start_group_size, 0 /* nodes started together; 0: all */) \
+	X(uint, start_group_delay, 10 /* ms between groups */) \
+	X(uint, emcy_window, 1000 /* ms; repeated EMCYs are coalesced */) \
+	X(uint, emcy_log_burst, 5 /* EMCYs logged per node...; 0: all */) \
+	X(uint, emcy_log_interval, 10000 /* ms; ...in this long */) \
 	X(uint, sync_interval, 0 /* us */) \
+	X(uint, sync_window, 0 /* us */) \
+	X(uint, sync_counter_overflow, 0) \
+	X(uint, sync_thread_priority, 0) \
+	X(string, sync_sched, "" /* fifo:sync_thread_priority if empty */) \
 	X(uint, trace_buffer_size, 0) \
 	X(string, trace_dump_path, "/var/log/canopen") \
+	X(string, trace_dump_format, "raw" /* or "pcapng", for Wireshark */) \
 	X(bool, enable_bootup_trace, 0) \
 	X(bool, enable_incident_trace, 0) \
+	X(bool, enable_mapped_trace, 0 /* trace buffers outlive crashes */) \
+	X(string, trace_map_path, "" /* for those; trace_dump_path if empty */) \
+	X(string, trace_filter, "" /* e.g. "-pdo tpdo1@5 rpdo/10" */) \
+	X(bool, enable_trace_recording, 0 /* to files in trace_dump_path */) \
+	X(string, recorder_sched, "") \
+	X(uint, trace_file_size, 64 /* MiB; recordings are rotated at this size */) \
+	X(uint, trace_file_age, 3600 /* s; ...or when they get this old */) \
+	X(uint, trace_max_files, 24 /* older recordings are removed */) \
+	X(uint, firmware_max_active, 4 /* concurrent program downloads */) \
+	X(uint, n_reactors, 1 /* event loops, counting the main loop */) \
+	X(uint, can_reactor, 0) \
+	X(uint, rest_reactor, 0) \
+	X(uint, rest_reactors, 1 /* connections are spread over these, from rest_reactor */) \
+	X(uint, trace_reactor, 0) \
+	X(uint, job_budget, 64 /* jobs of each kind between polls */) \
+	X(uint, job_budget_time, 1000 /* us; 0: no limit */) \
+	X(uint, mloop_profiling, 0 /* 1: time callbacks for GET /mloop */) \
+	X(uint, stall_threshold, 0 /* ms; longer callbacks are logged */) \
+	X(uint, event_trace_size, 0 /* events kept per thread for GET /timeline; 0: off */) \
+	X(bool, async_log, 1 /* log from a thread of its own */) \
+	X(string, log_sched, "") \
+	X(uint, log_ring_size, 1024 /* messages waiting to be logged */) \
+	X(uint, log_rate_limit, 0 /* per second from each place; 0: none */) \
+	X(bool, edf_scheduling, 0 /* jobs with deadlines first */) \
+	X(bool, lazy_eds, 0 /* read each EDS when a node needs it */) \
+	X(bool, preload_drivers, 1 /* of the nodes in state_path */) \
+	X(uint, driver_threads, 0 /* for driver callbacks; 0: receiving thread */) \
+	X(string, driver_sched, "") \
+	X(uint, driver_queue_length, 256 /* frames waiting for each of those */) \
+	X(uint, driver_budget, 1000 /* us; slower callbacks are logged; 0: off */) \
+	X(string, state_path, STATE_PATH /* node identities; "": none */) \
 
 #define CFG__NODE_PARAMETERS \
 	X(bool, has_zero_guard_status, 0) \
 	X(bool, ignore_sdo_multiplexer, 1) \
 	X(bool, send_full_sdo_frame, 0) \
+	X(uint, n_sdo_channels, 1 /* 0: as many as the EDS lists */) \
+	X(uint, sdo_timeout_min, 1000 /* ms; lower it to adapt to the node */) \
+	X(uint, sdo_timeout_max, 1000 /* ms */) \
 	X(uint, heartbeat_period, 10000 /* ms */) \
 	X(uint, heartbeat_timeout, 1000 /* ms */) \
 	X(uint, n_timeouts_max, 0) \
@@ -67,18 +148,27 @@
 #define CFG__STRTO_string(value) value
 #define CFG__STRTO_(type, ...) CFG__STRTO_ ## type(__VA_ARGS__)
 
+#define CFG__EQ_bool(a, b) ((a) == (b))
+#define CFG__EQ_uint(a, b) ((a) == (b))
+#define CFG__EQ_int(a, b) ((a) == (b))
+#define CFG__EQ_string(a, b) (strcmp(a, b) == 0)
+#define CFG__EQ_(type, ...) CFG__EQ_ ## type(__VA_ARGS__)
+
 struct cfg {
 #define X(type, name, default_) CFG__DEFINE_(type, name);
 	CFG__PARAMETERS
 #undef X
+};
 
-	struct {
+struct cfg_node {
 #define X(type, name, default_) CFG__DEFINE_(type, name);
-		CFG__NODE_PARAMETERS
+	CFG__NODE_PARAMETERS
 #undef X
-	} node[128];
 };
 
+struct co_master_node;
+struct lss_address;
+
 extern struct cfg cfg;
 
 void cfg_load_defaults(void);
@@ -87,8 +177,31 @@ void cfg_load_globals(void);
 int cfg_load_file(const char* path);
 void cfg_unload_file(void);
 
-void cfg_load_node(int id);
+/* Called for each global whose value in the file has changed. It returns
+ * non-zero to set the new value, and must not call into cfg.
+ */
+typedef int (*cfg_accept_fn)(const char* name, void* context);
+
+/* Reads the file that was loaded again. Only the globals that have changed in
+ * the file are considered, so that those given on the command line are kept
+ * otherwise. Nodes pick up the new file with cfg_load_node().
+ */
+int cfg_reload_file(cfg_accept_fn accept, void* context);
+
+void cfg_load_node(struct co_master_node* node);
+
+const char* cfg__file_read(const struct co_master_node* node, const char* key);
+
+/* The node id that the [lss] section gives a node that has none, or -1. The
+ * last matching key wins.
+ */
+int cfg_get_lss_nodeid(const struct lss_address* address);
+
+/* Called for each key of a section, in the order of the file. It must not
+ * call into cfg.
+ */
+typedef void (*cfg_key_fn)(const char* key, const char* value, void* context);
 
-const char* cfg__file_read(int nodeid, const char* key);
+void cfg_for_each_key(const char* section, cfg_key_fn fn, void* context);
 
 #endif /* CFG_H_ */
@@ -40,6 +40,23 @@
 #define co_atomic_add_fetch(ptr, value) \
 	__atomic_add_fetch(ptr, value, __ATOMIC_SEQ_CST)
 
+#define co_atomic_exchange(ptr, value) \
+	__atomic_exchange_n(ptr, value, __ATOMIC_SEQ_CST)
+
+#define co_atomic_load_acquire(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+
+#define co_atomic_store_release(ptr, value) \
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE)
+
+/* For counters that are only read for statistics */
+#define co_atomic_load_relaxed(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
+#define co_atomic_store_relaxed(ptr, value) \
+	__atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+
+#define co_atomic_add_relaxed(ptr, value) \
+	__atomic_add_fetch(ptr, value, __ATOMIC_RELAXED)
+
 #else
 
 #define co_atomic_cas(ptr, expected, desired) \
@@ -63,6 +80,20 @@
 #define co_atomic_sub_fetch(ptr, value) __sync_sub_and_fetch(ptr, value)
 #define co_atomic_add_fetch(ptr, value) __sync_add_and_fetch(ptr, value)
 
+/* __sync_lock_test_and_set() is only an acquire barrier */
+#define co_atomic_exchange(ptr, value) \
+({ \
+	__sync_synchronize(); \
+	__sync_lock_test_and_set(ptr, value); \
+})
+
+#define co_atomic_load_acquire(ptr) co_atomic_load(ptr)
+#define co_atomic_store_release(ptr, value) co_atomic_store(ptr, value)
+
+#define co_atomic_load_relaxed(ptr) co_atomic_load(ptr)
+#define co_atomic_store_relaxed(ptr, value) co_atomic_store(ptr, value)
+#define co_atomic_add_relaxed(ptr, value) co_atomic_add_fetch(ptr, value)
+
 #endif /* HAVE_NEW_ATOMICS */
 
 #undef HAVE_NEW_ATOMICS
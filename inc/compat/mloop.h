@@ -18,6 +18,7 @@
 
 #include <stdint.h>
 #include <signal.h>
+#include <sched.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,6 +40,15 @@ enum mloop_socket_event {
 	MLOOP_SOCKET_EVENT_ALL = 0xff
 };
 
+/* Backends that mloop_new_with_flags() may use to wait for events. If both are
+ * given, io_uring is tried first.
+ */
+enum mloop_flags {
+	MLOOP_F_DEFAULT = 0,
+	MLOOP_F_EPOLL = 1 << 0,
+	MLOOP_F_IO_URING = 1 << 1,
+};
+
 struct mloop;
 struct mloop_timer;
 struct mloop_socket;
@@ -55,13 +65,26 @@ typedef void (*mloop_signal_fn)(struct mloop_signal*, int);
 typedef void (*mloop_idle_fn)(struct mloop_idle*);
 typedef int (*mloop_idle_cond_fn)(struct mloop_idle*);
 typedef void (*mloop_free_fn)(void*);
+typedef void (*mloop_prepare_fn)(void*);
 
 extern int mloop_errno;
 
 /* Create a new mloop to be run in a thread
+ *
+ * This uses epoll, unless the library is built with MLOOP_USE_IO_URING, in
+ * which case io_uring is used where the kernel allows it.
  */
 struct mloop* mloop_new(void);
 
+/* Create a new mloop with the given backends. NULL is returned if none of
+ * them can be set up, e.g. with ENOSYS if io_uring is not supported.
+ */
+struct mloop* mloop_new_with_flags(int flags);
+
+/* Get the backend that the mloop is using
+ */
+int mloop_get_flags(const struct mloop* self);
+
 /* Create a new mloop object scope into the mloop provided as argument
  *
  * This is used for resource management in C++. This is not very useful for
@@ -77,16 +100,58 @@ struct mloop* mloop_default(void);
  */
 void mloop_set_job_queue_size(size_t qsize);
 
+/* Set how many freed objects of each type are kept for reuse. 0 turns the
+ * caches off, which may be of use when looking for memory errors. The default
+ * is 64.
+ */
+void mloop_set_object_cache_size(size_t size);
+
+/* Allocate objects of each type until n of them are cached, so that a loop
+ * that never has more than that many at once does not allocate any. The
+ * caches are made at least that large.
+ */
+int mloop_reserve_objects(size_t n);
+
 /* Set the stack size of new threads in the global thread pool
  */
 void mloop_set_worker_stack_size(size_t stack_size);
 
+/* Set how new threads in the global thread pool are scheduled. A policy of -1
+ * keeps that of the thread that starts them, and cpus may be NULL to let them
+ * run anywhere. For SCHED_OTHER and SCHED_BATCH, priority is the nice value.
+ * Where the policy is not permitted, workers keep that of their creator.
+ */
+void mloop_set_worker_sched(int policy, int priority, const cpu_set_t* cpus);
+
 /* Start worker threads if they have not already been started
  *
  * The thread pool is cleaned up when no mloop object exists anymore.
  */
 int mloop_require_workers(int nthreads);
 
+/* Let the thread pool grow beyond what is required, up to nthreads, when a job
+ * has waited longer than grow_wait_us to be taken or when more jobs are
+ * waiting than there are workers. The workers that were added exit once they
+ * have had nothing to do for idle_timeout ms. By default the pool does not
+ * grow.
+ */
+void mloop_set_max_workers(int nthreads);
+void mloop_set_worker_scaling(uint64_t grow_wait_us, int idle_timeout);
+
+struct mloop_worker_stats {
+	uint64_t n_workers;
+	uint64_t max_workers;
+	uint64_t n_started;
+	uint64_t n_retired;
+
+	/* Time from starting work to a worker taking it */
+	uint64_t n_jobs;
+	uint64_t total_wait_ns;
+	uint64_t max_wait_ns;
+};
+
+void mloop_get_worker_stats(struct mloop_worker_stats* stats);
+
 /* Clean up mloop.
  *
  */
@@ -112,6 +177,154 @@ int mloop_run(struct mloop* self);
  */
 int mloop_run_once(struct mloop* self);
 
+/* Returns 1 if the calling thread is running the mloop, i.e. if it is inside
+ * mloop_run() or mloop_run_once() of it, or 0 otherwise. Work that would be
+ * handed to the loop may then be done right away instead.
+ */
+int mloop_is_current(const struct mloop* self);
+
+/* Run an mloop created by mloop_new() in a thread of its own, i.e. as an
+ * additional reactor next to the default loop. The thread is bound to the given
+ * CPU unless it is negative. All signals are blocked in the thread.
+ *
+ * Objects belonging to the loop are then serviced by that thread. Use
+ * mloop_post() to hand work over to it from other threads.
+ */
+int mloop_start_thread(struct mloop* self, int cpu);
+
+/* Make the thread of the loop leave mloop_run() and wait for it to finish.
+ */
+void mloop_stop_thread(struct mloop* self);
+
+/* Run fn once in the given loop. This may be called from any thread.
+ *
+ * The function gets an async object whose context is the one given here. The
+ * free_fn is called on the context once the function has run. If -1 is
+ * returned, the context has not been taken over.
+ */
+int mloop_post(struct mloop* target, mloop_async_fn fn, void* context,
+	       mloop_free_fn free_fn);
+
+/* Limit the work that is done between two polls for events. Up to n_jobs
+ * async jobs, n_jobs notified idle jobs and n_jobs polled idle jobs are run
+ * per iteration, but no more than time_us is spent on them. Each kind still
+ * gets at least one job per iteration. A time_us of 0 removes the time limit.
+ *
+ * The default is 64 jobs and 1000 us.
+ */
+void mloop_set_job_budget(struct mloop* self, size_t n_jobs, uint64_t time_us);
+
+/* How often the loop has gone round, and how often it left jobs for the next
+ * round because the job count or the time budget was used up. Also, how many
+ * jobs had deadlines, how many of those missed them, and by how much at most.
+ */
+struct mloop_stats {
+	uint64_t n_iterations;
+	uint64_t n_job_budget_hits;
+	uint64_t n_time_budget_hits;
+	uint64_t n_deadline_jobs;
+	uint64_t n_deadline_misses;
+	uint64_t max_lateness_ns;
+};
+
+void mloop_get_stats(const struct mloop* self, struct mloop_stats* stats);
+
+/* Async jobs are run by priority by default. With earliest deadline first,
+ * jobs that have a deadline are run before those that have none, the earliest
+ * deadline first, and the others by priority.
+ */
+enum mloop_scheduling {
+	MLOOP_SCHED_PRIORITY = 0,
+	MLOOP_SCHED_EDF,
+};
+
+void mloop_set_scheduling(struct mloop* self, enum mloop_scheduling mode);
+
+/* Profiling of the time that callbacks take, which is off by default. Times
+ * are kept in histograms where bucket i counts times below 2^i us, and the
+ * last bucket everything longer.
+ */
+#define MLOOP_PROF_N_BUCKETS 20
+#define MLOOP_PROF_MAX_SITES 64
+
+enum mloop_prof_type {
+	MLOOP_PROF_SOCKET = 0,
+	MLOOP_PROF_TIMER,
+	MLOOP_PROF_ASYNC,
+	MLOOP_PROF_WORK,
+	MLOOP_PROF_SIGNAL,
+	MLOOP_PROF_IDLE,
+	MLOOP_PROF_N_TYPES
+};
+
+struct mloop_histogram {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[MLOOP_PROF_N_BUCKETS];
+};
+
+/* A callback function, told apart by its address */
+struct mloop_prof_site {
+	const void* fn;
+	enum mloop_prof_type type;
+	struct mloop_histogram time;
+};
+
+struct mloop_prof_depth {
+	size_t current;
+	size_t max;
+};
+
+/* Objects are allocated from caches that all loops share */
+struct mloop_alloc_stats {
+	uint64_t n_allocated;
+	uint64_t n_reused; /* Taken from the cache */
+	size_t n_cached;
+};
+
+struct mloop_prof {
+	struct mloop_histogram time[MLOOP_PROF_N_TYPES];
+	/* From the return of the poll to each socket callback */
+	struct mloop_histogram dispatch_lag;
+	/* From the expiry of each timer to its callback */
+	struct mloop_histogram timer_lag;
+	/* Sampled once per iteration */
+	struct mloop_prof_depth async_jobs;
+	struct mloop_prof_depth worker_jobs;
+	struct mloop_prof_depth idle_jobs;
+	uint64_t n_stalls;
+	struct mloop_prof_site last_stall; /* time holds only that stall */
+	size_t n_sites;
+	uint64_t n_untracked; /* Calls of sites that did not fit */
+	struct mloop_prof_site sites[MLOOP_PROF_MAX_SITES];
+	struct mloop_alloc_stats allocs[MLOOP_PROF_N_TYPES];
+};
+
+/* Turn profiling on or off. Turning it on clears what has been recorded. Each
+ * callback that takes longer than stall_threshold_us is logged with LOG_WARNING;
+ * 0 turns that off.
+ */
+void mloop_set_profiling(struct mloop* self, int enable,
+			 uint64_t stall_threshold_us);
+
+/* Returns -1 if profiling is off. This may be called from any thread. */
+int mloop_get_profile(const struct mloop* self, struct mloop_prof* prof);
+
+const char* mloop_prof_type_name(enum mloop_prof_type type);
+
+/* Write the symbol of a callback, or the object file and offset within it if
+ * the symbol is not exported, to buf.
+ */
+void mloop_prof_describe(const void* fn, char* buf, size_t size);
+
+/* Set a function that is called every time before the main loop goes to
+ * sleep waiting for events. Only one such function can be set per main loop.
+ * Pass NULL to remove it.
+ */
+void mloop_set_prepare_fn(struct mloop* self, mloop_prepare_fn fn,
+			  void* context);
+
 /* Iterate once through a running main loop.
  */
 void mloop_iterate(struct mloop* self);
@@ -175,7 +388,10 @@ void mloop_timer_set_type(struct mloop_timer* timer,
  */
 enum mloop_timer_type mloop_timer_get_type(const struct mloop_timer* timer);
 
-/* Set the period/timeout/abolute time.
+/* Set the period/timeout/abolute time in nanoseconds.
+ *
+ * Timers have a resolution of one millisecond. They are rounded up to it, so
+ * they never fire early.
  */
 void mloop_timer_set_time(struct mloop_timer* timer, uint64_t time);
 
@@ -268,7 +484,8 @@ mloop_socket_get_event(const struct mloop_socket* socket);
  * MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI
  *
  * This can be set to any combination of IN, PRI and OUT but you will always
- * receive events for ERR and HUP.
+ * receive events for ERR and HUP. If the socket has been started, the change
+ * takes effect immediately.
  */
 void mloop_socket_set_event(struct mloop_socket* socket,
 			    enum mloop_socket_event event);
@@ -335,6 +552,12 @@ void* mloop_async_get_context(const struct mloop_async* async);
 void mloop_async_set_priority(struct mloop_async* async,
 			      unsigned long priority);
 
+/* Set the time by which the job should have run, in nanoseconds on
+ * CLOCK_MONOTONIC. Zero means that there is no deadline, which is the default.
+ * Jobs that run late are counted in the stats of the loop.
+ */
+void mloop_async_set_deadline(struct mloop_async* async, uint64_t deadline);
+
 /* Check if the async has been started.
  */
 int mloop_async_is_started(const struct mloop_async* async);
@@ -404,6 +627,11 @@ void* mloop_work_get_context(const struct mloop_work* work);
  */
 void mloop_work_set_priority(struct mloop_work* work, unsigned long priority);
 
+/* Set the time by which the job should be done, including the done_fn, in
+ * nanoseconds on CLOCK_MONOTONIC. Zero means that there is no deadline.
+ */
+void mloop_work_set_deadline(struct mloop_work* work, uint64_t deadline);
+
 /* Check if the work has been started.
  */
 int mloop_work_is_started(const struct mloop_work* work);
@@ -490,6 +718,12 @@ int mloop_idle_start(struct mloop_idle* idle);
  */
 int mloop_idle_stop(struct mloop_idle* idle);
 
+/* Have the idle function run once in the next main loop iteration. This may
+ * be called from any thread. Notifying a job more than once before it runs
+ * has the same effect as notifying it once.
+ */
+int mloop_idle_notify(struct mloop_idle* idle);
+
 /* Set the context pointer. Can point to whatever you want.
  *
  * If you specify a free_fn, it will be called with the context pointer as an
@@ -503,7 +737,10 @@ void mloop_idle_set_context(struct mloop_idle* idle, void* context,
 void mloop_idle_set_idle_fn(struct mloop_idle* idle, mloop_idle_fn fn);
 
 /* Set the condition function. The idle function is only run if the condition
- * function returns true.
+ * function returns true. The condition is checked on every main loop
+ * iteration, so jobs that can use mloop_idle_notify() should leave it unset.
+ * An idle job that has no condition function when it is started is only run
+ * when notified.
  */
 void mloop_idle_set_cond_fn(struct mloop_idle* idle, mloop_idle_cond_fn fn);
 
@@ -19,21 +19,41 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <pthread.h>
 
+/* Elements are taken by priority, and in the order in which they were inserted
+ * within a priority. In the EDF mode, elements that have a deadline are taken
+ * before those that have none, earliest deadline first. A deadline of 0 means
+ * that there is none.
+ *
+ * The heap is 4-ary, and on 64-bit targets it is laid out so that the children
+ * of a node fill two whole cache lines.
+ */
+#define PRIOQ_ARITY 4
+#define PRIOQ_ALIGNMENT 64
+
+enum prioq_mode {
+	PRIOQ_PRIORITY = 0,
+	PRIOQ_EDF,
+};
+
 struct prioq_elem {
 	unsigned long priority;
 	unsigned long sequence_;
+	uint64_t deadline;
 	void* data;
 };
 
 struct prioq {
 	size_t size;
+	enum prioq_mode mode;
 	unsigned long sequence;
 	unsigned long index;
 	pthread_mutex_t mutex;
 	pthread_cond_t suspend_cond;
 	struct prioq_elem* head;
+	struct prioq_elem* base_; /* Allocated, a little ahead of head */
 };
 
 int prioq_init(struct prioq* self, size_t size);
@@ -47,30 +67,33 @@ int prioq_move(struct prioq* dst, struct prioq* src);
 
 int prioq_grow(struct prioq* self, size_t size);
 
+/* Changing the mode re-orders the elements that are already queued */
+void prioq_set_mode(struct prioq* self, enum prioq_mode mode);
+
 int prioq_insert(struct prioq* self, unsigned long priority, void* data);
+int prioq_insert_deadline(struct prioq* self, unsigned long priority,
+			  uint64_t deadline, void* data);
 
-int prioq_pop(struct prioq* self, struct prioq_elem* elem, int timeout);
+/* Insert n elements under one lock. Their sequence numbers are ignored. */
+int prioq_insert_many(struct prioq* self, const struct prioq_elem* elems,
+		      size_t n);
 
-static inline unsigned long prioq__parent(unsigned long index)
-{
-	return (index - 1) >> 1;
-}
+int prioq_pop(struct prioq* self, struct prioq_elem* elem, int timeout);
 
-static inline unsigned long prioq__lchild(unsigned long index)
-{
-	return (index << 1) + 1;
-}
+/* Take up to n elements under one lock, waiting for at least one as
+ * prioq_pop() does. Returns the number of elements taken.
+ */
+int prioq_pop_many(struct prioq* self, struct prioq_elem* elems, size_t n,
+		   int timeout);
 
-static inline unsigned long prioq__rchild(unsigned long index)
+static inline unsigned long prioq__parent(unsigned long index)
 {
-	return (index << 1) + 2;
+	return (index - 1) / PRIOQ_ARITY;
 }
 
-static inline void prioq__swap(struct prioq_elem* a, struct prioq_elem* b)
+static inline unsigned long prioq__first_child(unsigned long index)
 {
-	struct prioq_elem tmp = *a;
-	*a = *b;
-	*b = tmp;
+	return index * PRIOQ_ARITY + 1;
 }
 
 static inline void prioq__lock(struct prioq* self)
@@ -85,7 +108,9 @@ static inline void prioq__unlock(struct prioq* self)
 
 int prioq__is_seq_lt(unsigned long a, unsigned long b);
 
-unsigned long prioq__get_smaller_child(struct prioq* self, unsigned long index);
+unsigned long prioq__get_smallest_child(struct prioq* self,
+					unsigned long index,
+					const struct prioq_elem* elem);
 void prioq__bubble_up(struct prioq* self, unsigned long index);
 void prioq__sink_down(struct prioq* self, unsigned long index);
 
@@ -0,0 +1,85 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stdlib.h>
+
+/* A bare io_uring instance on top of the raw system calls, so that there is
+ * no need for liburing. HAVE_URING is only defined if the kernel headers are
+ * recent enough to have multishot polls; uring_init() fails with ENOSYS
+ * otherwise.
+ *
+ * None of this is thread safe. Getting and pushing entries must be serialised
+ * by the caller, and so must reaping completions. Entering the ring may be done
+ * from any thread once the entries have been pushed.
+ */
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#if defined(IORING_POLL_ADD_MULTI) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+	void* sq_ring;
+	size_t sq_ring_size;
+	void* cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	unsigned int* sq_head;
+	unsigned int* sq_tail;
+	unsigned int* sq_mask;
+	unsigned int* sq_array;
+	unsigned int sq_local_tail;
+	unsigned int* cq_head;
+	unsigned int* cq_tail;
+	unsigned int* cq_mask;
+	struct io_uring_cqe* cqes;
+};
+
+int uring_init(struct uring* self, unsigned int entries);
+void uring_destroy(struct uring* self);
+
+/* Get a zeroed submission entry, or NULL if the queue is full. The entry is
+ * not seen by the kernel until it is pushed.
+ */
+struct io_uring_sqe* uring_get_sqe(struct uring* self);
+void uring_push_sqe(struct uring* self);
+
+/* Submit to_submit pushed entries and wait for min_complete completions.
+ * Returns the number of entries that were submitted.
+ */
+int uring_enter(struct uring* self, unsigned int to_submit,
+		unsigned int min_complete);
+
+/* Copy the oldest completion into cqe and remove it from the queue. Returns -1
+ * if there is none.
+ */
+int uring_pop_cqe(struct uring* self, struct io_uring_cqe* cqe);
+
+#endif /* URING_H_ */
@@ -0,0 +1,90 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef WORKQ_H_
+#define WORKQ_H_
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+/* A job queue for a pool of worker threads. Each worker has a deque of its own
+ * for every priority band, with a lock of its own, and sleeps on a semaphore
+ * of its own. Jobs are handed out to the workers in turn. A worker that runs
+ * out of jobs steals them from the others, so the only state that all of them
+ * share is a few atomic counters.
+ *
+ * Jobs are taken in the order of their bands, and within a band in the order
+ * in which they were pushed to a deque. Priorities 0 to WORKQ_N_BANDS - 2 get
+ * bands of their own, and anything above shares the last one.
+ */
+
+#define WORKQ_N_BANDS 4
+#define WORKQ_MAX_WORKERS 32
+
+struct workq_deque {
+	pthread_mutex_t mutex;
+	void** data;
+	size_t mask;
+	size_t head, tail;
+};
+
+struct workq_worker {
+	struct workq_deque band[WORKQ_N_BANDS];
+	sem_t sem;
+	int is_sleeping;
+} __attribute__((aligned(64)));
+
+struct workq {
+	struct workq_worker* worker;
+	size_t n_workers;
+
+	/* The most workers there have been. Jobs may be left behind on the
+	 * deques of workers that have gone, so those are searched as well.
+	 */
+	size_t n_slots;
+
+	size_t next;
+	int is_stopping;
+};
+
+/* size is the initial length of the deques; they grow as needed */
+int workq_init(struct workq* self, size_t size);
+void workq_destroy(struct workq* self);
+
+/* Set how many workers take jobs from the queue, up to WORKQ_MAX_WORKERS.
+ * When there are fewer than before, the workers that go must be the last ones
+ * and must not be waiting in workq_pop() any more.
+ */
+void workq_set_n_workers(struct workq* self, size_t n);
+
+int workq_push(struct workq* self, unsigned long priority, void* data);
+
+/* Take a job for the given worker, waiting for one if there is none. Returns
+ * NULL once workq_stop() has been called.
+ */
+void* workq_pop(struct workq* self, size_t worker);
+
+/* Like workq_pop(), but gives up after timeout ms without a job. errno is then
+ * ETIMEDOUT.
+ */
+void* workq_timed_pop(struct workq* self, size_t worker, int timeout);
+
+void workq_stop(struct workq* self);
+
+/* The number of jobs that are waiting, as seen without taking any locks */
+size_t workq_get_length(const struct workq* self);
+
+#endif /* WORKQ_H_ */
@@ -16,7 +16,9 @@
 #ifndef CONVERSIONS_H_
 #define CONVERSIONS_H_
 
+#include <stdio.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include "canopen/types.h"
 
 struct canopen_data {
@@ -28,6 +30,15 @@ struct canopen_data {
 };
 
 char* canopen_data_tostring(char* dst, size_t size, struct canopen_data* src);
+
+/* Like canopen_data_tostring() but straight to output, without going through
+ * a buffer of the caller's. Unless quote is '\0', it is written before and
+ * after the value. Returns the number of bytes written, or -1 if the data
+ * could not be converted, in which case nothing is written.
+ */
+ssize_t canopen_data_write(FILE* output, const struct canopen_data* src,
+			   char quote);
+
 int canopen_data_fromstring(struct canopen_data* dst,
 			    enum canopen_type expected_type, const char* str);
 
@@ -0,0 +1,86 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef DRIVER_EXEC_H_
+#define DRIVER_EXEC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <linux/can.h>
+
+/* An executor runs driver callbacks on a thread of its own, so that a driver
+ * that takes its time holds up only the nodes that share its executor, and
+ * not the thread that receives the frames.
+ *
+ * Frames are posted to a bounded lock-free ring, from any number of threads.
+ * Posting never blocks: when the ring is full, the frame is dropped. The
+ * callbacks are run in the order that the frames were posted.
+ */
+
+typedef void (*drv_exec_fn)(void* context, const struct can_frame* cf,
+			    uint64_t timestamp);
+
+/* A slot may be written when its seq equals the position that was claimed
+ * for it, and run when it is one past that.
+ */
+struct drv_exec_event {
+	size_t seq;
+	drv_exec_fn fn;
+	void* context;
+	uint64_t timestamp;
+	struct canfd_frame frame;
+};
+
+struct drv_exec {
+	struct drv_exec_event* events;
+	size_t mask;
+
+	/* Claimed by the posters */
+	size_t head __attribute__((aligned(64)));
+
+	/* Owned by the thread of the executor */
+	size_t tail __attribute__((aligned(64)));
+
+	sem_t has_events;
+	pthread_t thread;
+	int is_stopping;
+
+	/* For drv_exec_flush() */
+	pthread_mutex_t mutex;
+	pthread_cond_t has_progressed;
+	int n_flushing;
+};
+
+/* The number of events is rounded up to a power of two */
+int drv_exec_init(struct drv_exec* self, size_t n_events, const char* name);
+
+/* Runs what has been posted before returning */
+void drv_exec_destroy(struct drv_exec* self);
+
+/* The frame is copied, and may be an FD frame. Returns -1 if the ring is
+ * full.
+ */
+int drv_exec_post(struct drv_exec* self, drv_exec_fn fn, void* context,
+		  const struct can_frame* cf, uint64_t timestamp);
+
+/* Wait until everything that was posted before the call has been run. This
+ * must not be called from a callback of the same executor.
+ */
+void drv_exec_flush(struct drv_exec* self);
+
+#endif /* DRIVER_EXEC_H_ */
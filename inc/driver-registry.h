@@ -0,0 +1,63 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef DRIVER_REGISTRY_H_
+#define DRIVER_REGISTRY_H_
+
+#include <stddef.h>
+
+struct co_drv;
+
+/* The driver DSOs in the driver directory, indexed once by name and opened
+ * once no matter how many nodes use them. Any thread may use the registry.
+ */
+
+struct drv_dso {
+	char name[64];
+	char path[256];
+
+	void* handle;
+	int (*init_fn)(struct co_drv*);
+	unsigned int ref;
+
+	/* Set when opening it failed, so that it is not tried again */
+	int is_broken;
+};
+
+/* Indexes the co_drv_<name>.so files in the directory. The registry indexes
+ * DRIVER_PATH on first use unless this has been called.
+ */
+int drv_registry_scan(const char* path);
+
+/* The name is not case sensitive. Returns NULL if there is no such driver or
+ * it could not be opened.
+ */
+struct drv_dso* drv_registry_open(const char* name);
+void drv_registry_close(struct drv_dso* dso);
+
+/* Opens the driver and keeps it open until drv_registry_cleanup(). Returns -1
+ * if there is no such driver or it could not be opened.
+ */
+int drv_registry_preload(const char* name);
+
+size_t drv_registry_get_n_open(void);
+
+/* Lets go of what was preloaded. The index is kept for the life of the
+ * process, since nodes may still be using the drivers in it.
+ */
+void drv_registry_cleanup(void);
+
+#endif /* DRIVER_REGISTRY_H_ */
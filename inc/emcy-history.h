@@ -0,0 +1,87 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _EMCY_HISTORY_H
+#define _EMCY_HISTORY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+struct co_emcy;
+
+#define EMCY_HISTORY_LENGTH 16
+
+/* An EMCY and the repetitions of it that were coalesced into it */
+struct emcy_record {
+	uint16_t code;
+	uint8_t reg;
+	uint64_t manufacturer_error;
+
+	/* Monotonic time in us */
+	uint64_t first_seen;
+	uint64_t last_seen;
+
+	uint32_t count;
+};
+
+struct emcy_history_params {
+	/* In us. An EMCY with the same code and register as one that was
+	 * seen less than this long ago is coalesced into it.
+	 */
+	uint64_t window;
+
+	/* At most log_burst EMCYs are logged per log_interval us, or all of
+	 * them if log_burst is 0
+	 */
+	uint64_t log_interval;
+	unsigned int log_burst;
+};
+
+/* The recent EMCYs of one node, oldest first from ring[head % LENGTH] once
+ * the ring has filled up. Everything here belongs to the main loop.
+ */
+struct emcy_history {
+	struct emcy_record ring[EMCY_HISTORY_LENGTH];
+	unsigned int head;
+
+	uint64_t n_received;
+	uint64_t n_suppressed;
+
+	uint64_t log_window_start;
+	unsigned int n_logged;
+
+	/* Suppressed since the last EMCY that was logged */
+	unsigned int n_unreported;
+};
+
+/* Records the EMCY and returns 1 if it should be logged. Repetitions within
+ * the window and EMCYs beyond the logging rate are counted as suppressed.
+ */
+int emcy_history_add(struct emcy_history* self, const struct co_emcy* emcy,
+		     uint64_t now, const struct emcy_history_params* params);
+
+/* Returns how many EMCYs were suppressed since this was last called */
+unsigned int emcy_history_take_unreported(struct emcy_history* self);
+
+size_t emcy_history_length(const struct emcy_history* self);
+
+/* index 0 is the oldest */
+const struct emcy_record*
+emcy_history_get(const struct emcy_history* self, size_t index);
+
+void emcy_history_write_json(FILE* output, const struct emcy_history* self,
+			     uint64_t now);
+
+#endif /* _EMCY_HISTORY_H */
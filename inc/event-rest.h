@@ -0,0 +1,101 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef EVENT_REST_H_
+#define EVENT_REST_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "canopen.h"
+#include "vector.h"
+
+struct rest_client;
+struct mloop_timer;
+struct co_master_node;
+struct co_emcy;
+struct pdo_map;
+
+/* GET /events?kinds=state,emcy,pdo&iface=<iface>&nodes=<id>,...&interval=<ms>
+ * keeps the connection open and sends server-sent events as things happen on
+ * the buses. All query parameters are optional.
+ *
+ * Only the latest state of each node and the latest value of each TPDO are
+ * kept, and each client is sent what changed at most once per interval. EMCYs
+ * are kept in a ring of EVENT_REST_EMCY_MAX, and clients that fall further
+ * behind than that miss the oldest ones. A client that does not take what it
+ * is sent is not written to until it does, and is dropped when
+ * EVENT_REST_PENDING_MAX bytes are waiting for it.
+ */
+#define EVENT_REST_EMCY_MAX 64
+#define EVENT_REST_PENDING_MAX 65536
+
+/* In ms */
+#define EVENT_REST_INTERVAL_DEFAULT 100
+#define EVENT_REST_INTERVAL_MIN 10
+#define EVENT_REST_KEEPALIVE 15000
+
+enum event_rest_kind {
+	EVENT_REST_STATE = 1 << 0,
+	EVENT_REST_EMCY = 1 << 1,
+	EVENT_REST_PDO = 1 << 2,
+	EVENT_REST_POLL = 1 << 3,
+};
+
+struct event_rest_subscriber {
+	struct event_rest_subscriber* next;
+	struct rest_client* client;
+	struct mloop_timer* timer;
+
+	int kinds;
+	int bus;
+	char nodes[CANOPEN_NODEID_MAX + 1];
+
+	uint32_t gen;
+	uint32_t emcy_seq;
+	uint32_t poll_gen;
+
+	/* In ms */
+	unsigned int interval;
+	unsigned int idle_time;
+
+	struct vector pending;
+};
+
+/* The publish functions may be called from any thread. They do nothing unless
+ * some client wants that kind of event.
+ */
+void event_rest_publish_state(const struct co_master_node* node,
+			      const char* state);
+void event_rest_publish_emcy(const struct co_master_node* node,
+			     const struct co_emcy* emcy);
+void event_rest_publish_pdo(const struct co_master_node* node, int n,
+			    const struct pdo_map* map, const void* data,
+			    size_t size);
+
+void event_rest_service(struct rest_client* client, const void* content);
+void event_rest_cleanup(void);
+
+/* These only add the subscriber to the list and take it out again */
+void event_rest__subscribe(struct event_rest_subscriber* sub);
+void event_rest__unlink(struct event_rest_subscriber* sub);
+
+/* Write the events that the subscriber has not seen. Returns the number of
+ * events written.
+ */
+int event_rest__format(FILE* output, struct event_rest_subscriber* sub);
+
+#endif /* EVENT_REST_H_ */
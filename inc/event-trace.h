@@ -0,0 +1,173 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef EVENT_TRACE_H_
+#define EVENT_TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "co_atomic.h"
+#include "time-utils.h"
+
+/* A timeline of what the master does, cheap enough to leave on. Each thread
+ * records into a ring of its own, so recording takes no locks and makes no
+ * system calls beyond reading the monotonic clock. When a ring is full, the
+ * oldest records are overwritten.
+ *
+ * The timeline is written in the Chrome trace event format, which can be
+ * opened in Perfetto or chrome://tracing.
+ *
+ * Events are declared here. The last column says what the argument is.
+ */
+#define EVENT_TRACE_EVENTS(X) \
+	X(STARTUP,       "startup",       "boot",   NONE) \
+	X(LOAD_EDS,      "load-eds",      "boot",   NONE) \
+	X(INIT_REST,     "init-rest",     "boot",   NONE) \
+	X(OPEN_BUSES,    "open-buses",    "boot",   NONE) \
+	X(START_WORKERS, "start-workers", "boot",   NONE) \
+	X(BOOTUP,        "bootup",        "boot",   BUS) \
+	X(PROBE,         "probe",         "boot",   BUS) \
+	X(LOAD_DRIVERS,  "load-drivers",  "boot",   BUS) \
+	X(START_NODES,   "start-nodes",   "boot",   BUS) \
+	X(SDO_QUEUED,    "sdo-queued",    "sdo",    SDO) \
+	X(SDO_TRANSFER,  "sdo-transfer",  "sdo",    SDO) \
+	X(DRIVER_PDO,    "driver-pdo",    "driver", NODE) \
+	X(DRIVER_EMCY,   "driver-emcy",   "driver", NODE) \
+	X(DRIVER_START,  "driver-start",  "driver", NODE) \
+	X(MLOOP_SOCKET,  "socket",        "mloop",  FN) \
+	X(MLOOP_TIMER,   "timer",         "mloop",  FN) \
+	X(MLOOP_ASYNC,   "async",         "mloop",  FN) \
+	X(MLOOP_WORK,    "work",          "mloop",  FN) \
+	X(MLOOP_SIGNAL,  "signal",        "mloop",  FN) \
+	X(MLOOP_IDLE,    "idle",          "mloop",  FN)
+
+/* The mloop events are in the order of enum mloop_prof_type */
+enum event_trace_id {
+#define X(id, name, category, arg) EVENT_TRACE_ ## id,
+	EVENT_TRACE_EVENTS(X)
+#undef X
+	EVENT_TRACE_N_IDS
+};
+
+enum event_trace_phase {
+	EVENT_TRACE_BEGIN = 'B',
+	EVENT_TRACE_END = 'E',
+	EVENT_TRACE_COMPLETE = 'X',
+	EVENT_TRACE_INSTANT = 'i',
+	EVENT_TRACE_ASYNC_BEGIN = 'b',
+	EVENT_TRACE_ASYNC_END = 'e',
+};
+
+struct event_trace_record {
+	uint64_t time; /* ns, CLOCK_MONOTONIC */
+	uint64_t duration; /* ns, complete events only */
+	uint64_t key; /* pairs up async events */
+	uint32_t arg;
+	uint16_t id;
+	uint8_t phase;
+};
+
+extern int event_trace_is_enabled_;
+
+static inline int event_trace_is_enabled(void)
+{
+	return __builtin_expect(co_atomic_load_relaxed(&event_trace_is_enabled_),
+				0);
+}
+
+void event_trace__record(enum event_trace_id id, enum event_trace_phase phase,
+			 uint64_t time, uint64_t duration, uint64_t key,
+			 uint32_t arg);
+
+static inline void event_trace__emit(enum event_trace_id id,
+				     enum event_trace_phase phase,
+				     uint64_t key, uint32_t arg)
+{
+	if (event_trace_is_enabled())
+		event_trace__record(id, phase, gettime_ns(CLOCK_MONOTONIC), 0,
+				    key, arg);
+}
+
+/* Begin and end must be paired on the same thread */
+static inline void event_trace_begin(enum event_trace_id id, uint32_t arg)
+{
+	event_trace__emit(id, EVENT_TRACE_BEGIN, 0, arg);
+}
+
+static inline void event_trace_end(enum event_trace_id id, uint32_t arg)
+{
+	event_trace__emit(id, EVENT_TRACE_END, 0, arg);
+}
+
+static inline void event_trace_instant(enum event_trace_id id, uint32_t arg)
+{
+	event_trace__emit(id, EVENT_TRACE_INSTANT, 0, arg);
+}
+
+/* Async events may begin and end on different threads. They are matched by
+ * id and key, so the key must be unique among those of the same id that are
+ * in flight.
+ */
+static inline void event_trace_async_begin(enum event_trace_id id,
+					   uint64_t key, uint32_t arg)
+{
+	event_trace__emit(id, EVENT_TRACE_ASYNC_BEGIN, key, arg);
+}
+
+static inline void event_trace_async_end(enum event_trace_id id, uint64_t key,
+					 uint32_t arg)
+{
+	event_trace__emit(id, EVENT_TRACE_ASYNC_END, key, arg);
+}
+
+/* For spans that are timed anyway: one record instead of two. start is from
+ * gettime_ns(CLOCK_MONOTONIC).
+ */
+static inline void event_trace_complete(enum event_trace_id id,
+					uint64_t start, uint64_t key,
+					uint32_t arg)
+{
+	if (!event_trace_is_enabled())
+		return;
+
+	uint64_t now = gettime_ns(CLOCK_MONOTONIC);
+	event_trace__record(id, EVENT_TRACE_COMPLETE, start, now - start, key,
+			    arg);
+}
+
+static inline uint32_t event_trace_sdo_arg(int node, int index, int subindex)
+{
+	return (uint32_t)(node & 0xff) << 24 | (uint32_t)(index & 0xffff) << 8
+	     | (uint32_t)(subindex & 0xff);
+}
+
+#define EVENT_TRACE_DEFAULT_SIZE 65536
+
+/* size is the number of records kept per thread. It is rounded up to a
+ * power of two. Rings that already exist keep their size.
+ */
+int event_trace_enable(size_t size);
+void event_trace_disable(void);
+
+/* May be called while other threads record */
+int event_trace_write_json(FILE* stream);
+
+/* Frees the rings. No thread may be recording. */
+void event_trace_cleanup(void);
+
+#endif /* EVENT_TRACE_H_ */
@@ -0,0 +1,115 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FRAME_RING_H
+#define _FRAME_RING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/can.h>
+
+#include "co_atomic.h"
+
+/* A lock-free ring of timestamped CAN frames with exactly one producer thread
+ * and one consumer thread. Neither side ever blocks; when the ring is full,
+ * frames are dropped and counted.
+ */
+
+struct frame_ring_entry {
+	uint64_t timestamp;
+	struct can_frame cf;
+};
+
+struct frame_ring {
+	struct frame_ring_entry* data;
+	size_t mask;
+
+	/* Written by the producer only */
+	size_t head __attribute__((aligned(64)));
+	uint64_t n_dropped;
+
+	/* Written by the consumer only */
+	size_t tail __attribute__((aligned(64)));
+};
+
+/* The size is rounded up to a power of two */
+static inline int frame_ring_init(struct frame_ring* self, size_t size)
+{
+	memset(self, 0, sizeof(*self));
+
+	size_t length = 1;
+	while (length < size)
+		length <<= 1;
+
+	self->data = malloc(length * sizeof(*self->data));
+	if (!self->data)
+		return -1;
+
+	self->mask = length - 1;
+	return 0;
+}
+
+static inline void frame_ring_destroy(struct frame_ring* self)
+{
+	free(self->data);
+	self->data = NULL;
+}
+
+/* Returns -1 if the ring is full */
+static inline int frame_ring_push(struct frame_ring* self,
+				  const struct can_frame* cf,
+				  uint64_t timestamp)
+{
+	size_t head = self->head;
+
+	if (head - co_atomic_load_acquire(&self->tail) > self->mask) {
+		self->n_dropped++;
+		return -1;
+	}
+
+	struct frame_ring_entry* entry = &self->data[head & self->mask];
+	entry->timestamp = timestamp;
+	entry->cf = *cf;
+
+	co_atomic_store_release(&self->head, head + 1);
+	return 0;
+}
+
+/* Returns NULL if the ring is empty. The entry stays valid until
+ * frame_ring_consume() is called.
+ */
+static inline const struct frame_ring_entry*
+frame_ring_peek(const struct frame_ring* self)
+{
+	size_t tail = self->tail;
+
+	if (tail == co_atomic_load_acquire(&self->head))
+		return NULL;
+
+	return &self->data[tail & self->mask];
+}
+
+static inline void frame_ring_consume(struct frame_ring* self)
+{
+	co_atomic_store_release(&self->tail, self->tail + 1);
+}
+
+static inline uint64_t frame_ring_get_n_dropped(const struct frame_ring* self)
+{
+	return co_atomic_load(&self->n_dropped);
+}
+
+#endif /* _FRAME_RING_H */
@@ -0,0 +1,117 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canopen.h"
+#include "node-identity.h"
+
+/* Passing a running master over to a new process, so that the program can be
+ * upgraded without taking the buses down. The old process starts the new one
+ * with one end of a socket pair, whose descriptor is in HANDOFF_ENV, and sends
+ * it what it knows over the pair, along with the descriptors of its sockets
+ * and shared memory. The new process takes the buses up where they were left,
+ * without resetting, probing or starting any nodes.
+ *
+ * The old process keeps its end open until it has let go of everything, so
+ * the new one waits for it to close before opening anything that may be
+ * locked, such as a mapped trace buffer.
+ *
+ * What is sent is a handoff_header, followed by n_buses handoff_bus records
+ * and then the trace frames of each bus in turn, as struct tb_frame. The
+ * descriptors come with the header. Both ends are the same kind of program on
+ * the same machine, so the records are sent as they are in memory.
+ */
+#define HANDOFF_MAGIC "COHANDOF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_ENV "CANOPEN_HANDOFF_FD"
+
+/* Descriptors that fit into one message */
+#define HANDOFF_MAX_FDS 64
+
+struct handoff_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t n_buses;
+
+	/* Index of the listening REST socket among the descriptors, or -1 */
+	int32_t rest;
+	uint32_t n_fds;
+};
+
+struct handoff_node {
+	uint32_t is_seen;
+
+	/* The node had a driver and was started */
+	uint32_t is_started;
+	struct node_identity identity;
+};
+
+struct handoff_bus {
+	char iface[256];
+
+	/* Indices of the descriptors, or -1 where the new process opens its
+	 * own
+	 */
+	int32_t socket;
+	int32_t shm_ring;
+	int32_t process_image;
+
+	/* Frames of the trace buffer that follow, oldest first */
+	uint32_t n_trace_frames;
+
+	struct handoff_node node[CANOPEN_NODEID_MAX + 1];
+};
+
+void handoff_header_init(struct handoff_header* self, uint32_t n_buses,
+			 uint32_t n_fds);
+int handoff_header_is_valid(const struct handoff_header* self);
+
+/* Start the program again with the same arguments, by the path by which it
+ * was started, so that a binary that has been replaced on disk is the one
+ * that runs. Returns the end of the socket pair to send to, or -1.
+ */
+int handoff_spawn(void);
+
+/* The end of the socket pair that a process started by handoff_spawn() got,
+ * or -1 if it was started in any other way. The variable is cleared, so that
+ * programs that this one starts do not take it up.
+ */
+int handoff_get_inherited(void);
+
+/* Send size bytes and the n_fds descriptors, which go with the first byte. The
+ * descriptors stay open in the sender.
+ */
+int handoff_send(int sock, const void* data, size_t size, const int* fds,
+		 size_t n_fds);
+
+/* Receive exactly size bytes. The descriptors that come with them are put into
+ * fds, which has room for *n_fds, and *n_fds is set to how many there were;
+ * any that do not fit are closed. fds may be NULL if none are expected.
+ *
+ * Returns 0, or -1 on error, with errno set to EPIPE if the peer closed first.
+ */
+int handoff_recv(int sock, void* data, size_t size, int* fds, size_t* n_fds);
+
+/* Wait up to timeout ms for the peer to close, discarding anything else that
+ * it sends. Returns 0 when it has, or -1 on error or timeout.
+ */
+int handoff_wait_close(int sock, int timeout);
+
+#endif /* _HANDOFF_H */
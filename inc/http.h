@@ -25,6 +25,7 @@ enum http_method {
 	HTTP_GET = 1,
 	HTTP_PUT = 2,
 	HTTP_OPTIONS = 4,
+	HTTP_POST = 8,
 };
 
 struct http_url_query {
@@ -33,10 +34,13 @@ struct http_url_query {
 };
 
 struct http_req {
+	char* head;
 	enum http_method method;
 	size_t header_length;
 	size_t content_length;
 	char* content_type;
+	char* if_none_match;
+	int close_connection;
 	size_t url_index;
 	char* url[URL_INDEX_MAX];
 	size_t url_query_index;
@@ -17,23 +17,52 @@
 #define INI_PARSER_H_INCLUDED_
 
 #include <stdio.h>
-#include "vector.h"
+#include <stddef.h>
 
+struct ini_arena;
+
+/* Keys are lowercase and interned, so that each key name is stored once per
+ * file.
+ */
 struct ini_key_value {
+	const char* key;
 	char* value;
-	char key[0];
 };
 
 struct ini_section {
-	struct vector kv;
-	char section[0];
+	const char* section;
+	const struct ini_arena* arena;
+	struct ini_key_value* kv;
+	size_t n_kv;
 };
 
+/* Sections are kept in the order that they appear in. Where a section or a
+ * key appears more than once, lookups find the last one.
+ *
+ * All sections, keys and lookup tables live in one arena, and the strings
+ * point into the text of the file, which is tokenized in place.
+ */
 struct ini_file {
-	struct vector section;
+	struct ini_section* section;
+	size_t n_sections;
+
+	struct ini_arena* arena;
+
+	/* The text when it is owned by the file */
+	char* buffer;
+	size_t buffer_size;
+	int buffer_is_mapped;
 };
 
+/* These return 0 on success. A negative value is minus the number of the line
+ * that could not be parsed, or -1 if the file could not be read.
+ */
 int ini_parse(struct ini_file* file, FILE* stream);
+int ini_parse_file(struct ini_file* file, const char* path);
+
+/* The buffer is modified and must outlive the parsed file */
+int ini_parse_buffer(struct ini_file* file, char* buffer, size_t size);
+
 void ini_destroy(struct ini_file* file);
 
 const char* ini_find(const struct ini_file* file, const char* section,
@@ -45,19 +74,18 @@ const struct ini_section* ini_find_section(const struct ini_file* file,
 
 static inline size_t ini_get_length(const struct ini_file* ini)
 {
-	return ini->section.index / sizeof(void*);
+	return ini->n_sections;
 }
 
 static inline const struct ini_section*
 ini_get_section(const struct ini_file* ini, size_t index)
 {
-	struct ini_section** section = ini->section.data;
-	return section[index];
+	return &ini->section[index];
 }
 
 static inline size_t ini_get_section_length(const struct ini_section* section)
 {
-	return section->kv.index / sizeof(void*);
+	return section->n_kv;
 }
 
 #endif /* INI_PARSER_H_INCLUDED_ */
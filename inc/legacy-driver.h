@@ -21,9 +21,10 @@
 
 struct legacy_master_iface {
 	int nodeid;
-	int (*send_pdo)(int nodeid, int n, unsigned char* data, size_t size);
+	int (*send_pdo)(int nodeid, int n, const unsigned char* data,
+			size_t size);
 	int (*send_sdo)(int nodeid, int index, int subindex,
-			unsigned char* data, size_t size);
+			const unsigned char* data, size_t size);
 	int (*request_sdo)(int nodeid, int index, int subindex);
 	int (*set_node_state)(int nodeid, int state);
 };
@@ -48,10 +49,24 @@ int legacy_driver_iface_process_emr(void* iface, int code, int reg,
 				    uint64_t manufacturer_error);
 
 int legacy_driver_iface_process_sdo(void* obj, int index, int subindex,
-				    unsigned char* data, size_t size);
+				    const unsigned char* data, size_t size);
 
+/* Same layout as CanIOMapDriver::PdoFrame */
+struct legacy_pdo {
+	int n;
+	const unsigned char* data;
+	size_t size;
+	uint64_t timestamp;
+};
+
+/* These do not copy the data and they never throw */
 int legacy_driver_iface_process_pdo(void* obj, int n, const unsigned char* data,
-				    size_t size);
+				    size_t size, uint64_t timestamp);
+
+/* Returns the number of PDOs that were handled without errors */
+size_t legacy_driver_iface_process_pdos(void* obj,
+					const struct legacy_pdo* pdos,
+					size_t n);
 
 int legacy_driver_iface_process_node_state(void* obj, int state);
 
@@ -0,0 +1,94 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef MEM_TAG_H_
+#define MEM_TAG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Allocations that are made on behalf of a subsystem carry its tag, so that
+ * what a long-running master holds on to can be put down to its owner. Each
+ * tag keeps the bytes that are live, the most that ever were, and how many
+ * allocations and frees there have been.
+ *
+ * Sizes are what the allocator actually handed out, which for malloc() is
+ * malloc_usable_size(), so nothing is added to the allocations themselves.
+ * Memory must be freed with the tag that it was allocated with. Memory that
+ * leaves a vector, e.g. by taking its data, is freed with MEM_TAG_VECTOR.
+ */
+enum mem_tag {
+	MEM_TAG_OTHER = 0,
+	MEM_TAG_VECTOR,
+	MEM_TAG_SDO_REQ,
+	MEM_TAG_INI,
+	MEM_TAG_EDS,
+	MEM_TAG_MLOOP,
+	MEM_TAG_REST,
+	MEM_TAG_N
+};
+
+/* Memory of a tag can come from somewhere other than malloc(), such as a pool
+ * or an arena. size returns how much was allocated for ptr. realloc may be
+ * NULL, in which case it is done with alloc, memcpy and free.
+ */
+struct mem_allocator {
+	void* (*alloc)(void* context, size_t size);
+	void* (*realloc)(void* context, void* ptr, size_t size);
+	void (*free)(void* context, void* ptr);
+	size_t (*size)(void* context, const void* ptr);
+	void* context;
+};
+
+struct mem_tag_stats {
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	uint64_t n_allocs;
+	uint64_t n_frees;
+	uint64_t n_failures;
+	uint64_t total_bytes; /* Allocated over time */
+};
+
+void* mem_alloc(enum mem_tag tag, size_t size);
+void* mem_calloc(enum mem_tag tag, size_t n, size_t size);
+void* mem_realloc(enum mem_tag tag, void* ptr, size_t size);
+char* mem_strdup(enum mem_tag tag, const char* str);
+void mem_free(enum mem_tag tag, void* ptr);
+
+/* The allocator is copied. This is meant for start-up: it fails with EBUSY
+ * while anything that was allocated with the tag has not been freed, and it
+ * must not race with allocations of the tag. NULL goes back to malloc().
+ */
+int mem_tag_set_allocator(enum mem_tag tag, const struct mem_allocator* alloc);
+
+const char* mem_tag_name(enum mem_tag tag);
+void mem_tag_get_stats(struct mem_tag_stats* dst, enum mem_tag tag);
+
+/* Rates are worked out over windows of this long. A timer ends each one by
+ * calling mem_tag_sample(), so that they do not depend on who reads them or
+ * how often.
+ */
+#define MEM_TAG_RATE_WINDOW 1000 /* ms */
+
+/* now is monotonic time in us */
+void mem_tag_sample(uint64_t now);
+
+/* Write the stats of all tags as a JSON object keyed by tag name. The rates
+ * are per second over the last whole window, and 0 until there is one.
+ */
+int mem_tag_write_json(FILE* stream);
+
+#endif /* MEM_TAG_H_ */
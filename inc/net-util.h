@@ -39,6 +39,11 @@ ssize_t net_filtered_read_frame(int fd, struct can_frame* cf, int timeout,
 int net_dont_block(int fd);
 int net_fix_sndbuf(int fd);
 int net_reuse_addr(int fd);
+
+/* Let sockets of this process bind to the same port, so that the kernel
+ * spreads the connections over them
+ */
+int net_reuse_port(int fd);
 int net_dont_delay(int fd);
 
 #endif /* NET_UTIL_H_ */
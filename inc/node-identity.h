@@ -0,0 +1,106 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NODE_IDENTITY_H
+#define _NODE_IDENTITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canopen.h"
+
+/* What the master read from each node on a bus when it last loaded its
+ * driver. It is kept in a file so that the next start can take it after
+ * checking one entry of the identity object (0x1018) instead of reading it
+ * all again.
+ *
+ * The file is only read by the program that wrote it, so the records are
+ * stored as they are in memory.
+ */
+#define NODE_IDENTITY_MAGIC "COIDENT"
+#define NODE_IDENTITY_VERSION 2
+
+struct node_identity {
+	uint32_t is_known;
+	uint32_t device_type;
+	uint32_t vendor_id;
+	uint32_t product_code;
+	uint32_t revision_number;
+	uint32_t serial_number;
+	char name[64];
+	char hw_version[64];
+	char sw_version[64];
+};
+
+/* What was learned of the SDO server of a type of device while nodes of that
+ * type were booted, so that later boot-ups can start out with the settings
+ * that work instead of finding them out again.
+ */
+enum node_sdo_profile_flags {
+	/* Block transfers are refused */
+	NODE_SDO_NO_BLOCK = 1,
+
+	/* Every response came with the multiplexer of another object */
+	NODE_SDO_MUX_MISMATCH = 2,
+};
+
+#define NODE_IDENTITY_N_PROFILES 32
+
+struct node_sdo_profile {
+	uint32_t vendor_id;
+	uint32_t product_code;
+	uint32_t flags;
+
+	/* The number of SDO channels that the server answers on, or 0 if
+	 * none has failed yet
+	 */
+	uint32_t n_channels;
+
+	/* Round trip time in us, smoothed, and its variation */
+	uint32_t srtt;
+	uint32_t rttvar;
+};
+
+struct node_identity_cache {
+	struct node_identity node[CANOPEN_NODEID_MAX + 1];
+	struct node_sdo_profile profile[NODE_IDENTITY_N_PROFILES];
+	int is_dirty;
+};
+
+/* The file of an interface in a state directory */
+void node_identity_make_path(char* dst, size_t size, const char* dir,
+			     const char* iface);
+
+/* A missing or invalid file leaves all nodes unknown */
+int node_identity_cache_load(struct node_identity_cache* self,
+			     const char* path);
+
+/* The file is replaced whole, so that readers never see half of it */
+int node_identity_cache_save(struct node_identity_cache* self,
+			     const char* path);
+
+/* Returns NULL if nothing is known of the type */
+struct node_sdo_profile*
+node_identity_find_profile(struct node_identity_cache* self,
+			   uint32_t vendor_id, uint32_t product_code);
+
+/* Makes a profile for the type if there is none. Returns NULL if the vendor
+ * is 0 or if all NODE_IDENTITY_N_PROFILES are taken by other types.
+ */
+struct node_sdo_profile*
+node_identity_get_profile(struct node_identity_cache* self,
+			  uint32_t vendor_id, uint32_t product_code);
+
+#endif /* _NODE_IDENTITY_H */
@@ -0,0 +1,66 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NODE_INFO_H
+#define _NODE_INFO_H
+
+#include <stdint.h>
+
+struct canopen_eds;
+
+/* What the master knows of a node, for threads other than those that load
+ * and unload its driver. The master publishes a new copy whenever that
+ * changes, and readers copy out the latest one without taking a lock. Each
+ * copy is whole, so that e.g. the name and the identity always belong to
+ * the same device.
+ */
+struct node_info {
+	/* enum co_master_driver_type */
+	int driver_type;
+	int is_initialized;
+
+	uint32_t device_type;
+	uint32_t vendor_id;
+	uint32_t product_code;
+	uint32_t revision_number;
+	uint32_t serial_number;
+
+	/* Looked up when the driver is loaded */
+	const struct canopen_eds* eds;
+
+	char name[64];
+	char hw_version[64];
+	char sw_version[64];
+};
+
+/* The sequence number is odd while a copy is being published, and goes up by
+ * two with each one.
+ */
+struct node_info_slot {
+	uint64_t sequence;
+	struct node_info info;
+};
+
+/* Publishers on different threads take turns */
+void node_info_publish(struct node_info_slot* self,
+		       const struct node_info* info);
+
+/* Returns the sequence number of the copy, which is 0 if nothing has been
+ * published yet. dst is then all zeros.
+ */
+uint64_t node_info_read(const struct node_info_slot* self,
+			struct node_info* dst);
+
+#endif /* _NODE_INFO_H */
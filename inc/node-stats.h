@@ -0,0 +1,111 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _NODE_STATS_H
+#define _NODE_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "canopen.h"
+#include "canopen/sdo.h"
+#include "canopen/sdo_req_enums.h"
+
+struct can_frame;
+
+/* Bucket i counts times below 2^i us that did not fit in the one before, and
+ * the last bucket counts the rest.
+ */
+#define NODE_STATS_N_BUCKETS 24
+
+struct node_stats_histogram {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[NODE_STATS_N_BUCKETS];
+};
+
+/* What a node has sent, how its SDO transfers have gone, and how long its
+ * driver has taken to handle what it sent.
+ *
+ * The counts of frames have one writer: the thread that receives the frames
+ * of the bus, or the main loop for the SDO transfers. The driver is timed on
+ * whichever thread runs its callbacks. Fields are updated with relaxed
+ * atomics so that they can be read from anywhere, but a reader may see one
+ * field updated before another.
+ *
+ * Heartbeat jitter is how much each interval between heartbeats differs from
+ * the one before it.
+ */
+struct node_stats {
+	uint64_t n_frames;
+	uint64_t n_pdos;
+	uint64_t n_sdos;
+	uint64_t n_emcys;
+	uint64_t n_heartbeats;
+
+	uint64_t n_sdo_transfers;
+	uint64_t n_sdo_aborts;
+	uint64_t n_sdo_timeouts;
+
+	/* Driver callbacks that took longer than their budget, and frames
+	 * that the executor of the driver had no room for
+	 */
+	uint64_t n_driver_overruns;
+	uint64_t n_driver_drops;
+
+	struct node_stats_histogram sdo_latency;
+	struct node_stats_histogram heartbeat_jitter;
+	struct node_stats_histogram driver_time;
+
+	/* In us */
+	uint64_t last_heartbeat;
+	uint64_t last_heartbeat_interval;
+};
+
+/* stats is indexed by node id. Frames that are not from a node are ignored. */
+void node_stats_count_frame(struct node_stats* stats,
+			    const struct can_frame* cf, uint64_t timestamp);
+
+void node_stats_count_sdo(struct node_stats* self,
+			  enum sdo_req_status status,
+			  enum sdo_abort_code abort_code, uint64_t latency);
+
+/* These return the number of overruns or drops so far, or 0 if the call was
+ * within the budget. A budget of 0 is never overrun.
+ */
+uint64_t node_stats_count_driver_call(struct node_stats* self, uint64_t us,
+				      uint64_t budget);
+uint64_t node_stats_count_driver_drop(struct node_stats* self);
+
+void node_stats_histogram_add(struct node_stats_histogram* self,
+			      uint64_t us);
+
+/* Copies what is there at the moment, field by field */
+void node_stats_read(struct node_stats* dst, const struct node_stats* src);
+
+static inline int node_stats_is_empty(const struct node_stats* self)
+{
+	return self->n_frames == 0 && self->n_sdo_transfers == 0;
+}
+
+/* These write the nodes of one bus that have anything to show. stats is
+ * indexed by node id.
+ */
+void node_stats_write_json(FILE* output, const struct node_stats* stats);
+void node_stats_write_prometheus(FILE* output, const char* iface,
+				 const struct node_stats* stats);
+
+#endif /* _NODE_STATS_H */
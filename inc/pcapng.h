@@ -0,0 +1,47 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PCAPNG_H
+#define _PCAPNG_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct tb_frame;
+
+/* Traces in the pcapng format that Wireshark and tcpdump read, with frames
+ * in the SocketCAN link layer. There is one interface per file, and times are
+ * stored in us since the epoch, as they are in trace buffers.
+ */
+#define PCAPNG_LINKTYPE_CAN_SOCKETCAN 227
+#define PCAPNG_TSRESOL_US 6
+
+/* Frames are assembled this many at a time and handed to the stream in one
+ * write.
+ */
+#define PCAPNG_BATCH_SIZE 64
+
+/* Write the section header and the description of the interface, which is
+ * named iface if it is not NULL.
+ */
+int pcapng_write_header(FILE* stream, const char* iface);
+
+/* Frames with CANFD_FDF set are written as CAN FD frames. Returns the number
+ * of frames that were written, which is less than n on error.
+ */
+size_t pcapng_write_frames(FILE* stream, const struct tb_frame* frames,
+			   size_t n);
+
+#endif /* _PCAPNG_H */
@@ -0,0 +1,105 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _PROCESS_IMAGE_H
+#define _PROCESS_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The latest TPDO 1-4 of each node on a bus, in shared memory, written by the
+ * master and read by any number of other processes. Readers poll the slots
+ * they are interested in; neither side makes a system call to do so.
+ *
+ * Each slot has a sequence number that is odd while the slot is being
+ * written and goes up by two with each TPDO, so a reader that sees the same
+ * even number before and after copying the slot got all of it, and half the
+ * number is the count of TPDOs received.
+ */
+#define PROCESS_IMAGE_MAGIC 0x474d4950 /* "PIMG" */
+#define PROCESS_IMAGE_VERSION 1
+
+#define PROCESS_IMAGE_N_NODES 128
+#define PROCESS_IMAGE_N_PDOS 4
+#define PROCESS_IMAGE_DATA_SIZE 64
+
+struct process_image_slot {
+	uint64_t sequence;
+
+	/* Monotonic time in us at which the TPDO was received */
+	uint64_t timestamp;
+	uint32_t size;
+	uint8_t data[PROCESS_IMAGE_DATA_SIZE];
+} __attribute__((aligned(64)));
+
+struct process_image_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t n_nodes;
+	uint32_t n_pdos;
+};
+
+/* Indexed by node id and then by PDO number less one. Node 0 is unused. */
+struct process_image_map {
+	struct process_image_header header;
+	struct process_image_slot slot[PROCESS_IMAGE_N_NODES]
+				      [PROCESS_IMAGE_N_PDOS];
+};
+
+struct process_image {
+	struct process_image_map* map;
+	int is_owner;
+	char name[256];
+};
+
+struct process_image_value {
+	uint64_t sequence;
+	uint64_t timestamp;
+	size_t size;
+	uint8_t data[PROCESS_IMAGE_DATA_SIZE];
+};
+
+/* The name of the image that the master keeps for a CAN interface */
+void process_image_make_name(char* dst, size_t size, const char* iface);
+
+/* An image that is left over by the same name is replaced */
+int process_image_create(struct process_image* self, const char* name);
+int process_image_open(struct process_image* self, const char* name);
+
+/* Take over writing an image that another process created, from the
+ * descriptor of its shared memory, which is closed. What is in it is kept.
+ */
+int process_image_adopt(struct process_image* self, const char* name, int fd);
+
+/* The image is removed when its writer destroys it. Readers that still have
+ * it open keep their mapping, but it is not updated any more.
+ */
+void process_image_destroy(struct process_image* self);
+
+/* Only one thread may write at a time. n is 1 to 4. Data beyond
+ * PROCESS_IMAGE_DATA_SIZE is left out.
+ */
+void process_image_write(struct process_image* self, int nodeid, int n,
+			 const void* data, size_t size, uint64_t timestamp);
+
+/* Copies the latest TPDO n of the node into dst. Returns 0 if there was one,
+ * or -1 if the node has not sent it yet, if nodeid or n are out of range or,
+ * with errno set to EAGAIN, if the slot kept changing while it was copied.
+ */
+int process_image_read(const struct process_image* self, int nodeid, int n,
+		       struct process_image_value* dst);
+
+#endif /* _PROCESS_IMAGE_H */
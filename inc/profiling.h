@@ -16,11 +16,11 @@
 #ifndef PROFILING_H_
 #define PROFILING_H_
 
-#include <time-utils.h>
-#include <stdint.h>
+/* Set CANOPEN_PROFILE in the environment to record a timeline of boot-up and
+ * of what the master does after that; see event-trace.h.
+ */
 
 extern int profiling_is_active_;
-extern uint64_t profiling_start_time_;
 
 int profiling_getenv(void);
 
@@ -31,16 +31,4 @@ static inline int profiling_is_active(void)
 	return profiling_is_active_;
 }
 
-static inline void profiling_reset(void)
-{
-	profiling_start_time_ = gettime_us(CLOCK_MONOTONIC);
-}
-
-#define tprintf(fmt, ...) \
-	printf("%07llu\t" fmt, gettime_us(CLOCK_MONOTONIC) - profiling_start_time_, \
-		## __VA_ARGS__)
-
-#define profile(fmt, ...) \
-	if (profiling_is_active()) tprintf(fmt, ## __VA_ARGS__)
-
 #endif /* PROFILING_H_ */
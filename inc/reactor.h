@@ -0,0 +1,76 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include "mloop.h"
+
+/* A set of event loops, each with its own epoll fd, timers and idle jobs.
+ * Reactor 0 is the default loop, which is run by the main thread. The others
+ * run in threads of their own; reactor i is bound to CPU i, modulo the number
+ * of CPUs that are online.
+ *
+ * Kinds of objects are pinned to a reactor by their role. Every role is on
+ * reactor 0 until it is pinned elsewhere. Anything that touches the state of
+ * the default loop from another reactor must go through mloop_post().
+ */
+
+#define REACTOR_MAX 16
+
+enum reactor_role {
+	REACTOR_CAN = 0, /* Reception of CAN frames */
+	REACTOR_REST, /* Connections to the REST service */
+	REACTOR_TRACE, /* Dumping of trace buffers */
+	REACTOR_N_ROLES
+};
+
+/* Create n - 1 reactors in addition to the default loop. Objects may be added
+ * to them before their threads are started.
+ */
+int reactor_init(unsigned int n);
+
+/* Free the reactors and unpin all roles */
+void reactor_cleanup(void);
+
+/* Start and stop the threads of all reactors except the default loop */
+int reactor_run(void);
+void reactor_stop(void);
+
+unsigned int reactor_count(void);
+
+/* Returns -1 and sets errno to EINVAL if there is no such reactor */
+int reactor_pin(enum reactor_role role, unsigned int index);
+
+/* Spread a role over n reactors, starting at index. The first of them is the
+ * one that reactor_get() returns.
+ */
+int reactor_pin_range(enum reactor_role role, unsigned int index,
+		      unsigned int n);
+
+/* The number of reactors that a role is spread over */
+unsigned int reactor_span(enum reactor_role role);
+
+struct mloop* reactor_get(enum reactor_role role);
+
+/* The i-th reactor of a role, with i less than reactor_span() */
+struct mloop* reactor_get_nth(enum reactor_role role, unsigned int i);
+
+static inline int reactor_is_default(enum reactor_role role)
+{
+	return reactor_get(role) == mloop_default();
+}
+
+#endif /* _REACTOR_H */
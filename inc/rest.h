@@ -17,15 +17,22 @@
 #define CANOPEN_REST_H_
 
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include "http.h"
 #include "vector.h"
 
+#define REST_CHUNK_SIZE 4096
+#define REST_RESPONSE_HEAD_SIZE 512
+#define REST_RESPONSE_MAX_SEGMENTS 8
+
 struct rest_reply_data {
 	const char* status_code;
 	const char* content_type;
 	ssize_t content_length;
 	const void* content;
+	const char* etag;
 };
 
 enum rest_client_state {
@@ -36,39 +43,205 @@ enum rest_client_state {
 	REST_CLIENT_DONE
 };
 
+struct rest_client;
+struct mloop_async;
+struct mloop_socket;
+struct mloop_timer;
+struct mloop_idle;
+
+typedef void (*rest_fn)(struct rest_client* client, const void* content);
+typedef void (*rest_disconnect_fn)(struct rest_client* client, void* context);
+
+/* Connections are kept open between requests. Requests that the client sends
+ * while one is being serviced are kept in pipelined until it is done, and are
+ * then answered in order.
+ */
 struct rest_client {
 	int ref;
 	enum rest_client_state state;
 	struct vector buffer;
+	size_t head_scanned;
+	struct vector pipelined;
 	struct http_req req;
 	FILE* output;
+	int output_fd;
+
+	/* Replies are sent without blocking, and what the socket does not take
+	 * is kept in unsent until it becomes writable. Replies may be sent
+	 * from any thread, so this is under output_lock, and output_drained
+	 * is signalled when it has all gone out. socket is cleared under the
+	 * lock when the connection goes away.
+	 */
+	pthread_mutex_t output_lock;
+	pthread_cond_t output_drained;
+	struct vector unsent;
+
+	struct mloop_socket* socket;
+	struct mloop_timer* idle_timer;
+	struct mloop_idle* resume;
+	int is_handling;
+
+	/* Services always run on the default loop. When the connection is on
+	 * another reactor, each call is posted there and disconnect carries the
+	 * disconnection over.
+	 */
+	int is_threaded;
+	struct mloop_async* disconnect;
+	rest_fn service_fn;
+	const void* content;
+
+	/* See rest_client_set_disconnect_fn() */
+	rest_disconnect_fn disconnect_fn;
+	void* disconnect_context;
 };
 
-typedef void (*rest_fn)(struct rest_client* client, const void* content);
+enum rest_service_flags {
+	/* Runs on the reactor of the connection rather than on the default
+	 * loop
+	 */
+	REST_SERVICE_ON_REACTOR = 1,
+};
 
 struct rest_service {
 	SLIST_ENTRY(rest_service) links;
+
+	/* The next service in the same slot of the routing table */
+	struct rest_service* next_route;
+
 	enum http_method method;
 	const char* path;
 	rest_fn fn;
+	enum rest_service_flags flags;
+};
+
+/* A reply that is put together from segments and sent with one writev(). The
+ * head is formatted into a buffer of its own, but content segments refer to
+ * the caller's data, such as a cached body, which must stay valid until the
+ * response has been sent. Whatever the socket does not take at once is copied.
+ */
+struct rest_response {
+	char head[REST_RESPONSE_HEAD_SIZE];
+	size_t head_length;
+	int is_head_ended;
+	int is_truncated;
+
+	struct iovec segment[REST_RESPONSE_MAX_SEGMENTS];
+	int n_segments;
 };
 
 int rest_init(int port);
+
+/* Connections are accepted on each reactor of REACTOR_REST, from a listening
+ * socket of its own. The sockets share the port with SO_REUSEPORT, so the
+ * kernel spreads the connections over them.
+ */
+
+/* Serve on a socket that is already listening, such as one that was handed
+ * over by another process. It is closed on failure. The other reactors get
+ * sockets of their own on the same port if it allows that.
+ */
+int rest_init_fd(int lfd);
+
+/* The socket that the first reactor listens on, or -1 */
+int rest_get_listen_fd(void);
+
 void rest_cleanup();
 
 int rest_register_service(enum http_method method, const char* path,
 			  rest_fn fn);
+
+/* For services that touch nothing but thread-safe interfaces, such as the SDO
+ * request queues and counters that are read with atomics. They run on the
+ * reactor of the connection, so they do not hold up the default loop.
+ */
+int rest_register_reactor_service(enum http_method method, const char* path,
+				  rest_fn fn);
+
+/* Run fn for the client on the default loop, as a service that was
+ * registered with rest_register_service() is run
+ */
+void rest_client_call(struct rest_client* client, rest_fn fn,
+		      const void* content);
 void rest_reply(FILE* output, struct rest_reply_data* data);
 void rest_reply_header(FILE* output, struct rest_reply_data* data);
 
+/* The same as rest_reply(), but the head and content go out together and
+ * without blocking. It may be called from any thread.
+ */
+int rest_client_reply(struct rest_client* client,
+		      const struct rest_reply_data* data);
+
+/* Send a chunk of a reply whose header was sent with a content_length of -1,
+ * in the same way. An empty chunk ends the reply.
+ */
+int rest_client_send_chunk(struct rest_client* client, const void* data,
+			   size_t size);
+
+void rest_response_init(struct rest_response* self);
+
+/* Formats the head of the reply as the first segment. The content of data is
+ * left out; add it with rest_response_add().
+ */
+void rest_response_header(struct rest_response* self,
+			  const struct rest_reply_data* data);
+
+/* Formats another line into the head, before it is ended */
+void rest_response_add_header(struct rest_response* self, const char* fmt,
+			      ...) __attribute__((format(printf, 2, 3)));
+
+int rest_response_add(struct rest_response* self, const void* data,
+		      size_t size);
+
+/* Returns 0 once the response has been sent or queued behind what was sent
+ * before, or -1 if the client has gone away or the response did not fit.
+ */
+int rest_response_send(struct rest_response* self, struct rest_client* client);
+
+/* Returns a stream that sends what is written to it as the chunks of a reply
+ * whose header was sent with a content_length of -1. Up to REST_CHUNK_SIZE bytes
+ * are gathered into each chunk. Closing the stream ends the reply but leaves
+ * the output open.
+ */
+FILE* rest_open_chunked(FILE* output);
+
+/* Open another stream to the client for a service that writes its reply from a
+ * thread of its own. The stream stays valid after the client disconnects, and
+ * the service must close it. This must be called on the default loop.
+ *
+ * Unlike the client's own output, writes to it block until the client has
+ * taken what was queued before and the data itself.
+ */
+FILE* rest_client_open_output(struct rest_client* self);
+
 void rest_client_ref(struct rest_client* self);
 int rest_client_unref(struct rest_client* self);
 
+/* The function is called on the default loop when the client disconnects, so
+ * that a service can cancel the work that it still has going for the client.
+ * The state is REST_CLIENT_DISCONNECTED by then. It stays set for the rest of
+ * the connection. This must be called on the default loop.
+ */
+void rest_client_set_disconnect_fn(struct rest_client* self,
+				   rest_disconnect_fn fn, void* context);
+
+/* Services call this when they have sent the whole reply. It may be called
+ * from any thread.
+ */
+void rest_client_done(struct rest_client* self);
+
+/* Whether everything that was replied has gone out to the socket, for a
+ * service that writes to output_fd itself
+ */
+int rest_client_is_flushed(struct rest_client* self);
+
 int rest__service_is_match(const struct rest_service* service,
 			   const struct http_req* req);
 struct rest_service* rest__find_service(const struct http_req* req);
 void rest__init_service_list(void);
 
+int rest__init_output(struct rest_client* client, int fd);
+void rest__destroy_output(struct rest_client* client);
+
 int rest__open_server(int port);
 int rest__read(struct vector* buffer, int fd);
 
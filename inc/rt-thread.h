@@ -0,0 +1,88 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _RT_THREAD_H
+#define _RT_THREAD_H
+
+#include <pthread.h>
+#include <sched.h>
+
+/* What a thread is for decides how it is scheduled and on which CPUs it may
+ * run. The master sets this up for each role from its configuration before
+ * any of the threads are created.
+ */
+enum rt_thread_role {
+	RT_THREAD_MAIN = 0,
+	RT_THREAD_WORKER,
+	RT_THREAD_SYNC,
+	RT_THREAD_PDO,
+	RT_THREAD_RECORDER,
+	RT_THREAD_LOG,
+	RT_THREAD_DRIVER,
+	RT_THREAD_N_ROLES
+};
+
+struct rt_thread_sched {
+	/* -1 keeps the policy of the thread that creates it */
+	int policy;
+	int priority;
+
+	/* Any CPU if none are set */
+	cpu_set_t cpus;
+};
+
+/* Reads "policy[:priority][@cpus]", where policy is one of other, batch, idle,
+ * fifo or rr, and cpus is a list like "0,2-3". Either part may be left out;
+ * an empty string changes nothing. For other and batch, the priority is the
+ * nice value.
+ *
+ * Returns -1 if the string is not understood.
+ */
+int rt_thread_parse_sched(struct rt_thread_sched* dst, const char* str);
+
+void rt_thread_set_sched(enum rt_thread_role role,
+			 const struct rt_thread_sched* sched);
+const struct rt_thread_sched* rt_thread_get_sched(enum rt_thread_role role);
+
+/* Create a thread that is scheduled as set for its role. If the process is not
+ * permitted to use that policy, the thread is created with the policy of its
+ * creator instead, but still on the CPUs of the role, and a warning naming
+ * the thread is logged.
+ *
+ * Returns -1 and sets errno on failure.
+ */
+int rt_thread_create(pthread_t* thread, enum rt_thread_role role,
+		     void* (*fn)(void*), void* context, const char* name);
+
+/* Schedule the calling thread as set for the role. Failures are logged and
+ * returned as -1 with errno set.
+ */
+int rt_thread_apply(enum rt_thread_role role, const char* name);
+
+/* Keep the process from page faulting once it is running: memory that is
+ * freed is no longer given back to the system, all of it is locked with
+ * mlockall() and stack_size bytes of the stack of the calling thread are
+ * written to. Threads that are created afterwards with rt_thread_create() do
+ * the same with their own stacks.
+ *
+ * Locking needs CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK. If it fails, a
+ * warning is logged and -1 is returned, but the rest is still done.
+ */
+int rt_thread_lock_memory(size_t stack_size);
+
+/* Write to up to size bytes of the stack below the caller */
+void rt_thread_prefault_stack(size_t size);
+
+#endif /* _RT_THREAD_H */
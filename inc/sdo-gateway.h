@@ -0,0 +1,88 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SDO_GATEWAY_H_
+#define SDO_GATEWAY_H_
+
+#include <stdint.h>
+#include "canopen/types.h"
+
+/* A CiA 309-3 ASCII gateway on TCP. Each line that a client sends is a
+ * command like
+ *
+ *	[1] 5 r 0x1017 0 u16
+ *	[2] 1 5 w 0x1017 0 u16 1000
+ *	[3] 7 r 0x2000 0 vs
+ *
+ * i.e. an optional sequence number in brackets, an optional network (1 is
+ * the first bus) and node, and then the command. Commands are started as
+ * soon as they are read, without waiting for the replies to earlier ones, so
+ * commands to different nodes run at the same time. Each reply carries the
+ * sequence number of its command, and replies are sent in the order in which
+ * the commands finish:
+ *
+ *	[2] OK
+ *	[1] 1000
+ *	[3] ERROR: 0x06020000
+ *
+ * Besides r[ead] and w[rite], "set network <net>" and "set node <node>" set
+ * the defaults for commands that leave them out. The data types are b, i8 to
+ * i64, u8 to u64, r32, r64 and vs, which is quoted with double quotes, in
+ * which a double quote is written twice.
+ *
+ * The gateway runs on the main loop. Commands that are still pending when a
+ * client goes away are cancelled.
+ */
+
+/* The codes after "ERROR:" that are not SDO abort codes */
+enum sdo_gateway_error {
+	SDO_GATEWAY_E_UNSUPPORTED = 100,
+	SDO_GATEWAY_E_SYNTAX = 101,
+	SDO_GATEWAY_E_STATE = 102,
+	SDO_GATEWAY_E_NO_NODE = 105,
+	SDO_GATEWAY_E_NET = 106,
+	SDO_GATEWAY_E_NODE = 107,
+};
+
+enum sdo_gateway_command_type {
+	SDO_GATEWAY_READ = 1,
+	SDO_GATEWAY_WRITE,
+	SDO_GATEWAY_SET_NET,
+	SDO_GATEWAY_SET_NODE,
+};
+
+/* net and node are -1 if they were left out. For set commands, the one that
+ * is set holds the new default.
+ */
+struct sdo_gateway_command {
+	int has_sequence;
+	uint32_t sequence;
+	enum sdo_gateway_command_type type;
+	int net, node;
+	int index, subindex;
+	enum canopen_type datatype;
+	const char* value;
+};
+
+/* The line is changed in place, and value points into it. Returns 0 or an
+ * sdo_gateway_error. The sequence number is set whenever the line has one,
+ * even if the rest of it is wrong.
+ */
+int sdo_gateway_parse(struct sdo_gateway_command* dst, char* line);
+
+int sdo_gateway_init(int port);
+void sdo_gateway_cleanup(void);
+
+#endif /* SDO_GATEWAY_H_ */
@@ -0,0 +1,128 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SDO_POLL_H_
+#define SDO_POLL_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "canopen/types.h"
+#include "canopen/sdo_req_enums.h"
+
+struct rest_client;
+struct mloop_timer;
+
+/* Named groups of objects that the master reads with background SDOs every
+ * period, however many clients want them. Clients read the latest values from
+ * here, through GET /poll/<name> or as "poll" events from /events, so the bus
+ * carries each object once per period rather than once per client.
+ *
+ * Groups come from the [poll] section of the configuration file, one key per
+ * group:
+ *
+ *	[poll]
+ *	temperatures = 1000 5/0x6000/1 6/0x6000/1 can1#7/0x2001/0/integer16
+ *
+ * i.e. the period in ms and then the objects, each as
+ * [iface#]node/index/subindex[/type]. The first bus is used if the iface is
+ * left out, and the type is looked up in the EDS of the node if it is. Clients
+ * make or replace a group with PUT /poll/<name>?period=<ms> and the objects
+ * in the body, and remove it with an empty body.
+ *
+ * Everything here runs on the main loop.
+ */
+#define SDO_POLL_NAME_MAX 64
+#define SDO_POLL_OBJECTS_MAX 256
+#define SDO_POLL_PERIOD_MIN 100 /* ms */
+
+/* Longer values are cut short */
+#define SDO_POLL_VALUE_MAX 64
+
+struct sdo_poll_group;
+
+struct sdo_poll_object {
+	struct sdo_poll_group* group;
+	int bus, nodeid, index, subindex;
+	enum canopen_type type;
+	int is_pending;
+
+	/* Of the last read */
+	enum sdo_req_status status;
+	uint32_t abort_code;
+
+	/* Of the last read that succeeded, in ms since the epoch; 0 if none
+	 * has yet
+	 */
+	uint64_t timestamp;
+
+	/* The generation at which the value or the status last changed */
+	uint32_t gen;
+
+	size_t size;
+	int is_size_unknown;
+	uint8_t data[SDO_POLL_VALUE_MAX];
+};
+
+struct sdo_poll_group {
+	struct sdo_poll_group* next;
+	int ref;
+	int is_removed;
+	char name[SDO_POLL_NAME_MAX];
+	unsigned int period; /* ms */
+	struct mloop_timer* timer;
+	size_t n_objects;
+	struct sdo_poll_object object[];
+};
+
+/* Objects are separated by white space or commas. Returns NULL with errno set
+ * to EINVAL if the name, the period or any of the objects is not valid.
+ */
+struct sdo_poll_group* sdo_poll_group_new(const char* name,
+					  unsigned int period,
+					  const char* objects);
+void sdo_poll_group_unref(struct sdo_poll_group* self);
+
+int sdo_poll_parse_object(struct sdo_poll_object* dst, const char* str);
+
+/* Takes the group over. A group by the same name is replaced. */
+int sdo_poll_add(struct sdo_poll_group* group);
+int sdo_poll_remove(const char* name);
+struct sdo_poll_group* sdo_poll_find(const char* name);
+
+/* Adds the groups of the configuration file */
+int sdo_poll_load_cfg(void);
+
+void sdo_poll_write_json(FILE* output, const struct sdo_poll_group* group);
+
+/* Writes an event for each object of a bus and node that the subscriber
+ * wants whose value has changed since the generation gen, and moves gen on.
+ * Returns the number of events.
+ */
+int sdo_poll_format_events(FILE* output, uint32_t* gen, int bus,
+			   const char* nodes);
+
+void sdo_poll_rest_service(struct rest_client* client, const void* content);
+
+void sdo_poll_cleanup(void);
+
+/* Exposed for testing */
+void sdo_poll__record(struct sdo_poll_object* object,
+		      enum sdo_req_status status, uint32_t abort_code,
+		      const void* data, size_t size, int is_size_unknown,
+		      uint64_t timestamp);
+
+#endif /* SDO_POLL_H_ */
@@ -3,4 +3,9 @@
 
 void sdo_rest_service(struct rest_client* client, const void* content);
 
+/* Drop the JSON that has been kept of each EDS. This must be done before the
+ * EDS database is unloaded.
+ */
+void sdo_rest_cleanup(void);
+
 #endif /* SDO_REST_H_ */
@@ -0,0 +1,90 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SDO_TRACE_H
+#define _SDO_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/can.h>
+
+#include "trace-analysis.h"
+
+/* Whole SDO transactions put together from the frames of each node, with the
+ * time it takes the server to respond and the time each transaction takes.
+ * Expediated, segmented and block transfers are followed. Frames that do not
+ * fit the state of a transfer, as when tracing starts in the middle of one,
+ * are ignored until the next transfer begins.
+ */
+
+enum st_type {
+	ST_UNKNOWN = 0,
+	ST_DOWNLOAD,
+	ST_UPLOAD,
+	ST_BLOCK_DOWNLOAD,
+	ST_BLOCK_UPLOAD,
+};
+
+enum st_result {
+	ST_DONE = 0,
+	ST_ABORTED,
+	ST_INTERRUPTED, /* A new transfer began before this one ended */
+};
+
+struct st_transaction {
+	int node;
+	enum st_type type;
+	enum st_result result;
+	int index, subindex;
+	size_t size; /* bytes of data that were transferred */
+	unsigned int n_segments;
+	uint64_t start, end; /* us */
+	uint32_t abort_code;
+};
+
+struct st_node {
+	int phase;
+	int is_expediated;
+	int is_last;
+	uint64_t request_time; /* Zero unless waiting for the server */
+	struct st_transaction transaction;
+};
+
+struct st_stats {
+	uint64_t n_transactions;
+	uint64_t n_aborts;
+	struct ta_histogram response; /* us */
+	struct ta_histogram duration; /* us */
+};
+
+struct sdo_tracker {
+	struct st_node nodes[128];
+	struct st_stats stats[128];
+};
+
+void st_init(struct sdo_tracker* self);
+
+/* Returns 1 and fills in the transaction if the frame ended one. A frame that
+ * begins a transfer while another is going on ends the old one.
+ */
+int st_feed(struct sdo_tracker* self, const struct can_frame* cf,
+	    uint64_t timestamp, struct st_transaction* transaction);
+
+const char* st_type_to_string(enum st_type type);
+
+void st_print_stats(const struct sdo_tracker* self, FILE* stream);
+
+#endif /* _SDO_TRACE_H */
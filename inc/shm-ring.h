@@ -0,0 +1,112 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/can.h>
+
+/* A ring of timestamped CAN frames in shared memory, written by one process
+ * and read by any number of others. Each reader keeps its own place and never
+ * holds up the writer; one that falls a whole lap behind skips ahead and
+ * counts the frames that it missed.
+ *
+ * As in the trace buffer, each slot has a sequence number that is odd while
+ * the slot is being written, so that readers can tell whether they copied a
+ * frame whole. Readers that run out of frames may sleep on a futex in the
+ * header, which the writer only wakes when someone is waiting.
+ */
+#define SHM_RING_MAGIC 0x474e5253 /* "SRNG" */
+#define SHM_RING_VERSION 1
+
+struct shm_ring_slot {
+	uint64_t sequence;
+	uint64_t timestamp;
+	struct can_frame cf;
+};
+
+struct shm_ring_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint64_t length;
+
+	/* The number of frames that have been published */
+	uint64_t head __attribute__((aligned(64)));
+
+	/* Bumped on each publication, for readers to wait on */
+	uint32_t futex __attribute__((aligned(64)));
+	uint32_t n_waiters;
+};
+
+struct shm_ring {
+	struct shm_ring_header* header;
+	struct shm_ring_slot* slots;
+	size_t length;
+	size_t map_size;
+
+	/* The next frame to write or to read */
+	uint64_t position;
+	uint64_t n_lost;
+
+	int is_owner;
+	char name[256];
+};
+
+/* The name of the ring that the master keeps for a CAN interface */
+void shm_ring_make_name(char* dst, size_t size, const char* iface);
+
+/* Create a ring with room for at least length frames. A ring that is left
+ * over by the same name is replaced.
+ */
+int shm_ring_create(struct shm_ring* self, const char* name, size_t length);
+
+/* Take over writing a ring that another process created, from the descriptor
+ * of its shared memory, which is closed. The ring is carried on from where it
+ * was left, and is removed when this one destroys it.
+ */
+int shm_ring_adopt(struct shm_ring* self, const char* name, int fd);
+
+/* Start reading a ring from the frames that are published next */
+int shm_ring_open(struct shm_ring* self, const char* name);
+
+/* The ring is removed when its writer destroys it. Readers that still have it
+ * open keep their mapping, but get nothing more from it.
+ */
+void shm_ring_destroy(struct shm_ring* self);
+
+/* Written frames are only seen by readers once they are published */
+void shm_ring_write(struct shm_ring* self, const struct can_frame* cf,
+		    uint64_t timestamp);
+void shm_ring_publish(struct shm_ring* self);
+
+/* Returns the number of frames read, which is 0 if there are none */
+size_t shm_ring_read(struct shm_ring* self, struct can_frame* cfs,
+		     uint64_t* timestamps, size_t n);
+
+/* Wait up to timeout ms, or for ever if it is negative, until there is
+ * something to read. Returns 1 if there is, 0 on timeout and -1 on error,
+ * including EINTR.
+ */
+int shm_ring_wait(struct shm_ring* self, int timeout);
+
+static inline uint64_t shm_ring_get_n_lost(const struct shm_ring* self)
+{
+	return self->n_lost;
+}
+
+#endif /* _SHM_RING_H */
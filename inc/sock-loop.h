@@ -0,0 +1,66 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SOCK_LOOP_H_
+#define SOCK_LOOP_H_
+
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/can.h>
+
+/* An in-memory CAN bus between endpoints in the same process, for tests and
+ * benchmarks that run the master, virtual nodes and whatever else on one bus
+ * without vcan. Endpoints that are opened with the same name are on the same
+ * bus, which lasts for as long as any of them is open. As on SocketCAN, each
+ * frame that is sent reaches every other endpoint on the bus, but not the one
+ * that sent it.
+ *
+ * Each endpoint has an event fd that is readable while frames are waiting
+ * for it, so that it can be waited on in an event loop. The fd is only
+ * written to when a queue that was empty gets a frame, and only read when it
+ * is emptied again, so frames do not go through the kernel.
+ *
+ * Frames are stamped with the time in microseconds since the epoch when they
+ * are sent, or with the virtual time of the bus once that has been set. The
+ * virtual time only moves when it is set, so the timestamps of a test do not
+ * depend on how fast it runs.
+ */
+#define SOCK_LOOP_QUEUE_LENGTH 4096 /* frames; must be a power of two */
+
+struct sock_loop;
+
+struct sock_loop* sock_loop_open(const char* name);
+void sock_loop_close(struct sock_loop* self);
+
+int sock_loop_get_fd(const struct sock_loop* self);
+
+/* Never blocks. Frames that do not fit into the queue of an endpoint are
+ * lost to that endpoint and counted.
+ */
+void sock_loop_send(struct sock_loop* self, const struct can_frame* cfs,
+		    size_t n);
+
+/* Returns the number of frames received, which is 0 if none are waiting */
+size_t sock_loop_recv(struct sock_loop* self, struct can_frame* cfs,
+		      uint64_t* timestamps, size_t n);
+
+/* The number of frames that did not fit into the queue */
+uint64_t sock_loop_get_n_lost(const struct sock_loop* self);
+
+/* The virtual time is shared by all endpoints of the bus */
+void sock_loop_set_time(struct sock_loop* self, uint64_t t);
+uint64_t sock_loop_get_time(const struct sock_loop* self);
+
+#endif /* SOCK_LOOP_H_ */
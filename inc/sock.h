@@ -17,20 +17,51 @@
 #define CAN_SOCK_H_
 
 #include <unistd.h>
+#include <stdint.h>
 
 struct can_frame;
+struct canfd_frame;
+struct can_filter;
 struct tracebuffer;
+struct sock_txq;
+struct sock_wire;
+struct sock_rxbuf;
+struct sock_tx_classes;
+struct shm_ring;
+struct bl_meter;
+struct sock_loop;
 
 enum sock_type {
 	SOCK_TYPE_UNSPEC = 0,
 	SOCK_TYPE_CAN = 1,
 	SOCK_TYPE_TCP = 2,
+	SOCK_TYPE_UDP = 3,
+	SOCK_TYPE_SHM = 4,
+	SOCK_TYPE_LOOP = 5,
+};
+
+/* What is sent on the bus, from the most to the least urgent */
+enum sock_tx_class {
+	SOCK_TX_RT = 0, /* NMT, SYNC and PDOs */
+	SOCK_TX_NORMAL, /* Everything else */
+	SOCK_TX_BULK, /* SDOs */
+	SOCK_TX_N_CLASSES
 };
 
 struct sock {
 	enum sock_type type;
 	int fd;
 	struct tracebuffer* tb;
+	struct sock_txq* txq;
+	struct sock_wire* wire;
+	struct shm_ring* shm;
+	struct sock_loop* loop;
+	struct sock_rxbuf* rxbuf;
+	int is_fd;
+	struct sock_tx_classes* tx;
+
+	/* Frames that are sent are counted here, if set */
+	struct bl_meter* meter;
 };
 
 static inline void sock_init(struct sock* sock, enum sock_type type, int fd,
@@ -39,8 +70,35 @@ static inline void sock_init(struct sock* sock, enum sock_type type, int fd,
 	sock->type = type;
 	sock->fd = fd;
 	sock->tb = tb;
+	sock->txq = NULL;
+	sock->wire = NULL;
+	sock->shm = NULL;
+	sock->loop = NULL;
+	sock->rxbuf = NULL;
+	sock->is_fd = 0;
+	sock->tx = NULL;
+	sock->meter = NULL;
 }
 
+/* The address of a TCP socket is host[:port] and that of a UDP socket is a
+ * multicast group[:port]. A UDP socket joins the group and publishes what is
+ * sent on it there, in datagrams that are described in can-wire.h. It receives
+ * what everyone else publishes to the group, but not its own frames.
+ *
+ * Frames from a datagram that do not fit into a sock_recv_batch() call are
+ * kept for the next one. Callers that wait for the socket to become readable
+ * should either ask for at least CAN_WIRE_DATAGRAM_MAX_FRAMES or receive until
+ * EAGAIN.
+ *
+ * The address of a shared memory socket is the CAN interface of a master that
+ * shares what it receives, as described in shm-ring.h. Such sockets can only
+ * receive, and they have no file descriptor, so they must be waited on with
+ * sock_poll() rather than in an event loop.
+ *
+ * The address of a loop socket is the name of a bus within the process, which
+ * is made when the first socket joins it, as described in sock-loop.h. Its
+ * virtual clock is set with sock_loop_set_time() on sock->loop.
+ */
 int sock_open(struct sock* sock, enum sock_type type, const char* addr,
 	      struct tracebuffer* tb);
 
@@ -48,11 +106,124 @@ ssize_t sock_send(const struct sock* sock, struct can_frame* cf, int flags);
 int sock_timed_send(const struct sock* sock, struct can_frame* cf, int timeout);
 
 ssize_t sock_recv(const struct sock* sock, struct can_frame* cf, int flags);
+
+/* Wait up to timeout ms for something to receive. Returns 1 if there may be,
+ * 0 on timeout or -1 on error.
+ */
+int sock_poll(const struct sock* sock, int timeout);
 int sock_timed_recv(const struct sock* sock, struct can_frame* cf, int timeout);
 
-static inline int sock_close(struct sock* sock)
-{
-	return close(sock->fd);
-}
+/* Receive up to n frames with as few system calls as possible. Unless
+ * MSG_DONTWAIT is given, this blocks until at least one frame is available.
+ *
+ * If timestamps is not NULL, it receives the time of arrival of each frame in
+ * microseconds since the epoch. For SocketCAN this is taken from the kernel.
+ *
+ * TCP sockets read as much as is available and keep what is left over, which
+ * does not make the socket readable again. Event handlers should therefore call
+ * this until it returns fewer than n frames.
+ *
+ * Returns the number of frames received, 0 if the peer has closed the
+ * connection or -1 on error (including EAGAIN).
+ */
+ssize_t sock_recv_batch(const struct sock* sock, struct can_frame* cfs,
+			uint64_t* timestamps, size_t n, int flags);
+
+/* Allow CAN FD frames on the socket. This is only supported for SocketCAN.
+ *
+ * Classic frames can still be sent and received with the functions above. CAN
+ * FD frames are dropped by those and must be received with
+ * sock_recv_fd_batch() instead, which returns both kinds; FD frames have
+ * CANFD_FDF set in their flags.
+ */
+int sock_enable_fd(struct sock* sock);
+
+/* Send a CAN FD frame. Anything in the staging queue is sent first. */
+ssize_t sock_send_fd(const struct sock* sock, struct canfd_frame* cf,
+		     int flags);
+
+ssize_t sock_recv_fd_batch(const struct sock* sock, struct canfd_frame* cfs,
+			   uint64_t* timestamps, size_t n, int flags);
+
+/* Send each class of frames on a CAN socket of its own, so that a burst of
+ * SDO segments in the kernel does not hold up the next SYNC or RPDO. The
+ * sockets have SO_PRIORITY 6 for SOCK_TX_RT, 0 for SOCK_TX_NORMAL, which stays
+ * on the socket itself, and 2 for SOCK_TX_BULK. The pfifo_fast queueing
+ * discipline puts these into its bands 0, 1 and 2 and always empties a lower
+ * band first:
+ *
+ *	tc qdisc replace dev can0 root pfifo_fast
+ *
+ * With any other discipline the priorities only matter if it uses them, e.g.
+ * "tc qdisc replace dev can0 root handle 1: prio" followed by filters on
+ * skb priority. Keep txqueuelen short ("ip link set can0 txqueuelen 32") so
+ * that frames wait in the queueing discipline rather than in the driver.
+ *
+ * Staged frames are also sent a class at a time, most urgent first, so RT
+ * frames overtake others that were staged before them. Within a class, the
+ * order is kept.
+ *
+ * The other sockets do not loop their frames back, as this one would receive
+ * them like those of any other process on the host. Other CAN sockets on the
+ * host do not see them either; the trace buffer still has them.
+ */
+int sock_open_tx_classes(struct sock* sock, const char* iface);
+
+enum sock_tx_class sock_tx_class_of(const struct can_frame* cf);
+
+/* Set up a transmit staging queue for the socket. Frames passed to
+ * sock_stage() from the calling thread are collected in the queue until
+ * sock_flush() is called, at which point they are all sent with as few
+ * system calls as possible.
+ *
+ * Frames staged from other threads, and frames given to sock_send(), are sent
+ * immediately, after anything that is already in the queue.
+ *
+ * sock_stage() returns 0 once the frame is queued, so a frame that cannot be
+ * sent later on is only seen by sock_flush(). Such frames are counted, see
+ * sock_get_n_unsent().
+ */
+int sock_txq_init(struct sock* sock, size_t size);
+void sock_txq_destroy(struct sock* sock);
+
+int sock_stage(const struct sock* sock, struct can_frame* cf);
+int sock_flush(const struct sock* sock);
+
+/* Returns how many staged frames were dropped because a flush failed */
+uint64_t sock_get_n_unsent(const struct sock* sock);
+
+/* Ask the peer of a TCP socket to use the compact wire format described in
+ * can-wire.h from now on, with the given CAN_WIRE_F_* flags. Frames that
+ * arrive before the answer are discarded.
+ *
+ * Returns 0 if the peer agreed. Otherwise, including when it does not answer
+ * within the timeout in ms, -1 is returned and the legacy format is kept.
+ * Peers that predate the compact format forward the request as an error
+ * frame.
+ */
+int sock_request_compact(struct sock* sock, int flags, int timeout);
+
+/* Answer a request from the peer, which has been received as the frame hello.
+ * Returns 0 if the compact format is used from now on.
+ */
+int sock_accept_compact(struct sock* sock, const struct can_frame* hello);
+
+/* Ask a bridge server to send only the frames that pass at least one of the
+ * filters, as with CAN_RAW_FILTER. Any earlier filters are replaced. With no
+ * filters, everything is sent.
+ */
+int sock_subscribe(const struct sock* sock, const struct can_filter* filters,
+		   size_t n);
+
+/* Returns the CAN_WIRE_F_* flags in use, or -1 for the legacy format */
+int sock_get_wire_flags(const struct sock* sock);
+
+/* Returns how many datagrams from other senders a UDP socket has missed, how
+ * many frames a shared memory socket has been lapped by, or how many frames
+ * did not fit into the queue of a loop socket.
+ */
+uint64_t sock_get_n_lost(const struct sock* sock);
+
+int sock_close(struct sock* sock);
 
 #endif /* CAN_SOCK_H_ */
@@ -19,14 +19,40 @@
 #include <sys/socket.h>
 #include <linux/can.h>
 
+/* Set on received CAN FD frames, as done by newer kernels */
+#ifndef CANFD_FDF
+#define CANFD_FDF 0x04
+#endif
+
 #define CANOPEN_SLAVE_FILTER_LENGTH 9
 #define CANOPEN_MASTER_FILTER_LENGTH 10
 
 void socketcan_make_slave_filters(struct can_filter* filters, int nodeid);
 void socketcan_make_master_filters(struct can_filter* filters, int nodeid);
 int socketcan_open(const char* iface);
+
+/* Allow the socket to send and receive CAN FD frames */
+int socketcan_enable_fd(int fd);
+
+/* Keep the frames that the socket sends from other sockets on the host */
+int socketcan_disable_loopback(int fd);
 int socketcan_apply_filters(int fd, struct can_filter* filters, int n);
 
+/* Receive error frames of the classes in mask, as well as data frames */
+int socketcan_apply_error_filter(int fd, can_err_mask_t mask);
+
+/* Restart the controller of the interface after it has gone bus-off, as
+ * "ip link set <iface> type can restart" does. This needs CAP_NET_ADMIN.
+ * Returns -1 with errno set to EBUSY if the controller is not off the bus.
+ */
+int socketcan_restart(const char* iface);
+
+/* Make a filter that matches exactly one standard frame identifier and no
+ * RTR frames. The kernel looks these up by identifier, so large sets of them
+ * are cheap.
+ */
+void socketcan_make_sff_filter(struct can_filter* filter, canid_t id);
+
 int socketcan_open_slave(const char* iface, int nodeid);
 int socketcan_open_master(const char* iface, int nodeid);
 
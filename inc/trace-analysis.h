@@ -0,0 +1,99 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _TRACE_ANALYSIS_H
+#define _TRACE_ANALYSIS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "trace-record.h"
+#include "trace-filter.h"
+#include "vector.h"
+
+/* Summaries of traces that are decoded in parallel. A file is split into
+ * chunks of blocks or frames that threads take turns at. Anything that spans
+ * chunks, such as an SDO request whose response is in the next chunk or the
+ * gap between the last heartbeat of one chunk and the first of the next, is
+ * put together once all chunks are done.
+ */
+
+/* Bucket n holds latencies from 2^n up to 2^(n+1) us */
+#define TA_N_BUCKETS 32
+
+struct ta_histogram {
+	uint64_t count;
+	uint64_t sum, min, max; /* us */
+	uint64_t buckets[TA_N_BUCKETS];
+};
+
+struct ta_rate {
+	uint64_t count;
+	uint64_t first, last;
+};
+
+struct ta_heartbeats {
+	uint64_t count;
+	uint64_t first, last;
+	uint64_t max_gap; /* us */
+	uint64_t max_gap_end;
+};
+
+struct ta_emcy {
+	uint64_t timestamp;
+	uint16_t code;
+	uint8_t reg;
+	uint8_t node;
+};
+
+struct ta_report {
+	uint64_t n_frames;
+	uint64_t first_timestamp, last_timestamp;
+	uint64_t n_node_frames[128];
+	uint64_t n_extended_frames;
+
+	struct ta_rate pdos[TF_N_COB_IDS];
+
+	struct ta_histogram sdo_latency;
+	struct ta_histogram node_sdo_latency[128];
+	uint64_t n_sdo_aborts;
+
+	struct ta_heartbeats heartbeats[128];
+
+	struct vector emcys; /* struct ta_emcy, oldest first */
+};
+
+/* Zero means one thread per CPU, and chunks of a size that lets each thread
+ * take several of them.
+ */
+struct ta_config {
+	unsigned int n_threads;
+	size_t chunk_length;
+};
+
+/* The report must be destroyed, even if this fails */
+int ta_analyze(const char* path, const struct tr_filter* filter,
+	       const struct ta_config* config, struct ta_report* report);
+
+void ta_report_destroy(struct ta_report* self);
+
+void ta_histogram_add(struct ta_histogram* self, uint64_t value);
+
+uint64_t ta_histogram_get_percentile(const struct ta_histogram* self,
+				     unsigned int percent);
+
+void ta_report_print(const struct ta_report* self, FILE* stream);
+
+#endif /* _TRACE_ANALYSIS_H */
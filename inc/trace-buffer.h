@@ -22,22 +22,168 @@
 
 #include "socketcan.h"
 
+struct trace_filter;
+
+/* Records have room for CAN FD frames. Classic frames are stored in the same
+ * space with the flags field cleared; FD frames have CANFD_FDF set.
+ */
 struct tb_frame {
 	uint64_t timestamp;
-	struct can_frame cf;
+	union {
+		struct can_frame cf;
+		struct canfd_frame cfd;
+	};
+};
+
+/* Raw dumps start with a header that tells the size of the records. Dumps
+ * from before it have none and hold classic frames in records of
+ * TB_LEGACY_RECORD_SIZE bytes: the timestamp and a struct can_frame.
+ */
+#define TB_DUMP_MAGIC 0x504d4454 /* "TDMP" */
+#define TB_DUMP_VERSION 1
+#define TB_LEGACY_RECORD_SIZE 24
+
+struct tb_dump_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint64_t reserved;
+};
+
+void tb_dump_header_init(struct tb_dump_header* header);
+
+/* Frames may be appended from any number of threads, and the buffer may be
+ * dumped while they do so. Each slot has a sequence number that is odd while
+ * the slot is being written, so that a dump can tell which frames it has
+ * copied whole. A frame is dropped only if a writer finds its slot still taken
+ * by another writer that is a whole lap behind.
+ */
+struct tb_slot {
+	uint64_t sequence;
+	struct tb_frame frame;
+};
+
+/* The slots follow the header, so that a buffer can be kept in a file as it
+ * is.
+ */
+#define TB_MAGIC 0x46554254 /* "TBUF" */
+#define TB_VERSION 1
+
+struct tb_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint64_t length;
+	uint64_t head; /* The number of slots that writers have taken */
+	uint64_t n_dropped;
+	uint64_t is_open; /* Cleared when the buffer is closed */
+	uint64_t n_filtered;
+	uint64_t reserved[2];
 };
 
 struct tracebuffer {
 	size_t length;
-	size_t index;
-	size_t count;
-	int is_blocked;
-	struct tb_frame* data;
+	struct tb_header* header;
+	struct tb_slot* slots;
+
+	int fd;
+	size_t map_size; /* Zero unless the buffer is mapped from a file */
+	int is_view;
+	uint64_t n_recovered;
+
+	struct trace_filter* filter;
 };
 
 int tb_init(struct tracebuffer* self, size_t size);
+
+/* Keep the buffer in a file that is mapped into memory, so that the frames
+ * are still there if the process dies. The file may be on a tmpfs, such as
+ * /dev/shm, to keep them in shared memory instead.
+ *
+ * A file that is left from a buffer of the same size is taken up where it was
+ * left off. If it was never closed, the number of frames that were in it is
+ * kept in n_recovered. Only one process may have the file open at a time.
+ */
+int tb_init_mapped(struct tracebuffer* self, size_t size, const char* path);
+
+/* Read a buffer from a file that was mapped by tb_init_mapped(). Such buffers
+ * must not be appended to and need not be destroyed.
+ */
+int tb_init_view(struct tracebuffer* self, const void* data, size_t size);
+
 void tb_destroy(struct tracebuffer* self);
+
+/* Write to every page of the buffer, so that appending to it later does not
+ * fault them in. What is in it is kept. This must be done before anything
+ * is appended.
+ */
+void tb_prefault(struct tracebuffer* self);
+
+/* Frames that the filter leaves out are only counted. The filter is not
+ * owned by the buffer and may be NULL.
+ */
+static inline void tb_set_filter(struct tracebuffer* self,
+				 struct trace_filter* filter)
+{
+	self->filter = filter;
+}
+
+static inline int tb_is_mapped(const struct tracebuffer* self)
+{
+	return self->map_size > 0;
+}
+
+/* Make sure that a mapped buffer is on disk, which is all a dump needs to do
+ * for those.
+ */
+int tb_sync(struct tracebuffer* self);
 void tb_append(struct tracebuffer* self, const struct can_frame* frame);
+void tb_append_ts(struct tracebuffer* self, const struct can_frame* frame,
+		  uint64_t timestamp);
+void tb_append_fd_ts(struct tracebuffer* self, const struct canfd_frame* frame,
+		     uint64_t timestamp);
+
+/* Dumps are either the raw records, which canopen-dump reads, or pcapng,
+ * which Wireshark reads.
+ */
+enum tb_format {
+	TB_FORMAT_RAW = 0,
+	TB_FORMAT_PCAPNG,
+};
+
+/* "raw" or "pcapng". Returns -1 if the name is neither. */
+int tb_parse_format(enum tb_format* format, const char* name);
+
+/* The file name extension for dumps of the format, with the dot */
+const char* tb_format_extension(enum tb_format format);
+
+/* Write the frames in the buffer, oldest first. Frames that are overwritten
+ * while they are being copied are left out and counted as dropped.
+ */
 void tb_dump(struct tracebuffer* self, FILE* stream);
 
+/* The same in the given format. The interface is named iface in pcapng dumps
+ * if it is not NULL.
+ */
+void tb_dump_as(struct tracebuffer* self, FILE* stream, enum tb_format format,
+		const char* iface);
+
+/* Copy the frames in the buffer, oldest first, to frames, which must have room
+ * for length frames. Returns the number of frames that were copied.
+ */
+size_t tb_snapshot(struct tracebuffer* self, struct tb_frame* frames);
+
+uint64_t tb_get_head(const struct tracebuffer* self);
+uint64_t tb_get_n_dropped(const struct tracebuffer* self);
+uint64_t tb_get_n_filtered(const struct tracebuffer* self);
+
+/* Copy up to n frames, starting at *position, and move *position past them.
+ * Frames that have been overwritten are skipped. Copying stops at a frame that
+ * is still being written, so that it can be picked up later.
+ *
+ * Returns the number of frames that were copied.
+ */
+size_t tb_read(struct tracebuffer* self, uint64_t* position,
+	       struct tb_frame* frames, size_t n);
+
 #endif /* _TRACE_BUFFER_H */
@@ -0,0 +1,67 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _TRACE_FILTER_H
+#define _TRACE_FILTER_H
+
+#include <stdint.h>
+
+#include "socketcan.h"
+
+/* Decides which frames go into a trace buffer. Rules are separated by spaces
+ * or commas and are applied in order, so later rules override earlier ones:
+ *
+ *     [+|-]<what>[@<node>[-<node>]][/<n>]
+ *
+ * "-" leaves frames out and "/n" keeps one in n. What is "*" for everything,
+ * a COB-ID or a range of COB-IDs such as 0x180-0x1ff, or one of nmt, sync,
+ * time, emcy, pdo, tpdo, rpdo, tpdo1-4, rpdo1-4, sdo, tsdo, rsdo and
+ * heartbeat. Nodes only apply to objects that belong to nodes. Extended
+ * frames are only matched by "*".
+ *
+ * For example, "-pdo tpdo1@5 rpdo/10" leaves out all PDOs except for TPDO1 of
+ * node 5 and one in ten RPDOs.
+ */
+#define TF_N_COB_IDS (CAN_SFF_MASK + 1)
+
+struct trace_filter {
+	/* 0 leaves frames out, 1 keeps them and n keeps one in n */
+	uint16_t period[TF_N_COB_IDS + 1];
+	uint32_t count[TF_N_COB_IDS + 1];
+};
+
+/* Everything is kept to begin with */
+void tf_init(struct trace_filter* self);
+
+/* Returns -1 with errno set to EINVAL if a rule cannot be parsed, in which case
+ * the filter is left as it was.
+ */
+int tf_parse(struct trace_filter* self, const char* rules);
+
+static inline int tf_match(struct trace_filter* self, uint32_t can_id)
+{
+	uint32_t index = can_id & CAN_EFF_FLAG ? TF_N_COB_IDS
+					       : can_id & CAN_SFF_MASK;
+	uint16_t period = self->period[index];
+
+	if (period <= 1)
+		return period;
+
+	uint32_t n = __atomic_fetch_add(&self->count[index], 1,
+					__ATOMIC_RELAXED);
+	return n % period == 0;
+}
+
+#endif /* _TRACE_FILTER_H */
@@ -0,0 +1,282 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _TRACE_RECORD_H
+#define _TRACE_RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "trace-buffer.h"
+
+/* Recordings are files of blocks of compressed frames. Every block starts
+ * with a fresh dictionary, so that it can be decoded on its own.
+ *
+ * Each frame starts with a tag byte and the difference from the timestamp of
+ * the previous frame as a zigzag varint. The CAN ID follows, either as an
+ * index into a dictionary of recently seen IDs or in full. The payload
+ * follows unless it is the same as last time for that ID.
+ *
+ * Block headers say which span of time and which nodes a block covers, so
+ * that readers can skip blocks without decoding them. A copy of all block
+ * headers is written as an index when a file is closed, and the file ends
+ * with a trailer that points to it. Files that were never closed have no
+ * index, but their blocks can still be skipped one header at a time.
+ */
+#define TR_FILE_MAGIC 0x52544f43 /* "COTR" */
+#define TR_BLOCK_MAGIC 0x4b4c4254 /* "TBLK" */
+#define TR_INDEX_MAGIC 0x58444954 /* "TIDX" */
+#define TR_TRAILER_MAGIC 0x444e4554 /* "TEND" */
+#define TR_VERSION 2
+
+#define TR_DICT_SIZE 256
+#define TR_BLOCK_SIZE 65536
+#define TR_MAX_FRAME_SIZE 96
+
+#define TR_TAG_ID_HIT 0x01
+#define TR_TAG_SAME_DATA 0x02
+#define TR_TAG_FLAGS 0x04
+
+struct tr_file_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	uint64_t start_time; /* us since the epoch */
+};
+
+struct tr_block_header {
+	uint32_t magic;
+	uint32_t size; /* Of the frames that follow */
+	uint32_t n_frames;
+	uint32_t reserved;
+	uint64_t first_timestamp; /* Where the codec starts */
+	uint64_t min_timestamp;
+	uint64_t max_timestamp;
+	uint64_t nodes[2]; /* Bit n is set if node n has sent a standard frame */
+};
+
+struct tr_index_entry {
+	uint64_t offset; /* Of the block header */
+	uint64_t min_timestamp;
+	uint64_t max_timestamp;
+	uint64_t nodes[2];
+};
+
+struct tr_index_header {
+	uint32_t magic;
+	uint32_t n_entries;
+};
+
+struct tr_trailer {
+	uint64_t index_offset;
+	uint32_t reserved;
+	uint32_t magic;
+};
+
+struct tr_dict_entry {
+	uint32_t can_id;
+	uint8_t is_used;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t data[CANFD_MAX_DLEN];
+};
+
+/* The encoder and the decoder keep the same state */
+struct tr_codec {
+	uint64_t timestamp;
+	struct tr_dict_entry dict[TR_DICT_SIZE];
+};
+
+void tr_codec_reset(struct tr_codec* self, uint64_t timestamp);
+
+/* dst must have room for TR_MAX_FRAME_SIZE bytes. Returns the number of bytes
+ * that were written.
+ */
+size_t tr_encode(struct tr_codec* self, uint8_t* dst,
+		 const struct tb_frame* frame);
+
+/* Returns the number of bytes that were read, or -1 if the data is cut short.
+ */
+ssize_t tr_decode(struct tr_codec* self, const uint8_t* src, size_t size,
+		  struct tb_frame* frame);
+
+/* NMT, SYNC and TIME are node 0. Extended frames belong to no node, so they
+ * never pass a filter that names nodes.
+ */
+struct tr_filter {
+	uint64_t from, to; /* Inclusive, in us. Zero means no limit. */
+	uint64_t nodes[2]; /* No bits set means all nodes */
+};
+
+static inline int tr_get_node(uint32_t can_id)
+{
+	return can_id & CAN_EFF_FLAG ? -1 : (int)(can_id & 0x7f);
+}
+
+static inline void tr_filter_add_node(struct tr_filter* self, int node)
+{
+	self->nodes[node / 64] |= 1ULL << (node % 64);
+}
+
+static inline int tr_filter_has_nodes(const struct tr_filter* self)
+{
+	return self->nodes[0] || self->nodes[1];
+}
+
+static inline int tr_filter_match_span(const struct tr_filter* self,
+				       uint64_t min, uint64_t max,
+				       const uint64_t nodes[2])
+{
+	if (self->from && max < self->from)
+		return 0;
+
+	if (self->to && min > self->to)
+		return 0;
+
+	return !tr_filter_has_nodes(self)
+	    || (nodes[0] & self->nodes[0]) || (nodes[1] & self->nodes[1]);
+}
+
+static inline int tr_filter_match(const struct tr_filter* self,
+				  uint32_t can_id, uint64_t timestamp)
+{
+	uint64_t nodes[2] = { 0, 0 };
+	int node = tr_get_node(can_id);
+
+	if (node >= 0)
+		nodes[node / 64] = 1ULL << (node % 64);
+	else if (tr_filter_has_nodes(self))
+		return 0;
+
+	return tr_filter_match_span(self, timestamp, timestamp, nodes);
+}
+
+typedef void (*tr_frame_fn)(const struct tb_frame* frame, void* context);
+
+/* Call fn for every frame in a file that passes the filter, which may be
+ * NULL. Recordings are mapped into memory and only the blocks that the filter
+ * may pass are decoded. Trace buffers that were kept in files are read as
+ * they were left. Other files are taken to be raw dumps of a trace buffer.
+ * Returns -1 with errno set to ENOTSUP if the
+ * recording or dump is of another version, or to EBADMSG if a dump without a
+ * header is not made of whole records.
+ */
+int tr_read_path(const char* path, const struct tr_filter* filter,
+		 tr_frame_fn fn, void* context);
+
+enum tr_file_type {
+	TR_FILE_RAW,
+	TR_FILE_RECORDING,
+	TR_FILE_BUFFER,
+	TR_FILE_LEGACY, /* A raw dump from before dumps had a header */
+};
+
+/* A file that is mapped for reading. It is made up of units that can be read
+ * on their own, in any order and from any thread: the blocks of recordings or
+ * the frames of other files.
+ */
+struct tr_file {
+	enum tr_file_type type;
+	const uint8_t* map;
+	size_t size;
+	size_t length; /* The number of units */
+	struct tr_index_entry* blocks;
+	struct tb_frame* frames;
+};
+
+int tr_file_open(struct tr_file* self, const char* path);
+void tr_file_close(struct tr_file* self);
+
+/* Call fn for the frames in the units from first up to last that pass the
+ * filter, which may be NULL.
+ */
+int tr_file_read(struct tr_file* self, size_t first, size_t last,
+		 const struct tr_filter* filter, tr_frame_fn fn,
+		 void* context);
+
+struct tr_stats {
+	uint64_t n_frames;
+	uint64_t n_lost; /* Overwritten in the ring before they were recorded */
+	uint64_t n_raw_bytes;
+	uint64_t n_bytes;
+	uint64_t n_files;
+	uint64_t n_write_errors;
+};
+
+/* Moves frames from a trace buffer to files on its own thread, so that the
+ * threads that receive frames never touch the disk. Blocks are written once
+ * they are full or once they have been open for TR_BLOCK_AGE. Files are named
+ * <name>-<start time>-<number>.ctr and a new one is started when the current
+ * one gets too big or too old. Only the newest max_files are kept.
+ */
+#define TR_POLL_PERIOD 50000ULL /* us */
+#define TR_BLOCK_AGE 1000000ULL /* us */
+
+struct tr_recorder {
+	struct tracebuffer* tb;
+	char directory[256];
+	char name[64];
+
+	uint64_t max_file_size;
+	uint64_t max_file_age; /* us */
+	unsigned int max_files;
+
+	uint64_t position;
+	struct tr_codec codec;
+	struct tr_block_header block;
+	uint8_t* data;
+	uint64_t block_start; /* Monotonic, in us */
+
+	FILE* file;
+	uint64_t file_size;
+	uint64_t file_start; /* Monotonic, in us */
+	struct tr_index_entry* index;
+	size_t index_length;
+	size_t index_size;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int is_running;
+	int is_stopping;
+
+	pthread_mutex_t stats_lock;
+	struct tr_stats stats;
+};
+
+int tr_recorder_init(struct tr_recorder* self, struct tracebuffer* tb,
+		     const char* directory, const char* name);
+void tr_recorder_destroy(struct tr_recorder* self);
+
+/* Sizes are in bytes and ages in us. Zero means no limit. */
+void tr_recorder_set_rotation(struct tr_recorder* self, uint64_t max_size,
+			      uint64_t max_age, unsigned int max_files);
+
+int tr_recorder_start(struct tr_recorder* self);
+
+/* Writes whatever is left before the thread exits */
+void tr_recorder_stop(struct tr_recorder* self);
+
+/* Take new frames from the trace buffer, and write out the block if it is
+ * full or if do_flush is set. This is what the thread does every
+ * TR_POLL_PERIOD.
+ */
+int tr_recorder_poll(struct tr_recorder* self, int do_flush);
+
+void tr_recorder_get_stats(struct tr_recorder* self, struct tr_stats* stats);
+
+#endif /* _TRACE_RECORD_H */
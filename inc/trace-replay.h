@@ -0,0 +1,103 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef _TRACE_REPLAY_H
+#define _TRACE_REPLAY_H
+
+#include <stdint.h>
+#include <signal.h>
+
+struct sock;
+struct can_frame;
+struct tb_frame;
+struct tr_filter;
+
+/* Plays the frames of a trace back onto a bus with the timing with which they
+ * were recorded, so that an incident can be reproduced against a master, or
+ * against virtual nodes.
+ *
+ * Each frame is given a deadline on the monotonic clock, relative to the first
+ * frame of the replay, and the replay sleeps until then with
+ * clock_nanosleep(). Frames whose deadlines are less than
+ * TRACE_REPLAY_BATCH_WINDOW apart are staged and sent together, so bursts are
+ * not spread out by the cost of sending them one at a time.
+ */
+
+/* In us */
+#define TRACE_REPLAY_BATCH_WINDOW 100
+
+enum trace_replay_source {
+	/* What the nodes sent: EMCY, TPDO, SDO responses and heartbeats */
+	TRACE_REPLAY_SLAVES = 0,
+	/* The rest: NMT, SYNC, TIME, RPDO, SDO requests and guarding */
+	TRACE_REPLAY_MASTER,
+	TRACE_REPLAY_ALL,
+};
+
+struct trace_replay_stats {
+	uint64_t n_frames;
+	uint64_t n_skipped; /* From the other side or not CANopen */
+	uint64_t n_errors;
+	uint64_t max_lateness; /* In us */
+};
+
+struct trace_replay {
+	const struct sock* sock;
+	double speed;
+	enum trace_replay_source source;
+	const volatile sig_atomic_t* is_stopping;
+
+	int is_started;
+	uint64_t first_timestamp;
+	uint64_t start;
+
+	struct trace_replay_stats stats;
+};
+
+/* Speed is a multiple of real time; 1 is as recorded and 0 is as fast as the
+ * socket takes the frames. Generated frames are staged on the transmit queue
+ * of the socket if it has one.
+ */
+void trace_replay_init(struct trace_replay* self, const struct sock* sock,
+		       double speed, enum trace_replay_source source);
+
+/* The replay stops at the next frame once *flag is set, e.g. by a signal
+ * handler.
+ */
+static inline void trace_replay_set_stop_flag(struct trace_replay* self,
+		const volatile sig_atomic_t* flag)
+{
+	self->is_stopping = flag;
+}
+
+/* Replay the frames of a file that pass the filter, which may be NULL. See
+ * tr_read_path().
+ */
+int trace_replay_path(struct trace_replay* self, const char* path,
+		      const struct tr_filter* filter);
+
+/* Frames must be given in the order in which they were recorded. Frames that
+ * go back in time are sent right away.
+ */
+void trace_replay_frame(struct trace_replay* self,
+			const struct tb_frame* frame);
+
+/* Send whatever is staged */
+void trace_replay_flush(struct trace_replay* self);
+
+int trace_replay_is_from_slave(const struct can_frame* cf);
+
+#endif /* _TRACE_REPLAY_H */
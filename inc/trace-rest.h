@@ -0,0 +1,80 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef TRACE_REST_H_
+#define TRACE_REST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "trace-buffer.h"
+
+struct rest_client;
+struct mloop_timer;
+
+/* GET [/<iface>]/trace?format=raw|pcapng&follow=1 sends the frames in the
+ * trace buffer of the bus with chunked encoding, as raw records or as pcapng.
+ * Nothing is written to disk and no other CAN socket is opened.
+ *
+ * The ring is copied when the request comes in, as a dump does it, and the
+ * copy is sent oldest first. With follow, the reply goes on with the frames
+ * that are traced after that, read from the ring where they are, until the
+ * client goes away. Frames that are overwritten before they are sent are left
+ * out.
+ *
+ * At most one batch is waiting for the client at a time, so a slow client
+ * only falls behind in the ring.
+ */
+#define TRACE_REST_BATCH_SIZE 256
+#define TRACE_REST_BATCHES_PER_TICK 16
+
+/* In ms */
+#define TRACE_REST_INTERVAL 20
+
+struct trace_rest_stream {
+	struct trace_rest_stream* next;
+	struct rest_client* client;
+	struct mloop_timer* timer;
+
+	struct tracebuffer* tb;
+	enum tb_format format;
+	char iface[16];
+	int is_following;
+	int is_header_sent;
+
+	struct tb_frame* snapshot;
+	size_t snapshot_length;
+	size_t n_snapshot_sent;
+
+	/* Where the ring is read from next, after the snapshot */
+	uint64_t position;
+
+	struct tb_frame batch[TRACE_REST_BATCH_SIZE];
+};
+
+/* Serve the request for the trace buffer of a bus. iface names the interface
+ * in pcapng traces and may be NULL. This must be called on the default loop.
+ */
+void trace_rest_serve(struct rest_client* client, struct tracebuffer* tb,
+		      const char* iface);
+
+void trace_rest_cleanup(void);
+
+/* Send what the client is ready for. Returns 1 when the reply has ended, 0 if
+ * there is more to send and -1 if the client is gone.
+ */
+int trace_rest__pump(struct trace_rest_stream* self);
+
+#endif /* TRACE_REST_H_ */
@@ -19,29 +19,59 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mem-tag.h"
+
 struct vector {
 	void* data;
 	size_t index;
 	size_t size;
+	void* inline_data;
 };
 
 static inline int vector_init(struct vector* self, size_t size)
 {
 	memset(self, 0, sizeof(*self));
 	self->size = size;
-	self->data = malloc(size);
+	self->data = mem_alloc(MEM_TAG_VECTOR, size);
 	return self->data ? 0 : -1;
 }
 
+/* Use a buffer owned by the caller until more room is needed. Such a vector
+ * must not be moved while it uses the buffer.
+ */
+static inline void vector_init_inline(struct vector* self, void* buffer,
+				      size_t size)
+{
+	memset(self, 0, sizeof(*self));
+	self->size = size;
+	self->data = buffer;
+	self->inline_data = buffer;
+}
+
+static inline int vector__is_inline(const struct vector* self)
+{
+	return self->data && self->data == self->inline_data;
+}
+
 static inline void vector_destroy(struct vector* self)
 {
-	free(self->data);
+	if (!vector__is_inline(self))
+		mem_free(MEM_TAG_VECTOR, self->data);
 	self->data = NULL;
 }
 
 static inline int vector__grow(struct vector* self, size_t size)
 {
-	void* data = realloc(self->data, size);
+	void* data;
+
+	if (vector__is_inline(self)) {
+		data = mem_alloc(MEM_TAG_VECTOR, size);
+		if (data)
+			memcpy(data, self->data, self->index);
+	} else {
+		data = mem_realloc(MEM_TAG_VECTOR, self->data, size);
+	}
+
 	if (!data)
 		return -1;
 	self->data = data;
@@ -90,6 +120,22 @@ static inline int vector_fill(struct vector* self, int c, size_t size)
 	return 0;
 }
 
+/* Exchange the contents of two vectors. Neither may be using an inline buffer;
+ * those stay with the vectors that own them.
+ */
+static inline void vector_swap(struct vector* a, struct vector* b)
+{
+	struct vector tmp = *a;
+
+	a->data = b->data;
+	a->index = b->index;
+	a->size = b->size;
+
+	b->data = tmp.data;
+	b->index = tmp.index;
+	b->size = tmp.size;
+}
+
 static inline int vector_copy(struct vector* dst, const struct vector* src)
 {
 	return vector_assign(dst, src->data, src->index);
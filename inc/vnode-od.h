@@ -0,0 +1,86 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CANOPEN_VNODE_OD_H_
+#define CANOPEN_VNODE_OD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canopen/types.h"
+
+struct ini_file;
+
+/* The object dictionary of a virtual node, compiled from the sections of its
+ * config that are named after an index and a subindex in hex:
+ *
+ *	[1008sub0]
+ *	type=VISIBLE_STRING
+ *	value=MCV14
+ *	access=ro		; downloads are refused, rw by default
+ *
+ * Each value is converted once, when the config is loaded, and kept as it goes
+ * on the wire, so an upload is a lookup and a copy. Downloads write the value
+ * in place. Numbers must be written whole, and strings may be at most as long
+ * as the room that was made for them.
+ */
+
+/* Strings are given at least this much room for downloads */
+#define VNODE_OD_MIN_STRING_CAPACITY 32
+
+struct vnode_od_entry {
+	/* The index shifted up by 8 bits, or'ed with the subindex */
+	uint32_t key;
+	enum canopen_type type;
+	int is_read_only;
+	uint32_t size;
+	uint32_t capacity;
+	uint32_t offset;
+};
+
+/* Entries are sorted by key, and their values are packed into data */
+struct vnode_od {
+	struct vnode_od_entry* entry;
+	size_t n_entries;
+	uint8_t* data;
+	size_t data_size;
+};
+
+/* Sections with other names are left out, as are those without a known type
+ * or a value. Returns 0 on success. A value that cannot be converted to its
+ * type fails with errno set to EINVAL.
+ */
+int vnode_od_compile(struct vnode_od* self, const struct ini_file* config);
+
+int vnode_od_copy(struct vnode_od* dst, const struct vnode_od* src);
+void vnode_od_destroy(struct vnode_od* self);
+
+const struct vnode_od_entry* vnode_od_find(const struct vnode_od* self,
+					   int index, int subindex);
+
+static inline const void* vnode_od_get_data(const struct vnode_od* self,
+					    const struct vnode_od_entry* entry)
+{
+	return self->data + entry->offset;
+}
+
+/* Returns -1 and sets errno to ENOENT if there is no such object, EACCES if it
+ * is read only, EMSGSIZE if the data is too long or ERANGE if a number is too
+ * short.
+ */
+int vnode_od_write(struct vnode_od* self, int index, int subindex,
+		   const void* data, size_t size);
+
+#endif /* CANOPEN_VNODE_OD_H_ */
@@ -0,0 +1,135 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef CANOPEN_VNODE_TRAFFIC_H_
+#define CANOPEN_VNODE_TRAFFIC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ini_file;
+
+/* Traffic that virtual nodes generate so that the throughput and latency of
+ * the master can be measured without hardware. The config of a node can have
+ * a section for each TPDO and one for EMCY:
+ *
+ *	[tpdo1]
+ *	period=1000		; microseconds between frames, or
+ *	sync=1			; send after every nth SYNC instead
+ *	size=8
+ *	pattern=counter		; constant, counter, random or replay
+ *	data=0100000000000000	; the constant, or the first counter value
+ *	file=vnodes/pdo1.txt	; payloads to replay, in hex, one per line
+ *
+ *	[emcy]
+ *	period=100000		; microseconds between bursts
+ *	burst=10		; frames per burst
+ *	code=0x8130
+ *	register=0x11
+ *
+ * Counters are little endian and EMCY frames count in the manufacturer
+ * specific bytes. Random payloads are seeded with the node id, so each run
+ * sends the same frames.
+ *
+ * Timed frames are scheduled on absolute deadlines, so the rate does not drift
+ * and the number of frames sent in a run only depends on its length. Frames
+ * that fall due together are sent together.
+ */
+
+#define VNODE_TRAFFIC_N_TPDOS 4
+
+/* A generator that is further behind than this many periods skips the rest */
+#define VNODE_TRAFFIC_MAX_CATCH_UP 64
+
+enum vnode_traffic_pattern {
+	VNODE_TRAFFIC_CONSTANT = 0,
+	VNODE_TRAFFIC_COUNTER,
+	VNODE_TRAFFIC_RANDOM,
+	VNODE_TRAFFIC_REPLAY,
+};
+
+struct vnode_traffic_frame {
+	uint8_t size;
+	uint8_t data[8];
+};
+
+struct vnode_traffic_gen {
+	int is_enabled;
+	uint32_t cob_id;
+
+	/* Exactly one of these is non-zero */
+	uint64_t period;
+	unsigned int sync;
+
+	unsigned int burst;
+	uint64_t deadline;
+	unsigned int n_syncs;
+
+	enum vnode_traffic_pattern pattern;
+	struct vnode_traffic_frame frame;
+	unsigned int counter_offset;
+	uint32_t random_state;
+
+	struct vnode_traffic_frame* replay;
+	size_t n_replay;
+	size_t replay_index;
+
+	uint64_t n_frames;
+	uint64_t n_skipped;
+};
+
+struct vnode_traffic {
+	struct vnode_traffic_gen tpdo[VNODE_TRAFFIC_N_TPDOS];
+	struct vnode_traffic_gen emcy;
+};
+
+/* Returns 0 on success, also if the config has no traffic sections */
+int vnode_traffic_load(struct vnode_traffic* self,
+		       const struct ini_file* config, int nodeid);
+void vnode_traffic_destroy(struct vnode_traffic* self);
+
+int vnode_traffic_is_timed(const struct vnode_traffic* self);
+int vnode_traffic_is_synchronous(const struct vnode_traffic* self);
+
+/* Schedule the first frames of the timed generators one period after now.
+ * Times are in microseconds on the monotonic clock.
+ */
+void vnode_traffic_start(struct vnode_traffic* self, uint64_t now);
+
+/* Returns the earliest deadline of the timed generators, or UINT64_MAX */
+uint64_t vnode_traffic_next_deadline(const struct vnode_traffic* self);
+
+/* Returns how many frames the generator should send at time now and moves its
+ * deadline past now.
+ */
+unsigned int vnode_traffic_due(struct vnode_traffic_gen* gen, uint64_t now);
+
+/* Returns how many frames the generator should send for a SYNC */
+unsigned int vnode_traffic_on_sync(struct vnode_traffic_gen* gen);
+
+void vnode_traffic_next_frame(struct vnode_traffic_gen* gen,
+			      struct vnode_traffic_frame* frame);
+
+/* Parse payloads in hex, one per line. Spaces between bytes, empty lines and
+ * lines that begin with # are ignored. The frames are allocated with malloc().
+ *
+ * Returns 0 on success. A negative value is minus the number of the line that
+ * could not be parsed, or -1 if the file could not be read or has no payloads.
+ */
+int vnode_traffic_load_replay(struct vnode_traffic_frame** frames, size_t* n,
+			      const char* path);
+
+#endif /* CANOPEN_VNODE_TRAFFIC_H_ */
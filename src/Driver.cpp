@@ -19,11 +19,74 @@
 
 #include "Driver.h"
 #include "CanIOHandlerInterface.h"
+#include "CanIOHandlerInterface2.h"
+#include "plog.h"
 
 #include <appcbase.h>
 
 using namespace std;
 
+/* Presents a handler of the first version as one of the second. The
+ * exceptions that the old handlers may throw stop here.
+ */
+class LegacyHandlerAdapter : public CanIOMapDriver::CanIOHandlerInterface2
+{
+    CanIOMapDriver::CanIOHandlerInterface* chi;
+
+public:
+    LegacyHandlerAdapter(CanIOMapDriver::CanIOHandlerInterface* handler)
+        : chi(handler) {}
+
+    CanIOMapDriver::CanIOHandlerInterface* handler() { return chi; }
+
+    virtual int processPdo(int n, const uint8_t* data, size_t size,
+                           uint64_t /*timestamp*/) noexcept
+    {
+        /* The old interface does not promise to leave the data alone, but
+         * no driver is known to change it.
+         */
+        unsigned char* buffer = const_cast<unsigned char*>(data);
+        try {
+            switch (n) {
+            case 1: return chi->processPdo1(buffer, size);
+            case 2: return chi->processPdo2(buffer, size);
+            case 3: return chi->processPdo3(buffer, size);
+            case 4: return chi->processPdo4(buffer, size);
+            }
+        } catch (exception& e) {
+            plog(LOG_ERROR, "processPdo%d: Caught exception: %s", n,
+                 e.what());
+        }
+        return -1;
+    }
+
+    virtual int processSdo(int index, int subindex,
+                           CanIOMapDriver::ConstBytes data)
+    {
+        return chi->processSdo(index, subindex,
+                               const_cast<unsigned char*>(data.data),
+                               data.size);
+    }
+
+    virtual int processEmr(unsigned short emergencyErrorcode,
+                           unsigned char errorRegister,
+                           unsigned long long manufacturerError)
+    {
+        return chi->processEmr(emergencyErrorcode, errorRegister,
+                               manufacturerError);
+    }
+
+    virtual int processNodeState(int state)
+    {
+        return chi->processNodeState(state);
+    }
+
+    virtual int initialize()
+    {
+        return chi->initialize();
+    }
+};
+
 int Driver::inst = 0;
 
 int
@@ -68,6 +131,8 @@ Driver::Driver( const char *filename )
     candriver_delete_handler = NULL;
     candriver_delete_all_handlers = NULL;
     candriver_close_driver = NULL;
+    candriver_create_handler2 = NULL;
+    candriver_delete_handler2 = NULL;
 
     handle = dlopen( filename, RTLD_NOW);
     dlsym_error = dlerror();
@@ -84,6 +149,12 @@ Driver::Driver( const char *filename )
 
     candriver_close_driver = tryLoadSymbol<candriver_close_driver_t*>(handle, "candriver_close_driver");
 
+    candriver_create_handler2 = tryLoadOptionalSymbol<candriver_create_handler2_t*>(handle, "candriver_create_handler2");
+    candriver_delete_handler2 = tryLoadOptionalSymbol<candriver_delete_handler2_t*>(handle, "candriver_delete_handler2");
+    if (!candriver_create_handler2 != !candriver_delete_handler2)
+        throw std::runtime_error("Driver " + string(filename)
+                                 + " must export both or neither of candriver_create_handler2 and candriver_delete_handler2");
+
     candriver_set_parent("canopen", appbase_get_instance());
 }
 
@@ -106,6 +177,34 @@ int Driver::deleteHandler(CanIOMapDriver::CanIOHandlerInterface* chi )
     return -1;
 }
 
+int
+Driver::createHandler2( const char* nodeName, int32_t profileNr,
+                        CanIOMapDriver::CanMasterInterface2 *cmi,
+                        CanIOMapDriver::CanIOHandlerInterface2** chi )
+{
+    if (candriver_create_handler2)
+        return candriver_create_handler2( nodeName, profileNr, cmi, chi );
+
+    CanIOMapDriver::CanIOHandlerInterface* old = NULL;
+    int rc = createHandler( nodeName, profileNr, cmi, &old );
+    if (rc != 0)
+        return rc;
+
+    *chi = new LegacyHandlerAdapter(old);
+    return 0;
+}
+
+int Driver::deleteHandler2(CanIOMapDriver::CanIOHandlerInterface2* chi )
+{
+    if (candriver_delete_handler2)
+        return candriver_delete_handler2( chi );
+
+    LegacyHandlerAdapter* adapter = static_cast<LegacyHandlerAdapter*>(chi);
+    int rc = deleteHandler( adapter->handler() );
+    delete adapter;
+    return rc;
+}
+
 Driver::~Driver()
 {
     candriver_delete_all_handlers();
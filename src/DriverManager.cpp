@@ -177,13 +177,13 @@ DriverManager::~DriverManager()
 }
 
 int DriverManager::createHandler(const char* nodeName, int profileNr,
-        CanIOMapDriver::CanMasterInterface *cmi,
-        CanIOMapDriver::CanIOHandlerInterface** chi )
+        CanIOMapDriver::CanMasterInterface2 *cmi,
+        CanIOMapDriver::CanIOHandlerInterface2** chi )
 {
     driver_t::iterator it;
     for (it = drivers.begin(); it != drivers.end(); ++it)
     {
-        if (0 == it->second->createHandler( nodeName, profileNr, cmi, chi ))
+        if (0 == it->second->createHandler2( nodeName, profileNr, cmi, chi ))
         {
             if (verbose)
             {
@@ -196,7 +196,7 @@ int DriverManager::createHandler(const char* nodeName, int profileNr,
 
     if (defaultDriver)
     {
-        if (0 == defaultDriver->createHandler( nodeName, profileNr, cmi, chi ))
+        if (0 == defaultDriver->createHandler2( nodeName, profileNr, cmi, chi ))
         {
             if (verbose)
             {
@@ -210,12 +210,12 @@ int DriverManager::createHandler(const char* nodeName, int profileNr,
 }
 
 int DriverManager::deleteHandler(int /*profileNr*/,
-        CanIOMapDriver::CanIOHandlerInterface* chi )
+        CanIOMapDriver::CanIOHandlerInterface2* chi )
 {
     Driver *dr = chi2driver[chi];
     if (dr)
     {
-        dr->deleteHandler(chi);
+        dr->deleteHandler2(chi);
         chi2driver.erase(chi);
         return 0;
     }
@@ -0,0 +1,251 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "async-log.h"
+#include "co_atomic.h"
+#include "time-utils.h"
+#include "plog.h"
+#include "rt-thread.h"
+
+/* A slot may be written when its seq equals the position that was claimed
+ * for it, and read when it is one past that. The reader then moves it a whole
+ * lap ahead.
+ */
+struct alog_record {
+	size_t seq;
+	int prio;
+	char text[ALOG_TEXT_SIZE];
+};
+
+struct alog {
+	struct alog_record* records;
+	size_t mask;
+	unsigned int rate_limit;
+
+	/* Claimed by the writers */
+	size_t head __attribute__((aligned(64)));
+	uint64_t n_dropped;
+
+	/* Owned by the logging thread */
+	size_t tail __attribute__((aligned(64)));
+	uint64_t n_reported_dropped;
+
+	sem_t has_records;
+	pthread_t thread;
+	int is_running;
+	int is_stopping;
+};
+
+static struct alog alog_;
+
+static int alog__is_limited(struct alog_site* site)
+{
+	unsigned int limit = alog_.rate_limit;
+	if (limit == 0)
+		return 0;
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	uint64_t start = co_atomic_load_relaxed(&site->window_start);
+
+	if ((start == 0 || now - start >= 1000000ULL)
+	 && co_atomic_cas(&site->window_start, start, now))
+		co_atomic_store_relaxed(&site->n_in_window, 0);
+
+	if (co_atomic_add_fetch(&site->n_in_window, 1) <= limit)
+		return 0;
+
+	co_atomic_add_fetch(&site->n_suppressed, 1);
+	return 1;
+}
+
+static void alog__format(char* dst, size_t size, struct alog_site* site,
+			 const char* fmt, va_list ap)
+{
+	int length = vsnprintf(dst, size, fmt, ap);
+	if (length < 0)
+		length = 0;
+
+	uint32_t n_suppressed = co_atomic_exchange(&site->n_suppressed, 0);
+	if (n_suppressed > 0 && (size_t)length < size)
+		snprintf(dst + length, size - length,
+			 " (%u more from here were suppressed)", n_suppressed);
+}
+
+static struct alog_record* alog__claim(void)
+{
+	size_t pos = co_atomic_load_relaxed(&alog_.head);
+
+	while (1) {
+		struct alog_record* record = &alog_.records[pos & alog_.mask];
+		size_t seq = co_atomic_load_acquire(&record->seq);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (co_atomic_cas(&alog_.head, pos, pos + 1))
+				return record;
+		} else if (diff < 0) {
+			co_atomic_add_fetch(&alog_.n_dropped, 1);
+			return NULL;
+		}
+
+		pos = co_atomic_load_relaxed(&alog_.head);
+	}
+}
+
+void alog__write(struct alog_site* site, int prio, const char* fmt, ...)
+{
+	va_list ap;
+
+	if (alog__is_limited(site))
+		return;
+
+	if (!co_atomic_load_acquire(&alog_.is_running)) {
+		char text[ALOG_TEXT_SIZE];
+
+		va_start(ap, fmt);
+		alog__format(text, sizeof(text), site, fmt, ap);
+		va_end(ap);
+
+		plog(prio, "%s", text);
+		return;
+	}
+
+	struct alog_record* record = alog__claim();
+	if (!record)
+		return;
+
+	size_t pos = co_atomic_load_relaxed(&record->seq);
+
+	record->prio = prio;
+
+	va_start(ap, fmt);
+	alog__format(record->text, sizeof(record->text), site, fmt, ap);
+	va_end(ap);
+
+	co_atomic_store_release(&record->seq, pos + 1);
+	sem_post(&alog_.has_records);
+}
+
+static void alog__report_dropped(void)
+{
+	uint64_t n_dropped = co_atomic_load_relaxed(&alog_.n_dropped);
+	if (n_dropped == alog_.n_reported_dropped)
+		return;
+
+	plog(LOG_WARNING, "%llu log messages were dropped",
+	     (unsigned long long)(n_dropped - alog_.n_reported_dropped));
+
+	alog_.n_reported_dropped = n_dropped;
+}
+
+static void alog__drain(void)
+{
+	while (1) {
+		size_t tail = alog_.tail;
+		struct alog_record* record = &alog_.records[tail & alog_.mask];
+
+		if (co_atomic_load_acquire(&record->seq) != tail + 1)
+			break;
+
+		plog(record->prio, "%s", record->text);
+
+		co_atomic_store_release(&record->seq, tail + alog_.mask + 1);
+		alog_.tail = tail + 1;
+	}
+
+	alog__report_dropped();
+}
+
+static void* alog__run(void* context)
+{
+	(void)context;
+
+	while (!co_atomic_load_acquire(&alog_.is_stopping)) {
+		sem_wait(&alog_.has_records);
+		alog__drain();
+	}
+
+	alog__drain();
+	return NULL;
+}
+
+int alog_start(size_t n_records, unsigned int rate_limit)
+{
+	size_t length = 1;
+	while (length < n_records)
+		length <<= 1;
+
+	if (alog_.records) {
+		sem_destroy(&alog_.has_records);
+		free(alog_.records);
+	}
+
+	memset(&alog_, 0, sizeof(alog_));
+
+	alog_.records = malloc(length * sizeof(*alog_.records));
+	if (!alog_.records)
+		return -1;
+
+	for (size_t i = 0; i < length; ++i)
+		alog_.records[i].seq = i;
+
+	alog_.mask = length - 1;
+	alog_.rate_limit = rate_limit;
+
+	if (sem_init(&alog_.has_records, 0, 0) < 0)
+		goto sem_failure;
+
+	if (rt_thread_create(&alog_.thread, RT_THREAD_LOG, alog__run, NULL,
+			     "Log writer") < 0)
+		goto thread_failure;
+
+	co_atomic_store_release(&alog_.is_running, 1);
+	return 0;
+
+thread_failure:
+	sem_destroy(&alog_.has_records);
+sem_failure:
+	free(alog_.records);
+	alog_.records = NULL;
+	return -1;
+}
+
+/* A message that is being written while this runs may be lost, so the ring
+ * and the semaphore are kept until the next start.
+ */
+void alog_stop(void)
+{
+	if (!alog_.is_running)
+		return;
+
+	co_atomic_store_release(&alog_.is_running, 0);
+	co_atomic_store_release(&alog_.is_stopping, 1);
+	sem_post(&alog_.has_records);
+	pthread_join(alog_.thread, NULL);
+}
+
+uint64_t alog_get_n_dropped(void)
+{
+	return co_atomic_load_relaxed(&alog_.n_dropped);
+}
@@ -0,0 +1,262 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "async-writer.h"
+#include "co_atomic.h"
+
+static inline int aw__is_full(const struct async_writer* self)
+{
+	return self->head - co_atomic_load(&self->tail) > self->mask;
+}
+
+static int aw__write(struct async_writer* self, const char* data,
+		     size_t size)
+{
+	while (size > 0) {
+		ssize_t n = write(self->fd, data, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n < 0)
+			return -1;
+
+		data += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/* The formatting thread only takes the lock when the writer is asleep, so the
+ * head and the flag are stored and loaded in sequential order on both sides.
+ */
+static void aw__wait_for_records(struct async_writer* self)
+{
+	pthread_mutex_lock(&self->lock);
+	co_atomic_store(&self->is_writer_waiting, 1);
+
+	while (co_atomic_load(&self->head) == self->tail && !self->is_stopping)
+		pthread_cond_wait(&self->has_records, &self->lock);
+
+	co_atomic_store(&self->is_writer_waiting, 0);
+	pthread_mutex_unlock(&self->lock);
+}
+
+static void aw__wake_formatter(struct async_writer* self)
+{
+	if (!co_atomic_load(&self->is_formatter_waiting))
+		return;
+
+	pthread_mutex_lock(&self->lock);
+	pthread_cond_signal(&self->has_room);
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* Records are released as soon as they have been copied, so the ring fills up
+ * again while the block is being written.
+ */
+static void* aw__run(void* context)
+{
+	struct async_writer* self = context;
+
+	while (1) {
+		size_t tail = self->tail;
+		size_t head = co_atomic_load(&self->head);
+
+		if (tail == head) {
+			if (co_atomic_load(&self->is_stopping))
+				break;
+
+			aw__wait_for_records(self);
+			continue;
+		}
+
+		size_t size = 0;
+		for (; tail != head; ++tail) {
+			const struct aw_record* record =
+				&self->records[tail & self->mask];
+
+			if (size + record->length > AW_BLOCK_SIZE)
+				break;
+
+			memcpy(self->block + size, record->text,
+			       record->length);
+			size += record->length;
+		}
+
+		co_atomic_store(&self->tail, tail);
+		aw__wake_formatter(self);
+
+		if (self->error == 0 && aw__write(self, self->block, size) < 0)
+			co_atomic_store(&self->error, errno);
+	}
+
+	return NULL;
+}
+
+int aw_init(struct async_writer* self, int fd, size_t n_records,
+	    enum aw_flags flags)
+{
+	memset(self, 0, sizeof(*self));
+	self->fd = fd;
+	self->flags = flags;
+
+	size_t length = 1;
+	while (length < n_records)
+		length <<= 1;
+
+	self->mask = length - 1;
+
+	self->records = malloc(length * sizeof(*self->records));
+	if (!self->records)
+		return -1;
+
+	self->block = malloc(AW_BLOCK_SIZE);
+	if (!self->block)
+		goto block_failure;
+
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_cond_init(&self->has_records, NULL);
+	pthread_cond_init(&self->has_room, NULL);
+
+	errno = pthread_create(&self->thread, NULL, aw__run, self);
+	if (errno != 0)
+		goto thread_failure;
+
+	return 0;
+
+thread_failure:
+	pthread_cond_destroy(&self->has_room);
+	pthread_cond_destroy(&self->has_records);
+	pthread_mutex_destroy(&self->lock);
+	free(self->block);
+block_failure:
+	free(self->records);
+	return -1;
+}
+
+void aw_destroy(struct async_writer* self)
+{
+	aw_commit(self);
+
+	pthread_mutex_lock(&self->lock);
+	co_atomic_store(&self->is_stopping, 1);
+	pthread_cond_signal(&self->has_records);
+	pthread_mutex_unlock(&self->lock);
+
+	pthread_join(self->thread, NULL);
+
+	pthread_cond_destroy(&self->has_room);
+	pthread_cond_destroy(&self->has_records);
+	pthread_mutex_destroy(&self->lock);
+	free(self->block);
+	free(self->records);
+}
+
+static void aw__wait_for_room(struct async_writer* self)
+{
+	pthread_mutex_lock(&self->lock);
+	co_atomic_store(&self->is_formatter_waiting, 1);
+
+	while (aw__is_full(self))
+		pthread_cond_wait(&self->has_room, &self->lock);
+
+	co_atomic_store(&self->is_formatter_waiting, 0);
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* A record that has no room in the ring is still formatted, into scratch space,
+ * so that callers need not care. The writer may just not have been scheduled
+ * yet, so it is given a chance to run before anything is dropped.
+ */
+static struct aw_record* aw__get_current(struct async_writer* self)
+{
+	if (self->current)
+		return self->current;
+
+	if (aw__is_full(self) && self->flags & AW_BLOCK)
+		aw__wait_for_room(self);
+	else if (aw__is_full(self))
+		sched_yield();
+
+	self->current = aw__is_full(self) ? &self->scratch
+			: &self->records[self->head & self->mask];
+	self->current->length = 0;
+	return self->current;
+}
+
+void aw_printf(struct async_writer* self, const char* fmt, ...)
+{
+	struct aw_record* record = aw__get_current(self);
+	size_t room = sizeof(record->text) - record->length;
+
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(record->text + record->length, room, fmt, ap);
+	va_end(ap);
+
+	if (n < 0)
+		return;
+
+	/* The terminating null character is not part of the record */
+	record->length += (size_t)n < room ? (size_t)n : room - 1;
+}
+
+void aw_commit(struct async_writer* self)
+{
+	struct aw_record* record = self->current;
+	if (!record)
+		return;
+
+	self->current = NULL;
+
+	if (record->length == 0)
+		return;
+
+	if (record->length == sizeof(record->text) - 1)
+		record->text[record->length - 1] = '\n';
+
+	if (record == &self->scratch) {
+		co_atomic_store(&self->n_dropped, self->n_dropped + 1);
+		return;
+	}
+
+	co_atomic_store(&self->head, self->head + 1);
+
+	if (!co_atomic_load(&self->is_writer_waiting))
+		return;
+
+	pthread_mutex_lock(&self->lock);
+	pthread_cond_signal(&self->has_records);
+	pthread_mutex_unlock(&self->lock);
+}
+
+uint64_t aw_get_n_dropped(const struct async_writer* self)
+{
+	return co_atomic_load(&self->n_dropped);
+}
+
+int aw_get_error(const struct async_writer* self)
+{
+	return co_atomic_load(&self->error);
+}
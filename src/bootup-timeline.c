@@ -0,0 +1,267 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "canopen.h"
+#include "bootup-timeline.h"
+
+#define BOOTUP_N_NODES (CANOPEN_NODEID_MAX + 1)
+
+/* Phases given for each node by bootup_timeline_describe() */
+#define BOOTUP_N_DESCRIBED 3
+
+static const char* bootup__phase_names[] = {
+#define X(step, name) [BOOTUP_ ## step] = name,
+	BOOTUP_STEPS(X)
+#undef X
+};
+
+struct bootup__phase {
+	enum bootup_step step;
+	uint64_t us;
+	int nodeid;
+};
+
+const char* bootup_phase_name(enum bootup_step step)
+{
+	return step < BOOTUP_N_STEPS ? bootup__phase_names[step] : "unknown";
+}
+
+void bootup_timeline_start(struct bootup_timeline* self, uint64_t start)
+{
+	for (int i = 0; i < BOOTUP_N_STEPS; ++i)
+		co_atomic_store_relaxed(&self->time[i], 0);
+
+	co_atomic_store_relaxed(&self->start, start);
+}
+
+void bootup_timeline_read(struct bootup_timeline* dst,
+			  const struct bootup_timeline* src)
+{
+	dst->start = co_atomic_load_relaxed(&src->start);
+
+	for (int i = 0; i < BOOTUP_N_STEPS; ++i)
+		dst->time[i] = co_atomic_load_relaxed(&src->time[i]);
+}
+
+uint64_t bootup_timeline_phase(const struct bootup_timeline* self,
+			       enum bootup_step step)
+{
+	uint64_t end = self->time[step];
+	if (end == 0)
+		return 0;
+
+	uint64_t begin = self->start;
+	for (int i = step - 1; i >= 0; --i)
+		if (self->time[i]) {
+			begin = self->time[i];
+			break;
+		}
+
+	return end > begin ? end - begin : 0;
+}
+
+uint64_t bootup_timeline_total(const struct bootup_timeline* self)
+{
+	for (int i = BOOTUP_N_STEPS - 1; i >= 0; --i)
+		if (self->time[i])
+			return self->time[i] > self->start
+			     ? self->time[i] - self->start : 0;
+
+	return 0;
+}
+
+static int bootup__cmp_phase(const void* a, const void* b)
+{
+	const struct bootup__phase* pa = a;
+	const struct bootup__phase* pb = b;
+
+	if (pa->us != pb->us)
+		return pa->us < pb->us ? 1 : -1;
+
+	return (int)pa->step - (int)pb->step;
+}
+
+struct bootup__node {
+	int nodeid;
+	uint64_t total;
+};
+
+static int bootup__cmp_node(const void* a, const void* b)
+{
+	const struct bootup__node* na = a;
+	const struct bootup__node* nb = b;
+
+	if (na->total != nb->total)
+		return na->total < nb->total ? 1 : -1;
+
+	return na->nodeid - nb->nodeid;
+}
+
+size_t bootup_timeline_rank(const struct bootup_timeline* timelines,
+			    int* nodeids, size_t n)
+{
+	struct bootup__node nodes[BOOTUP_N_NODES];
+	size_t n_nodes = 0;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct bootup_timeline t;
+		bootup_timeline_read(&t, &timelines[i]);
+
+		uint64_t total = bootup_timeline_total(&t);
+		if (total == 0)
+			continue;
+
+		nodes[n_nodes].nodeid = i;
+		nodes[n_nodes].total = total;
+		++n_nodes;
+	}
+
+	qsort(nodes, n_nodes, sizeof(nodes[0]), bootup__cmp_node);
+
+	if (n > n_nodes)
+		n = n_nodes;
+
+	for (size_t i = 0; i < n; ++i)
+		nodeids[i] = nodes[i].nodeid;
+
+	return n;
+}
+
+static inline unsigned long long bootup__ms(uint64_t us)
+{
+	return us / 1000ULL;
+}
+
+void bootup_timeline_describe(char* buf, size_t size,
+			      const struct bootup_timeline* self)
+{
+	struct bootup_timeline t;
+	struct bootup__phase phases[BOOTUP_N_STEPS];
+
+	bootup_timeline_read(&t, self);
+
+	for (int i = 0; i < BOOTUP_N_STEPS; ++i) {
+		phases[i].step = i;
+		phases[i].us = bootup_timeline_phase(&t, i);
+		phases[i].nodeid = 0;
+	}
+
+	qsort(phases, BOOTUP_N_STEPS, sizeof(phases[0]), bootup__cmp_phase);
+
+	int len = snprintf(buf, size, "%llu ms",
+			   bootup__ms(bootup_timeline_total(&t)));
+
+	for (int i = 0; i < BOOTUP_N_DESCRIBED && phases[i].us > 0; ++i) {
+		if (len < 0 || (size_t)len >= size)
+			return;
+
+		len += snprintf(buf + len, size - len, "%s%s %llu ms",
+				i == 0 ? " (" : ", ",
+				bootup_phase_name(phases[i].step),
+				bootup__ms(phases[i].us));
+	}
+
+	if (phases[0].us > 0 && len >= 0 && (size_t)len < size)
+		snprintf(buf + len, size - len, ")");
+}
+
+void bootup_timeline_describe_phases(char* buf, size_t size,
+				     const struct bootup_timeline* timelines)
+{
+	struct bootup__phase phases[BOOTUP_N_STEPS];
+
+	for (int i = 0; i < BOOTUP_N_STEPS; ++i) {
+		phases[i].step = i;
+		phases[i].us = 0;
+		phases[i].nodeid = 0;
+	}
+
+	for (int id = CANOPEN_NODEID_MIN; id <= CANOPEN_NODEID_MAX; ++id) {
+		struct bootup_timeline t;
+		bootup_timeline_read(&t, &timelines[id]);
+
+		for (int i = 0; i < BOOTUP_N_STEPS; ++i) {
+			uint64_t us = bootup_timeline_phase(&t, i);
+			if (us > phases[i].us) {
+				phases[i].us = us;
+				phases[i].nodeid = id;
+			}
+		}
+	}
+
+	qsort(phases, BOOTUP_N_STEPS, sizeof(phases[0]), bootup__cmp_phase);
+
+	int len = 0;
+	if (size > 0)
+		buf[0] = '\0';
+
+	for (int i = 0; i < BOOTUP_N_STEPS && phases[i].us > 0; ++i) {
+		if (len < 0 || (size_t)len >= size)
+			return;
+
+		len += snprintf(buf + len, size - len, "%s%s %llu ms (node %d)",
+				i == 0 ? "" : ", ",
+				bootup_phase_name(phases[i].step),
+				bootup__ms(phases[i].us), phases[i].nodeid);
+	}
+}
+
+void bootup_timeline_write_json(FILE* output,
+				const struct bootup_timeline* timelines)
+{
+	const char* separator = "";
+
+	fprintf(output, "{\"nodes\":{");
+
+	for (int id = CANOPEN_NODEID_MIN; id <= CANOPEN_NODEID_MAX; ++id) {
+		struct bootup_timeline t;
+		bootup_timeline_read(&t, &timelines[id]);
+
+		if (bootup_timeline_is_empty(&t))
+			continue;
+
+		fprintf(output, "%s\"%d\":{\"total_us\":%llu,\"phases_us\":{",
+			separator, id,
+			(unsigned long long)bootup_timeline_total(&t));
+
+		const char* phase_separator = "";
+		for (int i = 0; i < BOOTUP_N_STEPS; ++i) {
+			if (!t.time[i])
+				continue;
+
+			fprintf(output, "%s\"%s\":%llu", phase_separator,
+				bootup_phase_name(i),
+				(unsigned long long)bootup_timeline_phase(&t, i));
+			phase_separator = ",";
+		}
+
+		fprintf(output, "}}");
+		separator = ",";
+	}
+
+	int nodeids[BOOTUP_N_NODES];
+	size_t n = bootup_timeline_rank(timelines, nodeids, BOOTUP_N_NODES);
+
+	fprintf(output, "},\"slowest\":[");
+	for (size_t i = 0; i < n; ++i)
+		fprintf(output, "%s%d", i > 0 ? "," : "", nodeids[i]);
+	fprintf(output, "]}\r\n");
+}
@@ -0,0 +1,409 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+
+#include "bus-load.h"
+#include "socketcan.h"
+#include "canopen.h"
+
+#define BL_CRC15_POLY 0x4599
+
+/* CRC delimiter, ACK slot, ACK delimiter, end of frame and interframe space */
+#define BL_TRAILER_BITS 13
+
+struct bl__stuffer {
+	unsigned int n_bits;
+	unsigned int run;
+	int last;
+	uint16_t crc;
+};
+
+static const uint8_t bl__fd_lengths[] = { 8, 12, 16, 20, 24, 32, 48, 64 };
+
+/* After five equal bits, a bit of the opposite value is inserted. It counts
+ * towards the next run.
+ */
+static inline void bl__stuff(struct bl__stuffer* self, int bit)
+{
+	self->n_bits++;
+
+	if (bit != self->last) {
+		self->last = bit;
+		self->run = 1;
+		return;
+	}
+
+	if (++self->run < 5)
+		return;
+
+	self->n_bits++;
+	self->last = !bit;
+	self->run = 1;
+}
+
+static inline void bl__update_crc(struct bl__stuffer* self, int bit)
+{
+	int next = bit ^ ((self->crc >> 14) & 1);
+
+	self->crc = (self->crc << 1) & 0x7fff;
+	if (next)
+		self->crc ^= BL_CRC15_POLY;
+}
+
+static void bl__push(struct bl__stuffer* self, uint32_t value, int n)
+{
+	for (int i = n - 1; i >= 0; --i) {
+		int bit = (value >> i) & 1;
+
+		bl__update_crc(self, bit);
+		bl__stuff(self, bit);
+	}
+}
+
+static unsigned int bl__get_fd_dlc(size_t length)
+{
+	if (length <= 8)
+		return length;
+
+	for (unsigned int i = 1; i < sizeof(bl__fd_lengths); ++i)
+		if (length <= bl__fd_lengths[i])
+			return 8 + i;
+
+	return 15;
+}
+
+static size_t bl__get_fd_length(unsigned int dlc)
+{
+	return dlc <= 8 ? dlc : bl__fd_lengths[dlc - 8];
+}
+
+/* The fields of FD frames up to the DLC are those of classic frames, with the
+ * reserved bit after RTR (RRS) always dominant, and FDF, res, BRS and ESI in
+ * place of the reserved bits.
+ */
+static void bl__push_header(struct bl__stuffer* s, const struct can_frame* cf,
+			    int is_fd, int is_rtr)
+{
+	const struct canfd_frame* cfd = (const struct canfd_frame*)cf;
+
+	bl__push(s, 0, 1); /* SOF */
+
+	if (cf->can_id & CAN_EFF_FLAG) {
+		uint32_t id = cf->can_id & CAN_EFF_MASK;
+
+		bl__push(s, id >> 18, 11);
+		bl__push(s, 3, 2); /* SRR and IDE */
+		bl__push(s, id & 0x3ffff, 18);
+		bl__push(s, is_rtr, 1);
+	} else {
+		bl__push(s, cf->can_id & CAN_SFF_MASK, 11);
+		bl__push(s, is_rtr, 1);
+		bl__push(s, 0, 1); /* IDE */
+	}
+
+	if (is_fd) {
+		bl__push(s, 2, 2); /* FDF and res */
+		bl__push(s, !!(cfd->flags & CANFD_BRS), 1);
+		bl__push(s, 0, 1); /* ESI */
+	} else {
+		bl__push(s, 0, cf->can_id & CAN_EFF_FLAG ? 2 : 1);
+	}
+}
+
+/* The stuff count and the CRC of FD frames have a fixed stuff bit before them
+ * and after every four bits.
+ */
+static unsigned int bl__get_fd_tail_bits(size_t length)
+{
+	unsigned int n = 4 + (length > 16 ? 21 : 17);
+
+	return n + n / 4 + 1;
+}
+
+unsigned int bl_get_frame_bits(const struct can_frame* cf)
+{
+	const struct canfd_frame* cfd = (const struct canfd_frame*)cf;
+	int is_fd = cfd->flags & CANFD_FDF || cf->can_dlc > CAN_MAX_DLEN;
+	int is_rtr = !is_fd && cf->can_id & CAN_RTR_FLAG;
+
+	unsigned int dlc = is_fd ? bl__get_fd_dlc(cf->can_dlc)
+				 : cf->can_dlc > 8 ? 8 : cf->can_dlc;
+	size_t length = is_rtr ? 0 : bl__get_fd_length(dlc);
+
+	struct bl__stuffer s = { .last = -1 };
+
+	bl__push_header(&s, cf, is_fd, is_rtr);
+	bl__push(&s, dlc, 4);
+
+	/* FD frames are padded with zeros up to the next valid length */
+	for (size_t i = 0; i < length; ++i)
+		bl__push(&s, i < cf->can_dlc ? cfd->data[i] : 0, 8);
+
+	if (is_fd)
+		return s.n_bits + bl__get_fd_tail_bits(length)
+		     + BL_TRAILER_BITS;
+
+	uint16_t crc = s.crc;
+	for (int i = 14; i >= 0; --i)
+		bl__stuff(&s, (crc >> i) & 1);
+
+	return s.n_bits + BL_TRAILER_BITS;
+}
+
+void bl_meter_init(struct bl_meter* self, unsigned int bitrate)
+{
+	memset(self, 0, sizeof(*self));
+	self->bitrate = bitrate;
+	pthread_mutex_init(&self->lock, NULL);
+}
+
+void bl_meter_destroy(struct bl_meter* self)
+{
+	pthread_mutex_destroy(&self->lock);
+}
+
+static void bl_meter__update(struct bl_meter* self, uint64_t now)
+{
+	if (self->last_time == 0) {
+		self->last_time = now;
+		self->last_bits = co_atomic_load_relaxed(&self->n_bits);
+		return;
+	}
+
+	uint64_t elapsed = now - self->last_time;
+	if (now < self->last_time || elapsed < BL_METER_PERIOD)
+		return;
+
+	uint64_t n_bits = co_atomic_load_relaxed(&self->n_bits);
+	uint64_t bits_per_s = (n_bits - self->last_bits) * 1000000ULL / elapsed;
+	uint64_t sample = bits_per_s * 1000ULL / self->bitrate;
+
+	/* Frames that were counted before they went out can make a short
+	 * sample look like more than the bus could take.
+	 */
+	if (sample > 1000)
+		sample = 1000;
+
+	if (elapsed >= BL_METER_TAU)
+		self->load = sample;
+	else
+		self->load = ((int64_t)self->load * (BL_METER_TAU - elapsed)
+			      + (int64_t)sample * elapsed) / BL_METER_TAU;
+
+	self->last_time = now;
+	self->last_bits = n_bits;
+}
+
+unsigned int bl_meter_update(struct bl_meter* self, uint64_t now)
+{
+	if (self->bitrate == 0)
+		return 0;
+
+	pthread_mutex_lock(&self->lock);
+	bl_meter__update(self, now);
+	unsigned int load = self->load;
+	pthread_mutex_unlock(&self->lock);
+
+	return load;
+}
+
+enum bl_group bl_get_group(uint32_t cob_id)
+{
+	struct can_frame cf = { .can_id = cob_id };
+	struct canopen_msg msg;
+
+	if (cob_id & CAN_EFF_FLAG || canopen_get_object_type(&msg, &cf) < 0)
+		return BL_GROUP_OTHER;
+
+	switch (msg.object) {
+	case CANOPEN_NMT: return BL_GROUP_NMT;
+	case CANOPEN_SYNC: return BL_GROUP_SYNC;
+	case CANOPEN_TIMESTAMP: return BL_GROUP_TIME;
+	case CANOPEN_EMCY: return BL_GROUP_EMCY;
+	case CANOPEN_TPDO1 ... CANOPEN_RPDO4: return BL_GROUP_PDO;
+	case CANOPEN_TSDO ... CANOPEN_RSDO: return BL_GROUP_SDO;
+	case CANOPEN_HEARTBEAT: return BL_GROUP_HEARTBEAT;
+	default: break;
+	}
+
+	return BL_GROUP_OTHER;
+}
+
+static void bl__add(struct bl_counter* dst, const struct bl_counter* src)
+{
+	dst->n_frames += src->n_frames;
+	dst->n_bytes += src->n_bytes;
+	dst->n_bits += src->n_bits;
+}
+
+/* NMT, SYNC and TIME belong to node 0 */
+void bl_summarize(const struct bus_load* self, struct bl_summary* summary)
+{
+	memset(summary, 0, sizeof(*summary));
+
+	for (uint32_t i = 0; i < BL_N_COB_IDS; ++i) {
+		const struct bl_counter* counter = &self->cob_ids[i];
+		if (counter->n_frames == 0)
+			continue;
+
+		uint32_t cob_id = i < BL_N_COB_IDS - 1 ? i : CAN_EFF_FLAG;
+		enum bl_group group = bl_get_group(cob_id);
+
+		bl__add(&summary->total, counter);
+		bl__add(&summary->groups[group], counter);
+
+		if (group == BL_GROUP_OTHER)
+			continue;
+
+		struct can_frame cf = { .can_id = cob_id };
+		struct canopen_msg msg;
+		canopen_get_object_type(&msg, &cf);
+		bl__add(&summary->nodes[msg.id & 0x7f], counter);
+	}
+}
+
+struct bl__row {
+	unsigned int index;
+	struct bl_counter counter;
+};
+
+static int bl__cmp_rows(const void* a, const void* b)
+{
+	const struct bl__row* x = a;
+	const struct bl__row* y = b;
+
+	if (x->counter.n_bits != y->counter.n_bits)
+		return x->counter.n_bits < y->counter.n_bits ? 1 : -1;
+
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static size_t bl__sort(struct bl__row* rows, const struct bl_counter* counters,
+		       size_t n)
+{
+	size_t length = 0;
+
+	for (size_t i = 0; i < n; ++i)
+		if (counters[i].n_frames) {
+			rows[length].index = i;
+			rows[length++].counter = counters[i];
+		}
+
+	qsort(rows, length, sizeof(*rows), bl__cmp_rows);
+	return length;
+}
+
+static void bl__print_counter(FILE* stream, const struct bl_counter* counter,
+			      double seconds, double capacity)
+{
+	fprintf(stream, " %10.1f %11.1f %7.2f%%\n",
+		counter->n_frames / seconds, counter->n_bytes / seconds,
+		capacity > 0.0 ? 100.0 * counter->n_bits / capacity : 0.0);
+}
+
+static const char* bl__group_names[BL_N_GROUPS] = {
+	[BL_GROUP_NMT] = "NMT",
+	[BL_GROUP_SYNC] = "SYNC",
+	[BL_GROUP_TIME] = "TIME",
+	[BL_GROUP_EMCY] = "EMCY",
+	[BL_GROUP_PDO] = "PDO",
+	[BL_GROUP_SDO] = "SDO",
+	[BL_GROUP_HEARTBEAT] = "HEARTBEAT",
+	[BL_GROUP_OTHER] = "other",
+};
+
+static void bl__print_cob_ids(const struct bus_load* self, FILE* stream,
+			      double seconds, double capacity, size_t n_rows)
+{
+	struct bl__row* rows = malloc(BL_N_COB_IDS * sizeof(*rows));
+	if (!rows)
+		return;
+
+	size_t length = bl__sort(rows, self->cob_ids, BL_N_COB_IDS);
+
+	fprintf(stream, "\n  COB-ID  type       node   frames/s     bytes/s"
+			"     load\n");
+
+	for (size_t i = 0; i < length && i < n_rows; ++i) {
+		unsigned int index = rows[i].index;
+
+		if (index == BL_N_COB_IDS - 1) {
+			fprintf(stream, "  ext     %-10s    -", "other");
+		} else {
+			struct can_frame cf = { .can_id = index };
+			struct canopen_msg msg;
+
+			if (canopen_get_object_type(&msg, &cf) < 0)
+				fprintf(stream, "  0x%03x   %-10s    -", index,
+					"other");
+			else
+				fprintf(stream, "  0x%03x   %-10s %4d", index,
+					canopen_object_type_to_string_exact(
+						msg.object), msg.id);
+		}
+
+		bl__print_counter(stream, &rows[i].counter, seconds, capacity);
+	}
+
+	free(rows);
+}
+
+static void bl__print_nodes(const struct bl_summary* summary, FILE* stream,
+			    double seconds, double capacity, size_t n_rows)
+{
+	struct bl__row rows[128];
+	size_t length = bl__sort(rows, summary->nodes, 128);
+
+	fprintf(stream, "\n  node               frames/s     bytes/s"
+			"     load\n");
+
+	for (size_t i = 0; i < length && i < n_rows; ++i) {
+		fprintf(stream, "  %4u              ", rows[i].index);
+		bl__print_counter(stream, &rows[i].counter, seconds, capacity);
+	}
+}
+
+void bl_print(const struct bus_load* self, FILE* stream, uint64_t interval,
+	      unsigned int bitrate, size_t n_rows)
+{
+	struct bl_summary summary;
+	bl_summarize(self, &summary);
+
+	double seconds = interval ? interval / 1000000.0 : 1.0;
+	double capacity = (double)bitrate * seconds;
+	const struct bl_counter* total = &summary.total;
+
+	fprintf(stream, "Bus load %.2f%% of %u kbit/s, %.1f frames/s,"
+			" %.1f bytes/s\n",
+		capacity > 0.0 ? 100.0 * total->n_bits / capacity : 0.0,
+		bitrate / 1000, total->n_frames / seconds,
+		total->n_bytes / seconds);
+
+	fprintf(stream, "\n  type                 frames/s     bytes/s"
+			"     load\n");
+
+	for (int i = 0; i < BL_N_GROUPS; ++i) {
+		if (summary.groups[i].n_frames == 0)
+			continue;
+
+		fprintf(stream, "  %-18s", bl__group_names[i]);
+		bl__print_counter(stream, &summary.groups[i], seconds,
+				  capacity);
+	}
+
+	bl__print_cob_ids(self, stream, seconds, capacity, n_rows);
+	bl__print_nodes(&summary, stream, seconds, capacity, n_rows);
+}
@@ -13,6 +13,7 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,55 +21,160 @@
 
 #include "canopen/byteorder.h"
 
-#ifdef __powerpc__
+#define IS_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+/* memcpy() of a constant size turns into a single unaligned load or store */
+static inline void swap16(void* dst, const void* src)
+{
+	uint16_t v;
+	memcpy(&v, src, sizeof(v));
+	v = __builtin_bswap16(v);
+	memcpy(dst, &v, sizeof(v));
+}
+
+static inline void swap32(void* dst, const void* src)
+{
+	uint32_t v;
+	memcpy(&v, src, sizeof(v));
+	v = __builtin_bswap32(v);
+	memcpy(dst, &v, sizeof(v));
+}
+
+static inline void swap64(void* dst, const void* src)
+{
+	uint64_t v;
+	memcpy(&v, src, sizeof(v));
+	v = __builtin_bswap64(v);
+	memcpy(dst, &v, sizeof(v));
+}
+
+/* 16 bytes at a time on targets that can shuffle bytes within a vector
+ * register. Elsewhere GCC makes a byte at a time of this, which is slower than
+ * bswap. Returns the number of bytes done.
+ */
+#if defined(__SSSE3__) || defined(__ALTIVEC__) || defined(__ARM_NEON)
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+static const v16u8 mask16_ = { 1, 0, 3, 2, 5, 4, 7, 6,
+			       9, 8, 11, 10, 13, 12, 15, 14 };
+static const v16u8 mask32_ = { 3, 2, 1, 0, 7, 6, 5, 4,
+			       11, 10, 9, 8, 15, 14, 13, 12 };
+static const v16u8 mask64_ = { 7, 6, 5, 4, 3, 2, 1, 0,
+			       15, 14, 13, 12, 11, 10, 9, 8 };
+
+static inline size_t swap_blocks(uint8_t* d, const uint8_t* s, size_t size,
+				 v16u8 mask)
+{
+	size_t i;
+
+	for (i = 0; i + sizeof(v16u8) <= size; i += sizeof(v16u8)) {
+		v16u8 v;
+		memcpy(&v, s + i, sizeof(v));
+		v = __builtin_shuffle(v, mask);
+		memcpy(d + i, &v, sizeof(v));
+	}
+
+	return i;
+}
+
+#else
+
+#define swap_blocks(d, s, size, mask) ((size_t)0)
+
+#endif
+
+static void swap_array16(uint8_t* d, const uint8_t* s, size_t n)
+{
+	for (size_t i = swap_blocks(d, s, n * 2, mask16_) / 2; i < n; ++i)
+		swap16(d + i * 2, s + i * 2);
+}
+
+static void swap_array32(uint8_t* d, const uint8_t* s, size_t n)
+{
+	for (size_t i = swap_blocks(d, s, n * 4, mask32_) / 4; i < n; ++i)
+		swap32(d + i * 4, s + i * 4);
+}
+
+static void swap_array64(uint8_t* d, const uint8_t* s, size_t n)
+{
+	for (size_t i = swap_blocks(d, s, n * 8, mask64_) / 8; i < n; ++i)
+		swap64(d + i * 8, s + i * 8);
+}
+
+void byteorder__swap_array(void* dst, const void* src, size_t size, size_t n)
+{
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	switch (size) {
+	case 1:
+		if (d != s)
+			memcpy(d, s, n);
+		break;
+	case 2: swap_array16(d, s, n); break;
+	case 4: swap_array32(d, s, n); break;
+	case 8: swap_array64(d, s, n); break;
+	default:
+		abort();
+	}
+}
+
+#if IS_BIG_ENDIAN
+
+/* Reverse the order of size bytes, for the sizes that have no instruction */
+static void reverse(uint8_t* d, const uint8_t* s, size_t size)
+{
+	uint8_t tmp[8];
+	assert(size <= sizeof(tmp));
+
+	for (size_t i = 0; i < size; ++i)
+		tmp[size - 1 - i] = s[i];
+
+	memcpy(d, tmp, size);
+}
 
 void byteorder(void* dst, const void* src, size_t size)
 {
-	uint8_t* d = (uint8_t*)dst;
-	uint8_t* s = (uint8_t*)src;
-	int i = (int)size;
-
-	switch(size)
-	{
-	case 8: d[i - 1] = s[size - i]; --i;
-		d[i - 1] = s[size - i]; --i;
-		d[i - 1] = s[size - i]; --i;
-		d[i - 1] = s[size - i]; --i;
-	case 4: d[i - 1] = s[size - i]; --i;
-		d[i - 1] = s[size - i]; --i;
-	case 2: d[i - 1] = s[size - i]; --i;
-	case 1: d[i - 1] = s[size - i];
+	switch (size) {
+	case 8: swap64(dst, src); break;
+	case 4: swap32(dst, src); break;
+	case 2: swap16(dst, src); break;
+	case 1: *(uint8_t*)dst = *(const uint8_t*)src; break;
 	case 0: break;
 	default:
 		abort();
 	}
 }
 
+/* The src_size bytes of src end up reversed at the end of dst, which is where
+ * the least significant bytes of a big endian value are.
+ */
 void byteorder2(void* dst, const void* src, size_t dst_size, size_t src_size)
 {
-	uint8_t* d = (uint8_t*)dst;
-	uint8_t* s = (uint8_t*)src;
-	int d_i = dst_size;
-	int s_i = 0;
-
 	assert(dst_size >= src_size);
 
-	switch(src_size)
-	{
-	case 8: d[--d_i] = s[s_i++];
-	case 7:	d[--d_i] = s[s_i++];
-	case 6:	d[--d_i] = s[s_i++];
-	case 5:	d[--d_i] = s[s_i++];
-	case 4: d[--d_i] = s[s_i++];
-	case 3:	d[--d_i] = s[s_i++];
-	case 2: d[--d_i] = s[s_i++];
-	case 1: d[--d_i] = s[s_i++];
+	uint8_t* d = (uint8_t*)dst + dst_size - src_size;
+
+	switch (src_size) {
+	case 8: swap64(d, src); break;
+	case 4: swap32(d, src); break;
+	case 2: swap16(d, src); break;
+	case 1: *d = *(const uint8_t*)src; break;
 	case 0: break;
+	case 3: case 5: case 6: case 7:
+		reverse(d, src, src_size);
+		break;
 	default:
 		abort();
 	}
 }
 
+void byteorder_array(void* dst, const void* src, size_t size, size_t n)
+{
+	byteorder__swap_array(dst, src, size, n);
+}
+
 #else
 
 void byteorder(void* dst, const void* src, size_t size)
@@ -82,5 +188,10 @@ void byteorder2(void* dst, const void* src, size_t dst_size, size_t src_size)
 	memcpy(dst, src, src_size);
 }
 
-#endif
+void byteorder_array(void* dst, const void* src, size_t size, size_t n)
+{
+	if (dst != src)
+		memcpy(dst, src, size * n);
+}
 
+#endif
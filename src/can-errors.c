@@ -0,0 +1,187 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "can-errors.h"
+
+/* Thresholds of the error counters, from the CAN specification */
+#define CAN_ERRORS_WARNING_LIMIT 96
+#define CAN_ERRORS_PASSIVE_LIMIT 128
+
+void can_errors_init(struct can_errors* self, uint64_t hold_time)
+{
+	memset(self, 0, sizeof(*self));
+	self->hold_time = hold_time;
+}
+
+static inline void can_errors__count(uint64_t* counter)
+{
+	co_atomic_add_relaxed(counter, 1);
+}
+
+static enum can_errors_state
+can_errors__controller_state(const struct can_errors* self, uint8_t status)
+{
+	if (status & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE))
+		return CAN_ERRORS_PASSIVE;
+
+	if (status & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING))
+		return CAN_ERRORS_WARNING;
+
+	if (status & CAN_ERR_CRTL_ACTIVE)
+		return CAN_ERRORS_ACTIVE;
+
+	return self->state;
+}
+
+static enum can_errors_state can_errors__counter_state(unsigned int tx,
+						       unsigned int rx)
+{
+	unsigned int worst = tx > rx ? tx : rx;
+
+	if (worst >= CAN_ERRORS_PASSIVE_LIMIT)
+		return CAN_ERRORS_PASSIVE;
+
+	if (worst >= CAN_ERRORS_WARNING_LIMIT)
+		return CAN_ERRORS_WARNING;
+
+	return CAN_ERRORS_ACTIVE;
+}
+
+static void can_errors__set_state(struct can_errors* self,
+				  enum can_errors_state state, uint64_t now)
+{
+	if (state == self->state)
+		return;
+
+	switch (state) {
+	case CAN_ERRORS_WARNING:
+		can_errors__count(&self->n_warnings);
+		break;
+	case CAN_ERRORS_PASSIVE:
+		can_errors__count(&self->n_passive);
+		break;
+	case CAN_ERRORS_BUS_OFF:
+		can_errors__count(&self->n_bus_off);
+		self->bus_off_time = now;
+		break;
+	case CAN_ERRORS_ACTIVE:
+		break;
+	}
+
+	co_atomic_store_relaxed(&self->state, state);
+}
+
+int can_errors_on_frame(struct can_errors* self, const struct can_frame* cf,
+			uint64_t now)
+{
+	if (!(cf->can_id & CAN_ERR_FLAG))
+		return -1;
+
+	canid_t class = cf->can_id & CAN_ERR_MASK;
+	enum can_errors_state old_state = self->state;
+	enum can_errors_state state = old_state;
+
+	can_errors__count(&self->n_frames);
+
+	if (class & CAN_ERR_TX_TIMEOUT)
+		can_errors__count(&self->n_tx_timeouts);
+
+	if (class & CAN_ERR_LOSTARB)
+		can_errors__count(&self->n_lost_arbitration);
+
+	if (class & CAN_ERR_PROT)
+		can_errors__count(&self->n_protocol);
+
+	if (class & CAN_ERR_TRX)
+		can_errors__count(&self->n_transceiver);
+
+	if (class & CAN_ERR_ACK)
+		can_errors__count(&self->n_no_ack);
+
+	if (class & CAN_ERR_BUSERROR)
+		can_errors__count(&self->n_bus_errors);
+
+	if (class & CAN_ERR_CRTL) {
+		uint8_t status = cf->data[1];
+
+		if (status & (CAN_ERR_CRTL_RX_OVERFLOW
+			    | CAN_ERR_CRTL_TX_OVERFLOW))
+			can_errors__count(&self->n_overflows);
+
+		state = can_errors__controller_state(self, status);
+	}
+
+	if (class & CAN_ERR_CNT) {
+		co_atomic_store_relaxed(&self->tx_errors, cf->data[6]);
+		co_atomic_store_relaxed(&self->rx_errors, cf->data[7]);
+
+		/* The counters also tell when the controller has recovered,
+		 * which not all drivers report.
+		 */
+		if (!(class & CAN_ERR_CRTL) && state != CAN_ERRORS_BUS_OFF)
+			state = can_errors__counter_state(cf->data[6],
+							  cf->data[7]);
+	}
+
+	/* A restart leaves the controller error active with its counters
+	 * cleared. It is counted as an error so that traffic is let out
+	 * gradually.
+	 */
+	if (class & CAN_ERR_RESTARTED) {
+		can_errors__count(&self->n_restarts);
+		co_atomic_store_relaxed(&self->tx_errors, 0);
+		co_atomic_store_relaxed(&self->rx_errors, 0);
+		state = CAN_ERRORS_ACTIVE;
+	}
+
+	if (class & CAN_ERR_BUSOFF)
+		state = CAN_ERRORS_BUS_OFF;
+
+	/* Going from one state to a better one is not an error in itself */
+	if (class & ~(canid_t)(CAN_ERR_CNT | CAN_ERR_CRTL)
+	 || state > old_state
+	 || (class & CAN_ERR_CRTL && cf->data[1] & ~CAN_ERR_CRTL_ACTIVE))
+		co_atomic_store_relaxed(&self->last_error_time, now);
+
+	can_errors__set_state(self, state, now);
+	return state != old_state;
+}
+
+uint64_t can_errors_hold_until(const struct can_errors* self, uint64_t now)
+{
+	if (can_errors_get_state(self) >= CAN_ERRORS_PASSIVE)
+		return UINT64_MAX;
+
+	uint64_t last_error_time = co_atomic_load_relaxed(&self->last_error_time);
+	if (last_error_time == 0)
+		return now;
+
+	uint64_t until = last_error_time + self->hold_time;
+	return until > now ? until : now;
+}
+
+const char* can_errors_state_to_string(enum can_errors_state state)
+{
+	switch (state) {
+	case CAN_ERRORS_ACTIVE: return "active";
+	case CAN_ERRORS_WARNING: return "warning";
+	case CAN_ERRORS_PASSIVE: return "passive";
+	case CAN_ERRORS_BUS_OFF: return "bus-off";
+	}
+
+	return "unknown";
+}
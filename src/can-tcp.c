@@ -18,8 +18,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <mloop.h>
 
@@ -27,14 +29,77 @@
 #include "socketcan.h"
 #include "net-util.h"
 #include "sock.h"
+#include "can-wire.h"
+#include "can-tcp.h"
+#include "time-utils.h"
+
+/* Frames received from one socket are staged for the others until the batch
+ * has been forwarded, or until the flush delay expires, so that each one
+ * gets many frames per system call.
+ */
+#define CAN_TCP_BATCH_SIZE 64
+#define CAN_TCP_TXQ_SIZE 64
+
+/* TCP clients are written to without blocking. Whatever they can't take right
+ * away waits in a send queue of this many frames until the socket becomes
+ * writable again. This must be a power of two.
+ */
+#define CAN_TCP_SENDQ_SIZE 1024
+
+/* Frames are taken off the send queue and encoded this many at a time. Each
+ * one may need a timestamp record in front of it.
+ */
+#define CAN_TCP_WRITE_SIZE 256
+#define CAN_TCP_MAX_ENCODED_SIZE \
+	(CAN_WIRE_MAX_RECORD_SIZE + CAN_WIRE_HEADER_SIZE + 8)
+
+/* How long a client waits for the server to agree on the wire format, in ms */
+#define CAN_TCP_HELLO_TIMEOUT 1000
+
+/* Subscriptions beyond this many filters are ignored */
+#define CAN_TCP_MAX_FILTERS 64
 
 size_t strlcpy(char*, const char*, size_t);
 
+static unsigned int flush_delay_ = 0;
+static enum can_tcp_overflow overflow_ = CAN_TCP_OVERFLOW_DROP_OLDEST;
+static enum can_wire_format wire_format_ = CAN_WIRE_LEGACY;
+static int wire_flags_ = 0;
+static struct can_filter filters_[CAN_TCP_MAX_FILTERS];
+static size_t n_filters_ = 0;
+
 struct can_tcp;
 
+struct can_tcp_frame {
+	uint64_t timestamp;
+	struct can_frame cf;
+};
+
+/* A ring of frames in host order, and the encoded bytes of those that have
+ * been taken off it but not yet written.
+ */
+struct can_tcp_sendq {
+	struct can_tcp_frame* frames;
+	size_t head;
+	size_t length;
+	uint8_t* buffer;
+	size_t size;
+	size_t offset;
+};
+
 struct can_tcp_entry {
 	struct sock sock;
 	struct can_tcp* parent;
+	struct mloop_socket* socket;
+	struct can_tcp_sendq sendq;
+	int is_new;
+	int is_writing;
+	int is_dropped;
+	size_t max_lag;
+	uint64_t n_dropped;
+	size_t n_filters;
+	struct can_filter filters[CAN_TCP_MAX_FILTERS];
+	uint64_t sff_map[(CAN_SFF_MASK + 1) / 64]; /* Of standard data frames */
 	LIST_ENTRY(can_tcp_entry) links;
 };
 
@@ -49,8 +114,14 @@ struct can_tcp {
 	struct can_tcp_list list;
 	size_t ref;
 	enum can_tcp_state state;
+	unsigned int flush_delay;
+	enum can_tcp_overflow overflow;
+	struct mloop_timer* flush_timer;
+	LIST_ENTRY(can_tcp) links;
 };
 
+static LIST_HEAD(, can_tcp) bridges_ = LIST_HEAD_INITIALIZER(bridges_);
+
 static struct can_tcp* can_tcp__new(void)
 {
 	struct can_tcp* self = malloc(sizeof(*self));
@@ -62,12 +133,23 @@ static struct can_tcp* can_tcp__new(void)
 	LIST_INIT(&self->list);
 	self->ref = 1;
 	self->state = CAN_TCP_NEW;
+	self->flush_delay = flush_delay_;
+	self->overflow = overflow_;
+
+	LIST_INSERT_HEAD(&bridges_, self, links);
 
 	return self;
 }
 
 static void can_tcp__free(struct can_tcp* self)
 {
+	LIST_REMOVE(self, links);
+
+	if (self->flush_timer) {
+		mloop_timer_stop(self->flush_timer);
+		mloop_timer_unref(self->flush_timer);
+	}
+
 	free(self);
 }
 
@@ -82,36 +164,410 @@ static void can_tcp__unref(struct can_tcp* self)
 		can_tcp__free(self);
 }
 
-void my_sock_send(struct sock* sock, const struct can_frame* cf)
+static int can_tcp_sendq__init(struct can_tcp_sendq* self)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->frames = malloc(CAN_TCP_SENDQ_SIZE * sizeof(*self->frames));
+	if (!self->frames)
+		return -1;
+
+	self->buffer = malloc(CAN_TCP_WRITE_SIZE * CAN_TCP_MAX_ENCODED_SIZE);
+	if (!self->buffer) {
+		free(self->frames);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void can_tcp_sendq__destroy(struct can_tcp_sendq* self)
+{
+	free(self->buffer);
+	free(self->frames);
+}
+
+static inline int can_tcp_sendq__is_full(const struct can_tcp_sendq* self)
+{
+	return self->length == CAN_TCP_SENDQ_SIZE;
+}
+
+static inline int can_tcp_sendq__is_empty(const struct can_tcp_sendq* self)
+{
+	return self->length == 0 && self->offset == self->size;
+}
+
+static inline void can_tcp_sendq__push(struct can_tcp_sendq* self,
+				       const struct can_frame* cf,
+				       uint64_t timestamp)
+{
+	size_t index = (self->head + self->length++) & (CAN_TCP_SENDQ_SIZE - 1);
+	self->frames[index].timestamp = timestamp;
+	self->frames[index].cf = *cf;
+}
+
+static inline void can_tcp_sendq__drop_oldest(struct can_tcp_sendq* self)
+{
+	++self->head;
+	--self->length;
+}
+
+static void can_tcp_sendq__clear(struct can_tcp_sendq* self)
+{
+	self->head += self->length;
+	self->length = 0;
+	self->size = 0;
+	self->offset = 0;
+}
+
+static void can_tcp_sendq__encode(struct can_tcp_sendq* self,
+				  const struct sock* sock)
+{
+	int flags = sock_get_wire_flags(sock);
+	uint64_t current = 0;
+
+	size_t n = self->length < CAN_TCP_WRITE_SIZE
+		 ? self->length : CAN_TCP_WRITE_SIZE;
+
+	self->size = 0;
+	self->offset = 0;
+
+	for (size_t i = 0; i < n; ++i) {
+		struct can_tcp_frame* frame =
+			&self->frames[(self->head + i) & (CAN_TCP_SENDQ_SIZE - 1)];
+		uint8_t* dst = self->buffer + self->size;
+
+		if (flags < 0) {
+			struct can_frame cf = frame->cf;
+			cf.can_id = htonl(cf.can_id);
+			memcpy(dst, &cf, sizeof(cf));
+			self->size += sizeof(cf);
+			continue;
+		}
+
+		if (flags & CAN_WIRE_F_TIMESTAMPS)
+			self->size += can_wire_encode_timestamp(dst, &current,
+							       frame->timestamp);
+
+		self->size += can_wire_encode(self->buffer + self->size,
+					      &frame->cf);
+	}
+
+	self->head += n;
+	self->length -= n;
+}
+
+/* Returns -1 on errors other than EAGAIN */
+static int can_tcp_sendq__write(struct can_tcp_sendq* self,
+				const struct sock* sock, int flags)
+{
+	while (1) {
+		if (self->offset == self->size) {
+			if (self->length == 0)
+				return 0;
+
+			can_tcp_sendq__encode(self, sock);
+		}
+
+		ssize_t rc = send(sock->fd, self->buffer + self->offset,
+				  self->size - self->offset,
+				  flags | MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		self->offset += rc;
+	}
+}
+
+/* Writable events are only wanted while there is something left to write */
+static void can_tcp_entry__write(struct can_tcp_entry* self, int flags)
+{
+	struct can_tcp_sendq* sendq = &self->sendq;
+
+	/* The peer is gone. Reading from the socket will tell. */
+	if (can_tcp_sendq__write(sendq, &self->sock, flags) < 0)
+		can_tcp_sendq__clear(sendq);
+
+	int is_writing = !can_tcp_sendq__is_empty(sendq);
+	if (is_writing == self->is_writing)
+		return;
+
+	self->is_writing = is_writing;
+	mloop_socket_set_event(self->socket, MLOOP_SOCKET_EVENT_IN
+			       | MLOOP_SOCKET_EVENT_PRI
+			       | (is_writing ? MLOOP_SOCKET_EVENT_OUT : 0));
+}
+
+static void can_tcp_entry__enqueue(struct can_tcp_entry* self,
+				   const struct can_frame* cf,
+				   uint64_t timestamp)
+{
+	struct can_tcp_sendq* sendq = &self->sendq;
+
+	if (can_tcp_sendq__is_full(sendq)) {
+		switch (self->parent->overflow) {
+		case CAN_TCP_OVERFLOW_BLOCK:
+			can_tcp_sendq__write(sendq, &self->sock, 0);
+			break;
+		case CAN_TCP_OVERFLOW_DROP_CLIENT:
+			self->is_dropped = 1;
+			return;
+		case CAN_TCP_OVERFLOW_DROP_OLDEST:
+			break;
+		}
+	}
+
+	if (can_tcp_sendq__is_full(sendq)) {
+		can_tcp_sendq__drop_oldest(sendq);
+		++self->n_dropped;
+	}
+
+	can_tcp_sendq__push(sendq, cf, timestamp);
+
+	if (sendq->length > self->max_lag)
+		self->max_lag = sendq->length;
+}
+
+/* Everything that has been queued so far goes out in the legacy format, ahead
+ * of the answer.
+ */
+static void can_tcp_entry__accept_compact(struct can_tcp_entry* self,
+					  const struct can_frame* hello)
+{
+	if (can_tcp_sendq__write(&self->sendq, &self->sock, 0) < 0)
+		can_tcp_sendq__clear(&self->sendq);
+
+	sock_accept_compact(&self->sock, hello);
+}
+
+static int can_tcp__filter_match(const struct can_filter* filter,
+				 canid_t can_id)
+{
+	canid_t id = filter->can_id & ~CAN_INV_FILTER;
+	int is_match = (can_id & filter->can_mask) == (id & filter->can_mask);
+
+	return filter->can_id & CAN_INV_FILTER ? !is_match : is_match;
+}
+
+/* Whether standard data frames pass is looked up in a map. Adding a filter
+ * can only let more of them through, so it is just added to the map.
+ */
+static void can_tcp_entry__subscribe(struct can_tcp_entry* self,
+				     const struct can_frame* cf)
+{
+	struct can_filter filter;
+
+	if (can_wire_get_subscription(cf, &filter) < 0) {
+		self->n_filters = 0;
+		memset(self->sff_map, 0, sizeof(self->sff_map));
+		return;
+	}
+
+	if (self->n_filters >= CAN_TCP_MAX_FILTERS)
+		return;
+
+	self->filters[self->n_filters++] = filter;
+
+	for (canid_t id = 0; id <= CAN_SFF_MASK; ++id)
+		if (can_tcp__filter_match(&filter, id))
+			self->sff_map[id / 64] |= 1ULL << (id % 64);
+}
+
+static int can_tcp_entry__wants(const struct can_tcp_entry* self,
+				const struct can_frame* cf)
+{
+	canid_t id = cf->can_id;
+
+	if (self->n_filters == 0)
+		return 1;
+
+	if (!(id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG)))
+		return self->sff_map[id / 64] >> (id % 64) & 1;
+
+	for (size_t i = 0; i < self->n_filters; ++i)
+		if (can_tcp__filter_match(&self->filters[i], id))
+			return 1;
+
+	return 0;
+}
+
+static const char* can_tcp_entry__name(const struct can_tcp_entry* self,
+				       char* buffer, size_t size)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	if (getpeername(self->sock.fd, &addr, &addrlen) < 0
+	 || addr.sin_family != AF_INET)
+		snprintf(buffer, size, "fd %d", self->sock.fd);
+	else
+		snprintf(buffer, size, "%s:%d", inet_ntoa(addr.sin_addr),
+			 ntohs(addr.sin_port));
+
+	return buffer;
+}
+
+static void can_tcp_entry__drop(struct can_tcp_entry* self)
+{
+	char name[64];
+
+	if (!mloop_socket_is_started(self->socket))
+		return;
+
+	fprintf(stderr, "Dropping client %s: its send queue is full\n",
+		can_tcp_entry__name(self, name, sizeof(name)));
+
+	mloop_socket_stop(self->socket);
+}
+
+static void can_tcp__flush(struct can_tcp* self)
+{
+	struct can_tcp_entry* elem = NULL;
+	struct can_tcp_entry* tmp = NULL;
+
+	LIST_FOREACH_SAFE(elem, &self->list, links, tmp) {
+		if (elem->sock.type != SOCK_TYPE_TCP)
+			sock_flush(&elem->sock);
+		else if (elem->is_dropped)
+			can_tcp_entry__drop(elem);
+		else if (!elem->is_writing)
+			can_tcp_entry__write(elem, MSG_DONTWAIT);
+	}
+}
+
+static void can_tcp__on_flush_timeout(struct mloop_timer* timer)
 {
-	struct can_frame cp;
-	memcpy(&cp, cf, sizeof(cp));
-	sock_send(sock, &cp, 0);
+	can_tcp__flush(mloop_timer_get_context(timer));
+}
+
+static void can_tcp__schedule_flush(struct can_tcp* self)
+{
+	if (self->flush_delay == 0) {
+		can_tcp__flush(self);
+		return;
+	}
+
+	if (!self->flush_timer) {
+		self->flush_timer = mloop_timer_new(mloop_default());
+		if (!self->flush_timer)
+			goto failure;
+
+		mloop_timer_set_context(self->flush_timer, self, NULL);
+		mloop_timer_set_callback(self->flush_timer,
+					 can_tcp__on_flush_timeout);
+		mloop_timer_set_time(self->flush_timer,
+				     self->flush_delay * 1000ULL);
+	}
+
+	if (mloop_timer_is_started(self->flush_timer))
+		return;
+
+	if (mloop_timer_start(self->flush_timer) < 0)
+		goto failure;
+
+	return;
+
+failure:
+	can_tcp__flush(self);
 }
 
 static void can_tcp__send_to_others(struct can_tcp_entry* entry,
-				    struct can_frame* cf)
+				    const struct can_frame* cf,
+				    uint64_t timestamp)
 {
 	struct can_tcp* parent = entry->parent;
 	struct can_tcp_entry* elem = NULL;
 
-	LIST_FOREACH(elem, &parent->list, links)
-		if (elem != entry)
-			my_sock_send(&elem->sock, cf);
+	LIST_FOREACH(elem, &parent->list, links) {
+		if (elem == entry || elem->is_dropped
+		 || !can_tcp_entry__wants(elem, cf))
+			continue;
+
+		if (elem->sock.type == SOCK_TYPE_TCP) {
+			can_tcp_entry__enqueue(elem, cf, timestamp);
+			continue;
+		}
+
+		struct can_frame cp = *cf;
+		sock_stage(&elem->sock, &cp);
+	}
 }
 
-static void can_tcp__forward_message(struct mloop_socket* socket)
+static void can_tcp__forward_batch(struct can_tcp_entry* entry,
+				   struct can_frame* cfs, uint64_t* timestamps,
+				   ssize_t n)
+{
+	ssize_t i = 0;
+
+	/* Only the first thing a client says can be a request to change the
+	 * wire format.
+	 */
+	if (entry->is_new) {
+		entry->is_new = 0;
+
+		if (can_wire_is_hello(&cfs[0]))
+			can_tcp_entry__accept_compact(entry, &cfs[i++]);
+	}
+
+	for (; i < n; ++i) {
+		if (entry->sock.type == SOCK_TYPE_TCP
+		 && can_wire_is_subscription(&cfs[i])) {
+			can_tcp_entry__subscribe(entry, &cfs[i]);
+			continue;
+		}
+
+		can_tcp__send_to_others(entry, &cfs[i], timestamps[i]);
+	}
+}
+
+/* Frames that have been read into the socket's buffer don't make it readable
+ * again, so everything is forwarded before going back to the loop.
+ */
+static void can_tcp__forward_message(struct can_tcp_entry* entry)
+{
+	struct mloop_socket* socket = entry->socket;
+	struct can_frame cfs[CAN_TCP_BATCH_SIZE];
+	uint64_t timestamps[CAN_TCP_BATCH_SIZE];
+	ssize_t n, total = 0;
+
+	do {
+		n = sock_recv_batch(&entry->sock, cfs, timestamps,
+				    CAN_TCP_BATCH_SIZE, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (n <= 0) {
+			if (total > 0)
+				can_tcp__schedule_flush(entry->parent);
+
+			mloop_socket_stop(socket);
+			return;
+		}
+
+		total += n;
+
+		can_tcp__forward_batch(entry, cfs, timestamps, n);
+	} while (n == CAN_TCP_BATCH_SIZE);
+
+	can_tcp__schedule_flush(entry->parent);
+}
+
+static void can_tcp__on_socket_event(struct mloop_socket* socket)
 {
-	struct can_frame cf;
 	struct can_tcp_entry* entry = mloop_socket_get_context(socket);
 	assert(entry);
 
-	if (sock_recv(&entry->sock, &cf, MSG_DONTWAIT) <= 0) {
-		mloop_socket_stop(socket);
-		return;
-	}
+	enum mloop_socket_event event = mloop_socket_get_event(socket);
 
-	can_tcp__send_to_others(entry, &cf);
+	if (event & MLOOP_SOCKET_EVENT_OUT)
+		can_tcp_entry__write(entry, MSG_DONTWAIT);
+
+	if (event & ~MLOOP_SOCKET_EVENT_OUT)
+		can_tcp__forward_message(entry);
 }
 
 static void can_tcp_entry__free(void* ptr)
@@ -119,6 +575,7 @@ static void can_tcp_entry__free(void* ptr)
 	struct can_tcp_entry* entry = ptr;
 	LIST_REMOVE(entry, links);
 	sock_close(&entry->sock);
+	can_tcp_sendq__destroy(&entry->sendq);
 	can_tcp__unref(entry->parent);
 	free(entry);
 }
@@ -130,16 +587,28 @@ can_tcp__add_entry(struct can_tcp* self, const struct sock* sock)
 	if (!entry)
 		return NULL;
 
+	memset(entry, 0, sizeof(*entry));
+
 	struct mloop_socket* s = mloop_socket_new(mloop_default());
 	if (!s)
 		goto failure;
 
 	entry->parent = self;
+	entry->socket = s;
 	entry->sock = *sock;
+
+	if (sock->type == SOCK_TYPE_TCP) {
+		if (can_tcp_sendq__init(&entry->sendq) < 0)
+			goto txq_failure;
+	} else {
+		if (sock_txq_init(&entry->sock, CAN_TCP_TXQ_SIZE) < 0)
+			goto txq_failure;
+	}
+
 	LIST_INSERT_HEAD(&self->list, entry, links);
 
 	mloop_socket_set_context(s, entry, can_tcp_entry__free);
-	mloop_socket_set_callback(s, can_tcp__forward_message);
+	mloop_socket_set_callback(s, can_tcp__on_socket_event);
 	mloop_socket_set_fd(s, sock->fd);
 
 	int rc = mloop_socket_start(s);
@@ -150,6 +619,8 @@ can_tcp__add_entry(struct can_tcp* self, const struct sock* sock)
 
 	return rc >= 0 ? s : NULL;
 
+txq_failure:
+	mloop_socket_unref(s);
 failure:
 	free(entry);
 	return NULL;
@@ -157,7 +628,7 @@ failure:
 
 static int open_tcp_server(int port)
 {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0)
 		return -1;
 
@@ -183,7 +654,7 @@ failure:
 
 int can_tcp_open(const char* address, int port)
 {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0)
 		return -1;
 
@@ -212,7 +683,7 @@ static void can_tcp__on_connection(struct mloop_socket* socket)
 	struct can_tcp* can_tcp = mloop_socket_get_context(socket);
 	assert(can_tcp);
 
-	int connfd = accept(sfd, NULL, 0);
+	int connfd = accept4(sfd, NULL, 0, SOCK_CLOEXEC);
 	if (connfd < 0) {
 		perror("Could not accept connection");
 		return;
@@ -220,7 +691,8 @@ static void can_tcp__on_connection(struct mloop_socket* socket)
 
 	net_dont_delay(connfd);
 
-	struct sock sock = { .fd = connfd, .type = SOCK_TYPE_TCP };
+	struct sock sock;
+	sock_init(&sock, SOCK_TYPE_TCP, connfd, NULL);
 
 	struct mloop_socket* s = can_tcp__add_entry(can_tcp, &sock);
 	if (!s) {
@@ -228,6 +700,9 @@ static void can_tcp__on_connection(struct mloop_socket* socket)
 		goto failure;
 	}
 
+	struct can_tcp_entry* entry = mloop_socket_get_context(s);
+	entry->is_new = 1;
+
 	return;
 
 failure:
@@ -273,6 +748,57 @@ server_failure:
 	return NULL;
 }
 
+__attribute__((visibility("default")))
+void can_tcp_set_flush_delay(unsigned int us)
+{
+	flush_delay_ = us;
+}
+
+__attribute__((visibility("default")))
+void can_tcp_set_overflow_policy(enum can_tcp_overflow policy)
+{
+	overflow_ = policy;
+}
+
+__attribute__((visibility("default")))
+void can_tcp_set_wire_format(enum can_wire_format format, int flags)
+{
+	wire_format_ = format;
+	wire_flags_ = flags;
+}
+
+__attribute__((visibility("default")))
+int can_tcp_set_filters(const struct can_filter* filters, size_t n)
+{
+	if (n > CAN_TCP_MAX_FILTERS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(filters_, filters, n * sizeof(*filters));
+	n_filters_ = n;
+	return 0;
+}
+
+__attribute__((visibility("default")))
+void can_tcp_print_stats(FILE* output)
+{
+	struct can_tcp* bridge = NULL;
+	struct can_tcp_entry* elem = NULL;
+	char name[64];
+
+	LIST_FOREACH(bridge, &bridges_, links)
+		LIST_FOREACH(elem, &bridge->list, links) {
+			if (elem->sock.type != SOCK_TYPE_TCP)
+				continue;
+
+			fprintf(output, "%s: lag %zu (max %zu), dropped %llu\n",
+				can_tcp_entry__name(elem, name, sizeof(name)),
+				elem->sendq.length, elem->max_lag,
+				(unsigned long long)elem->n_dropped);
+		}
+}
+
 __attribute__((visibility("default")))
 int can_tcp_bridge_server(const char* can, int port)
 {
@@ -309,6 +835,51 @@ server_failure:
 	return -1;
 }
 
+__attribute__((visibility("default")))
+int can_tcp_bridge_multicast(const char* can, const char* group)
+{
+	struct sock cansock, udpsock;
+
+	struct can_tcp* can_tcp = can_tcp__new();
+	if (!can_tcp)
+		return -1;
+
+	if (can) {
+		if (sock_open(&cansock, SOCK_TYPE_CAN, can, NULL) < 0)
+			goto cansock_failure;
+		net_fix_sndbuf(cansock.fd);
+	}
+
+	if (sock_open(&udpsock, SOCK_TYPE_UDP, group, NULL) < 0)
+		goto udpsock_failure;
+
+	struct mloop_socket* s1;
+	if (can) {
+		s1 = can_tcp__add_entry(can_tcp, &cansock);
+		if (!s1)
+			goto s1_failure;
+	}
+
+	if (!can_tcp__add_entry(can_tcp, &udpsock))
+		goto s2_failure;
+
+	can_tcp__unref(can_tcp);
+
+	return 0;
+
+s2_failure:
+	if (can)
+		mloop_socket_stop(s1);
+s1_failure:
+	sock_close(&udpsock);
+udpsock_failure:
+	if (can)
+		sock_close(&cansock);
+cansock_failure:
+	can_tcp__free(can_tcp);
+	return -1;
+}
+
 __attribute__((visibility("default")))
 int can_tcp_bridge_client(const char* can, const char* address, int port)
 {
@@ -328,7 +899,17 @@ int can_tcp_bridge_client(const char* can, const char* address, int port)
 	if (connfd < 0)
 		goto tcpsock_failure;
 
-	struct sock connsock = { .fd = connfd, .type = SOCK_TYPE_TCP };
+	struct sock connsock;
+	sock_init(&connsock, SOCK_TYPE_TCP, connfd, NULL);
+
+	if (wire_format_ == CAN_WIRE_COMPACT
+	 && sock_request_compact(&connsock, wire_flags_,
+				 CAN_TCP_HELLO_TIMEOUT) < 0)
+		perror("Could not agree on the compact wire format");
+
+	if (n_filters_ > 0
+	 && sock_subscribe(&connsock, filters_, n_filters_) < 0)
+		goto subscribe_failure;
 
 	struct mloop_socket* s1;
 	if (can)  {
@@ -349,6 +930,7 @@ s2_failure:
 	if (can)
 		mloop_socket_stop(s1);
 s1_failure:
+subscribe_failure:
 	sock_close(&connsock);
 tcpsock_failure:
 	if (can)
@@ -0,0 +1,219 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "can-wire.h"
+
+#define CAN_WIRE_DELTA_MAX 0xffff
+
+static inline void can_wire__put_header(uint8_t* dst, uint32_t id, int rtr,
+					unsigned int dlc)
+{
+	uint16_t header = id << 5 | (rtr ? 1 << 4 : 0) | dlc;
+	dst[0] = header >> 8;
+	dst[1] = header & 0xff;
+}
+
+static inline unsigned int can_wire__get_dlc(const uint8_t* src)
+{
+	return src[1] & 0xf;
+}
+
+void can_wire_make_hello(struct can_frame* cf, enum can_wire_format format,
+			 int flags)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = CAN_WIRE_HELLO_ID;
+	cf->can_dlc = 2;
+	cf->data[0] = format;
+	cf->data[1] = flags;
+}
+
+static inline void can_wire__put_u32(uint8_t* dst, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		dst[i] = value >> (24 - 8 * i);
+}
+
+static inline uint32_t can_wire__get_u32(const uint8_t* src)
+{
+	return (uint32_t)src[0] << 24 | (uint32_t)src[1] << 16
+	     | (uint32_t)src[2] << 8 | src[3];
+}
+
+void can_wire_make_subscription(struct can_frame* cf,
+				const struct can_filter* filter)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = CAN_WIRE_SUBSCRIBE_ID;
+
+	if (!filter)
+		return;
+
+	cf->can_dlc = 8;
+	can_wire__put_u32(&cf->data[0], filter->can_id);
+	can_wire__put_u32(&cf->data[4], filter->can_mask);
+}
+
+int can_wire_get_subscription(const struct can_frame* cf,
+			      struct can_filter* filter)
+{
+	if (cf->can_dlc < 8)
+		return -1;
+
+	filter->can_id = can_wire__get_u32(&cf->data[0]);
+	filter->can_mask = can_wire__get_u32(&cf->data[4]);
+	return 0;
+}
+
+size_t can_wire_encode_datagram_header(void* dst, uint32_t source,
+				       uint32_t seq)
+{
+	uint8_t* p = dst;
+
+	can_wire__put_u32(p, CAN_WIRE_DATAGRAM_MAGIC);
+	can_wire__put_u32(p + 4, source);
+	can_wire__put_u32(p + 8, seq);
+
+	return CAN_WIRE_DATAGRAM_HEADER_SIZE;
+}
+
+int can_wire_decode_datagram_header(const void* src, size_t size,
+				    uint32_t* source, uint32_t* seq)
+{
+	const uint8_t* p = src;
+
+	if (size < CAN_WIRE_DATAGRAM_HEADER_SIZE
+	 || can_wire__get_u32(p) != CAN_WIRE_DATAGRAM_MAGIC)
+		return -1;
+
+	*source = can_wire__get_u32(p + 4);
+	*seq = can_wire__get_u32(p + 8);
+	return 0;
+}
+
+size_t can_wire_encode(void* dst, const struct can_frame* cf)
+{
+	uint8_t* p = dst;
+
+	if (cf->can_id & (CAN_EFF_FLAG | CAN_ERR_FLAG) || cf->can_dlc > 8) {
+		can_wire__put_header(p, 0, 0, CAN_WIRE_FULL);
+
+		struct can_frame wire = *cf;
+		wire.can_id = htonl(cf->can_id);
+		memcpy(p + CAN_WIRE_HEADER_SIZE, &wire, sizeof(wire));
+
+		return CAN_WIRE_HEADER_SIZE + sizeof(wire);
+	}
+
+	can_wire__put_header(p, cf->can_id & CAN_SFF_MASK,
+			     cf->can_id & CAN_RTR_FLAG, cf->can_dlc);
+
+	if (cf->can_id & CAN_RTR_FLAG)
+		return CAN_WIRE_HEADER_SIZE;
+
+	memcpy(p + CAN_WIRE_HEADER_SIZE, cf->data, cf->can_dlc);
+	return CAN_WIRE_HEADER_SIZE + cf->can_dlc;
+}
+
+size_t can_wire_encode_timestamp(void* dst, uint64_t* current, uint64_t t)
+{
+	uint8_t* p = dst;
+
+	if (t == *current)
+		return 0;
+
+	uint64_t previous = *current;
+	*current = t;
+
+	if (t > previous && t - previous <= CAN_WIRE_DELTA_MAX) {
+		uint64_t delta = t - previous;
+		can_wire__put_header(p, 0, 0, CAN_WIRE_DELTA);
+		p[2] = delta >> 8;
+		p[3] = delta & 0xff;
+		return CAN_WIRE_HEADER_SIZE + 2;
+	}
+
+	can_wire__put_header(p, 0, 0, CAN_WIRE_TIMESTAMP);
+	for (int i = 0; i < 8; ++i)
+		p[CAN_WIRE_HEADER_SIZE + i] = t >> (56 - 8 * i);
+
+	return CAN_WIRE_HEADER_SIZE + 8;
+}
+
+size_t can_wire_record_size(const void* src, size_t size)
+{
+	const uint8_t* p = src;
+
+	if (size < CAN_WIRE_HEADER_SIZE)
+		return 0;
+
+	unsigned int dlc = can_wire__get_dlc(p);
+
+	switch (dlc) {
+	case CAN_WIRE_FULL:
+		return CAN_WIRE_HEADER_SIZE + sizeof(struct can_frame);
+	case CAN_WIRE_TIMESTAMP:
+		return CAN_WIRE_HEADER_SIZE + 8;
+	case CAN_WIRE_DELTA:
+		return CAN_WIRE_HEADER_SIZE + 2;
+	}
+
+	/* Remote requests carry no payload */
+	if (p[1] & 1 << 4)
+		return CAN_WIRE_HEADER_SIZE;
+
+	return CAN_WIRE_HEADER_SIZE + dlc;
+}
+
+int can_wire_decode(const void* src, struct can_frame* cf, uint64_t* current)
+{
+	const uint8_t* p = src;
+	const uint8_t* payload = p + CAN_WIRE_HEADER_SIZE;
+
+	uint16_t header = (uint16_t)p[0] << 8 | p[1];
+	unsigned int dlc = header & 0xf;
+
+	switch (dlc) {
+	case CAN_WIRE_FULL:
+		memcpy(cf, payload, sizeof(*cf));
+		cf->can_id = ntohl(cf->can_id);
+		return 1;
+	case CAN_WIRE_TIMESTAMP:
+		*current = 0;
+		for (int i = 0; i < 8; ++i)
+			*current = *current << 8 | payload[i];
+		return 0;
+	case CAN_WIRE_DELTA:
+		*current += (uint64_t)payload[0] << 8 | payload[1];
+		return 0;
+	}
+
+	if (dlc > 8)
+		return -1;
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = header >> 5;
+	cf->can_dlc = dlc;
+
+	if (header & 1 << 4)
+		cf->can_id |= CAN_RTR_FLAG;
+	else
+		memcpy(cf->data, payload, dlc);
+
+	return 1;
+}
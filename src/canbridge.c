@@ -18,6 +18,7 @@
 #include <string.h>
 #include <getopt.h>
 #include <mloop.h>
+#include <linux/can.h>
 
 #include "can-tcp.h"
 
@@ -28,11 +29,28 @@ const char usage_[] =
 "    -h, --help                 Get help.\n"
 "    -L, --listen[=port]        Listen on TCP port. Default 5555.\n"
 "    -c, --connect=host[:port]  Connect to TCP server. Default 5555.\n"
+"    -m, --multicast=group[:port]\n"
+"                               Publish to a UDP multicast group and pass on\n"
+"                               what others publish there. Default port 5556.\n"
 "    -C, --create               Try to create a virtual CAN interface.\n"
+"    -d, --flush-delay=us       Gather frames for up to this long before\n"
+"                               writing them out. Default 0.\n"
+"    -o, --overflow=policy      What to do when a client falls too far\n"
+"                               behind: drop-oldest, drop-client or block.\n"
+"                               Default drop-oldest.\n"
+"    -z, --compact              Ask the server for the compact wire format.\n"
+"    -t, --timestamps           Also ask for the time of each frame.\n"
+"    -f, --filter=id[:mask],... Only receive frames that pass one of these\n"
+"                               filters from the server. The mask is 0x7ff\n"
+"                               unless given.\n"
+"\n"
+"Send SIGUSR1 to print the send queue statistics of each client.\n"
 "\n"
 "Examples:\n"
 "    $ canbridge can0 --listen=1234\n"
 "    $ canbridge vcan0 --connect=127.0.0.1:1234\n"
+"    $ canbridge vcan0 --connect=10.0.0.2 --filter=0x700:0x780,0x185\n"
+"    $ canbridge can0 --multicast=239.0.0.1\n"
 "\n";
 
 static inline int print_usage(FILE* output, int status)
@@ -58,10 +76,52 @@ static int try_setup(const char* iface)
 	return system(buffer);
 }
 
+static int set_overflow_policy(const char* policy)
+{
+	if (strcmp(policy, "drop-oldest") == 0)
+		can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_DROP_OLDEST);
+	else if (strcmp(policy, "drop-client") == 0)
+		can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_DROP_CLIENT);
+	else if (strcmp(policy, "block") == 0)
+		can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_BLOCK);
+	else
+		return -1;
+
+	return 0;
+}
+
+static int parse_filters(char* str)
+{
+	struct can_filter filters[64];
+	size_t n = 0;
+
+	for (char* tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+		if (n >= sizeof(filters) / sizeof(filters[0]))
+			return -1;
+
+		char* end = NULL;
+		filters[n].can_id = strtoul(tok, &end, 0);
+		filters[n].can_mask = *end == ':' ? strtoul(end + 1, &end, 0)
+						  : CAN_SFF_MASK;
+		if (*end != '\0')
+			return -1;
+
+		++n;
+	}
+
+	return can_tcp_set_filters(filters, n);
+}
+
 static void on_signal_event(struct mloop_signal* sig, int signo)
 {
 	(void)sig;
-	(void)signo;
+
+	if (signo == SIGUSR1) {
+		can_tcp_print_stats(stdout);
+		fflush(stdout);
+		return;
+	}
+
 	mloop_exit(mloop_default());
 }
 
@@ -71,16 +131,24 @@ int main(int argc, char* argv[])
 		{ "help",    no_argument,       0, 'h' },
 		{ "listen",  optional_argument, 0, 'L' },
 		{ "connect", required_argument, 0, 'c' },
+		{ "multicast", required_argument, 0, 'm' },
 		{ "create",  no_argument,       0, 'C' },
+		{ "flush-delay", required_argument, 0, 'd' },
+		{ "overflow", required_argument, 0, 'o' },
+		{ "compact", no_argument,     0, 'z' },
+		{ "timestamps", no_argument,  0, 't' },
+		{ "filter",  required_argument, 0, 'f' },
 		{ 0, 0, 0, 0 }
 	};
 
 	const char* listen_ = NULL;
 	const char* connect_ = NULL;
+	const char* multicast = NULL;
 	int create = 0;
+	int wire_flags = -1;
 
 	while (1) {
-		int c = getopt_long(argc, argv, "hL::c:C", long_options, NULL);
+		int c = getopt_long(argc, argv, "hL::c:m:Cd:o:ztf:", long_options, NULL);
 		if (c < 0)
 			break;
 
@@ -88,7 +156,29 @@ int main(int argc, char* argv[])
 		case 'h': return print_usage(stdout, 0);
 		case 'L': listen_ = optarg ? optarg : "5555"; break;
 		case 'c': connect_ = optarg; break;
+		case 'm': multicast = optarg; break;
 		case 'C': create = 1; break;
+		case 'd':
+			can_tcp_set_flush_delay(strtoul(optarg, NULL, 0));
+			break;
+		case 'o':
+			if (set_overflow_policy(optarg) < 0) {
+				fprintf(stderr, "Unknown overflow policy: %s\n",
+					optarg);
+				return print_usage(stderr, 1);
+			}
+			break;
+		case 'z':
+			if (wire_flags < 0)
+				wire_flags = 0;
+			break;
+		case 't': wire_flags = CAN_WIRE_F_TIMESTAMPS; break;
+		case 'f':
+			if (parse_filters(optarg) < 0) {
+				fprintf(stderr, "Invalid filter: %s\n", optarg);
+				return print_usage(stderr, 1);
+			}
+			break;
 		}
 	}
 
@@ -97,16 +187,19 @@ int main(int argc, char* argv[])
 
 	const char* iface = args[0];
 
-	if (listen_ && connect_) {
-		fprintf(stderr, "Can't have both listen and connect arguments\n");
+	if (!!listen_ + !!connect_ + !!multicast > 1) {
+		fprintf(stderr, "Only one of listen, connect and multicast can be given\n");
 		return print_usage(stderr, 1);
 	}
 
-	if (!listen_ && !connect_) {
-		fprintf(stderr, "You must either listen or connect\n");
+	if (!listen_ && !connect_ && !multicast) {
+		fprintf(stderr, "You must either listen, connect or multicast\n");
 		return print_usage(stderr, 1);
 	}
 
+	if (wire_flags >= 0)
+		can_tcp_set_wire_format(CAN_WIRE_COMPACT, wire_flags);
+
 	if (create) {
 		if (!iface) {
 			perror("Cannot create an interface unless you name it\n");
@@ -133,6 +226,11 @@ int main(int argc, char* argv[])
 			perror("Could not create interface bridge");
 			goto failure;
 		}
+	} else if (multicast) {
+		if (can_tcp_bridge_multicast(iface, multicast) < 0) {
+			perror("Could not create interface bridge");
+			goto failure;
+		}
 	} else {
 		int port = 5555;
 		char* portptr = strchr(connect_, ':');
@@ -152,6 +250,7 @@ int main(int argc, char* argv[])
 	sigaddset(&sigset, SIGINT);
 	sigaddset(&sigset, SIGTERM);
 	sigaddset(&sigset, SIGHUP);
+	sigaddset(&sigset, SIGUSR1);
 
 	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <getopt.h>
 #include <mloop.h>
 
@@ -28,17 +29,52 @@ const char usage_[] =
 "    -h, --help                 Get help.\n"
 "    -u, --time                 Show time of arrival.\n"
 "    -T, --tcp                  Connect via TCP.\n"
-"    -f, --file                 Dump from trace buffer file.\n"
+"    -U, --udp                  Subscribe to a UDP multicast group[:port].\n"
+"    -M, --shm                  Read what canopen-master receives on the\n"
+"                               interface from shared memory. The master\n"
+"                               must be run with --shm-ring.\n"
+"    -f, --file                 Dump from trace buffer file or recording.\n"
+"    -a, --analyze              Summarize the file instead of dumping it.\n"
+"    -j, --jobs=n               Analyze on n threads. Default: one per CPU.\n"
+"    -r, --replay=interface     Send the frames that the nodes sent in the file\n"
+"                               on another bus, with their recorded timing.\n"
+"        --speed=n              Replay n times as fast. 0 is as fast as\n"
+"                               possible. Default: 1.\n"
+"        --master-frames        Replay what the master sent instead, e.g. to\n"
+"                               drive virtual nodes.\n"
+"    -t, --top                  Show the bus load per COB-ID, node and type.\n"
+"    -b, --bitrate=n            Bit rate of the bus in bit/s. Default: 1000000.\n"
 "    -n, --nmt                  Show NMT.\n"
 "    -S, --sync                 Show SYNC.\n"
 "    -e, --emcy                 Show EMCY.\n"
 "    -p, --pdo[=mask]           Show PDO.\n"
 "    -s, --sdo                  Show SDO.\n"
+"    -x, --transactions         Show whole SDO transactions instead of frames,\n"
+"                               and response times per node at exit.\n"
 "    -H, --heartbeat            Show heartbeat.\n"
+"    -N, --node=list            Only show these nodes, e.g. 1,4-7.\n"
+"                               NMT, SYNC and TIME are node 0.\n"
+"        --from=time            Skip frames from before this time.\n"
+"        --to=time              Skip frames from after this time.\n"
+"        --pcap                 Write the frames to stdout in pcapng format,\n"
+"                               for Wireshark. With --file, the file is\n"
+"                               converted. Only --node, --from and --to apply.\n"
+"\n"
+"Times are either seconds since the epoch, as shown by --time, or local time\n"
+"as in \"2018-03-01 14:30:00\".\n"
 "\n"
 "Examples:\n"
 "    $ canopen-dump can0\n"
 "    $ canopen-dump -T 127.0.0.1\n"
+"    $ canopen-dump -U 239.0.0.1\n"
+"    $ canopen-dump -M can0\n"
+"    $ canopen-dump -f -a incident.trace\n"
+"    $ canopen-dump -t -b 250000 can0\n"
+"    $ canopen-dump -x -s can0\n"
+"    $ canopen-dump -f -N 5 --from=\"2018-03-01 14:30:00\" record-0001.ctr\n"
+"    $ canopen-dump -f -r vcan0 --speed=10 incident.trace\n"
+"    $ canopen-dump --pcap can0 | wireshark -k -i -\n"
+"    $ canopen-dump -f --pcap incident.trace > incident.pcapng\n"
 "\n";
 
 static inline int print_usage(FILE* output, int status)
@@ -54,26 +90,121 @@ unsigned int apply_pdo_option(const char* arg)
 	     : CO_DUMP_FILTER_PDO;
 }
 
+static int apply_node_option(struct co_dump_selection* selection,
+			     const char* arg)
+{
+	while (*arg) {
+		char* end;
+		unsigned long first = strtoul(arg, &end, 10);
+		unsigned long last = first;
+
+		if (end == arg)
+			return -1;
+
+		if (*end == '-') {
+			arg = end + 1;
+			last = strtoul(arg, &end, 10);
+			if (end == arg)
+				return -1;
+		}
+
+		if (first > last || last > 127)
+			return -1;
+
+		for (unsigned long i = first; i <= last; ++i)
+			selection->nodes[i / 64] |= 1ULL << (i % 64);
+
+		if (*end == ',')
+			++end;
+		else if (*end != '\0')
+			return -1;
+
+		arg = end;
+	}
+
+	return 0;
+}
+
+static int parse_time(uint64_t* result, const char* arg)
+{
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_isdst = -1;
+
+	const char* end = strptime(arg, "%Y-%m-%d %H:%M:%S", &tm);
+	if (end) {
+		time_t t = mktime(&tm);
+		if (t < 0)
+			return -1;
+
+		*result = t * 1000000ULL;
+	} else {
+		char* tail;
+		unsigned long long seconds = strtoull(arg, &tail, 10);
+		if (tail == arg)
+			return -1;
+
+		*result = seconds * 1000000ULL;
+		end = tail;
+	}
+
+	if (*end == '.') {
+		unsigned long long scale = 100000ULL;
+
+		for (++end; *end >= '0' && *end <= '9'; ++end, scale /= 10)
+			*result += (*end - '0') * scale;
+	}
+
+	return *end == '\0' ? 0 : -1;
+}
+
+enum {
+	OPT_FROM = 256,
+	OPT_TO,
+	OPT_SPEED,
+	OPT_MASTER_FRAMES,
+	OPT_PCAP,
+};
+
 int main(int argc, char* argv[])
 {
 	static const struct option long_options[] = {
 		{ "help",      no_argument,       0, 'h' },
 		{ "time",      no_argument,       0, 'u' },
 		{ "tcp",       no_argument,       0, 'T' },
+		{ "udp",       no_argument,       0, 'U' },
+		{ "shm",       no_argument,       0, 'M' },
 		{ "file",      no_argument,       0, 'f' },
+		{ "analyze",   no_argument,       0, 'a' },
+		{ "jobs",      required_argument, 0, 'j' },
+		{ "top",       no_argument,       0, 't' },
+		{ "bitrate",   required_argument, 0, 'b' },
 		{ "nmt",       no_argument,       0, 'n' },
 		{ "sync",      no_argument,       0, 'S' },
 		{ "emcy",      no_argument,       0, 'e' },
 		{ "pdo",       optional_argument, 0, 'p' },
 		{ "sdo",       no_argument,       0, 's' },
+		{ "transactions", no_argument,    0, 'x' },
 		{ "heartbeat", no_argument,       0, 'H' },
+		{ "node",      required_argument, 0, 'N' },
+		{ "from",      required_argument, 0, OPT_FROM },
+		{ "to",        required_argument, 0, OPT_TO },
+		{ "replay",    required_argument, 0, 'r' },
+		{ "speed",     required_argument, 0, OPT_SPEED },
+		{ "master-frames", no_argument,   0, OPT_MASTER_FRAMES },
+		{ "pcap",      no_argument,       0, OPT_PCAP },
 		{ 0, 0, 0, 0 }
 	};
 
 	enum co_dump_options opt = 0;
+	char* end;
+	struct co_dump_selection selection = { 0 };
+	const char* replay_to = NULL;
+	double speed = 1.0;
 
 	while (1) {
-		int c = getopt_long(argc, argv, "huTfnSepsiH", long_options, NULL);
+		int c = getopt_long(argc, argv, "huTUMfaj:r:tb:nSepsxiHN:",
+				    long_options, NULL);
 		if (c < 0)
 			break;
 
@@ -81,13 +212,46 @@ int main(int argc, char* argv[])
 		case 'h': return print_usage(stdout, 0);
 		case 'u': opt |= CO_DUMP_TIMESTAMP; break;
 		case 'T': opt |= CO_DUMP_TCP; break;
+		case 'U': opt |= CO_DUMP_UDP; break;
+		case 'M': opt |= CO_DUMP_SHM; break;
 		case 'f': opt |= CO_DUMP_FILE; break;
+		case 'a': opt |= CO_DUMP_ANALYZE; break;
+		case 'j': selection.n_threads = strtoul(optarg, NULL, 0); break;
+		case 'r': replay_to = optarg; break;
+		case 't': opt |= CO_DUMP_TOP; break;
+		case 'b': selection.bitrate = strtoul(optarg, NULL, 0); break;
 		case 'n': opt |= CO_DUMP_FILTER_NMT; break;
 		case 'S': opt |= CO_DUMP_FILTER_SYNC; break;
 		case 'e': opt |= CO_DUMP_FILTER_EMCY; break;
 		case 'p': opt |= apply_pdo_option(optarg); break;
 		case 's': opt |= CO_DUMP_FILTER_SDO; break;
+		case 'x': opt |= CO_DUMP_SDO_TRANSACTIONS; break;
 		case 'H': opt |= CO_DUMP_FILTER_HEARTBEAT; break;
+		case 'N':
+			if (apply_node_option(&selection, optarg) < 0) {
+				fprintf(stderr, "Invalid node list: %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case OPT_FROM:
+		case OPT_TO:
+			if (parse_time(c == OPT_FROM ? &selection.from
+						     : &selection.to,
+				       optarg) < 0) {
+				fprintf(stderr, "Invalid time: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_SPEED:
+			speed = strtod(optarg, &end);
+			if (*end != '\0' || speed < 0) {
+				fprintf(stderr, "Invalid speed: %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_MASTER_FRAMES: opt |= CO_DUMP_REPLAY_MASTER; break;
+		case OPT_PCAP: opt |= CO_DUMP_PCAP; break;
 		default: return print_usage(stderr, 1);
 		}
 	}
@@ -100,7 +264,10 @@ int main(int argc, char* argv[])
 
 	const char* iface = args[0];
 
+	if (replay_to)
+		return co_replay(args[0], replay_to, opt, &selection, speed);
+
 	setvbuf(stdout, NULL, _IOLBF, 0);
 
-	return co_dump(iface, opt);
+	return co_dump_select(iface, opt, &selection);
 }
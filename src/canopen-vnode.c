@@ -22,16 +22,22 @@
 #include "vnode.h"
 
 const char usage_[] =
-"Usage: canopen-vnode [options] <interface> <nodeid> [nodeid] [...]\n"
+"Usage: canopen-vnode [options] <interface> <nodes> [nodes] [...]\n"
 "\n"
 "Options:\n"
 "    -h, --help                 Get help.\n"
 "    -T, --tcp                  Connect via TCP.\n"
+"    -U, --udp                  Join a UDP multicast group[:port].\n"
 "    -c, --config               Set path to config file.\n"
 "\n"
+"Nodes are given as <nodeid>[-<last nodeid>][:<config>]. Nodes without a\n"
+"config of their own use the one that is set with --config. All nodes share\n"
+"one socket, and each config file is only loaded once.\n"
+"\n"
 "Examples:\n"
-"    $ canopen-vnode can0\n"
-"    $ canopen-vnode -T 127.0.0.1\n"
+"    $ canopen-vnode can0 5\n"
+"    $ canopen-vnode -T 127.0.0.1 1-127\n"
+"    $ canopen-vnode -U 239.0.0.1 1-64:vnodes/mcs816.ini 65-127:vnodes/mws2.ini\n"
 "\n";
 
 static struct vnode* node[127];
@@ -42,60 +48,93 @@ static inline int print_usage(FILE* output, int status)
 	return status;
 }
 
+void destroy_nodes(void)
+{
+	for (int i = 0; i < 127; ++i)
+		if (node[i]) {
+			co_vnode_destroy(node[i]);
+			node[i] = NULL;
+		}
+}
+
+static int parse_nodes(const char* arg, int* first, int* last,
+		       const char** config)
+{
+	char* end;
+
+	*first = strtol(arg, &end, 10);
+	*last = *first;
+
+	if (*end == '-')
+		*last = strtol(end + 1, &end, 10);
+
+	if (*end == ':')
+		*config = end + 1;
+	else if (*end != '\0')
+		return -1;
+
+	return 1 <= *first && *first <= *last && *last <= 127 ? 0 : -1;
+}
+
 int init_nodes(enum sock_type type, const char* config, const char* iface,
 	       char* ids[], int n_ids)
 {
 	memset(node, 0, sizeof(node));
 
-	int i;
-	for (i = 0; i < n_ids; ++i) {
-		int nodeid = atoi(ids[i]);
+	for (int i = 0; i < n_ids; ++i) {
+		const char* node_config = config;
+		int first, last;
 
-		struct vnode* vnode = co_vnode_new(type, iface, config, nodeid);
-		if (!vnode)
+		if (parse_nodes(ids[i], &first, &last, &node_config) < 0) {
+			fprintf(stderr, "Invalid nodes: %s\n", ids[i]);
 			goto failure;
+		}
+
+		for (int nodeid = first; nodeid <= last; ++nodeid) {
+			if (node[nodeid - 1]) {
+				fprintf(stderr, "Node %d is given twice\n",
+					nodeid);
+				goto failure;
+			}
 
-		node[nodeid - 1] = vnode;
+			struct vnode* vnode = co_vnode_new(type, iface,
+							   node_config, nodeid);
+			if (!vnode)
+				goto failure;
+
+			node[nodeid - 1] = vnode;
+		}
 	}
 
 	return 0;
 
 failure:
-	for (--i; i >= 0; --i) {
-		int nodeid = atoi(ids[i]);
-		co_vnode_destroy(node[nodeid - 1]);
-	}
-
+	destroy_nodes();
 	return -1;
 }
 
-void destroy_nodes(void)
-{
-	for (int i = 0; i < 127; ++i)
-		if (node[i])
-			co_vnode_destroy(node[i]);
-}
-
 int main(int argc, char* argv[])
 {
 	static const struct option long_options[] = {
 		{ "help",   no_argument,       0, 'h' },
 		{ "tcp",    no_argument,       0, 'T' },
+		{ "udp",    no_argument,       0, 'U' },
 		{ "config", required_argument, 0, 'c' },
 		{ 0, 0, 0, 0 }
 	};
 
-	int use_tcp = 0;
+	enum sock_type type = SOCK_TYPE_CAN;
 	const char* config = NULL;
 
 	while (1) {
-		int c = getopt_long(argc, argv, "hTc:", long_options, NULL);
+		int c = getopt_long(argc, argv, "hTUc:", long_options, NULL);
 		if (c < 0)
 			break;
 
 		switch (c) {
 		case 'h': return print_usage(stdout, 0);
-		case 'T': use_tcp = 1; break;
+		case 'T': type = SOCK_TYPE_TCP; break;
+		case 'U': type = SOCK_TYPE_UDP; break;
 		case 'c': config = optarg; break;
 		}
 	}
@@ -108,8 +147,6 @@ int main(int argc, char* argv[])
 
 	const char* iface = args[0];
 
-	enum sock_type type = use_tcp ? SOCK_TYPE_TCP : SOCK_TYPE_CAN;
-
 	struct mloop* mloop = mloop_default();
 	mloop_ref(mloop);
 
@@ -14,27 +14,62 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sharedmalloc.h>
 #include "canopen_info.h"
+#include "co_atomic.h"
+
+#define CANOPEN_INFO__MAX_TRIES 64
 
 struct canopen_info* canopen_info_ = NULL;
 
 static const char canopen_info_name[] = "canopen2";
 static const char canopen_info_description[] = "canopen2.xml";
 
+/* Drivers are loaded on workers while the main loop handles heartbeats and
+ * emergencies, so an entry may have more than one writer.
+ */
+static pthread_mutex_t canopen_info__mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int canopen_info__futex(uint32_t* addr, int op, uint32_t value,
+				      const struct timespec* timeout)
+{
+	return syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
 int canopen_info_init(const char* iface)
 {
 	char buffer[256];
 	snprintf(buffer, sizeof(buffer), "%s.%s", canopen_info_name, iface);
 	buffer[sizeof(buffer) - 1] = '\0';
 
-	canopen_info_ = s_malloc(sizeof(struct canopen_info) * 127, buffer,
+	canopen_info_ = s_malloc(sizeof(struct canopen_info)
+				 * CANOPEN_INFO_N_NODES
+				 + sizeof(struct canopen_info_state), buffer,
 				 canopen_info_description);
 	if (!canopen_info_)
 		return -1;
 
-	for (size_t i = 0; i < 127; ++i)
-		canopen_info_[i].is_active = 0;
+	/* Readers that are left over from before must see every entry change */
+	for (size_t i = 0; i < CANOPEN_INFO_N_NODES; ++i) {
+		struct canopen_info* info = &canopen_info_[i];
+		uint32_t sequence = co_atomic_load_relaxed(&info->sequence);
+
+		co_atomic_store_relaxed(&info->sequence, (sequence | 1) + 1);
+		info->is_active = 0;
+	}
+
+	struct canopen_info_state* state = canopen_info_get_state(canopen_info_);
+	co_atomic_add_fetch(&state->generation, 1);
+	canopen_info__futex(&state->generation, FUTEX_WAKE, INT_MAX, NULL);
 
 	return 0;
 }
@@ -44,3 +79,78 @@ void canopen_info_cleanup(void)
 	s_free(canopen_info_);
 }
 
+struct canopen_info* canopen_info_begin_update(int nodeid)
+{
+	assert(1 <= nodeid && nodeid <= CANOPEN_INFO_N_NODES);
+
+	struct canopen_info* info = &canopen_info_[nodeid - 1];
+
+	pthread_mutex_lock(&canopen_info__mutex);
+
+	uint32_t sequence = co_atomic_load_relaxed(&info->sequence);
+	co_atomic_store_relaxed(&info->sequence, sequence + 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	return info;
+}
+
+void canopen_info_end_update(struct canopen_info* info)
+{
+	struct canopen_info_state* state = canopen_info_get_state(canopen_info_);
+	uint32_t sequence = co_atomic_load_relaxed(&info->sequence);
+
+	co_atomic_store_release(&info->sequence, sequence + 1);
+
+	pthread_mutex_unlock(&canopen_info__mutex);
+
+	/* Waiters are counted before they sleep, so either they are seen
+	 * here or they see the new generation.
+	 */
+	co_atomic_add_fetch(&state->generation, 1);
+
+	if (co_atomic_load(&state->n_waiters) > 0)
+		canopen_info__futex(&state->generation, FUTEX_WAKE, INT_MAX,
+				    NULL);
+}
+
+int canopen_info_read(const struct canopen_info* info,
+		      struct canopen_info* dst)
+{
+	for (int i = 0; i < CANOPEN_INFO__MAX_TRIES; ++i) {
+		uint32_t sequence = co_atomic_load_acquire(&info->sequence);
+		if (sequence & 1)
+			continue;
+
+		memcpy(dst, info, sizeof(*dst));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (co_atomic_load_relaxed(&info->sequence) == sequence) {
+			dst->sequence = sequence;
+			return 0;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+uint32_t canopen_info_wait(struct canopen_info_state* state,
+			   uint32_t generation, int timeout)
+{
+	struct timespec ts = {
+		.tv_sec = timeout / 1000,
+		.tv_nsec = (timeout % 1000) * 1000000L
+	};
+
+	co_atomic_add_fetch(&state->n_waiters, 1);
+
+	/* The futex only sleeps while the generation is the given one */
+	canopen_info__futex(&state->generation, FUTEX_WAIT, generation,
+			    timeout >= 0 ? &ts : NULL);
+
+	co_atomic_sub_fetch(&state->n_waiters, 1);
+
+	return co_atomic_load(&state->generation);
+}
+
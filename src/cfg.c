@@ -13,9 +13,12 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <pthread.h>
+
 #include "cfg.h"
 #include "ini_parser.h"
 #include "canopen/master.h"
+#include "canopen/lss.h"
 
 #define EXPORT __attribute__((visibility("default")))
 
@@ -24,61 +27,78 @@
 
 static int cfg__is_initialised = 0;
 static struct ini_file ini;
+static char cfg__path[256];
+
+/* Nodes are loaded on worker threads while the file may be reloaded */
+static pthread_rwlock_t cfg__lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* The globals as the file had them, without the command line */
+static struct cfg cfg__from_file;
 
 size_t strlcpy(char*, const char*, size_t);
 
 EXPORT
 struct cfg cfg;
 
-EXPORT
-void cfg_load_defaults(void)
+static void cfg__load_defaults(struct cfg* dst)
 {
-#define X(type, name, default_) CFG__SET_(type, cfg.name, default_);
+#define X(type, name, default_) CFG__SET_(type, dst->name, default_);
 	CFG__PARAMETERS
 #undef X
+}
 
+EXPORT
+void cfg_load_defaults(void)
+{
+	cfg__load_defaults(&cfg);
 }
 
-void cfg__load_node_defaults(int id)
+void cfg__load_node_defaults(struct cfg_node* dst)
 {
-#define X(type, name, default_) CFG__SET_(type, cfg.node[id].name, default_);
+#define X(type, name, default_) CFG__SET_(type, dst->name, default_);
 	CFG__NODE_PARAMETERS
 #undef X
 }
 
-void cfg__load_node_config(int id)
+void cfg__load_node_config(struct cfg_node* dst,
+			   const struct co_master_node* node)
 {
 	const char* v;
 #define X(type, name, default_) \
-		v = cfg__file_read(id, XSTR(name)); \
+		v = cfg__file_read(node, XSTR(name)); \
 		if (v) { \
-			CFG__SET_(type, cfg.node[id].name, CFG__STRTO_(type, v)); \
+			CFG__SET_(type, dst->name, CFG__STRTO_(type, v)); \
 		}
 
 	CFG__NODE_PARAMETERS
 #undef X
 }
 
-void cfg_load_node(int id)
+void cfg_load_node(struct co_master_node* node)
 {
-	cfg__load_node_defaults(id);
-	cfg__load_node_config(id);
+	struct cfg_node* dst = &node->cfg;
+
+	pthread_rwlock_rdlock(&cfg__lock);
+
+	cfg__load_node_defaults(dst);
+	cfg__load_node_config(dst, node);
 
 	if (cfg.be_strict)
-		cfg.node[id].ignore_sdo_multiplexer = 0;
+		dst->ignore_sdo_multiplexer = 0;
 
 	if (cfg.heartbeat_period)
-		cfg.node[id].heartbeat_period = cfg.heartbeat_period;
+		dst->heartbeat_period = cfg.heartbeat_period;
 
 	if (cfg.heartbeat_timeout)
-		cfg.node[id].heartbeat_timeout = cfg.heartbeat_timeout;
+		dst->heartbeat_timeout = cfg.heartbeat_timeout;
 
 	if (cfg.n_timeouts_max)
-		cfg.node[id].n_timeouts_max = cfg.n_timeouts_max;
+		dst->n_timeouts_max = cfg.n_timeouts_max;
+
+	pthread_rwlock_unlock(&cfg__lock);
 }
 
-EXPORT
-void cfg_load_globals(void)
+static void cfg__load_globals(struct cfg* dst)
 {
 	const char* v;
 
@@ -89,13 +109,22 @@ void cfg_load_globals(void)
 #define X(type, name, default_) \
 		v = ini_find_key(section, XSTR(name)); \
 		if (v) { \
-			CFG__SET_(type, cfg.name, CFG__STRTO_(type, v)); \
+			CFG__SET_(type, dst->name, CFG__STRTO_(type, v)); \
 		}
 
 	CFG__PARAMETERS
 #undef X
 }
 
+EXPORT
+void cfg_load_globals(void)
+{
+	cfg__load_globals(&cfg);
+
+	cfg__load_defaults(&cfg__from_file);
+	cfg__load_globals(&cfg__from_file);
+}
+
 int cfg__load_stream(FILE* stream)
 {
 	int r = ini_parse(&ini, stream);
@@ -109,13 +138,15 @@ int cfg_load_file(const char* path)
 {
 	int r = -1;
 
-	FILE* stream = fopen(path, "r");
+	FILE* stream = fopen(path, "re");
 	if (!stream)
 		return -1;
 
 	if (cfg__load_stream(stream) < 0)
 		goto failure;
 
+	strlcpy(cfg__path, path, sizeof(cfg__path));
+
 	r = 0;
 failure:
 	fclose(stream);
@@ -132,19 +163,71 @@ void cfg_unload_file(void)
 	cfg__is_initialised = 0;
 }
 
-const char* cfg__get_by_nodeid(int nodeid, const char* key)
+EXPORT
+int cfg_reload_file(cfg_accept_fn accept, void* context)
+{
+	struct ini_file new_ini;
+	struct cfg from_file;
+
+	if (!cfg__path[0])
+		return -1;
+
+	if (ini_parse_file(&new_ini, cfg__path) < 0)
+		return -1;
+
+	pthread_rwlock_wrlock(&cfg__lock);
+
+	if (cfg__is_initialised)
+		ini_destroy(&ini);
+
+	ini = new_ini;
+	cfg__is_initialised = 1;
+
+	cfg__load_defaults(&from_file);
+	cfg__load_globals(&from_file);
+
+#define X(type, name, default_) \
+	if (!CFG__EQ_(type, from_file.name, cfg__from_file.name) \
+	 && accept(XSTR(name), context)) { \
+		CFG__SET_(type, cfg.name, from_file.name); \
+		CFG__SET_(type, cfg__from_file.name, from_file.name); \
+	}
+
+	CFG__PARAMETERS
+#undef X
+
+	pthread_rwlock_unlock(&cfg__lock);
+	return 0;
+}
+
+const char* cfg__get_by_iface(const struct co_master_node* node,
+			      const char* key)
 {
+	if (!node->bus)
+		return NULL;
+
 	char section[256];
-	snprintf(section, sizeof(section) - 1, "#%d", nodeid);
+	snprintf(section, sizeof(section) - 1, "%s#%d", node->bus->iface,
+		 node->nodeid);
 	section[sizeof(section) - 1] = '\0';
 
 	return ini_find(&ini, section, key);
 }
 
-const char* cfg__get_by_name(int nodeid, const char* key)
+const char* cfg__get_by_nodeid(const struct co_master_node* node,
+			       const char* key)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	if (!node || !*node->name)
+	char section[256];
+	snprintf(section, sizeof(section) - 1, "#%d", node->nodeid);
+	section[sizeof(section) - 1] = '\0';
+
+	return ini_find(&ini, section, key);
+}
+
+const char* cfg__get_by_name(const struct co_master_node* node,
+			     const char* key)
+{
+	if (!*node->name)
 		return NULL;
 
 	char section[256];
@@ -154,17 +237,20 @@ const char* cfg__get_by_name(int nodeid, const char* key)
 	return ini_find(&ini, section, key);
 }
 
-const char* cfg__file_read(int nodeid, const char* key)
+const char* cfg__file_read(const struct co_master_node* node, const char* key)
 {
 	if (!cfg__is_initialised)
 		return NULL;
 
      	const char* result = NULL;
 
-	result = cfg__get_by_nodeid(nodeid, key);
+	result = cfg__get_by_iface(node, key);
+	if (result) goto done;
+
+	result = cfg__get_by_nodeid(node, key);
 	if (result) goto done;
 
-	result = cfg__get_by_name(nodeid, key);
+	result = cfg__get_by_name(node, key);
 	if (result) goto done;
 
 	result = ini_find(&ini, "all", key);
@@ -174,3 +260,66 @@ done:
 	return result;
 }
 
+/* A key is vendor:product:revision:serial. The revision may be "*", as it
+ * changes with the firmware.
+ */
+static int cfg__lss_key_matches(const char* key,
+				const struct lss_address* address)
+{
+	const char* p = key;
+
+	for (int i = 0; i < LSS_N_FIELDS; ++i) {
+		char* end;
+
+		if (i > 0 && *p++ != ':')
+			return 0;
+
+		if (i == LSS_REVISION_NUMBER && *p == '*') {
+			++p;
+			continue;
+		}
+
+		unsigned long value = strtoul(p, &end, 0);
+		if (end == p || value != address->field[i])
+			return 0;
+
+		p = end;
+	}
+
+	return *p == '\0';
+}
+
+int cfg_get_lss_nodeid(const struct lss_address* address)
+{
+	int nodeid = -1;
+
+	pthread_rwlock_rdlock(&cfg__lock);
+
+	const struct ini_section* section = cfg__is_initialised
+		? ini_find_section(&ini, "lss") : NULL;
+
+	for (size_t i = 0; section && i < ini_get_section_length(section);
+	     ++i) {
+		const struct ini_key_value* kv = &section->kv[i];
+
+		if (cfg__lss_key_matches(kv->key, address))
+			nodeid = strtoul(kv->value, NULL, 0);
+	}
+
+	pthread_rwlock_unlock(&cfg__lock);
+	return nodeid;
+}
+
+void cfg_for_each_key(const char* section_name, cfg_key_fn fn, void* context)
+{
+	pthread_rwlock_rdlock(&cfg__lock);
+
+	const struct ini_section* section = cfg__is_initialised
+		? ini_find_section(&ini, section_name) : NULL;
+
+	for (size_t i = 0; section && i < ini_get_section_length(section);
+	     ++i)
+		fn(section->kv[i].key, section->kv[i].value, context);
+
+	pthread_rwlock_unlock(&cfg__lock);
+}
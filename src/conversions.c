@@ -15,6 +15,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/types.h>
 #include "canopen/byteorder.h"
 #include "conversions.h"
 
@@ -22,45 +23,137 @@ size_t strlcpy(char* dst, const char* src, size_t dsize);
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
-#define MAKE_TOSTRING(name, type_, fmt) \
-char* canopen_ ## name ## _tostring(char* dst, size_t dst_size, \
-				    struct canopen_data* src) \
-{ \
-	if (!src->is_size_unknown && src->size > canopen_type_size(src->type)) \
-		return NULL; \
-	type_ value = 0; \
-	byteorder2(&value, src->data, sizeof(value), src->size); \
-	snprintf(dst, dst_size - 1, fmt, value); \
-	dst[dst_size - 1] = '\0'; \
-	return dst; \
+/* Long enough for any number that is formatted here */
+#define NUMBER_MAX 32
+
+static const char digit_pairs_[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+/* Two digits per division, written from the end of the buffer. Returns the
+ * number of characters, which are not terminated.
+ */
+static size_t format_uint(char* dst, uint64_t value)
+{
+	char buffer[20];
+	char* ptr = buffer + sizeof(buffer);
+
+	while (value > UINT32_MAX) {
+		unsigned int i = (value % 100) * 2;
+		value /= 100;
+		*--ptr = digit_pairs_[i + 1];
+		*--ptr = digit_pairs_[i];
+	}
+
+	/* 32 bit division is cheaper, and most values fit */
+	uint32_t small = value;
+
+	while (small >= 100) {
+		unsigned int i = (small % 100) * 2;
+		small /= 100;
+		*--ptr = digit_pairs_[i + 1];
+		*--ptr = digit_pairs_[i];
+	}
+
+	if (small >= 10) {
+		unsigned int i = small * 2;
+		*--ptr = digit_pairs_[i + 1];
+		*--ptr = digit_pairs_[i];
+	} else {
+		*--ptr = '0' + small;
+	}
+
+	size_t length = buffer + sizeof(buffer) - ptr;
+	memcpy(dst, ptr, length);
+	return length;
 }
 
-MAKE_TOSTRING(uint, uint64_t, "%llu")
-MAKE_TOSTRING(float, float, "%e")
-MAKE_TOSTRING(double, double, "%e")
+static size_t format_int(char* dst, int64_t value)
+{
+	if (value >= 0)
+		return format_uint(dst, value);
+
+	*dst = '-';
+	return 1 + format_uint(dst + 1, -(uint64_t)value);
+}
 
-char* canopen_int_tostring(char* dst, size_t dst_size, struct canopen_data* src)
+/* The value of an integer of the given type, in host byte order. Anything
+ * beyond the size of the type is ignored, which matters when the size of an
+ * SDO upload was not indicated.
+ */
+static uint64_t get_raw(const struct canopen_data* src, size_t type_size)
+{
+	uint64_t value = 0;
+	byteorder2(&value, src->data, sizeof(value), MIN(src->size, 8));
+
+	if (type_size < 8)
+		value &= (1ULL << (type_size * 8)) - 1;
+
+	return value;
+}
+
+static int64_t sign_extend(uint64_t value, size_t type_size)
+{
+	if (type_size < 8 && value & (1ULL << (type_size * 8 - 1)))
+		value |= ~0ULL << (type_size * 8);
+
+	return value;
+}
+
+/* Returns the length, which is at most NUMBER_MAX - 1, or -1 if the data does
+ * not fit the type.
+ */
+static ssize_t format_number(char* dst, const struct canopen_data* src)
 {
 	size_t size = canopen_type_size(src->type);
 
 	if (!src->is_size_unknown && src->size > size)
-		return NULL;
-
-	/* The CAN bus network-order is little-endian */
-	uint64_t buffer = 0;
-	memcpy(&buffer, src->data, src->size);
+		return -1;
 
-	unsigned char* byte = (unsigned char*)&buffer;
+	if (canopen_type_is_unsigned_integer(src->type))
+		return format_uint(dst, get_raw(src, size));
 
-	int64_t value = 0;
-	byteorder(&value, &buffer, sizeof(value));
+	if (canopen_type_is_signed_integer(src->type))
+		return format_int(dst, sign_extend(get_raw(src, size), size));
+
+	/* The program never calls setlocale(), so these always use '.' */
+	if (src->type == CANOPEN_REAL32) {
+		float value = 0;
+		byteorder2(&value, src->data, sizeof(value),
+			   MIN(src->size, sizeof(value)));
+		return snprintf(dst, NUMBER_MAX, "%e", value);
+	}
+
+	if (src->type == CANOPEN_REAL64) {
+		double value = 0;
+		byteorder2(&value, src->data, sizeof(value),
+			   MIN(src->size, sizeof(value)));
+		return snprintf(dst, NUMBER_MAX, "%e", value);
+	}
 
-	if (size != 8 && byte[size - 1] & 0x80)
-		value -= 1LLU << (size << 3);
+	return -1;
+}
 
-	snprintf(dst, dst_size - 1, "%lld", value);
-	dst[dst_size - 1] = '\0';
+static char* number_tostring(char* dst, size_t dst_size,
+			     const struct canopen_data* src)
+{
+	char buffer[NUMBER_MAX];
+	ssize_t length = format_number(buffer, src);
+	if (length < 0)
+		return NULL;
 
+	/* As much as fits in dst_size - 2 characters */
+	size_t n = MIN((size_t)length, dst_size - 2);
+	memcpy(dst, buffer, n);
+	dst[n] = '\0';
 	return dst;
 }
 
@@ -90,22 +183,52 @@ char* canopen_data_tostring(char* dst, size_t dst_size,
 	if (src->type == CANOPEN_BOOLEAN)
 		return canopen_bool_tostring(dst, dst_size, src);
 
-	if (canopen_type_is_unsigned_integer(src->type))
-		return canopen_uint_tostring(dst, dst_size, src);
+	if (canopen_type_is_string(src->type))
+		return canopen_string_tostring(dst, dst_size, src);
 
-	if (canopen_type_is_signed_integer(src->type))
-		return canopen_int_tostring(dst, dst_size, src);
+	return number_tostring(dst, dst_size, src);
+}
 
-	if (src->type == CANOPEN_REAL32)
-		return canopen_float_tostring(dst, dst_size, src);
+static ssize_t write_quoted(FILE* output, const void* data, size_t size,
+			   char quote)
+{
+	if (quote)
+		fputc(quote, output);
 
-	if (src->type == CANOPEN_REAL64)
-		return canopen_double_tostring(dst, dst_size, src);
+	if (fwrite(data, 1, size, output) != size)
+		return -1;
 
-	if (canopen_type_is_string(src->type))
-		return canopen_string_tostring(dst, dst_size, src);
+	if (quote)
+		fputc(quote, output);
+
+	return size + (quote ? 2 : 0);
+}
 
-	return NULL;
+ssize_t canopen_data_write(FILE* output, const struct canopen_data* src,
+			   char quote)
+{
+	if (src->type == CANOPEN_BOOLEAN) {
+		if (!src->is_size_unknown && src->size != 1)
+			return -1;
+
+		const char* str = *(const char*)src->data ? "true" : "false";
+		return write_quoted(output, str, strlen(str), quote);
+	}
+
+	/* Up to the first NUL, as canopen_data_tostring() does */
+	if (canopen_type_is_string(src->type)) {
+		const char* end = memchr(src->data, '\0', src->size);
+		size_t size = end ? (size_t)(end - (const char*)src->data)
+				  : src->size;
+		return write_quoted(output, src->data, size, quote);
+	}
+
+	char buffer[NUMBER_MAX];
+	ssize_t length = format_number(buffer, src);
+	if (length < 0)
+		return -1;
+
+	return write_quoted(output, buffer, length, quote);
 }
 
 int canopen_bool_fromstring(struct canopen_data* dst, const char* str)
@@ -124,19 +247,109 @@ int canopen_bool_fromstring(struct canopen_data* dst, const char* str)
 	return 0;
 }
 
-#define uint64_t_tonumber(str, end) strtoull(str, end, 0);
-#define int64_t_tonumber(str, end) strtoll(str, end, 0);
-#define float_tonumber(str, end) strtof(str, end);
-#define double_tonumber(str, end) strtod(str, end);
+static inline int digit_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return 16;
+}
+
+/* Like strtoull() with base 0, i.e. hexadecimal after 0x and octal after a
+ * leading 0, except that the whole string must be a number and that numbers
+ * that do not fit in 64 bits are refused.
+ */
+static int parse_uint(uint64_t* dst, const char* str)
+{
+	unsigned int base = 10;
+
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+		base = 16;
+		str += 2;
+	} else if (str[0] == '0' && str[1] != '\0') {
+		base = 8;
+		str += 1;
+	}
+
+	if (*str == '\0')
+		return -1;
+
+	uint64_t value = 0;
+
+	for (; *str; ++str) {
+		unsigned int digit = digit_value(*str);
+		if (digit >= base)
+			return -1;
+
+		if (__builtin_mul_overflow(value, base, &value)
+		 || __builtin_add_overflow(value, digit, &value))
+			return -1;
+	}
+
+	*dst = value;
+	return 0;
+}
+
+static int parse_int(int64_t* dst, const char* str)
+{
+	int is_negative = *str == '-';
+	if (*str == '-' || *str == '+')
+		++str;
+
+	uint64_t magnitude;
+	if (parse_uint(&magnitude, str) < 0)
+		return -1;
+
+	if (magnitude > (uint64_t)INT64_MAX + is_negative)
+		return -1;
+
+	*dst = is_negative ? (int64_t)-magnitude : (int64_t)magnitude;
+	return 0;
+}
+
+static int set_integer(struct canopen_data* dst, enum canopen_type type,
+		       uint64_t value)
+{
+	dst->data = &dst->value;
+	dst->size = canopen_type_size(type);
+	byteorder(dst->data, &value, sizeof(value));
+	return 0;
+}
+
+int canopen_uint_fromstring(struct canopen_data* dst, enum canopen_type type,
+			    const char* str)
+{
+	uint64_t value;
 
-#define tonumber(type, str, end) type ## _tonumber(str, end)
+	if (*str == '+')
+		++str;
+
+	if (parse_uint(&value, str) < 0)
+		return -1;
+
+	return set_integer(dst, type, value);
+}
+
+int canopen_int_fromstring(struct canopen_data* dst, enum canopen_type type,
+			   const char* str)
+{
+	int64_t value;
+
+	if (parse_int(&value, str) < 0)
+		return -1;
+
+	return set_integer(dst, type, value);
+}
 
-#define MAKE_FROMSTRING(name, type_, reject) \
+#define MAKE_FROMSTRING(name, type_, tonumber) \
 int canopen_ ## name ## _fromstring(struct canopen_data* dst, \
 				    enum canopen_type type, \
 				    const char* str) \
 { \
-	if (reject) \
+	if (*str == ' ') \
 		return -1; \
 \
 	dst->data = &dst->value; \
@@ -144,16 +357,14 @@ int canopen_ ## name ## _fromstring(struct canopen_data* dst, \
 	dst->value = 0; \
 \
 	char* end = NULL; \
-	type_ host_order = tonumber(type_, str, &end); \
+	type_ host_order = tonumber(str, &end); \
 	byteorder(dst->data, &host_order, sizeof(host_order)); \
 \
 	return (*str != '\0' && *end == '\0') ? 0 : -1; \
 }
 
-MAKE_FROMSTRING(uint, uint64_t, *str == ' ' || *str == '-')
-MAKE_FROMSTRING(int, int64_t, *str == ' ')
-MAKE_FROMSTRING(float, float, *str == ' ')
-MAKE_FROMSTRING(double, double, *str == ' ')
+MAKE_FROMSTRING(float, float, strtof)
+MAKE_FROMSTRING(double, double, strtod)
 
 int canopen_string_fromstring(struct canopen_data* dst, const char* str)
 {
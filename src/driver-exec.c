@@ -0,0 +1,178 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "driver-exec.h"
+#include "co_atomic.h"
+#include "rt-thread.h"
+
+static void drv_exec__drain(struct drv_exec* self)
+{
+	while (1) {
+		size_t tail = self->tail;
+		struct drv_exec_event* event = &self->events[tail & self->mask];
+
+		if (co_atomic_load_acquire(&event->seq) != tail + 1)
+			break;
+
+		event->fn(event->context, (const struct can_frame*)&event->frame,
+			  event->timestamp);
+
+		co_atomic_store_release(&event->seq, tail + self->mask + 1);
+
+		/* This pairs with the check in drv_exec_flush(), so both are
+		 * sequentially consistent.
+		 */
+		co_atomic_store(&self->tail, tail + 1);
+
+		if (co_atomic_load(&self->n_flushing)) {
+			pthread_mutex_lock(&self->mutex);
+			pthread_cond_broadcast(&self->has_progressed);
+			pthread_mutex_unlock(&self->mutex);
+		}
+	}
+}
+
+static void* drv_exec__run(void* context)
+{
+	struct drv_exec* self = context;
+
+	while (!co_atomic_load_acquire(&self->is_stopping)) {
+		if (sem_wait(&self->has_events) < 0)
+			continue;
+
+		drv_exec__drain(self);
+	}
+
+	drv_exec__drain(self);
+	return NULL;
+}
+
+int drv_exec_init(struct drv_exec* self, size_t n_events, const char* name)
+{
+	memset(self, 0, sizeof(*self));
+
+	size_t length = 1;
+	while (length < n_events)
+		length <<= 1;
+
+	self->events = malloc(length * sizeof(*self->events));
+	if (!self->events)
+		return -1;
+
+	for (size_t i = 0; i < length; ++i)
+		self->events[i].seq = i;
+
+	self->mask = length - 1;
+
+	if (sem_init(&self->has_events, 0, 0) < 0)
+		goto sem_failure;
+
+	pthread_mutex_init(&self->mutex, NULL);
+	pthread_cond_init(&self->has_progressed, NULL);
+
+	if (rt_thread_create(&self->thread, RT_THREAD_DRIVER, drv_exec__run,
+			     self, name) < 0)
+		goto thread_failure;
+
+	return 0;
+
+thread_failure:
+	pthread_cond_destroy(&self->has_progressed);
+	pthread_mutex_destroy(&self->mutex);
+	sem_destroy(&self->has_events);
+sem_failure:
+	free(self->events);
+	self->events = NULL;
+	return -1;
+}
+
+void drv_exec_destroy(struct drv_exec* self)
+{
+	if (!self->events)
+		return;
+
+	co_atomic_store_release(&self->is_stopping, 1);
+	sem_post(&self->has_events);
+	pthread_join(self->thread, NULL);
+
+	pthread_cond_destroy(&self->has_progressed);
+	pthread_mutex_destroy(&self->mutex);
+	sem_destroy(&self->has_events);
+	free(self->events);
+	self->events = NULL;
+}
+
+static struct drv_exec_event* drv_exec__claim(struct drv_exec* self)
+{
+	size_t pos = co_atomic_load_relaxed(&self->head);
+
+	while (1) {
+		struct drv_exec_event* event = &self->events[pos & self->mask];
+		size_t seq = co_atomic_load_acquire(&event->seq);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (co_atomic_cas(&self->head, pos, pos + 1))
+				return event;
+		} else if (diff < 0) {
+			return NULL;
+		}
+
+		pos = co_atomic_load_relaxed(&self->head);
+	}
+}
+
+int drv_exec_post(struct drv_exec* self, drv_exec_fn fn, void* context,
+		  const struct can_frame* cf, uint64_t timestamp)
+{
+	struct drv_exec_event* event = drv_exec__claim(self);
+	if (!event)
+		return -1;
+
+	size_t pos = co_atomic_load_relaxed(&event->seq);
+	size_t size = cf->can_dlc < CANFD_MAX_DLEN ? cf->can_dlc
+						    : CANFD_MAX_DLEN;
+
+	event->fn = fn;
+	event->context = context;
+	event->timestamp = timestamp;
+	memcpy(&event->frame, cf, offsetof(struct canfd_frame, data) + size);
+
+	co_atomic_store_release(&event->seq, pos + 1);
+	sem_post(&self->has_events);
+	return 0;
+}
+
+void drv_exec_flush(struct drv_exec* self)
+{
+	size_t target = co_atomic_load(&self->head);
+
+	pthread_mutex_lock(&self->mutex);
+	co_atomic_add_fetch(&self->n_flushing, 1);
+
+	while ((intptr_t)(co_atomic_load(&self->tail) - target) < 0)
+		pthread_cond_wait(&self->has_progressed, &self->mutex);
+
+	co_atomic_sub_fetch(&self->n_flushing, 1);
+	pthread_mutex_unlock(&self->mutex);
+}
@@ -0,0 +1,281 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "driver-registry.h"
+#include "vector.h"
+#include "plog.h"
+
+#ifndef DRIVER_PATH
+#define DRIVER_PATH "/usr/lib/canopen"
+#endif
+
+#define DRV_REGISTRY_PREFIX "co_drv_"
+#define DRV_REGISTRY_SUFFIX ".so"
+
+size_t strlcpy(char*, const char*, size_t);
+
+/* Sorted by name. The entries do not move once the index is made, so
+ * pointers to them stay valid until the cleanup.
+ */
+static struct drv_dso* drv_registry_;
+static size_t drv_registry_length_;
+static int drv_registry_is_scanned_;
+
+/* Entries that drv_registry_preload() holds a reference to */
+static struct drv_dso** drv_registry_preloaded_;
+static size_t drv_registry_n_preloaded_;
+
+static pthread_mutex_t drv_registry_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
+static int drv_registry__cmp(const void* a, const void* b)
+{
+	const struct drv_dso* x = a;
+	const struct drv_dso* y = b;
+	return strcasecmp(x->name, y->name);
+}
+
+/* Returns 0 and puts the name in dst if the file is a driver */
+static int drv_registry__get_name(char* dst, size_t size, const char* file)
+{
+	size_t prefix_length = strlen(DRV_REGISTRY_PREFIX);
+	size_t suffix_length = strlen(DRV_REGISTRY_SUFFIX);
+	size_t length = strlen(file);
+
+	if (length <= prefix_length + suffix_length
+	 || strncmp(file, DRV_REGISTRY_PREFIX, prefix_length) != 0
+	 || strcmp(file + length - suffix_length, DRV_REGISTRY_SUFFIX) != 0)
+		return -1;
+
+	size_t name_length = length - prefix_length - suffix_length;
+	if (name_length >= size)
+		return -1;
+
+	memcpy(dst, file + prefix_length, name_length);
+	dst[name_length] = '\0';
+	return 0;
+}
+
+static int drv_registry__scan(const char* path)
+{
+	struct vector entries;
+	if (vector_init(&entries, 16 * sizeof(struct drv_dso)) < 0)
+		return -1;
+
+	DIR* dir = opendir(path);
+	if (!dir) {
+		plog(LOG_NOTICE, "driver: Could not open driver directory %s: %m",
+		     path);
+		goto done;
+	}
+
+	struct dirent* dirent;
+	while ((dirent = readdir(dir))) {
+		struct drv_dso dso;
+		memset(&dso, 0, sizeof(dso));
+
+		if (drv_registry__get_name(dso.name, sizeof(dso.name),
+					   dirent->d_name) < 0)
+			continue;
+
+		int length = snprintf(dso.path, sizeof(dso.path), "%s/%s",
+				      path, dirent->d_name);
+		if (length < 0 || (size_t)length >= sizeof(dso.path))
+			continue;
+
+		if (vector_append(&entries, &dso, sizeof(dso)) < 0) {
+			closedir(dir);
+			vector_destroy(&entries);
+			return -1;
+		}
+	}
+
+	closedir(dir);
+
+done:
+	drv_registry_ = entries.data;
+	drv_registry_length_ = entries.index / sizeof(struct drv_dso);
+	qsort(drv_registry_, drv_registry_length_, sizeof(struct drv_dso),
+	      drv_registry__cmp);
+
+	drv_registry_is_scanned_ = 1;
+	return 0;
+}
+
+int drv_registry_scan(const char* path)
+{
+	pthread_mutex_lock(&drv_registry_lock_);
+
+	int rc = drv_registry_is_scanned_ ? 0 : drv_registry__scan(path);
+
+	pthread_mutex_unlock(&drv_registry_lock_);
+	return rc;
+}
+
+static struct drv_dso* drv_registry__find(const char* name)
+{
+	struct drv_dso key;
+	if (strlcpy(key.name, name, sizeof(key.name)) >= sizeof(key.name))
+		return NULL;
+
+	return bsearch(&key, drv_registry_, drv_registry_length_,
+		       sizeof(struct drv_dso), drv_registry__cmp);
+}
+
+static int drv_registry__load(struct drv_dso* dso)
+{
+	dso->handle = dlopen(dso->path, RTLD_NOW | RTLD_LOCAL);
+	const char* err = dlerror();
+	if (!dso->handle) {
+		plog(LOG_ERROR, "driver: Failed to load driver for '%s': %s",
+		     dso->name, err);
+		return -1;
+	}
+
+	dso->init_fn = dlsym(dso->handle, "co_drv_init");
+	dlerror();
+	if (dso->init_fn)
+		return 0;
+
+	plog(LOG_ERROR, "driver: DSO for '%s' does not export an 'init' function",
+	     dso->name);
+
+	dlclose(dso->handle);
+	dso->handle = NULL;
+	return -1;
+}
+
+static struct drv_dso* drv_registry__open(const char* name)
+{
+	if (!drv_registry_is_scanned_ && drv_registry__scan(DRIVER_PATH) < 0)
+		return NULL;
+
+	struct drv_dso* dso = drv_registry__find(name);
+	if (!dso || dso->is_broken)
+		return NULL;
+
+	if (dso->ref == 0 && drv_registry__load(dso) < 0) {
+		dso->is_broken = 1;
+		return NULL;
+	}
+
+	++dso->ref;
+	return dso;
+}
+
+struct drv_dso* drv_registry_open(const char* name)
+{
+	pthread_mutex_lock(&drv_registry_lock_);
+	struct drv_dso* dso = drv_registry__open(name);
+	pthread_mutex_unlock(&drv_registry_lock_);
+	return dso;
+}
+
+static void drv_registry__close(struct drv_dso* dso)
+{
+	assert(dso->ref > 0);
+
+	if (--dso->ref > 0)
+		return;
+
+	dlclose(dso->handle);
+	dso->handle = NULL;
+	dso->init_fn = NULL;
+}
+
+void drv_registry_close(struct drv_dso* dso)
+{
+	pthread_mutex_lock(&drv_registry_lock_);
+	drv_registry__close(dso);
+	pthread_mutex_unlock(&drv_registry_lock_);
+}
+
+static int drv_registry__is_preloaded(const struct drv_dso* dso)
+{
+	for (size_t i = 0; i < drv_registry_n_preloaded_; ++i)
+		if (drv_registry_preloaded_[i] == dso)
+			return 1;
+
+	return 0;
+}
+
+int drv_registry_preload(const char* name)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&drv_registry_lock_);
+
+	struct drv_dso* dso = drv_registry__open(name);
+	if (!dso)
+		goto done;
+
+	rc = 0;
+
+	if (drv_registry__is_preloaded(dso)) {
+		drv_registry__close(dso);
+		goto done;
+	}
+
+	struct drv_dso** preloaded = realloc(drv_registry_preloaded_,
+		(drv_registry_n_preloaded_ + 1) * sizeof(*preloaded));
+	if (!preloaded) {
+		drv_registry__close(dso);
+		goto done;
+	}
+
+	preloaded[drv_registry_n_preloaded_++] = dso;
+	drv_registry_preloaded_ = preloaded;
+
+done:
+	pthread_mutex_unlock(&drv_registry_lock_);
+	return rc;
+}
+
+size_t drv_registry_get_n_open(void)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&drv_registry_lock_);
+
+	for (size_t i = 0; i < drv_registry_length_; ++i)
+		if (drv_registry_[i].ref > 0)
+			++n;
+
+	pthread_mutex_unlock(&drv_registry_lock_);
+	return n;
+}
+
+void drv_registry_cleanup(void)
+{
+	pthread_mutex_lock(&drv_registry_lock_);
+
+	for (size_t i = 0; i < drv_registry_n_preloaded_; ++i)
+		drv_registry__close(drv_registry_preloaded_[i]);
+
+	free(drv_registry_preloaded_);
+	drv_registry_preloaded_ = NULL;
+	drv_registry_n_preloaded_ = 0;
+
+	pthread_mutex_unlock(&drv_registry_lock_);
+}
@@ -15,87 +15,171 @@
 
 #include <stdlib.h>
 #include <stdint.h>
-#include <dlfcn.h>
+#include <errno.h>
 #include <unistd.h>
 #include "socketcan.h"
 #include "canopen/master.h"
 #include "canopen/sdo_req.h"
 #include "canopen/emcy.h"
+#include "canopen/eds.h"
+#include "canopen/sdo_sync.h"
+#include "canopen/pdo-map.h"
 #include "canopen-driver.h"
-#include "string-utils.h"
+#include "driver-registry.h"
+#include "mem-tag.h"
 #include "plog.h"
 
-#ifndef DRIVER_PATH
-#define DRIVER_PATH "/usr/lib/canopen"
-#endif
-
-size_t strlcpy(char*, const char*, size_t);
-
 struct co_sdo_req {
 	struct sdo_req req;
 	struct co_drv* drv;
 	co_sdo_done_fn on_done;
+	co_sdo_data_fn on_data;
+	int fd;
+};
+
+struct co_sdo_batch {
+	struct sdo_batch batch;
+	struct co_drv* drv;
+	co_sdo_batch_done_fn on_done;
 };
 
-const char* co__drv_find_dso(const char* name)
+int co_drv_load(struct co_drv* drv, const char* name)
 {
-	static __thread char result[256];
+	assert(!drv->dso);
+
+	drv->dso = drv_registry_open(name);
+	if (!drv->dso)
+		return -1;
 
-	char name_buffer[256];
-	strlcpy(name_buffer, name, 256);
+	drv->init_fn = drv->dso->init_fn;
+	return 0;
+}
 
-	snprintf(result, sizeof(result), DRIVER_PATH "/co_drv_%s.so",
-		 string_tolower(name_buffer));
-	result[sizeof(result) - 1] = '\0';
+int co_drv_init(struct co_drv* drv)
+{
+	return drv->init_fn(drv);
+}
 
-	if (access(result, R_OK) < 0)
-		return NULL;
+void co_drv_unload(struct co_drv* drv)
+{
+	if (drv->sync_cycle_fn)
+		co_set_sync_cycle_fn(drv, 0, NULL);
+
+	if (drv->context && drv->free_fn)
+		drv->free_fn(drv->context);
 
-	return result;
+	drv_registry_close(drv->dso);
+
+	for (int i = 0; i < 4; ++i) {
+		free(drv->tpdo_map[i]);
+		free(drv->rpdo_map[i]);
+	}
+
+	struct co_master_node* node = drv->node;
+	memset(drv, 0, sizeof(*drv));
+	drv->node = node;
 }
 
-int co_drv_load(struct co_drv* drv, const char* name)
+static int co__pdo_map_is_signed(const struct canopen_eds* eds, uint32_t value)
 {
-	assert(!drv->dso);
+	int index = value >> 16;
+	int subindex = (value >> 8) & 0xff;
 
-	const char* path = co__drv_find_dso(name);
-	if (!path)
-		return -1;
+	/* Dummy entries are mapped by the index of their data type */
+	if (index < 0x20)
+		return canopen_type_is_signed_integer(index);
+
+	if (!eds)
+		return 0;
+
+	const struct eds_obj* obj = eds_obj_find(eds, index, subindex);
+	return obj && canopen_type_is_signed_integer(obj->type);
+}
 
-	drv->dso = dlopen(path, RTLD_NOW | RTLD_LOCAL);
-	const char* err = dlerror();
-	if (!drv->dso) {
-		plog(LOG_ERROR, "driver: Failed to load driver for '%s': %s",
-		     name, err);
+static int co__load_pdo_map_from_node(struct pdo_map* map,
+				      struct co_master_node* node,
+				      const struct canopen_eds* eds, int index)
+{
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(node);
+
+	errno = 0;
+	uint8_t length = sdo_sync_read_u8(queue, index, 0);
+	if (errno != 0)
 		return -1;
+
+	for (int i = 1; i <= length; ++i) {
+		uint32_t value = sdo_sync_read_u32(queue, index, i);
+		if (errno != 0)
+			return -1;
+
+		int is_signed = co__pdo_map_is_signed(eds, value);
+		if (pdo_map_add(map, value, is_signed) < 0)
+			return -1;
 	}
 
-	drv->init_fn = dlsym(drv->dso, "co_drv_init");
-	dlerror();
-	if (drv->init_fn)
-		return 0;
+	return 0;
+}
 
-	plog(LOG_ERROR, "driver: DSO for '%s' does not export an 'init' function",
-	     name);
+static int co__eds_read_u32(uint32_t* dst, const struct canopen_eds* eds,
+			    int index, int subindex)
+{
+	const struct eds_obj* obj = eds_obj_find(eds, index, subindex);
+	if (!obj || !obj->default_value)
+		return -1;
 
-	dlclose(drv->dso);
-	memset(drv, 0, sizeof(*drv));
-	return -1;
+	char* end = NULL;
+	*dst = strtoul(obj->default_value, &end, 0);
+	return *end == '\0' ? 0 : -1;
 }
 
-int co_drv_init(struct co_drv* drv)
+static int co__load_pdo_map_from_eds(struct pdo_map* map,
+				     const struct canopen_eds* eds, int index)
 {
-	return drv->init_fn(drv);
+	uint32_t length;
+
+	if (!eds || co__eds_read_u32(&length, eds, index, 0) < 0)
+		return -1;
+
+	for (uint32_t i = 1; i <= length; ++i) {
+		uint32_t value;
+		if (co__eds_read_u32(&value, eds, index, i) < 0)
+			return -1;
+
+		int is_signed = co__pdo_map_is_signed(eds, value);
+		if (pdo_map_add(map, value, is_signed) < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
-void co_drv_unload(struct co_drv* drv)
+static struct pdo_map* co__load_pdo_map(struct co_drv* self, int index)
 {
-	if (drv->context && drv->free_fn)
-		drv->free_fn(drv->context);
+	struct co_master_node* node = co_drv_node(self);
+	const struct canopen_eds* eds = co_master_find_eds(node);
 
-	dlclose(drv->dso);
+	struct pdo_map* map = malloc(sizeof(*map));
+	if (!map)
+		return NULL;
 
-	memset(drv, 0, sizeof(*drv));
+	pdo_map_init(map);
+	if (co__load_pdo_map_from_node(map, node, eds, index) >= 0)
+		return map;
+
+	pdo_map_init(map);
+	if (co__load_pdo_map_from_eds(map, eds, index) >= 0)
+		return map;
+
+	plog(LOG_ERROR, "driver: Could not load PDO mapping 0x%04x of node %d on %s",
+	     index, co_master_get_node_id(node), node->bus->iface);
+
+	free(map);
+	return NULL;
+}
+
+static inline int co__is_pdo_number(int n)
+{
+	return 1 <= n && n <= 4;
 }
 
 #pragma GCC visibility push(default)
@@ -105,6 +189,11 @@ int co_get_nodeid(const struct co_drv* self)
 	return co_master_get_node_id(co_drv_node(self));
 }
 
+uint64_t co_get_rx_timestamp(const struct co_drv* self)
+{
+	return self->rx_timestamp;
+}
+
 uint32_t co_get_device_type(const struct co_drv* self)
 {
 	return co_drv_node(self)->device_type;
@@ -141,44 +230,135 @@ void* co_get_context(const struct co_drv* self)
 	return self->context;
 }
 
+static void co__set_pdo_fn(struct co_drv* self, int n, co_pdo_fn fn)
+{
+	self->pdo_fn[n - 1] = fn;
+	co__mux_update(co_drv_node(self));
+}
+
 void co_set_pdo1_fn(struct co_drv* self, co_pdo_fn fn)
 {
-	self->pdo1_fn = fn;
+	co__set_pdo_fn(self, 1, fn);
 }
 
 void co_set_pdo2_fn(struct co_drv* self, co_pdo_fn fn)
 {
-	self->pdo2_fn = fn;
+	co__set_pdo_fn(self, 2, fn);
 }
 
 void co_set_pdo3_fn(struct co_drv* self, co_pdo_fn fn)
 {
-	self->pdo3_fn = fn;
+	co__set_pdo_fn(self, 3, fn);
 }
 
 void co_set_pdo4_fn(struct co_drv* self, co_pdo_fn fn)
 {
-	self->pdo4_fn = fn;
+	co__set_pdo_fn(self, 4, fn);
+}
+
+void co_set_tpdo_fn(struct co_drv* self, co_tpdo_fn fn)
+{
+	self->tpdo_fn = fn;
+	co__mux_update(co_drv_node(self));
+}
+
+int co_set_sync_cycle_fn(struct co_drv* self, unsigned int mask,
+			 co_sync_cycle_fn fn)
+{
+	if (cfg.sync_interval == 0 || (mask & ~0xfU))
+		return -1;
+
+	struct co_master_node* node = co_drv_node(self);
+
+	self->sync_cycle_fn = fn;
+	sync_cycle_set_expected(&node->bus->sync_cycle,
+				co_master_get_node_id(node), fn ? mask : 0);
+	co__mux_update(node);
+	return 0;
 }
 
 int co_rpdo1(struct co_drv* self, const void* data, size_t size)
 {
-	return co__rpdox(co_get_nodeid(self), R_RPDO1, data, size);
+	return co__rpdox(co_drv_node(self), R_RPDO1, data, size);
 }
 
 int co_rpdo2(struct co_drv* self, const void* data, size_t size)
 {
-	return co__rpdox(co_get_nodeid(self), R_RPDO2, data, size);
+	return co__rpdox(co_drv_node(self), R_RPDO2, data, size);
 }
 
 int co_rpdo3(struct co_drv* self, const void* data, size_t size)
 {
-	return co__rpdox(co_get_nodeid(self), R_RPDO3, data, size);
+	return co__rpdox(co_drv_node(self), R_RPDO3, data, size);
 }
 
 int co_rpdo4(struct co_drv* self, const void* data, size_t size)
 {
-	return co__rpdox(co_get_nodeid(self), R_RPDO4, data, size);
+	return co__rpdox(co_drv_node(self), R_RPDO4, data, size);
+}
+
+int co_set_tpdo_signal_fn(struct co_drv* self, int n, co_pdo_signal_fn fn)
+{
+	if (!co__is_pdo_number(n))
+		return -1;
+
+	if (fn && !self->tpdo_map[n - 1]) {
+		self->tpdo_map[n - 1] = co__load_pdo_map(self, 0x1A00 + n - 1);
+		if (!self->tpdo_map[n - 1])
+			return -1;
+	}
+
+	self->tpdo_signal_fn[n - 1] = fn;
+	co__mux_update(co_drv_node(self));
+	return 0;
+}
+
+int co_map_rpdo(struct co_drv* self, int n)
+{
+	if (!co__is_pdo_number(n))
+		return -1;
+
+	if (self->rpdo_map[n - 1])
+		return 0;
+
+	self->rpdo_map[n - 1] = co__load_pdo_map(self, 0x1600 + n - 1);
+	return self->rpdo_map[n - 1] ? 0 : -1;
+}
+
+int co_get_tpdo_signal_position(const struct co_drv* self, int n, int index,
+				int subindex)
+{
+	if (!co__is_pdo_number(n) || !self->tpdo_map[n - 1])
+		return -1;
+
+	return pdo_map_find(self->tpdo_map[n - 1], index, subindex);
+}
+
+int co_get_rpdo_signal_position(const struct co_drv* self, int n, int index,
+				int subindex)
+{
+	if (!co__is_pdo_number(n) || !self->rpdo_map[n - 1])
+		return -1;
+
+	return pdo_map_find(self->rpdo_map[n - 1], index, subindex);
+}
+
+int co_rpdo_signals(struct co_drv* self, int n, const uint64_t* values,
+		    size_t n_values)
+{
+	static const int type[] = { R_RPDO1, R_RPDO2, R_RPDO3, R_RPDO4 };
+
+	if (!co__is_pdo_number(n))
+		return -1;
+
+	const struct pdo_map* map = self->rpdo_map[n - 1];
+	if (!map || n_values != map->length)
+		return -1;
+
+	uint8_t data[PDO_MAP_MAX_SIZE];
+	size_t size = pdo_map_pack(map, data, values);
+
+	return co__rpdox(co_drv_node(self), type[n - 1], data, size);
 }
 
 void co_set_emcy_fn(struct co_drv* self, co_emcy_fn fn)
@@ -193,7 +373,7 @@ void co_set_start_fn(struct co_drv* self, co_start_fn fn)
 
 const char* co_get_network_name(const struct co_drv* self)
 {
-	return self->iface;
+	return co_drv_node(self)->bus->iface;
 }
 
 void co_sdo_req_ref(struct co_sdo_req* self)
@@ -274,10 +454,83 @@ void* co_sdo_req_get_context(const struct co_sdo_req* self)
 	return self->req.context;
 }
 
+void co_sdo_req_set_block_transfer(struct co_sdo_req* self, int use_block)
+{
+	self->req.use_block = use_block;
+}
+
+static enum sdo_req_priority co__sdo_priority(enum co_sdo_priority priority)
+{
+	switch (priority) {
+	case CO_SDO_PRIO_NORMAL: return SDO_REQ_PRIO_NORMAL;
+	case CO_SDO_PRIO_HIGH: return SDO_REQ_PRIO_HIGH;
+	case CO_SDO_PRIO_BACKGROUND: return SDO_REQ_PRIO_BACKGROUND;
+	}
+
+	abort();
+	return -1;
+}
+
+void co_sdo_req_set_priority(struct co_sdo_req* self,
+			     enum co_sdo_priority priority)
+{
+	self->req.priority = co__sdo_priority(priority);
+}
+
+void co_sdo_req_set_cache_max_age(struct co_sdo_req* self, int max_age)
+{
+	self->req.cache_max_age = max_age;
+}
+
+static int co__sdo_req_on_data(struct sdo_req* req, const void* data,
+			       size_t size)
+{
+	struct co_sdo_req* self = (void*)req;
+	return self->on_data(self->drv, self, data, size);
+}
+
+void co_sdo_req_set_data_fn(struct co_sdo_req* self, co_sdo_data_fn fn)
+{
+	self->on_data = fn;
+	self->req.on_data = fn ? co__sdo_req_on_data : NULL;
+}
+
+static int co__sdo_req_write(struct co_drv* drv, struct co_sdo_req* self,
+			     const void* data, size_t size)
+{
+	(void)drv;
+	const char* ptr = data;
+
+	while (size > 0) {
+		ssize_t rc = write(self->fd, ptr, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		ptr += rc;
+		size -= rc;
+	}
+
+	return 0;
+}
+
+void co_sdo_req_set_output_fd(struct co_sdo_req* self, int fd)
+{
+	self->fd = fd;
+	co_sdo_req_set_data_fn(self, co__sdo_req_write);
+}
+
+int co_sdo_req_resume(struct co_sdo_req* self)
+{
+	return sdo_req_resume(&self->req);
+}
+
 int co_sdo_req_start(struct co_sdo_req* self)
 {
-	int nodeid = co_get_nodeid(self->drv);
-	return sdo_req_start(&self->req, sdo_req_queue_get(nodeid));
+	struct co_master_node* node = co_drv_node(self->drv);
+	return sdo_req_start(&self->req, co_master_get_sdo_queue(node));
 }
 
 const void* co_sdo_req_get_data(const struct co_sdo_req* self)
@@ -300,9 +553,9 @@ int co_sdo_req_get_subindex(const struct co_sdo_req* self)
 	return self->req.subindex;
 }
 
-enum co_sdo_status co_sdo_req_get_status(const struct co_sdo_req* self)
+static enum co_sdo_status co__sdo_status(enum sdo_req_status status)
 {
-	switch (self->req.status) {
+	switch (status) {
 	case SDO_REQ_PENDING: return CO_SDO_REQ_PENDING;
 	case SDO_REQ_OK: return CO_SDO_REQ_OK;
 	case SDO_REQ_LOCAL_ABORT: return CO_SDO_REQ_LOCAL_ABORT;
@@ -315,6 +568,211 @@ enum co_sdo_status co_sdo_req_get_status(const struct co_sdo_req* self)
 	return -1;
 }
 
+enum co_sdo_status co_sdo_req_get_status(const struct co_sdo_req* self)
+{
+	return co__sdo_status(self->req.status);
+}
+
+void co_sdo_batch_ref(struct co_sdo_batch* self)
+{
+	sdo_req_ref(&self->batch.req);
+}
+
+int co_sdo_batch_unref(struct co_sdo_batch* self)
+{
+	return sdo_req_unref(&self->batch.req);
+}
+
+static void co__sdo_batch_on_done(struct sdo_req* req)
+{
+	struct co_sdo_batch* self = (void*)req;
+
+	co_sdo_batch_done_fn on_done = self->on_done;
+	if (on_done)
+		on_done(self->drv, self);
+}
+
+struct co_sdo_batch* co_sdo_batch_new(struct co_drv* drv)
+{
+	struct co_sdo_batch* self = mem_alloc(MEM_TAG_SDO_REQ, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+
+	sdo_batch_init(&self->batch, co__sdo_batch_on_done, NULL);
+	self->drv = drv;
+
+	return self;
+}
+
+int co_sdo_batch_add_read(struct co_sdo_batch* self, int index, int subindex)
+{
+	return sdo_batch_add_upload(&self->batch, index, subindex);
+}
+
+int co_sdo_batch_add_write(struct co_sdo_batch* self, int index, int subindex,
+			   const void* data, size_t size)
+{
+	return sdo_batch_add_download(&self->batch, index, subindex, data,
+				      size);
+}
+
+void co_sdo_batch_set_done_fn(struct co_sdo_batch* self,
+			      co_sdo_batch_done_fn fn)
+{
+	self->on_done = fn;
+}
+
+void co_sdo_batch_set_context(struct co_sdo_batch* self, void* context,
+			      co_free_fn free_fn)
+{
+	self->batch.req.context = context;
+	self->batch.req.context_free_fn = free_fn;
+}
+
+void* co_sdo_batch_get_context(const struct co_sdo_batch* self)
+{
+	return self->batch.req.context;
+}
+
+void co_sdo_batch_set_block_transfer(struct co_sdo_batch* self, int use_block)
+{
+	self->batch.req.use_block = use_block;
+}
+
+void co_sdo_batch_set_priority(struct co_sdo_batch* self,
+			       enum co_sdo_priority priority)
+{
+	self->batch.req.priority = co__sdo_priority(priority);
+}
+
+int co_sdo_batch_start(struct co_sdo_batch* self)
+{
+	struct co_master_node* node = co_drv_node(self->drv);
+	return sdo_batch_start(&self->batch, co_master_get_sdo_queue(node));
+}
+
+enum co_sdo_status co_sdo_batch_get_status(const struct co_sdo_batch* self)
+{
+	return co__sdo_status(self->batch.req.status);
+}
+
+size_t co_sdo_batch_get_length(const struct co_sdo_batch* self)
+{
+	return sdo_batch_length(&self->batch);
+}
+
+enum co_sdo_status co_sdo_batch_get_item_status(const struct co_sdo_batch* self,
+						size_t i)
+{
+	return co__sdo_status(sdo_batch_get_item(&self->batch, i)->status);
+}
+
+const void* co_sdo_batch_get_item_data(const struct co_sdo_batch* self,
+				       size_t i)
+{
+	return sdo_batch_get_item(&self->batch, i)->data.data;
+}
+
+size_t co_sdo_batch_get_item_size(const struct co_sdo_batch* self, size_t i)
+{
+	return sdo_batch_get_item(&self->batch, i)->data.index;
+}
+
+static enum sdo_batch_policy co__sdo_batch_policy(enum co_sdo_on_failure p)
+{
+	switch (p) {
+	case CO_SDO_STOP: return SDO_BATCH_STOP;
+	case CO_SDO_CONTINUE: return SDO_BATCH_CONTINUE;
+	case CO_SDO_IGNORE: return SDO_BATCH_IGNORE;
+	}
+
+	abort();
+	return -1;
+}
+
+static int co__sdo_batch_add_step(struct sdo_batch* batch,
+				  const struct co_sdo_step* step)
+{
+	uint8_t buffer[sizeof(step->value)];
+	int rc;
+
+	switch (step->type) {
+	case CO_SDO_DOWNLOAD:
+		if (step->data) {
+			rc = sdo_batch_add_download(batch, step->index,
+						    step->subindex, step->data,
+						    step->size);
+			break;
+		}
+
+		if (step->size == 0 || step->size > sizeof(buffer)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (size_t i = 0; i < step->size; ++i)
+			buffer[i] = step->value >> (8 * i);
+
+		rc = sdo_batch_add_download(batch, step->index, step->subindex,
+					    buffer, step->size);
+		break;
+	case CO_SDO_UPLOAD:
+		rc = step->mask
+		   ? sdo_batch_add_check(batch, step->index, step->subindex,
+					 step->size, step->value, step->mask)
+		   : sdo_batch_add_upload(batch, step->index, step->subindex);
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (rc < 0)
+		return -1;
+
+	struct sdo_batch_item* item;
+	item = sdo_batch_get_item(batch, sdo_batch_length(batch) - 1);
+	item->policy = co__sdo_batch_policy(step->on_failure);
+	item->use_block = step->data != NULL && step->size > 7;
+	return 0;
+}
+
+struct co_sdo_batch* co_sdo_batch_new_script(struct co_drv* drv,
+					     const struct co_sdo_step* steps,
+					     size_t n_steps)
+{
+	struct co_sdo_batch* self = co_sdo_batch_new(drv);
+	if (!self)
+		return NULL;
+
+	for (size_t i = 0; i < n_steps; ++i)
+		if (co__sdo_batch_add_step(&self->batch, &steps[i]) < 0)
+			goto failure;
+
+	return self;
+
+failure:
+	co_sdo_batch_unref(self);
+	return NULL;
+}
+
+int co_sdo_run_script(struct co_drv* drv, const struct co_sdo_step* steps,
+		      size_t n_steps, co_sdo_batch_done_fn fn)
+{
+	struct co_sdo_batch* batch = co_sdo_batch_new_script(drv, steps,
+							     n_steps);
+	if (!batch)
+		return -1;
+
+	co_sdo_batch_set_done_fn(batch, fn);
+
+	int rc = co_sdo_batch_start(batch);
+	co_sdo_batch_unref(batch);
+	return rc;
+}
+
 int co_sdo_send_blob(struct co_drv* self, int index, int subindex,
 		     const void* payload, size_t size)
 {
@@ -330,7 +788,7 @@ int co_sdo_send_blob(struct co_drv* self, int index, int subindex,
 	if (!req)
 		return -1;
 
-	int r = sdo_req_start(req, sdo_req_queue_get(co_get_nodeid(self)));
+	int r = sdo_req_start(req, co_master_get_sdo_queue(co_drv_node(self)));
 	sdo_req_unref(req);
 	return r;
 }
@@ -340,14 +798,19 @@ void co_byteorder(void* dst, const void* src, size_t dst_size, size_t src_size)
 	return byteorder2(dst, src, dst_size, src_size);
 }
 
+void co_byteorder_array(void* dst, const void* src, size_t size, size_t n)
+{
+	byteorder_array(dst, src, size, n);
+}
+
 void co_setopt(struct co_drv* self, enum co_options opt)
 {
-	self->options = opt;
+	self->options |= opt;
 }
 
 void co_start(struct co_drv* self)
 {
-	co__start(co_get_nodeid(self));
+	co__start(co_drv_node(self));
 }
 
 #pragma GCC visibility pop
@@ -14,7 +14,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
 
 #include "socketcan.h"
 #include "canopen.h"
@@ -31,6 +34,13 @@
 #include "canopen/error.h"
 #include "time-utils.h"
 #include "trace-buffer.h"
+#include "trace-record.h"
+#include "trace-analysis.h"
+#include "trace-replay.h"
+#include "async-writer.h"
+#include "bus-load.h"
+#include "sdo-trace.h"
+#include "pcapng.h"
 
 #ifndef CAN_MAX_DLC
 #define CAN_MAX_DLC 8
@@ -38,8 +48,25 @@
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/* A whole multicast datagram fits into one batch */
+#define DUMP_BATCH_SIZE 64
+
+/* Live dumps can receive frames faster than a terminal takes the text */
+#define DUMP_RING_LENGTH 4096
+
+#define TOP_INTERVAL 1000000ULL
+#define TOP_N_ROWS 16
+#define TOP_BITRATE_DEFAULT 1000000
+
+/* pcapng goes out in blocks of this size while frames come in faster than
+ * they are received one batch at a time
+ */
+#define PCAP_BUFFER_SIZE (1 << 16)
+
+#define print(...) aw_printf(&writer_, __VA_ARGS__)
+
 #define printx(cf, fmt, ...) \
-	printf(fmt "%s\n", ## __VA_ARGS__, (cf)->can_id & CAN_RTR_FLAG ? " [RTR]" : "")
+	print(fmt "%s\n", ## __VA_ARGS__, (cf)->can_id & CAN_RTR_FLAG ? " [RTR]" : "")
 
 struct node_state {
 	uint32_t current_mux;
@@ -50,6 +77,13 @@ struct node_state {
 static enum co_dump_options options_ = 0;
 static struct node_state node_state_[127] = { 0 };
 static uint64_t current_time_ = 0;
+static struct tr_filter filter_ = { 0 };
+static struct ta_config analysis_config_ = { 0 };
+static struct async_writer writer_;
+static volatile sig_atomic_t is_stopping_ = 0;
+static struct bus_load bus_load_;
+static unsigned int bitrate_ = TOP_BITRATE_DEFAULT;
+static struct sdo_tracker sdo_tracker_;
 
 char* strlcpy(char* dst, const char* src, size_t size);
 const char* hexdump(const void* data, size_t size);
@@ -59,7 +93,7 @@ static inline void print_ts(void)
 	uint64_t t = current_time_;
 
 	if (options_ & CO_DUMP_TIMESTAMP)
-		printf("%llu.%06llu ", t / 1000000ULL, t % 1000000ULL);
+		print("%llu.%06llu ", t / 1000000ULL, t % 1000000ULL);
 }
 
 static inline struct node_state* get_node_state(int nodeid)
@@ -169,8 +203,12 @@ static int dump_pdo(int type, int n, struct canopen_msg* msg,
 
 	print_ts();
 
-	printx(cf, "%cPDO%d %d length=%d,data=%s", type, n, msg->id,
-	       cf->can_dlc, hexdump(cf->data, cf->can_dlc));
+	/* The flags of an FD frame are where the padding of a classic frame is */
+	const struct canfd_frame* cfd = (const struct canfd_frame*)cf;
+	const char* fd = cfd->flags & CANFD_FDF ? " [FD]" : "";
+
+	printx(cf, "%cPDO%d %d length=%d,data=%s%s", type, n, msg->id,
+	       cf->can_dlc, hexdump(cf->data, cf->can_dlc), fd);
 
 	return 0;
 }
@@ -198,8 +236,8 @@ static int dump_sdo_dl_init_req(struct canopen_msg* msg, struct can_frame* cf)
 
 	print_ts();
 
-	printf("RSDO %d init-download-%s index=%x,subindex=%d", msg->id,
-	       is_expediated ? "expediated" : "segment", index, subindex);
+	print("RSDO %d init-download-%s index=%x,subindex=%d", msg->id,
+	      is_expediated ? "expediated" : "segment", index, subindex);
 
 	if (!is_expediated && is_size_indicated && cf->can_dlc == CAN_MAX_DLC) {
 		size_t size = sdo_get_indicated_size(cf);
@@ -250,15 +288,15 @@ static int dump_sdo_dl_seg_req(struct canopen_msg* msg, struct can_frame* cf)
 
 	print_ts();
 
-	printf("RSDO %d download-segment%s size=%d,data=%s", msg->id,
-	       is_end ? "-end" : "", size, get_segment_data(state, data, size));
+	print("RSDO %d download-segment%s size=%d,data=%s", msg->id,
+	      is_end ? "-end" : "", size, get_segment_data(state, data, size));
 
 	if (state && is_end) {
 		const void* final_data = state->sdo_data.data;
 		size_t final_size = state->sdo_data.index;
 
-		printf(",final-size=%d,final-data=%s", final_size,
-		       get_segment_data(state, final_data, final_size));
+		print(",final-size=%d,final-data=%s", final_size,
+		      get_segment_data(state, final_data, final_size));
 
 		state->current_mux = 0;
 	}
@@ -339,8 +377,8 @@ static int dump_sdo_ul_init_res(struct canopen_msg* msg, struct can_frame* cf)
 
 	print_ts();
 
-	printf("TSDO %d init-upload-%s index=%x,subindex=%d", msg->id,
-	       is_expediated ? "expediated" : "segment", index, subindex);
+	print("TSDO %d init-upload-%s index=%x,subindex=%d", msg->id,
+	      is_expediated ? "expediated" : "segment", index, subindex);
 
 	if (!is_expediated && is_size_indicated && cf->can_dlc == CAN_MAX_DLC) {
 		size_t size = sdo_get_indicated_size(cf);
@@ -378,15 +416,15 @@ static int dump_sdo_ul_seg_res(struct canopen_msg* msg, struct can_frame* cf)
 
 	print_ts();
 
-	printf("TSDO %d upload-segment%s size=%d,data=%s", msg->id,
-	       is_end ? "-end" : "", size, get_segment_data(state, data, size));
+	print("TSDO %d upload-segment%s size=%d,data=%s", msg->id,
+	      is_end ? "-end" : "", size, get_segment_data(state, data, size));
 
 	if (state && is_end) {
 		const void* final_data = state->sdo_data.data;
 		size_t final_size = state->sdo_data.index;
 
-		printf(",final-size=%d,final-data=%s", final_size,
-		       get_segment_data(state, final_data, final_size));
+		print(",final-size=%d,final-data=%s", final_size,
+		      get_segment_data(state, final_data, final_size));
 	}
 
 	printx(cf, "");
@@ -433,6 +471,30 @@ static int dump_tsdo(struct canopen_msg* msg, struct can_frame* cf)
 	return 0;
 }
 
+static int dump_sdo_transaction(struct can_frame* cf)
+{
+	if (!(options_ & CO_DUMP_FILTER_SDO))
+		return 0;
+
+	struct st_transaction t;
+	if (!st_feed(&sdo_tracker_, cf, current_time_, &t))
+		return 0;
+
+	print_ts();
+	print("SDO %d %s index=%x,subindex=%d,size=%zu,segments=%u,duration=%.3fms",
+	      t.node, st_type_to_string(t.type), t.index, t.subindex, t.size,
+	      t.n_segments, (t.end - t.start) / 1000.0);
+
+	if (t.result == ST_ABORTED)
+		print(",abort=%#x,reason=\"%s\"", t.abort_code,
+		      sdo_strerror(t.abort_code));
+	else if (t.result == ST_INTERRUPTED)
+		print(",interrupted");
+
+	print("\n");
+	return 0;
+}
+
 static const char* state_str(enum nmt_state state)
 {
 	switch (state) {
@@ -470,6 +532,9 @@ static int multiplex(struct can_frame* cf)
 {
 	struct canopen_msg msg;
 
+	if (!tr_filter_match(&filter_, cf->can_id, current_time_))
+		return 0;
+
 	if (canopen_get_object_type(&msg, cf) != 0)
 		return -1;
 
@@ -486,8 +551,13 @@ static int multiplex(struct can_frame* cf)
 	case CANOPEN_RPDO2: return dump_pdo('R', 2, &msg, cf);
 	case CANOPEN_RPDO3: return dump_pdo('R', 3, &msg, cf);
 	case CANOPEN_RPDO4: return dump_pdo('R', 4, &msg, cf);
-	case CANOPEN_TSDO: return dump_tsdo(&msg, cf);
-	case CANOPEN_RSDO: return dump_rsdo(&msg, cf);
+	case CANOPEN_TSDO:
+	case CANOPEN_RSDO:
+		if (options_ & CO_DUMP_SDO_TRANSACTIONS)
+			return dump_sdo_transaction(cf);
+
+		return msg.object == CANOPEN_TSDO ? dump_tsdo(&msg, cf)
+						  : dump_rsdo(&msg, cf);
 	case CANOPEN_HEARTBEAT: return dump_heartbeat(&msg, cf);
 	default:
 		break;
@@ -497,21 +567,189 @@ static int multiplex(struct can_frame* cf)
 	return -1;
 }
 
+static void dump_frame(struct can_frame* cf, uint64_t timestamp)
+{
+	current_time_ = timestamp;
+	multiplex(cf);
+	aw_commit(&writer_);
+}
+
 static void run_dumper(struct sock* sock)
 {
-	struct can_frame cf;
+	struct can_frame cfs[DUMP_BATCH_SIZE];
+	uint64_t timestamps[DUMP_BATCH_SIZE];
 
-	while (1) {
-		memset(&cf, 0, sizeof(cf));
+	while (!is_stopping_) {
+		ssize_t n = sock_recv_batch(sock, cfs, timestamps,
+					    DUMP_BATCH_SIZE, 0);
+		if (n <= 0)
+			break;
+
+		for (ssize_t i = 0; i < n; ++i) {
+			/* This is where FD frames keep their flags */
+			cfs[i].__pad = 0;
+
+			dump_frame(&cfs[i], timestamps[i]);
+		}
+	}
+}
 
-		if (sock_recv(sock, &cf, MSG_WAITALL) <= 0)
+/* The header of an FD frame has the same layout as that of a classic frame,
+ * with the length in place of the dlc, so the frames can be passed on as they
+ * are. Only PDOs may be longer than 8 bytes.
+ */
+static void run_fd_dumper(struct sock* sock)
+{
+	struct canfd_frame cfs[DUMP_BATCH_SIZE];
+	uint64_t timestamps[DUMP_BATCH_SIZE];
+
+	while (!is_stopping_) {
+		ssize_t n = sock_recv_fd_batch(sock, cfs, timestamps,
+					       DUMP_BATCH_SIZE, 0);
+		if (n <= 0)
 			break;
 
-		current_time_ = gettime_us(CLOCK_REALTIME);
-		multiplex(&cf);
+		for (ssize_t i = 0; i < n; ++i)
+			dump_frame((struct can_frame*)&cfs[i], timestamps[i]);
 	}
 }
 
+static ssize_t recv_frames(struct sock* sock, struct canfd_frame* cfs,
+			   uint64_t* timestamps, int flags)
+{
+	if (sock->is_fd)
+		return sock_recv_fd_batch(sock, cfs, timestamps,
+					  DUMP_BATCH_SIZE, flags);
+
+	struct can_frame* frames = (struct can_frame*)cfs;
+	ssize_t n = sock_recv_batch(sock, frames, timestamps, DUMP_BATCH_SIZE,
+				    flags);
+
+	/* This is where FD frames keep their flags */
+	for (ssize_t i = 0; i < n; ++i)
+		frames[i].__pad = 0;
+
+	return n;
+}
+
+static inline struct can_frame* get_frame(const struct sock* sock,
+					  struct canfd_frame* cfs, ssize_t i)
+{
+	if (sock->is_fd)
+		return (struct can_frame*)&cfs[i];
+
+	return &((struct can_frame*)cfs)[i];
+}
+
+/* The screen is redrawn in one write so that it does not flicker */
+static void print_top(uint64_t interval)
+{
+	char* text = NULL;
+	size_t size = 0;
+
+	FILE* stream = open_memstream(&text, &size);
+	if (!stream)
+		return;
+
+	if (isatty(STDOUT_FILENO))
+		fprintf(stream, "\033[H\033[2J");
+
+	bl_print(&bus_load_, stream, interval, bitrate_, TOP_N_ROWS);
+	fprintf(stream, "\n");
+	fclose(stream);
+
+	ssize_t __attribute__((unused)) rc = write(STDOUT_FILENO, text, size);
+	free(text);
+}
+
+/* Frames are only counted as they come in; everything else is done once per
+ * refresh.
+ */
+static void run_top(struct sock* sock)
+{
+	struct canfd_frame cfs[DUMP_BATCH_SIZE];
+	uint64_t timestamps[DUMP_BATCH_SIZE];
+	uint64_t start = gettime_us(CLOCK_MONOTONIC);
+	bl_reset(&bus_load_);
+
+	while (!is_stopping_) {
+		uint64_t now = gettime_us(CLOCK_MONOTONIC);
+
+		if (now >= start + TOP_INTERVAL) {
+			print_top(now - start);
+			bl_reset(&bus_load_);
+			start = now;
+		}
+
+		int timeout = (start + TOP_INTERVAL - now + 999) / 1000;
+		int rc = sock_poll(sock, timeout);
+		if (rc < 0 && errno != EINTR)
+			break;
+
+		if (rc <= 0)
+			continue;
+
+		ssize_t n = recv_frames(sock, cfs, timestamps, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		if (n <= 0)
+			break;
+
+		for (ssize_t i = 0; i < n; ++i) {
+			struct can_frame* cf = get_frame(sock, cfs, i);
+
+			if (tr_filter_match(&filter_, cf->can_id, timestamps[i]))
+				bl_count(&bus_load_, cf);
+		}
+	}
+}
+
+/* Under load, receive batches are full and stdout is written in whole
+ * buffers. Otherwise, it is flushed after each batch so that Wireshark shows
+ * the frames as they come.
+ */
+static int run_pcap(struct sock* sock, const char* iface)
+{
+	struct canfd_frame cfs[DUMP_BATCH_SIZE];
+	uint64_t timestamps[DUMP_BATCH_SIZE];
+	struct tb_frame frames[DUMP_BATCH_SIZE];
+
+	if (pcapng_write_header(stdout, iface) < 0 || fflush(stdout) != 0)
+		return -1;
+
+	while (!is_stopping_) {
+		ssize_t n = recv_frames(sock, cfs, timestamps, 0);
+		if (n <= 0)
+			break;
+
+		size_t n_frames = 0;
+
+		for (ssize_t i = 0; i < n; ++i) {
+			struct can_frame* cf = get_frame(sock, cfs, i);
+
+			if (!tr_filter_match(&filter_, cf->can_id, timestamps[i]))
+				continue;
+
+			struct tb_frame* frame = &frames[n_frames++];
+			frame->timestamp = timestamps[i];
+
+			if (sock->is_fd)
+				frame->cfd = cfs[i];
+			else
+				frame->cf = *cf;
+		}
+
+		if (pcapng_write_frames(stdout, frames, n_frames) < n_frames)
+			return -1;
+
+		if (n < DUMP_BATCH_SIZE && fflush(stdout) != 0)
+			return -1;
+	}
+
+	return fflush(stdout) == 0 ? 0 : -1;
+}
+
 static void resolve_filters(enum co_dump_options options)
 {
 	options_ |= options & ~CO_DUMP_FILTER_MASK;
@@ -521,32 +759,178 @@ static void resolve_filters(enum co_dump_options options)
 		  : CO_DUMP_FILTER_MASK;
 }
 
-static int dump_file(const char* path, enum co_dump_options options)
+static void dump_recorded_frame(const struct tb_frame* frame, void* context)
 {
-	FILE* stream = fopen(path, "r");
-	if (!stream)
+	(void)context;
+
+	struct tb_frame copy = *frame;
+	dump_frame(&copy.cf, copy.timestamp);
+}
+
+static void resolve_selection(const struct co_dump_selection* selection)
+{
+	if (!selection)
+		return;
+
+	filter_.from = selection->from;
+	filter_.to = selection->to;
+	filter_.nodes[0] = selection->nodes[0];
+	filter_.nodes[1] = selection->nodes[1];
+
+	analysis_config_.n_threads = selection->n_threads;
+
+	if (selection->bitrate)
+		bitrate_ = selection->bitrate;
+}
+
+static void print_sdo_stats(void)
+{
+	if (!(options_ & CO_DUMP_SDO_TRANSACTIONS))
+		return;
+
+	printf("\n");
+	st_print_stats(&sdo_tracker_, stdout);
+}
+
+/* Recordings skip whatever lies outside of the selection. Raw dumps of a trace
+ * buffer have no index, so every frame in them is looked at.
+ */
+static int dump_file(const char* path)
+{
+	if (aw_init(&writer_, STDOUT_FILENO, DUMP_RING_LENGTH, AW_BLOCK) < 0)
 		return -1;
 
-	struct tb_frame frame;
-	while (fread(&frame, sizeof(frame), 1, stream)) {
-		current_time_ = frame.timestamp;
-		multiplex(&frame.cf);
+	int rc = tr_read_path(path, &filter_, dump_recorded_frame, NULL);
+
+	aw_destroy(&writer_);
+	print_sdo_stats();
+	return rc;
+}
+
+struct pcap_batch {
+	struct tb_frame frames[PCAPNG_BATCH_SIZE];
+	size_t n;
+	int is_failed;
+};
+
+static void flush_pcap_batch(struct pcap_batch* batch)
+{
+	if (!batch->is_failed
+	 && pcapng_write_frames(stdout, batch->frames, batch->n) < batch->n)
+		batch->is_failed = 1;
+
+	batch->n = 0;
+}
+
+static void add_pcap_frame(const struct tb_frame* frame, void* context)
+{
+	struct pcap_batch* batch = context;
+
+	batch->frames[batch->n++] = *frame;
+
+	if (batch->n == PCAPNG_BATCH_SIZE)
+		flush_pcap_batch(batch);
+}
+
+/* Returns the exit status, as reading and writing fail differently */
+static int convert_file(const char* path)
+{
+	static struct pcap_batch batch;
+
+	setvbuf(stdout, NULL, _IOFBF, PCAP_BUFFER_SIZE);
+
+	if (pcapng_write_header(stdout, NULL) < 0) {
+		perror("Could not write pcapng");
+		return 1;
+	}
+
+	if (tr_read_path(path, &filter_, add_pcap_frame, &batch) < 0) {
+		perror("Could not read file");
+		return 1;
+	}
+
+	flush_pcap_batch(&batch);
+
+	if (batch.is_failed || fflush(stdout) != 0) {
+		perror("Could not write pcapng");
+		return 1;
 	}
 
-	fclose(stream);
 	return 0;
 }
 
+static int analyze_file(const char* path)
+{
+	struct ta_report report;
+
+	int rc = ta_analyze(path, &filter_, &analysis_config_, &report);
+	if (rc == 0)
+		ta_report_print(&report, stdout);
+
+	ta_report_destroy(&report);
+	return rc;
+}
+
+static void on_stop_signal(int signo)
+{
+	(void)signo;
+	is_stopping_ = 1;
+}
+
+/* Without SA_RESTART, receiving is interrupted so that whatever is left in the
+ * ring gets written out before exiting.
+ */
+static void set_signal_handlers(void)
+{
+	struct sigaction sa = { .sa_handler = on_stop_signal };
+	sigemptyset(&sa.sa_mask);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void report_dropped(void)
+{
+	uint64_t n_dropped = aw_get_n_dropped(&writer_);
+	if (n_dropped > 0)
+		fprintf(stderr, "%llu records were dropped because the output could not keep up\n",
+			(unsigned long long)n_dropped);
+}
+
+static void report_lost(const struct sock* sock, enum sock_type type)
+{
+	uint64_t n_lost = sock_get_n_lost(sock);
+	if (n_lost > 0)
+		fprintf(stderr, "%llu %s were lost on the way\n",
+			(unsigned long long)n_lost,
+			type == SOCK_TYPE_UDP ? "datagrams" : "frames");
+}
+
 __attribute__((visibility("default")))
 int co_dump(const char* addr, enum co_dump_options options)
+{
+	return co_dump_select(addr, options, NULL);
+}
+
+__attribute__((visibility("default")))
+int co_dump_select(const char* addr, enum co_dump_options options,
+		   const struct co_dump_selection* selection)
 {
 	vector_init(&string_buffer_, 256);
 	node_state_init();
+	st_init(&sdo_tracker_);
 
 	resolve_filters(options);
+	resolve_selection(selection);
+
+	if (options & CO_DUMP_FILE && options & CO_DUMP_PCAP
+	 && !(options & CO_DUMP_ANALYZE))
+		return convert_file(addr);
 
 	if (options & CO_DUMP_FILE) {
-		if (dump_file(addr, options) < 0) {
+		int rc = options & CO_DUMP_ANALYZE ? analyze_file(addr)
+						   : dump_file(addr);
+		if (rc < 0) {
 			perror("Could not read file");
 			return 1;
 		}
@@ -556,7 +940,9 @@ int co_dump(const char* addr, enum co_dump_options options)
 
 	struct sock sock;
 	enum sock_type type = options & CO_DUMP_TCP ? SOCK_TYPE_TCP
-						    : SOCK_TYPE_CAN;
+			    : options & CO_DUMP_UDP ? SOCK_TYPE_UDP
+			    : options & CO_DUMP_SHM ? SOCK_TYPE_SHM
+			    : SOCK_TYPE_CAN;
 	if (sock_open(&sock, type, addr, NULL) < 0) {
 		perror("Could not open CAN bus");
 		return 1;
@@ -565,8 +951,98 @@ int co_dump(const char* addr, enum co_dump_options options)
 	if (type == SOCK_TYPE_CAN)
 		net_fix_sndbuf(sock.fd);
 
-	run_dumper(&sock);
+	set_signal_handlers();
+
+	int is_fd = type == SOCK_TYPE_CAN && sock_enable_fd(&sock) >= 0;
+
+	if (options & CO_DUMP_TOP) {
+		run_top(&sock);
+		sock_close(&sock);
+		return 0;
+	}
+
+	if (options & CO_DUMP_PCAP) {
+		setvbuf(stdout, NULL, _IOFBF, PCAP_BUFFER_SIZE);
 
+		int rc = run_pcap(&sock, type == SOCK_TYPE_CAN ? addr : NULL);
+		if (rc < 0)
+			perror("Could not write pcapng");
+
+		report_lost(&sock, type);
+		sock_close(&sock);
+		return rc < 0 ? 1 : 0;
+	}
+
+	if (aw_init(&writer_, STDOUT_FILENO, DUMP_RING_LENGTH, 0) < 0) {
+		perror("Could not start output writer");
+		sock_close(&sock);
+		return 1;
+	}
+
+	if (is_fd)
+		run_fd_dumper(&sock);
+	else
+		run_dumper(&sock);
+
+	report_lost(&sock, type);
 	sock_close(&sock);
+
+	aw_destroy(&writer_);
+	report_dropped();
+	print_sdo_stats();
+
 	return 0;
 }
+
+#define REPLAY_TXQ_SIZE 256
+
+__attribute__((visibility("default")))
+int co_replay(const char* path, const char* addr, enum co_dump_options options,
+	      const struct co_dump_selection* selection, double speed)
+{
+	struct trace_replay replay;
+	struct sock sock;
+
+	resolve_selection(selection);
+
+	enum sock_type type = options & CO_DUMP_TCP ? SOCK_TYPE_TCP
+			    : options & CO_DUMP_UDP ? SOCK_TYPE_UDP
+			    : SOCK_TYPE_CAN;
+	if (sock_open(&sock, type, addr, NULL) < 0) {
+		perror("Could not open CAN bus");
+		return 1;
+	}
+
+	if (type == SOCK_TYPE_CAN) {
+		net_fix_sndbuf(sock.fd);
+		sock_enable_fd(&sock);
+	}
+
+	if (sock_txq_init(&sock, REPLAY_TXQ_SIZE) < 0) {
+		perror("Could not set up transmit queue");
+		sock_close(&sock);
+		return 1;
+	}
+
+	set_signal_handlers();
+
+	trace_replay_init(&replay, &sock, speed,
+			  options & CO_DUMP_REPLAY_MASTER ? TRACE_REPLAY_MASTER
+							  : TRACE_REPLAY_SLAVES);
+	trace_replay_set_stop_flag(&replay, &is_stopping_);
+
+	int rc = trace_replay_path(&replay, path, &filter_);
+	if (rc < 0)
+		perror("Could not read file");
+
+	sock_close(&sock);
+
+	const struct trace_replay_stats* stats = &replay.stats;
+	fprintf(stderr, "%llu frames sent, %llu skipped, %llu failed, at most %llu us late\n",
+		(unsigned long long)stats->n_frames,
+		(unsigned long long)stats->n_skipped,
+		(unsigned long long)stats->n_errors,
+		(unsigned long long)stats->max_lateness);
+
+	return rc < 0 ? 1 : 0;
+}
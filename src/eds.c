@@ -14,16 +14,26 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/resource.h>
+#include <pthread.h>
+#include <ctype.h>
 #include <errno.h>
 #include <stddef.h>
 #include <limits.h>
 #include "plog.h"
 
 #include "vector.h"
-#include "sys/tree.h"
+#include "mem-tag.h"
+#include "co_atomic.h"
 
 #include "canopen/eds.h"
 #include "ini_parser.h"
@@ -40,48 +50,100 @@
 #define EDS_PATH "/var/marel/canmaster/eds.d"
 #endif
 
-struct eds_obj_node {
-	struct eds_obj obj;
-
-	RB_ENTRY(eds_obj_node) rb_entry;
+#ifndef EDS_CACHE_PATH
+#define EDS_CACHE_PATH "/var/marel/canmaster/eds.cache"
+#endif
 
-	char buffer[0];
+/* The database is kept in the same form as the cache file: a record for each
+ * EDS, the records of all objects, with those of each EDS sorted by key, and
+ * one table of strings. The strings that struct eds_obj points to are in that
+ * table, which is either what was read from the files or the mapped cache.
+ *
+ * The cache is used when the EDS files have the same paths, sizes and mtimes
+ * as when it was made.
+ */
+#define EDS__CACHE_MAGIC "EDSCACHE"
+#define EDS__CACHE_VERSION 1
+#define EDS__CACHE_BYTE_ORDER 0x01020304
+#define EDS__NO_STRING UINT32_MAX
+
+enum eds__string {
+	EDS__NAME = 0,
+	EDS__DEFAULT_VALUE,
+	EDS__LOW_LIMIT,
+	EDS__HIGH_LIMIT,
+	EDS__UNIT,
+	EDS__SCALING,
+	EDS__N_STRINGS
 };
 
-static inline int eds_obj_cmp(const struct eds_obj_node* o1,
-			      const struct eds_obj_node* o2)
-{
-	uint32_t k1 = o1->obj.key;
-	uint32_t k2 = o2->obj.key;
+struct eds__cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t fingerprint;
+	uint32_t n_eds;
+	uint32_t n_objs;
+	uint64_t strings_size;
+};
 
-	return k1 < k2 ? -1 : k1 > k2;
-}
+struct eds__cache_eds {
+	uint32_t vendor;
+	uint32_t product;
+	uint32_t revision;
+	uint32_t name;
+	uint32_t first_obj;
+	uint32_t n_objs;
+};
 
-RB_GENERATE_STATIC(eds_obj_tree, eds_obj_node, rb_entry, eds_obj_cmp);
+struct eds__cache_obj {
+	uint32_t key;
+	uint32_t type;
+	uint32_t access;
+	uint32_t strings[EDS__N_STRINGS];
+};
 
 size_t strlcpy(char*, const char*, size_t);
 
-static inline int eds__get_index(const struct eds_obj_node* node)
-{
-	return node->obj.key >> 8;
-}
+/* Where the records of one or more files are gathered as they are read */
+struct eds__builder {
+	struct vector eds_recs;
+	struct vector obj_recs;
+	struct vector strings;
 
-static inline int eds__get_subindex(const struct eds_obj_node* node)
-{
-	return node->obj.key & 0xff;
-}
+	/* Offsets of the strings, hashed, so that each is stored only once */
+	uint32_t* string_table;
+	size_t string_table_size;
+	size_t n_strings;
+};
 
-static inline void eds__set_index(struct eds_obj_node* node, int index)
-{
-	node->obj.key &= ~0xffff00;
-	node->obj.key |= index << 8;
-}
+static struct eds__builder eds__loaded;
 
-static inline void eds__set_subindex(struct eds_obj_node* node, int subindex)
-{
-	node->obj.key &= ~0xff;
-	node->obj.key |= subindex;
-}
+static int eds__n_threads = 1;
+static int eds__is_lazy = 0;
+static const char* eds__dir_path = EDS_PATH;
+static const char* eds__cache_file_path = EDS_CACHE_PATH;
+
+/* With lazy loading, the objects of each file are read the first time that it
+ * is looked up.
+ */
+struct eds__lazy {
+	char* path;
+	int is_loaded;
+	struct eds__builder builder;
+	struct eds_obj* objs;
+};
+
+static struct eds__lazy* eds__lazy;
+static size_t eds__n_lazy;
+static pthread_mutex_t eds__lazy_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct vector eds__paths;
+
+static void* eds__cache_map;
+static size_t eds__cache_map_size;
+
+static struct eds_obj* eds__objs;
 
 static struct vector eds__db;
 
@@ -95,7 +157,29 @@ size_t eds_db_length(void)
 	return eds__db.index / sizeof(struct canopen_eds);
 }
 
-const struct canopen_eds* eds_db_find(int vendor, int product, int revision)
+/* Identities are looked up in a hash table of (vendor, product) pairs. Each
+ * pair refers to a run of eds__by_id, which is sorted by revision and then by
+ * the order in which the files were loaded. Names are looked up in a trie of
+ * the product names. Both are made once the whole database has been loaded.
+ */
+struct eds__id_slot {
+	uint32_t vendor, product;
+	uint32_t first, count;
+};
+
+struct eds__trie_node {
+	uint32_t child, sibling;
+	int32_t eds;
+	char c;
+};
+
+static uint32_t* eds__by_id;
+static struct eds__id_slot* eds__id_table;
+static size_t eds__id_table_size;
+static struct vector eds__name_trie;
+
+static const struct canopen_eds* eds__find_linear(int vendor, int product,
+						  int revision)
 {
 	ssize_t best_match = -1;
 	uint32_t diff = UINT32_MAX;
@@ -124,65 +208,366 @@ const struct canopen_eds* eds_db_find(int vendor, int product, int revision)
 	return NULL;
 }
 
-const struct canopen_eds* eds_db_find_by_name(const char* name)
+static inline size_t eds__id_hash(uint32_t vendor, uint32_t product)
 {
-	const struct canopen_eds* best_match = NULL;
-	size_t best_length = 0;
+	uint32_t hash = vendor * 0x9e3779b1u ^ product * 0x85ebca6bu;
+	return hash ^ (hash >> 16);
+}
 
-	for (size_t i = 0; i < eds_db_length(); ++i)
-	{
-		const struct canopen_eds* eds = eds_db_get(i);
-		size_t current_len = strlen(eds->name);
+static const struct eds__id_slot* eds__find_id(uint32_t vendor,
+					       uint32_t product)
+{
+	size_t mask = eds__id_table_size - 1;
 
-		if (current_len < best_length)
-			continue;
+	for (size_t i = eds__id_hash(vendor, product) & mask;;
+	     i = (i + 1) & mask) {
+		const struct eds__id_slot* slot = &eds__id_table[i];
+		if (slot->count == 0)
+			return NULL;
+
+		if (slot->vendor == vendor && slot->product == product)
+			return slot;
+	}
+}
+
+static inline uint32_t eds__revision_at(size_t i)
+{
+	return eds_db_get(eds__by_id[i])->revision;
+}
+
+/* Among files of the same revision, the one that was loaded first wins */
+static size_t eds__first_of_revision(size_t first, size_t i)
+{
+	while (i > first && eds__revision_at(i - 1) == eds__revision_at(i))
+		--i;
+
+	return i;
+}
+
+/* The file with the closest revision is used if there is none of the same
+ * revision, and the one that was loaded first wins a tie.
+ */
+static const struct canopen_eds* eds__find(int vendor, int product,
+					   int revision)
+{
+	if (vendor <= 0 || product <= 0 || !eds__id_table)
+		return eds__find_linear(vendor, product, revision);
+
+	const struct eds__id_slot* slot = eds__find_id(vendor, product);
+	if (!slot)
+		return NULL;
+
+	size_t first = slot->first;
+	size_t end = slot->first + slot->count;
+
+	if (revision <= 0) {
+		uint32_t best = eds__by_id[first];
+		for (size_t i = first + 1; i < end; ++i)
+			if (eds__by_id[i] < best)
+				best = eds__by_id[i];
+
+		return eds_db_get(best);
+	}
+
+	size_t lo = first, hi = end;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (eds__revision_at(mid) < (uint32_t)revision)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < end && eds__revision_at(lo) == (uint32_t)revision)
+		return eds_db_get(eds__by_id[lo]);
+
+	ssize_t best_match = -1;
+	uint32_t diff = UINT32_MAX;
+
+	if (lo > first) {
+		size_t below = eds__first_of_revision(first, lo - 1);
+		best_match = eds__by_id[below];
+		diff = ABS(revision - (int)eds__revision_at(below));
+	}
+
+	if (lo < end) {
+		uint32_t d = ABS(revision - (int)eds__revision_at(lo));
+		if (d < diff || (d == diff && eds__by_id[lo] < best_match))
+			best_match = eds__by_id[lo];
+	}
+
+	return eds_db_get(best_match);
+}
+
+static inline struct eds__trie_node* eds__trie_node(uint32_t i)
+{
+	return &((struct eds__trie_node*)eds__name_trie.data)[i];
+}
+
+/* The longest name that the given name starts with wins, and of files with the
+ * same name, the one that was loaded last.
+ */
+static const struct canopen_eds* eds__find_by_name(const char* name)
+{
+	if (!eds__name_trie.data)
+		return NULL;
+
+	int32_t best_match = eds__trie_node(0)->eds;
+	uint32_t i = 0;
+
+	for (; *name; ++name) {
+		for (i = eds__trie_node(i)->child; i != 0;
+		     i = eds__trie_node(i)->sibling)
+			if (eds__trie_node(i)->c == *name)
+				break;
+
+		if (i == 0)
+			break;
+
+		if (eds__trie_node(i)->eds >= 0)
+			best_match = eds__trie_node(i)->eds;
+	}
+
+	return best_match >= 0 ? eds_db_get(best_match) : NULL;
+}
+
+static int eds__cmp_id(const void* p1, const void* p2)
+{
+	uint32_t i1 = *(const uint32_t*)p1;
+	uint32_t i2 = *(const uint32_t*)p2;
+	const struct canopen_eds* e1 = eds_db_get(i1);
+	const struct canopen_eds* e2 = eds_db_get(i2);
+
+	if (e1->vendor != e2->vendor)
+		return e1->vendor < e2->vendor ? -1 : 1;
+	if (e1->product != e2->product)
+		return e1->product < e2->product ? -1 : 1;
+	if (e1->revision != e2->revision)
+		return e1->revision < e2->revision ? -1 : 1;
+	return i1 < i2 ? -1 : i1 > i2;
+}
+
+static int eds__index_ids(void)
+{
+	size_t n = eds_db_length();
+
+	eds__by_id = mem_alloc(MEM_TAG_EDS, n * sizeof(*eds__by_id) + 1);
+	if (!eds__by_id)
+		return -1;
+
+	for (size_t i = 0; i < n; ++i)
+		eds__by_id[i] = i;
+
+	qsort(eds__by_id, n, sizeof(*eds__by_id), eds__cmp_id);
+
+	eds__id_table_size = 16;
+	while (eds__id_table_size < 2 * n)
+		eds__id_table_size *= 2;
+
+	eds__id_table = mem_calloc(MEM_TAG_EDS, eds__id_table_size,
+				   sizeof(*eds__id_table));
+	if (!eds__id_table)
+		return -1;
+
+	size_t mask = eds__id_table_size - 1;
+
+	for (size_t first = 0, end; first < n; first = end) {
+		const struct canopen_eds* eds = eds_db_get(eds__by_id[first]);
+
+		for (end = first + 1; end < n; ++end) {
+			const struct canopen_eds* e = eds_db_get(eds__by_id[end]);
+			if (e->vendor != eds->vendor || e->product != eds->product)
+				break;
+		}
+
+		size_t i = eds__id_hash(eds->vendor, eds->product) & mask;
+		while (eds__id_table[i].count != 0)
+			i = (i + 1) & mask;
+
+		eds__id_table[i].vendor = eds->vendor;
+		eds__id_table[i].product = eds->product;
+		eds__id_table[i].first = first;
+		eds__id_table[i].count = end - first;
+	}
+
+	return 0;
+}
+
+static int eds__trie_add_node(char c)
+{
+	struct eds__trie_node node = { .eds = -1, .c = c };
+
+	if (vector_append(&eds__name_trie, &node, sizeof(node)) < 0)
+		return -1;
+
+	return eds__name_trie.index / sizeof(node) - 1;
+}
+
+static int eds__index_names(void)
+{
+	if (eds__trie_add_node('\0') < 0)
+		return -1;
+
+	for (size_t n = 0; n < eds_db_length(); ++n) {
+		uint32_t i = 0;
+
+		for (const char* c = eds_db_get(n)->name; *c; ++c) {
+			uint32_t parent = i;
+
+			for (i = eds__trie_node(parent)->child; i != 0;
+			     i = eds__trie_node(i)->sibling)
+				if (eds__trie_node(i)->c == *c)
+					break;
+
+			if (i != 0)
+				continue;
+
+			int new_node = eds__trie_add_node(*c);
+			if (new_node < 0)
+				return -1;
+
+			i = new_node;
+			eds__trie_node(i)->sibling = eds__trie_node(parent)->child;
+			eds__trie_node(parent)->child = i;
+		}
 
-		if (strncmp(name, eds->name, current_len) != 0)
+		eds__trie_node(i)->eds = n;
+	}
+
+	return 0;
+}
+
+static uint32_t eds__name_hash(const char* name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const char* c = name; *c; ++c) {
+		hash ^= (uint8_t)tolower((unsigned char)*c);
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* The first object in index order is kept where more than one has a name */
+static void eds__index_obj_names(struct canopen_eds* eds)
+{
+	if (eds->n_objs == 0 || eds->name_table)
+		return;
+
+	size_t size = 16;
+	while (size < eds->n_objs * 2)
+		size *= 2;
+
+	uint32_t* table = mem_calloc(MEM_TAG_EDS, size, sizeof(*table));
+	if (!table)
+		return;
+
+	size_t mask = size - 1;
+
+	for (size_t n = 0; n < eds->n_objs; ++n) {
+		const char* name = eds->objs[n].name;
+		if (!name)
 			continue;
 
-		best_length = current_len;
-		best_match = eds;
+		size_t i = eds__name_hash(name) & mask;
+		while (table[i] != 0
+		    && strcasecmp(eds->objs[table[i] - 1].name, name) != 0)
+			i = (i + 1) & mask;
+
+		if (table[i] == 0)
+			table[i] = n + 1;
 	}
 
-	return best_match;
+	eds->name_table = table;
+	eds->name_table_size = size;
+}
+
+static void eds__unindex_obj_names(void)
+{
+	for (size_t i = 0; i < eds_db_length(); ++i) {
+		struct canopen_eds* eds = eds_db_get(i);
+		mem_free(MEM_TAG_EDS, eds->name_table);
+		eds->name_table = NULL;
+		eds->name_table_size = 0;
+	}
 }
 
-struct eds_obj_node* eds__obj_new(size_t buffer_size)
+static void eds__unindex(void)
 {
-	struct eds_obj_node* obj;
-	size_t size = sizeof(*obj) + buffer_size;
+	eds__unindex_obj_names();
 
-	obj = malloc(size);
-	if (!obj)
-		return 0;
+	mem_free(MEM_TAG_EDS, eds__by_id);
+	eds__by_id = NULL;
 
-	memset(obj, 0, size);
+	mem_free(MEM_TAG_EDS, eds__id_table);
+	eds__id_table = NULL;
+	eds__id_table_size = 0;
 
-	return obj;
+	vector_destroy(&eds__name_trie);
+	memset(&eds__name_trie, 0, sizeof(eds__name_trie));
+}
+
+/* Lookups fall back to going through the whole database if this fails */
+static void eds__index(void)
+{
+	if (eds__index_ids() < 0 || eds__index_names() < 0) {
+		plog(LOG_WARNING, "Could not index the EDS database");
+		eds__unindex();
+		return;
+	}
+
+	for (size_t i = 0; i < eds_db_length(); ++i)
+		eds__index_obj_names(eds_db_get(i));
+}
+
+static int eds__cmp_obj(const void* p1, const void* p2)
+{
+	uint32_t k1 = *(const uint32_t*)p1;
+	uint32_t k2 = ((const struct eds_obj*)p2)->key;
+
+	return k1 < k2 ? -1 : k1 > k2;
 }
 
 const struct eds_obj* eds_obj_find(const struct canopen_eds* eds,
 				   int index, int subindex)
 {
 	uint32_t key = (index << 8) | subindex;
-	void* cmp = (char*)&key;
-	return (void*)RB_FIND(eds_obj_tree, (void*)&eds->obj_tree, cmp);
+	return bsearch(&key, eds->objs, eds->n_objs, sizeof(*eds->objs),
+		       eds__cmp_obj);
 }
 
-static inline int eds__extension_matches(const char* path, const char* ext)
+/* The first one in index order wins if more than one has the name */
+const struct eds_obj* eds_obj_find_by_name(const struct canopen_eds* eds,
+					   const char* name)
 {
-	char* ptr = strrchr(path, '.');
-	return ptr ? strcmp(ext, ptr) == 0 : 0;
+	if (eds->name_table) {
+		size_t mask = eds->name_table_size - 1;
+
+		for (size_t i = eds__name_hash(name) & mask;
+		     eds->name_table[i] != 0; i = (i + 1) & mask) {
+			const struct eds_obj* obj =
+				&eds->objs[eds->name_table[i] - 1];
+			if (strcasecmp(obj->name, name) == 0)
+				return obj;
+		}
+
+		return NULL;
+	}
+
+	const struct eds_obj* obj;
+
+	for (obj = eds_obj_first(eds); obj; obj = eds_obj_next(eds, obj))
+		if (obj->name && strcasecmp(obj->name, name) == 0)
+			return obj;
+
+	return NULL;
 }
 
-static void eds__clear(struct canopen_eds* eds)
+static inline int eds__extension_matches(const char* path, const char* ext)
 {
-	struct eds_obj_node* node;
-	while (!RB_EMPTY(&eds->obj_tree)) {
-		node = RB_MIN(eds_obj_tree, &eds->obj_tree);
-		RB_REMOVE(eds_obj_tree, &eds->obj_tree, node);
-		free(node);
-	}
+	char* ptr = strrchr(path, '.');
+	return ptr ? strcmp(ext, ptr) == 0 : 0;
 }
 
 int eds__get_section_index(const char* str)
@@ -217,35 +602,145 @@ enum eds_obj_access eds__get_access_type(const char* str)
 	return 0;
 }
 
-static void eds__insert(struct canopen_eds* eds, struct eds_obj_node* node)
+static inline uint32_t eds__hash_string(const char* str)
 {
-	struct eds_obj_node* existing;
+	uint32_t hash = 2166136261u;
 
-	existing = RB_INSERT(eds_obj_tree, &eds->obj_tree, node);
-	if (!existing)
-		return;
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
 
-	RB_REMOVE(eds_obj_tree, &eds->obj_tree, existing);
-	free(existing);
+	return hash;
+}
 
-	RB_INSERT(eds_obj_tree, &eds->obj_tree, node);
+static uint32_t* eds__string_slot(const struct eds__builder* builder,
+				  const char* str)
+{
+	size_t mask = builder->string_table_size - 1;
+	const char* strings = builder->strings.data;
+
+	for (size_t i = eds__hash_string(str) & mask;; i = (i + 1) & mask) {
+		uint32_t* slot = &builder->string_table[i];
+		if (*slot == EDS__NO_STRING || strcmp(&strings[*slot], str) == 0)
+			return slot;
+	}
 }
 
-static const char*
-eds__append_buffer_value(struct eds_obj_node* node, const char* value,
-			 size_t* index)
+/* Drops the strings from the end offset on and hashes the rest again into a
+ * table of the given size.
+ */
+static int eds__index_strings(struct eds__builder* builder, size_t end,
+			      size_t table_size)
 {
-	if (!value)
-		return NULL;
+	builder->strings.index = end;
+
+	mem_free(MEM_TAG_EDS, builder->string_table);
+	builder->string_table = NULL;
+	builder->string_table_size = 0;
+	builder->n_strings = 0;
+
+	if (table_size == 0)
+		return 0;
+
+	uint32_t* table = mem_alloc(MEM_TAG_EDS, table_size * sizeof(*table));
+	if (!table)
+		return -1;
+
+	memset(table, 0xff, table_size * sizeof(*table));
+
+	builder->string_table = table;
+	builder->string_table_size = table_size;
+
+	const char* strings = builder->strings.data;
+
+	for (size_t offset = 0; offset < end;
+	     offset += strlen(&strings[offset]) + 1) {
+		*eds__string_slot(builder, &strings[offset]) = offset;
+		++builder->n_strings;
+	}
+
+	return 0;
+}
+
+static uint32_t eds__add_string(struct eds__builder* builder, const char* str)
+{
+	if (!str)
+		return EDS__NO_STRING;
+
+	if (2 * (builder->n_strings + 1) > builder->string_table_size) {
+		size_t size = builder->string_table_size ?
+			      2 * builder->string_table_size : 256;
+		if (eds__index_strings(builder, builder->strings.index, size) < 0)
+			return EDS__NO_STRING;
+	}
+
+	uint32_t* slot = eds__string_slot(builder, str);
+	if (*slot != EDS__NO_STRING)
+		return *slot;
+
+	uint32_t offset = builder->strings.index;
 
-	size_t i = *index;
-	*index += strlen(value) + 1;
-	return strcpy(&node->buffer[i], value);
+	if (vector_append(&builder->strings, str, strlen(str) + 1) < 0)
+		return EDS__NO_STRING;
 
+	*slot = offset;
+	++builder->n_strings;
+	return offset;
+}
+
+static inline struct eds__cache_obj*
+eds__obj_rec(const struct eds__builder* builder, size_t i)
+{
+	return &((struct eds__cache_obj*)builder->obj_recs.data)[i];
+}
+
+static inline size_t eds__n_obj_recs(const struct eds__builder* builder)
+{
+	return builder->obj_recs.index / sizeof(struct eds__cache_obj);
+}
+
+static inline struct eds__cache_eds*
+eds__eds_rec(const struct eds__builder* builder, size_t i)
+{
+	return &((struct eds__cache_eds*)builder->eds_recs.data)[i];
+}
+
+static inline size_t eds__n_eds_recs(const struct eds__builder* builder)
+{
+	return builder->eds_recs.index / sizeof(struct eds__cache_eds);
+}
+
+static inline void eds__vector_free(struct vector* vector)
+{
+	vector_destroy(vector);
+	memset(vector, 0, sizeof(*vector));
 }
 
-static int eds__convert_obj_tree(struct canopen_eds* eds, struct ini_file* ini)
+static void eds__builder_free(struct eds__builder* builder)
 {
+	mem_free(MEM_TAG_EDS, builder->string_table);
+	builder->string_table = NULL;
+	builder->string_table_size = 0;
+	builder->n_strings = 0;
+
+	eds__vector_free(&builder->eds_recs);
+	eds__vector_free(&builder->obj_recs);
+	eds__vector_free(&builder->strings);
+}
+
+static int eds__convert_objs(struct eds__builder* builder,
+			     struct ini_file* ini)
+{
+	static const char* keys[EDS__N_STRINGS] = {
+		[EDS__NAME] = "parametername",
+		[EDS__DEFAULT_VALUE] = "defaultvalue",
+		[EDS__LOW_LIMIT] = "lowlimit",
+		[EDS__HIGH_LIMIT] = "highlimit",
+		[EDS__UNIT] = "x-unit",
+		[EDS__SCALING] = "x-scaling",
+	};
+
 	for (size_t i = 0; i < ini_get_length(ini); ++i) {
 		const struct ini_section* section = ini_get_section(ini, i);
 
@@ -265,46 +760,83 @@ static int eds__convert_obj_tree(struct canopen_eds* eds, struct ini_file* ini)
 		if (!access)
 			access = "ro";
 
-		const char* name = ini_find_key(section, "parametername");
-		const char* default_val = ini_find_key(section, "defaultvalue");
-		const char* low_limit	= ini_find_key(section, "lowlimit");
-		const char* high_limit	= ini_find_key(section, "highlimit");
-		const char* unit	= ini_find_key(section, "x-unit");
-		const char* scaling	= ini_find_key(section, "x-scaling");
-
-		size_t buffer_size = (name ? strlen(name) + 1 : 0)
-				   + (default_val ? strlen(default_val) + 1 : 0)
-				   + (low_limit ? strlen(low_limit) + 1 : 0)
-				   + (high_limit ? strlen(high_limit) + 1 : 0)
-				   + (unit ? strlen(unit) + 1 : 0)
-				   + (scaling ? strlen(scaling) + 1 : 0);
-
-		struct eds_obj_node* obj = eds__obj_new(buffer_size);
-		if (!obj)
+		struct eds__cache_obj obj = {
+			.key = (index << 8) | subindex,
+			.type = strtoul(type, NULL, 0),
+			.access = eds__get_access_type(access),
+		};
+
+		for (int k = 0; k < EDS__N_STRINGS; ++k) {
+			const char* value = ini_find_key(section, keys[k]);
+			obj.strings[k] = eds__add_string(builder, value);
+			if (value && obj.strings[k] == EDS__NO_STRING)
+				return -1;
+		}
+
+		if (vector_append(&builder->obj_recs, &obj, sizeof(obj)) < 0)
 			return -1;
+	}
+
+	return 0;
+}
+
+static int eds__cmp_obj_ptr(const void* p1, const void* p2)
+{
+	const struct eds__cache_obj* o1 = *(const struct eds__cache_obj**)p1;
+	const struct eds__cache_obj* o2 = *(const struct eds__cache_obj**)p2;
+
+	if (o1->key != o2->key)
+		return o1->key < o2->key ? -1 : 1;
+
+	return o1 < o2 ? -1 : o1 > o2;
+}
 
-		obj->obj.type = strtoul(type, NULL, 0);
-		obj->obj.access = eds__get_access_type(access);
-		obj->obj.key = (index << 8) | subindex;
+/* Objects are sorted by key and, as before, a later section for the same
+ * object replaces an earlier one.
+ */
+static size_t eds__sort_objs(struct eds__builder* builder, size_t first,
+			     size_t end)
+{
+	size_t n = end - first;
+	if (n == 0)
+		return 0;
+
+	struct eds__cache_obj* objs = eds__obj_rec(builder, first);
+
+	/* qsort is not stable, so the records are sorted through pointers that
+	 * break ties by position.
+	 */
+	const struct eds__cache_obj** order;
+	order = mem_alloc(MEM_TAG_EDS, n * sizeof(*order));
+	struct eds__cache_obj* sorted;
+	sorted = mem_alloc(MEM_TAG_EDS, n * sizeof(*sorted));
+	if (!order || !sorted) {
+		mem_free(MEM_TAG_EDS, order);
+		mem_free(MEM_TAG_EDS, sorted);
+		return SIZE_MAX;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		order[i] = &objs[i];
 
-		size_t idx = 0;
-		obj->obj.name = eds__append_buffer_value(obj, name, &idx);
-		obj->obj.default_value
-			= eds__append_buffer_value(obj, default_val, &idx);
-		obj->obj.low_limit
-			= eds__append_buffer_value(obj, low_limit, &idx);
-		obj->obj.high_limit
-			= eds__append_buffer_value(obj, high_limit, &idx);
-		obj->obj.unit = eds__append_buffer_value(obj, unit, &idx);
-		obj->obj.scaling = eds__append_buffer_value(obj, scaling, &idx);
+	qsort(order, n, sizeof(*order), eds__cmp_obj_ptr);
+
+	size_t n_unique = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (i + 1 < n && order[i + 1]->key == order[i]->key)
+			continue;
 
-		eds__insert(eds, obj);
+		sorted[n_unique++] = *order[i];
 	}
 
-	return 0;
+	memcpy(objs, sorted, n_unique * sizeof(*sorted));
+
+	mem_free(MEM_TAG_EDS, sorted);
+	mem_free(MEM_TAG_EDS, order);
+	return n_unique;
 }
 
-static int eds__convert_ini(struct ini_file* ini)
+static int eds__convert_ini(struct eds__builder* builder, struct ini_file* ini)
 {
 	const char* vendor = ini_find(ini, "deviceinfo", "vendornumber");
 	if (!vendor)
@@ -322,61 +854,170 @@ static int eds__convert_ini(struct ini_file* ini)
 	if (!name)
 		return -1;
 
-	struct canopen_eds eds;
-	memset(&eds, 0, sizeof(eds));
+	size_t strings_index = builder->strings.index;
+	size_t first_obj = eds__n_obj_recs(builder);
 
-	RB_INIT(&eds.obj_tree);
+	struct eds__cache_eds eds = {
+		.vendor = strtoul(vendor, NULL, 0),
+		.product = strtoul(product, NULL, 0),
+		.revision = strtoul(revision, NULL, 0),
+		.name = eds__add_string(builder, name),
+		.first_obj = first_obj,
+	};
 
-	eds.vendor = strtoul(vendor, NULL, 0);
-	eds.product = strtoul(product, NULL, 0);
-	eds.revision = strtoul(revision, NULL, 0);
-	strlcpy(eds.name, name, sizeof(eds.name));
+	if (eds.name == EDS__NO_STRING)
+		goto failure;
 
-	if (eds__convert_obj_tree(&eds, ini) < 0)
+	if (eds__convert_objs(builder, ini) < 0)
 		goto failure;
 
-	if (vector_append(&eds__db, &eds, sizeof(eds)) < 0)
+	size_t n_objs = eds__sort_objs(builder, first_obj,
+				       eds__n_obj_recs(builder));
+	if (n_objs == SIZE_MAX)
+		goto failure;
+
+	eds.n_objs = n_objs;
+	builder->obj_recs.index = (first_obj + n_objs)
+				* sizeof(struct eds__cache_obj);
+
+	if (vector_append(&builder->eds_recs, &eds, sizeof(eds)) < 0)
 		goto failure;
 
 	return 0;
 
 failure:
-	eds__clear(&eds);
+	builder->obj_recs.index = first_obj * sizeof(struct eds__cache_obj);
+	eds__index_strings(builder, strings_index, builder->string_table_size);
 	return -1;
 }
 
-static int eds__load_file(const char* path)
+static int eds__load_file(struct eds__builder* builder, const char* path)
 {
-	FILE* file = fopen(path, "r");
-	if (!file)
-		return -1;
-
 	struct ini_file ini;
 
-	int lineno = ini_parse(&ini, file);
+	int lineno = ini_parse_file(&ini, path);
 	if (lineno < 0) {
 		plog(LOG_DEBUG, "Failed to parse EDS %s, line %d", path,
 		     -lineno);
-		goto failure;
+		return -1;
 	}
 
-	if (eds__convert_ini(&ini) < 0) {
+	if (eds__convert_ini(builder, &ini) < 0) {
 		plog(LOG_DEBUG, "Failed to convert EDS %s", path);
 		goto failure;
 	}
 
 	plog(LOG_DEBUG, "Loaded EDS %s", path);
 
-	fclose(file);
 	ini_destroy(&ini);
 	return 0;
 
 failure:
-	fclose(file);
 	ini_destroy(&ini);
 	return -1;
 }
 
+static char* eds__trim(char* str)
+{
+	while (isspace(*str))
+		++str;
+
+	char* end = str + strlen(str);
+	while (end > str && isspace(end[-1]))
+		*--end = '\0';
+
+	return str;
+}
+
+/* Only the [DeviceInfo] section is read, and it is read the way that the INI
+ * parser would read it.
+ */
+static int eds__load_identity(struct eds__builder* builder, const char* path)
+{
+	static const char* keys[] = {
+		"vendornumber", "productnumber", "revisionnumber", "productname"
+	};
+
+	char* values[4] = { 0 };
+	int is_device_info = 0;
+	char* line = NULL;
+	size_t size = 0;
+	int rc = -1;
+
+	FILE* file = fopen(path, "re");
+	if (!file)
+		return -1;
+
+	while (getline(&line, &size, file) >= 0) {
+		char* str = eds__trim(line);
+
+		if (*str == '[') {
+			if (is_device_info)
+				break;
+
+			size_t len = strlen(str);
+			is_device_info = len == strlen("[deviceinfo]")
+				      && str[len - 1] == ']'
+				      && strncasecmp(str + 1, "deviceinfo", len - 2) == 0;
+			continue;
+		}
+
+		char* eq = strchr(str, '=');
+		if (!is_device_info || !eq)
+			continue;
+
+		*eq = '\0';
+		char* key = eds__trim(str);
+
+		for (size_t i = 0; i < 4; ++i)
+			if (!values[i] && strcasecmp(key, keys[i]) == 0)
+				values[i] = mem_strdup(MEM_TAG_EDS,
+						       eds__trim(eq + 1));
+	}
+
+	for (size_t i = 0; i < 4; ++i)
+		if (!values[i])
+			goto done;
+
+	struct eds__cache_eds eds = {
+		.vendor = strtoul(values[0], NULL, 0),
+		.product = strtoul(values[1], NULL, 0),
+		.revision = strtoul(values[2], NULL, 0),
+		.name = eds__add_string(builder, values[3]),
+		.first_obj = eds__n_obj_recs(builder),
+	};
+
+	if (eds.name != EDS__NO_STRING
+	 && vector_append(&builder->eds_recs, &eds, sizeof(eds)) >= 0)
+		rc = 0;
+
+done:
+	for (size_t i = 0; i < 4; ++i)
+		mem_free(MEM_TAG_EDS, values[i]);
+
+	free(line);
+	fclose(file);
+	return rc;
+}
+
+static inline char* eds__path(size_t i)
+{
+	return ((char**)eds__paths.data)[i];
+}
+
+static inline size_t eds__n_paths(void)
+{
+	return eds__paths.index / sizeof(char*);
+}
+
+static void eds__free_paths(void)
+{
+	for (size_t i = 0; i < eds__n_paths(); ++i)
+		mem_free(MEM_TAG_EDS, eds__path(i));
+
+	eds__vector_free(&eds__paths);
+}
+
 static int eds__walker(const char* fpath, const struct stat* sb,
 		       int type, struct FTW* ftwbuf)
 {
@@ -389,7 +1030,11 @@ static int eds__walker(const char* fpath, const struct stat* sb,
 	if (!eds__extension_matches(fpath, ".eds"))
 		return 0;
 
-	eds__load_file(fpath);
+	char* path = mem_strdup(MEM_TAG_EDS, fpath);
+	if (!path || vector_append(&eds__paths, &path, sizeof(path)) < 0) {
+		mem_free(MEM_TAG_EDS, path);
+		return -1;
+	}
 
 	return 0;
 }
@@ -402,22 +1047,480 @@ static inline int eds__get_maxfiles(void)
 
 static inline const char* eds__get_path(void)
 {
-	return EDS_PATH;
+	return eds__dir_path;
 }
 
-static inline int eds__load_all_files(void)
+static inline int eds__find_files(void)
 {
 	return nftw(eds__get_path(), eds__walker, eds__get_maxfiles(),
 		    FTW_DEPTH);
 }
 
+/* The records of each file are appended in the order that the files were
+ * found, whichever thread read them.
+ */
+static int eds__merge(struct eds__builder* dst, const struct eds__builder* src)
+{
+	uint32_t strings_base = dst->strings.index;
+	uint32_t objs_base = eds__n_obj_recs(dst);
+
+	if (vector_append(&dst->strings, src->strings.data,
+			  src->strings.index) < 0)
+		return -1;
+
+	for (size_t i = 0; i < eds__n_obj_recs(src); ++i) {
+		struct eds__cache_obj obj = *eds__obj_rec(src, i);
+
+		for (int k = 0; k < EDS__N_STRINGS; ++k)
+			if (obj.strings[k] != EDS__NO_STRING)
+				obj.strings[k] += strings_base;
+
+		if (vector_append(&dst->obj_recs, &obj, sizeof(obj)) < 0)
+			return -1;
+	}
+
+	for (size_t i = 0; i < eds__n_eds_recs(src); ++i) {
+		struct eds__cache_eds eds = *eds__eds_rec(src, i);
+
+		eds.name += strings_base;
+		eds.first_obj += objs_base;
+
+		if (vector_append(&dst->eds_recs, &eds, sizeof(eds)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+struct eds__loader {
+	struct eds__builder* builders;
+	size_t next;
+};
+
+static void* eds__load_thread(void* arg)
+{
+	struct eds__loader* loader = arg;
+	size_t i;
+
+	while ((i = co_atomic_add_fetch(&loader->next, 1) - 1) < eds__n_paths())
+		if (eds__is_lazy)
+			eds__load_identity(&loader->builders[i], eds__path(i));
+		else
+			eds__load_file(&loader->builders[i], eds__path(i));
+
+	return NULL;
+}
+
+/* The files are shared out between eds__n_threads threads, counting this one.
+ * The worker pool has not been started at this point, so the threads are
+ * started just for this.
+ */
+static int eds__load_all_files(void)
+{
+	if (eds__find_files() < 0)
+		return -1;
+
+	size_t n_paths = eds__n_paths();
+	size_t n_threads = eds__n_threads;
+	if (n_threads > n_paths)
+		n_threads = n_paths;
+
+	struct eds__loader loader = { .next = 0 };
+	pthread_t threads[n_threads > 1 ? n_threads - 1 : 1];
+	size_t n_started = 0;
+	int rc = -1;
+
+	loader.builders = mem_calloc(MEM_TAG_EDS, n_paths + 1,
+				     sizeof(*loader.builders));
+	if (!loader.builders)
+		return -1;
+
+	for (; n_started + 1 < n_threads; ++n_started)
+		if (pthread_create(&threads[n_started], NULL, eds__load_thread,
+				   &loader) != 0)
+			break;
+
+	eds__load_thread(&loader);
+
+	for (size_t i = 0; i < n_started; ++i)
+		pthread_join(threads[i], NULL);
+
+	if (eds__is_lazy) {
+		eds__lazy = mem_calloc(MEM_TAG_EDS, n_paths + 1,
+				       sizeof(*eds__lazy));
+		if (!eds__lazy)
+			goto done;
+	}
+
+	for (size_t i = 0; i < n_paths; ++i) {
+		struct eds__builder* builder = &loader.builders[i];
+
+		if (eds__is_lazy && eds__n_eds_recs(builder) == 1) {
+			char* path = mem_strdup(MEM_TAG_EDS, eds__path(i));
+			if (!path)
+				goto done;
+
+			eds__lazy[eds__n_lazy++].path = path;
+		}
+
+		if (eds__merge(&eds__loaded, builder) < 0)
+			goto done;
+	}
+
+	rc = 0;
+done:
+	for (size_t i = 0; i < n_paths; ++i)
+		eds__builder_free(&loader.builders[i]);
+
+	mem_free(MEM_TAG_EDS, loader.builders);
+	return rc;
+}
+
+static struct eds_obj* eds__make_objs(const struct eds__cache_obj* objs,
+				      size_t n_objs, const char* strings,
+				      size_t strings_size)
+{
+	struct eds_obj* result;
+	result = mem_alloc(MEM_TAG_EDS, n_objs * sizeof(*result) + 1);
+	if (!result)
+		return NULL;
+
+	for (size_t i = 0; i < n_objs; ++i) {
+		const struct eds__cache_obj* rec = &objs[i];
+		const char* str[EDS__N_STRINGS];
+
+		for (int k = 0; k < EDS__N_STRINGS; ++k) {
+			uint32_t offset = rec->strings[k];
+			if (offset != EDS__NO_STRING && offset >= strings_size)
+				goto failure;
+
+			str[k] = offset != EDS__NO_STRING ? &strings[offset]
+							  : NULL;
+		}
+
+		struct eds_obj* obj = &result[i];
+		obj->key = rec->key;
+		obj->type = rec->type;
+		obj->access = rec->access;
+		obj->name = str[EDS__NAME];
+		obj->default_value = str[EDS__DEFAULT_VALUE];
+		obj->low_limit = str[EDS__LOW_LIMIT];
+		obj->high_limit = str[EDS__HIGH_LIMIT];
+		obj->unit = str[EDS__UNIT];
+		obj->scaling = str[EDS__SCALING];
+	}
+
+	return result;
+
+failure:
+	mem_free(MEM_TAG_EDS, result);
+	return NULL;
+}
+
+static int eds__materialize(const struct eds__cache_eds* recs, size_t n_eds,
+			    const struct eds__cache_obj* objs, size_t n_objs,
+			    const char* strings, size_t strings_size)
+{
+	if (strings_size > 0 && strings[strings_size - 1] != '\0')
+		return -1;
+
+	eds__objs = eds__make_objs(objs, n_objs, strings, strings_size);
+	if (!eds__objs)
+		return -1;
+
+	if (vector_reserve(&eds__db, n_eds * sizeof(struct canopen_eds)) < 0)
+		goto failure;
+
+	for (size_t i = 0; i < n_eds; ++i) {
+		const struct eds__cache_eds* rec = &recs[i];
+
+		if (rec->first_obj > n_objs
+		 || rec->n_objs > n_objs - rec->first_obj
+		 || rec->name >= strings_size)
+			goto failure;
+
+		struct canopen_eds eds;
+		memset(&eds, 0, sizeof(eds));
+
+		eds.vendor = rec->vendor;
+		eds.product = rec->product;
+		eds.revision = rec->revision;
+		strlcpy(eds.name, &strings[rec->name], sizeof(eds.name));
+		eds.objs = &eds__objs[rec->first_obj];
+		eds.n_objs = rec->n_objs;
+
+		if (vector_append(&eds__db, &eds, sizeof(eds)) < 0)
+			goto failure;
+	}
+
+	return 0;
+
+failure:
+	mem_free(MEM_TAG_EDS, eds__objs);
+	eds__objs = NULL;
+	vector_clear(&eds__db);
+	return -1;
+}
+
+static inline const char* eds__get_cache_path(void)
+{
+	return eds__cache_file_path;
+}
+
+static uint64_t eds__fingerprint_;
+
+static void eds__hash(uint64_t* hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = data;
+
+	for (size_t i = 0; i < size; ++i) {
+		*hash ^= bytes[i];
+		*hash *= 1099511628211ULL;
+	}
+}
+
+static int eds__fingerprint_walker(const char* fpath, const struct stat* sb,
+				   int type, struct FTW* ftwbuf)
+{
+	(void)ftwbuf;
+
+	if (type != FTW_F)
+		return 0;
+
+	if (!eds__extension_matches(fpath, ".eds"))
+		return 0;
+
+	uint64_t stamp[] = {
+		sb->st_ino,
+		sb->st_size,
+		sb->st_mtim.tv_sec,
+		sb->st_mtim.tv_nsec,
+	};
+
+	eds__hash(&eds__fingerprint_, fpath, strlen(fpath) + 1);
+	eds__hash(&eds__fingerprint_, stamp, sizeof(stamp));
+
+	return 0;
+}
+
+/* The files are not read for this, only stat'ed */
+static int eds__fingerprint(uint64_t* fingerprint)
+{
+	eds__fingerprint_ = 14695981039346656037ULL;
+
+	if (nftw(eds__get_path(), eds__fingerprint_walker, eds__get_maxfiles(),
+		 FTW_DEPTH) < 0)
+		return -1;
+
+	*fingerprint = eds__fingerprint_;
+	return 0;
+}
+
+static int eds__load_cache(uint64_t fingerprint)
+{
+	const char* path = eds__get_cache_path();
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct eds__cache_header)) {
+		close(fd);
+		return -1;
+	}
+
+	size_t size = st.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	const struct eds__cache_header* header = map;
+
+	if (memcmp(header->magic, EDS__CACHE_MAGIC, sizeof(header->magic)) != 0
+	 || header->version != EDS__CACHE_VERSION
+	 || header->byte_order != EDS__CACHE_BYTE_ORDER
+	 || header->fingerprint != fingerprint
+	 || header->n_eds > size / sizeof(struct eds__cache_eds)
+	 || header->n_objs > size / sizeof(struct eds__cache_obj))
+		goto failure;
+
+	size_t eds_offset = sizeof(*header);
+	size_t objs_offset = eds_offset
+			   + header->n_eds * sizeof(struct eds__cache_eds);
+	size_t strings_offset = objs_offset
+			      + header->n_objs * sizeof(struct eds__cache_obj);
+
+	if (strings_offset > size || size - strings_offset != header->strings_size)
+		goto failure;
+
+	const char* data = map;
+
+	if (eds__materialize((const void*)&data[eds_offset], header->n_eds,
+			     (const void*)&data[objs_offset], header->n_objs,
+			     &data[strings_offset], header->strings_size) < 0)
+		goto failure;
+
+	eds__cache_map = map;
+	eds__cache_map_size = size;
+
+	plog(LOG_DEBUG, "Loaded %u EDS from %s", header->n_eds, path);
+	return 0;
+
+failure:
+	plog(LOG_DEBUG, "The EDS cache %s is out of date", path);
+	munmap(map, size);
+	return -1;
+}
+
+/* The cache is written under another name and then moved into place, so that
+ * other instances never see it half written.
+ */
+static void eds__save_cache(uint64_t fingerprint)
+{
+	const char* path = eds__get_cache_path();
+	char tmp_path[PATH_MAX];
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+	FILE* file = fopen(tmp_path, "we");
+	if (!file) {
+		plog(LOG_WARNING, "Could not write the EDS cache %s: %m", path);
+		return;
+	}
+
+	struct eds__cache_header header = {
+		.version = EDS__CACHE_VERSION,
+		.byte_order = EDS__CACHE_BYTE_ORDER,
+		.fingerprint = fingerprint,
+		.n_eds = eds__n_eds_recs(&eds__loaded),
+		.n_objs = eds__n_obj_recs(&eds__loaded),
+		.strings_size = eds__loaded.strings.index,
+	};
+
+	memcpy(header.magic, EDS__CACHE_MAGIC, sizeof(header.magic));
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(eds__loaded.eds_recs.data, 1, eds__loaded.eds_recs.index, file);
+	fwrite(eds__loaded.obj_recs.data, 1, eds__loaded.obj_recs.index, file);
+	fwrite(eds__loaded.strings.data, 1, eds__loaded.strings.index, file);
+
+	int failed = ferror(file);
+	if (fclose(file) != 0)
+		failed = 1;
+
+	if (failed || rename(tmp_path, path) < 0) {
+		plog(LOG_WARNING, "Could not write the EDS cache %s: %m", path);
+		unlink(tmp_path);
+	}
+}
+
+static void eds__load_lazily(struct canopen_eds* eds)
+{
+	struct eds__lazy* lazy = &eds__lazy[eds - eds_db_get(0)];
+
+	if (co_atomic_load_acquire(&lazy->is_loaded))
+		return;
+
+	pthread_mutex_lock(&eds__lazy_mutex);
+
+	if (lazy->is_loaded)
+		goto done;
+
+	struct eds__builder* builder = &lazy->builder;
+
+	if (eds__load_file(builder, lazy->path) < 0
+	 || eds__n_eds_recs(builder) != 1)
+		goto failure;
+
+	lazy->objs = eds__make_objs(builder->obj_recs.data,
+				    eds__n_obj_recs(builder),
+				    builder->strings.data,
+				    builder->strings.index);
+	if (!lazy->objs)
+		goto failure;
+
+	eds->objs = lazy->objs;
+	eds->n_objs = eds__n_obj_recs(builder);
+	eds__index_obj_names(eds);
+
+	co_atomic_store_release(&lazy->is_loaded, 1);
+	goto done;
+
+failure:
+	/* It is not tried again; the EDS is left without objects */
+	plog(LOG_WARNING, "Could not load the objects of EDS %s", lazy->path);
+	co_atomic_store_release(&lazy->is_loaded, 1);
+done:
+	pthread_mutex_unlock(&eds__lazy_mutex);
+}
+
+static const struct canopen_eds* eds__use(const struct canopen_eds* eds)
+{
+	if (eds && eds__lazy)
+		eds__load_lazily(eds_db_get(eds - eds_db_get(0)));
+
+	return eds;
+}
+
+const struct canopen_eds* eds_db_find(int vendor, int product, int revision)
+{
+	return eds__use(eds__find(vendor, product, revision));
+}
+
+const struct canopen_eds* eds_db_find_by_name(const char* name)
+{
+	return eds__use(eds__find_by_name(name));
+}
+
+void eds_db_set_n_threads(int n)
+{
+	eds__n_threads = n > 0 ? n : 1;
+}
+
+void eds_db_set_lazy(int is_lazy)
+{
+	eds__is_lazy = is_lazy;
+}
+
+void eds_db_set_paths(const char* path, const char* cache_path)
+{
+	eds__dir_path = path ? path : EDS_PATH;
+	eds__cache_file_path = cache_path ? cache_path : EDS_CACHE_PATH;
+}
+
 int eds_db_load(void)
 {
-	vector_reserve(&eds__db, 16);
+	uint64_t fingerprint = 0;
+	int has_fingerprint = eds__fingerprint(&fingerprint) >= 0;
+
+	if (has_fingerprint && eds__load_cache(fingerprint) >= 0)
+		goto done;
 
 	if (eds__load_all_files() < 0)
 		goto failure;
 
+	if (eds__materialize(eds__loaded.eds_recs.data,
+			     eds__n_eds_recs(&eds__loaded),
+			     eds__loaded.obj_recs.data,
+			     eds__n_obj_recs(&eds__loaded),
+			     eds__loaded.strings.data,
+			     eds__loaded.strings.index) < 0)
+		goto failure;
+
+	/* A cache of identities alone would be of no use */
+	if (has_fingerprint && !eds__is_lazy)
+		eds__save_cache(fingerprint);
+
+	/* Only the strings are pointed to */
+	eds__vector_free(&eds__loaded.eds_recs);
+	eds__vector_free(&eds__loaded.obj_recs);
+
+done:
+	eds__free_paths();
+	eds__index();
 	return 0;
 
 failure:
@@ -425,25 +1528,47 @@ failure:
 	return -1;
 }
 
-static void eds__db_clear(void)
+static void eds__free_lazy(void)
 {
-	for (size_t i = 0; i < eds__db.index / sizeof(struct canopen_eds); ++i)
-		eds__clear(eds_db_get(i));
+	if (!eds__lazy)
+		return;
+
+	for (size_t i = 0; i < eds__n_lazy; ++i) {
+		mem_free(MEM_TAG_EDS, eds__lazy[i].path);
+		mem_free(MEM_TAG_EDS, eds__lazy[i].objs);
+		eds__builder_free(&eds__lazy[i].builder);
+	}
+
+	mem_free(MEM_TAG_EDS, eds__lazy);
+	eds__lazy = NULL;
+	eds__n_lazy = 0;
 }
 
 void eds_db_unload(void)
 {
-	eds__db_clear();
-	vector_destroy(&eds__db);
+	eds__unindex();
+	eds__free_lazy();
+	eds__vector_free(&eds__db);
+
+	mem_free(MEM_TAG_EDS, eds__objs);
+	eds__objs = NULL;
+
+	eds__builder_free(&eds__loaded);
+	eds__free_paths();
+
+	if (eds__cache_map) {
+		munmap(eds__cache_map, eds__cache_map_size);
+		eds__cache_map = NULL;
+	}
 }
 
 const struct eds_obj* eds_obj_first(const struct canopen_eds* eds)
 {
-	return (void*)RB_MIN(eds_obj_tree, (void*)&eds->obj_tree);
+	return eds->n_objs > 0 ? eds->objs : NULL;
 }
 
 const struct eds_obj* eds_obj_next(const struct canopen_eds* eds,
 				   const struct eds_obj* obj)
 {
-	return (void*)RB_NEXT(eds_obj_tree, &eds->obj_tree, (void*)obj);
+	return obj + 1 < eds->objs + eds->n_objs ? obj + 1 : NULL;
 }
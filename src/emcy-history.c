@@ -0,0 +1,136 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+
+#include "emcy-history.h"
+#include "canopen-driver.h"
+
+size_t emcy_history_length(const struct emcy_history* self)
+{
+	return self->head < EMCY_HISTORY_LENGTH ? self->head
+						: EMCY_HISTORY_LENGTH;
+}
+
+const struct emcy_record*
+emcy_history_get(const struct emcy_history* self, size_t index)
+{
+	size_t length = emcy_history_length(self);
+	assert(index < length);
+
+	size_t start = self->head - length;
+	return &self->ring[(start + index) % EMCY_HISTORY_LENGTH];
+}
+
+static struct emcy_record*
+emcy_history__find(struct emcy_history* self, const struct co_emcy* emcy,
+		   uint64_t now, uint64_t window)
+{
+	size_t length = emcy_history_length(self);
+
+	for (size_t i = length; i-- > 0;) {
+		struct emcy_record* record =
+			(struct emcy_record*)emcy_history_get(self, i);
+
+		if (record->last_seen + window <= now)
+			continue;
+
+		if (record->code == emcy->code && record->reg == emcy->reg)
+			return record;
+	}
+
+	return NULL;
+}
+
+static int emcy_history__may_log(struct emcy_history* self, uint64_t now,
+				 const struct emcy_history_params* params)
+{
+	if (params->log_burst == 0)
+		return 1;
+
+	if (self->n_logged == 0
+	 || now - self->log_window_start >= params->log_interval) {
+		self->log_window_start = now;
+		self->n_logged = 0;
+	}
+
+	if (self->n_logged >= params->log_burst)
+		return 0;
+
+	++self->n_logged;
+	return 1;
+}
+
+int emcy_history_add(struct emcy_history* self, const struct co_emcy* emcy,
+		     uint64_t now, const struct emcy_history_params* params)
+{
+	++self->n_received;
+
+	struct emcy_record* record =
+		emcy_history__find(self, emcy, now, params->window);
+
+	if (record) {
+		record->manufacturer_error = emcy->manufacturer_error;
+		record->last_seen = now;
+		++record->count;
+		goto suppress;
+	}
+
+	record = &self->ring[self->head++ % EMCY_HISTORY_LENGTH];
+	record->code = emcy->code;
+	record->reg = emcy->reg;
+	record->manufacturer_error = emcy->manufacturer_error;
+	record->first_seen = now;
+	record->last_seen = now;
+	record->count = 1;
+
+	if (emcy_history__may_log(self, now, params))
+		return 1;
+
+suppress:
+	++self->n_suppressed;
+	++self->n_unreported;
+	return 0;
+}
+
+unsigned int emcy_history_take_unreported(struct emcy_history* self)
+{
+	unsigned int n = self->n_unreported;
+	self->n_unreported = 0;
+	return n;
+}
+
+void emcy_history_write_json(FILE* output, const struct emcy_history* self,
+			     uint64_t now)
+{
+	fprintf(output, "{\"received\":%llu,\"suppressed\":%llu,\"recent\":[",
+		(unsigned long long)self->n_received,
+		(unsigned long long)self->n_suppressed);
+
+	size_t length = emcy_history_length(self);
+
+	for (size_t i = 0; i < length; ++i) {
+		const struct emcy_record* record = emcy_history_get(self, i);
+
+		fprintf(output, "%s{\"code\":\"0x%04x\",\"register\":\"0x%02x\",\"manufacturer_error\":\"0x%010llx\",\"count\":%u,\"first_ms_ago\":%llu,\"last_ms_ago\":%llu}",
+			i > 0 ? "," : "", record->code, record->reg,
+			(unsigned long long)record->manufacturer_error,
+			record->count,
+			(unsigned long long)(now - record->first_seen) / 1000ULL,
+			(unsigned long long)(now - record->last_seen) / 1000ULL);
+	}
+
+	fprintf(output, "]}");
+}
@@ -0,0 +1,604 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <mloop.h>
+
+#include "event-rest.h"
+#include "rest.h"
+#include "co_atomic.h"
+#include "canopen-driver.h"
+#include "canopen/master.h"
+#include "canopen/pdo-map.h"
+#include "sdo-poll.h"
+
+struct event_rest_pdo {
+	uint32_t gen;
+	size_t length;
+	int is_decoded;
+	struct pdo_map_entry entry[PDO_MAP_MAX_LENGTH];
+	uint64_t value[PDO_MAP_MAX_LENGTH];
+	uint8_t data[CANFD_MAX_DLEN];
+};
+
+struct event_rest_node {
+	uint32_t state_gen;
+	const char* state;
+	struct event_rest_pdo pdo[4];
+};
+
+struct event_rest_emcy {
+	int bus, nodeid;
+	struct co_emcy emcy;
+};
+
+/* Everything that is published goes into this table. Each change is stamped
+ * with the next generation, so a subscriber only has to remember the last
+ * generation that it saw.
+ */
+static pthread_mutex_t event_rest__mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct event_rest_node*
+event_rest__node[CO_MASTER_MAX_BUSES][CANOPEN_NODEID_MAX + 1];
+static uint32_t event_rest__gen = 0;
+
+static struct event_rest_emcy event_rest__emcy[EVENT_REST_EMCY_MAX];
+static uint32_t event_rest__emcy_seq = 0;
+
+/* The kinds that any subscriber wants */
+static int event_rest__kinds = 0;
+
+/* Subscribers are only touched on the default loop */
+static struct event_rest_subscriber* event_rest__subscribers = NULL;
+
+static inline int event_rest__is_wanted(enum event_rest_kind kind)
+{
+	return co_atomic_load(&event_rest__kinds) & kind;
+}
+
+/* Called with the lock held */
+static struct event_rest_node*
+event_rest__get_node(const struct co_master_node* node)
+{
+	struct event_rest_node** slot =
+		&event_rest__node[node->bus->index][node->nodeid];
+
+	if (!*slot)
+		*slot = calloc(1, sizeof(**slot));
+
+	return *slot;
+}
+
+void event_rest_publish_state(const struct co_master_node* node,
+			      const char* state)
+{
+	if (!event_rest__is_wanted(EVENT_REST_STATE))
+		return;
+
+	pthread_mutex_lock(&event_rest__mutex);
+
+	struct event_rest_node* entry = event_rest__get_node(node);
+	if (entry && entry->state != state) {
+		entry->state = state;
+		entry->state_gen = ++event_rest__gen;
+	}
+
+	pthread_mutex_unlock(&event_rest__mutex);
+}
+
+void event_rest_publish_emcy(const struct co_master_node* node,
+			     const struct co_emcy* emcy)
+{
+	if (!event_rest__is_wanted(EVENT_REST_EMCY))
+		return;
+
+	pthread_mutex_lock(&event_rest__mutex);
+
+	struct event_rest_emcy* entry =
+		&event_rest__emcy[event_rest__emcy_seq % EVENT_REST_EMCY_MAX];
+
+	entry->bus = node->bus->index;
+	entry->nodeid = node->nodeid;
+	entry->emcy = *emcy;
+	++event_rest__emcy_seq;
+
+	pthread_mutex_unlock(&event_rest__mutex);
+}
+
+/* n starts at 0. Mapped PDOs are decoded here, where the map is known to be
+ * valid.
+ */
+void event_rest_publish_pdo(const struct co_master_node* node, int n,
+			    const struct pdo_map* map, const void* data,
+			    size_t size)
+{
+	uint64_t values[PDO_MAP_MAX_LENGTH];
+
+	if (!event_rest__is_wanted(EVENT_REST_PDO))
+		return;
+
+	int is_decoded = map && pdo_map_unpack(map, values, data, size) == 0;
+
+	if (size > CANFD_MAX_DLEN)
+		size = CANFD_MAX_DLEN;
+
+	pthread_mutex_lock(&event_rest__mutex);
+
+	struct event_rest_node* entry = event_rest__get_node(node);
+	if (!entry)
+		goto done;
+
+	struct event_rest_pdo* pdo = &entry->pdo[n];
+
+	pdo->is_decoded = is_decoded;
+	if (is_decoded) {
+		pdo->length = map->length;
+		memcpy(pdo->entry, map->entry,
+		       map->length * sizeof(map->entry[0]));
+		memcpy(pdo->value, values, map->length * sizeof(values[0]));
+	} else {
+		pdo->length = size;
+		memcpy(pdo->data, data, size);
+	}
+
+	pdo->gen = ++event_rest__gen;
+
+done:
+	pthread_mutex_unlock(&event_rest__mutex);
+}
+
+static const char* event_rest__iface(int bus)
+{
+	return bus < co_master_get_n_buses() ? co_master_get_bus(bus)->iface
+					     : "";
+}
+
+static inline int event_rest__is_subscribed(const struct event_rest_subscriber* sub,
+					    int bus, int nodeid)
+{
+	return (sub->bus < 0 || sub->bus == bus) && sub->nodes[nodeid];
+}
+
+static void event_rest__format_pdo(FILE* output, int bus, int nodeid, int n,
+				   const struct event_rest_pdo* pdo)
+{
+	fprintf(output, "event: pdo\ndata: {\"iface\": \"%s\", \"node\": %d, \"pdo\": %d, ",
+		event_rest__iface(bus), nodeid, n + 1);
+
+	if (!pdo->is_decoded) {
+		fprintf(output, "\"data\": \"");
+		for (size_t i = 0; i < pdo->length; ++i)
+			fprintf(output, "%02x", pdo->data[i]);
+		fprintf(output, "\"}\n\n");
+		return;
+	}
+
+	fprintf(output, "\"signals\": {");
+	for (size_t i = 0; i < pdo->length; ++i) {
+		const struct pdo_map_entry* entry = &pdo->entry[i];
+
+		fprintf(output, "%s\"%#x:%#x\": ", i > 0 ? ", " : "",
+			entry->index, entry->subindex);
+
+		if (entry->is_signed)
+			fprintf(output, "%lld", (long long)pdo->value[i]);
+		else
+			fprintf(output, "%llu",
+				(unsigned long long)pdo->value[i]);
+	}
+	fprintf(output, "}}\n\n");
+}
+
+static int event_rest__format_nodes(FILE* output,
+				    struct event_rest_subscriber* sub)
+{
+	int n_events = 0;
+
+	for (int bus = 0; bus < CO_MASTER_MAX_BUSES; ++bus)
+		for (int nodeid = CANOPEN_NODEID_MIN;
+		     nodeid <= CANOPEN_NODEID_MAX; ++nodeid) {
+			const struct event_rest_node* node =
+				event_rest__node[bus][nodeid];
+
+			if (!node || !event_rest__is_subscribed(sub, bus, nodeid))
+				continue;
+
+			if (sub->kinds & EVENT_REST_STATE
+			 && node->state_gen > sub->gen) {
+				fprintf(output, "event: state\ndata: {\"iface\": \"%s\", \"node\": %d, \"state\": \"%s\"}\n\n",
+					event_rest__iface(bus), nodeid,
+					node->state);
+				++n_events;
+			}
+
+			if (!(sub->kinds & EVENT_REST_PDO))
+				continue;
+
+			for (int n = 0; n < 4; ++n)
+				if (node->pdo[n].gen > sub->gen) {
+					event_rest__format_pdo(output, bus,
+							       nodeid, n,
+							       &node->pdo[n]);
+					++n_events;
+				}
+		}
+
+	return n_events;
+}
+
+static int event_rest__format_emcys(FILE* output,
+				    struct event_rest_subscriber* sub)
+{
+	int n_events = 0;
+	uint32_t seq = sub->emcy_seq;
+
+	if (event_rest__emcy_seq - seq > EVENT_REST_EMCY_MAX)
+		seq = event_rest__emcy_seq - EVENT_REST_EMCY_MAX;
+
+	for (; seq != event_rest__emcy_seq; ++seq) {
+		const struct event_rest_emcy* entry =
+			&event_rest__emcy[seq % EVENT_REST_EMCY_MAX];
+
+		if (!event_rest__is_subscribed(sub, entry->bus, entry->nodeid))
+			continue;
+
+		fprintf(output, "event: emcy\ndata: {\"iface\": \"%s\", \"node\": %d, \"code\": \"0x%04x\", \"register\": \"0x%02x\", \"manufacturer-error\": \"0x%llx\"}\n\n",
+			event_rest__iface(entry->bus), entry->nodeid,
+			entry->emcy.code, entry->emcy.reg,
+			(unsigned long long)entry->emcy.manufacturer_error);
+		++n_events;
+	}
+
+	sub->emcy_seq = seq;
+	return n_events;
+}
+
+int event_rest__format(FILE* output, struct event_rest_subscriber* sub)
+{
+	int n_events = 0;
+
+	pthread_mutex_lock(&event_rest__mutex);
+
+	if (sub->gen != event_rest__gen) {
+		n_events += event_rest__format_nodes(output, sub);
+		sub->gen = event_rest__gen;
+	}
+
+	if (sub->kinds & EVENT_REST_EMCY)
+		n_events += event_rest__format_emcys(output, sub);
+	else
+		sub->emcy_seq = event_rest__emcy_seq;
+
+	pthread_mutex_unlock(&event_rest__mutex);
+
+	/* Polled values are only touched on the default loop */
+	if (sub->kinds & EVENT_REST_POLL)
+		n_events += sdo_poll_format_events(output, &sub->poll_gen,
+						   sub->bus, sub->nodes);
+
+	return n_events;
+}
+
+static void event_rest__update_kinds(void)
+{
+	int kinds = 0;
+
+	for (struct event_rest_subscriber* sub = event_rest__subscribers; sub;
+	     sub = sub->next)
+		kinds |= sub->kinds;
+
+	co_atomic_store(&event_rest__kinds, kinds);
+}
+
+void event_rest__subscribe(struct event_rest_subscriber* sub)
+{
+	sub->next = event_rest__subscribers;
+	event_rest__subscribers = sub;
+	event_rest__update_kinds();
+}
+
+void event_rest__unlink(struct event_rest_subscriber* sub)
+{
+	struct event_rest_subscriber** link = &event_rest__subscribers;
+	while (*link != sub)
+		link = &(*link)->next;
+	*link = sub->next;
+
+	event_rest__update_kinds();
+}
+
+static void event_rest__unsubscribe(struct event_rest_subscriber* sub)
+{
+	event_rest__unlink(sub);
+
+	mloop_timer_stop(sub->timer);
+	mloop_timer_unref(sub->timer);
+	rest_client_unref(sub->client);
+	vector_destroy(&sub->pending);
+	free(sub);
+}
+
+/* Returns -1 if the client is gone */
+static int event_rest__send_pending(struct event_rest_subscriber* sub)
+{
+	int fd = sub->client->output_fd;
+
+	/* The head of the reply may still be queued in the client */
+	if (!rest_client_is_flushed(sub->client))
+		return 0;
+
+	while (sub->pending.index > 0) {
+		ssize_t wsize = send(fd, sub->pending.data, sub->pending.index,
+				     MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (wsize < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+
+		sub->pending.index -= wsize;
+		memmove(sub->pending.data, (char*)sub->pending.data + wsize,
+			sub->pending.index);
+	}
+
+	return 0;
+}
+
+/* The events of each tick are sent as one chunk */
+static int event_rest__append_chunk(struct event_rest_subscriber* sub,
+				    const char* data, size_t size)
+{
+	char header[32];
+	int header_size = snprintf(header, sizeof(header), "%zx\r\n", size);
+
+	if (vector_append(&sub->pending, header, header_size) < 0
+	 || vector_append(&sub->pending, data, size) < 0
+	 || vector_append(&sub->pending, "\r\n", 2) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int event_rest__flush(struct event_rest_subscriber* sub)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+
+	/* Changes are held back until the client catches up */
+	if (sub->pending.index > 0)
+		return 0;
+
+	FILE* output = open_memstream(&buffer, &size);
+	if (!output)
+		return -1;
+
+	int n_events = event_rest__format(output, sub);
+
+	sub->idle_time = n_events > 0 ? 0 : sub->idle_time + sub->interval;
+	if (sub->idle_time >= EVENT_REST_KEEPALIVE) {
+		fprintf(output, ": keepalive\n\n");
+		sub->idle_time = 0;
+	}
+
+	if (fclose(output) != 0)
+		return -1;
+
+	int rc = size > 0 ? event_rest__append_chunk(sub, buffer, size) : 0;
+	free(buffer);
+	return rc;
+}
+
+static void event_rest__on_tick(struct mloop_timer* timer)
+{
+	struct event_rest_subscriber* sub = mloop_timer_get_context(timer);
+
+	if (sub->client->state == REST_CLIENT_DISCONNECTED)
+		goto failure;
+
+	if (event_rest__send_pending(sub) < 0
+	 || event_rest__flush(sub) < 0
+	 || event_rest__send_pending(sub) < 0)
+		goto failure;
+
+	if (sub->pending.index > EVENT_REST_PENDING_MAX)
+		goto failure;
+
+	return;
+
+failure:
+	event_rest__unsubscribe(sub);
+}
+
+static int event_rest__parse_kinds(const char* str)
+{
+	int kinds = 0;
+
+	if (!str)
+		return EVENT_REST_STATE | EVENT_REST_EMCY | EVENT_REST_PDO
+		     | EVENT_REST_POLL;
+
+	char* copy = strdup(str);
+	if (!copy)
+		return -1;
+
+	char* saveptr = NULL;
+	for (char* tok = strtok_r(copy, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		if (strcasecmp(tok, "state") == 0) {
+			kinds |= EVENT_REST_STATE;
+		} else if (strcasecmp(tok, "emcy") == 0) {
+			kinds |= EVENT_REST_EMCY;
+		} else if (strcasecmp(tok, "pdo") == 0) {
+			kinds |= EVENT_REST_PDO;
+		} else if (strcasecmp(tok, "poll") == 0) {
+			kinds |= EVENT_REST_POLL;
+		} else {
+			kinds = -1;
+			break;
+		}
+	}
+
+	free(copy);
+	return kinds;
+}
+
+static int event_rest__parse_nodes(char* nodes, const char* str)
+{
+	if (!str) {
+		memset(nodes, 1, CANOPEN_NODEID_MAX + 1);
+		return 0;
+	}
+
+	while (*str) {
+		char* end = NULL;
+		unsigned long nodeid = strtoul(str, &end, 10);
+		if (end == str || nodeid < CANOPEN_NODEID_MIN
+		 || nodeid > CANOPEN_NODEID_MAX)
+			return -1;
+
+		nodes[nodeid] = 1;
+
+		str = end;
+		if (*str == ',')
+			++str;
+		else if (*str != '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+static void event_rest__reply(struct rest_client* client,
+			      const char* status_code, const char* message)
+{
+	struct rest_reply_data reply = {
+		.status_code = status_code,
+		.content_type = "text/plain",
+		.content_length = strlen(message),
+		.content = message
+	};
+
+	rest_client_reply(client, &reply);
+	rest_client_done(client);
+}
+
+static struct event_rest_subscriber*
+event_rest__subscriber_new(struct rest_client* client)
+{
+	struct http_req* req = &client->req;
+
+	struct event_rest_subscriber* sub = calloc(1, sizeof(*sub));
+	if (!sub)
+		return NULL;
+
+	sub->client = client;
+	sub->bus = -1;
+
+	sub->kinds = event_rest__parse_kinds(http_req_query(req, "kinds"));
+	if (sub->kinds <= 0)
+		goto failure;
+
+	if (event_rest__parse_nodes(sub->nodes,
+				    http_req_query(req, "nodes")) < 0)
+		goto failure;
+
+	const char* iface = http_req_query(req, "iface");
+	if (iface) {
+		struct co_bus* bus = co_master_find_bus(iface);
+		if (!bus)
+			goto failure;
+
+		sub->bus = bus->index;
+	}
+
+	return sub;
+
+failure:
+	free(sub);
+	return NULL;
+}
+
+void event_rest_service(struct rest_client* client, const void* content)
+{
+	(void)content;
+
+	struct event_rest_subscriber* sub = event_rest__subscriber_new(client);
+	if (!sub) {
+		event_rest__reply(client, "400 Bad Request",
+				  "Invalid kinds, nodes or iface\r\n");
+		return;
+	}
+
+	const char* interval = http_req_query(&client->req, "interval");
+	sub->interval = interval ? atoi(interval) : EVENT_REST_INTERVAL_DEFAULT;
+	if ((int)sub->interval < EVENT_REST_INTERVAL_MIN)
+		sub->interval = EVENT_REST_INTERVAL_MIN;
+
+	/* Only EMCYs that come after this are sent */
+	pthread_mutex_lock(&event_rest__mutex);
+	sub->emcy_seq = event_rest__emcy_seq;
+	pthread_mutex_unlock(&event_rest__mutex);
+
+	if (vector_init(&sub->pending, REST_CHUNK_SIZE) < 0)
+		goto pending_failure;
+
+	sub->timer = mloop_timer_new(mloop_default());
+	if (!sub->timer)
+		goto timer_failure;
+
+	mloop_timer_set_type(sub->timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_time(sub->timer, sub->interval * 1000000ULL);
+	mloop_timer_set_context(sub->timer, sub, NULL);
+	mloop_timer_set_callback(sub->timer, event_rest__on_tick);
+
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "text/event-stream",
+		.content_length = -1,
+	};
+
+	/* The reply never ends, so the client is not done until it goes away.
+	 * The first tick sends the current state of everything.
+	 */
+	rest_reply_header(client->output, &reply);
+
+	rest_client_ref(client);
+	event_rest__subscribe(sub);
+
+	mloop_timer_start(sub->timer);
+	return;
+
+timer_failure:
+	vector_destroy(&sub->pending);
+pending_failure:
+	free(sub);
+	event_rest__reply(client, "500 Internal Server Error",
+			  "Out of memory\r\n");
+}
+
+void event_rest_cleanup(void)
+{
+	while (event_rest__subscribers)
+		event_rest__unsubscribe(event_rest__subscribers);
+
+	for (int bus = 0; bus < CO_MASTER_MAX_BUSES; ++bus)
+		for (int nodeid = 0; nodeid <= CANOPEN_NODEID_MAX; ++nodeid) {
+			free(event_rest__node[bus][nodeid]);
+			event_rest__node[bus][nodeid] = NULL;
+		}
+}
@@ -0,0 +1,339 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/syscall.h>
+
+#include "event-trace.h"
+
+/* Only the owning thread writes to a ring. It fills in the record before it
+ * moves head on, so a reader that copies records and then finds that head has
+ * not come round to them again has copied whole records.
+ */
+struct event_trace_ring {
+	struct event_trace_ring* next;
+	uint64_t head;
+	size_t mask;
+	int tid;
+	char name[16];
+	struct event_trace_record records[];
+};
+
+struct event_trace_info {
+	const char* name;
+	const char* category;
+	enum {
+		EVENT_TRACE_ARG_NONE,
+		EVENT_TRACE_ARG_BUS,
+		EVENT_TRACE_ARG_NODE,
+		EVENT_TRACE_ARG_SDO,
+		EVENT_TRACE_ARG_FN,
+	} arg;
+};
+
+static const struct event_trace_info event_trace__info[] = {
+#define X(id, name, category, arg) \
+	[EVENT_TRACE_ ## id] = { name, category, EVENT_TRACE_ARG_ ## arg },
+	EVENT_TRACE_EVENTS(X)
+#undef X
+};
+
+int event_trace_is_enabled_ = 0;
+
+static size_t event_trace__size = 0;
+static struct event_trace_ring* event_trace__rings = NULL;
+
+/* Rings that were freed by event_trace_cleanup() are from an old generation */
+static unsigned int event_trace__generation = 0;
+
+static __thread struct event_trace_ring* event_trace__ring = NULL;
+static __thread unsigned int event_trace__ring_generation = 0;
+static __thread int event_trace__has_failed = 0;
+
+static size_t event_trace__round_up(size_t size)
+{
+	size_t n = 1;
+	while (n < size)
+		n <<= 1;
+	return n;
+}
+
+static struct event_trace_ring* event_trace__new_ring(void)
+{
+	size_t size = co_atomic_load(&event_trace__size);
+	if (size == 0)
+		return NULL;
+
+	struct event_trace_ring* self =
+		malloc(sizeof(*self) + size * sizeof(self->records[0]));
+	if (!self)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+	self->mask = size - 1;
+	self->tid = syscall(SYS_gettid);
+
+	if (pthread_getname_np(pthread_self(), self->name, sizeof(self->name))
+	    != 0 || !self->name[0])
+		snprintf(self->name, sizeof(self->name), "%d", self->tid);
+
+	struct event_trace_ring* head;
+	do {
+		head = co_atomic_load(&event_trace__rings);
+		self->next = head;
+	} while (!co_atomic_cas(&event_trace__rings, head, self));
+
+	return self;
+}
+
+static struct event_trace_ring* event_trace__get_ring(void)
+{
+	unsigned int generation = co_atomic_load_relaxed(&event_trace__generation);
+
+	if (event_trace__ring_generation != generation) {
+		event_trace__ring = NULL;
+		event_trace__has_failed = 0;
+		event_trace__ring_generation = generation;
+	}
+
+	if (event_trace__ring || event_trace__has_failed)
+		return event_trace__ring;
+
+	event_trace__ring = event_trace__new_ring();
+	if (!event_trace__ring)
+		event_trace__has_failed = 1;
+
+	return event_trace__ring;
+}
+
+void event_trace__record(enum event_trace_id id, enum event_trace_phase phase,
+			 uint64_t time, uint64_t duration, uint64_t key,
+			 uint32_t arg)
+{
+	struct event_trace_ring* self = event_trace__get_ring();
+	if (!self)
+		return;
+
+	uint64_t head = self->head;
+	struct event_trace_record* record = &self->records[head & self->mask];
+
+	record->time = time;
+	record->duration = duration;
+	record->key = key;
+	record->arg = arg;
+	record->id = id;
+	record->phase = phase;
+
+	co_atomic_store_release(&self->head, head + 1);
+}
+
+int event_trace_enable(size_t size)
+{
+	if (size == 0)
+		return -1;
+
+	co_atomic_store(&event_trace__size, event_trace__round_up(size));
+	co_atomic_store(&event_trace_is_enabled_, 1);
+	return 0;
+}
+
+void event_trace_disable(void)
+{
+	co_atomic_store(&event_trace_is_enabled_, 0);
+}
+
+void event_trace_cleanup(void)
+{
+	event_trace_disable();
+
+	struct event_trace_ring* ring =
+		co_atomic_exchange(&event_trace__rings, NULL);
+
+	while (ring) {
+		struct event_trace_ring* next = ring->next;
+		free(ring);
+		ring = next;
+	}
+
+	co_atomic_add_fetch(&event_trace__generation, 1);
+}
+
+static void event_trace__write_string(FILE* stream, const char* str)
+{
+	fputc('"', stream);
+
+	for (const unsigned char* p = (const unsigned char*)str; *p; ++p)
+		if (*p == '"' || *p == '\\')
+			fprintf(stream, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(stream, "\\u%04x", *p);
+		else
+			fputc(*p, stream);
+
+	fputc('"', stream);
+}
+
+/* Static functions are given as an offset into their object file, which
+ * addr2line can look up
+ */
+static void event_trace__write_fn(FILE* stream, uint64_t key)
+{
+	const void* fn = (const void*)(uintptr_t)key;
+	char buffer[256];
+	Dl_info info;
+
+	if (!dladdr(fn, &info) || !info.dli_fname) {
+		snprintf(buffer, sizeof(buffer), "%#" PRIx64, key);
+	} else if (info.dli_sname && info.dli_saddr == fn) {
+		snprintf(buffer, sizeof(buffer), "%s", info.dli_sname);
+	} else {
+		const char* name = strrchr(info.dli_fname, '/');
+		snprintf(buffer, sizeof(buffer), "%s+%#lx",
+			 name ? name + 1 : info.dli_fname,
+			 (unsigned long)((const char*)fn
+					 - (const char*)info.dli_fbase));
+	}
+
+	fprintf(stream, "\"fn\":");
+	event_trace__write_string(stream, buffer);
+}
+
+static void event_trace__write_args(FILE* stream,
+				    const struct event_trace_record* record)
+{
+	const struct event_trace_info* info = &event_trace__info[record->id];
+	uint32_t arg = record->arg;
+
+	switch (info->arg) {
+	case EVENT_TRACE_ARG_NONE:
+		return;
+	case EVENT_TRACE_ARG_BUS:
+		fprintf(stream, ",\"args\":{\"bus\":%" PRIu32 "}", arg);
+		return;
+	case EVENT_TRACE_ARG_NODE:
+		fprintf(stream, ",\"args\":{\"node\":%" PRIu32 "}", arg);
+		return;
+	case EVENT_TRACE_ARG_SDO:
+		fprintf(stream, ",\"args\":{\"node\":%" PRIu32
+			",\"index\":\"%#06" PRIx32 "\",\"subindex\":%" PRIu32
+			"}", arg >> 24, (arg >> 8) & 0xffff, arg & 0xff);
+		return;
+	case EVENT_TRACE_ARG_FN:
+		fprintf(stream, ",\"args\":{");
+		event_trace__write_fn(stream, record->key);
+		fprintf(stream, "}");
+		return;
+	}
+}
+
+static void event_trace__write_record(FILE* stream, int tid,
+				      const struct event_trace_record* record)
+{
+	const struct event_trace_info* info = &event_trace__info[record->id];
+
+	fprintf(stream, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+		"\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64,
+		info->name, info->category, record->phase, (int)getpid(), tid,
+		record->time / 1000, record->time % 1000);
+
+	switch (record->phase) {
+	case EVENT_TRACE_COMPLETE:
+		fprintf(stream, ",\"dur\":%" PRIu64 ".%03" PRIu64,
+			record->duration / 1000, record->duration % 1000);
+		break;
+	case EVENT_TRACE_ASYNC_BEGIN:
+	case EVENT_TRACE_ASYNC_END:
+		fprintf(stream, ",\"id\":\"%#" PRIx64 "\"", record->key);
+		break;
+	case EVENT_TRACE_INSTANT:
+		fprintf(stream, ",\"s\":\"t\"");
+		break;
+	default:
+		break;
+	}
+
+	event_trace__write_args(stream, record);
+	fputc('}', stream);
+}
+
+static void event_trace__write_ring(FILE* stream,
+				    const struct event_trace_ring* ring,
+				    struct event_trace_record* copy)
+{
+	size_t size = ring->mask + 1;
+	uint64_t head = co_atomic_load_acquire(&ring->head);
+	uint64_t tail = head > size ? head - size : 0;
+
+	for (uint64_t i = tail; i < head; ++i)
+		copy[i - tail] = ring->records[i & ring->mask];
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	/* Records that the writer has got to again while they were copied
+	 * are dropped.
+	 */
+	uint64_t head2 = co_atomic_load_relaxed(&ring->head);
+	uint64_t first = head2 >= tail + size ? head2 - size + 1 : tail;
+
+	fprintf(stream, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":%d,\"args\":{\"name\":", (int)getpid(), ring->tid);
+	event_trace__write_string(stream, ring->name);
+	fprintf(stream, "}}");
+
+	for (uint64_t i = first; i < head; ++i)
+		event_trace__write_record(stream, ring->tid, &copy[i - tail]);
+}
+
+int event_trace_write_json(FILE* stream)
+{
+	size_t size = co_atomic_load(&event_trace__size);
+	struct event_trace_record* copy = NULL;
+
+	if (size) {
+		copy = malloc(size * sizeof(*copy));
+		if (!copy)
+			return -1;
+	}
+
+	fprintf(stream, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"args\":{\"name\":\"canopen-master\"}}", (int)getpid());
+
+	for (const struct event_trace_ring* ring =
+		co_atomic_load(&event_trace__rings); ring; ring = ring->next) {
+		/* Rings made before the size was changed keep their own */
+		if (ring->mask + 1 > size) {
+			size = ring->mask + 1;
+			free(copy);
+			copy = malloc(size * sizeof(*copy));
+			if (!copy)
+				return -1;
+		}
+
+		event_trace__write_ring(stream, ring, copy);
+	}
+
+	fprintf(stream, "\n]}\n");
+
+	free(copy);
+	return ferror(stream) ? -1 : 0;
+}
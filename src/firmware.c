@@ -0,0 +1,358 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "canopen/firmware.h"
+#include "canopen/sdo_req.h"
+#include "canopen/sdo_async.h"
+#include "time-utils.h"
+
+size_t strlcpy(char*, const char*, size_t);
+
+struct fw_image* fw_image_open(const char* path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		errno = EINVAL;
+		goto failure;
+	}
+
+	struct fw_image* self = malloc(sizeof(*self));
+	if (!self)
+		goto failure;
+
+	memset(self, 0, sizeof(*self));
+
+	self->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (self->data == MAP_FAILED)
+		goto mmap_failure;
+
+	madvise(self->data, st.st_size, MADV_SEQUENTIAL);
+
+	self->ref = 1;
+	self->size = st.st_size;
+	strlcpy(self->path, path, sizeof(self->path));
+
+	close(fd);
+	return self;
+
+mmap_failure:
+	free(self);
+failure:
+	close(fd);
+	return NULL;
+}
+
+static void fw_image_free(struct fw_image* self)
+{
+	munmap(self->data, self->size);
+	free(self);
+}
+
+ARC_GENERATE(fw_image, fw_image_free)
+
+const char* fw_job_state_str(enum fw_job_state state)
+{
+	switch (state) {
+	case FW_JOB_IDLE: return "idle";
+	case FW_JOB_PENDING: return "pending";
+	case FW_JOB_STOPPING: return "stopping";
+	case FW_JOB_CLEARING: return "clearing";
+	case FW_JOB_DOWNLOADING: return "downloading";
+	case FW_JOB_STARTING: return "starting";
+	case FW_JOB_DONE: return "done";
+	case FW_JOB_FAILED: return "failed";
+	}
+
+	return "unknown";
+}
+
+const char* fw_job_strerror(const struct fw_job* self)
+{
+	switch (self->status) {
+	case SDO_REQ_LOCAL_ABORT:
+	case SDO_REQ_REMOTE_ABORT:
+		return sdo_strerror(self->abort_code);
+	case SDO_REQ_CANCELLED:
+		return "Cancelled";
+	case SDO_REQ_NOMEM:
+		return "Out of memory";
+	default:
+		break;
+	}
+
+	return "";
+}
+
+void fw_updater_init(struct fw_updater* self, struct sdo_req_queue* queues,
+		     unsigned int max_active)
+{
+	memset(self, 0, sizeof(*self));
+	self->queues = queues;
+	self->max_active = max_active > 0 ? max_active : 1;
+}
+
+static void fw_job__detach(struct fw_job* self)
+{
+	if (self->req) {
+		self->req->on_done = NULL;
+		self->req->context_free_fn = NULL;
+		self->req = NULL;
+	}
+
+	if (self->image) {
+		fw_image_unref(self->image);
+		self->image = NULL;
+	}
+}
+
+/* The requests that are still queued are cancelled with the queues */
+void fw_updater_destroy(struct fw_updater* self)
+{
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		fw_job__detach(&self->job[i]);
+}
+
+static void fw_job__on_done(struct sdo_req* req)
+{
+	struct fw_job* self = req->context;
+
+	self->req_status = req->status;
+	self->abort_code = req->abort_code;
+}
+
+static void fw_job__on_req_free(void* ptr);
+
+static void fw_job__start_step(struct fw_job* self)
+{
+	uint8_t control;
+
+	struct sdo_req_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.index = FW_PROGRAM_CONTROL,
+		.subindex = self->program,
+		.dl_data = &control,
+		.dl_size = sizeof(control),
+		.on_done = fw_job__on_done,
+		.context = self,
+	};
+
+	switch (self->state) {
+	case FW_JOB_STOPPING:
+		control = FW_PROGRAM_STOP;
+		break;
+	case FW_JOB_CLEARING:
+		control = FW_PROGRAM_CLEAR;
+		info.timeout = FW_CLEAR_TIMEOUT;
+		break;
+	case FW_JOB_DOWNLOADING:
+		info.index = FW_PROGRAM_DATA;
+		info.dl_data = self->image->data;
+		info.dl_size = self->image->size;
+		info.is_dl_data_borrowed = 1;
+		info.use_block = 1;
+		info.timeout = FW_DOWNLOAD_TIMEOUT;
+		break;
+	case FW_JOB_STARTING:
+		control = FW_PROGRAM_START;
+		break;
+	default:
+		abort();
+	}
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req) {
+		self->req_status = SDO_REQ_NOMEM;
+		fw_job__on_req_free(self);
+		return;
+	}
+
+	/* The job moves on once the queue is done with the request, whether it
+	 * was finished or cancelled.
+	 */
+	req->context_free_fn = fw_job__on_req_free;
+	self->req = req;
+	self->req_status = SDO_REQ_PENDING;
+
+	sdo_req_start(req, &self->parent->queues[self->nodeid]);
+	sdo_req_unref(req);
+}
+
+static void fw_updater__run_pending(struct fw_updater* self)
+{
+	while (self->n_active < self->max_active) {
+		struct fw_job* next = NULL;
+
+		for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+			struct fw_job* job = &self->job[i];
+			if (job->state != FW_JOB_PENDING)
+				continue;
+
+			if (!next || job->pending_time < next->pending_time)
+				next = job;
+		}
+
+		if (!next)
+			return;
+
+		++self->n_active;
+		next->state = FW_JOB_DOWNLOADING;
+		fw_job__start_step(next);
+	}
+}
+
+static void fw_job__finish(struct fw_job* self, enum fw_job_state state)
+{
+	int was_active = self->state == FW_JOB_DOWNLOADING;
+
+	self->state = state;
+	self->end_time = gettime_us(CLOCK_MONOTONIC);
+
+	fw_image_unref(self->image);
+	self->image = NULL;
+
+	if (was_active) {
+		--self->parent->n_active;
+		fw_updater__run_pending(self->parent);
+	}
+}
+
+static void fw_job__fail(struct fw_job* self, enum sdo_req_status status)
+{
+	self->failed_state = self->state;
+	self->status = status;
+	fw_job__finish(self, FW_JOB_FAILED);
+}
+
+static void fw_job__on_req_free(void* ptr)
+{
+	struct fw_job* self = ptr;
+	enum sdo_req_status status = self->req_status;
+
+	self->req = NULL;
+
+	/* A program that is not running may refuse to be stopped */
+	int is_ok = status == SDO_REQ_OK
+		 || (self->state == FW_JOB_STOPPING
+		  && status == SDO_REQ_REMOTE_ABORT);
+
+	if (!is_ok) {
+		fw_job__fail(self, status == SDO_REQ_PENDING ? SDO_REQ_CANCELLED
+							     : status);
+		return;
+	}
+
+	switch (self->state) {
+	case FW_JOB_STOPPING:
+		self->state = FW_JOB_CLEARING;
+		break;
+	case FW_JOB_CLEARING:
+		/* Wait for a turn to use the bus */
+		self->state = FW_JOB_PENDING;
+		self->pending_time = gettime_us(CLOCK_MONOTONIC);
+		fw_updater__run_pending(self->parent);
+		return;
+	case FW_JOB_DOWNLOADING:
+		--self->parent->n_active;
+		self->state = FW_JOB_STARTING;
+		fw_updater__run_pending(self->parent);
+		break;
+	case FW_JOB_STARTING:
+		fw_job__finish(self, FW_JOB_DONE);
+		return;
+	default:
+		abort();
+	}
+
+	fw_job__start_step(self);
+}
+
+int fw_updater_start(struct fw_updater* self, int nodeid,
+		     struct fw_image* image, int program)
+{
+	if (nodeid < CANOPEN_NODEID_MIN || nodeid > CANOPEN_NODEID_MAX
+	 || program < 1 || program > 0xFE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct fw_job* job = &self->job[nodeid];
+
+	if (job->state != FW_JOB_IDLE && job->state != FW_JOB_DONE
+	 && job->state != FW_JOB_FAILED) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	memset(job, 0, sizeof(*job));
+
+	job->parent = self;
+	job->nodeid = nodeid;
+	job->program = program;
+	job->size = image->size;
+	job->image = image;
+	fw_image_ref(image);
+
+	job->state = FW_JOB_STOPPING;
+	job->start_time = gettime_us(CLOCK_MONOTONIC);
+
+	fw_job__start_step(job);
+	return 0;
+}
+
+struct fw_image* fw_updater_find_image(struct fw_updater* self,
+				       const char* path)
+{
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct fw_image* image = self->job[i].image;
+
+		if (image && strcmp(image->path, path) == 0) {
+			fw_image_ref(image);
+			return image;
+		}
+	}
+
+	return NULL;
+}
+
+size_t fw_job_get_progress(const struct fw_job* self)
+{
+	switch (self->state) {
+	case FW_JOB_DOWNLOADING:
+		return self->req && self->req->channel
+		     ? self->req->channel->pos : 0;
+	case FW_JOB_STARTING:
+	case FW_JOB_DONE:
+		return self->size;
+	default:
+		break;
+	}
+
+	return 0;
+}
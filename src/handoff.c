@@ -0,0 +1,331 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "handoff.h"
+#include "time-utils.h"
+
+#define HANDOFF_CMDLINE_MAX 4096
+#define HANDOFF_ARGS_MAX 128
+
+void handoff_header_init(struct handoff_header* self, uint32_t n_buses,
+			 uint32_t n_fds)
+{
+	memset(self, 0, sizeof(*self));
+	memcpy(self->magic, HANDOFF_MAGIC, sizeof(self->magic));
+	self->version = HANDOFF_VERSION;
+	self->n_buses = n_buses;
+	self->rest = -1;
+	self->n_fds = n_fds;
+}
+
+int handoff_header_is_valid(const struct handoff_header* self)
+{
+	return memcmp(self->magic, HANDOFF_MAGIC, sizeof(self->magic)) == 0
+	    && self->version == HANDOFF_VERSION
+	    && self->n_fds <= HANDOFF_MAX_FDS
+	    && self->rest < (int32_t)self->n_fds;
+}
+
+/* The arguments are separated by null characters. A command line that does
+ * not fit is not cut short, as the new process would then run with other
+ * arguments; the handoff fails with E2BIG instead.
+ */
+int handoff__read_cmdline(char* buffer, size_t size, char** argv,
+			  size_t max_args)
+{
+	int fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	size_t length = 0;
+	ssize_t rc;
+
+	while (length < size - 1
+	    && (rc = read(fd, buffer + length, size - 1 - length)) != 0) {
+		if (rc < 0 && errno == EINTR)
+			continue;
+
+		if (rc < 0) {
+			close(fd);
+			return -1;
+		}
+
+		length += rc;
+	}
+
+	/* Whatever is left to read would not fit */
+	char rest;
+	int is_truncated = length == size - 1 && read(fd, &rest, 1) > 0;
+	close(fd);
+
+	if (is_truncated) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	if (length == 0) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	buffer[length] = '\0';
+
+	size_t n = 0;
+	for (char* arg = buffer; arg < buffer + length;
+	     arg += strlen(arg) + 1) {
+		if (n == max_args - 1) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		argv[n++] = arg;
+	}
+
+	argv[n] = NULL;
+	return 0;
+}
+
+/* Only async-signal-safe calls are made between fork() and exec */
+static void handoff__exec(char** argv, int fd)
+{
+	sigset_t none;
+	sigemptyset(&none);
+	sigprocmask(SIG_SETMASK, &none, NULL);
+
+	if (fcntl(fd, F_SETFD, 0) < 0)
+		_exit(127);
+
+	execvp(argv[0], argv);
+	_exit(127);
+}
+
+int handoff_spawn(void)
+{
+	static char cmdline[HANDOFF_CMDLINE_MAX];
+	char* argv[HANDOFF_ARGS_MAX];
+
+	if (handoff__read_cmdline(cmdline, sizeof(cmdline), argv,
+				  HANDOFF_ARGS_MAX) < 0)
+		return -1;
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		return -1;
+
+	/* The environment is set here, as setenv() may allocate */
+	char value[16];
+	snprintf(value, sizeof(value), "%d", fds[1]);
+	if (setenv(HANDOFF_ENV, value, 1) < 0)
+		goto failure;
+
+	pid_t pid = fork();
+	if (pid == 0)
+		handoff__exec(argv, fds[1]);
+
+	unsetenv(HANDOFF_ENV);
+
+	if (pid < 0)
+		goto failure;
+
+	close(fds[1]);
+	return fds[0];
+
+failure:
+	close(fds[0]);
+	close(fds[1]);
+	return -1;
+}
+
+int handoff_get_inherited(void)
+{
+	const char* value = getenv(HANDOFF_ENV);
+	if (!value)
+		return -1;
+
+	char* end;
+	long fd = strtol(value, &end, 10);
+	unsetenv(HANDOFF_ENV);
+
+	if (*end != '\0' || fd < 0 || fd > INT32_MAX
+	 || fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+		return -1;
+
+	return fd;
+}
+
+int handoff_send(int sock, const void* data, size_t size, const int* fds,
+		 size_t n_fds)
+{
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	} control;
+
+	if (n_fds > HANDOFF_MAX_FDS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	const char* p = data;
+	size_t sent = 0;
+
+	while (sent < size) {
+		struct iovec iov = {
+			.iov_base = (void*)(p + sent),
+			.iov_len = size - sent,
+		};
+
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		};
+
+		if (sent == 0 && n_fds > 0) {
+			msg.msg_control = control.buffer;
+			msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+			memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+		}
+
+		ssize_t rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		sent += rc;
+	}
+
+	return 0;
+}
+
+static void handoff__take_fds(struct msghdr* msg, int* fds, size_t* n_fds,
+			      size_t max_fds)
+{
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg;
+	     cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		 || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const unsigned char* src = CMSG_DATA(cmsg);
+
+		for (size_t i = 0; i < n; ++i) {
+			int fd;
+			memcpy(&fd, src + i * sizeof(int), sizeof(fd));
+
+			if (*n_fds < max_fds)
+				fds[(*n_fds)++] = fd;
+			else
+				close(fd);
+		}
+	}
+}
+
+int handoff_recv(int sock, void* data, size_t size, int* fds, size_t* n_fds)
+{
+	union {
+		struct cmsghdr align;
+		char buffer[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+	} control;
+
+	size_t max_fds = fds && n_fds ? *n_fds : 0;
+	if (n_fds)
+		*n_fds = 0;
+
+	char* p = data;
+	size_t received = 0;
+
+	while (received < size) {
+		struct iovec iov = {
+			.iov_base = p + received,
+			.iov_len = size - received,
+		};
+
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = control.buffer,
+			.msg_controllen = sizeof(control.buffer),
+		};
+
+		ssize_t rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		handoff__take_fds(&msg, fds, n_fds, max_fds);
+
+		if (rc == 0) {
+			errno = EPIPE;
+			return -1;
+		}
+
+		received += rc;
+	}
+
+	return 0;
+}
+
+int handoff_wait_close(int sock, int timeout)
+{
+	uint64_t deadline = gettime_us(CLOCK_MONOTONIC) + timeout * 1000ULL;
+	char buffer[256];
+
+	for (;;) {
+		uint64_t now = gettime_us(CLOCK_MONOTONIC);
+		if (now >= deadline) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		struct pollfd pfd = { .fd = sock, .events = POLLIN };
+		int rc = poll(&pfd, 1, (deadline - now + 999) / 1000);
+		if (rc < 0 && errno != EINTR)
+			return -1;
+
+		if (rc <= 0)
+			continue;
+
+		ssize_t n = read(sock, buffer, sizeof(buffer));
+		if (n == 0)
+			return 0;
+
+		if (n < 0 && errno != EINTR && errno != EAGAIN)
+			return -1;
+	}
+}
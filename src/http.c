@@ -14,10 +14,11 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
-#include "vector.h"
 #include "http.h"
+#include "mem-tag.h"
 
 enum httplex_token_type {
 	HTTPLEX_SOLIDUS,
@@ -33,9 +34,11 @@ enum httplex_token_type {
 	HTTPLEX_END,
 };
 
+/* Tokens point into the input; they are not NUL-terminated */
 struct httplex_token {
 	enum httplex_token_type type;
 	const char* value;
+	size_t length;
 };
 
 enum httplex_state {
@@ -44,34 +47,56 @@ enum httplex_state {
 	HTTPLEX_STATE_VALUE,
 };
 
+/* A string in the request that is to be pointed at from struct http_req once
+ * the whole head has been parsed.
+ */
+struct httplex_ref {
+	char** field;
+	size_t length;
+};
+
+#define HTTPLEX_REF_MAX (URL_INDEX_MAX + 2 * URL_QUERY_INDEX_MAX + 4)
+
 struct httplex {
 	enum httplex_state state;
 	struct httplex_token current_token;
 	const char* input;
 	const char* pos;
 	const char* next_pos;
-	struct vector buffer;
 	int accepted;
 	int errno_;
+	size_t n_refs;
+	struct httplex_ref refs[HTTPLEX_REF_MAX];
 };
 
 int httplex_init(struct httplex* self, const char* input)
 {
-	memset(self, 0, sizeof(*self));
+	memset(self, 0, offsetof(struct httplex, refs));
 
 	self->input = input;
 	self->pos = input;
 	self->accepted = 1;
 
-	if (vector_reserve(&self->buffer, 256) < 0)
-		return -1;
-
 	return 0;
 }
 
 void httplex_destroy(struct httplex* self)
 {
-	vector_destroy(&self->buffer);
+	(void)self;
+}
+
+static int httplex__ref(struct httplex* self, char** field,
+			const struct httplex_token* tok)
+{
+	if (self->n_refs >= HTTPLEX_REF_MAX)
+		return -1;
+
+	struct httplex_ref* ref = &self->refs[self->n_refs++];
+	ref->field = field;
+	ref->length = tok->length;
+
+	*field = (char*)tok->value;
+	return 0;
 }
 
 static inline int httplex__is_literal(char c)
@@ -131,9 +156,8 @@ int httplex__classify_request_token(struct httplex* self)
 		self->current_token.type = HTTPLEX_LITERAL;
 		size_t len = httplex__literal_length(self->pos);
 		self->next_pos = self->pos + len;
-		vector_assign(&self->buffer, self->pos, len);
-		vector_append(&self->buffer, "", 1);
-		self->current_token.value = self->buffer.data;
+		self->current_token.value = self->pos;
+		self->current_token.length = len;
 		return 0;
 	}
 
@@ -179,11 +203,9 @@ int httplex__classify_key_token(struct httplex* self)
 	self->next_pos = self->pos + len;
 	self->next_pos += strspn(self->next_pos, " \t");
 
-	vector_assign(&self->buffer, self->pos, len - 1);
-	vector_append(&self->buffer, "", 1);
-
 	self->current_token.type = HTTPLEX_KEY;
-	self->current_token.value = self->buffer.data;
+	self->current_token.value = self->pos;
+	self->current_token.length = len - 1;
 	return 0;
 }
 
@@ -195,11 +217,9 @@ int httplex__classify_value_token(struct httplex* self)
 
 	self->next_pos = self->pos + len + 2;
 
-	vector_assign(&self->buffer, self->pos, len);
-	vector_append(&self->buffer, "", 1);
-
 	self->current_token.type = HTTPLEX_VALUE;
-	self->current_token.value = self->buffer.data;
+	self->current_token.value = self->pos;
+	self->current_token.length = len;
 	return 0;
 }
 
@@ -243,6 +263,13 @@ static inline int httplex_accept_token(struct httplex* self)
 	return 1;
 }
 
+static inline int httplex__token_is(const struct httplex_token* tok,
+				    const char* str)
+{
+	size_t len = strlen(str);
+	return tok->length == len && strncasecmp(str, tok->value, len) == 0;
+}
+
 int http__literal(struct httplex* lex, const char* str)
 {
 	struct httplex_token* tok = httplex_next_token(lex);
@@ -252,7 +279,7 @@ int http__literal(struct httplex* lex, const char* str)
 	if (tok->type != HTTPLEX_LITERAL)
 		return 0;
 
-	if (strcasecmp(str, tok->value) != 0)
+	if (!httplex__token_is(tok, str))
 		return 0;
 
 	return httplex_accept_token(lex);
@@ -276,6 +303,15 @@ int http__put(struct http_req* req, struct httplex* lex)
 	return 1;
 }
 
+int http__post(struct http_req* req, struct httplex* lex)
+{
+	if (!http__literal(lex, "POST"))
+		return 0;
+
+	req->method = HTTP_POST;
+	return 1;
+}
+
 int http__options(struct http_req* req, struct httplex* lex)
 {
 	if (!http__literal(lex, "OPTIONS"))
@@ -289,6 +325,7 @@ int http__method(struct http_req* req, struct httplex* lex)
 {
 	return http__get(req, lex)
 	    || http__put(req, lex)
+	    || http__post(req, lex)
 	    || http__options(req, lex);
 }
 
@@ -331,12 +368,9 @@ int http__url_path(struct http_req* req, struct httplex* lex)
 	if (req->url_index >= URL_INDEX_MAX)
 		return 0;
 
-	char* elem = strdup(tok->value);
-	if (!elem)
+	if (httplex__ref(lex, &req->url[req->url_index++], tok) < 0)
 		return 0;
 
-	req->url[req->url_index++] = elem;
-
 	httplex_accept_token(lex);
 
 	return http__peek(lex, HTTPLEX_SOLIDUS)
@@ -352,15 +386,13 @@ int http__url_query_key(struct http_req* req, struct httplex* lex)
 	if (tok->type != HTTPLEX_LITERAL)
 		return 0;
 
-	if (req->url_index >= URL_INDEX_MAX)
+	if (req->url_query_index >= URL_QUERY_INDEX_MAX)
 		return 0;
 
-	char* elem = strdup(tok->value);
-	if (!elem)
+	struct http_url_query* query = &req->url_query[req->url_query_index];
+	if (httplex__ref(lex, &query->key, tok) < 0)
 		return 0;
 
-	req->url_query[req->url_query_index].key = elem;
-
 	return httplex_accept_token(lex);
 }
 
@@ -373,15 +405,13 @@ int http__url_query_value(struct http_req* req, struct httplex* lex)
 	if (tok->type != HTTPLEX_LITERAL)
 		return 0;
 
-	if (req->url_index >= URL_INDEX_MAX)
+	if (req->url_query_index >= URL_QUERY_INDEX_MAX)
 		return 0;
 
-	char* elem = strdup(tok->value);
-	if (!elem)
+	struct http_url_query* query = &req->url_query[req->url_query_index++];
+	if (httplex__ref(lex, &query->value, tok) < 0)
 		return 0;
 
-	req->url_query[req->url_query_index++].value = elem;
-
 	return httplex_accept_token(lex);
 }
 
@@ -420,7 +450,7 @@ int http__expect_key(struct httplex* lex, const char* key)
 	if (tok->type != HTTPLEX_KEY)
 		return 0;
 
-	if (key && strcasecmp(tok->value, key) != 0)
+	if (key && !httplex__token_is(tok, key))
 		return 0;
 
 	return httplex_accept_token(lex);
@@ -459,7 +489,59 @@ int http__content_type(struct http_req* req, struct httplex* lex)
 	if (tok->type != HTTPLEX_VALUE)
 		return 0;
 
-	req->content_type = strdup(tok->value);
+	if (httplex__ref(lex, &req->content_type, tok) < 0)
+		return 0;
+
+	return httplex_accept_token(lex);
+}
+
+int http__if_none_match(struct http_req* req, struct httplex* lex)
+{
+	lex->state = HTTPLEX_STATE_KEY;
+	if (!http__expect_key(lex, "If-None-Match"))
+		return 0;
+
+	lex->state = HTTPLEX_STATE_VALUE;
+	struct httplex_token* tok = httplex_next_token(lex);
+	if (!tok)
+		return 0;
+
+	if (tok->type != HTTPLEX_VALUE)
+		return 0;
+
+	if (httplex__ref(lex, &req->if_none_match, tok) < 0)
+		return 0;
+
+	return httplex_accept_token(lex);
+}
+
+static int http__has_token(const struct httplex_token* tok, const char* str)
+{
+	size_t len = strlen(str);
+
+	for (size_t i = 0; i + len <= tok->length; ++i)
+		if (strncasecmp(&tok->value[i], str, len) == 0)
+			return 1;
+
+	return 0;
+}
+
+/* Connections are kept open unless the client says otherwise */
+int http__connection(struct http_req* req, struct httplex* lex)
+{
+	lex->state = HTTPLEX_STATE_KEY;
+	if (!http__expect_key(lex, "Connection"))
+		return 0;
+
+	lex->state = HTTPLEX_STATE_VALUE;
+	struct httplex_token* tok = httplex_next_token(lex);
+	if (!tok)
+		return 0;
+
+	if (tok->type != HTTPLEX_VALUE)
+		return 0;
+
+	req->close_connection = http__has_token(tok, "close");
 
 	return httplex_accept_token(lex);
 }
@@ -486,6 +568,8 @@ int http__header_kv(struct http_req* req, struct httplex* lex)
 {
 	return http__content_length(req, lex)
 	    || http__content_type(req, lex)
+	    || http__if_none_match(req, lex)
+	    || http__connection(req, lex)
 	    || http__dummy_kv(lex);
 }
 
@@ -500,6 +584,29 @@ int http__header(struct http_req* req, struct httplex* lex)
 	return 1;
 }
 
+/* The head is copied once into req->head, and the strings in req point into
+ * that copy. This way the request outlives the buffer that it was read into.
+ */
+static int http__resolve_refs(struct http_req* req, struct httplex* lex)
+{
+	req->head = mem_alloc(MEM_TAG_REST, req->header_length + 1);
+	if (!req->head)
+		return -1;
+
+	memcpy(req->head, lex->input, req->header_length);
+	req->head[req->header_length] = '\0';
+
+	for (size_t i = 0; i < lex->n_refs; ++i) {
+		struct httplex_ref* ref = &lex->refs[i];
+		size_t offset = *ref->field - lex->input;
+
+		*ref->field = &req->head[offset];
+		req->head[offset + ref->length] = '\0';
+	}
+
+	return 0;
+}
+
 int http_req_parse(struct http_req* req, const char* input)
 {
 	int rc = -1;
@@ -517,23 +624,19 @@ int http_req_parse(struct http_req* req, const char* input)
 
 	req->header_length = lex.next_pos - input;
 
-	rc = 0;
+	rc = http__resolve_refs(req, &lex);
 failure:
+	if (rc < 0)
+		memset(req, 0, sizeof(*req));
+
 	httplex_destroy(&lex);
 	return rc;
 }
 
 void http_req_free(struct http_req* req)
 {
-	free(req->content_type);
-
-	for (size_t i = 0; i < req->url_index; ++i)
-		free(req->url[i]);
-
-	for (size_t i = 0; i < req->url_query_index; ++i) {
-		free(req->url_query[i].key);
-		free(req->url_query[i].value);
-	}
+	mem_free(MEM_TAG_REST, req->head);
+	req->head = NULL;
 }
 
 const char* http_req_query(struct http_req* req, const char* key)
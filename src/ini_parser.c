@@ -15,295 +15,395 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ini_parser.h"
 #include "vector.h"
+#include "mem-tag.h"
 
-static inline char* ini__trim_left(char* str)
+#define INI__READ_SIZE 4096
+
+struct ini_arena {
+	/* Interned keys */
+	const char** keys;
+	size_t keys_mask;
+
+	/* Index + 1 into the sections of the file */
+	uint32_t* sections;
+	size_t sections_mask;
+
+	struct ini_key_value* kv;
+	size_t n_kv;
+
+	/* A copy of the last line, if it does not end in a newline */
+	char* tail;
+};
+
+static inline int ini__is_space(char c)
 {
-	while (isspace(*str))
-		++str;
-	return str;
+	return isspace((unsigned char)c);
 }
 
-static inline char* ini__trim_right(char* str)
+static inline char* ini__to_lower(char* str)
 {
-	char* end = str + strlen(str) - 1;
-	while (str < end && isspace(*end))
-		*end-- = '\0';
+	char* ptr = str;
+	while (*ptr) {
+		*ptr = tolower((unsigned char)*ptr);
+		++ptr;
+	}
 	return str;
 }
 
-static inline char* ini__trim(char* str)
+static inline uint32_t ini__hash(const char* str)
 {
-	return ini__trim_right(ini__trim_left(str));
+	uint32_t hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)tolower((unsigned char)*str++);
+		hash *= 16777619u;
+	}
+
+	return hash;
 }
 
-static inline int ini__is_section(const char* str)
+static inline size_t ini__table_size(size_t n)
 {
-	return *str == '[';
+	size_t size = 16;
+	while (size < 2 * n)
+		size *= 2;
+	return size;
 }
 
-static inline int ini__is_comment(const char* str)
+static inline size_t ini__align(size_t size)
 {
-	return *str == ';';
+	return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
 }
 
-static inline int ini__is_empty(const char* str)
+static const char** ini__key_slot(const struct ini_arena* arena,
+				  const char* key)
 {
-	return *str == '\0';
+	size_t mask = arena->keys_mask;
+
+	for (size_t i = ini__hash(key) & mask;; i = (i + 1) & mask) {
+		const char** slot = &arena->keys[i];
+		if (!*slot || strcasecmp(*slot, key) == 0)
+			return slot;
+	}
 }
 
-static inline char* ini__to_lower(char* str)
+static uint32_t* ini__section_slot(const struct ini_file* self,
+				   const char* name)
 {
-	char* ptr = str;
-	while (*ptr) {
-		*ptr = tolower(*ptr);
-		++ptr;
+	const struct ini_arena* arena = self->arena;
+	size_t mask = arena->sections_mask;
+
+	for (size_t i = ini__hash(name) & mask;; i = (i + 1) & mask) {
+		uint32_t* slot = &arena->sections[i];
+		if (!*slot || strcasecmp(self->section[*slot - 1].section,
+					 name) == 0)
+			return slot;
 	}
-	return str;
 }
 
-static struct ini_section* ini__new_section(const char* name)
+/* Everything is allocated up front from an upper bound on the number of
+ * sections and keys, which is found by counting lines and brackets.
+ */
+static int ini__new_arena(struct ini_file* self, const char* buffer,
+			  size_t size)
 {
-	size_t name_size = strlen(name) + 1;
-
-	struct ini_section* section = malloc(sizeof(*section) + name_size);
-	if (!section)
-		return NULL;
+	size_t n_lines = 1, n_sections = 2, tail_size = 0;
+	const char* end = buffer + size;
+
+	for (const char* p = buffer; p < end; ++p) {
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		++n_lines;
+	}
 
-	memset(section, 0, sizeof(*section));
+	for (const char* p = buffer; p < end; ++p) {
+		p = memchr(p, '[', end - p);
+		if (!p)
+			break;
+		++n_sections;
+	}
 
-	memcpy(section->section, name, name_size);
+	if (size > 0 && buffer[size - 1] != '\n') {
+		const char* last = memrchr(buffer, '\n', size);
+		tail_size = end - (last ? last + 1 : buffer) + 1;
+	}
 
-	if (vector_init(&section->kv, 8 * sizeof(void*)) < 0)
-		goto failure;
+	size_t keys_size = ini__table_size(n_lines);
+	size_t sections_size = ini__table_size(n_sections);
+
+	size_t sections_offset = ini__align(sizeof(struct ini_arena));
+	size_t kv_offset = sections_offset
+			 + ini__align(n_sections * sizeof(struct ini_section));
+	size_t keys_offset = kv_offset
+			   + ini__align(n_lines * sizeof(struct ini_key_value));
+	size_t table_offset = keys_offset
+			    + ini__align(keys_size * sizeof(const char*));
+	size_t tail_offset = table_offset
+			   + ini__align(sections_size * sizeof(uint32_t));
+
+	/* calloc leaves the tables empty without touching more of them than
+	 * is needed
+	 */
+	char* data = mem_calloc(MEM_TAG_INI, 1, tail_offset + tail_size);
+	if (!data)
+		return -1;
 
-	return section;
+	struct ini_arena* arena = (void*)data;
+	arena->keys = (void*)(data + keys_offset);
+	arena->keys_mask = keys_size - 1;
+	arena->sections = (void*)(data + table_offset);
+	arena->sections_mask = sections_size - 1;
+	arena->kv = (void*)(data + kv_offset);
+	arena->tail = tail_size ? data + tail_offset : NULL;
 
-failure:
-	free(section);
-	return NULL;
+	self->arena = arena;
+	self->section = (void*)(data + sections_offset);
+	return 0;
 }
 
-static int ini__append_new_section(struct ini_file* self, const char* name)
+static void ini__append_section(struct ini_file* self, const char* name)
 {
-	struct ini_section* section = ini__new_section(name);
-	if (!section)
-		return -1;
+	struct ini_arena* arena = self->arena;
+	struct ini_section* section = &self->section[self->n_sections++];
 
-	if (vector_append(&self->section, &section, sizeof(void*)) < 0)
-		goto failure;
-
-	return 0;
+	section->section = name;
+	section->arena = arena;
+	section->kv = &arena->kv[arena->n_kv];
+	section->n_kv = 0;
 
-failure:
-	free(section);
-	return -1;
+	*ini__section_slot(self, name) = self->n_sections;
 }
 
-static int ini__parse_section(struct ini_file* self, char* str)
+static void ini__append_key_value(struct ini_file* self, char* key,
+				  char* value)
 {
-	size_t len = strlen(str);
-	char* end = str + len - 1;
-	if (*str != '[' || *end != ']')
-		return -1;
+	struct ini_arena* arena = self->arena;
+	struct ini_section* section = &self->section[self->n_sections - 1];
 
-	*end = '\0';
-	const char* name = ini__to_lower(str + 1);
+	const char** slot = ini__key_slot(arena, key);
+	if (!*slot)
+		*slot = ini__to_lower(key);
 
-	return ini__append_new_section(self, name);
+	struct ini_key_value* kv = &arena->kv[arena->n_kv++];
+	kv->key = *slot;
+	kv->value = value;
+	++section->n_kv;
 }
 
-static struct ini_key_value* ini__new_key_value(const char* key,
-						const char* value)
+/* The line is tokenized in place. There is always room for a terminator at
+ * the end of it.
+ */
+static int ini__parse_line(struct ini_file* self, char* str, char* end)
 {
-	size_t key_size = strlen(key) + 1;
-	size_t value_size = strlen(value) + 1;
+	/* As with lines read as strings, anything after a NUL is ignored */
+	char* nul = memchr(str, '\0', end - str);
+	if (nul)
+		end = nul;
 
-	struct ini_key_value* kv = malloc(sizeof(*kv) + key_size + value_size);
-	if (!kv)
-		return NULL;
+	while (str < end && ini__is_space(*str))
+		++str;
 
-	memset(kv, 0, sizeof(*kv));
+	while (end > str && ini__is_space(end[-1]))
+		--end;
 
-	kv->value = kv->key + key_size;
+	if (str == end || *str == ';')
+		return 0;
 
-	strcpy(kv->key, key);
-	strcpy(kv->value, value);
+	if (*str == '[') {
+		if (end - str < 2 || end[-1] != ']')
+			return -1;
 
-	return kv;
-}
+		end[-1] = '\0';
+		ini__append_section(self, ini__to_lower(str + 1));
+		return 0;
+	}
 
-static inline struct ini_section* ini__current_section(struct ini_file* self)
-{
-	size_t index = self->section.index / sizeof(void*) - 1;
-	struct ini_section** section = self->section.data;
-	return section[index];
-}
+	char* eq = memchr(str, '=', end - str);
+	if (!eq)
+		return -1;
 
-static int ini__append_new_key_value(struct ini_file* self, const char* key,
-				     const char* value)
-{
-	struct ini_section* section = ini__current_section(self);
+	char* key_end = eq;
+	while (key_end > str && ini__is_space(key_end[-1]))
+		--key_end;
 
-	struct ini_key_value* kv = ini__new_key_value(key, value);
-	if (!kv)
-		return -1;
+	char* value = eq + 1;
+	while (value < end && ini__is_space(*value))
+		++value;
 
-	if (vector_append(&section->kv, &kv, sizeof(void*)) < 0)
-		goto failure;
+	*key_end = '\0';
+	*end = '\0';
 
+	ini__append_key_value(self, str, value);
 	return 0;
-
-failure:
-	free(kv);
-	return -1;
 }
 
-static int ini__parse_key_value(struct ini_file* self, char* str)
+int ini_parse_buffer(struct ini_file* self, char* buffer, size_t size)
 {
-	char* eq = strchr(str, '=');
-	if (!eq)
+	int lineno = 0;
+
+	memset(self, 0, sizeof(*self));
+
+	if (ini__new_arena(self, buffer, size) < 0)
 		return -1;
 
-	*eq = '\0';
+	ini__append_section(self, "(root)");
 
-	char* value = ini__trim_left(eq + 1);
-	char* key = ini__to_lower(ini__trim_right(str));
+	char* end = buffer + size;
 
-	return ini__append_new_key_value(self, key, value);
-}
+	for (char* line = buffer; line < end;) {
+		--lineno;
 
-int ini__parse_line(struct ini_file* self, char* line)
-{
-	char* trimmed = ini__trim(line);
+		char* eol = memchr(line, '\n', end - line);
+		char* next = eol ? eol + 1 : end;
 
-	if (ini__is_empty(trimmed) || ini__is_comment(trimmed))
-		return 0;
+		if (!eol) {
+			char* tail = self->arena->tail;
+			memcpy(tail, line, end - line);
+			eol = tail + (end - line);
+			line = tail;
+		}
 
-	if (ini__is_section(trimmed))
-		return ini__parse_section(self, trimmed);
+		if (ini__parse_line(self, line, eol) < 0)
+			goto failure;
+
+		line = next;
+	}
 
-	return ini__parse_key_value(self, trimmed);
+	return 0;
+
+failure:
+	ini_destroy(self);
+	return lineno;
 }
 
-static int ini__section_cmp(const void* p1, const void* p2)
+static int ini__read(struct vector* buffer, FILE* stream)
 {
-	const struct ini_section* const* sp1 = p1;
-	const struct ini_section* const* sp2 = p2;
+	while (1) {
+		if (vector_reserve(buffer, buffer->index + INI__READ_SIZE) < 0)
+			return -1;
 
-	const struct ini_section* s1 = *sp1;
-	const struct ini_section* s2 = *sp2;
+		char* data = buffer->data;
+		size_t n = fread(data + buffer->index, 1, INI__READ_SIZE, stream);
+		buffer->index += n;
 
-	return strcasecmp(s1->section, s2->section);
+		if (n < INI__READ_SIZE)
+			return ferror(stream) && buffer->index == 0 ? -1 : 0;
+	}
 }
 
-static int ini__key_cmp(const void* p1, const void* p2)
+int ini_parse(struct ini_file* self, FILE* stream)
 {
-	const struct ini_key_value* const* kvp1 = p1;
-	const struct ini_key_value* const* kvp2 = p2;
+	struct vector buffer;
+	int r = -1;
 
-	const struct ini_key_value* kv1 = *kvp1;
-	const struct ini_key_value* kv2 = *kvp2;
+	memset(self, 0, sizeof(*self));
 
-	return strcasecmp(kv1->key, kv2->key);
-}
+	if (vector_init(&buffer, INI__READ_SIZE) < 0)
+		return -1;
 
-static inline void ini__sort(struct ini_file* self)
-{
-	qsort(self->section.data, self->section.index / sizeof(void*),
-	      sizeof(struct section*), ini__section_cmp);
+	if (ini__read(&buffer, stream) < 0)
+		goto failure;
 
-	struct ini_section** section = self->section.data;
-	size_t section_end = self->section.index / sizeof(void*);
+	r = ini_parse_buffer(self, buffer.data, buffer.index);
+	if (r < 0)
+		goto failure;
 
-	for (size_t i = 0; i < section_end; ++i) {
-		struct ini_key_value** kv = section[i]->kv.data;
-		size_t kv_size = section[i]->kv.index / sizeof(void*);
+	self->buffer = buffer.data;
+	self->buffer_size = buffer.index;
+	return 0;
 
-		qsort(kv, kv_size, sizeof(struct kv*), ini__key_cmp);
-	}
+failure:
+	vector_destroy(&buffer);
+	return r;
 }
 
-int ini_parse(struct ini_file* self, FILE* stream)
+int ini_parse_file(struct ini_file* self, const char* path)
 {
-	char* line = NULL;
-	size_t size = 0;
-	int lineno = 0;
-
 	memset(self, 0, sizeof(*self));
 
-	vector_init(&self->section, 1024 * sizeof(void*));
-
-	if (ini__append_new_section(self, "(root)") < 0)
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
 		return -1;
 
-	while (getline(&line, &size, stream) >= 0) {
-		--lineno;
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	size_t size = st.st_size;
+	char* buffer = NULL;
 
-		if (ini__parse_line(self, line) < 0)
-			goto done;
+	/* Pages that are written to while tokenizing are copied */
+	if (size > 0) {
+		buffer = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			      fd, 0);
+		if (buffer == MAP_FAILED)
+			goto failure;
 	}
 
-	ini__sort(self);
+	close(fd);
 
-	lineno = 0;
-done:
-	free(line);
-	return lineno;
+	int r = ini_parse_buffer(self, buffer, size);
+	if (r < 0) {
+		if (buffer)
+			munmap(buffer, size);
+		return r;
+	}
+
+	self->buffer = buffer;
+	self->buffer_size = size;
+	self->buffer_is_mapped = 1;
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
 }
 
 void ini_destroy(struct ini_file* file)
 {
-	struct ini_section** section = file->section.data;
-	size_t section_end = file->section.index / sizeof(void*);
+	mem_free(MEM_TAG_INI, file->arena);
 
-	for (size_t i = 0; i < section_end; ++i) {
-		struct ini_key_value** kv = section[i]->kv.data;
-		size_t kv_end = section[i]->kv.index / sizeof(void*);
+	if (file->buffer_is_mapped)
+		munmap(file->buffer, file->buffer_size);
+	else
+		mem_free(MEM_TAG_VECTOR, file->buffer); /* From ini_parse() */
 
-		for (size_t j = 0; j < kv_end; ++j)
-			free(kv[j]);
-
-		vector_destroy(&section[i]->kv);
-		free(section[i]);
-	}
-
-	vector_destroy(&file->section);
+	memset(file, 0, sizeof(*file));
 }
 
 const char* ini_find_key(const struct ini_section* section, const char* key)
 {
-	struct ini_key_value** kvp;
-	char kbuf[sizeof(struct ini_key_value) + strlen(key) + 1];
-	struct ini_key_value* key_key = (void*)kbuf;
-	strcpy(key_key->key, key);
-	kvp = bsearch(&key_key, section->kv.data,
-		     section->kv.index / sizeof(void*), sizeof(void*),
-		     ini__key_cmp);
-
-	if (!kvp)
+	const char* interned = *ini__key_slot(section->arena, key);
+	if (!interned)
 		return NULL;
 
-	struct ini_key_value* kv = *kvp;
+	for (size_t i = section->n_kv; i > 0; --i)
+		if (section->kv[i - 1].key == interned)
+			return section->kv[i - 1].value;
 
-	return kv->value;
+	return NULL;
 }
 
 const struct ini_section* ini_find_section(const struct ini_file* file,
 					   const char* section)
 {
-	struct ini_section** sp;
-	char sbuf[sizeof(struct ini_section) + strlen(section) + 1];
-	struct ini_section* section_key = (void*)sbuf;
-	strcpy(section_key->section, section);
-	sp = bsearch(&section_key, file->section.data,
-		     file->section.index / sizeof(void*), sizeof(void*),
-		     ini__section_cmp);
-	return sp ? *sp : NULL;
+	if (!file->arena)
+		return NULL;
+
+	uint32_t index = *ini__section_slot(file, section);
+	return index ? &file->section[index - 1] : NULL;
 }
 
 const char* ini_find(const struct ini_file* file, const char* section,
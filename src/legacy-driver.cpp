@@ -15,6 +15,9 @@
 
 #include <exception>
 #include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include <pthread.h>
 #include "plog.h"
 
 extern "C" {
@@ -25,6 +28,7 @@ extern "C" {
 #include "DriverManager.h"
 #include "CanMasterInterface.h"
 #include "CanIOHandlerInterface.h"
+#include "CanIOHandlerInterface2.h"
 
 #define STR(x) #x
 
@@ -33,7 +37,7 @@ extern "C" {
 
 using std::exception;
 
-class LegacyMasterInterface: public CanMasterInterface {
+class LegacyMasterInterface: public CanMasterInterface2 {
 public:
 	LegacyMasterInterface(const struct legacy_master_iface* iface)
 		: self(*iface)
@@ -61,6 +65,11 @@ public:
 		return self.send_pdo(getNodeId(), 4, data, size);
 	}
 
+	virtual int sendPdo(int n, const uint8_t* data, size_t size) noexcept
+	{
+		return self.send_pdo(getNodeId(), n, data, size);
+	}
+
 	virtual int requestPdo1() { return -1; }
 	virtual int requestPdo2() { return -1; }
 	virtual int requestPdo3() { return -1; }
@@ -72,6 +81,12 @@ public:
 		return self.send_sdo(getNodeId(), index, subindex, data, size);
 	}
 
+	virtual int sendSdo(int index, int subindex, const uint8_t* data,
+			    size_t size) noexcept
+	{
+		return self.send_sdo(getNodeId(), index, subindex, data, size);
+	}
+
 	virtual int requestSdo(int index, int subindex)
 	{
 		return self.request_sdo(getNodeId(), index, subindex);
@@ -103,19 +118,45 @@ void legacy_master_iface_delete(void* obj)
 	delete (LegacyMasterInterface*)obj;
 }
 
+/* Creating a DriverManager loads every driver in the directory, so one is
+ * shared by everyone that asks for it.
+ */
+static DriverManager* driver_manager_ = NULL;
+static unsigned int driver_manager_ref_ = 0;
+static pthread_mutex_t driver_manager_lock_ = PTHREAD_MUTEX_INITIALIZER;
+
 void* legacy_driver_manager_new()
 {
+	pthread_mutex_lock(&driver_manager_lock_);
+
 	try {
-		return new DriverManager;
+		if (!driver_manager_)
+			driver_manager_ = new DriverManager;
+		++driver_manager_ref_;
 	} catch (exception& e) {
 		plogx(LOG_ERROR, "Caught exception: %s", e.what());
-		return NULL;
 	}
+
+	DriverManager* result = driver_manager_;
+	pthread_mutex_unlock(&driver_manager_lock_);
+	return result;
 }
 
 void legacy_driver_manager_delete(void* obj)
 {
-	delete (DriverManager*)obj;
+	if (!obj)
+		return;
+
+	pthread_mutex_lock(&driver_manager_lock_);
+
+	assert(obj == driver_manager_);
+
+	if (--driver_manager_ref_ == 0) {
+		delete driver_manager_;
+		driver_manager_ = NULL;
+	}
+
+	pthread_mutex_unlock(&driver_manager_lock_);
 }
 
 int legacy_driver_manager_create_handler(void* obj, const char* name,
@@ -126,8 +167,8 @@ int legacy_driver_manager_create_handler(void* obj, const char* name,
 	auto man = (DriverManager*)obj;
 	try {
 		return man->createHandler(name, profile_number,
-					  (CanMasterInterface*)master_iface,
-					  (CanIOHandlerInterface**)driver_iface);
+					  (LegacyMasterInterface*)master_iface,
+					  (CanIOHandlerInterface2**)driver_iface);
 	} catch (exception& e) {
 		plogx(LOG_ERROR, "Caught exception: %s", e.what());
 		return -1;
@@ -138,7 +179,7 @@ int legacy_driver_delete_handler(void* obj, int profile_number,
 				 void* driver_interface)
 {
 	auto man = (DriverManager*)obj;
-	auto iface = (CanIOHandlerInterface*)driver_interface;
+	auto iface = (CanIOHandlerInterface2*)driver_interface;
 	try {
 		return man->deleteHandler(profile_number, iface);
 	} catch (exception& e) {
@@ -149,7 +190,7 @@ int legacy_driver_delete_handler(void* obj, int profile_number,
 
 int legacy_driver_iface_initialize(void* obj)
 {
-	auto iface = (CanIOHandlerInterface*)obj;
+	auto iface = (CanIOHandlerInterface2*)obj;
 	try {
 		return iface->initialize();
 	} catch (exception& e) {
@@ -161,7 +202,7 @@ int legacy_driver_iface_initialize(void* obj)
 int legacy_driver_iface_process_emr(void* obj, int code, int reg,
 				    uint64_t manufacturer_error)
 {
-	auto iface = (CanIOHandlerInterface*)obj;
+	auto iface = (CanIOHandlerInterface2*)obj;
 	try {
 		return iface->processEmr(code, reg, manufacturer_error);
 	} catch (exception& e) {
@@ -171,11 +212,12 @@ int legacy_driver_iface_process_emr(void* obj, int code, int reg,
 }
 
 int legacy_driver_iface_process_sdo(void* obj, int index, int subindex,
-				    unsigned char* data, size_t size)
+				    const unsigned char* data, size_t size)
 {
-	auto iface = (CanIOHandlerInterface*)obj;
+	auto iface = (CanIOHandlerInterface2*)obj;
+	ConstBytes bytes = { data, size };
 	try {
-		return iface->processSdo(index, subindex, data, size);
+		return iface->processSdo(index, subindex, bytes);
 	} catch (exception& e) {
 		plogx(LOG_ERROR, "Caught exception: %s", e.what());
 		return -1;
@@ -183,29 +225,29 @@ int legacy_driver_iface_process_sdo(void* obj, int index, int subindex,
 }
 
 int legacy_driver_iface_process_pdo(void* obj, int n, const unsigned char* data,
-				    size_t size)
+				    size_t size, uint64_t timestamp)
 {
-	auto iface = (CanIOHandlerInterface*)obj;
+	auto iface = (CanIOHandlerInterface2*)obj;
+	return iface->processPdo(n, data, size, timestamp);
+}
 
-	try {
-		switch (n) {
-		case 1: return iface->processPdo1((unsigned char*)data, size);
-		case 2: return iface->processPdo2((unsigned char*)data, size);
-		case 3: return iface->processPdo3((unsigned char*)data, size);
-		case 4: return iface->processPdo4((unsigned char*)data, size);
-		}
-	} catch (exception& e) {
-		plogx(LOG_ERROR, "Caught exception: %s", e.what());
-		return -1;
-	}
+static_assert(sizeof(legacy_pdo) == sizeof(PdoFrame)
+	      && offsetof(legacy_pdo, data) == offsetof(PdoFrame, data)
+	      && offsetof(legacy_pdo, size) == offsetof(PdoFrame, size)
+	      && offsetof(legacy_pdo, timestamp) == offsetof(PdoFrame, timestamp),
+	      "struct legacy_pdo must match CanIOMapDriver::PdoFrame");
 
-	abort();
-	return -1;
+size_t legacy_driver_iface_process_pdos(void* obj,
+					const struct legacy_pdo* pdos,
+					size_t n)
+{
+	auto iface = (CanIOHandlerInterface2*)obj;
+	return iface->processPdos((const PdoFrame*)pdos, n);
 }
 
 int legacy_driver_iface_process_node_state(void* obj, int state)
 {
-	auto iface = (CanIOHandlerInterface*)obj;
+	auto iface = (CanIOHandlerInterface2*)obj;
 	try {
 		return iface->processNodeState(state);
 	} catch (exception& e) {
@@ -0,0 +1,183 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "socketcan.h"
+#include "canopen/lss.h"
+#include "time-utils.h"
+#include "sock.h"
+
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+
+#define LSS_FASTSCAN_CONFIRM 0x80
+
+static void lss__frame(struct can_frame* cf, enum lss_cs cs)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = R_LSS_MASTER;
+	cf->can_dlc = 8;
+	cf->data[0] = cs;
+}
+
+/* Answers that came in too late for an earlier request must not be taken
+ * for answers to the next one
+ */
+static void lss__drain(const struct sock* sock)
+{
+	struct can_frame cf;
+	while (sock_timed_recv(sock, &cf, 0) > 0)
+		;
+}
+
+/* Returns 1 if a node answered with cs within the timeout, or 0 otherwise.
+ * Other frames are skipped.
+ */
+static int lss__wait_for(const struct sock* sock, enum lss_cs cs,
+			 struct can_frame* cf, int timeout)
+{
+	int t = gettime_ms(CLOCK_MONOTONIC);
+	int t_end = t + timeout;
+
+	while (sock_timed_recv(sock, cf, MAX(0, t_end - t)) > 0) {
+		if (cf->can_id == R_LSS_SLAVE && cf->can_dlc >= 1
+		 && cf->data[0] == cs)
+			return 1;
+
+		t = gettime_ms(CLOCK_MONOTONIC);
+	}
+
+	return 0;
+}
+
+static int lss__request(const struct sock* sock, struct can_frame* cf,
+			enum lss_cs response, struct can_frame* dst,
+			int timeout)
+{
+	lss__drain(sock);
+
+	if (sock_send(sock, cf, 0) < 0)
+		return -1;
+
+	return lss__wait_for(sock, response, dst, timeout);
+}
+
+int lss_switch_state_global(const struct sock* sock, enum lss_mode mode)
+{
+	struct can_frame cf;
+	lss__frame(&cf, LSS_CS_SWITCH_STATE_GLOBAL);
+	cf.data[1] = mode;
+	return sock_send(sock, &cf, 0);
+}
+
+/* Nodes that are at field sub of the scan answer if their value of it is
+ * the same as id in bit_checked and all bits above it. With bit_checked at
+ * 0, a node that answers moves on to field next.
+ */
+static int lss__fastscan_step(const struct sock* sock, uint32_t id,
+			      int bit_checked, int sub, int next, int timeout)
+{
+	struct can_frame cf, response;
+	lss__frame(&cf, LSS_CS_FASTSCAN);
+	cf.data[1] = id;
+	cf.data[2] = id >> 8;
+	cf.data[3] = id >> 16;
+	cf.data[4] = id >> 24;
+	cf.data[5] = bit_checked;
+	cf.data[6] = sub;
+	cf.data[7] = next;
+
+	return lss__request(sock, &cf, LSS_CS_IDENTIFY_SLAVE, &response,
+			    timeout);
+}
+
+/* Each bit is taken to be 0 first, and is 1 if no node answers to that. So
+ * the scan follows the node with the lowest address.
+ */
+static int lss__fastscan_field(const struct sock* sock, uint32_t* dst,
+			       int sub, int timeout)
+{
+	uint32_t id = 0;
+
+	for (int bit = 31; bit >= 0; --bit) {
+		int rc = lss__fastscan_step(sock, id, bit, sub, sub, timeout);
+		if (rc < 0)
+			return -1;
+
+		if (rc == 0)
+			id |= 1U << bit;
+	}
+
+	/* A node that left the bus half way through leaves nothing to
+	 * confirm
+	 */
+	int next = (sub + 1) % LSS_N_FIELDS;
+	int rc = lss__fastscan_step(sock, id, 0, sub, next, timeout);
+	if (rc <= 0)
+		return rc;
+
+	*dst = id;
+	return 1;
+}
+
+int lss_fastscan(const struct sock* sock, struct lss_address* found,
+		 int timeout)
+{
+	memset(found, 0, sizeof(*found));
+
+	/* Every node that has no node id answers this */
+	int rc = lss__fastscan_step(sock, 0, LSS_FASTSCAN_CONFIRM, 0, 0,
+				    timeout);
+	if (rc <= 0)
+		return rc;
+
+	for (int sub = 0; sub < LSS_N_FIELDS; ++sub) {
+		rc = lss__fastscan_field(sock, &found->field[sub], sub,
+					 timeout);
+		if (rc <= 0)
+			return rc;
+	}
+
+	return 1;
+}
+
+static int lss__configure(const struct sock* sock, struct can_frame* cf,
+			  int timeout)
+{
+	struct can_frame response;
+	enum lss_cs cs = cf->data[0];
+
+	int rc = lss__request(sock, cf, cs, &response, timeout);
+	if (rc <= 0)
+		return -1;
+
+	return response.can_dlc >= 2 ? response.data[1] : -1;
+}
+
+int lss_configure_nodeid(const struct sock* sock, int nodeid, int timeout)
+{
+	struct can_frame cf;
+	lss__frame(&cf, LSS_CS_CONFIGURE_NODEID);
+	cf.data[1] = nodeid;
+	return lss__configure(sock, &cf, timeout);
+}
+
+int lss_store_configuration(const struct sock* sock, int timeout)
+{
+	struct can_frame cf;
+	lss__frame(&cf, LSS_CS_STORE_CONFIGURATION);
+	return lss__configure(sock, &cf, timeout);
+}
@@ -35,7 +35,7 @@
 size_t strlcpy(char*, const char*, size_t);
 
 const char usage_[] =
-"Usage: canopen-master [options] <interface>\n"
+"Usage: canopen-master [options] <interface> [<interface>...]\n"
 "\n"
 "Options:\n"
 "    -h, --help                Get help.\n"
@@ -46,10 +46,24 @@ const char usage_[] =
 "    -R, --rest-port           Set TCP port of the rest service (default 9191).\n"
 "    -f, --strict              Force strict communication patterns.\n"
 "    -T, --use-tcp             Interface argument is a TCP service address.\n"
+"    -z, --compact-tcp         Ask the TCP service for the compact format.\n"
+"    -F, --can-fd              Enable CAN FD frames.\n"
+"    -t, --pdo-thread-priority Receive PDOs on a thread with this real-time\n"
+"                              priority (1-99, default 0: disabled).\n"
+"    -M, --shm-ring            Share received frames with local tools, such\n"
+"                              as canopen-dump -M, through a ring of this\n"
+"                              many frames in shared memory (default 0).\n"
 "    -n, --range               Set node id range (inclusive) to be managed.\n"
 "    -p, --heartbeat-period    Set heartbeat period (default 10000ms).\n"
 "    -P, --heartbeat-timeout   Set heartbeat timeout (default 1000ms).\n"
 "    -x, --ntimeouts-max       Set maximum number of timeouts (default 2).\n"
+"\n"
+"Several interfaces may be given to have one process manage all of them.\n"
+"The SDO REST service is then available at /<interface>/sdo/ for each\n"
+"interface, and /sdo/ addresses the first one.\n"
+"\n"
+"Send SIGUSR2 to hand the buses over to a new process, started by the same\n"
+"path, which takes them up without resetting or restarting the nodes.\n"
 "\n";
 
 #ifndef NO_MAREL_CODE
@@ -67,6 +81,7 @@ const char appbase_usage_[] =
 "    $ canopen-master can0 -i0\n"
 "    $ canopen-master can1 -i1 -R9192\n"
 "    $ canopen-master can0 -n65-127\n"
+"    $ canopen-master can0 can1 can2 can3\n"
 "\n";
 #endif /* NO_MAREL_CODE */
 
@@ -137,6 +152,10 @@ int main(int argc, char* argv[])
 		{ "rest-port",         required_argument, 0, 'R' },
 		{ "strict",            no_argument,       0, 'f' },
 		{ "use-tcp",           no_argument,       0, 'T' },
+		{ "compact-tcp",       no_argument,       0, 'z' },
+		{ "can-fd",            no_argument,       0, 'F' },
+		{ "pdo-thread-priority", required_argument, 0, 't' },
+		{ "shm-ring",          required_argument, 0, 'M' },
 		{ "range",             required_argument, 0, 'n' },
 		{ "heartbeat-period",  required_argument, 0, 'p' },
 		{ "heartbeat-timeout", required_argument, 0, 'P' },
@@ -145,7 +164,7 @@ int main(int argc, char* argv[])
 	};
 
 	while (1) {
-		int c = getopt_long(argc, argv, "W:s:j:S:R:fTn:p:P:x:",
+		int c = getopt_long(argc, argv, "W:s:j:S:R:fTzFt:M:n:p:P:x:",
 				    long_options, NULL);
 		if (c < 0)
 			break;
@@ -166,6 +185,13 @@ int main(int argc, char* argv[])
 		case 'R': cfg.rest_port = atoi(optarg); break;
 		case 'f': cfg.be_strict = 1; break;
 		case 'T': cfg.use_tcp = 1; break;
+		case 'z': cfg.compact_tcp = 1; break;
+		case 'F': cfg.enable_can_fd = 1; break;
+		case 't': cfg.pdo_thread_priority = strtoul(optarg, NULL, 0);
+			  if (cfg.pdo_thread_priority > 99)
+				  return print_usage(stderr, 1);
+			  break;
+		case 'M': cfg.shm_ring_size = strtoul(optarg, NULL, 0); break;
 		case 'n': if (parse_range(optarg) < 0)
 				  return print_usage(stderr, 1);
 			  break;
@@ -181,7 +207,13 @@ int main(int argc, char* argv[])
 	if (nargs < 1)
 		return print_usage(stderr, 1);
 
-	strlcpy(cfg.iface, args[0], sizeof(cfg.iface));
+	size_t len = 0;
+	for (int i = 0; i < nargs; ++i) {
+		len += snprintf(cfg.iface + len, sizeof(cfg.iface) - len,
+				"%s%s", i > 0 ? "," : "", args[i]);
+		if (len >= sizeof(cfg.iface))
+			return print_usage(stderr, 1);
+	}
 
 	int r = co_master_run();
 
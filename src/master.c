@@ -20,8 +20,12 @@
 #include <stddef.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include "plog.h"
 
@@ -31,6 +35,7 @@
 #include "canopen/sdo.h"
 #include "canopen/sdo_req.h"
 #include "canopen/network.h"
+#include "canopen/lss.h"
 #include "canopen/nmt.h"
 #include "canopen/heartbeat.h"
 #include "canopen/emcy.h"
@@ -38,15 +43,34 @@
 #include "canopen/master.h"
 #include "canopen/sdo_sync.h"
 #include "canopen/error.h"
+#include "canopen/cob_table.h"
+#include "canopen/pdo-map.h"
+#include "canopen/sync-producer.h"
+#include "canopen/sync-cycle.h"
 #include "rest.h"
 #include "sdo-rest.h"
+#include "sdo-gateway.h"
+#include "sdo-poll.h"
+#include "mem-tag.h"
+#include "event-rest.h"
+#include "trace-rest.h"
+#include "async-log.h"
+#include "driver-registry.h"
+#include "driver-exec.h"
 #include "time-utils.h"
 #include "profiling.h"
+#include "event-trace.h"
 #include "string-utils.h"
 #include "net-util.h"
 #include "sock.h"
 #include "cfg.h"
 #include "trace-buffer.h"
+#include "trace-filter.h"
+#include "trace-record.h"
+#include "reactor.h"
+#include "rt-thread.h"
+#include "node-identity.h"
+#include "handoff.h"
 
 #ifndef NO_MAREL_CODE
 #include <appcbase.h>
@@ -62,6 +86,32 @@
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 
+/* Maximum number of frames read from the bus per system call */
+#define MUX_BATCH_SIZE 32
+#define PDO_THREAD_RING_SIZE 1024
+
+/* Number of frames that can be staged for transmission during one main loop
+ * iteration before the queue is flushed early.
+ */
+#define MASTER_TXQ_SIZE 128
+
+/* How long to wait for a TCP service to agree on the compact format, in ms */
+#define MASTER_HELLO_TIMEOUT 1000
+
+/* How long a new process waits for the one that hands over to it to let go of
+ * everything, in ms
+ */
+#define HANDOFF_CLOSE_TIMEOUT 10000
+
+/* Trace dumps are written before anything that has no deadline when the loops
+ * schedule by deadline, so that the traces of an incident are not overwritten
+ * while they are waiting behind slow requests.
+ */
+#define TRACE_DUMP_DEADLINE 100000000ULL /* ns */
+
+/* The slowest nodes of each boot-up are logged with what held them up */
+#define BOOTUP_N_LOGGED 5
+
 #define for_each_node(index) \
 	for(index = nodeid_min(); index <= nodeid_max(); ++index)
 
@@ -70,42 +120,39 @@
 
 size_t strlcpy(char* dst, const char* src, size_t dsize);
 
-static struct sock socket_ = { .fd = -1 };
-static char nodes_seen_[CANOPEN_NODEID_MAX + 1];
-static char nodes_seen_late_[CANOPEN_NODEID_MAX + 1];
-/* Note: nodes_seen_[0] is unused */
-
-static unsigned int n_scheduled_bootups = 0;
-static unsigned int n_inhibited_starts = 0;
-
-enum master_state {
-	MASTER_STATE_STARTUP = 0,
-	MASTER_STATE_RUNNING,
-	MASTER_STATE_STOPPING,
-};
-
-static enum master_state master_state_ = MASTER_STATE_STARTUP;
-
 static void* driver_manager_;
 pthread_mutex_t driver_manager_lock_ = PTHREAD_MUTEX_INITIALIZER;
 
 static struct mloop* mloop_ = NULL;
-static struct mloop_socket* mux_handler_ = NULL;
 
-static struct tracebuffer tracebuffer_;
+/* Set when this process has handed the buses over to a new one, which is
+ * told that it has all of them when the socket is closed.
+ */
+static int is_handed_over_ = 0;
+static int handoff_sock_ = -1;
+
+static enum tb_format trace_dump_format_ = TB_FORMAT_RAW;
 
 static void* master_iface_init(int nodeid);
 static int master_request_sdo(int nodeid, int index, int subindex);
 static int master_send_sdo(int nodeid, int index, int subindex,
-			   unsigned char* data, size_t size);
-static int master_send_pdo(int nodeid, int n, unsigned char* data, size_t size);
+			   const unsigned char* data, size_t size);
+static int master_send_pdo(int nodeid, int n, const unsigned char* data,
+			   size_t size);
 static void unload_legacy_module(int device_type, void* driver);
-static void on_bootup_done(struct mloop_work* self);
+static void on_drivers_loaded(struct co_bus* bus);
+static void setup_sdo_channels(struct co_master_node* node);
+static int start_identity_read(struct co_master_node* node);
+static void remove_sdo_channels(struct co_master_node* node);
 static int init_heartbeat_timer(struct co_master_node* node);
-static int init_ping_timer(struct co_master_node* node);
+static void arm_ping_timer(struct co_bus* bus);
+static void hand_over(void);
 
-struct co_master_node co_master_node_[CANOPEN_NODEID_MAX + 1];
-/* Note: node_[0] is unused */
+struct co_bus co_bus_[CO_MASTER_MAX_BUSES];
+int co_master_n_buses_ = 0;
+
+#define for_each_bus(bus) \
+	for(bus = co_bus_; bus < &co_bus_[co_master_n_buses_]; ++bus)
 
 static inline int nodeid_min(void)
 {
@@ -117,75 +164,207 @@ static inline int nodeid_max(void)
 	return cfg.range_stop == 0 ? CANOPEN_NODEID_MAX : cfg.range_stop;
 }
 
-static inline uint32_t get_device_type(int nodeid)
+struct co_bus* co_master_find_bus(const char* iface)
 {
-	return sdo_sync_read_u32(nodeid, 0x1000, 0);
+	struct co_bus* bus;
+	for_each_bus(bus)
+		if (strcmp(bus->iface, iface) == 0)
+			return bus;
+
+	return NULL;
 }
 
-static inline int node_has_identity(int nodeid)
+static const struct canopen_eds* lookup_eds(const struct node_info* info)
 {
-	return !!sdo_sync_read_u32(nodeid, 0x1018, 0);
+	const struct canopen_eds* eds;
+
+	if (info->vendor_id == 0)
+		return eds_db_find_by_name(info->name);
+
+	eds = eds_db_find(info->vendor_id, info->product_code,
+			  info->revision_number);
+	if (eds)
+		return eds;
+
+	return eds_db_find(info->vendor_id, info->product_code, -1);
 }
 
-static inline uint32_t get_vendor_id(int nodeid)
+static void make_node_info(struct node_info* dst,
+			   const struct co_master_node* node)
 {
-	return sdo_sync_read_u32(nodeid, 0x1018, 1);
+	memset(dst, 0, sizeof(*dst));
+
+	dst->driver_type = node->driver_type;
+	dst->is_initialized = node->is_initialized;
+	dst->device_type = node->device_type;
+	dst->vendor_id = node->vendor_id;
+	dst->product_code = node->product_code;
+	dst->revision_number = node->revision_number;
+	dst->serial_number = node->serial_number;
+	dst->eds = node->eds;
+	strlcpy(dst->name, node->name, sizeof(dst->name));
+	strlcpy(dst->hw_version, node->hw_version, sizeof(dst->hw_version));
+	strlcpy(dst->sw_version, node->sw_version, sizeof(dst->sw_version));
 }
 
-static inline uint32_t get_product_code(int nodeid)
+/* Called by whichever thread has just changed what is known of the node, so
+ * that the rest see all of the change at once
+ */
+static void publish_node_info(struct co_master_node* node)
 {
-	return sdo_sync_read_u32(nodeid, 0x1018, 2);
+	struct node_info info;
+	make_node_info(&info, node);
+	node_info_publish(&node->info, &info);
 }
 
-static inline uint32_t get_revision_number(int nodeid)
+uint64_t co_master_get_node_info(const struct co_master_node* node,
+				 struct node_info* dst)
 {
-	return sdo_sync_read_u32(nodeid, 0x1018, 3);
+	return node_info_read(&node->info, dst);
 }
 
-static inline int set_heartbeat_period(int nodeid, uint16_t period)
+const struct canopen_eds* co_master_find_eds(const struct co_master_node* node)
 {
-	struct sdo_req_info info = { .index = 0x1017, .subindex = 0 };
-	return sdo_sync_write_u16(nodeid, &info, period);
+	struct node_info info;
+	co_master_get_node_info(node, &info);
+	return info.eds ? info.eds : lookup_eds(&info);
+}
+
+/* The identity of a node is read as one batch of uploads, in this order */
+enum identity_item {
+	IDENTITY_DEVICE_TYPE,
+	IDENTITY_NAME,
+	IDENTITY_N_ENTRIES,
+	IDENTITY_VENDOR_ID,
+	IDENTITY_PRODUCT_CODE,
+	IDENTITY_REVISION_NUMBER,
+	IDENTITY_SERIAL_NUMBER,
+	IDENTITY_HW_VERSION,
+	IDENTITY_SW_VERSION,
+	IDENTITY_N_ITEMS
+};
+
+static const struct {
+	int index, subindex;
+} identity_objects_[IDENTITY_N_ITEMS] = {
+	[IDENTITY_DEVICE_TYPE] = { 0x1000, 0 },
+	[IDENTITY_NAME] = { 0x1008, 0 },
+	[IDENTITY_N_ENTRIES] = { 0x1018, 0 },
+	[IDENTITY_VENDOR_ID] = { 0x1018, 1 },
+	[IDENTITY_PRODUCT_CODE] = { 0x1018, 2 },
+	[IDENTITY_REVISION_NUMBER] = { 0x1018, 3 },
+	[IDENTITY_SERIAL_NUMBER] = { 0x1018, 4 },
+	[IDENTITY_HW_VERSION] = { 0x1009, 0 },
+	[IDENTITY_SW_VERSION] = { 0x100A, 0 },
+};
+
+static int add_identity_item(struct sdo_batch* batch, enum identity_item item)
+{
+	return sdo_batch_add_upload(batch, identity_objects_[item].index,
+				    identity_objects_[item].subindex);
 }
 
-static char* get_string(int nodeid, int index, int subindex)
+static int get_item_u32(uint32_t* dst, const struct sdo_batch* batch, size_t i)
 {
-	static __thread char buffer[256];
+	const struct sdo_batch_item* item = sdo_batch_get_item(batch, i);
 
-	struct sdo_req* req = sdo_sync_read(nodeid, index, subindex);
-	if (!req)
+	if (item->status != SDO_REQ_OK || item->data.index > sizeof(*dst))
+		return -1;
+
+	*dst = 0;
+	byteorder2(dst, item->data.data, sizeof(*dst), item->data.index);
+	return 0;
+}
+
+static inline uint32_t get_item_u32_or_0(const struct sdo_batch* batch,
+					 size_t i)
+{
+	uint32_t value = 0;
+	return get_item_u32(&value, batch, i) >= 0 ? value : 0;
+}
+
+/* Only called on the main loop */
+static char* get_item_string(const struct sdo_batch* batch, size_t i)
+{
+	static char buffer[256];
+
+	const struct sdo_batch_item* item = sdo_batch_get_item(batch, i);
+	if (item->status != SDO_REQ_OK)
 		return NULL;
 
-	memcpy(buffer, req->data.data, MIN(req->data.index, sizeof(buffer)));
-	buffer[MIN(req->data.index, sizeof(buffer) - 1)] = '\0';
+	memcpy(buffer, item->data.data, MIN(item->data.index, sizeof(buffer)));
+	buffer[MIN(item->data.index, sizeof(buffer) - 1)] = '\0';
 
-	sdo_req_unref(req);
 	return buffer;
 }
 
-static void stop_heartbeat_timer(int nodeid)
+static inline int set_heartbeat_period(struct co_master_node* node,
+				       uint16_t period)
+{
+	struct sdo_req_info info = { .index = 0x1017, .subindex = 0 };
+	return sdo_sync_write_u16(co_master_get_sdo_queue(node), &info,
+				  period);
+}
+
+static void stop_heartbeat_timer(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	node->bus->heartbeat_deadline[node->nodeid] = 0;
+
 	struct mloop_timer* timer = node->heartbeat_timer;
+	if (!timer)
+		return;
+
 	mloop_timer_stop(timer);
 	mloop_timer_unref(timer);
 	node->heartbeat_timer = NULL;
 }
 
-static void stop_ping_timer(int nodeid)
+static void stop_ping_timer(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	struct mloop_timer* timer = node->ping_timer;
-	mloop_timer_stop(timer);
-	mloop_timer_unref(timer);
-	node->ping_timer = NULL;
+	if (node->next_ping == 0)
+		return;
+
+	node->next_ping = 0;
+	arm_ping_timer(node->bus);
+}
+
+static inline struct bootup_timeline*
+get_bootup_timeline(struct co_master_node* node)
+{
+	return &node->bus->bootup[co_master_get_node_id(node)];
 }
 
 #ifndef NO_MAREL_CODE
-static void unload_legacy_driver(int nodeid)
+/* The info structure and the legacy driver interface only know about node
+ * ids, so they only cover the first bus. An update that is begun must be
+ * ended with canopen_info_end_update().
+ */
+static struct canopen_info* begin_info_update(const struct co_master_node* node)
+{
+	return node->bus->index == 0 ? canopen_info_begin_update(node->nodeid)
+				     : NULL;
+}
+
+static void copy_info_stats(struct canopen_info* info,
+			    const struct node_stats* stats)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	struct node_stats s;
+	node_stats_read(&s, stats);
+
+	const struct node_stats_histogram* latency = &s.sdo_latency;
+
+	info->rx_frames = s.n_frames;
+	info->rx_pdos = s.n_pdos;
+	info->sdo_transfers = s.n_sdo_transfers;
+	info->sdo_aborts = s.n_sdo_aborts;
+	info->sdo_timeouts = s.n_sdo_timeouts;
+	info->sdo_latency_avg_us = latency->count > 0
+				 ? latency->total_us / latency->count : 0;
+	info->heartbeat_jitter_max_us = s.heartbeat_jitter.max_us;
+}
 
+static void unload_legacy_driver(struct co_master_node* node)
+{
 	unload_legacy_module(node->device_type, node->driver);
 
 	legacy_master_iface_delete(node->master_iface);
@@ -201,9 +380,9 @@ static void unload_legacy_driver(int nodeid)
  * The sdo_req interface is not used for this because we're not interested in
  * the response and it would require more complicated code.
  */
-static void turn_off_heartbeat(int nodeid)
+static void turn_off_heartbeat(struct co_master_node* node)
 {
-	struct can_frame cf = { .can_id = R_RSDO + nodeid };
+	struct can_frame cf = { .can_id = R_RSDO + node->nodeid };
 	sdo_set_cs(&cf, SDO_CCS_DL_INIT_REQ);
 	sdo_set_index(&cf, 0x1017);
 	sdo_set_subindex(&cf, 0);
@@ -211,40 +390,69 @@ static void turn_off_heartbeat(int nodeid)
 	sdo_expediate(&cf);
 	sdo_set_expediated_size(&cf, sizeof(uint16_t));
 	cf.can_dlc = SDO_EXPEDIATED_DATA_IDX + sizeof(uint16_t);
-	sock_send(&socket_, &cf, 0);
+	sock_send(&node->bus->socket, &cf, 0);
 }
 
-static void stop_node_guarding(int nodeid)
+static void stop_node_guarding(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-
-	if (!cfg.node[nodeid].enable_node_guarding)
+	if (!node->cfg.enable_node_guarding)
 		return;
 
-	stop_heartbeat_timer(nodeid);
+	stop_heartbeat_timer(node);
 
 	if (!node->is_heartbeat_supported)
-		stop_ping_timer(nodeid);
+		stop_ping_timer(node);
 }
 
-static void unload_driver(int nodeid)
+static void drop_sync_rpdos(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	struct co_bus* bus = node->bus;
+
+	pthread_mutex_lock(&bus->sync_lock);
+	memset(node->is_sync_rpdo_latched, 0,
+	       sizeof(node->is_sync_rpdo_latched));
+	pthread_mutex_unlock(&bus->sync_lock);
+}
+
+/* Wait for the PDO thread to leave any handler that it might be running */
+static void mux_quiesce(struct co_bus* bus)
+{
+	if (!bus->is_rx_forwarded)
+		return;
+
+	pthread_mutex_lock(&bus->pdo_lock);
+	pthread_mutex_unlock(&bus->pdo_lock);
+}
+
+static void unload_driver(struct co_master_node* node)
+{
+	struct co_bus* bus = node->bus;
 
 	node->is_initialized = 0;
+	co__mux_update(node);
+	mux_quiesce(bus);
+
+	if (node->exec) {
+		drv_exec_flush(node->exec);
+		node->exec = NULL;
+	}
+
+	drop_sync_rpdos(node);
 
-	stop_node_guarding(nodeid);
+	stop_node_guarding(node);
 
-	sdo_req_queue_flush(sdo_req_queue_get(nodeid));
+	sdo_req_queue_flush(co_master_get_sdo_queue(node));
+	sdo_req_queue_clear_cache(co_master_get_sdo_queue(node));
+	remove_sdo_channels(node);
 
 	switch (node->driver_type) {
 #ifndef NO_MAREL_CODE
 	case CO_MASTER_DRIVER_LEGACY:
-		unload_legacy_driver(nodeid);
+		unload_legacy_driver(node);
 		break;
 #endif /* NO_MAREL_CODE */
 	case CO_MASTER_DRIVER_NEW:
-		co_drv_unload(&node->ndrv);
+		co_drv_unload(node->ndrv);
 		break;
 	case CO_MASTER_DRIVER_NONE:
 	default:
@@ -255,13 +463,19 @@ static void unload_driver(int nodeid)
 	node->device_type = 0;
 	node->is_heartbeat_supported = 0;
 	node->driver_type = CO_MASTER_DRIVER_NONE;
+	node->eds = NULL;
+	publish_node_info(node);
 
-	if (master_state_ == MASTER_STATE_STOPPING)
-		co_net_send_nmt(&socket_, NMT_CS_STOP, nodeid);
+	/* The nodes of a bus that was handed over are left running */
+	if (bus->state == CO_BUS_STATE_STOPPING && !is_handed_over_)
+		co_net_send_nmt(&bus->socket, NMT_CS_STOP, node->nodeid);
 
 #ifndef NO_MAREL_CODE
-	struct canopen_info* info = canopen_info_get(nodeid);
-	info->is_active = 0;
+	struct canopen_info* info = begin_info_update(node);
+	if (info) {
+		info->is_active = 0;
+		canopen_info_end_update(info);
+	}
 #endif /* NO_MAREL_CODE */
 }
 
@@ -277,44 +491,107 @@ static char* compose_trace_name(char* dst, size_t size)
 	return dst;
 }
 
-static void compose_trace_buffer_path(char* path, size_t size, const char* name)
+/* The interface name is added to the file name when there is more than one
+ * bus.
+ */
+static void compose_trace_buffer_path(char* path, size_t size,
+				      const struct co_bus* bus,
+				      const char* name)
 {
-	char ts[32];
+	const char* extension = tb_format_extension(trace_dump_format_);
 
-	if (!name)
-		name = compose_trace_name(ts, sizeof(ts));
+	if (co_master_n_buses_ > 1)
+		snprintf(path, size, "%s/%s-%s%s", cfg.trace_dump_path,
+			 name, bus->iface, extension);
+	else
+		snprintf(path, size, "%s/%s%s", cfg.trace_dump_path, name,
+			 extension);
 
-	snprintf(path, size, "%s/%s.trace", cfg.trace_dump_path, name);
 	path[size - 1] = '\0';
 }
 
-static void do_dump_tracebuffer(struct mloop_work* work)
+static void dump_bus_tracebuffer(struct co_bus* bus, const char* name)
 {
-	assert(cfg.trace_buffer_size > 0);
-
-	const char* name = mloop_work_get_context(work);
-
 	char path[256];
-	compose_trace_buffer_path(path, sizeof(path), name);
+	compose_trace_buffer_path(path, sizeof(path), bus, name);
 
-	FILE* stream = fopen(path, "w");
+	FILE* stream = fopen(path, "we");
 	if (!stream)
 		return;
 
-	tb_dump(&tracebuffer_, stream);
+	tb_dump_as(&bus->tracebuffer, stream, trace_dump_format_, bus->iface);
 
 	fclose(stream);
 }
 
+/* All buses are dumped together so that their traces can be correlated.
+ * Mapped trace buffers already are files, so incident dumps only need to get
+ * them onto the disk.
+ */
+static void dump_all_tracebuffers(const char* name)
+{
+	assert(cfg.trace_buffer_size > 0);
+
+	struct co_bus* bus;
+
+	if (!name && cfg.enable_mapped_trace) {
+		for_each_bus(bus)
+			if (tb_sync(&bus->tracebuffer) < 0)
+				plog(LOG_ERROR, "%s: Could not sync trace buffer: %m",
+				     bus->iface);
+		return;
+	}
+
+	char ts[32];
+	if (!name)
+		name = compose_trace_name(ts, sizeof(ts));
+
+	for_each_bus(bus)
+		dump_bus_tracebuffer(bus, name);
+}
+
+static void do_dump_tracebuffer(struct mloop_work* work)
+{
+	dump_all_tracebuffers(mloop_work_get_context(work));
+}
+
+static void on_dump_tracebuffer(struct mloop_async* async)
+{
+	dump_all_tracebuffers(mloop_async_get_context(async));
+}
+
 static void dump_tracebuffer(const char* name)
 {
 	if (cfg.trace_buffer_size == 0)
 		return;
 
+	uint64_t deadline = gettime_us(CLOCK_MONOTONIC) * 1000ULL
+			  + TRACE_DUMP_DEADLINE;
+
+	/* A trace reactor keeps the slow file writes off the worker threads */
+	if (!reactor_is_default(REACTOR_TRACE)) {
+		struct mloop_async* async =
+			mloop_async_new(reactor_get(REACTOR_TRACE));
+		if (!async)
+			return;
+
+		char* str = name ? strdup(name) : NULL;
+		if (str)
+			mloop_async_set_context(async, str, free);
+
+		mloop_async_set_callback(async, on_dump_tracebuffer);
+		mloop_async_set_deadline(async, deadline);
+		mloop_async_start(async);
+		mloop_async_unref(async);
+		return;
+	}
+
 	struct mloop_work* work = mloop_work_new(mloop_default());
 	if (!work)
 		return;
 
+	mloop_work_set_deadline(work, deadline);
+
 	if (name) {
 		char* str = strdup(name);
 		if (str)
@@ -326,32 +603,104 @@ static void dump_tracebuffer(const char* name)
 	mloop_work_unref(work);
 }
 
-static void on_heartbeat_timeout(struct mloop_timer* timer)
+static void handle_heartbeat_timeout(struct co_master_node* node)
 {
-	struct co_master_node* node = mloop_timer_get_context(timer);
 	int nodeid = co_master_get_node_id(node);
 
 	node->ntimeouts++;
 
 #ifndef NO_MAREL_CODE
-	struct canopen_info* info = canopen_info_get(nodeid);
-	info->skipped_heartbeats++;
+	struct canopen_info* info = begin_info_update(node);
+	if (info) {
+		info->skipped_heartbeats++;
+		canopen_info_end_update(info);
+	}
 #endif /* NO_MAREL_CODE */
 
-	plog(LOG_DEBUG, "Node \"%s\" with id %d has missed %u heartbeats",
-	     node->name, nodeid, node->ntimeouts);
+	alog(LOG_DEBUG, "Node \"%s\" with id %d on %s has missed %u heartbeats",
+	     node->name, nodeid, node->bus->iface, node->ntimeouts);
 
-	if (node->ntimeouts <= cfg.node[nodeid].n_timeouts_max)
+	if (node->ntimeouts <= node->cfg.n_timeouts_max)
 		return;
 
-	plog(LOG_NOTICE, "Node \"%s\" with id %d has timed out; unloading...",
-	     node->name, nodeid);
+	alog(LOG_NOTICE, "Node \"%s\" with id %d on %s has timed out; unloading...",
+	     node->name, nodeid, node->bus->iface);
 
 	if (cfg.enable_incident_trace)
 		dump_tracebuffer(NULL);
 
-	co_net_send_nmt(&socket_, NMT_CS_RESET_NODE, nodeid);
-	unload_driver(co_master_get_node_id(node));
+	event_rest_publish_state(node, "timed-out");
+
+	co_net_send_nmt(&node->bus->socket, NMT_CS_RESET_NODE, nodeid);
+	unload_driver(node);
+}
+
+static void on_heartbeat_timeout(struct mloop_timer* timer)
+{
+	handle_heartbeat_timeout(mloop_timer_get_context(timer));
+}
+
+static inline uint64_t get_heartbeat_deadline_period(const struct co_master_node* node)
+{
+	return (node->cfg.heartbeat_period + node->cfg.heartbeat_timeout)
+		* 1000ULL;
+}
+
+/* The deadlines run like the timers would: a node times out once, or once
+ * every period if it may time out more than once.
+ */
+static void on_heartbeat_scan(struct mloop_timer* timer)
+{
+	struct co_bus* bus = mloop_timer_get_context(timer);
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	int i;
+
+	for_each_node(i) {
+		uint64_t deadline = bus->heartbeat_deadline[i];
+		if (deadline == 0 || now < deadline)
+			continue;
+
+		struct co_master_node* node = co_bus_get_node(bus, i);
+
+		bus->heartbeat_deadline[i] = node->cfg.n_timeouts_max > 0
+			? deadline + get_heartbeat_deadline_period(node) : 0;
+
+		handle_heartbeat_timeout(node);
+	}
+}
+
+static int start_heartbeat_scanner(struct co_bus* bus)
+{
+	if (bus->heartbeat_scanner)
+		return 0;
+
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		return -1;
+
+	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_context(timer, bus, NULL);
+	mloop_timer_set_time(timer, cfg.heartbeat_scan_interval * 1000000ULL);
+	mloop_timer_set_callback(timer, on_heartbeat_scan);
+
+	if (mloop_timer_start(timer) < 0) {
+		mloop_timer_unref(timer);
+		return -1;
+	}
+
+	bus->heartbeat_scanner = timer;
+	return 0;
+}
+
+static void stop_heartbeat_scanner(struct co_bus* bus)
+{
+	struct mloop_timer* timer = bus->heartbeat_scanner;
+	if (!timer)
+		return;
+
+	mloop_timer_stop(timer);
+	mloop_timer_unref(timer);
+	bus->heartbeat_scanner = NULL;
 }
 
 static struct mloop_timer* get_heartbeat_timer(struct co_master_node* node)
@@ -362,29 +711,37 @@ static struct mloop_timer* get_heartbeat_timer(struct co_master_node* node)
 	return node->heartbeat_timer;
 }
 
-static struct mloop_timer* get_ping_timer(struct co_master_node* node)
+static int start_heartbeat_timer(struct co_master_node* node)
 {
-	if (!node->ping_timer)
-		init_ping_timer(node);
+	node->ntimeouts = 0;
 
-	return node->ping_timer;
-}
+	if (cfg.heartbeat_scan_interval > 0) {
+		node->bus->heartbeat_deadline[node->nodeid] =
+			gettime_us(CLOCK_MONOTONIC)
+			+ get_heartbeat_deadline_period(node);
+		return start_heartbeat_scanner(node->bus);
+	}
 
-static int start_heartbeat_timer(int nodeid)
-{
-	struct co_master_node* node = co_master_get_node(nodeid);
 	struct mloop_timer* timer = get_heartbeat_timer(node);
-	node->ntimeouts = 0;
 	return mloop_timer_start(timer);
 }
 
-static int restart_heartbeat_timer(int nodeid)
+/* This is called for every heartbeat. Moving a deadline takes no system call,
+ * unlike re-arming the timer.
+ */
+static int restart_heartbeat_timer(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	uint64_t* deadline = &node->bus->heartbeat_deadline[node->nodeid];
+	if (*deadline != 0) {
+		*deadline = gettime_us(CLOCK_MONOTONIC)
+			  + get_heartbeat_deadline_period(node);
+		return 0;
+	}
+
 	struct mloop_timer* timer = node->heartbeat_timer;
-	assert(timer);
 
-	if (!cfg.node[nodeid].enable_node_guarding)
+	/* There is no timer while a new configuration is being applied */
+	if (!node->cfg.enable_node_guarding || !timer)
 		return 0;
 
 	mloop_timer_stop(timer);
@@ -392,9 +749,8 @@ static int restart_heartbeat_timer(int nodeid)
 	return mloop_timer_start(timer);
 }
 
-static void on_ping_timeout(struct mloop_timer* timer)
+static void send_ping(struct co_master_node* node)
 {
-	struct co_master_node* node = mloop_timer_get_context(timer);
 	int nodeid = co_master_get_node_id(node);
 
 	struct can_frame cf = { 0 };
@@ -404,27 +760,160 @@ static void on_ping_timeout(struct mloop_timer* timer)
 	cf.can_dlc = 1;
 	heartbeat_set_state(&cf, 1);
 
-	sock_send(&socket_, &cf, 0);
+	sock_send(&node->bus->socket, &cf, 0);
 }
 
-static int start_ping_timer(int nodeid)
+static inline uint64_t get_ping_period(const struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	struct mloop_timer* timer = get_ping_timer(node);
-	return mloop_timer_start(timer);
+	return node->cfg.heartbeat_period * 1000ULL;
+}
+
+/* One timer sends the pings of a bus. It is set for the earliest ping due,
+ * and stopped when there are none.
+ */
+static void arm_ping_timer(struct co_bus* bus)
+{
+	struct mloop_timer* timer = bus->ping_timer;
+	if (!timer)
+		return;
+
+	uint64_t next = 0;
+	int i;
+
+	for_each_node(i) {
+		uint64_t t = co_bus_get_node(bus, i)->next_ping;
+		if (t != 0 && (next == 0 || t < next))
+			next = t;
+	}
+
+	mloop_timer_stop(timer);
+
+	if (next == 0)
+		return;
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	uint64_t delay = next > now ? next - now : 1;
+
+	mloop_timer_set_time(timer, delay * 1000ULL);
+	mloop_timer_start(timer);
+}
+
+static void on_ping_timeout(struct mloop_timer* timer)
+{
+	struct co_bus* bus = mloop_timer_get_context(timer);
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	int i;
+
+	for_each_node(i) {
+		struct co_master_node* node = co_bus_get_node(bus, i);
+		if (node->next_ping == 0 || node->next_ping > now)
+			continue;
+
+		send_ping(node);
+
+		/* Pings that were missed are skipped to keep the phase */
+		uint64_t period = get_ping_period(node);
+		while (node->next_ping <= now)
+			node->next_ping += period;
+	}
+
+	arm_ping_timer(bus);
+}
+
+static int init_ping_timer(struct co_bus* bus)
+{
+	if (bus->ping_timer)
+		return 0;
+
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		return -1;
+
+	mloop_timer_set_context(timer, bus, NULL);
+	mloop_timer_set_callback(timer, on_ping_timeout);
+	bus->ping_timer = timer;
+
+	return 0;
+}
+
+static void destroy_ping_timer(struct co_bus* bus)
+{
+	struct mloop_timer* timer = bus->ping_timer;
+	if (!timer)
+		return;
+
+	mloop_timer_stop(timer);
+	mloop_timer_unref(timer);
+	bus->ping_timer = NULL;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+/* A node is given the phase in the middle of the largest gap between those of
+ * the nodes that are pinged already, so that the pings are spread over the
+ * period without moving any of the others.
+ */
+static uint64_t get_first_ping(const struct co_master_node* node,
+			       uint64_t now)
+{
+	struct co_bus* bus = node->bus;
+	uint64_t period = get_ping_period(node);
+	uint64_t phases[CANOPEN_NODEID_MAX + 1];
+	size_t n = 0;
+	int i;
+
+	for_each_node(i) {
+		uint64_t t = co_bus_get_node(bus, i)->next_ping;
+		if (t != 0 && i != node->nodeid)
+			phases[n++] = t % period;
+	}
+
+	if (n == 0)
+		return now + period;
+
+	qsort(phases, n, sizeof(phases[0]), compare_u64);
+
+	uint64_t gap_start = phases[n - 1];
+	uint64_t gap = phases[0] + period - phases[n - 1];
+
+	for (size_t j = 1; j < n; ++j)
+		if (phases[j] - phases[j - 1] > gap) {
+			gap_start = phases[j - 1];
+			gap = phases[j] - phases[j - 1];
+		}
+
+	uint64_t phase = (gap_start + gap / 2) % period;
+	uint64_t next = now - now % period + phase;
+
+	return next > now ? next : next + period;
 }
 
-static void start_nodeguarding(int nodeid)
+static int start_ping_timer(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	if (get_ping_period(node) == 0)
+		return 0;
+
+	if (init_ping_timer(node->bus) < 0)
+		return -1;
+
+	node->next_ping = get_first_ping(node, gettime_us(CLOCK_MONOTONIC));
+	arm_ping_timer(node->bus);
+	return 0;
+}
 
-	if (!cfg.node[nodeid].enable_node_guarding)
+static void start_nodeguarding(struct co_master_node* node)
+{
+	if (!node->cfg.enable_node_guarding)
 		return;
 
 	if (!node->is_heartbeat_supported)
-		start_ping_timer(nodeid);
+		start_ping_timer(node);
 
-	start_heartbeat_timer(nodeid);
+	start_heartbeat_timer(node);
 }
 
 #ifndef NO_MAREL_CODE
@@ -448,24 +937,20 @@ static void unload_legacy_module(int device_type, void* driver)
 }
 #endif /* NO_MAREL_CODE */
 
-static int load_profile_driver(int nodeid)
+static int load_profile_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-
 	char buffer[256];
 	unsigned int profile = co_master_get_device_profile(node);
 	snprintf(buffer, sizeof(buffer), "cia%u", profile);
 	buffer[sizeof(buffer) - 1] = '\0';
 
-	return co_drv_load(&node->ndrv, buffer);
+	return co_drv_load(node->ndrv, buffer);
 }
 
-static int load_new_driver(int nodeid)
+static int load_new_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-
-	if (co_drv_load(&node->ndrv, node->name) < 0)
-		if (load_profile_driver(nodeid) < 0)
+	if (co_drv_load(node->ndrv, node->name) < 0)
+		if (load_profile_driver(node) < 0)
 			return -1;
 
 	node->driver_type = CO_MASTER_DRIVER_NEW;
@@ -474,11 +959,12 @@ static int load_new_driver(int nodeid)
 }
 
 #ifndef NO_MAREL_CODE
-static int load_legacy_driver(int nodeid)
+static int load_legacy_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	if (node->bus->index != 0)
+		return -1;
 
-	void* master_iface = master_iface_init(nodeid);
+	void* master_iface = master_iface_init(node->nodeid);
 	if (!master_iface)
 		return -1;
 
@@ -506,27 +992,37 @@ static int is_nodename_char(int c)
 }
 
 #ifndef NO_MAREL_CODE
-static void initialize_info_structure(int nodeid)
+static void initialize_info_structure(struct co_master_node* node)
 {
-	struct canopen_info* info = canopen_info_get(nodeid);
-	struct co_master_node* node = co_master_get_node(nodeid);
+	struct canopen_info* info = begin_info_update(node);
+	if (!info)
+		return;
 
 	info->device_type = node->device_type;
 	strlcpy(info->name, node->name, sizeof(info->name));
 	strlcpy(info->hw_version, node->hw_version, sizeof(info->hw_version));
 	strlcpy(info->sw_version, node->sw_version, sizeof(info->sw_version));
+
+	canopen_info_end_update(info);
 }
 
-static void load_error_register(int nodeid)
+static void load_error_register(struct co_master_node* node)
 {
-	struct canopen_info* info = canopen_info_get(nodeid);
+	if (node->bus->index != 0)
+		return;
 
+	/* The entry is not held while the node is asked */
 	errno = 0;
-	info->error_register = sdo_sync_read_u8(nodeid, 0x1001, 0);
-	if (info->error_register == 0 && errno != 0) {
+	uint32_t error_register =
+		sdo_sync_read_u8(co_master_get_sdo_queue(node), 0x1001, 0);
+	if (error_register == 0 && errno != 0) {
 		plog(LOG_WARNING, "load_driver: Could not get/convert error register for node %d",
-		     nodeid);
+		     node->nodeid);
 	}
+
+	struct canopen_info* info = begin_info_update(node);
+	info->error_register = error_register;
+	canopen_info_end_update(info);
 }
 #endif /* NO_MAREL_CODE */
 
@@ -541,137 +1037,399 @@ static const char* driver_type_str(enum co_master_driver_type type)
 	return "UNKNOWN";
 }
 
-static void apply_quirks(struct co_master_node* node)
+static struct node_sdo_profile*
+find_sdo_profile(const struct co_master_node* node)
 {
-	int nodeid = co_master_get_node_id(node);
+	struct node_identity_cache* cache = node->bus->identities;
+	if (!cache)
+		return NULL;
 
-	struct sdo_req_queue* sdo_queue = sdo_req_queue_get(nodeid);
-	struct sdo_async* sdo_client = &sdo_queue->sdo_client;
+	return node_identity_find_profile(cache, node->vendor_id,
+					  node->product_code);
+}
 
-	if (cfg.node[nodeid].ignore_sdo_multiplexer)
-		sdo_client->quirks |= SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
-	else
-		sdo_client->quirks &= ~SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
+/* The multiplexers are judged over all channels of the node together */
+static void get_sdo_observations(struct sdo_async_seen* dst,
+				 struct co_master_node* node)
+{
+	struct sdo_req_queue* sdo_queue = co_master_get_sdo_queue(node);
 
-	if (cfg.node[nodeid].send_full_sdo_frame)
+	memset(dst, 0, sizeof(*dst));
+
+	for (size_t i = 0; i < sdo_queue->n_channels; ++i) {
+		const struct sdo_async_seen* seen =
+			&sdo_queue->sdo_client[i].seen;
+
+		dst->n_responses += seen->n_responses;
+		dst->n_timeouts += seen->n_timeouts;
+		dst->n_mux_mismatches += seen->n_mux_mismatches;
+		dst->n_mux_matches += seen->n_mux_matches;
+		dst->is_block_accepted |= seen->is_block_accepted;
+	}
+}
+
+/* Quirks are learned from the type of the node and from what its server has
+ * done since the boot-up started. They are added to those that are
+ * configured, unless the master is to be strict.
+ */
+static enum sdo_async_quirks_flags
+get_learned_quirks(struct co_master_node* node,
+		   const struct node_sdo_profile* profile)
+{
+	if (cfg.be_strict)
+		return SDO_ASYNC_QUIRK_NONE;
+
+	if (profile && profile->flags & NODE_SDO_MUX_MISMATCH)
+		return SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
+
+	struct sdo_async_seen seen;
+	get_sdo_observations(&seen, node);
+
+	return sdo_async_is_multiplexer_mixed_up(&seen)
+	     ? SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER : SDO_ASYNC_QUIRK_NONE;
+}
+
+static void apply_sdo_quirks(struct co_master_node* node,
+			     struct sdo_async* sdo_client,
+			     enum sdo_async_quirks_flags learned)
+{
+	if (node->cfg.ignore_sdo_multiplexer
+	 || learned & SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER)
+		sdo_client->quirks |= SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
+	else
+		sdo_client->quirks &= ~SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
+
+	if (node->cfg.send_full_sdo_frame)
 		sdo_client->quirks |= SDO_ASYNC_QUIRK_NEEDS_FULL_FRAME;
 	else
 		sdo_client->quirks &= ~SDO_ASYNC_QUIRK_NEEDS_FULL_FRAME;
+}
+
+/* Nothing of the type is known until the identity of the node is, so this
+ * is done again when it is.
+ */
+static void apply_quirks(struct co_master_node* node)
+{
+	struct sdo_req_queue* sdo_queue = co_master_get_sdo_queue(node);
+	const struct node_sdo_profile* profile = find_sdo_profile(node);
+	enum sdo_async_quirks_flags learned = get_learned_quirks(node, profile);
+
+	for (size_t i = 0; i < sdo_queue->n_channels; ++i) {
+		struct sdo_async* sdo_client = &sdo_queue->sdo_client[i];
+
+		apply_sdo_quirks(node, sdo_client, learned);
+
+		if (profile && profile->flags & NODE_SDO_NO_BLOCK)
+			sdo_client->is_block_unsupported = 1;
+	}
+
+	sdo_req_queue_set_timeout_range(sdo_queue, node->cfg.sdo_timeout_min,
+					node->cfg.sdo_timeout_max);
+
+	node->learned_n_sdo_channels = profile ? profile->n_channels : 0;
+
+	if (!profile)
+		return;
+
+	/* Timeouts start out from the round trips of the last time rather
+	 * than from the longest one allowed
+	 */
+	struct sdo_rtt* rtt = &sdo_queue->rtt;
+	if (rtt->n_samples == 0 && profile->srtt != 0) {
+		rtt->srtt = profile->srtt;
+		rtt->rttvar = profile->rttvar;
+		rtt->n_samples = 1;
+	}
+}
+
+static void forget_sdo_observations(struct co_master_node* node)
+{
+	struct sdo_req_queue* sdo_queue = co_master_get_sdo_queue(node);
+
+	for (size_t i = 0; i < sdo_queue->n_channels; ++i)
+		memset(&sdo_queue->sdo_client[i].seen, 0,
+		       sizeof(sdo_queue->sdo_client[i].seen));
+}
+
+/* Whether a and b differ by more than a quarter of the larger one */
+static int is_far_apart(uint32_t a, uint32_t b)
+{
+	uint32_t max = a > b ? a : b;
+	uint32_t diff = a > b ? a - b : b - a;
+	return diff > max / 4;
+}
+
+/* What the server of the node was seen to do during the boot-up is kept for
+ * its type. The settings mostly get more careful this way: a type that
+ * failed with a faster one is not tried with it again. The multiplexer is
+ * the exception, as letting through answers for the wrong object is not
+ * careful at all. It is only ignored for a type whose server got it wrong
+ * every time, and checked again once a boot-up shows that it gets it right.
+ */
+static void learn_sdo_profile(struct co_master_node* node)
+{
+	struct node_identity_cache* cache = node->bus->identities;
+	if (!cache || node->driver_type == CO_MASTER_DRIVER_NONE)
+		return;
+
+	struct node_sdo_profile* profile =
+		node_identity_get_profile(cache, node->vendor_id,
+					  node->product_code);
+	if (!profile)
+		return;
+
+	struct sdo_req_queue* sdo_queue = co_master_get_sdo_queue(node);
+	struct node_sdo_profile learned = *profile;
+	int is_block_refused = 0;
 
+	for (size_t i = 0; i < sdo_queue->n_channels; ++i) {
+		const struct sdo_async* sdo_client = &sdo_queue->sdo_client[i];
+		const struct sdo_async_seen* seen = &sdo_client->seen;
 
+		is_block_refused |= sdo_client->is_block_unsupported;
+
+		if (i > 0 && seen->n_timeouts > 0 && seen->n_responses == 0
+		 && (learned.n_channels == 0 || i < learned.n_channels))
+			learned.n_channels = i;
+	}
+
+	struct sdo_async_seen seen;
+	get_sdo_observations(&seen, node);
+
+	if (sdo_async_is_multiplexer_mixed_up(&seen) && !cfg.be_strict)
+		learned.flags |= NODE_SDO_MUX_MISMATCH;
+	else if (seen.n_mux_matches > 0 && seen.n_mux_mismatches == 0)
+		learned.flags &= ~NODE_SDO_MUX_MISMATCH;
+
+	if (is_block_refused && !seen.is_block_accepted)
+		learned.flags |= NODE_SDO_NO_BLOCK;
+
+	/* Small changes are not worth writing the file for */
+	const struct sdo_rtt* rtt = &sdo_queue->rtt;
+	if (rtt->n_samples > 0 && is_far_apart(learned.srtt, rtt->srtt)) {
+		learned.srtt = rtt->srtt;
+		learned.rttvar = rtt->rttvar;
+	}
+
+	forget_sdo_observations(node);
+
+	if (memcmp(profile, &learned, sizeof(learned)) == 0)
+		return;
+
+	if (learned.flags != profile->flags
+	 || learned.n_channels != profile->n_channels)
+		plog(LOG_INFO, "load_driver: Learned SDO settings of \"%s\" at id %d on %s: block transfers %s, %s multiplexers, %u channels",
+		     node->name, node->nodeid, node->bus->iface,
+		     learned.flags & NODE_SDO_NO_BLOCK ? "off" : "on",
+		     learned.flags & NODE_SDO_MUX_MISMATCH ? "ignoring"
+							  : "checking",
+		     learned.n_channels);
+
+	*profile = learned;
+	cache->is_dirty = 1;
 }
 
-static int load_any_driver(int nodeid)
+static int load_any_driver(struct co_master_node* node)
 {
-	if (load_new_driver(nodeid) >= 0)
+	if (load_new_driver(node) >= 0)
 		return 0;
 
 #ifndef NO_MAREL_CODE
-	if (load_legacy_driver(nodeid) >= 0)
+	if (load_legacy_driver(node) >= 0)
 		return 0;
 #endif /* NO_MAREL_CODE */
 
 	return -1;
 }
 
-static int load_driver(int nodeid)
+/* The identity of a node is taken from what was read the last time if one
+ * read of the identity object says that it is the same node. That is the
+ * serial number where the node has one, and the revision otherwise. Nodes
+ * without an identity object are always read in full.
+ */
+static const struct node_identity*
+get_known_identity(const struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
+	const struct node_identity_cache* cache = node->bus->identities;
+	if (!cache)
+		return NULL;
 
-	node->name[0] = '\0';
-	cfg_load_node(nodeid);
-	apply_quirks(node);
+	const struct node_identity* known = &cache->node[node->nodeid];
+	if (!known->is_known || known->vendor_id == 0)
+		return NULL;
 
-	if (node->driver_type != CO_MASTER_DRIVER_NONE) {
-		plog(LOG_ERROR, "load_driver: A driver is already loaded for node %d",
-		     nodeid);
+	return known;
+}
+
+static enum identity_item get_check_item(const struct node_identity* known)
+{
+	return known->serial_number != 0 ? IDENTITY_SERIAL_NUMBER
+					 : IDENTITY_REVISION_NUMBER;
+}
+
+static void take_identity(struct co_master_node* node,
+			  const struct node_identity* known)
+{
+	node->device_type = known->device_type;
+	node->vendor_id = known->vendor_id;
+	node->product_code = known->product_code;
+	node->revision_number = known->revision_number;
+	node->serial_number = known->serial_number;
+	strlcpy(node->name, known->name, sizeof(node->name));
+	strlcpy(node->hw_version, known->hw_version, sizeof(node->hw_version));
+	strlcpy(node->sw_version, known->sw_version, sizeof(node->sw_version));
+}
+
+static int recall_identity(struct co_master_node* node,
+			   const struct sdo_batch* batch)
+{
+	const struct node_identity* known = get_known_identity(node);
+	if (!known)
 		return -1;
-	}
 
-	errno = 0;
-	node->device_type = get_device_type(nodeid);
-	if (node->device_type == 0 && errno != 0) {
-		plog(LOG_WARNING, "load_driver: Could not get/convert device type for node %d",
-		     nodeid);
+	uint32_t value;
+	if (get_item_u32(&value, batch, 0) < 0)
+		return -1;
+
+	uint32_t expected = get_check_item(known) == IDENTITY_SERIAL_NUMBER
+			  ? known->serial_number : known->revision_number;
+	if (value != expected)
+		return -1;
+
+	take_identity(node, known);
+
+	plog(LOG_DEBUG, "load_driver: Node \"%s\" at id %d on %s is as it was",
+	     node->name, node->nodeid, node->bus->iface);
+	return 0;
+}
+
+static int read_name(struct co_master_node* node, const struct sdo_batch* batch)
+{
+	int nodeid = co_master_get_node_id(node);
+	const char* iface = node->bus->iface;
+
+	if (get_item_u32(&node->device_type, batch, IDENTITY_DEVICE_TYPE) < 0) {
+		plog(LOG_WARNING, "load_driver: Could not get/convert device type for node %d on %s",
+		     nodeid, iface);
 		return -1;
 	}
 
-	char* name = get_string(nodeid, 0x1008, 0);
+	char* name = get_item_string(batch, IDENTITY_NAME);
 	if (!name) {
-		plog(LOG_WARNING, "load_driver: Could not get name of node %d",
-		     nodeid);
+		plog(LOG_WARNING, "load_driver: Could not get name of node %d on %s",
+		     nodeid, iface);
 		return -1;
 	}
 
 	string_keep_if(is_nodename_char, name);
 	strlcpy(node->name, name, sizeof(node->name));
+	return 0;
+}
 
-	/* Reload config when we have the name of the node */
-	cfg_load_node(nodeid);
-	apply_quirks(node);
-
-	if (node_has_identity(nodeid)) {
-		node->vendor_id = get_vendor_id(nodeid);
-		node->product_code = get_product_code(nodeid);
-		node->revision_number = get_revision_number(nodeid);
+static void read_identity(struct co_master_node* node,
+			  const struct sdo_batch* batch)
+{
+	node->vendor_id = 0;
+	node->product_code = 0;
+	node->revision_number = 0;
+	node->serial_number = 0;
+
+	if (get_item_u32_or_0(batch, IDENTITY_N_ENTRIES) != 0) {
+		node->vendor_id = get_item_u32_or_0(batch, IDENTITY_VENDOR_ID);
+		node->product_code =
+			get_item_u32_or_0(batch, IDENTITY_PRODUCT_CODE);
+		node->revision_number =
+			get_item_u32_or_0(batch, IDENTITY_REVISION_NUMBER);
+		node->serial_number =
+			get_item_u32_or_0(batch, IDENTITY_SERIAL_NUMBER);
 	}
 
-	uint64_t heartbeat_period = cfg.node[nodeid].heartbeat_period;
-	if (cfg.node[nodeid].enable_node_guarding)
-		node->is_heartbeat_supported = set_heartbeat_period(nodeid, heartbeat_period) >= 0;
-
-	char* hw_version = get_string(nodeid, 0x1009, 0);
+	char* hw_version = get_item_string(batch, IDENTITY_HW_VERSION);
 	if (!hw_version)
 		hw_version = "";
 
 	strlcpy(node->hw_version, string_trim(hw_version),
 		sizeof(node->hw_version));
 
-	char* sw_version = get_string(nodeid, 0x100A, 0);
+	char* sw_version = get_item_string(batch, IDENTITY_SW_VERSION);
 	if (!sw_version)
 		sw_version = "";
 
 	strlcpy(node->sw_version, string_trim(sw_version),
 		sizeof(node->sw_version));
+}
+
+/* This is what is left of loading a driver when the identity of the node is
+ * known. It runs on a worker because the EDS may have to be read, the driver
+ * opened, and the SDO writes made by the drivers are synchronous.
+ */
+static int load_driver(struct co_master_node* node)
+{
+	int nodeid = co_master_get_node_id(node);
+	const char* iface = node->bus->iface;
+
+	if (node->driver_type != CO_MASTER_DRIVER_NONE) {
+		plog(LOG_ERROR, "load_driver: A driver is already loaded for node %d on %s",
+		     nodeid, iface);
+		return -1;
+	}
+
+	struct bootup_timeline* bootup = get_bootup_timeline(node);
+
+	struct node_info info;
+	make_node_info(&info, node);
+	node->eds = lookup_eds(&info);
+	publish_node_info(node);
+	bootup_timeline_mark(bootup, BOOTUP_EDS_FOUND);
+
+	uint64_t heartbeat_period = node->cfg.heartbeat_period;
+	if (node->cfg.enable_node_guarding)
+		node->is_heartbeat_supported = set_heartbeat_period(node, heartbeat_period) >= 0;
 
 #ifndef NO_MAREL_CODE
-	initialize_info_structure(nodeid);
+	initialize_info_structure(node);
 
-	load_error_register(nodeid);
+	load_error_register(node);
 #endif /* NO_MAREL_CODE */
 
-	if (load_any_driver(nodeid) < 0) {
+	setup_sdo_channels(node);
+	bootup_timeline_mark(bootup, BOOTUP_CONFIGURED);
+
+	if (load_any_driver(node) < 0) {
 		if (node->is_heartbeat_supported)
-			turn_off_heartbeat(nodeid);
+			turn_off_heartbeat(node);
 
-		co_net_send_nmt(&socket_, NMT_CS_STOP, nodeid);
-		plog(LOG_NOTICE, "load_driver: There is no driver available for \"%s\" at id %d",
-		     node->name, nodeid);
+		co_net_send_nmt(&node->bus->socket, NMT_CS_STOP, nodeid);
+		plog(LOG_NOTICE, "load_driver: There is no driver available for \"%s\" at id %d on %s",
+		     node->name, nodeid, iface);
 		return -1;
 	}
 
-	plog(LOG_DEBUG, "load_driver: Successfully loaded %s for \"%s\" at id %d",
-	     driver_type_str(node->driver_type), node->name, nodeid);
+	publish_node_info(node);
+	bootup_timeline_mark(bootup, BOOTUP_OPENED);
+
+	plog(LOG_DEBUG, "load_driver: Successfully loaded %s for \"%s\" at id %d on %s",
+	     driver_type_str(node->driver_type), node->name, nodeid, iface);
 
 	return 0;
 
 }
 
 #ifndef NO_MAREL_CODE
-static int initialize_legacy_driver(int nodeid)
+static int initialize_legacy_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	struct canopen_info* info = canopen_info_get(nodeid);
-
+	int nodeid = co_master_get_node_id(node);
 	int rc = legacy_driver_iface_initialize(node->driver);
 	if (rc >= 0) {
+		struct canopen_info* info = begin_info_update(node);
 		info->is_active = 1;
 		info->last_seen = time(NULL);
+		canopen_info_end_update(info);
 	} else {
 		if (node->is_heartbeat_supported)
-			turn_off_heartbeat(nodeid);
+			turn_off_heartbeat(node);
 
-		co_net_send_nmt(&socket_, NMT_CS_STOP, nodeid);
+		co_net_send_nmt(&node->bus->socket, NMT_CS_STOP, nodeid);
 
 		plog(LOG_ERROR, "initialize_legacy_driver: Failed to initialize \"%s\" with id %d",
 		     node->name, nodeid);
@@ -687,46 +1445,49 @@ static int initialize_legacy_driver(int nodeid)
 }
 #endif /* NO_MAREL_CODE */
 
-static int initialize_new_driver(int nodeid)
+static int initialize_new_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	int rc = co_drv_init(&node->ndrv);
+	struct co_bus* bus = node->bus;
+	int nodeid = co_master_get_node_id(node);
+
+	int rc = co_drv_init(node->ndrv);
 	if (rc >= 0) {
 #ifndef NO_MAREL_CODE
-		struct canopen_info* info = canopen_info_get(nodeid);
-		info->is_active = 1;
-		info->last_seen = time(NULL);
+		struct canopen_info* info = begin_info_update(node);
+		if (info) {
+			info->is_active = 1;
+			info->last_seen = time(NULL);
+			canopen_info_end_update(info);
+		}
 #endif /* NO_MAREL_CODE */
 
-		if (master_state_ == MASTER_STATE_STARTUP
-		 && node->ndrv.options & CO_OPT_INHIBIT_START)
-			++n_inhibited_starts;
+		if (bus->state == CO_BUS_STATE_STARTUP
+		 && node->ndrv->options & CO_OPT_INHIBIT_START)
+			++bus->n_inhibited_starts;
 	} else {
 		if (node->is_heartbeat_supported)
-			turn_off_heartbeat(nodeid);
+			turn_off_heartbeat(node);
 
-		co_net_send_nmt(&socket_, NMT_CS_STOP, nodeid);
+		co_net_send_nmt(&bus->socket, NMT_CS_STOP, nodeid);
 
-		plog(LOG_ERROR, "initialize_new_driver: Failed to initialize \"%s\" with id %d",
-		     node->name, nodeid);
+		plog(LOG_ERROR, "initialize_new_driver: Failed to initialize \"%s\" with id %d on %s",
+		     node->name, nodeid, bus->iface);
 
-		co_drv_unload(&node->ndrv);
+		co_drv_unload(node->ndrv);
 		node->driver_type = CO_MASTER_DRIVER_NONE;
 	}
 
 	return rc;
 }
 
-static int initialize_driver(int nodeid)
+static int initialize_driver(struct co_master_node* node)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-
 	switch (node->driver_type) {
 	case CO_MASTER_DRIVER_NEW:
-		return initialize_new_driver(nodeid);
+		return initialize_new_driver(node);
 #ifndef NO_MAREL_CODE
 	case CO_MASTER_DRIVER_LEGACY:
-		return initialize_legacy_driver(nodeid);
+		return initialize_legacy_driver(node);
 #endif /* NO_MAREL_CODE */
 	case CO_MASTER_DRIVER_NONE:
 		return -1;
@@ -736,43 +1497,186 @@ static int initialize_driver(int nodeid)
 	}
 }
 
+static int parse_node_list(char* nodes, const char* str)
+{
+	while (*str) {
+		char* end = NULL;
+		unsigned long first = strtoul(str, &end, 0);
+		unsigned long last = first;
+		if (end == str)
+			return -1;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 0);
+			if (end == str)
+				return -1;
+		}
+
+		if (first < CANOPEN_NODEID_MIN || last > CANOPEN_NODEID_MAX
+		 || first > last)
+			return -1;
+
+		memset(&nodes[first], 1, last - first + 1);
+
+		str = end;
+		if (*str == ',')
+			++str;
+		else if (*str != '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+/* The nodes that are named in the configuration are expected, or else those
+ * that were known the last time. Returns -1 if nothing is expected.
+ */
+static int get_expected_nodes(char* nodes, const struct co_bus* bus)
+{
+	memset(nodes, 0, CANOPEN_NODEID_MAX + 1);
+
+	if (cfg.expected_nodes[0]) {
+		if (parse_node_list(nodes, cfg.expected_nodes) >= 0)
+			return 0;
+
+		plog(LOG_ERROR, "Invalid list of expected nodes: \"%s\"",
+		     cfg.expected_nodes);
+		return -1;
+	}
+
+	if (!bus->identities)
+		return -1;
+
+	int n = 0, i;
+	for_each_node(i)
+		if (bus->identities->node[i].is_known) {
+			nodes[i] = 1;
+			++n;
+		}
+
+	return n > 0 ? 0 : -1;
+}
+
+#define LSS_ADDRESS_FMT "%08x:%08x:%08x:%08x"
+#define LSS_ADDRESS_ARGS(a) (a)->field[0], (a)->field[1], (a)->field[2], \
+			    (a)->field[3]
+
+/* Nodes that have been swapped in may have no node id. Each of them is found
+ * by the LSS fast scan and given the one that the configuration has for its
+ * address, which it stores. They boot up with it when they leave the
+ * configuration state.
+ *
+ * A node that is not in the configuration would be found again by every
+ * scan, so the first one ends the commissioning.
+ */
+static void commission_lss_nodes(struct co_bus* bus)
+{
+	struct lss_address address;
+	int n_configured = 0;
+	int rc = 0;
+
+	lss_switch_state_global(&bus->socket, LSS_MODE_WAITING);
+
+	while (n_configured < CANOPEN_NODEID_MAX
+	    && (rc = lss_fastscan(&bus->socket, &address, cfg.lss_timeout)) > 0) {
+		int nodeid = cfg_get_lss_nodeid(&address);
+
+		if (nodeid < CANOPEN_NODEID_MIN || nodeid > CANOPEN_NODEID_MAX) {
+			plog(LOG_WARNING, "%s: Node " LSS_ADDRESS_FMT " has no node id, and none is configured for it",
+			     bus->iface, LSS_ADDRESS_ARGS(&address));
+			break;
+		}
+
+		if (lss_configure_nodeid(&bus->socket, nodeid,
+					 cfg.lss_timeout) != 0
+		 || lss_store_configuration(&bus->socket,
+					    cfg.lss_timeout) != 0) {
+			plog(LOG_ERROR, "%s: Could not give node id %d to node " LSS_ADDRESS_FMT,
+			     bus->iface, nodeid, LSS_ADDRESS_ARGS(&address));
+			break;
+		}
+
+		plog(LOG_INFO, "%s: Gave node id %d to node " LSS_ADDRESS_FMT,
+		     bus->iface, nodeid, LSS_ADDRESS_ARGS(&address));
+
+		lss_switch_state_global(&bus->socket, LSS_MODE_WAITING);
+		++n_configured;
+	}
+
+	lss_switch_state_global(&bus->socket, LSS_MODE_WAITING);
+
+	if (rc < 0)
+		plog(LOG_ERROR, "%s: LSS fast scan failed: %s", bus->iface,
+		     strerror(errno));
+}
+
 static void run_net_probe(struct mloop_work* self)
 {
-	(void)self;
+	struct co_bus* bus = mloop_work_get_context(self);
+	char nodes_expected[CANOPEN_NODEID_MAX + 1];
+	uint64_t seen_time[CANOPEN_NODEID_MAX + 1] = { 0 };
 
-	profile("Probe network...\n");
+	struct co_net_wait wait;
+	co_net_wait_init(&wait, cfg.probe_timeout);
+	wait.timeout_min = cfg.probe_timeout_min;
+	wait.seen_time = seen_time;
+
+	if (get_expected_nodes(nodes_expected, bus) >= 0)
+		wait.nodes_expected = nodes_expected;
+
+	if (cfg.lss_commission)
+		commission_lss_nodes(bus);
 
 	int start = CANOPEN_NODEID_MIN, stop = CANOPEN_NODEID_MAX;
 
 	if (cfg.range_start == 0 && cfg.range_stop == 0) {
-		co_net_reset(&socket_, nodes_seen_, 100);
+		co_net_reset_wait(&bus->socket, bus->nodes_seen, &wait);
 	} else  {
 		start = cfg.range_start;
 		stop = cfg.range_stop;
-		co_net_reset_range(&socket_, nodes_seen_, start, stop,
-				   100 * (start - stop + 1));
+		wait.timeout *= stop - start + 1;
+		co_net_reset_range_wait(&bus->socket, bus->nodes_seen, start,
+					stop, &wait);
+		wait.timeout = cfg.probe_timeout;
 	}
 
-	co_net_probe(&socket_, nodes_seen_, start, stop, 100);
+	int reset_duration = wait.duration;
+	int n_seen = wait.n_seen;
+
+	co_net_probe_wait(&bus->socket, bus->nodes_seen, start, stop, &wait);
+	n_seen += wait.n_seen;
+
+	for (int i = start; i <= stop; ++i)
+		if (seen_time[i])
+			bootup_timeline_set(&bus->bootup[i], BOOTUP_PROBED,
+					    seen_time[i]);
+
+	plog(LOG_INFO, "%s: Probe found %d nodes in %d ms (reset: %d ms, longest gap: %d ms)%s",
+	     bus->iface, n_seen, reset_duration + wait.duration, reset_duration,
+	     wait.gap_max, wait.is_complete ? "; all expected nodes answered"
+					    : "");
 }
 
 static void run_load_driver(struct mloop_work* self)
 {
 	struct co_master_node* node = mloop_work_get_context(self);
-	int nodeid = co_master_get_node_id(node);
-	load_driver(nodeid);
+	bootup_timeline_mark(get_bootup_timeline(node), BOOTUP_DEQUEUED);
+	load_driver(node);
 	node->is_loading = 0;
 }
 
 static void call_start_fn(struct co_master_node* node)
 {
 	co_start_fn start_fn;
+	uint64_t start = event_trace_is_enabled()
+		       ? gettime_ns(CLOCK_MONOTONIC) : 0;
 
 	switch (node->driver_type) {
 	case CO_MASTER_DRIVER_NEW:
-		start_fn = node->ndrv.start_fn;
+		start_fn = node->ndrv->start_fn;
 		if (start_fn)
-			start_fn(&node->ndrv);
+			start_fn(node->ndrv);
 		break;
 #ifndef NO_MAREL_CODE
 	case CO_MASTER_DRIVER_LEGACY:
@@ -780,773 +1684,4708 @@ static void call_start_fn(struct co_master_node* node)
 		break;
 #endif /* NO_MAREL_CODE */
 	case CO_MASTER_DRIVER_NONE:
-		break;
+		return;
 	}
+
+	event_trace_complete(EVENT_TRACE_DRIVER_START, start, 0,
+			     co_master_get_node_id(node));
+	bootup_timeline_mark(get_bootup_timeline(node), BOOTUP_STARTED);
 }
 
 static void start_single_node(struct co_master_node* node)
 {
 	int nodeid = co_master_get_node_id(node);
-	co_net_send_nmt(&socket_, NMT_CS_START, nodeid);
-	start_nodeguarding(nodeid);
+	co_net_send_nmt(&node->bus->socket, NMT_CS_START, nodeid);
+	start_nodeguarding(node);
 	call_start_fn(node);
 }
 
-static void on_load_driver_done(struct mloop_work* self)
+/* When cfg.driver_threads is set, the drivers are handed the frames that they
+ * receive on executors instead of on the threads that receive them. Nodes
+ * that run the same driver share an executor, so the callbacks of a driver
+ * are never run concurrently with each other.
+ */
+static struct drv_exec* driver_execs_ = NULL;
+static size_t n_driver_execs_ = 0;
+
+static void stop_driver_execs(void)
 {
-	struct co_master_node* node = mloop_work_get_context(self);
-	int nodeid = co_master_get_node_id(node);
+	for (size_t i = 0; i < n_driver_execs_; ++i)
+		drv_exec_destroy(&driver_execs_[i]);
+
+	free(driver_execs_);
+	driver_execs_ = NULL;
+	n_driver_execs_ = 0;
+}
+
+static int start_driver_execs(void)
+{
+	if (cfg.driver_threads == 0)
+		return 0;
+
+	driver_execs_ = calloc(cfg.driver_threads, sizeof(*driver_execs_));
+	if (!driver_execs_)
+		return -1;
+
+	while (n_driver_execs_ < cfg.driver_threads) {
+		if (drv_exec_init(&driver_execs_[n_driver_execs_],
+				  cfg.driver_queue_length, "driver") < 0)
+			goto failure;
+
+		++n_driver_execs_;
+	}
+
+	return 0;
+
+failure:
+	stop_driver_execs();
+	return -1;
+}
+
+static const char* get_driver_name(const struct co_master_node* node)
+{
+	if (node->driver_type == CO_MASTER_DRIVER_NEW && node->ndrv->dso)
+		return node->ndrv->dso->name;
+
+	return node->name;
+}
+
+static struct drv_exec* pick_driver_exec(const struct co_master_node* node)
+{
+	if (n_driver_execs_ == 0)
+		return NULL;
+
+	/* Driver names are not case sensitive */
+	uint32_t hash = 5381;
+	for (const char* p = get_driver_name(node); *p; ++p)
+		hash = hash * 33 + tolower((unsigned char)*p);
+
+	return &driver_execs_[hash % n_driver_execs_];
+}
 
-	--n_scheduled_bootups;
+static void start_loaded_driver(struct co_master_node* node)
+{
+	struct co_bus* bus = node->bus;
 
 	if (node->driver_type == CO_MASTER_DRIVER_NONE)
 		return;
 
-	if (initialize_driver(nodeid) < 0)
+	if (initialize_driver(node) < 0) {
+		publish_node_info(node);
 		return;
+	}
 
+	bootup_timeline_mark(get_bootup_timeline(node), BOOTUP_INITIALIZED);
+
+	node->exec = pick_driver_exec(node);
 	node->is_initialized = 1;
+	co__mux_update(node);
+	publish_node_info(node);
 
-	if (master_state_ == MASTER_STATE_STARTUP)
+	if (bus->state == CO_BUS_STATE_STARTUP)
 		return;
 
 	if (node->driver_type == CO_MASTER_DRIVER_NEW
-	 && node->ndrv.options & CO_OPT_INHIBIT_START)
+	 && node->ndrv->options & CO_OPT_INHIBIT_START)
 		return;
 
 	start_single_node(node);
 }
 
-static int schedule_load_driver(int nodeid)
+static int is_sdo_cfg_changed(const struct cfg_node* a,
+			      const struct cfg_node* b)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	if (node->is_loading)
-		return 0;
-
-	if (node->driver_type != CO_MASTER_DRIVER_NONE) {
-		if (!node->is_initialized)
-			return -1;
-
-		unload_driver(nodeid);
-	}
+	return a->ignore_sdo_multiplexer != b->ignore_sdo_multiplexer
+	    || a->send_full_sdo_frame != b->send_full_sdo_frame
+	    || a->sdo_timeout_min != b->sdo_timeout_min
+	    || a->sdo_timeout_max != b->sdo_timeout_max;
+}
 
-	struct mloop_work* work = mloop_work_new(mloop_default());
-	if (!work)
-		return -1;
+static int is_guarding_cfg_changed(const struct cfg_node* a,
+				   const struct cfg_node* b)
+{
+	return a->heartbeat_period != b->heartbeat_period
+	    || a->heartbeat_timeout != b->heartbeat_timeout
+	    || a->n_timeouts_max != b->n_timeouts_max
+	    || a->enable_node_guarding != b->enable_node_guarding;
+}
 
-	mloop_work_set_context(work, node, NULL);
-	mloop_work_set_work_fn(work, run_load_driver);
-	mloop_work_set_done_fn(work, on_load_driver_done);
+static void stop_guarding_timers(struct co_master_node* node)
+{
+	stop_heartbeat_timer(node);
+	stop_ping_timer(node);
+}
 
-	int rc = mloop_work_start(work);
-	if (rc >= 0)
-		++n_scheduled_bootups;
+/* The timers are made again with the new periods when they are started */
+static void restart_node_guarding(struct co_master_node* node)
+{
+	stop_guarding_timers(node);
 
-	mloop_work_unref(work);
+	if (node->is_initialized && node->bus->state == CO_BUS_STATE_RUNNING)
+		start_nodeguarding(node);
+}
 
-	node->is_loading = 1;
+struct heartbeat_update {
+	struct co_master_node* node;
+	uint16_t period;
+	int enable;
+	int is_supported;
+};
 
-	return rc;
+static void run_heartbeat_update(struct mloop_work* self)
+{
+	struct heartbeat_update* update = mloop_work_get_context(self);
+	struct co_master_node* node = update->node;
+
+	if (update->enable)
+		update->is_supported =
+			set_heartbeat_period(node, update->period) >= 0;
+	else if (update->is_supported)
+		turn_off_heartbeat(node);
 }
 
-static int handle_bootup(struct co_master_node* node)
+static void on_heartbeat_update_done(struct mloop_work* self)
 {
-	int nodeid = co_master_get_node_id(node);
+	struct heartbeat_update* update = mloop_work_get_context(self);
+	struct co_master_node* node = update->node;
 
-	if (master_state_ == MASTER_STATE_STARTUP) {
-		nodes_seen_late_[nodeid] = 1;
-		return 0;
-	}
+	if (node->is_loading || node->driver_type == CO_MASTER_DRIVER_NONE)
+		return;
 
-	return schedule_load_driver(nodeid);
+	node->is_heartbeat_supported = update->is_supported;
+	restart_node_guarding(node);
 }
 
-static void log_emcy(struct co_master_node* node, struct co_emcy* emcy)
+/* The heartbeat producer of the node is set on a worker, and guarding is
+ * restarted when that is done. Until then, the node is not guarded.
+ */
+static int schedule_heartbeat_update(struct co_master_node* node)
 {
-	int level = emcy->code != 0 ? LOG_EMERG : LOG_NOTICE;
-	int profile = co_master_get_device_profile(node);
+	struct heartbeat_update* update = malloc(sizeof(*update));
+	if (!update)
+		return -1;
 
-	plog(level, "Node %d: Code 0x%04x: %s",
-	     co_master_get_node_id(node), emcy->code,
-	     error_code_to_string(emcy->code, profile));
-}
+	update->node = node;
+	update->period = node->cfg.heartbeat_period;
+	update->enable = node->cfg.enable_node_guarding;
+	update->is_supported = node->is_heartbeat_supported;
 
-static int handle_emcy(struct co_master_node* node,
-		       const struct can_frame* frame)
-{
-	if (frame->can_dlc == 0)
-		return handle_bootup(node);
+	struct mloop_work* work = mloop_work_new(mloop_default());
+	if (!work) {
+		free(update);
+		return -1;
+	}
 
-	uint32_t error_register = emcy_get_register(frame);
+	mloop_work_set_context(work, update, free);
+	mloop_work_set_work_fn(work, run_heartbeat_update);
+	mloop_work_set_done_fn(work, on_heartbeat_update_done);
 
-	int nodeid = co_master_get_node_id(node);
+	stop_guarding_timers(node);
 
-#ifndef NO_MAREL_CODE
-	canopen_info_get(nodeid)->error_register = error_register;
-#endif /* NO_MAREL_CODE */
-
-	struct co_emcy emcy = {
-		.code = emcy_get_code(frame),
-		.reg = error_register,
-		.manufacturer_error = emcy_get_manufacturer_error(frame)
-	};
-
-	if (node->driver_type != CO_MASTER_DRIVER_NONE)
-		log_emcy(node, &emcy);
-
-	switch (node->driver_type) {
-	case CO_MASTER_DRIVER_NONE:
-		return -1;
-#ifndef NO_MAREL_CODE
-	case CO_MASTER_DRIVER_LEGACY:
-		legacy_driver_iface_process_emr(node->driver, emcy.code,
-						emcy.reg,
-						emcy.manufacturer_error);
-		break;
-#endif /* NO_MAREL_CODE */
-	case CO_MASTER_DRIVER_NEW:
-		if (node->ndrv.emcy_fn)
-			node->ndrv.emcy_fn(&node->ndrv, &emcy);
-		break;
-	}
-
-	return 0;
+	int rc = mloop_work_start(work);
+	mloop_work_unref(work);
+	return rc;
 }
 
-static int handle_heartbeat(struct co_master_node* node,
-			     const struct can_frame* frame)
+/* Reads the configuration of the node again and applies what changed.
+ * Returns 1 if anything did.
+ */
+static int reload_node_config(struct co_master_node* node)
 {
 	int nodeid = co_master_get_node_id(node);
+	struct cfg_node old = node->cfg;
 
-	if (!heartbeat_is_valid(frame))
-		return -1;
-
-	if (heartbeat_is_bootup(frame)
-	 && !cfg.node[nodeid].has_zero_guard_status)
-		return handle_bootup(node);
+	cfg_load_node(node);
 
-	if (master_state_ == MASTER_STATE_STARTUP)
-		return 0;
+	const struct cfg_node* new = &node->cfg;
+	int is_changed = 0;
 
-	/* This can happen if the CAN bus is disconnected but not the power to
-	 * the node. We reset communication to refresh the state.
-	 */
-	if (node->driver_type == CO_MASTER_DRIVER_NONE) {
-		if (heartbeat_get_state(frame) != NMT_STATE_STOPPED
-		 && !node->is_loading)
-			co_net_send_nmt(&socket_, NMT_CS_RESET_COMMUNICATION,
-					nodeid);
+	if (is_sdo_cfg_changed(&old, new)) {
+		apply_quirks(node);
+		is_changed = 1;
+	}
 
-		return 0;
+	if (old.n_sdo_channels != new->n_sdo_channels) {
+		plog(LOG_NOTICE, "Node %d on %s gets %llu SDO channels when it is next loaded",
+		     nodeid, node->bus->iface,
+		     (unsigned long long)new->n_sdo_channels);
+		is_changed = 1;
 	}
 
-	if (!node->is_initialized)
-		return -1;
+	if (old.has_zero_guard_status != new->has_zero_guard_status)
+		is_changed = 1;
 
-	restart_heartbeat_timer(nodeid);
+	if (!is_guarding_cfg_changed(&old, new))
+		return is_changed;
 
-	/* Make sure the node is in operational state */
-	if (heartbeat_get_state(frame) != NMT_STATE_OPERATIONAL)
-		co_net_send_nmt(&socket_, NMT_CS_START, nodeid);
+	if (node->driver_type == CO_MASTER_DRIVER_NONE)
+		return 1;
 
-#ifndef NO_MAREL_CODE
-	struct canopen_info* info = canopen_info_get(nodeid);
-	info->last_seen = time(NULL);
-	info->skipped_heartbeats = 0;
-#endif /* NO_MAREL_CODE */
+	if (old.heartbeat_period == new->heartbeat_period
+	 && old.enable_node_guarding == new->enable_node_guarding) {
+		restart_node_guarding(node);
+		return 1;
+	}
 
-	return 0;
+	if (schedule_heartbeat_update(node) < 0)
+		plog(LOG_ERROR, "Could not apply the new heartbeat period of node %d on %s",
+		     nodeid, node->bus->iface);
+
+	return 1;
 }
 
-static int handle_sdo(struct co_master_node* node, const struct can_frame* cf)
+static void make_identity(struct node_identity* dst,
+			  const struct co_master_node* node)
 {
-	int nodeid = co_master_get_node_id(node);
-	struct sdo_async* sdo_proc = &sdo_req_queue_get(nodeid)->sdo_client;
-	return sdo_async_feed(sdo_proc, cf);
+	memset(dst, 0, sizeof(*dst));
+
+	dst->is_known = 1;
+	dst->device_type = node->device_type;
+	dst->vendor_id = node->vendor_id;
+	dst->product_code = node->product_code;
+	dst->revision_number = node->revision_number;
+	dst->serial_number = node->serial_number;
+	strlcpy(dst->name, node->name, sizeof(dst->name));
+	strlcpy(dst->hw_version, node->hw_version, sizeof(dst->hw_version));
+	strlcpy(dst->sw_version, node->sw_version, sizeof(dst->sw_version));
 }
 
-static int handle_not_loaded(struct co_master_node* node,
-			     const struct canopen_msg* msg,
-			     const struct can_frame* frame)
+static void remember_identity(const struct co_master_node* node)
 {
-	switch (msg->object)
-	{
-	case CANOPEN_EMCY:
-		return handle_emcy(node, frame);
-	case CANOPEN_HEARTBEAT:
-		return handle_heartbeat(node, frame);
-	case CANOPEN_TSDO:
-		return handle_sdo(node, frame);
-	default:
-		break;
-	}
+	struct node_identity_cache* cache = node->bus->identities;
+	if (!cache || node->driver_type == CO_MASTER_DRIVER_NONE)
+		return;
 
-	return -1;
+	struct node_identity identity;
+	make_identity(&identity, node);
+
+	struct node_identity* known = &cache->node[node->nodeid];
+	if (memcmp(known, &identity, sizeof(identity)) == 0)
+		return;
+
+	*known = identity;
+	cache->is_dirty = 1;
 }
 
-#ifndef NO_MAREL_CODE
-static int handle_with_legacy(struct co_master_node* node,
-			      const struct canopen_msg* msg,
-			      const struct can_frame* cf)
+static void save_identities(struct co_bus* bus)
 {
-	void* driver = node->driver;
-	if (!driver)
-		return -1;
+	/* A bus that was handed over has them without a state path */
+	if (!bus->identities || !bus->identities->is_dirty
+	 || !cfg.state_path[0])
+		return;
 
-	switch (msg->object)
-	{
-	case CANOPEN_TPDO1:
-		return legacy_driver_iface_process_pdo(driver, 1, cf->data,
-						       cf->can_dlc);
-	case CANOPEN_TPDO2:
-		return legacy_driver_iface_process_pdo(driver, 2, cf->data,
-						       cf->can_dlc);
-	case CANOPEN_TPDO3:
-		return legacy_driver_iface_process_pdo(driver, 3, cf->data,
-						       cf->can_dlc);
-	case CANOPEN_TPDO4:
-		return legacy_driver_iface_process_pdo(driver, 4, cf->data,
-						       cf->can_dlc);
-	case CANOPEN_TSDO:
-		return handle_sdo(node, cf);
-	case CANOPEN_EMCY:
-		return handle_emcy(node, cf);
-	case CANOPEN_HEARTBEAT:
-		return handle_heartbeat(node, cf);
-	default:
-		break;
-	}
+	char path[256];
+	node_identity_make_path(path, sizeof(path), cfg.state_path, bus->iface);
 
-	return -1;
+	if (node_identity_cache_save(bus->identities, path) < 0)
+		plog(LOG_DEBUG, "Could not save node identities to %s: %m",
+		     path);
 }
-#endif /* NO_MAREL_CODE */
 
-static int handle_with_new_driver(struct co_master_node* node,
-				  const struct canopen_msg* msg,
-				  const struct can_frame* cf)
+/* The counter is only touched on the main loop, so the last driver of the
+ * boot-up can release the barrier directly.
+ *
+ * The driver was loaded with the configuration of the time, which may have
+ * been reloaded since.
+ */
+static void finish_load_driver(struct co_master_node* node)
 {
-	struct co_drv* drv = &node->ndrv;
+	struct co_bus* bus = node->bus;
 
-	switch (msg->object)
-	{
-	case CANOPEN_TPDO1:
-		if (drv->pdo1_fn)
-			drv->pdo1_fn(drv, cf->data, cf->can_dlc);
-		return 0;
-	case CANOPEN_TPDO2:
-		if (drv->pdo2_fn)
-			drv->pdo2_fn(drv, cf->data, cf->can_dlc);
-		return 0;
-	case CANOPEN_TPDO3:
-		if (drv->pdo3_fn)
-			drv->pdo3_fn(drv, cf->data, cf->can_dlc);
-		return 0;
-	case CANOPEN_TPDO4:
-		if (drv->pdo4_fn)
-			drv->pdo4_fn(drv, cf->data, cf->can_dlc);
-		return 0;
-	case CANOPEN_TSDO:
-		return handle_sdo(node, cf);
-	case CANOPEN_EMCY:
-		return handle_emcy(node, cf);
-	case CANOPEN_HEARTBEAT:
-		return handle_heartbeat(node, cf);
-	default:
-		break;
-	}
+	bootup_timeline_mark(get_bootup_timeline(node), BOOTUP_LOADED);
 
-	return -1;
+	--bus->n_scheduled_bootups;
+
+	reload_node_config(node);
+	learn_sdo_profile(node);
+	remember_identity(node);
+	start_loaded_driver(node);
+
+	/* Those of the boot-up are saved together when it is done */
+	if (!bus->is_waiting_for_drivers)
+		save_identities(bus);
+
+	if (bus->is_waiting_for_drivers && bus->n_scheduled_bootups == 0)
+		on_drivers_loaded(bus);
 }
 
-static void mux_on_frame(const struct can_frame* cf)
+static void on_load_driver_done(struct mloop_work* self)
 {
-	struct canopen_msg msg;
+	finish_load_driver(mloop_work_get_context(self));
+}
 
-	if (cf->can_id & (CAN_RTR_FLAG | CAN_EFF_FLAG | CAN_ERR_FLAG))
-		return;
+static void abort_load_driver(struct co_master_node* node)
+{
+	node->is_loading = 0;
+	finish_load_driver(node);
+}
 
-	if (canopen_get_object_type(&msg, cf) < 0)
-		return;
+static int start_load_driver_work(struct co_master_node* node)
+{
+	struct mloop_work* work = mloop_work_new(mloop_default());
+	if (!work)
+		return -1;
 
-	if (msg.object == CANOPEN_NMT) {
-		plog(LOG_ALERT, "Received NMT! Another CANopen master is not allowed on the bus!");
-		return;
-	}
+	mloop_work_set_context(work, node, NULL);
+	mloop_work_set_work_fn(work, run_load_driver);
+	mloop_work_set_done_fn(work, on_load_driver_done);
 
-	if (!(nodeid_min() <= msg.id && msg.id <= nodeid_max()))
-		return;
+	int rc = mloop_work_start(work);
+	mloop_work_unref(work);
+	return rc;
+}
 
-	struct co_master_node* node = co_master_get_node(msg.id);
+static void on_identity_known(struct co_master_node* node)
+{
+	bootup_timeline_mark(get_bootup_timeline(node), BOOTUP_IDENTIFIED);
 
-	if (!node->is_initialized) {
-		handle_not_loaded(node, &msg, cf);
-		return;
-	}
+	/* Reload config when we have the name of the node */
+	cfg_load_node(node);
+	apply_quirks(node);
 
-	switch (node->driver_type) {
-	case CO_MASTER_DRIVER_NONE:
-		handle_not_loaded(node, &msg, cf);
-		break;
-#ifndef NO_MAREL_CODE
-	case CO_MASTER_DRIVER_LEGACY:
-		handle_with_legacy(node, &msg, cf);
-		break;
-#endif /* NO_MAREL_CODE */
-	case CO_MASTER_DRIVER_NEW:
-		handle_with_new_driver(node, &msg, cf);
-		break;
+	if (start_load_driver_work(node) < 0) {
+		plog(LOG_ERROR, "load_driver: Could not schedule loading of \"%s\" at id %d on %s",
+		     node->name, node->nodeid, node->bus->iface);
+		abort_load_driver(node);
 	}
 }
 
-static void mux_handler_fn(struct mloop_socket* self)
+static int start_identity_batch(struct co_master_node* node,
+				sdo_req_fn on_done,
+				const enum identity_item* items, size_t n_items)
 {
-	struct can_frame cf;
+	struct sdo_batch* batch = sdo_batch_new(on_done, node);
+	if (!batch)
+		return -1;
 
-	while (1) {
-		memset(&cf, 0, sizeof(cf));
+	int rc = -1;
 
-		ssize_t rsize = sock_recv(&socket_, &cf, MSG_DONTWAIT);
-		if (rsize == 0)
-			mloop_socket_stop(self);
+	for (size_t i = 0; i < n_items; ++i)
+		if (add_identity_item(batch, items[i]) < 0)
+			goto done;
 
-		if (rsize <= 0)
-			return;
+	rc = sdo_batch_start(batch, co_master_get_sdo_queue(node));
 
-		mux_on_frame(&cf);
-	}
+done:
+	sdo_req_unref(&batch->req);
+	return rc;
 }
 
-static int init_multiplexer()
+/* A server that answers with the multiplexer of another object fails all of
+ * the identity read while that is checked, so it is read again without it
+ * once that has been seen. The quirk is then learned for the type.
+ */
+static int retry_identity_read(struct co_master_node* node)
 {
-	mux_handler_ = mloop_socket_new(mloop_default());
-	if (!mux_handler_)
+	struct sdo_req_queue* sdo_queue = co_master_get_sdo_queue(node);
+	const struct sdo_async* primary = &sdo_queue->sdo_client[0];
+
+	if (primary->quirks & SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER
+	 || get_learned_quirks(node, NULL) == SDO_ASYNC_QUIRK_NONE)
 		return -1;
 
-	mloop_socket_set_fd(mux_handler_, socket_.fd);
-	mloop_socket_set_callback(mux_handler_, mux_handler_fn);
+	plog(LOG_NOTICE, "load_driver: Node %d on %s answers with the wrong SDO multiplexer; reading it again without checking it",
+	     node->nodeid, node->bus->iface);
 
-	return mloop_socket_start(mux_handler_);
+	apply_quirks(node);
+	return start_identity_read(node);
 }
 
-static void wait_for_bootup(struct mloop_work* self)
+static void on_identity_read_done(struct sdo_req* req)
 {
-	(void)self;
-	while (n_scheduled_bootups > 0)
-		usleep(100);
+	struct sdo_batch* batch = (struct sdo_batch*)req;
+	struct co_master_node* node = req->context;
+
+	if (read_name(node, batch) < 0) {
+		if (retry_identity_read(node) < 0)
+			abort_load_driver(node);
+		return;
+	}
+
+	read_identity(node, batch);
+	on_identity_known(node);
 }
 
-static void schedule_bootup_done(void)
+static int start_identity_read(struct co_master_node* node)
 {
-	struct mloop_work* work = mloop_work_new(mloop_default());
-	assert(work);
-	mloop_work_set_work_fn(work, wait_for_bootup);
-	mloop_work_set_done_fn(work, on_bootup_done);
+	enum identity_item items[IDENTITY_N_ITEMS];
+	for (size_t i = 0; i < IDENTITY_N_ITEMS; ++i)
+		items[i] = i;
 
-	int rc = mloop_work_start(work);
-	assert(rc == 0);
-
-	mloop_work_unref(work);
+	return start_identity_batch(node, on_identity_read_done, items,
+				    IDENTITY_N_ITEMS);
 }
 
-
-static void run_bootup(void)
+static void on_identity_check_done(struct sdo_req* req)
 {
-	int i;
-	profile("Load drivers...\n");
-	for_each_node(i)
-		if (nodes_seen_[i])
-			schedule_load_driver(i);
+	struct sdo_batch* batch = (struct sdo_batch*)req;
+	struct co_master_node* node = req->context;
+
+	if (recall_identity(node, batch) >= 0) {
+		on_identity_known(node);
+		return;
+	}
 
-	schedule_bootup_done();
+	if (start_identity_read(node) < 0) {
+		plog(LOG_ERROR, "load_driver: Could not read the identity of node %d on %s",
+		     node->nodeid, node->bus->iface);
+		abort_load_driver(node);
+	}
 }
 
-static void load_late_nodes(void)
+static int start_identity_check(struct co_master_node* node,
+				const struct node_identity* known)
 {
-	int i;
-	for_each_node(i)
-		if (nodes_seen_late_[i]) {
-			plog(LOG_WARNING, "Node %d was late", i);
-			schedule_load_driver(i);
-		}
+	enum identity_item item = get_check_item(known);
+	return start_identity_batch(node, on_identity_check_done, &item, 1);
 }
 
-static void on_sync(struct mloop_timer* self)
+/* The identity of a node that another process handed over is taken as it
+ * was, as the node has not been reset since it was read. The load itself is
+ * scheduled on a worker, so none of it is done before this returns.
+ */
+static int resume_load_driver(struct co_master_node* node)
 {
-	(void)self;
+	struct co_bus* bus = node->bus;
+	if (!bus->is_adopted || !bus->identities)
+		return -1;
 
-	struct can_frame cf = {
-		.can_id = R_SYNC,
-		.can_dlc = 0,
-	};
+	const struct node_identity* known = &bus->identities->node[node->nodeid];
+	if (!known->is_known)
+		return -1;
+
+	take_identity(node, known);
 
-	sock_send(&socket_, &cf, 0);
+	++bus->n_scheduled_bootups;
+	node->is_loading = 1;
+
+	on_identity_known(node);
+	return 0;
 }
 
-static int start_sync_timer(void)
+/* Loading starts on the main loop with the identity of the node, which is
+ * read asynchronously, so the nodes of a boot-up are all read at once rather
+ * than a few at a time by the workers. The rest of it is scheduled on a
+ * worker when the identity is in.
+ *
+ * The callbacks of SDO requests are never called from within the start, so
+ * the caller sees the load as scheduled before any of it is done.
+ */
+static int schedule_load_driver(struct co_master_node* node)
 {
-	if (cfg.sync_interval == 0)
+	if (node->is_loading)
 		return 0;
 
-	struct mloop_timer* timer = mloop_timer_new(mloop_default());
-	if (!timer)
+	if (node->driver_type != CO_MASTER_DRIVER_NONE) {
+		if (!node->is_initialized)
+			return -1;
+
+		unload_driver(node);
+	}
+
+	/* Those of the boot-up of the bus were started with it */
+	struct bootup_timeline* bootup = get_bootup_timeline(node);
+	if (node->bus->state != CO_BUS_STATE_STARTUP)
+		bootup_timeline_start(bootup, gettime_us(CLOCK_MONOTONIC));
+
+	/* The SDO channel of a node is made when it is first seen so that the
+	 * quirks below reach it
+	 */
+	if (sdo_req_queue_activate(co_master_get_sdo_queue(node)) < 0)
 		return -1;
 
-	mloop_timer_set_callback(timer, on_sync);
-	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
-	mloop_timer_set_time(timer, cfg.sync_interval * 1000ULL);
+	node->name[0] = '\0';
+	cfg_load_node(node);
+	forget_sdo_observations(node);
+	apply_quirks(node);
 
-	int rc = mloop_timer_start(timer);
-	mloop_timer_unref(timer);
-	return rc;
-}
+	bootup_timeline_mark(bootup, BOOTUP_SCHEDULED);
 
-static void start_all_nodes(void)
-{
-	int i;
+	if (resume_load_driver(node) == 0)
+		return 0;
 
-	/* We start each node individually because we don't want to start nodes
-	 * that were not properly registered.
-	 */
-	profile("Start nodes...\n");
-	for_each_node_reverse(i)
-		if (co_master_get_node(i)->driver_type != CO_MASTER_DRIVER_NONE)
-			co_net_send_nmt(&socket_, NMT_CS_START, i);
+	const struct node_identity* known = get_known_identity(node);
+	int rc = known ? start_identity_check(node, known)
+		       : start_identity_read(node);
+	if (rc < 0)
+		return -1;
 
-	profile("Start node guarding...\n");
-	for_each_node(i)
-		if (co_master_get_node(i)->driver_type != CO_MASTER_DRIVER_NONE)
-			start_nodeguarding(i);
+	++node->bus->n_scheduled_bootups;
+	node->is_loading = 1;
 
-	profile("Notify drivers about start...\n");
-	for_each_node(i)
-		call_start_fn(co_master_get_node(i));
+	return 0;
+}
 
-	profile("Boot-up finished!\n");
+static int handle_bootup(struct co_master_node* node)
+{
+	struct co_bus* bus = node->bus;
 
-	master_state_ = MASTER_STATE_RUNNING;
+	/* Anything may have changed while the node was resetting */
+	sdo_req_queue_clear_cache(co_master_get_sdo_queue(node));
 
-	load_late_nodes();
+	event_rest_publish_state(node, "bootup");
 
-	start_sync_timer();
+	if (bus->state == CO_BUS_STATE_STARTUP) {
+		bus->nodes_seen_late[co_master_get_node_id(node)] = 1;
+		return 0;
+	}
 
-	if (cfg.enable_bootup_trace)
-		dump_tracebuffer("bootup");
+	return schedule_load_driver(node);
 }
 
-static void on_bootup_done(struct mloop_work* self)
+/* EMCYs that were not logged are summed up before the next one that is */
+static void log_emcy(struct co_master_node* node, struct co_emcy* emcy)
 {
-	(void)self;
+	int level = emcy->code != 0 ? LOG_EMERG : LOG_NOTICE;
+	int profile = co_master_get_device_profile(node);
 
-	if (n_inhibited_starts == 0)
-		start_all_nodes();
+	unsigned int n_unreported =
+		emcy_history_take_unreported(&node->emcy_history);
+	if (n_unreported > 0)
+		alog(LOG_WARNING, "Node %d on %s: %u EMCYs were not logged",
+		     co_master_get_node_id(node), node->bus->iface,
+		     n_unreported);
+
+	alog(level, "Node %d on %s: Code 0x%04x: %s",
+	     co_master_get_node_id(node), node->bus->iface, emcy->code,
+	     error_code_to_string(emcy->code, profile));
 }
 
-static void on_net_probe_done(struct mloop_work* self)
+static inline struct node_stats* get_node_stats(struct co_master_node* node)
 {
-	(void)self;
-
-	profile("Initialize multiplexer...\n");
-	int __unused rc = init_multiplexer();
-	assert(rc == 0);
+	return &node->bus->stats[co_master_get_node_id(node)];
+}
 
-	run_bootup();
+/* Driver calls are timed against their budget and for the event trace */
+static inline uint64_t driver_time_start(void)
+{
+	return cfg.driver_budget || event_trace_is_enabled()
+	     ? gettime_ns(CLOCK_MONOTONIC) : 0;
 }
 
-static void set_priority(void)
+/* Overruns and drops are logged the 1st, 2nd, 4th, 8th... time */
+static inline int is_power_of_two(uint64_t n)
 {
-	struct sched_param prio = { .sched_priority = 25 };
-	sched_setscheduler(getpid(), SCHED_FIFO, &prio);
+	return n != 0 && (n & (n - 1)) == 0;
 }
 
-static int start_bootup(void)
+static void driver_time_end(struct co_master_node* node,
+			    enum event_trace_id id, uint64_t start)
 {
-	struct mloop_work* work = mloop_work_new(mloop_default());
-	if (!work)
-		return -1;
+	if (start == 0)
+		return;
 
-	mloop_work_set_work_fn(work, run_net_probe);
-	mloop_work_set_done_fn(work, on_net_probe_done);
+	event_trace_complete(id, start, 0, co_master_get_node_id(node));
 
-	int rc = mloop_work_start(work);
-	mloop_work_unref(work);
+	uint64_t budget = cfg.driver_budget;
+	if (budget == 0)
+		return;
 
-	return rc;
+	uint64_t us = (gettime_ns(CLOCK_MONOTONIC) - start) / 1000ULL;
+	uint64_t n = node_stats_count_driver_call(get_node_stats(node), us,
+						  budget);
+
+	if (is_power_of_two(n))
+		alog(LOG_WARNING, "Node %d on %s: The driver took %llu us, which is over its budget of %llu us (%llu times so far)",
+		     co_master_get_node_id(node), node->bus->iface,
+		     (unsigned long long)us, (unsigned long long)budget,
+		     (unsigned long long)n);
 }
 
-#ifndef NO_MAREL_CODE
+static void count_driver_drop(struct co_master_node* node)
+{
+	uint64_t n = node_stats_count_driver_drop(get_node_stats(node));
+
+	if (is_power_of_two(n))
+		alog(LOG_WARNING, "Node %d on %s: A frame was dropped because the driver is not keeping up (%llu so far)",
+		     co_master_get_node_id(node), node->bus->iface,
+		     (unsigned long long)n);
+}
+
+static void call_emcy_fn(struct co_master_node* node, struct co_emcy* emcy)
+{
+	uint64_t start = driver_time_start();
+
+	switch (node->driver_type) {
+	case CO_MASTER_DRIVER_NONE:
+		return;
+#ifndef NO_MAREL_CODE
+	case CO_MASTER_DRIVER_LEGACY:
+		legacy_driver_iface_process_emr(node->driver, emcy->code,
+						emcy->reg,
+						emcy->manufacturer_error);
+		break;
+#endif /* NO_MAREL_CODE */
+	case CO_MASTER_DRIVER_NEW:
+		if (node->ndrv->emcy_fn)
+			node->ndrv->emcy_fn(node->ndrv, emcy);
+		break;
+	}
+
+	driver_time_end(node, EVENT_TRACE_DRIVER_EMCY, start);
+}
+
+/* The EMCY has already been logged and published by handle_emcy() */
+static void mux_run_emcy_fn(void* context, const struct can_frame* cf,
+			    uint64_t timestamp)
+{
+	struct co_master_node* node = context;
+
+	struct co_emcy emcy = {
+		.code = emcy_get_code(cf),
+		.reg = emcy_get_register(cf),
+		.manufacturer_error = emcy_get_manufacturer_error(cf)
+	};
+
+	node->ndrv->rx_timestamp = timestamp;
+	call_emcy_fn(node, &emcy);
+}
+
+static int handle_emcy(struct co_master_node* node,
+		       const struct can_frame* frame, uint64_t timestamp)
+{
+	if (frame->can_dlc == 0)
+		return handle_bootup(node);
+
+	uint32_t error_register = emcy_get_register(frame);
+
+#ifndef NO_MAREL_CODE
+	struct canopen_info* info = begin_info_update(node);
+	if (info) {
+		info->error_register = error_register;
+		canopen_info_end_update(info);
+	}
+#endif /* NO_MAREL_CODE */
+
+	struct co_emcy emcy = {
+		.code = emcy_get_code(frame),
+		.reg = error_register,
+		.manufacturer_error = emcy_get_manufacturer_error(frame)
+	};
+
+	struct emcy_history_params params = {
+		.window = cfg.emcy_window * 1000ULL,
+		.log_interval = cfg.emcy_log_interval * 1000ULL,
+		.log_burst = cfg.emcy_log_burst
+	};
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	int is_logged = emcy_history_add(&node->emcy_history, &emcy, now,
+					 &params);
+
+	if (is_logged && node->driver_type != CO_MASTER_DRIVER_NONE)
+		log_emcy(node, &emcy);
+
+	event_rest_publish_emcy(node, &emcy);
+
+	if (node->driver_type == CO_MASTER_DRIVER_NONE)
+		return -1;
+
+	if (node->exec) {
+		if (drv_exec_post(node->exec, mux_run_emcy_fn, node, frame,
+				  timestamp) < 0)
+			count_driver_drop(node);
+	} else {
+		node->ndrv->rx_timestamp = timestamp;
+		call_emcy_fn(node, &emcy);
+	}
+
+	return 0;
+}
+
+static const char* nmt_state_name(enum nmt_state state)
+{
+	switch (state) {
+	case NMT_STATE_BOOTUP: return "bootup";
+	case NMT_STATE_STOPPED: return "stopped";
+	case NMT_STATE_OPERATIONAL: return "operational";
+	case NMT_STATE_PREOPERATIONAL: return "pre-operational";
+	}
+
+	return "unknown";
+}
+
+static int handle_heartbeat(struct co_master_node* node,
+			     const struct can_frame* frame)
+{
+	struct co_bus* bus = node->bus;
+	int nodeid = co_master_get_node_id(node);
+
+	if (!heartbeat_is_valid(frame))
+		return -1;
+
+	if (heartbeat_is_bootup(frame)
+	 && !node->cfg.has_zero_guard_status)
+		return handle_bootup(node);
+
+	if (bus->state == CO_BUS_STATE_STARTUP)
+		return 0;
+
+	event_rest_publish_state(node,
+				 nmt_state_name(heartbeat_get_state(frame)));
+
+	/* This can happen if the CAN bus is disconnected but not the power to
+	 * the node. We reset communication to refresh the state.
+	 */
+	if (node->driver_type == CO_MASTER_DRIVER_NONE) {
+		if (heartbeat_get_state(frame) != NMT_STATE_STOPPED
+		 && !node->is_loading)
+			co_net_send_nmt(&bus->socket, NMT_CS_RESET_COMMUNICATION,
+					nodeid);
+
+		return 0;
+	}
+
+	if (!node->is_initialized)
+		return -1;
+
+	restart_heartbeat_timer(node);
+
+	/* Make sure the node is in operational state */
+	if (heartbeat_get_state(frame) != NMT_STATE_OPERATIONAL)
+		co_net_send_nmt(&bus->socket, NMT_CS_START, nodeid);
+
+#ifndef NO_MAREL_CODE
+	struct canopen_info* info = begin_info_update(node);
+	if (info) {
+		info->last_seen = time(NULL);
+		info->skipped_heartbeats = 0;
+		copy_info_stats(info, &bus->stats[nodeid]);
+		canopen_info_end_update(info);
+	}
+#endif /* NO_MAREL_CODE */
+
+	return 0;
+}
+
+static int handle_sdo(struct co_master_node* node, const struct can_frame* cf)
+{
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(node);
+	struct sdo_async* sdo_proc = sdo_req_queue_find_channel(queue, cf->can_id);
+	return sdo_proc ? sdo_async_feed(sdo_proc, cf) : -1;
+}
+
+#ifndef NO_MAREL_CODE
+static int handle_with_legacy(struct co_master_node* node,
+			      const struct canopen_msg* msg,
+			      const struct can_frame* cf, uint64_t timestamp)
+{
+	void* driver = node->driver;
+	if (!driver)
+		return -1;
+
+	switch (msg->object)
+	{
+	case CANOPEN_TPDO1:
+		return legacy_driver_iface_process_pdo(driver, 1, cf->data,
+						       cf->can_dlc, timestamp);
+	case CANOPEN_TPDO2:
+		return legacy_driver_iface_process_pdo(driver, 2, cf->data,
+						       cf->can_dlc, timestamp);
+	case CANOPEN_TPDO3:
+		return legacy_driver_iface_process_pdo(driver, 3, cf->data,
+						       cf->can_dlc, timestamp);
+	case CANOPEN_TPDO4:
+		return legacy_driver_iface_process_pdo(driver, 4, cf->data,
+						       cf->can_dlc, timestamp);
+	case CANOPEN_TSDO:
+		return handle_sdo(node, cf);
+	case CANOPEN_EMCY:
+		return handle_emcy(node, cf, 0);
+	case CANOPEN_HEARTBEAT:
+		return handle_heartbeat(node, cf);
+	default:
+		break;
+	}
+
+	return -1;
+}
+#endif /* NO_MAREL_CODE */
+
+static void mux_on_nmt(void* context, const struct can_frame* cf,
+		       uint64_t timestamp)
+{
+	struct co_bus* bus = context;
+	(void)cf;
+	(void)timestamp;
+
+	alog(LOG_ALERT, "Received NMT on %s! Another CANopen master is not allowed on the bus!",
+	     bus->iface);
+}
+
+static void mux_on_emcy(void* context, const struct can_frame* cf,
+			uint64_t timestamp)
+{
+	handle_emcy(context, cf, timestamp);
+}
+
+static void mux_on_heartbeat(void* context, const struct can_frame* cf,
+			     uint64_t timestamp)
+{
+	(void)timestamp;
+	handle_heartbeat(context, cf);
+}
+
+static void mux_on_sdo(void* context, const struct can_frame* cf,
+		       uint64_t timestamp)
+{
+	(void)timestamp;
+	handle_sdo(context, cf);
+}
+
+static void mux_call_signal_fn(struct co_drv* drv, co_pdo_signal_fn fn,
+			       const struct pdo_map* map,
+			       const struct can_frame* cf)
+{
+	uint64_t values[PDO_MAP_MAX_LENGTH];
+
+	if (pdo_map_unpack(map, values, cf->data, cf->can_dlc) < 0)
+		return;
+
+	fn(drv, values, map->length);
+}
+
+static void mux_call_tpdo_fn(struct co_drv* drv, int n,
+			     const struct can_frame* cf, uint64_t timestamp)
+{
+	struct co_pdo_frame pdo = {
+		.cob_id = cf->can_id & CAN_SFF_MASK,
+		.n = n + 1,
+		.data = cf->data,
+		.size = cf->can_dlc,
+		.timestamp = timestamp,
+		.sync_count = co_atomic_load_relaxed(&drv->node->bus->n_syncs),
+	};
+
+	drv->tpdo_fn(drv, &pdo);
+}
+
+/* Only the co_drv is read here, unless the frame is traced or published */
+static inline void mux_call_pdo_fn(struct co_drv* drv, int n,
+				   const struct can_frame* cf,
+				   uint64_t timestamp)
+{
+	/* On CAN FD sockets, cf points into a struct canfd_frame and can_dlc
+	 * holds the payload length.
+	 */
+	if (cf->can_dlc > CAN_MAX_DLEN && !(drv->options & CO_OPT_CAN_FD))
+		return;
+
+	drv->rx_timestamp = timestamp;
+
+	uint64_t start = driver_time_start();
+
+	if (drv->tpdo_fn)
+		mux_call_tpdo_fn(drv, n, cf, timestamp);
+
+	co_pdo_fn fn = drv->pdo_fn[n];
+	if (fn)
+		fn(drv, cf->data, cf->can_dlc);
+
+	co_pdo_signal_fn signal_fn = drv->tpdo_signal_fn[n];
+	if (signal_fn)
+		mux_call_signal_fn(drv, signal_fn, drv->tpdo_map[n], cf);
+
+	driver_time_end(drv->node, EVENT_TRACE_DRIVER_PDO, start);
+
+	event_rest_publish_pdo(drv->node, n, drv->tpdo_map[n], cf->data,
+			       cf->can_dlc);
+}
+
+static void mux_on_tpdo1(void* context, const struct can_frame* cf,
+			 uint64_t timestamp)
+{
+	mux_call_pdo_fn(context, 0, cf, timestamp);
+}
+
+static void mux_on_tpdo2(void* context, const struct can_frame* cf,
+			 uint64_t timestamp)
+{
+	mux_call_pdo_fn(context, 1, cf, timestamp);
+}
+
+static void mux_on_tpdo3(void* context, const struct can_frame* cf,
+			 uint64_t timestamp)
+{
+	mux_call_pdo_fn(context, 2, cf, timestamp);
+}
+
+static void mux_on_tpdo4(void* context, const struct can_frame* cf,
+			 uint64_t timestamp)
+{
+	mux_call_pdo_fn(context, 3, cf, timestamp);
+}
+
+#ifndef NO_MAREL_CODE
+static void mux_on_legacy_pdo(void* context, const struct can_frame* cf,
+			      uint64_t timestamp)
+{
+	if (cf->can_dlc > CAN_MAX_DLEN)
+		return;
+
+	struct canopen_msg msg;
+	if (canopen_get_object_type(&msg, cf) < 0)
+		return;
+
+	struct co_master_node* node = co_drv_node(context);
+
+	uint64_t start = driver_time_start();
+	handle_with_legacy(node, &msg, cf, timestamp);
+	driver_time_end(node, EVENT_TRACE_DRIVER_PDO, start);
+}
+#endif /* NO_MAREL_CODE */
+
+static const cob_table_fn mux_tpdo_handlers_[4] = {
+	mux_on_tpdo1, mux_on_tpdo2, mux_on_tpdo3, mux_on_tpdo4
+};
+
+/* The handler that calls the driver. TPDO handlers are all given the co_drv
+ * of the node.
+ */
+static cob_table_fn mux_get_driver_pdo_handler(const struct co_master_node* node,
+					       int n)
+{
+	const struct co_drv* drv = node->ndrv;
+
+	switch (node->driver_type) {
+	case CO_MASTER_DRIVER_NEW:
+		return drv->pdo_fn[n] || drv->tpdo_fn || drv->tpdo_signal_fn[n]
+		       ? mux_tpdo_handlers_[n] : NULL;
+#ifndef NO_MAREL_CODE
+	case CO_MASTER_DRIVER_LEGACY:
+		return mux_on_legacy_pdo;
+#endif /* NO_MAREL_CODE */
+	case CO_MASTER_DRIVER_NONE:
+	default:
+		break;
+	}
+
+	return NULL;
+}
+
+/* Pass the TPDO on to the executor of the node */
+static void mux_on_isolated_tpdo(void* context, const struct can_frame* cf,
+				 uint64_t timestamp)
+{
+	struct co_drv* drv = context;
+	struct co_master_node* node = co_drv_node(drv);
+	int n = ((cf->can_id & 0x780) - R_TPDO1) >> 8;
+
+	cob_table_fn fn = mux_get_driver_pdo_handler(node, n);
+	if (fn && drv_exec_post(node->exec, fn, drv, cf, timestamp) < 0)
+		count_driver_drop(node);
+}
+
+static cob_table_fn mux_get_pdo_handler(const struct co_master_node* node,
+					int n)
+{
+	if (!node->is_initialized)
+		return NULL;
+
+	cob_table_fn fn = mux_get_driver_pdo_handler(node, n);
+	return fn && node->exec ? mux_on_isolated_tpdo : fn;
+}
+
+static inline int is_tpdo_cob(uint32_t cob)
+{
+	switch (cob & 0x780) {
+	case R_TPDO1:
+	case R_TPDO2:
+	case R_TPDO3:
+	case R_TPDO4:
+		return 1;
+	}
+
+	return 0;
+}
+
+/* TPDOs are shared by mux_share_tpdo() whether or not they have a handler,
+ * so those that are collected into sync cycles must get through the filters
+ * even when no driver takes them one by one. The process image has those of
+ * every node in our range, with a driver or without.
+ */
+static int mux_is_shared_tpdo(const struct co_bus* bus, uint32_t cob)
+{
+	if (!is_tpdo_cob(cob))
+		return 0;
+
+	int nodeid = cob & 0x7f;
+	int n = ((cob & 0x780) - R_TPDO1) >> 8;
+
+	if (nodeid < nodeid_min() || nodeid > nodeid_max())
+		return 0;
+
+	return bus->process_image.map
+	    || sync_cycle_is_expected(&bus->sync_cycle, nodeid, n + 1);
+}
+
+/* Only let the kernel hand us frames that have a handler in the dispatch
+ * table or that are shared. Traffic for nodes outside our range, and PDOs
+ * that nothing has asked for, never wake us up, unless it is shared with
+ * local tools. The bus load meter has to see all of the traffic, so nothing
+ * is filtered while the load is measured.
+ */
+static int apply_mux_filters(struct co_bus* bus)
+{
+	if (bus->socket.type != SOCK_TYPE_CAN || bus->shm_ring.header
+	 || bus->socket.meter)
+		return 0;
+
+	pthread_mutex_lock(&bus->mux_filter_mutex);
+
+	int n = 0;
+	for (uint32_t cob = 0; cob <= CAN_SFF_MASK; ++cob)
+		if (cob_table_is_bound(&bus->mux_table, cob)
+		 || mux_is_shared_tpdo(bus, cob))
+			socketcan_make_sff_filter(&bus->mux_filters[n++], cob);
+
+	int rc = socketcan_apply_filters(bus->socket.fd, bus->mux_filters, n);
+
+	pthread_mutex_unlock(&bus->mux_filter_mutex);
+
+	if (rc < 0)
+		plog(LOG_ERROR, "apply_mux_filters: Failed to apply CAN filters on %s: %s",
+		     bus->iface, strerror(errno));
+
+	return rc;
+}
+
+/* Bring the PDO entries of the dispatch table and the socket filters up to
+ * date with the state of the node. This must be called whenever a driver is
+ * loaded or unloaded or its PDO or sync cycle callbacks change.
+ */
+void co__mux_update(struct co_master_node* node)
+{
+	int nodeid = co_master_get_node_id(node);
+	if (!(nodeid_min() <= nodeid && nodeid <= nodeid_max()))
+		return;
+
+	struct co_bus* bus = node->bus;
+	struct cob_table* table = &bus->mux_table;
+
+	cob_table_set_fn(table, R_TPDO1 + nodeid, mux_get_pdo_handler(node, 0));
+	cob_table_set_fn(table, R_TPDO2 + nodeid, mux_get_pdo_handler(node, 1));
+	cob_table_set_fn(table, R_TPDO3 + nodeid, mux_get_pdo_handler(node, 2));
+	cob_table_set_fn(table, R_TPDO4 + nodeid, mux_get_pdo_handler(node, 3));
+
+	if (bus->mux_table_is_ready)
+		apply_mux_filters(bus);
+}
+
+static void mux_bind(struct co_bus* bus, int cob, cob_table_fn fn,
+		     void* context)
+{
+	cob_table_set_context(&bus->mux_table, cob, context);
+	cob_table_set_fn(&bus->mux_table, cob, fn);
+}
+
+/* Default COB-IDs of SDO servers are usually relative to the node id, e.g.
+ * "$NODEID+0x640".
+ */
+static int eds_read_cob(uint32_t* dst, const struct canopen_eds* eds,
+			int nodeid, int index, int subindex)
+{
+	const struct eds_obj* obj = eds_obj_find(eds, index, subindex);
+	if (!obj || !obj->default_value)
+		return -1;
+
+	const char* str = obj->default_value;
+	uint32_t offset = 0;
+
+	if (strncasecmp(str, "$NODEID", 7) == 0) {
+		offset = nodeid;
+		str += 7;
+		if (*str == '+')
+			++str;
+	}
+
+	char* end = NULL;
+	*dst = offset + strtoul(str, &end, 0);
+	return end != str && *end == '\0' ? 0 : -1;
+}
+
+static int get_sdo_server_cob(uint32_t* dst, struct co_master_node* node,
+			      const struct canopen_eds* eds, int index,
+			      int subindex)
+{
+	errno = 0;
+	*dst = sdo_sync_read_u32(co_master_get_sdo_queue(node), index, subindex);
+	if (errno == 0)
+		return 0;
+
+	if (!eds)
+		return -1;
+
+	return eds_read_cob(dst, eds, co_master_get_node_id(node), index,
+			    subindex);
+}
+
+/* Bit 31 marks an SDO server as not in use and bit 29 means extended frames,
+ * which are not supported.
+ */
+static inline int is_valid_sdo_cob(uint32_t cob)
+{
+	return !(cob & (1UL << 31 | 1UL << 29));
+}
+
+static int add_sdo_channel(struct co_master_node* node,
+			   const struct canopen_eds* eds, int index)
+{
+	struct co_bus* bus = node->bus;
+	uint32_t request_cob, response_cob;
+
+	if (get_sdo_server_cob(&request_cob, node, eds, index, 1) < 0
+	 || get_sdo_server_cob(&response_cob, node, eds, index, 2) < 0)
+		return -1;
+
+	if (!is_valid_sdo_cob(request_cob) || !is_valid_sdo_cob(response_cob))
+		return -1;
+
+	request_cob &= CAN_SFF_MASK;
+	response_cob &= CAN_SFF_MASK;
+
+	/* Responses must be handled on the main thread, and SDO frames must
+	 * not be mistaken for anything else.
+	 */
+	if (is_tpdo_cob(response_cob)
+	 || cob_table_is_bound(&bus->mux_table, response_cob)) {
+		plog(LOG_WARNING, "add_sdo_channel: COB-ID 0x%03x of SDO server 0x%04x is already in use on %s",
+		     response_cob, index, bus->iface);
+		return -1;
+	}
+
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(node);
+	if (sdo_req_queue_add_channel(queue, request_cob, response_cob) < 0)
+		return -1;
+
+	mux_bind(bus, response_cob, mux_on_sdo, node);
+	return 0;
+}
+
+/* Extra channels are kept until the driver is unloaded */
+static void setup_sdo_channels(struct co_master_node* node)
+{
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(node);
+	if (queue->n_channels > 1)
+		return;
+
+	const struct canopen_eds* eds = co_master_find_eds(node);
+	int is_auto = node->cfg.n_sdo_channels == 0;
+
+	size_t n_channels = is_auto ? SDO_REQ_MAX_CHANNELS
+				    : node->cfg.n_sdo_channels;
+	if (n_channels > SDO_REQ_MAX_CHANNELS)
+		n_channels = SDO_REQ_MAX_CHANNELS;
+
+	/* Channels from the first one that never answered are left out */
+	if (is_auto && node->learned_n_sdo_channels != 0
+	 && n_channels > node->learned_n_sdo_channels)
+		n_channels = node->learned_n_sdo_channels;
+
+	for (size_t i = 1; i < n_channels; ++i) {
+		int index = 0x1200 + i;
+
+		if (is_auto && !(eds && eds_obj_find(eds, index, 1)))
+			break;
+
+		if (add_sdo_channel(node, eds, index) < 0)
+			break;
+	}
+
+	if (queue->n_channels == 1)
+		return;
+
+	struct co_bus* bus = node->bus;
+	if (bus->mux_table_is_ready)
+		apply_mux_filters(bus);
+
+	plog(LOG_DEBUG, "setup_sdo_channels: Using %zu SDO channels for node %d on %s",
+	     queue->n_channels, co_master_get_node_id(node), bus->iface);
+}
+
+static void remove_sdo_channels(struct co_master_node* node)
+{
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(node);
+	struct co_bus* bus = node->bus;
+
+	if (queue->n_channels == 1)
+		return;
+
+	for (size_t i = 1; i < queue->n_channels; ++i)
+		cob_table_set_fn(&bus->mux_table,
+				 queue->sdo_client[i].response_cob, NULL);
+
+	sdo_req_queue_remove_channels(queue);
+
+	if (bus->mux_table_is_ready)
+		apply_mux_filters(bus);
+}
+
+static void init_mux_table(struct co_bus* bus)
+{
+	int i;
+	struct cob_table* table = &bus->mux_table;
+
+	cob_table_init(table);
+
+	mux_bind(bus, R_NMT, mux_on_nmt, bus);
+
+	for_each_node(i) {
+		struct co_master_node* node = co_bus_get_node(bus, i);
+
+		mux_bind(bus, R_EMCY + i, mux_on_emcy, node);
+		mux_bind(bus, R_TSDO + i, mux_on_sdo, node);
+		mux_bind(bus, R_HEARTBEAT + i, mux_on_heartbeat, node);
+
+		cob_table_set_context(table, R_TPDO1 + i, node->ndrv);
+		cob_table_set_context(table, R_TPDO2 + i, node->ndrv);
+		cob_table_set_context(table, R_TPDO3 + i, node->ndrv);
+		cob_table_set_context(table, R_TPDO4 + i, node->ndrv);
+
+		co__mux_update(node);
+	}
+
+	bus->mux_table_is_ready = 1;
+	apply_mux_filters(bus);
+}
+
+static inline int mux_is_tpdo(const struct can_frame* cf)
+{
+	if (cf->can_id & (CAN_RTR_FLAG | CAN_EFF_FLAG | CAN_ERR_FLAG))
+		return 0;
+
+	return is_tpdo_cob(cf->can_id);
+}
+
+static inline void mux_share_tpdo(struct co_bus* bus,
+				  const struct can_frame* cf,
+				  uint64_t timestamp)
+{
+	if (!mux_is_tpdo(cf))
+		return;
+
+	int nodeid = cf->can_id & 0x7f;
+	int n = ((cf->can_id & 0x780) - R_TPDO1) >> 8;
+
+	if (nodeid == 0)
+		return;
+
+	if (bus->process_image.map)
+		process_image_write(&bus->process_image, nodeid, n + 1,
+				    cf->data, cf->can_dlc, timestamp);
+
+	if (sync_cycle_is_expected(&bus->sync_cycle, nodeid, n + 1))
+		sync_cycle_add(&bus->sync_cycle, nodeid, n + 1, cf->data,
+			       cf->can_dlc, timestamp);
+}
+
+static inline void mux_count(struct co_bus* bus, const struct can_frame* cf,
+			     uint64_t timestamp)
+{
+	node_stats_count_frame(bus->stats, cf, timestamp);
+
+	/* Error frames are made up by the driver and take no bus time */
+	if (bus->socket.meter && !(cf->can_id & CAN_ERR_FLAG))
+		bl_meter_count(bus->socket.meter, cf);
+}
+
+/* FD frames do not fit into the shared ring and are left out */
+static inline void mux_share(struct co_bus* bus, const struct can_frame* cf,
+			     uint64_t timestamp)
+{
+	if (bus->shm_ring.header && cf->can_dlc <= CAN_MAX_DLEN)
+		shm_ring_write(&bus->shm_ring, cf, timestamp);
+
+	mux_share_tpdo(bus, cf, timestamp);
+}
+
+static inline void mux_share_done(struct co_bus* bus)
+{
+	if (bus->shm_ring.header)
+		shm_ring_publish(&bus->shm_ring);
+}
+
+static uint64_t can_restart_deadline(const struct co_bus* bus)
+{
+	uint64_t since = bus->can_errors.bus_off_time;
+	if (bus->last_can_restart > since)
+		since = bus->last_can_restart;
+
+	return since + cfg.can_restart_delay * 1000ULL;
+}
+
+/* Background SDOs are held until the controller has been clear of errors for
+ * a while. The timer ends the hold, or restarts the controller if it is off
+ * the bus and that is up to us.
+ */
+static void update_can_error_hold(struct co_bus* bus)
+{
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	uint64_t until = can_errors_hold_until(&bus->can_errors, now);
+
+	sdo_throttle_hold(&bus->sdo_throttle, until > now);
+
+	if (can_errors_is_bus_off(&bus->can_errors) && cfg.can_restart_delay > 0)
+		until = can_restart_deadline(bus);
+
+	mloop_timer_stop(bus->can_error_timer);
+
+	if (until == UINT64_MAX)
+		return;
+
+	mloop_timer_set_time(bus->can_error_timer,
+			     (until > now ? until - now : 1) * 1000ULL);
+	mloop_timer_start(bus->can_error_timer);
+}
+
+static void restart_can_controller(struct co_bus* bus, uint64_t now)
+{
+	bus->last_can_restart = now;
+
+	if (socketcan_restart(bus->iface) < 0) {
+		plog(LOG_ERROR, "%s: Could not restart the CAN controller: %s",
+		     bus->iface, strerror(errno));
+		return;
+	}
+
+	plog(LOG_NOTICE, "%s: Restarting the CAN controller", bus->iface);
+}
+
+static void on_can_error_timeout(struct mloop_timer* timer)
+{
+	struct co_bus* bus = mloop_timer_get_context(timer);
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+
+	if (can_errors_is_bus_off(&bus->can_errors) && cfg.can_restart_delay > 0
+	 && now >= can_restart_deadline(bus))
+		restart_can_controller(bus, now);
+
+	update_can_error_hold(bus);
+}
+
+static void on_can_error_frame(struct co_bus* bus, const struct can_frame* cf)
+{
+	struct can_errors* errors = &bus->can_errors;
+	enum can_errors_state old_state = errors->state;
+
+	if (can_errors_on_frame(errors, cf, gettime_us(CLOCK_MONOTONIC)) > 0)
+		plog(errors->state > old_state ? LOG_WARNING : LOG_NOTICE,
+		     "%s: CAN controller went from %s to %s; tx errors: %u, rx errors: %u",
+		     bus->iface, can_errors_state_to_string(old_state),
+		     can_errors_state_to_string(errors->state),
+		     errors->tx_errors, errors->rx_errors);
+
+	update_can_error_hold(bus);
+}
+
+/* Only ever called on the main loop */
+static inline void mux_dispatch(struct co_bus* bus, const struct can_frame* cf,
+				uint64_t timestamp)
+{
+	if (cf->can_id & CAN_ERR_FLAG) {
+		if (bus->can_error_timer)
+			on_can_error_frame(bus, cf);
+		return;
+	}
+
+	cob_table_dispatch(&bus->mux_table, cf, timestamp);
+}
+
+static void mux_on_frame(struct co_bus* bus, const struct can_frame* cfs,
+			 const uint64_t* timestamps, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		mux_share(bus, &cfs[i], timestamps[i]);
+		mux_count(bus, &cfs[i], timestamps[i]);
+		mux_dispatch(bus, &cfs[i], timestamps[i]);
+	}
+
+	mux_share_done(bus);
+}
+
+static void mux_handler_fn(struct mloop_socket* self)
+{
+	struct co_bus* bus = mloop_socket_get_context(self);
+	struct can_frame cfs[MUX_BATCH_SIZE];
+	uint64_t timestamps[MUX_BATCH_SIZE];
+
+	while (1) {
+		ssize_t n = sock_recv_batch(&bus->socket, cfs, timestamps,
+					    MUX_BATCH_SIZE, MSG_DONTWAIT);
+		if (n == 0)
+			mloop_socket_stop(self);
+
+		if (n <= 0)
+			return;
+
+		mux_on_frame(bus, cfs, timestamps, n);
+
+		if (n < MUX_BATCH_SIZE)
+			return;
+	}
+}
+
+static void mux_fd_handler_fn(struct mloop_socket* self)
+{
+	struct co_bus* bus = mloop_socket_get_context(self);
+	struct canfd_frame cfs[MUX_BATCH_SIZE];
+	uint64_t timestamps[MUX_BATCH_SIZE];
+
+	while (1) {
+		ssize_t n = sock_recv_fd_batch(&bus->socket, cfs, timestamps,
+					       MUX_BATCH_SIZE, MSG_DONTWAIT);
+		if (n == 0)
+			mloop_socket_stop(self);
+
+		if (n <= 0)
+			return;
+
+		/* The header of an FD frame has the same layout as that of a
+		 * classic frame, with the length in place of the dlc.
+		 */
+		for (ssize_t i = 0; i < n; ++i) {
+			const struct can_frame* cf =
+				(const struct can_frame*)&cfs[i];
+
+			mux_share(bus, cf, timestamps[i]);
+			mux_count(bus, cf, timestamps[i]);
+			mux_dispatch(bus, cf, timestamps[i]);
+		}
+
+		mux_share_done(bus);
+
+		if (n < MUX_BATCH_SIZE)
+			return;
+	}
+}
+
+static ssize_t pdo_thread_recv(struct co_bus* bus, struct canfd_frame* buffer,
+			       uint64_t* timestamps, int flags)
+{
+	if (bus->socket.is_fd)
+		return sock_recv_fd_batch(&bus->socket, buffer, timestamps,
+					  MUX_BATCH_SIZE, flags);
+
+	return sock_recv_batch(&bus->socket, (struct can_frame*)buffer,
+			       timestamps, MUX_BATCH_SIZE, flags);
+}
+
+static inline const struct can_frame*
+pdo_thread_get_frame(const struct co_bus* bus,
+		     const struct canfd_frame* buffer, ssize_t i)
+{
+	if (bus->socket.is_fd)
+		return (const struct can_frame*)&buffer[i];
+
+	return &((const struct can_frame*)buffer)[i];
+}
+
+static void pdo_thread_dispatch(struct co_bus* bus,
+				const struct canfd_frame* buffer,
+				const uint64_t* timestamps, ssize_t n)
+{
+	int have_forwarded = 0;
+
+	pthread_mutex_lock(&bus->pdo_lock);
+
+	for (ssize_t i = 0; i < n; ++i) {
+		const struct can_frame* cf = pdo_thread_get_frame(bus, buffer, i);
+
+		mux_share(bus, cf, timestamps[i]);
+		mux_count(bus, cf, timestamps[i]);
+
+		if (mux_is_tpdo(cf))
+			cob_table_dispatch(&bus->mux_table, cf, timestamps[i]);
+		else if (frame_ring_push(&bus->rx_ring, cf, timestamps[i]) == 0)
+			have_forwarded = 1;
+	}
+
+	pthread_mutex_unlock(&bus->pdo_lock);
+
+	mux_share_done(bus);
+
+	if (have_forwarded) {
+		uint64_t one = 1;
+		ssize_t __unused rc = write(bus->rx_eventfd, &one, sizeof(one));
+	}
+}
+
+/* PDO handlers should not be interrupted in the middle, so cancellation is
+ * only allowed while waiting for frames.
+ */
+static void* run_pdo_thread(void* context)
+{
+	struct co_bus* bus = context;
+	struct canfd_frame buffer[MUX_BATCH_SIZE];
+	uint64_t timestamps[MUX_BATCH_SIZE];
+	ssize_t n;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (1) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		n = pdo_thread_recv(bus, buffer, timestamps, 0);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		pdo_thread_dispatch(bus, buffer, timestamps, n);
+	}
+
+	if (bus->state != CO_BUS_STATE_STOPPING)
+		plog(LOG_ERROR, "%s: PDO thread stopped receiving: %s",
+		     bus->iface, n == 0 ? "connection closed" : strerror(errno));
+
+	return NULL;
+}
+
+static void on_rx_ring_ready(struct mloop_socket* self)
+{
+	struct co_bus* bus = mloop_socket_get_context(self);
+	uint64_t count;
+
+	/* The counter is reset before the ring is drained so that no wake-up
+	 * is lost.
+	 */
+	if (read(bus->rx_eventfd, &count, sizeof(count)) < 0)
+		return;
+
+	const struct frame_ring_entry* entry;
+	while ((entry = frame_ring_peek(&bus->rx_ring))) {
+		mux_dispatch(bus, &entry->cf, entry->timestamp);
+		frame_ring_consume(&bus->rx_ring);
+	}
+}
+
+/* The receiving end of the socket is serviced off the main loop, and
+ * anything but TPDOs is passed on to it.
+ */
+static int start_rx_forwarding(struct co_bus* bus)
+{
+	if (frame_ring_init(&bus->rx_ring, PDO_THREAD_RING_SIZE) < 0)
+		return -1;
+
+	bus->rx_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (bus->rx_eventfd < 0)
+		goto eventfd_failure;
+
+	struct mloop_socket* handler = mloop_socket_new(mloop_default());
+	if (!handler)
+		goto handler_failure;
+
+	mloop_socket_set_fd(handler, bus->rx_eventfd);
+	mloop_socket_set_context(handler, bus, NULL);
+	mloop_socket_set_callback(handler, on_rx_ring_ready);
+
+	if (mloop_socket_start(handler) < 0)
+		goto handler_start_failure;
+
+	pthread_mutex_init(&bus->pdo_lock, NULL);
+
+	bus->mux_handler = handler;
+	bus->is_rx_forwarded = 1;
+	return 0;
+
+handler_start_failure:
+	mloop_socket_set_fd(handler, -1);
+	mloop_socket_unref(handler);
+handler_failure:
+	close(bus->rx_eventfd);
+eventfd_failure:
+	frame_ring_destroy(&bus->rx_ring);
+	return -1;
+}
+
+static void stop_rx_forwarding(struct co_bus* bus)
+{
+	if (!bus->is_rx_forwarded)
+		return;
+
+	uint64_t n_dropped = frame_ring_get_n_dropped(&bus->rx_ring);
+	if (n_dropped > 0)
+		plog(LOG_WARNING, "%s: %llu frames were dropped because the main loop fell behind the receiver",
+		     bus->iface, (unsigned long long)n_dropped);
+
+	mloop_socket_stop(bus->mux_handler);
+	mloop_socket_set_fd(bus->mux_handler, -1);
+	mloop_socket_unref(bus->mux_handler);
+	bus->mux_handler = NULL;
+
+	pthread_mutex_destroy(&bus->pdo_lock);
+	close(bus->rx_eventfd);
+	frame_ring_destroy(&bus->rx_ring);
+	bus->is_rx_forwarded = 0;
+}
+
+static int start_pdo_thread(struct co_bus* bus)
+{
+	if (start_rx_forwarding(bus) < 0)
+		return -1;
+
+	if (rt_thread_create(&bus->pdo_thread, RT_THREAD_PDO,
+			     run_pdo_thread, bus, bus->iface) < 0) {
+		stop_rx_forwarding(bus);
+		return -1;
+	}
+
+	bus->have_pdo_thread = 1;
+	return 0;
+}
+
+static void stop_pdo_thread(struct co_bus* bus)
+{
+	if (!bus->have_pdo_thread)
+		return;
+
+	pthread_cancel(bus->pdo_thread);
+	pthread_join(bus->pdo_thread, NULL);
+	bus->have_pdo_thread = 0;
+}
+
+static void on_rx_reactor_data(struct mloop_socket* self)
+{
+	struct co_bus* bus = mloop_socket_get_context(self);
+	struct canfd_frame buffer[MUX_BATCH_SIZE];
+	uint64_t timestamps[MUX_BATCH_SIZE];
+
+	while (1) {
+		ssize_t n = pdo_thread_recv(bus, buffer, timestamps,
+					    MSG_DONTWAIT);
+		if (n == 0)
+			mloop_socket_stop(self);
+
+		if (n <= 0)
+			return;
+
+		pdo_thread_dispatch(bus, buffer, timestamps, n);
+
+		if (n < MUX_BATCH_SIZE)
+			return;
+	}
+}
+
+/* Like the PDO thread, but on the CAN reactor */
+static int start_rx_reactor(struct co_bus* bus)
+{
+	if (start_rx_forwarding(bus) < 0)
+		return -1;
+
+	struct mloop_socket* handler = mloop_socket_new(reactor_get(REACTOR_CAN));
+	if (!handler)
+		goto failure;
+
+	mloop_socket_set_fd(handler, bus->socket.fd);
+	mloop_socket_set_context(handler, bus, NULL);
+	mloop_socket_set_callback(handler, on_rx_reactor_data);
+
+	if (mloop_socket_start(handler) < 0)
+		goto start_failure;
+
+	bus->rx_handler = handler;
+	return 0;
+
+start_failure:
+	mloop_socket_set_fd(handler, -1);
+	mloop_socket_unref(handler);
+failure:
+	stop_rx_forwarding(bus);
+	return -1;
+}
+
+/* The reactors have been stopped by now */
+static void stop_rx_reactor(struct co_bus* bus)
+{
+	if (!bus->rx_handler)
+		return;
+
+	mloop_socket_stop(bus->rx_handler);
+	mloop_socket_set_fd(bus->rx_handler, -1);
+	mloop_socket_unref(bus->rx_handler);
+	bus->rx_handler = NULL;
+}
+
+static void flush_tx_queues(void* context)
+{
+	(void)context;
+
+	struct co_bus* bus;
+	for_each_bus(bus)
+		sock_flush(&bus->socket);
+}
+
+static int init_multiplexer(struct co_bus* bus)
+{
+	init_mux_table(bus);
+
+	if (cfg.pdo_thread_priority > 0)
+		return start_pdo_thread(bus);
+
+	if (!reactor_is_default(REACTOR_CAN))
+		return start_rx_reactor(bus);
+
+	struct mloop_socket* handler = mloop_socket_new(mloop_default());
+	if (!handler)
+		return -1;
+
+	bus->mux_handler = handler;
+
+	mloop_socket_set_fd(handler, bus->socket.fd);
+	mloop_socket_set_context(handler, bus, NULL);
+	mloop_socket_set_callback(handler, bus->socket.is_fd ? mux_fd_handler_fn
+							     : mux_handler_fn);
+
+	return mloop_socket_start(handler);
+}
+
+static void run_bootup(struct co_bus* bus)
+{
+	int i;
+	event_trace_async_begin(EVENT_TRACE_LOAD_DRIVERS, bus->index,
+				bus->index);
+
+	bus->is_waiting_for_drivers = 1;
+
+	for_each_node(i)
+		if (bus->nodes_seen[i])
+			schedule_load_driver(co_bus_get_node(bus, i));
+
+	if (bus->n_scheduled_bootups == 0)
+		on_drivers_loaded(bus);
+}
+
+static void load_late_nodes(struct co_bus* bus)
+{
+	int i;
+	for_each_node(i)
+		if (bus->nodes_seen_late[i]) {
+			alog(LOG_WARNING, "Node %d on %s was late", i,
+			     bus->iface);
+			schedule_load_driver(co_bus_get_node(bus, i));
+		}
+}
+
+/* Called on the SYNC producer thread, so the latched RPDOs go out right
+ * behind the SYNC frame.
+ */
+static void flush_sync_rpdos(void* context)
+{
+	struct co_bus* bus = context;
+	int i;
+
+	uint64_t sync_count = co_atomic_add_relaxed(&bus->n_syncs, 1);
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+
+	if (sync_cycle_end(&bus->sync_cycle, sync_count - 1, now) > 0)
+		mloop_idle_notify(bus->sync_cycle_job);
+
+	pthread_mutex_lock(&bus->sync_lock);
+
+	bus->last_sync_time = now;
+
+	for_each_node(i) {
+		struct co_master_node* node = co_bus_get_node(bus, i);
+
+		for (int n = 0; n < 4; ++n) {
+			if (!node->is_sync_rpdo_latched[n])
+				continue;
+
+			sock_stage(&bus->socket, &node->sync_rpdo[n]);
+			node->is_sync_rpdo_latched[n] = 0;
+		}
+	}
+
+	pthread_mutex_unlock(&bus->sync_lock);
+}
+
+static void call_sync_cycle_fn(struct co_master_node* node,
+			       const struct sync_cycle_snapshot* snapshot)
+{
+	int nodeid = co_master_get_node_id(node);
+	unsigned int expected = snapshot->expected[nodeid];
+	unsigned int received = snapshot->received[nodeid] & expected;
+
+	struct co_sync_cycle cycle = {
+		.sync_count = snapshot->sync_count,
+		.received = received,
+		.missing = expected & ~received,
+	};
+
+	for (int n = 0; n < 4; ++n) {
+		if (!(received & (1 << n)))
+			continue;
+
+		const struct sync_cycle_pdo* pdo = &snapshot->pdo[nodeid][n];
+		cycle.pdo[n].data = pdo->data;
+		cycle.pdo[n].size = pdo->size;
+		cycle.pdo[n].timestamp = pdo->timestamp;
+	}
+
+	uint64_t start = driver_time_start();
+	node->ndrv->sync_cycle_fn(node->ndrv, &cycle);
+	driver_time_end(node, EVENT_TRACE_DRIVER_PDO, start);
+}
+
+/* Runs on the main loop after a SYNC cycle has ended. If the loop falls
+ * behind, only the last cycle is handed out.
+ */
+static void on_sync_cycle(struct mloop_idle* idle)
+{
+	struct co_bus* bus = mloop_idle_get_context(idle);
+	struct sync_cycle_snapshot* snapshot = &bus->sync_cycle_snapshot;
+	int i;
+
+	if (sync_cycle_read(&bus->sync_cycle, snapshot) < 0)
+		return;
+
+	if (snapshot->sync_count + 1 == bus->last_sync_cycle)
+		return;
+
+	bus->last_sync_cycle = snapshot->sync_count + 1;
+
+	for_each_node(i) {
+		struct co_master_node* node = co_bus_get_node(bus, i);
+
+		if (!snapshot->expected[i] || !node->is_initialized
+		    || node->driver_type != CO_MASTER_DRIVER_NEW
+		    || !node->ndrv->sync_cycle_fn)
+			continue;
+
+		call_sync_cycle_fn(node, snapshot);
+	}
+}
+
+static int start_sync_cycle_job(struct co_bus* bus)
+{
+	bus->sync_cycle_job = mloop_idle_new(mloop_default());
+	if (!bus->sync_cycle_job)
+		return -1;
+
+	mloop_idle_set_idle_fn(bus->sync_cycle_job, on_sync_cycle);
+	mloop_idle_set_context(bus->sync_cycle_job, bus, NULL);
+	mloop_idle_start(bus->sync_cycle_job);
+	return 0;
+}
+
+static void stop_sync_cycle_job(struct co_bus* bus)
+{
+	if (!bus->sync_cycle_job)
+		return;
+
+	mloop_idle_stop(bus->sync_cycle_job);
+	mloop_idle_unref(bus->sync_cycle_job);
+	bus->sync_cycle_job = NULL;
+}
+
+static int start_sync_producer(struct co_bus* bus)
+{
+	struct sync_producer* producer = &bus->sync_producer;
+
+	if (cfg.sync_interval == 0 || bus->have_sync_producer)
+		return 0;
+
+	if (start_sync_cycle_job(bus) < 0)
+		return -1;
+
+	if (sync_producer_init(producer, &bus->socket, cfg.sync_interval) < 0) {
+		stop_sync_cycle_job(bus);
+		return -1;
+	}
+
+	sync_producer_set_counter_overflow(producer, cfg.sync_counter_overflow);
+	sync_producer_set_callback(producer, flush_sync_rpdos, bus);
+
+	if (sync_producer_start(producer) < 0) {
+		plog(LOG_ERROR, "%s: Could not start SYNC producer: %s",
+		     bus->iface, strerror(errno));
+		sync_producer_destroy(producer);
+		stop_sync_cycle_job(bus);
+		return -1;
+	}
+
+	bus->have_sync_producer = 1;
+	return 0;
+}
+
+static void stop_sync_producer(struct co_bus* bus)
+{
+	if (!bus->have_sync_producer)
+		return;
+
+	sync_producer_destroy(&bus->sync_producer);
+	stop_sync_cycle_job(bus);
+	bus->have_sync_producer = 0;
+}
+
+static inline unsigned long long bootup_ms(uint64_t start, uint64_t stop)
+{
+	return (stop - start) / 1000ULL;
+}
+
+/* The critical path of the boot-up: the nodes that were started last, and
+ * what held them up
+ */
+static void log_slowest_nodes(struct co_bus* bus)
+{
+	int nodeids[BOOTUP_N_LOGGED];
+	char buffer[512];
+
+	size_t n = bootup_timeline_rank(bus->bootup, nodeids, BOOTUP_N_LOGGED);
+	if (n == 0)
+		return;
+
+	bootup_timeline_describe_phases(buffer, sizeof(buffer), bus->bootup);
+	plog(LOG_INFO, "%s: Longest boot-up phases: %s", bus->iface, buffer);
+
+	for (size_t i = 0; i < n; ++i) {
+		bootup_timeline_describe(buffer, sizeof(buffer),
+					 &bus->bootup[nodeids[i]]);
+		plog(LOG_INFO, "%s: Node %d was ready after %s", bus->iface,
+		     nodeids[i], buffer);
+	}
+}
+
+static void log_bootup_time(struct co_bus* bus)
+{
+	bus->bootup_time.nodes_started = gettime_us(CLOCK_MONOTONIC);
+
+	plog(LOG_INFO, "%s: Boot-up took %llu ms (probe: %llu ms, drivers: %llu ms, start: %llu ms)",
+	     bus->iface,
+	     bootup_ms(bus->bootup_time.start, bus->bootup_time.nodes_started),
+	     bootup_ms(bus->bootup_time.start, bus->bootup_time.probe_done),
+	     bootup_ms(bus->bootup_time.probe_done,
+		       bus->bootup_time.drivers_loaded),
+	     bootup_ms(bus->bootup_time.drivers_loaded,
+		       bus->bootup_time.nodes_started));
+
+	log_slowest_nodes(bus);
+}
+
+/* The boot-up trace is dumped when the last bus has finished booting so that
+ * it covers all of them.
+ */
+static int is_any_bus_starting(void)
+{
+	struct co_bus* bus;
+	for_each_bus(bus)
+		if (bus->state == CO_BUS_STATE_STARTUP)
+			return 1;
+
+	return 0;
+}
+
+static inline int is_startable(struct co_bus* bus, int nodeid)
+{
+	return co_bus_get_node(bus, nodeid)->driver_type != CO_MASTER_DRIVER_NONE;
+}
+
+/* A broadcast starts every node on the net, so the nodes that were seen but
+ * have no driver are stopped again right after it.
+ */
+static void send_broadcast_start(struct co_bus* bus)
+{
+	int i;
+
+	co_net_stage_nmt(&bus->socket, NMT_CS_START, 0);
+
+	for_each_node(i)
+		if (bus->nodes_seen[i] && !is_startable(bus, i))
+			co_net_stage_nmt(&bus->socket, NMT_CS_STOP, i);
+
+	sock_flush(&bus->socket);
+}
+
+/* Starts the nodes with drivers from first up to, but not including, end */
+static void start_nodes(struct co_bus* bus, int first, int end,
+			int is_broadcast)
+{
+	/* We start each node individually unless told otherwise because we
+	 * don't want to start nodes that were not properly registered.
+	 */
+	event_trace_begin(EVENT_TRACE_START_NODES, bus->index);
+
+	if (is_broadcast) {
+		send_broadcast_start(bus);
+	} else {
+		for (int i = end - 1; i >= first; --i)
+			if (is_startable(bus, i))
+				co_net_stage_nmt(&bus->socket, NMT_CS_START, i);
+
+		sock_flush(&bus->socket);
+	}
+
+	for (int i = first; i < end; ++i)
+		if (is_startable(bus, i))
+			start_nodeguarding(co_bus_get_node(bus, i));
+
+	for (int i = first; i < end; ++i)
+		call_start_fn(co_bus_get_node(bus, i));
+
+	event_trace_end(EVENT_TRACE_START_NODES, bus->index);
+}
+
+static void finish_starting_nodes(struct co_bus* bus)
+{
+	event_trace_async_end(EVENT_TRACE_BOOTUP, bus->index, bus->index);
+
+	bus->state = CO_BUS_STATE_RUNNING;
+	log_bootup_time(bus);
+
+	load_late_nodes(bus);
+
+	start_sync_producer(bus);
+
+	if (cfg.enable_bootup_trace && !is_any_bus_starting())
+		dump_tracebuffer("bootup");
+}
+
+/* Returns the end of the group of size nodes with drivers that begins at
+ * first, or first if there are none left.
+ */
+static int find_start_group_end(struct co_bus* bus, int first,
+				unsigned int size)
+{
+	unsigned int n = 0;
+	int i = first;
+
+	for (; i <= nodeid_max() && n < size; ++i)
+		if (is_startable(bus, i))
+			++n;
+
+	return n > 0 ? i : first;
+}
+
+static void stop_start_timer(struct co_bus* bus)
+{
+	struct mloop_timer* timer = bus->start_timer;
+	if (!timer)
+		return;
+
+	mloop_timer_stop(timer);
+	mloop_timer_unref(timer);
+	bus->start_timer = NULL;
+}
+
+static int start_next_group(struct co_bus* bus)
+{
+	int first = bus->next_start;
+	int end = find_start_group_end(bus, first, cfg.start_group_size);
+
+	start_nodes(bus, first, end, 0);
+	bus->next_start = end;
+
+	return find_start_group_end(bus, end, 1) > end;
+}
+
+static void on_start_group_timeout(struct mloop_timer* timer)
+{
+	struct co_bus* bus = mloop_timer_get_context(timer);
+
+	if (start_next_group(bus))
+		return;
+
+	stop_start_timer(bus);
+	finish_starting_nodes(bus);
+}
+
+/* The first group is started at once, and the timer starts the rest one at a
+ * time so that their PDOs do not all begin in the same instant.
+ */
+static int start_groups(struct co_bus* bus)
+{
+	bus->next_start = nodeid_min();
+
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		return -1;
+
+	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_context(timer, bus, NULL);
+	mloop_timer_set_time(timer, cfg.start_group_delay * 1000000LL);
+	mloop_timer_set_callback(timer, on_start_group_timeout);
+
+	if (!start_next_group(bus)) {
+		mloop_timer_unref(timer);
+		finish_starting_nodes(bus);
+		return 0;
+	}
+
+	if (mloop_timer_start(timer) < 0) {
+		mloop_timer_unref(timer);
+		return -1;
+	}
+
+	bus->start_timer = timer;
+	return 0;
+}
+
+/* Nodes are started in groups if a group size is set, with one broadcast if
+ * that is set and the master has the whole net, and one at a time otherwise.
+ */
+static void start_all_nodes(struct co_bus* bus)
+{
+	if (bus->start_timer)
+		return;
+
+	if (cfg.start_group_size > 0) {
+		if (start_groups(bus) >= 0)
+			return;
+
+		plog(LOG_ERROR, "%s: Could not start nodes in groups; starting the rest at once",
+		     bus->iface);
+		start_nodes(bus, bus->next_start, nodeid_max() + 1, 0);
+		finish_starting_nodes(bus);
+		return;
+	}
+
+	int is_broadcast = cfg.broadcast_start
+			&& cfg.range_start == 0 && cfg.range_stop == 0;
+
+	start_nodes(bus, nodeid_min(), nodeid_max() + 1, is_broadcast);
+	finish_starting_nodes(bus);
+}
+
+/* The nodes of a bus that was handed over are still operational, so only the
+ * master's side of starting them is done. Those that the last process had not
+ * started are started as usual.
+ */
+static void resume_nodes(struct co_bus* bus)
+{
+	event_trace_begin(EVENT_TRACE_START_NODES, bus->index);
+
+	for (int i = nodeid_min(); i <= nodeid_max(); ++i) {
+		if (!is_startable(bus, i))
+			continue;
+
+		struct co_master_node* node = co_bus_get_node(bus, i);
+
+		if (!bus->nodes_running[i]) {
+			start_single_node(node);
+			continue;
+		}
+
+		start_nodeguarding(node);
+		call_start_fn(node);
+	}
+
+	event_trace_end(EVENT_TRACE_START_NODES, bus->index);
+
+	bus->is_adopted = 0;
+	finish_starting_nodes(bus);
+}
+
+static void on_drivers_loaded(struct co_bus* bus)
+{
+	bus->is_waiting_for_drivers = 0;
+	bus->bootup_time.drivers_loaded = gettime_us(CLOCK_MONOTONIC);
+	event_trace_async_end(EVENT_TRACE_LOAD_DRIVERS, bus->index,
+			      bus->index);
+
+	save_identities(bus);
+
+	if (bus->is_adopted)
+		resume_nodes(bus);
+	else if (bus->n_inhibited_starts == 0)
+		start_all_nodes(bus);
+}
+
+static void on_net_probe_done(struct mloop_work* self)
+{
+	struct co_bus* bus = mloop_work_get_context(self);
+
+	bus->bootup_time.probe_done = gettime_us(CLOCK_MONOTONIC);
+	event_trace_async_end(EVENT_TRACE_PROBE, bus->index, bus->index);
+
+	int __unused rc = init_multiplexer(bus);
+	assert(rc == 0);
+
+	run_bootup(bus);
+}
+
+static int init_thread_sched(enum rt_thread_role role, const char* name,
+			     const char* str, unsigned int priority)
+{
+	struct rt_thread_sched sched;
+	char fifo[32];
+
+	if (!str[0] && priority > 0) {
+		snprintf(fifo, sizeof(fifo), "fifo:%u", priority);
+		str = fifo;
+	}
+
+	if (rt_thread_parse_sched(&sched, str) < 0) {
+		fprintf(stderr, "Invalid scheduling for %s: \"%s\"\n", name, str);
+		return -1;
+	}
+
+	rt_thread_set_sched(role, &sched);
+	return 0;
+}
+
+/* Must come before any of the threads are started */
+static int init_thread_scheds(void)
+{
+	if (init_thread_sched(RT_THREAD_MAIN, "main_sched", cfg.main_sched, 0) < 0
+	 || init_thread_sched(RT_THREAD_WORKER, "worker_sched",
+			      cfg.worker_sched, 0) < 0
+	 || init_thread_sched(RT_THREAD_SYNC, "sync_sched", cfg.sync_sched,
+			      cfg.sync_thread_priority) < 0
+	 || init_thread_sched(RT_THREAD_PDO, "pdo_sched", cfg.pdo_sched,
+			      cfg.pdo_thread_priority) < 0
+	 || init_thread_sched(RT_THREAD_RECORDER, "recorder_sched",
+			      cfg.recorder_sched, 0) < 0
+	 || init_thread_sched(RT_THREAD_LOG, "log_sched", cfg.log_sched, 0) < 0
+	 || init_thread_sched(RT_THREAD_DRIVER, "driver_sched",
+			      cfg.driver_sched, 0) < 0)
+		return -1;
+
+	const struct rt_thread_sched* worker =
+		rt_thread_get_sched(RT_THREAD_WORKER);
+	mloop_set_worker_sched(worker->policy, worker->priority,
+			       CPU_COUNT(&worker->cpus) > 0 ? &worker->cpus
+							    : NULL);
+	return 0;
+}
+
+/* A bus that was handed over is not probed. The nodes that the last process
+ * had seen are loaded from what it knew of them.
+ */
+static int resume_bus(struct co_bus* bus)
+{
+	bus->bootup_time.probe_done = gettime_us(CLOCK_MONOTONIC);
+	event_trace_async_end(EVENT_TRACE_PROBE, bus->index, bus->index);
+
+	if (init_multiplexer(bus) < 0)
+		return -1;
+
+	run_bootup(bus);
+	return 0;
+}
+
+static int start_bus_bootup(struct co_bus* bus)
+{
+	bus->bootup_time.start = gettime_us(CLOCK_MONOTONIC);
+
+	for (int i = 0; i <= CANOPEN_NODEID_MAX; ++i)
+		bootup_timeline_start(&bus->bootup[i], bus->bootup_time.start);
+
+	event_trace_async_begin(EVENT_TRACE_BOOTUP, bus->index, bus->index);
+	event_trace_async_begin(EVENT_TRACE_PROBE, bus->index, bus->index);
+
+	if (bus->is_adopted)
+		return resume_bus(bus);
+
+	struct mloop_work* work = mloop_work_new(mloop_default());
+	if (!work)
+		return -1;
+
+	mloop_work_set_context(work, bus, NULL);
+	mloop_work_set_work_fn(work, run_net_probe);
+	mloop_work_set_done_fn(work, on_net_probe_done);
+
+	int rc = mloop_work_start(work);
+	mloop_work_unref(work);
+
+	return rc;
+}
+
+/* The buses are probed in parallel on the worker threads */
+/* The context is the name of the node followed by the name of its profile's
+ * driver, which is used if there is no driver by that name
+ */
+static void run_driver_preload(struct mloop_work* work)
+{
+	const char* name = mloop_work_get_context(work);
+	const char* profile = name + strlen(name) + 1;
+
+	if (drv_registry_preload(name) < 0)
+		drv_registry_preload(profile);
+}
+
+static int schedule_driver_preload(const struct node_identity* identity)
+{
+	char buffer[sizeof(identity->name) + 16];
+	size_t length = strlen(identity->name);
+
+	memcpy(buffer, identity->name, length + 1);
+	snprintf(buffer + length + 1, sizeof(buffer) - length - 1, "cia%u",
+		 identity->device_type & 0xffff);
+
+	struct mloop_work* work = mloop_work_new(mloop_default());
+	if (!work)
+		return -1;
+
+	char* context = malloc(sizeof(buffer));
+	if (!context) {
+		mloop_work_unref(work);
+		return -1;
+	}
+
+	memcpy(context, buffer, sizeof(buffer));
+
+	mloop_work_set_context(work, context, free);
+	mloop_work_set_work_fn(work, run_driver_preload);
+	mloop_work_start(work);
+	mloop_work_unref(work);
+	return 0;
+}
+
+static int is_same_driver(const struct node_identity* a,
+			  const struct node_identity* b)
+{
+	return strcasecmp(a->name, b->name) == 0
+	    && (a->device_type & 0xffff) == (b->device_type & 0xffff);
+}
+
+/* The drivers of the nodes that were there the last time are opened on the
+ * workers while the network is being probed. Identical nodes share one job.
+ */
+static void preload_drivers(void)
+{
+	const struct node_identity* scheduled[CANOPEN_NODEID_MAX
+					      * CO_MASTER_MAX_BUSES];
+	size_t n = 0;
+
+	if (!cfg.preload_drivers)
+		return;
+
+	struct co_bus* bus;
+	for_each_bus(bus) {
+		if (!bus->identities)
+			continue;
+
+		int i;
+		for_each_node(i) {
+			const struct node_identity* identity =
+				&bus->identities->node[i];
+			if (!identity->is_known)
+				continue;
+
+			size_t j;
+			for (j = 0; j < n; ++j)
+				if (is_same_driver(scheduled[j], identity))
+					break;
+
+			if (j < n)
+				continue;
+
+			if (schedule_driver_preload(identity) < 0)
+				return;
+
+			scheduled[n++] = identity;
+		}
+	}
+}
+
+static int start_bootup(void)
+{
+	preload_drivers();
+
+	struct co_bus* bus;
+	for_each_bus(bus)
+		if (start_bus_bootup(bus) < 0)
+			return -1;
+
+	return 0;
+}
+
+#ifndef NO_MAREL_CODE
 static int on_tickermaster_alive(void)
 {
-	return start_bootup();
+	return start_bootup();
+}
+
+static int appbase_dummy()
+{
+	return 0;
+}
+
+static int run_appbase()
+{
+	appcbase_t cb = { 0 };
+	cb.queue_timeout_ms = -1;
+	cb.usetm = 1;
+	cb.initialize = appbase_dummy;
+	cb.deinitialize = appbase_dummy;
+	cb.on_tickmaster_alive = on_tickermaster_alive;
+
+	if (appbase_initialize("canopen", appbase_get_instance(), &cb) != 0)
+		return 1;
+
+	rt_thread_apply(RT_THREAD_MAIN, "Main loop");
+
+	mloop_run(mloop_);
+
+	appbase_deinitialize();
+
+	return 0;
+}
+
+static int master_set_node_state(int nodeid, int state)
+{
+	(void)nodeid;
+	(void)state;
+
+	/* not allowed */
+	return 0;
+}
+
+/* Legacy drivers are only loaded on the first bus */
+static inline
+struct co_master_node*
+get_node_from_sdo_queue(const struct sdo_req_queue* queue)
+{
+	return co_bus_get_node(co_master_get_bus(0), queue->nodeid);
+}
+
+static void on_master_sdo_request_done(struct sdo_req* req)
+{
+	struct co_master_node* node = get_node_from_sdo_queue(req->parent);
+	void* driver = node->driver;
+	assert(driver);
+
+	if (req->status == SDO_REQ_OK) {
+		legacy_driver_iface_process_sdo(driver,
+						req->index,
+						req->subindex,
+						req->data.data,
+						req->data.index);
+	} else {
+		legacy_driver_iface_process_sdo(driver,
+						req->index,
+						req->subindex,
+						NULL, 0);
+	}
+}
+
+static int master_request_sdo(int nodeid, int index, int subindex)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = index,
+		.subindex = subindex,
+		.on_done = on_master_sdo_request_done
+	};
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req)
+		return -1;
+
+	int rc = sdo_req_start(req, co_bus_get_sdo_queue(co_master_get_bus(0),
+							 nodeid));
+
+	sdo_req_unref(req);
+	return rc;
+}
+
+static void on_master_sdo_send_done(struct sdo_req* req)
+{
+	(void)req;
+}
+
+static int master_send_sdo(int nodeid, int index, int subindex,
+			   const unsigned char* data, size_t size)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.index = index,
+		.subindex = subindex,
+		.dl_data = data,
+		.dl_size = size,
+		.on_done = on_master_sdo_send_done
+	};
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req)
+		return -1;
+
+	int rc = sdo_req_start(req, co_bus_get_sdo_queue(co_master_get_bus(0),
+							 nodeid));
+
+	sdo_req_unref(req);
+	return rc;
+}
+#endif /* NO_MAREL_CODE */
+
+static int rpdox_fd(struct co_master_node* node, int type, const void* data,
+		    size_t size)
+{
+	struct sock* sock = &node->bus->socket;
+
+	if (!sock->is_fd || size > CANFD_MAX_DLEN)
+		return -1;
+
+	struct canfd_frame cf = {
+		.can_id = type + co_master_get_node_id(node),
+		.len = size,
+		.flags = CANFD_BRS,
+	};
+
+	memcpy(cf.data, data, size);
+
+	return sock_send_fd(sock, &cf, 0) < 0 ? -1 : (int)sizeof(cf);
+}
+
+static int is_sync_rpdo(const struct co_master_node* node, int n)
+{
+	static const enum co_options option[] = {
+		CO_OPT_SYNC_RPDO1,
+		CO_OPT_SYNC_RPDO2,
+		CO_OPT_SYNC_RPDO3,
+		CO_OPT_SYNC_RPDO4,
+	};
+
+	return cfg.sync_interval > 0 && (node->ndrv->options & option[n]);
+}
+
+static int is_within_sync_window(const struct co_bus* bus)
+{
+	if (cfg.sync_window == 0 || bus->last_sync_time == 0)
+		return 0;
+
+	return gettime_us(CLOCK_MONOTONIC) - bus->last_sync_time
+	       < cfg.sync_window;
+}
+
+/* While the synchronous window is still open, the RPDO can be sent right away
+ * and still be in time for the current cycle. Otherwise it waits for the next
+ * SYNC, and it is counted as late if there is a window that it missed.
+ *
+ * Returns 1 if the frame was latched.
+ */
+static int latch_sync_rpdo(struct co_master_node* node, int n,
+			   const struct can_frame* cf)
+{
+	struct co_bus* bus = node->bus;
+	int is_latched = 0;
+
+	pthread_mutex_lock(&bus->sync_lock);
+
+	if (is_within_sync_window(bus))
+		goto done;
+
+	if (node->is_sync_rpdo_latched[n])
+		bus->n_sync_rpdos_overwritten++;
+
+	if (cfg.sync_window > 0 && bus->last_sync_time != 0)
+		bus->n_sync_rpdos_late++;
+
+	node->sync_rpdo[n] = *cf;
+	node->is_sync_rpdo_latched[n] = 1;
+	is_latched = 1;
+
+done:
+	pthread_mutex_unlock(&bus->sync_lock);
+	return is_latched;
+}
+
+int co__rpdox(struct co_master_node* node, int type, const void* data,
+	      size_t size)
+{
+	if (!data)
+		return -1;
+
+	/* They would only fill the transmit queue with stale values */
+	struct co_bus* bus = node->bus;
+	if (can_errors_is_bus_off(&bus->can_errors)) {
+		co_atomic_add_relaxed(&bus->n_rpdos_dropped, 1);
+		errno = ENETDOWN;
+		return -1;
+	}
+
+	if (size > CAN_MAX_DLEN)
+		return rpdox_fd(node, type, data, size);
+
+	struct can_frame cf = {
+		.can_id = type + co_master_get_node_id(node),
+		.can_dlc = size
+	};
+
+	memcpy(cf.data, data, size);
+
+	int n = (type - R_RPDO1) / (R_RPDO2 - R_RPDO1);
+	if (is_sync_rpdo(node, n) && latch_sync_rpdo(node, n, &cf))
+		return sizeof(cf);
+
+	/* Drivers expect the byte count, as with sock_send() */
+	return sock_stage(&node->bus->socket, &cf) < 0 ? -1 : (int)sizeof(cf);
+
+}
+
+int co__start(struct co_master_node* node)
+{
+	assert(node);
+
+	struct co_bus* bus = node->bus;
+
+	if (!(node->ndrv->options & CO_OPT_INHIBIT_START))
+		return -1;
+
+	node->ndrv->options &= ~CO_OPT_INHIBIT_START;
+
+	if (bus->state != CO_BUS_STATE_STARTUP)
+		start_single_node(node);
+	else if (--bus->n_inhibited_starts == 0 && !bus->is_waiting_for_drivers)
+		start_all_nodes(bus);
+
+	return 0;
+}
+
+#ifndef NO_MAREL_CODE
+static int master_send_pdo(int nodeid, int n, const unsigned char* data,
+			   size_t size)
+{
+	struct co_master_node* node;
+	node = co_bus_get_node(co_master_get_bus(0), nodeid);
+
+	switch (n) {
+	case 1: return co__rpdox(node, R_RPDO1, data, size);
+	case 2: return co__rpdox(node, R_RPDO2, data, size);
+	case 3: return co__rpdox(node, R_RPDO3, data, size);
+	case 4: return co__rpdox(node, R_RPDO4, data, size);
+	}
+
+	abort();
+	return -1;
+}
+
+static void* master_iface_init(int nodeid)
+{
+	struct legacy_master_iface cb;
+	cb.set_node_state = master_set_node_state;
+	cb.request_sdo = master_request_sdo;
+	cb.send_sdo = master_send_sdo;
+	cb.send_pdo = master_send_pdo;
+	cb.nodeid = nodeid;
+
+	return legacy_master_iface_new(&cb);
+}
+#endif /* NO_MAREL_CODE */
+
+static int init_heartbeat_timer(struct co_master_node* node)
+{
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		return -1;
+
+	uint64_t period = node->cfg.heartbeat_period
+			+ node->cfg.heartbeat_timeout;
+
+	if (node->cfg.n_timeouts_max > 0)
+		mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+
+	mloop_timer_set_context(timer, node, NULL);
+	mloop_timer_set_time(timer, period * 1000000LL);
+	mloop_timer_set_callback(timer, on_heartbeat_timeout);
+	node->heartbeat_timer = timer;
+
+	return 0;
+}
+
+static void unload_all_drivers(struct co_bus* bus)
+{
+	int i;
+	for_each_node(i)
+		if (co_bus_get_node(bus, i)->driver_type != CO_MASTER_DRIVER_NONE)
+			unload_driver(co_bus_get_node(bus, i));
+}
+
+static int init_trace_dump_path(const char* path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0) {
+		if (!S_ISDIR(st.st_mode)) {
+			errno = EEXIST;
+			return -1;
+		}
+	} else {
+		if (mkdir(path, 0755) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Globals that are read where they are used or that reload_config() applies.
+ * The rest take a restart.
+ */
+static const char* live_globals_[] = {
+	"heartbeat_period",
+	"heartbeat_timeout",
+	"n_timeouts_max",
+	"range_start",
+	"range_stop",
+	"expected_nodes",
+	"probe_timeout",
+	"probe_timeout_min",
+	"broadcast_start",
+	"start_group_size",
+	"start_group_delay",
+	"emcy_window",
+	"emcy_log_burst",
+	"emcy_log_interval",
+	"sync_window",
+	"enable_bootup_trace",
+	"enable_incident_trace",
+	"job_budget",
+	"job_budget_time",
+	"mloop_profiling",
+	"stall_threshold",
+	"driver_budget",
+};
+
+#define N_GLOBALS_MAX 64
+
+struct reload_report {
+	const char* applied[N_GLOBALS_MAX];
+	size_t n_applied;
+	const char* ignored[N_GLOBALS_MAX];
+	size_t n_ignored;
+	size_t n_nodes;
+};
+
+static int accept_live_global(const char* name, void* context)
+{
+	struct reload_report* report = context;
+	size_t n = sizeof(live_globals_) / sizeof(live_globals_[0]);
+
+	for (size_t i = 0; i < n; ++i) {
+		if (strcmp(name, live_globals_[i]) != 0)
+			continue;
+
+		plog(LOG_NOTICE, "Configuration: %s has changed", name);
+
+		if (report->n_applied < N_GLOBALS_MAX)
+			report->applied[report->n_applied++] = name;
+		return 1;
+	}
+
+	plog(LOG_NOTICE, "Configuration: %s has changed, but that takes a restart",
+	     name);
+
+	if (report->n_ignored < N_GLOBALS_MAX)
+		report->ignored[report->n_ignored++] = name;
+	return 0;
+}
+
+/* Only what changed is applied, so nodes whose configuration is the same are
+ * not touched. Nodes that are being loaded are taken care of when they are
+ * done.
+ */
+static int reload_config(struct reload_report* report)
+{
+	memset(report, 0, sizeof(*report));
+
+	if (cfg_reload_file(accept_live_global, report) < 0) {
+		plog(LOG_ERROR, "Could not reload the configuration: %m");
+		return -1;
+	}
+
+	mloop_set_job_budget(mloop_, cfg.job_budget, cfg.job_budget_time);
+	mloop_set_profiling(mloop_, cfg.mloop_profiling || cfg.stall_threshold,
+			    cfg.stall_threshold * 1000ULL);
+
+	struct co_bus* bus;
+	int i;
+
+	for_each_bus(bus)
+		for_each_node(i) {
+			struct co_master_node* node = co_bus_get_node(bus, i);
+			if (node->is_loading)
+				continue;
+
+			if (reload_node_config(node))
+				++report->n_nodes;
+		}
+
+	plog(LOG_NOTICE, "Configuration reloaded; %zu nodes changed",
+	     report->n_nodes);
+	return 0;
+}
+
+void on_stop_signal(struct mloop_signal* sig, int signo)
+{
+	(void)sig;
+
+	struct reload_report report;
+
+	switch (signo) {
+	case SIGUSR1:
+		dump_tracebuffer(NULL);
+		break;
+	case SIGHUP:
+		reload_config(&report);
+		break;
+	case SIGUSR2:
+		hand_over();
+		break;
+	default:
+		mloop_exit(mloop_default());
+		break;
+	}
+}
+
+int init_signal_handler(struct mloop* mloop)
+{
+	struct mloop_signal* ms = mloop_signal_new(mloop);
+	if (!ms)
+		return -1;
+
+	sigset_t s;
+	sigemptyset(&s);
+	sigaddset(&s, SIGINT);
+	sigaddset(&s, SIGTERM);
+	sigaddset(&s, SIGQUIT);
+	sigaddset(&s, SIGUSR1);
+	sigaddset(&s, SIGUSR2);
+	sigaddset(&s, SIGHUP);
+
+	pthread_sigmask(SIG_BLOCK, &s, NULL);
+
+	mloop_signal_set_signals(ms, &s);
+	mloop_signal_set_callback(ms, on_stop_signal);
+	int rc = mloop_signal_start(ms);
+	mloop_signal_unref(ms);
+	return rc;
+}
+
+/* The interface argument is a comma separated list, e.g. "can0,can1" */
+static int parse_buses(const char* ifaces)
+{
+	char buffer[sizeof(cfg.iface)];
+	strlcpy(buffer, ifaces, sizeof(buffer));
+
+	co_master_n_buses_ = 0;
+
+	char* saveptr = NULL;
+	for (char* iface = strtok_r(buffer, ",", &saveptr); iface;
+	     iface = strtok_r(NULL, ",", &saveptr)) {
+		iface = string_trim(iface);
+		if (!*iface)
+			continue;
+
+		if (co_master_n_buses_ >= CO_MASTER_MAX_BUSES) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		if (co_master_find_bus(iface)) {
+			errno = EEXIST;
+			return -1;
+		}
+
+		struct co_bus* bus = &co_bus_[co_master_n_buses_];
+		memset(bus, 0, sizeof(*bus));
+
+		bus->index = co_master_n_buses_++;
+		strlcpy(bus->iface, iface, sizeof(bus->iface));
+	}
+
+	if (co_master_n_buses_ == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void stats_rest_reply(struct rest_client* client, const char* status,
+			    const char* content_type, const char* content,
+			    size_t size)
+{
+	struct rest_reply_data reply = {
+		.status_code = status,
+		.content_type = content_type,
+		.content_length = size,
+		.content = content
+	};
+
+	rest_client_reply(client, &reply);
+
+	rest_client_done(client);
+}
+
+/* [/<iface>]/sync replies with the SYNC lateness statistics of the bus */
+static void sync_rest_service(struct rest_client* client, const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "sync") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus || !bus->have_sync_producer) {
+		const char* message = "SYNC is not enabled\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				strlen(message));
+		return;
+	}
+
+	struct sync_stats stats;
+	sync_producer_get_stats(&bus->sync_producer, &stats);
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	fprintf(stream, "{\"period\":%llu,\"cycles\":%llu,\"skipped\":%llu,\"max_lateness\":%llu,\"histogram\":[",
+		(unsigned long long)cfg.sync_interval,
+		(unsigned long long)stats.n_cycles,
+		(unsigned long long)stats.n_skipped,
+		(unsigned long long)stats.max_lateness);
+
+	for (int i = 0; i < SYNC_HISTOGRAM_LENGTH; ++i)
+		fprintf(stream, "%s%llu", i > 0 ? "," : "",
+			(unsigned long long)stats.histogram[i]);
+
+	fprintf(stream, "]}\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* [/<iface>]/bus-load replies with the load of the bus, in per mille of its bit
+ * rate, and with how background SDOs have been paced
+ */
+static void bus_load_rest_service(struct rest_client* client,
+				  const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "bus-load") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus || cfg.bitrate == 0) {
+		const char* message = "The bus load is not measured; see bitrate\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				strlen(message));
+		return;
+	}
+
+	unsigned int load = bl_meter_update(&bus->meter,
+					    gettime_us(CLOCK_MONOTONIC));
+
+	/* Counted on the main loop, so they may be a little behind */
+	const struct sdo_throttle* throttle = &bus->sdo_throttle;
+	uint64_t n_admitted = co_atomic_load_relaxed(&throttle->n_admitted);
+	uint64_t n_deferred = co_atomic_load_relaxed(&throttle->n_deferred);
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	fprintf(stream, "{\"bitrate\":%llu,\"load\":%u,\"ceiling\":%u,\"sdo_admitted\":%llu,\"sdo_deferred\":%llu}\r\n",
+		(unsigned long long)cfg.bitrate, load, throttle->ceiling,
+		(unsigned long long)n_admitted,
+		(unsigned long long)n_deferred);
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* [/<iface>]/can-errors replies with the error state of the CAN controller
+ * and counts of the errors that it has reported
+ */
+static void can_errors_rest_service(struct rest_client* client,
+				    const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "can-errors") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus || !bus->can_error_timer) {
+		const char* message = "No error frames are received from the bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	/* Counted on the main loop, so they may be a little behind */
+	const struct can_errors* errors = &bus->can_errors;
+#define LOAD(name) (unsigned long long)co_atomic_load_relaxed(&errors->name)
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	fprintf(stream, "{\"state\":\"%s\",\"tx_errors\":%u,\"rx_errors\":%u,\"frames\":%llu,\"warnings\":%llu,\"passive\":%llu,\"bus_off\":%llu,\"restarts\":%llu,",
+		can_errors_state_to_string(can_errors_get_state(errors)),
+		co_atomic_load_relaxed(&errors->tx_errors),
+		co_atomic_load_relaxed(&errors->rx_errors),
+		LOAD(n_frames), LOAD(n_warnings), LOAD(n_passive),
+		LOAD(n_bus_off), LOAD(n_restarts));
+	fprintf(stream, "\"tx_timeouts\":%llu,\"lost_arbitration\":%llu,\"overflows\":%llu,\"protocol\":%llu,\"transceiver\":%llu,\"no_ack\":%llu,\"rpdos_dropped\":%llu,\"tx_unsent\":%llu}\r\n",
+		LOAD(n_tx_timeouts), LOAD(n_lost_arbitration),
+		LOAD(n_overflows), LOAD(n_protocol), LOAD(n_transceiver),
+		LOAD(n_no_ack),
+		(unsigned long long)co_atomic_load_relaxed(&bus->n_rpdos_dropped),
+		(unsigned long long)sock_get_n_unsent(&bus->socket));
+	fclose(stream);
+
+#undef LOAD
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* [/<iface>]/sdo-rtt replies with the SDO round-trip times of the nodes on the
+ * bus that have been talked to, in microseconds, and their current timeouts
+ */
+static void sdo_rtt_rest_service(struct rest_client* client,
+				 const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "sdo-rtt") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus) {
+		const char* message = "No such bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	const char* separator = "";
+	fprintf(stream, "{");
+
+	for (int nodeid = CANOPEN_NODEID_MIN; nodeid <= CANOPEN_NODEID_MAX;
+	     ++nodeid) {
+		const struct sdo_req_queue* queue;
+		queue = co_bus_get_sdo_queue(bus, nodeid);
+
+		const struct sdo_rtt* rtt = &queue->rtt;
+		if (rtt->n_samples == 0 && rtt->n_timeouts == 0)
+			continue;
+
+		fprintf(stream, "%s\"%d\":{\"srtt\":%llu,\"rttvar\":%llu,\"samples\":%llu,\"timeouts\":%llu,\"timeout\":%u}",
+			separator, nodeid,
+			(unsigned long long)rtt->srtt,
+			(unsigned long long)rtt->rttvar,
+			(unsigned long long)rtt->n_samples,
+			(unsigned long long)rtt->n_timeouts,
+			sdo_req_queue_get_timeout(queue));
+
+		separator = ",";
+	}
+
+	fprintf(stream, "}\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* [/<iface>]/stats[?format=prometheus] replies with what each node on the
+ * bus has sent and how its SDO transfers have gone
+ */
+static void node_stats_rest_service(struct rest_client* client,
+				    const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "stats") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus) {
+		const char* message = "No such bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	const char* format = http_req_query(&client->req, "format");
+	int is_prometheus = format && strcasecmp(format, "prometheus") == 0;
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	if (is_prometheus)
+		node_stats_write_prometheus(stream, bus->iface, bus->stats);
+	else
+		node_stats_write_json(stream, bus->stats);
+
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK",
+			 is_prometheus ? "text/plain; version=0.0.4"
+				       : "application/json",
+			 buffer, size);
+	free(buffer);
+}
+
+/* GET [/<iface>]/bootup replies with when each node got through each step of
+ * its boot-up, and the nodes ordered by how long they took
+ */
+static void bootup_rest_service(struct rest_client* client,
+				const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "bootup") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus) {
+		const char* message = "No such bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	bootup_timeline_write_json(stream, bus->bootup);
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* GET [/<iface>]/trace streams the trace buffer of the bus; see trace-rest.h */
+static void trace_rest_service(struct rest_client* client, const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+
+	if (strcasecmp(req->url[0], "trace") == 0)
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	else
+		bus = co_master_find_bus(req->url[0]);
+
+	if (!bus || cfg.trace_buffer_size == 0) {
+		const char* message = "There is no trace buffer; see trace_buffer_size\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	trace_rest_serve(client, &bus->tracebuffer, bus->iface);
+}
+
+/* GET [/<iface>]/emcy[/<node>] replies with the recent EMCYs of the nodes on
+ * the bus that have sent any, or of the given node
+ */
+static void emcy_rest_service(struct rest_client* client, const void* content)
+{
+	(void)content;
+
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+	size_t offset = 0;
+
+	if (strcasecmp(req->url[0], "emcy") == 0) {
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	} else {
+		bus = co_master_find_bus(req->url[0]);
+		offset = 1;
+	}
+
+	if (!bus) {
+		const char* message = "No such bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	int first = CANOPEN_NODEID_MIN, last = CANOPEN_NODEID_MAX;
+
+	if (req->url_index > offset + 1) {
+		first = last = atoi(req->url[offset + 1]);
+
+		if (first < CANOPEN_NODEID_MIN || first > CANOPEN_NODEID_MAX) {
+			const char* message = "No such node\r\n";
+			stats_rest_reply(client, "404 Not Found", "text/plain",
+					 message, strlen(message));
+			return;
+		}
+	}
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	const char* separator = "";
+	fprintf(stream, "{");
+
+	for (int nodeid = first; nodeid <= last; ++nodeid) {
+		const struct co_master_node* node = co_bus_get_node(bus, nodeid);
+		const struct emcy_history* history = &node->emcy_history;
+
+		if (history->n_received == 0)
+			continue;
+
+		fprintf(stream, "%s\"%d\":", separator, nodeid);
+		emcy_history_write_json(stream, history, now);
+		separator = ",";
+	}
+
+	fprintf(stream, "}\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* /mloop replies with how the main loop keeps up with its jobs */
+static void histogram_to_json(FILE* stream, const struct mloop_histogram* hist)
+{
+	fprintf(stream, "{\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu,\"buckets\":[",
+		(unsigned long long)hist->count,
+		(unsigned long long)hist->total_us,
+		(unsigned long long)hist->max_us);
+
+	for (int i = 0; i < MLOOP_PROF_N_BUCKETS; ++i)
+		fprintf(stream, "%s%llu", i ? "," : "",
+			(unsigned long long)hist->buckets[i]);
+
+	fprintf(stream, "]}");
+}
+
+static void prof_site_to_json(FILE* stream, const struct mloop_prof_site* site)
+{
+	char name[256];
+	mloop_prof_describe(site->fn, name, sizeof(name));
+
+	fprintf(stream, "{\"site\":\"%s\",\"type\":\"%s\",\"time\":", name,
+		mloop_prof_type_name(site->type));
+	histogram_to_json(stream, &site->time);
+	fprintf(stream, "}");
+}
+
+static void prof_depth_to_json(FILE* stream, const char* name,
+			       const struct mloop_prof_depth* depth)
+{
+	fprintf(stream, "\"%s\":{\"current\":%zu,\"max\":%zu}", name,
+		depth->current, depth->max);
+}
+
+static void mloop_profile_to_json(FILE* stream, const struct mloop_prof* prof)
+{
+	fprintf(stream, "{\"time\":{");
+	for (int i = 0; i < MLOOP_PROF_N_TYPES; ++i) {
+		fprintf(stream, "%s\"%s\":", i ? "," : "",
+			mloop_prof_type_name(i));
+		histogram_to_json(stream, &prof->time[i]);
+	}
+
+	fprintf(stream, "},\"dispatch_lag\":");
+	histogram_to_json(stream, &prof->dispatch_lag);
+	fprintf(stream, ",\"timer_lag\":");
+	histogram_to_json(stream, &prof->timer_lag);
+
+	fprintf(stream, ",\"queues\":{");
+	prof_depth_to_json(stream, "async", &prof->async_jobs);
+	fprintf(stream, ",");
+	prof_depth_to_json(stream, "worker", &prof->worker_jobs);
+	fprintf(stream, ",");
+	prof_depth_to_json(stream, "idle", &prof->idle_jobs);
+
+	fprintf(stream, "},\"stalls\":%llu", (unsigned long long)prof->n_stalls);
+	if (prof->n_stalls > 0) {
+		fprintf(stream, ",\"last_stall\":");
+		prof_site_to_json(stream, &prof->last_stall);
+	}
+
+	fprintf(stream, ",\"allocations\":{");
+	for (int i = 0; i < MLOOP_PROF_N_TYPES; ++i) {
+		const struct mloop_alloc_stats* allocs = &prof->allocs[i];
+		fprintf(stream, "%s\"%s\":{\"allocated\":%llu,\"reused\":%llu,\"cached\":%zu}",
+			i ? "," : "", mloop_prof_type_name(i),
+			(unsigned long long)allocs->n_allocated,
+			(unsigned long long)allocs->n_reused, allocs->n_cached);
+	}
+
+	/* The SDO pools too, so that any allocation in a steady state shows */
+	struct sdo_req_alloc_stats sdo_allocs[2];
+	sdo_req_get_alloc_stats(&sdo_allocs[0], &sdo_allocs[1]);
+	for (int i = 0; i < 2; ++i)
+		fprintf(stream, ",\"%s\":{\"allocated\":%llu,\"reused\":%llu,\"cached\":%zu}",
+			i ? "sdo_buffer" : "sdo_req",
+			(unsigned long long)sdo_allocs[i].n_allocated,
+			(unsigned long long)sdo_allocs[i].n_reused,
+			sdo_allocs[i].n_cached);
+
+	fprintf(stream, "},\"untracked\":%llu,\"sites\":[",
+		(unsigned long long)prof->n_untracked);
+	for (size_t i = 0; i < prof->n_sites; ++i) {
+		if (i > 0)
+			fprintf(stream, ",");
+		prof_site_to_json(stream, &prof->sites[i]);
+	}
+
+	fprintf(stream, "]}");
+}
+
+static void mloop_rest_service(struct rest_client* client, const void* content)
+{
+	(void)content;
+
+	struct mloop_stats stats;
+	mloop_get_stats(mloop_, &stats);
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	fprintf(stream, "{\"iterations\":%llu,\"job_budget_hits\":%llu,\"time_budget_hits\":%llu",
+		(unsigned long long)stats.n_iterations,
+		(unsigned long long)stats.n_job_budget_hits,
+		(unsigned long long)stats.n_time_budget_hits);
+
+	fprintf(stream, ",\"deadline_jobs\":%llu,\"deadline_misses\":%llu,\"max_lateness_us\":%llu",
+		(unsigned long long)stats.n_deadline_jobs,
+		(unsigned long long)stats.n_deadline_misses,
+		(unsigned long long)(stats.max_lateness_ns / 1000ULL));
+
+	struct mloop_worker_stats workers;
+	mloop_get_worker_stats(&workers);
+
+	fprintf(stream, ",\"workers\":{\"current\":%llu,\"max\":%llu,\"started\":%llu,\"retired\":%llu",
+		(unsigned long long)workers.n_workers,
+		(unsigned long long)workers.max_workers,
+		(unsigned long long)workers.n_started,
+		(unsigned long long)workers.n_retired);
+
+	fprintf(stream, ",\"jobs\":%llu,\"mean_wait_us\":%llu,\"max_wait_us\":%llu}",
+		(unsigned long long)workers.n_jobs,
+		(unsigned long long)(workers.n_jobs
+			? workers.total_wait_ns / workers.n_jobs / 1000ULL : 0),
+		(unsigned long long)(workers.max_wait_ns / 1000ULL));
+
+	struct mloop_prof* prof = malloc(sizeof(*prof));
+	if (prof && mloop_get_profile(mloop_, prof) == 0) {
+		fprintf(stream, ",\"profile\":");
+		mloop_profile_to_json(stream, prof);
+	}
+	free(prof);
+
+	fprintf(stream, "}\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+static struct mloop_timer* memory_sampler_;
+
+static void on_memory_sample(struct mloop_timer* timer)
+{
+	(void)timer;
+	mem_tag_sample(gettime_us(CLOCK_MONOTONIC));
+}
+
+/* The allocation rates of /memory are over fixed windows that end here */
+static int start_memory_sampler(void)
+{
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		return -1;
+
+	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_time(timer, MEM_TAG_RATE_WINDOW * 1000000ULL);
+	mloop_timer_set_callback(timer, on_memory_sample);
+
+	if (mloop_timer_start(timer) < 0) {
+		mloop_timer_unref(timer);
+		return -1;
+	}
+
+	mem_tag_sample(gettime_us(CLOCK_MONOTONIC));
+	memory_sampler_ = timer;
+	return 0;
+}
+
+static void stop_memory_sampler(void)
+{
+	if (!memory_sampler_)
+		return;
+
+	mloop_timer_stop(memory_sampler_);
+	mloop_timer_unref(memory_sampler_);
+	memory_sampler_ = NULL;
+}
+
+/* /memory replies with what each subsystem has allocated */
+static void memory_rest_service(struct rest_client* client,
+				const void* content)
+{
+	(void)content;
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	mem_tag_write_json(stream);
+	fprintf(stream, "\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* /timeline replies with the event trace in the Chrome trace event format */
+static void timeline_rest_service(struct rest_client* client,
+				  const void* content)
+{
+	(void)content;
+
+	if (!event_trace_is_enabled()) {
+		const char* message = "Event tracing is off; see event_trace_size\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	int rc = event_trace_write_json(stream);
+	fclose(stream);
+
+	if (rc < 0) {
+		free(buffer);
+		return;
+	}
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+static void print_json_names(FILE* stream, const char* const* names,
+			     size_t n)
+{
+	fprintf(stream, "[");
+	for (size_t i = 0; i < n; ++i)
+		fprintf(stream, "%s\"%s\"", i > 0 ? "," : "", names[i]);
+	fprintf(stream, "]");
+}
+
+/* POST /config reloads the configuration file and replies with what was
+ * applied and what takes a restart
+ */
+static void config_rest_service(struct rest_client* client,
+				const void* content)
+{
+	(void)content;
+
+	struct reload_report report;
+
+	if (reload_config(&report) < 0) {
+		const char* message = "Could not reload the configuration\r\n";
+		stats_rest_reply(client, "500 Internal Server Error",
+				 "text/plain", message, strlen(message));
+		return;
+	}
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	fprintf(stream, "{\"applied\":");
+	print_json_names(stream, report.applied, report.n_applied);
+	fprintf(stream, ",\"needs_restart\":");
+	print_json_names(stream, report.ignored, report.n_ignored);
+	fprintf(stream, ",\"nodes_changed\":%zu}\r\n", report.n_nodes);
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+static void firmware_rest_status(struct rest_client* client,
+				 struct co_bus* bus)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return;
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	const char* separator = "";
+	fprintf(stream, "{");
+
+	for (int nodeid = CANOPEN_NODEID_MIN; nodeid <= CANOPEN_NODEID_MAX;
+	     ++nodeid) {
+		const struct fw_job* job;
+		job = fw_updater_get_job(&bus->firmware, nodeid);
+		if (job->state == FW_JOB_IDLE)
+			continue;
+
+		uint64_t end = job->end_time ? job->end_time : now;
+
+		fprintf(stream, "%s\"%d\":{\"state\":\"%s\",\"progress\":%zu,\"size\":%zu,\"time\":%llu",
+			separator, nodeid, fw_job_state_str(job->state),
+			fw_job_get_progress(job), job->size,
+			(unsigned long long)(end - job->start_time) / 1000ULL);
+
+		if (job->state == FW_JOB_FAILED)
+			fprintf(stream, ",\"failed_in\":\"%s\",\"error\":\"%s\"",
+				fw_job_state_str(job->failed_state),
+				fw_job_strerror(job));
+
+		fprintf(stream, "}");
+		separator = ",";
+	}
+
+	fprintf(stream, "}\r\n");
+	fclose(stream);
+
+	stats_rest_reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+}
+
+/* A list of node ids or ranges of them, such as 2,5-9 */
+static int firmware_parse_nodes(char* nodes, const char* str)
+{
+	memset(nodes, 0, CANOPEN_NODEID_MAX + 1);
+
+	do {
+		char* end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+
+		if (end == str)
+			return -1;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str)
+				return -1;
+		}
+
+		if (first < CANOPEN_NODEID_MIN || last > CANOPEN_NODEID_MAX
+		 || first > last)
+			return -1;
+
+		for (long i = first; i <= last; ++i)
+			nodes[i] = 1;
+
+		str = end;
+	} while (*str++ == ',');
+
+	return *--str == '\0' ? 0 : -1;
+}
+
+static void firmware_rest_start(struct rest_client* client,
+				struct co_bus* bus, const char* node_list,
+				const char* content)
+{
+	const char* message;
+	char nodes[CANOPEN_NODEID_MAX + 1];
+
+	if (firmware_parse_nodes(nodes, node_list) < 0) {
+		message = "Nodes must be given as a list, e.g. 2,5-9\r\n";
+		stats_rest_reply(client, "400 Bad Request", "text/plain",
+				 message, strlen(message));
+		return;
+	}
+
+	/* The content is the path of the image on the master */
+	char path[256];
+	size_t length = MIN(client->req.content_length, sizeof(path) - 1);
+	memcpy(path, content, length);
+	path[length] = '\0';
+	path[strcspn(path, "\r\n")] = '\0';
+
+	const char* program_str = http_req_query(&client->req, "program");
+	int program = program_str ? atoi(program_str) : 1;
+
+	struct fw_image* image = fw_updater_find_image(&bus->firmware, path);
+	if (!image)
+		image = fw_image_open(path);
+
+	if (!image) {
+		char buffer[256];
+		snprintf(buffer, sizeof(buffer), "Could not open image: %s\r\n",
+			 strerror(errno));
+		stats_rest_reply(client, "400 Bad Request", "text/plain",
+				 buffer, strlen(buffer));
+		return;
+	}
+
+	int n_started = 0, n_busy = 0;
+
+	for (int nodeid = CANOPEN_NODEID_MIN; nodeid <= CANOPEN_NODEID_MAX;
+	     ++nodeid) {
+		if (!nodes[nodeid])
+			continue;
+
+		if (fw_updater_start(&bus->firmware, nodeid, image, program) < 0)
+			++n_busy;
+		else
+			++n_started;
+	}
+
+	fw_image_unref(image);
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "{\"started\":%d,\"busy\":%d}\r\n",
+		 n_started, n_busy);
+	stats_rest_reply(client, n_started > 0 ? "200 OK" : "409 Conflict",
+			 "application/json", buffer, strlen(buffer));
+}
+
+/* GET [/<iface>]/firmware replies with the state of the program downloads on
+ * the bus. PUT [/<iface>]/firmware/<nodes>[?program=<n>] downloads the image
+ * at the path in the content to the given nodes.
+ */
+static void firmware_rest_service(struct rest_client* client,
+				  const void* content)
+{
+	const struct http_req* req = &client->req;
+	struct co_bus* bus;
+	size_t offset = 0;
+
+	if (strcasecmp(req->url[0], "firmware") == 0) {
+		bus = co_master_get_n_buses() > 0 ? co_master_get_bus(0) : NULL;
+	} else {
+		bus = co_master_find_bus(req->url[0]);
+		offset = 1;
+	}
+
+	if (!bus) {
+		const char* message = "No such bus\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	if (req->method != HTTP_PUT) {
+		firmware_rest_status(client, bus);
+		return;
+	}
+
+	if (req->url_index != offset + 2) {
+		const char* message = "Wrong URL format. Must be [/<iface>]/firmware/<nodes>\r\n";
+		stats_rest_reply(client, "404 Not Found", "text/plain", message,
+				 strlen(message));
+		return;
+	}
+
+	firmware_rest_start(client, bus, req->url[offset + 1], content);
+}
+
+/* Runs on the REST reactor. The services that only read counters are run
+ * there too, and the rest are handed to the default loop.
+ */
+static void bus_rest_service(struct rest_client* client, const void* content)
+{
+	const struct http_req* req = &client->req;
+
+	if (req->url_index >= 2 && strcasecmp(req->url[1], "sync") == 0)
+		rest_client_call(client, sync_rest_service, content);
+	else if (req->url_index >= 2 && strcasecmp(req->url[1], "sdo-rtt") == 0)
+		rest_client_call(client, sdo_rtt_rest_service, content);
+	else if (req->url_index >= 2
+	      && strcasecmp(req->url[1], "bus-load") == 0)
+		bus_load_rest_service(client, content);
+	else if (req->url_index >= 2
+	      && strcasecmp(req->url[1], "can-errors") == 0)
+		can_errors_rest_service(client, content);
+	else if (req->url_index >= 2 && strcasecmp(req->url[1], "stats") == 0)
+		node_stats_rest_service(client, content);
+	else if (req->url_index >= 2 && strcasecmp(req->url[1], "emcy") == 0)
+		rest_client_call(client, emcy_rest_service, content);
+	else if (req->url_index >= 2
+	      && strcasecmp(req->url[1], "bootup") == 0)
+		bootup_rest_service(client, content);
+	else if (req->url_index >= 2
+	      && strcasecmp(req->url[1], "firmware") == 0)
+		rest_client_call(client, firmware_rest_service, content);
+	else if (req->url_index >= 2 && strcasecmp(req->url[1], "trace") == 0)
+		rest_client_call(client, trace_rest_service, content);
+	else
+		rest_client_call(client, sdo_rest_service, content);
+}
+
+static int register_rest_services(void)
+{
+	if (rest_register_service(HTTP_GET | HTTP_PUT | HTTP_POST,
+				  "sdo", sdo_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "sync", sync_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "sdo-rtt", sdo_rtt_rest_service) < 0)
+		return -1;
+
+	/* These only read counters and snapshots, so dashboards that poll
+	 * them do not hold up the default loop
+	 */
+	if (rest_register_reactor_service(HTTP_GET, "bus-load",
+					  bus_load_rest_service) < 0)
+		return -1;
+
+	if (rest_register_reactor_service(HTTP_GET, "can-errors",
+					  can_errors_rest_service) < 0)
+		return -1;
+
+	if (rest_register_reactor_service(HTTP_GET, "stats",
+					  node_stats_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "emcy", emcy_rest_service) < 0)
+		return -1;
+
+	if (rest_register_reactor_service(HTTP_GET, "bootup",
+					  bootup_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET | HTTP_PUT, "firmware",
+				  firmware_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "mloop", mloop_rest_service) < 0)
+		return -1;
+
+	if (rest_register_reactor_service(HTTP_GET, "memory",
+					  memory_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "timeline",
+				  timeline_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "events", event_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET | HTTP_PUT, "poll",
+				  sdo_poll_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_GET, "trace", trace_rest_service) < 0)
+		return -1;
+
+	if (rest_register_service(HTTP_POST, "config", config_rest_service) < 0)
+		return -1;
+
+	/* /<iface>/sdo/..., /<iface>/sync, /<iface>/sdo-rtt,
+	 * /<iface>/bus-load, /<iface>/can-errors, /<iface>/stats,
+	 * /<iface>/emcy, /<iface>/bootup, /<iface>/firmware and
+	 * /<iface>/trace address a particular bus
+	 */
+	struct co_bus* bus;
+	for_each_bus(bus)
+		if (rest_register_reactor_service(HTTP_GET | HTTP_PUT
+						  | HTTP_POST, bus->iface,
+						  bus_rest_service) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Failing to record a bus is not fatal, so it is only logged */
+static void start_trace_recorder(struct co_bus* bus)
+{
+	if (!cfg.enable_trace_recording || cfg.trace_buffer_size == 0)
+		return;
+
+	struct tr_recorder* recorder = malloc(sizeof(*recorder));
+	if (!recorder)
+		goto failure;
+
+	char name[64];
+	if (co_master_n_buses_ > 1)
+		snprintf(name, sizeof(name), "record-%s", bus->iface);
+	else
+		snprintf(name, sizeof(name), "record");
+
+	if (tr_recorder_init(recorder, &bus->tracebuffer, cfg.trace_dump_path,
+			     name) < 0)
+		goto init_failure;
+
+	tr_recorder_set_rotation(recorder, cfg.trace_file_size << 20,
+				 cfg.trace_file_age * 1000000ULL,
+				 cfg.trace_max_files);
+
+	if (tr_recorder_start(recorder) < 0)
+		goto start_failure;
+
+	bus->recorder = recorder;
+	return;
+
+start_failure:
+	tr_recorder_destroy(recorder);
+init_failure:
+	free(recorder);
+failure:
+	plog(LOG_ERROR, "%s: Could not start trace recording: %m", bus->iface);
+}
+
+static void stop_trace_recorder(struct co_bus* bus)
+{
+	if (!bus->recorder)
+		return;
+
+	tr_recorder_stop(bus->recorder);
+
+	struct tr_stats stats;
+	tr_recorder_get_stats(bus->recorder, &stats);
+	if (stats.n_lost > 0 || stats.n_write_errors > 0)
+		plog(LOG_NOTICE, "%s: Trace recording: %llu frames lost, %llu blocks not written",
+		     bus->iface, (unsigned long long)stats.n_lost,
+		     (unsigned long long)stats.n_write_errors);
+
+	tr_recorder_destroy(bus->recorder);
+	free(bus->recorder);
+	bus->recorder = NULL;
+}
+
+/* A mapped trace buffer that was left open holds the trace of a crash, which
+ * is dumped before anything is added to it.
+ */
+static int init_tracebuffer(struct co_bus* bus)
+{
+	if (tb_parse_format(&trace_dump_format_, cfg.trace_dump_format) < 0) {
+		fprintf(stderr, "Invalid trace dump format: %s\n",
+			cfg.trace_dump_format);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!cfg.enable_mapped_trace)
+		return tb_init(&bus->tracebuffer, cfg.trace_buffer_size);
+
+	const char* dir = cfg.trace_map_path[0] ? cfg.trace_map_path
+						: cfg.trace_dump_path;
+	if (init_trace_dump_path(dir) < 0)
+		return -1;
+
+	char path[300];
+	if (co_master_n_buses_ > 1)
+		snprintf(path, sizeof(path), "%s/ring-%s.tbuf", dir, bus->iface);
+	else
+		snprintf(path, sizeof(path), "%s/ring.tbuf", dir);
+
+	if (tb_init_mapped(&bus->tracebuffer, cfg.trace_buffer_size, path) < 0)
+		return -1;
+
+	uint64_t n_recovered = bus->tracebuffer.n_recovered;
+	if (n_recovered == 0)
+		return 0;
+
+	char ts[32], name[64];
+	snprintf(name, sizeof(name), "crash-%s",
+		 compose_trace_name(ts, sizeof(ts)));
+
+	if (init_trace_dump_path(cfg.trace_dump_path) == 0)
+		dump_bus_tracebuffer(bus, name);
+
+	plog(LOG_NOTICE, "%s: Recovered %llu frames from a trace buffer that was not closed; dumped as \"%s\"",
+	     bus->iface, (unsigned long long)n_recovered, name);
+	return 0;
+}
+
+static int init_trace_filter(struct co_bus* bus)
+{
+	bus->trace_filter = NULL;
+
+	if (!cfg.trace_filter[0])
+		return 0;
+
+	struct trace_filter* filter = malloc(sizeof(*filter));
+	if (!filter)
+		return -1;
+
+	tf_init(filter);
+
+	if (tf_parse(filter, cfg.trace_filter) < 0) {
+		fprintf(stderr, "Invalid trace filter: %s\n", cfg.trace_filter);
+		free(filter);
+		return -1;
+	}
+
+	bus->trace_filter = filter;
+	tb_set_filter(&bus->tracebuffer, filter);
+	return 0;
+}
+
+/* Going without is not fatal; the nodes are then read in full */
+static void load_identities(struct co_bus* bus)
+{
+	if (!cfg.state_path[0])
+		return;
+
+	bus->identities = malloc(sizeof(*bus->identities));
+	if (!bus->identities)
+		return;
+
+	char path[256];
+	node_identity_make_path(path, sizeof(path), cfg.state_path, bus->iface);
+
+	if (node_identity_cache_load(bus->identities, path) < 0)
+		plog(LOG_DEBUG, "No node identities in %s: %m", path);
+}
+
+/* What a new process got from the one that handed over to it, until the
+ * buses have been opened with it. Descriptors that are taken are set to -1,
+ * and the rest are closed when it is dropped.
+ */
+static struct handoff_header handoff_header_;
+static struct handoff_bus* handoff_buses_ = NULL;
+static struct tb_frame** handoff_traces_ = NULL;
+static int handoff_fds_[HANDOFF_MAX_FDS];
+static size_t handoff_n_fds_ = 0;
+
+static int take_handoff_fd(int32_t index)
+{
+	if (index < 0 || (size_t)index >= handoff_n_fds_)
+		return -1;
+
+	int fd = handoff_fds_[index];
+	handoff_fds_[index] = -1;
+	return fd;
+}
+
+static int find_handoff_bus(const char* iface)
+{
+	if (!handoff_buses_)
+		return -1;
+
+	for (uint32_t i = 0; i < handoff_header_.n_buses; ++i)
+		if (strcmp(handoff_buses_[i].iface, iface) == 0)
+			return i;
+
+	return -1;
+}
+
+static void drop_handoff(void)
+{
+	for (size_t i = 0; i < handoff_n_fds_; ++i)
+		if (handoff_fds_[i] >= 0)
+			close(handoff_fds_[i]);
+
+	handoff_n_fds_ = 0;
+
+	if (handoff_traces_)
+		for (uint32_t i = 0; i < handoff_header_.n_buses; ++i)
+			free(handoff_traces_[i]);
+
+	free(handoff_traces_);
+	handoff_traces_ = NULL;
+	free(handoff_buses_);
+	handoff_buses_ = NULL;
+}
+
+static int receive_handoff(int sock)
+{
+	struct handoff_header* header = &handoff_header_;
+
+	handoff_n_fds_ = HANDOFF_MAX_FDS;
+	if (handoff_recv(sock, header, sizeof(*header), handoff_fds_,
+			 &handoff_n_fds_) < 0)
+		return -1;
+
+	if (!handoff_header_is_valid(header)
+	 || handoff_n_fds_ != header->n_fds) {
+		errno = EPROTO;
+		goto failure;
+	}
+
+	handoff_buses_ = calloc(header->n_buses, sizeof(*handoff_buses_));
+	handoff_traces_ = calloc(header->n_buses, sizeof(*handoff_traces_));
+	if (!handoff_buses_ || !handoff_traces_)
+		goto failure;
+
+	if (handoff_recv(sock, handoff_buses_,
+			 header->n_buses * sizeof(*handoff_buses_), NULL,
+			 NULL) < 0)
+		goto failure;
+
+	for (uint32_t i = 0; i < header->n_buses; ++i) {
+		size_t size = handoff_buses_[i].n_trace_frames
+			    * sizeof(struct tb_frame);
+		if (size == 0)
+			continue;
+
+		handoff_traces_[i] = malloc(size);
+		if (!handoff_traces_[i]
+		 || handoff_recv(sock, handoff_traces_[i], size, NULL,
+				 NULL) < 0)
+			goto failure;
+	}
+
+	if (handoff_wait_close(sock, HANDOFF_CLOSE_TIMEOUT) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	drop_handoff();
+	return -1;
+}
+
+/* Anything that goes wrong leaves this process to start as if it were the
+ * first, which resets the nodes.
+ */
+static void take_over(void)
+{
+	int sock = handoff_get_inherited();
+	if (sock < 0)
+		return;
+
+	if (receive_handoff(sock) < 0)
+		plog(LOG_ERROR, "Handoff: Could not take over from the previous process: %m; starting afresh");
+	else
+		plog(LOG_NOTICE, "Handoff: Taking over %u buses from the previous process",
+		     handoff_header_.n_buses);
+
+	close(sock);
+}
+
+/* The frames that the last process traced are put in front of those that
+ * this one traces. A mapped trace buffer is taken up from its file instead.
+ */
+static void restore_trace(struct co_bus* bus, int index)
+{
+	const struct tb_frame* frames = handoff_traces_[index];
+
+	for (uint32_t i = 0; i < handoff_buses_[index].n_trace_frames; ++i)
+		tb_append_fd_ts(&bus->tracebuffer, &frames[i].cfd,
+				frames[i].timestamp);
+}
+
+/* The identities of the nodes override those that were saved, as they are
+ * the latest. Without a state path, they are kept only for the boot-up.
+ */
+static void adopt_nodes(struct co_bus* bus, int index)
+{
+	const struct handoff_bus* handed = &handoff_buses_[index];
+
+	if (!bus->identities)
+		bus->identities = calloc(1, sizeof(*bus->identities));
+
+	int n_running = 0;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		const struct handoff_node* node = &handed->node[i];
+
+		bus->nodes_seen[i] = !!node->is_seen;
+		bus->nodes_running[i] = !!node->is_started;
+		n_running += bus->nodes_running[i];
+
+		if (bus->identities && node->identity.is_known)
+			bus->identities->node[i] = node->identity;
+	}
+
+	bus->is_adopted = 1;
+
+	plog(LOG_NOTICE, "%s: Taken over with %d running nodes", bus->iface,
+	     n_running);
+}
+
+/* Without error frames, the bus is taken to be fine, as it was before they
+ * were looked at, so failing to subscribe is only logged.
+ */
+static int init_can_errors(struct co_bus* bus)
+{
+	can_errors_init(&bus->can_errors, cfg.can_error_hold * 1000ULL);
+
+	if (socketcan_apply_error_filter(bus->socket.fd, CAN_ERRORS_MASK) < 0) {
+		plog(LOG_WARNING, "%s: Could not subscribe to error frames: %s",
+		     bus->iface, strerror(errno));
+		return 0;
+	}
+
+	bus->can_error_timer = mloop_timer_new(mloop_default());
+	if (!bus->can_error_timer)
+		return -1;
+
+	mloop_timer_set_context(bus->can_error_timer, bus, NULL);
+	mloop_timer_set_callback(bus->can_error_timer, on_can_error_timeout);
+	return 0;
+}
+
+static void destroy_can_errors(struct co_bus* bus)
+{
+	if (!bus->can_error_timer)
+		return;
+
+	mloop_timer_stop(bus->can_error_timer);
+	mloop_timer_unref(bus->can_error_timer);
+	bus->can_error_timer = NULL;
+
+	const struct can_errors* errors = &bus->can_errors;
+	uint64_t n_unsent = sock_get_n_unsent(&bus->socket);
+	if (errors->n_frames > 0 || bus->n_rpdos_dropped > 0 || n_unsent > 0)
+		plog(LOG_NOTICE, "%s: CAN errors: %llu error frames, %llu times bus-off, %llu restarts, %llu RPDOs dropped, %llu frames unsent",
+		     bus->iface, (unsigned long long)errors->n_frames,
+		     (unsigned long long)errors->n_bus_off,
+		     (unsigned long long)errors->n_restarts,
+		     (unsigned long long)bus->n_rpdos_dropped,
+		     (unsigned long long)n_unsent);
+}
+
+static int open_bus(struct co_bus* bus)
+{
+	bus->socket.fd = -1;
+	bus->state = CO_BUS_STATE_STARTUP;
+	pthread_mutex_init(&bus->mux_filter_mutex, NULL);
+	pthread_mutex_init(&bus->sync_lock, NULL);
+	sync_cycle_init(&bus->sync_cycle);
+	bl_meter_init(&bus->meter, cfg.bitrate);
+
+	int handoff = find_handoff_bus(bus->iface);
+	const struct handoff_bus* handed = handoff >= 0
+					 ? &handoff_buses_[handoff] : NULL;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		bus->node[i].bus = bus;
+		bus->node[i].nodeid = i;
+		bus->node[i].ndrv = &bus->drv[i];
+		bus->drv[i].node = &bus->node[i];
+	}
+
+	if (cfg.trace_buffer_size > 0) {
+		if (init_tracebuffer(bus) < 0) {
+			perror("Could not initialize trace buffer");
+			goto tracebuffer_failure;
+		}
+
+		if (cfg.lock_memory)
+			tb_prefault(&bus->tracebuffer);
+
+		if (init_trace_filter(bus) < 0)
+			goto socketcan_open_failure;
+
+		if (handed)
+			restore_trace(bus, handoff);
+	}
+
+	struct tracebuffer* tb = cfg.trace_buffer_size > 0 ? &bus->tracebuffer
+							   : NULL;
+
+	/* Frames that arrived during the handoff are waiting on the socket */
+	enum sock_type sock_type = cfg.use_tcp ? SOCK_TYPE_TCP : SOCK_TYPE_CAN;
+	int fd = handed && !cfg.use_tcp ? take_handoff_fd(handed->socket) : -1;
+	if (fd >= 0)
+		sock_init(&bus->socket, SOCK_TYPE_CAN, fd, tb);
+	else if (sock_open(&bus->socket, sock_type, bus->iface, tb) < 0) {
+		fprintf(stderr, "Could not open CAN bus %s: %s\n", bus->iface,
+			strerror(errno));
+		goto socketcan_open_failure;
+	}
+
+	if (cfg.bitrate > 0)
+		bus->socket.meter = &bus->meter;
+
+	if (cfg.use_tcp && cfg.compact_tcp
+	 && sock_request_compact(&bus->socket, 0, MASTER_HELLO_TIMEOUT) < 0)
+		fprintf(stderr, "Using the legacy wire format on %s: %s\n",
+			bus->iface, strerror(errno));
+
+	if (cfg.enable_can_fd && sock_enable_fd(&bus->socket) < 0) {
+		fprintf(stderr, "Could not enable CAN FD on %s: %s\n",
+			bus->iface, strerror(errno));
+		goto txq_failure;
+	}
+
+	/* Not fatal: everything is then sent on the one socket */
+	if (cfg.can_tx_classes && sock_type == SOCK_TYPE_CAN
+	 && sock_open_tx_classes(&bus->socket, bus->iface) < 0)
+		fprintf(stderr, "Could not open transmit class sockets on %s: %s\n",
+			bus->iface, strerror(errno));
+
+	if (sock_txq_init(&bus->socket, MASTER_TXQ_SIZE) < 0) {
+		perror("Could not allocate transmit queue");
+		goto txq_failure;
+	}
+
+	if (cfg.shm_ring_size > 0) {
+		char name[256];
+		shm_ring_make_name(name, sizeof(name), bus->iface);
+
+		/* Readers keep on reading a ring that was handed over */
+		int fd = handed ? take_handoff_fd(handed->shm_ring) : -1;
+		int rc = fd >= 0 ? shm_ring_adopt(&bus->shm_ring, name, fd)
+				 : shm_ring_create(&bus->shm_ring, name,
+						   cfg.shm_ring_size);
+		if (rc < 0) {
+			fprintf(stderr, "Could not create shared memory ring %s: %s\n",
+				name, strerror(errno));
+			goto txq_failure;
+		}
+	}
+
+	if (cfg.process_image) {
+		char name[256];
+		process_image_make_name(name, sizeof(name), bus->iface);
+
+		int fd = handed ? take_handoff_fd(handed->process_image) : -1;
+		int rc = fd >= 0 ? process_image_adopt(&bus->process_image, name,
+						       fd)
+				 : process_image_create(&bus->process_image,
+							name);
+		if (rc < 0) {
+			fprintf(stderr, "Could not create process image %s: %s\n",
+				name, strerror(errno));
+			goto process_image_failure;
+		}
+	}
+
+	enum sdo_async_quirks_flags sdo_quirks;
+	sdo_quirks = cfg.be_strict ? SDO_ASYNC_QUIRK_NONE : SDO_ASYNC_QUIRK_ALL;
+
+	if (sdo_req_queues_init(bus->sdo_queue, &bus->socket,
+				cfg.sdo_queue_length, sdo_quirks) < 0)
+		goto sdo_queue_failure;
+
+	if (sdo_throttle_init(&bus->sdo_throttle, &bus->meter,
+			      cfg.bitrate > 0 ? cfg.sdo_load_ceiling * 10 : 0) < 0)
+		goto sdo_throttle_failure;
+
+	for (int i = 0; i <= CANOPEN_NODEID_MAX; ++i) {
+		bus->sdo_queue[i].stats = &bus->stats[i];
+		bus->sdo_queue[i].throttle = &bus->sdo_throttle;
+	}
+
+	if (sock_type == SOCK_TYPE_CAN && init_can_errors(bus) < 0)
+		goto can_errors_failure;
+
+	fw_updater_init(&bus->firmware, bus->sdo_queue, cfg.firmware_max_active);
+
+	load_identities(bus);
+
+	if (handed)
+		adopt_nodes(bus, handoff);
+
+	if (sock_type == SOCK_TYPE_CAN)
+		net_fix_sndbuf(bus->socket.fd);
+
+	start_trace_recorder(bus);
+
+	return 0;
+
+can_errors_failure:
+	sdo_throttle_destroy(&bus->sdo_throttle);
+sdo_throttle_failure:
+	sdo_req_queues_cleanup(bus->sdo_queue);
+sdo_queue_failure:
+	process_image_destroy(&bus->process_image);
+process_image_failure:
+	shm_ring_destroy(&bus->shm_ring);
+txq_failure:
+	sock_close(&bus->socket);
+socketcan_open_failure:
+	if (cfg.trace_buffer_size > 0) {
+		tb_destroy(&bus->tracebuffer);
+		free(bus->trace_filter);
+	}
+tracebuffer_failure:
+	bl_meter_destroy(&bus->meter);
+	sync_cycle_destroy(&bus->sync_cycle);
+	pthread_mutex_destroy(&bus->sync_lock);
+	pthread_mutex_destroy(&bus->mux_filter_mutex);
+	return -1;
 }
 
-static int appbase_dummy()
+/* Nothing is sent or received on the bus after this */
+static void stop_bus_io(struct co_bus* bus)
 {
-	return 0;
+	stop_start_timer(bus);
+	stop_heartbeat_scanner(bus);
+	destroy_ping_timer(bus);
+	stop_sync_producer(bus);
+
+	stop_pdo_thread(bus);
+	stop_rx_reactor(bus);
+	stop_rx_forwarding(bus);
+
+	if (bus->mux_handler) {
+		mloop_socket_set_fd(bus->mux_handler, -1);
+		mloop_socket_unref(bus->mux_handler);
+		bus->mux_handler = NULL;
+	}
 }
 
-static int run_appbase()
+static void close_bus(struct co_bus* bus)
 {
-	appcbase_t cb = { 0 };
-	cb.queue_timeout_ms = -1;
-	cb.usetm = 1;
-	cb.initialize = appbase_dummy;
-	cb.deinitialize = appbase_dummy;
-	cb.on_tickmaster_alive = on_tickermaster_alive;
+	stop_bus_io(bus);
 
-	if (appbase_initialize("canopen", appbase_get_instance(), &cb) != 0)
-		return 1;
+	fw_updater_destroy(&bus->firmware);
+	sdo_req_queues_cleanup(bus->sdo_queue);
+	destroy_can_errors(bus);
+	sdo_throttle_destroy(&bus->sdo_throttle);
 
-	set_priority();
+	free(bus->identities);
+	bus->identities = NULL;
+	sock_close(&bus->socket);
+	shm_ring_destroy(&bus->shm_ring);
+	process_image_destroy(&bus->process_image);
 
-	mloop_run(mloop_);
+	stop_trace_recorder(bus);
 
-	appbase_deinitialize();
+	if (cfg.trace_buffer_size > 0) {
+		tb_destroy(&bus->tracebuffer);
+		free(bus->trace_filter);
+		bus->trace_filter = NULL;
+	}
 
-	return 0;
+	if (bus->n_sync_rpdos_overwritten > 0 || bus->n_sync_rpdos_late > 0)
+		plog(LOG_NOTICE, "%s: Synchronous RPDOs: %llu overwritten, %llu late",
+		     bus->iface,
+		     (unsigned long long)bus->n_sync_rpdos_overwritten,
+		     (unsigned long long)bus->n_sync_rpdos_late);
+
+	uint64_t n_cycles, n_incomplete;
+	sync_cycle_get_counts(&bus->sync_cycle, &n_cycles, &n_incomplete);
+	if (n_incomplete > 0)
+		plog(LOG_NOTICE, "%s: Synchronous TPDOs: %llu of %llu cycles incomplete",
+		     bus->iface, (unsigned long long)n_incomplete,
+		     (unsigned long long)n_cycles);
+
+	if (bus->sdo_throttle.n_deferred > 0)
+		plog(LOG_NOTICE, "%s: Background SDOs: %llu admitted, %llu deferred for bus load",
+		     bus->iface,
+		     (unsigned long long)bus->sdo_throttle.n_admitted,
+		     (unsigned long long)bus->sdo_throttle.n_deferred);
+
+	bl_meter_destroy(&bus->meter);
+	sync_cycle_destroy(&bus->sync_cycle);
+	pthread_mutex_destroy(&bus->sync_lock);
+	pthread_mutex_destroy(&bus->mux_filter_mutex);
 }
 
-static int master_set_node_state(int nodeid, int state)
+static int open_buses(void)
 {
-	(void)nodeid;
-	(void)state;
+	int i;
+
+	for (i = 0; i < co_master_n_buses_; ++i)
+		if (open_bus(&co_bus_[i]) < 0)
+			goto failure;
 
-	/* not allowed */
 	return 0;
+
+failure:
+	while (i-- > 0)
+		close_bus(&co_bus_[i]);
+	return -1;
 }
 
-static inline
-struct co_master_node*
-get_node_from_sdo_queue(const struct sdo_req_queue* queue)
+static void close_buses(void)
 {
-	return co_master_get_node(queue->nodeid);
+	struct co_bus* bus;
+	for_each_bus(bus)
+		close_bus(bus);
 }
 
-static void on_master_sdo_request_done(struct sdo_req* req)
+static void stop_buses(void)
 {
-	struct co_master_node* node = get_node_from_sdo_queue(req->parent);
-	void* driver = node->driver;
-	assert(driver);
-
-	if (req->status == SDO_REQ_OK) {
-		legacy_driver_iface_process_sdo(driver,
-						req->index,
-						req->subindex,
-						(unsigned char*)req->data.data,
-						req->data.index);
-	} else {
-		legacy_driver_iface_process_sdo(driver,
-						req->index,
-						req->subindex,
-						NULL, 0);
+	struct co_bus* bus;
+	for_each_bus(bus) {
+		bus->state = CO_BUS_STATE_STOPPING;
+		unload_all_drivers(bus);
 	}
 }
 
-static int master_request_sdo(int nodeid, int index, int subindex)
+/* The descriptor is owned by the list from here on, even if it does not fit.
+ * Returns its index, or -1.
+ */
+static int32_t add_handoff_fd(int* fds, size_t* n_fds, int fd)
 {
-	struct sdo_req_info info = {
-		.type = SDO_REQ_UPLOAD,
-		.index = index,
-		.subindex = subindex,
-		.on_done = on_master_sdo_request_done
-	};
-
-	struct sdo_req* req = sdo_req_new(&info);
-	if (!req)
+	if (fd < 0)
 		return -1;
 
-	int rc = sdo_req_start(req, sdo_req_queue_get(nodeid));
+	if (*n_fds >= HANDOFF_MAX_FDS) {
+		close(fd);
+		return -1;
+	}
 
-	sdo_req_unref(req);
-	return rc;
+	fds[*n_fds] = fd;
+	return (*n_fds)++;
 }
 
-static void on_master_sdo_send_done(struct sdo_req* req)
+/* The shared memory is opened again by name, as the descriptors were closed
+ * once it was mapped. Only SocketCAN sockets are handed over; the new process
+ * connects to a TCP service of its own.
+ */
+static void describe_bus(struct handoff_bus* dst, struct co_bus* bus,
+			 int* fds, size_t* n_fds)
 {
-	(void)req;
+	strlcpy(dst->iface, bus->iface, sizeof(dst->iface));
+
+	dst->socket = bus->socket.type == SOCK_TYPE_CAN
+		    ? add_handoff_fd(fds, n_fds,
+				     fcntl(bus->socket.fd, F_DUPFD_CLOEXEC, 0))
+		    : -1;
+
+	dst->shm_ring = bus->shm_ring.header
+		      ? add_handoff_fd(fds, n_fds,
+				       shm_open(bus->shm_ring.name,
+						O_RDWR | O_CLOEXEC, 0))
+		      : -1;
+
+	dst->process_image = bus->process_image.map
+			   ? add_handoff_fd(fds, n_fds,
+					    shm_open(bus->process_image.name,
+						     O_RDWR | O_CLOEXEC, 0))
+			   : -1;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		const struct co_master_node* node = co_bus_get_node(bus, i);
+		struct handoff_node* handed = &dst->node[i];
+
+		handed->is_seen = bus->nodes_seen[i]
+			       || node->driver_type != CO_MASTER_DRIVER_NONE;
+		handed->is_started = is_startable(bus, i);
+
+		if (node->driver_type != CO_MASTER_DRIVER_NONE)
+			make_identity(&handed->identity, node);
+	}
 }
 
-static int master_send_sdo(int nodeid, int index, int subindex,
-			   unsigned char* data, size_t size)
+/* A mapped trace buffer is left in its file for the new process */
+static struct tb_frame* snapshot_trace(struct co_bus* bus, uint32_t* n)
 {
-	struct sdo_req_info info = {
-		.type = SDO_REQ_DOWNLOAD,
-		.index = index,
-		.subindex = subindex,
-		.dl_data = data,
-		.dl_size = size,
-		.on_done = on_master_sdo_send_done
-	};
+	*n = 0;
 
-	struct sdo_req* req = sdo_req_new(&info);
-	if (!req)
-		return -1;
+	if (cfg.trace_buffer_size == 0 || tb_is_mapped(&bus->tracebuffer))
+		return NULL;
 
-	int rc = sdo_req_start(req, sdo_req_queue_get(nodeid));
+	struct tb_frame* frames = malloc(bus->tracebuffer.length
+					 * sizeof(*frames));
+	if (frames)
+		*n = tb_snapshot(&bus->tracebuffer, frames);
 
-	sdo_req_unref(req);
-	return rc;
+	return frames;
 }
-#endif /* NO_MAREL_CODE */
 
-int co__rpdox(int nodeid, int type, const void* data, size_t size)
+static int send_handoff(int sock)
 {
-	if (!data || size > CAN_MAX_DLEN)
-		return -1;
+	int rc = -1;
+	int fds[HANDOFF_MAX_FDS];
+	size_t n_fds = 0;
+	struct co_bus* bus;
+
+	struct handoff_bus* buses = calloc(co_master_n_buses_, sizeof(*buses));
+	struct tb_frame** traces = calloc(co_master_n_buses_, sizeof(*traces));
+	if (!buses || !traces)
+		goto done;
+
+	for_each_bus(bus) {
+		describe_bus(&buses[bus->index], bus, fds, &n_fds);
+		traces[bus->index] = snapshot_trace(bus,
+				&buses[bus->index].n_trace_frames);
+	}
 
-	struct can_frame cf = {
-		.can_id = type + nodeid,
-		.can_dlc = size
-	};
+	struct handoff_header header;
+	int32_t rest = add_handoff_fd(fds, &n_fds,
+			fcntl(rest_get_listen_fd(), F_DUPFD_CLOEXEC, 0));
+	handoff_header_init(&header, co_master_n_buses_, n_fds);
+	header.rest = rest;
 
-	memcpy(cf.data, data, size);
+	if (handoff_send(sock, &header, sizeof(header), fds, n_fds) < 0
+	 || handoff_send(sock, buses, co_master_n_buses_ * sizeof(*buses),
+			 NULL, 0) < 0)
+		goto done;
+
+	for (int i = 0; i < co_master_n_buses_; ++i)
+		if (handoff_send(sock, traces[i], buses[i].n_trace_frames
+				 * sizeof(struct tb_frame), NULL, 0) < 0)
+			goto done;
+
+	rc = 0;
 
-	return sock_send(&socket_, &cf, 0);
+done:
+	for (size_t i = 0; i < n_fds; ++i)
+		close(fds[i]);
 
+	if (traces)
+		for (int i = 0; i < co_master_n_buses_; ++i)
+			free(traces[i]);
+
+	free(traces);
+	free(buses);
+	return rc;
 }
 
-int co__start(int nodeid)
+/* The buses are handed over to a new process, started from the binary that
+ * is on disk now, which takes them up without resetting or starting any
+ * nodes. This process stops receiving first, so that the trace that it sends
+ * is complete, and then exits without stopping the nodes. The shared memory
+ * is left for the new process.
+ *
+ * If the new process cannot be started, this one carries on. If it cannot be
+ * sent what it needs, it starts afresh, and this one stops as usual.
+ */
+static void hand_over(void)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	assert(node);
+	if (is_handed_over_)
+		return;
 
-	if (!(node->ndrv.options & CO_OPT_INHIBIT_START))
-		return -1;
+	if (is_any_bus_starting()) {
+		plog(LOG_WARNING, "Handoff: Not handing over while buses are starting");
+		return;
+	}
 
-	node->ndrv.options &= ~CO_OPT_INHIBIT_START;
+	int sock = handoff_spawn();
+	if (sock < 0) {
+		plog(LOG_ERROR, "Handoff: Could not start a new process: %m");
+		return;
+	}
 
-	if (master_state_ != MASTER_STATE_STARTUP)
-		start_single_node(node);
-	else if (--n_inhibited_starts == 0)
-		start_all_nodes();
+	/* The other reactors may be receiving from the buses */
+	reactor_stop();
 
-	return 0;
-}
+	struct co_bus* bus;
+	for_each_bus(bus)
+		stop_bus_io(bus);
 
-#ifndef NO_MAREL_CODE
-static int master_send_pdo(int nodeid, int n, unsigned char* data, size_t size)
-{
-	switch (n) {
-	case 1: return co__rpdox(nodeid, R_RPDO1, data, size);
-	case 2: return co__rpdox(nodeid, R_RPDO2, data, size);
-	case 3: return co__rpdox(nodeid, R_RPDO3, data, size);
-	case 4: return co__rpdox(nodeid, R_RPDO4, data, size);
+	if (send_handoff(sock) < 0) {
+		plog(LOG_ERROR, "Handoff: Could not send the state to the new process: %m; stopping");
+		close(sock);
+		mloop_exit(mloop_default());
+		return;
 	}
 
-	abort();
-	return -1;
-}
+	for_each_bus(bus) {
+		bus->shm_ring.is_owner = 0;
+		bus->process_image.is_owner = 0;
+	}
 
-static void* master_iface_init(int nodeid)
-{
-	struct legacy_master_iface cb;
-	cb.set_node_state = master_set_node_state;
-	cb.request_sdo = master_request_sdo;
-	cb.send_sdo = master_send_sdo;
-	cb.send_pdo = master_send_pdo;
-	cb.nodeid = nodeid;
+	is_handed_over_ = 1;
+	handoff_sock_ = sock;
 
-	return legacy_master_iface_new(&cb);
+	plog(LOG_NOTICE, "Handoff: Handed over to a new process");
+	mloop_exit(mloop_default());
 }
-#endif /* NO_MAREL_CODE */
 
-static int init_heartbeat_timer(struct co_master_node* node)
+static int init_reactors(void)
 {
-	int nodeid = co_master_get_node_id(node);
-
-	struct mloop_timer* timer = mloop_timer_new(mloop_default());
-	if (!timer)
+	if (reactor_init(cfg.n_reactors > 0 ? cfg.n_reactors : 1) < 0)
 		return -1;
 
-	uint64_t period = cfg.node[nodeid].heartbeat_period
-			+ cfg.node[nodeid].heartbeat_timeout;
+	if (reactor_pin(REACTOR_CAN, cfg.can_reactor) < 0
+	 || reactor_pin_range(REACTOR_REST, cfg.rest_reactor,
+			      cfg.rest_reactors > 0 ? cfg.rest_reactors : 1) < 0
+	 || reactor_pin(REACTOR_TRACE, cfg.trace_reactor) < 0)
+		goto failure;
 
-	if (cfg.node[nodeid].n_timeouts_max > 0)
-		mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+	if (cfg.edf_scheduling) {
+		mloop_set_scheduling(mloop_, MLOOP_SCHED_EDF);
 
-	mloop_timer_set_context(timer, node, NULL);
-	mloop_timer_set_time(timer, period * 1000000LL);
-	mloop_timer_set_callback(timer, on_heartbeat_timeout);
-	node->heartbeat_timer = timer;
+		for (int i = 0; i < REACTOR_N_ROLES; ++i)
+			mloop_set_scheduling(reactor_get(i), MLOOP_SCHED_EDF);
+	}
 
 	return 0;
+
+failure:
+	reactor_cleanup();
+	return -1;
 }
 
-static int init_ping_timer(struct co_master_node* node)
+static void start_event_trace(void)
 {
-	int nodeid = co_master_get_node_id(node);
-
-	struct mloop_timer* timer = mloop_timer_new(mloop_default());
-	if (!timer)
-		return -1;
-
-	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
-	mloop_timer_set_context(timer, node, NULL);
-	mloop_timer_set_time(timer, cfg.node[nodeid].heartbeat_period * 1000000LL);
-	mloop_timer_set_callback(timer, on_ping_timeout);
-	node->ping_timer = timer;
+	size_t size = cfg.event_trace_size;
 
-	return 0;
-}
+	/* CANOPEN_PROFILE used to print the boot-up phases */
+	if (size == 0 && profiling_is_active())
+		size = EVENT_TRACE_DEFAULT_SIZE;
 
-static void unload_all_drivers()
-{
-	int i;
-	for_each_node(i)
-		if (co_master_get_node(i)->driver_type != CO_MASTER_DRIVER_NONE)
-			unload_driver(i);
+	if (size > 0 && event_trace_enable(size) < 0)
+		perror("Could not enable event tracing");
 }
 
-static int init_trace_dump_path(const char* path)
+/* The timeline is saved to trace_dump_path when the master stops */
+static void save_event_trace(void)
 {
-	struct stat st;
-
-	if (stat(path, &st) == 0) {
-		if (!S_ISDIR(st.st_mode)) {
-			errno = EEXIST;
-			return -1;
-		}
-	} else {
-		if (mkdir(path, 0755) < 0)
-			return -1;
-	}
+	char path[256];
 
-	return 0;
-}
+	if (!event_trace_is_enabled())
+		return;
 
-void on_stop_signal(struct mloop_signal* sig, int signo)
-{
-	(void)sig;
+	event_trace_disable();
 
-	switch (signo) {
-	case SIGUSR1:
-		dump_tracebuffer(NULL);
-		break;
-	default:
-		mloop_exit(mloop_default());
-		break;
+	if (init_trace_dump_path(cfg.trace_dump_path) < 0) {
+		plog(LOG_ERROR, "Could not create %s: %m", cfg.trace_dump_path);
+		return;
 	}
-}
 
-int init_signal_handler(struct mloop* mloop)
-{
-	struct mloop_signal* ms = mloop_signal_new(mloop);
-	if (!ms)
-		return -1;
+	snprintf(path, sizeof(path), "%s/timeline.json", cfg.trace_dump_path);
 
-	sigset_t s;
-	sigemptyset(&s);
-	sigaddset(&s, SIGINT);
-	sigaddset(&s, SIGTERM);
-	sigaddset(&s, SIGQUIT);
-	sigaddset(&s, SIGUSR1);
+	FILE* stream = fopen(path, "we");
+	if (!stream) {
+		plog(LOG_ERROR, "Could not save event trace to %s: %m", path);
+		return;
+	}
 
-	pthread_sigmask(SIG_BLOCK, &s, NULL);
+	if (event_trace_write_json(stream) < 0)
+		plog(LOG_ERROR, "Could not save event trace to %s", path);
 
-	mloop_signal_set_signals(ms, &s);
-	mloop_signal_set_callback(ms, on_stop_signal);
-	int rc = mloop_signal_start(ms);
-	mloop_signal_unref(ms);
-	return rc;
+	fclose(stream);
 }
 
 __attribute__((visibility("default")))
@@ -1554,57 +6393,97 @@ int co_master_run(void)
 {
 	int rc = 0;
 
-	profiling_reset();
-	profile("Starting up canopen-master...\n");
+	start_event_trace();
+	event_trace_begin(EVENT_TRACE_STARTUP, 0);
+
+	if (parse_buses(cfg.iface) < 0) {
+		perror("Invalid interface list");
+		return 1;
+	}
+
+	if (init_thread_scheds() < 0)
+		return 1;
+
+	/* Before any of the threads are started, so that they all prefault
+	 * their stacks
+	 */
+	if (cfg.lock_memory)
+		rt_thread_lock_memory(cfg.stack_prefault * 1024);
+
+	if (cfg.sdo_req_reserve > 0 && sdo_req_reserve(cfg.sdo_req_reserve) < 0)
+		perror("Could not preallocate SDO requests");
 
-	memset(nodes_seen_, 0, sizeof(nodes_seen_));
-	memset(nodes_seen_late_, 0, sizeof(nodes_seen_));
-	memset(co_master_node_, 0, sizeof(co_master_node_));
+	if (cfg.mloop_reserve > 0
+	 && mloop_reserve_objects(cfg.mloop_reserve) < 0)
+		perror("Could not preallocate loop objects");
+
+	take_over();
 
 	mloop_ = mloop_default();
 	mloop_ref(mloop_);
+	mloop_set_job_budget(mloop_, cfg.job_budget, cfg.job_budget_time);
+
+	if (cfg.mloop_profiling || cfg.stall_threshold)
+		mloop_set_profiling(mloop_, 1, cfg.stall_threshold * 1000ULL);
 
-	profile("Load EDS database...\n");
+	if (cfg.async_log
+	 && alog_start(cfg.log_ring_size, cfg.log_rate_limit) < 0)
+		perror("Could not start logging thread; logging synchronously");
+
+	if (start_driver_execs() < 0)
+		perror("Could not start driver threads; running drivers on the receiving threads");
+
+	if (init_reactors() < 0) {
+		perror("Could not create reactors");
+		rc = 1;
+		goto reactor_failure;
+	}
+
+	event_trace_begin(EVENT_TRACE_LOAD_EDS, 0);
+	eds_db_set_n_threads(cfg.n_workers);
+	eds_db_set_lazy(cfg.lazy_eds);
 	eds_db_load();
+	event_trace_end(EVENT_TRACE_LOAD_EDS, 0);
 
-	profile("Initialize and register SDO REST service...\n");
-	if (rest_init(cfg.rest_port) < 0) {
+	event_trace_begin(EVENT_TRACE_INIT_REST, 0);
+	int rest_fd = take_handoff_fd(handoff_header_.rest);
+	if ((rest_fd >= 0 ? rest_init_fd(rest_fd)
+			  : rest_init(cfg.rest_port)) < 0) {
 		perror("Could not initialize rest service");
 		goto rest_init_failure;
 	}
 
-	if (rest_register_service(HTTP_GET | HTTP_PUT,
-				  "sdo", sdo_rest_service) < 0)
+	if (register_rest_services() < 0)
 		goto rest_service_failure;
 
-	profile("Open interface...\n");
-	enum sock_type sock_type = cfg.use_tcp ? SOCK_TYPE_TCP : SOCK_TYPE_CAN;
-	if (sock_open(&socket_, sock_type, cfg.iface,
-		      cfg.trace_buffer_size > 0 ? &tracebuffer_ : NULL) < 0) {
-		perror("Could not open CAN bus");
-		goto socketcan_open_failure;
-	}
+	if (start_memory_sampler() < 0)
+		perror("Could not start memory sampler; /memory shows no rates");
+	event_trace_end(EVENT_TRACE_INIT_REST, 0);
 
-#ifndef NO_MAREL_CODE
-	if (canopen_info_init(cfg.iface) < 0) {
-		perror("Could not initialize info structure");
-		goto info_failure;
+	event_trace_begin(EVENT_TRACE_OPEN_BUSES, 0);
+	if (open_buses() < 0) {
+		rc = 1;
+		goto open_buses_failure;
 	}
-#endif /* NO_MAREL_CODE */
+	event_trace_end(EVENT_TRACE_OPEN_BUSES, 0);
 
-	enum sdo_async_quirks_flags sdo_quirks;
-	sdo_quirks = cfg.be_strict ? SDO_ASYNC_QUIRK_NONE : SDO_ASYNC_QUIRK_ALL;
+	drop_handoff();
 
-	profile("Initialize SDO queues...\n");
-	if (sdo_req_queues_init(&socket_, cfg.sdo_queue_length, sdo_quirks)
-			< 0)
-		goto sdo_req_queues_failure;
+	/* Not fatal: the buses can still be reached through REST */
+	if (cfg.gateway_port > 0 && sdo_gateway_init(cfg.gateway_port) < 0)
+		perror("Could not start CiA 309-3 gateway");
 
-	if (sock_type == SOCK_TYPE_CAN)
-		net_fix_sndbuf(socket_.fd);
+	/* Groups that are not valid are logged and left out */
+	sdo_poll_load_cfg();
+
+	mloop_set_prepare_fn(mloop_, flush_tx_queues, NULL);
 
 #ifndef NO_MAREL_CODE
-	profile("Create legacy driver manager...\n");
+	if (canopen_info_init(co_master_get_bus(0)->iface) < 0) {
+		perror("Could not initialize info structure");
+		goto info_failure;
+	}
+
 	driver_manager_ = legacy_driver_manager_new();
 	if (!driver_manager_) {
 		rc = 1;
@@ -1613,31 +6492,34 @@ int co_master_run(void)
 #endif /* NO_MAREL_CODE */
 
 	mloop_set_job_queue_size(cfg.job_queue_length);
-	mloop_set_worker_stack_size(cfg.job_queue_length);
+	mloop_set_worker_stack_size(cfg.worker_stack_size);
+	mloop_set_max_workers(cfg.max_workers);
+	mloop_set_worker_scaling(cfg.worker_grow_wait, cfg.worker_idle_timeout);
 
-	profile("Start worker threads...\n");
+	event_trace_begin(EVENT_TRACE_START_WORKERS, 0);
 	if (mloop_require_workers(cfg.n_workers) != 0) {
 		rc = 1;
 		goto worker_failure;
 	}
+	event_trace_end(EVENT_TRACE_START_WORKERS, 0);
 
-	if (cfg.trace_buffer_size > 0) {
-		profile("Initialize trace buffer...\n");
-		if (tb_init(&tracebuffer_, cfg.trace_buffer_size) < 0) {
-			perror("Could not initialize trace buffer");
-			rc = 1;
-			goto tracebuffer_failure;
-		}
-
-		if (init_trace_dump_path(cfg.trace_dump_path) < 0) {
-			perror("Could not create directory for trace dump");
-			rc = 1;
-			goto trace_dump_path_failure;
-		}
+	if (cfg.trace_buffer_size > 0
+	 && init_trace_dump_path(cfg.trace_dump_path) < 0) {
+		perror("Could not create directory for trace dump");
+		rc = 1;
+		goto trace_dump_path_failure;
 	}
 
 	init_signal_handler(mloop_);
 
+	if (reactor_run() < 0) {
+		perror("Could not start reactors");
+		rc = 1;
+		goto reactor_run_failure;
+	}
+
+	event_trace_end(EVENT_TRACE_STARTUP, 0);
+
 #ifndef NO_MAREL_CODE
 	rc = run_appbase();
 #else
@@ -1647,44 +6529,48 @@ int co_master_run(void)
 	rc = mloop_run(mloop_);
 #endif /* NO_MAREL_CODE */
 
-	master_state_ = MASTER_STATE_STOPPING;
-
-	unload_all_drivers();
-
-	if (mux_handler_) {
-		mloop_socket_set_fd(mux_handler_, -1);
-		mloop_socket_unref(mux_handler_);
-	}
+	stop_buses();
 
 bootup_failure:
+	reactor_stop();
+reactor_run_failure:
 trace_dump_path_failure:
-	if (cfg.trace_buffer_size > 0)
-		tb_destroy(&tracebuffer_);
-tracebuffer_failure:
 worker_failure:
 #ifndef NO_MAREL_CODE
 	legacy_driver_manager_delete(driver_manager_);
-#endif /* NO_MAREL_CODE */
 
 driver_manager_failure:
-	sdo_req_queues_cleanup();
-
-sdo_req_queues_failure:
-	if (socket_.fd >= 0)
-		sock_close(&socket_);
-
-#ifndef NO_MAREL_CODE
 	canopen_info_cleanup();
-#endif /* NO_MAREL_CODE */
 info_failure:
-socketcan_open_failure:
+#endif /* NO_MAREL_CODE */
+	mloop_set_prepare_fn(mloop_, NULL, NULL);
+	sdo_gateway_cleanup();
+	sdo_poll_cleanup();
+	close_buses();
+
+open_buses_failure:
+	stop_memory_sampler();
 rest_service_failure:
+	drv_registry_cleanup();
+	event_rest_cleanup();
+	trace_rest_cleanup();
 	rest_cleanup();
 
 rest_init_failure:
+	sdo_rest_cleanup();
 	eds_db_unload();
+	reactor_cleanup();
 
+reactor_failure:
+	save_event_trace();
+	stop_driver_execs();
+	alog_stop();
 	mloop_unref(mloop_);
+	drop_handoff();
+
+	/* The new process waits for this before it opens the buses */
+	if (handoff_sock_ >= 0)
+		close(handoff_sock_);
+
 	return rc;
 }
-
@@ -0,0 +1,304 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#include "mem-tag.h"
+#include "co_atomic.h"
+
+struct mem_tag_counters {
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	uint64_t n_allocs;
+	uint64_t n_frees;
+	uint64_t n_failures;
+	uint64_t total_bytes;
+} __attribute__((aligned(64)));
+
+static const char* mem_tag__names[MEM_TAG_N] = {
+	[MEM_TAG_OTHER] = "other",
+	[MEM_TAG_VECTOR] = "vector",
+	[MEM_TAG_SDO_REQ] = "sdo_req",
+	[MEM_TAG_INI] = "ini",
+	[MEM_TAG_EDS] = "eds",
+	[MEM_TAG_MLOOP] = "mloop",
+	[MEM_TAG_REST] = "rest",
+};
+
+static void* mem__malloc(void* context, size_t size)
+{
+	(void)context;
+	return malloc(size);
+}
+
+static void* mem__realloc(void* context, void* ptr, size_t size)
+{
+	(void)context;
+	return realloc(ptr, size);
+}
+
+static void mem__free(void* context, void* ptr)
+{
+	(void)context;
+	free(ptr);
+}
+
+static size_t mem__usable_size(void* context, const void* ptr)
+{
+	(void)context;
+	return malloc_usable_size((void*)ptr);
+}
+
+static const struct mem_allocator mem__default_allocator = {
+	.alloc = mem__malloc,
+	.realloc = mem__realloc,
+	.free = mem__free,
+	.size = mem__usable_size,
+};
+
+static struct mem_tag_counters mem_tag__counters[MEM_TAG_N];
+static struct mem_allocator mem_tag__allocators[MEM_TAG_N];
+static pthread_mutex_t mem_tag__mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct mem_tag__sample {
+	uint64_t time;
+	uint64_t n_allocs[MEM_TAG_N];
+	uint64_t total_bytes[MEM_TAG_N];
+};
+
+/* The two ends of the last whole window, guarded by the mutex */
+static struct mem_tag__sample mem_tag__samples[2];
+static int mem_tag__n_samples;
+
+/* Zeroed entries stand for the default */
+static inline const struct mem_allocator* mem__allocator(enum mem_tag tag)
+{
+	const struct mem_allocator* allocator = &mem_tag__allocators[tag];
+	return allocator->alloc ? allocator : &mem__default_allocator;
+}
+
+static void mem__count_alloc(enum mem_tag tag, size_t size)
+{
+	struct mem_tag_counters* counters = &mem_tag__counters[tag];
+
+	co_atomic_add_relaxed(&counters->n_allocs, 1);
+	co_atomic_add_relaxed(&counters->total_bytes, size);
+
+	uint64_t live = co_atomic_add_relaxed(&counters->live_bytes, size);
+	uint64_t peak = co_atomic_load_relaxed(&counters->peak_bytes);
+	while (live > peak && !co_atomic_cas(&counters->peak_bytes, peak, live))
+		peak = co_atomic_load_relaxed(&counters->peak_bytes);
+}
+
+static void mem__count_free(enum mem_tag tag, size_t size)
+{
+	struct mem_tag_counters* counters = &mem_tag__counters[tag];
+
+	co_atomic_add_relaxed(&counters->n_frees, 1);
+	co_atomic_add_relaxed(&counters->live_bytes, -(uint64_t)size);
+}
+
+static inline void* mem__counted(enum mem_tag tag,
+				 const struct mem_allocator* allocator,
+				 void* ptr)
+{
+	if (ptr)
+		mem__count_alloc(tag, allocator->size(allocator->context, ptr));
+	else
+		co_atomic_add_relaxed(&mem_tag__counters[tag].n_failures, 1);
+
+	return ptr;
+}
+
+void* mem_alloc(enum mem_tag tag, size_t size)
+{
+	const struct mem_allocator* allocator = mem__allocator(tag);
+	return mem__counted(tag, allocator,
+			    allocator->alloc(allocator->context, size));
+}
+
+void* mem_calloc(enum mem_tag tag, size_t n, size_t size)
+{
+	const struct mem_allocator* allocator = mem__allocator(tag);
+
+	if (allocator == &mem__default_allocator)
+		return mem__counted(tag, allocator, calloc(n, size));
+
+	if (size && n > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return mem__counted(tag, allocator, NULL);
+	}
+
+	void* ptr = mem_alloc(tag, n * size);
+	if (ptr)
+		memset(ptr, 0, n * size);
+
+	return ptr;
+}
+
+void* mem_realloc(enum mem_tag tag, void* ptr, size_t size)
+{
+	if (!ptr)
+		return mem_alloc(tag, size);
+
+	const struct mem_allocator* allocator = mem__allocator(tag);
+	size_t old_size = allocator->size(allocator->context, ptr);
+
+	if (!allocator->realloc) {
+		void* result = mem_alloc(tag, size);
+		if (!result)
+			return NULL;
+
+		memcpy(result, ptr, old_size < size ? old_size : size);
+		mem_free(tag, ptr);
+		return result;
+	}
+
+	void* result = allocator->realloc(allocator->context, ptr, size);
+	if (!result) {
+		co_atomic_add_relaxed(&mem_tag__counters[tag].n_failures, 1);
+		return NULL;
+	}
+
+	/* Counted as a free of the old block and an allocation of the new */
+	mem__count_free(tag, old_size);
+	mem__count_alloc(tag, allocator->size(allocator->context, result));
+	return result;
+}
+
+char* mem_strdup(enum mem_tag tag, const char* str)
+{
+	size_t size = strlen(str) + 1;
+
+	char* copy = mem_alloc(tag, size);
+	if (copy)
+		memcpy(copy, str, size);
+
+	return copy;
+}
+
+void mem_free(enum mem_tag tag, void* ptr)
+{
+	if (!ptr)
+		return;
+
+	const struct mem_allocator* allocator = mem__allocator(tag);
+
+	mem__count_free(tag, allocator->size(allocator->context, ptr));
+	allocator->free(allocator->context, ptr);
+}
+
+int mem_tag_set_allocator(enum mem_tag tag, const struct mem_allocator* alloc)
+{
+	struct mem_tag_counters* counters = &mem_tag__counters[tag];
+	int rc = 0;
+
+	pthread_mutex_lock(&mem_tag__mutex);
+
+	if (co_atomic_load(&counters->n_allocs)
+	    != co_atomic_load(&counters->n_frees)) {
+		errno = EBUSY;
+		rc = -1;
+	} else if (alloc) {
+		mem_tag__allocators[tag] = *alloc;
+	} else {
+		memset(&mem_tag__allocators[tag], 0,
+		       sizeof(mem_tag__allocators[tag]));
+	}
+
+	pthread_mutex_unlock(&mem_tag__mutex);
+	return rc;
+}
+
+const char* mem_tag_name(enum mem_tag tag)
+{
+	return (unsigned)tag < MEM_TAG_N ? mem_tag__names[tag] : "unknown";
+}
+
+void mem_tag_get_stats(struct mem_tag_stats* dst, enum mem_tag tag)
+{
+	const struct mem_tag_counters* counters = &mem_tag__counters[tag];
+
+	dst->live_bytes = co_atomic_load_relaxed(&counters->live_bytes);
+	dst->peak_bytes = co_atomic_load_relaxed(&counters->peak_bytes);
+	dst->n_allocs = co_atomic_load_relaxed(&counters->n_allocs);
+	dst->n_frees = co_atomic_load_relaxed(&counters->n_frees);
+	dst->n_failures = co_atomic_load_relaxed(&counters->n_failures);
+	dst->total_bytes = co_atomic_load_relaxed(&counters->total_bytes);
+}
+
+void mem_tag_sample(uint64_t now)
+{
+	struct mem_tag__sample sample;
+	sample.time = now;
+
+	for (int i = 0; i < MEM_TAG_N; ++i) {
+		struct mem_tag_stats stats;
+		mem_tag_get_stats(&stats, i);
+
+		sample.n_allocs[i] = stats.n_allocs;
+		sample.total_bytes[i] = stats.total_bytes;
+	}
+
+	pthread_mutex_lock(&mem_tag__mutex);
+
+	mem_tag__samples[0] = mem_tag__samples[1];
+	mem_tag__samples[1] = sample;
+	if (mem_tag__n_samples < 2)
+		++mem_tag__n_samples;
+
+	pthread_mutex_unlock(&mem_tag__mutex);
+}
+
+int mem_tag_write_json(FILE* stream)
+{
+	pthread_mutex_lock(&mem_tag__mutex);
+
+	const struct mem_tag__sample* start = &mem_tag__samples[0];
+	const struct mem_tag__sample* end = &mem_tag__samples[1];
+	double elapsed = mem_tag__n_samples == 2 && end->time > start->time
+		       ? (end->time - start->time) / 1e6 : 0;
+
+	fprintf(stream, "{");
+
+	for (int i = 0; i < MEM_TAG_N; ++i) {
+		struct mem_tag_stats stats;
+		mem_tag_get_stats(&stats, i);
+
+		uint64_t n_allocs = end->n_allocs[i] - start->n_allocs[i];
+		uint64_t n_bytes = end->total_bytes[i] - start->total_bytes[i];
+
+		fprintf(stream, "%s\"%s\":{\"live_bytes\":%llu,\"peak_bytes\":%llu,\"allocs\":%llu,\"frees\":%llu,\"failures\":%llu",
+			i ? "," : "", mem_tag__names[i],
+			(unsigned long long)stats.live_bytes,
+			(unsigned long long)stats.peak_bytes,
+			(unsigned long long)stats.n_allocs,
+			(unsigned long long)stats.n_frees,
+			(unsigned long long)stats.n_failures);
+
+		fprintf(stream, ",\"allocs_per_s\":%.1f,\"bytes_per_s\":%.1f}",
+			elapsed > 0 ? n_allocs / elapsed : 0.0,
+			elapsed > 0 ? n_bytes / elapsed : 0.0);
+	}
+
+	fprintf(stream, "}");
+
+	pthread_mutex_unlock(&mem_tag__mutex);
+	return ferror(stream) ? -1 : 0;
+}
@@ -28,19 +28,38 @@
 #include <sys/timerfd.h>
 #include <sys/eventfd.h>
 #include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <limits.h>
 #include <errno.h>
 #include <execinfo.h>
+#include <sched.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include <sys/queue.h>
 
 #include "atomic_compat.h"
 #include "mloop.h"
 #include "prioq.h"
+#include "workq.h"
+#include "uring.h"
+#include "plog.h"
+#include "event-trace.h"
+#include "mem-tag.h"
 
 #define EXPORT __attribute__((visibility("default")))
 
 #define MAX_EVENTS 16
 
+#define MLOOP_DEFAULT_JOB_BUDGET 64
+#define MLOOP_DEFAULT_JOB_BUDGET_US 1000
+
+#ifdef MLOOP_USE_IO_URING
+#define MLOOP_DEFAULT_FLAGS (MLOOP_F_IO_URING | MLOOP_F_EPOLL)
+#else
+#define MLOOP_DEFAULT_FLAGS MLOOP_F_EPOLL
+#endif
+
 #define mloop__cas(ptr, expected, desired) \
 ({ \
 	__typeof__(expected) expected_ = (expected); \
@@ -99,6 +118,8 @@ struct mloop_socket {
 	int fd;
 	enum mloop_socket_event revents;
 	enum mloop_socket_event events;
+	unsigned int uring_gen;
+	int is_multishot;
 };
 
 struct mloop_timer {
@@ -106,10 +127,15 @@ struct mloop_timer {
 	/* Members specific to timer can be added below */
 	enum mloop_timer_type timer_type;
 	uint64_t time;
+	uint64_t expires; /* In wheel ticks */
+	LIST_ENTRY(mloop_timer) wheel_links;
+	TAILQ_ENTRY(mloop_timer) expired_links;
+	int is_linked;
 };
 
 #define MLOOP_JOB_COMMON \
 	unsigned long priority; \
+	uint64_t deadline; \
 	int is_cancelled;
 
 struct mloop_async {
@@ -125,6 +151,9 @@ struct mloop_work {
 	MLOOP_JOB_COMMON /* Do not move */
 	/* Members specific to work can be added below */
 	mloop_work_fn work_fn;
+
+	/* Monotonic time in ns at which it was given to the workers */
+	uint64_t queued_at;
 };
 
 struct mloop_signal {
@@ -140,21 +169,101 @@ struct mloop_idle {
 	mloop_idle_fn idle_fn;
 	mloop_idle_cond_fn cond_fn;
 	TAILQ_ENTRY(mloop_idle) idle_links;
+	TAILQ_ENTRY(mloop_idle) ready_links;
+	int is_polled;
+	int is_ready;
 };
 
 LIST_HEAD(mloop_object_list, mloop_common);
 TAILQ_HEAD(mloop_idle_list, mloop_idle);
+LIST_HEAD(mloop_timer_list, mloop_timer);
+TAILQ_HEAD(mloop_expired_list, mloop_timer);
+
+/* All timers of a core live in a hierarchical timer wheel that is driven by a
+ * single timerfd. Level n has slots that are 64^n ticks wide, and timers are
+ * moved down a level whenever the level below has gone round. Starting and
+ * stopping a timer only touches a list; the timerfd is re-armed only when a
+ * timer is due before the time that it is already armed for.
+ */
+#define MLOOP_WHEEL_TICK_NS 1000000ULL
+#define MLOOP_WHEEL_BITS 6
+#define MLOOP_WHEEL_SLOTS (1 << MLOOP_WHEEL_BITS)
+#define MLOOP_WHEEL_MASK (MLOOP_WHEEL_SLOTS - 1)
+#define MLOOP_WHEEL_LEVELS 6
+#define MLOOP_WHEEL_MAX_DELTA (1ULL << (MLOOP_WHEEL_BITS * MLOOP_WHEEL_LEVELS))
+#define MLOOP_WHEEL_NEVER UINT64_MAX
+
+struct mloop_timer_wheel {
+	struct mloop_socket socket;
+	pthread_mutex_t mutex;
+	uint64_t tick; /* The next tick to be processed */
+	uint64_t armed_tick;
+	int is_expiring;
+	size_t n_timers;
+	struct mloop_timer_list slots[MLOOP_WHEEL_LEVELS][MLOOP_WHEEL_SLOTS];
+};
+
+/* With io_uring, every started socket has a poll request in flight that holds
+ * a reference to it. Sockets of users get one-shot polls that are re-armed
+ * after the callback, so that events stay level triggered, while the internal
+ * eventfd and timerfd get multishot polls because their handlers drain them.
+ *
+ * Polls that are armed from within the loop are submitted together with the
+ * next wait, and those from other threads are submitted right away. The low
+ * bits of the user data count how often the socket has been stopped, so that
+ * completions of old polls can be told apart.
+ */
+#define MLOOP_URING_ENTRIES 256
+#define MLOOP_URING_GEN_MASK 7ULL
+
+struct mloop_uring {
+	struct uring ring;
+	pthread_mutex_t mutex;
+	unsigned int n_pending;
+	size_t n_in_flight;
+	pthread_t runner;
+	int is_running;
+	int is_closing;
+};
+
+/* Profiling data is written by the thread of the loop and can be read by any
+ * thread, so it is kept under a lock. The lock is only taken while profiling
+ * is on.
+ */
+#define MLOOP_PROF_HASH_SIZE (2 * MLOOP_PROF_MAX_SITES)
+
+struct mloop_profiler {
+	pthread_mutex_t mutex;
+	int is_enabled;
+	uint64_t stall_threshold_ns;
+	unsigned char index[MLOOP_PROF_HASH_SIZE]; /* Site number + 1 */
+	struct mloop_prof data;
+};
 
 struct mloop_core {
 	int ref;
 	int epollfd;
+	int is_uring;
+	struct mloop_uring uring;
 	struct mloop_socket break_out_socket;
 	int do_exit;
 	struct prioq async_jobs;
 	struct mloop_idle_list idle_jobs;
+	struct mloop_idle_list ready_jobs;
+	size_t n_idle_jobs;
+	size_t n_ready_jobs;
 	pthread_mutex_t idle_list_mutex;
 	struct mloop_object_list free_list;
 	pthread_mutex_t free_list_mutex;
+	mloop_prepare_fn prepare_fn;
+	void* prepare_context;
+	pthread_t thread;
+	int have_thread;
+	struct mloop_timer_wheel timers;
+	size_t job_budget;
+	uint64_t job_budget_ns;
+	struct mloop_stats stats;
+	struct mloop_profiler prof;
 };
 
 struct mloop {
@@ -168,17 +277,59 @@ int mloop_errno;
 
 static enum mloop_type mloop__debug = MLOOP_INIT;
 
-#define NTHREADS_MAX 32
+#define NTHREADS_MAX WORKQ_MAX_WORKERS
 
-static struct prioq mloop__job_queue;
+static struct workq mloop__job_queue;
 static int mloop__nthreads = 0;
 static size_t mloop__qsize = 64;
 static size_t mloop__stacksize = 0;
 static pthread_t mloop__threads[NTHREADS_MAX];
 
+/* The pool grows beyond what is required, up to the most that are allowed,
+ * while jobs wait long or pile up, and the workers that were added go again
+ * when they have been idle for a while. Workers are added and removed at the
+ * end of mloop__threads, under the mutex.
+ */
+static pthread_mutex_t mloop__pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int mloop__min_threads = 0;
+static int mloop__max_threads = 0;
+static uint64_t mloop__grow_wait_ns = 1000000ULL;
+static int mloop__idle_timeout = 10000; /* ms */
+
+static int mloop__worker_policy = -1;
+static int mloop__worker_priority = 0;
+static cpu_set_t mloop__worker_cpus;
+static struct mloop_worker_stats mloop__worker_stats;
+
 static struct mloop* mloop__default = NULL;
 static size_t mloop__core_count = 0;
 
+/* The core whose jobs and events the calling thread is handling, if any */
+static __thread struct mloop_core* mloop__current = NULL;
+
+/* Freed objects are kept for reuse, up to a limit for each type. The caches
+ * are shared by all cores because objects may outlive the core that they were
+ * used in.
+ */
+#define MLOOP_DEFAULT_CACHE_SIZE 64
+
+struct mloop_cache {
+	pthread_mutex_t mutex;
+	struct mloop_object_list objects;
+	size_t n_cached;
+	uint64_t n_allocated;
+	uint64_t n_reused;
+};
+
+static struct mloop_cache mloop__caches[MLOOP_PROF_N_TYPES] = {
+	[0 ... MLOOP_PROF_N_TYPES - 1] = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.objects = LIST_HEAD_INITIALIZER(objects),
+	}
+};
+
+static size_t mloop__cache_size = MLOOP_DEFAULT_CACHE_SIZE;
+
 enum mloop__debug_parser_token {
 	MLOOP__START = 0,
 	MLOOP__NAME,
@@ -199,6 +350,13 @@ static void mloop__ref_any(void* ptr);
 static int mloop__start_socket(struct mloop* self, struct mloop_socket* socket);
 static int mloop__socket_stop(struct mloop_socket* self);
 static int mloop__start_async(struct mloop* self, struct mloop_async* async);
+uint32_t mloop__get_epoll_event(enum mloop_socket_event events);
+static int mloop__poll_add(struct mloop_core* core,
+			   struct mloop_socket* socket);
+static int mloop__poll_modify(struct mloop_core* core,
+			      struct mloop_socket* socket);
+static int mloop__poll_init(struct mloop_core* core, int flags);
+static void mloop__poll_destroy(struct mloop_core* core);
 
 static int mloop__debug_parse_expect(struct mloop__debug_parser* parser,
 				     enum mloop__debug_parser_token token,
@@ -416,6 +574,7 @@ static inline void mloop__idle_list_add(struct mloop_idle* obj)
 	mloop__idle_list_lock(core);
 	mloop_idle_ref(obj);
 	TAILQ_INSERT_TAIL(&core->idle_jobs, obj, idle_links);
+	++core->n_idle_jobs;
 	mloop__idle_list_unlock(core);
 }
 
@@ -424,6 +583,7 @@ static inline void mloop__idle_list_remove(struct mloop_idle* obj)
 	struct mloop_core* core = obj->parent_core;
 	mloop__idle_list_lock(core);
 	TAILQ_REMOVE(&core->idle_jobs, obj, idle_links);
+	--core->n_idle_jobs;
 	mloop_idle_unref(obj);
 	mloop__idle_list_unlock(core);
 }
@@ -432,8 +592,56 @@ static inline struct mloop_idle* mloop__idle_list_pop(struct mloop_core* core)
 {
 	mloop__idle_list_lock(core);
 	struct mloop_idle* idle = TAILQ_FIRST(&core->idle_jobs);
-	if (idle)
+	if (idle) {
 		TAILQ_REMOVE(&core->idle_jobs, idle, idle_links);
+		--core->n_idle_jobs;
+	}
+	mloop__idle_list_unlock(core);
+	return idle;
+}
+
+/* Returns 1 if the job was not already on the ready list */
+static inline int mloop__ready_list_add(struct mloop_idle* obj)
+{
+	struct mloop_core* core = obj->parent_core;
+	int rc = 0;
+
+	mloop__idle_list_lock(core);
+	if (!obj->is_ready) {
+		obj->is_ready = 1;
+		mloop_idle_ref(obj);
+		TAILQ_INSERT_TAIL(&core->ready_jobs, obj, ready_links);
+		++core->n_ready_jobs;
+		rc = 1;
+	}
+	mloop__idle_list_unlock(core);
+
+	return rc;
+}
+
+static inline void mloop__ready_list_remove(struct mloop_idle* obj)
+{
+	struct mloop_core* core = obj->parent_core;
+	mloop__idle_list_lock(core);
+	if (obj->is_ready) {
+		obj->is_ready = 0;
+		TAILQ_REMOVE(&core->ready_jobs, obj, ready_links);
+		--core->n_ready_jobs;
+		mloop_idle_unref(obj);
+	}
+	mloop__idle_list_unlock(core);
+}
+
+/* The reference that was held by the list is passed on to the caller */
+static inline struct mloop_idle* mloop__ready_list_pop(struct mloop_core* core)
+{
+	mloop__idle_list_lock(core);
+	struct mloop_idle* idle = TAILQ_FIRST(&core->ready_jobs);
+	if (idle) {
+		idle->is_ready = 0;
+		TAILQ_REMOVE(&core->ready_jobs, idle, ready_links);
+		--core->n_ready_jobs;
+	}
 	mloop__idle_list_unlock(core);
 	return idle;
 }
@@ -442,6 +650,9 @@ static inline void mloop__idle_list_clear(struct mloop_core* self)
 {
 	while (!TAILQ_EMPTY(&self->idle_jobs))
 		mloop__idle_list_remove(TAILQ_FIRST(&self->idle_jobs));
+
+	while (!TAILQ_EMPTY(&self->ready_jobs))
+		mloop__ready_list_remove(TAILQ_FIRST(&self->ready_jobs));
 }
 
 static void mloop__free_context(void* ptr)
@@ -482,6 +693,84 @@ static inline void mloop__print_debug(void* ptr, const char* action, int ref,
 	}
 }
 
+static enum mloop_prof_type mloop__prof_type(enum mloop_type type)
+{
+	switch (type) {
+	case MLOOP_SOCKET: return MLOOP_PROF_SOCKET;
+	case MLOOP_TIMER: return MLOOP_PROF_TIMER;
+	case MLOOP_ASYNC: return MLOOP_PROF_ASYNC;
+	case MLOOP_WORK: return MLOOP_PROF_WORK;
+	case MLOOP_SIGNAL: return MLOOP_PROF_SIGNAL;
+	case MLOOP_IDLE: return MLOOP_PROF_IDLE;
+	default: break;
+	}
+
+	abort();
+}
+
+/* Returns a zeroed object */
+static void* mloop__alloc(enum mloop_type type, size_t size)
+{
+	struct mloop_cache* cache = &mloop__caches[mloop__prof_type(type)];
+	int is_reused = 0;
+
+	pthread_mutex_lock(&cache->mutex);
+	struct mloop_common* obj = LIST_FIRST(&cache->objects);
+	if (obj) {
+		LIST_REMOVE(obj, free_links);
+		cache->n_cached--;
+		is_reused = 1;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	if (!obj) {
+		obj = mem_alloc(MEM_TAG_MLOOP, size);
+		if (!obj)
+			return NULL;
+	}
+
+	memset(obj, 0, size);
+
+	pthread_mutex_lock(&cache->mutex);
+	cache->n_allocated++;
+	cache->n_reused += is_reused;
+	pthread_mutex_unlock(&cache->mutex);
+
+	return obj;
+}
+
+static void mloop__release(void* ptr)
+{
+	struct mloop_common* obj = ptr;
+	struct mloop_cache* cache = &mloop__caches[mloop__prof_type(obj->type)];
+
+	pthread_mutex_lock(&cache->mutex);
+	if (cache->n_cached < mloop__atomic_load(&mloop__cache_size)) {
+		LIST_INSERT_HEAD(&cache->objects, obj, free_links);
+		cache->n_cached++;
+		obj = NULL;
+	}
+	pthread_mutex_unlock(&cache->mutex);
+
+	mem_free(MEM_TAG_MLOOP, obj);
+}
+
+static void mloop__trim_caches(size_t size)
+{
+	for (int i = 0; i < MLOOP_PROF_N_TYPES; ++i) {
+		struct mloop_cache* cache = &mloop__caches[i];
+
+		pthread_mutex_lock(&cache->mutex);
+		while (cache->n_cached > size) {
+			struct mloop_common* obj = LIST_FIRST(&cache->objects);
+			LIST_REMOVE(obj, free_links);
+			cache->n_cached--;
+			mem_free(MEM_TAG_MLOOP, obj);
+		}
+		pthread_mutex_unlock(&cache->mutex);
+	}
+}
+
 static void mloop__free_any(void* ptr)
 {
 	struct mloop_common* common = ptr;
@@ -664,6 +953,37 @@ static void mloop__block_all_signals()
 	pthread_sigmask(SIG_BLOCK, &mask, NULL);
 }
 
+static inline uint64_t mloop__monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Jobs with deadlines are counted by the loop and by the workers alike */
+static void mloop__count_deadline(struct mloop_core* core, uint64_t deadline)
+{
+	if (!deadline)
+		return;
+
+	struct mloop_stats* stats = &core->stats;
+	__atomic_fetch_add(&stats->n_deadline_jobs, 1, __ATOMIC_RELAXED);
+
+	uint64_t now = mloop__monotonic_ns();
+	if (now <= deadline)
+		return;
+
+	__atomic_fetch_add(&stats->n_deadline_misses, 1, __ATOMIC_RELAXED);
+
+	uint64_t lateness = now - deadline;
+	uint64_t max = __atomic_load_n(&stats->max_lateness_ns,
+				       __ATOMIC_RELAXED);
+	while (lateness > max
+	    && !__atomic_compare_exchange_n(&stats->max_lateness_ns, &max,
+					    lateness, 0, __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+}
+
 static int mloop__forward_work(struct mloop_work* work)
 {
 	struct mloop* mloop = work->parent;
@@ -675,7 +995,8 @@ static int mloop__forward_work(struct mloop_work* work)
 	 * can start processing the job before the state has been changed.
 	 */
 	prioq__lock(queue);
-	if (prioq_insert(queue, async->priority, async) < 0)
+	if (prioq_insert_deadline(queue, async->priority, async->deadline,
+				  async) < 0)
 		goto failure;
 
 	mloop__break_out(mloop);
@@ -690,21 +1011,131 @@ failure:
 	return -1;
 }
 
+static inline int mloop__is_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static inline int mloop__is_elastic(void)
+{
+	return __atomic_load_n(&mloop__max_threads, __ATOMIC_RELAXED)
+	     > __atomic_load_n(&mloop__min_threads, __ATOMIC_RELAXED);
+}
+
+static inline int mloop__is_stopping(void)
+{
+	return __atomic_load_n(&mloop__job_queue.is_stopping, __ATOMIC_SEQ_CST);
+}
+
+static int mloop__start_worker(pthread_t* thread, size_t index,
+			       size_t stacksize);
+
+static void mloop__grow_workers(void)
+{
+	pthread_mutex_lock(&mloop__pool_mutex);
+
+	int n = mloop__nthreads;
+	if (n == 0 || n >= mloop__max_threads || mloop__is_stopping())
+		goto done;
+
+	if (mloop__start_worker(&mloop__threads[n], n, mloop__stacksize) != 0)
+		goto done;
+
+	__atomic_store_n(&mloop__nthreads, n + 1, __ATOMIC_SEQ_CST);
+	workq_set_n_workers(&mloop__job_queue, n + 1);
+
+	struct mloop_worker_stats* stats = &mloop__worker_stats;
+	__atomic_fetch_add(&stats->n_started, 1, __ATOMIC_RELAXED);
+	if ((uint64_t)n + 1 > stats->max_workers)
+		__atomic_store_n(&stats->max_workers, n + 1, __ATOMIC_RELAXED);
+
+done:
+	pthread_mutex_unlock(&mloop__pool_mutex);
+}
+
+/* Only the last worker may go, so that those that are left keep their
+ * indices. Returns 1 if the worker is to exit.
+ */
+static int mloop__retire_worker(size_t index)
+{
+	int is_retired = 0;
+
+	pthread_mutex_lock(&mloop__pool_mutex);
+
+	int n = mloop__nthreads;
+	if ((int)index != n - 1 || n <= mloop__min_threads
+	 || mloop__is_stopping())
+		goto done;
+
+	__atomic_store_n(&mloop__nthreads, n - 1, __ATOMIC_SEQ_CST);
+	workq_set_n_workers(&mloop__job_queue, n - 1);
+	pthread_detach(mloop__threads[index]);
+
+	__atomic_fetch_add(&mloop__worker_stats.n_retired, 1,
+			   __ATOMIC_RELAXED);
+	is_retired = 1;
+
+done:
+	pthread_mutex_unlock(&mloop__pool_mutex);
+	return is_retired;
+}
+
+/* Returns NULL when the worker is to exit */
+static struct mloop_work* mloop__take_work(size_t index)
+{
+	while (1) {
+		if (!mloop__is_elastic())
+			return workq_pop(&mloop__job_queue, index);
+
+		errno = 0;
+		struct mloop_work* work =
+			workq_timed_pop(&mloop__job_queue, index,
+					mloop__idle_timeout);
+		if (work || errno != ETIMEDOUT)
+			return work;
+
+		if (mloop__retire_worker(index))
+			return NULL;
+	}
+}
+
+static void mloop__count_queue_wait(const struct mloop_work* work)
+{
+	struct mloop_worker_stats* stats = &mloop__worker_stats;
+	uint64_t wait = mloop__monotonic_ns() - work->queued_at;
+
+	__atomic_fetch_add(&stats->n_jobs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stats->total_wait_ns, wait, __ATOMIC_RELAXED);
+
+	uint64_t max = __atomic_load_n(&stats->max_wait_ns, __ATOMIC_RELAXED);
+	while (wait > max
+	    && !__atomic_compare_exchange_n(&stats->max_wait_ns, &max, wait, 0,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+
+	if (wait > mloop__grow_wait_ns && mloop__is_elastic())
+		mloop__grow_workers();
+}
+
 static void* mloop__worker_fn(void* context)
 {
-	(void)context;
+	size_t index = (size_t)context;
 
 	mloop__block_all_signals();
 
-	while (1) {
-		struct prioq_elem elem;
-		if (prioq_pop(&mloop__job_queue, &elem, -1) < 0)
-			continue;
+	/* The nice value belongs to the thread, so it is set from within */
+	if (!mloop__is_rt_policy(mloop__worker_policy)
+	 && mloop__worker_priority != 0)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+			    mloop__worker_priority);
 
-		if (elem.data == NULL)
+	while (1) {
+		struct mloop_work* work = mloop__take_work(index);
+		if (!work)
 			break;
 
-		struct mloop_work* work = elem.data;
+		mloop__count_queue_wait(work);
+
 		if (work->is_cancelled)
 			goto cancelled;
 
@@ -714,6 +1145,9 @@ static void* mloop__worker_fn(void* context)
 		if (work_fn)
 			work_fn(work);
 
+		if (!work->done_fn)
+			mloop__count_deadline(work->parent_core, work->deadline);
+
 		if (mloop_work_unref(work) == 0)
 			continue; /* No one is interested in the result */
 
@@ -736,30 +1170,37 @@ cancelled:
 
 static void mloop__reap_threads()
 {
+	pthread_t threads[NTHREADS_MAX];
 	struct timespec ts;
 
-	/* A thread returns if it's sent a null-job */
-	for (int i = 0; i < mloop__nthreads; ++i)
-		prioq_insert(&mloop__job_queue, 0, NULL);
+	/* No worker comes or goes once the queue is stopping */
+	pthread_mutex_lock(&mloop__pool_mutex);
+	workq_stop(&mloop__job_queue);
+	int n = mloop__nthreads;
+	memcpy(threads, mloop__threads, n * sizeof(threads[0]));
+	pthread_mutex_unlock(&mloop__pool_mutex);
 
 	int rc = clock_gettime(CLOCK_REALTIME, &ts);
 	assert(rc == 0);
 	ts.tv_sec += 1;
 
-	for (int i = 0; i < mloop__nthreads; ++i)
-		pthread_timedjoin_np(mloop__threads[i], NULL, &ts);
+	for (int i = 0; i < n; ++i)
+		pthread_timedjoin_np(threads[i], NULL, &ts);
 }
 
 void mloop__stop_workers()
 {
+	if (mloop__nthreads == 0)
+		return;
+
 	mloop__reap_threads();
-	prioq_destroy(&mloop__job_queue);
+	workq_destroy(&mloop__job_queue);
+	mloop__nthreads = 0;
 }
 
-static int mloop__start_threads(size_t stacksize, int required)
+static int mloop__create_worker(pthread_t* thread, size_t index,
+				size_t stacksize, int use_policy)
 {
-	int rc = 0;
-
 	pthread_attr_t attr;
 
 	pthread_attr_init(&attr);
@@ -767,34 +1208,166 @@ static int mloop__start_threads(size_t stacksize, int required)
 	if (stacksize != 0)
 		pthread_attr_setstacksize(&attr, stacksize);
 
-	int i;
-	for (i = mloop__nthreads; i < required; ++i) {
-		rc = pthread_create(&mloop__threads[i], &attr,
-				    mloop__worker_fn, NULL);
-		if (rc < 0) {
-			errno = rc;
-			mloop__nthreads = i;
-			mloop__reap_threads();
-			break;
-		}
+	if (CPU_COUNT(&mloop__worker_cpus) > 0)
+		pthread_attr_setaffinity_np(&attr, sizeof(mloop__worker_cpus),
+					    &mloop__worker_cpus);
+
+	if (use_policy && mloop__worker_policy >= 0) {
+		struct sched_param param = { .sched_priority = 0 };
+		if (mloop__is_rt_policy(mloop__worker_policy))
+			param.sched_priority = mloop__worker_priority;
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, mloop__worker_policy);
+		pthread_attr_setschedparam(&attr, &param);
 	}
 
+	int rc = pthread_create(thread, &attr, mloop__worker_fn,
+				(void*)index);
+
 	pthread_attr_destroy(&attr);
 	return rc;
 }
 
+static int mloop__start_worker(pthread_t* thread, size_t index,
+			       size_t stacksize)
+{
+	int rc = mloop__create_worker(thread, index, stacksize, 1);
+	if (rc == EPERM) {
+		plog(LOG_WARNING, "Not permitted to use scheduling policy %d with priority %d for workers; running with normal priority",
+		     mloop__worker_policy, mloop__worker_priority);
+		rc = mloop__create_worker(thread, index, stacksize, 0);
+	}
+
+	if (rc != 0)
+		errno = rc;
+
+	return rc != 0 ? -1 : 0;
+}
+
+static int mloop__start_threads(size_t stacksize, int required)
+{
+	for (int i = mloop__nthreads; i < required; ++i)
+		if (mloop__start_worker(&mloop__threads[i], i, stacksize) < 0) {
+			mloop__nthreads = i;
+			mloop__reap_threads();
+			return -1;
+		}
+
+	return 0;
+}
+
 EXPORT
 void mloop_set_job_queue_size(size_t qsize)
 {
 	mloop__qsize = qsize;
 }
 
+EXPORT
+void mloop_set_object_cache_size(size_t size)
+{
+	mloop__atomic_store(&mloop__cache_size, size);
+	mloop__trim_caches(size);
+}
+
+static size_t mloop__object_size(enum mloop_prof_type type)
+{
+	switch (type) {
+	case MLOOP_PROF_SOCKET: return sizeof(struct mloop_socket);
+	case MLOOP_PROF_TIMER: return sizeof(struct mloop_timer);
+	case MLOOP_PROF_ASYNC: return sizeof(struct mloop_async);
+	case MLOOP_PROF_WORK: return sizeof(struct mloop_work);
+	case MLOOP_PROF_SIGNAL: return sizeof(struct mloop_signal);
+	case MLOOP_PROF_IDLE: return sizeof(struct mloop_idle);
+	default: break;
+	}
+
+	abort();
+}
+
+EXPORT
+int mloop_reserve_objects(size_t n)
+{
+	if (mloop__atomic_load(&mloop__cache_size) < n)
+		mloop__atomic_store(&mloop__cache_size, n);
+
+	for (int i = 0; i < MLOOP_PROF_N_TYPES; ++i) {
+		struct mloop_cache* cache = &mloop__caches[i];
+		size_t size = mloop__object_size(i);
+		int rc = 0;
+
+		pthread_mutex_lock(&cache->mutex);
+		while (cache->n_cached < n) {
+			struct mloop_common* obj = mem_calloc(MEM_TAG_MLOOP, 1,
+							      size);
+			if (!obj) {
+				rc = -1;
+				break;
+			}
+
+			LIST_INSERT_HEAD(&cache->objects, obj, free_links);
+			cache->n_cached++;
+		}
+		pthread_mutex_unlock(&cache->mutex);
+
+		if (rc < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 EXPORT
 void mloop_set_worker_stack_size(size_t stack_size)
 {
 	mloop__stacksize = stack_size;
 }
 
+EXPORT
+void mloop_set_worker_sched(int policy, int priority, const cpu_set_t* cpus)
+{
+	mloop__worker_policy = policy;
+	mloop__worker_priority = priority;
+
+	if (cpus)
+		mloop__worker_cpus = *cpus;
+	else
+		CPU_ZERO(&mloop__worker_cpus);
+}
+
+EXPORT
+void mloop_set_max_workers(int nthreads)
+{
+	if (nthreads >= NTHREADS_MAX)
+		nthreads = NTHREADS_MAX - 1;
+
+	__atomic_store_n(&mloop__max_threads, nthreads, __ATOMIC_RELAXED);
+}
+
+EXPORT
+void mloop_set_worker_scaling(uint64_t grow_wait_us, int idle_timeout)
+{
+	mloop__grow_wait_ns = grow_wait_us * 1000ULL;
+	mloop__idle_timeout = idle_timeout;
+}
+
+EXPORT
+void mloop_get_worker_stats(struct mloop_worker_stats* stats)
+{
+	const struct mloop_worker_stats* src = &mloop__worker_stats;
+
+	stats->n_workers = __atomic_load_n(&mloop__nthreads, __ATOMIC_RELAXED);
+	stats->max_workers = __atomic_load_n(&src->max_workers,
+					     __ATOMIC_RELAXED);
+	stats->n_started = __atomic_load_n(&src->n_started, __ATOMIC_RELAXED);
+	stats->n_retired = __atomic_load_n(&src->n_retired, __ATOMIC_RELAXED);
+	stats->n_jobs = __atomic_load_n(&src->n_jobs, __ATOMIC_RELAXED);
+	stats->total_wait_ns = __atomic_load_n(&src->total_wait_ns,
+					       __ATOMIC_RELAXED);
+	stats->max_wait_ns = __atomic_load_n(&src->max_wait_ns,
+					     __ATOMIC_RELAXED);
+}
+
 EXPORT
 int mloop_require_workers(int nthreads)
 {
@@ -805,13 +1378,20 @@ int mloop_require_workers(int nthreads)
 		return 0;
 
 	if (mloop__nthreads == 0)
-		if (prioq_init(&mloop__job_queue, mloop__qsize) < 0)
+		if (workq_init(&mloop__job_queue, mloop__qsize) < 0)
 			return -1;
 
 	if (mloop__start_threads(mloop__stacksize, nthreads) < 0)
 		goto thread_start_failure;
 
-	mloop__nthreads = nthreads;
+	pthread_mutex_lock(&mloop__pool_mutex);
+	__atomic_store_n(&mloop__nthreads, nthreads, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&mloop__min_threads, nthreads, __ATOMIC_RELAXED);
+	workq_set_n_workers(&mloop__job_queue, nthreads);
+
+	if ((uint64_t)nthreads > mloop__worker_stats.max_workers)
+		mloop__worker_stats.max_workers = nthreads;
+	pthread_mutex_unlock(&mloop__pool_mutex);
 
 	return 0;
 
@@ -826,73 +1406,518 @@ void mloop__on_break_out_event(struct mloop_socket* socket)
 	(void)read(socket->fd, &count, sizeof(count));
 }
 
-static struct mloop_core* mloop_core__new(struct mloop* mloop)
+/* Timers are rounded up to the next tick so that they never fire early */
+static inline uint64_t mloop__ticks(uint64_t ns)
 {
-	struct mloop_core* self = malloc(sizeof(*self));
-	if (!self)
-		return NULL;
+	return (ns + MLOOP_WHEEL_TICK_NS - 1) / MLOOP_WHEEL_TICK_NS;
+}
 
-	memset(self, 0, sizeof(*self));
+static inline int mloop__prof_is_enabled(struct mloop_core* core)
+{
+	return __atomic_load_n(&core->prof.is_enabled, __ATOMIC_RELAXED);
+}
 
-	self->epollfd = epoll_create(MAX_EVENTS);
-	if (self->epollfd < 0)
-		goto epoll_failure;
+/* Returns 0 if neither profiling nor event tracing is on */
+static inline uint64_t mloop__prof_start(struct mloop_core* core)
+{
+	return mloop__prof_is_enabled(core) || event_trace_is_enabled()
+	     ? mloop__monotonic_ns() : 0;
+}
 
-	mloop->core = self;
+static inline unsigned int mloop__prof_bucket(uint64_t us)
+{
+	unsigned int i = us ? 64 - __builtin_clzll(us) : 0;
+	return i < MLOOP_PROF_N_BUCKETS ? i : MLOOP_PROF_N_BUCKETS - 1;
+}
 
-	struct mloop_socket* break_out_socket = &self->break_out_socket;
-	break_out_socket->parent = mloop;
-	break_out_socket->parent_core = self;
-	break_out_socket->ref = 1;
-	break_out_socket->callback_fn = mloop__on_break_out_event;
-	break_out_socket->events = MLOOP_SOCKET_EVENT_IN
-				 | MLOOP_SOCKET_EVENT_PRI;
-	break_out_socket->fd = eventfd(0, EFD_NONBLOCK);
-	if (break_out_socket->fd < 0)
-		goto break_out_socket_fd_failure;
+static inline void mloop__histogram_add(struct mloop_histogram* self,
+					uint64_t us)
+{
+	self->count++;
+	self->total_us += us;
+	if (us > self->max_us)
+		self->max_us = us;
+	self->buckets[mloop__prof_bucket(us)]++;
+}
 
-	if (mloop__start_socket(mloop, break_out_socket) < 0)
-		goto break_out_socket_add_failure;
+static inline void mloop__prof_depth_add(struct mloop_prof_depth* self,
+					 size_t depth)
+{
+	self->current = depth;
+	if (depth > self->max)
+		self->max = depth;
+}
 
-	break_out_socket->state = MLOOP_STARTED;
+static struct mloop_prof_site*
+mloop__prof_find_site(struct mloop_profiler* self, const void* fn,
+		      enum mloop_prof_type type)
+{
+	struct mloop_prof* data = &self->data;
+	size_t hash = ((uintptr_t)fn >> 4) * 2654435761UL + type;
 
-	if (prioq_init(&self->async_jobs, 64) < 0)
-		goto async_job_queue_failure;
+	for (size_t i = 0; i < MLOOP_PROF_HASH_SIZE; ++i) {
+		size_t slot = (hash + i) % MLOOP_PROF_HASH_SIZE;
+		unsigned int n = self->index[slot];
 
-	pthread_mutex_init(&mloop->object_list_mutex, NULL);
-	pthread_mutex_init(&self->idle_list_mutex, NULL);
-	pthread_mutex_init(&self->free_list_mutex, NULL);
-	LIST_INIT(&mloop->objects);
-	LIST_INIT(&self->free_list);
-	TAILQ_INIT(&self->idle_jobs);
+		if (n == 0) {
+			if (data->n_sites >= MLOOP_PROF_MAX_SITES)
+				return NULL;
 
-	self->ref = 1;
+			struct mloop_prof_site* site =
+				&data->sites[data->n_sites++];
+			site->fn = fn;
+			site->type = type;
+			self->index[slot] = data->n_sites;
+			return site;
+		}
 
-	__atomic_add_fetch(&mloop__core_count, 1, __ATOMIC_SEQ_CST);
+		struct mloop_prof_site* site = &data->sites[n - 1];
+		if (site->fn == fn && site->type == type)
+			return site;
+	}
 
-	return self;
+	return NULL;
+}
 
-async_job_queue_failure:
-	mloop__socket_stop(break_out_socket);
-break_out_socket_add_failure:
+static void mloop__prof_record(struct mloop_core* core,
+			       enum mloop_prof_type type, const void* fn,
+			       uint64_t start)
+{
+	struct mloop_profiler* self = &core->prof;
+	uint64_t ns = mloop__monotonic_ns() - start;
+	uint64_t us = ns / 1000;
+
+	pthread_mutex_lock(&self->mutex);
+
+	mloop__histogram_add(&self->data.time[type], us);
+
+	struct mloop_prof_site* site = mloop__prof_find_site(self, fn, type);
+	if (site)
+		mloop__histogram_add(&site->time, us);
+	else
+		self->data.n_untracked++;
+
+	int is_stall = self->stall_threshold_ns
+		    && ns > self->stall_threshold_ns;
+	if (is_stall) {
+		struct mloop_prof_site* stall = &self->data.last_stall;
+		self->data.n_stalls++;
+		memset(stall, 0, sizeof(*stall));
+		stall->fn = fn;
+		stall->type = type;
+		mloop__histogram_add(&stall->time, us);
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+
+	if (is_stall) {
+		char name[256];
+		mloop_prof_describe(fn, name, sizeof(name));
+		plog(LOG_WARNING, "mloop: %s callback %s stalled the loop for %llu us",
+		     mloop_prof_type_name(type), name, (unsigned long long)us);
+	}
+}
+
+static inline void mloop__prof_end(struct mloop_core* core,
+				   enum mloop_prof_type type, const void* fn,
+				   uint64_t start)
+{
+	if (!start)
+		return;
+
+	event_trace_complete(EVENT_TRACE_MLOOP_SOCKET + type, start,
+			     (uintptr_t)fn, 0);
+
+	if (mloop__prof_is_enabled(core))
+		mloop__prof_record(core, type, fn, start);
+}
+
+static void mloop__prof_add_lag(struct mloop_core* core,
+				struct mloop_histogram* lag, uint64_t since)
+{
+	uint64_t now = mloop__monotonic_ns();
+	uint64_t us = now > since ? (now - since) / 1000 : 0;
+
+	pthread_mutex_lock(&core->prof.mutex);
+	mloop__histogram_add(lag, us);
+	pthread_mutex_unlock(&core->prof.mutex);
+}
+
+static void mloop__wheel_arm(struct mloop_timer_wheel* self, uint64_t tick)
+{
+	if (self->is_expiring || tick >= self->armed_tick)
+		return;
+
+	uint64_t ns = tick * MLOOP_WHEEL_TICK_NS;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	/* A zero value would disarm the timer */
+	its.it_value.tv_sec = ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL + (ns == 0);
+
+	if (timerfd_settime(self->socket.fd, TFD_TIMER_ABSTIME, &its, NULL) == 0)
+		self->armed_tick = tick;
+}
+
+/* Puts the timer into the slot that is due at or before its expiry and
+ * returns the tick at which that slot is due.
+ */
+static uint64_t mloop__wheel_place(struct mloop_timer_wheel* self,
+				   struct mloop_timer* timer)
+{
+	uint64_t expires = timer->expires;
+
+	if (expires < self->tick)
+		expires = self->tick;
+
+	/* Timers that are too far off are parked in the highest level and
+	 * placed again when it comes round.
+	 */
+	if (expires - self->tick >= MLOOP_WHEEL_MAX_DELTA)
+		expires = self->tick + MLOOP_WHEEL_MAX_DELTA - 1;
+
+	uint64_t delta = expires - self->tick;
+
+	int level = 0;
+	while (delta >= 1ULL << (MLOOP_WHEEL_BITS * (level + 1)))
+		++level;
+
+	int shift = MLOOP_WHEEL_BITS * level;
+	size_t index = (expires >> shift) & MLOOP_WHEEL_MASK;
+
+	LIST_INSERT_HEAD(&self->slots[level][index], timer, wheel_links);
+
+	return (expires >> shift) << shift;
+}
+
+static void mloop__wheel_add(struct mloop_timer_wheel* self,
+			     struct mloop_timer* timer)
+{
+	uint64_t due = mloop__wheel_place(self, timer);
+	timer->is_linked = 1;
+	++self->n_timers;
+
+	mloop__wheel_arm(self, due);
+}
+
+static void mloop__wheel_remove(struct mloop_timer_wheel* self,
+				struct mloop_timer* timer)
+{
+	if (!timer->is_linked)
+		return;
+
+	LIST_REMOVE(timer, wheel_links);
+	timer->is_linked = 0;
+	--self->n_timers;
+}
+
+/* The tick at which a timer fires or a slot has to be moved down a level */
+static uint64_t mloop__wheel_next_tick(const struct mloop_timer_wheel* self)
+{
+	if (self->n_timers == 0)
+		return MLOOP_WHEEL_NEVER;
+
+	uint64_t next = MLOOP_WHEEL_NEVER;
+
+	for (int level = 0; level < MLOOP_WHEEL_LEVELS; ++level) {
+		int shift = MLOOP_WHEEL_BITS * level;
+		uint64_t base = self->tick >> shift;
+
+		/* The current slot of a higher level has been moved down
+		 * already, so whatever is in it is a full round away, unless
+		 * that happens at the tick that is up next.
+		 */
+		uint64_t mask = (1ULL << shift) - 1;
+		int first = (self->tick & mask) == 0 ? 0 : 1;
+
+		for (int i = first; i < first + MLOOP_WHEEL_SLOTS; ++i) {
+			size_t index = (base + i) & MLOOP_WHEEL_MASK;
+			if (LIST_EMPTY(&self->slots[level][index]))
+				continue;
+
+			uint64_t tick = level == 0 ? self->tick + i
+						   : (base + i) << shift;
+			if (tick < next)
+				next = tick;
+			break;
+		}
+	}
+
+	return next;
+}
+
+static void mloop__wheel_cascade(struct mloop_timer_wheel* self, int level,
+				 size_t index)
+{
+	struct mloop_timer_list* slot = &self->slots[level][index];
+	struct mloop_timer_list pending;
+	LIST_INIT(&pending);
+
+	while (!LIST_EMPTY(slot)) {
+		struct mloop_timer* timer = LIST_FIRST(slot);
+		LIST_REMOVE(timer, wheel_links);
+		LIST_INSERT_HEAD(&pending, timer, wheel_links);
+	}
+
+	while (!LIST_EMPTY(&pending)) {
+		struct mloop_timer* timer = LIST_FIRST(&pending);
+		LIST_REMOVE(timer, wheel_links);
+		mloop__wheel_place(self, timer);
+	}
+}
+
+/* Moves the timers that are due at or before now onto the expired list. Each
+ * of them is referenced.
+ */
+static void mloop__wheel_expire(struct mloop_timer_wheel* self, uint64_t now,
+				struct mloop_expired_list* expired)
+{
+	while (self->tick <= now) {
+		/* Skip the ticks at which nothing happens */
+		uint64_t next = mloop__wheel_next_tick(self);
+		if (next > now) {
+			self->tick = now + 1;
+			break;
+		}
+
+		self->tick = next;
+
+		if ((next & MLOOP_WHEEL_MASK) == 0) {
+			for (int level = 1; level < MLOOP_WHEEL_LEVELS; ++level) {
+				int shift = MLOOP_WHEEL_BITS * level;
+				size_t index = (next >> shift) & MLOOP_WHEEL_MASK;
+
+				mloop__wheel_cascade(self, level, index);
+				if (index != 0)
+					break;
+			}
+		}
+
+		struct mloop_timer_list* slot =
+			&self->slots[0][next & MLOOP_WHEEL_MASK];
+
+		while (!LIST_EMPTY(slot)) {
+			struct mloop_timer* timer = LIST_FIRST(slot);
+			mloop__wheel_remove(self, timer);
+			mloop_timer_ref(timer);
+			TAILQ_INSERT_TAIL(expired, timer, expired_links);
+		}
+
+		++self->tick;
+	}
+}
+
+static void mloop__fire_timer(struct mloop_timer* self)
+{
+	struct mloop_socket* socket = &self->socket;
+	struct mloop_timer_wheel* wheel = &socket->parent_core->timers;
+	int is_periodic = self->timer_type & MLOOP_TIMER_PERIODIC;
+
+	/* It may have been stopped or restarted since it expired */
+	pthread_mutex_lock(&wheel->mutex);
+
+	int is_due = !self->is_linked && mloop_timer_is_started(self);
+	uint64_t due_tick = self->expires;
+
+	if (is_due && is_periodic) {
+		/* Missed periods are skipped, but the phase is kept */
+		uint64_t period = mloop__ticks(self->time);
+		self->expires += period;
+		if (self->expires < wheel->tick)
+			self->expires += (wheel->tick - self->expires + period - 1)
+				       / period * period;
+
+		mloop__wheel_add(wheel, self);
+	}
+
+	pthread_mutex_unlock(&wheel->mutex);
+
+	if (!is_due)
+		goto done;
+
+	if (!is_periodic) {
+		if (mloop__change_state(self, MLOOP_STARTED, MLOOP_STOPPING) < 0)
+			goto done;
+
+		mloop__object_list_remove(self);
+
+		int rc = mloop__change_state(self, MLOOP_STOPPING,
+					     MLOOP_STOPPED);
+		assert(rc == 0);
+	}
+
+	struct mloop_core* core = socket->parent_core;
+	uint64_t start = mloop__prof_start(core);
+	if (start && mloop__prof_is_enabled(core))
+		mloop__prof_add_lag(core, &core->prof.data.timer_lag,
+				    due_tick * MLOOP_WHEEL_TICK_NS);
+
+	mloop_timer_fn callback_fn = (mloop_timer_fn)socket->callback_fn;
+	if (callback_fn)
+		callback_fn(self);
+
+	mloop__prof_end(core, MLOOP_PROF_TIMER, callback_fn, start);
+
+done:
+	mloop_timer_unref(self);
+}
+
+void mloop__on_timer_wheel_event(struct mloop_socket* socket)
+{
+	struct mloop_timer_wheel* self = &socket->parent_core->timers;
+	struct mloop_expired_list expired;
+	TAILQ_INIT(&expired);
+
+	uint64_t count = 0;
+	(void)read(socket->fd, &count, sizeof(count));
+
+	pthread_mutex_lock(&self->mutex);
+	self->armed_tick = MLOOP_WHEEL_NEVER;
+	self->is_expiring = 1;
+	mloop__wheel_expire(self, mloop__monotonic_ns() / MLOOP_WHEEL_TICK_NS,
+			    &expired);
+	pthread_mutex_unlock(&self->mutex);
+
+	/* Timers that are started from here on are armed for below */
+	while (!TAILQ_EMPTY(&expired)) {
+		struct mloop_timer* timer = TAILQ_FIRST(&expired);
+		TAILQ_REMOVE(&expired, timer, expired_links);
+		mloop__fire_timer(timer);
+	}
+
+	pthread_mutex_lock(&self->mutex);
+	self->is_expiring = 0;
+	mloop__wheel_arm(self, mloop__wheel_next_tick(self));
+	pthread_mutex_unlock(&self->mutex);
+}
+
+static int mloop__wheel_init(struct mloop_timer_wheel* self,
+			     struct mloop* mloop)
+{
+	struct mloop_socket* socket = &self->socket;
+	socket->parent = mloop;
+	socket->parent_core = mloop->core;
+	socket->ref = 1;
+	socket->callback_fn = mloop__on_timer_wheel_event;
+	socket->events = MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI;
+	socket->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (socket->fd < 0)
+		return -1;
+
+	socket->is_multishot = 1;
+	socket->state = MLOOP_STARTED;
+
+	if (mloop__poll_add(mloop->core, socket) < 0)
+		goto failure;
+
+	pthread_mutex_init(&self->mutex, NULL);
+	self->tick = mloop__monotonic_ns() / MLOOP_WHEEL_TICK_NS;
+	self->armed_tick = MLOOP_WHEEL_NEVER;
+
+	for (int level = 0; level < MLOOP_WHEEL_LEVELS; ++level)
+		for (int i = 0; i < MLOOP_WHEEL_SLOTS; ++i)
+			LIST_INIT(&self->slots[level][i]);
+
+	return 0;
+
+failure:
+	close(socket->fd);
+	return -1;
+}
+
+/* Timers that are still referenced by someone outlive the core */
+static void mloop__wheel_destroy(struct mloop_timer_wheel* self)
+{
+	for (int level = 0; level < MLOOP_WHEEL_LEVELS; ++level)
+		for (int i = 0; i < MLOOP_WHEEL_SLOTS; ++i)
+			while (!LIST_EMPTY(&self->slots[level][i]))
+				mloop__wheel_remove(self,
+					LIST_FIRST(&self->slots[level][i]));
+
+	pthread_mutex_destroy(&self->mutex);
+	close(self->socket.fd);
+}
+
+static struct mloop_core* mloop_core__new(struct mloop* mloop, int flags)
+{
+	struct mloop_core* self = mem_alloc(MEM_TAG_MLOOP, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	memset(self, 0, sizeof(*self));
+
+	if (mloop__poll_init(self, flags) < 0)
+		goto poll_failure;
+
+	mloop->core = self;
+
+	struct mloop_socket* break_out_socket = &self->break_out_socket;
+	break_out_socket->parent = mloop;
+	break_out_socket->parent_core = self;
+	break_out_socket->ref = 1;
+	break_out_socket->callback_fn = mloop__on_break_out_event;
+	break_out_socket->events = MLOOP_SOCKET_EVENT_IN
+				 | MLOOP_SOCKET_EVENT_PRI;
+	break_out_socket->is_multishot = 1;
+	break_out_socket->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (break_out_socket->fd < 0)
+		goto break_out_socket_fd_failure;
+
+	if (mloop__start_socket(mloop, break_out_socket) < 0)
+		goto break_out_socket_add_failure;
+
+	break_out_socket->state = MLOOP_STARTED;
+
+	if (prioq_init(&self->async_jobs, 64) < 0)
+		goto async_job_queue_failure;
+
+	if (mloop__wheel_init(&self->timers, mloop) < 0)
+		goto timer_wheel_failure;
+
+	pthread_mutex_init(&mloop->object_list_mutex, NULL);
+	pthread_mutex_init(&self->idle_list_mutex, NULL);
+	pthread_mutex_init(&self->free_list_mutex, NULL);
+	LIST_INIT(&mloop->objects);
+	LIST_INIT(&self->free_list);
+	TAILQ_INIT(&self->idle_jobs);
+	TAILQ_INIT(&self->ready_jobs);
+
+	pthread_mutex_init(&self->prof.mutex, NULL);
+
+	self->job_budget = MLOOP_DEFAULT_JOB_BUDGET;
+	self->job_budget_ns = MLOOP_DEFAULT_JOB_BUDGET_US * 1000ULL;
+
+	self->ref = 1;
+
+	__atomic_add_fetch(&mloop__core_count, 1, __ATOMIC_SEQ_CST);
+
+	return self;
+
+timer_wheel_failure:
+	prioq_destroy(&self->async_jobs);
+async_job_queue_failure:
+	mloop__socket_stop(break_out_socket);
+break_out_socket_add_failure:
 	close(break_out_socket->fd);
 break_out_socket_fd_failure:
-	close(self->epollfd);
-epoll_failure:
-	free(self);
+	mloop__poll_destroy(self);
+poll_failure:
+	mem_free(MEM_TAG_MLOOP, self);
 	return NULL;
 }
 
 EXPORT
-struct mloop* mloop_new(void)
+struct mloop* mloop_new_with_flags(int flags)
 {
-	struct mloop* self = malloc(sizeof(*self));
+	struct mloop* self = mem_alloc(MEM_TAG_MLOOP, sizeof(*self));
 	if (!self)
 		return NULL;
 
 	memset(self, 0, sizeof(*self));
 
-	self->core = mloop_core__new(self);
+	self->core = mloop_core__new(self, flags);
 	if (!self->core)
 		goto failure;
 
@@ -901,22 +1926,35 @@ struct mloop* mloop_new(void)
 	return self;
 
 failure:
-	free(self);
+	mem_free(MEM_TAG_MLOOP, self);
 	return NULL;
 }
 
+EXPORT
+struct mloop* mloop_new(void)
+{
+	return mloop_new_with_flags(MLOOP_F_DEFAULT);
+}
+
 static void mloop_core__free(struct mloop_core* self)
 {
-	if (__atomic_sub_fetch(&mloop__core_count, 1, __ATOMIC_SEQ_CST) == 0)
+	int is_last = __atomic_sub_fetch(&mloop__core_count, 1,
+					 __ATOMIC_SEQ_CST) == 0;
+	if (is_last)
 		mloop__stop_workers();
 
+	mloop__poll_destroy(self);
 	mloop__idle_list_clear(self);
 	mloop__collect(self);
+	mloop__wheel_destroy(&self->timers);
 	pthread_mutex_destroy(&self->idle_list_mutex);
+	pthread_mutex_destroy(&self->prof.mutex);
 	prioq_destroy(&self->async_jobs);
 	close(self->break_out_socket.fd);
-	close(self->epollfd);
-	free(self);
+	mem_free(MEM_TAG_MLOOP, self);
+
+	if (is_last)
+		mloop__trim_caches(0);
 }
 
 static int mloop_core__ref(struct mloop_core* self)
@@ -936,7 +1974,7 @@ static int mloop_core__unref(struct mloop_core* self)
 EXPORT
 struct mloop* mloop_scope_new(struct mloop* other)
 {
-	struct mloop* self = malloc(sizeof(*self));
+	struct mloop* self = mem_alloc(MEM_TAG_MLOOP, sizeof(*self));
 	if (!self)
 		return NULL;
 
@@ -959,7 +1997,7 @@ void mloop_free(struct mloop* self)
 	mloop__object_list_clear(self);
 	pthread_mutex_destroy(&self->object_list_mutex);
 	mloop_core__unref(self->core);
-	free(self);
+	mem_free(MEM_TAG_MLOOP, self);
 }
 
 EXPORT
@@ -1000,12 +2038,10 @@ struct mloop* mloop_default()
 EXPORT
 struct mloop_socket* mloop_socket_new(struct mloop* creator)
 {
-	struct mloop_socket* self = malloc(sizeof(*self));
+	struct mloop_socket* self = mloop__alloc(MLOOP_SOCKET, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	self->type = MLOOP_SOCKET;
 	self->fd = -1;
 	self->ref = 1;
@@ -1020,29 +2056,19 @@ struct mloop_socket* mloop_socket_new(struct mloop* creator)
 EXPORT
 struct mloop_timer* mloop_timer_new(struct mloop* creator)
 {
-	struct mloop_timer* self = malloc(sizeof(*self));
+	struct mloop_timer* self = mloop__alloc(MLOOP_TIMER, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	struct mloop_socket* socket = &self->socket;
 	socket->type = MLOOP_TIMER;
+	socket->fd = -1;
 	socket->ref = 1;
 	socket->creator = creator;
-	socket->events = MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI;
-
-	socket->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
-	if (socket->fd < 0)
-		goto timerfd_create_failure;
 
 	mloop__print_debug(self, "new", 1, 1);
 
 	return self;
-
-timerfd_create_failure:
-	free(self);
-	return NULL;
 }
 
 void mloop__signal_reader(struct mloop_socket* socket)
@@ -1056,20 +2082,23 @@ void mloop__signal_reader(struct mloop_socket* socket)
 
 	assert(size == sizeof(fdsi));
 
+	uint64_t start = mloop__prof_start(socket->parent_core);
+
 	mloop_signal_fn signal_fn = sig->signal_fn;
 	if (signal_fn)
 		signal_fn(sig, fdsi.ssi_signo);
+
+	mloop__prof_end(socket->parent_core, MLOOP_PROF_SIGNAL, signal_fn,
+			start);
 }
 
 EXPORT
 struct mloop_signal* mloop_signal_new(struct mloop* creator)
 {
-	struct mloop_signal* self = malloc(sizeof(*self));
+	struct mloop_signal* self = mloop__alloc(MLOOP_SIGNAL, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	struct mloop_socket* socket = &self->socket;
 	socket->type = MLOOP_SIGNAL;
 	socket->fd = -1;
@@ -1079,7 +2108,7 @@ struct mloop_signal* mloop_signal_new(struct mloop* creator)
 	socket->events = MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI;
 
 	sigemptyset(&self->sigset);
-	socket->fd = signalfd(-1, &self->sigset, SFD_NONBLOCK);
+	socket->fd = signalfd(-1, &self->sigset, SFD_NONBLOCK | SFD_CLOEXEC);
 	if (socket->fd < 0)
 		goto failure;
 
@@ -1088,19 +2117,17 @@ struct mloop_signal* mloop_signal_new(struct mloop* creator)
 	return self;
 
 failure:
-	free(self);
+	mloop__release(self);
 	return NULL;
 }
 
 EXPORT
 struct mloop_async* mloop_async_new(struct mloop* creator)
 {
-	struct mloop_async* self = malloc(sizeof(*self));
+	struct mloop_async* self = mloop__alloc(MLOOP_ASYNC, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	self->type = MLOOP_ASYNC;
 	self->priority = ULONG_MAX;
 	self->ref = 1;
@@ -1112,12 +2139,10 @@ struct mloop_async* mloop_async_new(struct mloop* creator)
 EXPORT
 struct mloop_work* mloop_work_new(struct mloop* creator)
 {
-	struct mloop_work* self = malloc(sizeof(*self));
+	struct mloop_work* self = mloop__alloc(MLOOP_WORK, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	self->type = MLOOP_WORK;
 	self->priority = ULONG_MAX;
 	self->ref = 1;
@@ -1131,12 +2156,10 @@ struct mloop_work* mloop_work_new(struct mloop* creator)
 EXPORT
 struct mloop_idle* mloop_idle_new(struct mloop* creator)
 {
-	struct mloop_idle* self = malloc(sizeof(*self));
+	struct mloop_idle* self = mloop__alloc(MLOOP_IDLE, sizeof(*self));
 	if (!self)
 		return NULL;
 
-	memset(self, 0, sizeof(*self));
-
 	self->type = MLOOP_IDLE;
 	self->ref = 1;
 	self->creator = creator;
@@ -1152,12 +2175,22 @@ void mloop_socket_free(struct mloop_socket* self)
 	mloop__free_context(self);
 	if (self->fd >= 0)
 		close(self->fd);
-	free(self);
+	mloop__release(self);
 }
 
 EXPORT
 void mloop_timer_free(struct mloop_timer* self)
 {
+	/* The last reference may be dropped by mloop_free() while the timer
+	 * is started.
+	 */
+	if (self->is_linked) {
+		struct mloop_timer_wheel* wheel = &self->socket.parent_core->timers;
+		pthread_mutex_lock(&wheel->mutex);
+		mloop__wheel_remove(wheel, self);
+		pthread_mutex_unlock(&wheel->mutex);
+	}
+
 	mloop_socket_free(&self->socket);
 }
 
@@ -1165,14 +2198,14 @@ EXPORT
 void mloop_async_free(struct mloop_async* self)
 {
 	mloop__free_context(self);
-	free(self);
+	mloop__release(self);
 }
 
 EXPORT
 void mloop_work_free(struct mloop_work* self)
 {
 	mloop__free_context(self);
-	free(self);
+	mloop__release(self);
 }
 
 EXPORT
@@ -1185,32 +2218,7 @@ EXPORT
 void mloop_idle_free(struct mloop_idle* self)
 {
 	mloop__free_context(self);
-	free(self);
-}
-
-void mloop__read_timer(struct mloop_socket* timer)
-{
-	uint64_t dummy;
-	(void)read(timer->fd, &dummy, sizeof(dummy));
-}
-
-void mloop__process_timer(struct mloop_socket* socket)
-{
-	struct mloop_timer* timer = (struct mloop_timer*)socket;
-
-	mloop__read_timer(socket);
-
-	int is_periodic = timer->timer_type & MLOOP_TIMER_PERIODIC;
-	if (is_periodic)
-		return;
-
-	if (mloop__change_state(timer, MLOOP_STARTED, MLOOP_STOPPING) < 0)
-		return;
-
-	mloop__socket_stop(socket);
-
-	int rc = mloop__change_state(timer, MLOOP_STOPPING, MLOOP_STOPPED);
-	assert(rc == 0);
+	mloop__release(self);
 }
 
 EXPORT
@@ -1224,7 +2232,13 @@ EXPORT
 void mloop_socket_set_event(struct mloop_socket* socket,
 			    enum mloop_socket_event events)
 {
+	if (socket->events == events)
+		return;
+
 	socket->events = events;
+
+	if (mloop_socket_is_started(socket))
+		mloop__poll_modify(socket->parent_core, socket);
 }
 
 enum mloop_socket_event
@@ -1250,9 +2264,35 @@ uint32_t mloop__get_epoll_event(enum mloop_socket_event events)
 	return e;
 }
 
+/* Timers and signals are timed in their own handlers, so only the sockets of
+ * users are timed here.
+ */
+static void mloop__dispatch_socket(struct mloop_core* core,
+				   struct mloop_socket* socket,
+				   uint64_t wake_time)
+{
+	mloop_socket_fn callback_fn = socket->callback_fn;
+	if (!callback_fn)
+		return;
+
+	uint64_t start = 0;
+	if (wake_time) {
+		if (mloop__prof_is_enabled(core))
+			mloop__prof_add_lag(core, &core->prof.data.dispatch_lag,
+					    wake_time);
+		if (socket->type == MLOOP_SOCKET)
+			start = mloop__monotonic_ns();
+	}
+
+	callback_fn(socket);
+
+	mloop__prof_end(core, MLOOP_PROF_SOCKET, callback_fn, start);
+}
+
 void mloop__process_events(struct mloop* self, struct epoll_event* events,
 			   int nfds)
 {
+	uint64_t wake_time = mloop__prof_start(self->core);
 	int i;
 
 	/* All active events are referenced/unreferenced before/after
@@ -1267,71 +2307,619 @@ void mloop__process_events(struct mloop* self, struct epoll_event* events,
 		struct epoll_event* event = &events[i];
 		struct mloop_socket* socket = event->data.ptr;
 
-		/* Let's not process freed sockets */
-		if (mloop__atomic_load(&socket->ref) <= 1)
-			continue;
+		/* Let's not process freed sockets */
+		if (mloop__atomic_load(&socket->ref) <= 1)
+			continue;
+
+		socket->revents = mloop__get_socket_event(event->events);
+
+		if (mloop_socket_is_started(socket))
+			mloop__dispatch_socket(self->core, socket, wake_time);
+	}
+
+	for (i = 0; i < nfds; ++i)
+		mloop__unref_any(events[i].data.ptr);
+}
+
+#ifdef HAVE_URING
+
+static inline uint64_t mloop__uring_tag(struct mloop_socket* socket)
+{
+	unsigned int gen = mloop__atomic_load(&socket->uring_gen);
+	return (uintptr_t)socket | (gen & MLOOP_URING_GEN_MASK);
+}
+
+static inline int mloop__uring_is_runner(struct mloop_uring* self)
+{
+	return mloop__atomic_load(&self->is_running)
+	    && pthread_equal(self->runner, pthread_self());
+}
+
+static inline void mloop__uring_set_runner(struct mloop_core* core,
+					   int is_running)
+{
+	if (!core->is_uring)
+		return;
+
+	if (is_running)
+		core->uring.runner = pthread_self();
+
+	mloop__atomic_store(&core->uring.is_running, is_running);
+}
+
+static void mloop__uring_submit_locked(struct mloop_uring* self)
+{
+	unsigned int n = self->n_pending;
+	if (n == 0)
+		return;
+
+	int rc = uring_enter(&self->ring, n, 0);
+	self->n_pending = rc > 0 ? n - rc : n;
+}
+
+static struct io_uring_sqe* mloop__uring_get_sqe(struct mloop_uring* self)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(&self->ring);
+	if (sqe)
+		return sqe;
+
+	mloop__uring_submit_locked(self);
+	return uring_get_sqe(&self->ring);
+}
+
+static void mloop__uring_push_locked(struct mloop_uring* self)
+{
+	uring_push_sqe(&self->ring);
+	++self->n_pending;
+
+	/* The loop may be sleeping in io_uring_enter() */
+	if (!mloop__uring_is_runner(self))
+		mloop__uring_submit_locked(self);
+}
+
+static int mloop__uring_poll_add(struct mloop_core* core,
+				 struct mloop_socket* socket)
+{
+	struct mloop_uring* self = &core->uring;
+
+	if (socket->fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+
+	pthread_mutex_lock(&self->mutex);
+
+	struct io_uring_sqe* sqe = mloop__uring_get_sqe(self);
+	if (!sqe)
+		goto failure;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = socket->fd;
+	sqe->poll32_events = mloop__get_epoll_event(socket->events);
+	sqe->len = socket->is_multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = mloop__uring_tag(socket);
+
+	mloop__ref_any(socket);
+	__atomic_add_fetch(&self->n_in_flight, 1, __ATOMIC_SEQ_CST);
+
+	mloop__uring_push_locked(self);
+
+	pthread_mutex_unlock(&self->mutex);
+	return 0;
+
+failure:
+	pthread_mutex_unlock(&self->mutex);
+	errno = EBUSY;
+	return -1;
+}
+
+static int mloop__uring_poll_remove(struct mloop_core* core,
+				    struct mloop_socket* socket)
+{
+	struct mloop_uring* self = &core->uring;
+
+	pthread_mutex_lock(&self->mutex);
+
+	struct io_uring_sqe* sqe = mloop__uring_get_sqe(self);
+	if (!sqe)
+		goto failure;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = mloop__uring_tag(socket);
+
+	/* Whatever the old poll completes with is ignored from here on */
+	__atomic_add_fetch(&socket->uring_gen, 1, __ATOMIC_SEQ_CST);
+
+	mloop__uring_push_locked(self);
+
+	pthread_mutex_unlock(&self->mutex);
+	return 0;
+
+failure:
+	pthread_mutex_unlock(&self->mutex);
+	errno = EBUSY;
+	return -1;
+}
+
+static inline int mloop__uring_is_current(struct mloop_socket* socket,
+					  uint64_t user_data)
+{
+	return mloop__uring_tag(socket) == user_data;
+}
+
+/* Sockets that are still starting are re-armed too; the completion may have
+ * raced with mloop_socket_start() in another thread.
+ */
+static inline int mloop__uring_may_rearm(struct mloop_socket* socket,
+					 uint64_t user_data)
+{
+	enum mloop_state state = mloop__atomic_load(&socket->state);
+
+	return mloop__uring_is_current(socket, user_data)
+	    && (state == MLOOP_STARTED || state == MLOOP_STARTING);
+}
+
+static void mloop__uring_process_cqe(struct mloop_core* core,
+				     const struct io_uring_cqe* cqe,
+				     uint64_t wake_time)
+{
+	struct mloop_uring* uring = &core->uring;
+	struct mloop_socket* socket =
+		(void*)(uintptr_t)(cqe->user_data & ~MLOOP_URING_GEN_MASK);
+
+	/* Completions of removals and cancellations */
+	if (!socket)
+		return;
+
+	int is_final = !(cqe->flags & IORING_CQE_F_MORE);
+
+	if (cqe->res != -ECANCELED && !uring->is_closing
+	 && mloop__uring_is_current(socket, cqe->user_data)
+	 && mloop_socket_is_started(socket)) {
+		socket->revents = cqe->res < 0 ? MLOOP_SOCKET_EVENT_ERR
+				: mloop__get_socket_event(cqe->res);
+
+		mloop__dispatch_socket(core, socket, wake_time);
+	}
+
+	if (!is_final)
+		return;
+
+	if (cqe->res >= 0 && !uring->is_closing
+	 && mloop__uring_may_rearm(socket, cqe->user_data))
+		mloop__uring_poll_add(core, socket);
+
+	__atomic_sub_fetch(&uring->n_in_flight, 1, __ATOMIC_SEQ_CST);
+	mloop__unref_any(socket);
+}
+
+static void mloop__uring_wait(struct mloop* self, int timeout)
+{
+	struct mloop_uring* uring = &self->core->uring;
+
+	pthread_mutex_lock(&uring->mutex);
+	unsigned int n = uring->n_pending;
+	uring->n_pending = 0;
+	pthread_mutex_unlock(&uring->mutex);
+
+	if (n == 0 && timeout == 0)
+		return;
+
+	int rc = uring_enter(&uring->ring, n, timeout != 0 ? 1 : 0);
+
+	/* Interrupted waits still submit everything */
+	if (rc < 0 && errno == EINTR)
+		return;
+
+	if (rc < (int)n) {
+		pthread_mutex_lock(&uring->mutex);
+		uring->n_pending += rc > 0 ? n - rc : n;
+		pthread_mutex_unlock(&uring->mutex);
+	}
+}
+
+static void mloop__uring_process(struct mloop* self)
+{
+	struct io_uring_cqe cqe;
+	uint64_t wake_time = mloop__prof_start(self->core);
+
+	for (int i = 0; i < MAX_EVENTS; ++i) {
+		if (uring_pop_cqe(&self->core->uring.ring, &cqe) < 0)
+			break;
+
+		mloop__uring_process_cqe(self->core, &cqe, wake_time);
+	}
+}
+
+static void mloop__uring_flush(struct mloop_core* core)
+{
+	if (!core->is_uring)
+		return;
+
+	pthread_mutex_lock(&core->uring.mutex);
+	mloop__uring_submit_locked(&core->uring);
+	pthread_mutex_unlock(&core->uring.mutex);
+}
+
+static int mloop__uring_init(struct mloop_core* core)
+{
+	struct mloop_uring* self = &core->uring;
+
+	if (uring_init(&self->ring, MLOOP_URING_ENTRIES) < 0)
+		return -1;
+
+	pthread_mutex_init(&self->mutex, NULL);
+	core->is_uring = 1;
+	return 0;
+}
+
+/* Outstanding polls hold references, so they are cancelled and their
+ * completions are waited for before the ring goes away.
+ */
+static void mloop__uring_destroy(struct mloop_core* core)
+{
+	struct mloop_uring* self = &core->uring;
+	struct io_uring_cqe cqe;
+
+	self->is_closing = 1;
+
+#ifdef IORING_ASYNC_CANCEL_ANY
+	pthread_mutex_lock(&self->mutex);
+	struct io_uring_sqe* sqe = mloop__uring_get_sqe(self);
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		uring_push_sqe(&self->ring);
+		++self->n_pending;
+	}
+	mloop__uring_submit_locked(self);
+	pthread_mutex_unlock(&self->mutex);
+
+	while (mloop__atomic_load(&self->n_in_flight) > 0) {
+		if (uring_pop_cqe(&self->ring, &cqe) == 0) {
+			mloop__uring_process_cqe(core, &cqe, 0);
+			continue;
+		}
+
+		if (uring_enter(&self->ring, 0, 1) < 0 && errno != EINTR)
+			break;
+	}
+#endif
+
+	while (uring_pop_cqe(&self->ring, &cqe) == 0)
+		mloop__uring_process_cqe(core, &cqe, 0);
+
+	uring_destroy(&self->ring);
+	pthread_mutex_destroy(&self->mutex);
+}
+
+#else
+
+static inline void mloop__uring_set_runner(struct mloop_core* core,
+					   int is_running)
+{
+	(void)core;
+	(void)is_running;
+}
+
+static int mloop__uring_poll_add(struct mloop_core* core,
+				 struct mloop_socket* socket)
+{
+	(void)core;
+	(void)socket;
+	errno = ENOSYS;
+	return -1;
+}
+
+static int mloop__uring_poll_remove(struct mloop_core* core,
+				    struct mloop_socket* socket)
+{
+	(void)core;
+	(void)socket;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void mloop__uring_wait(struct mloop* self, int timeout)
+{
+	(void)self;
+	(void)timeout;
+}
+
+static void mloop__uring_process(struct mloop* self)
+{
+	(void)self;
+}
+
+static void mloop__uring_flush(struct mloop_core* core)
+{
+	(void)core;
+}
+
+static int mloop__uring_init(struct mloop_core* core)
+{
+	(void)core;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void mloop__uring_destroy(struct mloop_core* core)
+{
+	(void)core;
+}
+
+#endif /* HAVE_URING */
+
+static int mloop__poll_add(struct mloop_core* core,
+			   struct mloop_socket* socket)
+{
+	if (core->is_uring)
+		return mloop__uring_poll_add(core, socket);
+
+	struct epoll_event event = {
+		.events = mloop__get_epoll_event(socket->events),
+		.data.ptr = socket
+	};
+
+	return epoll_ctl(core->epollfd, EPOLL_CTL_ADD, socket->fd, &event);
+}
+
+static int mloop__poll_remove(struct mloop_core* core,
+			      struct mloop_socket* socket)
+{
+	if (core->is_uring)
+		return mloop__uring_poll_remove(core, socket);
+
+	return epoll_ctl(core->epollfd, EPOLL_CTL_DEL, socket->fd, NULL);
+}
+
+/* A poll request can't be changed in place, so under io_uring it is replaced.
+ * Completions of the old one are ignored as it belongs to an older generation.
+ */
+static int mloop__poll_modify(struct mloop_core* core,
+			      struct mloop_socket* socket)
+{
+	if (core->is_uring) {
+		if (mloop__uring_poll_remove(core, socket) < 0)
+			return -1;
+
+		return mloop__uring_poll_add(core, socket);
+	}
+
+	struct epoll_event event = {
+		.events = mloop__get_epoll_event(socket->events),
+		.data.ptr = socket
+	};
+
+	return epoll_ctl(core->epollfd, EPOLL_CTL_MOD, socket->fd, &event);
+}
+
+/* io_uring is preferred if both are allowed */
+static int mloop__poll_init(struct mloop_core* core, int flags)
+{
+	if (flags == MLOOP_F_DEFAULT)
+		flags = MLOOP_DEFAULT_FLAGS;
+
+	core->epollfd = -1;
+
+	if (flags & MLOOP_F_IO_URING) {
+		if (mloop__uring_init(core) == 0)
+			return 0;
+
+		if (!(flags & MLOOP_F_EPOLL))
+			return -1;
+	}
+
+	if (!(flags & MLOOP_F_EPOLL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	core->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	return core->epollfd >= 0 ? 0 : -1;
+}
+
+static void mloop__poll_destroy(struct mloop_core* core)
+{
+	if (core->is_uring)
+		mloop__uring_destroy(core);
+	else
+		close(core->epollfd);
+}
+
+/* Returns 1 if a job was run */
+static int mloop__process_async_job(struct mloop* self)
+{
+	struct prioq_elem elem;
+
+	if (prioq_pop(&self->core->async_jobs, &elem, 0) < 0)
+		return 0;
+
+	struct mloop_async* async = elem.data;
+	assert(async);
+	assert(async->state == MLOOP_STARTED);
+
+	if (async->is_cancelled)
+		goto cancelled;
+
+	mloop__count_deadline(self->core, async->deadline);
+
+	uint64_t start = mloop__prof_start(self->core);
+
+	mloop_async_fn callback_fn = async->callback_fn;
+	if (callback_fn)
+		callback_fn(async);
+
+	mloop__prof_end(self->core, async->type == MLOOP_WORK
+			? MLOOP_PROF_WORK : MLOOP_PROF_ASYNC, callback_fn, start);
+
+cancelled:
+	if (mloop__object_list_remove(async) == 0)
+		return 1;
+
+	int rc = mloop__change_state(async, MLOOP_STARTED, MLOOP_STOPPED);
+	assert(rc == 0);
+	return 1;
+}
+
+/* Returns 1 if a job was run */
+static int mloop__process_ready_job(struct mloop* self)
+{
+	struct mloop_idle* job = mloop__ready_list_pop(self->core);
+	if (!job)
+		return 0;
+
+	mloop_idle_fn idle_fn = job->idle_fn;
+	if (idle_fn && mloop_idle_is_started(job)) {
+		uint64_t start = mloop__prof_start(self->core);
+		idle_fn(job);
+		mloop__prof_end(self->core, MLOOP_PROF_IDLE, idle_fn, start);
+	}
+
+	mloop_idle_unref(job);
+	return 1;
+}
+
+/* Returns 1 if a job was polled */
+static int mloop__process_idle_job(struct mloop* self)
+{
+	/* Note: pop() does not unreference the job and this is crucial for the
+	 * sake of concurrency. */
+	struct mloop_idle* job = mloop__idle_list_pop(self->core);
+	if (!job)
+		return 0;
+
+	mloop_idle_cond_fn cond_fn = job->cond_fn;
+	if (cond_fn && cond_fn(job)) {
+		uint64_t start = mloop__prof_start(self->core);
+
+		mloop_idle_fn idle_fn = job->idle_fn;
+		if (idle_fn)
+			idle_fn(job);
+
+		mloop__prof_end(self->core, MLOOP_PROF_IDLE, idle_fn, start);
+	}
+
+	if (mloop_idle_unref(job) > 0)
+		mloop__idle_list_add(job);
+
+	return 1;
+}
+
+static inline size_t mloop__count_jobs(struct mloop_core* core,
+				       const size_t* count)
+{
+	mloop__idle_list_lock(core);
+	size_t n = *count;
+	mloop__idle_list_unlock(core);
+	return n;
+}
+
+static inline int mloop__is_late(uint64_t deadline)
+{
+	return deadline && mloop__monotonic_ns() >= deadline;
+}
+
+static inline void mloop__count_budget_hit(struct mloop_core* core,
+					   int is_late)
+{
+	uint64_t* counter = is_late ? &core->stats.n_time_budget_hits
+				    : &core->stats.n_job_budget_hits;
 
-		socket->revents = mloop__get_socket_event(event->events);
+	/* Only the thread that runs the loop writes the counters */
+	__atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of jobs that were run */
+static size_t mloop__process_budgeted(struct mloop* self,
+				      int (*process_fn)(struct mloop*),
+				      size_t n, uint64_t deadline)
+{
+	size_t i = 0;
 
-		mloop_socket_fn callback_fn = socket->callback_fn;
-		if (callback_fn && mloop_socket_is_started(socket))
-			callback_fn(socket);
+	while (i < n && process_fn(self)) {
+		++i;
 
-		if (socket->type == MLOOP_TIMER)
-			mloop__process_timer(socket);
+		if (mloop__is_late(deadline))
+			break;
 	}
 
-	for (i = 0; i < nfds; ++i)
-		mloop__unref_any(events[i].data.ptr);
+	return i;
 }
 
-void mloop__process_async_jobs(struct mloop* self)
+/* Worker results and other jobs that come in bursts are drained in one go
+ * rather than one per poll. Each kind of job gets at least one turn per
+ * iteration, even when the time has run out.
+ */
+static void mloop__prof_sample_depths(struct mloop_core* core)
 {
-	struct prioq_elem elem;
+	size_t n_async = mloop__atomic_load(&core->async_jobs.index);
 
-	if (prioq_pop(&self->core->async_jobs, &elem, 0) < 0)
-		return;
+	mloop__idle_list_lock(core);
+	size_t n_idle = core->n_idle_jobs + core->n_ready_jobs;
+	mloop__idle_list_unlock(core);
 
-	struct mloop_async* async = elem.data;
-	assert(async);
-	assert(async->state == MLOOP_STARTED);
+	size_t n_work = mloop__atomic_load(&mloop__nthreads) > 0
+		      ? workq_get_length(&mloop__job_queue) : 0;
 
-	if (async->is_cancelled)
-		goto cancelled;
+	pthread_mutex_lock(&core->prof.mutex);
+	mloop__prof_depth_add(&core->prof.data.async_jobs, n_async);
+	mloop__prof_depth_add(&core->prof.data.idle_jobs, n_idle);
+	mloop__prof_depth_add(&core->prof.data.worker_jobs, n_work);
+	pthread_mutex_unlock(&core->prof.mutex);
+}
 
-	mloop_async_fn callback_fn = async->callback_fn;
-	if (callback_fn)
-		callback_fn(async);
+static void mloop__process_jobs(struct mloop* self)
+{
+	struct mloop_core* core = self->core;
+	size_t budget = core->job_budget;
 
-cancelled:
-	if (mloop__object_list_remove(async) == 0)
-		return;
+	uint64_t deadline = core->job_budget_ns
+			  ? mloop__monotonic_ns() + core->job_budget_ns : 0;
 
-	int rc = mloop__change_state(async, MLOOP_STARTED, MLOOP_STOPPED);
-	assert(rc == 0);
-}
+	__atomic_store_n(&core->stats.n_iterations,
+			 core->stats.n_iterations + 1, __ATOMIC_RELAXED);
 
-void mloop__process_idle_jobs(struct mloop* self)
-{
-	/* Note: pop() does not unreference the job and this is crucial for the
-	 * sake of concurrency. */
-	struct mloop_idle* job = mloop__idle_list_pop(self->core);
-	if (!job)
-		return;
+	if (mloop__prof_is_enabled(core))
+		mloop__prof_sample_depths(core);
 
-	mloop_idle_cond_fn cond_fn = job->cond_fn;
-	if (cond_fn && cond_fn(job)) {
-		mloop_idle_fn idle_fn = job->idle_fn;
-		if (idle_fn)
-			idle_fn(job);
+	mloop__process_budgeted(self, mloop__process_async_job, budget,
+				deadline);
+
+	int is_late = mloop__is_late(deadline);
+	if (core->async_jobs.index > 0)
+		mloop__count_budget_hit(core, is_late);
+
+	/* Jobs that are notified or put back while these are run wait for the
+	 * next iteration, so that a job that keeps notifying itself cannot
+	 * starve the loop.
+	 */
+	size_t n_ready = mloop__count_jobs(core, &core->n_ready_jobs);
+	size_t n = is_late ? 1 : budget;
+	if (n > n_ready)
+		n = n_ready;
+
+	if (mloop__process_budgeted(self, mloop__process_ready_job, n,
+				    deadline) < n_ready) {
+		is_late = mloop__is_late(deadline);
+		mloop__count_budget_hit(core, is_late);
 	}
 
-	if (mloop_idle_unref(job) > 0)
-		mloop__idle_list_add(job);
+	size_t n_idle = mloop__count_jobs(core, &core->n_idle_jobs);
+	n = is_late ? 1 : budget;
+	if (n > n_idle)
+		n = n_idle;
+
+	if (mloop__process_budgeted(self, mloop__process_idle_job, n,
+				    deadline) < n_idle)
+		mloop__count_budget_hit(core, mloop__is_late(deadline));
 }
 
 static inline int mloop__have_idle_jobs_nolocks(const struct mloop* self)
 {
+	if (!TAILQ_EMPTY(&self->core->ready_jobs))
+		return 1;
+
 	struct mloop_idle* idle;
 	TAILQ_FOREACH(idle, &self->core->idle_jobs, idle_links)
 		if (idle->cond_fn && idle->cond_fn(idle))
@@ -1352,61 +2940,331 @@ static inline int mloop__have_async_or_idle_jobs(struct mloop* self)
 	return self->core->async_jobs.index > 0 || mloop__have_idle_jobs(self);
 }
 
-EXPORT
-int mloop_run(struct mloop* self)
+static inline void mloop__prepare(struct mloop* self)
+{
+	mloop_prepare_fn prepare_fn = self->core->prepare_fn;
+	if (prepare_fn)
+		prepare_fn(self->core->prepare_context);
+}
+
+static int mloop__run(struct mloop* self)
 {
 	struct epoll_event events[MAX_EVENTS];
 	memset(events, 0, sizeof(events));
 
-	self->core->do_exit = 0;
-
 	int old_cancel_type = 0;
 	int old_cancel_state = 0;
 
 	pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &old_cancel_type);
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old_cancel_state);
 
-	while (!mloop__is_exiting(self)) {
-		int timeout = mloop__have_async_or_idle_jobs(self) ? 0 : -1;
+	struct mloop_core* old_current = mloop__current;
+	mloop__current = self->core;
 
-		int nfds = epoll_wait(self->core->epollfd, events, MAX_EVENTS,
-				      timeout);
+	mloop__uring_set_runner(self->core, 1);
 
-		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	while (!mloop__is_exiting(self)) {
+		int timeout = mloop__have_async_or_idle_jobs(self) ? 0 : -1;
 
-		if (nfds > 0)
-			mloop__process_events(self, events, nfds);
+		if (self->core->is_uring) {
+			mloop__uring_wait(self, timeout);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			mloop__uring_process(self);
+		} else {
+			int nfds = epoll_wait(self->core->epollfd, events,
+					      MAX_EVENTS, timeout);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+			if (nfds > 0)
+				mloop__process_events(self, events, nfds);
+		}
 
-		mloop__process_async_jobs(self);
-		mloop__process_idle_jobs(self);
+		mloop__process_jobs(self);
 		mloop__collect(self->core);
 
+		mloop__prepare(self);
 
 		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
 	}
 
+	mloop__uring_set_runner(self->core, 0);
+	mloop__uring_flush(self->core);
+
+	mloop__current = old_current;
+
 	pthread_setcancelstate(old_cancel_state, NULL);
 	pthread_setcanceltype(old_cancel_type, NULL);
 
 	return 0;
 }
 
+EXPORT
+int mloop_run(struct mloop* self)
+{
+	self->core->do_exit = 0;
+	return mloop__run(self);
+}
+
+static void* mloop__thread_fn(void* context)
+{
+	struct mloop* self = context;
+
+	/* Signals are handled by the default loop */
+	mloop__block_all_signals();
+
+	mloop__run(self);
+	return NULL;
+}
+
+EXPORT
+int mloop_start_thread(struct mloop* self, int cpu)
+{
+	struct mloop_core* core = self->core;
+
+	if (core->have_thread || self == mloop__default) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+
+	/* Reset here rather than in the thread so that an mloop_exit() that
+	 * comes before the thread is running is not lost.
+	 */
+	core->do_exit = 0;
+
+	int rc = pthread_create(&core->thread, &attr, mloop__thread_fn, self);
+	pthread_attr_destroy(&attr);
+
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+
+	core->have_thread = 1;
+	return 0;
+}
+
+EXPORT
+void mloop_stop_thread(struct mloop* self)
+{
+	struct mloop_core* core = self->core;
+
+	if (!core->have_thread)
+		return;
+
+	mloop_exit(self);
+	pthread_join(core->thread, NULL);
+	core->have_thread = 0;
+}
+
+EXPORT
+int mloop_post(struct mloop* target, mloop_async_fn fn, void* context,
+	       mloop_free_fn free_fn)
+{
+	struct mloop_async* async = mloop_async_new(target);
+	if (!async)
+		return -1;
+
+	mloop_async_set_context(async, context, free_fn);
+	mloop_async_set_callback(async, fn);
+
+	int rc = mloop_async_start(async);
+
+	/* The context still belongs to the caller if it was not posted */
+	if (rc < 0)
+		async->free_fn = NULL;
+
+	mloop_async_unref(async);
+	return rc;
+}
+
 EXPORT
 int mloop_run_once(struct mloop* self)
 {
+	struct mloop_core* core = self->core;
 	struct epoll_event events[MAX_EVENTS];
 
-	int nfds = epoll_wait(self->core->epollfd, events, MAX_EVENTS, 0);
-	if (nfds > 0)
-		mloop__process_events(self, events, nfds);
+	struct mloop_core* old_current = mloop__current;
+	mloop__current = core;
+
+	mloop__uring_set_runner(core, 1);
+
+	if (core->is_uring) {
+		mloop__uring_wait(self, 0);
+		mloop__uring_process(self);
+	} else {
+		int nfds = epoll_wait(core->epollfd, events, MAX_EVENTS, 0);
+		if (nfds > 0)
+			mloop__process_events(self, events, nfds);
+	}
+
+	mloop__process_jobs(self);
+	mloop__collect(core);
+
+	mloop__prepare(self);
+
+	/* Polls that were re-armed above must be in before the caller waits on
+	 * the poll fd again.
+	 */
+	mloop__uring_set_runner(core, 0);
+	mloop__uring_flush(core);
+
+	mloop__current = old_current;
+	return 0;
+}
+
+EXPORT
+int mloop_is_current(const struct mloop* self)
+{
+	return self && mloop__current == self->core;
+}
+
+EXPORT
+void mloop_set_job_budget(struct mloop* self, size_t n_jobs, uint64_t time_us)
+{
+	self->core->job_budget = n_jobs > 0 ? n_jobs : 1;
+	self->core->job_budget_ns = time_us * 1000ULL;
+}
+
+EXPORT
+void mloop_get_stats(const struct mloop* self, struct mloop_stats* stats)
+{
+	const struct mloop_stats* src = &self->core->stats;
+
+	stats->n_iterations = __atomic_load_n(&src->n_iterations,
+					      __ATOMIC_RELAXED);
+	stats->n_job_budget_hits = __atomic_load_n(&src->n_job_budget_hits,
+						   __ATOMIC_RELAXED);
+	stats->n_time_budget_hits = __atomic_load_n(&src->n_time_budget_hits,
+						    __ATOMIC_RELAXED);
+	stats->n_deadline_jobs = __atomic_load_n(&src->n_deadline_jobs,
+						 __ATOMIC_RELAXED);
+	stats->n_deadline_misses = __atomic_load_n(&src->n_deadline_misses,
+						   __ATOMIC_RELAXED);
+	stats->max_lateness_ns = __atomic_load_n(&src->max_lateness_ns,
+						 __ATOMIC_RELAXED);
+}
+
+EXPORT
+void mloop_set_scheduling(struct mloop* self, enum mloop_scheduling mode)
+{
+	prioq_set_mode(&self->core->async_jobs, mode == MLOOP_SCHED_EDF
+						? PRIOQ_EDF : PRIOQ_PRIORITY);
+}
+
+EXPORT
+void mloop_set_profiling(struct mloop* self, int enable,
+			 uint64_t stall_threshold_us)
+{
+	struct mloop_profiler* prof = &self->core->prof;
+
+	pthread_mutex_lock(&prof->mutex);
+
+	if (enable && !prof->is_enabled) {
+		memset(prof->index, 0, sizeof(prof->index));
+		memset(&prof->data, 0, sizeof(prof->data));
+	}
+
+	prof->stall_threshold_ns = stall_threshold_us * 1000ULL;
+	__atomic_store_n(&prof->is_enabled, !!enable, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&prof->mutex);
+}
+
+EXPORT
+int mloop_get_profile(const struct mloop* self, struct mloop_prof* prof)
+{
+	struct mloop_profiler* src = &self->core->prof;
+
+	if (!__atomic_load_n(&src->is_enabled, __ATOMIC_RELAXED)) {
+		errno = ENOENT;
+		return -1;
+	}
 
-	mloop__process_async_jobs(self);
-	mloop__process_idle_jobs(self);
-	mloop__collect(self->core);
+	pthread_mutex_lock(&src->mutex);
+	memcpy(prof, &src->data, sizeof(*prof));
+	pthread_mutex_unlock(&src->mutex);
+
+	for (int i = 0; i < MLOOP_PROF_N_TYPES; ++i) {
+		struct mloop_cache* cache = &mloop__caches[i];
+		struct mloop_alloc_stats* allocs = &prof->allocs[i];
+
+		pthread_mutex_lock(&cache->mutex);
+		allocs->n_allocated = cache->n_allocated;
+		allocs->n_reused = cache->n_reused;
+		allocs->n_cached = cache->n_cached;
+		pthread_mutex_unlock(&cache->mutex);
+	}
 
 	return 0;
 }
 
+EXPORT
+const char* mloop_prof_type_name(enum mloop_prof_type type)
+{
+	switch (type) {
+	case MLOOP_PROF_SOCKET: return "socket";
+	case MLOOP_PROF_TIMER: return "timer";
+	case MLOOP_PROF_ASYNC: return "async";
+	case MLOOP_PROF_WORK: return "work";
+	case MLOOP_PROF_SIGNAL: return "signal";
+	case MLOOP_PROF_IDLE: return "idle";
+	default: break;
+	}
+
+	return "unknown";
+}
+
+EXPORT
+void mloop_prof_describe(const void* fn, char* buf, size_t size)
+{
+	Dl_info info;
+
+	if (!dladdr(fn, &info) || !info.dli_fname) {
+		snprintf(buf, size, "%p", fn);
+		return;
+	}
+
+	if (info.dli_sname && info.dli_saddr == fn) {
+		snprintf(buf, size, "%s", info.dli_sname);
+		return;
+	}
+
+	/* Static functions can be looked up with addr2line */
+	const char* name = strrchr(info.dli_fname, '/');
+	snprintf(buf, size, "%s+%#lx", name ? name + 1 : info.dli_fname,
+		 (unsigned long)((const char*)fn - (const char*)info.dli_fbase));
+}
+
+EXPORT
+int mloop_get_pollfd(const struct mloop* self)
+{
+	const struct mloop_core* core = self->core;
+	return core->is_uring ? core->uring.ring.fd : core->epollfd;
+}
+
+EXPORT
+int mloop_get_flags(const struct mloop* self)
+{
+	return self->core->is_uring ? MLOOP_F_IO_URING : MLOOP_F_EPOLL;
+}
+
+EXPORT
+void mloop_set_prepare_fn(struct mloop* self, mloop_prepare_fn fn,
+			  void* context)
+{
+	self->core->prepare_context = context;
+	self->core->prepare_fn = fn;
+}
+
 EXPORT
 void mloop_iterate(struct mloop* self)
 {
@@ -1422,15 +3280,10 @@ void mloop_exit(struct mloop* self)
 
 static int mloop__start_socket(struct mloop* self, struct mloop_socket* socket)
 {
-	struct epoll_event event = {
-		.events = mloop__get_epoll_event(socket->events),
-		.data.ptr = socket
-	};
-
 	socket->parent = self;
 	socket->parent_core = self->core;
 
-	if (epoll_ctl(self->core->epollfd, EPOLL_CTL_ADD, socket->fd, &event) < 0)
+	if (mloop__poll_add(self->core, socket) < 0)
 		return -1;
 
 	mloop__object_list_add(socket);
@@ -1464,7 +3317,7 @@ static int mloop__socket_stop(struct mloop_socket* self)
 {
 	struct mloop* mloop = self->parent;
 
-	int rc = epoll_ctl(mloop->core->epollfd, EPOLL_CTL_DEL, self->fd, NULL);
+	int rc = mloop__poll_remove(mloop->core, self);
 	mloop__object_list_remove(self);
 
 	return rc;
@@ -1489,6 +3342,7 @@ int mloop_timer_start(struct mloop_timer* timer)
 {
 	struct mloop_socket* socket = &timer->socket;
 	struct mloop* mloop = socket->creator;
+	struct mloop_timer_wheel* wheel = &mloop->core->timers;
 
 	if (timer->time == 0)
 		return -1;
@@ -1496,54 +3350,55 @@ int mloop_timer_start(struct mloop_timer* timer)
 	if (mloop__change_state(socket, MLOOP_STOPPED, MLOOP_STARTING) < 0)
 		return -1;
 
-	struct timespec ts = {
-		.tv_sec = timer->time / 1000000000LL,
-		.tv_nsec = timer->time % 1000000000LL
-	};
-
-	struct itimerspec its;
-	memset(&its, 0, sizeof(its));
+	socket->parent = mloop;
+	socket->parent_core = mloop->core;
+	mloop__object_list_add(socket);
 
-	its.it_value = ts;
+	uint64_t now = mloop__monotonic_ns();
 
-	if (timer->timer_type & MLOOP_TIMER_PERIODIC)
-		its.it_interval = ts;
+	uint64_t expires = timer->timer_type & MLOOP_TIMER_ABSOLUTE
+			 ? timer->time : now + timer->time;
 
-	int flags = timer->timer_type & MLOOP_TIMER_ABSOLUTE ? TFD_TIMER_ABSTIME : 0;
+	timer->expires = mloop__ticks(expires);
 
-	if (timerfd_settime(socket->fd, flags, &its, NULL) < 0)
-		goto failure;
+	pthread_mutex_lock(&wheel->mutex);
 
-	if (mloop__start_socket(mloop, socket) < 0)
-		goto failure;
+	/* An empty wheel has nothing to catch up on */
+	uint64_t now_tick = now / MLOOP_WHEEL_TICK_NS;
+	if (wheel->n_timers == 0 && now_tick > wheel->tick)
+		wheel->tick = now_tick;
 
+	/* The state is changed under the lock so that the timer cannot be
+	 * found expired while it is still starting.
+	 */
 	int rc = mloop__change_state(socket, MLOOP_STARTING, MLOOP_STARTED);
 	assert(rc == 0);
 
-	return 0;
+	mloop__wheel_add(wheel, timer);
 
-failure:
-	rc = mloop__change_state(socket, MLOOP_STARTING, MLOOP_STOPPED);
-	assert(rc == 0);
-	return -1;
+	pthread_mutex_unlock(&wheel->mutex);
+
+	return 0;
 }
 
 EXPORT
 int mloop_timer_stop(struct mloop_timer* self)
 {
 	struct mloop_socket* socket = &self->socket;
+	struct mloop_timer_wheel* wheel = &socket->parent_core->timers;
 
 	if (mloop__change_state(self, MLOOP_STARTED, MLOOP_STOPPING) < 0)
 		return -1;
 
-	struct itimerspec its;
-	memset(&its, 0, sizeof(its));
-
-	if (timerfd_settime(socket->fd, 0, &its, NULL) < 0)
-		goto failure;
+	/* The timerfd is left armed; waking up for nothing is cheaper than
+	 * re-arming it every time a timer is stopped.
+	 */
+	pthread_mutex_lock(&wheel->mutex);
+	mloop__wheel_remove(wheel, self);
+	pthread_mutex_unlock(&wheel->mutex);
 
 	mloop_socket_ref(socket);
-	mloop__socket_stop(socket);
+	mloop__object_list_remove(socket);
 	if (mloop_socket_unref(socket) == 0)
 		return 0;
 
@@ -1551,11 +3406,6 @@ int mloop_timer_stop(struct mloop_timer* self)
 	assert(rc == 0);
 
 	return 0;
-
-failure:
-	rc = mloop__change_state(self, MLOOP_STOPPING, MLOOP_STARTED);
-	assert(rc == 0);
-	return -1;
 }
 
 EXPORT
@@ -1568,7 +3418,7 @@ int mloop_signal_start(struct mloop_signal* sig)
 	if (mloop__change_state(sig, MLOOP_STOPPED, MLOOP_STARTING) < 0)
 		return -1;
 
-	fd = signalfd(socket->fd, &sig->sigset, SFD_NONBLOCK);
+	fd = signalfd(socket->fd, &sig->sigset, SFD_NONBLOCK | SFD_CLOEXEC);
 	if (fd < 0)
 		goto signalfd_failure;
 
@@ -1607,7 +3457,12 @@ static int mloop__start_idle(struct mloop* self, struct mloop_idle* idle)
 	idle->parent = self;
 	idle->parent_core = self->core;
 	mloop__object_list_add(idle);
-	mloop__idle_list_add(idle);
+
+	/* Jobs without a condition only run when notified */
+	idle->is_polled = idle->cond_fn != NULL;
+	if (idle->is_polled)
+		mloop__idle_list_add(idle);
+
 	mloop__break_out(self);
 	return 0;
 }
@@ -1636,11 +3491,26 @@ failure:
 
 static int mloop__idle_stop(struct mloop_idle* self)
 {
-	mloop__idle_list_remove(self);
+	if (self->is_polled)
+		mloop__idle_list_remove(self);
+	mloop__ready_list_remove(self);
 	mloop__object_list_remove(self);
 	return 0;
 }
 
+EXPORT
+int mloop_idle_notify(struct mloop_idle* self)
+{
+	if (!mloop_idle_is_started(self))
+		return -1;
+
+	/* A job that is already on the ready list has woken the loop */
+	if (mloop__ready_list_add(self))
+		mloop__break_out(self->parent);
+
+	return 0;
+}
+
 EXPORT
 int mloop_idle_stop(struct mloop_idle* self)
 {
@@ -1663,7 +3533,8 @@ static int mloop__start_async(struct mloop* self, struct mloop_async* async)
 	async->parent_core = self->core;
 	async->is_cancelled = 0;
 
-	if (prioq_insert(queue, async->priority, async) < 0)
+	if (prioq_insert_deadline(queue, async->priority, async->deadline,
+				  async) < 0)
 		return -1;
 
 	mloop__object_list_add(async);
@@ -1695,7 +3566,7 @@ int mloop_async_start(struct mloop_async* async)
 	return 0;
 
 failure:
-	prioq__unlock(&mloop__job_queue);
+	prioq__unlock(&mloop->core->async_jobs);
 	rc = mloop__change_state(async, MLOOP_STARTING, MLOOP_STOPPED);
 	assert(rc == 0);
 	return -1;
@@ -1707,6 +3578,20 @@ void mloop_async_cancel(struct mloop_async* self)
 	self->is_cancelled = 1;
 }
 
+/* The workers only know priority bands, so with EDF, work that has a deadline
+ * is queued in the first band and ordered by deadline on its way back.
+ */
+static unsigned long mloop__work_band(const struct mloop_work* work)
+{
+	const struct prioq* queue = &work->parent_core->async_jobs;
+
+	if (work->deadline
+	 && __atomic_load_n(&queue->mode, __ATOMIC_RELAXED) == PRIOQ_EDF)
+		return 0;
+
+	return work->priority;
+}
+
 EXPORT
 int mloop_work_start(struct mloop_work* work)
 {
@@ -1720,23 +3605,26 @@ int mloop_work_start(struct mloop_work* work)
 	work->parent_core = mloop->core;
 	work->is_cancelled = 0;
 
-	/* We lock the work queue here so that we can keep it blocked until the
-	 * object has been added to the list of active objects.
-	 *
-	 * We could also reverse the order and add "mloop__object_list_remove()"
-	 * to the failure case for prioq_insert()
+	/* The job is added to the list of active objects first because a worker
+	 * may remove it as soon as it has been queued.
 	 */
-	prioq__lock(&mloop__job_queue);
-	if (prioq_insert(&mloop__job_queue, work->priority, work) < 0)
+	mloop__object_list_add(work);
+
+	work->queued_at = mloop__monotonic_ns();
+
+	if (workq_push(&mloop__job_queue, mloop__work_band(work), work) < 0)
 		goto failure;
 
-	mloop__object_list_add(work);
-	prioq__unlock(&mloop__job_queue);
+	/* More jobs waiting than there are workers to take them */
+	if (mloop__is_elastic()
+	 && workq_get_length(&mloop__job_queue)
+	    > (size_t)__atomic_load_n(&mloop__nthreads, __ATOMIC_RELAXED))
+		mloop__grow_workers();
 
 	return 0;
 
 failure:
-	prioq__unlock(&mloop__job_queue);
+	mloop__object_list_remove(work);
 	rc = mloop__change_state(work, MLOOP_STARTING, MLOOP_STOPPED);
 	assert(rc == 0);
 	return -1;
@@ -1883,6 +3771,12 @@ void mloop_async_set_priority(struct mloop_async* self, unsigned long priority)
 	self->priority = priority;
 }
 
+EXPORT
+void mloop_async_set_deadline(struct mloop_async* self, uint64_t deadline)
+{
+	self->deadline = deadline;
+}
+
 EXPORT
 void mloop_work_set_context(struct mloop_work* self, void* context,
 			    mloop_free_fn free_fn)
@@ -1915,6 +3809,12 @@ void mloop_work_set_priority(struct mloop_work* self, unsigned long priority)
 	self->priority = priority;
 }
 
+EXPORT
+void mloop_work_set_deadline(struct mloop_work* self, uint64_t deadline)
+{
+	self->deadline = deadline;
+}
+
 EXPORT
 void mloop_signal_set_callback(struct mloop_signal* self, mloop_signal_fn fn)
 {
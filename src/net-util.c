@@ -113,6 +113,12 @@ int net_reuse_addr(int fd)
 	return setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 }
 
+int net_reuse_port(int fd)
+{
+	int one = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+}
+
 int net_dont_delay(int fd)
 {
 	int one = 1;
@@ -14,6 +14,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <time.h>
 #include <poll.h>
@@ -31,17 +32,31 @@
 #include "sock.h"
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+
+static void co_net__nmt_frame(struct can_frame* cf, int cs, int nodeid)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = 0;
+	cf->can_dlc = 2;
+	nmt_set_cs(cf, cs);
+	nmt_set_nodeid(cf, nodeid);
+}
 
 int co_net_send_nmt(const struct sock* sock, int cs, int nodeid)
 {
-	struct can_frame cf = { 0 };
-	cf.can_id = 0;
-	cf.can_dlc = 2;
-	nmt_set_cs(&cf, cs);
-	nmt_set_nodeid(&cf, nodeid);
+	struct can_frame cf;
+	co_net__nmt_frame(&cf, cs, nodeid);
 	return sock_send(sock, &cf, 0);
 }
 
+int co_net_stage_nmt(const struct sock* sock, int cs, int nodeid)
+{
+	struct can_frame cf;
+	co_net__nmt_frame(&cf, cs, nodeid);
+	return sock_stage(sock, &cf);
+}
+
 int co_net__request_heartbeat(const struct sock* sock, int nodeid)
 {
 	struct can_frame cf = { 0 };
@@ -62,16 +77,58 @@ int co_net__request_sdo(const struct sock* sock, int nodeid)
 	return sock_send(sock, &cf, 0);
 }
 
-int co_net__wait_for_bootup(const struct sock* sock, char* nodes_seen,
-			    int start, int end, int timeout)
+void co_net_wait_init(struct co_net_wait* wait, int timeout)
+{
+	memset(wait, 0, sizeof(*wait));
+	wait->timeout = timeout;
+	wait->timeout_min = timeout;
+}
+
+static int co_net__is_expected_complete(const struct co_net_wait* wait,
+					const char* nodes_seen, int start,
+					int end)
+{
+	if (!wait->nodes_expected)
+		return 0;
+
+	for (int i = start; i <= end; ++i)
+		if (wait->nodes_expected[i] && !nodes_seen[i])
+			return 0;
+
+	return 1;
+}
+
+/* The quiet period is twice the longest gap between responses so far, within
+ * the limits, and the time to the first response counts as a gap.
+ */
+static int co_net__quiet_period(const struct co_net_wait* wait)
+{
+	if (wait->n_seen == 0)
+		return wait->timeout;
+
+	int timeout_min = MIN(wait->timeout_min, wait->timeout);
+	return MIN(wait->timeout, MAX(timeout_min, 2 * wait->gap_max));
+}
+
+static int co_net__wait_for(const struct sock* sock, char* nodes_seen,
+			    int start, int end, enum canopen_object object,
+			    struct co_net_wait* wait)
 {
 	struct can_frame cf;
 	struct canopen_msg msg;
 
-	int t = gettime_ms(CLOCK_MONOTONIC);
-	int t_end = t + timeout;
+	int t_start = gettime_ms(CLOCK_MONOTONIC);
+	int t = t_start;
+	int t_last = t_start;
+	int t_end = t + wait->timeout;
+
+	wait->n_seen = 0;
+	wait->gap_max = 0;
+	wait->is_complete = co_net__is_expected_complete(wait, nodes_seen,
+							 start, end);
 
-	while (sock_timed_recv(sock, &cf, MAX(0, t_end - t)) > 0) {
+	while (!wait->is_complete
+	    && sock_timed_recv(sock, &cf, MAX(0, t_end - t)) > 0) {
 		t = gettime_ms(CLOCK_MONOTONIC);
 
 		canopen_get_object_type(&msg, &cf);
@@ -79,41 +136,73 @@ int co_net__wait_for_bootup(const struct sock* sock, char* nodes_seen,
 		if (!(start <= msg.id && msg.id <= end))
 			continue;
 
-		if (msg.object != CANOPEN_HEARTBEAT)
+		if (msg.object != object || nodes_seen[msg.id])
 			continue;
 
 		nodes_seen[msg.id] = 1;
-		t_end = t + timeout;
+		++wait->n_seen;
+
+		if (wait->seen_time)
+			wait->seen_time[msg.id] = gettime_us(CLOCK_MONOTONIC);
+
+		wait->gap_max = MAX(wait->gap_max, t - t_last);
+		t_last = t;
+		t_end = t + co_net__quiet_period(wait);
+
+		wait->is_complete = co_net__is_expected_complete(wait,
+								 nodes_seen,
+								 start, end);
 	}
 
+	wait->duration = gettime_ms(CLOCK_MONOTONIC) - t_start;
 	return 0;
 }
 
+int co_net__wait_for_bootup(const struct sock* sock, char* nodes_seen,
+			    int start, int end, int timeout)
+{
+	struct co_net_wait wait;
+	co_net_wait_init(&wait, timeout);
+	return co_net__wait_for(sock, nodes_seen, start, end,
+				CANOPEN_HEARTBEAT, &wait);
+}
+
 int co_net__wait_for_sdo(const struct sock* sock, char* nodes_seen,
 			 int start, int end, int timeout)
 {
-	struct can_frame cf;
-	struct canopen_msg msg;
-
-	int t = gettime_ms(CLOCK_MONOTONIC);
-	int t_end = t + timeout;
-
-	while (sock_timed_recv(sock, &cf, MAX(0, t_end - t)) > 0) {
-		t = gettime_ms(CLOCK_MONOTONIC);
+	struct co_net_wait wait;
+	co_net_wait_init(&wait, timeout);
+	return co_net__wait_for(sock, nodes_seen, start, end, CANOPEN_TSDO,
+				&wait);
+}
 
-		canopen_get_object_type(&msg, &cf);
+int co_net_reset_wait(const struct sock* sock, char* nodes_seen,
+		      struct co_net_wait* wait)
+{
+	co_net_send_nmt(sock, NMT_CS_RESET_COMMUNICATION, 0);
+	return co_net__wait_for(sock, nodes_seen, 0, 127, CANOPEN_HEARTBEAT,
+				wait);
+}
 
-		if (!(start <= msg.id && msg.id <= end))
-			continue;
+int co_net_reset_range_wait(const struct sock* sock, char* nodes_seen,
+			    int start, int end, struct co_net_wait* wait)
+{
+	for (int i = start; i <= end; ++i)
+		co_net_send_nmt(sock, NMT_CS_RESET_COMMUNICATION, i);
 
-		if (msg.object != CANOPEN_TSDO)
-			continue;
+	return co_net__wait_for(sock, nodes_seen, start, end,
+				CANOPEN_HEARTBEAT, wait);
+}
 
-		nodes_seen[msg.id] = 1;
-		t_end = t + timeout;
-	}
+int co_net_probe_wait(const struct sock* sock, char* nodes_seen, int start,
+		      int end, struct co_net_wait* wait)
+{
+	for (int i = start; i <= end; ++i)
+		if (!nodes_seen[i])
+			co_net__request_heartbeat(sock, i);
 
-	return 0;
+	return co_net__wait_for(sock, nodes_seen, start, end,
+				CANOPEN_HEARTBEAT, wait);
 }
 
 int co_net_reset(const struct sock* sock, char* nodes_seen, int timeout)
@@ -0,0 +1,159 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "node-identity.h"
+
+struct node_identity__header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t record_size;
+	uint32_t n_nodes;
+	uint32_t profile_size;
+	uint32_t n_profiles;
+};
+
+#define NODE_IDENTITY__BYTE_ORDER 0x01020304
+
+static void node_identity__make_header(struct node_identity__header* header)
+{
+	memset(header, 0, sizeof(*header));
+	strncpy(header->magic, NODE_IDENTITY_MAGIC, sizeof(header->magic));
+	header->version = NODE_IDENTITY_VERSION;
+	header->byte_order = NODE_IDENTITY__BYTE_ORDER;
+	header->record_size = sizeof(struct node_identity);
+	header->n_nodes = CANOPEN_NODEID_MAX + 1;
+	header->profile_size = sizeof(struct node_sdo_profile);
+	header->n_profiles = NODE_IDENTITY_N_PROFILES;
+}
+
+void node_identity_make_path(char* dst, size_t size, const char* dir,
+			     const char* iface)
+{
+	snprintf(dst, size, "%s/%s.nodes", dir, iface);
+}
+
+int node_identity_cache_load(struct node_identity_cache* self,
+			     const char* path)
+{
+	struct node_identity__header expected, header;
+
+	memset(self, 0, sizeof(*self));
+
+	FILE* file = fopen(path, "re");
+	if (!file)
+		return -1;
+
+	node_identity__make_header(&expected);
+
+	if (fread(&header, sizeof(header), 1, file) != 1
+	 || memcmp(&header, &expected, sizeof(header)) != 0
+	 || fread(self->node, sizeof(self->node), 1, file) != 1
+	 || fread(self->profile, sizeof(self->profile), 1, file) != 1)
+		goto failure;
+
+	fclose(file);
+
+	/* The strings are not trusted to be terminated */
+	for (int i = 0; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct node_identity* node = &self->node[i];
+		node->name[sizeof(node->name) - 1] = '\0';
+		node->hw_version[sizeof(node->hw_version) - 1] = '\0';
+		node->sw_version[sizeof(node->sw_version) - 1] = '\0';
+	}
+
+	return 0;
+
+failure:
+	fclose(file);
+	memset(self, 0, sizeof(*self));
+	errno = EINVAL;
+	return -1;
+}
+
+int node_identity_cache_save(struct node_identity_cache* self,
+			     const char* path)
+{
+	struct node_identity__header header;
+	char tmp_path[256];
+
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int)getpid());
+
+	FILE* file = fopen(tmp_path, "we");
+	if (!file)
+		return -1;
+
+	node_identity__make_header(&header);
+
+	int failed = fwrite(&header, sizeof(header), 1, file) != 1
+		  || fwrite(self->node, sizeof(self->node), 1, file) != 1
+		  || fwrite(self->profile, sizeof(self->profile), 1, file) != 1;
+
+	failed |= fclose(file) != 0;
+
+	if (failed || rename(tmp_path, path) < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	self->is_dirty = 0;
+	return 0;
+}
+
+struct node_sdo_profile*
+node_identity_find_profile(struct node_identity_cache* self,
+			   uint32_t vendor_id, uint32_t product_code)
+{
+	if (vendor_id == 0)
+		return NULL;
+
+	for (int i = 0; i < NODE_IDENTITY_N_PROFILES; ++i) {
+		struct node_sdo_profile* profile = &self->profile[i];
+		if (profile->vendor_id == vendor_id
+		 && profile->product_code == product_code)
+			return profile;
+	}
+
+	return NULL;
+}
+
+struct node_sdo_profile*
+node_identity_get_profile(struct node_identity_cache* self,
+			  uint32_t vendor_id, uint32_t product_code)
+{
+	struct node_sdo_profile* profile =
+		node_identity_find_profile(self, vendor_id, product_code);
+	if (profile || vendor_id == 0)
+		return profile;
+
+	for (int i = 0; i < NODE_IDENTITY_N_PROFILES; ++i) {
+		profile = &self->profile[i];
+		if (profile->vendor_id != 0)
+			continue;
+
+		memset(profile, 0, sizeof(*profile));
+		profile->vendor_id = vendor_id;
+		profile->product_code = product_code;
+		return profile;
+	}
+
+	return NULL;
+}
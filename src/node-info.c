@@ -0,0 +1,76 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <sched.h>
+
+#include "node-info.h"
+
+#define node_info__load(ptr, order) __atomic_load_n(ptr, __ATOMIC_ ## order)
+#define node_info__store(ptr, value, order) \
+	__atomic_store_n(ptr, value, __ATOMIC_ ## order)
+
+/* Readers spin this many times before giving up the processor to a
+ * publisher that may have been preempted
+ */
+#define NODE_INFO__SPIN 64
+
+static uint64_t node_info__begin_write(struct node_info_slot* self)
+{
+	for (int i = 0;; ++i) {
+		uint64_t sequence = node_info__load(&self->sequence, RELAXED);
+
+		if (!(sequence & 1)
+		 && __atomic_compare_exchange_n(&self->sequence, &sequence,
+						sequence + 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return sequence;
+
+		if (i >= NODE_INFO__SPIN)
+			sched_yield();
+	}
+}
+
+void node_info_publish(struct node_info_slot* self,
+		       const struct node_info* info)
+{
+	uint64_t sequence = node_info__begin_write(self);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(&self->info, info, sizeof(self->info));
+
+	node_info__store(&self->sequence, sequence + 2, RELEASE);
+}
+
+uint64_t node_info_read(const struct node_info_slot* self,
+			struct node_info* dst)
+{
+	for (int i = 0;; ++i) {
+		uint64_t sequence = node_info__load(&self->sequence, ACQUIRE);
+
+		if (!(sequence & 1)) {
+			memcpy(dst, &self->info, sizeof(*dst));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+			if (node_info__load(&self->sequence, RELAXED)
+			    == sequence)
+				return sequence;
+		}
+
+		if (i >= NODE_INFO__SPIN)
+			sched_yield();
+	}
+}
@@ -0,0 +1,307 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <linux/can.h>
+
+#include "co_atomic.h"
+#include "node-stats.h"
+
+#define node_stats__inc(ptr) co_atomic_add_relaxed(ptr, 1)
+
+static inline uint64_t node_stats__load(const uint64_t* ptr)
+{
+	return co_atomic_load_relaxed(ptr);
+}
+
+static size_t node_stats__bucket(uint64_t us)
+{
+	size_t i = 0;
+
+	while (i < NODE_STATS_N_BUCKETS - 1 && us >= (1ULL << i))
+		++i;
+
+	return i;
+}
+
+void node_stats_histogram_add(struct node_stats_histogram* self, uint64_t us)
+{
+	node_stats__inc(&self->count);
+	co_atomic_add_relaxed(&self->total_us, us);
+	node_stats__inc(&self->buckets[node_stats__bucket(us)]);
+
+	uint64_t max = node_stats__load(&self->max_us);
+	while (us > max && !co_atomic_cas(&self->max_us, max, us))
+		max = node_stats__load(&self->max_us);
+}
+
+static void node_stats__count_heartbeat(struct node_stats* self,
+					uint64_t timestamp)
+{
+	uint64_t last = self->last_heartbeat;
+	self->last_heartbeat = timestamp;
+
+	node_stats__inc(&self->n_heartbeats);
+
+	if (last == 0 || timestamp < last)
+		return;
+
+	uint64_t interval = timestamp - last;
+	uint64_t last_interval = self->last_heartbeat_interval;
+	self->last_heartbeat_interval = interval;
+
+	if (last_interval == 0)
+		return;
+
+	node_stats_histogram_add(&self->heartbeat_jitter,
+				 interval > last_interval
+				 ? interval - last_interval
+				 : last_interval - interval);
+}
+
+/* Only the default COB-IDs of each node are counted */
+void node_stats_count_frame(struct node_stats* stats,
+			    const struct can_frame* cf, uint64_t timestamp)
+{
+	if (cf->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return;
+
+	int nodeid = cf->can_id & 0x7f;
+	if (nodeid < CANOPEN_NODEID_MIN)
+		return;
+
+	struct node_stats* self = &stats[nodeid];
+
+	switch (cf->can_id & 0x780) {
+	case R_EMCY:
+		node_stats__inc(&self->n_emcys);
+		break;
+	case R_TPDO1:
+	case R_TPDO2:
+	case R_TPDO3:
+	case R_TPDO4:
+		node_stats__inc(&self->n_pdos);
+		break;
+	case R_TSDO:
+		node_stats__inc(&self->n_sdos);
+		break;
+	case R_HEARTBEAT:
+		node_stats__count_heartbeat(self, timestamp);
+		break;
+	default:
+		return;
+	}
+
+	node_stats__inc(&self->n_frames);
+}
+
+void node_stats_count_sdo(struct node_stats* self, enum sdo_req_status status,
+			  enum sdo_abort_code abort_code, uint64_t latency)
+{
+	node_stats__inc(&self->n_sdo_transfers);
+
+	if (status == SDO_REQ_LOCAL_ABORT && abort_code == SDO_ABORT_TIMEOUT)
+		node_stats__inc(&self->n_sdo_timeouts);
+	else if (status != SDO_REQ_OK)
+		node_stats__inc(&self->n_sdo_aborts);
+
+	if (status == SDO_REQ_OK)
+		node_stats_histogram_add(&self->sdo_latency, latency);
+}
+
+uint64_t node_stats_count_driver_call(struct node_stats* self, uint64_t us,
+				      uint64_t budget)
+{
+	node_stats_histogram_add(&self->driver_time, us);
+
+	if (budget == 0 || us <= budget)
+		return 0;
+
+	return node_stats__inc(&self->n_driver_overruns);
+}
+
+uint64_t node_stats_count_driver_drop(struct node_stats* self)
+{
+	return node_stats__inc(&self->n_driver_drops);
+}
+
+static void node_stats__read_histogram(struct node_stats_histogram* dst,
+				       const struct node_stats_histogram* src)
+{
+	dst->count = node_stats__load(&src->count);
+	dst->total_us = node_stats__load(&src->total_us);
+	dst->max_us = node_stats__load(&src->max_us);
+
+	for (size_t i = 0; i < NODE_STATS_N_BUCKETS; ++i)
+		dst->buckets[i] = node_stats__load(&src->buckets[i]);
+}
+
+void node_stats_read(struct node_stats* dst, const struct node_stats* src)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	dst->n_frames = node_stats__load(&src->n_frames);
+	dst->n_pdos = node_stats__load(&src->n_pdos);
+	dst->n_sdos = node_stats__load(&src->n_sdos);
+	dst->n_emcys = node_stats__load(&src->n_emcys);
+	dst->n_heartbeats = node_stats__load(&src->n_heartbeats);
+	dst->n_sdo_transfers = node_stats__load(&src->n_sdo_transfers);
+	dst->n_sdo_aborts = node_stats__load(&src->n_sdo_aborts);
+	dst->n_sdo_timeouts = node_stats__load(&src->n_sdo_timeouts);
+	dst->n_driver_overruns = node_stats__load(&src->n_driver_overruns);
+	dst->n_driver_drops = node_stats__load(&src->n_driver_drops);
+
+	node_stats__read_histogram(&dst->sdo_latency, &src->sdo_latency);
+	node_stats__read_histogram(&dst->heartbeat_jitter,
+				   &src->heartbeat_jitter);
+	node_stats__read_histogram(&dst->driver_time, &src->driver_time);
+}
+
+static void node_stats__histogram_to_json(FILE* output,
+					  const struct node_stats_histogram* h)
+{
+	fprintf(output, "{\"count\":%llu,\"total_us\":%llu,\"max_us\":%llu,\"buckets\":[",
+		(unsigned long long)h->count,
+		(unsigned long long)h->total_us,
+		(unsigned long long)h->max_us);
+
+	for (size_t i = 0; i < NODE_STATS_N_BUCKETS; ++i)
+		fprintf(output, "%s%llu", i > 0 ? "," : "",
+			(unsigned long long)h->buckets[i]);
+
+	fprintf(output, "]}");
+}
+
+void node_stats_write_json(FILE* output, const struct node_stats* stats)
+{
+	const char* separator = "";
+
+	fprintf(output, "{");
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct node_stats s;
+		node_stats_read(&s, &stats[i]);
+
+		if (node_stats_is_empty(&s))
+			continue;
+
+		fprintf(output, "%s\"%d\":{\"frames\":%llu,\"pdos\":%llu,\"sdos\":%llu,\"emcys\":%llu,\"heartbeats\":%llu,\"sdo_transfers\":%llu,\"sdo_aborts\":%llu,\"sdo_timeouts\":%llu,\"driver_overruns\":%llu,\"driver_drops\":%llu,\"sdo_latency\":",
+			separator, i,
+			(unsigned long long)s.n_frames,
+			(unsigned long long)s.n_pdos,
+			(unsigned long long)s.n_sdos,
+			(unsigned long long)s.n_emcys,
+			(unsigned long long)s.n_heartbeats,
+			(unsigned long long)s.n_sdo_transfers,
+			(unsigned long long)s.n_sdo_aborts,
+			(unsigned long long)s.n_sdo_timeouts,
+			(unsigned long long)s.n_driver_overruns,
+			(unsigned long long)s.n_driver_drops);
+
+		node_stats__histogram_to_json(output, &s.sdo_latency);
+		fprintf(output, ",\"heartbeat_jitter\":");
+		node_stats__histogram_to_json(output, &s.heartbeat_jitter);
+		fprintf(output, ",\"driver_time\":");
+		node_stats__histogram_to_json(output, &s.driver_time);
+		fprintf(output, "}");
+
+		separator = ",";
+	}
+
+	fprintf(output, "}\r\n");
+}
+
+#define NODE_STATS__COUNTERS \
+	X(n_frames, frames, "Frames received from the node") \
+	X(n_pdos, pdos, "TPDOs received from the node") \
+	X(n_sdos, sdo_responses, "SDO responses received from the node") \
+	X(n_emcys, emcys, "EMCYs received from the node") \
+	X(n_heartbeats, heartbeats, "Heartbeats received from the node") \
+	X(n_sdo_transfers, sdo_transfers, "SDO transfers that have finished") \
+	X(n_sdo_aborts, sdo_aborts, "SDO transfers that were aborted") \
+	X(n_sdo_timeouts, sdo_timeouts, "SDO transfers that timed out") \
+	X(n_driver_overruns, driver_overruns, "Driver callbacks that took longer than their budget") \
+	X(n_driver_drops, driver_drops, "Frames that were not passed to the driver for want of room")
+
+static void node_stats__histogram_to_prometheus(FILE* output,
+						const char* name,
+						const char* iface, int nodeid,
+						const struct node_stats_histogram* h)
+{
+	uint64_t n = 0;
+
+	/* Prometheus buckets are cumulative and in seconds */
+	for (size_t i = 0; i < NODE_STATS_N_BUCKETS - 1; ++i) {
+		n += h->buckets[i];
+		fprintf(output, "canopen_node_%s_seconds_bucket{iface=\"%s\",node=\"%d\",le=\"%g\"} %llu\n",
+			name, iface, nodeid, (double)(1ULL << i) / 1e6,
+			(unsigned long long)n);
+	}
+
+	fprintf(output, "canopen_node_%s_seconds_bucket{iface=\"%s\",node=\"%d\",le=\"+Inf\"} %llu\n",
+		name, iface, nodeid, (unsigned long long)h->count);
+	fprintf(output, "canopen_node_%s_seconds_sum{iface=\"%s\",node=\"%d\"} %g\n",
+		name, iface, nodeid, (double)h->total_us / 1e6);
+	fprintf(output, "canopen_node_%s_seconds_count{iface=\"%s\",node=\"%d\"} %llu\n",
+		name, iface, nodeid, (unsigned long long)h->count);
+}
+
+void node_stats_write_prometheus(FILE* output, const char* iface,
+				 const struct node_stats* stats)
+{
+	struct node_stats s[CANOPEN_NODEID_MAX + 1];
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		node_stats_read(&s[i], &stats[i]);
+
+#define X(field, name, help) \
+	fprintf(output, "# HELP canopen_node_" #name "_total " help "\n"); \
+	fprintf(output, "# TYPE canopen_node_" #name "_total counter\n"); \
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) \
+		if (!node_stats_is_empty(&s[i])) \
+			fprintf(output, "canopen_node_" #name "_total{iface=\"%s\",node=\"%d\"} %llu\n", \
+				iface, i, (unsigned long long)s[i].field);
+	NODE_STATS__COUNTERS
+#undef X
+
+	fprintf(output, "# HELP canopen_node_sdo_latency_seconds Time from the start of an SDO transfer until it was done\n");
+	fprintf(output, "# TYPE canopen_node_sdo_latency_seconds histogram\n");
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		if (!node_stats_is_empty(&s[i]))
+			node_stats__histogram_to_prometheus(output,
+							    "sdo_latency",
+							    iface, i,
+							    &s[i].sdo_latency);
+
+	fprintf(output, "# HELP canopen_node_heartbeat_jitter_seconds Change from one heartbeat interval to the next\n");
+	fprintf(output, "# TYPE canopen_node_heartbeat_jitter_seconds histogram\n");
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		if (!node_stats_is_empty(&s[i]))
+			node_stats__histogram_to_prometheus(output,
+							    "heartbeat_jitter",
+							    iface, i,
+							    &s[i].heartbeat_jitter);
+
+	fprintf(output, "# HELP canopen_node_driver_time_seconds Time taken by the driver to handle a frame\n");
+	fprintf(output, "# TYPE canopen_node_driver_time_seconds histogram\n");
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		if (!node_stats_is_empty(&s[i]))
+			node_stats__histogram_to_prometheus(output,
+							    "driver_time",
+							    iface, i,
+							    &s[i].driver_time);
+}
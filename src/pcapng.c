@@ -0,0 +1,178 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "pcapng.h"
+#include "trace-buffer.h"
+#include "socketcan.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+#define PCAPNG_OPT_END 0
+#define PCAPNG_OPT_IF_NAME 2
+#define PCAPNG_OPT_IF_TSRESOL 9
+
+/* The block type, both lengths, the interface, the time and both sizes */
+#define PCAPNG_EPB_OVERHEAD 32
+#define PCAPNG_EPB_MAX_SIZE (PCAPNG_EPB_OVERHEAD + CANFD_MTU)
+
+/* The SocketCAN pseudo-header has the CAN id in network byte order */
+struct pcapng_can_frame {
+	uint32_t can_id;
+	uint8_t len;
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint8_t data[CANFD_MAX_DLEN];
+};
+
+static inline size_t pcapng__pad(size_t size)
+{
+	return (size + 3) & ~(size_t)3;
+}
+
+static inline uint8_t* pcapng__put32(uint8_t* dst, uint32_t value)
+{
+	memcpy(dst, &value, sizeof(value));
+	return dst + sizeof(value);
+}
+
+static inline uint8_t* pcapng__put16(uint8_t* dst, uint16_t value)
+{
+	memcpy(dst, &value, sizeof(value));
+	return dst + sizeof(value);
+}
+
+static uint8_t* pcapng__put_option(uint8_t* dst, uint16_t code,
+				   const void* value, size_t size)
+{
+	dst = pcapng__put16(dst, code);
+	dst = pcapng__put16(dst, size);
+
+	memcpy(dst, value, size);
+	memset(dst + size, 0, pcapng__pad(size) - size);
+
+	return dst + pcapng__pad(size);
+}
+
+int pcapng_write_header(FILE* stream, const char* iface)
+{
+	uint8_t shb[28];
+	uint8_t* p = shb;
+
+	p = pcapng__put32(p, PCAPNG_SHB);
+	p = pcapng__put32(p, sizeof(shb));
+	p = pcapng__put32(p, PCAPNG_BYTE_ORDER_MAGIC);
+	p = pcapng__put16(p, 1);
+	p = pcapng__put16(p, 0);
+
+	/* The length of the section is not known */
+	p = pcapng__put32(p, UINT32_MAX);
+	p = pcapng__put32(p, UINT32_MAX);
+	p = pcapng__put32(p, sizeof(shb));
+
+	/* The name is cut short at the size of an interface name */
+	uint8_t idb[16 + 4 + IFNAMSIZ + 8 + 4 + 4];
+	p = idb + 8;
+
+	p = pcapng__put16(p, PCAPNG_LINKTYPE_CAN_SOCKETCAN);
+	p = pcapng__put16(p, 0);
+	p = pcapng__put32(p, CANFD_MTU);
+
+	if (iface)
+		p = pcapng__put_option(p, PCAPNG_OPT_IF_NAME, iface,
+				       strnlen(iface, IFNAMSIZ));
+
+	uint8_t tsresol = PCAPNG_TSRESOL_US;
+	p = pcapng__put_option(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, 1);
+	p = pcapng__put16(p, PCAPNG_OPT_END);
+	p = pcapng__put16(p, 0);
+
+	uint32_t idb_size = p - idb + 4;
+	pcapng__put32(idb, PCAPNG_IDB);
+	pcapng__put32(idb + 4, idb_size);
+	pcapng__put32(p, idb_size);
+
+	if (fwrite(shb, sizeof(shb), 1, stream) != 1
+	 || fwrite(idb, idb_size, 1, stream) != 1)
+		return -1;
+
+	return 0;
+}
+
+/* Classic frames take up CAN_MTU and FD frames CANFD_MTU, as they do when
+ * they are captured from a CAN socket.
+ */
+static size_t pcapng__put_frame(uint8_t* dst, const struct tb_frame* frame)
+{
+	int is_fd = frame->cfd.flags & CANFD_FDF;
+	size_t mtu = is_fd ? CANFD_MTU : CAN_MTU;
+	size_t max_len = is_fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	size_t len = frame->cfd.len < max_len ? frame->cfd.len : max_len;
+
+	struct pcapng_can_frame cf;
+	memset(&cf, 0, mtu);
+	cf.can_id = htonl(frame->cfd.can_id);
+	cf.len = len;
+	cf.flags = is_fd ? frame->cfd.flags : 0;
+	memcpy(cf.data, frame->cfd.data, len);
+
+	uint32_t size = PCAPNG_EPB_OVERHEAD + mtu;
+	uint8_t* p = dst;
+
+	p = pcapng__put32(p, PCAPNG_EPB);
+	p = pcapng__put32(p, size);
+	p = pcapng__put32(p, 0);
+	p = pcapng__put32(p, frame->timestamp >> 32);
+	p = pcapng__put32(p, frame->timestamp);
+	p = pcapng__put32(p, mtu);
+	p = pcapng__put32(p, mtu);
+
+	memcpy(p, &cf, mtu);
+	p += mtu;
+
+	pcapng__put32(p, size);
+	return size;
+}
+
+size_t pcapng_write_frames(FILE* stream, const struct tb_frame* frames,
+			   size_t n)
+{
+	uint8_t batch[PCAPNG_BATCH_SIZE * PCAPNG_EPB_MAX_SIZE];
+	size_t n_written = 0;
+
+	while (n_written < n) {
+		size_t n_batch = n - n_written < PCAPNG_BATCH_SIZE
+			       ? n - n_written : PCAPNG_BATCH_SIZE;
+		size_t size = 0;
+
+		for (size_t i = 0; i < n_batch; ++i)
+			size += pcapng__put_frame(batch + size,
+						  &frames[n_written + i]);
+
+		if (fwrite(batch, size, 1, stream) != 1)
+			break;
+
+		n_written += n_batch;
+	}
+
+	return n_written;
+}
@@ -0,0 +1,136 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include "canopen/pdo-map.h"
+
+void pdo_map_init(struct pdo_map* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+int pdo_map_add(struct pdo_map* self, uint32_t value, int is_signed)
+{
+	unsigned int bits = value & 0xff;
+
+	if (bits == 0 || bits > 64)
+		return -1;
+
+	if (self->length >= PDO_MAP_MAX_LENGTH)
+		return -1;
+
+	if (self->bits + bits > PDO_MAP_MAX_SIZE * 8)
+		return -1;
+
+	struct pdo_map_entry* entry = &self->entry[self->length];
+	entry->index = value >> 16;
+	entry->subindex = (value >> 8) & 0xff;
+	entry->bits = bits;
+	entry->is_signed = !!is_signed;
+
+	struct pdo_map_step* step = &self->step[self->length];
+	step->offset = self->bits / 8;
+	step->shift = self->bits % 8;
+	step->size = (step->shift + bits + 7) / 8;
+	step->mask = bits == 64 ? UINT64_MAX : (1ULL << bits) - 1;
+	step->sign = is_signed ? 1ULL << (bits - 1) : 0;
+
+	self->bits += bits;
+	self->size = (self->bits + 7) / 8;
+	self->length++;
+
+	return 0;
+}
+
+int pdo_map_find(const struct pdo_map* self, int index, int subindex)
+{
+	for (size_t i = 0; i < self->length; ++i)
+		if (self->entry[i].index == index
+		 && self->entry[i].subindex == subindex)
+			return i;
+
+	return -1;
+}
+
+static inline uint64_t pdo_map__load_le(const uint8_t* src, size_t size)
+{
+	uint64_t value = 0;
+
+	while (size-- > 0)
+		value = value << 8 | src[size];
+
+	return value;
+}
+
+/* A 64 bit value that does not start on a byte boundary touches nine bytes */
+static inline uint64_t pdo_map__extract(const struct pdo_map_step* step,
+					const uint8_t* src)
+{
+	src += step->offset;
+
+	uint64_t value;
+	if (step->size > 8) {
+		value = pdo_map__load_le(src, 8) >> step->shift;
+		value |= (uint64_t)src[8] << (64 - step->shift);
+	} else {
+		value = pdo_map__load_le(src, step->size) >> step->shift;
+	}
+
+	value &= step->mask;
+
+	if (step->sign)
+		value = (value ^ step->sign) - step->sign;
+
+	return value;
+}
+
+static inline void pdo_map__insert(const struct pdo_map_step* step,
+				   uint8_t* dst, uint64_t value)
+{
+	dst += step->offset;
+	value &= step->mask;
+
+	uint64_t shifted = value << step->shift;
+	size_t n = step->size > 8 ? 8 : step->size;
+
+	for (size_t i = 0; i < n; ++i)
+		dst[i] |= shifted >> (i * 8);
+
+	if (step->size > 8)
+		dst[8] |= value >> (64 - step->shift);
+}
+
+int pdo_map_unpack(const struct pdo_map* self, uint64_t* values,
+		   const void* data, size_t size)
+{
+	if (size < self->size)
+		return -1;
+
+	for (size_t i = 0; i < self->length; ++i)
+		values[i] = pdo_map__extract(&self->step[i], data);
+
+	return 0;
+}
+
+size_t pdo_map_pack(const struct pdo_map* self, void* data,
+		    const uint64_t* values)
+{
+	memset(data, 0, self->size);
+
+	for (size_t i = 0; i < self->length; ++i)
+		pdo_map__insert(&self->step[i], data, values[i]);
+
+	return self->size;
+}
@@ -21,12 +21,40 @@
 #include "prioq.h"
 #include "thread-utils.h"
 
+/* The root is placed PRIOQ_ARITY - 1 elements into the allocation, so that
+ * the children of every node start on an aligned address.
+ */
+static int prioq__alloc(struct prioq* self, size_t size)
+{
+	size_t length = (size + PRIOQ_ARITY - 1) * sizeof(*self->head);
+	length = (length + PRIOQ_ALIGNMENT - 1) & ~(PRIOQ_ALIGNMENT - 1);
+
+	struct prioq_elem* base = aligned_alloc(PRIOQ_ALIGNMENT, length);
+	if (!base)
+		return -1;
+
+	struct prioq_elem* head = base + PRIOQ_ARITY - 1;
+	if (self->head)
+		memcpy(head, self->head, self->index * sizeof(*head));
+
+	free(self->base_);
+	self->base_ = base;
+	self->head = head;
+	self->size = size;
+	return 0;
+}
+
 int prioq_init(struct prioq* self, size_t size)
 {
 	self->sequence = 0;
-	self->size = size;
+	self->mode = PRIOQ_PRIORITY;
+	self->size = 0;
 	self->index = 0;
-	self->head = calloc(size, sizeof(*self->head));
+	self->head = NULL;
+	self->base_ = NULL;
+
+	if (prioq__alloc(self, size > 0 ? size : 1) < 0)
+		return -1;
 
 	pthread_mutexattr_t attr;
 	pthread_mutexattr_init(&attr);
@@ -36,14 +64,14 @@ int prioq_init(struct prioq* self, size_t size)
 
 	pthread_cond_init(&self->suspend_cond, NULL);
 
-	return self->head ? 0 : -1;
+	return 0;
 }
 
 void prioq_destroy(struct prioq* self)
 {
 	pthread_mutex_destroy(&self->mutex);
 	pthread_cond_destroy(&self->suspend_cond);
-	free(self->head);
+	free(self->base_);
 }
 
 void prioq_clear(struct prioq* self)
@@ -67,6 +95,7 @@ int prioq_copy(struct prioq* dst, struct prioq* src)
 
 	dst->index = src->index;
 	dst->sequence = src->sequence;
+	dst->mode = src->mode;
 
 	memcpy(dst->head, src->head, dst->index * sizeof(*dst->head));
 
@@ -110,23 +139,38 @@ int prioq_grow(struct prioq* self, size_t size)
 		goto done;
 	}
 
-	struct prioq_elem* new_head = realloc(self->head,
-					      size * sizeof(*self->head));
-	if (!new_head) {
+	if (prioq__alloc(self, size) < 0) {
 		rc = -1;
 		goto done;
 	}
 
-	self->size = size;
-	self->head = new_head;
-
 	rc = 1;
 done:
 	prioq__unlock(self);
 	return rc;
 }
 
+void prioq_set_mode(struct prioq* self, enum prioq_mode mode)
+{
+	prioq__lock(self);
+
+	if (self->mode != mode) {
+		self->mode = mode;
+
+		for (unsigned long i = self->index / PRIOQ_ARITY + 1; i-- > 0;)
+			prioq__sink_down(self, i);
+	}
+
+	prioq__unlock(self);
+}
+
 int prioq_insert(struct prioq* self, unsigned long priority, void* data)
+{
+	return prioq_insert_deadline(self, priority, 0, data);
+}
+
+int prioq_insert_deadline(struct prioq* self, unsigned long priority,
+			  uint64_t deadline, void* data)
 {
 	int rc = -1;
 
@@ -139,6 +183,7 @@ int prioq_insert(struct prioq* self, unsigned long priority, void* data)
 	struct prioq_elem* elem = &self->head[self->index++];
 
 	elem->priority = priority;
+	elem->deadline = deadline;
 	elem->data = data;
 	elem->sequence_ = self->sequence++;
 
@@ -152,23 +197,70 @@ done:
 	return rc;
 }
 
-int prioq_pop(struct prioq* self, struct prioq_elem* elem, int timeout)
+int prioq_insert_many(struct prioq* self, const struct prioq_elem* elems,
+		      size_t n)
 {
+	int rc = -1;
+
 	prioq__lock(self);
 
-	int rc = block_thread_while_empty(&self->suspend_cond, &self->mutex,
-					  timeout, self->index == 0);
-	if (rc < 0)
+	size_t size = self->size;
+	while (size < self->index + n)
+		size *= 2;
+
+	if (prioq_grow(self, size) < 0)
 		goto done;
 
+	for (size_t i = 0; i < n; ++i) {
+		struct prioq_elem* elem = &self->head[self->index++];
+
+		*elem = elems[i];
+		elem->sequence_ = self->sequence++;
+
+		prioq__bubble_up(self, self->index - 1);
+	}
+
+	if (n > 1)
+		pthread_cond_broadcast(&self->suspend_cond);
+	else if (n == 1)
+		pthread_cond_signal(&self->suspend_cond);
+
+	rc = 0;
+done:
+	prioq__unlock(self);
+	return rc;
+}
+
+static inline void prioq__pop_head(struct prioq* self, struct prioq_elem* elem)
+{
 	assert(self->index > 0);
 
 	*elem = self->head[0];
 	self->head[0] = self->head[--self->index];
 
 	prioq__sink_down(self, 0);
+}
 
-	rc = 1;
+int prioq_pop(struct prioq* self, struct prioq_elem* elem, int timeout)
+{
+	return prioq_pop_many(self, elem, 1, timeout);
+}
+
+int prioq_pop_many(struct prioq* self, struct prioq_elem* elems, size_t n,
+		   int timeout)
+{
+	prioq__lock(self);
+
+	int rc = block_thread_while_empty(&self->suspend_cond, &self->mutex,
+					  timeout, self->index == 0);
+	if (rc < 0)
+		goto done;
+
+	size_t i;
+	for (i = 0; i < n && self->index > 0; ++i)
+		prioq__pop_head(self, &elems[i]);
+
+	rc = i;
 done:
 	prioq__unlock(self);
 	return rc;
@@ -203,8 +295,19 @@ int prioq__is_seq_lt(unsigned long a, unsigned long b)
 	return a < b;
 }
 
-static inline int is_lt(struct prioq_elem* a, struct prioq_elem* b)
+static inline int is_lt(const struct prioq* self, const struct prioq_elem* a,
+			const struct prioq_elem* b)
 {
+	if (self->mode == PRIOQ_EDF && a->deadline != b->deadline) {
+		if (!b->deadline)
+			return 1;
+
+		if (!a->deadline)
+			return 0;
+
+		return a->deadline < b->deadline;
+	}
+
 	if (a->priority < b->priority)
 		return 1;
 
@@ -214,48 +317,59 @@ static inline int is_lt(struct prioq_elem* a, struct prioq_elem* b)
 	return prioq__is_seq_lt(a->sequence_, b->sequence_);
 }
 
+/* Both directions move a hole through the heap and only write the element
+ * once it has found its place.
+ */
 void prioq__bubble_up(struct prioq* self, unsigned long index)
 {
-	if (index == 0)
-		return;
+	struct prioq_elem elem = self->head[index];
 
-	struct prioq_elem* elem = &self->head[index];
-	struct prioq_elem* parent = &self->head[prioq__parent(index)];
+	while (index > 0) {
+		unsigned long parent = prioq__parent(index);
+		if (!is_lt(self, &elem, &self->head[parent]))
+			break;
 
-	if (is_lt(elem, parent)) {
-		prioq__swap(elem, parent);
-		prioq__bubble_up(self, prioq__parent(index));
+		self->head[index] = self->head[parent];
+		index = parent;
 	}
+
+	self->head[index] = elem;
 }
 
-unsigned long prioq__get_smaller_child(struct prioq* self, unsigned long index)
+/* Returns 0 if none of the children is less than elem */
+unsigned long prioq__get_smallest_child(struct prioq* self,
+					unsigned long index,
+					const struct prioq_elem* elem)
 {
-	unsigned long left_index = prioq__lchild(index);
-	unsigned long right_index = prioq__rchild(index);
-
-	struct prioq_elem* elem = &self->head[index];
-	struct prioq_elem* left_elem = &self->head[left_index];
-	struct prioq_elem* right_elem = &self->head[right_index];
+	unsigned long first = prioq__first_child(index);
+	if (first >= self->index)
+		return 0;
 
-	if (right_index < self->index && is_lt(right_elem, elem))
-		return is_lt(right_elem, left_elem) ? right_index : left_index;
+	unsigned long end = first + PRIOQ_ARITY;
+	if (end > self->index)
+		end = self->index;
 
-	if (left_index < self->index && is_lt(left_elem, elem))
-		return left_index;
+	unsigned long smallest = first;
+	for (unsigned long i = first + 1; i < end; ++i)
+		if (is_lt(self, &self->head[i], &self->head[smallest]))
+			smallest = i;
 
-	return 0;
+	return is_lt(self, &self->head[smallest], elem) ? smallest : 0;
 }
 
 void prioq__sink_down(struct prioq* self, unsigned long index)
 {
-	unsigned long smaller_child = prioq__get_smaller_child(self, index);
-	if (smaller_child == 0)
-		return;
+	struct prioq_elem elem = self->head[index];
 
-	struct prioq_elem* parent = &self->head[index];
-	struct prioq_elem* child = &self->head[smaller_child];
+	while (1) {
+		unsigned long child = prioq__get_smallest_child(self, index,
+								&elem);
+		if (child == 0)
+			break;
 
-	prioq__swap(parent, child);
-	prioq__sink_down(self, smaller_child);
-}
+		self->head[index] = self->head[child];
+		index = child;
+	}
 
+	self->head[index] = elem;
+}
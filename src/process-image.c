@@ -0,0 +1,239 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "process-image.h"
+
+size_t strlcpy(char* dst, const char* src, size_t size);
+
+#define process_image__load(ptr, order) __atomic_load_n(ptr, __ATOMIC_ ## order)
+#define process_image__store(ptr, value, order) \
+	__atomic_store_n(ptr, value, __ATOMIC_ ## order)
+
+/* A reader that is overtaken this many times in a row gives up */
+#define PROCESS_IMAGE__MAX_TRIES 64
+
+static inline struct process_image_slot*
+process_image__slot(const struct process_image* self, int nodeid, int n)
+{
+	return &self->map->slot[nodeid][n - 1];
+}
+
+static int process_image__is_valid(const struct process_image_map* map,
+				   size_t size)
+{
+	const struct process_image_header* header = &map->header;
+
+	return size == sizeof(*map)
+	    && process_image__load(&header->magic, ACQUIRE) == PROCESS_IMAGE_MAGIC
+	    && header->version == PROCESS_IMAGE_VERSION
+	    && header->slot_size == sizeof(struct process_image_slot)
+	    && header->n_nodes == PROCESS_IMAGE_N_NODES
+	    && header->n_pdos == PROCESS_IMAGE_N_PDOS;
+}
+
+void process_image_make_name(char* dst, size_t size, const char* iface)
+{
+	snprintf(dst, size, "/canopen2.%s.pdos", iface);
+}
+
+int process_image_create(struct process_image* self, const char* name)
+{
+	memset(self, 0, sizeof(*self));
+	strlcpy(self->name, name, sizeof(self->name));
+
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, sizeof(*self->map)) < 0)
+		goto failure;
+
+	void* data = mmap(NULL, sizeof(*self->map), PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	self->map = data;
+
+	struct process_image_header* header = &self->map->header;
+	header->version = PROCESS_IMAGE_VERSION;
+	header->slot_size = sizeof(struct process_image_slot);
+	header->n_nodes = PROCESS_IMAGE_N_NODES;
+	header->n_pdos = PROCESS_IMAGE_N_PDOS;
+
+	/* Readers take the image for valid once they see the magic number */
+	process_image__store(&header->magic, PROCESS_IMAGE_MAGIC, RELEASE);
+
+	self->is_owner = 1;
+	return 0;
+
+failure:
+	close(fd);
+	shm_unlink(name);
+	return -1;
+}
+
+int process_image_open(struct process_image* self, const char* name)
+{
+	memset(self, 0, sizeof(*self));
+	strlcpy(self->name, name, sizeof(self->name));
+
+	int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	if ((size_t)st.st_size != sizeof(*self->map)) {
+		errno = EINVAL;
+		goto failure;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	if (!process_image__is_valid(data, st.st_size)) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	self->map = data;
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+int process_image_adopt(struct process_image* self, const char* name, int fd)
+{
+	memset(self, 0, sizeof(*self));
+	strlcpy(self->name, name, sizeof(self->name));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	if ((size_t)st.st_size != sizeof(*self->map)) {
+		errno = EINVAL;
+		goto failure;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	if (!process_image__is_valid(data, st.st_size)) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	self->map = data;
+	self->is_owner = 1;
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+void process_image_destroy(struct process_image* self)
+{
+	if (!self->map)
+		return;
+
+	if (self->is_owner)
+		shm_unlink(self->name);
+
+	munmap(self->map, sizeof(*self->map));
+	self->map = NULL;
+}
+
+void process_image_write(struct process_image* self, int nodeid, int n,
+			 const void* data, size_t size, uint64_t timestamp)
+{
+	struct process_image_slot* slot = process_image__slot(self, nodeid, n);
+	uint64_t sequence = process_image__load(&slot->sequence, RELAXED);
+
+	if (size > PROCESS_IMAGE_DATA_SIZE)
+		size = PROCESS_IMAGE_DATA_SIZE;
+
+	process_image__store(&slot->sequence, sequence + 1, RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->timestamp = timestamp;
+	slot->size = size;
+	memcpy(slot->data, data, size);
+
+	process_image__store(&slot->sequence, sequence + 2, RELEASE);
+}
+
+int process_image_read(const struct process_image* self, int nodeid, int n,
+		       struct process_image_value* dst)
+{
+	if (!(1 <= nodeid && nodeid < PROCESS_IMAGE_N_NODES)
+	 || !(1 <= n && n <= PROCESS_IMAGE_N_PDOS))
+		return -1;
+
+	const struct process_image_slot* slot =
+		process_image__slot(self, nodeid, n);
+
+	for (int i = 0; i < PROCESS_IMAGE__MAX_TRIES; ++i) {
+		uint64_t sequence = process_image__load(&slot->sequence, ACQUIRE);
+		if (sequence == 0)
+			return -1;
+
+		if (sequence & 1)
+			continue;
+
+		dst->timestamp = slot->timestamp;
+		dst->size = slot->size;
+		if (dst->size > PROCESS_IMAGE_DATA_SIZE)
+			dst->size = PROCESS_IMAGE_DATA_SIZE;
+		memcpy(dst->data, slot->data, dst->size);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (process_image__load(&slot->sequence, RELAXED) == sequence) {
+			dst->sequence = sequence;
+			return 0;
+		}
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
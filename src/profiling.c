@@ -17,7 +17,6 @@
 #include "profiling.h"
 
 int profiling_is_active_ = -1;
-uint64_t profiling_start_time_ = 0;
 
 int profiling_getenv(void)
 {
@@ -0,0 +1,129 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include "reactor.h"
+
+static struct mloop* reactor__loop[REACTOR_MAX];
+static unsigned int reactor__count = 0;
+static unsigned int reactor__pin[REACTOR_N_ROLES];
+static unsigned int reactor__span[REACTOR_N_ROLES];
+
+int reactor_init(unsigned int n)
+{
+	if (n == 0 || n > REACTOR_MAX || reactor__count > 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	reactor__loop[0] = mloop_default();
+	reactor__count = 1;
+
+	for (unsigned int i = 1; i < n; ++i) {
+		struct mloop* mloop = mloop_new();
+		if (!mloop)
+			goto failure;
+
+		reactor__loop[reactor__count++] = mloop;
+	}
+
+	return 0;
+
+failure:
+	reactor_cleanup();
+	return -1;
+}
+
+void reactor_cleanup(void)
+{
+	reactor_stop();
+
+	for (unsigned int i = 1; i < reactor__count; ++i) {
+		mloop_unref(reactor__loop[i]);
+		reactor__loop[i] = NULL;
+	}
+
+	reactor__count = 0;
+
+	for (int i = 0; i < REACTOR_N_ROLES; ++i) {
+		reactor__pin[i] = 0;
+		reactor__span[i] = 0;
+	}
+}
+
+int reactor_run(void)
+{
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n_cpus < 1)
+		n_cpus = 1;
+
+	for (unsigned int i = 1; i < reactor__count; ++i)
+		if (mloop_start_thread(reactor__loop[i], i % n_cpus) < 0)
+			goto failure;
+
+	return 0;
+
+failure:
+	reactor_stop();
+	return -1;
+}
+
+void reactor_stop(void)
+{
+	for (unsigned int i = 1; i < reactor__count; ++i)
+		mloop_stop_thread(reactor__loop[i]);
+}
+
+unsigned int reactor_count(void)
+{
+	return reactor__count > 0 ? reactor__count : 1;
+}
+
+int reactor_pin(enum reactor_role role, unsigned int index)
+{
+	return reactor_pin_range(role, index, 1);
+}
+
+int reactor_pin_range(enum reactor_role role, unsigned int index,
+		      unsigned int n)
+{
+	if (role < 0 || role >= REACTOR_N_ROLES || n == 0
+	 || index >= reactor_count() || n > reactor_count() - index) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	reactor__pin[role] = index;
+	reactor__span[role] = n;
+	return 0;
+}
+
+unsigned int reactor_span(enum reactor_role role)
+{
+	return reactor__span[role] > 0 ? reactor__span[role] : 1;
+}
+
+struct mloop* reactor_get(enum reactor_role role)
+{
+	return reactor_get_nth(role, 0);
+}
+
+struct mloop* reactor_get_nth(enum reactor_role role, unsigned int i)
+{
+	unsigned int index = reactor__pin[role] + i;
+
+	return index > 0 ? reactor__loop[index] : mloop_default();
+}
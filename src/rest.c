@@ -16,27 +16,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <assert.h>
 #include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <mloop.h>
 #include <sys/queue.h>
 
 #include "net-util.h"
 #include "http.h"
 #include "vector.h"
+#include "mem-tag.h"
 #include "rest.h"
-#include "stream.h"
+#include "reactor.h"
+#include "co_atomic.h"
 
 #define REST_BACKLOG 16
+#define REST_IDLE_TIMEOUT 30 /* seconds */
+#define REST_PIPELINE_MAX 65536
+#define REST_HEAD_MAX 16384
+#define REST_READ_SIZE 4096
+
+/* Must be a power of two */
+#define REST_ROUTE_TABLE_SIZE 64
 
 SLIST_HEAD(rest_service_list, rest_service);
 
 static struct rest_service_list rest_service_list_;
 
+/* Services are routed by the hash of the first component of the URL. Each
+ * slot is in the same order as the list, so later services come first.
+ */
+static struct rest_service* rest_route_table_[REST_ROUTE_TABLE_SIZE];
+
+static uint32_t rest__hash_path(const char* path)
+{
+	uint32_t hash = 2166136261u;
+
+	for (const char* c = path; *c; ++c) {
+		hash ^= (uint8_t)tolower((unsigned char)*c);
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static inline struct rest_service** rest__route_slot(const char* path)
+{
+	return &rest_route_table_[rest__hash_path(path)
+				  & (REST_ROUTE_TABLE_SIZE - 1)];
+}
+
 int rest__service_is_match(const struct rest_service* service,
 			   const struct http_req* req)
 {
@@ -47,9 +83,13 @@ int rest__service_is_match(const struct rest_service* service,
 
 struct rest_service* rest__find_service(const struct http_req* req)
 {
+	if (req->url_index == 0)
+		return NULL;
+
 	struct rest_service* service;
 
-	SLIST_FOREACH(service, &rest_service_list_, links)
+	for (service = *rest__route_slot(req->url[0]); service;
+	     service = service->next_route)
 		if (rest__service_is_match(service, req))
 			return service;
 
@@ -58,11 +98,12 @@ struct rest_service* rest__find_service(const struct http_req* req)
 
 int rest__open_server(int port)
 {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 	if (fd < 0)
 		return -1;
 
 	net_reuse_addr(fd);
+	net_reuse_port(fd);
 
 	struct sockaddr_in addr;
 	memset(&addr, 0, sizeof(addr));
@@ -83,39 +124,53 @@ failure:
 	return -1;
 }
 
+/* Reads straight into the buffer until the socket runs dry. A byte is always
+ * left spare at the end so that the head can be terminated.
+ */
 int rest__read(struct vector* buffer, int fd)
 {
-	errno = 0;
-	char input[256];
-	ssize_t size = read(fd, &input, sizeof(input));
-	if (size == 0)
-		return -1;
+	while (1) {
+		if (vector_reserve(buffer, buffer->index + REST_READ_SIZE) < 0)
+			return -1;
 
-	if (size < 0)
-		return (errno == EWOULDBLOCK || errno == EAGAIN) ? 0 : -1;
+		errno = 0;
+		ssize_t size = read(fd, (char*)buffer->data + buffer->index,
+				    buffer->size - buffer->index - 1);
+		if (size == 0)
+			return -1;
 
-	if (vector_append(buffer, input, size) < 0)
-		return -1;
+		if (size < 0)
+			return (errno == EWOULDBLOCK || errno == EAGAIN) ? 0 : -1;
 
-	return rest__read(buffer, fd);
+		buffer->index += size;
+	}
 }
 
-int rest__read_head(struct vector* buffer, int fd)
+/* Only what has come in since the last call is searched for the end of the
+ * head, give or take the part of the terminator that may have been seen.
+ */
+int rest__read_head(struct rest_client* client, int fd)
 {
-	int rc = rest__read(buffer, fd);
-	if (rc < 0)
+	struct vector* buffer = &client->buffer;
+
+	if (rest__read(buffer, fd) < 0)
 		return -1;
 
-	vector_append(buffer, "", 1);
-	rc = !!strstr(buffer->data, "\r\n\r\n");
-	buffer->index--;
+	size_t start = client->head_scanned > 3 ? client->head_scanned - 3 : 0;
+	char* data = buffer->data;
 
-	return rc;
+	client->head_scanned = buffer->index;
+
+	if (!memmem(data + start, buffer->index - start, "\r\n\r\n", 4))
+		return buffer->index > REST_HEAD_MAX ? -1 : 0;
+
+	data[buffer->index] = '\0';
+	return 1;
 }
 
 static struct rest_client* rest_client_new()
 {
-	struct rest_client* self = malloc(sizeof(*self));
+	struct rest_client* self = mem_alloc(MEM_TAG_REST, sizeof(*self));
 	if (!self)
 		return NULL;
 
@@ -126,92 +181,327 @@ static struct rest_client* rest_client_new()
 	if (vector_init(&self->buffer, 256) < 0)
 		goto failure;
 
+	if (vector_init(&self->pipelined, 256) < 0)
+		goto pipelined_failure;
+
+	if (vector_init(&self->unsent, 0) < 0)
+		goto unsent_failure;
+
+	pthread_mutex_init(&self->output_lock, NULL);
+	pthread_cond_init(&self->output_drained, NULL);
+	self->output_fd = -1;
+
 	return self;
 
+unsent_failure:
+	vector_destroy(&self->pipelined);
+pipelined_failure:
+	vector_destroy(&self->buffer);
 failure:
-	free(self);
+	mem_free(MEM_TAG_REST, self);
 	return NULL;
 }
 
 void rest_client_free(struct rest_client* self)
 {
 	if (!self) return;
+	if (self->disconnect)
+		mloop_async_unref(self->disconnect);
+	if (self->idle_timer)
+		mloop_timer_unref(self->idle_timer);
+	if (self->resume)
+		mloop_idle_unref(self->resume);
 	vector_destroy(&self->buffer);
+	vector_destroy(&self->pipelined);
+	vector_destroy(&self->unsent);
+	pthread_cond_destroy(&self->output_drained);
+	pthread_mutex_destroy(&self->output_lock);
 	if (self->state > REST_CLIENT_START)
 		http_req_free(&self->req);
-	free(self);
+	mem_free(MEM_TAG_REST, self);
 }
 
 void rest_client_ref(struct rest_client* self)
 {
-	++self->ref;
+	co_atomic_add_fetch(&self->ref, 1);
 }
 
 int rest_client_unref(struct rest_client* self)
 {
-	int ref = --self->ref;
+	int ref = co_atomic_sub_fetch(&self->ref, 1);
 	if (ref == 0)
 		rest_client_free(self);
 
 	return ref;
 }
 
-static inline void rest__print_status_code(FILE* output, const char* status)
+void rest_client_set_disconnect_fn(struct rest_client* self,
+				   rest_disconnect_fn fn, void* context)
 {
-	fprintf(output, "HTTP/1.1 %s\r\n", status);
+	self->disconnect_fn = fn;
+	self->disconnect_context = context;
 }
 
-static inline void rest__print_server(FILE* output)
+void rest_client_done(struct rest_client* self)
 {
-	fprintf(output, "Server: CANopen master REST service\r\n");
+	co_atomic_store(&self->state, REST_CLIENT_DONE);
+
+	/* When everything runs on one loop, a reply that is made from within
+	 * the connection's handler is seen there.
+	 */
+	if (!self->is_threaded && self->is_handling)
+		return;
+
+	mloop_idle_notify(self->resume);
 }
 
-static inline void rest__print_content_type(FILE* output, const char* type)
+/* Called with the output lock held */
+static void rest__want_writable(struct rest_client* client, int is_wanted)
 {
-	fprintf(output, "Content-Type: %s\r\n", type);
+	mloop_socket_set_event(client->socket, MLOOP_SOCKET_EVENT_IN
+			       | MLOOP_SOCKET_EVENT_PRI
+			       | (is_wanted ? MLOOP_SOCKET_EVENT_OUT : 0));
+}
+
+/* Whatever is not sent right away is queued behind what is already waiting.
+ * If the queue can not take it, the connection is shut down rather than have
+ * the client see a reply with a hole in it.
+ */
+static int rest__send(struct rest_client* client, const struct iovec* iov,
+		      int n)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&client->output_lock);
+
+	struct vector* unsent = &client->unsent;
+	int was_idle = unsent->index == 0;
+	size_t sent = 0;
+
+	if (!client->socket) {
+		errno = EPIPE;
+		goto done;
+	}
+
+	if (was_idle) {
+		struct msghdr msg = {
+			.msg_iov = (struct iovec*)iov,
+			.msg_iovlen = n,
+		};
+
+		ssize_t wsize = sendmsg(client->output_fd, &msg,
+					MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (wsize < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			goto done;
+
+		sent = wsize > 0 ? wsize : 0;
+	}
+
+	for (int i = 0; i < n; ++i) {
+		if (sent >= iov[i].iov_len) {
+			sent -= iov[i].iov_len;
+			continue;
+		}
+
+		if (vector_append(unsent, (char*)iov[i].iov_base + sent,
+				  iov[i].iov_len - sent) < 0) {
+			shutdown(client->output_fd, SHUT_RDWR);
+			goto done;
+		}
+
+		sent = 0;
+	}
+
+	if (was_idle && unsent->index > 0)
+		rest__want_writable(client, 1);
+
+	rc = 0;
+done:
+	pthread_mutex_unlock(&client->output_lock);
+	return rc;
 }
 
-static inline void rest__print_content_length(FILE* output, size_t length)
+/* Called on the connection's loop when the socket is writable */
+static void rest__send_unsent(struct rest_client* client)
 {
-	fprintf(output, "Content-Length: %u\r\n", length);
+	pthread_mutex_lock(&client->output_lock);
+
+	struct vector* unsent = &client->unsent;
+
+	while (unsent->index > 0) {
+		ssize_t wsize = send(client->output_fd, unsent->data,
+				     unsent->index, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (wsize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			goto done;
+
+		/* The peer is gone. Reading from the socket will tell. */
+		if (wsize < 0) {
+			vector_clear(unsent);
+			break;
+		}
+
+		unsent->index -= wsize;
+		memmove(unsent->data, (char*)unsent->data + wsize,
+			unsent->index);
+	}
+
+	rest__want_writable(client, 0);
+	pthread_cond_broadcast(&client->output_drained);
+
+done:
+	pthread_mutex_unlock(&client->output_lock);
 }
 
-static inline void rest__print_connection_type(FILE* output)
+int rest_client_is_flushed(struct rest_client* self)
 {
-	fprintf(output, "Connection: close\r\n");
+	pthread_mutex_lock(&self->output_lock);
+	int is_flushed = self->unsent.index == 0;
+	pthread_mutex_unlock(&self->output_lock);
+	return is_flushed;
 }
 
-static inline void rest__print_allow_origin(FILE* output)
+void rest_response_init(struct rest_response* self)
 {
-	fprintf(output, "Access-Control-Allow-Origin: *\r\n");
+	self->head_length = 0;
+	self->is_head_ended = 0;
+	self->is_truncated = 0;
+	self->segment[0].iov_base = self->head;
+	self->segment[0].iov_len = 0;
+	self->n_segments = 1;
 }
 
-static inline void rest__print_allow_methods(FILE* output)
+static void rest_response__vprintf(struct rest_response* self,
+				   const char* fmt, va_list ap)
 {
-	fprintf(output, "Access-Control-Allow-Methods: GET, PUT\r\n");
+	size_t size = sizeof(self->head) - self->head_length;
+	int length = vsnprintf(self->head + self->head_length, size, fmt, ap);
+
+	if (length < 0 || (size_t)length >= size) {
+		self->is_truncated = 1;
+		return;
+	}
+
+	self->head_length += length;
+	self->segment[0].iov_len = self->head_length;
 }
 
-static inline void rest__print_chunked_transfer_encoding(FILE* output)
+void rest_response_add_header(struct rest_response* self, const char* fmt,
+			      ...)
 {
-	fprintf(output, "Transfer-Encoding: chunked\r\n");
+	assert(!self->is_head_ended);
+
+	va_list ap;
+	va_start(ap, fmt);
+	rest_response__vprintf(self, fmt, ap);
+	va_end(ap);
 }
 
-void rest_reply_header(FILE* output, struct rest_reply_data* data)
+/* Connections are persistent in HTTP/1.1, which is all that is spoken here */
+void rest_response_header(struct rest_response* self,
+			  const struct rest_reply_data* data)
 {
-	rest__print_status_code(output, data->status_code);
+	rest_response_add_header(self,
+		"HTTP/1.1 %s\r\n"
+		"Server: CANopen master REST service\r\n"
+		"Keep-Alive: timeout=%d\r\n",
+		data->status_code, REST_IDLE_TIMEOUT);
 
-	rest__print_server(output);
-	rest__print_connection_type(output);
-	rest__print_content_type(output, data->content_type);
+	if (data->content_type)
+		rest_response_add_header(self, "Content-Type: %s\r\n",
+					 data->content_type);
 
 	if (data->content_length >= 0)
-		rest__print_content_length(output, data->content_length);
+		rest_response_add_header(self, "Content-Length: %zd\r\n",
+					 data->content_length);
 	else
-		rest__print_chunked_transfer_encoding(output);
+		rest_response_add_header(self,
+					 "Transfer-Encoding: chunked\r\n");
+
+	if (data->etag)
+		rest_response_add_header(self, "ETag: %s\r\n", data->etag);
+
+	rest_response_add_header(self,
+		"Access-Control-Allow-Origin: *\r\n"
+		"Access-Control-Allow-Methods: GET, PUT, POST\r\n");
+}
+
+static void rest_response__end_head(struct rest_response* self)
+{
+	if (self->is_head_ended)
+		return;
+
+	rest_response_add_header(self, "\r\n");
+	self->is_head_ended = 1;
+}
+
+int rest_response_add(struct rest_response* self, const void* data,
+		      size_t size)
+{
+	rest_response__end_head(self);
+
+	if (size == 0)
+		return 0;
+
+	if (self->n_segments >= REST_RESPONSE_MAX_SEGMENTS) {
+		self->is_truncated = 1;
+		return -1;
+	}
+
+	struct iovec* segment = &self->segment[self->n_segments++];
+	segment->iov_base = (void*)data;
+	segment->iov_len = size;
+	return 0;
+}
+
+int rest_response_send(struct rest_response* self, struct rest_client* client)
+{
+	rest_response__end_head(self);
+
+	if (self->is_truncated) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return rest__send(client, self->segment, self->n_segments);
+}
+
+int rest_client_reply(struct rest_client* client,
+		      const struct rest_reply_data* data)
+{
+	struct rest_response response;
+	rest_response_init(&response);
+	rest_response_header(&response, data);
+
+	if (data->content_length > 0)
+		rest_response_add(&response, data->content,
+				  data->content_length);
 
-	rest__print_allow_origin(output);
-	rest__print_allow_methods(output);
-	fprintf(output, "\r\n");
+	return rest_response_send(&response, client);
+}
+
+int rest_client_send_chunk(struct rest_client* client, const void* data,
+			   size_t size)
+{
+	char head[32];
+	int head_length = snprintf(head, sizeof(head), "%zx\r\n", size);
+
+	const struct iovec iov[] = {
+		{ .iov_base = head, .iov_len = head_length },
+		{ .iov_base = (void*)data, .iov_len = size },
+		{ .iov_base = "\r\n", .iov_len = 2 },
+	};
+
+	return rest__send(client, iov, 3);
+}
+
+void rest_reply_header(FILE* output, struct rest_reply_data* data)
+{
+	struct rest_response response;
+	rest_response_init(&response);
+	rest_response_header(&response, data);
+	rest_response__end_head(&response);
+
+	fwrite(response.head, 1, response.head_length, output);
 	fflush(output);
 }
 
@@ -222,6 +512,174 @@ void rest_reply(FILE* output, struct rest_reply_data* data)
 	fflush(output);
 }
 
+struct rest_chunked {
+	FILE* output;
+	char buffer[REST_CHUNK_SIZE];
+};
+
+static ssize_t rest__write_chunk(void* cookie, const char* buf, size_t size)
+{
+	struct rest_chunked* self = cookie;
+
+	if (size == 0)
+		return 0;
+
+	fprintf(self->output, "%zx\r\n", size);
+	fwrite(buf, 1, size, self->output);
+	fprintf(self->output, "\r\n");
+
+	return fflush(self->output) == 0 ? (ssize_t)size : -1;
+}
+
+static int rest__end_chunks(void* cookie)
+{
+	struct rest_chunked* self = cookie;
+
+	fprintf(self->output, "0\r\n\r\n");
+	int rc = fflush(self->output);
+
+	mem_free(MEM_TAG_REST, self);
+	return rc;
+}
+
+static cookie_io_functions_t rest__chunked_funcs_ = {
+	.write = rest__write_chunk,
+	.close = rest__end_chunks,
+};
+
+FILE* rest_open_chunked(FILE* output)
+{
+	struct rest_chunked* self = mem_alloc(MEM_TAG_REST, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->output = output;
+
+	FILE* stream = fopencookie(self, "w", rest__chunked_funcs_);
+	if (!stream) {
+		mem_free(MEM_TAG_REST, self);
+		return NULL;
+	}
+
+	/* Whatever fills the buffer goes out as one chunk */
+	setvbuf(stream, self->buffer, _IOFBF, sizeof(self->buffer));
+	return stream;
+}
+
+/* The client's own output queues what can not be sent right away */
+static ssize_t rest__output_write(void* cookie, const char* buf, size_t size)
+{
+	struct iovec iov = { .iov_base = (void*)buf, .iov_len = size };
+
+	return rest__send(cookie, &iov, 1) == 0 ? (ssize_t)size : -1;
+}
+
+static int rest__output_close(void* cookie)
+{
+	struct rest_client* client = cookie;
+	return close(client->output_fd);
+}
+
+static cookie_io_functions_t rest__output_funcs_ = {
+	.write = rest__output_write,
+	.close = rest__output_close,
+};
+
+int rest__init_output(struct rest_client* client, int fd)
+{
+	client->output = fopencookie(client, "w", rest__output_funcs_);
+	if (!client->output)
+		return -1;
+
+	client->output_fd = fd;
+	return 0;
+}
+
+void rest__destroy_output(struct rest_client* client)
+{
+	fclose(client->output);
+	client->output = NULL;
+}
+
+/* A stream that a service writes to from a thread of its own */
+struct rest_thread_output {
+	struct rest_client* client;
+	int fd;
+};
+
+static ssize_t rest__thread_output_write(void* cookie, const char* buf,
+					 size_t size)
+{
+	struct rest_thread_output* self = cookie;
+	struct rest_client* client = self->client;
+
+	pthread_mutex_lock(&client->output_lock);
+	while (client->unsent.index > 0 && client->socket)
+		pthread_cond_wait(&client->output_drained,
+				  &client->output_lock);
+	int is_gone = !client->socket;
+	pthread_mutex_unlock(&client->output_lock);
+
+	if (is_gone) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	ssize_t wsize = -1;
+	ssize_t total = 0;
+
+	while (total < (ssize_t)size) {
+		wsize = net_write(self->fd, buf + total, size - total, -1);
+		if (wsize < 0)
+			break;
+
+		total += wsize;
+	}
+
+	return total > 0 || wsize >= 0 ? total : -1;
+}
+
+static int rest__thread_output_close(void* cookie)
+{
+	struct rest_thread_output* self = cookie;
+
+	int rc = close(self->fd);
+	rest_client_unref(self->client);
+	mem_free(MEM_TAG_REST, self);
+	return rc;
+}
+
+static cookie_io_functions_t rest__thread_output_funcs_ = {
+	.write = rest__thread_output_write,
+	.close = rest__thread_output_close,
+};
+
+FILE* rest_client_open_output(struct rest_client* self)
+{
+	struct rest_thread_output* output;
+	output = mem_alloc(MEM_TAG_REST, sizeof(*output));
+	if (!output)
+		return NULL;
+
+	output->client = self;
+	output->fd = fcntl(self->output_fd, F_DUPFD_CLOEXEC, 0);
+	if (output->fd < 0)
+		goto dup_failure;
+
+	FILE* stream = fopencookie(output, "w", rest__thread_output_funcs_);
+	if (!stream)
+		goto stream_failure;
+
+	rest_client_ref(self);
+	return stream;
+
+stream_failure:
+	close(output->fd);
+dup_failure:
+	mem_free(MEM_TAG_REST, output);
+	return NULL;
+}
+
 void rest__not_found(struct rest_client* client)
 {
 	const char* content = "No service is implemented for the given path.\r\n";
@@ -233,9 +691,9 @@ void rest__not_found(struct rest_client* client)
 		.content_length = strlen(content),
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 void rest__print_index(struct rest_client* client)
@@ -249,32 +707,83 @@ void rest__print_index(struct rest_client* client)
 		.content_length = strlen(content),
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 void rest__print_options(struct rest_client* client,
 			 const struct rest_service* service)
 {
-	FILE* output = client->output;
 	enum http_method methods = service ? service->method : 0xff;
 
-	rest__print_status_code(client->output, "200 OK");
-	rest__print_server(output);
-	rest__print_connection_type(output);
-	rest__print_content_length(output, 0);
-	rest__print_allow_origin(output);
-	rest__print_allow_methods(output);
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_length = 0,
+	};
+
+	struct rest_response response;
+	rest_response_init(&response);
+	rest_response_header(&response, &reply);
+	rest_response_add_header(&response, "Allow:%s%s%s OPTIONS\r\n",
+				 methods & HTTP_GET ? " GET," : "",
+				 methods & HTTP_PUT ? " PUT," : "",
+				 methods & HTTP_POST ? " POST," : "");
+	rest_response_send(&response, client);
 
-	fprintf(output, "Allow:%s%s OPTIONS\r\n",
-		 methods & HTTP_GET ? " GET," : "",
-		 methods & HTTP_PUT ? " PUT," : "");
+	rest_client_done(client);
+}
 
-	fprintf(client->output, "\r\n");
-	fflush(client->output);
+static void rest__on_service_call(struct mloop_async* async)
+{
+	struct rest_client* client = mloop_async_get_context(async);
 
-	client->state = REST_CLIENT_DONE;
+	client->service_fn(client, client->content);
+	rest_client_unref(client);
+}
+
+void rest_client_call(struct rest_client* client, rest_fn fn,
+		      const void* content)
+{
+	if (!client->is_threaded) {
+		fn(client, content);
+		return;
+	}
+
+	client->service_fn = fn;
+	client->content = content;
+
+	rest_client_ref(client);
+	if (mloop_post(mloop_default(), rest__on_service_call, client,
+		       NULL) == 0)
+		return;
+
+	rest_client_unref(client);
+
+	const char* message = "The service could not be reached.\r\n";
+
+	struct rest_reply_data reply = {
+		.status_code = "503 Service Unavailable",
+		.content_type = "text/plain",
+		.content = message,
+		.content_length = strlen(message),
+	};
+
+	rest_client_reply(client, &reply);
+
+	rest_client_done(client);
+}
+
+static void rest__call_service(struct rest_client* client,
+			       const struct rest_service* service,
+			       const void* content)
+{
+	client->state = REST_CLIENT_SERVICING;
+
+	if (service->flags & REST_SERVICE_ON_REACTOR)
+		service->fn(client, content);
+	else
+		rest_client_call(client, service->fn, content);
 }
 
 static inline int rest__have_full_content(struct rest_client* client)
@@ -302,8 +811,7 @@ void rest__process_content(struct rest_client* client)
 	const void* content = (char*)client->buffer.data
 			    + client->req.header_length;
 
-	client->state = REST_CLIENT_SERVICING;
-	service->fn(client, content);
+	rest__call_service(client, service, content);
 }
 
 void rest__handle_get(struct rest_client* client)
@@ -319,8 +827,7 @@ void rest__handle_get(struct rest_client* client)
 		return;
 	}
 
-	client->state = REST_CLIENT_SERVICING;
-	service->fn(client, NULL);
+	rest__call_service(client, service, NULL);
 }
 
 void rest__handle_options(struct rest_client* client)
@@ -344,24 +851,25 @@ void rest__handle_options(struct rest_client* client)
 	rest__print_options(client, service);
 }
 
-void rest__handle_header(int fd, struct rest_client* client,
-			 struct mloop_socket* socket)
+int rest__handle_header(int fd, struct rest_client* client,
+			struct mloop_socket* socket)
 {
-	int rc = rest__read_head(&client->buffer, fd);
+	int rc = rest__read_head(client, fd);
 	if (rc < 0)
-		mloop_socket_stop(socket);
+		goto failure;
 
-	if (rc <= 0)
-		return;
+	if (rc == 0)
+		return 0;
 
 	if (http_req_parse(&client->req, client->buffer.data) < 0)
-		mloop_socket_stop(socket);
+		goto failure;
 
 	switch (client->req.method) {
 	case HTTP_GET:
 		rest__handle_get(client);
 		break;
 	case HTTP_PUT:
+	case HTTP_POST:
 		client->state = REST_CLIENT_CONTENT;
 		rest__process_content(client);
 		break;
@@ -369,77 +877,251 @@ void rest__handle_header(int fd, struct rest_client* client,
 		rest__handle_options(client);
 		break;
 	}
+
+	return 0;
+
+failure:
+	mloop_socket_stop(socket);
+	return -1;
 }
 
-void rest__handle_content(int fd, struct rest_client* client,
-			  struct mloop_socket* socket)
+int rest__handle_content(int fd, struct rest_client* client,
+			 struct mloop_socket* socket)
 {
 	int rc = rest__read(&client->buffer, fd);
 	if (rc < 0) {
 		mloop_socket_stop(socket);
-		return;
+		return -1;
 	}
 
 	rest__process_content(client);
+	return 0;
 }
 
-void rest__handle_junk(int fd, struct rest_client* client,
-		       struct mloop_socket* socket)
+/* The content of the request that is being serviced must stay where it is, so
+ * anything that comes after it is kept aside.
+ */
+int rest__handle_pipelined(int fd, struct rest_client* client,
+			   struct mloop_socket* socket)
 {
-	char junk[256];
-	ssize_t size;
+	int rc = rest__read(&client->pipelined, fd);
+	if (rc < 0 || client->pipelined.index > REST_PIPELINE_MAX) {
+		mloop_socket_stop(socket);
+		return -1;
+	}
 
-	do {
-		size = read(fd, &junk, sizeof(junk));
-	} while (size > 0);
+	return 0;
+}
 
-	if (size == 0)
-		mloop_socket_stop(socket);
+static void rest__wait_for_request(struct rest_client* client)
+{
+	if (mloop_timer_is_started(client->idle_timer))
+		mloop_timer_stop(client->idle_timer);
+
+	mloop_timer_start(client->idle_timer);
+}
+
+/* Whatever follows the request in the buffer is the start of the next one */
+static int rest__next_request(struct rest_client* client)
+{
+	struct vector* buffer = &client->buffer;
+	size_t length = client->req.header_length
+		      + client->req.content_length;
+
+	/* Only PUT waits for the content */
+	if (length > buffer->index)
+		length = buffer->index;
+
+	http_req_free(&client->req);
+	memset(&client->req, 0, sizeof(client->req));
+
+	memmove(buffer->data, (char*)buffer->data + length,
+		buffer->index - length);
+	buffer->index -= length;
+
+	if (vector_append(buffer, client->pipelined.data,
+			  client->pipelined.index) < 0)
+		return -1;
+
+	vector_clear(&client->pipelined);
+
+	client->head_scanned = 0;
+	client->state = REST_CLIENT_START;
+	rest__wait_for_request(client);
+	return 0;
+}
+
+/* Returns -1 if the connection has been closed */
+static int rest__resume(struct rest_client* client)
+{
+	struct mloop_socket* socket = client->socket;
+	int fd = mloop_socket_get_fd(socket);
+
+	while (co_atomic_load(&client->state) == REST_CLIENT_DONE) {
+		if (client->req.close_connection
+		 || rest__next_request(client) < 0) {
+			mloop_socket_stop(socket);
+			return -1;
+		}
+
+		if (rest__handle_header(fd, client, socket) < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
 static void rest__on_client_data(struct mloop_socket* socket)
 {
 	struct rest_client* client = mloop_socket_get_context(socket);
 	int fd = mloop_socket_get_fd(socket);
+	int rc;
+
+	enum mloop_socket_event event = mloop_socket_get_event(socket);
+	if (event & MLOOP_SOCKET_EVENT_OUT) {
+		rest__send_unsent(client);
+
+		if (!(event & ~MLOOP_SOCKET_EVENT_OUT))
+			return;
+	}
+
+	client->is_handling = 1;
 
-	switch (client->state) {
+	/* A service on the default loop may be done with the client already */
+	switch (co_atomic_load(&client->state)) {
 	case REST_CLIENT_START:
-		rest__handle_header(fd, client, socket);
+		rc = rest__handle_header(fd, client, socket);
 		break;
 	case REST_CLIENT_CONTENT:
-		rest__handle_content(fd, client, socket);
+		rc = rest__handle_content(fd, client, socket);
 		break;
 	case REST_CLIENT_SERVICING:
-		rest__handle_junk(fd, client, socket);
-		break;
 	case REST_CLIENT_DONE:
-		mloop_socket_stop(socket);
+		rc = rest__handle_pipelined(fd, client, socket);
 		break;
 	default:
 		abort();
 	}
+
+	if (rc < 0 || rest__resume(client) < 0)
+		return;
+
+	client->is_handling = 0;
 }
 
-static void rest__on_socket_free(void* ptr)
+static void rest__on_resume(struct mloop_idle* idle)
+{
+	struct rest_client* client = mloop_idle_get_context(idle);
+
+	client->is_handling = 1;
+
+	if (rest__resume(client) < 0)
+		return;
+
+	client->is_handling = 0;
+}
+
+/* The handler sees the end of the stream and closes the connection */
+static void rest__on_idle_timeout(struct mloop_timer* timer)
+{
+	struct rest_client* client = mloop_timer_get_context(timer);
+
+	if (co_atomic_load(&client->state) <= REST_CLIENT_CONTENT)
+		shutdown(mloop_socket_get_fd(client->socket), SHUT_RDWR);
+}
+
+static void rest__disconnect(struct rest_client* client)
 {
-	struct rest_client* client = ptr;
 	client->state = REST_CLIENT_DISCONNECTED;
-	fclose(client->output);
+
+	if (client->disconnect_fn)
+		client->disconnect_fn(client, client->disconnect_context);
+
+	rest__destroy_output(client);
 	rest_client_unref(client);
 }
 
+static void rest__on_disconnect(struct mloop_async* async)
+{
+	rest__disconnect(mloop_async_get_context(async));
+}
+
+static void rest__on_socket_free(void* ptr)
+{
+	struct rest_client* client = ptr;
+
+	if (mloop_timer_is_started(client->idle_timer))
+		mloop_timer_stop(client->idle_timer);
+
+	mloop_idle_stop(client->resume);
+
+	/* Nothing more is sent, and writers that wait are let go */
+	pthread_mutex_lock(&client->output_lock);
+	client->socket = NULL;
+	vector_clear(&client->unsent);
+	pthread_cond_broadcast(&client->output_drained);
+	pthread_mutex_unlock(&client->output_lock);
+
+	/* The service might still be writing to the output */
+	if (client->disconnect && mloop_async_start(client->disconnect) == 0)
+		return;
+
+	rest__disconnect(client);
+}
+
+static int rest__init_threaded_client(struct rest_client* client)
+{
+	struct mloop* mloop = mloop_default();
+
+	client->is_threaded = 1;
+
+	client->disconnect = mloop_async_new(mloop);
+	if (!client->disconnect)
+		return -1;
+
+	mloop_async_set_context(client->disconnect, client, NULL);
+	mloop_async_set_callback(client->disconnect, rest__on_disconnect);
+
+	return 0;
+}
+
+static int rest__init_client_jobs(struct rest_client* client,
+				  struct mloop* mloop)
+{
+	client->idle_timer = mloop_timer_new(mloop);
+	if (!client->idle_timer)
+		return -1;
+
+	client->resume = mloop_idle_new(mloop);
+	if (!client->resume)
+		return -1;
+
+	mloop_timer_set_context(client->idle_timer, client, NULL);
+	mloop_timer_set_callback(client->idle_timer, rest__on_idle_timeout);
+	mloop_timer_set_time(client->idle_timer,
+			     REST_IDLE_TIMEOUT * 1000000000ULL);
+
+	mloop_idle_set_context(client->resume, client, NULL);
+	mloop_idle_set_idle_fn(client->resume, rest__on_resume);
+
+	return 0;
+}
+
 static void rest__on_connection(struct mloop_socket* socket)
 {
 	int sfd = mloop_socket_get_fd(socket);
 
-	int cfd = accept(sfd, NULL, 0);
+	int cfd = accept4(sfd, NULL, 0, SOCK_CLOEXEC);
 	if (cfd < 0)
 		return;
 
 	net_dont_block(cfd);
 	net_dont_delay(cfd);
 
-	struct mloop_socket* client = mloop_socket_new(mloop_default());
+	/* Each connection stays on the reactor that accepted it */
+	struct mloop* mloop = mloop_socket_get_context(socket);
+
+	struct mloop_socket* client = mloop_socket_new(mloop);
 	if (!client)
 		goto socket_failure;
 
@@ -447,72 +1129,102 @@ static void rest__on_connection(struct mloop_socket* socket)
 	if (!state)
 		goto state_failure;
 
-	int nfd = dup(cfd);
+	if (rest__init_client_jobs(state, mloop) < 0)
+		goto jobs_failure;
+
+	if (mloop != mloop_default() && rest__init_threaded_client(state) < 0)
+		goto threaded_failure;
+
+	int nfd = fcntl(cfd, F_DUPFD_CLOEXEC, 0);
 	if (nfd < 0)
 		goto nfd_failure;
 
-	state->output = stream_open(nfd, "w");
-	if (!state->output)
+	if (rest__init_output(state, nfd) < 0)
 		goto fdopen_failure;
 
+	state->socket = client;
+
 	mloop_socket_set_fd(client, cfd);
 	mloop_socket_set_callback(client, rest__on_client_data);
 	mloop_socket_set_context(client, state, rest__on_socket_free);
 	mloop_socket_start(client);
 
+	mloop_idle_start(state->resume);
+	rest__wait_for_request(state);
+
 	mloop_socket_unref(client);
 	return;
 
 fdopen_failure:
 	close(nfd);
 nfd_failure:
-	free(state);
+threaded_failure:
+jobs_failure:
+	rest_client_free(state);
 state_failure:
 	mloop_socket_unref(client);
 socket_failure:
 	close(cfd);
 }
 
-int rest_register_service(enum http_method method, const char* path, rest_fn fn)
+static int rest__register(enum http_method method, const char* path,
+			  rest_fn fn, enum rest_service_flags flags)
 {
-	struct rest_service *service = malloc(sizeof(*service));
+	struct rest_service *service = mem_alloc(MEM_TAG_REST, sizeof(*service));
 	if (!service)
 		return -1;
 
 	service->method = method | HTTP_OPTIONS;
 	service->path = path;
 	service->fn = fn;
+	service->flags = flags;
+
+	struct rest_service** slot = rest__route_slot(path);
+	service->next_route = *slot;
+	*slot = service;
 
 	SLIST_INSERT_HEAD(&rest_service_list_, service, links);
 
 	return 0;
 }
 
-void rest__init_service_list(void)
+int rest_register_service(enum http_method method, const char* path, rest_fn fn)
 {
-	SLIST_INIT(&rest_service_list_);
+	return rest__register(method, path, fn, 0);
 }
 
-int rest_init(int port)
+int rest_register_reactor_service(enum http_method method, const char* path,
+				  rest_fn fn)
 {
-	struct mloop* mloop = mloop_default();
+	return rest__register(method, path, fn, REST_SERVICE_ON_REACTOR);
+}
 
-	rest__init_service_list();
+void rest__init_service_list(void)
+{
+	SLIST_INIT(&rest_service_list_);
+	memset(rest_route_table_, 0, sizeof(rest_route_table_));
+}
 
-	int lfd = rest__open_server(port);
-	if (lfd < 0)
-		return -1;
+static int rest__listen_fd_ = -1;
 
+/* The listening socket is closed on failure */
+static int rest__listen(int lfd, struct mloop* mloop)
+{
 	struct mloop_socket* socket = mloop_socket_new(mloop);
 	if (!socket)
 		goto socket_failure;
 
 	mloop_socket_set_fd(socket, lfd);
+	mloop_socket_set_context(socket, mloop, NULL);
 	mloop_socket_set_callback(socket, rest__on_connection);
 	if (mloop_socket_start(socket) < 0)
 		goto start_failure;
 
 	mloop_socket_unref(socket);
+
+	if (rest__listen_fd_ < 0)
+		rest__listen_fd_ = lfd;
+
 	return 0;
 
 start_failure:
@@ -522,12 +1234,71 @@ socket_failure:
 	return -1;
 }
 
+/* Sockets for the rest of the reactors, on the same port as the first */
+static int rest__listen_on_reactors(int port)
+{
+	for (unsigned int i = 1; i < reactor_span(REACTOR_REST); ++i) {
+		int lfd = rest__open_server(port);
+		if (lfd < 0)
+			return -1;
+
+		if (rest__listen(lfd, reactor_get_nth(REACTOR_REST, i)) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int rest_init(int port)
+{
+	rest__init_service_list();
+	rest__listen_fd_ = -1;
+
+	int lfd = rest__open_server(port);
+	if (lfd < 0)
+		return -1;
+
+	if (rest__listen(lfd, reactor_get(REACTOR_REST)) < 0)
+		return -1;
+
+	return rest__listen_on_reactors(port);
+}
+
+/* A socket that was handed over by a process that did not set SO_REUSEPORT
+ * can not be shared, and is then left to accept on its own.
+ */
+int rest_init_fd(int lfd)
+{
+	rest__init_service_list();
+	rest__listen_fd_ = -1;
+
+	struct sockaddr_in addr;
+	socklen_t addr_size = sizeof(addr);
+	int port = getsockname(lfd, (struct sockaddr*)&addr, &addr_size) == 0
+		 ? ntohs(addr.sin_port) : -1;
+
+	if (rest__listen(lfd, reactor_get(REACTOR_REST)) < 0)
+		return -1;
+
+	if (port >= 0)
+		rest__listen_on_reactors(port);
+
+	return 0;
+}
+
+int rest_get_listen_fd(void)
+{
+	return rest__listen_fd_;
+}
+
 void rest_cleanup()
 {
 	while (!SLIST_EMPTY(&rest_service_list_)) {
 		struct rest_service* service = SLIST_FIRST(&rest_service_list_);
 		SLIST_REMOVE_HEAD(&rest_service_list_, links);
-		free(service);
+		mem_free(MEM_TAG_REST, service);
 	}
+
+	memset(rest_route_table_, 0, sizeof(rest_route_table_));
 }
 
@@ -0,0 +1,344 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <alloca.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "rt-thread.h"
+#include "plog.h"
+
+/* Left untouched below the prefaulted part, for the guard page and for the
+ * frames of whoever prefaults
+ */
+#define RT_THREAD_STACK_MARGIN (16 * 1024)
+
+static size_t rt_thread__prefault_size = 0;
+
+static struct rt_thread_sched rt_thread__sched[RT_THREAD_N_ROLES] = {
+	[0 ... RT_THREAD_N_ROLES - 1] = { .policy = -1 },
+};
+
+static const struct {
+	const char* name;
+	int policy;
+} rt_thread__policies[] = {
+	{ "other", SCHED_OTHER },
+	{ "batch", SCHED_BATCH },
+	{ "idle", SCHED_IDLE },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+};
+
+static inline int rt_thread__is_rt(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static inline int rt_thread__has_cpus(const struct rt_thread_sched* sched)
+{
+	return CPU_COUNT(&sched->cpus) > 0;
+}
+
+static int rt_thread__parse_policy(struct rt_thread_sched* dst,
+				   const char* str, size_t len)
+{
+	const size_t n_policies = sizeof(rt_thread__policies)
+				/ sizeof(rt_thread__policies[0]);
+
+	for (size_t i = 0; i < n_policies; ++i)
+		if (strlen(rt_thread__policies[i].name) == len
+		 && strncmp(rt_thread__policies[i].name, str, len) == 0) {
+			dst->policy = rt_thread__policies[i].policy;
+			return 0;
+		}
+
+	return -1;
+}
+
+static int rt_thread__parse_cpus(cpu_set_t* dst, const char* str)
+{
+	while (*str) {
+		char* end = NULL;
+		unsigned long first = strtoul(str, &end, 0);
+		unsigned long last = first;
+		if (end == str)
+			return -1;
+
+		if (*end == '-') {
+			str = end + 1;
+			last = strtoul(str, &end, 0);
+			if (end == str)
+				return -1;
+		}
+
+		if (first > last || last >= CPU_SETSIZE)
+			return -1;
+
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, dst);
+
+		str = end;
+		if (*str == ',')
+			++str;
+		else if (*str != '\0')
+			return -1;
+	}
+
+	return 0;
+}
+
+int rt_thread_parse_sched(struct rt_thread_sched* dst, const char* str)
+{
+	dst->policy = -1;
+	dst->priority = 0;
+	CPU_ZERO(&dst->cpus);
+
+	const char* cpus = strchr(str, '@');
+	size_t len = cpus ? (size_t)(cpus - str) : strlen(str);
+
+	const char* colon = memchr(str, ':', len);
+	size_t policy_len = colon ? (size_t)(colon - str) : len;
+
+	if (policy_len > 0 && rt_thread__parse_policy(dst, str, policy_len) < 0)
+		return -1;
+
+	if (colon) {
+		char* end = NULL;
+		long priority = strtol(colon + 1, &end, 0);
+		if (policy_len == 0 || end == colon + 1
+		 || end != str + len)
+			return -1;
+
+		dst->priority = priority;
+	}
+
+	if (rt_thread__is_rt(dst->policy)
+	 && (dst->priority < sched_get_priority_min(dst->policy)
+	  || dst->priority > sched_get_priority_max(dst->policy)))
+		return -1;
+
+	if (cpus && (rt_thread__parse_cpus(&dst->cpus, cpus + 1) < 0
+		  || !rt_thread__has_cpus(dst)))
+		return -1;
+
+	return 0;
+}
+
+void rt_thread_set_sched(enum rt_thread_role role,
+			 const struct rt_thread_sched* sched)
+{
+	rt_thread__sched[role] = *sched;
+}
+
+const struct rt_thread_sched* rt_thread_get_sched(enum rt_thread_role role)
+{
+	return &rt_thread__sched[role];
+}
+
+/* The nice value belongs to the thread on Linux, so a thread that is not
+ * real-time sets it itself once it runs. It also prefaults its own stack.
+ */
+struct rt_thread__start {
+	void* (*fn)(void*);
+	void* context;
+	int nice;
+};
+
+static void* rt_thread__run(void* context)
+{
+	struct rt_thread__start start = *(struct rt_thread__start*)context;
+	free(context);
+
+	if (start.nice != 0)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), start.nice);
+
+	if (rt_thread__prefault_size > 0)
+		rt_thread_prefault_stack(rt_thread__prefault_size);
+
+	return start.fn(start.context);
+}
+
+static int rt_thread__create(pthread_t* thread,
+			     const struct rt_thread_sched* sched,
+			     int use_policy, void* (*fn)(void*),
+			     void* context)
+{
+	pthread_attr_t attr;
+	struct sched_param param = { .sched_priority = 0 };
+	struct rt_thread__start* start = NULL;
+
+	pthread_attr_init(&attr);
+
+	if (rt_thread__has_cpus(sched))
+		pthread_attr_setaffinity_np(&attr, sizeof(sched->cpus),
+					    &sched->cpus);
+
+	if (use_policy && sched->policy >= 0) {
+		if (rt_thread__is_rt(sched->policy))
+			param.sched_priority = sched->priority;
+
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, sched->policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+	int nice = use_policy && !rt_thread__is_rt(sched->policy)
+		 ? sched->priority : 0;
+
+	if (nice != 0 || rt_thread__prefault_size > 0) {
+		start = malloc(sizeof(*start));
+		if (!start) {
+			pthread_attr_destroy(&attr);
+			return ENOMEM;
+		}
+
+		start->fn = fn;
+		start->context = context;
+		start->nice = nice;
+
+		fn = rt_thread__run;
+		context = start;
+	}
+
+	int rc = pthread_create(thread, &attr, fn, context);
+	if (rc != 0)
+		free(start);
+
+	pthread_attr_destroy(&attr);
+	return rc;
+}
+
+int rt_thread_create(pthread_t* thread, enum rt_thread_role role,
+		     void* (*fn)(void*), void* context, const char* name)
+{
+	const struct rt_thread_sched* sched = &rt_thread__sched[role];
+
+	int rc = rt_thread__create(thread, sched, 1, fn, context);
+
+	if (rc == EPERM) {
+		plog(LOG_WARNING, "%s: Not permitted to use scheduling policy %d with priority %d; running with normal priority",
+		     name, sched->policy, sched->priority);
+
+		rc = rt_thread__create(thread, sched, 0, fn, context);
+	}
+
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+int rt_thread_apply(enum rt_thread_role role, const char* name)
+{
+	const struct rt_thread_sched* sched = &rt_thread__sched[role];
+	pthread_t self = pthread_self();
+	int rc = 0;
+
+	if (rt_thread__has_cpus(sched)) {
+		rc = pthread_setaffinity_np(self, sizeof(sched->cpus),
+					    &sched->cpus);
+		if (rc != 0)
+			plog(LOG_WARNING, "%s: Could not set CPU affinity: %s",
+			     name, strerror(rc));
+	}
+
+	if (sched->policy >= 0) {
+		struct sched_param param = { .sched_priority = 0 };
+		if (rt_thread__is_rt(sched->policy))
+			param.sched_priority = sched->priority;
+
+		int prc = pthread_setschedparam(self, sched->policy, &param);
+		if (prc == 0 && !rt_thread__is_rt(sched->policy)
+		 && setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+				sched->priority) < 0)
+			prc = errno;
+
+		if (prc != 0) {
+			plog(LOG_WARNING, "%s: Could not set scheduling policy %d with priority %d: %s",
+			     name, sched->policy, sched->priority,
+			     strerror(prc));
+			rc = prc;
+		}
+	}
+
+	if (rc != 0) {
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Only the part of the stack below the caller is touched, and no more than
+ * there is room for.
+ */
+__attribute__((noinline))
+void rt_thread_prefault_stack(size_t size)
+{
+	pthread_attr_t attr;
+	void* stack_addr;
+	size_t stack_size;
+
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return;
+
+	int rc = pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+	pthread_attr_destroy(&attr);
+	if (rc != 0)
+		return;
+
+	uint8_t here;
+	size_t room = &here - (uint8_t*)stack_addr;
+	if (room < RT_THREAD_STACK_MARGIN)
+		return;
+
+	if (size > room - RT_THREAD_STACK_MARGIN)
+		size = room - RT_THREAD_STACK_MARGIN;
+
+	volatile uint8_t* stack = alloca(size);
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < size; i += page_size)
+		stack[i] = 0;
+}
+
+int rt_thread_lock_memory(size_t stack_size)
+{
+	/* Memory that is freed is kept rather than given back to the system,
+	 * which would only have to fault it in again.
+	 */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+
+	rt_thread__prefault_size = stack_size;
+	rt_thread_prefault_stack(stack_size);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		plog(LOG_WARNING, "Could not lock memory: %m");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,837 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <mloop.h>
+
+#include "sdo-gateway.h"
+#include "canopen.h"
+#include "canopen/master.h"
+#include "canopen/sdo.h"
+#include "canopen/sdo_req.h"
+#include "conversions.h"
+#include "net-util.h"
+#include "vector.h"
+
+#define SDO_GATEWAY_BACKLOG 16
+#define SDO_GATEWAY_READ_SIZE 4096
+
+/* Reading stops while a client has this many commands pending, or this much
+ * that has not been executed yet.
+ */
+#define SDO_GATEWAY_MAX_PENDING 256
+#define SDO_GATEWAY_INPUT_MAX (64 * 1024)
+
+/* A client that sends a longer line is dropped */
+#define SDO_GATEWAY_LINE_MAX 1024
+
+#define SDO_GATEWAY_MAX_WORDS 10
+
+#define SDO_GATEWAY_SPACE " \f\n\r\t\v"
+
+struct sdo_gateway_client {
+	struct mloop_socket* socket;
+	int fd;
+	int ref;
+	int is_closed;
+	int is_eof;
+	int is_processing;
+	enum mloop_socket_event events;
+
+	struct vector input;
+	struct vector output;
+	size_t output_offset;
+
+	size_t n_pending;
+
+	/* For commands that leave them out; a node of 0 is not set */
+	int net, node;
+};
+
+/* What is needed to reply to an SDO request */
+struct sdo_gateway_pending {
+	struct sdo_gateway_client* client;
+	int has_sequence;
+	uint32_t sequence;
+	enum canopen_type datatype;
+};
+
+static struct mloop_socket* sdo_gateway__listener = NULL;
+
+static const struct {
+	const char* name;
+	enum canopen_type type;
+} sdo_gateway__types[] = {
+	{ "b", CANOPEN_BOOLEAN },
+	{ "i8", CANOPEN_INTEGER8 },
+	{ "i16", CANOPEN_INTEGER16 },
+	{ "i24", CANOPEN_INTEGER24 },
+	{ "i32", CANOPEN_INTEGER32 },
+	{ "i40", CANOPEN_INTEGER40 },
+	{ "i48", CANOPEN_INTEGER48 },
+	{ "i56", CANOPEN_INTEGER56 },
+	{ "i64", CANOPEN_INTEGER64 },
+	{ "u8", CANOPEN_UNSIGNED8 },
+	{ "u16", CANOPEN_UNSIGNED16 },
+	{ "u24", CANOPEN_UNSIGNED24 },
+	{ "u32", CANOPEN_UNSIGNED32 },
+	{ "u40", CANOPEN_UNSIGNED40 },
+	{ "u48", CANOPEN_UNSIGNED48 },
+	{ "u56", CANOPEN_UNSIGNED56 },
+	{ "u64", CANOPEN_UNSIGNED64 },
+	{ "r32", CANOPEN_REAL32 },
+	{ "r64", CANOPEN_REAL64 },
+	{ "vs", CANOPEN_VISIBLE_STRING },
+};
+
+static enum canopen_type sdo_gateway__find_type(const char* name)
+{
+	const size_t n = sizeof(sdo_gateway__types)
+		       / sizeof(sdo_gateway__types[0]);
+
+	for (size_t i = 0; i < n; ++i)
+		if (strcmp(sdo_gateway__types[i].name, name) == 0)
+			return sdo_gateway__types[i].type;
+
+	return CANOPEN_UNKNOWN;
+}
+
+/* Split str into words in place. A word that starts with a double quote ends
+ * at the next double quote that is not doubled, and the quotes are taken out.
+ * Returns the number of words, or -1 if there are more than n or a quote is
+ * not closed.
+ */
+static int sdo_gateway__split(char* str, char* words[], int n)
+{
+	int count = 0;
+
+	while (1) {
+		str += strspn(str, SDO_GATEWAY_SPACE);
+		if (*str == '\0')
+			return count;
+
+		if (count == n)
+			return -1;
+
+		if (*str != '"') {
+			words[count++] = str;
+			str += strcspn(str, SDO_GATEWAY_SPACE);
+			if (*str != '\0')
+				*str++ = '\0';
+			continue;
+		}
+
+		char* dst = ++str;
+		words[count++] = dst;
+
+		while (*str != '"' || str[1] == '"') {
+			if (*str == '\0')
+				return -1;
+
+			if (*str == '"')
+				++str;
+
+			*dst++ = *str++;
+		}
+
+		*dst = '\0';
+		++str;
+
+		if (*str != '\0' && !strchr(SDO_GATEWAY_SPACE, *str))
+			return -1;
+	}
+}
+
+/* Decimal, or hexadecimal after 0x */
+static int sdo_gateway__parse_number(unsigned long* dst, const char* str,
+				     unsigned long max)
+{
+	char* end = NULL;
+
+	if (*str < '0' || *str > '9')
+		return -1;
+
+	errno = 0;
+	*dst = strtoul(str, &end, str[0] == '0' && (str[1] == 'x'
+						   || str[1] == 'X') ? 16 : 10);
+
+	return *end == '\0' && errno == 0 && *dst <= max ? 0 : -1;
+}
+
+static int sdo_gateway__parse_sequence(struct sdo_gateway_command* dst,
+				       char** line)
+{
+	char* str = *line + strspn(*line, SDO_GATEWAY_SPACE);
+	if (*str != '[')
+		return 0;
+
+	char* end = strchr(str, ']');
+	if (!end)
+		return -1;
+
+	*end = '\0';
+
+	unsigned long sequence;
+	if (sdo_gateway__parse_number(&sequence, str + 1, UINT32_MAX) < 0)
+		return -1;
+
+	dst->has_sequence = 1;
+	dst->sequence = sequence;
+	*line = end + 1;
+	return 0;
+}
+
+static int sdo_gateway__parse_object(struct sdo_gateway_command* dst,
+				     char* args[])
+{
+	unsigned long index, subindex;
+
+	if (sdo_gateway__parse_number(&index, args[0], 0xffff) < 0
+	 || sdo_gateway__parse_number(&subindex, args[1], 0xff) < 0)
+		return SDO_GATEWAY_E_SYNTAX;
+
+	dst->index = index;
+	dst->subindex = subindex;
+
+	dst->datatype = sdo_gateway__find_type(args[2]);
+	return dst->datatype != CANOPEN_UNKNOWN ? 0 : SDO_GATEWAY_E_UNSUPPORTED;
+}
+
+static int sdo_gateway__parse_set(struct sdo_gateway_command* dst,
+				  char* args[])
+{
+	unsigned long value;
+
+	if (sdo_gateway__parse_number(&value, args[1], INT32_MAX) < 0)
+		return SDO_GATEWAY_E_SYNTAX;
+
+	if (strcmp(args[0], "network") == 0) {
+		dst->type = SDO_GATEWAY_SET_NET;
+		dst->net = value;
+	} else if (strcmp(args[0], "node") == 0) {
+		dst->type = SDO_GATEWAY_SET_NODE;
+		dst->node = value;
+	} else {
+		return SDO_GATEWAY_E_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int sdo_gateway_parse(struct sdo_gateway_command* dst, char* line)
+{
+	char* words[SDO_GATEWAY_MAX_WORDS];
+
+	memset(dst, 0, sizeof(*dst));
+	dst->net = -1;
+	dst->node = -1;
+
+	if (sdo_gateway__parse_sequence(dst, &line) < 0)
+		return SDO_GATEWAY_E_SYNTAX;
+
+	int n = sdo_gateway__split(line, words, SDO_GATEWAY_MAX_WORDS);
+	if (n <= 0)
+		return SDO_GATEWAY_E_SYNTAX;
+
+	/* [[net] node] */
+	unsigned long numbers[2];
+	int n_numbers = 0;
+	while (n_numbers < 2 && n_numbers < n
+	    && sdo_gateway__parse_number(&numbers[n_numbers], words[n_numbers],
+					 INT32_MAX) == 0)
+		++n_numbers;
+
+	if (n_numbers == 2)
+		dst->net = numbers[0];
+
+	if (n_numbers > 0)
+		dst->node = numbers[n_numbers - 1];
+
+	if (n_numbers == n)
+		return SDO_GATEWAY_E_SYNTAX;
+
+	const char* command = words[n_numbers];
+	char** args = &words[n_numbers + 1];
+	int n_args = n - n_numbers - 1;
+
+	if (strcmp(command, "r") == 0 || strcmp(command, "read") == 0) {
+		dst->type = SDO_GATEWAY_READ;
+		return n_args == 3 ? sdo_gateway__parse_object(dst, args)
+				   : SDO_GATEWAY_E_SYNTAX;
+	}
+
+	if (strcmp(command, "w") == 0 || strcmp(command, "write") == 0) {
+		dst->type = SDO_GATEWAY_WRITE;
+		if (n_args != 4)
+			return SDO_GATEWAY_E_SYNTAX;
+
+		dst->value = args[3];
+		return sdo_gateway__parse_object(dst, args);
+	}
+
+	if (strcmp(command, "set") == 0)
+		return n_args == 2 ? sdo_gateway__parse_set(dst, args)
+				   : SDO_GATEWAY_E_SYNTAX;
+
+	return SDO_GATEWAY_E_UNSUPPORTED;
+}
+
+static void sdo_gateway__ref(struct sdo_gateway_client* self)
+{
+	++self->ref;
+}
+
+static void sdo_gateway__unref(struct sdo_gateway_client* self)
+{
+	if (--self->ref > 0)
+		return;
+
+	vector_destroy(&self->input);
+	vector_destroy(&self->output);
+	free(self);
+}
+
+static void sdo_gateway__on_socket_free(void* context)
+{
+	sdo_gateway__unref(context);
+}
+
+/* Whatever is still pending is cancelled, and the replies to it are
+ * dropped.
+ */
+static void sdo_gateway__close(struct sdo_gateway_client* self)
+{
+	if (self->is_closed)
+		return;
+
+	self->is_closed = 1;
+
+	if (self->n_pending > 0)
+		for (int i = 0; i < co_master_get_n_buses(); ++i)
+			sdo_req_queues_cancel(co_master_get_bus(i)->sdo_queue,
+					      self);
+
+	mloop_socket_stop(self->socket);
+	mloop_socket_unref(self->socket);
+}
+
+/* Reading stops while the client has enough to do, and writing is only
+ * waited for while there is something left to write.
+ */
+static void sdo_gateway__update_events(struct sdo_gateway_client* self)
+{
+	enum mloop_socket_event events = MLOOP_SOCKET_EVENT_NONE;
+
+	if (!self->is_eof && self->n_pending < SDO_GATEWAY_MAX_PENDING
+	 && self->input.index < SDO_GATEWAY_INPUT_MAX)
+		events |= MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI;
+
+	if (self->output_offset < self->output.index)
+		events |= MLOOP_SOCKET_EVENT_OUT;
+
+	if (events == self->events)
+		return;
+
+	self->events = events;
+	mloop_socket_set_event(self->socket, events);
+}
+
+static void sdo_gateway__flush(struct sdo_gateway_client* self)
+{
+	struct vector* output = &self->output;
+
+	while (self->output_offset < output->index) {
+		ssize_t rc = send(self->fd,
+				  (char*)output->data + self->output_offset,
+				  output->index - self->output_offset,
+				  MSG_NOSIGNAL);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			sdo_gateway__close(self);
+			return;
+		}
+
+		self->output_offset += rc;
+	}
+
+	if (self->output_offset == output->index) {
+		vector_clear(output);
+		self->output_offset = 0;
+	}
+
+	/* All that a client that has stopped sending has asked for is done */
+	if (self->is_eof && self->n_pending == 0 && output->index == 0) {
+		sdo_gateway__close(self);
+		return;
+	}
+
+	sdo_gateway__update_events(self);
+}
+
+static int sdo_gateway__append(struct sdo_gateway_client* self,
+			       const char* str)
+{
+	return vector_append(&self->output, str, strlen(str));
+}
+
+static int sdo_gateway__begin_reply(struct sdo_gateway_client* self,
+				    int has_sequence, uint32_t sequence)
+{
+	char prefix[16];
+
+	if (!has_sequence)
+		return 0;
+
+	snprintf(prefix, sizeof(prefix), "[%u] ", sequence);
+	return sdo_gateway__append(self, prefix);
+}
+
+static void sdo_gateway__reply(struct sdo_gateway_client* self,
+			       int has_sequence, uint32_t sequence,
+			       const char* message)
+{
+	if (sdo_gateway__begin_reply(self, has_sequence, sequence) < 0
+	 || sdo_gateway__append(self, message) < 0
+	 || sdo_gateway__append(self, "\r\n") < 0)
+		sdo_gateway__close(self);
+}
+
+static void sdo_gateway__reply_error(struct sdo_gateway_client* self,
+				     int has_sequence, uint32_t sequence,
+				     uint32_t code)
+{
+	char message[32];
+
+	if (code >= 0x10000)
+		snprintf(message, sizeof(message), "ERROR: 0x%08x", code);
+	else
+		snprintf(message, sizeof(message), "ERROR: %u", code);
+
+	sdo_gateway__reply(self, has_sequence, sequence, message);
+}
+
+/* Up to the first NUL, as canopen_data_tostring() does */
+static int sdo_gateway__append_string(struct vector* output,
+				      const struct vector* data)
+{
+	const char* str = data->data;
+	const char* end = memchr(str, '\0', data->index);
+	size_t size = end ? (size_t)(end - str) : data->index;
+
+	if (vector_append(output, "\"", 1) < 0)
+		return -1;
+
+	for (const char* quote; (quote = memchr(str, '"', size));) {
+		size_t n = quote + 1 - str;
+		if (vector_append(output, str, n) < 0
+		 || vector_append(output, "\"", 1) < 0)
+			return -1;
+
+		str += n;
+		size -= n;
+	}
+
+	if (vector_append(output, str, size) < 0
+	 || vector_append(output, "\"", 1) < 0)
+		return -1;
+
+	return 0;
+}
+
+static void sdo_gateway__reply_value(struct sdo_gateway_client* self,
+				     const struct sdo_gateway_pending* pending,
+				     const struct sdo_req* req)
+{
+	if (pending->datatype == CANOPEN_VISIBLE_STRING) {
+		if (sdo_gateway__begin_reply(self, pending->has_sequence,
+					     pending->sequence) < 0
+		 || sdo_gateway__append_string(&self->output, &req->data) < 0
+		 || sdo_gateway__append(self, "\r\n") < 0)
+			sdo_gateway__close(self);
+
+		return;
+	}
+
+	/* Booleans are 0 or 1 */
+	struct canopen_data data = {
+		.type = pending->datatype == CANOPEN_BOOLEAN
+		      ? CANOPEN_UNSIGNED8 : pending->datatype,
+		.data = req->data.data,
+		.size = req->data.index,
+		.is_size_unknown = !req->is_size_indicated
+	};
+
+	char buffer[64];
+	if (!canopen_data_tostring(buffer, sizeof(buffer), &data)) {
+		sdo_gateway__reply_error(self, pending->has_sequence,
+					 pending->sequence, SDO_ABORT_SIZE);
+		return;
+	}
+
+	sdo_gateway__reply(self, pending->has_sequence, pending->sequence,
+			   buffer);
+}
+
+static void sdo_gateway__process_input(struct sdo_gateway_client* self);
+
+static void sdo_gateway__on_done(struct sdo_req* req)
+{
+	struct sdo_gateway_pending* pending = req->context;
+	struct sdo_gateway_client* self = pending->client;
+
+	if (self->is_closed)
+		goto done;
+
+	if (req->status == SDO_REQ_OK && req->type == SDO_REQ_UPLOAD)
+		sdo_gateway__reply_value(self, pending, req);
+	else if (req->status == SDO_REQ_OK)
+		sdo_gateway__reply(self, pending->has_sequence,
+				   pending->sequence, "OK");
+	else
+		sdo_gateway__reply_error(self, pending->has_sequence,
+					 pending->sequence,
+					 req->abort_code ? req->abort_code
+							 : SDO_GATEWAY_E_STATE);
+
+done:
+	--self->n_pending;
+	free(pending);
+
+	/* Replies to what is done at once are sent together after it */
+	if (!self->is_closed && !self->is_processing) {
+		sdo_gateway__process_input(self);
+		sdo_gateway__flush(self);
+	}
+
+	sdo_gateway__unref(self);
+}
+
+static int sdo_gateway__convert(struct canopen_data* dst,
+				const struct sdo_gateway_command* command)
+{
+	if (command->datatype != CANOPEN_BOOLEAN)
+		return canopen_data_fromstring(dst, command->datatype,
+					       command->value);
+
+	if (canopen_data_fromstring(dst, CANOPEN_UNSIGNED8, command->value) < 0
+	 || dst->value > 1)
+		return -1;
+
+	return 0;
+}
+
+static void sdo_gateway__start(struct sdo_gateway_client* self,
+			       const struct sdo_gateway_command* command,
+			       struct co_master_node* node)
+{
+	struct canopen_data data = { 0 };
+
+	if (command->type == SDO_GATEWAY_WRITE
+	 && sdo_gateway__convert(&data, command) < 0) {
+		sdo_gateway__reply_error(self, command->has_sequence,
+					 command->sequence,
+					 SDO_GATEWAY_E_SYNTAX);
+		return;
+	}
+
+	struct sdo_gateway_pending* pending = malloc(sizeof(*pending));
+	if (!pending)
+		goto failure;
+
+	pending->client = self;
+	pending->has_sequence = command->has_sequence;
+	pending->sequence = command->sequence;
+	pending->datatype = command->datatype;
+
+	struct sdo_req_info info = {
+		.type = command->type == SDO_GATEWAY_WRITE ? SDO_REQ_DOWNLOAD
+							   : SDO_REQ_UPLOAD,
+		.index = command->index,
+		.subindex = command->subindex,
+		.on_done = sdo_gateway__on_done,
+		.context = pending,
+		.dl_data = data.data,
+		.dl_size = data.size,
+		.priority = SDO_REQ_PRIO_BACKGROUND,
+		.owner = self,
+	};
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req)
+		goto req_failure;
+
+	sdo_gateway__ref(self);
+	++self->n_pending;
+
+	/* It may be done before this returns */
+	if (sdo_req_start(req, co_master_get_sdo_queue(node)) < 0) {
+		--self->n_pending;
+		sdo_gateway__unref(self);
+		sdo_req_unref(req);
+		goto req_failure;
+	}
+
+	sdo_req_unref(req);
+	return;
+
+req_failure:
+	free(pending);
+failure:
+	sdo_gateway__reply_error(self, command->has_sequence,
+				 command->sequence, SDO_GATEWAY_E_STATE);
+}
+
+static void sdo_gateway__execute(struct sdo_gateway_client* self, char* line)
+{
+	struct sdo_gateway_command command;
+
+	/* Empty lines are ignored */
+	if (line[strspn(line, SDO_GATEWAY_SPACE)] == '\0')
+		return;
+
+	int error = sdo_gateway_parse(&command, line);
+	if (error) {
+		sdo_gateway__reply_error(self, command.has_sequence,
+					 command.sequence, error);
+		return;
+	}
+
+	int net = command.net >= 0 ? command.net : self->net;
+	int nodeid = command.node >= 0 ? command.node : self->node;
+
+	if (net < 1 || net > co_master_get_n_buses())
+		error = SDO_GATEWAY_E_NET;
+	else if (command.type == SDO_GATEWAY_SET_NET)
+		self->net = net;
+	else if (nodeid == 0 && command.node < 0)
+		error = SDO_GATEWAY_E_NO_NODE;
+	else if (nodeid < CANOPEN_NODEID_MIN || nodeid > CANOPEN_NODEID_MAX)
+		error = SDO_GATEWAY_E_NODE;
+	else if (command.type == SDO_GATEWAY_SET_NODE)
+		self->node = nodeid;
+	else {
+		struct co_bus* bus = co_master_get_bus(net - 1);
+		sdo_gateway__start(self, &command, co_bus_get_node(bus, nodeid));
+		return;
+	}
+
+	if (error)
+		sdo_gateway__reply_error(self, command.has_sequence,
+					 command.sequence, error);
+	else
+		sdo_gateway__reply(self, command.has_sequence,
+				   command.sequence, "OK");
+}
+
+/* Complete lines are executed until enough are pending. The rest is kept
+ * for later.
+ */
+static void sdo_gateway__process_input(struct sdo_gateway_client* self)
+{
+	struct vector* input = &self->input;
+	char* data = input->data;
+	size_t start = 0;
+
+	self->is_processing = 1;
+
+	while (!self->is_closed && self->n_pending < SDO_GATEWAY_MAX_PENDING) {
+		char* end = memchr(data + start, '\n', input->index - start);
+		if (!end)
+			break;
+
+		*end = '\0';
+		sdo_gateway__execute(self, data + start);
+		start = end + 1 - data;
+	}
+
+	self->is_processing = 0;
+
+	memmove(data, data + start, input->index - start);
+	input->index -= start;
+
+	if (input->index > SDO_GATEWAY_LINE_MAX
+	 && !memchr(data, '\n', input->index))
+		sdo_gateway__close(self);
+}
+
+/* Returns -1 on errors. The end of the stream is only noted, as what the
+ * client has sent before it is still answered, including a last line that
+ * is not terminated.
+ */
+static int sdo_gateway__read(struct sdo_gateway_client* self)
+{
+	struct vector* input = &self->input;
+
+	while (!self->is_eof && input->index < SDO_GATEWAY_INPUT_MAX) {
+		if (vector_reserve(input, input->index
+					  + SDO_GATEWAY_READ_SIZE) < 0)
+			return -1;
+
+		ssize_t size = read(self->fd, (char*)input->data + input->index,
+				    input->size - input->index);
+		if (size == 0) {
+			char* data = input->data;
+			if (input->index > 0 && data[input->index - 1] != '\n')
+				data[input->index++] = '\n';
+
+			self->is_eof = 1;
+		}
+
+		if (size < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+
+		input->index += size;
+	}
+
+	return 0;
+}
+
+static void sdo_gateway__on_client_data(struct mloop_socket* socket)
+{
+	struct sdo_gateway_client* self = mloop_socket_get_context(socket);
+	enum mloop_socket_event event = mloop_socket_get_event(socket);
+
+	if (event & (MLOOP_SOCKET_EVENT_ERR | MLOOP_SOCKET_EVENT_HUP)
+	 && !(event & MLOOP_SOCKET_EVENT_IN)) {
+		sdo_gateway__close(self);
+		return;
+	}
+
+	sdo_gateway__ref(self);
+
+	if (event & MLOOP_SOCKET_EVENT_IN && sdo_gateway__read(self) < 0)
+		sdo_gateway__close(self);
+
+	if (!self->is_closed)
+		sdo_gateway__process_input(self);
+
+	if (!self->is_closed)
+		sdo_gateway__flush(self);
+
+	sdo_gateway__unref(self);
+}
+
+static void sdo_gateway__on_connection(struct mloop_socket* socket)
+{
+	int fd = accept4(mloop_socket_get_fd(socket), NULL, 0, SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	net_dont_block(fd);
+	net_dont_delay(fd);
+
+	struct sdo_gateway_client* self = calloc(1, sizeof(*self));
+	if (!self)
+		goto client_failure;
+
+	self->fd = fd;
+	self->ref = 1;
+	self->net = 1;
+	self->events = MLOOP_SOCKET_EVENT_IN | MLOOP_SOCKET_EVENT_PRI;
+
+	if (vector_init(&self->input, SDO_GATEWAY_READ_SIZE) < 0
+	 || vector_init(&self->output, SDO_GATEWAY_READ_SIZE) < 0)
+		goto vector_failure;
+
+	self->socket = mloop_socket_new(mloop_default());
+	if (!self->socket)
+		goto vector_failure;
+
+	mloop_socket_set_fd(self->socket, fd);
+	mloop_socket_set_callback(self->socket, sdo_gateway__on_client_data);
+	mloop_socket_set_context(self->socket, self,
+				 sdo_gateway__on_socket_free);
+
+	if (mloop_socket_start(self->socket) < 0) {
+		self->is_closed = 1;
+		mloop_socket_unref(self->socket);
+	}
+
+	return;
+
+vector_failure:
+	vector_destroy(&self->input);
+	vector_destroy(&self->output);
+	free(self);
+client_failure:
+	close(fd);
+}
+
+int sdo_gateway_init(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	net_reuse_addr(fd);
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		goto failure;
+
+	if (listen(fd, SDO_GATEWAY_BACKLOG) < 0)
+		goto failure;
+
+	net_dont_block(fd);
+
+	struct mloop_socket* socket = mloop_socket_new(mloop_default());
+	if (!socket)
+		goto failure;
+
+	mloop_socket_set_fd(socket, fd);
+	mloop_socket_set_callback(socket, sdo_gateway__on_connection);
+
+	if (mloop_socket_start(socket) < 0) {
+		mloop_socket_unref(socket);
+		goto failure;
+	}
+
+	sdo_gateway__listener = socket;
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+void sdo_gateway_cleanup(void)
+{
+	if (!sdo_gateway__listener)
+		return;
+
+	mloop_socket_stop(sdo_gateway__listener);
+	mloop_socket_unref(sdo_gateway__listener);
+	sdo_gateway__listener = NULL;
+}
@@ -0,0 +1,650 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <mloop.h>
+
+#include "sdo-poll.h"
+#include "canopen/sdo_req.h"
+#include "canopen/sdo.h"
+#include "canopen/eds.h"
+#include "canopen/master.h"
+#include "conversions.h"
+#include "rest.h"
+#include "cfg.h"
+#include "plog.h"
+#include "time-utils.h"
+
+size_t strlcpy(char*, const char*, size_t);
+
+#define SDO_POLL_SEPARATORS " \t\r\n,"
+#define SDO_POLL_OBJECT_LENGTH_MAX 128
+#define SDO_POLL_PERIOD_DEFAULT 1000 /* ms */
+
+static struct sdo_poll_group* sdo_poll__groups = NULL;
+
+/* Stamped on each object whose value or status changes, so that subscribers
+ * only have to remember the last generation that they saw
+ */
+static uint32_t sdo_poll__gen = 0;
+
+static int sdo_poll__parse_number(int* dst, const char* str, int min, int max)
+{
+	char* end = NULL;
+
+	errno = 0;
+	unsigned long value = strtoul(str, &end, 0);
+	if (errno || end == str || *end != '\0' || value < (unsigned long)min
+	 || value > (unsigned long)max)
+		return -1;
+
+	*dst = value;
+	return 0;
+}
+
+int sdo_poll_parse_object(struct sdo_poll_object* dst, const char* str)
+{
+	char buffer[SDO_POLL_OBJECT_LENGTH_MAX];
+	char* field[4];
+	size_t n_fields = 0;
+
+	if (strlcpy(buffer, str, sizeof(buffer)) >= sizeof(buffer))
+		return -1;
+
+	memset(dst, 0, sizeof(*dst));
+	dst->type = CANOPEN_UNKNOWN;
+
+	char* p = buffer;
+	char* hash = strchr(p, '#');
+	if (hash) {
+		*hash = '\0';
+
+		struct co_bus* bus = co_master_find_bus(p);
+		if (!bus)
+			return -1;
+
+		dst->bus = bus->index;
+		p = hash + 1;
+	}
+
+	char* saveptr = NULL;
+	for (char* tok = strtok_r(p, "/", &saveptr); tok;
+	     tok = strtok_r(NULL, "/", &saveptr)) {
+		if (n_fields == 4)
+			return -1;
+
+		field[n_fields++] = tok;
+	}
+
+	if (n_fields < 3
+	 || sdo_poll__parse_number(&dst->nodeid, field[0], CANOPEN_NODEID_MIN,
+				   CANOPEN_NODEID_MAX) < 0
+	 || sdo_poll__parse_number(&dst->index, field[1], 0x1000, 0xffff) < 0
+	 || sdo_poll__parse_number(&dst->subindex, field[2], 0, 0xff) < 0)
+		return -1;
+
+	if (n_fields == 4) {
+		dst->type = canopen_type_from_string(field[3]);
+		if (dst->type == CANOPEN_UNKNOWN)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int sdo_poll__is_valid_name(const char* name)
+{
+	size_t length = strlen(name);
+
+	if (length == 0 || length >= SDO_POLL_NAME_MAX)
+		return 0;
+
+	for (size_t i = 0; i < length; ++i)
+		if (!isalnum((unsigned char)name[i])
+		 && !strchr("-_.", name[i]))
+			return 0;
+
+	return 1;
+}
+
+/* Finds the next object in the list; returns its length, or 0 at the end */
+static size_t sdo_poll__next_token(const char** str)
+{
+	*str += strspn(*str, SDO_POLL_SEPARATORS);
+	return strcspn(*str, SDO_POLL_SEPARATORS);
+}
+
+static size_t sdo_poll__count_objects(const char* str)
+{
+	size_t n = 0;
+
+	for (size_t length; (length = sdo_poll__next_token(&str)) > 0;
+	     str += length)
+		++n;
+
+	return n;
+}
+
+struct sdo_poll_group* sdo_poll_group_new(const char* name,
+					  unsigned int period,
+					  const char* objects)
+{
+	size_t n_objects = sdo_poll__count_objects(objects);
+
+	if (!sdo_poll__is_valid_name(name) || period < SDO_POLL_PERIOD_MIN
+	 || n_objects == 0 || n_objects > SDO_POLL_OBJECTS_MAX)
+		goto invalid;
+
+	struct sdo_poll_group* self = calloc(1, sizeof(*self)
+				      + n_objects * sizeof(self->object[0]));
+	if (!self)
+		return NULL;
+
+	self->ref = 1;
+	self->period = period;
+	self->n_objects = n_objects;
+	strlcpy(self->name, name, sizeof(self->name));
+
+	const char* str = objects;
+	for (size_t i = 0, length; (length = sdo_poll__next_token(&str)) > 0;
+	     str += length, ++i) {
+		char token[SDO_POLL_OBJECT_LENGTH_MAX];
+		struct sdo_poll_object* object = &self->object[i];
+
+		if (length >= sizeof(token))
+			goto object_failure;
+
+		memcpy(token, str, length);
+		token[length] = '\0';
+
+		if (sdo_poll_parse_object(object, token) < 0)
+			goto object_failure;
+
+		object->group = self;
+	}
+
+	return self;
+
+object_failure:
+	free(self);
+invalid:
+	errno = EINVAL;
+	return NULL;
+}
+
+void sdo_poll_group_unref(struct sdo_poll_group* self)
+{
+	if (--self->ref > 0)
+		return;
+
+	if (self->timer) {
+		mloop_timer_stop(self->timer);
+		mloop_timer_unref(self->timer);
+	}
+
+	free(self);
+}
+
+void sdo_poll__record(struct sdo_poll_object* object,
+		      enum sdo_req_status status, uint32_t abort_code,
+		      const void* data, size_t size, int is_size_unknown,
+		      uint64_t timestamp)
+{
+	int is_changed = status != object->status
+		      || abort_code != object->abort_code;
+
+	if (status == SDO_REQ_OK) {
+		if (size > SDO_POLL_VALUE_MAX)
+			size = SDO_POLL_VALUE_MAX;
+
+		is_changed = is_changed || size != object->size
+			  || memcmp(data, object->data, size) != 0;
+
+		memcpy(object->data, data, size);
+		object->size = size;
+		object->is_size_unknown = is_size_unknown;
+		object->timestamp = timestamp;
+	}
+
+	object->status = status;
+	object->abort_code = abort_code;
+
+	if (is_changed)
+		object->gen = ++sdo_poll__gen;
+}
+
+static void sdo_poll__on_done(struct sdo_req* req)
+{
+	struct sdo_poll_object* object = req->context;
+	struct sdo_poll_group* group = object->group;
+
+	object->is_pending = 0;
+
+	if (!group->is_removed && req->status != SDO_REQ_CANCELLED)
+		sdo_poll__record(object, req->status, req->abort_code,
+				 req->data.data, req->data.index,
+				 !req->is_size_indicated,
+				 gettime_ms(CLOCK_REALTIME));
+
+	sdo_poll_group_unref(group);
+}
+
+/* The type is looked up when the object is first read, as the EDS of the
+ * node may not be known when the group is made.
+ */
+static int sdo_poll__resolve_type(struct sdo_poll_object* object,
+				  const struct co_master_node* node)
+{
+	if (object->type != CANOPEN_UNKNOWN)
+		return 0;
+
+	const struct canopen_eds* eds = co_master_find_eds(node);
+	const struct eds_obj* obj = eds ? eds_obj_find(eds, object->index,
+						       object->subindex)
+					: NULL;
+	if (!obj)
+		return -1;
+
+	object->type = obj->type;
+	return 0;
+}
+
+/* An object that has not been answered since the last period is not read
+ * again until it is. Nodes without a driver may not be there at all, so they
+ * are left alone rather than timed out on each period.
+ */
+static void sdo_poll__start(struct sdo_poll_object* object)
+{
+	struct sdo_poll_group* group = object->group;
+
+	if (object->is_pending || object->bus >= co_master_get_n_buses())
+		return;
+
+	struct co_bus* bus = co_master_get_bus(object->bus);
+	struct co_master_node* node = co_bus_get_node(bus, object->nodeid);
+
+	if (node->driver_type == CO_MASTER_DRIVER_NONE
+	 || sdo_poll__resolve_type(object, node) < 0)
+		return;
+
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = object->index,
+		.subindex = object->subindex,
+		.on_done = sdo_poll__on_done,
+		.context = object,
+		.priority = SDO_REQ_PRIO_BACKGROUND,
+		.owner = group,
+	};
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req)
+		return;
+
+	object->is_pending = 1;
+	++group->ref;
+
+	if (sdo_req_start(req, co_master_get_sdo_queue(node)) < 0) {
+		object->is_pending = 0;
+		--group->ref;
+	}
+
+	sdo_req_unref(req);
+}
+
+static void sdo_poll__on_tick(struct mloop_timer* timer)
+{
+	struct sdo_poll_group* group = mloop_timer_get_context(timer);
+
+	for (size_t i = 0; i < group->n_objects; ++i)
+		sdo_poll__start(&group->object[i]);
+}
+
+struct sdo_poll_group* sdo_poll_find(const char* name)
+{
+	for (struct sdo_poll_group* group = sdo_poll__groups; group;
+	     group = group->next)
+		if (strcmp(group->name, name) == 0)
+			return group;
+
+	return NULL;
+}
+
+/* Requests that are still out hold a reference to the group, and their
+ * results are dropped when they come in.
+ */
+static void sdo_poll__stop(struct sdo_poll_group* group)
+{
+	group->is_removed = 1;
+
+	if (group->timer)
+		mloop_timer_stop(group->timer);
+
+	for (int i = 0; i < co_master_get_n_buses(); ++i)
+		sdo_req_queues_cancel(co_master_get_bus(i)->sdo_queue, group);
+
+	sdo_poll_group_unref(group);
+}
+
+static void sdo_poll__unlink(struct sdo_poll_group* group)
+{
+	struct sdo_poll_group** link = &sdo_poll__groups;
+	while (*link != group)
+		link = &(*link)->next;
+	*link = group->next;
+}
+
+int sdo_poll_remove(const char* name)
+{
+	struct sdo_poll_group* group = sdo_poll_find(name);
+	if (!group) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	sdo_poll__unlink(group);
+	sdo_poll__stop(group);
+	return 0;
+}
+
+int sdo_poll_add(struct sdo_poll_group* group)
+{
+	group->timer = mloop_timer_new(mloop_default());
+	if (!group->timer)
+		goto failure;
+
+	mloop_timer_set_type(group->timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_time(group->timer, group->period * 1000000ULL);
+	mloop_timer_set_context(group->timer, group, NULL);
+	mloop_timer_set_callback(group->timer, sdo_poll__on_tick);
+
+	if (mloop_timer_start(group->timer) < 0)
+		goto failure;
+
+	sdo_poll_remove(group->name);
+
+	group->next = sdo_poll__groups;
+	sdo_poll__groups = group;
+	return 0;
+
+failure:
+	sdo_poll_group_unref(group);
+	return -1;
+}
+
+static void sdo_poll__load_cfg_group(const char* name, const char* value,
+				     void* context)
+{
+	int* rc = context;
+	char* end = NULL;
+
+	unsigned long period = strtoul(value, &end, 0);
+	struct sdo_poll_group* group = end != value
+				     ? sdo_poll_group_new(name, period, end)
+				     : NULL;
+	if (!group || sdo_poll_add(group) < 0) {
+		plog(LOG_ERROR, "Could not add polling group \"%s\": %m",
+		     name);
+		*rc = -1;
+	}
+}
+
+int sdo_poll_load_cfg(void)
+{
+	int rc = 0;
+	cfg_for_each_key("poll", sdo_poll__load_cfg_group, &rc);
+	return rc;
+}
+
+static const char* sdo_poll__iface(int bus)
+{
+	return bus < co_master_get_n_buses() ? co_master_get_bus(bus)->iface
+					     : "";
+}
+
+static void sdo_poll__write_value(FILE* output,
+				  const struct sdo_poll_object* object)
+{
+	struct canopen_data data = {
+		.type = object->type,
+		.data = (void*)object->data,
+		.size = object->size,
+		.is_size_unknown = object->is_size_unknown
+	};
+
+	if (object->timestamp == 0 || canopen_data_write(output, &data, '"') < 0)
+		fprintf(output, "null");
+}
+
+static void sdo_poll__write_object(FILE* output,
+				   const struct sdo_poll_object* object)
+{
+	fprintf(output, "\"iface\": \"%s\", \"node\": %d, \"index\": \"%#x\", \"subindex\": %d, \"value\": ",
+		sdo_poll__iface(object->bus), object->nodeid, object->index,
+		object->subindex);
+
+	sdo_poll__write_value(output, object);
+
+	fprintf(output, ", \"timestamp\": %llu",
+		(unsigned long long)object->timestamp);
+
+	if (object->status != SDO_REQ_OK && object->status != SDO_REQ_PENDING)
+		fprintf(output, ", \"error\": \"%s\"",
+			sdo_strerror(object->abort_code));
+}
+
+void sdo_poll_write_json(FILE* output, const struct sdo_poll_group* group)
+{
+	fprintf(output, "{\"name\": \"%s\", \"period\": %u, \"objects\": [",
+		group->name, group->period);
+
+	for (size_t i = 0; i < group->n_objects; ++i) {
+		fprintf(output, "%s{", i > 0 ? ", " : "");
+		sdo_poll__write_object(output, &group->object[i]);
+		fprintf(output, "}");
+	}
+
+	fprintf(output, "]}");
+}
+
+int sdo_poll_format_events(FILE* output, uint32_t* gen, int bus,
+			   const char* nodes)
+{
+	int n_events = 0;
+
+	if (*gen == sdo_poll__gen)
+		return 0;
+
+	for (const struct sdo_poll_group* group = sdo_poll__groups; group;
+	     group = group->next)
+		for (size_t i = 0; i < group->n_objects; ++i) {
+			const struct sdo_poll_object* object =
+				&group->object[i];
+
+			if (object->gen <= *gen
+			 || (bus >= 0 && bus != object->bus)
+			 || !nodes[object->nodeid])
+				continue;
+
+			fprintf(output, "event: poll\ndata: {\"group\": \"%s\", ",
+				group->name);
+			sdo_poll__write_object(output, object);
+			fprintf(output, "}\n\n");
+			++n_events;
+		}
+
+	*gen = sdo_poll__gen;
+	return n_events;
+}
+
+static void sdo_poll__reply(struct rest_client* client,
+			    const char* status_code, const char* content_type,
+			    const char* content, size_t size)
+{
+	struct rest_reply_data reply = {
+		.status_code = status_code,
+		.content_type = content_type,
+		.content_length = size,
+		.content = content
+	};
+
+	rest_client_reply(client, &reply);
+	rest_client_done(client);
+}
+
+static void sdo_poll__reply_text(struct rest_client* client,
+				 const char* status_code, const char* message)
+{
+	sdo_poll__reply(client, status_code, "text/plain", message,
+			strlen(message));
+}
+
+static void sdo_poll__get(struct rest_client* client, const char* name)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+
+	const struct sdo_poll_group* group = name ? sdo_poll_find(name) : NULL;
+	if (name && !group) {
+		sdo_poll__reply_text(client, "404 Not Found",
+				     "No such group\r\n");
+		return;
+	}
+
+	FILE* output = open_memstream(&buffer, &size);
+	if (!output)
+		goto failure;
+
+	if (group) {
+		sdo_poll_write_json(output, group);
+	} else {
+		fprintf(output, "[");
+		for (group = sdo_poll__groups; group; group = group->next)
+			fprintf(output, "%s{\"name\": \"%s\", \"period\": %u, \"objects\": %zu}",
+				group == sdo_poll__groups ? "" : ", ",
+				group->name, group->period, group->n_objects);
+		fprintf(output, "]");
+	}
+
+	fprintf(output, "\r\n");
+
+	if (fclose(output) != 0)
+		goto failure;
+
+	sdo_poll__reply(client, "200 OK", "application/json", buffer, size);
+	free(buffer);
+	return;
+
+failure:
+	free(buffer);
+	sdo_poll__reply_text(client, "500 Internal Server Error",
+			     "Out of memory\r\n");
+}
+
+/* The body lists the objects; an empty one removes the group */
+static void sdo_poll__put(struct rest_client* client, const char* name,
+			  const void* content)
+{
+	size_t content_length = client->req.content_length;
+
+	const char* period_str = http_req_query(&client->req, "period");
+	unsigned int period = period_str ? strtoul(period_str, NULL, 0)
+					 : SDO_POLL_PERIOD_DEFAULT;
+
+	char* objects = malloc(content_length + 1);
+	if (!objects) {
+		sdo_poll__reply_text(client, "500 Internal Server Error",
+				     "Out of memory\r\n");
+		return;
+	}
+
+	memcpy(objects, content, content_length);
+	objects[content_length] = '\0';
+
+	if (sdo_poll__count_objects(objects) == 0) {
+		if (sdo_poll_remove(name) < 0)
+			sdo_poll__reply_text(client, "404 Not Found",
+					     "No such group\r\n");
+		else
+			sdo_poll__reply_text(client, "200 OK", "");
+		goto done;
+	}
+
+	struct sdo_poll_group* group = sdo_poll_group_new(name, period,
+							  objects);
+	if (!group) {
+		sdo_poll__reply_text(client, errno == EINVAL
+				     ? "400 Bad Request"
+				     : "500 Internal Server Error",
+				     errno == EINVAL
+				     ? "Invalid name, period or objects\r\n"
+				     : "Out of memory\r\n");
+		goto done;
+	}
+
+	if (sdo_poll_add(group) < 0)
+		sdo_poll__reply_text(client, "500 Internal Server Error",
+				     "Could not start polling\r\n");
+	else
+		sdo_poll__reply_text(client, "200 OK", "");
+
+done:
+	free(objects);
+}
+
+/* /poll lists the groups and /poll/<name> has the values of one */
+void sdo_poll_rest_service(struct rest_client* client, const void* content)
+{
+	const struct http_req* req = &client->req;
+	const char* name = req->url_index > 1 ? req->url[1] : NULL;
+
+	if (req->url_index > 2) {
+		sdo_poll__reply_text(client, "404 Not Found",
+				     "No such resource\r\n");
+		return;
+	}
+
+	switch (req->method) {
+	case HTTP_GET:
+		sdo_poll__get(client, name);
+		return;
+	case HTTP_PUT:
+		if (name) {
+			sdo_poll__put(client, name, content);
+			return;
+		}
+		break;
+	default:
+		break;
+	}
+
+	sdo_poll__reply_text(client, "405 Method Not Allowed",
+			     "Groups are read with GET and set with PUT /poll/<name>\r\n");
+}
+
+void sdo_poll_cleanup(void)
+{
+	while (sdo_poll__groups) {
+		struct sdo_poll_group* group = sdo_poll__groups;
+		sdo_poll__groups = group->next;
+		sdo_poll__stop(group);
+	}
+}
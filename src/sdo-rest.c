@@ -14,8 +14,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <pthread.h>
 #include <mloop.h>
 
 #include "canopen/sdo_req.h"
@@ -32,8 +36,15 @@ size_t strlcpy(char*, const char*, size_t);
 
 #define is_in_range(x, min, max) ((min) <= (x) && (x) <= (max))
 
+/* Values of this many objects are read before they are sent */
+#define SDO_REST_EDS_WINDOW 32
+
+/* No more than this many objects can be read in one bulk request */
+#define SDO_REST_BULK_MAX 256
+
 struct sdo_rest_path {
-	int nodeid, index, subindex;
+	struct co_master_node* node;
+	int index, subindex;
 };
 
 struct sdo_rest_context {
@@ -43,40 +54,52 @@ struct sdo_rest_context {
 };
 
 struct sdo_rest_eds_context {
-	unsigned int nodeid;
+	struct co_master_node* node;
 	struct rest_client* client;
 	const struct canopen_eds* eds;
-	char* buffer;
-	size_t length;
+	FILE* output;
 };
 
-static int sdo_rest__convert_path(struct sdo_rest_path* dst,
-				  const struct rest_client* client)
+/* The URL is either /sdo/... which addresses the first bus or
+ * /<iface>/sdo/... which addresses the bus on the given interface. The
+ * offset is set to the index of the first URL component after "sdo".
+ */
+static struct co_bus* sdo_rest__find_bus(size_t* offset,
+					 const struct rest_client* client)
 {
-	dst->nodeid = strtoul(client->req.url[1], NULL, 10);
-	dst->index = strtoul(client->req.url[2], NULL, 16);
-	dst->subindex = strtoul(client->req.url[3], NULL, 10);
+	const struct http_req* req = &client->req;
+
+	if (strcasecmp(req->url[0], "sdo") == 0) {
+		*offset = 1;
+		return co_master_get_n_buses() > 0 ? co_master_get_bus(0)
+						   : NULL;
+	}
+
+	if (req->url_index < 2 || strcasecmp(req->url[1], "sdo") != 0)
+		return NULL;
 
-	return (is_in_range(dst->nodeid, CANOPEN_NODEID_MIN, CANOPEN_NODEID_MAX)
-	     && dst->index >= 0x1000) ? 0 : -1;
+	*offset = 2;
+	return co_master_find_bus(req->url[0]);
 }
 
-static const struct canopen_eds* sdo_rest__find_eds(int nodeid)
+static struct co_master_node* sdo_rest__find_node(struct co_bus* bus,
+						  const char* str)
 {
-	struct co_master_node* node = co_master_get_node(nodeid);
-	assert(node);
-
-	const struct canopen_eds* eds;
+	unsigned int nodeid = strtoul(str, NULL, 10);
+	if (!is_in_range(nodeid, CANOPEN_NODEID_MIN, CANOPEN_NODEID_MAX))
+		return NULL;
 
-	if (node->vendor_id == 0)
-		return eds_db_find_by_name(node->name);
+	return co_bus_get_node(bus, nodeid);
+}
 
-	eds = eds_db_find(node->vendor_id, node->product_code,
-			  node->revision_number);
-	if (eds)
-		return eds;
+static int sdo_rest__convert_path(struct sdo_rest_path* dst,
+				  struct co_bus* bus, char* url[])
+{
+	dst->node = sdo_rest__find_node(bus, url[0]);
+	dst->index = strtoul(url[1], NULL, 16);
+	dst->subindex = strtoul(url[2], NULL, 10);
 
-	return eds_db_find(node->vendor_id, node->product_code, -1);
+	return (dst->node && dst->index >= 0x1000) ? 0 : -1;
 }
 
 static struct sdo_rest_context*
@@ -104,9 +127,9 @@ static void sdo_rest_not_found(struct rest_client* client, const char* message)
 		.content = message
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 static void sdo_rest_server_error(struct rest_client* client,
@@ -119,16 +142,16 @@ static void sdo_rest_server_error(struct rest_client* client,
 		.content = message
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 static const struct eds_obj*
 sdo_rest__get_eds_obj(const struct sdo_rest_path* path,
 		      struct rest_client* client)
 {
-	const struct canopen_eds* eds = sdo_rest__find_eds(path->nodeid);
+	const struct canopen_eds* eds = co_master_find_eds(path->node);
 	if (!eds) {
 		sdo_rest_server_error(client, "Could not find EDS for node\r\n");
 		return NULL;
@@ -154,9 +177,9 @@ static void sdo_rest_bad_request(struct rest_client* client,
 		.content = message
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 static void on_sdo_rest_upload_done(struct sdo_req* req)
@@ -194,9 +217,9 @@ static void on_sdo_rest_upload_done(struct sdo_req* req)
 		.content = message
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 
 done:
 	rest_client_unref(client);
@@ -209,10 +232,28 @@ static enum canopen_type sdo_rest__get_type(struct rest_client* client)
 	return type ? canopen_type_from_string(type) : CANOPEN_UNKNOWN;
 }
 
+/* Constant objects are cached for good. Read-only objects are cached for as
+ * long as the max_age query parameter says, in ms.
+ */
+static int sdo_rest__get_cache_max_age(struct rest_client* client,
+				       const struct eds_obj* obj)
+{
+	if (obj->access & EDS_OBJ_CONST)
+		return SDO_REQ_CACHE_FOREVER;
+
+	if (obj->access & EDS_OBJ_W)
+		return 0;
+
+	const char* str = http_req_query(&client->req, "max_age");
+	int max_age = str ? atoi(str) : 0;
+	return max_age > 0 ? max_age : 0;
+}
+
 static int sdo_rest__get(struct sdo_rest_context* context)
 {
 	struct rest_client* client = context->client;
 	struct sdo_rest_path* path = &context->path;
+	int cache_max_age = 0;
 
 	enum canopen_type type = sdo_rest__get_type(client);
 	if (type != CANOPEN_UNKNOWN) {
@@ -230,6 +271,7 @@ static int sdo_rest__get(struct sdo_rest_context* context)
 		}
 
 		context->type = eds_obj->type;
+		cache_max_age = sdo_rest__get_cache_max_age(client, eds_obj);
 	}
 
 	struct sdo_req_info info = {
@@ -237,7 +279,10 @@ static int sdo_rest__get(struct sdo_rest_context* context)
 		.index = path->index,
 		.subindex = path->subindex,
 		.on_done = on_sdo_rest_upload_done,
-		.context = context
+		.context = context,
+		.cache_max_age = cache_max_age,
+		.priority = SDO_REQ_PRIO_BACKGROUND,
+		.owner = client,
 	};
 
 	struct sdo_req* req = sdo_req_new(&info);
@@ -248,13 +293,14 @@ static int sdo_rest__get(struct sdo_rest_context* context)
 
 	rest_client_ref(client);
 
-	int rc = sdo_req_start(req, sdo_req_queue_get(path->nodeid));
-
-	if (sdo_req_unref(req) == 0) {
+	/* A cached value is replied to before this returns */
+	int rc = sdo_req_start(req, co_master_get_sdo_queue(path->node));
+	if (rc < 0) {
 		sdo_rest_server_error(client, "Failed to start sdo request\r\n");
 		rest_client_unref(client);
 	}
 
+	sdo_req_unref(req);
 	return rc;
 }
 
@@ -279,9 +325,9 @@ static void on_sdo_rest_download_done(struct sdo_req* req)
 		.content = ""
 	};
 
-	rest_reply(client->output, &reply);
+	rest_client_reply(client, &reply);
 
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 
 done:
 	rest_client_unref(client);
@@ -336,7 +382,9 @@ static int sdo_rest__put(struct sdo_rest_context* context, const void* content)
 		.on_done = on_sdo_rest_download_done,
 		.context = context,
 		.dl_data = data.data,
-		.dl_size = data.size
+		.dl_size = data.size,
+		.priority = SDO_REQ_PRIO_BACKGROUND,
+		.owner = client,
 	};
 
 	struct sdo_req* req = sdo_req_new(&info);
@@ -347,7 +395,7 @@ static int sdo_rest__put(struct sdo_rest_context* context, const void* content)
 
 	rest_client_ref(client);
 
-	int rc = sdo_req_start(req, sdo_req_queue_get(path->nodeid));
+	int rc = sdo_req_start(req, co_master_get_sdo_queue(path->node));
 
 	if (sdo_req_unref(req) == 0) {
 		sdo_rest_server_error(client, "Failed to start sdo request\r\n");
@@ -364,6 +412,7 @@ int sdo_rest__process(struct sdo_rest_context* context, const void* content)
 	switch (client->req.method) {
 	case HTTP_GET: return sdo_rest__get(context);
 	case HTTP_PUT: return sdo_rest__put(context, content);
+	case HTTP_POST:
 	case HTTP_OPTIONS:
 		       break;
 	}
@@ -372,45 +421,64 @@ int sdo_rest__process(struct sdo_rest_context* context, const void* content)
 	return -1;
 }
 
-ssize_t sdo_rest__read_value(FILE* out, unsigned int nodeid, int index,
-			     int subindex, enum canopen_type type)
+static int sdo_rest__has_value(const struct eds_obj* obj)
 {
-	struct sdo_req_info info = {
-		.type = SDO_REQ_UPLOAD,
-		.index = index,
-		.subindex = subindex
-	};
+	return !!(obj->access & (EDS_OBJ_CONST | EDS_OBJ_R));
+}
 
-	struct sdo_req* req = sdo_req_new(&info);
-	if (!req)
-		goto nomem;
+/* The values of up to n objects, starting at obj, are read as one batch, so
+ * that they do not get mixed up with other requests to the node.
+ */
+static struct sdo_batch* sdo_rest__read_values(struct sdo_req_queue* queue,
+					       struct rest_client* client,
+					       const struct canopen_eds* eds,
+					       const struct eds_obj* obj,
+					       size_t n)
+{
+	struct sdo_batch* batch = sdo_batch_new(NULL, NULL);
+	if (!batch)
+		return NULL;
+
+	batch->req.priority = SDO_REQ_PRIO_BACKGROUND;
+	batch->req.owner = client;
 
-	if (sdo_req_start(req, sdo_req_queue_get(nodeid)) < 0)
+	for (; obj && n > 0; obj = eds_obj_next(eds, obj), --n)
+		if (sdo_rest__has_value(obj))
+			if (sdo_batch_add_upload(batch, eds_obj_index(obj),
+						 eds_obj_subindex(obj)) < 0)
+				goto failure;
+
+	if (sdo_batch_start(batch, queue) < 0)
 		goto failure;
 
-	sdo_req_wait(req);
+	sdo_req_wait(&batch->req);
+	return batch;
+
+failure:
+	sdo_req_unref(&batch->req);
+	return NULL;
+}
 
-	if (req->status != SDO_REQ_OK)
+ssize_t sdo_rest__print_value(FILE* out, const struct sdo_batch_item* item,
+			      enum canopen_type type)
+{
+	if (!item || item->status != SDO_REQ_OK)
 		goto failure;
 
 	struct canopen_data data = {
 		.type = type,
-		.data = req->data.data,
-		.size = req->data.index,
-		.is_size_unknown = !req->is_size_indicated
+		.data = item->data.data,
+		.size = item->data.index,
+		.is_size_unknown = !item->is_size_indicated
 	};
 
-	char buffer[256];
-	char* str = canopen_data_tostring(buffer, sizeof(buffer), &data);
-	if (!str)
+	ssize_t length = canopen_data_write(out, &data, '"');
+	if (length < 0)
 		goto failure;
 
-	sdo_req_unref(req);
-	return fprintf(out, "\"%s\"", str);
+	return length;
 
 failure:
-	sdo_req_unref(req);
-nomem:
 	return fprintf(out, "null");
 }
 
@@ -445,27 +513,247 @@ static char* sdo_rest__clean_string(const char* str)
 	return string_keep_if(isprint, buffer);
 }
 
-void sdo_rest__eds_job(struct mloop_work* work)
+static void sdo_rest__print_eds_obj(FILE* out, const struct eds_obj* obj,
+				    int with_value,
+				    const struct sdo_batch_item* value)
 {
-	char* buffer = NULL;
-	size_t size = 0;
+	int is_const = !!(obj->access & EDS_OBJ_CONST);
+	int is_readable = !!(obj->access & EDS_OBJ_R);
+	int is_writable = !!(obj->access & EDS_OBJ_W);
+
+	int index = eds_obj_index(obj);
+	int subindex = eds_obj_subindex(obj);
+
+	fprintf(out, " \"%#x:%#x\": {\n", index, subindex);
+
+	fprintf(out, "  \"type\": %u,\n", obj->type);
+	if (is_const) {
+		fprintf(out, "  \"const\": true");
+	} else {
+		fprintf(out, "  \"read-write\": [%s, %s]",
+			       is_readable ? "true" : "false",
+			       is_writable ? "true" : "false");
+	}
+
+	if (sdo_rest__has_value(obj) && with_value) {
+		fprintf(out, ",\n  \"value\": ");
+		sdo_rest__print_value(out, value, obj->type);
+	}
+
+	if (obj->name) {
+		const char* clean_name;
+		const char* escaped_name;
+		clean_name = sdo_rest__clean_string(obj->name);
+		escaped_name = sdo_rest__escape_string(clean_name);
+
+		fprintf(out, ",\n  \"name\": \"%s\"", escaped_name);
+	}
+
+	if (obj->default_value)
+		fprintf(out, ",\n  \"default-value\": \"%s\"",
+			obj->default_value);
+
+	if (obj->low_limit)
+		fprintf(out, ",\n  \"low-limit\": \"%s\"", obj->low_limit);
+
+	if (obj->high_limit)
+		fprintf(out, ",\n  \"high-limit\": \"%s\"", obj->high_limit);
+
+	if (obj->unit)
+		fprintf(out, ",\n  \"unit\": \"%s\"", obj->unit);
+
+	if (obj->scaling)
+		fprintf(out, ",\n  \"scaling\": \"%s\"", obj->scaling);
+
+	fprintf(out, "\n }");
+}
+
+/* Without values, the JSON for an EDS never changes, so it is made the first
+ * time that it is asked for and kept until the EDS database is unloaded.
+ */
+struct sdo_rest_eds_json {
+	struct sdo_rest_eds_json* next;
+	const struct canopen_eds* eds;
+	char* data;
+	size_t size;
+	char etag[20];
+};
+
+static struct sdo_rest_eds_json* sdo_rest__eds_json_ = NULL;
+static pthread_mutex_t sdo_rest__eds_json_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t sdo_rest__hash(const char* data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static struct sdo_rest_eds_json*
+sdo_rest__render_eds_json(const struct canopen_eds* eds)
+{
+	struct sdo_rest_eds_json* json = malloc(sizeof(*json));
+	if (!json)
+		return NULL;
+
+	memset(json, 0, sizeof(*json));
+	json->eds = eds;
+
+	FILE* out = open_memstream(&json->data, &json->size);
+	if (!out)
+		goto failure;
+
+	fprintf(out, "{\n");
+
+	for (const struct eds_obj* obj = eds_obj_first(eds); obj;
+	     obj = eds_obj_next(eds, obj)) {
+		if (obj != eds_obj_first(eds))
+			fprintf(out, ",\n");
+
+		sdo_rest__print_eds_obj(out, obj, 0, NULL);
+	}
+
+	fprintf(out, "\n}\n");
 
+	if (fclose(out) != 0)
+		goto failure;
+
+	snprintf(json->etag, sizeof(json->etag), "\"%016llx\"",
+		 (unsigned long long)sdo_rest__hash(json->data, json->size));
+
+	return json;
+
+failure:
+	free(json->data);
+	free(json);
+	return NULL;
+}
+
+/* Called with the mutex held */
+static struct sdo_rest_eds_json*
+sdo_rest__lookup_eds_json(const struct canopen_eds* eds)
+{
+	struct sdo_rest_eds_json* json;
+
+	for (json = sdo_rest__eds_json_; json; json = json->next)
+		if (json->eds == eds)
+			break;
+
+	return json;
+}
+
+/* Returns NULL if the JSON has not been made yet */
+static const struct sdo_rest_eds_json*
+sdo_rest__find_eds_json(const struct canopen_eds* eds)
+{
+	pthread_mutex_lock(&sdo_rest__eds_json_mutex);
+	const struct sdo_rest_eds_json* json = sdo_rest__lookup_eds_json(eds);
+	pthread_mutex_unlock(&sdo_rest__eds_json_mutex);
+	return json;
+}
+
+static const struct sdo_rest_eds_json*
+sdo_rest__get_eds_json(const struct canopen_eds* eds)
+{
+	struct sdo_rest_eds_json* json;
+
+	pthread_mutex_lock(&sdo_rest__eds_json_mutex);
+
+	json = sdo_rest__lookup_eds_json(eds);
+	if (json)
+		goto done;
+
+	json = sdo_rest__render_eds_json(eds);
+	if (json) {
+		json->next = sdo_rest__eds_json_;
+		sdo_rest__eds_json_ = json;
+	}
+
+done:
+	pthread_mutex_unlock(&sdo_rest__eds_json_mutex);
+	return json;
+}
+
+void sdo_rest_cleanup(void)
+{
+	pthread_mutex_lock(&sdo_rest__eds_json_mutex);
+
+	while (sdo_rest__eds_json_) {
+		struct sdo_rest_eds_json* json = sdo_rest__eds_json_;
+		sdo_rest__eds_json_ = json->next;
+		free(json->data);
+		free(json);
+	}
+
+	pthread_mutex_unlock(&sdo_rest__eds_json_mutex);
+}
+
+static int sdo_rest__is_etag_match(const char* tags, const char* etag)
+{
+	return tags && (strcmp(tags, "*") == 0 || strstr(tags, etag));
+}
+
+/* The JSON is sent from where it is kept, along with the head */
+static int sdo_rest__reply_eds_json(struct rest_client* client,
+				    const struct sdo_rest_eds_json* json)
+{
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "application/json",
+		.content_length = json->size,
+		.content = json->data,
+		.etag = json->etag,
+	};
+
+	if (sdo_rest__is_etag_match(client->req.if_none_match, json->etag)) {
+		reply.status_code = "304 Not Modified";
+		reply.content_length = 0;
+	}
+
+	return rest_client_reply(client, &reply);
+}
+
+/* The reply is written as it is made, so that the client sees the first objects
+ * while values are still being read. Writes block the worker until the client
+ * takes them, and no more than a chunk is buffered here.
+ */
+void sdo_rest__eds_job(struct mloop_work* work)
+{
 	struct sdo_rest_eds_context* context = mloop_work_get_context(work);
 	const struct canopen_eds* eds = context->eds;
 	struct rest_client* client = context->client;
-	unsigned int nodeid = context->nodeid;
+	struct sdo_req_queue* queue = co_master_get_sdo_queue(context->node);
 
-	int is_const, is_readable, is_writable;
 	int with_value = http_req_query(&client->req, "with_value") != NULL;
 
-	int index, subindex;
-
-	FILE* out = open_memstream(&buffer, &size);
-	if (!out) {
-		sdo_rest_server_error(client, "Out of memory\r\n");
+	if (!with_value) {
+		const struct sdo_rest_eds_json* json = sdo_rest__get_eds_json(eds);
+		if (!json || sdo_rest__reply_eds_json(client, json) < 0)
+			mloop_work_cancel(work);
 		return;
 	}
 
+	struct sdo_batch* values = NULL;
+	size_t value_index = 0;
+	size_t window = 0;
+
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "application/json",
+		.content_length = -1,
+	};
+
+	rest_reply_header(context->output, &reply);
+
+	FILE* out = rest_open_chunked(context->output);
+	if (!out)
+		goto failure;
+
 	fprintf(out, "{\n");
 	const struct eds_obj* obj = eds_obj_first(eds);
 	if (!obj)
@@ -473,79 +761,47 @@ void sdo_rest__eds_job(struct mloop_work* work)
 
 	goto first_object;
 	do {
-		if (client->state == REST_CLIENT_DISCONNECTED)
+		if (client->state == REST_CLIENT_DISCONNECTED || ferror(out))
 			goto failure;
 
 		fprintf(out, ",\n");
 first_object:
-		is_const = !!(obj->access & EDS_OBJ_CONST);
-		is_readable = !!(obj->access & EDS_OBJ_R);
-		is_writable = !!(obj->access & EDS_OBJ_W);
-
-		index = eds_obj_index(obj);
-		subindex = eds_obj_subindex(obj);
-
-		fprintf(out, " \"%#x:%#x\": {\n", index, subindex);
-
-		fprintf(out, "  \"type\": %u,\n", obj->type);
-		if (is_const) {
-			fprintf(out, "  \"const\": true");
-		} else {
-			fprintf(out, "  \"read-write\": [%s, %s]",
-				       is_readable ? "true" : "false",
-				       is_writable ? "true" : "false");
+		if (window-- == 0) {
+			if (values)
+				sdo_req_unref(&values->req);
+
+			values = sdo_rest__read_values(queue, client, eds, obj,
+						       SDO_REST_EDS_WINDOW);
+			value_index = 0;
+			window = SDO_REST_EDS_WINDOW - 1;
 		}
 
-		if ((is_const || is_readable) && with_value) {
-			fprintf(out, ",\n  \"value\": ");
-			sdo_rest__read_value(out, nodeid, index,
-						    subindex, obj->type);
-		}
-
-		if (obj->name) {
-			const char* clean_name;
-			const char* escaped_name;
-			clean_name = sdo_rest__clean_string(obj->name);
-			escaped_name = sdo_rest__escape_string(clean_name);
-
-			fprintf(out, ",\n  \"name\": \"%s\"", escaped_name);
-		}
-
-		if (obj->default_value)
-			fprintf(out, ",\n  \"default-value\": \"%s\"",
-				obj->default_value);
-
-		if (obj->low_limit)
-			fprintf(out, ",\n  \"low-limit\": \"%s\"",
-				obj->low_limit);
+		sdo_rest__print_eds_obj(out, obj, 1, values ?
+			sdo_batch_get_item(values, value_index) : NULL);
 
-		if (obj->high_limit)
-			fprintf(out, ",\n  \"high-limit\": \"%s\"",
-				obj->high_limit);
+		if (sdo_rest__has_value(obj))
+			++value_index;
 
-		if (obj->unit)
-			fprintf(out, ",\n  \"unit\": \"%s\"", obj->unit);
-
-		if (obj->scaling)
-			fprintf(out, ",\n  \"scaling\": \"%s\"", obj->scaling);
-
-		fprintf(out, "\n }");
 		obj = eds_obj_next(eds, obj);
 	} while (obj);
 done:
 	fprintf(out, "\n}\n");
 
-	fclose(out);
+	if (fclose(out) != 0)
+		mloop_work_cancel(work);
 
-	context->buffer = buffer;
-	context->length = size;
+	if (values)
+		sdo_req_unref(&values->req);
 
 	return;
 
 failure:
+	/* The reply is left unfinished, so the client can tell */
 	mloop_work_cancel(work);
-	fclose(out);
-	free(buffer);
+	if (out)
+		fclose(out);
+	if (values)
+		sdo_req_unref(&values->req);
 	return;
 }
 
@@ -553,22 +809,11 @@ void sdo_rest__eds_job_done(struct mloop_work* work)
 {
 	struct sdo_rest_eds_context* context = mloop_work_get_context(work);
 	struct rest_client* client = context->client;
-	char* buffer = context->buffer;
-	size_t length = context->length;
 
 	if (client->state == REST_CLIENT_DISCONNECTED)
 		return;
 
-	struct rest_reply_data reply = {
-		.status_code = "200 OK",
-		.content_type = "application/json",
-		.content_length = length,
-		.content = buffer
-	};
-
-	rest_reply(client->output, &reply);
-
-	client->state = REST_CLIENT_DONE;
+	rest_client_done(client);
 }
 
 void sdo_rest__eds_job_free(void* ptr)
@@ -576,34 +821,49 @@ void sdo_rest__eds_job_free(void* ptr)
 	struct sdo_rest_eds_context* context = ptr;
 	struct rest_client* client = context->client;
 	rest_client_unref(client);
-	free(context->buffer);
+	fclose(context->output);
 	free(context);
 }
 
-int sdo_rest__send_eds(struct rest_client* client)
+int sdo_rest__send_eds(struct rest_client* client, struct co_bus* bus,
+		       char* url[])
 {
-	unsigned int nodeid = strtoul(client->req.url[1], NULL, 10);
-	if (!is_in_range(nodeid, CANOPEN_NODEID_MIN, CANOPEN_NODEID_MAX)) {
+	struct co_master_node* node = sdo_rest__find_node(bus, url[0]);
+	if (!node) {
 		sdo_rest_not_found(client, "URL is out of range\r\n");
 		return -1;
 	}
 
-	const struct canopen_eds* eds = sdo_rest__find_eds(nodeid);
+	const struct canopen_eds* eds = co_master_find_eds(node);
 	if (!eds) {
 		sdo_rest_server_error(client, "Could not find EDS for node\r\n");
 		return -1;
 	}
 
+	/* Only the first request for the JSON has to wait for it to be made */
+	const struct sdo_rest_eds_json* json = sdo_rest__find_eds_json(eds);
+	if (json && !http_req_query(&client->req, "with_value")) {
+		sdo_rest__reply_eds_json(client, json);
+		rest_client_done(client);
+		return 0;
+	}
+
 	struct sdo_rest_eds_context* context = malloc(sizeof(*context));
 	memset(context, 0, sizeof(*context));
 	context->client = client;
 	context->eds = eds;
-	context->nodeid = nodeid;
+	context->node = node;
+
+	context->output = rest_client_open_output(client);
+	if (!context->output) {
+		sdo_rest_server_error(client, "Could not open output\r\n");
+		goto failure;
+	}
 
 	struct mloop_work* work = mloop_work_new(mloop_default());
 	if (!work) {
 		sdo_rest_server_error(client, "Out of memory\r\n");
-		goto failure;
+		goto work_failure;
 	}
 
 	mloop_work_set_context(work, context, sdo_rest__eds_job_free);
@@ -616,25 +876,409 @@ int sdo_rest__send_eds(struct rest_client* client)
 	mloop_work_unref(work);
 	return 0;
 
+work_failure:
+	fclose(context->output);
 failure:
 	free(context);
 	return -1;
 }
 
+/* A bulk request names objects as <nodeid>:<index>:<subindex>, with the index
+ * in hex, or as <nodeid>:<name>, where the name is looked up in the node's EDS.
+ * The objects of each node are read as one batch, so the nodes are read from in
+ * parallel. Objects that can't be read get an error of their own in the reply.
+ */
+struct sdo_rest_bulk_item {
+	struct co_master_node* node;
+	int index, subindex;
+	enum canopen_type type;
+	size_t batch_index;
+	const char* error;
+};
+
+struct sdo_rest_bulk_context {
+	struct rest_client* client;
+	size_t n_pending;
+	size_t n_items;
+	struct sdo_batch* batch[CANOPEN_NODEID_MAX + 1];
+	struct sdo_rest_bulk_item items[SDO_REST_BULK_MAX];
+};
+
+static void sdo_rest__url_decode(char* str)
+{
+	char* dst = str;
+
+	for (; *str; ++str)
+		if (*str == '+') {
+			*dst++ = ' ';
+		} else if (*str == '%' && isxdigit(str[1]) && isxdigit(str[2])) {
+			char hex[3] = { str[1], str[2], '\0' };
+			*dst++ = strtoul(hex, NULL, 16);
+			str += 2;
+		} else {
+			*dst++ = *str;
+		}
+
+	*dst = '\0';
+}
+
+static void sdo_rest__resolve_bulk_item(struct sdo_rest_bulk_item* item,
+					struct co_bus* bus, char* str,
+					enum canopen_type type)
+{
+	char* end = NULL;
+	unsigned int nodeid = strtoul(str, &end, 10);
+	if (*end != ':' || end == str
+	 || !is_in_range(nodeid, CANOPEN_NODEID_MIN, CANOPEN_NODEID_MAX)) {
+		item->error = "Invalid node id";
+		return;
+	}
+
+	item->node = co_bus_get_node(bus, nodeid);
+
+	char* rest = end + 1;
+	item->index = strtoul(rest, &end, 16);
+	int is_numeric = end != rest && *end == ':';
+	if (is_numeric) {
+		rest = end + 1;
+		item->subindex = strtoul(rest, &end, 10);
+		is_numeric = end != rest && *end == '\0';
+	}
+
+	if (is_numeric && type != CANOPEN_UNKNOWN) {
+		item->type = type;
+		return;
+	}
+
+	const struct canopen_eds* eds = co_master_find_eds(item->node);
+	if (!eds) {
+		item->error = "Could not find EDS for node";
+		return;
+	}
+
+	const struct eds_obj* obj = is_numeric
+		? eds_obj_find(eds, item->index, item->subindex)
+		: eds_obj_find_by_name(eds, rest);
+	if (!obj) {
+		item->error = "Object not found in EDS";
+		return;
+	}
+
+	if (!sdo_rest__has_value(obj)) {
+		item->error = "Object is not readable";
+		return;
+	}
+
+	item->index = eds_obj_index(obj);
+	item->subindex = eds_obj_subindex(obj);
+	item->type = type != CANOPEN_UNKNOWN ? type : obj->type;
+}
+
+/* Items are separated by commas in the query and by commas or line breaks in
+ * the content.
+ */
+static int sdo_rest__parse_bulk_items(struct sdo_rest_bulk_context* context,
+				      struct co_bus* bus, char* str)
+{
+	struct rest_client* client = context->client;
+	enum canopen_type type = sdo_rest__get_type(client);
+	int is_query = client->req.method == HTTP_GET;
+	char* saveptr = NULL;
+
+	for (char* tok = strtok_r(str, ",\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, ",\r\n", &saveptr)) {
+		if (is_query)
+			sdo_rest__url_decode(tok);
+
+		tok = string_trim(tok);
+		if (*tok == '\0')
+			continue;
+
+		if (context->n_items >= SDO_REST_BULK_MAX)
+			return -1;
+
+		struct sdo_rest_bulk_item* item =
+			&context->items[context->n_items++];
+		sdo_rest__resolve_bulk_item(item, bus, tok, type);
+	}
+
+	return 0;
+}
+
+static void sdo_rest__print_bulk_item(FILE* out,
+				      struct sdo_rest_bulk_context* context,
+				      const struct sdo_rest_bulk_item* item)
+{
+	const struct sdo_batch_item* value = NULL;
+
+	if (item->node) {
+		int nodeid = co_master_get_node_id(item->node);
+		fprintf(out, "  \"node\": %d,\n", nodeid);
+
+		if (!item->error) {
+			value = sdo_batch_get_item(context->batch[nodeid],
+						   item->batch_index);
+			fprintf(out, "  \"index\": \"%#x\",\n", item->index);
+			fprintf(out, "  \"subindex\": \"%#x\",\n",
+				item->subindex);
+		}
+	}
+
+	const char* error = item->error;
+	if (!error && value->status != SDO_REQ_OK)
+		error = sdo_strerror(value->abort_code);
+
+	if (error) {
+		fprintf(out, "  \"status\": \"error\",\n");
+		fprintf(out, "  \"error\": \"%s\"", error);
+		return;
+	}
+
+	fprintf(out, "  \"status\": \"ok\",\n");
+	fprintf(out, "  \"value\": ");
+	sdo_rest__print_value(out, value, item->type);
+}
+
+static void sdo_rest__bulk_reply(struct sdo_rest_bulk_context* context)
+{
+	struct rest_client* client = context->client;
+	char* buffer = NULL;
+	size_t size = 0;
+
+	FILE* out = open_memstream(&buffer, &size);
+	if (!out) {
+		sdo_rest_server_error(client, "Out of memory\r\n");
+		return;
+	}
+
+	fprintf(out, "[\n");
+	for (size_t i = 0; i < context->n_items; ++i) {
+		fprintf(out, "%s {\n", i > 0 ? ",\n" : "");
+		sdo_rest__print_bulk_item(out, context, &context->items[i]);
+		fprintf(out, "\n }");
+	}
+	fprintf(out, "\n]\n");
+
+	if (fclose(out) != 0) {
+		free(buffer);
+		sdo_rest_server_error(client, "Out of memory\r\n");
+		return;
+	}
+
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "application/json",
+		.content_length = size,
+		.content = buffer
+	};
+
+	rest_client_reply(client, &reply);
+	free(buffer);
+
+	rest_client_done(client);
+}
+
+static void sdo_rest__bulk_free(struct sdo_rest_bulk_context* context)
+{
+	for (size_t i = 0; i <= CANOPEN_NODEID_MAX; ++i)
+		if (context->batch[i])
+			sdo_req_unref(&context->batch[i]->req);
+
+	rest_client_unref(context->client);
+	free(context);
+}
+
+/* The last batch to finish sends the reply */
+static void sdo_rest__bulk_release(struct sdo_rest_bulk_context* context)
+{
+	if (--context->n_pending > 0)
+		return;
+
+	if (context->client->state != REST_CLIENT_DISCONNECTED)
+		sdo_rest__bulk_reply(context);
+
+	sdo_rest__bulk_free(context);
+}
+
+static void on_sdo_rest_bulk_batch_done(struct sdo_req* req)
+{
+	sdo_rest__bulk_release(req->context);
+}
+
+static struct sdo_batch*
+sdo_rest__get_bulk_batch(struct sdo_rest_bulk_context* context, int nodeid)
+{
+	struct sdo_batch* batch = context->batch[nodeid];
+	if (batch)
+		return batch;
+
+	batch = sdo_batch_new(on_sdo_rest_bulk_batch_done, context);
+	if (!batch)
+		return NULL;
+
+	batch->req.priority = SDO_REQ_PRIO_BACKGROUND;
+	batch->req.owner = context->client;
+	context->batch[nodeid] = batch;
+	return batch;
+}
+
+static int sdo_rest__add_bulk_items(struct sdo_rest_bulk_context* context)
+{
+	for (size_t i = 0; i < context->n_items; ++i) {
+		struct sdo_rest_bulk_item* item = &context->items[i];
+		if (item->error)
+			continue;
+
+		int nodeid = co_master_get_node_id(item->node);
+		struct sdo_batch* batch = sdo_rest__get_bulk_batch(context,
+								   nodeid);
+		if (!batch)
+			return -1;
+
+		item->batch_index = sdo_batch_length(batch);
+		if (sdo_batch_add_upload(batch, item->index,
+					 item->subindex) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void sdo_rest__start_bulk(struct sdo_rest_bulk_context* context,
+				 struct co_bus* bus)
+{
+	/* Batches that finish right away must not send the reply early */
+	context->n_pending = 1;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i)
+		if (context->batch[i])
+			++context->n_pending;
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct sdo_batch* batch = context->batch[i];
+		if (!batch)
+			continue;
+
+		if (sdo_batch_start(batch, co_bus_get_sdo_queue(bus, i)) == 0)
+			continue;
+
+		for (size_t j = 0; j < context->n_items; ++j) {
+			struct sdo_rest_bulk_item* item = &context->items[j];
+			if (!item->error && item->node->nodeid == i)
+				item->error = "Failed to start sdo request";
+		}
+
+		sdo_rest__bulk_release(context);
+	}
+
+	sdo_rest__bulk_release(context);
+}
+
+int sdo_rest__bulk(struct rest_client* client, struct co_bus* bus,
+		   const void* content)
+{
+	const char* query = http_req_query(&client->req, "items");
+	size_t length = client->req.method == HTTP_GET
+		      ? (query ? strlen(query) : 0)
+		      : client->req.content_length;
+
+	char* str = malloc(length + 1);
+	if (!str) {
+		sdo_rest_server_error(client, "Out of memory\r\n");
+		return -1;
+	}
+
+	if (length > 0)
+		memcpy(str, client->req.method == HTTP_GET ? query : content,
+		       length);
+	str[length] = '\0';
+
+	struct sdo_rest_bulk_context* context = malloc(sizeof(*context));
+	if (!context) {
+		sdo_rest_server_error(client, "Out of memory\r\n");
+		goto context_failure;
+	}
+
+	memset(context, 0, sizeof(*context));
+	context->client = client;
+
+	if (sdo_rest__parse_bulk_items(context, bus, str) < 0) {
+		sdo_rest_bad_request(client, "Too many items\r\n");
+		goto failure;
+	}
+
+	if (context->n_items == 0) {
+		sdo_rest_bad_request(client, "No items were given\r\n");
+		goto failure;
+	}
+
+	if (sdo_rest__add_bulk_items(context) < 0) {
+		sdo_rest_server_error(client, "Out of memory\r\n");
+		goto failure;
+	}
+
+	free(str);
+
+	rest_client_ref(client);
+	sdo_rest__start_bulk(context, bus);
+	return 0;
+
+failure:
+	for (size_t i = 0; i <= CANOPEN_NODEID_MAX; ++i)
+		if (context->batch[i])
+			sdo_req_unref(&context->batch[i]->req);
+	free(context);
+context_failure:
+	free(str);
+	return -1;
+}
+
+/* Requests are made with the client as their owner, so whatever is still
+ * waiting or running for it is cancelled when it goes away, rather than taking
+ * up the bus for a reply that nobody reads.
+ */
+static void sdo_rest__on_disconnect(struct rest_client* client, void* context)
+{
+	struct co_bus* bus = context;
+	sdo_req_queues_cancel(bus->sdo_queue, client);
+}
+
 void sdo_rest_service(struct rest_client* client, const void* content)
 {
-	if (client->req.url_index == 2 && client->req.method == HTTP_GET) {
-		sdo_rest__send_eds(client);
+	size_t offset;
+	struct co_bus* bus = sdo_rest__find_bus(&offset, client);
+	if (!bus) {
+		sdo_rest_not_found(client, "No such bus\r\n");
+		return;
+	}
+
+	rest_client_set_disconnect_fn(client, sdo_rest__on_disconnect, bus);
+
+	char** url = &client->req.url[offset];
+	size_t url_index = client->req.url_index - offset;
+
+	if (url_index == 1 && strcasecmp(url[0], "bulk") == 0) {
+		sdo_rest__bulk(client, bus, content);
+		return;
+	}
+
+	if (client->req.method == HTTP_POST) {
+		sdo_rest_not_found(client, "Only [/<iface>]/sdo/bulk takes POST\r\n");
+		return;
+	}
+
+	if (url_index == 1 && client->req.method == HTTP_GET) {
+		sdo_rest__send_eds(client, bus, url);
 		return;
 	}
 
-	if (client->req.url_index < 4) {
-		sdo_rest_not_found(client, "Wrong URL format. Must be /sdo/<nodeid>/<index>/<subindex>\r\n");
+	if (url_index < 3) {
+		sdo_rest_not_found(client, "Wrong URL format. Must be [/<iface>]/sdo/<nodeid>/<index>/<subindex>\r\n");
 		return;
 	}
 
 	struct sdo_rest_path path;
-	if (sdo_rest__convert_path(&path, client) < 0) {
+	if (sdo_rest__convert_path(&path, bus, url) < 0) {
 		sdo_rest_not_found(client, "URL is out of range\r\n");
 		return;
 	}
@@ -0,0 +1,434 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "sdo-trace.h"
+#include "canopen.h"
+#include "canopen/sdo.h"
+
+enum st__phase {
+	ST__IDLE = 0,
+	ST__DL_INIT,
+	ST__DL_SEG,
+	ST__UL_INIT,
+	ST__UL_SEG,
+	ST__BLK_DL_INIT,
+	ST__BLK_DL_DATA,
+	ST__BLK_DL_END,
+	ST__BLK_UL_INIT,
+	ST__BLK_UL_START,
+	ST__BLK_UL_DATA,
+	ST__BLK_UL_END,
+};
+
+void st_init(struct sdo_tracker* self)
+{
+	memset(self, 0, sizeof(*self));
+}
+
+const char* st_type_to_string(enum st_type type)
+{
+	switch (type) {
+	case ST_DOWNLOAD:	return "download";
+	case ST_UPLOAD:		return "upload";
+	case ST_BLOCK_DOWNLOAD:	return "block-download";
+	case ST_BLOCK_UPLOAD:	return "block-upload";
+	default:		return "unknown";
+	}
+}
+
+static void st__request(struct st_node* node, uint64_t timestamp)
+{
+	node->request_time = timestamp;
+	node->transaction.end = timestamp;
+}
+
+static void st__respond(struct sdo_tracker* self, struct st_node* node,
+			uint64_t timestamp)
+{
+	struct st_stats* stats = &self->stats[node->transaction.node];
+
+	node->transaction.end = timestamp;
+
+	if (!node->request_time)
+		return;
+
+	uint64_t t = node->request_time;
+	ta_histogram_add(&stats->response, timestamp > t ? timestamp - t : 0);
+	node->request_time = 0;
+}
+
+static int st__finish(struct sdo_tracker* self, struct st_node* node,
+		      enum st_result result, struct st_transaction* out)
+{
+	struct st_transaction* transaction = &node->transaction;
+	struct st_stats* stats = &self->stats[transaction->node];
+
+	transaction->result = result;
+
+	stats->n_transactions++;
+	if (result == ST_ABORTED)
+		stats->n_aborts++;
+
+	if (result == ST_DONE)
+		ta_histogram_add(&stats->duration,
+				 transaction->end - transaction->start);
+
+	*out = *transaction;
+	node->phase = ST__IDLE;
+	node->request_time = 0;
+	return 1;
+}
+
+/* Whatever was going on is cut short */
+static int st__begin(struct sdo_tracker* self, struct st_node* node, int id,
+		     enum st_type type, int phase, const struct can_frame* cf,
+		     uint64_t timestamp, struct st_transaction* out)
+{
+	int rc = 0;
+
+	if (node->phase != ST__IDLE)
+		rc = st__finish(self, node, ST_INTERRUPTED, out);
+
+	struct st_transaction* transaction = &node->transaction;
+	memset(transaction, 0, sizeof(*transaction));
+
+	transaction->node = id;
+	transaction->type = type;
+	transaction->index = sdo_get_index(cf);
+	transaction->subindex = sdo_get_subindex(cf);
+	transaction->start = timestamp;
+
+	node->phase = phase;
+	node->is_expediated = 0;
+	node->is_last = 0;
+	st__request(node, timestamp);
+	return rc;
+}
+
+static size_t st__get_expediated_size(const struct can_frame* cf)
+{
+	return sdo_is_size_indicated(cf) ? sdo_get_expediated_size(cf) : 4;
+}
+
+/* Only aborts from the server count as responses */
+static int st__abort(struct sdo_tracker* self, struct st_node* node, int id,
+		     const struct can_frame* cf, uint64_t timestamp,
+		     int is_response, struct st_transaction* out)
+{
+	/* Tracing began in the middle of the transfer */
+	if (node->phase == ST__IDLE) {
+		st__begin(self, node, id, ST_UNKNOWN, ST__IDLE, cf, timestamp,
+			  out);
+		node->request_time = 0;
+	}
+
+	if (is_response)
+		st__respond(self, node, timestamp);
+	else
+		node->transaction.end = timestamp;
+
+	node->transaction.abort_code = sdo_get_abort_code(cf);
+	return st__finish(self, node, ST_ABORTED, out);
+}
+
+static void st__block_segment(struct st_node* node, const struct can_frame* cf)
+{
+	node->transaction.n_segments++;
+	node->transaction.size += SDO_SEGMENT_MAX_SIZE;
+	node->is_last = sdo_is_last_block_segment(cf);
+}
+
+static size_t st__block_unused_size(const struct st_node* node,
+				    const struct can_frame* cf)
+{
+	size_t unused = sdo_get_block_unused_size(cf);
+	return unused < node->transaction.size ? unused
+					       : node->transaction.size;
+}
+
+static int st__on_block_download_request(struct sdo_tracker* self,
+					 struct st_node* node, int id,
+					 const struct can_frame* cf,
+					 uint64_t timestamp,
+					 struct st_transaction* out)
+{
+	if (!sdo_is_block_end(cf))
+		return st__begin(self, node, id, ST_BLOCK_DOWNLOAD,
+				 ST__BLK_DL_INIT, cf, timestamp, out);
+
+	if (node->phase == ST__BLK_DL_END) {
+		node->transaction.size -= st__block_unused_size(node, cf);
+		st__request(node, timestamp);
+	}
+
+	return 0;
+}
+
+static int st__on_block_upload_request(struct sdo_tracker* self,
+				       struct st_node* node, int id,
+				       const struct can_frame* cf,
+				       uint64_t timestamp,
+				       struct st_transaction* out)
+{
+	switch (sdo_get_block_cs(cf)) {
+	case SDO_BLOCK_INIT:
+		return st__begin(self, node, id, ST_BLOCK_UPLOAD,
+				 ST__BLK_UL_INIT, cf, timestamp, out);
+	case SDO_BLOCK_START:
+		if (node->phase != ST__BLK_UL_START)
+			return 0;
+
+		node->phase = ST__BLK_UL_DATA;
+		st__request(node, timestamp);
+		return 0;
+	case SDO_BLOCK_ACK:
+		if (node->phase != ST__BLK_UL_DATA)
+			return 0;
+
+		if (node->is_last)
+			node->phase = ST__BLK_UL_END;
+
+		st__request(node, timestamp);
+		return 0;
+	case SDO_BLOCK_END:
+		if (node->phase != ST__BLK_UL_END)
+			return 0;
+
+		node->transaction.end = timestamp;
+		return st__finish(self, node, ST_DONE, out);
+	}
+
+	return 0;
+}
+
+/* Frames from the client to the server */
+static int st__on_request(struct sdo_tracker* self, struct st_node* node,
+			  int id, const struct can_frame* cf,
+			  uint64_t timestamp, struct st_transaction* out)
+{
+	struct st_transaction* transaction = &node->transaction;
+
+	if (node->phase == ST__BLK_DL_DATA && !sdo_is_block_abort(cf)) {
+		st__block_segment(node, cf);
+		st__request(node, timestamp);
+		return 0;
+	}
+
+	int rc;
+
+	switch (sdo_get_cs(cf)) {
+	case SDO_CCS_DL_INIT_REQ:
+		rc = st__begin(self, node, id, ST_DOWNLOAD, ST__DL_INIT, cf,
+			       timestamp, out);
+
+		if (sdo_is_expediated(cf)) {
+			node->is_expediated = 1;
+			transaction->size = st__get_expediated_size(cf);
+		}
+
+		return rc;
+	case SDO_CCS_DL_SEG_REQ:
+		if (node->phase != ST__DL_SEG)
+			return 0;
+
+		transaction->n_segments++;
+		transaction->size += sdo_get_segment_size(cf);
+		node->is_last = sdo_is_end_segment(cf);
+		st__request(node, timestamp);
+		return 0;
+	case SDO_CCS_UL_INIT_REQ:
+		return st__begin(self, node, id, ST_UPLOAD, ST__UL_INIT, cf,
+				 timestamp, out);
+	case SDO_CCS_UL_SEG_REQ:
+		if (node->phase == ST__UL_SEG)
+			st__request(node, timestamp);
+		return 0;
+	case SDO_CCS_ABORT:
+		return st__abort(self, node, id, cf, timestamp, 0, out);
+	case SDO_CCS_BLK_DL_REQ:
+		return st__on_block_download_request(self, node, id, cf,
+						     timestamp, out);
+	case SDO_CCS_BLK_UL_REQ:
+		return st__on_block_upload_request(self, node, id, cf,
+						   timestamp, out);
+	}
+
+	return 0;
+}
+
+static int st__on_block_response(struct sdo_tracker* self,
+				 struct st_node* node,
+				 const struct can_frame* cf,
+				 uint64_t timestamp,
+				 struct st_transaction* out)
+{
+	int cs = sdo_get_block_cs(cf);
+
+	if (node->phase == ST__BLK_DL_INIT && cs == SDO_BLOCK_INIT) {
+		st__respond(self, node, timestamp);
+		node->phase = ST__BLK_DL_DATA;
+	} else if (node->phase == ST__BLK_DL_DATA && cs == SDO_BLOCK_ACK) {
+		st__respond(self, node, timestamp);
+		if (node->is_last)
+			node->phase = ST__BLK_DL_END;
+	} else if (node->phase == ST__BLK_DL_END && cs == SDO_BLOCK_END) {
+		st__respond(self, node, timestamp);
+		return st__finish(self, node, ST_DONE, out);
+	}
+
+	return 0;
+}
+
+/* During upload, the server sends the sub-commands in the lowest bit only */
+static void st__on_block_upload_response(struct sdo_tracker* self,
+					 struct st_node* node,
+					 const struct can_frame* cf,
+					 uint64_t timestamp)
+{
+	if (node->phase == ST__BLK_UL_INIT && !sdo_is_block_end(cf)) {
+		st__respond(self, node, timestamp);
+		node->phase = ST__BLK_UL_START;
+	} else if (node->phase == ST__BLK_UL_END && sdo_is_block_end(cf)) {
+		st__respond(self, node, timestamp);
+		node->transaction.size -= st__block_unused_size(node, cf);
+	}
+}
+
+/* Frames from the server to the client */
+static int st__on_response(struct sdo_tracker* self, struct st_node* node,
+			   int id, const struct can_frame* cf,
+			   uint64_t timestamp, struct st_transaction* out)
+{
+	struct st_transaction* transaction = &node->transaction;
+
+	if (node->phase == ST__BLK_UL_DATA && !sdo_is_block_abort(cf)) {
+		st__respond(self, node, timestamp);
+		st__block_segment(node, cf);
+		return 0;
+	}
+
+	switch (sdo_get_cs(cf)) {
+	case SDO_SCS_DL_INIT_RES:
+		if (node->phase != ST__DL_INIT)
+			return 0;
+
+		st__respond(self, node, timestamp);
+		if (node->is_expediated)
+			return st__finish(self, node, ST_DONE, out);
+
+		node->phase = ST__DL_SEG;
+		return 0;
+	case SDO_SCS_DL_SEG_RES:
+		if (node->phase != ST__DL_SEG)
+			return 0;
+
+		st__respond(self, node, timestamp);
+		return node->is_last ? st__finish(self, node, ST_DONE, out) : 0;
+	case SDO_SCS_UL_INIT_RES:
+		if (node->phase != ST__UL_INIT)
+			return 0;
+
+		st__respond(self, node, timestamp);
+		if (sdo_is_expediated(cf)) {
+			transaction->size = st__get_expediated_size(cf);
+			return st__finish(self, node, ST_DONE, out);
+		}
+
+		node->phase = ST__UL_SEG;
+		return 0;
+	case SDO_SCS_UL_SEG_RES:
+		if (node->phase != ST__UL_SEG)
+			return 0;
+
+		st__respond(self, node, timestamp);
+		transaction->n_segments++;
+		transaction->size += sdo_get_segment_size(cf);
+		return sdo_is_end_segment(cf)
+		     ? st__finish(self, node, ST_DONE, out) : 0;
+	case SDO_SCS_ABORT:
+		return st__abort(self, node, id, cf, timestamp, 1, out);
+	case SDO_SCS_BLK_DL_RES:
+		return st__on_block_response(self, node, cf, timestamp, out);
+	case SDO_SCS_BLK_UL_RES:
+		st__on_block_upload_response(self, node, cf, timestamp);
+		return 0;
+	}
+
+	return 0;
+}
+
+int st_feed(struct sdo_tracker* self, const struct can_frame* cf,
+	    uint64_t timestamp, struct st_transaction* transaction)
+{
+	struct canopen_msg msg;
+
+	if (cf->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG) || cf->can_dlc < 1)
+		return 0;
+
+	if (canopen_get_object_type(&msg, cf) < 0 || msg.id < 1)
+		return 0;
+
+	struct st_node* node = &self->nodes[msg.id];
+
+	switch (msg.object) {
+	case CANOPEN_RSDO:
+		return st__on_request(self, node, msg.id, cf, timestamp,
+				      transaction);
+	case CANOPEN_TSDO:
+		return st__on_response(self, node, msg.id, cf, timestamp,
+				       transaction);
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static void st__print_latency(const struct ta_histogram* self, FILE* stream)
+{
+	if (self->count == 0) {
+		fprintf(stream, " %8s %8s %8s", "-", "-", "-");
+		return;
+	}
+
+	fprintf(stream, " %8llu %8llu %8llu",
+		(unsigned long long)ta_histogram_get_percentile(self, 50),
+		(unsigned long long)ta_histogram_get_percentile(self, 99),
+		(unsigned long long)self->max);
+}
+
+/* Percentiles are the upper ends of the histogram buckets they fall into */
+void st_print_stats(const struct sdo_tracker* self, FILE* stream)
+{
+	fprintf(stream, "SDO transactions per node (us):\n");
+	fprintf(stream, "  node    count   aborts  response p50/p99/max"
+			"        duration p50/p99/max\n");
+
+	for (int i = 1; i < 128; ++i) {
+		const struct st_stats* stats = &self->stats[i];
+		if (stats->n_transactions == 0 && stats->response.count == 0)
+			continue;
+
+		fprintf(stream, "  %4d %8llu %8llu ", i,
+			(unsigned long long)stats->n_transactions,
+			(unsigned long long)stats->n_aborts);
+		st__print_latency(&stats->response, stream);
+		fprintf(stream, "   ");
+		st__print_latency(&stats->duration, stream);
+		fprintf(stream, "\n");
+	}
+}
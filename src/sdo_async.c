@@ -18,6 +18,8 @@
  * Features:
  * - Converts between plain data buffers and SDO transactions.
  * - Chooses expediated/segmented mode based on data size.
+ * - Block transfer with CRC when requested, falling back to segmented mode if
+ *   the server does not support it.
  * - Automatic timeout with abort.
  * - Enforces correct communication according to standard.
  * - Validates data according to state and aborts when receiving unexpected
@@ -27,12 +29,14 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <mloop.h>
 #include "canopen/sdo.h"
 #include "canopen/sdo_async.h"
 #include "canopen.h"
 #include "net-util.h"
 #include "sock.h"
+#include "time-utils.h"
 
 #define MIN(a, b) ((a) < (b)) ? (a) : (b);
 
@@ -47,6 +51,9 @@ static int sdo_async__send(struct sdo_async* self, struct can_frame* cf)
 	if (self->quirks & SDO_ASYNC_QUIRK_NEEDS_FULL_FRAME)
 		cf->can_dlc = CAN_MAX_DLC;
 
+	if (self->rtt)
+		self->request_time = gettime_us(CLOCK_MONOTONIC);
+
 	return sock_send(&self->sock, cf, 0);
 }
 
@@ -62,6 +69,7 @@ int sdo_async_stop(struct sdo_async* self)
 		self->free_fn(self->context);
 
 	self->is_running = 0;
+	self->is_late_response_possible = 1;
 
 	return 0;
 }
@@ -89,7 +97,7 @@ static inline void sdo_async__init_frame(const struct sdo_async* self,
 					 struct can_frame* cf)
 {
 	sdo_clear_frame(cf);
-	cf->can_id = R_RSDO + self->nodeid;
+	cf->can_id = self->request_cob;
 }
 
 static int sdo_async__abort(struct sdo_async* self, enum sdo_abort_code code)
@@ -105,12 +113,54 @@ static int sdo_async__abort(struct sdo_async* self, enum sdo_abort_code code)
 	return -1;
 }
 
+int sdo_async_abort(struct sdo_async* self, enum sdo_abort_code code)
+{
+	if (!self->is_running)
+		return -1;
+
+	self->is_late_response_possible = 1;
+	sdo_async__abort(self, code);
+	return 0;
+}
+
 void sdo_async__on_timeout(struct mloop_timer* timer)
 {
 	struct sdo_async* self = mloop_timer_get_context(timer);
+
+	self->seen.n_timeouts++;
+	self->is_late_response_possible = 1;
+
+	if (self->rtt)
+		sdo_rtt_on_timeout(self->rtt);
+
 	sdo_async__abort(self, SDO_ABORT_TIMEOUT);
 }
 
+/* A response for another object is let through if the server is known to
+ * get the multiplexer wrong
+ */
+static int sdo_async__is_other_object(struct sdo_async* self, int index,
+				      int subindex)
+{
+	int is_late_response_possible = self->is_late_response_possible;
+	self->is_late_response_possible = 0;
+
+	if (index == self->index && subindex == self->subindex) {
+		self->seen.n_mux_matches++;
+		return 0;
+	}
+
+	if (!is_late_response_possible)
+		self->seen.n_mux_mismatches++;
+
+	return !(self->quirks & SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER);
+}
+
+int sdo_async_is_multiplexer_mixed_up(const struct sdo_async_seen* seen)
+{
+	return seen->n_mux_mismatches > 0 && seen->n_mux_matches == 0;
+}
+
 int sdo_async_init(struct sdo_async* self, const struct sock* sock, int nodeid)
 {
 	memset(self, 0, sizeof(*self));
@@ -124,6 +174,8 @@ int sdo_async_init(struct sdo_async* self, const struct sock* sock, int nodeid)
 
 	self->sock = *sock;
 	self->nodeid = nodeid;
+	self->request_cob = R_RSDO + nodeid;
+	self->response_cob = R_TSDO + nodeid;
 	mloop_timer_set_context(self->timer, self, NULL);
 	mloop_timer_set_callback(self->timer, sdo_async__on_timeout);
 
@@ -142,7 +194,7 @@ void sdo_async_destroy(struct sdo_async* self)
 
 static inline int sdo_async__is_expediated(const struct sdo_async* self)
 {
-	return self->buffer.index <= SDO_EXPEDIATED_DATA_SIZE;
+	return self->dl_size <= SDO_EXPEDIATED_DATA_SIZE;
 }
 
 int sdo_async__send_init_dl(struct sdo_async* self)
@@ -155,12 +207,12 @@ int sdo_async__send_init_dl(struct sdo_async* self)
 	sdo_indicate_size(&cf);
 	if (sdo_async__is_expediated(self)) {
 		sdo_expediate(&cf);
-		sdo_set_expediated_size(&cf, self->buffer.index);
-		cf.can_dlc = SDO_EXPEDIATED_DATA_IDX + self->buffer.index;
-		memcpy(&cf.data[SDO_EXPEDIATED_DATA_IDX], self->buffer.data,
-		       self->buffer.index);
+		sdo_set_expediated_size(&cf, self->dl_size);
+		cf.can_dlc = SDO_EXPEDIATED_DATA_IDX + self->dl_size;
+		memcpy(&cf.data[SDO_EXPEDIATED_DATA_IDX], self->dl_data,
+		       self->dl_size);
 	} else {
-		sdo_set_indicated_size(&cf, self->buffer.index);
+		sdo_set_indicated_size(&cf, self->dl_size);
 		cf.can_dlc = CAN_MAX_DLC;
 	}
 	mloop_timer_start(self->timer);
@@ -181,11 +233,47 @@ int sdo_async__send_init_ul(struct sdo_async* self)
 	return 0;
 }
 
+int sdo_async__send_block_init_dl(struct sdo_async* self)
+{
+	struct can_frame cf;
+	sdo_async__init_frame(self, &cf);
+	sdo_set_cs(&cf, SDO_CCS_BLK_DL_REQ);
+	sdo_set_block_crc_supported(&cf);
+	sdo_indicate_block_size(&cf);
+	sdo_set_index(&cf, self->index);
+	sdo_set_subindex(&cf, self->subindex);
+	sdo_set_indicated_size(&cf, self->dl_size);
+	cf.can_dlc = CAN_MAX_DLC;
+	mloop_timer_start(self->timer);
+	sdo_async__send(self, &cf);
+	return 0;
+}
+
+int sdo_async__send_block_init_ul(struct sdo_async* self)
+{
+	struct can_frame cf;
+	sdo_async__init_frame(self, &cf);
+	sdo_set_cs(&cf, SDO_CCS_BLK_UL_REQ);
+	sdo_set_block_crc_supported(&cf);
+	sdo_set_index(&cf, self->index);
+	sdo_set_subindex(&cf, self->subindex);
+	cf.data[SDO_BLOCK_SIZE_IDX] = SDO_BLOCK_MAX_SIZE;
+	cf.data[SDO_BLOCK_PST_IDX] = SDO_EXPEDIATED_DATA_SIZE;
+	cf.can_dlc = CAN_MAX_DLC;
+	mloop_timer_start(self->timer);
+	sdo_async__send(self, &cf);
+	return 0;
+}
+
 int sdo_async__send_init(struct sdo_async* self)
 {
 	switch (self->type) {
-	case SDO_REQ_DOWNLOAD: return sdo_async__send_init_dl(self);
-	case SDO_REQ_UPLOAD: return sdo_async__send_init_ul(self);
+	case SDO_REQ_DOWNLOAD:
+		return self->is_block ? sdo_async__send_block_init_dl(self)
+				      : sdo_async__send_init_dl(self);
+	case SDO_REQ_UPLOAD:
+		return self->is_block ? sdo_async__send_block_init_ul(self)
+				      : sdo_async__send_init_ul(self);
 	}
 
 	abort();
@@ -207,14 +295,33 @@ int sdo_async_start(struct sdo_async* self, const struct sdo_async_info* info)
 	self->index = info->index;
 	self->subindex = info->subindex;
 	self->is_size_indicated = 0;
+	self->is_paused = 0;
+	self->crc = 0;
+	self->start_time = gettime_us(CLOCK_MONOTONIC);
 	mloop_timer_set_time(self->timer, info->timeout * 1000000ULL);
 
-	if (info->type == SDO_REQ_DOWNLOAD)
+	self->on_data = info->type == SDO_REQ_UPLOAD ? info->on_data : NULL;
+	self->chunk_size = info->chunk_size ? info->chunk_size
+					    : SDO_ASYNC_CHUNK_SIZE;
+
+	if (info->type == SDO_REQ_DOWNLOAD && info->is_data_borrowed) {
+		vector_clear(&self->buffer);
+		self->dl_data = info->data;
+		self->dl_size = info->size;
+	} else if (info->type == SDO_REQ_DOWNLOAD) {
 		vector_assign(&self->buffer, info->data, info->size);
-	else
+		self->dl_data = self->buffer.data;
+		self->dl_size = self->buffer.index;
+	} else {
 		vector_clear(&self->buffer);
+	}
 
-	self->comm_state = SDO_ASYNC_COMM_INIT_RESPONSE;
+	self->is_block = info->use_block && !self->is_block_unsupported;
+	if (info->type == SDO_REQ_DOWNLOAD && sdo_async__is_expediated(self))
+		self->is_block = 0;
+
+	self->comm_state = self->is_block ? SDO_ASYNC_COMM_BLOCK_INIT_RESPONSE
+					  : SDO_ASYNC_COMM_INIT_RESPONSE;
 
 	self->is_running = 1;
 
@@ -225,7 +332,7 @@ int sdo_async_start(struct sdo_async* self, const struct sdo_async_info* info)
 
 static inline int sdo_async__is_at_end(const struct sdo_async* self)
 {
-	return self->pos >= self->buffer.index;
+	return self->pos >= self->dl_size;
 }
 
 int sdo_async__request_dl_segment(struct sdo_async* self)
@@ -235,11 +342,12 @@ int sdo_async__request_dl_segment(struct sdo_async* self)
 	sdo_set_cs(&cf, SDO_CCS_DL_SEG_REQ);
 	if (self->is_toggled) sdo_toggle(&cf);
 
-	size_t size = MIN(SDO_SEGMENT_MAX_SIZE, self->buffer.index - self->pos);
+	size_t size = MIN(SDO_SEGMENT_MAX_SIZE, self->dl_size - self->pos);
 	assert(size > 0);
 
 	sdo_set_segment_size(&cf, size);
-	memcpy(&cf.data[SDO_SEGMENT_IDX], self->buffer.data + self->pos, size);
+	memcpy(&cf.data[SDO_SEGMENT_IDX],
+	       (const char*)self->dl_data + self->pos, size);
 
 	cf.can_dlc = SDO_SEGMENT_IDX + size;
 	self->pos += size;
@@ -266,9 +374,8 @@ int sdo_async__feed_init_dl_response(struct sdo_async* self,
 	if (cs != SDO_SCS_DL_INIT_RES)
 		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
 
-	if (!(self->quirks & SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER))
-		if (index != self->index || subindex != self->subindex)
-			return sdo_async__abort(self, SDO_ABORT_GENERAL);
+	if (sdo_async__is_other_object(self, index, subindex))
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
 
 	if (sdo_async__is_expediated(self)) {
 		self->status = SDO_REQ_OK;
@@ -281,6 +388,49 @@ int sdo_async__feed_init_dl_response(struct sdo_async* self,
 	return 0;
 }
 
+/* Pass the buffered data on once there is a whole chunk of it, or all of it at
+ * the end. During block uploads, the last segment is held back until the end
+ * because only then is it known how much of it is used.
+ *
+ * Returns -1 if the transfer was aborted and 1 if it should be paused.
+ */
+static int sdo_async__stream(struct sdo_async* self, int is_end)
+{
+	size_t keep = !is_end && self->is_block ? SDO_SEGMENT_MAX_SIZE : 0;
+	if (self->buffer.index <= keep)
+		return 0;
+
+	size_t size = self->buffer.index - keep;
+	if (!is_end && size < self->chunk_size)
+		return 0;
+
+	/* The end of the transfer checks the rest */
+	if (!is_end && self->is_block && self->is_crc_used)
+		self->crc = sdo_crc16(self->crc, self->buffer.data, size);
+
+	int rc = self->on_data(self, self->buffer.data, size);
+	if (!self->is_running)
+		return -1;
+
+	if (rc < 0)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	memmove(self->buffer.data, (char*)self->buffer.data + size, keep);
+	self->buffer.index = keep;
+
+	return rc > 0;
+}
+
+static int sdo_async__finish_ul(struct sdo_async* self)
+{
+	if (self->on_data && sdo_async__stream(self, 1) < 0)
+		return -1;
+
+	self->status = SDO_REQ_OK;
+	sdo_async__on_done(self);
+	return 0;
+}
+
 int sdo_async__handle_expediated_ul(struct sdo_async* self,
 				    const struct can_frame* cf)
 {
@@ -291,9 +441,7 @@ int sdo_async__handle_expediated_ul(struct sdo_async* self,
 	assert(size <= SDO_EXPEDIATED_DATA_SIZE);
 	vector_assign(&self->buffer, &cf->data[SDO_EXPEDIATED_DATA_IDX],
 		      size);
-	self->status = SDO_REQ_OK;
-	sdo_async__on_done(self);
-	return 0;
+	return sdo_async__finish_ul(self);
 }
 
 int sdo_async__request_ul_segment(struct sdo_async* self)
@@ -312,7 +460,8 @@ int sdo_async__handle_init_segmented_ul(struct sdo_async* self,
 					const struct can_frame* cf)
 {
 	self->is_size_indicated = sdo_is_size_indicated(cf);
-	if (self->is_size_indicated && cf->can_dlc == CAN_MAX_DLC)
+	if (self->is_size_indicated && cf->can_dlc == CAN_MAX_DLC
+	 && !self->on_data)
 		if (vector_reserve(&self->buffer, sdo_get_indicated_size(cf)) < 0)
 			return sdo_async__abort(self, SDO_ABORT_NOMEM);
 
@@ -335,9 +484,8 @@ int sdo_async__feed_init_ul_response(struct sdo_async* self,
 	if (cs != SDO_SCS_UL_INIT_RES)
 		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
 
-	if (!(self->quirks & SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER))
-		if (index != self->index || subindex != self->subindex)
-			return sdo_async__abort(self, SDO_ABORT_GENERAL);
+	if (sdo_async__is_other_object(self, index, subindex))
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
 
 	return sdo_is_expediated(cf)
 	     ? sdo_async__handle_expediated_ul(self, cf)
@@ -401,12 +549,17 @@ int sdo_async__feed_ul_seg_response(struct sdo_async* self,
 	if (vector_append(&self->buffer, data, size) < 0)
 		return sdo_async__abort(self, SDO_ABORT_NOMEM);
 
-	if (sdo_is_end_segment(cf)) {
-		self->status = SDO_REQ_OK;
-		sdo_async__on_done(self);
-	} else {
+	if (sdo_is_end_segment(cf))
+		return sdo_async__finish_ul(self);
+
+	int rc = self->on_data ? sdo_async__stream(self, 0) : 0;
+	if (rc < 0)
+		return -1;
+
+	if (rc > 0)
+		self->is_paused = 1;
+	else
 		sdo_async__request_ul_segment(self);
-	}
 
 	return 0;
 }
@@ -423,16 +576,370 @@ int sdo_async__feed_seg_response(struct sdo_async* self,
 	return -1;
 }
 
+int sdo_async__send_dl_block(struct sdo_async* self)
+{
+	self->block_pos = self->pos;
+	self->seqno = 0;
+
+	do {
+		struct can_frame cf;
+		sdo_async__init_frame(self, &cf);
+
+		size_t size = MIN(SDO_SEGMENT_MAX_SIZE,
+				  self->dl_size - self->pos);
+		memcpy(&cf.data[SDO_SEGMENT_IDX],
+		       (const char*)self->dl_data + self->pos, size);
+		self->pos += size;
+
+		sdo_set_block_seqno(&cf, ++self->seqno);
+
+		self->is_last_segment_sent = sdo_async__is_at_end(self);
+		if (self->is_last_segment_sent)
+			sdo_end_block_segment(&cf);
+
+		cf.can_dlc = CAN_MAX_DLC;
+		sdo_async__send(self, &cf);
+	} while (!self->is_last_segment_sent && self->seqno < self->block_size);
+
+	mloop_timer_start(self->timer);
+	self->comm_state = SDO_ASYNC_COMM_BLOCK_RESPONSE;
+
+	return 0;
+}
+
+int sdo_async__send_dl_block_end(struct sdo_async* self)
+{
+	struct can_frame cf;
+	sdo_async__init_frame(self, &cf);
+	sdo_set_cs(&cf, SDO_CCS_BLK_DL_REQ);
+	sdo_set_block_cs(&cf, SDO_BLOCK_END);
+	sdo_set_block_unused_size(&cf, sdo_block_unused_size(self->dl_size));
+
+	if (self->is_crc_used)
+		sdo_set_block_crc(&cf, sdo_crc16(0, self->dl_data,
+						 self->dl_size));
+
+	cf.can_dlc = CAN_MAX_DLC;
+	mloop_timer_start(self->timer);
+	sdo_async__send(self, &cf);
+
+	self->comm_state = SDO_ASYNC_COMM_BLOCK_END_RESPONSE;
+
+	return 0;
+}
+
+int sdo_async__send_ul_block_cs(struct sdo_async* self, enum sdo_block_cs cs)
+{
+	struct can_frame cf;
+	sdo_async__init_frame(self, &cf);
+	sdo_set_cs(&cf, SDO_CCS_BLK_UL_REQ);
+	sdo_set_block_cs(&cf, cs);
+
+	if (cs == SDO_BLOCK_ACK) {
+		cf.data[SDO_BLOCK_ACKSEQ_IDX] = self->seqno;
+		cf.data[SDO_BLOCK_NEXT_SIZE_IDX] = self->block_size;
+	}
+
+	cf.can_dlc = CAN_MAX_DLC;
+	if (cs != SDO_BLOCK_END)
+		mloop_timer_start(self->timer);
+	sdo_async__send(self, &cf);
+	return 0;
+}
+
+int sdo_async__feed_block_init_dl_response(struct sdo_async* self,
+					   const struct can_frame* cf)
+{
+	if (cf->can_dlc < SDO_BLOCK_SIZE_IDX + 1)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	if (sdo_get_cs(cf) != SDO_SCS_BLK_DL_RES
+	 || sdo_get_block_cs(cf) != SDO_BLOCK_INIT)
+		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
+
+	if (sdo_async__is_other_object(self, sdo_get_index(cf),
+				       sdo_get_subindex(cf)))
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	self->seen.is_block_accepted = 1;
+
+	int block_size = cf->data[SDO_BLOCK_SIZE_IDX];
+	if (block_size < 1 || block_size > SDO_BLOCK_MAX_SIZE)
+		return sdo_async__abort(self, SDO_ABORT_BLOCKSZ);
+
+	self->block_size = block_size;
+	self->is_crc_used = sdo_is_block_crc_supported(cf);
+	self->pos = 0;
+
+	return sdo_async__send_dl_block(self);
+}
+
+int sdo_async__feed_block_init_ul_response(struct sdo_async* self,
+					   const struct can_frame* cf)
+{
+	if (cf->can_dlc < 4)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	int cs = sdo_get_cs(cf);
+
+	/* The server may switch to the regular protocol for small objects */
+	if (cs == SDO_SCS_UL_INIT_RES) {
+		self->is_block = 0;
+		self->comm_state = SDO_ASYNC_COMM_INIT_RESPONSE;
+		return sdo_async__feed_init_ul_response(self, cf);
+	}
+
+	if (cs != SDO_SCS_BLK_UL_RES || sdo_is_block_end(cf))
+		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
+
+	if (sdo_async__is_other_object(self, sdo_get_index(cf),
+				       sdo_get_subindex(cf)))
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	self->seen.is_block_accepted = 1;
+
+	self->is_crc_used = sdo_is_block_crc_supported(cf);
+	self->is_size_indicated = sdo_is_block_size_indicated(cf);
+	if (self->is_size_indicated && cf->can_dlc == CAN_MAX_DLC
+	 && !self->on_data)
+		if (vector_reserve(&self->buffer, sdo_get_indicated_size(cf)) < 0)
+			return sdo_async__abort(self, SDO_ABORT_NOMEM);
+
+	self->seqno = 0;
+	self->block_size = SDO_BLOCK_MAX_SIZE;
+	self->comm_state = SDO_ASYNC_COMM_BLOCK_RESPONSE;
+
+	return sdo_async__send_ul_block_cs(self, SDO_BLOCK_START);
+}
+
+int sdo_async__feed_block_init_response(struct sdo_async* self,
+					const struct can_frame* cf)
+{
+	switch (self->type) {
+	case SDO_REQ_DOWNLOAD:
+		return sdo_async__feed_block_init_dl_response(self, cf);
+	case SDO_REQ_UPLOAD:
+		return sdo_async__feed_block_init_ul_response(self, cf);
+	}
+
+	abort();
+	return -1;
+}
+
+int sdo_async__feed_dl_block_response(struct sdo_async* self,
+				      const struct can_frame* cf)
+{
+	if (cf->can_dlc < SDO_BLOCK_NEXT_SIZE_IDX + 1)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	if (sdo_get_cs(cf) != SDO_SCS_BLK_DL_RES
+	 || sdo_get_block_cs(cf) != SDO_BLOCK_ACK)
+		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
+
+	int ackseq = cf->data[SDO_BLOCK_ACKSEQ_IDX];
+	if (ackseq > self->seqno)
+		return sdo_async__abort(self, SDO_ABORT_SEQNR);
+
+	int block_size = cf->data[SDO_BLOCK_NEXT_SIZE_IDX];
+	if (block_size < 1 || block_size > SDO_BLOCK_MAX_SIZE)
+		return sdo_async__abort(self, SDO_ABORT_BLOCKSZ);
+
+	self->block_size = block_size;
+
+	if (ackseq == self->seqno && self->is_last_segment_sent)
+		return sdo_async__send_dl_block_end(self);
+
+	/* Segments after the acknowledged one are sent again */
+	self->pos = self->block_pos + ackseq * SDO_SEGMENT_MAX_SIZE;
+
+	return sdo_async__send_dl_block(self);
+}
+
+static int sdo_async__ack_ul_block(struct sdo_async* self)
+{
+	sdo_async__send_ul_block_cs(self, SDO_BLOCK_ACK);
+	self->seqno = 0;
+	return 0;
+}
+
+int sdo_async__feed_ul_block_segment(struct sdo_async* self,
+				     const struct can_frame* cf)
+{
+	int seqno = sdo_get_block_seqno(cf);
+	int is_last = sdo_is_last_block_segment(cf);
+	int is_in_sequence = seqno == self->seqno + 1;
+
+	/* Out of sequence segments are dropped and sent again by the server
+	 * in the next block.
+	 */
+	if (is_in_sequence) {
+		const void* data = &cf->data[SDO_SEGMENT_IDX];
+		if (vector_append(&self->buffer, data,
+				  SDO_SEGMENT_MAX_SIZE) < 0)
+			return sdo_async__abort(self, SDO_ABORT_NOMEM);
+
+		self->seqno = seqno;
+	}
+
+	if (!is_last && seqno < self->block_size) {
+		mloop_timer_start(self->timer);
+		return 0;
+	}
+
+	if (is_last && is_in_sequence)
+		self->comm_state = SDO_ASYNC_COMM_BLOCK_END_RESPONSE;
+
+	/* The server sends no more until the block is acknowledged */
+	int rc = self->on_data ? sdo_async__stream(self, 0) : 0;
+	if (rc < 0)
+		return -1;
+
+	if (rc > 0) {
+		self->is_paused = 1;
+		return 0;
+	}
+
+	return sdo_async__ack_ul_block(self);
+}
+
+int sdo_async__feed_block_response(struct sdo_async* self,
+				   const struct can_frame* cf)
+{
+	switch (self->type) {
+	case SDO_REQ_DOWNLOAD:
+		return sdo_async__feed_dl_block_response(self, cf);
+	case SDO_REQ_UPLOAD:
+		return sdo_async__feed_ul_block_segment(self, cf);
+	}
+
+	abort();
+	return -1;
+}
+
+int sdo_async__feed_dl_block_end_response(struct sdo_async* self,
+					  const struct can_frame* cf)
+{
+	if (cf->can_dlc < 1)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	if (sdo_get_cs(cf) != SDO_SCS_BLK_DL_RES
+	 || sdo_get_block_cs(cf) != SDO_BLOCK_END)
+		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
+
+	self->status = SDO_REQ_OK;
+	sdo_async__on_done(self);
+	return 0;
+}
+
+int sdo_async__feed_ul_block_end(struct sdo_async* self,
+				 const struct can_frame* cf)
+{
+	if (cf->can_dlc < SDO_BLOCK_CRC_IDX + 2)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	if (sdo_get_cs(cf) != SDO_SCS_BLK_UL_RES || !sdo_is_block_end(cf))
+		return sdo_async__abort(self, SDO_ABORT_INVALID_CS);
+
+	size_t unused = sdo_get_block_unused_size(cf);
+	if (unused > self->buffer.index)
+		return sdo_async__abort(self, SDO_ABORT_GENERAL);
+
+	self->buffer.index -= unused;
+
+	if (self->is_crc_used) {
+		uint16_t crc = sdo_crc16(self->crc, self->buffer.data,
+					 self->buffer.index);
+		if (crc != sdo_get_block_crc(cf))
+			return sdo_async__abort(self, SDO_ABORT_CRCERR);
+	}
+
+	/* A streamed transfer can still be aborted by its last chunk */
+	if (self->on_data && sdo_async__stream(self, 1) < 0)
+		return -1;
+
+	sdo_async__send_ul_block_cs(self, SDO_BLOCK_END);
+
+	self->status = SDO_REQ_OK;
+	sdo_async__on_done(self);
+	return 0;
+}
+
+int sdo_async__feed_block_end_response(struct sdo_async* self,
+				       const struct can_frame* cf)
+{
+	switch (self->type) {
+	case SDO_REQ_DOWNLOAD:
+		return sdo_async__feed_dl_block_end_response(self, cf);
+	case SDO_REQ_UPLOAD:
+		return sdo_async__feed_ul_block_end(self, cf);
+	}
+
+	abort();
+	return -1;
+}
+
+static int sdo_async__is_abort(const struct sdo_async* self,
+			       const struct can_frame* cf)
+{
+	if (self->type == SDO_REQ_UPLOAD
+	 && self->comm_state == SDO_ASYNC_COMM_BLOCK_RESPONSE)
+		return sdo_is_block_abort(cf);
+
+	return sdo_get_cs(cf) == SDO_SCS_ABORT;
+}
+
+/* Servers that do not support block transfer abort the initiation, so the
+ * transfer is started over in the regular mode. Other abort codes may be
+ * specific to the object, so block transfer is still tried next time.
+ */
+static int sdo_async__fall_back(struct sdo_async* self,
+				const struct can_frame* cf)
+{
+	if (sdo_get_abort_code(cf) == SDO_ABORT_INVALID_CS)
+		self->is_block_unsupported = 1;
+
+	self->is_block = 0;
+	self->comm_state = SDO_ASYNC_COMM_INIT_RESPONSE;
+
+	return sdo_async__send_init(self);
+}
+
+int sdo_async_resume(struct sdo_async* self)
+{
+	if (!self->is_running || !self->is_paused) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	self->is_paused = 0;
+
+	return self->is_block ? sdo_async__ack_ul_block(self)
+			      : sdo_async__request_ul_segment(self);
+}
+
 int sdo_async_feed(struct sdo_async* self, const struct can_frame* cf)
 {
-	assert(cf->can_id == R_TSDO + self->nodeid);
+	assert(cf->can_id == self->response_cob);
 
 	if (!self->is_running)
 		return -1;
 
+	/* Nothing but an abort is expected while the transfer is paused */
+	if (self->is_paused && !sdo_async__is_abort(self, cf))
+		return -1;
+
 	mloop_timer_stop(self->timer);
+	self->seen.n_responses++;
+
+	/* Outside of block transfers, every request gets exactly one response */
+	if (self->rtt && !self->is_block && !self->is_paused)
+		sdo_rtt_add_sample(self->rtt, gettime_us(CLOCK_MONOTONIC)
+					      - self->request_time);
+
+	if (sdo_async__is_abort(self, cf)) {
+		if (self->comm_state == SDO_ASYNC_COMM_BLOCK_INIT_RESPONSE)
+			return sdo_async__fall_back(self, cf);
 
-	if (sdo_get_cs(cf) == SDO_SCS_ABORT) {
 		self->status = SDO_REQ_REMOTE_ABORT;
 		self->abort_code = sdo_get_abort_code(cf);
 		sdo_async__on_done(self);
@@ -444,6 +951,12 @@ int sdo_async_feed(struct sdo_async* self, const struct can_frame* cf)
 		return sdo_async__feed_init_response(self, cf);
 	case SDO_ASYNC_COMM_SEG_RESPONSE:
 		return sdo_async__feed_seg_response(self, cf);
+	case SDO_ASYNC_COMM_BLOCK_INIT_RESPONSE:
+		return sdo_async__feed_block_init_response(self, cf);
+	case SDO_ASYNC_COMM_BLOCK_RESPONSE:
+		return sdo_async__feed_block_response(self, cf);
+	case SDO_ASYNC_COMM_BLOCK_END_RESPONSE:
+		return sdo_async__feed_block_end_response(self, cf);
 	case SDO_ASYNC_COMM_START:
 		break;
 	}
@@ -82,3 +82,20 @@ const char* sdo_strerror(enum sdo_abort_code code)
 	return "UNKNOWN";
 }
 
+
+uint16_t sdo_crc16(uint16_t crc, const void* data, size_t size)
+{
+	static const uint16_t table[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+		0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+	};
+
+	const uint8_t* bytes = data;
+
+	for (size_t i = 0; i < size; ++i) {
+		crc = (crc << 4) ^ table[(crc >> 12) ^ (bytes[i] >> 4)];
+		crc = (crc << 4) ^ table[(crc >> 12) ^ (bytes[i] & 0xf)];
+	}
+
+	return crc;
+}
@@ -22,7 +22,8 @@
  * node with id between 1 and 127. Multiple requests can be made to the same
  * node at the same time. They will be queued up in FIFO order.
  *
- * There are 127 queues available; one for each possible node.
+ * There are 127 queues available; one for each possible node. A queue can use
+ * several SDO channels if the node has more than one SDO server.
  *
  * A request can be handled in either a synchronous or asynchronous manner, by
  * either waiting for it to finish using sdo_req_wait() or registering an
@@ -31,85 +32,340 @@
 #include <assert.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "vector.h"
+#include "mem-tag.h"
 #include "sys/queue.h"
 #include "canopen/sdo.h"
 #include "canopen/sdo_async.h"
 #include "canopen/sdo_req.h"
+#include "canopen/sdo_throttle.h"
 #include "sock.h"
+#include "co_atomic.h"
+#include "time-utils.h"
+#include "node-stats.h"
+#include "event-trace.h"
 
-#define SDO_REQ_TIMEOUT 1000 /* ms */
+#define SDO_REQ_TIMEOUT 1000 /* ms, until a range is set */
 #define SDO_REQ_ASYNC_PRIO 1000
 
-#define SDO_BUFFER_INITIAL_SIZE 8
+/* The most bit times that a frame with 8 bytes of data can take */
+#define SDO_REQ_FRAME_BITS 135
 
-/* Index 0 is unused */
-static struct sdo_req_queue sdo_req__queues[128];
+/* Freed requests are kept for reuse, so that the many short lived requests of
+ * boot-up and REST polling do not fragment the heap. The pool grows to what
+ * sdo_req_reserve() is asked for.
+ */
+#define SDO_REQ_POOL_SIZE 256
+
+static pthread_mutex_t sdo_req__pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sdo_req_list sdo_req__pool = TAILQ_HEAD_INITIALIZER(sdo_req__pool);
+static size_t sdo_req__pool_length = 0;
+static size_t sdo_req__pool_size = SDO_REQ_POOL_SIZE;
+static struct sdo_req_alloc_stats sdo_req__stats;
+
+static struct sdo_req* sdo_req__alloc(void)
+{
+	pthread_mutex_lock(&sdo_req__pool_mutex);
+
+	struct sdo_req* self = TAILQ_FIRST(&sdo_req__pool);
+	if (self) {
+		TAILQ_REMOVE(&sdo_req__pool, self, links);
+		--sdo_req__pool_length;
+		++sdo_req__stats.n_reused;
+	}
+
+	++sdo_req__stats.n_allocated;
+
+	pthread_mutex_unlock(&sdo_req__pool_mutex);
+
+	return self ? self : mem_alloc(MEM_TAG_SDO_REQ, sizeof(*self));
+}
+
+static void sdo_req__release(struct sdo_req* self)
+{
+	pthread_mutex_lock(&sdo_req__pool_mutex);
+
+	if (sdo_req__pool_length < sdo_req__pool_size) {
+		TAILQ_INSERT_HEAD(&sdo_req__pool, self, links);
+		++sdo_req__pool_length;
+		self = NULL;
+	}
+
+	pthread_mutex_unlock(&sdo_req__pool_mutex);
+
+	mem_free(MEM_TAG_SDO_REQ, self);
+}
+
+/* Uploads are handed over from the channels to the requests that made them.
+ * A channel gets a buffer from this pool in return, and buffers come back
+ * when the requests are freed. Large buffers are not kept.
+ */
+#define SDO_REQ_BUFFER_POOL_SIZE 64
+#define SDO_REQ_BUFFER_INITIAL_SIZE 64
+#define SDO_REQ_BUFFER_MAX_POOLED 4096
+
+static pthread_mutex_t sdo_req__buffer_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct vector sdo_req__buffer_pool[SDO_REQ_BUFFER_POOL_SIZE];
+static size_t sdo_req__buffer_pool_length = 0;
+static struct sdo_req_alloc_stats sdo_req__buffer_stats;
+
+static int sdo_req__get_buffer(struct vector* buffer)
+{
+	int have_buffer = 0;
+
+	pthread_mutex_lock(&sdo_req__buffer_pool_mutex);
+
+	if (sdo_req__buffer_pool_length > 0) {
+		*buffer = sdo_req__buffer_pool[--sdo_req__buffer_pool_length];
+		have_buffer = 1;
+		++sdo_req__buffer_stats.n_reused;
+	}
+
+	++sdo_req__buffer_stats.n_allocated;
+
+	pthread_mutex_unlock(&sdo_req__buffer_pool_mutex);
+
+	if (have_buffer) {
+		vector_clear(buffer);
+		return 0;
+	}
+
+	return vector_init(buffer, SDO_REQ_BUFFER_INITIAL_SIZE);
+}
+
+static void sdo_req__put_buffer(struct vector* buffer)
+{
+	if (!buffer->data || vector__is_inline(buffer)
+	 || buffer->size > SDO_REQ_BUFFER_MAX_POOLED)
+		goto done;
+
+	pthread_mutex_lock(&sdo_req__buffer_pool_mutex);
+
+	if (sdo_req__buffer_pool_length < SDO_REQ_BUFFER_POOL_SIZE) {
+		struct vector* slot;
+		slot = &sdo_req__buffer_pool[sdo_req__buffer_pool_length++];
+		vector_init_inline(slot, NULL, 0);
+		vector_swap(slot, buffer);
+	}
+
+	pthread_mutex_unlock(&sdo_req__buffer_pool_mutex);
+
+done:
+	vector_destroy(buffer);
+}
+
+int sdo_req_reserve(size_t n)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&sdo_req__pool_mutex);
+
+	if (sdo_req__pool_size < n)
+		sdo_req__pool_size = n;
+
+	while (sdo_req__pool_length < n) {
+		struct sdo_req* req = mem_alloc(MEM_TAG_SDO_REQ, sizeof(*req));
+		if (!req) {
+			rc = -1;
+			break;
+		}
+
+		TAILQ_INSERT_HEAD(&sdo_req__pool, req, links);
+		++sdo_req__pool_length;
+	}
+
+	pthread_mutex_unlock(&sdo_req__pool_mutex);
+
+	if (rc < 0)
+		return -1;
+
+	size_t n_buffers = n < SDO_REQ_BUFFER_POOL_SIZE ? n
+						       : SDO_REQ_BUFFER_POOL_SIZE;
+
+	pthread_mutex_lock(&sdo_req__buffer_pool_mutex);
+
+	while (sdo_req__buffer_pool_length < n_buffers) {
+		struct vector* slot;
+		slot = &sdo_req__buffer_pool[sdo_req__buffer_pool_length];
+		if (vector_init(slot, SDO_REQ_BUFFER_INITIAL_SIZE) < 0) {
+			rc = -1;
+			break;
+		}
+
+		++sdo_req__buffer_pool_length;
+	}
+
+	pthread_mutex_unlock(&sdo_req__buffer_pool_mutex);
+
+	return rc;
+}
+
+void sdo_req_get_alloc_stats(struct sdo_req_alloc_stats* reqs,
+			     struct sdo_req_alloc_stats* buffers)
+{
+	pthread_mutex_lock(&sdo_req__pool_mutex);
+	*reqs = sdo_req__stats;
+	reqs->n_cached = sdo_req__pool_length;
+	pthread_mutex_unlock(&sdo_req__pool_mutex);
+
+	pthread_mutex_lock(&sdo_req__buffer_pool_mutex);
+	*buffers = sdo_req__buffer_stats;
+	buffers->n_cached = sdo_req__buffer_pool_length;
+	pthread_mutex_unlock(&sdo_req__buffer_pool_mutex);
+}
+
+/* Move the upload buffer of the channel into dst rather than copying it. The
+ * channel receives the next upload into what was in dst, or into a buffer
+ * from the pool. Data that fits the inline buffer of dst is simply copied.
+ */
+static int sdo_req__take_buffer(struct vector* dst, struct sdo_async* async)
+{
+	struct vector* buffer = &async->buffer;
+
+	if (vector__is_inline(buffer)
+	 || (vector__is_inline(dst) && buffer->index <= dst->size))
+		return vector_copy(dst, buffer);
+
+	if (!dst->data || vector__is_inline(dst)) {
+		struct vector fresh;
+		if (sdo_req__get_buffer(&fresh) < 0)
+			return vector_copy(dst, buffer);
+
+		dst->data = fresh.data;
+		dst->size = fresh.size;
+	}
+
+	vector_swap(dst, buffer);
+	vector_clear(buffer);
+	return 0;
+}
 
 struct sdo_req* sdo_req_new(struct sdo_req_info* info)
 {
-	struct sdo_req* self = malloc(sizeof(*self));
+	struct sdo_req* self = sdo_req__alloc();
 	if (!self)
 		return NULL;
 
 	memset(self, 0, sizeof(*self));
 
+	self->is_pooled = 1;
+	vector_init_inline(&self->data, self->inline_data,
+			   sizeof(self->inline_data));
+
 	self->ref = 1;
 	self->type = info->type;
 	self->index = info->index;
 	self->subindex = info->subindex;
 	self->on_done = info->on_done;
 	self->context = info->context;
-
-	if (info->type == SDO_REQ_DOWNLOAD) {
+	self->use_block = info->use_block;
+	self->cache_max_age = info->cache_max_age;
+	self->priority = info->priority;
+	self->on_data = info->on_data;
+	self->owner = info->owner;
+
+	self->timeout = info->timeout;
+
+	/* Borrowed data is not freed, as it counts as an inline buffer */
+	if (info->type == SDO_REQ_DOWNLOAD && info->is_dl_data_borrowed) {
+		vector_init_inline(&self->data, (void*)info->dl_data,
+				   info->dl_size);
+		self->data.index = info->dl_size;
+	} else if (info->type == SDO_REQ_DOWNLOAD) {
 		if (vector_assign(&self->data, info->dl_data,
 				  info->dl_size) < 0)
 			goto failure;
-	} else {
-		if (vector_init(&self->data, SDO_BUFFER_INITIAL_SIZE) < 0)
-			goto failure;
 	}
 
 	return self;
 
 failure:
-	free(self);
+	sdo_req__release(self);
 	return NULL;
 }
 
+/* Waiters sleep on the status word itself, so one that was set up with
+ * memset() can be waited upon as well. Most requests are never waited upon,
+ * so waiters announce themselves and the futex is only woken for them. Both
+ * sides use sequentially consistent operations, so either the waiter sees the
+ * new status or the one that sets it sees the waiter.
+ */
+static inline int* sdo_req__status_word(struct sdo_req* self)
+{
+	_Static_assert(sizeof(self->status) == sizeof(int),
+		       "The status must fit a futex word");
+	return (int*)&self->status;
+}
+
+static void sdo_req__set_status(struct sdo_req* self,
+				enum sdo_req_status status)
+{
+	int* word = sdo_req__status_word(self);
+
+	co_atomic_store(word, status);
+
+	if (co_atomic_load(&self->n_waiters) > 0)
+		syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+			NULL, 0);
+}
+
+static void sdo_batch__destroy(struct sdo_batch* self)
+{
+	size_t length = sdo_batch_length(self);
+
+	for (size_t i = 0; i < length; ++i)
+		sdo_req__put_buffer(&sdo_batch_get_item(self, i)->data);
+
+	vector_destroy(&self->items);
+}
+
 void sdo_req_free(struct sdo_req* self)
 {
 	if (self->context && self->context_free_fn)
 		self->context_free_fn(self->context);
 
-	vector_destroy(&self->data);
-	free(self);
+	if (self->is_batch)
+		sdo_batch__destroy((struct sdo_batch*)self);
+
+	sdo_req__put_buffer(&self->data);
+
+	/* Requests that are embedded in other objects are not from the pool */
+	if (self->is_pooled)
+		sdo_req__release(self);
+	else
+		mem_free(MEM_TAG_SDO_REQ, self);
 }
 
 ARC_GENERATE(sdo_req, sdo_req_free)
 
 void sdo_req__process_queue(struct mloop_idle* idle);
-int sdo_req__have_req(struct mloop_idle* idle);
 
-int sdo_req__queue_init(struct sdo_req_queue* self, const struct sock* sock,
-			int nodeid, size_t limit,
-			enum sdo_async_quirks_flags quirks)
+/* Sets up what costs nothing but memory. The channel and the idle job are
+ * made when the queue is activated.
+ */
+static void sdo_req__queue_prepare(struct sdo_req_queue* self,
+				   const struct sock* sock, int nodeid,
+				   size_t limit,
+				   enum sdo_async_quirks_flags quirks)
 {
 	memset(self, 0, sizeof(*self));
 
-	if (sdo_async_init(&self->sdo_client, sock, nodeid) < 0)
-		return -1;
-
-	self->idle = mloop_idle_new(mloop_default());
-	if (!self->idle)
-		goto failure;
+	self->sock = sock;
+	self->quirks = quirks;
 
-	mloop_idle_set_idle_fn(self->idle, sdo_req__process_queue);
-	mloop_idle_set_cond_fn(self->idle, sdo_req__have_req);
-	mloop_idle_set_context(self->idle, self, NULL);
-	mloop_idle_start(self->idle);
+	sdo_rtt_init(&self->rtt);
+	self->timeout_min = SDO_REQ_TIMEOUT;
+	self->timeout_max = SDO_REQ_TIMEOUT;
 
-	self->sdo_client.quirks = quirks;
+	for (size_t i = 0; i < SDO_REQ_CACHE_SIZE; ++i) {
+		struct sdo_req_cache_entry* entry = &self->cache[i];
+		vector_init_inline(&entry->data, entry->inline_data,
+				   sizeof(entry->inline_data));
+	}
 
 	self->limit = limit;
 	self->nodeid = nodeid;
@@ -120,224 +376,1261 @@ int sdo_req__queue_init(struct sdo_req_queue* self, const struct sock* sock,
 	pthread_mutex_init(&self->mutex, &attr);
 	pthread_mutexattr_destroy(&attr);
 
-	TAILQ_INIT(&self->list);
-
-	return 0;
-
-failure:
-	sdo_async_destroy(&self->sdo_client);
-	return -1;
+	for (size_t i = 0; i < SDO_REQ_N_PRIORITIES; ++i)
+		TAILQ_INIT(&self->list[i]);
 }
 
-void sdo_req__queue_clear(struct sdo_req_queue* self)
+void sdo_req_queue__lock(struct sdo_req_queue* self)
 {
-	while (!TAILQ_EMPTY(&self->list)) {
-		struct sdo_req* req = TAILQ_FIRST(&self->list);
-		TAILQ_REMOVE(&self->list, req, links);
-		req->status = SDO_REQ_CANCELLED;
-		sdo_req_unref(req);
-	}
-	self->size = 0;
+	pthread_mutex_lock(&self->mutex);
 }
 
-void sdo_req__queue_destroy(struct sdo_req_queue* self)
+void sdo_req_queue__unlock(struct sdo_req_queue* self)
 {
-	mloop_idle_unref(self->idle);
-	sdo_async_destroy(&self->sdo_client);
-	sdo_req__queue_clear(self);
-	pthread_mutex_destroy(&self->mutex);
+	pthread_mutex_unlock(&self->mutex);
 }
 
-int sdo_req_queues_init(const struct sock* sock, size_t limit,
-			enum sdo_async_quirks_flags quirks)
+static int sdo_req__queue_do_activate(struct sdo_req_queue* self)
 {
-	size_t i;
+	struct sdo_async* primary = &self->sdo_client[0];
 
-	for (i = 1; i < 128; ++i)
-		if (sdo_req__queue_init(&sdo_req__queues[i], sock, i, limit,
-					quirks) < 0)
-			goto failure;
+	if (sdo_async_init(primary, self->sock, self->nodeid) < 0)
+		return -1;
 
-	return 0;
+	self->idle = mloop_idle_new(mloop_default());
+	if (!self->idle) {
+		sdo_async_destroy(primary);
+		return -1;
+	}
 
-failure:
-	for (--i; i > 0; --i)
-		sdo_req__queue_destroy(&sdo_req__queues[i]);
-	return -1;
+	/* The queue is only processed when notified that it may have work */
+	mloop_idle_set_idle_fn(self->idle, sdo_req__process_queue);
+	mloop_idle_set_context(self->idle, self, NULL);
+	mloop_idle_start(self->idle);
+
+	primary->quirks = self->quirks;
+	primary->rtt = &self->rtt;
+
+	co_atomic_store_release(&self->is_active, 1);
+
+	/* Frames may be looked up on another thread as soon as this is set */
+	co_atomic_store_release(&self->n_channels, 1);
+	return 0;
 }
 
-void sdo_req_queues_cleanup()
+int sdo_req_queue_activate(struct sdo_req_queue* self)
 {
-	size_t i;
-	for (i = 1; i < 128; ++i)
-		sdo_req__queue_destroy(&sdo_req__queues[i]);
+	if (co_atomic_load_acquire(&self->is_active))
+		return 0;
+
+	sdo_req_queue__lock(self);
+	int rc = self->is_active ? 0 : sdo_req__queue_do_activate(self);
+	sdo_req_queue__unlock(self);
+
+	return rc;
 }
 
-struct sdo_req_queue* sdo_req_queue_get(int nodeid)
+int sdo_req__queue_init(struct sdo_req_queue* self, const struct sock* sock,
+			int nodeid, size_t limit,
+			enum sdo_async_quirks_flags quirks)
 {
-	assert(1 <= nodeid && nodeid <= 127);
-	return &sdo_req__queues[nodeid];
+	sdo_req__queue_prepare(self, sock, nodeid, limit, quirks);
+
+	if (sdo_req_queue_activate(self) < 0) {
+		sdo_req__queue_destroy(self);
+		return -1;
+	}
+
+	return 0;
 }
 
-void sdo_req_queue__lock(struct sdo_req_queue* self)
+static const enum sdo_req_priority sdo_req__priority_order[] = {
+	SDO_REQ_PRIO_HIGH,
+	SDO_REQ_PRIO_NORMAL,
+	SDO_REQ_PRIO_BACKGROUND,
+};
+
+static size_t sdo_req__rank(enum sdo_req_priority prio)
 {
-	pthread_mutex_lock(&self->mutex);
+	size_t i = 0;
+	while (sdo_req__priority_order[i] != prio)
+		++i;
+
+	return i;
 }
 
-void sdo_req_queue__unlock(struct sdo_req_queue* self)
+static inline uint32_t sdo_req__trace_arg(const struct sdo_req* req)
 {
-	pthread_mutex_unlock(&self->mutex);
+	return event_trace_sdo_arg(req->parent ? req->parent->nodeid : 0,
+				   req->index, req->subindex);
 }
 
-void sdo_req_queue_flush(struct sdo_req_queue* self)
+static int sdo_req__may_follow(const struct sdo_req* req)
 {
-	sdo_req_queue__lock(self);
-	sdo_req__queue_clear(self);
-	sdo_async_stop(&self->sdo_client);
-	sdo_req_queue__unlock(self);
+	return req->type == SDO_REQ_UPLOAD && !req->is_batch && !req->on_data;
 }
 
-int sdo_req_queue__enqueue(struct sdo_req_queue* self, struct sdo_req* req)
+static int sdo_req__writes(const struct sdo_req* req, int index, int subindex)
 {
-	assert(req->parent == NULL);
-
-	int rc = -1;
-	sdo_req_queue__lock(self);
-	if (self->size >= self->limit)
-		goto done;
-	else
-		++self->size;
-
-	req->parent = self;
-	TAILQ_INSERT_TAIL(&self->list, req, links);
-	mloop_iterate(mloop_default());
+	if (!req->is_batch)
+		return req->type == SDO_REQ_DOWNLOAD && req->index == index
+		    && req->subindex == subindex;
+
+	const struct sdo_batch* batch = (const struct sdo_batch*)req;
+
+	for (size_t i = 0; i < sdo_batch_length(batch); ++i) {
+		const struct sdo_batch_item* item =
+			sdo_batch_get_item(batch, i);
+		if (item->type == SDO_REQ_DOWNLOAD && item->index == index
+		 && item->subindex == subindex)
+			return 1;
+	}
 
-	rc = 0;
-done:
-	sdo_req_queue__unlock(self);
-	return rc;
+	return 0;
 }
 
-struct sdo_req* sdo_req_queue__dequeue(struct sdo_req_queue* self)
+/* Looks at one request that is waiting or running. Returns -1 if req must
+ * not follow anything, 1 if it may follow this one and 0 otherwise.
+ */
+static int sdo_req__check_leader(const struct sdo_req* other,
+				 const struct sdo_req* req)
 {
-	sdo_req_queue__lock(self);
+	if (sdo_req__writes(other, req->index, req->subindex))
+		return -1;
 
-	struct sdo_req* req = TAILQ_FIRST(&self->list);
-	if (!req)
-		return NULL;
+	return sdo_req__may_follow(other) && other->index == req->index
+	    && other->subindex == req->subindex;
+}
 
-	assert(self->size);
-	--self->size;
+/* Running requests are the contexts of the channels that run them */
+static struct sdo_req* sdo_req_queue__find_leader(struct sdo_req_queue* self,
+						  const struct sdo_req* req,
+						  int* is_waiting)
+{
+	struct sdo_req* leader = NULL;
+	size_t n_channels = co_atomic_load_acquire(&self->n_channels);
+
+	for (size_t i = 0; i < n_channels; ++i) {
+		struct sdo_async* channel = &self->sdo_client[i];
+		if (!channel->is_running || !channel->context)
+			continue;
+
+		struct sdo_req* other = channel->context;
+		int rc = sdo_req__check_leader(other, req);
+		if (rc < 0)
+			return NULL;
+
+		if (rc > 0 && !leader) {
+			leader = other;
+			*is_waiting = 0;
+		}
+	}
 
-	TAILQ_REMOVE(&self->list, req, links);
+	for (size_t i = 0; i < SDO_REQ_N_PRIORITIES; ++i) {
+		struct sdo_req* other;
+		TAILQ_FOREACH(other, &self->list[i], links) {
+			int rc = sdo_req__check_leader(other, req);
+			if (rc < 0)
+				return NULL;
+
+			if (rc > 0 && !leader) {
+				leader = other;
+				*is_waiting = 1;
+			}
+		}
+	}
 
-	sdo_req_queue__unlock(self);
-	return req;
+	return leader;
 }
 
-int sdo_req_queue_remove(struct sdo_req_queue* self, struct sdo_req* req)
+/* Returns 0 if req now follows another request. It then no longer counts
+ * towards the size of the queue.
+ */
+static int sdo_req_queue__coalesce(struct sdo_req_queue* self,
+				   struct sdo_req* req)
 {
-	if (!req->parent)
+	if (!sdo_req__may_follow(req))
 		return -1;
 
-	sdo_req_queue__lock(self);
+	int is_waiting = 0;
+	struct sdo_req* leader = sdo_req_queue__find_leader(self, req,
+							    &is_waiting);
+	if (!leader)
+		return -1;
 
-	TAILQ_REMOVE(&self->list, req, links);
-	req->parent = NULL;
+	if (is_waiting
+	 && sdo_req__rank(req->priority) < sdo_req__rank(leader->priority)) {
+		TAILQ_REMOVE(&self->list[leader->priority], leader, links);
+		leader->priority = req->priority;
+		TAILQ_INSERT_TAIL(&self->list[leader->priority], leader, links);
+	}
 
-	sdo_req_queue__unlock(self);
+	struct sdo_req** tail = &leader->followers;
+	while (*tail)
+		tail = &(*tail)->next_follower;
 
+	*tail = req;
+	co_atomic_sub_fetch(&self->size, 1);
 	return 0;
 }
 
-void sdo_req_wait(struct sdo_req* self)
+/* Each follower is given a copy of the data, as the leader keeps its own */
+static void sdo_req__finish_followers(struct sdo_req* self,
+				      enum sdo_req_status status)
 {
-	while (self->status == SDO_REQ_PENDING)
-		usleep(100); /* TODO: Use something more sophisticated */
-}
+	struct sdo_req* follower;
 
-void sdo_req__on_done(struct sdo_async* async);
+	while ((follower = self->followers)) {
+		self->followers = follower->next_follower;
+		follower->next_follower = NULL;
 
-void sdo_req__on_stop(void* ptr)
-{
-	struct sdo_req* req = ptr;
+		enum sdo_req_status follower_status = status;
+		if (status == SDO_REQ_OK
+		 && vector_copy(&follower->data, &self->data) < 0)
+			follower_status = SDO_REQ_NOMEM;
 
-	if (req->status == SDO_REQ_PENDING)
-		req->status = SDO_REQ_CANCELLED;
+		follower->abort_code = self->abort_code;
+		follower->is_size_indicated = self->is_size_indicated;
 
-	sdo_req_unref(req);
-}
+		event_trace_async_end(EVENT_TRACE_SDO_QUEUED,
+				      (uintptr_t)follower,
+				      sdo_req__trace_arg(follower));
 
-int sdo_req__have_req(struct mloop_idle* idle)
-{
-	struct sdo_req_queue* queue = mloop_idle_get_context(idle);
-	if (queue->sdo_client.is_running)
-	       return 0;
+		sdo_req__set_status(follower, follower_status);
+
+		sdo_req_fn on_done = follower->on_done;
+		if (on_done)
+			on_done(follower);
 
-	__sync_synchronize();
-	return !TAILQ_EMPTY(&queue->list);
+		sdo_req_unref(follower);
+	}
 }
 
-void sdo_req__process_queue(struct mloop_idle* idle)
+static void sdo_req__cancel_followers(struct sdo_req* self)
 {
-	struct sdo_req_queue* queue = mloop_idle_get_context(idle);
-	assert(!queue->sdo_client.is_running);
+	struct sdo_req* follower;
 
-	sdo_req_queue__lock(queue);
+	while ((follower = self->followers)) {
+		self->followers = follower->next_follower;
+		follower->next_follower = NULL;
 
-	struct sdo_req* req = sdo_req_queue__dequeue(queue);
-	if (!req)
-		goto done;
+		event_trace_async_end(EVENT_TRACE_SDO_QUEUED,
+				      (uintptr_t)follower,
+				      sdo_req__trace_arg(follower));
+		sdo_req__set_status(follower, SDO_REQ_CANCELLED);
+		sdo_req_unref(follower);
+	}
+}
 
-	struct sdo_async_info info = {
-		.type = req->type,
-		.index = req->index,
-		.subindex = req->subindex,
-		.timeout = SDO_REQ_TIMEOUT,
-		.data = req->data.data,
-		.size = req->data.index,
-		.on_done = sdo_req__on_done,
-		.context = req,
-		.free_fn = sdo_req__on_stop
-	};
+/* The intake is in LIFO order, so it is reversed before being sorted into the
+ * lists.
+ */
+static void sdo_req_queue__drain_intake(struct sdo_req_queue* self)
+{
+	struct sdo_req* req = co_atomic_exchange(&self->intake, NULL);
+	struct sdo_req* fifo = NULL;
+
+	while (req) {
+		struct sdo_req* next = req->intake_next;
+		req->intake_next = fifo;
+		fifo = req;
+		req = next;
+	}
 
-	sdo_async_start(&queue->sdo_client, &info);
+	while (fifo) {
+		req = fifo;
+		fifo = req->intake_next;
+		req->intake_next = NULL;
 
-done:
-	sdo_req_queue__unlock(queue);
+		if (sdo_req_queue__coalesce(self, req) < 0)
+			TAILQ_INSERT_TAIL(&self->list[req->priority], req,
+					  links);
+	}
 }
 
-void sdo_req__on_done(struct sdo_async* async)
+void sdo_req__queue_clear(struct sdo_req_queue* self)
 {
-	struct sdo_req_queue* queue = sdo_req_queue__from_async(async);
+	size_t n_cleared = 0;
+
+	sdo_req_queue__drain_intake(self);
+
+	for (size_t i = 0; i < SDO_REQ_N_PRIORITIES; ++i) {
+		struct sdo_req_list* list = &self->list[i];
+
+		while (!TAILQ_EMPTY(list)) {
+			struct sdo_req* req = TAILQ_FIRST(list);
+			TAILQ_REMOVE(list, req, links);
+			event_trace_async_end(EVENT_TRACE_SDO_QUEUED,
+					      (uintptr_t)req,
+					      sdo_req__trace_arg(req));
+			sdo_req__cancel_followers(req);
+			sdo_req__set_status(req, SDO_REQ_CANCELLED);
+			sdo_req_unref(req);
+			++n_cleared;
+		}
+
+		self->n_passed_over[i] = 0;
+	}
 
-	struct sdo_req* req = async->context;
-	assert(req != NULL);
+	/* Requests that are enqueued meanwhile stay in the intake */
+	co_atomic_sub_fetch(&self->size, n_cleared);
+}
 
-	assert(async->status != SDO_REQ_PENDING);
-	req->status = async->status;
-	req->abort_code = async->abort_code;
-	req->is_size_indicated = async->is_size_indicated;
+void sdo_req__queue_destroy(struct sdo_req_queue* self)
+{
+	if (self->is_active) {
+		/* A notification that is still pending must not run on a
+		 * dead queue
+		 */
+		mloop_idle_stop(self->idle);
+		if (self->throttle)
+			sdo_throttle_cancel(self->throttle, self->idle);
+		mloop_idle_unref(self->idle);
+		sdo_req_queue_remove_channels(self);
+		sdo_async_destroy(&self->sdo_client[0]);
+	}
 
-	if (req->type == SDO_REQ_UPLOAD)
-		if (vector_copy(&req->data, &async->buffer) < 0)
-			req->status = SDO_REQ_NOMEM;
+	sdo_req__queue_clear(self);
 
-	sdo_req_fn on_done = req->on_done;
-	if (on_done)
-		on_done(req);
+	for (size_t i = 0; i < SDO_REQ_CACHE_SIZE; ++i)
+		vector_destroy(&self->cache[i].data);
 
-	mloop_iterate(mloop_default());
+	pthread_mutex_destroy(&self->mutex);
 }
 
-int sdo_req_start(struct sdo_req* self, struct sdo_req_queue* queue)
+/* The queues are indexed by node id, so there must be room for 128 of them.
+ * Index 0 is unused. Each queue is activated when it is first used.
+ */
+int sdo_req_queues_init(struct sdo_req_queue* queues, const struct sock* sock,
+			size_t limit, enum sdo_async_quirks_flags quirks)
 {
-	sdo_req_ref(self);
+	for (size_t i = 1; i < 128; ++i)
+		sdo_req__queue_prepare(&queues[i], sock, i, limit, quirks);
 
-	if (sdo_req_queue__enqueue(queue, self) == 0)
-		return 0;
+	return 0;
+}
 
-	sdo_req_unref(self);
-	return -1;
+void sdo_req_queues_cleanup(struct sdo_req_queue* queues)
+{
+	size_t i;
+	for (i = 1; i < 128; ++i)
+		sdo_req__queue_destroy(&queues[i]);
 }
 
+void sdo_req_queue_flush(struct sdo_req_queue* self)
+{
+	sdo_req__queue_clear(self);
+
+	sdo_req_queue__lock(self);
+	for (size_t i = 0; i < self->n_channels; ++i)
+		sdo_async_stop(&self->sdo_client[i]);
+	sdo_req_queue__unlock(self);
+}
+
+int sdo_req_queue_add_channel(struct sdo_req_queue* self, uint32_t request_cob,
+			      uint32_t response_cob)
+{
+	int rc = -1;
+	sdo_req_queue__lock(self);
+
+	if (sdo_req_queue_activate(self) < 0)
+		goto done;
+
+	if (self->n_channels >= SDO_REQ_MAX_CHANNELS) {
+		errno = ENOSPC;
+		goto done;
+	}
+
+	struct sdo_async* channel = &self->sdo_client[self->n_channels];
+	const struct sdo_async* primary = &self->sdo_client[0];
+
+	if (sdo_async_init(channel, &primary->sock, self->nodeid) < 0)
+		goto done;
+
+	channel->request_cob = request_cob;
+	channel->response_cob = response_cob;
+	channel->quirks = primary->quirks;
+	channel->is_block_unsupported = primary->is_block_unsupported;
+	channel->rtt = &self->rtt;
+
+	/* Frames may be looked up on another thread as soon as this is set */
+	co_atomic_store_release(&self->n_channels, self->n_channels + 1);
+
+	mloop_idle_notify(self->idle);
+
+	rc = 0;
+done:
+	sdo_req_queue__unlock(self);
+	return rc;
+}
+
+void sdo_req_queue_remove_channels(struct sdo_req_queue* self)
+{
+	sdo_req_queue__lock(self);
+
+	while (self->n_channels > 1) {
+		struct sdo_async* channel = &self->sdo_client[--self->n_channels];
+		sdo_async_stop(channel);
+		sdo_async_destroy(channel);
+	}
+
+	sdo_req_queue__unlock(self);
+}
+
+static struct sdo_req_cache_entry*
+sdo_req_queue__cache_find(struct sdo_req_queue* self, int index, int subindex)
+{
+	for (size_t i = 0; i < SDO_REQ_CACHE_SIZE; ++i) {
+		struct sdo_req_cache_entry* entry = &self->cache[i];
+		if (entry->is_used && entry->index == index
+		 && entry->subindex == subindex)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* The oldest entry is replaced when the cache is full */
+static void sdo_req_queue__cache_store(struct sdo_req_queue* self,
+				       const struct sdo_req* req)
+{
+	sdo_req_queue__lock(self);
+
+	struct sdo_req_cache_entry* entry;
+	entry = sdo_req_queue__cache_find(self, req->index, req->subindex);
+	if (!entry)
+		entry = &self->cache[self->cache_next++ % SDO_REQ_CACHE_SIZE];
+
+	entry->is_used = vector_copy(&entry->data, &req->data) == 0;
+	entry->index = req->index;
+	entry->subindex = req->subindex;
+	entry->time = gettime_ns(CLOCK_MONOTONIC);
+	entry->is_size_indicated = req->is_size_indicated;
+
+	sdo_req_queue__unlock(self);
+}
+
+static void sdo_req_queue__cache_drop(struct sdo_req_queue* self, int index,
+				      int subindex)
+{
+	sdo_req_queue__lock(self);
+
+	struct sdo_req_cache_entry* entry;
+	entry = sdo_req_queue__cache_find(self, index, subindex);
+	if (entry)
+		entry->is_used = 0;
+
+	sdo_req_queue__unlock(self);
+}
+
+/* Returns -1 if the value is not in the cache or is too old */
+static int sdo_req_queue__cache_load(struct sdo_req_queue* self,
+				     struct sdo_req* req)
+{
+	int rc = -1;
+	sdo_req_queue__lock(self);
+
+	const struct sdo_req_cache_entry* entry;
+	entry = sdo_req_queue__cache_find(self, req->index, req->subindex);
+	if (!entry)
+		goto done;
+
+	uint64_t age = gettime_ns(CLOCK_MONOTONIC) - entry->time;
+	if (req->cache_max_age != SDO_REQ_CACHE_FOREVER
+	 && age > msec_to_nsec(req->cache_max_age))
+		goto done;
+
+	if (vector_copy(&req->data, &entry->data) < 0)
+		goto done;
+
+	req->is_size_indicated = entry->is_size_indicated;
+	req->abort_code = 0;
+
+	rc = 0;
+done:
+	sdo_req_queue__unlock(self);
+	return rc;
+}
+
+void sdo_req_queue_clear_cache(struct sdo_req_queue* self)
+{
+	sdo_req_queue__lock(self);
+
+	for (size_t i = 0; i < SDO_REQ_CACHE_SIZE; ++i)
+		self->cache[i].is_used = 0;
+
+	sdo_req_queue__unlock(self);
+}
+
+void sdo_req_queue_set_timeout_range(struct sdo_req_queue* self,
+				     unsigned int min, unsigned int max)
+{
+	self->timeout_min = min;
+	self->timeout_max = max > min ? max : min;
+}
+
+unsigned int sdo_req_queue_get_timeout(const struct sdo_req_queue* self)
+{
+	return sdo_rtt_get_timeout(&self->rtt, self->timeout_min,
+				   self->timeout_max);
+}
+
+struct sdo_async* sdo_req_queue_find_channel(struct sdo_req_queue* self,
+					     uint32_t response_cob)
+{
+	size_t n_channels = co_atomic_load_acquire(&self->n_channels);
+
+	for (size_t i = 0; i < n_channels; ++i)
+		if (self->sdo_client[i].response_cob == response_cob)
+			return &self->sdo_client[i];
+
+	return NULL;
+}
+
+static void sdo_req_queue__push_intake(struct sdo_req_queue* self,
+				       struct sdo_req* req)
+{
+	struct sdo_req* head;
+
+	do {
+		head = co_atomic_load(&self->intake);
+		req->intake_next = head;
+	} while (!co_atomic_cas(&self->intake, head, req));
+}
+
+static struct sdo_async*
+sdo_req_queue__find_idle_channel(struct sdo_req_queue* self);
+static void sdo_req_queue__process(struct sdo_req_queue* queue);
+
+int sdo_req_queue__enqueue(struct sdo_req_queue* self, struct sdo_req* req)
+{
+	assert(req->parent == NULL);
+	assert(req->priority < SDO_REQ_N_PRIORITIES);
+
+	if (sdo_req_queue_activate(self) < 0)
+		return -1;
+
+	size_t size = co_atomic_add_fetch(&self->size, 1);
+	if (size > self->limit) {
+		co_atomic_sub_fetch(&self->size, 1);
+		return -1;
+	}
+
+	int is_first = size == 1;
+	req->parent = self;
+
+	if (req->type == SDO_REQ_DOWNLOAD)
+		sdo_req_queue__cache_drop(self, req->index, req->subindex);
+
+	event_trace_async_begin(EVENT_TRACE_SDO_QUEUED, (uintptr_t)req,
+				sdo_req__trace_arg(req));
+
+	sdo_req_queue__push_intake(self, req);
+
+	/* Nothing is waiting ahead of a request that is made from the main
+	 * loop to an idle channel, so it is started right away rather than an
+	 * iteration later. Otherwise it takes its turn.
+	 */
+	if (is_first && mloop_is_current(mloop_default())
+	 && !self->is_processing && sdo_req_queue__find_idle_channel(self)) {
+		sdo_req_queue__process(self);
+		return 0;
+	}
+
+	mloop_idle_notify(self->idle);
+	return 0;
+}
+
+/* The size of uploads is not known up front, so they are taken to be
+ * expedited. What they take beyond that still shows up in the bus load.
+ */
+static size_t sdo_req__estimate_frames(enum sdo_req_type type, size_t size)
+{
+	if (type == SDO_REQ_UPLOAD || size <= 4)
+		return 1;
+
+	return 1 + (size + 6) / 7;
+}
+
+/* Both ways */
+static unsigned int sdo_req__estimate_bits(const struct sdo_req* req)
+{
+	size_t n_frames = 0;
+
+	if (req->is_batch) {
+		const struct sdo_batch* batch = (const struct sdo_batch*)req;
+
+		for (size_t i = 0; i < sdo_batch_length(batch); ++i) {
+			const struct sdo_batch_item* item =
+				sdo_batch_get_item(batch, i);
+			n_frames += sdo_req__estimate_frames(item->type,
+							     item->data.index);
+		}
+	} else {
+		n_frames = sdo_req__estimate_frames(req->type, req->data.index);
+	}
+
+	return 2 * n_frames * SDO_REQ_FRAME_BITS;
+}
+
+static int sdo_req_queue__may_start(struct sdo_req_queue* self,
+				    enum sdo_req_priority prio)
+{
+	if (prio != SDO_REQ_PRIO_BACKGROUND || !self->throttle)
+		return 1;
+
+	const struct sdo_req* req = TAILQ_FIRST(&self->list[prio]);
+
+	return sdo_throttle_admit(self->throttle, gettime_us(CLOCK_MONOTONIC),
+				  sdo_req__estimate_bits(req), self->idle) == 0;
+}
+
+/* Returns -1 if all lists are empty, or if only background requests are
+ * waiting and the bus is too busy for them.
+ */
+static int sdo_req_queue__pick_list(struct sdo_req_queue* self)
+{
+	int picked = -1;
+
+	for (size_t i = 0; i < SDO_REQ_N_PRIORITIES; ++i) {
+		enum sdo_req_priority prio = sdo_req__priority_order[i];
+		if (TAILQ_EMPTY(&self->list[prio]))
+			continue;
+
+		if (picked < 0
+		 || self->n_passed_over[prio] >= SDO_REQ_MAX_PASSED_OVER)
+			picked = prio;
+	}
+
+	/* Only asked once it would otherwise be started, as it takes from
+	 * the bucket
+	 */
+	if (picked == SDO_REQ_PRIO_BACKGROUND
+	 && !sdo_req_queue__may_start(self, SDO_REQ_PRIO_BACKGROUND)) {
+		picked = -1;
+
+		for (size_t i = 0; i < SDO_REQ_N_PRIORITIES && picked < 0; ++i) {
+			enum sdo_req_priority prio = sdo_req__priority_order[i];
+			if (prio != SDO_REQ_PRIO_BACKGROUND
+			 && !TAILQ_EMPTY(&self->list[prio]))
+				picked = prio;
+		}
+	}
+
+	for (int i = 0; i < SDO_REQ_N_PRIORITIES; ++i)
+		if (i != picked && !TAILQ_EMPTY(&self->list[i]))
+			++self->n_passed_over[i];
+
+	if (picked >= 0)
+		self->n_passed_over[picked] = 0;
+
+	return picked;
+}
+
+struct sdo_req* sdo_req_queue__dequeue(struct sdo_req_queue* self)
+{
+	sdo_req_queue__drain_intake(self);
+
+	int prio = sdo_req_queue__pick_list(self);
+	if (prio < 0)
+		return NULL;
+
+	struct sdo_req* req = TAILQ_FIRST(&self->list[prio]);
+	TAILQ_REMOVE(&self->list[prio], req, links);
+
+	assert(co_atomic_load(&self->size));
+	co_atomic_sub_fetch(&self->size, 1);
+
+	return req;
+}
+
+int sdo_req_wait_timeout(struct sdo_req* self, int timeout)
+{
+	int* word = sdo_req__status_word(self);
+	uint64_t deadline = gettime_ns(CLOCK_MONOTONIC) + msec_to_nsec(timeout);
+	int rc = 0;
+
+	co_atomic_add_fetch(&self->n_waiters, 1);
+
+	while (co_atomic_load(word) == SDO_REQ_PENDING) {
+		struct timespec ts, *tp = NULL;
+
+		if (timeout >= 0) {
+			uint64_t now = gettime_ns(CLOCK_MONOTONIC);
+			if (now >= deadline) {
+				errno = ETIMEDOUT;
+				rc = -1;
+				break;
+			}
+
+			ts = ns_to_timespec(deadline - now);
+			tp = &ts;
+		}
+
+		syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, SDO_REQ_PENDING,
+			tp, NULL, 0);
+	}
+
+	co_atomic_sub_fetch(&self->n_waiters, 1);
+	return rc;
+}
+
+void sdo_req_wait(struct sdo_req* self)
+{
+	sdo_req_wait_timeout(self, -1);
+}
+
+int sdo_req_resume(struct sdo_req* self)
+{
+	if (!self->channel) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return sdo_async_resume(self->channel);
+}
+
+void sdo_req__on_done(struct sdo_async* async);
+
+void sdo_req__on_stop(void* ptr)
+{
+	struct sdo_req* req = ptr;
+
+	req->channel = NULL;
+
+	if (req->status == SDO_REQ_PENDING) {
+		event_trace_async_end(EVENT_TRACE_SDO_TRANSFER, (uintptr_t)req,
+				      sdo_req__trace_arg(req));
+		sdo_req__cancel_followers(req);
+		sdo_req__set_status(req, SDO_REQ_CANCELLED);
+	}
+
+	sdo_req_unref(req);
+}
+
+static struct sdo_async*
+sdo_req_queue__find_idle_channel(struct sdo_req_queue* self)
+{
+	size_t n_channels = co_atomic_load_acquire(&self->n_channels);
+
+	for (size_t i = 0; i < n_channels; ++i)
+		if (!self->sdo_client[i].is_running)
+			return &self->sdo_client[i];
+
+	return NULL;
+}
+
+static int sdo_req__on_data(struct sdo_async* async, const void* data,
+			    size_t size)
+{
+	struct sdo_req* req = async->context;
+	return req->on_data(req, data, size);
+}
+
+static void sdo_req__start_on_channel(struct sdo_async* channel,
+				      struct sdo_req* req)
+{
+	struct sdo_async_info info = {
+		.type = req->type,
+		.index = req->index,
+		.subindex = req->subindex,
+		.timeout = req->timeout ? req->timeout
+				       : sdo_req_queue_get_timeout(req->parent),
+		.data = req->data.data,
+		.size = req->data.index,
+		.is_data_borrowed = 1,
+		.on_done = sdo_req__on_done,
+		.context = req,
+		.free_fn = sdo_req__on_stop,
+		.use_block = req->use_block,
+		.on_data = req->on_data ? sdo_req__on_data : NULL,
+	};
+
+	req->channel = channel;
+	sdo_async_start(channel, &info);
+}
+
+static void sdo_batch__start_item(struct sdo_async* channel,
+				  struct sdo_batch* self);
+
+static void sdo_req_queue__process(struct sdo_req_queue* queue)
+{
+	struct sdo_async* channel;
+
+	if (queue->is_processing)
+		return;
+
+	queue->is_processing = 1;
+
+	/* Even with all channels busy, so that new uploads can follow running
+	 * ones
+	 */
+	sdo_req_queue__drain_intake(queue);
+
+	while ((channel = sdo_req_queue__find_idle_channel(queue))) {
+		struct sdo_req* req = sdo_req_queue__dequeue(queue);
+		if (!req)
+			break;
+
+		if (event_trace_is_enabled()) {
+			uint32_t arg = sdo_req__trace_arg(req);
+			event_trace_async_end(EVENT_TRACE_SDO_QUEUED,
+					      (uintptr_t)req, arg);
+			event_trace_async_begin(EVENT_TRACE_SDO_TRANSFER,
+						(uintptr_t)req, arg);
+		}
+
+		if (req->is_batch)
+			sdo_batch__start_item(channel, (struct sdo_batch*)req);
+		else
+			sdo_req__start_on_channel(channel, req);
+	}
+
+	queue->is_processing = 0;
+}
+
+void sdo_req__process_queue(struct mloop_idle* idle)
+{
+	sdo_req_queue__process(mloop_idle_get_context(idle));
+}
+
+static void sdo_req__count(struct sdo_req_queue* queue,
+			   const struct sdo_async* async)
+{
+	if (queue && queue->stats)
+		node_stats_count_sdo(queue->stats, async->status,
+				     async->abort_code,
+				     gettime_us(CLOCK_MONOTONIC)
+				     - async->start_time);
+}
+
+void sdo_req__on_done(struct sdo_async* async)
+{
+	struct sdo_req* req = async->context;
+	assert(req != NULL);
+
+	assert(async->status != SDO_REQ_PENDING);
+	enum sdo_req_status status = async->status;
+	req->abort_code = async->abort_code;
+	req->is_size_indicated = async->is_size_indicated;
+
+	if (req->type == SDO_REQ_UPLOAD)
+		if (sdo_req__take_buffer(&req->data, async) < 0)
+			status = SDO_REQ_NOMEM;
+
+	struct sdo_req_queue* queue = req->parent;
+	assert(queue);
+
+	sdo_req__count(queue, async);
+
+	event_trace_async_end(EVENT_TRACE_SDO_TRANSFER, (uintptr_t)req,
+			      sdo_req__trace_arg(req));
+
+	/* The object may have changed even if the download failed */
+	if (req->type == SDO_REQ_DOWNLOAD)
+		sdo_req_queue__cache_drop(queue, req->index, req->subindex);
+	else if (status == SDO_REQ_OK && req->cache_max_age != 0
+	      && !req->on_data)
+		sdo_req_queue__cache_store(queue, req);
+
+	sdo_req__finish_followers(req, status);
+
+	/* Waiters may read the data as soon as the status is set */
+	sdo_req__set_status(req, status);
+
+	sdo_req_fn on_done = req->on_done;
+	if (on_done)
+		on_done(req);
+
+	/* The channel is idle now */
+	mloop_idle_notify(queue->idle);
+}
+
+/* Returns -1 if the request has to go to the node */
+static int sdo_req__start_from_cache(struct sdo_req* self,
+				     struct sdo_req_queue* queue)
+{
+	if (self->type != SDO_REQ_UPLOAD || self->cache_max_age == 0
+	 || self->on_data)
+		return -1;
+
+	if (sdo_req_queue__cache_load(queue, self) < 0)
+		return -1;
+
+	sdo_req__set_status(self, SDO_REQ_OK);
+
+	sdo_req_fn on_done = self->on_done;
+	if (on_done)
+		on_done(self);
+
+	return 0;
+}
+
+int sdo_req_start(struct sdo_req* self, struct sdo_req_queue* queue)
+{
+	if (sdo_req__start_from_cache(self, queue) == 0)
+		return 0;
+
+	sdo_req_ref(self);
+
+	if (sdo_req_queue__enqueue(queue, self) == 0)
+		return 0;
+
+	sdo_req_unref(self);
+	return -1;
+}
+
+
+void sdo_batch_init(struct sdo_batch* self, sdo_req_fn on_done, void* context)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->req.ref = 1;
+	self->req.is_batch = 1;
+	self->req.on_done = on_done;
+	self->req.context = context;
+}
+
+struct sdo_batch* sdo_batch_new(sdo_req_fn on_done, void* context)
+{
+	struct sdo_batch* self = mem_alloc(MEM_TAG_SDO_REQ, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	sdo_batch_init(self, on_done, context);
+	return self;
+}
+
+static struct sdo_batch_item* sdo_batch__add(struct sdo_batch* self,
+					     enum sdo_req_type type,
+					     int index, int subindex)
+{
+	struct sdo_batch_item item = {
+		.type = type,
+		.index = index,
+		.subindex = subindex,
+	};
+
+	if (vector_append(&self->items, &item, sizeof(item)) < 0)
+		return NULL;
+
+	return sdo_batch_get_item(self, sdo_batch_length(self) - 1);
+}
+
+int sdo_batch_add_upload(struct sdo_batch* self, int index, int subindex)
+{
+	return sdo_batch__add(self, SDO_REQ_UPLOAD, index, subindex) ? 0 : -1;
+}
+
+int sdo_batch_add_download(struct sdo_batch* self, int index, int subindex,
+			   const void* data, size_t size)
+{
+	struct sdo_batch_item* item;
+	item = sdo_batch__add(self, SDO_REQ_DOWNLOAD, index, subindex);
+	if (!item)
+		return -1;
+
+	if (vector_assign(&item->data, data, size) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	vector_destroy(&item->data);
+	self->items.index -= sizeof(*item);
+	return -1;
+}
+
+int sdo_batch_add_check(struct sdo_batch* self, int index, int subindex,
+			size_t size, uint64_t expected, uint64_t mask)
+{
+	if (size == 0 || size > sizeof(expected)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct sdo_batch_item* item;
+	item = sdo_batch__add(self, SDO_REQ_UPLOAD, index, subindex);
+	if (!item)
+		return -1;
+
+	item->expected_size = size;
+	item->expected_value = expected;
+	item->expected_mask = mask;
+	return 0;
+}
+
+int sdo_batch_start(struct sdo_batch* self, struct sdo_req_queue* queue)
+{
+	if (sdo_batch_length(self) == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return sdo_req_start(&self->req, queue);
+}
+
+static void sdo_batch__on_item_done(struct sdo_async* async);
+
+/* This is called once for every item that was started: after it is done, or
+ * when it is stopped. The latter is the only case where the number of
+ * releases can overtake the number of finished items.
+ */
+static void sdo_batch__on_item_stop(void* ptr)
+{
+	struct sdo_batch* self = ptr;
+
+	if (++self->n_released > self->n_finished &&
+	    self->req.status == SDO_REQ_PENDING) {
+		sdo_req__set_status(&self->req, SDO_REQ_CANCELLED);
+		sdo_req_unref(&self->req);
+	}
+
+	sdo_req_unref(&self->req);
+}
+
+static void sdo_batch__start_item(struct sdo_async* channel,
+				  struct sdo_batch* self)
+{
+	struct sdo_batch_item* item = sdo_batch_get_item(self, self->n_finished);
+
+	struct sdo_async_info info = {
+		.type = item->type,
+		.index = item->index,
+		.subindex = item->subindex,
+		.timeout = self->req.timeout
+			 ? self->req.timeout
+			 : sdo_req_queue_get_timeout(self->req.parent),
+		.data = item->data.data,
+		.size = item->data.index,
+		.is_data_borrowed = 1,
+		.on_done = sdo_batch__on_item_done,
+		.context = self,
+		.free_fn = sdo_batch__on_item_stop,
+		.use_block = self->req.use_block || item->use_block,
+	};
+
+	sdo_req_ref(&self->req);
+	sdo_async_start(channel, &info);
+}
+
+static void sdo_batch__finish(struct sdo_batch* self)
+{
+	enum sdo_req_status status = SDO_REQ_OK;
+	size_t length = sdo_batch_length(self);
+
+	for (size_t i = 0; i < length && status == SDO_REQ_OK; ++i) {
+		const struct sdo_batch_item* item = sdo_batch_get_item(self, i);
+		if (item->policy != SDO_BATCH_IGNORE)
+			status = item->status;
+	}
+
+	event_trace_async_end(EVENT_TRACE_SDO_TRANSFER, (uintptr_t)&self->req,
+			      sdo_req__trace_arg(&self->req));
+
+	sdo_req__set_status(&self->req, status);
+
+	sdo_req_fn on_done = self->req.on_done;
+	if (on_done)
+		on_done(&self->req);
+
+	if (self->req.parent)
+		mloop_idle_notify(self->req.parent->idle);
+
+	/* Drop the reference that was taken by sdo_req_start() */
+	sdo_req_unref(&self->req);
+}
+
+static int sdo_batch__is_expected(const struct sdo_batch_item* item)
+{
+	if (item->data.index != item->expected_size)
+		return 0;
+
+	const uint8_t* data = item->data.data;
+	uint64_t value = 0;
+
+	for (size_t i = 0; i < item->expected_size; ++i)
+		value |= (uint64_t)data[i] << (8 * i);
+
+	return ((value ^ item->expected_value) & item->expected_mask) == 0;
+}
+
+/* The items that follow are never started */
+static void sdo_batch__cancel_rest(struct sdo_batch* self)
+{
+	size_t length = sdo_batch_length(self);
+
+	for (size_t i = self->n_finished; i < length; ++i)
+		sdo_batch_get_item(self, i)->status = SDO_REQ_CANCELLED;
+
+	self->n_finished = length;
+}
+
+static void sdo_batch__on_item_done(struct sdo_async* async)
+{
+	struct sdo_batch* self = async->context;
+	assert(self != NULL);
+
+	struct sdo_batch_item* item = sdo_batch_get_item(self, self->n_finished);
+
+	assert(async->status != SDO_REQ_PENDING);
+	sdo_req__count(self->req.parent, async);
+
+	item->status = async->status;
+	item->abort_code = async->abort_code;
+	item->is_size_indicated = async->is_size_indicated;
+
+	if (item->type == SDO_REQ_UPLOAD) {
+		if (sdo_req__take_buffer(&item->data, async) < 0)
+			item->status = SDO_REQ_NOMEM;
+
+		if (item->status == SDO_REQ_OK && item->expected_size > 0
+		 && !sdo_batch__is_expected(item)) {
+			item->status = SDO_REQ_LOCAL_ABORT;
+			item->abort_code = SDO_ABORT_NVAL;
+		}
+	} else {
+		sdo_req_queue__cache_drop(self->req.parent, item->index,
+					  item->subindex);
+	}
+
+	/* The next item goes out straight away on the same channel, so nothing
+	 * else gets between items of the batch.
+	 */
+	if (++self->n_finished < sdo_batch_length(self)
+	 && (self->req.is_cancelled
+	  || (item->status != SDO_REQ_OK && item->policy == SDO_BATCH_STOP)))
+		sdo_batch__cancel_rest(self);
+
+	if (self->n_finished < sdo_batch_length(self))
+		sdo_batch__start_item(async, self);
+	else
+		sdo_batch__finish(self);
+}
+
+/* Followers of the owner are taken off the request that they follow */
+static void sdo_req__take_followers(struct sdo_req* self, const void* owner,
+				    struct sdo_req_list* dst)
+{
+	struct sdo_req** link = &self->followers;
+
+	while (*link) {
+		struct sdo_req* follower = *link;
+		if (follower->owner != owner) {
+			link = &follower->next_follower;
+			continue;
+		}
+
+		*link = follower->next_follower;
+		follower->next_follower = NULL;
+		TAILQ_INSERT_TAIL(dst, follower, links);
+	}
+}
+
+static void sdo_req_queue__take_waiting(struct sdo_req_queue* self,
+					const void* owner,
+					struct sdo_req_list* dst)
+{
+	size_t n_taken = 0;
+
+	sdo_req_queue__drain_intake(self);
+
+	for (size_t i = 0; i < SDO_REQ_N_PRIORITIES; ++i) {
+		struct sdo_req* req = TAILQ_FIRST(&self->list[i]);
+
+		while (req) {
+			struct sdo_req* next = TAILQ_NEXT(req, links);
+
+			sdo_req__take_followers(req, owner, dst);
+
+			if (req->owner == owner && !req->followers) {
+				TAILQ_REMOVE(&self->list[i], req, links);
+				TAILQ_INSERT_TAIL(dst, req, links);
+				++n_taken;
+			}
+
+			req = next;
+		}
+	}
+
+	co_atomic_sub_fetch(&self->size, n_taken);
+
+	size_t n_channels = co_atomic_load_acquire(&self->n_channels);
+	for (size_t i = 0; i < n_channels; ++i) {
+		struct sdo_async* channel = &self->sdo_client[i];
+		if (channel->is_running && channel->context)
+			sdo_req__take_followers(channel->context, owner, dst);
+	}
+}
+
+static void sdo_req__finish_cancelled(struct sdo_req* self)
+{
+	event_trace_async_end(EVENT_TRACE_SDO_QUEUED, (uintptr_t)self,
+			      sdo_req__trace_arg(self));
+
+	if (self->is_batch)
+		sdo_batch__cancel_rest((struct sdo_batch*)self);
+
+	sdo_req__set_status(self, SDO_REQ_CANCELLED);
+
+	sdo_req_fn on_done = self->on_done;
+	if (on_done)
+		on_done(self);
+
+	sdo_req_unref(self);
+}
+
+/* Done functions may make new requests, so the lists and the channels are
+ * not walked while they are called.
+ */
+size_t sdo_req_queue_cancel(struct sdo_req_queue* self, const void* owner)
+{
+	struct sdo_req_list cancelled = TAILQ_HEAD_INITIALIZER(cancelled);
+	size_t n_cancelled = 0;
+
+	if (!owner || !self->is_active)
+		return 0;
+
+	sdo_req_queue__take_waiting(self, owner, &cancelled);
+
+	struct sdo_req* req;
+	while ((req = TAILQ_FIRST(&cancelled))) {
+		TAILQ_REMOVE(&cancelled, req, links);
+		sdo_req__finish_cancelled(req);
+		++n_cancelled;
+	}
+
+	struct sdo_async* running[SDO_REQ_MAX_CHANNELS];
+	size_t n_running = 0;
+
+	size_t n_channels = co_atomic_load_acquire(&self->n_channels);
+	for (size_t i = 0; i < n_channels; ++i) {
+		struct sdo_async* channel = &self->sdo_client[i];
+		if (!channel->is_running || !channel->context)
+			continue;
+
+		req = channel->context;
+		if (req->owner != owner || req->followers)
+			continue;
+
+		/* A batch stops after the item that is aborted */
+		req->is_cancelled = 1;
+		running[n_running++] = channel;
+	}
+
+	for (size_t i = 0; i < n_running; ++i)
+		if (sdo_async_abort(running[i], SDO_ABORT_GENERAL) == 0)
+			++n_cancelled;
+
+	return n_cancelled;
+}
+
+size_t sdo_req_queues_cancel(struct sdo_req_queue* queues, const void* owner)
+{
+	size_t n_cancelled = 0;
+
+	for (size_t i = 1; i < 128; ++i)
+		n_cancelled += sdo_req_queue_cancel(&queues[i], owner);
+
+	return n_cancelled;
+}
@@ -257,15 +257,8 @@ int sdo_srv__ul_init_res(struct sdo_srv* self)
 	return sdo_srv__send(self, &cf);
 }
 
-int sdo_srv__ul_init_req(struct sdo_srv* self, const struct can_frame* cf)
+int sdo_srv__ul_start(struct sdo_srv* self)
 {
-	if (sdo_srv__init_req(self, cf) < 0)
-		return -1;
-
-	self->req_type = SDO_REQ_UPLOAD;
-	if (sdo_srv__on_init(self) < 0)
-		return -1;
-
 	if (self->buffer.index <= SDO_EXPEDIATED_DATA_SIZE)
 		return sdo_srv__ul_expediated(self);
 
@@ -276,6 +269,18 @@ int sdo_srv__ul_init_req(struct sdo_srv* self, const struct can_frame* cf)
 	return sdo_srv__ul_init_res(self);
 }
 
+int sdo_srv__ul_init_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	if (sdo_srv__init_req(self, cf) < 0)
+		return -1;
+
+	self->req_type = SDO_REQ_UPLOAD;
+	if (sdo_srv__on_init(self) < 0)
+		return -1;
+
+	return sdo_srv__ul_start(self);
+}
+
 int sdo_srv__ul_seg_req(struct sdo_srv* self, const struct can_frame* cf)
 {
 	if (self->comm_state != SDO_SRV_COMM_UL_SEG_REQ)
@@ -315,10 +320,277 @@ int sdo_srv__ul_seg_req(struct sdo_srv* self, const struct can_frame* cf)
 	return sdo_srv__send(self, &rcf);
 }
 
+int sdo_srv__blk_dl_res(struct sdo_srv* self, enum sdo_block_cs cs)
+{
+	struct can_frame cf;
+	sdo_clear_frame(&cf);
+	sdo_set_cs(&cf, SDO_SCS_BLK_DL_RES);
+	sdo_set_block_cs(&cf, cs);
+
+	switch (cs) {
+	case SDO_BLOCK_INIT:
+		sdo_set_block_crc_supported(&cf);
+		sdo_set_index(&cf, self->index);
+		sdo_set_subindex(&cf, self->subindex);
+		cf.data[SDO_BLOCK_SIZE_IDX] = self->block_size;
+		break;
+	case SDO_BLOCK_ACK:
+		cf.data[SDO_BLOCK_ACKSEQ_IDX] = self->seqno;
+		cf.data[SDO_BLOCK_NEXT_SIZE_IDX] = self->block_size;
+		break;
+	default:
+		break;
+	}
+
+	cf.can_dlc = CAN_MAX_DLC;
+	return sdo_srv__send(self, &cf);
+}
+
+int sdo_srv__blk_dl_init_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	if (sdo_srv__init_req(self, cf) < 0)
+		return -1;
+
+	self->req_type = SDO_REQ_DOWNLOAD;
+
+	if (sdo_srv__on_init(self) < 0)
+		return -1;
+
+	if (sdo_is_block_size_indicated(cf) && cf->can_dlc == CAN_MAX_DLC)
+		if (vector_reserve(&self->buffer,
+				   sdo_get_indicated_size(cf)) < 0)
+			return sdo_srv_abort(self, SDO_ABORT_NOMEM);
+
+	self->is_crc_used = sdo_is_block_crc_supported(cf);
+	self->block_size = SDO_BLOCK_MAX_SIZE;
+	self->seqno = 0;
+	self->status = SDO_REQ_PENDING;
+	self->comm_state = SDO_SRV_COMM_BLK_DL_SEG_REQ;
+
+	return sdo_srv__blk_dl_res(self, SDO_BLOCK_INIT);
+}
+
+int sdo_srv__blk_dl_seg_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	int seqno = sdo_get_block_seqno(cf);
+	int is_last = sdo_is_last_block_segment(cf);
+	int is_in_sequence = seqno == self->seqno + 1;
+
+	/* Out of sequence segments are dropped and the client sends them again
+	 * in the next block.
+	 */
+	if (is_in_sequence) {
+		const void* data = &cf->data[SDO_SEGMENT_IDX];
+		if (vector_append(&self->buffer, data,
+				  SDO_SEGMENT_MAX_SIZE) < 0)
+			return sdo_srv_abort(self, SDO_ABORT_NOMEM);
+
+		self->seqno = seqno;
+	}
+
+	if (!is_last && seqno < self->block_size)
+		return 0;
+
+	int rc = sdo_srv__blk_dl_res(self, SDO_BLOCK_ACK);
+	self->seqno = 0;
+
+	if (is_last && is_in_sequence)
+		self->comm_state = SDO_SRV_COMM_BLK_DL_END_REQ;
+
+	return rc;
+}
+
+int sdo_srv__blk_dl_end_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	if (self->comm_state != SDO_SRV_COMM_BLK_DL_END_REQ)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	if (cf->can_dlc < SDO_BLOCK_CRC_IDX + 2)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	size_t unused = sdo_get_block_unused_size(cf);
+	if (unused > self->buffer.index)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	self->buffer.index -= unused;
+
+	if (self->is_crc_used) {
+		uint16_t crc = sdo_crc16(0, self->buffer.data,
+					 self->buffer.index);
+		if (crc != sdo_get_block_crc(cf))
+			return sdo_srv_abort(self, SDO_ABORT_CRCERR);
+	}
+
+	self->status = SDO_REQ_OK;
+	if (sdo_srv__on_done(self) < 0)
+		return -1;
+
+	return sdo_srv__blk_dl_res(self, SDO_BLOCK_END);
+}
+
+int sdo_srv__blk_ul_init_res(struct sdo_srv* self)
+{
+	struct can_frame cf;
+	sdo_clear_frame(&cf);
+	sdo_set_cs(&cf, SDO_SCS_BLK_UL_RES);
+	sdo_set_block_crc_supported(&cf);
+	sdo_indicate_block_size(&cf);
+	sdo_set_index(&cf, self->index);
+	sdo_set_subindex(&cf, self->subindex);
+	sdo_set_indicated_size(&cf, self->buffer.index);
+	cf.can_dlc = CAN_MAX_DLC;
+	return sdo_srv__send(self, &cf);
+}
+
+int sdo_srv__blk_ul_init_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	if (sdo_srv__init_req(self, cf) < 0)
+		return -1;
+
+	if (cf->can_dlc < SDO_BLOCK_PST_IDX + 1)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	int block_size = cf->data[SDO_BLOCK_SIZE_IDX];
+	if (block_size < 1 || block_size > SDO_BLOCK_MAX_SIZE)
+		return sdo_srv_abort(self, SDO_ABORT_BLOCKSZ);
+
+	self->req_type = SDO_REQ_UPLOAD;
+	if (sdo_srv__on_init(self) < 0)
+		return -1;
+
+	/* Switch to the regular protocol if the client asks for it */
+	size_t threshold = cf->data[SDO_BLOCK_PST_IDX];
+	if (threshold && self->buffer.index <= threshold)
+		return sdo_srv__ul_start(self);
+
+	self->is_crc_used = sdo_is_block_crc_supported(cf);
+	self->block_size = block_size;
+	self->pos = 0;
+	self->status = SDO_REQ_PENDING;
+	self->comm_state = SDO_SRV_COMM_BLK_UL_START_REQ;
+
+	return sdo_srv__blk_ul_init_res(self);
+}
+
+int sdo_srv__blk_ul_send_block(struct sdo_srv* self)
+{
+	self->block_pos = self->pos;
+	self->seqno = 0;
+
+	do {
+		struct can_frame cf;
+		sdo_clear_frame(&cf);
+
+		size_t size = MIN(SDO_SEGMENT_MAX_SIZE,
+				  self->buffer.index - self->pos);
+		const char* data = self->buffer.data;
+		memcpy(&cf.data[SDO_SEGMENT_IDX], &data[self->pos], size);
+		self->pos += size;
+
+		sdo_set_block_seqno(&cf, ++self->seqno);
+
+		self->is_last_segment_sent = self->pos >= self->buffer.index;
+		if (self->is_last_segment_sent)
+			sdo_end_block_segment(&cf);
+
+		cf.can_dlc = CAN_MAX_DLC;
+		if (sdo_srv__send(self, &cf) < 0)
+			return -1;
+	} while (!self->is_last_segment_sent && self->seqno < self->block_size);
+
+	self->comm_state = SDO_SRV_COMM_BLK_UL_ACK_REQ;
+
+	return 0;
+}
+
+int sdo_srv__blk_ul_start_req(struct sdo_srv* self)
+{
+	if (self->comm_state != SDO_SRV_COMM_BLK_UL_START_REQ)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	return sdo_srv__blk_ul_send_block(self);
+}
+
+int sdo_srv__blk_ul_end_res(struct sdo_srv* self)
+{
+	struct can_frame cf;
+	sdo_clear_frame(&cf);
+	sdo_set_cs(&cf, SDO_SCS_BLK_UL_RES);
+	sdo_set_block_cs(&cf, SDO_BLOCK_END);
+	sdo_set_block_unused_size(&cf, sdo_block_unused_size(self->buffer.index));
+
+	if (self->is_crc_used)
+		sdo_set_block_crc(&cf, sdo_crc16(0, self->buffer.data,
+						 self->buffer.index));
+
+	cf.can_dlc = CAN_MAX_DLC;
+	self->comm_state = SDO_SRV_COMM_BLK_UL_END_REQ;
+	return sdo_srv__send(self, &cf);
+}
+
+int sdo_srv__blk_ul_ack_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	if (self->comm_state != SDO_SRV_COMM_BLK_UL_ACK_REQ)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	if (cf->can_dlc < SDO_BLOCK_NEXT_SIZE_IDX + 1)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	int ackseq = cf->data[SDO_BLOCK_ACKSEQ_IDX];
+	if (ackseq > self->seqno)
+		return sdo_srv_abort(self, SDO_ABORT_SEQNR);
+
+	int block_size = cf->data[SDO_BLOCK_NEXT_SIZE_IDX];
+	if (block_size < 1 || block_size > SDO_BLOCK_MAX_SIZE)
+		return sdo_srv_abort(self, SDO_ABORT_BLOCKSZ);
+
+	self->block_size = block_size;
+
+	if (ackseq == self->seqno && self->is_last_segment_sent)
+		return sdo_srv__blk_ul_end_res(self);
+
+	/* Segments after the acknowledged one are sent again */
+	self->pos = self->block_pos + ackseq * SDO_SEGMENT_MAX_SIZE;
+
+	return sdo_srv__blk_ul_send_block(self);
+}
+
+int sdo_srv__blk_ul_end_req(struct sdo_srv* self)
+{
+	if (self->comm_state != SDO_SRV_COMM_BLK_UL_END_REQ)
+		return sdo_srv_abort(self, SDO_ABORT_GENERAL);
+
+	self->status = SDO_REQ_OK;
+	return sdo_srv__on_done(self);
+}
+
+int sdo_srv__blk_ul_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	switch (sdo_get_block_cs(cf)) {
+	case SDO_BLOCK_INIT: return sdo_srv__blk_ul_init_req(self, cf);
+	case SDO_BLOCK_END: return sdo_srv__blk_ul_end_req(self);
+	case SDO_BLOCK_ACK: return sdo_srv__blk_ul_ack_req(self, cf);
+	case SDO_BLOCK_START: return sdo_srv__blk_ul_start_req(self);
+	}
+
+	abort();
+	return -1;
+}
+
+int sdo_srv__blk_dl_req(struct sdo_srv* self, const struct can_frame* cf)
+{
+	return sdo_is_block_end(cf) ? sdo_srv__blk_dl_end_req(self, cf)
+				    : sdo_srv__blk_dl_init_req(self, cf);
+}
+
 int sdo_srv_feed(struct sdo_srv* self, const struct can_frame* cf)
 {
 	assert(cf->can_id == R_RSDO + self->nodeid);
 
+	if (self->comm_state == SDO_SRV_COMM_BLK_DL_SEG_REQ
+	 && !sdo_is_block_abort(cf))
+		return sdo_srv__blk_dl_seg_req(self, cf);
+
 	enum sdo_ccs cs = sdo_get_cs(cf);
 
 	switch (cs) {
@@ -327,6 +599,8 @@ int sdo_srv_feed(struct sdo_srv* self, const struct can_frame* cf)
 	case SDO_CCS_DL_SEG_REQ: return sdo_srv__dl_seg_req(self, cf);
 	case SDO_CCS_UL_INIT_REQ: return sdo_srv__ul_init_req(self, cf);
 	case SDO_CCS_UL_SEG_REQ: return sdo_srv__ul_seg_req(self, cf);
+	case SDO_CCS_BLK_UL_REQ: return sdo_srv__blk_ul_req(self, cf);
+	case SDO_CCS_BLK_DL_REQ: return sdo_srv__blk_dl_req(self, cf);
 	}
 
 	return sdo_srv_abort(self, SDO_ABORT_INVALID_CS);
@@ -17,7 +17,8 @@
 #include "canopen/byteorder.h"
 #include "canopen/sdo_sync.h"
 
-struct sdo_req* sdo_sync_read(int nodeid, int index, int subindex)
+struct sdo_req* sdo_sync_read(struct sdo_req_queue* queue, int index,
+			      int subindex)
 {
 	struct sdo_req_info info = {
 		.type = SDO_REQ_UPLOAD,
@@ -29,7 +30,7 @@ struct sdo_req* sdo_sync_read(int nodeid, int index, int subindex)
 	if (!req)
 		return NULL;
 
-	if (sdo_req_start(req, sdo_req_queue_get(nodeid)) < 0)
+	if (sdo_req_start(req, queue) < 0)
 		goto done;
 
 	sdo_req_wait(req);
@@ -47,10 +48,11 @@ done:
 }
 
 #define DECLARE_SDO_READ(type, name) \
-type sdo_sync_read_ ## name(int nodeid, int index, int subindex) \
+type sdo_sync_read_ ## name(struct sdo_req_queue* queue, int index, \
+			    int subindex) \
 { \
 	type value = 0; \
-	struct sdo_req* req = sdo_sync_read(nodeid, index, subindex); \
+	struct sdo_req* req = sdo_sync_read(queue, index, subindex); \
 	if (!req) \
 		return 0; \
 	if (req->data.index > sizeof(value)) { \
@@ -72,7 +74,7 @@ DECLARE_SDO_READ(uint16_t, u16)
 DECLARE_SDO_READ(int8_t, i8)
 DECLARE_SDO_READ(uint8_t, u8)
 
-int sdo_sync_write(int nodeid, struct sdo_req_info* info)
+int sdo_sync_write(struct sdo_req_queue* queue, struct sdo_req_info* info)
 {
 	int rc = -1;
 	info->type = SDO_REQ_DOWNLOAD;
@@ -81,7 +83,7 @@ int sdo_sync_write(int nodeid, struct sdo_req_info* info)
 	if (!req)
 		return -1;
 
-	if (sdo_req_start(req, sdo_req_queue_get(nodeid)) < 0)
+	if (sdo_req_start(req, queue) < 0)
 		goto failure;
 
 	sdo_req_wait(req);
@@ -96,13 +98,14 @@ failure:
 }
 
 #define DECLARE_SDO_WRITE(type, name) \
-int sdo_sync_write_ ## name(int nodeid, struct sdo_req_info* info, type value) \
+int sdo_sync_write_ ## name(struct sdo_req_queue* queue, \
+			    struct sdo_req_info* info, type value) \
 { \
 	type network_order = 0; \
 	byteorder(&network_order, &value, sizeof(network_order)); \
 	info->dl_data = &network_order; \
 	info->dl_size = sizeof(network_order); \
-	return sdo_sync_write(nodeid, info); \
+	return sdo_sync_write(queue, info); \
 }
 
 DECLARE_SDO_WRITE(int64_t, i64)
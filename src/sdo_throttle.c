@@ -0,0 +1,176 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <mloop.h>
+
+#include "canopen/sdo_throttle.h"
+#include "bus-load.h"
+#include "co_atomic.h"
+
+#define SDO_THROTTLE_MIN_WAIT 1000 /* us */
+
+static void sdo_throttle__notify_waiting(struct sdo_throttle* self)
+{
+	/* Each queue takes another turn; those that are turned away again
+	 * come back onto the list.
+	 */
+	size_t n_waiting = self->n_waiting;
+	struct mloop_idle* waiting[SDO_THROTTLE_MAX_WAITING];
+	memcpy(waiting, self->waiting, n_waiting * sizeof(waiting[0]));
+	self->n_waiting = 0;
+
+	for (size_t i = 0; i < n_waiting; ++i)
+		mloop_idle_notify(waiting[i]);
+}
+
+static void sdo_throttle__on_timeout(struct mloop_timer* timer)
+{
+	sdo_throttle__notify_waiting(mloop_timer_get_context(timer));
+}
+
+int sdo_throttle_init(struct sdo_throttle* self, struct bl_meter* meter,
+		      unsigned int ceiling)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->meter = meter;
+	self->ceiling = ceiling;
+	self->depth = (uint64_t)ceiling * meter->bitrate * BL_METER_PERIOD
+		    / 1000000000ULL;
+	self->tokens = self->depth;
+
+	if (ceiling == 0)
+		return 0;
+
+	self->timer = mloop_timer_new(mloop_default());
+	if (!self->timer)
+		return -1;
+
+	mloop_timer_set_context(self->timer, self, NULL);
+	mloop_timer_set_callback(self->timer, sdo_throttle__on_timeout);
+	return 0;
+}
+
+void sdo_throttle_destroy(struct sdo_throttle* self)
+{
+	if (!self->timer)
+		return;
+
+	mloop_timer_stop(self->timer);
+	mloop_timer_unref(self->timer);
+	self->timer = NULL;
+	self->n_waiting = 0;
+}
+
+/* Bit times per second that the bus has to spare */
+static uint64_t sdo_throttle__get_rate(struct sdo_throttle* self, uint64_t now)
+{
+	unsigned int load = bl_meter_update(self->meter, now);
+
+	return load < self->ceiling
+	       ? (uint64_t)(self->ceiling - load) * self->meter->bitrate / 1000
+	       : 0;
+}
+
+static void sdo_throttle__refill(struct sdo_throttle* self, uint64_t now,
+				 uint64_t rate)
+{
+	if (self->last_time != 0 && now > self->last_time)
+		self->tokens += (now - self->last_time) * rate / 1000000ULL;
+
+	if (self->tokens > self->depth)
+		self->tokens = self->depth;
+
+	self->last_time = now;
+}
+
+static void sdo_throttle__add_waiter(struct sdo_throttle* self,
+				     struct mloop_idle* waiter)
+{
+	size_t i;
+	for (i = 0; i < self->n_waiting; ++i)
+		if (self->waiting[i] == waiter)
+			break;
+
+	if (i == self->n_waiting && i < SDO_THROTTLE_MAX_WAITING)
+		self->waiting[self->n_waiting++] = waiter;
+}
+
+static void sdo_throttle__wait(struct sdo_throttle* self,
+			       struct mloop_idle* waiter, uint64_t rate)
+{
+	sdo_throttle__add_waiter(self, waiter);
+
+	if (mloop_timer_is_started(self->timer))
+		return;
+
+	/* Without anything to spare, look again when the load is next
+	 * measured.
+	 */
+	uint64_t wait = rate ? (uint64_t)-self->tokens * 1000000ULL / rate
+			     : BL_METER_PERIOD;
+	if (wait < SDO_THROTTLE_MIN_WAIT)
+		wait = SDO_THROTTLE_MIN_WAIT;
+	if (wait > BL_METER_TAU)
+		wait = BL_METER_TAU;
+
+	mloop_timer_set_time(self->timer, wait * 1000ULL);
+	mloop_timer_start(self->timer);
+}
+
+int sdo_throttle_admit(struct sdo_throttle* self, uint64_t now,
+		       unsigned int n_bits, struct mloop_idle* waiter)
+{
+	if (self->is_held) {
+		co_atomic_add_relaxed(&self->n_deferred, 1);
+		sdo_throttle__add_waiter(self, waiter);
+		return -1;
+	}
+
+	if (self->ceiling == 0 || self->meter->bitrate == 0)
+		return 0;
+
+	uint64_t rate = sdo_throttle__get_rate(self, now);
+	sdo_throttle__refill(self, now, rate);
+
+	if (self->tokens < 0 || (rate == 0 && self->tokens < n_bits)) {
+		co_atomic_add_relaxed(&self->n_deferred, 1);
+		sdo_throttle__wait(self, waiter, rate);
+		return -1;
+	}
+
+	self->tokens -= n_bits;
+	co_atomic_add_relaxed(&self->n_admitted, 1);
+	return 0;
+}
+
+void sdo_throttle_hold(struct sdo_throttle* self, int is_held)
+{
+	int was_held = self->is_held;
+	self->is_held = is_held;
+
+	if (was_held && !is_held)
+		sdo_throttle__notify_waiting(self);
+}
+
+void sdo_throttle_cancel(struct sdo_throttle* self, struct mloop_idle* waiter)
+{
+	for (size_t i = 0; i < self->n_waiting; ++i)
+		if (self->waiting[i] == waiter) {
+			self->waiting[i] = self->waiting[--self->n_waiting];
+			return;
+		}
+}
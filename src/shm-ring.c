@@ -0,0 +1,345 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "shm-ring.h"
+#include "co_atomic.h"
+#include "time-utils.h"
+
+size_t strlcpy(char* dst, const char* src, size_t size);
+
+#define shm_ring__load(ptr, order) __atomic_load_n(ptr, __ATOMIC_ ## order)
+#define shm_ring__store(ptr, value, order) \
+	__atomic_store_n(ptr, value, __ATOMIC_ ## order)
+
+static inline uint64_t shm_ring__busy(uint64_t position)
+{
+	return 2 * position + 1;
+}
+
+static inline uint64_t shm_ring__done(uint64_t position)
+{
+	return 2 * position + 2;
+}
+
+static inline size_t shm_ring__size(size_t length)
+{
+	return sizeof(struct shm_ring_header)
+	     + length * sizeof(struct shm_ring_slot);
+}
+
+static inline int shm_ring__futex(uint32_t* addr, int op, uint32_t value,
+				  const struct timespec* timeout)
+{
+	return syscall(SYS_futex, addr, op, value, timeout, NULL, 0);
+}
+
+static void shm_ring__set_storage(struct shm_ring* self, void* data)
+{
+	self->header = data;
+	self->slots = (struct shm_ring_slot*)(self->header + 1);
+}
+
+static int shm_ring__is_header_valid(const struct shm_ring_header* header,
+				     size_t size)
+{
+	return shm_ring__load(&header->magic, ACQUIRE) == SHM_RING_MAGIC
+	    && header->version == SHM_RING_VERSION
+	    && header->slot_size == sizeof(struct shm_ring_slot)
+	    && header->length > 0
+	    && (header->length & (header->length - 1)) == 0
+	    && shm_ring__size(header->length) == size;
+}
+
+void shm_ring_make_name(char* dst, size_t size, const char* iface)
+{
+	snprintf(dst, size, "/canopen2.%s.frames", iface);
+}
+
+int shm_ring_create(struct shm_ring* self, const char* name, size_t length)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->length = 2;
+	while (self->length < length)
+		self->length <<= 1;
+
+	self->map_size = shm_ring__size(self->length);
+	strlcpy(self->name, name, sizeof(self->name));
+
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0660);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, self->map_size) < 0)
+		goto failure;
+
+	void* data = mmap(NULL, self->map_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	shm_ring__set_storage(self, data);
+
+	self->header->version = SHM_RING_VERSION;
+	self->header->slot_size = sizeof(struct shm_ring_slot);
+	self->header->length = self->length;
+
+	/* Readers take the ring for valid once they see the magic number */
+	shm_ring__store(&self->header->magic, SHM_RING_MAGIC, RELEASE);
+
+	self->is_owner = 1;
+	return 0;
+
+failure:
+	close(fd);
+	shm_unlink(name);
+	return -1;
+}
+
+int shm_ring_adopt(struct shm_ring* self, const char* name, int fd)
+{
+	memset(self, 0, sizeof(*self));
+	strlcpy(self->name, name, sizeof(self->name));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	if ((size_t)st.st_size < sizeof(struct shm_ring_header)) {
+		errno = EINVAL;
+		goto failure;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	if (!shm_ring__is_header_valid(data, st.st_size)) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm_ring__set_storage(self, data);
+	self->map_size = st.st_size;
+	self->length = self->header->length;
+	self->position = shm_ring__load(&self->header->head, ACQUIRE);
+	self->is_owner = 1;
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+int shm_ring_open(struct shm_ring* self, const char* name)
+{
+	memset(self, 0, sizeof(*self));
+	strlcpy(self->name, name, sizeof(self->name));
+
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	if ((size_t)st.st_size < sizeof(struct shm_ring_header)) {
+		errno = EINVAL;
+		goto failure;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+
+	if (!shm_ring__is_header_valid(data, st.st_size)) {
+		munmap(data, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	shm_ring__set_storage(self, data);
+	self->map_size = st.st_size;
+	self->length = self->header->length;
+	self->position = shm_ring__load(&self->header->head, ACQUIRE);
+	return 0;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+void shm_ring_destroy(struct shm_ring* self)
+{
+	if (!self->header)
+		return;
+
+	if (self->is_owner)
+		shm_unlink(self->name);
+
+	munmap(self->header, self->map_size);
+	self->header = NULL;
+}
+
+void shm_ring_write(struct shm_ring* self, const struct can_frame* cf,
+		    uint64_t timestamp)
+{
+	uint64_t position = self->position++;
+	struct shm_ring_slot* slot = &self->slots[position & (self->length - 1)];
+
+	shm_ring__store(&slot->sequence, shm_ring__busy(position), RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->timestamp = timestamp;
+	slot->cf = *cf;
+
+	shm_ring__store(&slot->sequence, shm_ring__done(position), RELEASE);
+}
+
+void shm_ring_publish(struct shm_ring* self)
+{
+	struct shm_ring_header* header = self->header;
+
+	if (shm_ring__load(&header->head, RELAXED) == self->position)
+		return;
+
+	co_atomic_store(&header->head, self->position);
+	co_atomic_add_fetch(&header->futex, 1);
+
+	if (co_atomic_load(&header->n_waiters) > 0)
+		shm_ring__futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* A reader that has been lapped goes on from half a lap behind the writer, so
+ * that it is not overtaken again right away.
+ */
+static void shm_ring__catch_up(struct shm_ring* self, uint64_t head)
+{
+	if (head < self->position + self->length)
+		head = self->position + self->length;
+
+	uint64_t position = head - self->length / 2;
+
+	self->n_lost += position - self->position;
+	self->position = position;
+}
+
+size_t shm_ring_read(struct shm_ring* self, struct can_frame* cfs,
+		     uint64_t* timestamps, size_t n)
+{
+	struct shm_ring_header* header = self->header;
+	uint64_t head = shm_ring__load(&header->head, ACQUIRE);
+	size_t count = 0;
+
+	if (head - self->position > self->length)
+		shm_ring__catch_up(self, head);
+
+	while (count < n && self->position < head) {
+		uint64_t position = self->position;
+		struct shm_ring_slot* slot =
+			&self->slots[position & (self->length - 1)];
+
+		uint64_t sequence = shm_ring__load(&slot->sequence, ACQUIRE);
+
+		cfs[count] = slot->cf;
+		timestamps[count] = slot->timestamp;
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* The writer has come round to the slot again */
+		if (sequence != shm_ring__done(position)
+		 || shm_ring__load(&slot->sequence, RELAXED) != sequence) {
+			head = shm_ring__load(&header->head, ACQUIRE);
+			shm_ring__catch_up(self, head);
+			continue;
+		}
+
+		++self->position;
+		++count;
+	}
+
+	return count;
+}
+
+static inline int shm_ring__is_readable(const struct shm_ring* self)
+{
+	return shm_ring__load(&self->header->head, ACQUIRE) != self->position;
+}
+
+int shm_ring_wait(struct shm_ring* self, int timeout)
+{
+	struct shm_ring_header* header = self->header;
+	uint64_t t_end = gettime_us(CLOCK_MONOTONIC) + timeout * 1000LL;
+
+	while (1) {
+		uint32_t futex = co_atomic_load(&header->futex);
+
+		if (shm_ring__is_readable(self))
+			return 1;
+
+		struct timespec ts;
+		struct timespec* tsp = NULL;
+
+		if (timeout >= 0) {
+			uint64_t t = gettime_us(CLOCK_MONOTONIC);
+			if (t >= t_end)
+				return 0;
+
+			ts.tv_sec = (t_end - t) / 1000000ULL;
+			ts.tv_nsec = (t_end - t) % 1000000ULL * 1000ULL;
+			tsp = &ts;
+		}
+
+		/* The writer checks for waiters after it bumps the futex, so
+		 * either it wakes us or the futex has changed by the time we
+		 * wait on it.
+		 */
+		co_atomic_add_fetch(&header->n_waiters, 1);
+
+		int rc = shm_ring__futex(&header->futex, FUTEX_WAIT, futex, tsp);
+		int saved_errno = errno;
+
+		co_atomic_sub_fetch(&header->n_waiters, 1);
+
+		if (rc < 0 && saved_errno != EAGAIN && saved_errno != ETIMEDOUT) {
+			errno = saved_errno;
+			return -1;
+		}
+	}
+}
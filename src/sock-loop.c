@@ -0,0 +1,269 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "sock-loop.h"
+#include "time-utils.h"
+
+size_t strlcpy(char* dst, const char* src, size_t size);
+
+#define SOCK_LOOP_NAME_MAX 64
+
+/* Everything on a bus is guarded by its mutex, so a frame reaches all
+ * endpoints in the same order.
+ */
+struct sock_loop_bus {
+	struct sock_loop_bus* next;
+	char name[SOCK_LOOP_NAME_MAX];
+	pthread_mutex_t mutex;
+	struct sock_loop* endpoints;
+	int is_virtual_time;
+	uint64_t time;
+};
+
+struct sock_loop {
+	struct sock_loop* next;
+	struct sock_loop_bus* bus;
+	int fd;
+	int is_signalled;
+	uint64_t n_lost;
+
+	/* Frames wait in [tail, head) */
+	uint64_t head, tail;
+	struct can_frame frames[SOCK_LOOP_QUEUE_LENGTH];
+	uint64_t timestamps[SOCK_LOOP_QUEUE_LENGTH];
+};
+
+static pthread_mutex_t sock_loop__mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sock_loop_bus* sock_loop__buses = NULL;
+
+/* Called with sock_loop__mutex held */
+static struct sock_loop_bus* sock_loop__get_bus(const char* name)
+{
+	struct sock_loop_bus* bus;
+
+	for (bus = sock_loop__buses; bus; bus = bus->next)
+		if (strcmp(bus->name, name) == 0)
+			return bus;
+
+	bus = calloc(1, sizeof(*bus));
+	if (!bus)
+		return NULL;
+
+	strlcpy(bus->name, name, sizeof(bus->name));
+	pthread_mutex_init(&bus->mutex, NULL);
+
+	bus->next = sock_loop__buses;
+	sock_loop__buses = bus;
+	return bus;
+}
+
+/* Called with sock_loop__mutex held */
+static void sock_loop__put_bus(struct sock_loop_bus* bus)
+{
+	if (bus->endpoints)
+		return;
+
+	struct sock_loop_bus** link = &sock_loop__buses;
+	while (*link != bus)
+		link = &(*link)->next;
+	*link = bus->next;
+
+	pthread_mutex_destroy(&bus->mutex);
+	free(bus);
+}
+
+struct sock_loop* sock_loop_open(const char* name)
+{
+	if (strlen(name) >= SOCK_LOOP_NAME_MAX) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	struct sock_loop* self = calloc(1, sizeof(*self));
+	if (!self)
+		return NULL;
+
+	self->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (self->fd < 0)
+		goto eventfd_failure;
+
+	pthread_mutex_lock(&sock_loop__mutex);
+
+	struct sock_loop_bus* bus = sock_loop__get_bus(name);
+	if (!bus) {
+		pthread_mutex_unlock(&sock_loop__mutex);
+		goto bus_failure;
+	}
+
+	self->bus = bus;
+
+	pthread_mutex_lock(&bus->mutex);
+	self->next = bus->endpoints;
+	bus->endpoints = self;
+	pthread_mutex_unlock(&bus->mutex);
+
+	pthread_mutex_unlock(&sock_loop__mutex);
+	return self;
+
+bus_failure:
+	close(self->fd);
+eventfd_failure:
+	free(self);
+	return NULL;
+}
+
+void sock_loop_close(struct sock_loop* self)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&sock_loop__mutex);
+
+	pthread_mutex_lock(&bus->mutex);
+	struct sock_loop** link = &bus->endpoints;
+	while (*link != self)
+		link = &(*link)->next;
+	*link = self->next;
+	pthread_mutex_unlock(&bus->mutex);
+
+	sock_loop__put_bus(bus);
+
+	pthread_mutex_unlock(&sock_loop__mutex);
+
+	close(self->fd);
+	free(self);
+}
+
+int sock_loop_get_fd(const struct sock_loop* self)
+{
+	return self->fd;
+}
+
+static inline uint64_t sock_loop__now(const struct sock_loop_bus* bus)
+{
+	return bus->is_virtual_time ? bus->time : gettime_us(CLOCK_REALTIME);
+}
+
+/* Called with the bus mutex held */
+static void sock_loop__deliver(struct sock_loop* self,
+			       const struct can_frame* cfs, size_t n,
+			       uint64_t timestamp)
+{
+	size_t space = SOCK_LOOP_QUEUE_LENGTH - (self->head - self->tail);
+	size_t count = n < space ? n : space;
+
+	for (size_t i = 0; i < count; ++i) {
+		size_t slot = (self->head + i) & (SOCK_LOOP_QUEUE_LENGTH - 1);
+
+		self->frames[slot] = cfs[i];
+		self->timestamps[slot] = timestamp;
+	}
+
+	self->head += count;
+	self->n_lost += n - count;
+
+	if (count > 0 && !self->is_signalled) {
+		uint64_t one = 1;
+		ssize_t rc = write(self->fd, &one, sizeof(one));
+		(void)rc;
+		self->is_signalled = 1;
+	}
+}
+
+void sock_loop_send(struct sock_loop* self, const struct can_frame* cfs,
+		    size_t n)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&bus->mutex);
+
+	uint64_t timestamp = sock_loop__now(bus);
+
+	for (struct sock_loop* peer = bus->endpoints; peer; peer = peer->next)
+		if (peer != self)
+			sock_loop__deliver(peer, cfs, n, timestamp);
+
+	pthread_mutex_unlock(&bus->mutex);
+}
+
+size_t sock_loop_recv(struct sock_loop* self, struct can_frame* cfs,
+		      uint64_t* timestamps, size_t n)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&bus->mutex);
+
+	size_t count = self->head - self->tail;
+	if (count > n)
+		count = n;
+
+	for (size_t i = 0; i < count; ++i) {
+		size_t slot = (self->tail + i) & (SOCK_LOOP_QUEUE_LENGTH - 1);
+
+		cfs[i] = self->frames[slot];
+		if (timestamps)
+			timestamps[i] = self->timestamps[slot];
+	}
+
+	self->tail += count;
+
+	if (self->tail == self->head && self->is_signalled) {
+		uint64_t value;
+		ssize_t rc = read(self->fd, &value, sizeof(value));
+		(void)rc;
+		self->is_signalled = 0;
+	}
+
+	pthread_mutex_unlock(&bus->mutex);
+	return count;
+}
+
+uint64_t sock_loop_get_n_lost(const struct sock_loop* self)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&bus->mutex);
+	uint64_t n_lost = self->n_lost;
+	pthread_mutex_unlock(&bus->mutex);
+
+	return n_lost;
+}
+
+void sock_loop_set_time(struct sock_loop* self, uint64_t t)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&bus->mutex);
+	bus->time = t;
+	bus->is_virtual_time = 1;
+	pthread_mutex_unlock(&bus->mutex);
+}
+
+uint64_t sock_loop_get_time(const struct sock_loop* self)
+{
+	struct sock_loop_bus* bus = self->bus;
+
+	pthread_mutex_lock(&bus->mutex);
+	uint64_t t = sock_loop__now(bus);
+	pthread_mutex_unlock(&bus->mutex);
+
+	return t;
+}
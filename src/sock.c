@@ -19,15 +19,92 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <linux/can.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 
 #include "sock.h"
+#include "canopen.h"
 #include "socketcan.h"
 #include "net-util.h"
 #include "can-tcp.h"
+#include "can-wire.h"
+#include "shm-ring.h"
+#include "sock-loop.h"
 #include "trace-buffer.h"
+#include "bus-load.h"
+#include "time-utils.h"
+#include "co_atomic.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#define SOCK_UDP_PORT 5556
+
+/* Loss is tracked for this many senders at a time */
+#define SOCK_UDP_MAX_PEERS 16
+
+/* Bands 0 and 2 of pfifo_fast; the main socket has 0, which is band 1 */
+#define SOCK_TX_PRIORITY_RT 6
+#define SOCK_TX_PRIORITY_BULK 2
 
 size_t strlcpy(char* dst, const char* src, size_t size);
 
+struct sock_txq {
+	pthread_mutex_t mutex;
+	pthread_t owner;
+	size_t size;
+	size_t index;
+	uint64_t n_unsent;
+	struct can_frame frames[];
+};
+
+struct sock_tx_classes {
+	int fd[SOCK_TX_N_CLASSES];
+};
+
+struct sock_udp_peer {
+	uint32_t source;
+	uint32_t next_seq;
+};
+
+/* Frames are taken off the socket a whole datagram at a time. Those that the
+ * caller has not asked for yet wait in frames[index..length).
+ */
+struct sock_udp {
+	struct sockaddr_in group;
+	uint32_t source;
+	uint32_t seq; /* Of the next datagram that is sent */
+	uint64_t n_lost;
+	size_t n_peers_seen;
+	struct sock_udp_peer peers[SOCK_UDP_MAX_PEERS];
+	size_t index;
+	size_t length;
+	struct can_frame frames[CAN_WIRE_DATAGRAM_MAX_FRAMES];
+	uint64_t timestamps[CAN_WIRE_DATAGRAM_MAX_FRAMES];
+};
+
+struct sock_wire {
+	int flags;
+	uint64_t timestamp; /* Of the frames that are being received */
+	struct sock_udp* udp;
+};
+
+/* Stream sockets read as much as there is into a buffer and decode frames
+ * from there, so that a whole batch takes one system call however the stream
+ * happens to be cut.
+ */
+#define SOCK_RXBUF_SIZE 16384
+
+struct sock_rxbuf {
+	size_t start;
+	size_t end;
+	uint8_t data[SOCK_RXBUF_SIZE];
+};
+
 static int sock__open_tcp(const char* addr)
 {
 	char buffer[256];
@@ -41,72 +118,1308 @@ static int sock__open_tcp(const char* addr)
 	return can_tcp_open(buffer, port);
 }
 
+static int sock__open_udp(const char* addr, struct sockaddr_in* group)
+{
+	char buffer[256];
+	strlcpy(buffer, addr, sizeof(buffer));
+	char* portptr = strchr(buffer, ':');
+	int port = SOCK_UDP_PORT;
+	if (portptr) {
+		*portptr++ = '\0';
+		port = atoi(portptr);
+	}
+
+	memset(group, 0, sizeof(*group));
+	group->sin_family = AF_INET;
+	group->sin_port = htons(port);
+
+	if (inet_aton(buffer, &group->sin_addr) == 0
+	 || !IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* Any number of publishers and subscribers may share the group on one
+	 * host. Binding to the group keeps out other traffic to the port.
+	 */
+	net_reuse_addr(fd);
+
+	if (bind(fd, (struct sockaddr*)group, sizeof(*group)) < 0)
+		goto failure;
+
+	struct ip_mreq mreq = {
+		.imr_multiaddr = group->sin_addr,
+		.imr_interface.s_addr = htonl(INADDR_ANY),
+	};
+
+	if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+		       sizeof(mreq)) < 0)
+		goto failure;
+
+	return fd;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+/* Each socket gets its own ID, so that it can tell its own datagrams, which
+ * are looped back to it, from those of other senders on the same host.
+ */
+static uint32_t sock__make_source_id(void)
+{
+	static uint32_t counter = 0;
+
+	uint64_t t = gettime_us(CLOCK_REALTIME);
+	uint32_t n = co_atomic_add_fetch(&counter, 1);
+
+	return (uint32_t)t ^ (uint32_t)(t >> 32) ^ (uint32_t)getpid() << 16
+	     ^ n * 0x9e3779b9U;
+}
+
+static int sock__set_wire(struct sock* sock, int flags);
+
+static int sock__set_udp(struct sock* sock, const struct sockaddr_in* group)
+{
+	struct sock_udp* udp = malloc(sizeof(*udp));
+	if (!udp)
+		return -1;
+
+	memset(udp, 0, sizeof(*udp));
+	udp->group = *group;
+	udp->source = sock__make_source_id();
+
+	if (sock__set_wire(sock, CAN_WIRE_F_TIMESTAMPS) < 0) {
+		free(udp);
+		return -1;
+	}
+
+	sock->wire->udp = udp;
+	return 0;
+}
+
+static int sock__open_loop(struct sock* sock, const char* name)
+{
+	struct sock_loop* loop = sock_loop_open(name);
+	if (!loop)
+		return -1;
+
+	sock->loop = loop;
+	sock->fd = sock_loop_get_fd(loop);
+	return sock->fd;
+}
+
+static int sock__open_shm(struct sock* sock, const char* iface)
+{
+	char name[256];
+	shm_ring_make_name(name, sizeof(name), iface);
+
+	struct shm_ring* ring = malloc(sizeof(*ring));
+	if (!ring)
+		return -1;
+
+	if (shm_ring_open(ring, name) < 0) {
+		free(ring);
+		return -1;
+	}
+
+	sock->shm = ring;
+	return 0;
+}
+
 int sock_open(struct sock* sock, enum sock_type type, const char* addr,
 	      struct tracebuffer* tb)
 {
+	struct sockaddr_in group;
 	int fd = -1;
 	switch (type) {
 	case SOCK_TYPE_CAN: fd = socketcan_open(addr); break;
 	case SOCK_TYPE_TCP: fd = sock__open_tcp(addr); break;
+	case SOCK_TYPE_UDP: fd = sock__open_udp(addr, &group); break;
+	case SOCK_TYPE_SHM: break;
+	case SOCK_TYPE_LOOP: break;
 	default: abort();
 	}
 	sock_init(sock, type, fd, tb);
+
+	if (type == SOCK_TYPE_SHM)
+		return sock__open_shm(sock, addr);
+
+	if (type == SOCK_TYPE_LOOP)
+		return sock__open_loop(sock, addr);
+
+	if (fd >= 0 && type == SOCK_TYPE_UDP && sock__set_udp(sock, &group) < 0) {
+		close(fd);
+		return -1;
+	}
+
 	return fd;
 }
 
+/* Only the legacy TCP format has IDs in network byte order. Compact frames
+ * are encoded when they are sent, so they stay in host order until then.
+ */
+static inline int sock__is_network_order(const struct sock* sock)
+{
+	return sock->type == SOCK_TYPE_TCP && !sock->wire;
+}
+
 static inline struct can_frame*
 sock__frame_htonl(const struct sock* sock, struct can_frame* cf)
 {
-	if (sock->type != SOCK_TYPE_CAN)
+	if (sock__is_network_order(sock))
 		cf->can_id = htonl(cf->can_id);
 	return cf;
 }
 
-static inline struct can_frame*
-sock__frame_ntohl(const struct sock* sock, struct can_frame* cf)
+
+/* The buffer must have room for n + 1 records */
+static size_t sock__encode(const struct sock* sock, uint8_t* buffer,
+			   const struct can_frame* cfs, size_t n)
 {
-	if (sock->type != SOCK_TYPE_CAN)
-		cf->can_id = ntohl(cf->can_id);
-	return cf;
+	size_t size = 0;
+
+	if (sock->wire->flags & CAN_WIRE_F_TIMESTAMPS) {
+		uint64_t current = 0;
+		size += can_wire_encode_timestamp(buffer, &current,
+						  gettime_us(CLOCK_REALTIME));
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		size += can_wire_encode(buffer + size, &cfs[i]);
+
+	return size;
+}
+
+/* Frames are sent in as few datagrams as they fit in */
+static int sock__send_datagrams(const struct sock* sock,
+				const struct can_frame* cfs, size_t n,
+				int flags)
+{
+	struct sock_udp* udp = sock->wire->udp;
+	uint8_t buffer[CAN_WIRE_DATAGRAM_MAX_SIZE];
+
+	while (n > 0) {
+		size_t batch = MIN(n, CAN_WIRE_DATAGRAM_MAX_FRAMES);
+		uint32_t seq = co_atomic_add_fetch(&udp->seq, 1) - 1;
+
+		size_t size = can_wire_encode_datagram_header(buffer,
+							      udp->source, seq);
+		size += sock__encode(sock, buffer + size, cfs, batch);
+
+		if (sendto(sock->fd, buffer, size, flags,
+			   (struct sockaddr*)&udp->group,
+			   sizeof(udp->group)) != (ssize_t)size)
+			return -1;
+
+		cfs += batch;
+		n -= batch;
+	}
+
+	return 0;
+}
+
+static ssize_t sock__send_compact(const struct sock* sock,
+				  const struct can_frame* cfs, size_t n,
+				  int flags)
+{
+	if (sock->type == SOCK_TYPE_UDP)
+		return sock__send_datagrams(sock, cfs, n, flags);
+
+	uint8_t buffer[(n + 1) * CAN_WIRE_MAX_RECORD_SIZE];
+	size_t size = sock__encode(sock, buffer, cfs, n);
+
+	return send(sock->fd, buffer, size, flags) == (ssize_t)size ? 0 : -1;
+}
+
+enum sock_tx_class sock_tx_class_of(const struct can_frame* cf)
+{
+	if (cf->can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG | CAN_ERR_FLAG))
+		return SOCK_TX_NORMAL;
+
+	canid_t id = cf->can_id & CAN_SFF_MASK;
+
+	if (id == R_NMT || id == R_SYNC || (TPDO1_LOW <= id && id <= RPDO4_HIGH))
+		return SOCK_TX_RT;
+
+	if (TSDO_LOW <= id && id <= RSDO_HIGH)
+		return SOCK_TX_BULK;
+
+	return SOCK_TX_NORMAL;
+}
+
+static int sock__tx_fd(const struct sock* sock, const struct can_frame* cf)
+{
+	return sock->tx ? sock->tx->fd[sock_tx_class_of(cf)] : sock->fd;
+}
+
+static int sock__sendmmsg(int fd, struct can_frame* cfs, size_t n)
+{
+	struct mmsghdr msgs[n];
+	struct iovec iovs[n];
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (size_t i = 0; i < n; ++i) {
+		iovs[i].iov_base = &cfs[i];
+		iovs[i].iov_len = sizeof(cfs[i]);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	size_t sent = 0;
+	while (sent < n) {
+		int rc = sendmmsg(fd, &msgs[sent], n - sent, 0);
+		if (rc <= 0)
+			return -1;
+
+		sent += rc;
+	}
+
+	return 0;
+}
+
+/* With class sockets, the frames are sorted by class, most urgent first,
+ * keeping their order within each class.
+ */
+static int sock__flush_can(const struct sock* sock, struct can_frame* cfs,
+			   size_t n)
+{
+	if (!sock->tx)
+		return sock__sendmmsg(sock->fd, cfs, n);
+
+	struct can_frame sorted[n];
+	uint8_t classes[n];
+	size_t start[SOCK_TX_N_CLASSES + 1] = { 0 };
+
+	for (size_t i = 0; i < n; ++i) {
+		classes[i] = sock_tx_class_of(&cfs[i]);
+		++start[classes[i] + 1];
+	}
+
+	for (int c = 0; c < SOCK_TX_N_CLASSES; ++c)
+		start[c + 1] += start[c];
+
+	size_t index[SOCK_TX_N_CLASSES];
+	memcpy(index, start, sizeof(index));
+
+	for (size_t i = 0; i < n; ++i)
+		sorted[index[classes[i]]++] = cfs[i];
+
+	int rc = 0;
+
+	for (int c = 0; c < SOCK_TX_N_CLASSES; ++c)
+		if (start[c + 1] > start[c]
+		 && sock__sendmmsg(sock->tx->fd[c], &sorted[start[c]],
+				   start[c + 1] - start[c]) < 0)
+			rc = -1;
+
+	return rc;
+}
+
+static int sock__flush_tcp(const struct sock* sock, struct can_frame* cfs,
+			   size_t n)
+{
+	if (sock->wire)
+		return sock__send_compact(sock, cfs, n, 0);
+
+	size_t size = n * sizeof(*cfs);
+	return send(sock->fd, cfs, size, 0) == (ssize_t)size ? 0 : -1;
+}
+
+static int sock__flush_nolock(const struct sock* sock)
+{
+	struct sock_txq* txq = sock->txq;
+	int rc = 0;
+
+	if (txq->index == 0)
+		return 0;
+
+	switch (sock->type) {
+	case SOCK_TYPE_CAN:
+		rc = sock__flush_can(sock, txq->frames, txq->index);
+		break;
+	case SOCK_TYPE_TCP:
+		rc = sock__flush_tcp(sock, txq->frames, txq->index);
+		break;
+	case SOCK_TYPE_UDP:
+		rc = sock__send_datagrams(sock, txq->frames, txq->index, 0);
+		break;
+	case SOCK_TYPE_LOOP:
+		sock_loop_send(sock->loop, txq->frames, txq->index);
+		break;
+	case SOCK_TYPE_SHM:
+		errno = EOPNOTSUPP;
+		rc = -1;
+		break;
+	default:
+		abort();
+	}
+
+	if (rc < 0)
+		txq->n_unsent += txq->index;
+
+	txq->index = 0;
+	return rc;
+}
+
+int sock_txq_init(struct sock* sock, size_t size)
+{
+	struct sock_txq* txq;
+
+	txq = malloc(sizeof(*txq) + size * sizeof(txq->frames[0]));
+	if (!txq)
+		return -1;
+
+	pthread_mutex_init(&txq->mutex, NULL);
+	txq->owner = pthread_self();
+	txq->size = size;
+	txq->index = 0;
+	txq->n_unsent = 0;
+
+	sock->txq = txq;
+	return 0;
+}
+
+void sock_txq_destroy(struct sock* sock)
+{
+	struct sock_txq* txq = sock->txq;
+	if (!txq)
+		return;
+
+	sock_flush(sock);
+	sock->txq = NULL;
+
+	pthread_mutex_destroy(&txq->mutex);
+	free(txq);
+}
+
+int sock_flush(const struct sock* sock)
+{
+	struct sock_txq* txq = sock->txq;
+	if (!txq)
+		return 0;
+
+	pthread_mutex_lock(&txq->mutex);
+	int rc = sock__flush_nolock(sock);
+	pthread_mutex_unlock(&txq->mutex);
+
+	return rc;
+}
+
+int sock_stage(const struct sock* sock, struct can_frame* cf)
+{
+	struct sock_txq* txq = sock->txq;
+	int rc = 0;
+
+	if (!txq || !pthread_equal(txq->owner, pthread_self()))
+		return sock_send(sock, cf, 0) == sizeof(*cf) ? 0 : -1;
+
+	pthread_mutex_lock(&txq->mutex);
+
+	if (txq->index >= txq->size)
+		rc = sock__flush_nolock(sock);
+
+	if (sock->tb)
+		tb_append(sock->tb, cf);
+
+	if (sock->meter)
+		bl_meter_count(sock->meter, cf);
+
+	txq->frames[txq->index++] = *sock__frame_htonl(sock, cf);
+
+	pthread_mutex_unlock(&txq->mutex);
+	return rc;
 }
 
 ssize_t sock_send(const struct sock* sock, struct can_frame* cf, int flags)
 {
+	if (sock->type == SOCK_TYPE_SHM) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	sock_flush(sock);
+
 	if (sock->tb)
 		tb_append(sock->tb, cf);
 
-	return send(sock->fd, sock__frame_htonl(sock, cf), sizeof(*cf), flags);
+	if (sock->meter)
+		bl_meter_count(sock->meter, cf);
+
+	if (sock->wire)
+		return sock__send_compact(sock, cf, 1, flags) == 0
+		     ? (ssize_t)sizeof(*cf) : -1;
+
+	if (sock->loop) {
+		sock_loop_send(sock->loop, cf, 1);
+		return sizeof(*cf);
+	}
+
+	return send(sock__tx_fd(sock, cf), sock__frame_htonl(sock, cf),
+		    sizeof(*cf), flags);
 }
 
 int sock_timed_send(const struct sock* sock, struct can_frame* cf, int timeout)
 {
+	if (sock->type == SOCK_TYPE_SHM) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	sock_flush(sock);
+
 	if (sock->tb)
 		tb_append(sock->tb, cf);
 
-	return net_write_frame(sock->fd, sock__frame_htonl(sock, cf), timeout);
+	if (sock->meter)
+		bl_meter_count(sock->meter, cf);
+
+	/* Datagrams never wait for the peer, and neither does a loop */
+	if (sock->type == SOCK_TYPE_UDP)
+		return sock__send_datagrams(sock, cf, 1, 0) == 0
+		       ? (int)sizeof(*cf) : -1;
+
+	if (sock->loop) {
+		sock_loop_send(sock->loop, cf, 1);
+		return sizeof(*cf);
+	}
+
+	if (sock->wire) {
+		uint8_t buffer[2 * CAN_WIRE_MAX_RECORD_SIZE];
+		size_t size = sock__encode(sock, buffer, cf, 1);
+
+		return net_write(sock->fd, buffer, size, timeout)
+		       == (ssize_t)size ? (int)sizeof(*cf) : -1;
+	}
+
+	return net_write_frame(sock__tx_fd(sock, cf), sock__frame_htonl(sock, cf),
+			       timeout);
 }
 
 ssize_t sock_recv(const struct sock* sock, struct can_frame* cf, int flags)
 {
-	ssize_t rsize = recv(sock->fd, cf, sizeof(*cf), flags);
-	if (rsize <= 0)
-		return rsize;
+	ssize_t n = sock_recv_batch(sock, cf, NULL, 1, flags);
+	return n > 0 ? (ssize_t)sizeof(*cf) : n;
+}
 
-	if (sock->tb)
-		tb_append(sock->tb, cf);
+static int sock__wait_readable(const struct sock* sock, int timeout)
+{
+	struct pollfd pollfd = { .fd = sock->fd, .events = POLLIN };
+	return poll(&pollfd, 1, timeout) == 1 ? 0 : -1;
+}
+
+static int sock__has_buffered_frame(const struct sock* sock)
+{
+	struct sock_rxbuf* rxbuf = sock->rxbuf;
+	if (!rxbuf)
+		return 0;
+
+	const uint8_t* p = rxbuf->data + rxbuf->start;
+	size_t size = rxbuf->end - rxbuf->start;
+
+	if (!sock->wire)
+		return size >= sizeof(struct can_frame);
+
+	/* A timestamp record counts, which is close enough */
+	size_t need = can_wire_record_size(p, size);
+	return need > 0 && need <= size;
+}
+
+int sock_poll(const struct sock* sock, int timeout)
+{
+	if (sock->type == SOCK_TYPE_SHM)
+		return shm_ring_wait(sock->shm, timeout);
+
+	if (sock->type == SOCK_TYPE_UDP
+	 && sock->wire->udp->index < sock->wire->udp->length)
+		return 1;
 
-	sock__frame_ntohl(sock, cf);
-	return rsize;
+	if (sock__has_buffered_frame(sock))
+		return 1;
+
+	struct pollfd pollfd = { .fd = sock->fd, .events = POLLIN };
+	return poll(&pollfd, 1, timeout);
+}
+
+/* Frames may be waiting in a buffer, or the socket may be readable without a
+ * whole frame to be had, so the socket being readable tells nothing either
+ * way.
+ */
+static int sock__timed_recv_polled(const struct sock* sock,
+				   struct can_frame* cf, int timeout)
+{
+	uint64_t t_end = gettime_us(CLOCK_MONOTONIC) + timeout * 1000ULL;
+
+	while (1) {
+		ssize_t n = sock_recv(sock, cf, MSG_DONTWAIT);
+		if (n > 0)
+			return sizeof(*cf);
+
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return -1;
+
+		uint64_t t = gettime_us(CLOCK_MONOTONIC);
+		if (t >= t_end
+		 || sock_poll(sock, (t_end - t + 999) / 1000) <= 0) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+	}
 }
 
 int sock_timed_recv(const struct sock* sock, struct can_frame* cf, int timeout)
 {
+	if (sock->type != SOCK_TYPE_CAN)
+		return sock__timed_recv_polled(sock, cf, timeout);
+
 	int rc = net_read_frame(sock->fd, cf, timeout);
 
 	if (rc >= 0 && sock->tb)
 		tb_append(sock->tb, cf);
 
-	sock__frame_ntohl(sock, cf);
 	return rc;
 }
 
+
+static uint64_t sock__get_cmsg_timestamp(struct msghdr* msg)
+{
+	struct cmsghdr* cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		 || cmsg->cmsg_type != SCM_TIMESTAMP)
+			continue;
+
+		struct timeval tv;
+		memcpy(&tv, CMSG_DATA(cmsg), sizeof(tv));
+		return tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+
+	return 0;
+}
+
+/* Receive up to n datagrams of at most stride bytes each into consecutive
+ * slots of the frames array. Datagrams that do not fit, i.e. CAN FD frames
+ * received into classic frames, are dropped. The length of each datagram is
+ * put into sizes if it is not NULL.
+ */
+static ssize_t sock__recvmmsg(const struct sock* sock, void* frames,
+			      size_t stride, uint64_t* timestamps,
+			      size_t* sizes, size_t n, int flags)
+{
+	struct mmsghdr msgs[n];
+	struct iovec iovs[n];
+	char control[n][CMSG_SPACE(sizeof(struct timeval))];
+	int rc;
+	ssize_t count;
+
+	do {
+		memset(msgs, 0, sizeof(msgs));
+
+		for (size_t i = 0; i < n; ++i) {
+			iovs[i].iov_base = (char*)frames + i * stride;
+			iovs[i].iov_len = stride;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+		}
+
+		rc = recvmmsg(sock->fd, msgs, n, flags | MSG_WAITFORONE, NULL);
+		if (rc <= 0)
+			return rc < 0 ? -1 : 0;
+
+		uint64_t now = 0;
+		count = 0;
+
+		for (int i = 0; i < rc; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+				continue;
+
+			uint64_t t = sock__get_cmsg_timestamp(&msgs[i].msg_hdr);
+			if (!t) {
+				if (!now)
+					now = gettime_us(CLOCK_REALTIME);
+				t = now;
+			}
+
+			if (count != i)
+				memcpy((char*)frames + count * stride,
+				       (char*)frames + i * stride, stride);
+
+			timestamps[count] = t;
+			if (sizes)
+				sizes[count] = msgs[i].msg_len;
+
+			++count;
+		}
+	} while (count == 0);
+
+	return count;
+}
+
+static ssize_t sock__recv_batch_can(const struct sock* sock,
+				    struct can_frame* cfs, uint64_t* timestamps,
+				    size_t n, int flags)
+{
+	return sock__recvmmsg(sock, cfs, sizeof(*cfs), timestamps, NULL, n,
+			      flags);
+}
+
+/* Returns 1 if a frame was decoded from the front of the buffer, 0 if more
+ * data is needed and -1 if it holds something other than a frame.
+ */
+static int sock__decode_buffered(const struct sock* sock,
+				 struct sock_rxbuf* rxbuf, struct can_frame* cf,
+				 uint64_t* timestamp, uint64_t* now)
+{
+	struct sock_wire* wire = sock->wire;
+
+	while (1) {
+		const uint8_t* p = rxbuf->data + rxbuf->start;
+		size_t size = rxbuf->end - rxbuf->start;
+
+		if (!wire) {
+			if (size < sizeof(*cf))
+				return 0;
+
+			memcpy(cf, p, sizeof(*cf));
+			cf->can_id = ntohl(cf->can_id);
+			rxbuf->start += sizeof(*cf);
+			break;
+		}
+
+		size_t need = can_wire_record_size(p, size);
+		if (need == 0 || need > size)
+			return 0;
+
+		int rc = can_wire_decode(p, cf, &wire->timestamp);
+		if (rc < 0) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		rxbuf->start += need;
+
+		if (rc > 0 && wire->flags & CAN_WIRE_F_TIMESTAMPS) {
+			*timestamp = wire->timestamp;
+			return 1;
+		}
+
+		if (rc > 0)
+			break;
+	}
+
+	/* The stream carries no timestamps, so each read shares one */
+	if (!*now)
+		*now = gettime_us(CLOCK_REALTIME);
+
+	*timestamp = *now;
+	return 1;
+}
+
+static ssize_t sock__decode_batch(const struct sock* sock,
+				  struct sock_rxbuf* rxbuf,
+				  struct can_frame* cfs, uint64_t* timestamps,
+				  size_t n)
+{
+	uint64_t now = 0;
+	size_t count = 0;
+
+	while (count < n) {
+		int rc = sock__decode_buffered(sock, rxbuf, &cfs[count],
+					       &timestamps[count], &now);
+		if (rc < 0 && count == 0)
+			return -1;
+
+		if (rc <= 0)
+			break;
+
+		++count;
+	}
+
+	return count;
+}
+
+/* The buffer is set up when it is first needed, so that stream sockets get one
+ * however they were made.
+ */
+static struct sock_rxbuf* sock__get_rxbuf(const struct sock* sock)
+{
+	if (sock->rxbuf)
+		return sock->rxbuf;
+
+	struct sock_rxbuf* rxbuf = malloc(sizeof(*rxbuf));
+	if (!rxbuf)
+		return NULL;
+
+	rxbuf->start = 0;
+	rxbuf->end = 0;
+
+	((struct sock*)sock)->rxbuf = rxbuf;
+	return rxbuf;
+}
+
+/* Frames are decoded from whatever has been read already. The stream is only
+ * read from again when that runs out, as much as fits into the buffer. It is
+ * read from once more, without blocking, only if that filled the buffer, so
+ * a batch that comes up short means that the socket has been drained.
+ */
+static ssize_t sock__recv_batch_stream(const struct sock* sock,
+				       struct can_frame* cfs,
+				       uint64_t* timestamps, size_t n,
+				       int flags)
+{
+	struct sock_rxbuf* rxbuf = sock__get_rxbuf(sock);
+	if (!rxbuf)
+		return -1;
+
+	ssize_t count = sock__decode_batch(sock, rxbuf, cfs, timestamps, n);
+	if (count < 0)
+		return -1;
+
+	while ((size_t)count < n) {
+		/* Whatever is left is the beginning of a record */
+		if (rxbuf->start > 0) {
+			memmove(rxbuf->data, rxbuf->data + rxbuf->start,
+				rxbuf->end - rxbuf->start);
+			rxbuf->end -= rxbuf->start;
+			rxbuf->start = 0;
+		}
+
+		size_t space = sizeof(rxbuf->data) - rxbuf->end;
+		ssize_t rsize = recv(sock->fd, rxbuf->data + rxbuf->end, space,
+				     count > 0 ? flags | MSG_DONTWAIT
+					       : flags & ~MSG_WAITALL);
+		if (rsize <= 0)
+			return count > 0 ? count : rsize;
+
+		rxbuf->end += rsize;
+
+		ssize_t rc = sock__decode_batch(sock, rxbuf, &cfs[count],
+						&timestamps[count], n - count);
+		if (rc < 0)
+			return count > 0 ? count : -1;
+
+		count += rc;
+
+		if (count > 0 && (size_t)rsize < space)
+			break;
+	}
+
+	return count;
+}
+
+/* Datagrams that arrive after others from the same sender count as lost in
+ * between. Those that arrive late have already been counted.
+ */
+static void sock__count_lost(struct sock_udp* udp, uint32_t source,
+			     uint32_t seq)
+{
+	size_t n_peers = MIN(udp->n_peers_seen, SOCK_UDP_MAX_PEERS);
+	struct sock_udp_peer* peer = NULL;
+
+	for (size_t i = 0; i < n_peers; ++i)
+		if (udp->peers[i].source == source) {
+			peer = &udp->peers[i];
+			break;
+		}
+
+	if (!peer) {
+		/* The oldest peer makes way when the table is full */
+		peer = &udp->peers[udp->n_peers_seen++ % SOCK_UDP_MAX_PEERS];
+		peer->source = source;
+		peer->next_seq = seq + 1;
+		return;
+	}
+
+	uint32_t gap = seq - peer->next_seq;
+	if (gap >= UINT32_C(1) << 31)
+		return;
+
+	udp->n_lost += gap;
+	peer->next_seq = seq + 1;
+}
+
+/* Returns the number of frames that the datagram held, which may be 0 if it
+ * was not for us, or -1 on error.
+ */
+static ssize_t sock__recv_datagram(const struct sock* sock, int flags)
+{
+	struct sock_wire* wire = sock->wire;
+	struct sock_udp* udp = wire->udp;
+	uint8_t buffer[CAN_WIRE_DATAGRAM_MAX_SIZE];
+	uint32_t source, seq;
+
+	ssize_t size = recv(sock->fd, buffer, sizeof(buffer), flags);
+	if (size < 0)
+		return -1;
+
+	if (can_wire_decode_datagram_header(buffer, size, &source, &seq) < 0
+	 || source == udp->source)
+		return 0;
+
+	sock__count_lost(udp, source, seq);
+
+	size_t pos = CAN_WIRE_DATAGRAM_HEADER_SIZE;
+	size_t count = 0;
+
+	while (count < CAN_WIRE_DATAGRAM_MAX_FRAMES) {
+		size_t need = can_wire_record_size(buffer + pos, size - pos);
+		if (need == 0 || pos + need > (size_t)size)
+			break;
+
+		int rc = can_wire_decode(buffer + pos, &udp->frames[count],
+					 &wire->timestamp);
+		if (rc < 0)
+			break;
+
+		pos += need;
+
+		if (rc > 0)
+			udp->timestamps[count++] = wire->timestamp;
+	}
+
+	udp->index = 0;
+	udp->length = count;
+	return count;
+}
+
+/* Another datagram is only read if all of its frames are sure to fit, unless
+ * nothing has been received yet, so that a caller that asks for at least
+ * CAN_WIRE_DATAGRAM_MAX_FRAMES never leaves any behind.
+ */
+static ssize_t sock__recv_batch_udp(const struct sock* sock,
+				    struct can_frame* cfs, uint64_t* timestamps,
+				    size_t n, int flags)
+{
+	struct sock_udp* udp = sock->wire->udp;
+	size_t count = 0;
+
+	while (count < n) {
+		if (udp->index < udp->length) {
+			cfs[count] = udp->frames[udp->index];
+			timestamps[count++] = udp->timestamps[udp->index++];
+			continue;
+		}
+
+		if (count > 0 && n - count < CAN_WIRE_DATAGRAM_MAX_FRAMES)
+			break;
+
+		if (sock__recv_datagram(sock, count > 0 ? flags | MSG_DONTWAIT
+							: flags) < 0) {
+			if (count > 0)
+				break;
+
+			return -1;
+		}
+	}
+
+	return count;
+}
+
+static ssize_t sock__recv_batch_shm(const struct sock* sock,
+				    struct can_frame* cfs, uint64_t* timestamps,
+				    size_t n, int flags)
+{
+	while (1) {
+		size_t count = shm_ring_read(sock->shm, cfs, timestamps, n);
+		if (count > 0)
+			return count;
+
+		if (flags & MSG_DONTWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (shm_ring_wait(sock->shm, -1) < 0)
+			return -1;
+	}
+}
+
+static ssize_t sock__recv_batch_loop(const struct sock* sock,
+				     struct can_frame* cfs,
+				     uint64_t* timestamps, size_t n, int flags)
+{
+	while (1) {
+		size_t count = sock_loop_recv(sock->loop, cfs, timestamps, n);
+		if (count > 0)
+			return count;
+
+		if (flags & MSG_DONTWAIT) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (sock__wait_readable(sock, -1) < 0)
+			return -1;
+	}
+}
+
+ssize_t sock_recv_batch(const struct sock* sock, struct can_frame* cfs,
+			uint64_t* timestamps, size_t n, int flags)
+{
+	uint64_t local_timestamps[timestamps ? 1 : n];
+	ssize_t count;
+
+	if (!timestamps)
+		timestamps = local_timestamps;
+
+	switch (sock->type) {
+	case SOCK_TYPE_CAN:
+		count = sock__recv_batch_can(sock, cfs, timestamps, n, flags);
+		break;
+	case SOCK_TYPE_TCP:
+		count = sock__recv_batch_stream(sock, cfs, timestamps, n,
+						flags);
+		break;
+	case SOCK_TYPE_UDP:
+		count = sock__recv_batch_udp(sock, cfs, timestamps, n, flags);
+		break;
+	case SOCK_TYPE_SHM:
+		count = sock__recv_batch_shm(sock, cfs, timestamps, n, flags);
+		break;
+	case SOCK_TYPE_LOOP:
+		count = sock__recv_batch_loop(sock, cfs, timestamps, n, flags);
+		break;
+	default:
+		abort();
+	}
+
+	if (sock->tb)
+		for (ssize_t i = 0; i < count; ++i)
+			tb_append_ts(sock->tb, &cfs[i], timestamps[i]);
+
+	return count;
+}
+
+int sock_enable_fd(struct sock* sock)
+{
+	if (sock->type != SOCK_TYPE_CAN)
+		return -1;
+
+	if (socketcan_enable_fd(sock->fd) < 0)
+		return -1;
+
+	for (int c = 0; sock->tx && c < SOCK_TX_N_CLASSES; ++c)
+		if (c != SOCK_TX_NORMAL && socketcan_enable_fd(sock->tx->fd[c]) < 0)
+			return -1;
+
+	sock->is_fd = 1;
+	return 0;
+}
+
+ssize_t sock_send_fd(const struct sock* sock, struct canfd_frame* cf,
+		     int flags)
+{
+	if (!sock->is_fd)
+		return -1;
+
+	sock_flush(sock);
+
+	if (sock->tb)
+		tb_append_fd_ts(sock->tb, cf, gettime_us(CLOCK_REALTIME));
+
+	if (sock->meter)
+		bl_meter_count(sock->meter, (struct can_frame*)cf);
+
+	return send(sock__tx_fd(sock, (struct can_frame*)cf), cf, sizeof(*cf),
+		    flags);
+}
+
+ssize_t sock_recv_fd_batch(const struct sock* sock, struct canfd_frame* cfs,
+			   uint64_t* timestamps, size_t n, int flags)
+{
+	if (!sock->is_fd)
+		return -1;
+
+	uint64_t local_timestamps[timestamps ? 1 : n];
+	size_t sizes[n];
+
+	if (!timestamps)
+		timestamps = local_timestamps;
+
+	ssize_t count = sock__recvmmsg(sock, cfs, sizeof(*cfs), timestamps,
+				       sizes, n, flags);
+
+	for (ssize_t i = 0; i < count; ++i) {
+		/* A classic frame's dlc is in the same place as an FD frame's
+		 * len, so only the flags need fixing up.
+		 */
+		if (sizes[i] == CANFD_MTU)
+			cfs[i].flags |= CANFD_FDF;
+		else
+			cfs[i].flags = 0;
+
+		if (sock->tb)
+			tb_append_fd_ts(sock->tb, &cfs[i], timestamps[i]);
+	}
+
+	return count;
+}
+
+static int sock__set_wire(struct sock* sock, int flags)
+{
+	struct sock_wire* wire = malloc(sizeof(*wire));
+	if (!wire)
+		return -1;
+
+	wire->flags = flags;
+	wire->timestamp = 0;
+	wire->udp = NULL;
+
+	sock->wire = wire;
+	return 0;
+}
+
+int sock_get_wire_flags(const struct sock* sock)
+{
+	return sock->wire ? sock->wire->flags : -1;
+}
+
+uint64_t sock_get_n_lost(const struct sock* sock)
+{
+	switch (sock->type) {
+	case SOCK_TYPE_UDP: return sock->wire->udp->n_lost;
+	case SOCK_TYPE_SHM: return shm_ring_get_n_lost(sock->shm);
+	case SOCK_TYPE_LOOP: return sock_loop_get_n_lost(sock->loop);
+	default: return 0;
+	}
+}
+
+uint64_t sock_get_n_unsent(const struct sock* sock)
+{
+	struct sock_txq* txq = sock->txq;
+	if (!txq)
+		return 0;
+
+	pthread_mutex_lock(&txq->mutex);
+	uint64_t n = txq->n_unsent;
+	pthread_mutex_unlock(&txq->mutex);
+
+	return n;
+}
+
+static void sock__destroy_tx_classes(struct sock_tx_classes* tx)
+{
+	for (int c = 0; c < SOCK_TX_N_CLASSES; ++c)
+		if (c != SOCK_TX_NORMAL && tx->fd[c] >= 0)
+			close(tx->fd[c]);
+
+	free(tx);
+}
+
+/* Nothing is received on these */
+/* The frames are not looped back, as the main socket could not tell them from
+ * those of other processes on the same host
+ */
+static int sock__open_tx_class(const char* iface, int priority, int is_fd)
+{
+	int fd = socketcan_open(iface);
+	if (fd < 0)
+		return -1;
+
+	if (socketcan_apply_filters(fd, NULL, 0) < 0
+	 || socketcan_disable_loopback(fd) < 0
+	 || setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority,
+		       sizeof(priority)) < 0
+	 || (is_fd && socketcan_enable_fd(fd) < 0)) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return -1;
+	}
+
+	return fd;
+}
+
+int sock_open_tx_classes(struct sock* sock, const char* iface)
+{
+	static const int priorities[SOCK_TX_N_CLASSES] = {
+		[SOCK_TX_RT] = SOCK_TX_PRIORITY_RT,
+		[SOCK_TX_BULK] = SOCK_TX_PRIORITY_BULK,
+	};
+
+	if (sock->type != SOCK_TYPE_CAN || sock->tx) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	struct sock_tx_classes* tx = calloc(1, sizeof(*tx));
+	if (!tx)
+		return -1;
+
+	for (int c = 0; c < SOCK_TX_N_CLASSES; ++c)
+		tx->fd[c] = -1;
+
+	tx->fd[SOCK_TX_NORMAL] = sock->fd;
+
+	for (int c = 0; c < SOCK_TX_N_CLASSES; ++c) {
+		if (c == SOCK_TX_NORMAL)
+			continue;
+
+		tx->fd[c] = sock__open_tx_class(iface, priorities[c],
+						sock->is_fd);
+		if (tx->fd[c] < 0) {
+			int e = errno;
+			sock__destroy_tx_classes(tx);
+			errno = e;
+			return -1;
+		}
+	}
+
+	sock->tx = tx;
+	return 0;
+}
+
+static void sock_shm_destroy(struct sock* sock)
+{
+	if (!sock->shm)
+		return;
+
+	shm_ring_destroy(sock->shm);
+	free(sock->shm);
+	sock->shm = NULL;
+}
+
+/* The descriptor belongs to the loop */
+static void sock_loop_destroy(struct sock* sock)
+{
+	if (!sock->loop)
+		return;
+
+	sock_loop_close(sock->loop);
+	sock->loop = NULL;
+	sock->fd = -1;
+}
+
+static void sock_wire_destroy(struct sock* sock)
+{
+	if (sock->wire)
+		free(sock->wire->udp);
+
+	free(sock->wire);
+	sock->wire = NULL;
+}
+
+/* Anything that comes after the answer stays in the buffer, to be decoded in
+ * whatever format has been agreed on. Frames read here are not traced.
+ */
+static int sock__read_legacy(const struct sock* sock, struct can_frame* cf,
+			     int timeout)
+{
+	uint64_t timestamp;
+
+	while (1) {
+		ssize_t n = sock__recv_batch_stream(sock, cf, &timestamp, 1,
+						    MSG_DONTWAIT);
+		if (n > 0)
+			return 0;
+
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return -1;
+
+		if (sock__wait_readable(sock, timeout) < 0)
+			return -1;
+	}
+}
+
+int sock_request_compact(struct sock* sock, int flags, int timeout)
+{
+	struct can_frame cf;
+
+	if (sock->type != SOCK_TYPE_TCP || sock->wire) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	can_wire_make_hello(&cf, CAN_WIRE_COMPACT, flags);
+	cf.can_id = htonl(cf.can_id);
+
+	if (net_write_frame(sock->fd, &cf, timeout) != sizeof(cf))
+		return -1;
+
+	uint64_t t_end = gettime_us(CLOCK_MONOTONIC) + timeout * 1000ULL;
+
+	while (1) {
+		uint64_t t = gettime_us(CLOCK_MONOTONIC);
+		if (t >= t_end) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		if (sock__read_legacy(sock, &cf, (t_end - t + 999) / 1000) < 0)
+			return -1;
+
+		if (can_wire_is_hello(&cf))
+			break;
+	}
+
+	if (cf.data[0] != CAN_WIRE_COMPACT) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	return sock__set_wire(sock, cf.data[1] & flags);
+}
+
+int sock_accept_compact(struct sock* sock, const struct can_frame* hello)
+{
+	struct can_frame cf;
+
+	int is_compact = sock->type == SOCK_TYPE_TCP && !sock->wire
+		      && hello->data[0] == CAN_WIRE_COMPACT;
+	int flags = hello->data[1] & CAN_WIRE_F_TIMESTAMPS;
+
+	can_wire_make_hello(&cf, is_compact ? CAN_WIRE_COMPACT
+					    : CAN_WIRE_LEGACY, flags);
+	cf.can_id = htonl(cf.can_id);
+
+	if (send(sock->fd, &cf, sizeof(cf), MSG_NOSIGNAL) != sizeof(cf))
+		return -1;
+
+	return is_compact ? sock__set_wire(sock, flags) : -1;
+}
+
+int sock_subscribe(const struct sock* sock, const struct can_filter* filters,
+		   size_t n)
+{
+	struct can_frame cfs[n + 1];
+
+	if (sock->type != SOCK_TYPE_TCP) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	can_wire_make_subscription(&cfs[0], NULL);
+	for (size_t i = 0; i < n; ++i)
+		can_wire_make_subscription(&cfs[i + 1], &filters[i]);
+
+	for (size_t i = 0; i < n + 1; ++i)
+		sock__frame_htonl(sock, &cfs[i]);
+
+	sock_flush(sock);
+	return sock__flush_tcp(sock, cfs, n + 1);
+}
+
+int sock_close(struct sock* sock)
+{
+	sock_txq_destroy(sock);
+	sock_wire_destroy(sock);
+	sock_shm_destroy(sock);
+	sock_loop_destroy(sock);
+
+	free(sock->rxbuf);
+	sock->rxbuf = NULL;
+
+	if (sock->tx)
+		sock__destroy_tx_classes(sock->tx);
+	sock->tx = NULL;
+
+	return sock->fd >= 0 ? close(sock->fd) : 0;
+}
@@ -13,6 +13,7 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -21,7 +22,12 @@
 #include <unistd.h>
 #include <linux/can.h>
 #include <linux/can/raw.h>
+#include <linux/can/netlink.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "canopen.h"
 #include "socketcan.h"
@@ -74,7 +80,7 @@ int socketcan_open(const char* iface)
 	struct sockaddr_can addr;
 	struct ifreq ifr;
 
-	fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	fd = socket(PF_CAN, SOCK_RAW | SOCK_CLOEXEC, CAN_RAW);
 	if (fd < 0)
 		return -1;
 
@@ -89,6 +95,10 @@ int socketcan_open(const char* iface)
 	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
 		goto error;
 
+	/* Not fatal: receivers fall back to reading the clock themselves */
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one));
+
 	return fd;
 
 error:
@@ -96,12 +106,131 @@ error:
 	return -1;
 }
 
+int socketcan_enable_fd(int fd)
+{
+	int one = 1;
+	return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &one, sizeof(one));
+}
+
+int socketcan_disable_loopback(int fd)
+{
+	int zero = 0;
+	return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_LOOPBACK, &zero,
+			  sizeof(zero));
+}
+
 int socketcan_apply_filters(int fd, struct can_filter* filters, int n)
 {
 	return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
 			  n*sizeof(struct can_filter));
 }
 
+int socketcan_apply_error_filter(int fd, can_err_mask_t mask)
+{
+	return setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &mask,
+			  sizeof(mask));
+}
+
+struct socketcan__link_req {
+	struct nlmsghdr header;
+	struct ifinfomsg info;
+	char attrs[64];
+};
+
+static struct rtattr* socketcan__add_attr(struct socketcan__link_req* req,
+					  int type, const void* data,
+					  size_t size)
+{
+	struct rtattr* attr = (struct rtattr*)((char*)req
+					       + NLMSG_ALIGN(req->header.nlmsg_len));
+
+	attr->rta_type = type;
+	attr->rta_len = RTA_LENGTH(size);
+	if (size > 0)
+		memcpy(RTA_DATA(attr), data, size);
+
+	req->header.nlmsg_len = NLMSG_ALIGN(req->header.nlmsg_len)
+			      + RTA_ALIGN(attr->rta_len);
+	return attr;
+}
+
+static void socketcan__end_nest(struct socketcan__link_req* req,
+				struct rtattr* nest)
+{
+	nest->rta_len = (char*)req + req->header.nlmsg_len - (char*)nest;
+}
+
+static int socketcan__wait_for_ack(int fd, uint32_t seq)
+{
+	char buffer[512];
+
+	ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+	if (n < 0)
+		return -1;
+
+	struct nlmsghdr* header = (struct nlmsghdr*)buffer;
+	for (; NLMSG_OK(header, (size_t)n); header = NLMSG_NEXT(header, n)) {
+		if (header->nlmsg_seq != seq || header->nlmsg_type != NLMSG_ERROR)
+			continue;
+
+		const struct nlmsgerr* err = NLMSG_DATA(header);
+		if (err->error == 0)
+			return 0;
+
+		errno = -err->error;
+		return -1;
+	}
+
+	errno = EPROTO;
+	return -1;
+}
+
+int socketcan_restart(const char* iface)
+{
+	unsigned int ifindex = if_nametoindex(iface);
+	if (ifindex == 0)
+		return -1;
+
+	struct socketcan__link_req req;
+	memset(&req, 0, sizeof(req));
+
+	req.header.nlmsg_len = NLMSG_LENGTH(sizeof(req.info));
+	req.header.nlmsg_type = RTM_NEWLINK;
+	req.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req.header.nlmsg_seq = 1;
+	req.info.ifi_family = AF_UNSPEC;
+	req.info.ifi_index = ifindex;
+
+	uint32_t restart = 1;
+	struct rtattr* link_info = socketcan__add_attr(&req, IFLA_LINKINFO,
+						       NULL, 0);
+	socketcan__add_attr(&req, IFLA_INFO_KIND, "can", 4);
+	struct rtattr* data = socketcan__add_attr(&req, IFLA_INFO_DATA, NULL, 0);
+	socketcan__add_attr(&req, IFLA_CAN_RESTART, &restart, sizeof(restart));
+	socketcan__end_nest(&req, data);
+	socketcan__end_nest(&req, link_info);
+
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -1;
+
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	int rc = sendto(fd, &req, req.header.nlmsg_len, 0,
+			(struct sockaddr*)&addr, sizeof(addr)) < 0
+	       ? -1 : socketcan__wait_for_ack(fd, req.header.nlmsg_seq);
+
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return rc;
+}
+
+void socketcan_make_sff_filter(struct can_filter* filter, canid_t id)
+{
+	filter->can_id = id & CAN_SFF_MASK;
+	filter->can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+}
+
 int socketcan_open_slave(const char* iface, int nodeid)
 {
 	struct can_filter filters[CANOPEN_SLAVE_FILTER_LENGTH];
@@ -0,0 +1,133 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "canopen/sync-cycle.h"
+
+int sync_cycle_init(struct sync_cycle* self)
+{
+	memset(self, 0, sizeof(*self));
+	return pthread_mutex_init(&self->lock, NULL) == 0 ? 0 : -1;
+}
+
+void sync_cycle_destroy(struct sync_cycle* self)
+{
+	pthread_mutex_destroy(&self->lock);
+}
+
+void sync_cycle_set_expected(struct sync_cycle* self, int nodeid,
+			     unsigned int mask)
+{
+	__atomic_store_n(&self->expected[nodeid], mask & 0xf, __ATOMIC_RELAXED);
+}
+
+void sync_cycle_add(struct sync_cycle* self, int nodeid, int n,
+		    const void* data, size_t size, uint64_t timestamp)
+{
+	if (size > SYNC_CYCLE_DATA_SIZE)
+		size = SYNC_CYCLE_DATA_SIZE;
+
+	pthread_mutex_lock(&self->lock);
+
+	struct sync_cycle_snapshot* back = &self->buffer[self->back];
+	struct sync_cycle_pdo* pdo = &back->pdo[nodeid][n - 1];
+
+	pdo->timestamp = timestamp;
+	pdo->size = size;
+	memcpy(pdo->data, data, size);
+
+	back->received[nodeid] |= 1 << (n - 1);
+
+	pthread_mutex_unlock(&self->lock);
+}
+
+/* Returns the number of nodes that TPDOs were expected from */
+static int sync_cycle__find_missing(struct sync_cycle_snapshot* snapshot)
+{
+	int n_expected = 0;
+
+	for (int i = 1; i < SYNC_CYCLE_N_NODES; ++i) {
+		if (snapshot->expected[i])
+			++n_expected;
+
+		if (!(snapshot->expected[i] & ~snapshot->received[i]))
+			continue;
+
+		snapshot->missing_nodes[i / 64] |= 1ULL << (i % 64);
+		snapshot->n_missing++;
+	}
+
+	return n_expected;
+}
+
+static void sync_cycle__reset(struct sync_cycle_snapshot* snapshot,
+			      uint64_t start)
+{
+	snapshot->start = start;
+	memset(snapshot->received, 0, sizeof(snapshot->received));
+	memset(snapshot->missing_nodes, 0, sizeof(snapshot->missing_nodes));
+	snapshot->n_missing = 0;
+}
+
+int sync_cycle_end(struct sync_cycle* self, uint64_t sync_count, uint64_t now)
+{
+	pthread_mutex_lock(&self->lock);
+
+	struct sync_cycle_snapshot* done = &self->buffer[self->back];
+
+	done->sync_count = sync_count;
+	done->end = now;
+
+	for (int i = 0; i < SYNC_CYCLE_N_NODES; ++i)
+		done->expected[i] = __atomic_load_n(&self->expected[i],
+						    __ATOMIC_RELAXED);
+
+	int n_expected = sync_cycle__find_missing(done);
+
+	self->n_cycles++;
+	if (done->n_missing > 0)
+		self->n_incomplete++;
+
+	self->back ^= 1;
+	sync_cycle__reset(&self->buffer[self->back], now);
+
+	pthread_mutex_unlock(&self->lock);
+	return n_expected;
+}
+
+int sync_cycle_read(struct sync_cycle* self, struct sync_cycle_snapshot* dst)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&self->lock);
+
+	if (self->n_cycles > 0) {
+		memcpy(dst, &self->buffer[self->back ^ 1], sizeof(*dst));
+		rc = 0;
+	}
+
+	pthread_mutex_unlock(&self->lock);
+	return rc;
+}
+
+void sync_cycle_get_counts(struct sync_cycle* self, uint64_t* n_cycles,
+			   uint64_t* n_incomplete)
+{
+	pthread_mutex_lock(&self->lock);
+	*n_cycles = self->n_cycles;
+	*n_incomplete = self->n_incomplete;
+	pthread_mutex_unlock(&self->lock);
+}
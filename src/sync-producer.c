@@ -0,0 +1,180 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "canopen.h"
+#include "canopen/sync-producer.h"
+#include "sock.h"
+#include "rt-thread.h"
+#include "time-utils.h"
+
+int sync_producer_init(struct sync_producer* self, struct sock* sock,
+		       uint64_t period)
+{
+	if (period == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(self, 0, sizeof(*self));
+
+	self->sock = sock;
+	self->period = period;
+	self->counter = 1;
+
+	return pthread_mutex_init(&self->stats_lock, NULL) == 0 ? 0 : -1;
+}
+
+void sync_producer_destroy(struct sync_producer* self)
+{
+	sync_producer_stop(self);
+	pthread_mutex_destroy(&self->stats_lock);
+}
+
+void sync_producer_set_counter_overflow(struct sync_producer* self,
+					unsigned int value)
+{
+	self->counter_overflow = value;
+	self->counter = 1;
+}
+
+void sync_producer_set_callback(struct sync_producer* self,
+				sync_producer_fn fn, void* context)
+{
+	self->fn = fn;
+	self->context = context;
+}
+
+void sync_producer_make_frame(struct sync_producer* self,
+			      struct can_frame* cf)
+{
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = R_SYNC;
+
+	if (self->counter_overflow <= 1)
+		return;
+
+	cf->can_dlc = 1;
+	cf->data[0] = self->counter;
+
+	if (++self->counter > self->counter_overflow)
+		self->counter = 1;
+}
+
+unsigned int sync_stats_bucket(uint64_t lateness)
+{
+	unsigned int bucket = 0;
+
+	while (lateness > 0 && bucket < SYNC_HISTOGRAM_LENGTH - 1) {
+		lateness >>= 1;
+		++bucket;
+	}
+
+	return bucket;
+}
+
+void sync_stats_add(struct sync_stats* self, uint64_t lateness,
+		    uint64_t n_skipped)
+{
+	self->n_cycles++;
+	self->n_skipped += n_skipped;
+	self->histogram[sync_stats_bucket(lateness)]++;
+
+	if (lateness > self->max_lateness)
+		self->max_lateness = lateness;
+}
+
+void sync_producer_get_stats(struct sync_producer* self,
+			     struct sync_stats* stats)
+{
+	pthread_mutex_lock(&self->stats_lock);
+	*stats = self->stats;
+	pthread_mutex_unlock(&self->stats_lock);
+}
+
+static void sync_producer__sleep_until(const struct timespec* deadline)
+{
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline,
+			       NULL) == EINTR)
+		;
+}
+
+/* The callback may take locks, so cancellation is only allowed while
+ * sleeping.
+ */
+static void* sync_producer__run(void* context)
+{
+	struct sync_producer* self = context;
+	uint64_t period = self->period * 1000ULL;
+	struct timespec deadline;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	while (1) {
+		add_to_timespec(&deadline, period);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		sync_producer__sleep_until(&deadline);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		uint64_t now = gettime_ns(CLOCK_MONOTONIC);
+
+		struct can_frame cf;
+		sync_producer_make_frame(self, &cf);
+		sock_send(self->sock, &cf, 0);
+
+		if (self->fn)
+			self->fn(self->context);
+
+		uint64_t target = timespec_to_ns(&deadline);
+		uint64_t lateness = now > target ? now - target : 0;
+
+		uint64_t n_skipped = lateness / period;
+		add_to_timespec(&deadline, n_skipped * period);
+
+		pthread_mutex_lock(&self->stats_lock);
+		sync_stats_add(&self->stats, lateness / 1000ULL, n_skipped);
+		pthread_mutex_unlock(&self->stats_lock);
+	}
+
+	return NULL;
+}
+
+int sync_producer_start(struct sync_producer* self)
+{
+	if (self->is_running)
+		return 0;
+
+	if (rt_thread_create(&self->thread, RT_THREAD_SYNC, sync_producer__run,
+			     self, "SYNC producer") < 0)
+		return -1;
+
+	self->is_running = 1;
+	return 0;
+}
+
+void sync_producer_stop(struct sync_producer* self)
+{
+	if (!self->is_running)
+		return;
+
+	pthread_cancel(self->thread);
+	pthread_join(self->thread, NULL);
+	self->is_running = 0;
+}
@@ -0,0 +1,640 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "trace-analysis.h"
+#include "canopen.h"
+
+#define TA_CHUNKS_PER_THREAD 8
+
+/* What a chunk knows about its ends */
+struct ta__node_edges {
+	uint64_t first_heartbeat, last_heartbeat;
+	uint64_t first_response; /* An SDO response before any request */
+	uint64_t pending_request;
+	int has_request;
+};
+
+struct ta__chunk {
+	struct ta__node_edges nodes[128];
+};
+
+struct ta__job {
+	struct tr_file* file;
+	const struct tr_filter* filter;
+	struct ta__chunk* chunks;
+	size_t n_chunks;
+	size_t chunk_length;
+	size_t next_chunk;
+	int rc;
+	int error;
+};
+
+struct ta__worker {
+	pthread_t thread;
+	struct ta__job* job;
+	struct ta_report report;
+	struct ta__chunk* chunk;
+};
+
+static void ta__report_init(struct ta_report* self)
+{
+	memset(self, 0, sizeof(*self));
+	vector_init(&self->emcys, 16 * sizeof(struct ta_emcy));
+}
+
+void ta_report_destroy(struct ta_report* self)
+{
+	vector_destroy(&self->emcys);
+}
+
+static inline int ta__log2(uint64_t x)
+{
+	return x ? 63 - __builtin_clzll(x) : 0;
+}
+
+void ta_histogram_add(struct ta_histogram* self, uint64_t value)
+{
+	if (self->count == 0 || value < self->min)
+		self->min = value;
+
+	if (value > self->max)
+		self->max = value;
+
+	self->count++;
+	self->sum += value;
+
+	int bucket = ta__log2(value);
+	self->buckets[bucket < TA_N_BUCKETS ? bucket : TA_N_BUCKETS - 1]++;
+}
+
+static void ta__histogram_merge(struct ta_histogram* self,
+				const struct ta_histogram* other)
+{
+	if (other->count == 0)
+		return;
+
+	if (self->count == 0 || other->min < self->min)
+		self->min = other->min;
+
+	if (other->max > self->max)
+		self->max = other->max;
+
+	self->count += other->count;
+	self->sum += other->sum;
+
+	for (int i = 0; i < TA_N_BUCKETS; ++i)
+		self->buckets[i] += other->buckets[i];
+}
+
+uint64_t ta_histogram_get_percentile(const struct ta_histogram* self,
+				     unsigned int percent)
+{
+	uint64_t rank = (self->count * percent + 99) / 100;
+	uint64_t seen = 0;
+
+	for (int i = 0; i < TA_N_BUCKETS; ++i) {
+		seen += self->buckets[i];
+		if (seen >= rank && seen > 0) {
+			uint64_t upper = (2ULL << i) - 1;
+			return upper < self->max ? upper : self->max;
+		}
+	}
+
+	return self->max;
+}
+
+static void ta__add_latency(struct ta_report* report, int node,
+			    uint64_t request, uint64_t response)
+{
+	uint64_t latency = response > request ? response - request : 0;
+
+	ta_histogram_add(&report->sdo_latency, latency);
+	ta_histogram_add(&report->node_sdo_latency[node], latency);
+}
+
+static void ta__add_gap(struct ta_heartbeats* self, uint64_t last,
+			uint64_t timestamp)
+{
+	uint64_t gap = timestamp > last ? timestamp - last : 0;
+
+	if (gap > self->max_gap) {
+		self->max_gap = gap;
+		self->max_gap_end = timestamp;
+	}
+}
+
+static int ta__is_sdo_abort(const struct can_frame* cf)
+{
+	return cf->can_dlc > 0 && (cf->data[0] >> 5) == 4;
+}
+
+static void ta__on_sdo(struct ta__worker* self, const struct tb_frame* frame,
+		       enum canopen_object object, int node)
+{
+	struct ta__node_edges* edges = &self->chunk->nodes[node];
+
+	if (ta__is_sdo_abort(&frame->cf))
+		self->report.n_sdo_aborts++;
+
+	if (object == CANOPEN_RSDO) {
+		edges->pending_request = frame->timestamp;
+		edges->has_request = 1;
+		return;
+	}
+
+	if (edges->pending_request) {
+		ta__add_latency(&self->report, node, edges->pending_request,
+				frame->timestamp);
+		edges->pending_request = 0;
+	} else if (!edges->has_request && !edges->first_response) {
+		edges->first_response = frame->timestamp;
+	}
+}
+
+static void ta__on_heartbeat(struct ta__worker* self,
+			     const struct tb_frame* frame, int node)
+{
+	struct ta__node_edges* edges = &self->chunk->nodes[node];
+	struct ta_heartbeats* heartbeats = &self->report.heartbeats[node];
+
+	/* Node guarding requests come from the master */
+	if (frame->cf.can_id & CAN_RTR_FLAG)
+		return;
+
+	if (heartbeats->count == 0 || frame->timestamp < heartbeats->first)
+		heartbeats->first = frame->timestamp;
+
+	if (frame->timestamp > heartbeats->last)
+		heartbeats->last = frame->timestamp;
+
+	heartbeats->count++;
+
+	if (edges->last_heartbeat)
+		ta__add_gap(heartbeats, edges->last_heartbeat,
+			    frame->timestamp);
+	else
+		edges->first_heartbeat = frame->timestamp;
+
+	edges->last_heartbeat = frame->timestamp;
+}
+
+static void ta__on_emcy(struct ta__worker* self, const struct tb_frame* frame,
+			int node)
+{
+	const struct can_frame* cf = &frame->cf;
+
+	struct ta_emcy emcy = {
+		.timestamp = frame->timestamp,
+		.code = cf->data[0] | cf->data[1] << 8,
+		.reg = cf->data[2],
+		.node = node,
+	};
+
+	vector_append(&self->report.emcys, &emcy, sizeof(emcy));
+}
+
+static void ta__on_frame(const struct tb_frame* frame, void* context)
+{
+	struct ta__worker* self = context;
+	struct ta_report* report = &self->report;
+
+	if (report->n_frames == 0 || frame->timestamp < report->first_timestamp)
+		report->first_timestamp = frame->timestamp;
+
+	if (frame->timestamp > report->last_timestamp)
+		report->last_timestamp = frame->timestamp;
+
+	report->n_frames++;
+
+	if (frame->cf.can_id & CAN_EFF_FLAG) {
+		report->n_extended_frames++;
+		return;
+	}
+
+	report->n_node_frames[tr_get_node(frame->cf.can_id)]++;
+
+	struct canopen_msg msg;
+	if (canopen_get_object_type(&msg, &frame->cf) < 0)
+		return;
+
+	uint32_t cob = frame->cf.can_id & CAN_SFF_MASK;
+	struct ta_rate* rate;
+
+	switch (msg.object) {
+	case CANOPEN_TPDO1: case CANOPEN_TPDO2:
+	case CANOPEN_TPDO3: case CANOPEN_TPDO4:
+	case CANOPEN_RPDO1: case CANOPEN_RPDO2:
+	case CANOPEN_RPDO3: case CANOPEN_RPDO4:
+		rate = &report->pdos[cob];
+		if (rate->count == 0 || frame->timestamp < rate->first)
+			rate->first = frame->timestamp;
+		if (frame->timestamp > rate->last)
+			rate->last = frame->timestamp;
+		rate->count++;
+		break;
+	case CANOPEN_TSDO:
+	case CANOPEN_RSDO:
+		ta__on_sdo(self, frame, msg.object, msg.id);
+		break;
+	case CANOPEN_HEARTBEAT:
+		ta__on_heartbeat(self, frame, msg.id);
+		break;
+	case CANOPEN_EMCY:
+		ta__on_emcy(self, frame, msg.id);
+		break;
+	default:
+		break;
+	}
+}
+
+static void* ta__run_worker(void* context)
+{
+	struct ta__worker* self = context;
+	struct ta__job* job = self->job;
+
+	while (1) {
+		size_t i = __atomic_fetch_add(&job->next_chunk, 1,
+					      __ATOMIC_RELAXED);
+		if (i >= job->n_chunks)
+			break;
+
+		self->chunk = &job->chunks[i];
+
+		size_t first = i * job->chunk_length;
+		if (tr_file_read(job->file, first, first + job->chunk_length,
+				 job->filter, ta__on_frame, self) < 0) {
+			__atomic_store_n(&job->error, errno, __ATOMIC_RELAXED);
+			__atomic_store_n(&job->rc, -1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static void ta__merge(struct ta_report* self, const struct ta_report* other)
+{
+	if (other->n_frames == 0)
+		return;
+
+	if (self->n_frames == 0
+	 || other->first_timestamp < self->first_timestamp)
+		self->first_timestamp = other->first_timestamp;
+
+	if (other->last_timestamp > self->last_timestamp)
+		self->last_timestamp = other->last_timestamp;
+
+	self->n_frames += other->n_frames;
+	self->n_extended_frames += other->n_extended_frames;
+	self->n_sdo_aborts += other->n_sdo_aborts;
+
+	for (int i = 0; i < 128; ++i) {
+		self->n_node_frames[i] += other->n_node_frames[i];
+
+		ta__histogram_merge(&self->node_sdo_latency[i],
+				    &other->node_sdo_latency[i]);
+
+		struct ta_heartbeats* hb = &self->heartbeats[i];
+		const struct ta_heartbeats* other_hb = &other->heartbeats[i];
+
+		if (other_hb->count == 0)
+			continue;
+
+		if (hb->count == 0 || other_hb->first < hb->first)
+			hb->first = other_hb->first;
+
+		if (other_hb->last > hb->last)
+			hb->last = other_hb->last;
+
+		hb->count += other_hb->count;
+
+		if (other_hb->max_gap > hb->max_gap) {
+			hb->max_gap = other_hb->max_gap;
+			hb->max_gap_end = other_hb->max_gap_end;
+		}
+	}
+
+	ta__histogram_merge(&self->sdo_latency, &other->sdo_latency);
+
+	for (size_t i = 0; i < TF_N_COB_IDS; ++i) {
+		struct ta_rate* rate = &self->pdos[i];
+		const struct ta_rate* other_rate = &other->pdos[i];
+
+		if (other_rate->count == 0)
+			continue;
+
+		if (rate->count == 0 || other_rate->first < rate->first)
+			rate->first = other_rate->first;
+
+		if (other_rate->last > rate->last)
+			rate->last = other_rate->last;
+
+		rate->count += other_rate->count;
+	}
+
+	vector_append(&self->emcys, other->emcys.data, other->emcys.index);
+}
+
+/* Requests that are still pending at the end of a chunk are answered by the
+ * first response in a later chunk, if no request came between them.
+ */
+static void ta__stitch(struct ta_report* report, const struct ta__job* job)
+{
+	uint64_t pending[128] = { 0 };
+	uint64_t last_heartbeat[128] = { 0 };
+
+	for (size_t i = 0; i < job->n_chunks; ++i) {
+		for (int node = 0; node < 128; ++node) {
+			const struct ta__node_edges* edges =
+				&job->chunks[i].nodes[node];
+
+			if (pending[node] && edges->first_response) {
+				ta__add_latency(report, node, pending[node],
+						edges->first_response);
+				pending[node] = 0;
+			}
+
+			if (edges->has_request)
+				pending[node] = edges->pending_request;
+
+			if (!edges->first_heartbeat)
+				continue;
+
+			if (last_heartbeat[node])
+				ta__add_gap(&report->heartbeats[node],
+					    last_heartbeat[node],
+					    edges->first_heartbeat);
+
+			last_heartbeat[node] = edges->last_heartbeat;
+		}
+	}
+}
+
+static int ta__compare_emcys(const void* a, const void* b)
+{
+	const struct ta_emcy* x = a;
+	const struct ta_emcy* y = b;
+
+	return x->timestamp < y->timestamp ? -1 : x->timestamp > y->timestamp;
+}
+
+static unsigned int ta__get_n_threads(const struct ta_config* config)
+{
+	if (config && config->n_threads)
+		return config->n_threads;
+
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+int ta_analyze(const char* path, const struct tr_filter* filter,
+	       const struct ta_config* config, struct ta_report* report)
+{
+	int rc = -1;
+
+	ta__report_init(report);
+
+	struct tr_file file;
+	if (tr_file_open(&file, path) < 0)
+		return -1;
+
+	unsigned int n_threads = ta__get_n_threads(config);
+
+	struct ta__job job = {
+		.file = &file,
+		.filter = filter,
+		.chunk_length = config && config->chunk_length
+			      ? config->chunk_length
+			      : file.length / (n_threads * TA_CHUNKS_PER_THREAD)
+				+ 1,
+	};
+
+	job.n_chunks = (file.length + job.chunk_length - 1) / job.chunk_length;
+	if (n_threads > job.n_chunks)
+		n_threads = job.n_chunks ? job.n_chunks : 1;
+
+	job.chunks = calloc(job.n_chunks + 1, sizeof(*job.chunks));
+	if (!job.chunks)
+		goto chunks_failure;
+
+	struct ta__worker* workers = calloc(n_threads, sizeof(*workers));
+	if (!workers)
+		goto workers_failure;
+
+	unsigned int n_started = 0;
+
+	for (unsigned int i = 0; i < n_threads; ++i) {
+		workers[i].job = &job;
+		ta__report_init(&workers[i].report);
+
+		/* The calling thread takes part as the first worker, so all
+		 * chunks get done even if no other thread can be started.
+		 */
+		if (i > 0 && pthread_create(&workers[i].thread, NULL,
+					    ta__run_worker, &workers[i]) != 0)
+			break;
+
+		++n_started;
+	}
+
+	ta__run_worker(&workers[0]);
+
+	for (unsigned int i = 1; i < n_started; ++i)
+		pthread_join(workers[i].thread, NULL);
+
+	if (job.rc < 0) {
+		errno = job.error;
+		goto done;
+	}
+
+	for (unsigned int i = 0; i < n_threads; ++i)
+		ta__merge(report, &workers[i].report);
+
+	ta__stitch(report, &job);
+
+	qsort(report->emcys.data, report->emcys.index / sizeof(struct ta_emcy),
+	      sizeof(struct ta_emcy), ta__compare_emcys);
+
+	rc = 0;
+done:
+	for (unsigned int i = 0; i < n_threads; ++i)
+		ta_report_destroy(&workers[i].report);
+	free(workers);
+workers_failure:
+	free(job.chunks);
+chunks_failure:
+	tr_file_close(&file);
+	return rc;
+}
+
+static double ta__seconds(uint64_t us)
+{
+	return us / 1000000.0;
+}
+
+static void ta__print_time(FILE* stream, uint64_t t)
+{
+	fprintf(stream, "%llu.%06llu", (unsigned long long)(t / 1000000ULL),
+		(unsigned long long)(t % 1000000ULL));
+}
+
+static void ta__print_nodes(const struct ta_report* self, FILE* stream)
+{
+	fprintf(stream, "\nFrames per node:\n");
+
+	for (int i = 0; i < 128; ++i)
+		if (self->n_node_frames[i])
+			fprintf(stream, "  %3d %12llu\n", i,
+				(unsigned long long)self->n_node_frames[i]);
+
+	if (self->n_extended_frames)
+		fprintf(stream, "  ext %12llu\n",
+			(unsigned long long)self->n_extended_frames);
+}
+
+static void ta__print_pdos(const struct ta_report* self, FILE* stream)
+{
+	fprintf(stream, "\nPDOs:\n");
+	fprintf(stream, "  COB-ID  type   node        count     rate (Hz)\n");
+
+	for (uint32_t cob = 0; cob < TF_N_COB_IDS; ++cob) {
+		const struct ta_rate* rate = &self->pdos[cob];
+		if (rate->count == 0)
+			continue;
+
+		struct can_frame cf = { .can_id = cob };
+		struct canopen_msg msg;
+		canopen_get_object_type(&msg, &cf);
+
+		uint64_t span = rate->last - rate->first;
+		double hz = span ? (rate->count - 1) / ta__seconds(span) : 0.0;
+
+		fprintf(stream, "  0x%03x   %-6s %4d %12llu %13.2f\n", cob,
+			canopen_object_type_to_string(msg.object), msg.id,
+			(unsigned long long)rate->count, hz);
+	}
+}
+
+static void ta__print_latency(const struct ta_histogram* self, FILE* stream)
+{
+	fprintf(stream, "%8llu %8llu %8llu %8llu %8llu %8llu %8llu\n",
+		(unsigned long long)self->count,
+		(unsigned long long)self->min,
+		(unsigned long long)(self->sum / self->count),
+		(unsigned long long)ta_histogram_get_percentile(self, 50),
+		(unsigned long long)ta_histogram_get_percentile(self, 90),
+		(unsigned long long)ta_histogram_get_percentile(self, 99),
+		(unsigned long long)self->max);
+}
+
+/* Percentiles are the upper ends of the buckets they fall into */
+static void ta__print_sdo(const struct ta_report* self, FILE* stream)
+{
+	fprintf(stream, "\nSDO round trips (us), %llu aborts:\n",
+		(unsigned long long)self->n_sdo_aborts);
+
+	if (self->sdo_latency.count == 0)
+		return;
+
+	fprintf(stream, "  node    count      min     mean      p50      p90"
+			"      p99      max\n");
+
+	for (int i = 0; i < 128; ++i) {
+		if (self->node_sdo_latency[i].count == 0)
+			continue;
+
+		fprintf(stream, "  %4d ", i);
+		ta__print_latency(&self->node_sdo_latency[i], stream);
+	}
+
+	fprintf(stream, "  all  ");
+	ta__print_latency(&self->sdo_latency, stream);
+
+	fprintf(stream, "\n  Distribution:\n");
+
+	for (int i = 0; i < TA_N_BUCKETS; ++i) {
+		uint64_t count = self->sdo_latency.buckets[i];
+		if (count)
+			fprintf(stream, "  %10llu..%-10llu %8llu\n",
+				i ? 1ULL << i : 0ULL, (2ULL << i) - 1,
+				(unsigned long long)count);
+	}
+}
+
+static void ta__print_emcys(const struct ta_report* self, FILE* stream)
+{
+	size_t n = self->emcys.index / sizeof(struct ta_emcy);
+	const struct ta_emcy* emcys = self->emcys.data;
+
+	fprintf(stream, "\nEMCY (%zu):\n", n);
+
+	for (size_t i = 0; i < n; ++i) {
+		fprintf(stream, "  ");
+		ta__print_time(stream, emcys[i].timestamp);
+		fprintf(stream, " node=%d code=%04x register=%02x\n",
+			emcys[i].node, emcys[i].code, emcys[i].reg);
+	}
+}
+
+static void ta__print_heartbeats(const struct ta_report* self, FILE* stream)
+{
+	fprintf(stream, "\nHeartbeats:\n");
+	fprintf(stream, "  node    count  period (ms)  max gap (ms)"
+			"  gap ended at\n");
+
+	for (int i = 0; i < 128; ++i) {
+		const struct ta_heartbeats* hb = &self->heartbeats[i];
+		if (hb->count == 0)
+			continue;
+
+		uint64_t span = hb->last - hb->first;
+		double period = hb->count > 1 ? span / 1000.0 / (hb->count - 1)
+					      : 0.0;
+
+		fprintf(stream, "  %4d %8llu %12.1f %13.1f  ", i,
+			(unsigned long long)hb->count, period,
+			hb->max_gap / 1000.0);
+
+		if (hb->max_gap_end)
+			ta__print_time(stream, hb->max_gap_end);
+
+		fprintf(stream, "\n");
+	}
+}
+
+void ta_report_print(const struct ta_report* self, FILE* stream)
+{
+	fprintf(stream, "%llu frames", (unsigned long long)self->n_frames);
+
+	if (self->n_frames) {
+		fprintf(stream, " over %.3f s, from ",
+			ta__seconds(self->last_timestamp
+				    - self->first_timestamp));
+		ta__print_time(stream, self->first_timestamp);
+	}
+
+	fprintf(stream, "\n");
+
+	ta__print_nodes(self, stream);
+	ta__print_pdos(self, stream);
+	ta__print_sdo(self, stream);
+	ta__print_emcys(self, stream);
+	ta__print_heartbeats(self, stream);
+}
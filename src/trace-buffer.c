@@ -14,16 +14,24 @@
  */
 
 #include "trace-buffer.h"
+#include "trace-filter.h"
+#include "pcapng.h"
 
 #include "socketcan.h"
-#include "co_atomic.h"
 #include "time-utils.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 static inline unsigned long clzl(unsigned long x)
 {
@@ -35,68 +43,388 @@ static inline unsigned long round_up_to_power_of_2(unsigned long x)
 	return 1UL << ((sizeof(x) << 3) - clzl(x - 1UL));
 }
 
-static inline int tb_try_block(struct tracebuffer* self)
+#define tb__load(ptr, order) __atomic_load_n(ptr, __ATOMIC_ ## order)
+#define tb__store(ptr, value, order) \
+	__atomic_store_n(ptr, value, __ATOMIC_ ## order)
+
+static inline uint64_t tb__busy(uint64_t position)
+{
+	return 2 * position + 1;
+}
+
+static inline uint64_t tb__done(uint64_t position)
+{
+	return 2 * position + 2;
+}
+
+static size_t tb__size(size_t length)
+{
+	return sizeof(struct tb_header) + length * sizeof(struct tb_slot);
+}
+
+static void tb__set_storage(struct tracebuffer* self, void* data)
 {
-	return co_atomic_cas(&self->is_blocked, 0, 1);
+	self->header = data;
+	self->slots = (struct tb_slot*)(self->header + 1);
 }
 
-static inline void tb_unblock(struct tracebuffer* self)
+static void tb__init_header(struct tracebuffer* self)
 {
-	co_atomic_store(&self->is_blocked, 0);
+	self->header->magic = TB_MAGIC;
+	self->header->version = TB_VERSION;
+	self->header->slot_size = sizeof(struct tb_slot);
+	self->header->length = self->length;
 }
 
-static inline int tb_is_blocked(const struct tracebuffer* self)
+static int tb__is_header_valid(const struct tb_header* header, size_t size)
 {
-	return co_atomic_load(&self->is_blocked);
+	return header->magic == TB_MAGIC
+	    && header->version == TB_VERSION
+	    && header->slot_size == sizeof(struct tb_slot)
+	    && header->length > 0
+	    && (header->length & (header->length - 1)) == 0
+	    && tb__size(header->length) == size;
 }
 
 int tb_init(struct tracebuffer* self, size_t size)
 {
 	memset(self, 0, sizeof(*self));
+	self->fd = -1;
+
+	self->length = round_up_to_power_of_2(size / sizeof(struct tb_frame));
+
+	void* data = calloc(1, tb__size(self->length));
+	if (!data)
+		return -1;
+
+	tb__set_storage(self, data);
+	tb__init_header(self);
+	return 0;
+}
+
+/* A writer that died in the middle of a frame leaves its slot marked as busy,
+ * which would make the writers that come after it drop their frames there.
+ */
+static void tb__recover(struct tracebuffer* self)
+{
+	uint64_t head = self->header->head;
+	self->n_recovered = head < self->length ? head : self->length;
+
+	for (size_t i = 0; i < self->length; ++i)
+		if (self->slots[i].sequence & 1)
+			self->slots[i].sequence = 0;
+}
+
+int tb_init_mapped(struct tracebuffer* self, size_t size, const char* path)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->length = round_up_to_power_of_2(size / sizeof(struct tb_frame));
+	self->map_size = tb__size(self->length);
+
+	self->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (self->fd < 0)
+		return -1;
+
+	if (flock(self->fd, LOCK_EX | LOCK_NB) < 0)
+		goto failure;
+
+	struct stat st;
+	struct tb_header header;
+	if (fstat(self->fd, &st) < 0)
+		goto failure;
+
+	int is_reused = (size_t)st.st_size == self->map_size
+		     && pread(self->fd, &header, sizeof(header), 0)
+			== sizeof(header)
+		     && tb__is_header_valid(&header, self->map_size);
+
+	/* Truncating it first leaves nothing from an unusable file */
+	if (!is_reused && (ftruncate(self->fd, 0) < 0
+			|| ftruncate(self->fd, self->map_size) < 0))
+		goto failure;
+
+	void* data = mmap(NULL, self->map_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, self->fd, 0);
+	if (data == MAP_FAILED)
+		goto failure;
+
+	tb__set_storage(self, data);
+
+	if (!is_reused)
+		tb__init_header(self);
+	else if (self->header->is_open)
+		tb__recover(self);
+
+	self->header->is_open = 1;
+	return 0;
+
+failure:
+	close(self->fd);
+	self->map_size = 0;
+	return -1;
+}
+
+int tb_init_view(struct tracebuffer* self, const void* data, size_t size)
+{
+	memset(self, 0, sizeof(*self));
+	self->fd = -1;
 
-	self->length = round_up_to_power_of_2(size / sizeof(self->data[0]));
-	self->data = malloc(self->length * sizeof(self->data[0]));
+	if (size < sizeof(struct tb_header)
+	 || !tb__is_header_valid(data, size)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-	return self->data ? 0 : -1;
+	self->length = ((const struct tb_header*)data)->length;
+	self->is_view = 1;
+	tb__set_storage(self, (void*)data);
+	return 0;
 }
 
 void tb_destroy(struct tracebuffer* self)
 {
-	free(self->data);
+	if (!tb_is_mapped(self)) {
+		free(self->header);
+		return;
+	}
+
+	self->header->is_open = 0;
+	msync(self->header, self->map_size, MS_ASYNC);
+	munmap(self->header, self->map_size);
+	close(self->fd);
+}
+
+void tb_prefault(struct tracebuffer* self)
+{
+	volatile uint8_t* data = (volatile uint8_t*)self->header;
+	size_t size = tb__size(self->length);
+	size_t page_size = sysconf(_SC_PAGESIZE);
+
+	for (size_t i = 0; i < size; i += page_size)
+		data[i] = data[i];
 }
 
-void tb_append(struct tracebuffer* self, const struct can_frame* frame)
+int tb_sync(struct tracebuffer* self)
+{
+	if (!tb_is_mapped(self))
+		return 0;
+
+	return msync(self->header, self->map_size, MS_SYNC);
+}
+
+/* Returns the position of a slot that has been taken for writing, or -1 if the
+ * frame has to be dropped or is filtered out.
+ */
+static int64_t tb__begin_write(struct tracebuffer* self, uint32_t can_id)
+{
+	if (self->filter && !tf_match(self->filter, can_id)) {
+		__atomic_fetch_add(&self->header->n_filtered, 1,
+				   __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	uint64_t position = __atomic_fetch_add(&self->header->head, 1,
+					       __ATOMIC_RELAXED);
+	struct tb_slot* slot = &self->slots[position & (self->length - 1)];
+
+	uint64_t sequence = tb__load(&slot->sequence, RELAXED);
+	if ((sequence & 1) || sequence > tb__busy(position)
+	 || !__atomic_compare_exchange_n(&slot->sequence, &sequence,
+					 tb__busy(position), 0,
+					 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&self->header->n_dropped, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	/* A dump that sees the frame being written also sees the odd number */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return position;
+}
+
+static inline struct tb_frame* tb__frame(struct tracebuffer* self,
+					 uint64_t position)
+{
+	return &self->slots[position & (self->length - 1)].frame;
+}
+
+static inline void tb__end_write(struct tracebuffer* self, uint64_t position)
 {
-	if (tb_is_blocked(self))
+	struct tb_slot* slot = &self->slots[position & (self->length - 1)];
+	tb__store(&slot->sequence, tb__done(position), RELEASE);
+}
+
+void tb_append_ts(struct tracebuffer* self, const struct can_frame* frame,
+		  uint64_t timestamp)
+{
+	int64_t position = tb__begin_write(self, frame->can_id);
+	if (position < 0)
 		return;
 
-	struct tb_frame tb_frame = {
-		.timestamp = gettime_us(CLOCK_REALTIME),
-		.cf = *frame,
-	};
+	struct tb_frame* tb_frame = tb__frame(self, position);
 
-	self->data[self->index++] = tb_frame;
-	self->index &= (self->length - 1);
+	tb_frame->timestamp = timestamp;
+	tb_frame->cf = *frame;
+	tb_frame->cfd.flags = 0;
 
-	if (self->count < self->length)
-		self->count++;
+	tb__end_write(self, position);
 }
 
-void tb_dump(struct tracebuffer* self, FILE* stream)
+void tb_append_fd_ts(struct tracebuffer* self, const struct canfd_frame* frame,
+		     uint64_t timestamp)
 {
-	if (!tb_try_block(self))
+	int64_t position = tb__begin_write(self, frame->can_id);
+	if (position < 0)
 		return;
 
-	if (self->count < self->length) {
-		fwrite(self->data, sizeof(self->data[0]), self->count, stream);
-	} else {
-		fwrite(&self->data[self->index], sizeof(self->data[0]),
-		       self->length - self->index, stream);
+	struct tb_frame* tb_frame = tb__frame(self, position);
+
+	tb_frame->timestamp = timestamp;
+
+	/* Don't copy more than the payload; records are large */
+	size_t len = frame->len < CANFD_MAX_DLEN ? frame->len : CANFD_MAX_DLEN;
+	size_t size = offsetof(struct canfd_frame, data) + len;
+	memcpy(&tb_frame->cfd, frame, size);
+
+	tb__end_write(self, position);
+}
+
+void tb_append(struct tracebuffer* self, const struct can_frame* frame)
+{
+	tb_append_ts(self, frame, gettime_us(CLOCK_REALTIME));
+}
+
+/* Returns 1 if the frame at the given position was copied whole, 0 if it is
+ * still being written and -1 if it has been overwritten.
+ */
+static int tb__read(struct tracebuffer* self, uint64_t position,
+		    struct tb_frame* frame)
+{
+	struct tb_slot* slot = &self->slots[position & (self->length - 1)];
+
+	uint64_t sequence = tb__load(&slot->sequence, ACQUIRE);
+	if (sequence != tb__done(position))
+		return sequence > tb__done(position) ? -1 : 0;
 
-		fwrite(self->data, sizeof(self->data[0]), self->index, stream);
+	memcpy(frame, &slot->frame, sizeof(*frame));
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return tb__load(&slot->sequence, RELAXED) == sequence ? 1 : -1;
+}
+
+size_t tb_snapshot(struct tracebuffer* self, struct tb_frame* frames)
+{
+	uint64_t head = tb__load(&self->header->head, ACQUIRE);
+	uint64_t position = head > self->length ? head - self->length : 0;
+	size_t n = 0;
+
+	for (; position < head; ++position) {
+		int rc = tb__read(self, position, &frames[n]);
+		if (rc > 0)
+			++n;
+		else if (rc < 0 && !self->is_view)
+			__atomic_fetch_add(&self->header->n_dropped, 1,
+					   __ATOMIC_RELAXED);
 	}
 
-	tb_unblock(self);
+	return n;
+}
+
+void tb_dump_header_init(struct tb_dump_header* header)
+{
+	memset(header, 0, sizeof(*header));
+	header->magic = TB_DUMP_MAGIC;
+	header->version = TB_DUMP_VERSION;
+	header->record_size = sizeof(struct tb_frame);
+}
+
+int tb_parse_format(enum tb_format* format, const char* name)
+{
+	if (strcasecmp(name, "raw") == 0)
+		*format = TB_FORMAT_RAW;
+	else if (strcasecmp(name, "pcapng") == 0)
+		*format = TB_FORMAT_PCAPNG;
+	else
+		return -1;
+
+	return 0;
+}
+
+const char* tb_format_extension(enum tb_format format)
+{
+	return format == TB_FORMAT_PCAPNG ? ".pcapng" : ".trace";
+}
+
+void tb_dump_as(struct tracebuffer* self, FILE* stream, enum tb_format format,
+		const char* iface)
+{
+	/* The snapshot is taken first so that the writers are never held up
+	 * by the stream.
+	 */
+	struct tb_frame* snapshot = malloc(self->length * sizeof(*snapshot));
+	if (!snapshot)
+		return;
+
+	size_t n = tb_snapshot(self, snapshot);
+	struct tb_dump_header header;
+
+	switch (format) {
+	case TB_FORMAT_RAW:
+		tb_dump_header_init(&header);
+		fwrite(&header, sizeof(header), 1, stream);
+		fwrite(snapshot, sizeof(*snapshot), n, stream);
+		break;
+	case TB_FORMAT_PCAPNG:
+		if (pcapng_write_header(stream, iface) == 0)
+			pcapng_write_frames(stream, snapshot, n);
+		break;
+	}
+
+	free(snapshot);
 
 	fflush(stream);
 }
+
+void tb_dump(struct tracebuffer* self, FILE* stream)
+{
+	tb_dump_as(self, stream, TB_FORMAT_RAW, NULL);
+}
+
+uint64_t tb_get_head(const struct tracebuffer* self)
+{
+	return tb__load(&self->header->head, ACQUIRE);
+}
+
+uint64_t tb_get_n_dropped(const struct tracebuffer* self)
+{
+	return tb__load(&self->header->n_dropped, RELAXED);
+}
+
+uint64_t tb_get_n_filtered(const struct tracebuffer* self)
+{
+	return tb__load(&self->header->n_filtered, RELAXED);
+}
+
+size_t tb_read(struct tracebuffer* self, uint64_t* position,
+	       struct tb_frame* frames, size_t n)
+{
+	uint64_t head = tb__load(&self->header->head, ACQUIRE);
+	uint64_t start = head > self->length ? head - self->length : 0;
+	size_t i = 0;
+
+	if (*position < start)
+		*position = start;
+
+	while (i < n && *position < head) {
+		int rc = tb__read(self, *position, &frames[i]);
+		if (rc == 0)
+			break;
+
+		if (rc > 0)
+			++i;
+
+		++*position;
+	}
+
+	return i;
+}
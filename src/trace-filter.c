@@ -0,0 +1,259 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "trace-filter.h"
+#include "canopen.h"
+
+#define TF_MAX_RULES 64
+
+struct tf_rule {
+	uint32_t objects; /* enum canopen_object; zero if COB-IDs are given */
+	uint32_t first_cob, last_cob;
+	int first_node, last_node;
+	int is_all;
+	unsigned int period;
+};
+
+static const struct {
+	const char* name;
+	uint32_t objects;
+} tf__objects[] = {
+	{ "nmt", CANOPEN_NMT },
+	{ "sync", CANOPEN_SYNC },
+	{ "time", CANOPEN_TIMESTAMP },
+	{ "emcy", CANOPEN_EMCY },
+	{ "tpdo1", CANOPEN_TPDO1 },
+	{ "tpdo2", CANOPEN_TPDO2 },
+	{ "tpdo3", CANOPEN_TPDO3 },
+	{ "tpdo4", CANOPEN_TPDO4 },
+	{ "rpdo1", CANOPEN_RPDO1 },
+	{ "rpdo2", CANOPEN_RPDO2 },
+	{ "rpdo3", CANOPEN_RPDO3 },
+	{ "rpdo4", CANOPEN_RPDO4 },
+	{ "tpdo", CANOPEN_TPDO1 | CANOPEN_TPDO2 | CANOPEN_TPDO3
+		| CANOPEN_TPDO4 },
+	{ "rpdo", CANOPEN_RPDO1 | CANOPEN_RPDO2 | CANOPEN_RPDO3
+		| CANOPEN_RPDO4 },
+	{ "pdo", CANOPEN_TPDO1 | CANOPEN_TPDO2 | CANOPEN_TPDO3 | CANOPEN_TPDO4
+	       | CANOPEN_RPDO1 | CANOPEN_RPDO2 | CANOPEN_RPDO3
+	       | CANOPEN_RPDO4 },
+	{ "tsdo", CANOPEN_TSDO },
+	{ "rsdo", CANOPEN_RSDO },
+	{ "sdo", CANOPEN_TSDO | CANOPEN_RSDO },
+	{ "heartbeat", CANOPEN_HEARTBEAT },
+};
+
+void tf_init(struct trace_filter* self)
+{
+	memset(self, 0, sizeof(*self));
+
+	for (size_t i = 0; i <= TF_N_COB_IDS; ++i)
+		self->period[i] = 1;
+}
+
+static int tf__parse_number(const char** src, const char* end,
+			    unsigned long max, unsigned long* result)
+{
+	char buffer[16];
+	size_t len = 0;
+
+	while (*src + len < end && (*src)[len] != '-' && (*src)[len] != '@'
+	    && (*src)[len] != '/')
+		++len;
+
+	if (len == 0 || len >= sizeof(buffer))
+		return -1;
+
+	memcpy(buffer, *src, len);
+	buffer[len] = '\0';
+
+	char* tail;
+	*result = strtoul(buffer, &tail, 0);
+	if (*tail != '\0' || *result > max)
+		return -1;
+
+	*src += len;
+	return 0;
+}
+
+static int tf__parse_range(const char** src, const char* end,
+			   unsigned long max, unsigned long* first,
+			   unsigned long* last)
+{
+	if (tf__parse_number(src, end, max, first) < 0)
+		return -1;
+
+	*last = *first;
+
+	if (*src < end && **src == '-') {
+		++*src;
+		if (tf__parse_number(src, end, max, last) < 0)
+			return -1;
+	}
+
+	return *first <= *last ? 0 : -1;
+}
+
+static int tf__parse_what(struct tf_rule* rule, const char** src,
+			  const char* end)
+{
+	const char* p = *src;
+
+	if (p < end && *p == '*') {
+		rule->is_all = 1;
+		*src = p + 1;
+		return 0;
+	}
+
+	if (p < end && *p >= '0' && *p <= '9') {
+		unsigned long first, last;
+		if (tf__parse_range(src, end, CAN_SFF_MASK, &first, &last) < 0)
+			return -1;
+
+		rule->first_cob = first;
+		rule->last_cob = last;
+		return 0;
+	}
+
+	size_t len = 0;
+	while (p + len < end && p[len] != '@' && p[len] != '/')
+		++len;
+
+	for (size_t i = 0; i < sizeof(tf__objects) / sizeof(tf__objects[0]);
+	     ++i) {
+		if (strlen(tf__objects[i].name) == len
+		 && strncasecmp(tf__objects[i].name, p, len) == 0) {
+			rule->objects = tf__objects[i].objects;
+			*src = p + len;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int tf__parse_rule(struct tf_rule* rule, const char* src,
+			  const char* end)
+{
+	memset(rule, 0, sizeof(*rule));
+	rule->first_node = 0;
+	rule->last_node = CANOPEN_NODEID_MAX;
+	rule->period = 1;
+
+	if (*src == '-') {
+		rule->period = 0;
+		++src;
+	} else if (*src == '+') {
+		++src;
+	}
+
+	if (tf__parse_what(rule, &src, end) < 0)
+		return -1;
+
+	if (src < end && *src == '@') {
+		unsigned long first, last;
+		++src;
+		if (rule->is_all || rule->objects == 0
+		 || tf__parse_range(&src, end, CANOPEN_NODEID_MAX, &first,
+				    &last) < 0)
+			return -1;
+
+		rule->first_node = first;
+		rule->last_node = last;
+	}
+
+	if (src < end && *src == '/') {
+		unsigned long period;
+		++src;
+		if (rule->period == 0
+		 || tf__parse_number(&src, end, UINT16_MAX, &period) < 0
+		 || period == 0)
+			return -1;
+
+		rule->period = period;
+	}
+
+	return src == end ? 0 : -1;
+}
+
+static int tf__is_separator(char c)
+{
+	return c == ' ' || c == '\t' || c == ',';
+}
+
+static void tf__apply_rule(struct trace_filter* self,
+			   const struct tf_rule* rule)
+{
+	for (uint32_t cob = 0; cob < TF_N_COB_IDS; ++cob) {
+		if (rule->is_all) {
+			self->period[cob] = rule->period;
+			continue;
+		}
+
+		if (rule->objects == 0) {
+			if (rule->first_cob <= cob && cob <= rule->last_cob)
+				self->period[cob] = rule->period;
+			continue;
+		}
+
+		struct can_frame cf = { .can_id = cob };
+		struct canopen_msg msg;
+		if (canopen_get_object_type(&msg, &cf) < 0)
+			continue;
+
+		if ((msg.object & rule->objects)
+		 && rule->first_node <= (int)msg.id
+		 && (int)msg.id <= rule->last_node)
+			self->period[cob] = rule->period;
+	}
+
+	if (rule->is_all)
+		self->period[TF_N_COB_IDS] = rule->period;
+}
+
+int tf_parse(struct trace_filter* self, const char* rules)
+{
+	struct tf_rule parsed[TF_MAX_RULES];
+	size_t n = 0;
+
+	for (const char* p = rules; *p; ) {
+		if (tf__is_separator(*p)) {
+			++p;
+			continue;
+		}
+
+		const char* end = p;
+		while (*end && !tf__is_separator(*end))
+			++end;
+
+		if (n >= TF_MAX_RULES
+		 || tf__parse_rule(&parsed[n++], p, end) < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		p = end;
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		tf__apply_rule(self, &parsed[i]);
+
+	return 0;
+}
@@ -0,0 +1,903 @@
+/* Copyright (c) 2018, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace-record.h"
+#include "time-utils.h"
+#include "rt-thread.h"
+
+#define TR_READ_BATCH 64
+
+static inline uint8_t tr__hash(uint32_t can_id)
+{
+	return (can_id * 2654435761U) >> 24;
+}
+
+static inline uint64_t tr__zigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t tr__unzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline uint8_t* tr__put_varint(uint8_t* dst, uint64_t value)
+{
+	while (value >= 0x80) {
+		*dst++ = value | 0x80;
+		value >>= 7;
+	}
+
+	*dst++ = value;
+	return dst;
+}
+
+static const uint8_t* tr__get_varint(const uint8_t* src, const uint8_t* end,
+				     uint64_t* value)
+{
+	uint64_t result = 0;
+
+	for (int shift = 0; src < end && shift < 64; shift += 7) {
+		uint8_t byte = *src++;
+		result |= (uint64_t)(byte & 0x7f) << shift;
+
+		if (!(byte & 0x80)) {
+			*value = result;
+			return src;
+		}
+	}
+
+	return NULL;
+}
+
+void tr_codec_reset(struct tr_codec* self, uint64_t timestamp)
+{
+	memset(self, 0, sizeof(*self));
+	self->timestamp = timestamp;
+}
+
+size_t tr_encode(struct tr_codec* self, uint8_t* dst,
+		 const struct tb_frame* frame)
+{
+	uint8_t* tag = dst;
+	uint8_t* p = dst + 1;
+	*tag = 0;
+
+	int64_t delta = frame->timestamp - self->timestamp;
+	self->timestamp = frame->timestamp;
+	p = tr__put_varint(p, tr__zigzag(delta));
+
+	uint32_t can_id = frame->cfd.can_id;
+	uint8_t index = tr__hash(can_id);
+	struct tr_dict_entry* entry = &self->dict[index];
+
+	if (entry->is_used && entry->can_id == can_id) {
+		*tag |= TR_TAG_ID_HIT;
+		*p++ = index;
+	} else {
+		memcpy(p, &can_id, sizeof(can_id));
+		p += sizeof(can_id);
+		entry->can_id = can_id;
+		entry->is_used = 1;
+	}
+
+	uint8_t len = frame->cfd.len < CANFD_MAX_DLEN ? frame->cfd.len
+						      : CANFD_MAX_DLEN;
+	uint8_t flags = frame->cfd.flags;
+
+	if (entry->len == len && entry->flags == flags
+	 && memcmp(entry->data, frame->cfd.data, len) == 0) {
+		*tag |= TR_TAG_SAME_DATA;
+		return p - dst;
+	}
+
+	*p++ = len;
+
+	if (flags) {
+		*tag |= TR_TAG_FLAGS;
+		*p++ = flags;
+	}
+
+	memcpy(p, frame->cfd.data, len);
+	p += len;
+
+	entry->len = len;
+	entry->flags = flags;
+	memcpy(entry->data, frame->cfd.data, len);
+
+	return p - dst;
+}
+
+ssize_t tr_decode(struct tr_codec* self, const uint8_t* src, size_t size,
+		  struct tb_frame* frame)
+{
+	const uint8_t* end = src + size;
+	const uint8_t* p = src;
+
+	if (p >= end)
+		return -1;
+
+	uint8_t tag = *p++;
+
+	uint64_t delta;
+	p = tr__get_varint(p, end, &delta);
+	if (!p)
+		return -1;
+
+	self->timestamp += tr__unzigzag(delta);
+
+	struct tr_dict_entry* entry;
+
+	if (tag & TR_TAG_ID_HIT) {
+		if (p >= end)
+			return -1;
+
+		entry = &self->dict[*p++];
+	} else {
+		uint32_t can_id;
+		if (end - p < (ssize_t)sizeof(can_id))
+			return -1;
+
+		memcpy(&can_id, p, sizeof(can_id));
+		p += sizeof(can_id);
+
+		entry = &self->dict[tr__hash(can_id)];
+		entry->can_id = can_id;
+		entry->is_used = 1;
+	}
+
+	if (!(tag & TR_TAG_SAME_DATA)) {
+		if (p >= end)
+			return -1;
+
+		uint8_t len = *p++;
+		uint8_t flags = 0;
+
+		if (tag & TR_TAG_FLAGS) {
+			if (p >= end)
+				return -1;
+
+			flags = *p++;
+		}
+
+		if (len > CANFD_MAX_DLEN || end - p < len)
+			return -1;
+
+		entry->len = len;
+		entry->flags = flags;
+		memcpy(entry->data, p, len);
+		p += len;
+	}
+
+	memset(frame, 0, sizeof(*frame));
+	frame->timestamp = self->timestamp;
+	frame->cfd.can_id = entry->can_id;
+	frame->cfd.len = entry->len;
+	frame->cfd.flags = entry->flags;
+	memcpy(frame->cfd.data, entry->data, entry->len);
+
+	return p - src;
+}
+
+static const struct tr_filter tr__no_filter;
+
+/* Moves the offset past the block. Returns 0 at the end of the recording,
+ * which is where a block that is cut short ends up, as the last one does if
+ * the recorder did not get to finish it.
+ */
+/* The offset may come from a damaged index, so nothing is added to it before
+ * it is known to be within the file
+ */
+static int tr__has_block_header(size_t size, uint64_t offset)
+{
+	return offset <= size
+	    && size - offset >= sizeof(struct tr_block_header);
+}
+
+static int tr__has_block_data(size_t size, uint64_t offset,
+			      const struct tr_block_header* header)
+{
+	return header->size
+	    <= size - offset - sizeof(struct tr_block_header);
+}
+
+static int tr__read_block(const uint8_t* map, size_t size, uint64_t* offset_,
+			  const struct tr_filter* filter, tr_frame_fn fn,
+			  void* context)
+{
+	struct tr_block_header header;
+	uint64_t offset = *offset_;
+
+	if (!tr__has_block_header(size, offset))
+		return 0;
+
+	memcpy(&header, map + offset, sizeof(header));
+
+	if (header.magic != TR_BLOCK_MAGIC
+	 || !tr__has_block_data(size, offset, &header))
+		return 0;
+
+	*offset_ = offset + sizeof(header) + header.size;
+
+	if (!tr_filter_match_span(filter, header.min_timestamp,
+				  header.max_timestamp, header.nodes))
+		return 1;
+
+	struct tr_codec codec;
+	tr_codec_reset(&codec, header.first_timestamp);
+
+	const uint8_t* p = map + offset + sizeof(header);
+	const uint8_t* end = p + header.size;
+
+	for (uint32_t i = 0; i < header.n_frames; ++i) {
+		struct tb_frame frame;
+		ssize_t n = tr_decode(&codec, p, end - p, &frame);
+		if (n < 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+
+		if (tr_filter_match(filter, frame.cfd.can_id, frame.timestamp))
+			fn(&frame, context);
+
+		p += n;
+	}
+
+	return 1;
+}
+
+static const struct tr_index_header* tr__find_index(const uint8_t* map,
+						    size_t size,
+						    size_t start)
+{
+	struct tr_trailer trailer;
+	struct tr_index_header header;
+
+	if (size < start + sizeof(header) + sizeof(trailer))
+		return NULL;
+
+	memcpy(&trailer, map + size - sizeof(trailer), sizeof(trailer));
+
+	if (trailer.magic != TR_TRAILER_MAGIC
+	 || trailer.index_offset < start
+	 || trailer.index_offset > size - sizeof(trailer) - sizeof(header))
+		return NULL;
+
+	memcpy(&header, map + trailer.index_offset, sizeof(header));
+
+	if (header.magic != TR_INDEX_MAGIC
+	 || header.n_entries != (size - sizeof(trailer) - sizeof(header)
+				 - trailer.index_offset)
+				/ sizeof(struct tr_index_entry))
+		return NULL;
+
+	return (const struct tr_index_header*)(map + trailer.index_offset);
+}
+
+static int tr__load_index(struct tr_file* self,
+			  const struct tr_index_header* index)
+{
+	self->blocks = malloc((index->n_entries + 1) * sizeof(*self->blocks));
+	if (!self->blocks)
+		return -1;
+
+	memcpy(self->blocks, (const uint8_t*)index + sizeof(*index),
+	       index->n_entries * sizeof(*self->blocks));
+	self->length = index->n_entries;
+	return 0;
+}
+
+/* Files that were never closed have no index, but the blocks can still be
+ * found without decoding them.
+ */
+static int tr__scan_blocks(struct tr_file* self, uint64_t offset)
+{
+	size_t size = 0;
+
+	while (tr__has_block_header(self->size, offset)) {
+		struct tr_block_header header;
+		memcpy(&header, self->map + offset, sizeof(header));
+
+		if (header.magic != TR_BLOCK_MAGIC
+		 || !tr__has_block_data(self->size, offset, &header))
+			break;
+
+		if (self->length >= size) {
+			size = size ? size * 2 : 64;
+			struct tr_index_entry* blocks =
+				realloc(self->blocks, size * sizeof(*blocks));
+			if (!blocks)
+				return -1;
+
+			self->blocks = blocks;
+		}
+
+		struct tr_index_entry* entry = &self->blocks[self->length++];
+		entry->offset = offset;
+		entry->min_timestamp = header.min_timestamp;
+		entry->max_timestamp = header.max_timestamp;
+		entry->nodes[0] = header.nodes[0];
+		entry->nodes[1] = header.nodes[1];
+
+		offset += sizeof(header) + header.size;
+	}
+
+	return 0;
+}
+
+static int tr__open_recording(struct tr_file* self)
+{
+	struct tr_file_header header;
+	memcpy(&header, self->map, sizeof(header));
+
+	if (header.version != TR_VERSION) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	if (header.header_size < sizeof(header)
+	 || header.header_size > self->size) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	const struct tr_index_header* index =
+		tr__find_index(self->map, self->size, header.header_size);
+
+	return index ? tr__load_index(self, index)
+		     : tr__scan_blocks(self, header.header_size);
+}
+
+/* Buffers that were mapped from files are read as they were last left */
+static int tr__open_buffer(struct tr_file* self)
+{
+	struct tracebuffer tb;
+	if (tb_init_view(&tb, self->map, self->size) < 0)
+		return -1;
+
+	struct tb_frame* frames = malloc(tb.length * sizeof(*frames));
+	if (!frames)
+		return -1;
+
+	self->length = tb_snapshot(&tb, frames);
+	self->frames = frames;
+	return 0;
+}
+
+/* The map is aligned to a page and the header keeps the frames aligned, so
+ * they can be used where they are.
+ */
+static int tr__open_dump(struct tr_file* self)
+{
+	struct tb_dump_header header;
+	memcpy(&header, self->map, sizeof(header));
+
+	if (header.version != TB_DUMP_VERSION
+	 || header.record_size != sizeof(struct tb_frame)) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	self->frames = (struct tb_frame*)(self->map + sizeof(header));
+	self->length = (self->size - sizeof(header)) / sizeof(struct tb_frame);
+	return 0;
+}
+
+/* Dumps without a header hold classic frames in smaller records, which are
+ * copied into frames of the current layout.
+ */
+static int tr__open_legacy(struct tr_file* self)
+{
+	if (self->size % TB_LEGACY_RECORD_SIZE != 0) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	size_t length = self->size / TB_LEGACY_RECORD_SIZE;
+	struct tb_frame* frames = calloc(length, sizeof(*frames));
+	if (!frames)
+		return -1;
+
+	for (size_t i = 0; i < length; ++i) {
+		const uint8_t* record = self->map + i * TB_LEGACY_RECORD_SIZE;
+		memcpy(&frames[i].timestamp, record, sizeof(uint64_t));
+		memcpy(&frames[i].cf, record + sizeof(uint64_t),
+		       sizeof(struct can_frame));
+		frames[i].cfd.flags = 0;
+	}
+
+	self->length = length;
+	self->frames = frames;
+	return 0;
+}
+
+int tr_file_open(struct tr_file* self, const char* path)
+{
+	memset(self, 0, sizeof(*self));
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		goto failure;
+
+	self->type = TR_FILE_RAW;
+	self->size = st.st_size;
+
+	if (self->size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	void* map = mmap(NULL, self->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto failure;
+
+	close(fd);
+	self->map = map;
+
+	uint32_t magic = 0;
+	if (self->size >= sizeof(struct tr_file_header))
+		memcpy(&magic, self->map, sizeof(magic));
+
+	int rc = 0;
+
+	if (magic == TR_FILE_MAGIC) {
+		self->type = TR_FILE_RECORDING;
+		rc = tr__open_recording(self);
+	} else if (magic == TB_MAGIC) {
+		self->type = TR_FILE_BUFFER;
+		rc = tr__open_buffer(self);
+	} else if (magic == TB_DUMP_MAGIC) {
+		rc = tr__open_dump(self);
+	} else {
+		self->type = TR_FILE_LEGACY;
+		rc = tr__open_legacy(self);
+	}
+
+	if (rc < 0)
+		tr_file_close(self);
+
+	return rc;
+
+failure:
+	close(fd);
+	return -1;
+}
+
+void tr_file_close(struct tr_file* self)
+{
+	if (self->type == TR_FILE_BUFFER || self->type == TR_FILE_LEGACY)
+		free(self->frames);
+
+	free(self->blocks);
+
+	if (self->map)
+		munmap((void*)self->map, self->size);
+
+	memset(self, 0, sizeof(*self));
+}
+
+int tr_file_read(struct tr_file* self, size_t first, size_t last,
+		 const struct tr_filter* filter, tr_frame_fn fn,
+		 void* context)
+{
+	if (!filter)
+		filter = &tr__no_filter;
+
+	if (last > self->length)
+		last = self->length;
+
+	for (size_t i = first; i < last; ++i) {
+		if (self->type != TR_FILE_RECORDING) {
+			const struct tb_frame* frame = &self->frames[i];
+
+			if (tr_filter_match(filter, frame->cfd.can_id,
+					    frame->timestamp))
+				fn(frame, context);
+			continue;
+		}
+
+		struct tr_index_entry* entry = &self->blocks[i];
+		if (!tr_filter_match_span(filter, entry->min_timestamp,
+					  entry->max_timestamp, entry->nodes))
+			continue;
+
+		uint64_t offset = entry->offset;
+		if (tr__read_block(self->map, self->size, &offset, filter, fn,
+				   context) <= 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int tr_read_path(const char* path, const struct tr_filter* filter,
+		 tr_frame_fn fn, void* context)
+{
+	struct tr_file file;
+	if (tr_file_open(&file, path) < 0)
+		return -1;
+
+	int rc = tr_file_read(&file, 0, file.length, filter, fn, context);
+
+	tr_file_close(&file);
+	return rc;
+}
+
+int tr_recorder_init(struct tr_recorder* self, struct tracebuffer* tb,
+		     const char* directory, const char* name)
+{
+	memset(self, 0, sizeof(*self));
+
+	self->tb = tb;
+	strncpy(self->directory, directory, sizeof(self->directory) - 1);
+	strncpy(self->name, name, sizeof(self->name) - 1);
+
+	self->data = malloc(TR_BLOCK_SIZE);
+	if (!self->data)
+		return -1;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&self->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&self->mutex, NULL);
+	pthread_mutex_init(&self->stats_lock, NULL);
+	return 0;
+}
+
+/* The index is only of use to readers, so the file is closed whether or not
+ * it could be written. It is left out of files that may have half a block at
+ * the end, because the offset of the index would be wrong.
+ */
+static void tr__write_index(struct tr_recorder* self)
+{
+	struct tr_index_header header = {
+		.magic = TR_INDEX_MAGIC,
+		.n_entries = self->index_length,
+	};
+
+	struct tr_trailer trailer = {
+		.index_offset = self->file_size,
+		.magic = TR_TRAILER_MAGIC,
+	};
+
+	if (fwrite(&header, sizeof(header), 1, self->file) != 1
+	 || fwrite(self->index, sizeof(self->index[0]), self->index_length,
+		   self->file) != self->index_length
+	 || fwrite(&trailer, sizeof(trailer), 1, self->file) != 1)
+		return;
+
+	pthread_mutex_lock(&self->stats_lock);
+	self->stats.n_bytes += sizeof(header) + sizeof(trailer)
+			     + self->index_length * sizeof(self->index[0]);
+	pthread_mutex_unlock(&self->stats_lock);
+}
+
+static void tr__close_file(struct tr_recorder* self)
+{
+	if (!self->file)
+		return;
+
+	if (!ferror(self->file))
+		tr__write_index(self);
+
+	fclose(self->file);
+	self->file = NULL;
+	self->index_length = 0;
+}
+
+static int tr__add_to_index(struct tr_recorder* self)
+{
+	if (self->index_length >= self->index_size) {
+		size_t size = self->index_size ? self->index_size * 2 : 64;
+		struct tr_index_entry* index =
+			realloc(self->index, size * sizeof(*index));
+		if (!index)
+			return -1;
+
+		self->index = index;
+		self->index_size = size;
+	}
+
+	struct tr_index_entry* entry = &self->index[self->index_length++];
+	entry->offset = self->file_size;
+	entry->min_timestamp = self->block.min_timestamp;
+	entry->max_timestamp = self->block.max_timestamp;
+	entry->nodes[0] = self->block.nodes[0];
+	entry->nodes[1] = self->block.nodes[1];
+	return 0;
+}
+
+void tr_recorder_destroy(struct tr_recorder* self)
+{
+	tr_recorder_stop(self);
+	tr__close_file(self);
+
+	pthread_mutex_destroy(&self->stats_lock);
+	pthread_mutex_destroy(&self->mutex);
+	pthread_cond_destroy(&self->cond);
+	free(self->index);
+	free(self->data);
+}
+
+void tr_recorder_set_rotation(struct tr_recorder* self, uint64_t max_size,
+			      uint64_t max_age, unsigned int max_files)
+{
+	self->max_file_size = max_size;
+	self->max_file_age = max_age;
+	self->max_files = max_files;
+}
+
+/* The names sort by the time at which the files were started */
+static void tr__remove_old_files(struct tr_recorder* self)
+{
+	if (self->max_files == 0)
+		return;
+
+	char pattern[sizeof(self->directory) + sizeof(self->name) + 16];
+	snprintf(pattern, sizeof(pattern), "%s/%s-[0-9]*.ctr", self->directory,
+		 self->name);
+
+	glob_t files;
+	if (glob(pattern, 0, NULL, &files) != 0)
+		return;
+
+	for (size_t i = 0; i + self->max_files < files.gl_pathc; ++i)
+		unlink(files.gl_pathv[i]);
+
+	globfree(&files);
+}
+
+static int tr__open_file(struct tr_recorder* self)
+{
+	uint64_t now = gettime_us(CLOCK_REALTIME);
+	time_t seconds = now / 1000000ULL;
+
+	struct tm tm;
+	char ts[32];
+	localtime_r(&seconds, &tm);
+	strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S", &tm);
+
+	char path[sizeof(self->directory) + sizeof(self->name) + 48];
+	snprintf(path, sizeof(path), "%s/%s-%s-%04u.ctr", self->directory,
+		 self->name, ts, (unsigned int)(self->stats.n_files % 10000));
+
+	self->file = fopen(path, "we");
+	if (!self->file)
+		return -1;
+
+	struct tr_file_header header = {
+		.magic = TR_FILE_MAGIC,
+		.version = TR_VERSION,
+		.header_size = sizeof(header),
+		.start_time = now,
+	};
+
+	if (fwrite(&header, sizeof(header), 1, self->file) != 1) {
+		tr__close_file(self);
+		return -1;
+	}
+
+	self->file_size = sizeof(header);
+	self->file_start = gettime_us(CLOCK_MONOTONIC);
+
+	pthread_mutex_lock(&self->stats_lock);
+	self->stats.n_files++;
+	self->stats.n_bytes += sizeof(header);
+	pthread_mutex_unlock(&self->stats_lock);
+
+	tr__remove_old_files(self);
+	return 0;
+}
+
+static int tr__is_file_done(const struct tr_recorder* self, uint64_t now)
+{
+	if (self->max_file_size && self->file_size >= self->max_file_size)
+		return 1;
+
+	if (self->max_file_age && now - self->file_start >= self->max_file_age)
+		return 1;
+
+	return 0;
+}
+
+/* The block is gone either way, so that a full disk does not stop the
+ * recorder from catching up once there is room again.
+ */
+static int tr__write_block(struct tr_recorder* self, uint64_t now)
+{
+	int rc = -1;
+
+	if (self->file && tr__is_file_done(self, now))
+		tr__close_file(self);
+
+	if (!self->file && tr__open_file(self) < 0)
+		goto done;
+
+	self->block.magic = TR_BLOCK_MAGIC;
+
+	if (fwrite(&self->block, sizeof(self->block), 1, self->file) != 1
+	 || fwrite(self->data, 1, self->block.size, self->file)
+	    != self->block.size
+	 || fflush(self->file) != 0) {
+		tr__close_file(self);
+		goto done;
+	}
+
+	/* A block that cannot be indexed is still found by scanning */
+	tr__add_to_index(self);
+
+	size_t size = sizeof(self->block) + self->block.size;
+	self->file_size += size;
+
+	pthread_mutex_lock(&self->stats_lock);
+	self->stats.n_bytes += size;
+	pthread_mutex_unlock(&self->stats_lock);
+
+	rc = 0;
+done:
+	if (rc < 0) {
+		pthread_mutex_lock(&self->stats_lock);
+		self->stats.n_write_errors++;
+		pthread_mutex_unlock(&self->stats_lock);
+	}
+
+	memset(&self->block, 0, sizeof(self->block));
+	return rc;
+}
+
+static void tr__append(struct tr_recorder* self, const struct tb_frame* frame,
+		       uint64_t now)
+{
+	if (self->block.n_frames == 0) {
+		tr_codec_reset(&self->codec, frame->timestamp);
+		self->block.first_timestamp = frame->timestamp;
+		self->block.min_timestamp = frame->timestamp;
+		self->block.max_timestamp = frame->timestamp;
+		self->block_start = now;
+	}
+
+	self->block.size += tr_encode(&self->codec,
+				      self->data + self->block.size, frame);
+	self->block.n_frames++;
+
+	if (frame->timestamp < self->block.min_timestamp)
+		self->block.min_timestamp = frame->timestamp;
+
+	if (frame->timestamp > self->block.max_timestamp)
+		self->block.max_timestamp = frame->timestamp;
+
+	int node = tr_get_node(frame->cfd.can_id);
+	if (node >= 0)
+		self->block.nodes[node / 64] |= 1ULL << (node % 64);
+}
+
+int tr_recorder_poll(struct tr_recorder* self, int do_flush)
+{
+	struct tb_frame frames[TR_READ_BATCH];
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+	int rc = 0;
+
+	while (1) {
+		uint64_t start = self->position;
+		size_t n = tb_read(self->tb, &self->position, frames,
+				   TR_READ_BATCH);
+
+		for (size_t i = 0; i < n; ++i) {
+			if (self->block.size + TR_MAX_FRAME_SIZE > TR_BLOCK_SIZE
+			 && tr__write_block(self, now) < 0)
+				rc = -1;
+
+			tr__append(self, &frames[i], now);
+		}
+
+		pthread_mutex_lock(&self->stats_lock);
+		self->stats.n_frames += n;
+		self->stats.n_lost += self->position - start - n;
+		self->stats.n_raw_bytes += n * sizeof(frames[0]);
+		pthread_mutex_unlock(&self->stats_lock);
+
+		if (n < TR_READ_BATCH)
+			break;
+	}
+
+	if (self->block.n_frames > 0
+	 && (do_flush || now - self->block_start >= TR_BLOCK_AGE)
+	 && tr__write_block(self, now) < 0)
+		rc = -1;
+
+	return rc;
+}
+
+static void* tr_recorder__run(void* context)
+{
+	struct tr_recorder* self = context;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&self->mutex);
+
+	while (!self->is_stopping) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		add_to_timespec(&deadline, TR_POLL_PERIOD * 1000ULL);
+		pthread_cond_timedwait(&self->cond, &self->mutex, &deadline);
+
+		pthread_mutex_unlock(&self->mutex);
+		tr_recorder_poll(self, 0);
+		pthread_mutex_lock(&self->mutex);
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+
+	tr_recorder_poll(self, 1);
+	tr__close_file(self);
+	return NULL;
+}
+
+int tr_recorder_start(struct tr_recorder* self)
+{
+	if (self->is_running)
+		return 0;
+
+	/* Only frames from here on are recorded */
+	self->position = tb_get_head(self->tb);
+	self->is_stopping = 0;
+
+	if (rt_thread_create(&self->thread, RT_THREAD_RECORDER,
+			     tr_recorder__run, self, "Trace recorder") < 0)
+		return -1;
+
+	self->is_running = 1;
+	return 0;
+}
+
+void tr_recorder_stop(struct tr_recorder* self)
+{
+	if (!self->is_running)
+		return;
+
+	pthread_mutex_lock(&self->mutex);
+	self->is_stopping = 1;
+	pthread_cond_signal(&self->cond);
+	pthread_mutex_unlock(&self->mutex);
+
+	pthread_join(self->thread, NULL);
+	self->is_running = 0;
+}
+
+void tr_recorder_get_stats(struct tr_recorder* self, struct tr_stats* stats)
+{
+	pthread_mutex_lock(&self->stats_lock);
+	*stats = self->stats;
+	pthread_mutex_unlock(&self->stats_lock);
+}
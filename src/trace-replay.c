@@ -0,0 +1,174 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "socketcan.h"
+#include "canopen.h"
+#include "sock.h"
+#include "time-utils.h"
+#include "trace-buffer.h"
+#include "trace-record.h"
+#include "trace-replay.h"
+
+void trace_replay_init(struct trace_replay* self, const struct sock* sock,
+		       double speed, enum trace_replay_source source)
+{
+	memset(self, 0, sizeof(*self));
+	self->sock = sock;
+	self->speed = speed;
+	self->source = source;
+}
+
+int trace_replay_is_from_slave(const struct can_frame* cf)
+{
+	struct canopen_msg msg;
+
+	if (cf->can_id & CAN_EFF_FLAG)
+		return 0;
+
+	if (canopen_get_object_type(&msg, cf) < 0)
+		return 0;
+
+	switch (msg.object) {
+	case CANOPEN_EMCY:
+	case CANOPEN_TPDO1:
+	case CANOPEN_TPDO2:
+	case CANOPEN_TPDO3:
+	case CANOPEN_TPDO4:
+	case CANOPEN_TSDO:
+		return 1;
+	case CANOPEN_HEARTBEAT:
+		/* Node guarding requests are remote frames from the master */
+		return !(cf->can_id & CAN_RTR_FLAG);
+	default:
+		return 0;
+	}
+}
+
+static int trace_replay__is_selected(const struct trace_replay* self,
+				     const struct can_frame* cf)
+{
+	struct canopen_msg msg;
+
+	switch (self->source) {
+	case TRACE_REPLAY_SLAVES:
+		return trace_replay_is_from_slave(cf);
+	case TRACE_REPLAY_MASTER:
+		return !(cf->can_id & CAN_EFF_FLAG)
+		    && canopen_get_object_type(&msg, cf) == 0
+		    && !trace_replay_is_from_slave(cf);
+	case TRACE_REPLAY_ALL:
+		return 1;
+	}
+
+	return 0;
+}
+
+void trace_replay_flush(struct trace_replay* self)
+{
+	if (sock_flush(self->sock) < 0)
+		++self->stats.n_errors;
+}
+
+/* Returns the current time in ns */
+static uint64_t trace_replay__wait(struct trace_replay* self,
+				   uint64_t deadline)
+{
+	uint64_t now = gettime_ns(CLOCK_MONOTONIC);
+	if (deadline <= now + TRACE_REPLAY_BATCH_WINDOW * 1000ULL)
+		return now;
+
+	trace_replay_flush(self);
+
+	struct timespec ts = ns_to_timespec(deadline);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+	       == EINTR)
+		if (self->is_stopping && *self->is_stopping)
+			break;
+
+	return gettime_ns(CLOCK_MONOTONIC);
+}
+
+static void trace_replay__send(struct trace_replay* self,
+			       const struct tb_frame* frame)
+{
+	struct tb_frame copy = *frame;
+	int rc;
+
+	if (copy.cfd.flags & CANFD_FDF) {
+		copy.cfd.flags &= ~CANFD_FDF;
+		rc = sock_send_fd(self->sock, &copy.cfd, 0) < 0 ? -1 : 0;
+	} else {
+		rc = sock_stage(self->sock, &copy.cf);
+	}
+
+	if (rc < 0)
+		++self->stats.n_errors;
+	else
+		++self->stats.n_frames;
+}
+
+void trace_replay_frame(struct trace_replay* self,
+			const struct tb_frame* frame)
+{
+	if (self->is_stopping && *self->is_stopping)
+		return;
+
+	if (!trace_replay__is_selected(self, &frame->cf)) {
+		++self->stats.n_skipped;
+		return;
+	}
+
+	if (!self->is_started) {
+		self->is_started = 1;
+		self->first_timestamp = frame->timestamp;
+		self->start = gettime_ns(CLOCK_MONOTONIC);
+	}
+
+	if (self->speed > 0 && frame->timestamp > self->first_timestamp) {
+		uint64_t offset = (frame->timestamp - self->first_timestamp)
+				* 1000ULL;
+		uint64_t deadline = self->start
+				  + (uint64_t)(offset / self->speed);
+
+		uint64_t now = trace_replay__wait(self, deadline);
+		if (now > deadline) {
+			uint64_t lateness = (now - deadline) / 1000ULL;
+			if (lateness > self->stats.max_lateness)
+				self->stats.max_lateness = lateness;
+		}
+	}
+
+	trace_replay__send(self, frame);
+}
+
+static void trace_replay__on_frame(const struct tb_frame* frame,
+				   void* context)
+{
+	trace_replay_frame(context, frame);
+}
+
+int trace_replay_path(struct trace_replay* self, const char* path,
+		      const struct tr_filter* filter)
+{
+	int rc = tr_read_path(path, filter, trace_replay__on_frame, self);
+	trace_replay_flush(self);
+	return rc;
+}
@@ -0,0 +1,283 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <mloop.h>
+
+#include "trace-rest.h"
+#include "rest.h"
+#include "pcapng.h"
+
+size_t strlcpy(char* dst, const char* src, size_t dsize);
+
+static struct trace_rest_stream* trace_rest__streams = NULL;
+
+static void trace_rest__reply(struct rest_client* client,
+			      const char* status_code, const char* message)
+{
+	struct rest_reply_data reply = {
+		.status_code = status_code,
+		.content_type = "text/plain",
+		.content_length = strlen(message),
+		.content = message
+	};
+
+	rest_client_reply(client, &reply);
+	rest_client_done(client);
+}
+
+static void trace_rest__unlink(struct trace_rest_stream* self)
+{
+	struct trace_rest_stream** link = &trace_rest__streams;
+	while (*link != self)
+		link = &(*link)->next;
+	*link = self->next;
+}
+
+static void trace_rest__free(struct trace_rest_stream* self)
+{
+	if (self->timer) {
+		mloop_timer_stop(self->timer);
+		mloop_timer_unref(self->timer);
+	}
+
+	free(self->snapshot);
+	free(self);
+}
+
+static void trace_rest__close(struct trace_rest_stream* self)
+{
+	trace_rest__unlink(self);
+	rest_client_unref(self->client);
+	trace_rest__free(self);
+}
+
+/* Raw records are sent from where they are, after a chunk with the header of
+ * the dump. Blocks of pcapng are put together first, with the header of the
+ * file in front of the first batch.
+ */
+static int trace_rest__send_raw(struct trace_rest_stream* self,
+				const struct tb_frame* frames, size_t n)
+{
+	if (!self->is_header_sent) {
+		struct tb_dump_header header;
+		tb_dump_header_init(&header);
+
+		if (rest_client_send_chunk(self->client, &header,
+					   sizeof(header)) < 0)
+			return -1;
+
+		self->is_header_sent = 1;
+	}
+
+	return n == 0 ? 0 : rest_client_send_chunk(self->client, frames,
+						   n * sizeof(*frames));
+}
+
+static int trace_rest__send(struct trace_rest_stream* self,
+			    const struct tb_frame* frames, size_t n)
+{
+	if (self->format == TB_FORMAT_RAW)
+		return trace_rest__send_raw(self, frames, n);
+
+	char* buffer = NULL;
+	size_t size = 0;
+
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return -1;
+
+	if (!self->is_header_sent)
+		pcapng_write_header(stream, self->iface[0] ? self->iface : NULL);
+
+	pcapng_write_frames(stream, frames, n);
+
+	int rc = fclose(stream) == 0
+	       ? rest_client_send_chunk(self->client, buffer, size) : -1;
+
+	free(buffer);
+	self->is_header_sent = rc == 0;
+	return rc;
+}
+
+static size_t trace_rest__next(struct trace_rest_stream* self,
+			       const struct tb_frame** frames)
+{
+	if (self->n_snapshot_sent < self->snapshot_length) {
+		size_t n = self->snapshot_length - self->n_snapshot_sent;
+		if (n > TRACE_REST_BATCH_SIZE)
+			n = TRACE_REST_BATCH_SIZE;
+
+		*frames = &self->snapshot[self->n_snapshot_sent];
+		self->n_snapshot_sent += n;
+		return n;
+	}
+
+	free(self->snapshot);
+	self->snapshot = NULL;
+
+	if (!self->is_following)
+		return 0;
+
+	*frames = self->batch;
+	return tb_read(self->tb, &self->position, self->batch,
+		       TRACE_REST_BATCH_SIZE);
+}
+
+int trace_rest__pump(struct trace_rest_stream* self)
+{
+	if (self->client->state == REST_CLIENT_DISCONNECTED)
+		return -1;
+
+	for (int i = 0; i < TRACE_REST_BATCHES_PER_TICK; ++i) {
+		/* The socket must take the last batch before another is
+		 * made
+		 */
+		if (!rest_client_is_flushed(self->client))
+			return 0;
+
+		const struct tb_frame* frames = NULL;
+		size_t n = trace_rest__next(self, &frames);
+
+		if (n == 0 && !self->is_following) {
+			/* An empty trace is still a valid file */
+			if (!self->is_header_sent
+			 && trace_rest__send(self, NULL, 0) < 0)
+				return -1;
+
+			if (rest_client_send_chunk(self->client, NULL, 0) < 0)
+				return -1;
+
+			rest_client_done(self->client);
+			return 1;
+		}
+
+		if (n == 0)
+			return 0;
+
+		if (trace_rest__send(self, frames, n) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void trace_rest__on_tick(struct mloop_timer* timer)
+{
+	struct trace_rest_stream* self = mloop_timer_get_context(timer);
+
+	if (trace_rest__pump(self) != 0)
+		trace_rest__close(self);
+}
+
+static int trace_rest__parse_query(struct trace_rest_stream* self,
+				   struct http_req* req)
+{
+	const char* format = http_req_query(req, "format");
+	if (format && tb_parse_format(&self->format, format) < 0)
+		return -1;
+
+	const char* follow = http_req_query(req, "follow");
+	self->is_following = follow && strcmp(follow, "0") != 0
+			  && strcasecmp(follow, "false") != 0;
+
+	return 0;
+}
+
+/* The position after the snapshot is where following picks up, so no frame
+ * is sent twice.
+ */
+static int trace_rest__take_snapshot(struct trace_rest_stream* self)
+{
+	self->snapshot = malloc(self->tb->length * sizeof(*self->snapshot));
+	if (!self->snapshot)
+		return -1;
+
+	self->position = 0;
+	self->snapshot_length = tb_read(self->tb, &self->position,
+					self->snapshot, self->tb->length);
+	return 0;
+}
+
+void trace_rest_serve(struct rest_client* client, struct tracebuffer* tb,
+		      const char* iface)
+{
+	struct trace_rest_stream* self = calloc(1, sizeof(*self));
+	if (!self) {
+		trace_rest__reply(client, "500 Internal Server Error",
+				  "Out of memory\r\n");
+		return;
+	}
+
+	self->client = client;
+	self->tb = tb;
+	self->format = TB_FORMAT_RAW;
+
+	if (iface)
+		strlcpy(self->iface, iface, sizeof(self->iface));
+
+	if (trace_rest__parse_query(self, &client->req) < 0) {
+		trace_rest__reply(client, "400 Bad Request",
+				  "The format is either raw or pcapng\r\n");
+		goto failure;
+	}
+
+	self->timer = mloop_timer_new(mloop_default());
+	if (!self->timer || trace_rest__take_snapshot(self) < 0) {
+		trace_rest__reply(client, "500 Internal Server Error",
+				  "Out of memory\r\n");
+		goto failure;
+	}
+
+	mloop_timer_set_type(self->timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_time(self->timer, TRACE_REST_INTERVAL * 1000000ULL);
+	mloop_timer_set_context(self->timer, self, NULL);
+	mloop_timer_set_callback(self->timer, trace_rest__on_tick);
+
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = self->format == TB_FORMAT_PCAPNG
+			      ? "application/x-pcapng"
+			      : "application/octet-stream",
+		.content_length = -1,
+	};
+
+	if (rest_client_reply(client, &reply) < 0)
+		goto failure;
+
+	rest_client_ref(client);
+	self->next = trace_rest__streams;
+	trace_rest__streams = self;
+
+	/* The client is not done until the whole trace has been sent */
+	mloop_timer_start(self->timer);
+
+	if (trace_rest__pump(self) != 0)
+		trace_rest__close(self);
+
+	return;
+
+failure:
+	trace_rest__free(self);
+}
+
+void trace_rest_cleanup(void)
+{
+	while (trace_rest__streams)
+		trace_rest__close(trace_rest__streams);
+}
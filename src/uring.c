@@ -0,0 +1,185 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#define uring__load_acquire(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define uring__store_release(ptr, val) \
+	__atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
+static void* uring__map(int fd, size_t size, off_t offset)
+{
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, offset);
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int uring_init(struct uring* self, unsigned int entries)
+{
+	struct io_uring_params params;
+	memset(self, 0, sizeof(*self));
+	memset(&params, 0, sizeof(params));
+
+	self->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (self->fd < 0)
+		return -1;
+
+	self->sq_entries = params.sq_entries;
+	self->cq_entries = params.cq_entries;
+
+	self->sq_ring_size = params.sq_off.array
+			   + params.sq_entries * sizeof(unsigned int);
+	self->cq_ring_size = params.cq_off.cqes
+			   + params.cq_entries * sizeof(struct io_uring_cqe);
+	self->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	self->sq_ring = uring__map(self->fd, self->sq_ring_size,
+				   IORING_OFF_SQ_RING);
+	if (!self->sq_ring)
+		goto sq_ring_failure;
+
+	self->cq_ring = uring__map(self->fd, self->cq_ring_size,
+				   IORING_OFF_CQ_RING);
+	if (!self->cq_ring)
+		goto cq_ring_failure;
+
+	self->sqes = uring__map(self->fd, self->sqes_size, IORING_OFF_SQES);
+	if (!self->sqes)
+		goto sqes_failure;
+
+	char* sq = self->sq_ring;
+	self->sq_head = (unsigned int*)(sq + params.sq_off.head);
+	self->sq_tail = (unsigned int*)(sq + params.sq_off.tail);
+	self->sq_mask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	self->sq_array = (unsigned int*)(sq + params.sq_off.array);
+	self->sq_local_tail = *self->sq_tail;
+
+	char* cq = self->cq_ring;
+	self->cq_head = (unsigned int*)(cq + params.cq_off.head);
+	self->cq_tail = (unsigned int*)(cq + params.cq_off.tail);
+	self->cq_mask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	self->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	return 0;
+
+sqes_failure:
+	munmap(self->cq_ring, self->cq_ring_size);
+cq_ring_failure:
+	munmap(self->sq_ring, self->sq_ring_size);
+sq_ring_failure:
+	close(self->fd);
+	self->fd = -1;
+	return -1;
+}
+
+void uring_destroy(struct uring* self)
+{
+	munmap(self->sqes, self->sqes_size);
+	munmap(self->cq_ring, self->cq_ring_size);
+	munmap(self->sq_ring, self->sq_ring_size);
+	close(self->fd);
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* self)
+{
+	unsigned int head = uring__load_acquire(self->sq_head);
+	if (self->sq_local_tail - head >= self->sq_entries)
+		return NULL;
+
+	unsigned int index = self->sq_local_tail & *self->sq_mask;
+	struct io_uring_sqe* sqe = &self->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	self->sq_array[index] = index;
+	return sqe;
+}
+
+void uring_push_sqe(struct uring* self)
+{
+	uring__store_release(self->sq_tail, ++self->sq_local_tail);
+}
+
+int uring_enter(struct uring* self, unsigned int to_submit,
+		unsigned int min_complete)
+{
+	unsigned int flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	return syscall(__NR_io_uring_enter, self->fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int uring_pop_cqe(struct uring* self, struct io_uring_cqe* cqe)
+{
+	unsigned int head = *self->cq_head;
+	if (head == uring__load_acquire(self->cq_tail))
+		return -1;
+
+	*cqe = self->cqes[head & *self->cq_mask];
+	uring__store_release(self->cq_head, head + 1);
+	return 0;
+}
+
+#else
+
+int uring_init(struct uring* self, unsigned int entries)
+{
+	(void)entries;
+	memset(self, 0, sizeof(*self));
+	self->fd = -1;
+	errno = ENOSYS;
+	return -1;
+}
+
+void uring_destroy(struct uring* self)
+{
+	(void)self;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct uring* self)
+{
+	(void)self;
+	return NULL;
+}
+
+void uring_push_sqe(struct uring* self)
+{
+	(void)self;
+}
+
+int uring_enter(struct uring* self, unsigned int to_submit,
+		unsigned int min_complete)
+{
+	(void)self;
+	(void)to_submit;
+	(void)min_complete;
+	errno = ENOSYS;
+	return -1;
+}
+
+int uring_pop_cqe(struct uring* self, struct io_uring_cqe* cqe)
+{
+	(void)self;
+	(void)cqe;
+	return -1;
+}
+
+#endif /* HAVE_URING */
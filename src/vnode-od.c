@@ -0,0 +1,269 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "ini_parser.h"
+#include "conversions.h"
+#include "vnode-od.h"
+
+#define VNODE_OD_KEY(index, subindex) \
+	(((uint32_t)(index) << 8) | (uint32_t)(subindex))
+
+/* A section that names an object, and where it is in the file */
+struct vnode_od__source {
+	uint32_t key;
+	size_t position;
+	const struct ini_section* section;
+};
+
+/* Section names are the same as the ones that were looked up before the
+ * dictionary was compiled: the index and the subindex in hex.
+ */
+static int vnode_od__parse_name(uint32_t* key, const char* name)
+{
+	char* end;
+
+	unsigned long index = strtoul(name, &end, 16);
+	if (end == name || strncasecmp(end, "sub", 3) != 0 || index > 0xffff)
+		return -1;
+
+	const char* sub = end + 3;
+	unsigned long subindex = strtoul(sub, &end, 16);
+	if (end == sub || *end != '\0' || subindex > 0xff)
+		return -1;
+
+	*key = VNODE_OD_KEY(index, subindex);
+	return 0;
+}
+
+/* Within a key, the last one in the file comes first */
+static int vnode_od__cmp_source(const void* ptr1, const void* ptr2)
+{
+	const struct vnode_od__source* x = ptr1;
+	const struct vnode_od__source* y = ptr2;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+
+	return x->position < y->position ? 1 : x->position > y->position ? -1 : 0;
+}
+
+static size_t vnode_od__collect(struct vnode_od__source* sources,
+				const struct ini_file* config)
+{
+	size_t n = 0;
+
+	for (size_t i = 0; i < ini_get_length(config); ++i) {
+		const struct ini_section* s = ini_get_section(config, i);
+		struct vnode_od__source* source = &sources[n];
+
+		if (vnode_od__parse_name(&source->key, s->section) < 0)
+			continue;
+
+		const char* type = ini_find_key(s, "type");
+		if (!type || canopen_type_from_string(type) == CANOPEN_UNKNOWN
+		 || !ini_find_key(s, "value"))
+			continue;
+
+		source->position = i;
+		source->section = s;
+		++n;
+	}
+
+	qsort(sources, n, sizeof(*sources), vnode_od__cmp_source);
+
+	/* Only the last of each key is kept */
+	size_t n_unique = 0;
+	for (size_t i = 0; i < n; ++i)
+		if (n_unique == 0 || sources[n_unique - 1].key != sources[i].key)
+			sources[n_unique++] = sources[i];
+
+	return n_unique;
+}
+
+static int vnode_od__convert(struct canopen_data* data,
+			     const struct ini_section* s)
+{
+	enum canopen_type type =
+		canopen_type_from_string(ini_find_key(s, "type"));
+
+	return canopen_data_fromstring(data, type, ini_find_key(s, "value"));
+}
+
+static uint32_t vnode_od__get_capacity(const struct canopen_data* data)
+{
+	if (!canopen_type_is_string(data->type))
+		return data->size;
+
+	return data->size > VNODE_OD_MIN_STRING_CAPACITY
+	       ? data->size : VNODE_OD_MIN_STRING_CAPACITY;
+}
+
+static int vnode_od__is_read_only(const struct ini_section* s)
+{
+	const char* access = ini_find_key(s, "access");
+	return access && strcasecmp(access, "ro") == 0;
+}
+
+int vnode_od_compile(struct vnode_od* self, const struct ini_file* config)
+{
+	memset(self, 0, sizeof(*self));
+
+	size_t length = ini_get_length(config);
+	if (length == 0)
+		return 0;
+
+	struct vnode_od__source* sources = malloc(length * sizeof(*sources));
+	if (!sources)
+		return -1;
+
+	size_t n = vnode_od__collect(sources, config);
+
+	/* The values are converted twice, first to make room for them */
+	size_t data_size = 0;
+	for (size_t i = 0; i < n; ++i) {
+		struct canopen_data data;
+		if (vnode_od__convert(&data, sources[i].section) < 0) {
+			errno = EINVAL;
+			goto failure;
+		}
+
+		data_size += vnode_od__get_capacity(&data);
+	}
+
+	self->entry = malloc(n * sizeof(*self->entry) + 1);
+	self->data = malloc(data_size + 1);
+	if (!self->entry || !self->data)
+		goto failure;
+
+	size_t offset = 0;
+	for (size_t i = 0; i < n; ++i) {
+		const struct ini_section* s = sources[i].section;
+		struct vnode_od_entry* entry = &self->entry[i];
+		struct canopen_data data;
+
+		vnode_od__convert(&data, s);
+
+		entry->key = sources[i].key;
+		entry->type = data.type;
+		entry->is_read_only = vnode_od__is_read_only(s);
+		entry->size = data.size;
+		entry->capacity = vnode_od__get_capacity(&data);
+		entry->offset = offset;
+
+		memcpy(self->data + offset, data.data, data.size);
+		offset += entry->capacity;
+	}
+
+	self->n_entries = n;
+	self->data_size = data_size;
+	free(sources);
+	return 0;
+
+failure:
+	vnode_od_destroy(self);
+	free(sources);
+	return -1;
+}
+
+int vnode_od_copy(struct vnode_od* dst, const struct vnode_od* src)
+{
+	memset(dst, 0, sizeof(*dst));
+
+	if (src->n_entries == 0)
+		return 0;
+
+	dst->entry = malloc(src->n_entries * sizeof(*dst->entry));
+	dst->data = malloc(src->data_size + 1);
+	if (!dst->entry || !dst->data) {
+		vnode_od_destroy(dst);
+		return -1;
+	}
+
+	memcpy(dst->entry, src->entry, src->n_entries * sizeof(*dst->entry));
+	memcpy(dst->data, src->data, src->data_size);
+	dst->n_entries = src->n_entries;
+	dst->data_size = src->data_size;
+	return 0;
+}
+
+void vnode_od_destroy(struct vnode_od* self)
+{
+	free(self->data);
+	free(self->entry);
+	memset(self, 0, sizeof(*self));
+}
+
+static struct vnode_od_entry* vnode_od__find(const struct vnode_od* self,
+					     uint32_t key)
+{
+	size_t low = 0;
+	size_t high = self->n_entries;
+
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		struct vnode_od_entry* entry = &self->entry[middle];
+
+		if (entry->key == key)
+			return entry;
+
+		if (entry->key < key)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	return NULL;
+}
+
+const struct vnode_od_entry* vnode_od_find(const struct vnode_od* self,
+					   int index, int subindex)
+{
+	return vnode_od__find(self, VNODE_OD_KEY(index, subindex));
+}
+
+int vnode_od_write(struct vnode_od* self, int index, int subindex,
+		   const void* data, size_t size)
+{
+	struct vnode_od_entry* entry =
+		vnode_od__find(self, VNODE_OD_KEY(index, subindex));
+	if (!entry) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (entry->is_read_only) {
+		errno = EACCES;
+		return -1;
+	}
+
+	if (size > entry->capacity) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (!canopen_type_is_string(entry->type) && size < entry->capacity) {
+		errno = ERANGE;
+		return -1;
+	}
+
+	memcpy(self->data + entry->offset, data, size);
+	entry->size = size;
+	return 0;
+}
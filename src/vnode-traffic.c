@@ -0,0 +1,388 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "canopen.h"
+#include "ini_parser.h"
+#include "vector.h"
+#include "mem-tag.h"
+#include "vnode-traffic.h"
+
+static int vnode_traffic__get_uint(const struct ini_section* s,
+				   const char* key, uint64_t* value)
+{
+	const char* str = ini_find_key(s, key);
+	if (!str)
+		return 0;
+
+	char* end;
+	*value = strtoull(str, &end, 0);
+	return *str != '\0' && *end == '\0' ? 0 : -1;
+}
+
+static int vnode_traffic__hex_digit(int c)
+{
+	if ('0' <= c && c <= '9') return c - '0';
+	if ('a' <= c && c <= 'f') return c - 'a' + 10;
+	if ('A' <= c && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static int vnode_traffic__parse_hex(struct vnode_traffic_frame* frame,
+				    const char* str)
+{
+	frame->size = 0;
+
+	while (1) {
+		while (isspace((unsigned char)*str))
+			++str;
+
+		if (*str == '\0')
+			return 0;
+
+		int high = vnode_traffic__hex_digit(str[0]);
+		int low = high < 0 ? -1 : vnode_traffic__hex_digit(str[1]);
+		if (low < 0 || frame->size >= sizeof(frame->data))
+			return -1;
+
+		frame->data[frame->size++] = high << 4 | low;
+		str += 2;
+	}
+}
+
+int vnode_traffic_load_replay(struct vnode_traffic_frame** frames, size_t* n,
+			      const char* path)
+{
+	char line[256];
+	struct vector buffer;
+	int lineno = 0;
+
+	FILE* stream = fopen(path, "re");
+	if (!stream)
+		return -1;
+
+	if (vector_init(&buffer, 64 * sizeof(struct vnode_traffic_frame)) < 0)
+		goto failure;
+
+	while (fgets(line, sizeof(line), stream)) {
+		struct vnode_traffic_frame frame;
+		--lineno;
+
+		const char* str = line + strspn(line, " \t\r\n");
+		if (*str == '\0' || *str == '#')
+			continue;
+
+		if (vnode_traffic__parse_hex(&frame, str) < 0)
+			goto parse_failure;
+
+		if (vector_append(&buffer, &frame, sizeof(frame)) < 0) {
+			lineno = -1;
+			goto parse_failure;
+		}
+	}
+
+	if (ferror(stream) || buffer.index == 0) {
+		lineno = -1;
+		goto parse_failure;
+	}
+
+	fclose(stream);
+	*frames = buffer.data;
+	*n = buffer.index / sizeof(struct vnode_traffic_frame);
+	return 0;
+
+parse_failure:
+	vector_destroy(&buffer);
+failure:
+	fclose(stream);
+	return lineno < 0 ? lineno : -1;
+}
+
+static enum vnode_traffic_pattern
+vnode_traffic__pattern_from_string(const char* str)
+{
+	if (!str)
+		return VNODE_TRAFFIC_CONSTANT;
+
+	if (0 == strcasecmp(str, "constant")) return VNODE_TRAFFIC_CONSTANT;
+	if (0 == strcasecmp(str, "counter"))  return VNODE_TRAFFIC_COUNTER;
+	if (0 == strcasecmp(str, "random"))   return VNODE_TRAFFIC_RANDOM;
+	if (0 == strcasecmp(str, "replay"))   return VNODE_TRAFFIC_REPLAY;
+
+	return -1;
+}
+
+static int vnode_traffic__load_timing(struct vnode_traffic_gen* gen,
+				      const struct ini_section* s)
+{
+	uint64_t period = 0, sync = 0, burst = 1;
+
+	if (vnode_traffic__get_uint(s, "period", &period) < 0
+	 || vnode_traffic__get_uint(s, "sync", &sync) < 0
+	 || vnode_traffic__get_uint(s, "burst", &burst) < 0)
+		return -1;
+
+	if (!period == !sync || sync > 240 || burst == 0 || burst > 1000)
+		return -1;
+
+	gen->period = period;
+	gen->sync = sync;
+	gen->burst = burst;
+	return 0;
+}
+
+static int vnode_traffic__load_tpdo(struct vnode_traffic_gen* gen,
+				    const struct ini_section* s, int nodeid,
+				    int n)
+{
+	uint64_t size = 8;
+	int rc;
+
+	gen->cob_id = R_TPDO1 + 0x100 * n + nodeid;
+	gen->random_state = (uint32_t)nodeid * 0x9e3779b9U ^ (n + 1);
+
+	if (vnode_traffic__load_timing(gen, s) < 0
+	 || vnode_traffic__get_uint(s, "size", &size) < 0 || size > 8)
+		return -1;
+
+	gen->pattern = vnode_traffic__pattern_from_string(
+				ini_find_key(s, "pattern"));
+
+	const char* data = ini_find_key(s, "data");
+	const char* file = ini_find_key(s, "file");
+
+	switch ((int)gen->pattern) {
+	case VNODE_TRAFFIC_CONSTANT:
+	case VNODE_TRAFFIC_COUNTER:
+		if (data && vnode_traffic__parse_hex(&gen->frame, data) < 0)
+			return -1;
+
+		if (gen->frame.size > size)
+			return -1;
+		break;
+	case VNODE_TRAFFIC_RANDOM:
+		break;
+	case VNODE_TRAFFIC_REPLAY:
+		if (!file)
+			return -1;
+
+		rc = vnode_traffic_load_replay(&gen->replay,
+						   &gen->n_replay, file);
+		if (rc < 0) {
+			fprintf(stderr, "Could not load %s (%d)\n", file, rc);
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	gen->frame.size = size;
+	gen->is_enabled = 1;
+	return 0;
+}
+
+static int vnode_traffic__load_emcy(struct vnode_traffic_gen* gen,
+				    const struct ini_section* s, int nodeid)
+{
+	uint64_t code = 0x1000, reg = 0x01;
+
+	gen->cob_id = R_EMCY + nodeid;
+
+	if (vnode_traffic__load_timing(gen, s) < 0 || gen->sync
+	 || vnode_traffic__get_uint(s, "code", &code) < 0 || code > 0xffff
+	 || vnode_traffic__get_uint(s, "register", &reg) < 0 || reg > 0xff)
+		return -1;
+
+	gen->pattern = VNODE_TRAFFIC_COUNTER;
+	gen->counter_offset = 3;
+	gen->frame.size = 8;
+	gen->frame.data[0] = code;
+	gen->frame.data[1] = code >> 8;
+	gen->frame.data[2] = reg;
+	gen->is_enabled = 1;
+	return 0;
+}
+
+int vnode_traffic_load(struct vnode_traffic* self,
+		       const struct ini_file* config, int nodeid)
+{
+	const struct ini_section* s;
+	char section[16];
+
+	memset(self, 0, sizeof(*self));
+
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i) {
+		snprintf(section, sizeof(section), "tpdo%d", i + 1);
+
+		s = ini_find_section(config, section);
+		if (s && vnode_traffic__load_tpdo(&self->tpdo[i], s, nodeid,
+						  i) < 0)
+			goto failure;
+	}
+
+	strcpy(section, "emcy");
+	s = ini_find_section(config, section);
+	if (s && vnode_traffic__load_emcy(&self->emcy, s, nodeid) < 0)
+		goto failure;
+
+	return 0;
+
+failure:
+	fprintf(stderr, "Invalid traffic config in section [%s]\n", section);
+	vnode_traffic_destroy(self);
+	return -1;
+}
+
+void vnode_traffic_destroy(struct vnode_traffic* self)
+{
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i)
+		mem_free(MEM_TAG_VECTOR, self->tpdo[i].replay);
+
+	memset(self, 0, sizeof(*self));
+}
+
+int vnode_traffic_is_timed(const struct vnode_traffic* self)
+{
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i)
+		if (self->tpdo[i].is_enabled && self->tpdo[i].period)
+			return 1;
+
+	return self->emcy.is_enabled;
+}
+
+int vnode_traffic_is_synchronous(const struct vnode_traffic* self)
+{
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i)
+		if (self->tpdo[i].is_enabled && self->tpdo[i].sync)
+			return 1;
+
+	return 0;
+}
+
+static void vnode_traffic__start_gen(struct vnode_traffic_gen* gen,
+				     uint64_t now)
+{
+	gen->deadline = now + gen->period;
+	gen->n_syncs = 0;
+}
+
+void vnode_traffic_start(struct vnode_traffic* self, uint64_t now)
+{
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i)
+		vnode_traffic__start_gen(&self->tpdo[i], now);
+
+	vnode_traffic__start_gen(&self->emcy, now);
+}
+
+static uint64_t
+vnode_traffic__deadline(const struct vnode_traffic_gen* gen)
+{
+	return gen->is_enabled && gen->period ? gen->deadline : UINT64_MAX;
+}
+
+uint64_t vnode_traffic_next_deadline(const struct vnode_traffic* self)
+{
+	uint64_t deadline = vnode_traffic__deadline(&self->emcy);
+
+	for (int i = 0; i < VNODE_TRAFFIC_N_TPDOS; ++i) {
+		uint64_t d = vnode_traffic__deadline(&self->tpdo[i]);
+		if (d < deadline)
+			deadline = d;
+	}
+
+	return deadline;
+}
+
+unsigned int vnode_traffic_due(struct vnode_traffic_gen* gen, uint64_t now)
+{
+	if (!gen->is_enabled || !gen->period || now < gen->deadline)
+		return 0;
+
+	uint64_t n = (now - gen->deadline) / gen->period + 1;
+	gen->deadline += n * gen->period;
+
+	if (n > VNODE_TRAFFIC_MAX_CATCH_UP) {
+		gen->n_skipped += (n - VNODE_TRAFFIC_MAX_CATCH_UP) * gen->burst;
+		n = VNODE_TRAFFIC_MAX_CATCH_UP;
+	}
+
+	return n * gen->burst;
+}
+
+unsigned int vnode_traffic_on_sync(struct vnode_traffic_gen* gen)
+{
+	if (!gen->is_enabled || !gen->sync)
+		return 0;
+
+	if (++gen->n_syncs < gen->sync)
+		return 0;
+
+	gen->n_syncs = 0;
+	return gen->burst;
+}
+
+static void vnode_traffic__count(struct vnode_traffic_gen* gen)
+{
+	struct vnode_traffic_frame* frame = &gen->frame;
+
+	for (unsigned int i = gen->counter_offset; i < frame->size; ++i)
+		if (++frame->data[i] != 0)
+			break;
+}
+
+/* xorshift32 */
+static uint32_t vnode_traffic__random(struct vnode_traffic_gen* gen)
+{
+	uint32_t x = gen->random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return gen->random_state = x;
+}
+
+void vnode_traffic_next_frame(struct vnode_traffic_gen* gen,
+			      struct vnode_traffic_frame* frame)
+{
+	switch (gen->pattern) {
+	case VNODE_TRAFFIC_CONSTANT:
+		*frame = gen->frame;
+		break;
+	case VNODE_TRAFFIC_COUNTER:
+		*frame = gen->frame;
+		vnode_traffic__count(gen);
+		break;
+	case VNODE_TRAFFIC_RANDOM:
+		frame->size = gen->frame.size;
+		for (unsigned int i = 0; i < frame->size; i += 4) {
+			uint32_t r = vnode_traffic__random(gen);
+			memcpy(&frame->data[i], &r, sizeof(r));
+		}
+		break;
+	case VNODE_TRAFFIC_REPLAY:
+		*frame = gen->replay[gen->replay_index];
+		if (++gen->replay_index == gen->n_replay)
+			gen->replay_index = 0;
+		break;
+	}
+
+	++gen->n_frames;
+}
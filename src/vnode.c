@@ -19,6 +19,8 @@
 #include <mloop.h>
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
+#include <linux/can.h>
 
 #include "socketcan.h"
 #include "canopen.h"
@@ -30,13 +32,17 @@
 #include "net-util.h"
 #include "sock.h"
 #include "ini_parser.h"
-#include "conversions.h"
+#include "time-utils.h"
 #include "vnode.h"
+#include "vnode-traffic.h"
+#include "vnode-od.h"
 #include "type-macros.h"
 
 #define SDO_MUX(index, subindex) ((index << 16) | subindex)
 #define HEARTBEAT_PERIOD SDO_MUX(0x1017, 0)
 
+#define VNODE_TXQ_SIZE 256
+
 enum vnode__bootup_method {
 	VNODE_BOOT_UNSPEC = 0,
 	VNODE_BOOT_STANDARD = 1,
@@ -44,9 +50,23 @@ enum vnode__bootup_method {
 	VNODE_BOOT_BOTH = VNODE_BOOT_STANDARD | VNODE_BOOT_LEGACY,
 };
 
+/* Nodes of the same type usually share a config file, so each file is mapped
+ * and parsed once and the result is shared by all the nodes that name it.
+ * Nothing is written to a config after it has been parsed. Each node gets its
+ * own copy of the object dictionary, as downloads change it.
+ */
+struct vnode__config {
+	struct vnode__config* next;
+	char* path;
+	int ref;
+	struct ini_file ini;
+	struct vnode_od od;
+};
+
 struct vnode {
 	int is_running;
-	struct ini_file config;
+	struct vnode__config* config;
+	struct vnode_od od;
 	int nodeid;
 	enum nmt_state state;
 	struct sdo_srv sdo_srv;
@@ -56,6 +76,14 @@ struct vnode {
 	int have_node_guarding;
 	int have_guard_status_bug;
 	enum vnode__bootup_method bootup_method;
+	struct vnode_traffic traffic;
+};
+
+typedef void (*vnode__handler_fn)(struct vnode*, const struct can_frame*);
+
+struct vnode__route {
+	struct vnode* node;
+	vnode__handler_fn fn;
 };
 
 struct sock vnode__sock;
@@ -63,8 +91,22 @@ static struct mloop_socket* vnode__socket = NULL;
 
 struct vnode vnode__node[127] = { 0 };
 
+static struct vnode__config* vnode__configs = NULL;
+
+/* One timer drives the generated traffic of all the nodes */
+static struct mloop_timer* vnode__traffic_timer = NULL;
+
+/* All nodes in the process share one socket, and frames are passed to the
+ * node that they are addressed to by looking up their COB-ID here. NMT
+ * commands carry the node id in the payload, so they are not in the table.
+ */
+static struct vnode__route vnode__routes[CAN_SFF_MASK + 1];
+
 static inline struct vnode* vnode__get_node(int nodeid)
 {
+	if (!(CANOPEN_NODEID_MIN <= nodeid && nodeid <= CANOPEN_NODEID_MAX))
+		return NULL;
+
 	return &vnode__node[nodeid - 1];
 }
 
@@ -95,10 +137,17 @@ static int vnode__config_is_true(const struct ini_section* s, const char* key)
 	return value ? strcasecmp(value, "yes") == 0 : 0;
 }
 
+static const struct ini_section*
+vnode__find_section(const struct vnode* self, const char* section)
+{
+	return self->config ? ini_find_section(&self->config->ini, section)
+			    : NULL;
+}
+
 static void vnode__load_device_info(struct vnode* self)
 {
 	const struct ini_section* s;
-	s = ini_find_section(&self->config, "device");
+	s = vnode__find_section(self, "device");
 	if (!s)
 		return;
 
@@ -109,23 +158,90 @@ static void vnode__load_device_info(struct vnode* self)
 	self->bootup_method = vnode__get_bootup_method(s);
 }
 
-static int vnode__load_config(struct vnode* self, const char* path)
+static struct vnode__config* vnode__config_get(const char* path)
 {
-	FILE* stream = fopen(path, "r");
-	if (!stream) {
+	struct vnode__config* config;
+
+	for (config = vnode__configs; config; config = config->next)
+		if (strcmp(config->path, path) == 0) {
+			++config->ref;
+			return config;
+		}
+
+	config = malloc(sizeof(*config));
+	if (!config)
+		return NULL;
+
+	config->path = strdup(path);
+	if (!config->path)
+		goto path_failure;
+
+	int rc = ini_parse_file(&config->ini, path);
+	if (rc == -1) {
 		perror("Could not open config");
-		return -1;
+		goto parse_failure;
+	} else if (rc < 0) {
+		fprintf(stderr, "Could not parse config %s at line %d\n",
+			path, -rc);
+		goto parse_failure;
+	}
+
+	if (vnode_od_compile(&config->od, &config->ini) < 0) {
+		fprintf(stderr, "Could not compile the objects of config %s: %s\n",
+			path, strerror(errno));
+		goto compile_failure;
 	}
 
-	int rc = ini_parse(&self->config, stream);
-	if (rc < 0)
-		perror("Could not parse config");
+	config->ref = 1;
+	config->next = vnode__configs;
+	vnode__configs = config;
+	return config;
+
+compile_failure:
+	ini_destroy(&config->ini);
+parse_failure:
+	free(config->path);
+path_failure:
+	free(config);
+	return NULL;
+}
+
+static void vnode__config_put(struct vnode__config* config)
+{
+	if (--config->ref > 0)
+		return;
+
+	struct vnode__config** link = &vnode__configs;
+	while (*link != config)
+		link = &(*link)->next;
+	*link = config->next;
+
+	vnode_od_destroy(&config->od);
+	ini_destroy(&config->ini);
+	free(config->path);
+	free(config);
+}
 
-	fclose(stream);
+static int vnode__load_config(struct vnode* self, const char* path)
+{
+	self->config = vnode__config_get(path);
+	if (!self->config)
+		return -1;
+
+	if (vnode_od_copy(&self->od, &self->config->od) < 0) {
+		vnode__config_put(self->config);
+		self->config = NULL;
+		return -1;
+	}
 
 	vnode__load_device_info(self);
+	return 0;
+}
 
-	return rc;
+static void vnode__unload_config(struct vnode* self)
+{
+	vnode_od_destroy(&self->od);
+	vnode__config_put(self->config);
 }
 
 static void vnode__send_state(struct vnode* self)
@@ -198,6 +314,127 @@ static int vnode__restart_heartbeat_timer(struct vnode* self)
 	return vnode__start_heartbeat_timer(self);
 }
 
+static void vnode__send_traffic(struct vnode_traffic_gen* gen,
+				unsigned int n)
+{
+	struct vnode_traffic_frame frame;
+	struct can_frame cf = { .can_id = gen->cob_id };
+
+	for (unsigned int i = 0; i < n; ++i) {
+		vnode_traffic_next_frame(gen, &frame);
+		cf.can_dlc = frame.size;
+		memcpy(cf.data, frame.data, frame.size);
+		sock_stage(&vnode__sock, &cf);
+	}
+}
+
+static int vnode__is_generating(const struct vnode* self)
+{
+	return self->is_running && self->state == NMT_STATE_OPERATIONAL;
+}
+
+static void vnode__schedule_traffic(void)
+{
+	uint64_t deadline = UINT64_MAX;
+
+	for (int i = 0; i < CANOPEN_NODEID_MAX; ++i) {
+		struct vnode* node = &vnode__node[i];
+		if (!vnode__is_generating(node))
+			continue;
+
+		uint64_t d = vnode_traffic_next_deadline(&node->traffic);
+		if (d < deadline)
+			deadline = d;
+	}
+
+	struct mloop_timer* timer = vnode__traffic_timer;
+	mloop_timer_stop(timer);
+
+	if (deadline == UINT64_MAX)
+		return;
+
+	mloop_timer_set_time(timer, deadline * 1000ULL);
+	mloop_timer_start(timer);
+}
+
+/* Everything that has fallen due on any node is sent in one batch */
+static void vnode__on_traffic_timer(struct mloop_timer* timer)
+{
+	(void)timer;
+
+	uint64_t now = gettime_us(CLOCK_MONOTONIC);
+
+	for (int i = 0; i < CANOPEN_NODEID_MAX; ++i) {
+		struct vnode* node = &vnode__node[i];
+		if (!vnode__is_generating(node))
+			continue;
+
+		struct vnode_traffic* traffic = &node->traffic;
+
+		for (int j = 0; j < VNODE_TRAFFIC_N_TPDOS; ++j)
+			vnode__send_traffic(&traffic->tpdo[j],
+				vnode_traffic_due(&traffic->tpdo[j], now));
+
+		vnode__send_traffic(&traffic->emcy,
+				    vnode_traffic_due(&traffic->emcy, now));
+	}
+
+	sock_flush(&vnode__sock);
+	vnode__schedule_traffic();
+}
+
+static void vnode__on_sync(const struct can_frame* cf)
+{
+	(void)cf;
+
+	for (int i = 0; i < CANOPEN_NODEID_MAX; ++i) {
+		struct vnode* node = &vnode__node[i];
+		if (!vnode__is_generating(node))
+			continue;
+
+		struct vnode_traffic* traffic = &node->traffic;
+
+		for (int j = 0; j < VNODE_TRAFFIC_N_TPDOS; ++j)
+			vnode__send_traffic(&traffic->tpdo[j],
+				vnode_traffic_on_sync(&traffic->tpdo[j]));
+	}
+
+	sock_flush(&vnode__sock);
+}
+
+static int vnode__setup_traffic(struct vnode* self)
+{
+	if (!self->config)
+		return 0;
+
+	if (vnode_traffic_load(&self->traffic, &self->config->ini,
+			       self->nodeid) < 0)
+		return -1;
+
+	if (!vnode_traffic_is_timed(&self->traffic) || vnode__traffic_timer)
+		return 0;
+
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer) {
+		vnode_traffic_destroy(&self->traffic);
+		return -1;
+	}
+
+	mloop_timer_set_type(timer, MLOOP_TIMER_ABSOLUTE);
+	mloop_timer_set_callback(timer, vnode__on_traffic_timer);
+
+	vnode__traffic_timer = timer;
+	return 0;
+}
+
+static void vnode__start_traffic(struct vnode* self)
+{
+	vnode_traffic_start(&self->traffic, gettime_us(CLOCK_MONOTONIC));
+
+	if (vnode_traffic_is_timed(&self->traffic))
+		vnode__schedule_traffic();
+}
+
 static void vnode__nmt(struct vnode* self, const struct can_frame* cf)
 {
 	int nodeid = nmt_get_nodeid(cf);
@@ -207,7 +444,10 @@ static void vnode__nmt(struct vnode* self, const struct can_frame* cf)
 	enum nmt_cs cs = nmt_get_cs(cf);
 	switch (cs) {
 	case NMT_CS_START:
-		self->state = NMT_STATE_OPERATIONAL;
+		if (self->state != NMT_STATE_OPERATIONAL) {
+			self->state = NMT_STATE_OPERATIONAL;
+			vnode__start_traffic(self);
+		}
 		vnode__start_heartbeat_timer(self);
 		break;
 	case NMT_CS_STOP:
@@ -238,45 +478,30 @@ static int vnode__sdo_get_heartbeat(struct vnode* self, struct sdo_srv* srv)
 	return 0;
 }
 
-static const char* vnode__make_section_string(int index, int subindex)
+static int vnode__sdo_get_config(struct vnode* self, struct sdo_srv* srv)
 {
-	static char buffer[256];
-	snprintf(buffer, sizeof(buffer), "%xsub%x", index, subindex);
-	return buffer;
-}
+	const struct vnode_od_entry* entry =
+		vnode_od_find(&self->od, srv->index, srv->subindex);
+	if (!entry)
+		return sdo_srv_abort(srv, SDO_ABORT_NEXIST);
 
-static enum canopen_type vnode__get_section_type(const struct ini_section* s)
-{
-	const char* type_str = ini_find_key(s, "type");
-	if (!type_str)
-		return CANOPEN_UNKNOWN;
+	if (vector_assign(&srv->buffer, vnode_od_get_data(&self->od, entry),
+			  entry->size) < 0)
+		return sdo_srv_abort(srv, SDO_ABORT_NOMEM);
 
-	return canopen_type_from_string(type_str);
+	return 0;
 }
 
-static int vnode__sdo_get_config(struct vnode* self, struct sdo_srv* srv)
+/* Downloads are refused before the data is transferred where that is known */
+static int vnode__sdo_check_config(struct vnode* self, struct sdo_srv* srv)
 {
-	const char* section;
-	section = vnode__make_section_string(srv->index, srv->subindex);
-
-	const struct ini_section* s = ini_find_section(&self->config, section);
-	if (!s)
-		return sdo_srv_abort(srv, SDO_ABORT_NEXIST);
-
-	enum canopen_type type = vnode__get_section_type(s);
-	if (type == CANOPEN_UNKNOWN)
+	const struct vnode_od_entry* entry =
+		vnode_od_find(&self->od, srv->index, srv->subindex);
+	if (!entry)
 		return sdo_srv_abort(srv, SDO_ABORT_NEXIST);
 
-	const char* value = ini_find_key(s, "value");
-	if (!value)
-		return sdo_srv_abort(srv, SDO_ABORT_NEXIST);
-
-	struct canopen_data data;
-	if (canopen_data_fromstring(&data, type, value) < 0)
-		return sdo_srv_abort(srv, SDO_ABORT_NOMEM);
-
-	if (vector_assign(&srv->buffer, data.data, data.size) < 0)
-		return sdo_srv_abort(srv, SDO_ABORT_NOMEM);
+	if (entry->is_read_only)
+		return sdo_srv_abort(srv, SDO_ABORT_RO);
 
 	return 0;
 }
@@ -294,7 +519,7 @@ static int vnode__on_sdo_init(struct sdo_srv* srv)
 	default:
 		return srv->req_type == SDO_REQ_UPLOAD
 		     ? vnode__sdo_get_config(self, srv)
-		     : sdo_srv_abort(srv, SDO_ABORT_RO);
+		     : vnode__sdo_check_config(self, srv);
 	}
 
 	abort();
@@ -334,9 +559,25 @@ static int vnode__sdo_set_heartbeat(struct vnode* self, struct sdo_srv* srv)
 	return 0;
 }
 
-static int vnode__sdo_set_config(struct sdo_srv* srv)
+static enum sdo_abort_code vnode__od_abort_code(int error)
+{
+	switch (error) {
+	case ENOENT: return SDO_ABORT_NEXIST;
+	case EACCES: return SDO_ABORT_RO;
+	case EMSGSIZE: return SDO_ABORT_TOO_LONG;
+	case ERANGE: return SDO_ABORT_TOO_SHORT;
+	}
+
+	return SDO_ABORT_GENERAL;
+}
+
+static int vnode__sdo_set_config(struct vnode* self, struct sdo_srv* srv)
 {
-	return sdo_srv_abort(srv, SDO_ABORT_NEXIST);
+	if (vnode_od_write(&self->od, srv->index, srv->subindex,
+			   srv->buffer.data, srv->buffer.index) < 0)
+		return sdo_srv_abort(srv, vnode__od_abort_code(errno));
+
+	return 0;
 }
 
 static int vnode__on_sdo_done(struct sdo_srv* srv)
@@ -353,7 +594,7 @@ static int vnode__on_sdo_done(struct sdo_srv* srv)
 	case HEARTBEAT_PERIOD:
 		return vnode__sdo_set_heartbeat(self, srv);
 	default:
-		return vnode__sdo_set_config(srv);
+		return vnode__sdo_set_config(self, srv);
 	}
 
 	abort();
@@ -367,53 +608,97 @@ static void vnode__rsdo(struct vnode* self, const struct can_frame* cf)
 	sdo_srv_feed(&self->sdo_srv, cf);
 }
 
-static void vnode__on_frame(const struct can_frame* cf)
+static void vnode__add_routes(struct vnode* self)
 {
-	struct vnode* self;
-	struct canopen_msg msg;
+	struct vnode__route* routes = vnode__routes;
 
-	if (canopen_get_object_type(&msg, cf) < 0)
-		return;
+	routes[R_RSDO + self->nodeid].node = self;
+	routes[R_RSDO + self->nodeid].fn = vnode__rsdo;
+	routes[R_HEARTBEAT + self->nodeid].node = self;
+	routes[R_HEARTBEAT + self->nodeid].fn = vnode__heartbeat;
+}
 
-	if (msg.object != CANOPEN_NMT) {
-		if (!(CANOPEN_NODEID_MIN <= msg.id
-		      && msg.id <= CANOPEN_NODEID_MAX))
-			return;
+static void vnode__remove_routes(struct vnode* self)
+{
+	memset(&vnode__routes[R_RSDO + self->nodeid], 0,
+	       sizeof(vnode__routes[0]));
+	memset(&vnode__routes[R_HEARTBEAT + self->nodeid], 0,
+	       sizeof(vnode__routes[0]));
+}
 
-		self = vnode__get_node(msg.id);
-		if (!self)
-			return;
+/* Let the kernel, or the bridge server, drop frames that are not routed to
+ * any of the nodes so that the process is not woken up for them.
+ */
+static int vnode__update_filters(void)
+{
+	struct can_filter filters[2 + 2 * CANOPEN_NODEID_MAX];
+	int n = 0;
 
-		if (msg.id != self->nodeid)
-			return;
-	} else {
-		if (nmt_get_nodeid(cf) == 0) {
-			for (int i = 1; i < 128; ++i) {
-				self = vnode__get_node(i);
-				if (self->is_running)
-					vnode__nmt(self, cf);
-				return;
-			}
-		} else {
-			self = vnode__get_node(nmt_get_nodeid(cf));
-		}
+	socketcan_make_sff_filter(&filters[n++], R_NMT);
+	socketcan_make_sff_filter(&filters[n++], R_SYNC);
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		if (!vnode__routes[R_RSDO + i].node)
+			continue;
+
+		socketcan_make_sff_filter(&filters[n++], R_RSDO + i);
+
+		/* Node guarding requests are RTR frames */
+		filters[n].can_id = R_HEARTBEAT + i;
+		filters[n].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG;
+		++n;
 	}
 
-	switch (msg.object) {
-	case CANOPEN_HEARTBEAT:
-		vnode__heartbeat(self, cf);
-		break;
-	case CANOPEN_NMT:
-		vnode__nmt(self, cf);
-		break;
-	case CANOPEN_RSDO:
-		vnode__rsdo(self, cf);
-		break;
+	switch (vnode__sock.type) {
+	case SOCK_TYPE_CAN:
+		return socketcan_apply_filters(vnode__sock.fd, filters, n);
+	case SOCK_TYPE_TCP:
+		return sock_subscribe(&vnode__sock, filters, n);
 	default:
-		break;
+		return 0;
+	}
+}
+
+static void vnode__on_nmt(const struct can_frame* cf)
+{
+	int nodeid = nmt_get_nodeid(cf);
+
+	if (nodeid != 0) {
+		struct vnode* self = vnode__get_node(nodeid);
+		if (self && self->is_running)
+			vnode__nmt(self, cf);
+		return;
+	}
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct vnode* self = vnode__get_node(i);
+		if (self->is_running)
+			vnode__nmt(self, cf);
 	}
 }
 
+static void vnode__on_frame(const struct can_frame* cf)
+{
+	if (cf->can_id & CAN_EFF_FLAG)
+		return;
+
+	uint32_t cob = cf->can_id & CAN_SFF_MASK;
+
+	if (cob == R_NMT) {
+		vnode__on_nmt(cf);
+		return;
+	}
+
+	if (cob == R_SYNC) {
+		vnode__on_sync(cf);
+		return;
+	}
+
+	const struct vnode__route* route = &vnode__routes[cob];
+	if (route->fn)
+		route->fn(route->node, cf);
+}
+
 static void vnode__mux(struct mloop_socket* socket)
 {
 	struct can_frame cf;
@@ -455,6 +740,12 @@ static void vnode__cleanup_mloop(void)
 	if (mloop_socket_unref(vnode__socket) == 1) {
 		mloop_socket_stop(vnode__socket);
 		vnode__socket = NULL;
+
+		if (vnode__traffic_timer) {
+			mloop_timer_stop(vnode__traffic_timer);
+			mloop_timer_unref(vnode__traffic_timer);
+			vnode__traffic_timer = NULL;
+		}
 	}
 }
 
@@ -471,6 +762,10 @@ int vnode__init_socket(struct vnode* self, enum sock_type type,
 		return -1;
 	}
 
+	/* Generated traffic is staged and sent in batches */
+	if (sock_txq_init(&vnode__sock, VNODE_TXQ_SIZE) < 0)
+		goto failure;
+
 	if (vnode__setup_mloop(self) < 0)
 		goto failure;
 
@@ -509,6 +804,13 @@ struct vnode* co_vnode_new(enum sock_type type, const char* iface,
 		if (vnode__setup_heartbeat_timer(self) < 0)
 			goto srv_failure;
 
+	if (vnode__setup_traffic(self) < 0)
+		goto traffic_failure;
+
+	vnode__add_routes(self);
+	if (vnode__update_filters() < 0)
+		perror("Could not set receive filters");
+
 	if (self->bootup_method & VNODE_BOOT_LEGACY)
 		vnode__send_legacy_bootup(self);
 
@@ -517,10 +819,13 @@ struct vnode* co_vnode_new(enum sock_type type, const char* iface,
 	self->is_running = 1;
 	return self;
 
+traffic_failure:
+	if (self->have_heartbeat)
+		mloop_timer_unref(self->heartbeat_timer);
 	sdo_srv_destroy(&self->sdo_srv);
 srv_failure:
-	if (config_path)
-		ini_destroy(&self->config);
+	if (self->config)
+		vnode__unload_config(self);
 config_failure:
 	vnode__cleanup_mloop();
 	return NULL;
@@ -533,7 +838,13 @@ void co_vnode_destroy(struct vnode* self)
 		mloop_timer_unref(self->heartbeat_timer);
 
 	sdo_srv_destroy(&self->sdo_srv);
-	ini_destroy(&self->config);
+	vnode_traffic_destroy(&self->traffic);
+	if (self->config)
+		vnode__unload_config(self);
+
+	vnode__remove_routes(self);
+	vnode__update_filters();
+
 	vnode__cleanup_mloop();
 	self->is_running = 0;
 }
@@ -0,0 +1,340 @@
+/* Copyright (c) 2014-2016, Marel
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+ * OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "workq.h"
+
+#define workq__load(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define workq__store(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+
+#define workq__cas(ptr, expected, desired) \
+({ \
+	__typeof__(expected) expected_ = (expected); \
+	__atomic_compare_exchange_n((ptr), &expected_, desired, 0, \
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+})
+
+static int workq_deque__init(struct workq_deque* self, size_t size)
+{
+	size_t length = 1;
+	while (length < size)
+		length <<= 1;
+
+	self->data = malloc(length * sizeof(*self->data));
+	if (!self->data)
+		return -1;
+
+	self->mask = length - 1;
+	self->head = 0;
+	self->tail = 0;
+	pthread_mutex_init(&self->mutex, NULL);
+	return 0;
+}
+
+static void workq_deque__destroy(struct workq_deque* self)
+{
+	pthread_mutex_destroy(&self->mutex);
+	free(self->data);
+}
+
+static inline int workq_deque__is_empty(const struct workq_deque* self)
+{
+	return workq__load(&self->head) == workq__load(&self->tail);
+}
+
+/* The contents are unwrapped into the new buffer */
+static int workq_deque__grow(struct workq_deque* self)
+{
+	size_t length = (self->mask + 1) * 2;
+
+	void** data = malloc(length * sizeof(*data));
+	if (!data)
+		return -1;
+
+	size_t n = self->tail - self->head;
+	for (size_t i = 0; i < n; ++i)
+		data[i] = self->data[(self->head + i) & self->mask];
+
+	free(self->data);
+	self->data = data;
+	self->mask = length - 1;
+	workq__store(&self->tail, n);
+	workq__store(&self->head, 0);
+	return 0;
+}
+
+static int workq_deque__push(struct workq_deque* self, void* data)
+{
+	int rc = -1;
+
+	pthread_mutex_lock(&self->mutex);
+
+	if (self->tail - self->head > self->mask
+	 && workq_deque__grow(self) < 0)
+		goto done;
+
+	self->data[self->tail & self->mask] = data;
+	workq__store(&self->tail, self->tail + 1);
+
+	rc = 0;
+done:
+	pthread_mutex_unlock(&self->mutex);
+	return rc;
+}
+
+static void* workq_deque__pop(struct workq_deque* self)
+{
+	/* Looking without the lock keeps idle workers off busy deques */
+	if (workq_deque__is_empty(self))
+		return NULL;
+
+	void* data = NULL;
+
+	pthread_mutex_lock(&self->mutex);
+
+	if (self->head != self->tail) {
+		data = self->data[self->head & self->mask];
+		workq__store(&self->head, self->head + 1);
+	}
+
+	pthread_mutex_unlock(&self->mutex);
+	return data;
+}
+
+int workq_init(struct workq* self, size_t size)
+{
+	memset(self, 0, sizeof(*self));
+
+	size_t per_worker = size / WORKQ_N_BANDS;
+	if (per_worker < 16)
+		per_worker = 16;
+
+	self->worker = aligned_alloc(64, WORKQ_MAX_WORKERS
+					 * sizeof(*self->worker));
+	if (!self->worker)
+		return -1;
+
+	memset(self->worker, 0, WORKQ_MAX_WORKERS * sizeof(*self->worker));
+
+	int i, j;
+	for (i = 0; i < WORKQ_MAX_WORKERS; ++i) {
+		struct workq_worker* worker = &self->worker[i];
+
+		for (j = 0; j < WORKQ_N_BANDS; ++j)
+			if (workq_deque__init(&worker->band[j], per_worker) < 0)
+				goto failure;
+
+		sem_init(&worker->sem, 0, 0);
+	}
+
+	return 0;
+
+failure:
+	while (j-- > 0)
+		workq_deque__destroy(&self->worker[i].band[j]);
+
+	while (i-- > 0) {
+		sem_destroy(&self->worker[i].sem);
+		for (j = 0; j < WORKQ_N_BANDS; ++j)
+			workq_deque__destroy(&self->worker[i].band[j]);
+	}
+
+	free(self->worker);
+	return -1;
+}
+
+void workq_destroy(struct workq* self)
+{
+	for (int i = 0; i < WORKQ_MAX_WORKERS; ++i) {
+		struct workq_worker* worker = &self->worker[i];
+
+		sem_destroy(&worker->sem);
+		for (int j = 0; j < WORKQ_N_BANDS; ++j)
+			workq_deque__destroy(&worker->band[j]);
+	}
+
+	free(self->worker);
+}
+
+void workq_set_n_workers(struct workq* self, size_t n)
+{
+	if (n > WORKQ_MAX_WORKERS)
+		n = WORKQ_MAX_WORKERS;
+
+	if (n > workq__load(&self->n_slots))
+		workq__store(&self->n_slots, n);
+
+	workq__store(&self->n_workers, n);
+}
+
+static inline size_t workq__n_workers(const struct workq* self)
+{
+	size_t n = workq__load(&self->n_workers);
+	return n > 0 ? n : 1;
+}
+
+static inline size_t workq__n_slots(const struct workq* self)
+{
+	size_t n = workq__load(&self->n_slots);
+	return n > 0 ? n : 1;
+}
+
+size_t workq_get_length(const struct workq* self)
+{
+	size_t n = 0;
+	size_t n_slots = workq__n_slots(self);
+
+	for (size_t i = 0; i < n_slots; ++i)
+		for (int j = 0; j < WORKQ_N_BANDS; ++j) {
+			const struct workq_deque* deque = &self->worker[i].band[j];
+			size_t head = workq__load(&deque->head);
+			size_t tail = workq__load(&deque->tail);
+
+			/* Growing the deque moves both */
+			if (tail > head)
+				n += tail - head;
+		}
+
+	return n;
+}
+
+static inline int workq__wake(struct workq_worker* worker)
+{
+	if (!workq__cas(&worker->is_sleeping, 1, 0))
+		return 0;
+
+	sem_post(&worker->sem);
+	return 1;
+}
+
+int workq_push(struct workq* self, unsigned long priority, void* data)
+{
+	size_t n = workq__n_workers(self);
+	size_t target = __atomic_fetch_add(&self->next, 1, __ATOMIC_RELAXED) % n;
+	size_t band = priority < WORKQ_N_BANDS - 1 ? priority
+						    : WORKQ_N_BANDS - 1;
+
+	if (workq_deque__push(&self->worker[target].band[band], data) < 0)
+		return -1;
+
+	/* If the owner is busy, someone else might as well steal the job */
+	for (size_t i = 0; i < n; ++i)
+		if (workq__wake(&self->worker[(target + i) % n]))
+			break;
+
+	return 0;
+}
+
+static void* workq__find(struct workq* self, size_t index)
+{
+	size_t n = workq__n_slots(self);
+
+	for (int band = 0; band < WORKQ_N_BANDS; ++band)
+		for (size_t i = 0; i < n; ++i) {
+			struct workq_worker* worker =
+				&self->worker[(index + i) % n];
+
+			void* data = workq_deque__pop(&worker->band[band]);
+			if (data)
+				return data;
+		}
+
+	return NULL;
+}
+
+/* Returns -1 if the time ran out first */
+static int workq__sleep(struct workq_worker* worker,
+			const struct timespec* deadline)
+{
+	if (!deadline) {
+		while (sem_wait(&worker->sem) < 0 && errno == EINTR);
+		return 0;
+	}
+
+	while (sem_timedwait(&worker->sem, deadline) < 0)
+		if (errno != EINTR)
+			goto timeout;
+
+	return 0;
+
+timeout:
+	/* The flag is only taken along with a wake-up */
+	if (workq__cas(&worker->is_sleeping, 1, 0))
+		return -1;
+
+	while (sem_wait(&worker->sem) < 0 && errno == EINTR);
+	return 0;
+}
+
+static void* workq__pop(struct workq* self, size_t index,
+			const struct timespec* deadline)
+{
+	struct workq_worker* worker = &self->worker[index];
+
+	while (!workq__load(&self->is_stopping)) {
+		void* data = workq__find(self, index);
+		if (data)
+			return data;
+
+		workq__store(&worker->is_sleeping, 1);
+
+		/* Anything that was pushed before the flag became visible */
+		data = workq__find(self, index);
+		if (data) {
+			/* A wake-up is on its way if the flag was taken */
+			if (!workq__cas(&worker->is_sleeping, 1, 0))
+				while (sem_wait(&worker->sem) < 0
+				    && errno == EINTR);
+			return data;
+		}
+
+		if (workq__sleep(worker, deadline) < 0) {
+			errno = ETIMEDOUT;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+void* workq_pop(struct workq* self, size_t index)
+{
+	return workq__pop(self, index, NULL);
+}
+
+void* workq_timed_pop(struct workq* self, size_t index, int timeout)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec += 1;
+	}
+
+	return workq__pop(self, index, &deadline);
+}
+
+void workq_stop(struct workq* self)
+{
+	workq__store(&self->is_stopping, 1);
+
+	for (int i = 0; i < WORKQ_MAX_WORKERS; ++i)
+		sem_post(&self->worker[i].sem);
+}
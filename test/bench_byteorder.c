@@ -0,0 +1,147 @@
+/* Compare the byte swapping that byteorder() used to do on big endian hosts,
+ * one byte at a time, against the bswap and vector kernels that it uses now.
+ * The swapping kernels are run whatever the byte order of the host, and
+ * byteorder_array() shows what this host actually pays.
+ *
+ * Usage: bench_byteorder [number of values]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "canopen/byteorder.h"
+#include "time-utils.h"
+
+#define N_VALUES_DEFAULT 16000000ULL
+#define ARRAY_BYTES 4096
+
+static const size_t sizes_[] = { 2, 4, 8 };
+
+static uint8_t src_[ARRAY_BYTES];
+static uint8_t dst_[ARRAY_BYTES];
+static volatile uint8_t sink_;
+
+/* byteorder() as it was on powerpc */
+static void __attribute__((noinline))
+old_byteorder(void* dst, const void* src, size_t size)
+{
+	uint8_t* d = (uint8_t*)dst;
+	uint8_t* s = (uint8_t*)src;
+	int i = (int)size;
+
+	switch(size)
+	{
+	case 8: d[i - 1] = s[size - i]; --i;
+		d[i - 1] = s[size - i]; --i;
+		d[i - 1] = s[size - i]; --i;
+		d[i - 1] = s[size - i]; --i;
+		/* fall through */
+	case 4: d[i - 1] = s[size - i]; --i;
+		d[i - 1] = s[size - i]; --i;
+		/* fall through */
+	case 2: d[i - 1] = s[size - i]; --i;
+		/* fall through */
+	case 1: d[i - 1] = s[size - i];
+		/* fall through */
+	case 0: break;
+	default:
+		abort();
+	}
+}
+
+static uint64_t run_old_values(size_t size, uint64_t n)
+{
+	size_t n_per_array = ARRAY_BYTES / size;
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; ++i) {
+		size_t offset = (i % n_per_array) * size;
+		old_byteorder(dst_ + offset, src_ + offset, size);
+	}
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+	sink_ = dst_[0];
+	return t1 - t0;
+}
+
+static uint64_t run_new_values(size_t size, uint64_t n)
+{
+	size_t n_per_array = ARRAY_BYTES / size;
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; ++i) {
+		size_t offset = (i % n_per_array) * size;
+		byteorder__swap_array(dst_ + offset, src_ + offset, size, 1);
+	}
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+	sink_ = dst_[0];
+	return t1 - t0;
+}
+
+static uint64_t run_old_array(size_t size, uint64_t n)
+{
+	size_t n_per_array = ARRAY_BYTES / size;
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; i += n_per_array)
+		for (size_t j = 0; j < n_per_array; ++j)
+			old_byteorder(dst_ + j * size, src_ + j * size, size);
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+	sink_ = dst_[0];
+	return t1 - t0;
+}
+
+static uint64_t run_array(void (*fn)(void*, const void*, size_t, size_t),
+			  size_t size, uint64_t n)
+{
+	size_t n_per_array = ARRAY_BYTES / size;
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; i += n_per_array)
+		fn(dst_, src_, size, n_per_array);
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+	sink_ = dst_[0];
+	return t1 - t0;
+}
+
+static void report(const char* name, uint64_t n, uint64_t ns)
+{
+	printf("  %-22s %8.3f ns per value\n", name, ns / (double)n);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : N_VALUES_DEFAULT;
+
+	srand(42);
+	for (size_t i = 0; i < ARRAY_BYTES; ++i)
+		src_[i] = rand();
+
+	printf("This host is %s endian\n",
+	       __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ ? "big" : "little");
+
+	for (size_t i = 0; i < sizeof(sizes_) / sizeof(sizes_[0]); ++i) {
+		size_t size = sizes_[i];
+
+		printf("%zu bytes:\n", size);
+		report("byte loop", n, run_old_values(size, n));
+		report("bswap", n, run_new_values(size, n));
+		report("byte loop, array", n, run_old_array(size, n));
+		report("swap array", n,
+		       run_array(byteorder__swap_array, size, n));
+		report("byteorder_array", n,
+		       run_array(byteorder_array, size, n));
+	}
+
+	return 0;
+}
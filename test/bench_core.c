@@ -0,0 +1,596 @@
+/* Time the core containers and parsers: prioq, vector, the ini parser, the EDS
+ * database and the HTTP parser.
+ *
+ * The number of operations per run is doubled until a run takes at least
+ * RUN_TIME_MIN, and that also serves as warm-up. A few more runs are thrown
+ * away and then each benchmark is run a number of times, from which the
+ * minimum, median, mean and maximum time per operation are reported.
+ *
+ * Unless a directory of EDS files is given, N_EDS_FILES made-up ones are
+ * written to a temporary directory.
+ *
+ * Usage: bench_core [-e EDS directory] [-r runs] [-w warm-up runs] [name]
+ *
+ * Only the benchmarks whose names start with the given name are run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "prioq.h"
+#include "vector.h"
+#include "ini_parser.h"
+#include "http.h"
+#include "canopen/eds.h"
+#include "time-utils.h"
+
+#define RUN_TIME_MIN 20000000ULL /* ns */
+#define N_RUNS_DEFAULT 15
+#define N_WARMUPS_DEFAULT 3
+#define MAX_RUNS 1000
+
+#define N_EDS_FILES 1000
+#define N_MFR_OBJECTS 200
+#define N_RANDOM 65536
+
+#define PRIOQ_SIZE 1024
+#define PRIOQ_N_THREADS 4
+
+struct bench {
+	const char* name;
+	int (*setup)(void);
+	void (*run)(uint64_t n);
+	void (*teardown)(void);
+};
+
+struct eds_file {
+	char* data;
+	size_t size;
+};
+
+static const char* eds_dir_ = NULL;
+static char tmp_dir_[] = "/tmp/bench_core-XXXXXX";
+static char cache_path_[sizeof(tmp_dir_) + 16];
+
+static struct eds_file* eds_files_;
+static size_t n_eds_files_;
+static char* scratch_;
+static size_t scratch_size_;
+
+static uint32_t random_[N_RANDOM];
+static volatile uintptr_t sink_;
+
+static struct prioq prioq_;
+
+static const char http_head_[] =
+	"GET /sdo/12/6041/0?type=UNSIGNED16&cache=100 HTTP/1.1\r\n"
+	"Host: localhost:9191\r\n"
+	"User-Agent: curl/7.88.1\r\n"
+	"Accept: application/json\r\n"
+	"If-None-Match: \"3f2a\"\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+static const struct canopen_eds** eds_keys_;
+static size_t n_eds_keys_;
+static const struct canopen_eds* big_eds_;
+
+/* prioq */
+
+static int prioq_setup(void)
+{
+	if (prioq_init(&prioq_, PRIOQ_SIZE) < 0)
+		return -1;
+
+	for (size_t i = 0; i < PRIOQ_SIZE; ++i)
+		prioq_insert(&prioq_, random_[i % N_RANDOM] % 1000, NULL);
+
+	return 0;
+}
+
+static void prioq_teardown(void)
+{
+	prioq_destroy(&prioq_);
+}
+
+static void prioq_pop_insert(uint64_t n, uint64_t offset)
+{
+	struct prioq_elem elem;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (prioq_pop(&prioq_, &elem, 0) < 0)
+			continue;
+
+		sink_ = (uintptr_t)elem.data;
+		prioq_insert(&prioq_, random_[(offset + i) % N_RANDOM] % 1000,
+			     elem.data);
+	}
+}
+
+static void prioq_run(uint64_t n)
+{
+	prioq_pop_insert(n, 0);
+}
+
+struct prioq_thread {
+	pthread_t thread;
+	uint64_t n, offset;
+};
+
+static void* prioq_thread_main(void* context)
+{
+	struct prioq_thread* t = context;
+	prioq_pop_insert(t->n, t->offset);
+	return NULL;
+}
+
+/* The threads share the queue and the time is per pop and insert */
+static void prioq_contended_run(uint64_t n)
+{
+	struct prioq_thread threads[PRIOQ_N_THREADS];
+
+	for (int i = 0; i < PRIOQ_N_THREADS; ++i) {
+		threads[i].n = n / PRIOQ_N_THREADS;
+		threads[i].offset = i * (N_RANDOM / PRIOQ_N_THREADS);
+		pthread_create(&threads[i].thread, NULL, prioq_thread_main,
+			       &threads[i]);
+	}
+
+	for (int i = 0; i < PRIOQ_N_THREADS; ++i)
+		pthread_join(threads[i].thread, NULL);
+}
+
+/* vector */
+
+/* Each vector starts small and grows to 64 KiB */
+static void vector_run(uint64_t n, size_t item_size)
+{
+	static const char item[256];
+	const size_t n_items = 65536 / item_size;
+	struct vector vector;
+
+	for (uint64_t i = 0; i < n; i += n_items) {
+		if (vector_init(&vector, 16) < 0)
+			return;
+
+		for (size_t j = 0; j < n_items; ++j)
+			vector_append(&vector, item, item_size);
+
+		sink_ = (uintptr_t)vector.data;
+		vector_destroy(&vector);
+	}
+}
+
+static void vector_8_run(uint64_t n)
+{
+	vector_run(n, 8);
+}
+
+static void vector_256_run(uint64_t n)
+{
+	vector_run(n, 256);
+}
+
+/* ini parser */
+
+/* ini_parse_buffer() modifies the buffer, so each file is copied into the
+ * scratch buffer first. That is included in the time.
+ */
+static void ini_run(uint64_t n)
+{
+	struct ini_file ini;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		const struct eds_file* file = &eds_files_[i % n_eds_files_];
+
+		memcpy(scratch_, file->data, file->size);
+		if (ini_parse_buffer(&ini, scratch_, file->size) < 0)
+			continue;
+
+		sink_ = ini_get_length(&ini);
+		ini_destroy(&ini);
+	}
+}
+
+/* EDS database */
+
+static void eds_load_cold_run(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		unlink(cache_path_);
+		eds_db_load();
+		sink_ = eds_db_length();
+		eds_db_unload();
+	}
+}
+
+static int eds_load_cached_setup(void)
+{
+	unlink(cache_path_);
+	if (eds_db_load() < 0)
+		return -1;
+
+	eds_db_unload();
+	return 0;
+}
+
+static void eds_load_cached_run(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		eds_db_load();
+		sink_ = eds_db_length();
+		eds_db_unload();
+	}
+}
+
+static int eds_find_setup(void)
+{
+	if (eds_db_load() < 0 || eds_db_length() == 0)
+		return -1;
+
+	n_eds_keys_ = eds_db_length();
+	eds_keys_ = malloc(n_eds_keys_ * sizeof(*eds_keys_));
+	if (!eds_keys_) {
+		eds_db_unload();
+		return -1;
+	}
+
+	for (size_t i = 0; i < n_eds_keys_; ++i) {
+		eds_keys_[i] = eds_db_get(i);
+
+		if (!big_eds_ || eds_keys_[i]->n_objs > big_eds_->n_objs)
+			big_eds_ = eds_keys_[i];
+	}
+
+	return 0;
+}
+
+static void eds_find_teardown(void)
+{
+	free(eds_keys_);
+	eds_keys_ = NULL;
+	big_eds_ = NULL;
+	eds_db_unload();
+}
+
+/* One in eight lookups is for a revision that does not exist */
+static void eds_find_run(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ++i) {
+		uint32_t r = random_[i % N_RANDOM];
+		const struct canopen_eds* eds = eds_keys_[r % n_eds_keys_];
+		int revision = (r >> 24) % 8 == 0 ? 0x7fffffff
+						  : (int)eds->revision;
+
+		sink_ = (uintptr_t)eds_db_find(eds->vendor, eds->product,
+					       revision);
+	}
+}
+
+/* Objects of the largest EDS, and some that it does not have */
+static void eds_obj_find_run(uint64_t n)
+{
+	const struct eds_obj* objs = big_eds_->objs;
+	size_t n_objs = big_eds_->n_objs;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		uint32_t r = random_[i % N_RANDOM];
+		uint32_t key = (r >> 24) % 8 == 0 ? 0x5fff00 | (r & 0xff)
+						  : objs[r % n_objs].key;
+
+		sink_ = (uintptr_t)eds_obj_find(big_eds_, key >> 8, key & 0xff);
+	}
+}
+
+/* HTTP parser */
+
+static void http_run(uint64_t n)
+{
+	struct http_req req;
+
+	for (uint64_t i = 0; i < n; ++i) {
+		if (http_req_parse(&req, http_head_) < 0)
+			continue;
+
+		sink_ = req.header_length;
+		http_req_free(&req);
+	}
+}
+
+static const struct bench benches_[] = {
+	{ "prioq/pop-insert", prioq_setup, prioq_run, prioq_teardown },
+	{ "prioq/pop-insert-4-threads", prioq_setup, prioq_contended_run,
+	  prioq_teardown },
+	{ "vector/append-8", NULL, vector_8_run, NULL },
+	{ "vector/append-256", NULL, vector_256_run, NULL },
+	{ "ini/parse-eds", NULL, ini_run, NULL },
+	{ "eds/load-cold", NULL, eds_load_cold_run, NULL },
+	{ "eds/load-cached", eds_load_cached_setup, eds_load_cached_run,
+	  NULL },
+	{ "eds/db-find", eds_find_setup, eds_find_run, eds_find_teardown },
+	{ "eds/obj-find", eds_find_setup, eds_obj_find_run,
+	  eds_find_teardown },
+	{ "http/req-parse", NULL, http_run, NULL },
+};
+
+static uint64_t time_run(const struct bench* bench, uint64_t n)
+{
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+	bench->run(n);
+	return gettime_ns(CLOCK_MONOTONIC) - t0;
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int run_bench(const struct bench* bench, int n_runs, int n_warmups)
+{
+	double ns_per_op[MAX_RUNS];
+
+	if (bench->setup && bench->setup() < 0) {
+		fprintf(stderr, "Could not set up %s\n", bench->name);
+		return -1;
+	}
+
+	uint64_t n = 1;
+	while (time_run(bench, n) < RUN_TIME_MIN)
+		n *= 2;
+
+	for (int i = 0; i < n_warmups; ++i)
+		time_run(bench, n);
+
+	double sum = 0.0;
+	for (int i = 0; i < n_runs; ++i) {
+		ns_per_op[i] = time_run(bench, n) / (double)n;
+		sum += ns_per_op[i];
+	}
+
+	if (bench->teardown)
+		bench->teardown();
+
+	qsort(ns_per_op, n_runs, sizeof(ns_per_op[0]), compare_doubles);
+
+	printf("%-28s %12.1f %12.1f %12.1f %12.1f %12llu\n", bench->name,
+	       ns_per_op[0], ns_per_op[n_runs / 2], sum / n_runs,
+	       ns_per_op[n_runs - 1], (unsigned long long)n);
+	fflush(stdout);
+	return 0;
+}
+
+/* A device with the mandatory objects, four PDOs of each kind and a block of
+ * manufacturer specific objects, which is what a typical EDS looks like to
+ * the parser.
+ */
+static void write_object(FILE* f, int index, int subindex, const char* name,
+			 int type)
+{
+	if (subindex < 0)
+		fprintf(f, "[%X]\n", index);
+	else
+		fprintf(f, "[%Xsub%X]\n", index, subindex);
+
+	fprintf(f, "ParameterName=%s\n"
+		   "ObjectType=0x7\n"
+		   "DataType=0x%04X\n"
+		   "AccessType=rw\n"
+		   "DefaultValue=0\n"
+		   "PDOMapping=0\n\n",
+		name, type);
+}
+
+static int write_eds(const char* path, int n)
+{
+	FILE* f = fopen(path, "w");
+	if (!f)
+		return -1;
+
+	fprintf(f, "[FileInfo]\n"
+		   "FileName=device%d.eds\n"
+		   "FileVersion=1\n"
+		   "Description=Made up by bench_core\n\n"
+		   "[DeviceInfo]\n"
+		   "VendorName=Bench\n"
+		   "VendorNumber=0x%X\n"
+		   "ProductName=Device %d\n"
+		   "ProductNumber=0x%X\n"
+		   "RevisionNumber=0x%X\n\n",
+		n, 0x100 + n % 50, n, 0x1000 + n / 10, n % 10);
+
+	write_object(f, 0x1000, -1, "Device type", 7);
+	write_object(f, 0x1001, -1, "Error register", 5);
+	write_object(f, 0x1017, -1, "Producer heartbeat time", 6);
+
+	for (int sub = 0; sub <= 4; ++sub)
+		write_object(f, 0x1018, sub, "Identity", 7);
+
+	for (int pdo = 0; pdo < 4; ++pdo)
+		for (int base = 0x1400; base <= 0x1A00; base += 0x200)
+			for (int sub = 0; sub <= 8; ++sub)
+				write_object(f, base + pdo, sub, "PDO", 7);
+
+	for (int i = 0; i < N_MFR_OBJECTS; ++i)
+		write_object(f, 0x2000 + i, 0, "Manufacturer value", 7);
+
+	return fclose(f);
+}
+
+static int make_eds_files(void)
+{
+	char path[sizeof(tmp_dir_) + 32];
+
+	if (!mkdtemp(tmp_dir_))
+		return -1;
+
+	for (int i = 0; i < N_EDS_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/device%d.eds", tmp_dir_, i);
+		if (write_eds(path, i) < 0)
+			return -1;
+	}
+
+	eds_dir_ = tmp_dir_;
+	return 0;
+}
+
+static void remove_eds_files(void)
+{
+	char path[sizeof(tmp_dir_) + 32];
+
+	for (int i = 0; i < N_EDS_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/device%d.eds", tmp_dir_, i);
+		unlink(path);
+	}
+
+	unlink(cache_path_);
+	rmdir(tmp_dir_);
+}
+
+static int read_file(struct eds_file* file, const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	struct stat st;
+	if (fstat(fileno(f), &st) < 0 || st.st_size == 0)
+		goto failure;
+
+	file->size = st.st_size;
+	file->data = malloc(file->size);
+	if (!file->data)
+		goto failure;
+
+	if (fread(file->data, 1, file->size, f) != file->size) {
+		free(file->data);
+		goto failure;
+	}
+
+	fclose(f);
+	return 0;
+
+failure:
+	fclose(f);
+	return -1;
+}
+
+/* The ini parser is run on the files in memory */
+static int read_eds_files(const char* dir_path)
+{
+	char path[4096];
+
+	DIR* dir = opendir(dir_path);
+	if (!dir)
+		return -1;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		const char* ext = strrchr(entry->d_name, '.');
+		if (!ext || strcasecmp(ext, ".eds") != 0)
+			continue;
+
+		void* files = realloc(eds_files_,
+				      (n_eds_files_ + 1) * sizeof(*eds_files_));
+		if (!files)
+			break;
+		eds_files_ = files;
+
+		snprintf(path, sizeof(path), "%s/%s", dir_path, entry->d_name);
+		if (read_file(&eds_files_[n_eds_files_], path) < 0)
+			continue;
+
+		if (eds_files_[n_eds_files_].size > scratch_size_)
+			scratch_size_ = eds_files_[n_eds_files_].size;
+
+		++n_eds_files_;
+	}
+
+	closedir(dir);
+
+	scratch_ = malloc(scratch_size_);
+	return n_eds_files_ > 0 && scratch_ ? 0 : -1;
+}
+
+static void free_eds_files(void)
+{
+	for (size_t i = 0; i < n_eds_files_; ++i)
+		free(eds_files_[i].data);
+
+	free(eds_files_);
+	free(scratch_);
+}
+
+int main(int argc, char* argv[])
+{
+	int n_runs = N_RUNS_DEFAULT;
+	int n_warmups = N_WARMUPS_DEFAULT;
+	int rc = 0;
+
+	while (1) {
+		int c = getopt(argc, argv, "e:r:w:");
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'e': eds_dir_ = optarg; break;
+		case 'r': n_runs = atoi(optarg); break;
+		case 'w': n_warmups = atoi(optarg); break;
+		default:
+			fprintf(stderr, "Usage: %s [-e EDS directory] [-r runs] [-w warm-up runs] [name]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (n_runs < 1 || n_runs > MAX_RUNS || n_warmups < 0) {
+		fprintf(stderr, "The number of runs must be 1-%d\n", MAX_RUNS);
+		return 1;
+	}
+
+	const char* filter = optind < argc ? argv[optind] : "";
+
+	srand(42);
+	for (size_t i = 0; i < N_RANDOM; ++i)
+		random_[i] = ((uint32_t)rand() << 16) ^ (uint32_t)rand();
+
+	int is_made_up = !eds_dir_;
+	if (is_made_up && make_eds_files() < 0) {
+		perror("Could not write EDS files");
+		return 1;
+	}
+
+	snprintf(cache_path_, sizeof(cache_path_), "%s.cache",
+		 is_made_up ? tmp_dir_ : "/tmp/bench_core");
+	eds_db_set_paths(eds_dir_, cache_path_);
+
+	if (read_eds_files(eds_dir_) < 0) {
+		fprintf(stderr, "Could not read EDS files from %s\n", eds_dir_);
+		rc = 1;
+		goto done;
+	}
+
+	printf("%-28s %12s %12s %12s %12s %12s\n", "ns per operation", "min",
+	       "median", "mean", "max", "ops per run");
+
+	for (size_t i = 0; i < sizeof(benches_) / sizeof(benches_[0]); ++i)
+		if (strncmp(benches_[i].name, filter, strlen(filter)) == 0
+		 && run_bench(&benches_[i], n_runs, n_warmups) < 0)
+			rc = 1;
+
+done:
+	free_eds_files();
+	if (is_made_up)
+		remove_eds_files();
+	else
+		unlink(cache_path_);
+	return rc;
+}
@@ -0,0 +1,235 @@
+/* Compare frame dispatch through cob_table against classifying each frame with
+ * canopen_get_object_type() and switching on the result, which is what the
+ * master used to do.
+ *
+ * Usage: bench_dispatch [number of frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <linux/can.h>
+
+#include "canopen.h"
+#include "canopen/cob_table.h"
+#include "time-utils.h"
+
+#define N_NODES 127
+#define N_FRAMES_DEFAULT 100000000ULL
+#define FRAME_MIX_LENGTH 4096
+
+struct node {
+	int is_initialized;
+	int has_driver;
+	void (*pdo_fn[4])(struct node*, const void*, size_t);
+	uint64_t count;
+};
+
+static struct node nodes_[N_NODES + 1];
+static struct can_frame frames_[FRAME_MIX_LENGTH];
+static struct cob_table table_;
+static volatile uint64_t sink_;
+
+/* Driver callbacks live in shared objects, so keep the compiler from seeing
+ * through them.
+ */
+__attribute__((noinline))
+static void on_pdo(struct node* node, const void* data, size_t size)
+{
+	(void)data;
+	node->count += size;
+}
+
+__attribute__((noinline))
+static void on_other(struct node* node, const struct can_frame* cf)
+{
+	node->count += cf->can_dlc;
+}
+
+static void reference_dispatch(const struct can_frame* cf)
+{
+	struct canopen_msg msg;
+
+	if (cf->can_id & (CAN_RTR_FLAG | CAN_EFF_FLAG | CAN_ERR_FLAG))
+		return;
+
+	if (canopen_get_object_type(&msg, cf) < 0)
+		return;
+
+	if (msg.object == CANOPEN_NMT)
+		return;
+
+	if (!(1 <= msg.id && msg.id <= N_NODES))
+		return;
+
+	struct node* node = &nodes_[msg.id];
+
+	if (!node->is_initialized || !node->has_driver) {
+		switch (msg.object) {
+		case CANOPEN_EMCY:
+		case CANOPEN_HEARTBEAT:
+		case CANOPEN_TSDO:
+			on_other(node, cf);
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	switch (msg.object) {
+	case CANOPEN_TPDO1:
+		if (node->pdo_fn[0])
+			node->pdo_fn[0](node, cf->data, cf->can_dlc);
+		break;
+	case CANOPEN_TPDO2:
+		if (node->pdo_fn[1])
+			node->pdo_fn[1](node, cf->data, cf->can_dlc);
+		break;
+	case CANOPEN_TPDO3:
+		if (node->pdo_fn[2])
+			node->pdo_fn[2](node, cf->data, cf->can_dlc);
+		break;
+	case CANOPEN_TPDO4:
+		if (node->pdo_fn[3])
+			node->pdo_fn[3](node, cf->data, cf->can_dlc);
+		break;
+	case CANOPEN_TSDO:
+	case CANOPEN_EMCY:
+	case CANOPEN_HEARTBEAT:
+		on_other(node, cf);
+		break;
+	default:
+		break;
+	}
+}
+
+#define TABLE_PDO_FN(n) \
+static void table_on_tpdo##n(void* context, const struct can_frame* cf, \
+			     uint64_t timestamp) \
+{ \
+	(void)timestamp; \
+	struct node* node = context; \
+	node->pdo_fn[n - 1](node, cf->data, cf->can_dlc); \
+}
+
+TABLE_PDO_FN(1)
+TABLE_PDO_FN(2)
+TABLE_PDO_FN(3)
+TABLE_PDO_FN(4)
+
+static void table_on_other(void* context, const struct can_frame* cf,
+			   uint64_t timestamp)
+{
+	(void)timestamp;
+	on_other(context, cf);
+}
+
+static void bind(int cob, cob_table_fn fn, void* context)
+{
+	cob_table_set_context(&table_, cob, context);
+	cob_table_set_fn(&table_, cob, fn);
+}
+
+static void init_nodes(void)
+{
+	cob_table_init(&table_);
+
+	for (int i = 1; i <= N_NODES; ++i) {
+		struct node* node = &nodes_[i];
+
+		/* Every fourth node has no driver */
+		node->is_initialized = 1;
+		node->has_driver = i % 4 != 0;
+
+		bind(R_EMCY + i, table_on_other, node);
+		bind(R_TSDO + i, table_on_other, node);
+		bind(R_HEARTBEAT + i, table_on_other, node);
+
+		if (!node->has_driver)
+			continue;
+
+		for (int j = 0; j < 4; ++j)
+			node->pdo_fn[j] = on_pdo;
+
+		bind(R_TPDO1 + i, table_on_tpdo1, node);
+		bind(R_TPDO2 + i, table_on_tpdo2, node);
+		bind(R_TPDO3 + i, table_on_tpdo3, node);
+		bind(R_TPDO4 + i, table_on_tpdo4, node);
+	}
+}
+
+/* Mostly TPDOs with some heartbeats, SDO responses and SYNC */
+static void init_frames(void)
+{
+	static const int cobs[] = {
+		R_TPDO1, R_TPDO1, R_TPDO2, R_TPDO2, R_TPDO3, R_TPDO4,
+		R_HEARTBEAT, R_TSDO, R_SYNC, R_RPDO1,
+	};
+
+	srand(42);
+
+	for (int i = 0; i < FRAME_MIX_LENGTH; ++i) {
+		struct can_frame* cf = &frames_[i];
+		int cob = cobs[rand() % (sizeof(cobs) / sizeof(cobs[0]))];
+
+		memset(cf, 0, sizeof(*cf));
+		cf->can_id = cob == R_SYNC ? cob : cob + 1 + rand() % N_NODES;
+		cf->can_dlc = cob == R_HEARTBEAT ? 1 : 8;
+	}
+}
+
+static uint64_t sum_counts(void)
+{
+	uint64_t sum = 0;
+	for (int i = 1; i <= N_NODES; ++i) {
+		sum += nodes_[i].count;
+		nodes_[i].count = 0;
+	}
+	return sum;
+}
+
+static void report(const char* name, uint64_t n, uint64_t t0, uint64_t t1)
+{
+	double seconds = (t1 - t0) / 1e9;
+	printf("%-10s %12.0f frames/s  %6.2f ns/frame\n", name, n / seconds,
+	       (t1 - t0) / (double)n);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : N_FRAMES_DEFAULT;
+
+	init_nodes();
+	init_frames();
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+	for (uint64_t i = 0; i < n; ++i)
+		reference_dispatch(&frames_[i & (FRAME_MIX_LENGTH - 1)]);
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+
+	uint64_t reference_sum = sum_counts();
+	report("reference", n, t0, t1);
+
+	t0 = gettime_ns(CLOCK_MONOTONIC);
+	for (uint64_t i = 0; i < n; ++i)
+		cob_table_dispatch(&table_, &frames_[i & (FRAME_MIX_LENGTH - 1)],
+				   0);
+	t1 = gettime_ns(CLOCK_MONOTONIC);
+
+	uint64_t table_sum = sum_counts();
+	report("cob_table", n, t0, t1);
+
+	sink_ = reference_sum + table_sum;
+
+	if (reference_sum != table_sum) {
+		fprintf(stderr, "Results differ: %llu != %llu\n",
+			(unsigned long long)reference_sum,
+			(unsigned long long)table_sum);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,576 @@
+/* End-to-end benchmark of canopen-master on a virtual CAN bus. Virtual nodes
+ * are run in one child process and the master in another. The nodes send
+ * TPDOs at a fixed rate while SDO uploads are made through the REST service.
+ * The results are written to stdout as one JSON object, for tracking them
+ * from release to release:
+ *
+ *	bootup_s		From starting the master until it has started
+ *				every node, or null if it did not within
+ *				BOOTUP_TIMEOUT
+ *	frames_per_s		Frames that the master counted per second
+ *	offered_frames_per_s	Frames that the nodes sent per second
+ *	pdo_latency_us		Percentiles of the time from the kernel receiving
+ *				a TPDO until the master has dispatched it and
+ *				published it in its shared memory ring. This
+ *				includes the time it takes this program to wake
+ *				up, which is the same from run to run.
+ *	sdo_per_s		SDO uploads per second through REST
+ *	cpu_us_per_frame	CPU time that the master used per frame counted
+ *
+ * A vcan interface is needed:
+ *
+ *	# ip link add dev vcan0 type vcan && ip link set vcan0 up
+ *
+ * Usage: bench_master [-i interface] [-m canopen-master] [-n nodes]
+ *		       [-p PDO period in us] [-c SDO clients] [-d seconds]
+ *		       [-R REST port]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/can.h>
+#include <mloop.h>
+
+#include "canopen.h"
+#include "canopen/nmt.h"
+#include "co_atomic.h"
+#include "shm-ring.h"
+#include "sock.h"
+#include "time-utils.h"
+#include "vector.h"
+#include "vnode.h"
+
+#define BOOTUP_TIMEOUT 30000000ULL /* us */
+#define SETTLE_TIME 1000000ULL /* us */
+#define SHM_RING_LENGTH "65536"
+#define LATENCY_MAX_SAMPLES (1 << 22)
+#define RECV_BATCH_SIZE 64
+#define MAX_SDO_CLIENTS 256
+
+struct bench_config {
+	const char* iface;
+	const char* master;
+	int n_nodes;
+	unsigned int pdo_period;
+	int n_sdo_clients;
+	unsigned int duration;
+	int port;
+};
+
+static struct bench_config config_ = {
+	.iface = "vcan0",
+	.master = "canopen-master",
+	.n_nodes = 127,
+	.pdo_period = 1000,
+	.n_sdo_clients = 4,
+	.duration = 10,
+	.port = 9191,
+};
+
+static volatile int is_measuring_ = 0;
+static volatile int is_stopping_ = 0;
+
+static uint32_t* latencies_;
+static size_t n_latencies_ = 0;
+static uint64_t n_sdos_ = 0;
+
+static int write_vnode_config(char* path)
+{
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	FILE* stream = fdopen(fd, "w");
+	if (!stream) {
+		close(fd);
+		return -1;
+	}
+
+	fprintf(stream,
+		"[device]\n"
+		"node_guarding=no\n"
+		"heartbeat=yes\n"
+		"bootup=standard\n"
+		"\n"
+		"[1000sub0]\n"
+		"type=UNSIGNED32\n"
+		"value=0x20192\n"
+		"\n"
+		"[1008sub0]\n"
+		"type=VISIBLE_STRING\n"
+		"value=BENCH\n"
+		"\n"
+		"[tpdo1]\n"
+		"period=%u\n"
+		"size=8\n"
+		"pattern=counter\n",
+		config_.pdo_period);
+
+	return fclose(stream);
+}
+
+static pid_t start_vnodes(const char* config_path)
+{
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	for (int i = 1; i <= config_.n_nodes; ++i)
+		if (!co_vnode_new(SOCK_TYPE_CAN, config_.iface, config_path, i))
+			_exit(1);
+
+	mloop_run(mloop_default());
+	_exit(0);
+}
+
+/* The master keeps stdout to itself, so that ours only has the results */
+static pid_t start_master(void)
+{
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	int null = open("/dev/null", O_WRONLY);
+	if (null >= 0)
+		dup2(null, STDOUT_FILENO);
+
+	char port[16];
+	snprintf(port, sizeof(port), "%d", config_.port);
+
+	execlp(config_.master, config_.master, config_.iface, "-R", port,
+	       "-M", SHM_RING_LENGTH, (char*)NULL);
+	perror("Could not run the master");
+	_exit(1);
+}
+
+static void stop_child(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+/* In us */
+static uint64_t get_cpu_time(pid_t pid)
+{
+	char path[64];
+	unsigned long long utime = 0, stime = 0;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+
+	FILE* stream = fopen(path, "r");
+	if (!stream)
+		return 0;
+
+	/* The name of the command may have spaces in it */
+	char line[1024];
+	if (fgets(line, sizeof(line), stream)) {
+		const char* p = strrchr(line, ')');
+		if (p)
+			sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+			       &utime, &stime);
+	}
+
+	fclose(stream);
+	return (utime + stime) * 1000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+/* Returns the HTTP status code, and the reply in buffer if it is not NULL */
+static int http_get(const char* path, struct vector* buffer)
+{
+	char chunk[4096];
+	int status = -1;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(config_.port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		goto done;
+
+	int n = snprintf(chunk, sizeof(chunk),
+			 "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n",
+			 path);
+	if (write(fd, chunk, n) != n)
+		goto done;
+
+	if (buffer)
+		buffer->index = 0;
+
+	int is_first = 1;
+	ssize_t size;
+	while ((size = read(fd, chunk, sizeof(chunk) - 1)) > 0) {
+		if (is_first) {
+			chunk[size] = '\0';
+			sscanf(chunk, "HTTP/1.%*d %d", &status);
+			is_first = 0;
+		}
+
+		if (buffer && vector_append(buffer, chunk, size) < 0)
+			break;
+	}
+
+	if (buffer)
+		vector_append(buffer, "", 1);
+
+done:
+	close(fd);
+	return status;
+}
+
+/* The sum of what the master has counted for each node, or -1 */
+static int64_t get_frame_count(void)
+{
+	struct vector buffer;
+	int64_t sum = 0;
+
+	if (vector_init(&buffer, 65536) < 0)
+		return -1;
+
+	if (http_get("/stats", &buffer) != 200) {
+		vector_destroy(&buffer);
+		return -1;
+	}
+
+	const char* key = "\"frames\":";
+	for (const char* p = strstr(buffer.data, key); p;
+	     p = strstr(p, key)) {
+		p += strlen(key);
+		sum += strtoll(p, NULL, 10);
+	}
+
+	vector_destroy(&buffer);
+	return sum;
+}
+
+static void* run_sdo_client(void* context)
+{
+	int n = (int)(intptr_t)context;
+	char path[64];
+
+	while (!is_stopping_) {
+		int nodeid = n % config_.n_nodes + 1;
+		n += config_.n_sdo_clients;
+
+		snprintf(path, sizeof(path), "/sdo/%d/1000/0?type=UNSIGNED32",
+			 nodeid);
+
+		if (http_get(path, NULL) == 200 && is_measuring_)
+			co_atomic_add_fetch(&n_sdos_, 1);
+	}
+
+	return NULL;
+}
+
+static int is_tpdo(uint32_t can_id)
+{
+	uint32_t cob = can_id & CAN_SFF_MASK;
+
+	if (can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG))
+		return 0;
+
+	return (TPDO1_LOW <= cob && cob <= TPDO1_HIGH)
+	    || (TPDO2_LOW <= cob && cob <= TPDO2_HIGH)
+	    || (TPDO3_LOW <= cob && cob <= TPDO3_HIGH)
+	    || (TPDO4_LOW <= cob && cob <= TPDO4_HIGH);
+}
+
+static void* run_latency_probe(void* context)
+{
+	(void)context;
+
+	struct shm_ring ring;
+	struct can_frame cfs[RECV_BATCH_SIZE];
+	uint64_t timestamps[RECV_BATCH_SIZE];
+	char name[256];
+
+	shm_ring_make_name(name, sizeof(name), config_.iface);
+
+	while (shm_ring_open(&ring, name) < 0) {
+		if (is_stopping_)
+			return NULL;
+		usleep(10000);
+	}
+
+	while (!is_stopping_) {
+		if (shm_ring_wait(&ring, 100) <= 0)
+			continue;
+
+		size_t n = shm_ring_read(&ring, cfs, timestamps,
+					 RECV_BATCH_SIZE);
+		uint64_t now = gettime_us(CLOCK_REALTIME);
+
+		if (!is_measuring_)
+			continue;
+
+		for (size_t i = 0; i < n; ++i) {
+			if (!is_tpdo(cfs[i].can_id))
+				continue;
+
+			if (n_latencies_ >= LATENCY_MAX_SAMPLES)
+				break;
+
+			uint64_t latency = now > timestamps[i]
+					 ? now - timestamps[i] : 0;
+			latencies_[n_latencies_++] = latency > UINT32_MAX
+						   ? UINT32_MAX : latency;
+		}
+	}
+
+	shm_ring_destroy(&ring);
+	return NULL;
+}
+
+/* Returns the time at which the last node was started, or 0 */
+static uint64_t wait_for_bootup(struct sock* sock, uint64_t start)
+{
+	struct can_frame cfs[RECV_BATCH_SIZE];
+	char is_started[CANOPEN_NODEID_MAX + 1] = { 0 };
+	int n_started = 0;
+
+	while (gettime_us(CLOCK_MONOTONIC) < start + BOOTUP_TIMEOUT) {
+		if (sock_poll(sock, 100) <= 0)
+			continue;
+
+		ssize_t n = sock_recv_batch(sock, cfs, NULL, RECV_BATCH_SIZE,
+					    MSG_DONTWAIT);
+
+		for (ssize_t i = 0; i < n; ++i) {
+			if (cfs[i].can_id != R_NMT
+			 || nmt_get_cs(&cfs[i]) != NMT_CS_START)
+				continue;
+
+			int nodeid = nmt_get_nodeid(&cfs[i]);
+			for (int j = 1; j <= config_.n_nodes; ++j)
+				if ((nodeid == 0 || nodeid == j)
+				 && !is_started[j]) {
+					is_started[j] = 1;
+					++n_started;
+				}
+		}
+
+		if (n_started == config_.n_nodes)
+			return gettime_us(CLOCK_MONOTONIC);
+	}
+
+	return 0;
+}
+
+/* Everything but NMT, SYNC, SDO requests and node guarding */
+static int is_from_node(uint32_t can_id)
+{
+	uint32_t cob = can_id & CAN_SFF_MASK;
+
+	if (can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG))
+		return 0;
+
+	return cob > R_SYNC && !(RSDO_LOW <= cob && cob <= RSDO_HIGH);
+}
+
+/* Returns the number of frames that the nodes sent before end */
+static uint64_t count_offered_frames(struct sock* sock, uint64_t end)
+{
+	struct can_frame cfs[RECV_BATCH_SIZE];
+	uint64_t count = 0;
+
+	uint64_t now;
+	while ((now = gettime_us(CLOCK_MONOTONIC)) < end) {
+		if (sock_poll(sock, (end - now) / 1000 + 1) <= 0)
+			continue;
+
+		ssize_t n;
+		while ((n = sock_recv_batch(sock, cfs, NULL, RECV_BATCH_SIZE,
+					    MSG_DONTWAIT)) > 0)
+			for (ssize_t i = 0; i < n; ++i)
+				count += is_from_node(cfs[i].can_id);
+	}
+
+	return count;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t get_percentile(double p)
+{
+	if (n_latencies_ == 0)
+		return 0;
+
+	size_t i = (size_t)(p * (n_latencies_ - 1) + 0.5);
+	return latencies_[i];
+}
+
+static void print_results(uint64_t bootup, double elapsed, int64_t n_frames,
+			  uint64_t n_offered, uint64_t cpu)
+{
+	qsort(latencies_, n_latencies_, sizeof(latencies_[0]),
+	      compare_latencies);
+
+	printf("{\"nodes\":%d,\"pdo_period_us\":%u,\"sdo_clients\":%d,\"duration_s\":%.3f,",
+	       config_.n_nodes, config_.pdo_period, config_.n_sdo_clients,
+	       elapsed);
+
+	if (bootup)
+		printf("\"bootup_s\":%.3f,", bootup / 1e6);
+	else
+		printf("\"bootup_s\":null,");
+
+	printf("\"frames_per_s\":%.1f,\"offered_frames_per_s\":%.1f,",
+	       n_frames / elapsed, n_offered / elapsed);
+
+	printf("\"pdo_latency_us\":{\"samples\":%zu,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u},",
+	       n_latencies_, get_percentile(0.5), get_percentile(0.9),
+	       get_percentile(0.99), get_percentile(0.999),
+	       n_latencies_ ? latencies_[n_latencies_ - 1] : 0);
+
+	printf("\"sdo_per_s\":%.1f,\"cpu_us_per_frame\":%.3f}\n",
+	       co_atomic_load(&n_sdos_) / elapsed,
+	       n_frames > 0 ? (double)cpu / n_frames : 0.0);
+}
+
+static int parse_options(int argc, char* argv[])
+{
+	while (1) {
+		int c = getopt(argc, argv, "i:m:n:p:c:d:R:");
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'i': config_.iface = optarg; break;
+		case 'm': config_.master = optarg; break;
+		case 'n': config_.n_nodes = atoi(optarg); break;
+		case 'p': config_.pdo_period = strtoul(optarg, NULL, 0); break;
+		case 'c': config_.n_sdo_clients = atoi(optarg); break;
+		case 'd': config_.duration = strtoul(optarg, NULL, 0); break;
+		case 'R': config_.port = atoi(optarg); break;
+		default: return -1;
+		}
+	}
+
+	if (config_.n_nodes < 1 || config_.n_nodes > CANOPEN_NODEID_MAX) {
+		fprintf(stderr, "The number of nodes must be 1-%d\n",
+			CANOPEN_NODEID_MAX);
+		return -1;
+	}
+
+	if (config_.pdo_period == 0 || config_.duration == 0
+	 || config_.n_sdo_clients < 0
+	 || config_.n_sdo_clients > MAX_SDO_CLIENTS)
+		return -1;
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	char config_path[] = "/tmp/bench_master-XXXXXX";
+	pthread_t probe, clients[MAX_SDO_CLIENTS];
+	struct sock sock;
+	int rc = 1;
+
+	if (parse_options(argc, argv) < 0) {
+		fprintf(stderr, "Usage: %s [-i interface] [-m canopen-master] [-n nodes] [-p PDO period in us] [-c SDO clients] [-d seconds] [-R REST port]\n",
+			argv[0]);
+		return 1;
+	}
+
+	latencies_ = malloc(LATENCY_MAX_SAMPLES * sizeof(latencies_[0]));
+	if (!latencies_)
+		return 1;
+
+	if (sock_open(&sock, SOCK_TYPE_CAN, config_.iface, NULL) < 0) {
+		perror("Could not open the CAN interface");
+		return 1;
+	}
+
+	if (write_vnode_config(config_path) < 0) {
+		perror("Could not write the config of the nodes");
+		goto config_failure;
+	}
+
+	pid_t vnodes = start_vnodes(config_path);
+	if (vnodes < 0)
+		goto vnode_failure;
+
+	/* Let the nodes boot before the master looks for them */
+	usleep(100000);
+
+	uint64_t start = gettime_us(CLOCK_MONOTONIC);
+	pid_t master = start_master();
+	if (master < 0)
+		goto master_failure;
+
+	pthread_create(&probe, NULL, run_latency_probe, NULL);
+
+	uint64_t bootup = wait_for_bootup(&sock, start);
+	if (bootup)
+		bootup -= start;
+	else
+		fprintf(stderr, "Not all nodes were started within %llu s\n",
+			BOOTUP_TIMEOUT / 1000000ULL);
+
+	for (int i = 0; i < config_.n_sdo_clients; ++i)
+		pthread_create(&clients[i], NULL, run_sdo_client,
+			       (void*)(intptr_t)i);
+
+	usleep(SETTLE_TIME);
+
+	int64_t frames_before = get_frame_count();
+	uint64_t cpu_before = get_cpu_time(master);
+	uint64_t measure_start = gettime_us(CLOCK_MONOTONIC);
+	is_measuring_ = 1;
+
+	uint64_t n_offered = count_offered_frames(&sock,
+			measure_start + config_.duration * 1000000ULL);
+
+	is_measuring_ = 0;
+	uint64_t measure_end = gettime_us(CLOCK_MONOTONIC);
+	uint64_t cpu_after = get_cpu_time(master);
+	int64_t frames_after = get_frame_count();
+
+	is_stopping_ = 1;
+	for (int i = 0; i < config_.n_sdo_clients; ++i)
+		pthread_join(clients[i], NULL);
+	pthread_join(probe, NULL);
+
+	if (frames_before < 0 || frames_after < 0) {
+		fprintf(stderr, "Could not get statistics from the master\n");
+	} else {
+		print_results(bootup, (measure_end - measure_start) / 1e6,
+			      frames_after - frames_before, n_offered,
+			      cpu_after - cpu_before);
+		rc = 0;
+	}
+
+	stop_child(master);
+master_failure:
+	stop_child(vnodes);
+vnode_failure:
+	unlink(config_path);
+config_failure:
+	sock_close(&sock);
+	free(latencies_);
+	return rc;
+}
@@ -0,0 +1,295 @@
+/* Measure the cost of handing received TPDOs to drivers, as mux_on_frame()
+ * does it, with the node structures of the master. Between batches, a buffer
+ * is walked to stand in for whatever else the main loop does, so that the
+ * dispatch state has to be brought back into the cache from time to time.
+ *
+ * Cache misses are read from the hardware counters where perf_event_open() is
+ * allowed; otherwise only the time is shown.
+ *
+ * Usage: bench_mux [-n number of frames] [-N nodes] [-p KiB walked per batch]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/can.h>
+#include <linux/perf_event.h>
+
+#include "canopen.h"
+#include "canopen/master.h"
+#include "canopen/cob_table.h"
+#include "node-stats.h"
+#include "cfg.h"
+#include "time-utils.h"
+
+#define N_FRAMES_DEFAULT 20000000ULL
+#define FRAME_MIX_LENGTH 4096
+#define BATCH_SIZE 32
+#define N_RUNS 5
+
+static struct co_bus bus_;
+static struct can_frame frames_[FRAME_MIX_LENGTH];
+static uint64_t timestamps_[FRAME_MIX_LENGTH];
+static uint8_t* pollution_;
+static size_t pollution_size_;
+static volatile uint64_t sink_;
+
+struct counter {
+	const char* name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+};
+
+static struct counter counters_[] = {
+	{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+	{ "L1d-misses", PERF_TYPE_HW_CACHE,
+	  PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8
+	  | PERF_COUNT_HW_CACHE_RESULT_MISS << 16, -1 },
+};
+
+#define N_COUNTERS (sizeof(counters_) / sizeof(counters_[0]))
+
+/* Driver callbacks live in shared objects, so keep the compiler from seeing
+ * through them.
+ */
+__attribute__((noinline))
+static void on_pdo(struct co_drv* drv, const void* data, size_t size)
+{
+	(void)drv;
+	sink_ += size + ((const uint8_t*)data)[0];
+}
+
+static void open_counters(void)
+{
+	for (size_t i = 0; i < N_COUNTERS; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counters_[i].type;
+		attr.config = counters_[i].config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		counters_[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+					  0);
+	}
+}
+
+static void close_counters(void)
+{
+	for (size_t i = 0; i < N_COUNTERS; ++i)
+		if (counters_[i].fd >= 0)
+			close(counters_[i].fd);
+}
+
+static void set_counters(unsigned long request)
+{
+	for (size_t i = 0; i < N_COUNTERS; ++i)
+		if (counters_[i].fd >= 0)
+			ioctl(counters_[i].fd, request, 0);
+}
+
+static int read_counter(uint64_t* dst, const struct counter* counter)
+{
+	return counter->fd >= 0
+	       && read(counter->fd, dst, sizeof(*dst)) == sizeof(*dst) ? 0 : -1;
+}
+
+/* The same as init_mux_table() and a driver that sets all four PDO
+ * callbacks
+ */
+static void init_bus(int n_nodes)
+{
+	cfg_load_defaults();
+
+	/* Reading the clock around each callback would hide the rest */
+	cfg.driver_budget = 0;
+
+	cob_table_init(&bus_.mux_table);
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct co_master_node* node = &bus_.node[i];
+
+		node->bus = &bus_;
+		node->nodeid = i;
+		node->ndrv = &bus_.drv[i];
+		bus_.drv[i].node = node;
+
+		for (int n = 0; n < 4; ++n)
+			cob_table_set_context(&bus_.mux_table,
+					      R_TPDO1 + (n << 8) + i,
+					      node->ndrv);
+
+		if (i > n_nodes)
+			continue;
+
+		node->driver_type = CO_MASTER_DRIVER_NEW;
+		node->is_initialized = 1;
+
+		for (int n = 0; n < 4; ++n)
+			node->ndrv->pdo_fn[n] = on_pdo;
+
+		co__mux_update(node);
+	}
+}
+
+static void init_frames(int n_nodes)
+{
+	static const int cobs[] = { R_TPDO1, R_TPDO2, R_TPDO3, R_TPDO4 };
+
+	srand(42);
+
+	for (int i = 0; i < FRAME_MIX_LENGTH; ++i) {
+		struct can_frame* cf = &frames_[i];
+
+		memset(cf, 0, sizeof(*cf));
+		cf->can_id = cobs[rand() % 4] + 1 + rand() % n_nodes;
+		cf->can_dlc = 8;
+		cf->data[0] = i;
+		timestamps_[i] = i;
+	}
+}
+
+static void pollute(void)
+{
+	for (size_t i = 0; i < pollution_size_; i += 64)
+		++pollution_[i];
+}
+
+static void dispatch(uint64_t i, uint64_t n)
+{
+	for (uint64_t j = i; j < i + n; ++j) {
+		size_t k = j & (FRAME_MIX_LENGTH - 1);
+
+		node_stats_count_frame(bus_.stats, &frames_[k], timestamps_[k]);
+		cob_table_dispatch(&bus_.mux_table, &frames_[k], timestamps_[k]);
+	}
+}
+
+/* Reading the clock may be a system call, so only whole runs are timed. The
+ * counters are read the same way, into counts.
+ */
+static uint64_t run(uint64_t n, int is_polluted, int is_dispatched,
+		    uint64_t* counts)
+{
+	set_counters(PERF_EVENT_IOC_RESET);
+	set_counters(PERF_EVENT_IOC_ENABLE);
+	uint64_t start = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; i += BATCH_SIZE) {
+		if (is_polluted)
+			pollute();
+
+		if (is_dispatched)
+			dispatch(i, n - i < BATCH_SIZE ? n - i : BATCH_SIZE);
+	}
+
+	uint64_t elapsed = gettime_ns(CLOCK_MONOTONIC) - start;
+	set_counters(PERF_EVENT_IOC_DISABLE);
+
+	for (size_t i = 0; i < N_COUNTERS; ++i)
+		if (read_counter(&counts[i], &counters_[i]) < 0)
+			counts[i] = UINT64_MAX;
+
+	return elapsed;
+}
+
+static uint64_t best_run(uint64_t n, int is_dispatched, uint64_t* counts)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < N_RUNS; ++i) {
+		uint64_t run_counts[N_COUNTERS];
+		uint64_t elapsed = run(n, 1, is_dispatched, run_counts);
+
+		if (elapsed < best) {
+			best = elapsed;
+			memcpy(counts, run_counts, sizeof(run_counts));
+		}
+	}
+
+	return best;
+}
+
+static void report(const char* name, uint64_t n, uint64_t elapsed,
+		   const uint64_t* counts)
+{
+	printf("%-8s %8.2f ns/frame", name, elapsed / (double)n);
+
+	for (size_t i = 0; i < N_COUNTERS; ++i)
+		if (counts[i] != UINT64_MAX)
+			printf("  %6.3f %s/frame", (int64_t)counts[i] / (double)n,
+			       counters_[i].name);
+
+	printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t n = N_FRAMES_DEFAULT;
+	int n_nodes = CANOPEN_NODEID_MAX;
+	size_t pollution_kib = 256;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:N:p:")) != -1) {
+		switch (opt) {
+		case 'n': n = strtoull(optarg, NULL, 0); break;
+		case 'N': n_nodes = atoi(optarg); break;
+		case 'p': pollution_kib = strtoul(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "Usage: %s [-n frames] [-N nodes] [-p KiB]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (n_nodes < CANOPEN_NODEID_MIN || n_nodes > CANOPEN_NODEID_MAX) {
+		fprintf(stderr, "The number of nodes must be from 1 to 127\n");
+		return 1;
+	}
+
+	pollution_size_ = pollution_kib * 1024;
+	pollution_ = calloc(1, pollution_size_ + 1);
+	if (!pollution_) {
+		perror("Could not allocate buffer");
+		return 1;
+	}
+
+	init_bus(n_nodes);
+	init_frames(n_nodes);
+	open_counters();
+
+	printf("%d nodes, %zu bytes of dispatch state, %zu bytes per node\n",
+	       n_nodes, sizeof(struct co_drv), sizeof(struct co_master_node));
+
+	uint64_t counts[N_COUNTERS];
+	uint64_t elapsed = run(n, 0, 1, counts);
+	report("warm", n, elapsed, counts);
+
+	/* The cost of the walk on its own is taken off. The best of a few
+	 * runs of each is used, as the difference is easily lost in noise.
+	 */
+	n /= 8;
+	uint64_t walk_counts[N_COUNTERS];
+	uint64_t walk_elapsed = best_run(n, 0, walk_counts);
+	elapsed = best_run(n, 1, counts);
+
+	for (size_t i = 0; i < N_COUNTERS; ++i)
+		if (counts[i] != UINT64_MAX && walk_counts[i] != UINT64_MAX)
+			counts[i] -= walk_counts[i];
+
+	report("evicted", n, elapsed > walk_elapsed ? elapsed - walk_elapsed : 0,
+	       counts);
+
+	close_counters();
+	free(pollution_);
+	return 0;
+}
@@ -0,0 +1,254 @@
+/* Compare the 4-ary prioq, one element and one batch at a time, against the
+ * binary heap that prioq used to be. Each round fills the queue up to the given
+ * size and then keeps it there, popping an element and inserting a new one.
+ *
+ * Usage: bench_prioq [number of pops and inserts per size] [batch length]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "prioq.h"
+#include "time-utils.h"
+
+#define N_OPS_DEFAULT 4000000ULL
+#define BATCH_LENGTH_DEFAULT 32
+#define MAX_BATCH_LENGTH 1024
+#define N_PRIORITIES 1000
+#define N_RANDOM 65536
+
+static const size_t sizes_[] = { 256, 1024, 4096, 16384, 65536 };
+
+static unsigned long random_[N_RANDOM];
+static volatile uintptr_t sink_;
+
+/* The binary heap as it was, with a recursive lock taken per operation */
+struct binq_elem {
+	unsigned long priority;
+	unsigned long sequence;
+	void* data;
+};
+
+struct binq {
+	size_t size;
+	size_t index;
+	unsigned long sequence;
+	pthread_mutex_t mutex;
+	struct binq_elem* head;
+};
+
+static inline int binq__is_lt(const struct binq_elem* a,
+			      const struct binq_elem* b)
+{
+	if (a->priority != b->priority)
+		return a->priority < b->priority;
+
+	return prioq__is_seq_lt(a->sequence, b->sequence);
+}
+
+static inline void binq__swap(struct binq_elem* a, struct binq_elem* b)
+{
+	struct binq_elem tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+static void binq__bubble_up(struct binq* self, size_t index)
+{
+	if (index == 0)
+		return;
+
+	size_t parent = (index - 1) >> 1;
+	if (binq__is_lt(&self->head[index], &self->head[parent])) {
+		binq__swap(&self->head[index], &self->head[parent]);
+		binq__bubble_up(self, parent);
+	}
+}
+
+static void binq__sink_down(struct binq* self, size_t index)
+{
+	size_t left = (index << 1) + 1;
+	size_t right = (index << 1) + 2;
+	size_t smaller = index;
+
+	if (left < self->index
+	 && binq__is_lt(&self->head[left], &self->head[smaller]))
+		smaller = left;
+
+	if (right < self->index
+	 && binq__is_lt(&self->head[right], &self->head[smaller]))
+		smaller = right;
+
+	if (smaller == index)
+		return;
+
+	binq__swap(&self->head[index], &self->head[smaller]);
+	binq__sink_down(self, smaller);
+}
+
+static int binq_init(struct binq* self, size_t size)
+{
+	self->size = size;
+	self->index = 0;
+	self->sequence = 0;
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&self->mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	self->head = malloc(size * sizeof(*self->head));
+	return self->head ? 0 : -1;
+}
+
+static void binq_destroy(struct binq* self)
+{
+	pthread_mutex_destroy(&self->mutex);
+	free(self->head);
+}
+
+static void binq_insert(struct binq* self, unsigned long priority, void* data)
+{
+	pthread_mutex_lock(&self->mutex);
+
+	struct binq_elem* elem = &self->head[self->index++];
+	elem->priority = priority;
+	elem->sequence = self->sequence++;
+	elem->data = data;
+	binq__bubble_up(self, self->index - 1);
+
+	pthread_mutex_unlock(&self->mutex);
+}
+
+static void* binq_pop(struct binq* self)
+{
+	pthread_mutex_lock(&self->mutex);
+
+	void* data = self->head[0].data;
+	self->head[0] = self->head[--self->index];
+	binq__sink_down(self, 0);
+
+	pthread_mutex_unlock(&self->mutex);
+	return data;
+}
+
+static inline unsigned long next_priority(uint64_t i)
+{
+	return random_[i % N_RANDOM];
+}
+
+static uint64_t run_binq(size_t size, uint64_t n)
+{
+	struct binq queue;
+	if (binq_init(&queue, size) < 0)
+		return 0;
+
+	for (size_t i = 0; i < size; ++i)
+		binq_insert(&queue, next_priority(i), NULL);
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; ++i) {
+		sink_ = (uintptr_t)binq_pop(&queue);
+		binq_insert(&queue, next_priority(i), NULL);
+	}
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+
+	binq_destroy(&queue);
+	return t1 - t0;
+}
+
+static uint64_t run_prioq(size_t size, uint64_t n)
+{
+	struct prioq queue;
+	if (prioq_init(&queue, size) < 0)
+		return 0;
+
+	for (size_t i = 0; i < size; ++i)
+		prioq_insert(&queue, next_priority(i), NULL);
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; ++i) {
+		struct prioq_elem elem;
+		prioq_pop(&queue, &elem, 0);
+		sink_ = (uintptr_t)elem.data;
+		prioq_insert(&queue, next_priority(i), NULL);
+	}
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+
+	prioq_destroy(&queue);
+	return t1 - t0;
+}
+
+static uint64_t run_prioq_batched(size_t size, uint64_t n, size_t batch)
+{
+	static struct prioq_elem elems[MAX_BATCH_LENGTH];
+
+	struct prioq queue;
+	if (prioq_init(&queue, size) < 0)
+		return 0;
+
+	for (size_t i = 0; i < size; ++i)
+		prioq_insert(&queue, next_priority(i), NULL);
+
+	if (batch > size)
+		batch = size;
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+
+	for (uint64_t i = 0; i < n; i += batch) {
+		int n_popped = prioq_pop_many(&queue, elems, batch, 0);
+
+		for (int j = 0; j < n_popped; ++j) {
+			sink_ = (uintptr_t)elems[j].data;
+			elems[j].priority = next_priority(i + j);
+		}
+
+		prioq_insert_many(&queue, elems, n_popped);
+	}
+
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+
+	prioq_destroy(&queue);
+	return t1 - t0;
+}
+
+static void report(const char* name, uint64_t n, uint64_t ns)
+{
+	printf("  %-14s %8.2f ns per pop and insert\n", name, ns / (double)n);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : N_OPS_DEFAULT;
+	size_t batch = argc > 2 ? strtoul(argv[2], NULL, 0)
+				: BATCH_LENGTH_DEFAULT;
+
+	if (batch < 1 || batch > MAX_BATCH_LENGTH) {
+		fprintf(stderr, "The batch length must be 1-%d\n",
+			MAX_BATCH_LENGTH);
+		return 1;
+	}
+
+	srand(42);
+	for (size_t i = 0; i < N_RANDOM; ++i)
+		random_[i] = rand() % N_PRIORITIES;
+
+	for (size_t i = 0; i < sizeof(sizes_) / sizeof(sizes_[0]); ++i) {
+		size_t size = sizes_[i];
+
+		printf("%zu elements:\n", size);
+		report("binary", n, run_binq(size, n));
+		report("4-ary", n, run_prioq(size, n));
+		report("4-ary batched", n, run_prioq_batched(size, n, batch));
+	}
+
+	return 0;
+}
@@ -0,0 +1,557 @@
+/* Measure SDO transfers from sdo_req queues to sdo_srv servers. Each case keeps
+ * a number of requests in flight to each of the given nodes for a while and
+ * prints one line of JSON with the transfer rate and the latency distribution:
+ *
+ *	{"direction":"upload","mode":"segmented","size":64,"nodes":16,
+ *	 "depth":8,"start":"direct","transfers":..,"errors":..,"per_s":..,"bytes_per_s":..,
+ *	 "latency_us":{"p50":..,"p90":..,"p99":..,"p999":..,"max":..}}
+ *
+ * The latency is from sdo_req_start() until the done function is called, so
+ * with a depth of more than one it includes the time spent in the queue.
+ *
+ * By default the frames go through a local socket pair with the servers in
+ * their own thread. With -i, they go over a CAN interface such as vcan0
+ * instead, and with -L over an in-process loop bus, which leaves the kernel
+ * out of it but for waking the server thread.
+ *
+ * The next request of a slot is normally made from the done function, so a
+ * node that has nothing else queued starts it at once. With -S, it is made
+ * between iterations of the main loop instead, which leaves it to the idle
+ * job of the queue, as requests from other threads are. The line then has
+ * "start":"deferred" rather than "start":"direct".
+ *
+ * Usage: bench_sdo [-i interface] [-n nodes] [-q depth] [-d ms per case]
+ *		    [-t upload|download] [-m expedited|segmented|block]
+ *		    [-s size] [-S] [-L]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <mloop.h>
+
+#include "canopen.h"
+#include "canopen/sdo_req.h"
+#include "canopen/sdo_srv.h"
+#include "sock.h"
+#include "time-utils.h"
+
+#define BENCH_INDEX 0x2000
+#define MAX_DEPTH 64
+#define MAX_SIZE 65536
+#define LATENCY_MAX_SAMPLES (1 << 22)
+#define RECV_BATCH_SIZE 64
+
+enum bench_mode {
+	BENCH_EXPEDITED = 0,
+	BENCH_SEGMENTED,
+	BENCH_BLOCK,
+};
+
+static const char* mode_names_[] = {
+	[BENCH_EXPEDITED] = "expedited",
+	[BENCH_SEGMENTED] = "segmented",
+	[BENCH_BLOCK] = "block",
+};
+
+struct bench_case {
+	enum bench_mode mode;
+	size_t size;
+};
+
+static const struct bench_case cases_[] = {
+	{ BENCH_EXPEDITED, 4 },
+	{ BENCH_SEGMENTED, 7 },
+	{ BENCH_SEGMENTED, 64 },
+	{ BENCH_SEGMENTED, 1024 },
+	{ BENCH_SEGMENTED, 16384 },
+	{ BENCH_BLOCK, 64 },
+	{ BENCH_BLOCK, 1024 },
+	{ BENCH_BLOCK, 16384 },
+	{ BENCH_BLOCK, 65536 },
+};
+
+/* One request that is kept in flight */
+struct slot {
+	int nodeid;
+	uint64_t start_time;
+};
+
+static const char* iface_ = NULL;
+static int n_nodes_ = 16;
+static int depth_ = 8;
+static unsigned int duration_ = 1000;
+static int direction_ = -1;
+static int mode_ = -1;
+static size_t size_ = 0;
+static int is_deferred_ = 0;
+static int is_loop_ = 0;
+
+static struct sock client_sock_, server_sock_;
+static struct sdo_req_queue queues_[CANOPEN_NODEID_MAX + 1];
+static struct sdo_srv servers_[CANOPEN_NODEID_MAX + 1];
+static struct slot slots_[CANOPEN_NODEID_MAX * MAX_DEPTH];
+static struct slot* deferred_[CANOPEN_NODEID_MAX * MAX_DEPTH];
+static size_t n_deferred_;
+
+static char payload_[MAX_SIZE];
+static size_t server_size_;
+
+static volatile int is_server_stopping_ = 0;
+
+static enum sdo_req_type type_;
+static const struct bench_case* case_;
+static int is_stopping_;
+static size_t n_outstanding_;
+static uint64_t n_transfers_, n_errors_, n_bytes_;
+static uint32_t* latencies_;
+static size_t n_latencies_;
+
+static int on_srv_init(struct sdo_srv* srv)
+{
+	if (srv->req_type == SDO_REQ_DOWNLOAD)
+		return 0;
+
+	if (vector_assign(&srv->buffer, payload_, server_size_) < 0)
+		return sdo_srv_abort(srv, SDO_ABORT_NOMEM);
+
+	return 0;
+}
+
+static int on_srv_done(struct sdo_srv* srv)
+{
+	(void)srv;
+	return 0;
+}
+
+static void* run_servers(void* context)
+{
+	(void)context;
+
+	struct can_frame cfs[RECV_BATCH_SIZE];
+
+	while (!is_server_stopping_) {
+		if (sock_poll(&server_sock_, 100) <= 0)
+			continue;
+
+		ssize_t n;
+		while ((n = sock_recv_batch(&server_sock_, cfs, NULL,
+					    RECV_BATCH_SIZE, MSG_DONTWAIT)) > 0)
+			for (ssize_t i = 0; i < n; ++i) {
+				uint32_t cob = cfs[i].can_id;
+				if (cob < RSDO_LOW + 1
+				 || cob > RSDO_LOW + (uint32_t)n_nodes_)
+					continue;
+
+				sdo_srv_feed(&servers_[cob - RSDO_LOW], &cfs[i]);
+			}
+	}
+
+	return NULL;
+}
+
+static void on_client_readable(struct mloop_socket* socket)
+{
+	(void)socket;
+
+	struct can_frame cfs[RECV_BATCH_SIZE];
+	ssize_t n;
+
+	while ((n = sock_recv_batch(&client_sock_, cfs, NULL, RECV_BATCH_SIZE,
+				    MSG_DONTWAIT)) > 0)
+		for (ssize_t i = 0; i < n; ++i) {
+			uint32_t cob = cfs[i].can_id;
+			if (cob < TSDO_LOW + 1
+			 || cob > TSDO_LOW + (uint32_t)n_nodes_)
+				continue;
+
+			struct sdo_async* channel = sdo_req_queue_find_channel(
+					&queues_[cob - TSDO_LOW], cob);
+			if (channel)
+				sdo_async_feed(channel, &cfs[i]);
+		}
+}
+
+static int start_transfer(struct slot* slot);
+
+static void on_transfer_done(struct sdo_req* req)
+{
+	struct slot* slot = req->context;
+	uint64_t latency = gettime_us(CLOCK_MONOTONIC) - slot->start_time;
+
+	if (req->status == SDO_REQ_OK) {
+		++n_transfers_;
+		n_bytes_ += case_->size;
+
+		if (n_latencies_ < LATENCY_MAX_SAMPLES)
+			latencies_[n_latencies_++] = latency > UINT32_MAX
+						   ? UINT32_MAX : latency;
+	} else {
+		++n_errors_;
+	}
+
+	if (!is_stopping_ && is_deferred_) {
+		deferred_[n_deferred_++] = slot;
+		return;
+	}
+
+	if (!is_stopping_ && start_transfer(slot) == 0)
+		return;
+
+	if (--n_outstanding_ == 0)
+		mloop_exit(mloop_default());
+}
+
+static int start_transfer(struct slot* slot)
+{
+	struct sdo_req_info info = {
+		.type = type_,
+		.index = BENCH_INDEX,
+		.subindex = 0,
+		.on_done = on_transfer_done,
+		.context = slot,
+		.use_block = case_->mode == BENCH_BLOCK,
+	};
+
+	if (type_ == SDO_REQ_DOWNLOAD) {
+		info.dl_data = payload_;
+		info.dl_size = case_->size;
+		info.is_dl_data_borrowed = 1;
+	}
+
+	struct sdo_req* req = sdo_req_new(&info);
+	if (!req)
+		return -1;
+
+	slot->start_time = gettime_us(CLOCK_MONOTONIC);
+
+	int rc = sdo_req_start(req, &queues_[slot->nodeid]);
+	sdo_req_unref(req);
+	return rc;
+}
+
+/* Runs the loop a step at a time and makes the requests of the slots that
+ * finished in between, outside of it.
+ */
+static void run_deferred(void)
+{
+	struct pollfd pfd = {
+		.fd = mloop_get_pollfd(mloop_default()),
+		.events = POLLIN,
+	};
+
+	while (n_outstanding_ > 0) {
+		poll(&pfd, 1, -1);
+		mloop_run_once(mloop_default());
+
+		size_t n = n_deferred_;
+		n_deferred_ = 0;
+
+		for (size_t i = 0; i < n; ++i)
+			if (start_transfer(deferred_[i]) < 0)
+				--n_outstanding_;
+	}
+}
+
+static void on_case_timeout(struct mloop_timer* timer)
+{
+	(void)timer;
+	is_stopping_ = 1;
+}
+
+static int compare_latencies(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t get_percentile(double p)
+{
+	if (n_latencies_ == 0)
+		return 0;
+
+	size_t i = (size_t)(p * (n_latencies_ - 1) + 0.5);
+	return latencies_[i];
+}
+
+static int run_case(enum sdo_req_type type, const struct bench_case* c,
+		    int n_nodes, int depth, struct mloop_timer* timer)
+{
+	type_ = type;
+	case_ = c;
+	server_size_ = c->size;
+	is_stopping_ = 0;
+	n_outstanding_ = 0;
+	n_transfers_ = n_errors_ = n_bytes_ = 0;
+	n_latencies_ = 0;
+	n_deferred_ = 0;
+
+	mloop_timer_set_time(timer, duration_ * 1000000ULL);
+	mloop_timer_start(timer);
+
+	uint64_t start = gettime_us(CLOCK_MONOTONIC);
+
+	/* Interleave the nodes so that they all get going at once */
+	for (int d = 0; d < depth; ++d)
+		for (int i = 1; i <= n_nodes; ++i) {
+			struct slot* slot = &slots_[(i - 1) * depth + d];
+			slot->nodeid = i;
+			if (start_transfer(slot) == 0)
+				++n_outstanding_;
+		}
+
+	if (n_outstanding_ == 0) {
+		mloop_timer_stop(timer);
+		fprintf(stderr, "No transfers could be started\n");
+		return -1;
+	}
+
+	if (is_deferred_)
+		run_deferred();
+	else
+		mloop_run(mloop_default());
+
+	mloop_timer_stop(timer);
+
+	double elapsed = (gettime_us(CLOCK_MONOTONIC) - start) / 1e6;
+
+	qsort(latencies_, n_latencies_, sizeof(latencies_[0]),
+	      compare_latencies);
+
+	printf("{\"direction\":\"%s\",\"mode\":\"%s\",\"size\":%zu,\"nodes\":%d,\"depth\":%d,\"start\":\"%s\",",
+	       type == SDO_REQ_UPLOAD ? "upload" : "download",
+	       mode_names_[c->mode], c->size, n_nodes, depth,
+	       is_deferred_ ? "deferred" : "direct");
+
+	printf("\"transfers\":%llu,\"errors\":%llu,\"per_s\":%.1f,\"bytes_per_s\":%.1f,",
+	       (unsigned long long)n_transfers_,
+	       (unsigned long long)n_errors_, n_transfers_ / elapsed,
+	       n_bytes_ / elapsed);
+
+	printf("\"latency_us\":{\"p50\":%u,\"p90\":%u,\"p99\":%u,\"p999\":%u,\"max\":%u}}\n",
+	       get_percentile(0.5), get_percentile(0.9), get_percentile(0.99),
+	       get_percentile(0.999),
+	       n_latencies_ ? latencies_[n_latencies_ - 1] : 0);
+
+	fflush(stdout);
+	return 0;
+}
+
+static int open_sockets(void)
+{
+	if (iface_) {
+		if (sock_open(&client_sock_, SOCK_TYPE_CAN, iface_, NULL) < 0)
+			return -1;
+
+		if (sock_open(&server_sock_, SOCK_TYPE_CAN, iface_, NULL) < 0) {
+			sock_close(&client_sock_);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (is_loop_) {
+		if (sock_open(&client_sock_, SOCK_TYPE_LOOP, "bench_sdo", NULL) < 0)
+			return -1;
+
+		if (sock_open(&server_sock_, SOCK_TYPE_LOOP, "bench_sdo", NULL) < 0) {
+			sock_close(&client_sock_);
+			return -1;
+		}
+
+		return 0;
+	}
+
+	int fds[2];
+	if (socketpair(AF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+		return -1;
+
+	sock_init(&client_sock_, SOCK_TYPE_CAN, fds[0], NULL);
+	sock_init(&server_sock_, SOCK_TYPE_CAN, fds[1], NULL);
+	return 0;
+}
+
+static int parse_mode(const char* name)
+{
+	for (size_t i = 0; i < sizeof(mode_names_) / sizeof(mode_names_[0]); ++i)
+		if (strcmp(name, mode_names_[i]) == 0)
+			return i;
+
+	return -1;
+}
+
+static int parse_options(int argc, char* argv[])
+{
+	while (1) {
+		int c = getopt(argc, argv, "i:n:q:d:t:m:s:SL");
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'i': iface_ = optarg; break;
+		case 'n': n_nodes_ = atoi(optarg); break;
+		case 'q': depth_ = atoi(optarg); break;
+		case 'd': duration_ = strtoul(optarg, NULL, 0); break;
+		case 't':
+			if (strcmp(optarg, "upload") == 0)
+				direction_ = SDO_REQ_UPLOAD;
+			else if (strcmp(optarg, "download") == 0)
+				direction_ = SDO_REQ_DOWNLOAD;
+			else
+				return -1;
+			break;
+		case 'm':
+			mode_ = parse_mode(optarg);
+			if (mode_ < 0)
+				return -1;
+			break;
+		case 's': size_ = strtoul(optarg, NULL, 0); break;
+		case 'S': is_deferred_ = 1; break;
+		case 'L': is_loop_ = 1; break;
+		default: return -1;
+		}
+	}
+
+	if (iface_ && is_loop_)
+		return -1;
+
+	if (n_nodes_ < 1 || n_nodes_ > CANOPEN_NODEID_MAX)
+		return -1;
+
+	if (depth_ < 1 || depth_ > MAX_DEPTH)
+		return -1;
+
+	if (size_ > MAX_SIZE || duration_ == 0)
+		return -1;
+
+	/* Only expedited transfers fit in one frame */
+	if (size_ && mode_ == BENCH_EXPEDITED && size_ > 4)
+		return -1;
+
+	return 0;
+}
+
+/* Runs the case with one node at a depth of one, and with all of them at the
+ * full depth, unless those are the same.
+ */
+static int run_cases(enum sdo_req_type type, const struct bench_case* c,
+		     struct mloop_timer* timer)
+{
+	if (run_case(type, c, 1, 1, timer) < 0)
+		return -1;
+
+	if (n_nodes_ == 1 && depth_ == 1)
+		return 0;
+
+	return run_case(type, c, n_nodes_, depth_, timer);
+}
+
+static int run_all(struct mloop_timer* timer)
+{
+	for (int type = SDO_REQ_UPLOAD; type <= SDO_REQ_DOWNLOAD; ++type) {
+		if (direction_ >= 0 && type != direction_)
+			continue;
+
+		/* A given size replaces the sizes of the selected modes */
+		for (int mode = BENCH_EXPEDITED; mode <= BENCH_BLOCK; ++mode) {
+			if (mode_ >= 0 && mode != mode_)
+				continue;
+
+			if (size_) {
+				struct bench_case c = { mode, size_ };
+				if (mode == BENCH_EXPEDITED && size_ > 4)
+					continue;
+				if (run_cases(type, &c, timer) < 0)
+					return -1;
+				continue;
+			}
+
+			for (size_t i = 0; i < sizeof(cases_) / sizeof(cases_[0]); ++i)
+				if (cases_[i].mode == (enum bench_mode)mode
+				 && run_cases(type, &cases_[i], timer) < 0)
+					return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	pthread_t server_thread;
+	int rc = 1;
+
+	if (parse_options(argc, argv) < 0) {
+		fprintf(stderr, "Usage: %s [-i interface] [-n nodes] [-q depth] [-d ms per case] [-t upload|download] [-m expedited|segmented|block] [-s size] [-S] [-L]\n",
+			argv[0]);
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(payload_); ++i)
+		payload_[i] = i;
+
+	latencies_ = malloc(LATENCY_MAX_SAMPLES * sizeof(latencies_[0]));
+	if (!latencies_)
+		return 1;
+
+	if (open_sockets() < 0) {
+		perror("Could not open sockets");
+		goto socket_failure;
+	}
+
+	if (sdo_req_queues_init(queues_, &client_sock_, MAX_DEPTH,
+				SDO_ASYNC_QUIRK_NONE) < 0)
+		goto queue_failure;
+
+	for (int i = 1; i <= n_nodes_; ++i)
+		sdo_srv_init(&servers_[i], &server_sock_, i, on_srv_init,
+			     on_srv_done);
+
+	struct mloop_socket* socket = mloop_socket_new(mloop_default());
+	if (!socket)
+		goto mloop_socket_failure;
+
+	mloop_socket_set_fd(socket, client_sock_.fd);
+	mloop_socket_set_callback(socket, on_client_readable);
+	mloop_socket_start(socket);
+
+	struct mloop_timer* timer = mloop_timer_new(mloop_default());
+	if (!timer)
+		goto timer_failure;
+
+	mloop_timer_set_type(timer, MLOOP_TIMER_RELATIVE);
+	mloop_timer_set_callback(timer, on_case_timeout);
+
+	if (pthread_create(&server_thread, NULL, run_servers, NULL) != 0)
+		goto thread_failure;
+
+	rc = run_all(timer) < 0 ? 1 : 0;
+
+	is_server_stopping_ = 1;
+	pthread_join(server_thread, NULL);
+
+thread_failure:
+	mloop_timer_unref(timer);
+timer_failure:
+	mloop_socket_stop(socket);
+	mloop_socket_unref(socket);
+mloop_socket_failure:
+	for (int i = 1; i <= n_nodes_; ++i)
+		sdo_srv_destroy(&servers_[i]);
+	sdo_req_queues_cleanup(queues_);
+queue_failure:
+	sock_close(&client_sock_);
+	sock_close(&server_sock_);
+socket_failure:
+	free(latencies_);
+	return rc;
+}
@@ -0,0 +1,179 @@
+/* Compare the work-stealing workq against a single prioq that all workers wait
+ * on, which is what the mloop worker pool used to be. One thread submits jobs
+ * in bursts, as the bootup does when it loads drivers, and the workers run
+ * them.
+ *
+ * Usage: bench_workers [number of jobs] [number of workers] [job length in ns]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "prioq.h"
+#include "workq.h"
+#include "time-utils.h"
+
+#define N_JOBS_DEFAULT 1000000ULL
+#define N_WORKERS_DEFAULT 4
+#define JOB_LENGTH_DEFAULT 200
+#define BURST_LENGTH 128
+#define N_PRIORITIES 3
+
+struct job {
+	unsigned long priority;
+};
+
+static struct job stop_job_;
+static uint64_t job_length_;
+static uint64_t n_done_;
+static uint64_t n_inverted_;
+
+static struct prioq prioq_;
+static struct workq workq_;
+
+static void run_job(const struct job* job, unsigned long* last_priority)
+{
+	uint64_t end = gettime_ns(CLOCK_MONOTONIC) + job_length_;
+	while (gettime_ns(CLOCK_MONOTONIC) < end);
+
+	/* Only a rough measure, as other workers run jobs at the same time */
+	if (job->priority < *last_priority)
+		__atomic_add_fetch(&n_inverted_, 1, __ATOMIC_RELAXED);
+
+	*last_priority = job->priority;
+	__atomic_add_fetch(&n_done_, 1, __ATOMIC_RELEASE);
+}
+
+static void* prioq_worker(void* context)
+{
+	(void)context;
+	unsigned long last_priority = 0;
+
+	while (1) {
+		struct prioq_elem elem;
+		if (prioq_pop(&prioq_, &elem, -1) < 0)
+			continue;
+
+		if (elem.data == &stop_job_)
+			break;
+
+		run_job(elem.data, &last_priority);
+	}
+
+	return NULL;
+}
+
+static void* workq_worker(void* context)
+{
+	size_t index = (size_t)context;
+	unsigned long last_priority = 0;
+	struct job* job;
+
+	while ((job = workq_pop(&workq_, index)))
+		run_job(job, &last_priority);
+
+	return NULL;
+}
+
+static int prioq_submit(unsigned long priority, void* data)
+{
+	return prioq_insert(&prioq_, priority, data);
+}
+
+static int workq_submit(unsigned long priority, void* data)
+{
+	return workq_push(&workq_, priority, data);
+}
+
+static void submit_all(int (*submit)(unsigned long, void*), struct job* jobs,
+		       uint64_t n)
+{
+	for (uint64_t i = 0; i < n; ) {
+		uint64_t end = i + BURST_LENGTH < n ? i + BURST_LENGTH : n;
+
+		for (; i < end; ++i)
+			while (submit(jobs[i].priority, &jobs[i]) < 0)
+				sched_yield();
+
+		/* Let the workers catch up before the next burst */
+		while (__atomic_load_n(&n_done_, __ATOMIC_ACQUIRE) + BURST_LENGTH
+		       < end)
+			sched_yield();
+	}
+
+	while (__atomic_load_n(&n_done_, __ATOMIC_ACQUIRE) < n)
+		sched_yield();
+}
+
+static void report(const char* name, uint64_t n, uint64_t t0, uint64_t t1)
+{
+	double seconds = (t1 - t0) / 1e9;
+	printf("%-8s %12.0f jobs/s  %8.2f ns/job  %llu out of order\n", name,
+	       n / seconds, (t1 - t0) / (double)n,
+	       (unsigned long long)n_inverted_);
+}
+
+int main(int argc, char* argv[])
+{
+	uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : N_JOBS_DEFAULT;
+	size_t n_workers = argc > 2 ? strtoul(argv[2], NULL, 0)
+				    : N_WORKERS_DEFAULT;
+	job_length_ = argc > 3 ? strtoull(argv[3], NULL, 0)
+			       : JOB_LENGTH_DEFAULT;
+
+	if (n_workers < 1 || n_workers > WORKQ_MAX_WORKERS) {
+		fprintf(stderr, "The number of workers must be 1-%d\n",
+			WORKQ_MAX_WORKERS);
+		return 1;
+	}
+
+	struct job* jobs = malloc(n * sizeof(*jobs));
+	if (!jobs)
+		return 1;
+
+	srand(42);
+	for (uint64_t i = 0; i < n; ++i)
+		jobs[i].priority = rand() % N_PRIORITIES;
+
+	pthread_t threads[WORKQ_MAX_WORKERS];
+
+	prioq_init(&prioq_, 64);
+	for (size_t i = 0; i < n_workers; ++i)
+		pthread_create(&threads[i], NULL, prioq_worker, NULL);
+
+	uint64_t t0 = gettime_ns(CLOCK_MONOTONIC);
+	submit_all(prioq_submit, jobs, n);
+	uint64_t t1 = gettime_ns(CLOCK_MONOTONIC);
+	report("prioq", n, t0, t1);
+
+	for (size_t i = 0; i < n_workers; ++i)
+		prioq_insert(&prioq_, 0, &stop_job_);
+	for (size_t i = 0; i < n_workers; ++i)
+		pthread_join(threads[i], NULL);
+	prioq_destroy(&prioq_);
+
+	n_done_ = 0;
+	n_inverted_ = 0;
+
+	workq_init(&workq_, 64);
+	workq_set_n_workers(&workq_, n_workers);
+	for (size_t i = 0; i < n_workers; ++i)
+		pthread_create(&threads[i], NULL, workq_worker, (void*)i);
+
+	t0 = gettime_ns(CLOCK_MONOTONIC);
+	submit_all(workq_submit, jobs, n);
+	t1 = gettime_ns(CLOCK_MONOTONIC);
+	report("workq", n, t0, t1);
+
+	workq_stop(&workq_);
+	for (size_t i = 0; i < n_workers; ++i)
+		pthread_join(threads[i], NULL);
+	workq_destroy(&workq_);
+
+	free(jobs);
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include "tst.h"
+#include "async-log.h"
+#include "plog.h"
+
+#include <pthread.h>
+#include <string.h>
+
+static int test_sites_are_rate_limited()
+{
+	static struct alog_site site;
+
+	ASSERT_INT_EQ(0, alog_start(16, 2));
+
+	for (int i = 0; i < 5; ++i)
+		alog__write(&site, LOG_DEBUG, "unit_async-log: %d", i);
+
+	ASSERT_UINT_EQ(5, site.n_in_window);
+	ASSERT_UINT_EQ(3, site.n_suppressed);
+
+	alog_stop();
+	return 0;
+}
+
+#define N_WRITERS 4
+#define N_MESSAGES 10000
+
+static void* write_messages(void* context)
+{
+	(void)context;
+
+	for (int i = 0; i < N_MESSAGES; ++i)
+		alog(LOG_DEBUG, "unit_async-log: message %d", i);
+
+	return NULL;
+}
+
+static int test_concurrent_writers()
+{
+	pthread_t threads[N_WRITERS];
+
+	ASSERT_INT_EQ(0, alog_start(64, 0));
+
+	for (int i = 0; i < N_WRITERS; ++i)
+		ASSERT_INT_EQ(0, pthread_create(&threads[i], NULL,
+						write_messages, NULL));
+
+	for (int i = 0; i < N_WRITERS; ++i)
+		pthread_join(threads[i], NULL);
+
+	alog_stop();
+
+	ASSERT_TRUE(alog_get_n_dropped() < N_WRITERS * N_MESSAGES);
+	return 0;
+}
+
+static int test_messages_pass_through_when_stopped()
+{
+	static struct alog_site site;
+
+	alog__write(&site, LOG_DEBUG, "unit_async-log: not started");
+	ASSERT_UINT_EQ(0, site.n_suppressed);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	openlog("unit_async-log", 0, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_ERR));
+	RUN_TEST(test_sites_are_rate_limited);
+	RUN_TEST(test_concurrent_writers);
+	RUN_TEST(test_messages_pass_through_when_stopped);
+	return r;
+}
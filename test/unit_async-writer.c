@@ -0,0 +1,166 @@
+#include "tst.h"
+#include "async-writer.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_OUTPUT (1 << 20)
+
+struct reader {
+	int fd;
+	size_t size;
+	char data[MAX_OUTPUT];
+};
+
+static struct reader reader_;
+
+static void* run_reader(void* context)
+{
+	struct reader* reader = context;
+
+	while (reader->size < sizeof(reader->data)) {
+		ssize_t n = read(reader->fd, reader->data + reader->size,
+				 sizeof(reader->data) - reader->size);
+		if (n <= 0)
+			break;
+
+		reader->size += n;
+	}
+
+	return NULL;
+}
+
+static size_t count_lines(const char* data, size_t size)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < size; ++i)
+		if (data[i] == '\n')
+			++n;
+	return n;
+}
+
+static int test_records_are_written_in_order()
+{
+	int fds[2];
+	ASSERT_INT_EQ(0, pipe(fds));
+
+	pthread_t thread;
+	memset(&reader_, 0, sizeof(reader_));
+	reader_.fd = fds[0];
+	pthread_create(&thread, NULL, run_reader, &reader_);
+
+	struct async_writer writer;
+	ASSERT_INT_EQ(0, aw_init(&writer, fds[1], 4, AW_BLOCK));
+
+	for (int i = 0; i < 10000; ++i) {
+		aw_printf(&writer, "%d", i);
+		aw_printf(&writer, " frame\n");
+		aw_commit(&writer);
+
+		/* Empty records are not written */
+		aw_commit(&writer);
+	}
+
+	aw_destroy(&writer);
+	close(fds[1]);
+	pthread_join(thread, NULL);
+	close(fds[0]);
+
+	ASSERT_UINT_EQ(10000, count_lines(reader_.data, reader_.size));
+	ASSERT_UINT_EQ(0, aw_get_n_dropped(&writer));
+	ASSERT_INT_EQ(0, aw_get_error(&writer));
+
+	const char* line = reader_.data;
+	for (int i = 0; i < 10000; ++i) {
+		char expected[32];
+		int n = snprintf(expected, sizeof(expected), "%d frame\n", i);
+		ASSERT_INT_EQ(0, memcmp(line, expected, n));
+		line += n;
+	}
+
+	return 0;
+}
+
+/* The output is full, so the writer is stuck until it is read */
+static int test_records_are_dropped_when_output_is_blocked()
+{
+	int fds[2];
+	ASSERT_INT_EQ(0, pipe(fds));
+
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	char fill[4096] = { 0 };
+	size_t n_filled = 0;
+	ssize_t n;
+	while ((n = write(fds[1], fill, sizeof(fill))) > 0)
+		n_filled += n;
+	fcntl(fds[1], F_SETFL, 0);
+
+	struct async_writer writer;
+	ASSERT_INT_EQ(0, aw_init(&writer, fds[1], 4, 0));
+
+	for (int i = 0; i < 1000; ++i) {
+		aw_printf(&writer, "%d\n", i);
+		aw_commit(&writer);
+	}
+
+	uint64_t n_dropped = aw_get_n_dropped(&writer);
+	ASSERT_TRUE(n_dropped >= 1000 - 8);
+
+	pthread_t thread;
+	memset(&reader_, 0, sizeof(reader_));
+	reader_.fd = fds[0];
+	pthread_create(&thread, NULL, run_reader, &reader_);
+
+	aw_destroy(&writer);
+	close(fds[1]);
+	pthread_join(thread, NULL);
+	close(fds[0]);
+
+	ASSERT_TRUE(reader_.size >= n_filled);
+	ASSERT_TRUE(count_lines(reader_.data + n_filled,
+				reader_.size - n_filled)
+		    == 1000 - n_dropped);
+	return 0;
+}
+
+static int test_long_records_are_cut_off()
+{
+	int fds[2];
+	ASSERT_INT_EQ(0, pipe(fds));
+
+	struct async_writer writer;
+	ASSERT_INT_EQ(0, aw_init(&writer, fds[1], 4, AW_BLOCK));
+
+	char text[1024];
+	memset(text, 'x', sizeof(text) - 1);
+	text[sizeof(text) - 1] = '\0';
+
+	aw_printf(&writer, "%s", text);
+	aw_printf(&writer, "%s\n", text);
+	aw_commit(&writer);
+
+	aw_destroy(&writer);
+	close(fds[1]);
+
+	char output[2048];
+	ssize_t n = read(fds[0], output, sizeof(output));
+	close(fds[0]);
+
+	ASSERT_INT_EQ(AW_RECORD_SIZE - sizeof(uint32_t) - 1, n);
+	ASSERT_INT_EQ('x', output[n - 2]);
+	ASSERT_INT_EQ('\n', output[n - 1]);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_records_are_written_in_order);
+	RUN_TEST(test_records_are_dropped_when_output_is_blocked);
+	RUN_TEST(test_long_records_are_cut_off);
+	return r;
+}
@@ -0,0 +1,126 @@
+#include "tst.h"
+#include "bootup-timeline.h"
+#include "canopen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct bootup_timeline timelines_[CANOPEN_NODEID_MAX + 1];
+
+static void start_all(uint64_t start)
+{
+	for (int i = 0; i <= CANOPEN_NODEID_MAX; ++i)
+		bootup_timeline_start(&timelines_[i], start);
+}
+
+static int test_phases_run_from_the_step_before()
+{
+	struct bootup_timeline* t = &timelines_[5];
+	start_all(1000);
+
+	bootup_timeline_set(t, BOOTUP_PROBED, 1500);
+	bootup_timeline_set(t, BOOTUP_IDENTIFIED, 4000);
+	bootup_timeline_set(t, BOOTUP_STARTED, 9000);
+
+	ASSERT_UINT_EQ(500, bootup_timeline_phase(t, BOOTUP_PROBED));
+	ASSERT_UINT_EQ(0, bootup_timeline_phase(t, BOOTUP_SCHEDULED));
+	ASSERT_UINT_EQ(2500, bootup_timeline_phase(t, BOOTUP_IDENTIFIED));
+	ASSERT_UINT_EQ(5000, bootup_timeline_phase(t, BOOTUP_STARTED));
+	ASSERT_UINT_EQ(8000, bootup_timeline_total(t));
+	ASSERT_TRUE(bootup_timeline_is_empty(&timelines_[6]));
+	return 0;
+}
+
+static int test_restart_clears_steps()
+{
+	struct bootup_timeline* t = &timelines_[5];
+	start_all(1000);
+
+	bootup_timeline_set(t, BOOTUP_PROBED, 1500);
+	bootup_timeline_start(t, 20000);
+	bootup_timeline_set(t, BOOTUP_SCHEDULED, 21000);
+
+	ASSERT_UINT_EQ(0, bootup_timeline_phase(t, BOOTUP_PROBED));
+	ASSERT_UINT_EQ(1000, bootup_timeline_phase(t, BOOTUP_SCHEDULED));
+	ASSERT_UINT_EQ(1000, bootup_timeline_total(t));
+	return 0;
+}
+
+static int test_rank_puts_slowest_first()
+{
+	int nodeids[4];
+	start_all(0);
+
+	bootup_timeline_set(&timelines_[3], BOOTUP_STARTED, 3000);
+	bootup_timeline_set(&timelines_[9], BOOTUP_STARTED, 9000);
+	bootup_timeline_set(&timelines_[7], BOOTUP_LOADED, 5000);
+
+	ASSERT_UINT_EQ(2, bootup_timeline_rank(timelines_, nodeids, 2));
+	ASSERT_INT_EQ(9, nodeids[0]);
+	ASSERT_INT_EQ(7, nodeids[1]);
+
+	ASSERT_UINT_EQ(3, bootup_timeline_rank(timelines_, nodeids, 4));
+	ASSERT_INT_EQ(3, nodeids[2]);
+	return 0;
+}
+
+static int test_describe_gives_longest_phases()
+{
+	char buf[256];
+	struct bootup_timeline* t = &timelines_[5];
+	start_all(0);
+
+	bootup_timeline_set(t, BOOTUP_PROBED, 10000);
+	bootup_timeline_set(t, BOOTUP_IDENTIFIED, 2010000);
+	bootup_timeline_set(t, BOOTUP_OPENED, 2030000);
+	bootup_timeline_set(t, BOOTUP_INITIALIZED, 2530000);
+	bootup_timeline_set(t, BOOTUP_STARTED, 2531000);
+
+	bootup_timeline_describe(buf, sizeof(buf), t);
+	ASSERT_STR_EQ("2531 ms (identity 2000 ms, init 500 ms, dlopen 20 ms)",
+		      buf);
+
+	bootup_timeline_set(&timelines_[8], BOOTUP_INITIALIZED, 800000);
+
+	bootup_timeline_describe_phases(buf, sizeof(buf), timelines_);
+	ASSERT_STR_EQ("identity 2000 ms (node 5), init 800 ms (node 8), dlopen 20 ms (node 5), probe 10 ms (node 5), start 1 ms (node 5)",
+		      buf);
+
+	/* Cut short rather than overrun */
+	bootup_timeline_describe_phases(buf, 16, timelines_);
+	ASSERT_STR_EQ("identity 2000 m", buf);
+	return 0;
+}
+
+static int test_json()
+{
+	char* buffer = NULL;
+	size_t size = 0;
+	start_all(0);
+
+	bootup_timeline_set(&timelines_[5], BOOTUP_PROBED, 100);
+	bootup_timeline_set(&timelines_[5], BOOTUP_STARTED, 400);
+	bootup_timeline_set(&timelines_[2], BOOTUP_PROBED, 50);
+
+	FILE* stream = open_memstream(&buffer, &size);
+	ASSERT_TRUE(stream != NULL);
+	bootup_timeline_write_json(stream, timelines_);
+	fclose(stream);
+
+	ASSERT_STR_EQ("{\"nodes\":{\"2\":{\"total_us\":50,\"phases_us\":{\"probe\":50}},\"5\":{\"total_us\":400,\"phases_us\":{\"probe\":100,\"start\":300}}},\"slowest\":[5,2]}\r\n",
+		      buffer);
+	free(buffer);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_phases_run_from_the_step_before);
+	RUN_TEST(test_restart_clears_steps);
+	RUN_TEST(test_rank_puts_slowest_first);
+	RUN_TEST(test_describe_gives_longest_phases);
+	RUN_TEST(test_json);
+	return r;
+}
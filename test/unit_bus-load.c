@@ -0,0 +1,204 @@
+#include "tst.h"
+#include "bus-load.h"
+#include "socketcan.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct bus_load load_;
+
+static struct can_frame make_frame(uint32_t can_id, size_t dlc,
+				   const uint8_t* data)
+{
+	struct can_frame cf;
+	memset(&cf, 0, sizeof(cf));
+
+	cf.can_id = can_id;
+	cf.can_dlc = dlc;
+	if (data)
+		memcpy(cf.data, data, dlc);
+
+	return cf;
+}
+
+/* Reference values were worked out by stuffing the bits of each frame by
+ * hand, CRC included.
+ */
+static int test_frame_bits()
+{
+	static const uint8_t pdo[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+	static const uint8_t nmt[] = { 1, 5 };
+	static const uint8_t sdo[] = { 0x40, 0x00, 0x10, 0, 0, 0, 0, 0 };
+	static const uint8_t ones[] = { 0xff, 0xff, 0xff, 0xff,
+					0xff, 0xff, 0xff, 0xff };
+	static const uint8_t hb[] = { 5 };
+
+	struct can_frame cf;
+
+	/* 34 dominant bits in a row, with a stuff bit after every five */
+	cf = make_frame(0, 0, NULL);
+	ASSERT_UINT_EQ(53, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0x185, 8, pdo);
+	ASSERT_UINT_EQ(120, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0x705, 1, hb);
+	ASSERT_UINT_EQ(59, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0, 2, nmt);
+	ASSERT_UINT_EQ(70, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0x605, 8, sdo);
+	ASSERT_UINT_EQ(124, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0x7ff, 8, ones);
+	ASSERT_UINT_EQ(126, bl_get_frame_bits(&cf));
+
+	cf = make_frame(0x1234567 | CAN_EFF_FLAG, 8, ones);
+	ASSERT_UINT_EQ(145, bl_get_frame_bits(&cf));
+
+	/* Remote frames carry no data */
+	cf = make_frame(0x705 | CAN_RTR_FLAG, 0, NULL);
+	ASSERT_UINT_EQ(49, bl_get_frame_bits(&cf));
+	return 0;
+}
+
+/* Stuffing adds at most one bit for every four after the first */
+static int test_frame_bits_are_bounded()
+{
+	srand(42);
+
+	for (int i = 0; i < 10000; ++i) {
+		uint8_t data[8];
+		for (int j = 0; j < 8; ++j)
+			data[j] = rand();
+
+		int is_extended = i % 2;
+		uint32_t can_id = is_extended
+				? (rand() & CAN_EFF_MASK) | CAN_EFF_FLAG
+				: rand() & CAN_SFF_MASK;
+		size_t dlc = rand() % 9;
+
+		struct can_frame cf = make_frame(can_id, dlc, data);
+		unsigned int bits = bl_get_frame_bits(&cf);
+
+		unsigned int g = is_extended ? 54 : 34;
+		unsigned int n = 8 * dlc;
+		ASSERT_UINT_GE(g + n + 13, bits);
+		ASSERT_UINT_LE(g + n + 13 + (g + n - 1) / 4, bits);
+		ASSERT_UINT_EQ(g + n + 13 + (g + n - 1) / 4,
+			       bl_get_frame_bits_max(&cf));
+	}
+
+	return 0;
+}
+
+static int test_fd_frame_bits()
+{
+	struct canfd_frame cfd;
+	memset(&cfd, 0, sizeof(cfd));
+	cfd.can_id = 0x185;
+	cfd.len = 64;
+	cfd.flags = CANFD_FDF;
+	memset(cfd.data, 0x55, sizeof(cfd.data));
+
+	unsigned int bits = bl_get_frame_bits((struct can_frame*)&cfd);
+
+	/* 22 header bits and 64 bytes of alternating bits, none of which need
+	 * stuffing, then the stuff count and CRC-21 with their 7 fixed stuff
+	 * bits
+	 */
+	ASSERT_UINT_EQ(22 + 512 + 4 + 21 + 7 + 13, bits);
+
+	/* A length that is not valid on the bus is padded with zeros */
+	cfd.len = 10;
+	unsigned int padded = bl_get_frame_bits((struct can_frame*)&cfd);
+	cfd.len = 12;
+	cfd.data[10] = cfd.data[11] = 0;
+	ASSERT_UINT_EQ(padded, bl_get_frame_bits((struct can_frame*)&cfd));
+	return 0;
+}
+
+static int test_summary()
+{
+	static const uint8_t data[8] = { 0 };
+
+	bl_reset(&load_);
+
+	struct can_frame pdo = make_frame(0x185, 8, data);
+	struct can_frame sdo = make_frame(0x605, 8, data);
+	struct can_frame hb = make_frame(0x705, 1, data);
+	struct can_frame sync = make_frame(0x80, 0, data);
+	struct can_frame ext = make_frame(0x100 | CAN_EFF_FLAG, 4, data);
+	struct can_frame lss = make_frame(0x7e5, 8, data);
+
+	for (int i = 0; i < 10; ++i)
+		bl_count(&load_, &pdo);
+
+	bl_count(&load_, &sdo);
+	bl_count(&load_, &hb);
+	bl_count(&load_, &sync);
+	bl_count(&load_, &ext);
+	bl_count(&load_, &lss);
+
+	ASSERT_UINT_EQ(10, load_.cob_ids[0x185].n_frames);
+	ASSERT_UINT_EQ(80, load_.cob_ids[0x185].n_bytes);
+	ASSERT_UINT_EQ(1, load_.cob_ids[BL_N_COB_IDS - 1].n_frames);
+
+	struct bl_summary summary;
+	bl_summarize(&load_, &summary);
+
+	ASSERT_UINT_EQ(15, summary.total.n_frames);
+	ASSERT_UINT_EQ(80 + 8 + 1 + 4 + 8, summary.total.n_bytes);
+	ASSERT_UINT_EQ(10, summary.groups[BL_GROUP_PDO].n_frames);
+	ASSERT_UINT_EQ(1, summary.groups[BL_GROUP_SDO].n_frames);
+	ASSERT_UINT_EQ(1, summary.groups[BL_GROUP_HEARTBEAT].n_frames);
+	ASSERT_UINT_EQ(1, summary.groups[BL_GROUP_SYNC].n_frames);
+	ASSERT_UINT_EQ(2, summary.groups[BL_GROUP_OTHER].n_frames);
+
+	ASSERT_UINT_EQ(12, summary.nodes[5].n_frames);
+	ASSERT_UINT_EQ(1, summary.nodes[0].n_frames);
+
+	uint64_t bits = 0;
+	for (int i = 0; i < BL_N_GROUPS; ++i)
+		bits += summary.groups[i].n_bits;
+	ASSERT_TRUE(bits == summary.total.n_bits);
+	return 0;
+}
+
+static int test_print()
+{
+	static const uint8_t data[8] = { 0 };
+
+	bl_reset(&load_);
+
+	struct can_frame pdo = make_frame(0x185, 8, data);
+	struct can_frame ext = make_frame(0x100 | CAN_EFF_FLAG, 4, data);
+	for (int i = 0; i < 1000; ++i)
+		bl_count(&load_, &pdo);
+	bl_count(&load_, &ext);
+
+	char* text = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&text, &size);
+	bl_print(&load_, stream, 1000000, 250000, 16);
+	fclose(stream);
+
+	ASSERT_TRUE(strstr(text, "0x185   TPDO1") != NULL);
+	ASSERT_TRUE(strstr(text, "ext") != NULL);
+	ASSERT_TRUE(strstr(text, "of 250 kbit/s") != NULL);
+
+	free(text);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_frame_bits);
+	RUN_TEST(test_frame_bits_are_bounded);
+	RUN_TEST(test_fd_frame_bits);
+	RUN_TEST(test_summary);
+	RUN_TEST(test_print);
+	return r;
+}
@@ -0,0 +1,75 @@
+#include "tst.h"
+#include "canopen/byteorder.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static int test_swap_array_of_each_size()
+{
+	uint8_t src[64], dst[64];
+	for (size_t i = 0; i < sizeof(src); ++i)
+		src[i] = i;
+
+	/* Odd lengths to get some of it done outside of the vector loop */
+	static const size_t sizes[] = { 2, 4, 8 };
+	for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); ++k) {
+		size_t size = sizes[k];
+		size_t n = sizeof(src) / size - 1;
+
+		memset(dst, 0xff, sizeof(dst));
+		byteorder__swap_array(dst, src, size, n);
+
+		for (size_t i = 0; i < n * size; ++i) {
+			size_t start = i / size * size;
+			size_t mirror = start + size - 1 - (i - start);
+			ASSERT_UINT_EQ(src[mirror], dst[i]);
+		}
+		ASSERT_UINT_EQ(0xff, dst[n * size]);
+	}
+
+	return 0;
+}
+
+static int test_swap_array_in_place()
+{
+	uint32_t values[9];
+	for (size_t i = 0; i < 9; ++i)
+		values[i] = 0x01020304 + i;
+
+	byteorder__swap_array(values, values, sizeof(values[0]), 9);
+
+	for (size_t i = 0; i < 9; ++i)
+		ASSERT_UINT_EQ(__builtin_bswap32(0x01020304 + i), values[i]);
+	return 0;
+}
+
+static int test_network_order()
+{
+	const uint8_t network[] = { 0x78, 0x56, 0x34, 0x12 };
+	uint32_t value = 0;
+	uint16_t short_value = 0;
+
+	byteorder(&value, network, sizeof(value));
+	ASSERT_UINT_EQ(0x12345678, value);
+
+	uint32_t values[2] = { 0 };
+	byteorder_array(values, network, sizeof(values[0]), 1);
+	ASSERT_UINT_EQ(0x12345678, values[0]);
+
+	value = 0;
+	byteorder2(&value, network, sizeof(value), 2);
+	ASSERT_UINT_EQ(0x5678, value);
+
+	byteorder2(&short_value, network, sizeof(short_value), 2);
+	ASSERT_UINT_EQ(0x5678, short_value);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_swap_array_of_each_size);
+	RUN_TEST(test_swap_array_in_place);
+	RUN_TEST(test_network_order);
+	return r;
+}
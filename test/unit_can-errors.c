@@ -0,0 +1,149 @@
+#include <string.h>
+#include "tst.h"
+#include "can-errors.h"
+
+#define HOLD_TIME 500000 /* us */
+
+static struct can_frame make_error(canid_t class, uint8_t status,
+				   uint8_t tx_errors, uint8_t rx_errors)
+{
+	struct can_frame cf;
+	memset(&cf, 0, sizeof(cf));
+
+	cf.can_id = CAN_ERR_FLAG | class;
+	cf.can_dlc = CAN_ERR_DLC;
+	cf.data[1] = status;
+	cf.data[6] = tx_errors;
+	cf.data[7] = rx_errors;
+	return cf;
+}
+
+static int test_data_frame()
+{
+	struct can_errors errors;
+	can_errors_init(&errors, HOLD_TIME);
+
+	struct can_frame cf = { .can_id = 0x181, .can_dlc = 8 };
+	ASSERT_INT_EQ(-1, can_errors_on_frame(&errors, &cf, 1000));
+	ASSERT_UINT_EQ(0, errors.n_frames);
+	ASSERT_UINT_EQ(1000, can_errors_hold_until(&errors, 1000));
+	return 0;
+}
+
+static int test_controller_states()
+{
+	struct can_errors errors;
+	can_errors_init(&errors, HOLD_TIME);
+
+	struct can_frame cf = make_error(CAN_ERR_CRTL, CAN_ERR_CRTL_TX_WARNING,
+					 0, 0);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 1000));
+	ASSERT_INT_EQ(CAN_ERRORS_WARNING, can_errors_get_state(&errors));
+	ASSERT_UINT_EQ(1000 + HOLD_TIME, can_errors_hold_until(&errors, 1000));
+
+	cf = make_error(CAN_ERR_CRTL, CAN_ERR_CRTL_RX_PASSIVE, 0, 0);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 2000));
+	ASSERT_INT_EQ(CAN_ERRORS_PASSIVE, can_errors_get_state(&errors));
+	ASSERT_TRUE(can_errors_hold_until(&errors, 2000) == UINT64_MAX);
+
+	/* Recovering is not an error, so the hold runs from the last one */
+	cf = make_error(CAN_ERR_CRTL, CAN_ERR_CRTL_ACTIVE, 0, 0);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 3000));
+	ASSERT_INT_EQ(CAN_ERRORS_ACTIVE, can_errors_get_state(&errors));
+	ASSERT_UINT_EQ(2000 + HOLD_TIME, can_errors_hold_until(&errors, 3000));
+	ASSERT_UINT_EQ(900000, can_errors_hold_until(&errors, 900000));
+
+	ASSERT_UINT_EQ(3, errors.n_frames);
+	ASSERT_UINT_EQ(1, errors.n_warnings);
+	ASSERT_UINT_EQ(1, errors.n_passive);
+	return 0;
+}
+
+static int test_error_counters()
+{
+	struct can_errors errors;
+	can_errors_init(&errors, HOLD_TIME);
+
+	struct can_frame cf = make_error(CAN_ERR_PROT | CAN_ERR_CNT, 0, 130,
+					 4);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 1000));
+	ASSERT_INT_EQ(CAN_ERRORS_PASSIVE, can_errors_get_state(&errors));
+	ASSERT_UINT_EQ(130, errors.tx_errors);
+	ASSERT_UINT_EQ(4, errors.rx_errors);
+	ASSERT_UINT_EQ(1, errors.n_protocol);
+
+	cf = make_error(CAN_ERR_PROT | CAN_ERR_CNT, 0, 100, 4);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 2000));
+	ASSERT_INT_EQ(CAN_ERRORS_WARNING, can_errors_get_state(&errors));
+
+	cf = make_error(CAN_ERR_PROT | CAN_ERR_CNT, 0, 10, 4);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 3000));
+	ASSERT_INT_EQ(CAN_ERRORS_ACTIVE, can_errors_get_state(&errors));
+
+	cf = make_error(CAN_ERR_PROT | CAN_ERR_CNT, 0, 12, 4);
+	ASSERT_INT_EQ(0, can_errors_on_frame(&errors, &cf, 4000));
+	ASSERT_UINT_EQ(4000 + HOLD_TIME, can_errors_hold_until(&errors, 4000));
+	return 0;
+}
+
+static int test_bus_off_and_restart()
+{
+	struct can_errors errors;
+	can_errors_init(&errors, HOLD_TIME);
+
+	struct can_frame cf = make_error(CAN_ERR_BUSOFF, 0, 0, 0);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 1000));
+	ASSERT_TRUE(can_errors_is_bus_off(&errors));
+	ASSERT_UINT_EQ(1000, errors.bus_off_time);
+	ASSERT_UINT_EQ(1, errors.n_bus_off);
+	ASSERT_TRUE(can_errors_hold_until(&errors, 5000) == UINT64_MAX);
+
+	/* The counters do not bring it back on the bus */
+	cf = make_error(CAN_ERR_CNT, 0, 0, 0);
+	ASSERT_INT_EQ(0, can_errors_on_frame(&errors, &cf, 2000));
+	ASSERT_TRUE(can_errors_is_bus_off(&errors));
+
+	/* A restart does, and traffic goes again a while later */
+	cf = make_error(CAN_ERR_RESTARTED, 0, 0, 0);
+	ASSERT_INT_EQ(1, can_errors_on_frame(&errors, &cf, 10000));
+	ASSERT_INT_EQ(CAN_ERRORS_ACTIVE, can_errors_get_state(&errors));
+	ASSERT_UINT_EQ(1, errors.n_restarts);
+	ASSERT_UINT_EQ(10000 + HOLD_TIME,
+		       can_errors_hold_until(&errors, 10000));
+	return 0;
+}
+
+static int test_counts()
+{
+	struct can_errors errors;
+	can_errors_init(&errors, HOLD_TIME);
+
+	struct can_frame cf = make_error(CAN_ERR_TX_TIMEOUT | CAN_ERR_LOSTARB
+					 | CAN_ERR_TRX | CAN_ERR_ACK
+					 | CAN_ERR_CRTL,
+					 CAN_ERR_CRTL_RX_OVERFLOW, 0, 0);
+	ASSERT_INT_EQ(0, can_errors_on_frame(&errors, &cf, 1000));
+	ASSERT_INT_EQ(CAN_ERRORS_ACTIVE, can_errors_get_state(&errors));
+
+	ASSERT_UINT_EQ(1, errors.n_tx_timeouts);
+	ASSERT_UINT_EQ(1, errors.n_lost_arbitration);
+	ASSERT_UINT_EQ(1, errors.n_transceiver);
+	ASSERT_UINT_EQ(1, errors.n_no_ack);
+	ASSERT_UINT_EQ(1, errors.n_overflows);
+	ASSERT_UINT_EQ(0, errors.n_protocol);
+	ASSERT_UINT_EQ(1000 + HOLD_TIME, can_errors_hold_until(&errors, 1000));
+
+	ASSERT_STR_EQ("bus-off", can_errors_state_to_string(CAN_ERRORS_BUS_OFF));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_data_frame);
+	RUN_TEST(test_controller_states);
+	RUN_TEST(test_error_counters);
+	RUN_TEST(test_bus_off_and_restart);
+	RUN_TEST(test_counts);
+	return r;
+}
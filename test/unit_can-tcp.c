@@ -0,0 +1,592 @@
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include "tst.h"
+#include "mloop.h"
+#include "can-tcp.h"
+#include "sock.h"
+#include "can-wire.h"
+
+#define N_FRAMES 200
+#define N_ROUNDS 4000
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static void run_for(struct mloop* mloop, uint64_t ms)
+{
+	uint64_t end = now_ms() + ms;
+	struct pollfd pfd = { .fd = mloop_get_pollfd(mloop), .events = POLLIN };
+
+	for (uint64_t t = now_ms(); t < end; t = now_ms()) {
+		poll(&pfd, 1, end - t);
+		mloop_run_once(mloop);
+	}
+}
+
+static int is_readable(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/* All frames are sent in one write, as a peer that batches would */
+static int send_frames(int fd)
+{
+	struct can_frame cfs[N_FRAMES];
+	memset(cfs, 0, sizeof(cfs));
+
+	for (int i = 0; i < N_FRAMES; ++i) {
+		cfs[i].can_id = htonl(0x180 + i);
+		cfs[i].can_dlc = 1;
+		cfs[i].data[0] = i;
+	}
+
+	return send(fd, cfs, sizeof(cfs), 0) == sizeof(cfs) ? 0 : -1;
+}
+
+static int recv_frames(struct mloop* mloop, int fd)
+{
+	static struct can_frame cfs[N_FRAMES];
+	size_t size = 0;
+
+	for (int i = 0; i < 100 && size < sizeof(cfs); ++i) {
+		run_for(mloop, 2);
+		while (is_readable(fd) && size < sizeof(cfs)) {
+			ssize_t n = recv(fd, (char*)cfs + size,
+					 sizeof(cfs) - size, 0);
+			if (n <= 0)
+				return -1;
+			size += n;
+		}
+	}
+
+	if (size != sizeof(cfs))
+		return -1;
+
+	for (int i = 0; i < N_FRAMES; ++i)
+		if (ntohl(cfs[i].can_id) != 0x180u + i || cfs[i].data[0] != i)
+			return -1;
+
+	return 0;
+}
+
+static int test_frames_are_forwarded(int port)
+{
+	struct mloop* mloop = mloop_default();
+
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, port));
+
+	int a = can_tcp_open("127.0.0.1", port);
+	int b = can_tcp_open("127.0.0.1", port);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	run_for(mloop, 10);
+
+	ASSERT_INT_EQ(0, send_frames(a));
+	ASSERT_INT_EQ(0, recv_frames(mloop, b));
+
+	/* ...and back the other way */
+	ASSERT_INT_EQ(0, send_frames(b));
+	ASSERT_INT_EQ(0, recv_frames(mloop, a));
+
+	close(a);
+	close(b);
+	run_for(mloop, 10);
+	return 0;
+}
+
+/* A client that never reads, with as little buffer space as the kernel allows */
+static int open_stalled_client(int port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	int size = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = inet_addr("127.0.0.1"),
+	};
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Far more is sent than the stalled client can buffer, but the other client
+ * still gets all of it.
+ */
+static int flood(struct mloop* mloop, int from, int to)
+{
+	static char buffer[N_FRAMES * sizeof(struct can_frame)];
+	struct pollfd pfd = { .fd = mloop_get_pollfd(mloop), .events = POLLIN };
+
+	for (int i = 0; i < N_ROUNDS; ++i) {
+		ASSERT_INT_EQ(0, send_frames(from));
+
+		size_t size = 0;
+		uint64_t end = now_ms() + 1000;
+
+		while (size < sizeof(buffer) && now_ms() < end) {
+			poll(&pfd, 1, 1);
+			mloop_run_once(mloop);
+
+			while (size < sizeof(buffer) && is_readable(to)) {
+				ssize_t n = recv(to, buffer, sizeof(buffer) - size,
+						 0);
+				if (n <= 0)
+					return -1;
+				size += n;
+			}
+		}
+
+		ASSERT_UINT_EQ(sizeof(buffer), size);
+	}
+
+	return 0;
+}
+
+/* Drains what the bridge has sent so far and checks if it hung up after it */
+static int is_closed(int fd)
+{
+	char buffer[4096];
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	while (poll(&pfd, 1, 100) == 1) {
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int test_immediate_flush()
+{
+	can_tcp_set_flush_delay(0);
+	return test_frames_are_forwarded(15571);
+}
+
+static int test_delayed_flush()
+{
+	struct mloop* mloop = mloop_default();
+
+	can_tcp_set_flush_delay(200000);
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, 15572));
+	can_tcp_set_flush_delay(0);
+
+	int a = can_tcp_open("127.0.0.1", 15572);
+	int b = can_tcp_open("127.0.0.1", 15572);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	run_for(mloop, 10);
+
+	/* Only full queues are written out before the delay is up */
+	struct can_frame cf = { .can_id = htonl(0x181), .can_dlc = 0 };
+	ASSERT_INT_EQ(sizeof(cf), send(a, &cf, sizeof(cf), 0));
+	run_for(mloop, 20);
+	ASSERT_FALSE(is_readable(b));
+
+	run_for(mloop, 300);
+	ASSERT_TRUE(is_readable(b));
+	ASSERT_INT_EQ(sizeof(cf), recv(b, &cf, sizeof(cf), 0));
+	ASSERT_UINT_EQ(0x181, ntohl(cf.can_id));
+
+	close(a);
+	close(b);
+	run_for(mloop, 10);
+	return 0;
+}
+
+static int test_stalled_client_loses_frames()
+{
+	struct mloop* mloop = mloop_default();
+
+	can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_DROP_OLDEST);
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, 15573));
+
+	int a = can_tcp_open("127.0.0.1", 15573);
+	int b = can_tcp_open("127.0.0.1", 15573);
+	int c = open_stalled_client(15573);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	ASSERT_INT_GE(0, c);
+	run_for(mloop, 10);
+
+	ASSERT_INT_EQ(0, flood(mloop, a, b));
+	ASSERT_FALSE(is_closed(c));
+
+	close(a);
+	close(b);
+	close(c);
+	run_for(mloop, 10);
+	return 0;
+}
+
+static int test_stalled_client_is_dropped()
+{
+	struct mloop* mloop = mloop_default();
+
+	can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_DROP_CLIENT);
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, 15574));
+	can_tcp_set_overflow_policy(CAN_TCP_OVERFLOW_DROP_OLDEST);
+
+	int a = can_tcp_open("127.0.0.1", 15574);
+	int b = can_tcp_open("127.0.0.1", 15574);
+	int c = open_stalled_client(15574);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	ASSERT_INT_GE(0, c);
+	run_for(mloop, 10);
+
+	ASSERT_INT_EQ(0, flood(mloop, a, b));
+	ASSERT_TRUE(is_closed(c));
+
+	close(a);
+	close(b);
+	close(c);
+	run_for(mloop, 10);
+	return 0;
+}
+
+struct compact_request {
+	struct sock sock;
+	int rc;
+};
+
+static void* request_compact(void* ptr)
+{
+	struct compact_request* req = ptr;
+	req->rc = sock_request_compact(&req->sock, CAN_WIRE_F_TIMESTAMPS, 1000);
+	return NULL;
+}
+
+static int test_compact_client()
+{
+	struct mloop* mloop = mloop_default();
+	struct compact_request req;
+	pthread_t thread;
+
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, 15575));
+
+	int a = can_tcp_open("127.0.0.1", 15575);
+	int b = can_tcp_open("127.0.0.1", 15575);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	run_for(mloop, 10);
+
+	/* The server answers from the main loop */
+	sock_init(&req.sock, SOCK_TYPE_TCP, a, NULL);
+	pthread_create(&thread, NULL, request_compact, &req);
+	run_for(mloop, 50);
+	pthread_join(thread, NULL);
+
+	ASSERT_INT_EQ(0, req.rc);
+	ASSERT_INT_EQ(CAN_WIRE_F_TIMESTAMPS, sock_get_wire_flags(&req.sock));
+
+	/* A SYNC takes a timestamp and a header */
+	struct can_frame cf = { .can_id = htonl(0x80), .can_dlc = 0 };
+	ASSERT_INT_EQ(sizeof(cf), send(b, &cf, sizeof(cf), 0));
+	run_for(mloop, 10);
+
+	char buffer[64];
+	ASSERT_INT_EQ(12, recv(a, buffer, sizeof(buffer), MSG_PEEK));
+
+	uint64_t t = 0;
+	ASSERT_INT_EQ(1, sock_recv_batch(&req.sock, &cf, &t, 1, MSG_DONTWAIT));
+	ASSERT_UINT_EQ(0x80, cf.can_id);
+	ASSERT_UINT_GT(0, t);
+
+	/* ...and the other way, to a legacy client */
+	ASSERT_INT_EQ(0, send_frames(b));
+	struct can_frame cfs[N_FRAMES];
+	ssize_t n = 0;
+	for (int i = 0; i < 100 && n < N_FRAMES; ++i) {
+		run_for(mloop, 2);
+		ssize_t rc = sock_recv_batch(&req.sock, cfs + n, NULL,
+					     N_FRAMES - n, MSG_DONTWAIT);
+		if (rc > 0)
+			n += rc;
+	}
+
+	ASSERT_INT_EQ(N_FRAMES, n);
+	for (unsigned int i = 0; i < N_FRAMES; ++i) {
+		ASSERT_UINT_EQ(0x180 + i, cfs[i].can_id);
+		ASSERT_UINT_EQ(i & 0xff, cfs[i].data[0]);
+	}
+
+	for (int i = 0; i < N_FRAMES; ++i)
+		ASSERT_INT_EQ(sizeof(cfs[i]), sock_send(&req.sock, &cfs[i], 0));
+
+	ASSERT_INT_EQ(0, recv_frames(mloop, b));
+
+	sock_close(&req.sock);
+	close(b);
+	run_for(mloop, 10);
+	return 0;
+}
+
+static int test_compact_is_not_answered()
+{
+	struct sock sock;
+	int fds[2];
+
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	sock_init(&sock, SOCK_TYPE_TCP, fds[0], NULL);
+
+	ASSERT_INT_EQ(-1, sock_request_compact(&sock, 0, 20));
+	ASSERT_INT_EQ(-1, sock_get_wire_flags(&sock));
+
+	sock_close(&sock);
+	close(fds[1]);
+	return 0;
+}
+
+static int test_stream_is_buffered()
+{
+	struct sock sock;
+	struct can_frame cfs[N_FRAMES];
+	int fds[2];
+
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	sock_init(&sock, SOCK_TYPE_TCP, fds[0], NULL);
+
+	/* Everything that has arrived comes out of one call */
+	ASSERT_INT_EQ(0, send_frames(fds[1]));
+	ASSERT_INT_EQ(N_FRAMES, sock_recv_batch(&sock, cfs, NULL, N_FRAMES,
+						MSG_DONTWAIT));
+	for (unsigned int i = 0; i < N_FRAMES; ++i)
+		ASSERT_UINT_EQ(0x180 + i, cfs[i].can_id);
+
+	/* A frame that is cut in two is kept until the rest of it arrives */
+	struct can_frame cf = { .can_id = htonl(0x80), .can_dlc = 0 };
+	ASSERT_INT_EQ(5, send(fds[1], &cf, 5, 0));
+	ASSERT_INT_EQ(-1, sock_recv_batch(&sock, cfs, NULL, 1, MSG_DONTWAIT));
+	ASSERT_INT_EQ(sizeof(cf) - 5, send(fds[1], (char*)&cf + 5,
+					   sizeof(cf) - 5, 0));
+	ASSERT_INT_EQ(1, sock_recv_batch(&sock, cfs, NULL, 1, MSG_DONTWAIT));
+	ASSERT_UINT_EQ(0x80, cfs[0].can_id);
+
+	/* Frames left in the buffer make the socket ready */
+	ASSERT_INT_EQ(0, send_frames(fds[1]));
+	ASSERT_INT_EQ(1, sock_recv_batch(&sock, cfs, NULL, 1, MSG_DONTWAIT));
+	ASSERT_FALSE(is_readable(fds[0]));
+	ASSERT_INT_EQ(1, sock_poll(&sock, 0));
+	ASSERT_INT_EQ(N_FRAMES - 1, sock_recv_batch(&sock, cfs, NULL, N_FRAMES,
+						    MSG_DONTWAIT));
+	ASSERT_INT_EQ(0, sock_poll(&sock, 0));
+
+	close(fds[1]);
+	ASSERT_INT_EQ(0, sock_recv_batch(&sock, cfs, NULL, 1, MSG_DONTWAIT));
+
+	sock_close(&sock);
+	return 0;
+}
+
+static int recv_available(struct mloop* mloop, int fd,
+			  struct can_frame* cfs, int max)
+{
+	size_t size = 0;
+
+	run_for(mloop, 20);
+	while (is_readable(fd) && size < max * sizeof(*cfs)) {
+		ssize_t n = recv(fd, (char*)cfs + size,
+				 max * sizeof(*cfs) - size, 0);
+		if (n <= 0)
+			return -1;
+		size += n;
+	}
+
+	return size / sizeof(*cfs);
+}
+
+static int test_subscription()
+{
+	struct mloop* mloop = mloop_default();
+	struct can_frame cfs[N_FRAMES];
+	struct sock sock;
+
+	ASSERT_INT_EQ(0, can_tcp_bridge_server(NULL, 15576));
+
+	int a = can_tcp_open("127.0.0.1", 15576);
+	int b = can_tcp_open("127.0.0.1", 15576);
+	ASSERT_INT_GE(0, a);
+	ASSERT_INT_GE(0, b);
+	sock_init(&sock, SOCK_TYPE_TCP, b, NULL);
+	run_for(mloop, 10);
+
+	/* 0x185 and one extended ID */
+	struct can_filter filters[] = {
+		{ .can_id = 0x185, .can_mask = CAN_SFF_MASK },
+		{ .can_id = 0x1234 | CAN_EFF_FLAG,
+		  .can_mask = CAN_EFF_MASK | CAN_EFF_FLAG },
+	};
+
+	ASSERT_INT_EQ(0, sock_subscribe(&sock, filters, 2));
+	run_for(mloop, 10);
+
+	ASSERT_INT_EQ(0, send_frames(a));
+	struct can_frame eff = { .can_id = htonl(0x1234 | CAN_EFF_FLAG) };
+	ASSERT_INT_EQ(sizeof(eff), send(a, &eff, sizeof(eff), 0));
+	eff.can_id = htonl(0x1235 | CAN_EFF_FLAG);
+	ASSERT_INT_EQ(sizeof(eff), send(a, &eff, sizeof(eff), 0));
+
+	ASSERT_INT_EQ(2, recv_available(mloop, b, cfs, N_FRAMES));
+	ASSERT_UINT_EQ(0x185, ntohl(cfs[0].can_id));
+	ASSERT_UINT_EQ(0x1234 | CAN_EFF_FLAG, ntohl(cfs[1].can_id));
+
+	/* Subscribing to nothing gets everything back */
+	ASSERT_INT_EQ(0, sock_subscribe(&sock, NULL, 0));
+	run_for(mloop, 10);
+	ASSERT_INT_EQ(0, send_frames(a));
+	ASSERT_INT_EQ(0, recv_frames(mloop, b));
+
+	close(a);
+	close(b);
+	run_for(mloop, 10);
+	return 0;
+}
+
+static void multicast_group(char* buffer, size_t size)
+{
+	snprintf(buffer, size, "239.255.67.78:%d", 20000 + getpid() % 20000);
+}
+
+static int test_multicast()
+{
+	struct sock pub, sub;
+	struct can_frame cfs[N_FRAMES];
+	uint64_t timestamps[N_FRAMES];
+	char group[64];
+
+	multicast_group(group, sizeof(group));
+
+	ASSERT_INT_GE(0, sock_open(&pub, SOCK_TYPE_UDP, group, NULL));
+	ASSERT_INT_GE(0, sock_open(&sub, SOCK_TYPE_UDP, group, NULL));
+	ASSERT_INT_EQ(0, sock_txq_init(&pub, N_FRAMES));
+
+	for (int i = 0; i < N_FRAMES; ++i) {
+		struct can_frame cf = { .can_id = i, .can_dlc = i % 9 };
+		memset(cf.data, i, cf.can_dlc);
+		ASSERT_INT_EQ(0, sock_stage(&pub, &cf));
+	}
+
+	ASSERT_INT_EQ(0, sock_flush(&pub));
+
+	size_t count = 0;
+	while (count < N_FRAMES) {
+		ASSERT_TRUE(is_readable(sub.fd) || poll(&(struct pollfd){
+			.fd = sub.fd, .events = POLLIN }, 1, 1000) == 1);
+
+		ssize_t n = sock_recv_batch(&sub, &cfs[count],
+					    &timestamps[count],
+					    N_FRAMES - count, MSG_DONTWAIT);
+		ASSERT_INT_GT(0, n);
+		count += n;
+	}
+
+	for (unsigned int i = 0; i < N_FRAMES; ++i) {
+		unsigned int dlc = i % 9;
+		ASSERT_UINT_EQ(i, cfs[i].can_id);
+		ASSERT_UINT_EQ(dlc, cfs[i].can_dlc);
+		ASSERT_TRUE(timestamps[i] > 0);
+	}
+
+	ASSERT_UINT_EQ(0, sock_get_n_lost(&sub));
+
+	/* A socket does not hear itself */
+	ASSERT_INT_EQ(-1, sock_recv(&pub, &cfs[0], MSG_DONTWAIT));
+
+	sock_close(&pub);
+	sock_close(&sub);
+	return 0;
+}
+
+static int send_datagram(int fd, const char* group, uint32_t seq)
+{
+	uint8_t buffer[CAN_WIRE_DATAGRAM_MAX_SIZE];
+	struct can_frame cf = { .can_id = 0x80 };
+	uint64_t t = 0;
+
+	size_t size = can_wire_encode_datagram_header(buffer, 1234, seq);
+	size += can_wire_encode_timestamp(buffer + size, &t, 1);
+	size += can_wire_encode(buffer + size, &cf);
+
+	char host[64];
+	snprintf(host, sizeof(host), "%s", group);
+	char* port = strchr(host, ':');
+	*port++ = '\0';
+
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	inet_aton(host, &addr.sin_addr);
+	addr.sin_port = htons(atoi(port));
+
+	return sendto(fd, buffer, size, 0, (struct sockaddr*)&addr,
+		      sizeof(addr)) == (ssize_t)size ? 0 : -1;
+}
+
+static int test_multicast_loss()
+{
+	struct sock sub;
+	struct can_frame cf;
+	char group[64];
+
+	multicast_group(group, sizeof(group));
+
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	ASSERT_INT_GE(0, fd);
+	ASSERT_INT_GE(0, sock_open(&sub, SOCK_TYPE_UDP, group, NULL));
+
+	ASSERT_INT_EQ(0, send_datagram(fd, group, 7));
+	ASSERT_INT_EQ(sizeof(cf), sock_timed_recv(&sub, &cf, 1000));
+
+	ASSERT_INT_EQ(0, send_datagram(fd, group, 10));
+	ASSERT_INT_EQ(sizeof(cf), sock_timed_recv(&sub, &cf, 1000));
+	ASSERT_UINT_EQ(2, sock_get_n_lost(&sub));
+
+	/* Late arrivals have already been counted */
+	ASSERT_INT_EQ(0, send_datagram(fd, group, 8));
+	ASSERT_INT_EQ(sizeof(cf), sock_timed_recv(&sub, &cf, 1000));
+	ASSERT_UINT_EQ(2, sock_get_n_lost(&sub));
+
+	ASSERT_INT_EQ(0, send_datagram(fd, group, 11));
+	ASSERT_INT_EQ(sizeof(cf), sock_timed_recv(&sub, &cf, 1000));
+	ASSERT_UINT_EQ(2, sock_get_n_lost(&sub));
+
+	sock_close(&sub);
+	close(fd);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_immediate_flush);
+	RUN_TEST(test_delayed_flush);
+	RUN_TEST(test_stalled_client_loses_frames);
+	RUN_TEST(test_stalled_client_is_dropped);
+	RUN_TEST(test_compact_client);
+	RUN_TEST(test_compact_is_not_answered);
+	RUN_TEST(test_stream_is_buffered);
+	RUN_TEST(test_subscription);
+	RUN_TEST(test_multicast);
+	RUN_TEST(test_multicast_loss);
+	return r;
+}
@@ -0,0 +1,183 @@
+#include "tst.h"
+#include "can-wire.h"
+
+#include <string.h>
+#include <arpa/inet.h>
+
+static uint8_t buffer_[1024];
+
+static int roundtrip(const struct can_frame* cf, size_t expected_size)
+{
+	struct can_frame out;
+	uint64_t t = 0;
+
+	size_t size = can_wire_encode(buffer_, cf);
+	ASSERT_UINT_EQ(expected_size, size);
+	ASSERT_UINT_EQ(size, can_wire_record_size(buffer_, size));
+	ASSERT_INT_EQ(1, can_wire_decode(buffer_, &out, &t));
+
+	ASSERT_UINT_EQ(cf->can_id, out.can_id);
+	ASSERT_UINT_EQ(cf->can_dlc, out.can_dlc);
+	if (!(cf->can_id & CAN_RTR_FLAG))
+		ASSERT_INT_EQ(0, memcmp(cf->data, out.data, cf->can_dlc));
+
+	return 0;
+}
+
+static int test_standard_frames_are_small()
+{
+	struct can_frame sync = { .can_id = 0x80, .can_dlc = 0 };
+	struct can_frame heartbeat = { .can_id = 0x705, .can_dlc = 1,
+				       .data = { 5 } };
+	struct can_frame pdo = { .can_id = 0x185, .can_dlc = 8,
+				 .data = { 1, 2, 3, 4, 5, 6, 7, 8 } };
+
+	ASSERT_INT_EQ(0, roundtrip(&sync, 2));
+	ASSERT_INT_EQ(0, roundtrip(&heartbeat, 3));
+	ASSERT_INT_EQ(0, roundtrip(&pdo, 10));
+	return 0;
+}
+
+static int test_remote_requests_have_no_payload()
+{
+	struct can_frame rtr = { .can_id = 0x705 | CAN_RTR_FLAG, .can_dlc = 1 };
+	return roundtrip(&rtr, 2);
+}
+
+static int test_other_frames_are_sent_in_full()
+{
+	struct can_frame eff = { .can_id = 0x1234567 | CAN_EFF_FLAG,
+				 .can_dlc = 2, .data = { 0xaa, 0x55 } };
+
+	ASSERT_INT_EQ(0, roundtrip(&eff, 2 + sizeof(struct can_frame)));
+
+	struct can_frame wire;
+	memcpy(&wire, buffer_ + 2, sizeof(wire));
+	ASSERT_UINT_EQ(eff.can_id, ntohl(wire.can_id));
+	return 0;
+}
+
+static int test_timestamps()
+{
+	struct can_frame cf;
+	uint64_t sent = 0, received = 0;
+	size_t size = 0;
+
+	size += can_wire_encode_timestamp(buffer_ + size, &sent, 1000000000ULL);
+	ASSERT_UINT_EQ(10, size);
+
+	ASSERT_UINT_EQ(0, can_wire_encode_timestamp(buffer_ + size, &sent,
+						    1000000000ULL));
+
+	size += can_wire_encode_timestamp(buffer_ + size, &sent, 1000000250ULL);
+	ASSERT_UINT_EQ(14, size);
+
+	/* Going back in time takes a whole timestamp */
+	size += can_wire_encode_timestamp(buffer_ + size, &sent, 999999999ULL);
+	ASSERT_UINT_EQ(24, size);
+
+	size_t pos = 0;
+
+	ASSERT_INT_EQ(0, can_wire_decode(buffer_ + pos, &cf, &received));
+	ASSERT_UINT_EQ(1000000000ULL, received);
+	pos += can_wire_record_size(buffer_ + pos, size - pos);
+
+	ASSERT_INT_EQ(0, can_wire_decode(buffer_ + pos, &cf, &received));
+	ASSERT_UINT_EQ(1000000250ULL, received);
+	pos += can_wire_record_size(buffer_ + pos, size - pos);
+
+	ASSERT_INT_EQ(0, can_wire_decode(buffer_ + pos, &cf, &received));
+	ASSERT_UINT_EQ(999999999ULL, received);
+	pos += can_wire_record_size(buffer_ + pos, size - pos);
+
+	ASSERT_UINT_EQ(size, pos);
+	return 0;
+}
+
+static int test_partial_records()
+{
+	struct can_frame pdo = { .can_id = 0x185, .can_dlc = 4 };
+
+	size_t size = can_wire_encode(buffer_, &pdo);
+	ASSERT_UINT_EQ(0, can_wire_record_size(buffer_, 1));
+	ASSERT_UINT_EQ(size, can_wire_record_size(buffer_, 2));
+	return 0;
+}
+
+static int test_invalid_records()
+{
+	struct can_frame cf;
+	uint64_t t = 0;
+
+	buffer_[0] = 0;
+	buffer_[1] = 9;
+	ASSERT_INT_EQ(-1, can_wire_decode(buffer_, &cf, &t));
+	return 0;
+}
+
+static int test_hello()
+{
+	struct can_frame cf;
+
+	can_wire_make_hello(&cf, CAN_WIRE_COMPACT, CAN_WIRE_F_TIMESTAMPS);
+	ASSERT_TRUE(can_wire_is_hello(&cf));
+	ASSERT_UINT_EQ(CAN_WIRE_COMPACT, cf.data[0]);
+	ASSERT_UINT_EQ(CAN_WIRE_F_TIMESTAMPS, cf.data[1]);
+
+	cf.can_id = 0x80;
+	ASSERT_FALSE(can_wire_is_hello(&cf));
+	return 0;
+}
+
+static int test_subscription()
+{
+	struct can_frame cf;
+	struct can_filter filter = { .can_id = 0x700, .can_mask = 0x780 };
+	struct can_filter out;
+
+	can_wire_make_subscription(&cf, &filter);
+	ASSERT_TRUE(can_wire_is_subscription(&cf));
+	ASSERT_INT_EQ(0, can_wire_get_subscription(&cf, &out));
+	ASSERT_UINT_EQ(0x700, out.can_id);
+	ASSERT_UINT_EQ(0x780, out.can_mask);
+
+	can_wire_make_subscription(&cf, NULL);
+	ASSERT_TRUE(can_wire_is_subscription(&cf));
+	ASSERT_INT_EQ(-1, can_wire_get_subscription(&cf, &out));
+	return 0;
+}
+
+static int test_datagram_header()
+{
+	uint32_t source = 0, seq = 0;
+
+	size_t size = can_wire_encode_datagram_header(buffer_, 0xdeadbeef, 42);
+	ASSERT_UINT_EQ(CAN_WIRE_DATAGRAM_HEADER_SIZE, size);
+
+	ASSERT_INT_EQ(0, can_wire_decode_datagram_header(buffer_, size,
+							 &source, &seq));
+	ASSERT_UINT_EQ(0xdeadbeef, source);
+	ASSERT_UINT_EQ(42, seq);
+
+	ASSERT_INT_EQ(-1, can_wire_decode_datagram_header(buffer_, size - 1,
+							  &source, &seq));
+	buffer_[0] ^= 1;
+	ASSERT_INT_EQ(-1, can_wire_decode_datagram_header(buffer_, size,
+							  &source, &seq));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_standard_frames_are_small);
+	RUN_TEST(test_remote_requests_have_no_payload);
+	RUN_TEST(test_other_frames_are_sent_in_full);
+	RUN_TEST(test_timestamps);
+	RUN_TEST(test_partial_records);
+	RUN_TEST(test_invalid_records);
+	RUN_TEST(test_hello);
+	RUN_TEST(test_subscription);
+	RUN_TEST(test_datagram_header);
+	return r;
+}
@@ -0,0 +1,84 @@
+#include "tst.h"
+#include "canopen-driver-cxx.h"
+
+#include <stdint.h>
+#include <string.h>
+
+typedef co_pdo_layout<uint16_t, int32_t, uint8_t> status_pdo;
+typedef co_pdo_layout<float, int8_t, uint64_t> mixed_pdo;
+
+static_assert(status_pdo::size == 7, "");
+static_assert(status_pdo::field<1>::offset == 2, "");
+static_assert(status_pdo::field<2>::offset == 6, "");
+static_assert(mixed_pdo::size == 13, "");
+
+static int test_unpack()
+{
+	const uint8_t data[] = { 0x37, 0x02, 0xfe, 0xff, 0xff, 0xff, 0x08 };
+	uint16_t status = 0;
+	int32_t position = 0;
+	uint8_t mode = 0;
+
+	ASSERT_TRUE(status_pdo::unpack(data, sizeof(data), status, position,
+				       mode));
+	ASSERT_UINT_EQ(0x237, status);
+	ASSERT_INT_EQ(-2, position);
+	ASSERT_UINT_EQ(8, mode);
+
+	ASSERT_INT_EQ(-2, status_pdo::get<1>(data));
+	return 0;
+}
+
+static int test_short_pdo_is_refused()
+{
+	const uint8_t data[] = { 0x37, 0x02, 0xfe, 0xff, 0xff, 0xff };
+	uint16_t status = 1;
+	int32_t position = 2;
+	uint8_t mode = 3;
+
+	ASSERT_FALSE(status_pdo::unpack(data, sizeof(data), status, position,
+					mode));
+	ASSERT_UINT_EQ(1, status);
+	ASSERT_INT_EQ(2, position);
+	ASSERT_UINT_EQ(3, mode);
+	return 0;
+}
+
+static int test_pack()
+{
+	const uint8_t expected[] = { 0x0f, 0x00, 0x10, 0x27, 0x00, 0x00, 0x01 };
+	uint8_t data[status_pdo::size];
+
+	status_pdo::pack(data, 0x000f, 10000, 1);
+	ASSERT_INT_EQ(0, memcmp(expected, data, sizeof(data)));
+
+	status_pdo::set<2>(data, 6);
+	ASSERT_UINT_EQ(6, data[6]);
+	return 0;
+}
+
+static int test_round_trip()
+{
+	uint8_t data[mixed_pdo::size];
+	float f = 0;
+	int8_t i = 0;
+	uint64_t u = 0;
+
+	mixed_pdo::pack(data, 1.5f, -100, 0x0102030405060708ULL);
+	ASSERT_UINT_EQ(0x08, data[5]);
+	ASSERT_TRUE(mixed_pdo::unpack(data, sizeof(data), f, i, u));
+	ASSERT_DOUBLE_EQ(1.5, f);
+	ASSERT_INT_EQ(-100, i);
+	ASSERT_TRUE(u == 0x0102030405060708ULL);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_unpack);
+	RUN_TEST(test_short_pdo_is_refused);
+	RUN_TEST(test_pack);
+	RUN_TEST(test_round_trip);
+	return r;
+}
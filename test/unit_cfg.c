@@ -2,6 +2,9 @@
 #include "cfg.h"
 #include "canopen/master.h"
 
+#include <stdlib.h>
+#include <unistd.h>
+
 int cfg__load_stream(FILE* stream);
 
 static int test_priority_order(void)
@@ -18,27 +21,127 @@ static int test_priority_order(void)
 	"a=6\n"
 	"";
 
-	struct co_master_node* node;
+	struct co_master_node a = { .nodeid = 23, .name = "foobar" };
+	struct co_master_node b = { .nodeid = 42, .name = "mynode" };
+
+	FILE* stream = fmemopen((void*)text, strlen(text) + 1, "r");
+	cfg__load_stream(stream);
+	fclose(stream);
 
-	node = co_master_get_node(23);
-	strcpy(node->name, "foobar");
+	ASSERT_STR_EQ("1", cfg__file_read(&a, "a"));
+	ASSERT_STR_EQ("2", cfg__file_read(&a, "b"));
+	ASSERT_STR_EQ("3", cfg__file_read(&a, "c"));
 
-	node = co_master_get_node(42);
-	strcpy(node->name, "mynode");
+	ASSERT_STR_EQ("6", cfg__file_read(&b, "a"));
+	ASSERT_STR_EQ("5", cfg__file_read(&b, "b"));
+	ASSERT_STR_EQ("3", cfg__file_read(&b, "c"));
+
+	cfg_unload_file();
+	return 0;
+}
+
+static int test_bus_section(void)
+{
+	const char* text =
+	"[all]\n"
+	"a=1\n"
+	"[#42]\n"
+	"a=2\n"
+	"b=3\n"
+	"[can1#42]\n"
+	"a=4\n"
+	"";
+
+	static struct co_bus can0 = { .index = 0, .iface = "can0" };
+	static struct co_bus can1 = { .index = 1, .iface = "can1" };
+
+	struct co_master_node a = { .bus = &can0, .nodeid = 42 };
+	struct co_master_node b = { .bus = &can1, .nodeid = 42 };
 
 	FILE* stream = fmemopen((void*)text, strlen(text) + 1, "r");
 	cfg__load_stream(stream);
 	fclose(stream);
 
-	ASSERT_STR_EQ("1", cfg__file_read(23, "a"));
-	ASSERT_STR_EQ("2", cfg__file_read(23, "b"));
-	ASSERT_STR_EQ("3", cfg__file_read(23, "c"));
+	ASSERT_STR_EQ("2", cfg__file_read(&a, "a"));
+	ASSERT_STR_EQ("3", cfg__file_read(&a, "b"));
+
+	ASSERT_STR_EQ("4", cfg__file_read(&b, "a"));
+	ASSERT_STR_EQ("3", cfg__file_read(&b, "b"));
+
+	cfg_unload_file();
+	return 0;
+}
+
+static int write_file(const char* path, const char* text)
+{
+	FILE* stream = fopen(path, "w");
+	if (!stream)
+		return -1;
+
+	fputs(text, stream);
+	fclose(stream);
+	return 0;
+}
+
+static int accept_all_but_iface(const char* name, void* context)
+{
+	int* n_changed = context;
+	++*n_changed;
+	return strcmp(name, "iface") != 0;
+}
+
+static int test_reload(void)
+{
+	char path[] = "/tmp/unit_cfg.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_TRUE(fd >= 0);
+	close(fd);
+
+	ASSERT_INT_EQ(0, write_file(path,
+		"[master]\n"
+		"iface=can0\n"
+		"heartbeat_period=100\n"
+		"heartbeat_timeout=50\n"
+		"[#5]\n"
+		"sdo_timeout_max=2000\n"));
+
+	cfg_load_defaults();
+	ASSERT_INT_EQ(0, cfg_load_file(path));
+	cfg_load_globals();
+
+	/* As if given on the command line */
+	cfg.heartbeat_timeout = 70;
+
+	ASSERT_INT_EQ(0, write_file(path,
+		"[master]\n"
+		"iface=can1\n"
+		"heartbeat_period=200\n"
+		"heartbeat_timeout=50\n"
+		"n_timeouts_max=3\n"
+		"[#5]\n"
+		"sdo_timeout_max=3000\n"));
+
+	int n_changed = 0;
+	ASSERT_INT_EQ(0, cfg_reload_file(accept_all_but_iface, &n_changed));
+
+	ASSERT_INT_EQ(3, n_changed);
+	ASSERT_STR_EQ("can0", cfg.iface);
+	ASSERT_UINT_EQ(200, cfg.heartbeat_period);
+	ASSERT_UINT_EQ(70, cfg.heartbeat_timeout);
+	ASSERT_UINT_EQ(3, cfg.n_timeouts_max);
+
+	struct co_master_node node = { .nodeid = 5 };
+	cfg_load_node(&node);
+	ASSERT_UINT_EQ(3000, node.cfg.sdo_timeout_max);
+	ASSERT_UINT_EQ(200, node.cfg.heartbeat_period);
 
-	ASSERT_STR_EQ("6", cfg__file_read(42, "a"));
-	ASSERT_STR_EQ("5", cfg__file_read(42, "b"));
-	ASSERT_STR_EQ("3", cfg__file_read(42, "c"));
+	/* What was not taken is offered again */
+	n_changed = 0;
+	ASSERT_INT_EQ(0, cfg_reload_file(accept_all_but_iface, &n_changed));
+	ASSERT_INT_EQ(1, n_changed);
 
 	cfg_unload_file();
+	unlink(path);
 	return 0;
 }
 
@@ -46,5 +149,7 @@ int main()
 {
 	int r = 0;
 	RUN_TEST(test_priority_order);
+	RUN_TEST(test_bus_section);
+	RUN_TEST(test_reload);
 	return r;
 }
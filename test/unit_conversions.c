@@ -152,6 +152,72 @@ static int test_string_tostring()
 	return 0;
 }
 
+static int test_int_tostring__with_unknown_size()
+{
+	char buf[256];
+	uint8_t value[] = { 0xfe, 0xff, 0xaa, 0xaa };
+	struct canopen_data data = {
+		.type = CANOPEN_INTEGER16,
+		.data = value,
+		.size = sizeof(value),
+		.is_size_unknown = 1
+	};
+	ASSERT_STR_EQ("-2", canopen_data_tostring(buf, sizeof(buf), &data));
+
+	data.type = CANOPEN_UNSIGNED16;
+	ASSERT_STR_EQ("65534", canopen_data_tostring(buf, sizeof(buf), &data));
+	return 0;
+}
+
+static int test_int64_limits_tostring()
+{
+	char buf[256];
+	int64_t value = INT64_MIN;
+	struct canopen_data data = {
+		.type = CANOPEN_INTEGER64,
+		.data = &value,
+		.size = sizeof(value)
+	};
+	ASSERT_STR_EQ("-9223372036854775808",
+		      canopen_data_tostring(buf, sizeof(buf), &data));
+
+	uint64_t uvalue = UINT64_MAX;
+	data.type = CANOPEN_UNSIGNED64;
+	data.data = &uvalue;
+	ASSERT_STR_EQ("18446744073709551615",
+		      canopen_data_tostring(buf, sizeof(buf), &data));
+
+	/* Truncated to what fits */
+	ASSERT_STR_EQ("184", canopen_data_tostring(buf, 5, &data));
+	return 0;
+}
+
+static int test_data_write()
+{
+	char buf[256];
+	uint32_t value = 1234567;
+	struct canopen_data data = {
+		.type = CANOPEN_UNSIGNED32,
+		.data = &value,
+		.size = sizeof(value)
+	};
+
+	FILE* output = fmemopen(buf, sizeof(buf), "w");
+	ASSERT_INT_EQ(9, canopen_data_write(output, &data, '"'));
+
+	data.type = CANOPEN_VISIBLE_STRING;
+	data.data = "abc\0def";
+	data.size = 7;
+	ASSERT_INT_EQ(3, canopen_data_write(output, &data, '\0'));
+
+	data.type = CANOPEN_UNSIGNED8;
+	ASSERT_INT_EQ(-1, canopen_data_write(output, &data, '"'));
+	fclose(output);
+
+	ASSERT_STR_EQ("\"1234567\"abc", buf);
+	return 0;
+}
+
 static int test_bool_fromstring()
 {
 	struct canopen_data data;
@@ -176,6 +242,27 @@ static int test_uint_fromstring()
 
 	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
 							"-42"));
+
+	ASSERT_INT_EQ(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							"0x1aF"));
+	ASSERT_INT_EQ(0x1af, *(uint32_t*)data.data);
+	ASSERT_INT_EQ(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							"010"));
+	ASSERT_INT_EQ(8, *(uint32_t*)data.data);
+	ASSERT_INT_EQ(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							"0"));
+	ASSERT_INT_EQ(0, *(uint32_t*)data.data);
+
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							"08"));
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							"0x"));
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							""));
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED32,
+							" 42"));
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_UNSIGNED64,
+						"18446744073709551616"));
 	return 0;
 }
 
@@ -189,6 +276,14 @@ static int test_int_fromstring()
 
 	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_INTEGER32,
 							"foobar"));
+
+	ASSERT_INT_EQ(0, canopen_data_fromstring(&data, CANOPEN_INTEGER64,
+						"-9223372036854775808"));
+	ASSERT_TRUE(*(int64_t*)data.data == INT64_MIN);
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_INTEGER64,
+						"9223372036854775808"));
+	ASSERT_INT_LT(0, canopen_data_fromstring(&data, CANOPEN_INTEGER32,
+							"-"));
 	return 0;
 }
 
@@ -232,6 +327,9 @@ int main()
 	RUN_TEST(test_float_tostring);
 	RUN_TEST(test_double_tostring);
 	RUN_TEST(test_string_tostring);
+	RUN_TEST(test_int_tostring__with_unknown_size);
+	RUN_TEST(test_int64_limits_tostring);
+	RUN_TEST(test_data_write);
 
 	RUN_TEST(test_bool_fromstring);
 	RUN_TEST(test_uint_fromstring);
@@ -0,0 +1,176 @@
+#include "tst.h"
+#include "driver-exec.h"
+#include "co_atomic.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint32_t ids_[64];
+static int n_calls_ = 0;
+
+static void record(void* context, const struct can_frame* cf,
+		   uint64_t timestamp)
+{
+	(void)context;
+	(void)timestamp;
+
+	ids_[n_calls_++ % 64] = cf->can_id;
+}
+
+static int test_frames_are_run_in_order()
+{
+	struct drv_exec exec;
+	n_calls_ = 0;
+
+	ASSERT_INT_EQ(0, drv_exec_init(&exec, 16, "unit_driver-exec"));
+
+	for (uint32_t i = 0; i < 10; ++i) {
+		struct can_frame cf = { .can_id = 0x180 + i, .can_dlc = 1 };
+		ASSERT_INT_EQ(0, drv_exec_post(&exec, record, NULL, &cf, i));
+	}
+
+	drv_exec_flush(&exec);
+	ASSERT_INT_EQ(10, n_calls_);
+
+	for (uint32_t i = 0; i < 10; ++i)
+		ASSERT_UINT_EQ(0x180 + i, ids_[i]);
+
+	drv_exec_destroy(&exec);
+	return 0;
+}
+
+static uint8_t fd_data_[CANFD_MAX_DLEN];
+static uint64_t timestamp_;
+
+static void copy_fd_frame(void* context, const struct can_frame* cf,
+			  uint64_t timestamp)
+{
+	(void)context;
+
+	const struct canfd_frame* cfd = (const struct canfd_frame*)cf;
+	memcpy(fd_data_, cfd->data, cfd->len);
+	timestamp_ = timestamp;
+}
+
+static int test_fd_frames_are_copied()
+{
+	struct drv_exec exec;
+	struct canfd_frame cfd = { .can_id = 0x185, .len = 20 };
+
+	for (int i = 0; i < 20; ++i)
+		cfd.data[i] = i;
+
+	ASSERT_INT_EQ(0, drv_exec_init(&exec, 4, "unit_driver-exec"));
+	ASSERT_INT_EQ(0, drv_exec_post(&exec, copy_fd_frame, NULL,
+				       (const struct can_frame*)&cfd, 42));
+
+	/* The frame must not be referenced after it was posted */
+	memset(&cfd, 0, sizeof(cfd));
+
+	drv_exec_flush(&exec);
+	ASSERT_UINT_EQ(42, timestamp_);
+	ASSERT_INT_EQ(19, fd_data_[19]);
+
+	drv_exec_destroy(&exec);
+	return 0;
+}
+
+static int is_blocked_ = 0;
+
+static void block(void* context, const struct can_frame* cf,
+		  uint64_t timestamp)
+{
+	(void)context;
+	(void)cf;
+	(void)timestamp;
+
+	while (co_atomic_load(&is_blocked_))
+		usleep(1000);
+}
+
+static int test_full_ring_drops_frames()
+{
+	struct drv_exec exec;
+	struct can_frame cf = { .can_id = 0x185 };
+
+	ASSERT_INT_EQ(0, drv_exec_init(&exec, 4, "unit_driver-exec"));
+
+	co_atomic_store(&is_blocked_, 1);
+
+	int n_posted = 0;
+	for (int i = 0; i < 10; ++i)
+		if (drv_exec_post(&exec, block, NULL, &cf, 0) == 0)
+			++n_posted;
+
+	/* One may already have been taken off the ring */
+	ASSERT_TRUE(4 <= n_posted && n_posted <= 5);
+
+	co_atomic_store(&is_blocked_, 0);
+	drv_exec_flush(&exec);
+
+	ASSERT_INT_EQ(0, drv_exec_post(&exec, block, NULL, &cf, 0));
+
+	drv_exec_destroy(&exec);
+	return 0;
+}
+
+#define N_POSTERS 4
+#define N_FRAMES 10000
+
+static int n_counted_ = 0;
+
+static void count(void* context, const struct can_frame* cf,
+		  uint64_t timestamp)
+{
+	(void)context;
+	(void)cf;
+	(void)timestamp;
+
+	++n_counted_;
+}
+
+static int n_accepted_ = 0;
+
+static void* post_frames(void* context)
+{
+	struct drv_exec* exec = context;
+	struct can_frame cf = { .can_id = 0x181 };
+
+	for (int i = 0; i < N_FRAMES; ++i)
+		if (drv_exec_post(exec, count, NULL, &cf, 0) == 0)
+			co_atomic_add_fetch(&n_accepted_, 1);
+
+	return NULL;
+}
+
+static int test_concurrent_posters()
+{
+	struct drv_exec exec;
+	pthread_t threads[N_POSTERS];
+
+	ASSERT_INT_EQ(0, drv_exec_init(&exec, 64, "unit_driver-exec"));
+
+	for (int i = 0; i < N_POSTERS; ++i)
+		ASSERT_INT_EQ(0, pthread_create(&threads[i], NULL,
+						post_frames, &exec));
+
+	for (int i = 0; i < N_POSTERS; ++i)
+		pthread_join(threads[i], NULL);
+
+	drv_exec_flush(&exec);
+	ASSERT_INT_EQ(n_accepted_, n_counted_);
+
+	drv_exec_destroy(&exec);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_frames_are_run_in_order);
+	RUN_TEST(test_fd_frames_are_copied);
+	RUN_TEST(test_full_ring_drops_frames);
+	RUN_TEST(test_concurrent_posters);
+	return r;
+}
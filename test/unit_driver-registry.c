@@ -0,0 +1,80 @@
+#include "tst.h"
+#include "driver-registry.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char dir_[] = "/tmp/unit_driver-registry.XXXXXX";
+
+static void touch(const char* file)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir_, file);
+
+	FILE* stream = fopen(path, "w");
+	if (stream) {
+		fputs("not an ELF file\n", stream);
+		fclose(stream);
+	}
+}
+
+static void remove_file(const char* file)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", dir_, file);
+	unlink(path);
+}
+
+static int test_missing_drivers()
+{
+	ASSERT_TRUE(drv_registry_open("other") == NULL);
+	ASSERT_TRUE(drv_registry_open("") == NULL);
+	ASSERT_INT_EQ(-1, drv_registry_preload("other"));
+	return 0;
+}
+
+static int test_broken_drivers_are_not_retried()
+{
+	ASSERT_TRUE(drv_registry_open("SERVO") == NULL);
+	ASSERT_TRUE(drv_registry_open("servo") == NULL);
+	ASSERT_UINT_EQ(0, drv_registry_get_n_open());
+	return 0;
+}
+
+static int test_directory_is_only_scanned_once()
+{
+	touch("co_drv_late.so");
+	ASSERT_INT_EQ(0, drv_registry_scan(dir_));
+	ASSERT_INT_EQ(-1, drv_registry_preload("late"));
+	remove_file("co_drv_late.so");
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+
+	if (!mkdtemp(dir_))
+		return 1;
+
+	touch("co_drv_servo.so");
+	touch("co_drv_.so");
+	touch("other.so");
+
+	if (drv_registry_scan(dir_) < 0)
+		return 1;
+
+	RUN_TEST(test_missing_drivers);
+	RUN_TEST(test_broken_drivers_are_not_retried);
+	RUN_TEST(test_directory_is_only_scanned_once);
+
+	drv_registry_cleanup();
+
+	remove_file("co_drv_servo.so");
+	remove_file("co_drv_.so");
+	remove_file("other.so");
+	rmdir(dir_);
+	return r;
+}
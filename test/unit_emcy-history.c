@@ -0,0 +1,103 @@
+#include "tst.h"
+#include "emcy-history.h"
+#include "canopen-driver.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static const struct emcy_history_params params_ = {
+	.window = 1000000,
+	.log_interval = 10000000,
+	.log_burst = 3,
+};
+
+static struct emcy_history history_;
+
+static int add(uint16_t code, uint8_t reg, uint64_t now)
+{
+	struct co_emcy emcy = { .code = code, .reg = reg };
+	return emcy_history_add(&history_, &emcy, now, &params_);
+}
+
+static int test_repetitions_are_coalesced()
+{
+	memset(&history_, 0, sizeof(history_));
+
+	ASSERT_TRUE(add(0x8130, 0x11, 0));
+	ASSERT_FALSE(add(0x8130, 0x11, 500000));
+	ASSERT_FALSE(add(0x8130, 0x11, 1400000));
+	ASSERT_TRUE(add(0x8130, 0x01, 1500000));
+
+	ASSERT_UINT_EQ(2, emcy_history_length(&history_));
+
+	const struct emcy_record* record = emcy_history_get(&history_, 0);
+	ASSERT_UINT_EQ(3, record->count);
+	ASSERT_UINT_EQ(1400000, record->last_seen);
+
+	/* The window is counted from the last repetition */
+	ASSERT_FALSE(add(0x8130, 0x11, 2300000));
+	ASSERT_TRUE(add(0x8130, 0x11, 3400000));
+
+	ASSERT_UINT_EQ(6, history_.n_received);
+	ASSERT_UINT_EQ(3, emcy_history_take_unreported(&history_));
+	ASSERT_UINT_EQ(0, emcy_history_take_unreported(&history_));
+	return 0;
+}
+
+static int test_logging_is_rate_limited()
+{
+	memset(&history_, 0, sizeof(history_));
+
+	ASSERT_TRUE(add(1, 0, 0));
+	ASSERT_TRUE(add(2, 0, 1));
+	ASSERT_TRUE(add(3, 0, 2));
+	ASSERT_FALSE(add(4, 0, 3));
+	ASSERT_FALSE(add(5, 0, 4));
+	ASSERT_TRUE(add(6, 0, 10000000));
+
+	ASSERT_UINT_EQ(2, history_.n_suppressed);
+	ASSERT_UINT_EQ(6, emcy_history_length(&history_));
+	return 0;
+}
+
+static int test_oldest_are_overwritten()
+{
+	memset(&history_, 0, sizeof(history_));
+
+	for (int i = 0; i < EMCY_HISTORY_LENGTH + 4; ++i)
+		add(i, 0, i * 2000000ULL);
+
+	ASSERT_UINT_EQ(EMCY_HISTORY_LENGTH, emcy_history_length(&history_));
+	ASSERT_UINT_EQ(4, emcy_history_get(&history_, 0)->code);
+	ASSERT_UINT_EQ(EMCY_HISTORY_LENGTH + 3,
+		       emcy_history_get(&history_, EMCY_HISTORY_LENGTH - 1)->code);
+	return 0;
+}
+
+static int test_json()
+{
+	static char buffer[4096];
+
+	memset(&history_, 0, sizeof(history_));
+	add(0x8130, 0x11, 1000);
+	add(0x8130, 0x11, 2000);
+
+	FILE* output = fmemopen(buffer, sizeof(buffer), "w");
+	emcy_history_write_json(output, &history_, 3000000);
+	fclose(output);
+
+	ASSERT_TRUE(strstr(buffer, "\"received\":2,\"suppressed\":1") != NULL);
+	ASSERT_TRUE(strstr(buffer, "\"code\":\"0x8130\",\"register\":\"0x11\"") != NULL);
+	ASSERT_TRUE(strstr(buffer, "\"count\":2,\"first_ms_ago\":2999,\"last_ms_ago\":2998") != NULL);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_repetitions_are_coalesced);
+	RUN_TEST(test_logging_is_rate_limited);
+	RUN_TEST(test_oldest_are_overwritten);
+	RUN_TEST(test_json);
+	return r;
+}
@@ -0,0 +1,165 @@
+#include "tst.h"
+#include "event-rest.h"
+#include "canopen-driver.h"
+#include "canopen/master.h"
+#include "canopen/pdo-map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static struct co_bus bus_ = { .index = 0, .iface = "can0" };
+
+static char* format(struct event_rest_subscriber* sub, int* n_events)
+{
+	static char buffer[16384];
+
+	FILE* output = fmemopen(buffer, sizeof(buffer), "w");
+	*n_events = event_rest__format(output, sub);
+	fclose(output);
+
+	return buffer;
+}
+
+static void init_subscriber(struct event_rest_subscriber* sub, int kinds)
+{
+	memset(sub, 0, sizeof(*sub));
+	sub->kinds = kinds;
+	sub->bus = -1;
+	memset(sub->nodes, 1, sizeof(sub->nodes));
+	event_rest__subscribe(sub);
+}
+
+static int test_state_changes_are_coalesced()
+{
+	struct co_master_node node = { .bus = &bus_, .nodeid = 42 };
+	struct event_rest_subscriber sub;
+	int n_events = 0;
+
+	init_subscriber(&sub, EVENT_REST_STATE);
+
+	event_rest_publish_state(&node, "bootup");
+	event_rest_publish_state(&node, "pre-operational");
+	event_rest_publish_state(&node, "operational");
+
+	char* output = format(&sub, &n_events);
+	ASSERT_INT_EQ(1, n_events);
+	ASSERT_TRUE(strstr(output, "\"node\": 42") != NULL);
+	ASSERT_TRUE(strstr(output, "\"state\": \"operational\"") != NULL);
+
+	/* Nothing has changed since */
+	event_rest_publish_state(&node, "operational");
+	format(&sub, &n_events);
+	ASSERT_INT_EQ(0, n_events);
+
+	event_rest__unlink(&sub);
+	return 0;
+}
+
+static int test_pdo_signals_are_decoded()
+{
+	struct co_master_node node = { .bus = &bus_, .nodeid = 5 };
+	struct event_rest_subscriber sub;
+	struct pdo_map map;
+	int n_events = 0;
+
+	init_subscriber(&sub, EVENT_REST_PDO);
+
+	pdo_map_init(&map);
+	ASSERT_INT_EQ(0, pdo_map_add(&map, 0x60410010, 0));
+	ASSERT_INT_EQ(0, pdo_map_add(&map, 0x606c0020, 1));
+
+	uint8_t data[] = { 0x37, 0x02, 0xff, 0xff, 0xff, 0xff };
+	event_rest_publish_pdo(&node, 0, &map, data, sizeof(data));
+
+	char* output = format(&sub, &n_events);
+	ASSERT_INT_EQ(1, n_events);
+	ASSERT_TRUE(strstr(output, "\"pdo\": 1") != NULL);
+	ASSERT_TRUE(strstr(output, "\"0x6041:0\": 567") != NULL);
+	ASSERT_TRUE(strstr(output, "\"0x606c:0\": -1") != NULL);
+
+	event_rest_publish_pdo(&node, 1, NULL, data, 2);
+
+	output = format(&sub, &n_events);
+	ASSERT_INT_EQ(1, n_events);
+	ASSERT_TRUE(strstr(output, "\"pdo\": 2") != NULL);
+	ASSERT_TRUE(strstr(output, "\"data\": \"3702\"") != NULL);
+
+	event_rest__unlink(&sub);
+	return 0;
+}
+
+static int test_emcys_are_not_coalesced()
+{
+	struct co_master_node node = { .bus = &bus_, .nodeid = 7 };
+	struct co_master_node other = { .bus = &bus_, .nodeid = 8 };
+	struct event_rest_subscriber sub;
+	int n_events = 0;
+
+	init_subscriber(&sub, EVENT_REST_EMCY);
+	sub.nodes[8] = 0;
+
+	struct co_emcy emcy = { .code = 0x8130, .reg = 0x11 };
+	event_rest_publish_emcy(&node, &emcy);
+	event_rest_publish_emcy(&other, &emcy);
+	emcy.code = 0;
+	event_rest_publish_emcy(&node, &emcy);
+
+	char* output = format(&sub, &n_events);
+	ASSERT_INT_EQ(2, n_events);
+	ASSERT_TRUE(strstr(output, "\"code\": \"0x8130\"") != NULL);
+	ASSERT_TRUE(strstr(output, "\"node\": 8") == NULL);
+
+	format(&sub, &n_events);
+	ASSERT_INT_EQ(0, n_events);
+
+	event_rest__unlink(&sub);
+	return 0;
+}
+
+static int test_old_emcys_are_dropped()
+{
+	struct co_master_node node = { .bus = &bus_, .nodeid = 7 };
+	struct event_rest_subscriber sub;
+	int n_events = 0;
+
+	init_subscriber(&sub, EVENT_REST_EMCY);
+	format(&sub, &n_events);
+
+	struct co_emcy emcy = { .code = 0x1000 };
+	for (int i = 0; i < EVENT_REST_EMCY_MAX + 10; ++i)
+		event_rest_publish_emcy(&node, &emcy);
+
+	format(&sub, &n_events);
+	ASSERT_INT_EQ(EVENT_REST_EMCY_MAX, n_events);
+
+	event_rest__unlink(&sub);
+	return 0;
+}
+
+static int test_nothing_is_kept_without_subscribers()
+{
+	struct co_master_node node = { .bus = &bus_, .nodeid = 100 };
+	struct event_rest_subscriber sub;
+	int n_events = 0;
+
+	event_rest_publish_state(&node, "operational");
+
+	init_subscriber(&sub, EVENT_REST_STATE);
+	char* output = format(&sub, &n_events);
+	ASSERT_TRUE(strstr(output, "\"node\": 100") == NULL);
+
+	event_rest__unlink(&sub);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_state_changes_are_coalesced);
+	RUN_TEST(test_pdo_signals_are_decoded);
+	RUN_TEST(test_emcys_are_not_coalesced);
+	RUN_TEST(test_old_emcys_are_dropped);
+	RUN_TEST(test_nothing_is_kept_without_subscribers);
+	return r;
+}
@@ -0,0 +1,164 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tst.h"
+#include "event-trace.h"
+
+static char* write_json(void)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return NULL;
+
+	if (event_trace_write_json(stream) < 0) {
+		fclose(stream);
+		free(buffer);
+		return NULL;
+	}
+
+	fclose(stream);
+	return buffer;
+}
+
+static int count(const char* haystack, const char* needle)
+{
+	int n = 0;
+	for (const char* p = strstr(haystack, needle); p;
+	     p = strstr(p + 1, needle))
+		++n;
+	return n;
+}
+
+static int test_disabled_records_nothing()
+{
+	event_trace_begin(EVENT_TRACE_STARTUP, 0);
+	event_trace_end(EVENT_TRACE_STARTUP, 0);
+
+	char* json = write_json();
+	ASSERT_TRUE(json != NULL);
+	ASSERT_INT_EQ(0, count(json, "\"startup\""));
+	ASSERT_INT_EQ(0, count(json, "thread_name"));
+	free(json);
+
+	event_trace_cleanup();
+	return 0;
+}
+
+static int test_begin_end()
+{
+	ASSERT_INT_EQ(0, event_trace_enable(16));
+
+	event_trace_begin(EVENT_TRACE_START_NODES, 2);
+	event_trace_end(EVENT_TRACE_START_NODES, 2);
+	event_trace_instant(EVENT_TRACE_STARTUP, 0);
+
+	char* json = write_json();
+	ASSERT_TRUE(json != NULL);
+	ASSERT_INT_EQ(1, count(json, "\"traceEvents\""));
+	ASSERT_INT_EQ(1, count(json, "thread_name"));
+	ASSERT_INT_EQ(2, count(json, "\"start-nodes\""));
+	ASSERT_INT_EQ(1, count(json, "\"ph\":\"B\""));
+	ASSERT_INT_EQ(1, count(json, "\"ph\":\"E\""));
+	ASSERT_INT_EQ(1, count(json, "\"ph\":\"i\""));
+	ASSERT_INT_EQ(2, count(json, "{\"bus\":2}"));
+	free(json);
+
+	event_trace_cleanup();
+	return 0;
+}
+
+static int test_async_and_complete()
+{
+	ASSERT_INT_EQ(0, event_trace_enable(16));
+
+	uint32_t arg = event_trace_sdo_arg(5, 0x1018, 1);
+	event_trace_async_begin(EVENT_TRACE_SDO_TRANSFER, 0xabc, arg);
+	event_trace_async_end(EVENT_TRACE_SDO_TRANSFER, 0xabc, arg);
+	event_trace_complete(EVENT_TRACE_DRIVER_PDO, 1000, 0, 7);
+
+	char* json = write_json();
+	ASSERT_TRUE(json != NULL);
+	ASSERT_INT_EQ(2, count(json, "\"id\":\"0xabc\""));
+	ASSERT_INT_EQ(2, count(json,
+		"{\"node\":5,\"index\":\"0x1018\",\"subindex\":1}"));
+	ASSERT_INT_EQ(1, count(json, "\"ph\":\"X\""));
+	ASSERT_INT_EQ(1, count(json, "\"ts\":1.000,\"dur\":"));
+	ASSERT_INT_EQ(1, count(json, "{\"node\":7}"));
+	free(json);
+
+	event_trace_cleanup();
+	return 0;
+}
+
+static int test_oldest_are_overwritten()
+{
+	ASSERT_INT_EQ(0, event_trace_enable(5));
+
+	for (int i = 0; i < 20; ++i)
+		event_trace_instant(EVENT_TRACE_PROBE, i);
+
+	char* json = write_json();
+	ASSERT_TRUE(json != NULL);
+	/* The oldest of a full ring might be being written over */
+	ASSERT_INT_EQ(7, count(json, "\"probe\""));
+	ASSERT_INT_EQ(0, count(json, "{\"bus\":12}"));
+	ASSERT_INT_EQ(1, count(json, "{\"bus\":13}"));
+	ASSERT_INT_EQ(1, count(json, "{\"bus\":19}"));
+	free(json);
+
+	event_trace_cleanup();
+	return 0;
+}
+
+static void* record_in_thread(void* context)
+{
+	(void)context;
+	for (int i = 0; i < 100000; ++i)
+		event_trace_instant(EVENT_TRACE_DRIVER_EMCY, i);
+	return NULL;
+}
+
+static int test_thread_has_own_ring()
+{
+	pthread_t thread;
+
+	ASSERT_INT_EQ(0, event_trace_enable(64));
+	event_trace_instant(EVENT_TRACE_STARTUP, 0);
+
+	ASSERT_INT_EQ(0, pthread_create(&thread, NULL, record_in_thread, NULL));
+
+	/* The other thread may overwrite while this one reads */
+	for (int i = 0; i < 10; ++i) {
+		char* json = write_json();
+		ASSERT_TRUE(json != NULL);
+		ASSERT_INT_LE(64, count(json, "\"driver-emcy\""));
+		free(json);
+	}
+
+	pthread_join(thread, NULL);
+
+	char* json = write_json();
+	ASSERT_TRUE(json != NULL);
+	ASSERT_INT_EQ(2, count(json, "thread_name"));
+	ASSERT_INT_EQ(1, count(json, "\"startup\""));
+	ASSERT_INT_EQ(63, count(json, "\"driver-emcy\""));
+	free(json);
+
+	event_trace_cleanup();
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_disabled_records_nothing);
+	RUN_TEST(test_begin_end);
+	RUN_TEST(test_async_and_complete);
+	RUN_TEST(test_oldest_are_overwritten);
+	RUN_TEST(test_thread_has_own_ring);
+	return r;
+}
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "tst.h"
+#include "canopen/firmware.h"
+#include "canopen/sdo_req.h"
+
+#define N_STARTED_MAX 256
+
+static struct sdo_req* started[N_STARTED_MAX];
+static int n_started;
+
+/* The requests are kept here so that the test can finish them */
+int sdo_req_start(struct sdo_req* self, struct sdo_req_queue* queue)
+{
+	self->parent = queue;
+	sdo_req_ref(self);
+	started[n_started++] = self;
+	return 0;
+}
+
+static struct sdo_req* find_started(struct sdo_req_queue* queue)
+{
+	for (int i = 0; i < n_started; ++i)
+		if (started[i] && started[i]->parent == queue)
+			return started[i];
+
+	return NULL;
+}
+
+static void finish(struct sdo_req* req, enum sdo_req_status status)
+{
+	for (int i = 0; i < n_started; ++i)
+		if (started[i] == req)
+			started[i] = NULL;
+
+	req->status = status;
+	if (status == SDO_REQ_REMOTE_ABORT)
+		req->abort_code = SDO_ABORT_GENERAL;
+
+	if (req->on_done && status != SDO_REQ_CANCELLED)
+		req->on_done(req);
+
+	sdo_req_unref(req);
+}
+
+static struct fw_image* open_image(size_t size)
+{
+	char path[] = "/tmp/unit_firmware_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return NULL;
+
+	char* data = malloc(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = i;
+
+	ssize_t written = write(fd, data, size);
+	free(data);
+	close(fd);
+
+	struct fw_image* image = written == (ssize_t)size
+			       ? fw_image_open(path) : NULL;
+	unlink(path);
+	return image;
+}
+
+static int control_value(const struct sdo_req* req)
+{
+	if (req->index != FW_PROGRAM_CONTROL || req->data.index != 1)
+		return -1;
+
+	return ((const uint8_t*)req->data.data)[0];
+}
+
+static int test_image_open_fails_on_missing_file()
+{
+	ASSERT_PTR_EQ(NULL, fw_image_open("/nonexistent/firmware.bin"));
+	ASSERT_INT_EQ(ENOENT, errno);
+	return 0;
+}
+
+static int test_job_steps()
+{
+	struct sdo_req_queue queues[CANOPEN_NODEID_MAX + 1];
+	struct fw_updater updater;
+	n_started = 0;
+
+	struct fw_image* image = open_image(1000);
+	ASSERT_TRUE(image);
+
+	fw_updater_init(&updater, queues, 1);
+	ASSERT_INT_EQ(0, fw_updater_start(&updater, 5, image, 1));
+	fw_image_unref(image);
+
+	const struct fw_job* job = fw_updater_get_job(&updater, 5);
+	ASSERT_INT_EQ(FW_JOB_STOPPING, job->state);
+	ASSERT_INT_LT(0, fw_updater_start(&updater, 5, image, 1));
+	ASSERT_INT_EQ(EBUSY, errno);
+
+	struct sdo_req* req = find_started(&queues[5]);
+	ASSERT_TRUE(req);
+	ASSERT_INT_EQ(1, req->subindex);
+	ASSERT_INT_EQ(FW_PROGRAM_STOP, control_value(req));
+
+	/* The program might not have been running */
+	finish(req, SDO_REQ_REMOTE_ABORT);
+	ASSERT_INT_EQ(FW_JOB_CLEARING, job->state);
+
+	req = find_started(&queues[5]);
+	ASSERT_INT_EQ(FW_PROGRAM_CLEAR, control_value(req));
+	ASSERT_UINT_EQ(FW_CLEAR_TIMEOUT, req->timeout);
+	finish(req, SDO_REQ_OK);
+	ASSERT_INT_EQ(FW_JOB_DOWNLOADING, job->state);
+
+	req = find_started(&queues[5]);
+	ASSERT_INT_EQ(FW_PROGRAM_DATA, req->index);
+	ASSERT_UINT_EQ(1000, req->data.index);
+	ASSERT_PTR_EQ(job->image->data, req->data.data);
+	ASSERT_PTR_EQ(job->image, fw_updater_find_image(&updater,
+							job->image->path));
+	fw_image_unref(job->image);
+	finish(req, SDO_REQ_OK);
+	ASSERT_INT_EQ(FW_JOB_STARTING, job->state);
+	ASSERT_UINT_EQ(1000, fw_job_get_progress(job));
+
+	req = find_started(&queues[5]);
+	ASSERT_INT_EQ(FW_PROGRAM_START, control_value(req));
+	finish(req, SDO_REQ_OK);
+	ASSERT_INT_EQ(FW_JOB_DONE, job->state);
+	ASSERT_PTR_EQ(NULL, job->image);
+
+	fw_updater_destroy(&updater);
+	return 0;
+}
+
+static int test_failed_step()
+{
+	struct sdo_req_queue queues[CANOPEN_NODEID_MAX + 1];
+	struct fw_updater updater;
+	n_started = 0;
+
+	struct fw_image* image = open_image(100);
+	fw_updater_init(&updater, queues, 1);
+	ASSERT_INT_EQ(0, fw_updater_start(&updater, 2, image, 1));
+	fw_image_unref(image);
+
+	const struct fw_job* job = fw_updater_get_job(&updater, 2);
+
+	finish(find_started(&queues[2]), SDO_REQ_OK);
+	finish(find_started(&queues[2]), SDO_REQ_REMOTE_ABORT);
+
+	ASSERT_INT_EQ(FW_JOB_FAILED, job->state);
+	ASSERT_INT_EQ(FW_JOB_CLEARING, job->failed_state);
+	ASSERT_INT_EQ(SDO_REQ_REMOTE_ABORT, job->status);
+	ASSERT_PTR_EQ(NULL, find_started(&queues[2]));
+
+	/* A failed job can be started again */
+	image = open_image(100);
+	ASSERT_INT_EQ(0, fw_updater_start(&updater, 2, image, 1));
+	fw_image_unref(image);
+
+	/* Cancelled requests never reach on_done */
+	finish(find_started(&queues[2]), SDO_REQ_CANCELLED);
+	ASSERT_INT_EQ(FW_JOB_FAILED, job->state);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, job->status);
+
+	fw_updater_destroy(&updater);
+	return 0;
+}
+
+static int test_max_active()
+{
+	struct sdo_req_queue queues[CANOPEN_NODEID_MAX + 1];
+	struct fw_updater updater;
+	n_started = 0;
+
+	struct fw_image* image = open_image(100);
+	fw_updater_init(&updater, queues, 2);
+
+	for (int i = 1; i <= 3; ++i) {
+		ASSERT_INT_EQ(0, fw_updater_start(&updater, i, image, 1));
+		finish(find_started(&queues[i]), SDO_REQ_OK);
+	}
+
+	fw_image_unref(image);
+
+	for (int i = 1; i <= 3; ++i)
+		finish(find_started(&queues[i]), SDO_REQ_OK);
+
+	ASSERT_INT_EQ(FW_JOB_DOWNLOADING, fw_updater_get_job(&updater, 1)->state);
+	ASSERT_INT_EQ(FW_JOB_DOWNLOADING, fw_updater_get_job(&updater, 2)->state);
+	ASSERT_INT_EQ(FW_JOB_PENDING, fw_updater_get_job(&updater, 3)->state);
+	ASSERT_PTR_EQ(NULL, find_started(&queues[3]));
+	ASSERT_UINT_EQ(2, updater.n_active);
+
+	/* The waiting job takes over once a download is finished */
+	finish(find_started(&queues[2]), SDO_REQ_OK);
+	ASSERT_INT_EQ(FW_JOB_STARTING, fw_updater_get_job(&updater, 2)->state);
+	ASSERT_INT_EQ(FW_JOB_DOWNLOADING, fw_updater_get_job(&updater, 3)->state);
+	ASSERT_UINT_EQ(2, updater.n_active);
+
+	/* So it does when a download fails */
+	finish(find_started(&queues[1]), SDO_REQ_LOCAL_ABORT);
+	ASSERT_INT_EQ(FW_JOB_FAILED, fw_updater_get_job(&updater, 1)->state);
+	ASSERT_UINT_EQ(1, updater.n_active);
+
+	for (int i = 0; i < n_started; ++i)
+		if (started[i])
+			finish(started[i], SDO_REQ_OK);
+
+	for (int i = 0; i < n_started; ++i)
+		if (started[i])
+			finish(started[i], SDO_REQ_OK);
+
+	ASSERT_INT_EQ(FW_JOB_DONE, fw_updater_get_job(&updater, 2)->state);
+	ASSERT_INT_EQ(FW_JOB_DONE, fw_updater_get_job(&updater, 3)->state);
+	ASSERT_UINT_EQ(0, updater.n_active);
+
+	fw_updater_destroy(&updater);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_image_open_fails_on_missing_file);
+	RUN_TEST(test_job_steps);
+	RUN_TEST(test_failed_step);
+	RUN_TEST(test_max_active);
+	return r;
+}
@@ -0,0 +1,127 @@
+#include <pthread.h>
+#include <sched.h>
+#include "tst.h"
+#include "frame-ring.h"
+
+#define N_THREADED_FRAMES 100000
+
+static int test_init_rounds_up()
+{
+	struct frame_ring ring;
+	ASSERT_INT_EQ(0, frame_ring_init(&ring, 5));
+	ASSERT_UINT_EQ(7, ring.mask);
+	frame_ring_destroy(&ring);
+	return 0;
+}
+
+static int test_empty()
+{
+	struct frame_ring ring;
+	frame_ring_init(&ring, 4);
+	ASSERT_TRUE(frame_ring_peek(&ring) == NULL);
+	frame_ring_destroy(&ring);
+	return 0;
+}
+
+static int test_push_peek_consume()
+{
+	struct frame_ring ring;
+	frame_ring_init(&ring, 4);
+
+	struct can_frame cf = { .can_id = 0x701, .can_dlc = 1 };
+	ASSERT_INT_EQ(0, frame_ring_push(&ring, &cf, 42));
+
+	cf.can_id = 0x702;
+	ASSERT_INT_EQ(0, frame_ring_push(&ring, &cf, 43));
+
+	const struct frame_ring_entry* entry = frame_ring_peek(&ring);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(0x701, entry->cf.can_id);
+	ASSERT_UINT_EQ(42, entry->timestamp);
+	frame_ring_consume(&ring);
+
+	entry = frame_ring_peek(&ring);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(0x702, entry->cf.can_id);
+	ASSERT_UINT_EQ(43, entry->timestamp);
+	frame_ring_consume(&ring);
+
+	ASSERT_TRUE(frame_ring_peek(&ring) == NULL);
+
+	frame_ring_destroy(&ring);
+	return 0;
+}
+
+static int test_full()
+{
+	struct frame_ring ring;
+	frame_ring_init(&ring, 2);
+
+	struct can_frame cf = { 0 };
+	ASSERT_INT_EQ(0, frame_ring_push(&ring, &cf, 0));
+	ASSERT_INT_EQ(0, frame_ring_push(&ring, &cf, 0));
+	ASSERT_INT_LT(0, frame_ring_push(&ring, &cf, 0));
+	ASSERT_UINT_EQ(1, frame_ring_get_n_dropped(&ring));
+
+	frame_ring_consume(&ring);
+	ASSERT_INT_EQ(0, frame_ring_push(&ring, &cf, 0));
+
+	frame_ring_destroy(&ring);
+	return 0;
+}
+
+static void* producer(void* context)
+{
+	struct frame_ring* ring = context;
+	struct can_frame cf = { 0 };
+
+	for (uint64_t i = 0; i < N_THREADED_FRAMES; ) {
+		cf.can_id = i & CAN_SFF_MASK;
+		if (frame_ring_push(ring, &cf, i) == 0)
+			++i;
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static int test_threaded()
+{
+	struct frame_ring ring;
+	frame_ring_init(&ring, 64);
+
+	pthread_t thread;
+	ASSERT_INT_EQ(0, pthread_create(&thread, NULL, producer, &ring));
+
+	for (uint64_t i = 0; i < N_THREADED_FRAMES; ) {
+		const struct frame_ring_entry* entry = frame_ring_peek(&ring);
+		if (!entry) {
+			sched_yield();
+			continue;
+		}
+
+		ASSERT_UINT_EQ(i, entry->timestamp);
+		ASSERT_UINT_EQ(i & CAN_SFF_MASK, entry->cf.can_id);
+		frame_ring_consume(&ring);
+		++i;
+	}
+
+	pthread_join(thread, NULL);
+
+	ASSERT_TRUE(frame_ring_peek(&ring) == NULL);
+
+	frame_ring_destroy(&ring);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_init_rounds_up);
+	RUN_TEST(test_empty);
+	RUN_TEST(test_push_peek_consume);
+	RUN_TEST(test_full);
+	RUN_TEST(test_threaded);
+	return r;
+}
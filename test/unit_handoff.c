@@ -0,0 +1,237 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tst.h"
+#include "handoff.h"
+
+int handoff__read_cmdline(char* buffer, size_t size, char** argv,
+			  size_t max_args);
+
+/* More than fits into the socket buffers, so that it is sent in parts */
+#define LARGE_SIZE (4 * 1024 * 1024)
+
+struct sender {
+	int sock;
+	const void* data;
+	size_t size;
+	const int* fds;
+	size_t n_fds;
+	int rc;
+};
+
+static void* run_sender(void* context)
+{
+	struct sender* sender = context;
+	sender->rc = handoff_send(sender->sock, sender->data, sender->size,
+				  sender->fds, sender->n_fds);
+	return NULL;
+}
+
+static int test_header_is_checked()
+{
+	struct handoff_header header;
+
+	handoff_header_init(&header, 2, 3);
+	ASSERT_TRUE(handoff_header_is_valid(&header));
+	ASSERT_INT_EQ(-1, header.rest);
+
+	header.rest = 2;
+	ASSERT_TRUE(handoff_header_is_valid(&header));
+	header.rest = 3;
+	ASSERT_FALSE(handoff_header_is_valid(&header));
+
+	handoff_header_init(&header, 2, HANDOFF_MAX_FDS + 1);
+	ASSERT_FALSE(handoff_header_is_valid(&header));
+
+	handoff_header_init(&header, 2, 3);
+	header.version = HANDOFF_VERSION + 1;
+	ASSERT_FALSE(handoff_header_is_valid(&header));
+
+	handoff_header_init(&header, 2, 3);
+	header.magic[0] = 'X';
+	ASSERT_FALSE(handoff_header_is_valid(&header));
+	return 0;
+}
+
+static int test_data_and_fds_are_passed()
+{
+	int pair[2], pipe_fds[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	ASSERT_INT_EQ(0, pipe(pipe_fds));
+
+	uint8_t* data = malloc(LARGE_SIZE);
+	uint8_t* received = malloc(LARGE_SIZE);
+	ASSERT_TRUE(data && received);
+
+	for (size_t i = 0; i < LARGE_SIZE; ++i)
+		data[i] = i * 7;
+
+	struct sender sender = {
+		.sock = pair[0],
+		.data = data,
+		.size = LARGE_SIZE,
+		.fds = pipe_fds,
+		.n_fds = 2,
+	};
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, run_sender, &sender);
+
+	int fds[4];
+	size_t n_fds = 4;
+	ASSERT_INT_EQ(0, handoff_recv(pair[1], received, LARGE_SIZE, fds,
+				      &n_fds));
+
+	pthread_join(thread, NULL);
+	ASSERT_INT_EQ(0, sender.rc);
+	ASSERT_INT_EQ(0, memcmp(data, received, LARGE_SIZE));
+
+	/* They are the same pipe, by other descriptors */
+	ASSERT_UINT_EQ(2, n_fds);
+	ASSERT_TRUE(fds[0] != pipe_fds[0] && fds[1] != pipe_fds[1]);
+	ASSERT_TRUE(fcntl(fds[0], F_GETFD) & FD_CLOEXEC);
+
+	char c = 'x';
+	ASSERT_INT_EQ(1, write(fds[1], &c, 1));
+	c = 0;
+	ASSERT_INT_EQ(1, read(pipe_fds[0], &c, 1));
+	ASSERT_INT_EQ('x', c);
+
+	for (int i = 0; i < 2; ++i) {
+		close(fds[i]);
+		close(pipe_fds[i]);
+		close(pair[i]);
+	}
+
+	free(received);
+	free(data);
+	return 0;
+}
+
+static int test_fds_that_do_not_fit_are_dropped()
+{
+	int pair[2], pipe_fds[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	ASSERT_INT_EQ(0, pipe(pipe_fds));
+
+	ASSERT_INT_EQ(0, handoff_send(pair[0], "ab", 2, pipe_fds, 2));
+
+	int fd;
+	size_t n_fds = 1;
+	char buffer[2];
+	ASSERT_INT_EQ(0, handoff_recv(pair[1], buffer, 2, &fd, &n_fds));
+	ASSERT_UINT_EQ(1, n_fds);
+	ASSERT_INT_EQ(0, memcmp("ab", buffer, 2));
+
+	/* Only the originals are left of the write end */
+	close(fd);
+	close(pipe_fds[1]);
+
+	ASSERT_INT_EQ(0, read(pipe_fds[0], buffer, 1));
+
+	close(pipe_fds[0]);
+	close(pair[0]);
+	close(pair[1]);
+	return 0;
+}
+
+static int test_close_is_seen()
+{
+	int pair[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	ASSERT_INT_EQ(0, handoff_send(pair[0], "abc", 3, NULL, 0));
+	ASSERT_INT_EQ(-1, handoff_wait_close(pair[1], 10));
+	ASSERT_INT_EQ(ETIMEDOUT, errno);
+
+	close(pair[0]);
+	ASSERT_INT_EQ(0, handoff_wait_close(pair[1], 1000));
+
+	char buffer[4];
+	ASSERT_INT_EQ(-1, handoff_recv(pair[1], buffer, sizeof(buffer), NULL,
+				       NULL));
+	ASSERT_INT_EQ(EPIPE, errno);
+
+	close(pair[1]);
+	return 0;
+}
+
+static int test_half_a_message_is_an_error()
+{
+	int pair[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	ASSERT_INT_EQ(0, handoff_send(pair[0], "ab", 2, NULL, 0));
+	close(pair[0]);
+
+	char buffer[4];
+	ASSERT_INT_EQ(-1, handoff_recv(pair[1], buffer, sizeof(buffer), NULL,
+				       NULL));
+	ASSERT_INT_EQ(EPIPE, errno);
+
+	close(pair[1]);
+	return 0;
+}
+
+static int test_inherited_fd_is_taken_once()
+{
+	int pair[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+
+	ASSERT_INT_EQ(-1, handoff_get_inherited());
+
+	char value[16];
+	snprintf(value, sizeof(value), "%d", pair[1]);
+	setenv(HANDOFF_ENV, value, 1);
+
+	ASSERT_INT_EQ(pair[1], handoff_get_inherited());
+	ASSERT_TRUE(fcntl(pair[1], F_GETFD) & FD_CLOEXEC);
+	ASSERT_PTR_EQ(NULL, getenv(HANDOFF_ENV));
+	ASSERT_INT_EQ(-1, handoff_get_inherited());
+
+	setenv(HANDOFF_ENV, "3x", 1);
+	ASSERT_INT_EQ(-1, handoff_get_inherited());
+
+	close(pair[0]);
+	close(pair[1]);
+	return 0;
+}
+
+/* The new process must get the same arguments or none at all */
+static int test_long_cmdline_is_not_cut_short()
+{
+	char buffer[4096];
+	char* argv[4];
+
+	ASSERT_INT_EQ(0, handoff__read_cmdline(buffer, sizeof(buffer), argv, 4));
+	ASSERT_TRUE(argv[0] != NULL);
+	ASSERT_PTR_EQ(NULL, argv[1]);
+
+	errno = 0;
+	ASSERT_INT_EQ(-1, handoff__read_cmdline(buffer, 4, argv, 4));
+	ASSERT_INT_EQ(E2BIG, errno);
+
+	errno = 0;
+	ASSERT_INT_EQ(-1, handoff__read_cmdline(buffer, sizeof(buffer), argv,
+						1));
+	ASSERT_INT_EQ(E2BIG, errno);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_header_is_checked);
+	RUN_TEST(test_data_and_fds_are_passed);
+	RUN_TEST(test_fds_that_do_not_fit_are_dropped);
+	RUN_TEST(test_close_is_seen);
+	RUN_TEST(test_half_a_message_is_an_error);
+	RUN_TEST(test_inherited_fd_is_taken_once);
+	RUN_TEST(test_long_cmdline_is_not_cut_short);
+	return r;
+}
@@ -83,6 +83,25 @@ int test_put_with_content_length()
 	return 0;
 }
 
+int test_post_with_content_length()
+{
+	const char* text =
+	"POST /sdo/bulk HTTP/1.1\r\n"
+	"Content-Length: 13\r\n"
+	"\r\n";
+
+	struct http_req req;
+	ASSERT_INT_EQ(0, http_req_parse(&req, text));
+
+	ASSERT_INT_EQ(HTTP_POST, req.method);
+	ASSERT_INT_EQ(2, req.url_index);
+	ASSERT_STR_EQ("bulk", req.url[1]);
+	ASSERT_UINT_EQ(13, req.content_length);
+
+	http_req_free(&req);
+	return 0;
+}
+
 int test_get_with_content_type()
 {
 	const char* text =
@@ -145,6 +164,60 @@ int test_get_with_two_query_pairs()
 	return 0;
 }
 
+int test_get_with_connection_close()
+{
+	const char* text =
+	"GET / HTTP/1.1\r\n"
+	"Connection: Close\r\n"
+	"\r\n";
+
+	struct http_req req;
+	ASSERT_INT_EQ(0, http_req_parse(&req, text));
+	ASSERT_TRUE(req.close_connection);
+	http_req_free(&req);
+
+	ASSERT_INT_EQ(0, http_req_parse(&req, "GET / HTTP/1.1\r\n"
+					      "Connection: keep-alive\r\n"
+					      "\r\n"));
+	ASSERT_FALSE(req.close_connection);
+	http_req_free(&req);
+	return 0;
+}
+
+int test_req_outlives_input()
+{
+	char text[] = "PUT /sdo/0x1000?node=5 HTTP/1.1\r\n"
+		      "Content-Type: text/plain\r\n"
+		      "\r\n";
+
+	struct http_req req;
+	ASSERT_INT_EQ(0, http_req_parse(&req, text));
+	memset(text, 'x', sizeof(text) - 1);
+
+	ASSERT_INT_EQ(2, req.url_index);
+	ASSERT_STR_EQ("sdo", req.url[0]);
+	ASSERT_STR_EQ("0x1000", req.url[1]);
+	ASSERT_STR_EQ("5", http_req_query(&req, "node"));
+	ASSERT_STR_EQ("text/plain", req.content_type);
+
+	http_req_free(&req);
+	return 0;
+}
+
+int test_get_with_if_none_match()
+{
+	const char* text =
+	"GET /eds HTTP/1.1\r\n"
+	"If-None-Match: \"0123456789abcdef\"\r\n"
+	"\r\n";
+
+	struct http_req req;
+	ASSERT_INT_EQ(0, http_req_parse(&req, text));
+	ASSERT_STR_EQ("\"0123456789abcdef\"", req.if_none_match);
+	http_req_free(&req);
+	return 0;
+}
+
 int main()
 {
 	int r = 0;
@@ -153,8 +226,12 @@ int main()
 	RUN_TEST(test_get_two_elem_path);
 	RUN_TEST(test_put_empty_path);
 	RUN_TEST(test_put_with_content_length);
+	RUN_TEST(test_post_with_content_length);
 	RUN_TEST(test_get_with_content_type);
 	RUN_TEST(test_get_with_single_query);
 	RUN_TEST(test_get_with_two_query_pairs);
+	RUN_TEST(test_get_with_connection_close);
+	RUN_TEST(test_req_outlives_input);
+	RUN_TEST(test_get_with_if_none_match);
 	return r;
 }
@@ -49,12 +49,61 @@ static int test_simple_file()
 	return 0;
 }
 
+static int test_buffer()
+{
+	char text[] =
+	"[DeviceInfo]\r\n"
+	"VendorNumber = 0x42\r\n"
+	"\r\n"
+	"[1000]\n"
+	"ParameterName=Device Type\n"
+	"parametername=Device type\n"
+	"[1000]\n"
+	"DataType=0x0007\n"
+	"Empty=";
+
+	struct ini_file file;
+	ASSERT_INT_EQ(0, ini_parse_buffer(&file, text, sizeof(text) - 1));
+
+	ASSERT_UINT_EQ(4, ini_get_length(&file));
+	ASSERT_STR_EQ("0x42", ini_find(&file, "DEVICEINFO", "vendornumber"));
+
+	/* The last section and key of the same name win */
+	const struct ini_section* s = ini_find_section(&file, "1000");
+	ASSERT_TRUE(s == ini_get_section(&file, 3));
+	ASSERT_STR_EQ("0x0007", ini_find_key(s, "DataType"));
+	ASSERT_STR_EQ("", ini_find_key(s, "empty"));
+	ASSERT_TRUE(ini_find_key(s, "parametername") == NULL);
+
+	s = ini_get_section(&file, 2);
+	ASSERT_STR_EQ("Device type", ini_find_key(s, "ParameterName"));
+
+	/* Keys are interned */
+	ASSERT_TRUE(s->kv[0].key == s->kv[1].key);
+
+	ini_destroy(&file);
+	return 0;
+}
+
+static int test_invalid_line()
+{
+	char text[] = "[a]\nx=y\nnot a key\n";
+
+	struct ini_file file;
+	ASSERT_INT_EQ(-3, ini_parse_buffer(&file, text, sizeof(text) - 1));
+
+	ini_destroy(&file);
+	return 0;
+}
+
 int main()
 {
     int r = 0;
     setup();
 
     RUN_TEST(test_simple_file);
+    RUN_TEST(test_buffer);
+    RUN_TEST(test_invalid_line);
 
     cleanup();
     return r;
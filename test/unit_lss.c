@@ -0,0 +1,253 @@
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "tst.h"
+#include "fff.h"
+#include "canopen/lss.h"
+#include "socketcan.h"
+#include "sock.h"
+
+DEFINE_FFF_GLOBALS;
+
+FAKE_VALUE_FUNC(int, poll, struct pollfd*, nfds_t, int);
+FAKE_VALUE_FUNC(ssize_t, read, int, void*, size_t);
+FAKE_VALUE_FUNC(ssize_t, send, int, const void*, size_t, int);
+
+#define N_SLAVES_MAX 4
+#define N_ANSWERS_MAX 16
+
+/* LSS slaves as CiA 305 has them, answering the frames that the master sends
+ */
+struct slave {
+	struct lss_address address;
+	enum lss_mode mode;
+	int pos;
+	int nodeid;
+	int pending_nodeid;
+	int stored_nodeid;
+};
+
+static struct slave slaves_[N_SLAVES_MAX];
+static int n_slaves_;
+
+static struct can_frame answers_[N_ANSWERS_MAX];
+static int n_answers_;
+static int n_requests_;
+
+static void answer(enum lss_cs cs, int error)
+{
+	struct can_frame* cf = &answers_[n_answers_++];
+
+	memset(cf, 0, sizeof(*cf));
+	cf->can_id = R_LSS_SLAVE;
+	cf->can_dlc = 8;
+	cf->data[0] = cs;
+	cf->data[1] = error;
+}
+
+static void on_fastscan(struct slave* slave, const struct can_frame* cf)
+{
+	uint32_t id = cf->data[1] | cf->data[2] << 8 | cf->data[3] << 16
+		    | (uint32_t)cf->data[4] << 24;
+	int bit_checked = cf->data[5];
+	int sub = cf->data[6];
+	int next = cf->data[7];
+
+	if (slave->mode != LSS_MODE_WAITING
+	 || slave->nodeid != LSS_NODEID_UNCONFIGURED)
+		return;
+
+	if (bit_checked == 0x80) {
+		slave->pos = 0;
+		answer(LSS_CS_IDENTIFY_SLAVE, 0);
+		return;
+	}
+
+	if (slave->pos != sub
+	 || (uint64_t)(slave->address.field[sub] ^ id) >> bit_checked)
+		return;
+
+	answer(LSS_CS_IDENTIFY_SLAVE, 0);
+
+	if (bit_checked != 0)
+		return;
+
+	slave->pos = next;
+	if (next < sub)
+		slave->mode = LSS_MODE_CONFIGURATION;
+}
+
+static void on_request(struct slave* slave, const struct can_frame* cf)
+{
+	switch (cf->data[0]) {
+	case LSS_CS_SWITCH_STATE_GLOBAL:
+		slave->mode = cf->data[1];
+		if (slave->mode == LSS_MODE_WAITING)
+			slave->nodeid = slave->pending_nodeid;
+		break;
+	case LSS_CS_FASTSCAN:
+		on_fastscan(slave, cf);
+		break;
+	case LSS_CS_CONFIGURE_NODEID:
+		if (slave->mode != LSS_MODE_CONFIGURATION)
+			break;
+		slave->pending_nodeid = cf->data[1];
+		answer(LSS_CS_CONFIGURE_NODEID, 0);
+		break;
+	case LSS_CS_STORE_CONFIGURATION:
+		if (slave->mode != LSS_MODE_CONFIGURATION)
+			break;
+		slave->stored_nodeid = slave->pending_nodeid;
+		answer(LSS_CS_STORE_CONFIGURATION, 0);
+		break;
+	}
+}
+
+static ssize_t send_to_slaves(int fd, const void* src, size_t size,
+			      int flags)
+{
+	(void)fd;
+	(void)flags;
+
+	const struct can_frame* cf = src;
+	if (cf->can_id != R_LSS_MASTER)
+		return size;
+
+	++n_requests_;
+
+	for (int i = 0; i < n_slaves_; ++i)
+		on_request(&slaves_[i], cf);
+
+	return size;
+}
+
+static int poll_answers(struct pollfd* fds, nfds_t n, int timeout)
+{
+	(void)fds;
+	(void)n;
+	(void)timeout;
+
+	return n_answers_ > 0;
+}
+
+static ssize_t read_answer(int fd, void* dst, size_t size)
+{
+	(void)fd;
+
+	memcpy(dst, &answers_[0], size);
+	memmove(&answers_[0], &answers_[1],
+		--n_answers_ * sizeof(answers_[0]));
+	return size;
+}
+
+static void add_slave(uint32_t vendor, uint32_t product, uint32_t revision,
+		      uint32_t serial)
+{
+	struct slave* slave = &slaves_[n_slaves_++];
+
+	memset(slave, 0, sizeof(*slave));
+	slave->address.field[LSS_VENDOR_ID] = vendor;
+	slave->address.field[LSS_PRODUCT_CODE] = product;
+	slave->address.field[LSS_REVISION_NUMBER] = revision;
+	slave->address.field[LSS_SERIAL_NUMBER] = serial;
+	slave->nodeid = LSS_NODEID_UNCONFIGURED;
+	slave->pending_nodeid = LSS_NODEID_UNCONFIGURED;
+	slave->stored_nodeid = LSS_NODEID_UNCONFIGURED;
+}
+
+static void reset_bus(void)
+{
+	RESET_FAKE(poll);
+	RESET_FAKE(read);
+	RESET_FAKE(send);
+
+	poll_fake.custom_fake = poll_answers;
+	read_fake.custom_fake = read_answer;
+	send_fake.custom_fake = send_to_slaves;
+
+	n_slaves_ = 0;
+	n_answers_ = 0;
+	n_requests_ = 0;
+}
+
+static struct sock sock_ = { .fd = 42, .type = SOCK_TYPE_CAN };
+
+static int test_fastscan_finds_nothing()
+{
+	struct lss_address address;
+
+	reset_bus();
+	add_slave(1, 2, 3, 4);
+	slaves_[0].nodeid = 5;
+
+	ASSERT_INT_EQ(0, lss_fastscan(&sock_, &address, 1));
+	ASSERT_INT_EQ(1, n_requests_);
+	return 0;
+}
+
+static int test_fastscan_finds_node()
+{
+	struct lss_address address;
+
+	reset_bus();
+	add_slave(0x29c, 0x401, 0x10002, 0xdeadbeef);
+
+	ASSERT_INT_EQ(1, lss_fastscan(&sock_, &address, 1));
+	ASSERT_INT_EQ(0, memcmp(&slaves_[0].address, &address,
+				sizeof(address)));
+	ASSERT_INT_EQ(LSS_MODE_CONFIGURATION, slaves_[0].mode);
+	ASSERT_INT_EQ(1 + 4 * 33, n_requests_);
+	return 0;
+}
+
+static int test_nodes_are_commissioned_one_by_one()
+{
+	struct lss_address address;
+
+	reset_bus();
+	add_slave(0x29c, 0x401, 1, 1000);
+	add_slave(0x29c, 0x401, 1, 999);
+	add_slave(0x29c, 0x400, 2, 1000);
+
+	static const int expected[] = { 2, 1, 0 };
+
+	for (int i = 0; i < 3; ++i) {
+		ASSERT_INT_EQ(1, lss_fastscan(&sock_, &address, 1));
+
+		struct slave* slave = &slaves_[expected[i]];
+		ASSERT_INT_EQ(0, memcmp(&slave->address, &address,
+					sizeof(address)));
+
+		ASSERT_INT_EQ(0, lss_configure_nodeid(&sock_, 10 + i, 1));
+		ASSERT_INT_EQ(0, lss_store_configuration(&sock_, 1));
+		ASSERT_INT_GE(0, lss_switch_state_global(&sock_,
+							 LSS_MODE_WAITING));
+
+		ASSERT_INT_EQ(10 + i, slave->nodeid);
+		ASSERT_INT_EQ(10 + i, slave->stored_nodeid);
+	}
+
+	ASSERT_INT_EQ(0, lss_fastscan(&sock_, &address, 1));
+	return 0;
+}
+
+static int test_configure_without_node()
+{
+	reset_bus();
+
+	ASSERT_INT_EQ(-1, lss_configure_nodeid(&sock_, 10, 1));
+	ASSERT_INT_EQ(-1, lss_store_configuration(&sock_, 1));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_fastscan_finds_nothing);
+	RUN_TEST(test_fastscan_finds_node);
+	RUN_TEST(test_nodes_are_commissioned_one_by_one);
+	RUN_TEST(test_configure_without_node);
+	return r;
+}
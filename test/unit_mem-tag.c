@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include "tst.h"
+#include "mem-tag.h"
+#include "vector.h"
+
+static int n_pool_allocs_ = 0;
+static int n_pool_frees_ = 0;
+
+static void* pool_alloc(void* context, size_t size)
+{
+	++*(int*)context;
+	++n_pool_allocs_;
+	return malloc(size);
+}
+
+static void pool_free(void* context, void* ptr)
+{
+	(void)context;
+	++n_pool_frees_;
+	free(ptr);
+}
+
+static size_t pool_size(void* context, const void* ptr)
+{
+	(void)context;
+	return malloc_usable_size((void*)ptr);
+}
+
+static int test_alloc_and_free_are_counted()
+{
+	struct mem_tag_stats before, stats;
+	mem_tag_get_stats(&before, MEM_TAG_OTHER);
+
+	void* ptr = mem_alloc(MEM_TAG_OTHER, 100);
+	ASSERT_TRUE(ptr != NULL);
+
+	mem_tag_get_stats(&stats, MEM_TAG_OTHER);
+	ASSERT_UINT_EQ(before.n_allocs + 1, stats.n_allocs);
+	ASSERT_TRUE(stats.live_bytes - before.live_bytes >= 100);
+	ASSERT_TRUE(stats.peak_bytes >= stats.live_bytes);
+
+	mem_free(MEM_TAG_OTHER, ptr);
+
+	mem_tag_get_stats(&stats, MEM_TAG_OTHER);
+	ASSERT_UINT_EQ(before.n_frees + 1, stats.n_frees);
+	ASSERT_UINT_EQ(before.live_bytes, stats.live_bytes);
+	return 0;
+}
+
+static int test_peak_is_kept()
+{
+	struct mem_tag_stats before, stats;
+	mem_tag_get_stats(&before, MEM_TAG_OTHER);
+
+	void* ptr = mem_alloc(MEM_TAG_OTHER, 1 << 16);
+	ASSERT_TRUE(ptr != NULL);
+	mem_free(MEM_TAG_OTHER, ptr);
+
+	mem_tag_get_stats(&stats, MEM_TAG_OTHER);
+	ASSERT_UINT_EQ(before.live_bytes, stats.live_bytes);
+	ASSERT_TRUE(stats.peak_bytes >= before.live_bytes + (1 << 16));
+	return 0;
+}
+
+static int test_realloc_moves_the_count()
+{
+	struct mem_tag_stats before, stats;
+	mem_tag_get_stats(&before, MEM_TAG_OTHER);
+
+	char* ptr = mem_realloc(MEM_TAG_OTHER, NULL, 16);
+	ASSERT_TRUE(ptr != NULL);
+	strcpy(ptr, "hello");
+
+	ptr = mem_realloc(MEM_TAG_OTHER, ptr, 4096);
+	ASSERT_TRUE(ptr != NULL);
+	ASSERT_STR_EQ("hello", ptr);
+
+	mem_tag_get_stats(&stats, MEM_TAG_OTHER);
+	ASSERT_TRUE(stats.live_bytes - before.live_bytes >= 4096);
+
+	mem_free(MEM_TAG_OTHER, ptr);
+
+	mem_tag_get_stats(&stats, MEM_TAG_OTHER);
+	ASSERT_UINT_EQ(before.live_bytes, stats.live_bytes);
+	ASSERT_UINT_EQ(stats.n_allocs - before.n_allocs,
+		       stats.n_frees - before.n_frees);
+	return 0;
+}
+
+static int test_vectors_are_counted()
+{
+	struct mem_tag_stats before, stats;
+	struct vector vector;
+
+	mem_tag_get_stats(&before, MEM_TAG_VECTOR);
+
+	ASSERT_INT_EQ(0, vector_init(&vector, 8));
+	ASSERT_INT_EQ(0, vector_fill(&vector, 0, 1000));
+
+	mem_tag_get_stats(&stats, MEM_TAG_VECTOR);
+	ASSERT_TRUE(stats.live_bytes - before.live_bytes >= 1000);
+
+	vector_destroy(&vector);
+
+	mem_tag_get_stats(&stats, MEM_TAG_VECTOR);
+	ASSERT_UINT_EQ(before.live_bytes, stats.live_bytes);
+	return 0;
+}
+
+static int test_allocator_can_be_plugged_in()
+{
+	int n_calls = 0;
+	struct mem_allocator pool = {
+		.alloc = pool_alloc,
+		.free = pool_free,
+		.size = pool_size,
+		.context = &n_calls,
+	};
+
+	ASSERT_INT_EQ(0, mem_tag_set_allocator(MEM_TAG_INI, &pool));
+
+	char* ptr = mem_calloc(MEM_TAG_INI, 4, 8);
+	ASSERT_TRUE(ptr != NULL);
+	ASSERT_INT_EQ(1, n_calls);
+	for (int i = 0; i < 32; ++i)
+		ASSERT_INT_EQ(0, ptr[i]);
+
+	/* Without realloc, the block is moved */
+	ptr = mem_realloc(MEM_TAG_INI, ptr, 64);
+	ASSERT_TRUE(ptr != NULL);
+	ASSERT_INT_EQ(2, n_pool_allocs_);
+	ASSERT_INT_EQ(1, n_pool_frees_);
+
+	ASSERT_INT_EQ(-1, mem_tag_set_allocator(MEM_TAG_INI, NULL));
+	ASSERT_INT_EQ(EBUSY, errno);
+
+	mem_free(MEM_TAG_INI, ptr);
+	ASSERT_INT_EQ(2, n_pool_frees_);
+
+	ASSERT_INT_EQ(0, mem_tag_set_allocator(MEM_TAG_INI, NULL));
+
+	ptr = mem_alloc(MEM_TAG_INI, 8);
+	mem_free(MEM_TAG_INI, ptr);
+	ASSERT_INT_EQ(2, n_pool_allocs_);
+	return 0;
+}
+
+static int test_json_has_every_tag()
+{
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	ASSERT_TRUE(stream != NULL);
+
+	ASSERT_INT_EQ(0, mem_tag_write_json(stream));
+	fclose(stream);
+
+	for (int i = 0; i < MEM_TAG_N; ++i) {
+		char key[64];
+		snprintf(key, sizeof(key), "\"%s\":{\"live_bytes\":",
+			 mem_tag_name(i));
+		ASSERT_TRUE(strstr(buffer, key) != NULL);
+	}
+
+	ASSERT_TRUE(strstr(buffer, "\"allocs_per_s\":0.0") != NULL);
+
+	free(buffer);
+	return 0;
+}
+
+static char* write_json(void)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	if (!stream)
+		return NULL;
+
+	mem_tag_write_json(stream);
+	fclose(stream);
+	return buffer;
+}
+
+static int test_rates_are_over_sampled_windows()
+{
+	mem_tag_sample(1000000);
+
+	for (int i = 0; i < 10; ++i)
+		mem_free(MEM_TAG_EDS, mem_alloc(MEM_TAG_EDS, 16));
+
+	mem_tag_sample(3000000);
+
+	/* Readers see the same window however often they read */
+	for (int i = 0; i < 2; ++i) {
+		char* buffer = write_json();
+		ASSERT_TRUE(buffer != NULL);
+
+		char* eds = strstr(buffer, "\"eds\":");
+		ASSERT_TRUE(eds != NULL);
+		ASSERT_TRUE(strstr(eds, "\"allocs_per_s\":5.0") != NULL);
+		free(buffer);
+	}
+
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_alloc_and_free_are_counted);
+	RUN_TEST(test_peak_is_kept);
+	RUN_TEST(test_realloc_moves_the_count);
+	RUN_TEST(test_vectors_are_counted);
+	RUN_TEST(test_allocator_can_be_plugged_in);
+	RUN_TEST(test_json_has_every_tag);
+	RUN_TEST(test_rates_are_over_sampled_windows);
+	return r;
+}
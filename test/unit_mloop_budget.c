@@ -0,0 +1,262 @@
+#include <time.h>
+#include <unistd.h>
+#include "tst.h"
+#include "mloop.h"
+
+#define N_JOBS 100
+
+static int n_run;
+static useconds_t job_time;
+
+static void on_async(struct mloop_async* async)
+{
+	(void)async;
+
+	if (job_time)
+		usleep(job_time);
+
+	++n_run;
+}
+
+static void start_jobs(struct mloop* mloop, int n)
+{
+	for (int i = 0; i < n; ++i) {
+		struct mloop_async* async = mloop_async_new(mloop);
+		mloop_async_set_callback(async, on_async);
+		mloop_async_start(async);
+		mloop_async_unref(async);
+	}
+}
+
+static int test_burst_is_drained_at_once()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_job_budget(mloop, 1000, 0);
+	n_run = 0;
+	job_time = 0;
+
+	start_jobs(mloop, N_JOBS);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_EQ(N_JOBS, n_run);
+
+	struct mloop_stats stats;
+	mloop_get_stats(mloop, &stats);
+	ASSERT_UINT_EQ(1, stats.n_iterations);
+	ASSERT_UINT_EQ(0, stats.n_job_budget_hits);
+	ASSERT_UINT_EQ(0, stats.n_time_budget_hits);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_job_budget()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_job_budget(mloop, 30, 0);
+	n_run = 0;
+	job_time = 0;
+
+	start_jobs(mloop, N_JOBS);
+
+	mloop_run_once(mloop);
+	ASSERT_INT_EQ(30, n_run);
+
+	for (int i = 0; i < 3; ++i)
+		mloop_run_once(mloop);
+	ASSERT_INT_EQ(N_JOBS, n_run);
+
+	struct mloop_stats stats;
+	mloop_get_stats(mloop, &stats);
+	ASSERT_UINT_EQ(4, stats.n_iterations);
+	ASSERT_UINT_EQ(3, stats.n_job_budget_hits);
+	ASSERT_UINT_EQ(0, stats.n_time_budget_hits);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_time_budget()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_job_budget(mloop, 1000, 5000);
+	n_run = 0;
+	job_time = 2000;
+
+	start_jobs(mloop, 20);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_GE(1, n_run);
+	ASSERT_INT_LE(3, n_run);
+
+	struct mloop_stats stats;
+	mloop_get_stats(mloop, &stats);
+	ASSERT_UINT_EQ(1, stats.n_time_budget_hits);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static int n_idle_run;
+
+static int idle_cond(struct mloop_idle* idle)
+{
+	(void)idle;
+	return 1;
+}
+
+static void on_idle(struct mloop_idle* idle)
+{
+	(void)idle;
+	++n_idle_run;
+}
+
+/* Idle jobs get their turn even when async jobs use up all the time */
+static int test_idle_is_not_starved()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_job_budget(mloop, 1000, 1000);
+	n_run = 0;
+	n_idle_run = 0;
+	job_time = 2000;
+
+	struct mloop_idle* idle = mloop_idle_new(mloop);
+	mloop_idle_set_cond_fn(idle, idle_cond);
+	mloop_idle_set_idle_fn(idle, on_idle);
+	mloop_idle_start(idle);
+
+	start_jobs(mloop, 10);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_EQ(1, n_run);
+	ASSERT_INT_EQ(1, n_idle_run);
+
+	/* Each polled job gets one turn per iteration */
+	job_time = 0;
+	mloop_run_once(mloop);
+	ASSERT_INT_EQ(2, n_idle_run);
+
+	mloop_idle_stop(idle);
+	mloop_idle_unref(idle);
+	mloop_free(mloop);
+	return 0;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int order[2];
+
+static void on_ordered(struct mloop_async* async)
+{
+	int* id = mloop_async_get_context(async);
+
+	order[n_run++] = *id;
+	if (*id == 0)
+		usleep(3000);
+}
+
+static void start_mixed_jobs(struct mloop* mloop)
+{
+	static int ids[] = { 0, 1 };
+
+	/* The background job is queued first at the highest priority */
+	struct mloop_async* background = mloop_async_new(mloop);
+	mloop_async_set_context(background, &ids[0], NULL);
+	mloop_async_set_callback(background, on_ordered);
+	mloop_async_set_priority(background, 0);
+	mloop_async_start(background);
+	mloop_async_unref(background);
+
+	struct mloop_async* urgent = mloop_async_new(mloop);
+	mloop_async_set_context(urgent, &ids[1], NULL);
+	mloop_async_set_callback(urgent, on_ordered);
+	mloop_async_set_priority(urgent, 1000);
+	mloop_async_set_deadline(urgent, now_ns() + 1000000ULL);
+	mloop_async_start(urgent);
+	mloop_async_unref(urgent);
+}
+
+static int test_deadlines()
+{
+	struct mloop_stats stats;
+	struct mloop* mloop = mloop_new();
+	mloop_set_job_budget(mloop, 1000, 0);
+	n_run = 0;
+
+	start_mixed_jobs(mloop);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_EQ(0, order[0]);
+	ASSERT_INT_EQ(1, order[1]);
+
+	mloop_get_stats(mloop, &stats);
+	ASSERT_UINT_EQ(1, stats.n_deadline_jobs);
+	ASSERT_UINT_EQ(1, stats.n_deadline_misses);
+	ASSERT_TRUE(stats.max_lateness_ns >= 1000000ULL);
+
+	mloop_set_scheduling(mloop, MLOOP_SCHED_EDF);
+	n_run = 0;
+
+	start_mixed_jobs(mloop);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_EQ(1, order[0]);
+	ASSERT_INT_EQ(0, order[1]);
+
+	mloop_get_stats(mloop, &stats);
+	ASSERT_UINT_EQ(2, stats.n_deadline_jobs);
+	ASSERT_UINT_EQ(1, stats.n_deadline_misses);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static void on_work(struct mloop_work* work)
+{
+	(void)work;
+}
+
+/* Work without a done_fn is accounted for by the worker */
+static int test_work_deadline()
+{
+	struct mloop_stats stats;
+	struct mloop* mloop = mloop_new();
+	mloop_set_scheduling(mloop, MLOOP_SCHED_EDF);
+	ASSERT_INT_EQ(0, mloop_require_workers(1));
+
+	struct mloop_work* work = mloop_work_new(mloop);
+	mloop_work_set_work_fn(work, on_work);
+	mloop_work_set_deadline(work, now_ns() - 1000000ULL);
+	ASSERT_INT_EQ(0, mloop_work_start(work));
+	mloop_work_unref(work);
+
+	for (int i = 0; i < 100; ++i) {
+		mloop_get_stats(mloop, &stats);
+		if (stats.n_deadline_jobs)
+			break;
+		usleep(1000);
+	}
+
+	ASSERT_UINT_EQ(1, stats.n_deadline_jobs);
+	ASSERT_UINT_EQ(1, stats.n_deadline_misses);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_burst_is_drained_at_once);
+	RUN_TEST(test_job_budget);
+	RUN_TEST(test_time_budget);
+	RUN_TEST(test_idle_is_not_starved);
+	RUN_TEST(test_deadlines);
+	RUN_TEST(test_work_deadline);
+	return r;
+}
@@ -0,0 +1,111 @@
+#include "tst.h"
+#include "mloop.h"
+
+static struct mloop_prof prof;
+
+static int test_objects_are_reused()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_profiling(mloop, 1, 0);
+
+	struct mloop_socket* socket = mloop_socket_new(mloop);
+	mloop_socket_unref(socket);
+
+	ASSERT_PTR_EQ(socket, mloop_socket_new(mloop));
+	ASSERT_INT_EQ(-1, mloop_socket_get_fd(socket));
+	ASSERT_PTR_EQ(NULL, mloop_socket_get_context(socket));
+
+	/* Timers are sockets, but they come from a cache of their own */
+	struct mloop_timer* timer = mloop_timer_new(mloop);
+	ASSERT_TRUE((void*)timer != (void*)socket);
+	mloop_timer_unref(timer);
+	mloop_socket_unref(socket);
+
+	ASSERT_PTR_EQ(timer, mloop_timer_new(mloop));
+	mloop_timer_unref(timer);
+
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_TRUE(prof.allocs[MLOOP_PROF_SOCKET].n_allocated >= 2);
+	ASSERT_TRUE(prof.allocs[MLOOP_PROF_SOCKET].n_reused >= 1);
+	ASSERT_TRUE(prof.allocs[MLOOP_PROF_TIMER].n_reused >= 1);
+	ASSERT_UINT_EQ(1, prof.allocs[MLOOP_PROF_TIMER].n_cached);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static void on_async(struct mloop_async* async)
+{
+	(void)async;
+}
+
+/* Jobs are freed by the loop once they have run */
+static int test_cache_is_bounded()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_profiling(mloop, 1, 0);
+	mloop_set_object_cache_size(8);
+
+	for (int i = 0; i < 100; ++i)
+		mloop_post(mloop, on_async, NULL, NULL);
+
+	mloop_run_once(mloop);
+	mloop_run_once(mloop);
+
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(8, prof.allocs[MLOOP_PROF_ASYNC].n_cached);
+
+	mloop_set_object_cache_size(0);
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(0, prof.allocs[MLOOP_PROF_ASYNC].n_cached);
+
+	struct mloop_async* async = mloop_async_new(mloop);
+	mloop_async_unref(async);
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(0, prof.allocs[MLOOP_PROF_ASYNC].n_cached);
+
+	mloop_set_object_cache_size(64);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_reserved_objects_are_used()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_profiling(mloop, 1, 0);
+	mloop_set_object_cache_size(0);
+
+	ASSERT_INT_EQ(0, mloop_reserve_objects(100));
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(100, prof.allocs[MLOOP_PROF_ASYNC].n_cached);
+	ASSERT_UINT_EQ(100, prof.allocs[MLOOP_PROF_IDLE].n_cached);
+
+	uint64_t n_allocated = prof.allocs[MLOOP_PROF_ASYNC].n_allocated;
+	uint64_t n_reused = prof.allocs[MLOOP_PROF_ASYNC].n_reused;
+
+	for (int i = 0; i < 100; ++i)
+		mloop_post(mloop, on_async, NULL, NULL);
+
+	mloop_run_once(mloop);
+	mloop_run_once(mloop);
+
+	/* None came from the heap, and all went back */
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(100, prof.allocs[MLOOP_PROF_ASYNC].n_allocated
+			    - n_allocated);
+	ASSERT_UINT_EQ(100, prof.allocs[MLOOP_PROF_ASYNC].n_reused - n_reused);
+	ASSERT_UINT_EQ(100, prof.allocs[MLOOP_PROF_ASYNC].n_cached);
+
+	mloop_set_object_cache_size(64);
+	mloop_free(mloop);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_objects_are_reused);
+	RUN_TEST(test_cache_is_bounded);
+	RUN_TEST(test_reserved_objects_are_used);
+	return r;
+}
@@ -0,0 +1,155 @@
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tst.h"
+#include "mloop.h"
+
+static struct mloop_prof prof;
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static void run_for(struct mloop* mloop, uint64_t ms)
+{
+	uint64_t end = now_ms() + ms;
+	struct pollfd pfd = { .fd = mloop_get_pollfd(mloop), .events = POLLIN };
+
+	for (uint64_t t = now_ms(); t < end; t = now_ms()) {
+		poll(&pfd, 1, end - t);
+		mloop_run_once(mloop);
+	}
+}
+
+static void quick_job(struct mloop_async* async)
+{
+	(void)async;
+}
+
+static void slow_job(struct mloop_async* async)
+{
+	(void)async;
+	usleep(3000);
+}
+
+static const struct mloop_prof_site* find_site(const void* fn)
+{
+	for (size_t i = 0; i < prof.n_sites; ++i)
+		if (prof.sites[i].fn == fn)
+			return &prof.sites[i];
+
+	return NULL;
+}
+
+static int test_off_by_default()
+{
+	struct mloop* mloop = mloop_new();
+
+	ASSERT_INT_LT(0, mloop_get_profile(mloop, &prof));
+	ASSERT_INT_EQ(ENOENT, errno);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_sites_and_stalls()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_profiling(mloop, 1, 2000);
+
+	for (int i = 0; i < 10; ++i)
+		mloop_post(mloop, quick_job, NULL, NULL);
+	mloop_post(mloop, slow_job, NULL, NULL);
+
+	mloop_run_once(mloop);
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+
+	ASSERT_UINT_EQ(11, prof.time[MLOOP_PROF_ASYNC].count);
+	ASSERT_UINT_EQ(2, prof.n_sites);
+	ASSERT_UINT_EQ(11, prof.async_jobs.max);
+
+	const struct mloop_prof_site* quick = find_site(quick_job);
+	const struct mloop_prof_site* slow = find_site(slow_job);
+	ASSERT_TRUE(quick && slow);
+	ASSERT_UINT_EQ(10, quick->time.count);
+	ASSERT_UINT_EQ(1, slow->time.count);
+	ASSERT_UINT_GE(3000, slow->time.max_us);
+	ASSERT_INT_EQ(MLOOP_PROF_ASYNC, slow->type);
+
+	/* 3 ms falls into the bucket for 2048 to 4095 us */
+	ASSERT_UINT_EQ(1, slow->time.buckets[12]);
+
+	ASSERT_UINT_EQ(1, prof.n_stalls);
+	ASSERT_TRUE(prof.last_stall.fn == slow_job);
+
+	/* Turning it on again starts over */
+	mloop_set_profiling(mloop, 0, 0);
+	mloop_set_profiling(mloop, 1, 0);
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(0, prof.n_sites);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static void on_timeout(struct mloop_timer* timer)
+{
+	(void)timer;
+}
+
+static int test_timer_lag()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_profiling(mloop, 1, 0);
+
+	struct mloop_timer* timer = mloop_timer_new(mloop);
+	mloop_timer_set_time(timer, 5000000ULL);
+	mloop_timer_set_callback(timer, on_timeout);
+	mloop_timer_start(timer);
+
+	/* The loop is late for the timer on purpose */
+	usleep(20000);
+	run_for(mloop, 5);
+
+	ASSERT_INT_EQ(0, mloop_get_profile(mloop, &prof));
+	ASSERT_UINT_EQ(1, prof.time[MLOOP_PROF_TIMER].count);
+	ASSERT_UINT_EQ(1, prof.timer_lag.count);
+	ASSERT_UINT_GE(10000, prof.timer_lag.max_us);
+	ASSERT_TRUE(find_site(on_timeout) != NULL);
+	ASSERT_TRUE(prof.dispatch_lag.count >= 1);
+
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_describe()
+{
+	char name[256];
+
+	/* It may be found under an alias */
+	mloop_prof_describe(dlsym(RTLD_DEFAULT, "free"), name, sizeof(name));
+	ASSERT_TRUE(strstr(name, "free") != NULL);
+	ASSERT_TRUE(strchr(name, '+') == NULL);
+
+	mloop_prof_describe(quick_job, name, sizeof(name));
+	ASSERT_TRUE(strlen(name) > 0);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_off_by_default);
+	RUN_TEST(test_sites_and_stalls);
+	RUN_TEST(test_timer_lag);
+	RUN_TEST(test_describe);
+	return r;
+}
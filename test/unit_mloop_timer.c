@@ -0,0 +1,296 @@
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include "tst.h"
+#include "mloop.h"
+
+#define N_TIMERS 100
+
+struct expiry {
+	struct mloop_timer* timer;
+	uint64_t timeout;
+	uint64_t start;
+	uint64_t fired;
+	int count;
+};
+
+static struct expiry* fire_order[N_TIMERS];
+static int n_fired;
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_for(struct mloop* mloop, uint64_t ms)
+{
+	uint64_t end = now_ms() + ms;
+	struct pollfd pfd = { .fd = mloop_get_pollfd(mloop), .events = POLLIN };
+
+	for (uint64_t t = now_ms(); t < end; t = now_ms()) {
+		poll(&pfd, 1, end - t);
+		mloop_run_once(mloop);
+	}
+}
+
+static void on_timeout(struct mloop_timer* timer)
+{
+	struct expiry* expiry = mloop_timer_get_context(timer);
+
+	expiry->fired = now_ns();
+	++expiry->count;
+
+	if (n_fired < N_TIMERS)
+		fire_order[n_fired++] = expiry;
+}
+
+static struct mloop_timer* new_timer(struct mloop* mloop,
+				     struct expiry* expiry, uint64_t ms)
+{
+	struct mloop_timer* timer = mloop_timer_new(mloop);
+
+	expiry->timer = timer;
+	expiry->timeout = ms;
+	expiry->count = 0;
+
+	mloop_timer_set_time(timer, ms * 1000000ULL);
+	mloop_timer_set_context(timer, expiry, NULL);
+	mloop_timer_set_callback(timer, on_timeout);
+	return timer;
+}
+
+static int start(struct expiry* expiry)
+{
+	expiry->start = now_ns();
+	return mloop_timer_start(expiry->timer);
+}
+
+static int test_one_shot()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry;
+	struct mloop_timer* timer = new_timer(mloop, &expiry, 20);
+
+	ASSERT_INT_EQ(0, start(&expiry));
+	ASSERT_TRUE(mloop_timer_is_started(timer));
+	ASSERT_INT_LT(0, mloop_timer_start(timer));
+
+	run_for(mloop, 50);
+
+	ASSERT_INT_EQ(1, expiry.count);
+	ASSERT_UINT_GE(20000000ULL, expiry.fired - expiry.start);
+	ASSERT_FALSE(mloop_timer_is_started(timer));
+	ASSERT_INT_LT(0, mloop_timer_stop(timer));
+
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_periodic()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry;
+	struct mloop_timer* timer = new_timer(mloop, &expiry, 10);
+	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+
+	ASSERT_INT_EQ(0, start(&expiry));
+	run_for(mloop, 55);
+
+	ASSERT_INT_EQ(5, expiry.count);
+	ASSERT_TRUE(mloop_timer_is_started(timer));
+
+	ASSERT_INT_EQ(0, mloop_timer_stop(timer));
+	run_for(mloop, 20);
+	ASSERT_INT_EQ(5, expiry.count);
+
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_absolute()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry;
+	struct mloop_timer* timer = new_timer(mloop, &expiry, 0);
+	mloop_timer_set_type(timer, MLOOP_TIMER_ABSOLUTE);
+
+	uint64_t deadline = now_ns() + 15000000ULL;
+	mloop_timer_set_time(timer, deadline);
+	ASSERT_INT_EQ(0, start(&expiry));
+
+	run_for(mloop, 40);
+
+	ASSERT_INT_EQ(1, expiry.count);
+	ASSERT_TRUE(expiry.fired >= deadline);
+
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+/* Like the heartbeat timer, which is restarted for every heartbeat */
+static int test_restart_postpones()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry;
+	struct mloop_timer* timer = new_timer(mloop, &expiry, 30);
+
+	ASSERT_INT_EQ(0, start(&expiry));
+
+	for (int i = 0; i < 10; ++i) {
+		run_for(mloop, 5);
+		mloop_timer_stop(timer);
+		ASSERT_INT_EQ(0, start(&expiry));
+	}
+
+	ASSERT_INT_EQ(0, expiry.count);
+
+	run_for(mloop, 50);
+	ASSERT_INT_EQ(1, expiry.count);
+	ASSERT_UINT_GE(30000000ULL, expiry.fired - expiry.start);
+
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+static struct mloop_timer* pair[2];
+
+static void on_timeout_stop_pair(struct mloop_timer* timer)
+{
+	on_timeout(timer);
+	mloop_timer_stop(pair[0]);
+	mloop_timer_stop(pair[1]);
+}
+
+/* Whichever of the two fires first stops the other one */
+static int test_stop_from_callback()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry a, b;
+	pair[0] = new_timer(mloop, &a, 10);
+	pair[1] = new_timer(mloop, &b, 10);
+
+	mloop_timer_set_callback(pair[0], on_timeout_stop_pair);
+	mloop_timer_set_callback(pair[1], on_timeout_stop_pair);
+
+	ASSERT_INT_EQ(0, start(&a));
+	ASSERT_INT_EQ(0, start(&b));
+
+	run_for(mloop, 30);
+
+	ASSERT_INT_EQ(1, a.count + b.count);
+
+	mloop_timer_unref(pair[0]);
+	mloop_timer_unref(pair[1]);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_order()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry[N_TIMERS];
+
+	/* Spread over the first two levels of the wheel, in reverse order */
+	for (int i = 0; i < N_TIMERS; ++i) {
+		new_timer(mloop, &expiry[i], 2 * (N_TIMERS - i));
+		ASSERT_INT_EQ(0, start(&expiry[i]));
+	}
+
+	n_fired = 0;
+	run_for(mloop, 2 * N_TIMERS + 50);
+
+	ASSERT_INT_EQ(N_TIMERS, n_fired);
+
+	for (unsigned int i = 0; i < N_TIMERS; ++i) {
+		struct expiry* e = fire_order[i];
+
+		ASSERT_INT_EQ(1, e->count);
+		ASSERT_UINT_EQ(2 * (i + 1), e->timeout);
+		ASSERT_UINT_GE(e->timeout * 1000000ULL, e->fired - e->start);
+	}
+
+	for (int i = 0; i < N_TIMERS; ++i)
+		mloop_timer_unref(expiry[i].timer);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+static int test_far_future()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry far, near;
+	struct mloop_timer* tf = new_timer(mloop, &far, 1ULL << 40);
+	struct mloop_timer* tn = new_timer(mloop, &near, 10);
+
+	ASSERT_INT_EQ(0, start(&far));
+	ASSERT_INT_EQ(0, start(&near));
+
+	run_for(mloop, 30);
+
+	ASSERT_INT_EQ(0, far.count);
+	ASSERT_INT_EQ(1, near.count);
+	ASSERT_TRUE(mloop_timer_is_started(tf));
+
+	mloop_timer_unref(tf);
+	mloop_timer_unref(tn);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int next_fd()
+{
+	int fd = dup(0);
+	close(fd);
+	return fd;
+}
+
+static int test_timers_share_fd()
+{
+	struct mloop* mloop = mloop_new();
+	struct expiry expiry[N_TIMERS];
+
+	int fd = next_fd();
+
+	for (int i = 0; i < N_TIMERS; ++i) {
+		new_timer(mloop, &expiry[i], 1000);
+		ASSERT_INT_EQ(0, start(&expiry[i]));
+	}
+
+	ASSERT_INT_EQ(fd, next_fd());
+
+	for (int i = 0; i < N_TIMERS; ++i) {
+		mloop_timer_stop(expiry[i].timer);
+		mloop_timer_unref(expiry[i].timer);
+	}
+
+	mloop_free(mloop);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_one_shot);
+	RUN_TEST(test_periodic);
+	RUN_TEST(test_absolute);
+	RUN_TEST(test_restart_postpones);
+	RUN_TEST(test_stop_from_callback);
+	RUN_TEST(test_order);
+	RUN_TEST(test_far_future);
+	RUN_TEST(test_timers_share_fd);
+	return r;
+}
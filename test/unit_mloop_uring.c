@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "tst.h"
+#include "mloop.h"
+
+static uint64_t now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000ULL;
+}
+
+static void run_for(struct mloop* mloop, uint64_t ms)
+{
+	uint64_t end = now_ms() + ms;
+	struct pollfd pfd = { .fd = mloop_get_pollfd(mloop), .events = POLLIN };
+
+	for (uint64_t t = now_ms(); t < end; t = now_ms()) {
+		poll(&pfd, 1, end - t);
+		mloop_run_once(mloop);
+	}
+}
+
+static struct mloop* new_uring_mloop()
+{
+	struct mloop* mloop = mloop_new_with_flags(MLOOP_F_IO_URING);
+	if (!mloop)
+		fprintf(stderr, "io_uring is not available: %s\n",
+			strerror(errno));
+	return mloop;
+}
+
+static int n_reads;
+static int read_limit;
+
+/* Reads one byte per event so that the rest has to be delivered again */
+static void on_readable(struct mloop_socket* socket)
+{
+	char c;
+	if (n_reads < read_limit && read(mloop_socket_get_fd(socket), &c, 1) == 1)
+		++n_reads;
+}
+
+static int test_fallback_to_epoll()
+{
+	struct mloop* mloop = mloop_new_with_flags(MLOOP_F_EPOLL);
+	ASSERT_TRUE(mloop);
+	ASSERT_INT_EQ(MLOOP_F_EPOLL, mloop_get_flags(mloop));
+	mloop_free(mloop);
+
+	ASSERT_PTR_EQ(NULL, mloop_new_with_flags(0x100));
+	ASSERT_INT_EQ(EINVAL, errno);
+	return 0;
+}
+
+static int test_socket_is_level_triggered()
+{
+	struct mloop* mloop = new_uring_mloop();
+	ASSERT_TRUE(mloop);
+	ASSERT_INT_EQ(MLOOP_F_IO_URING, mloop_get_flags(mloop));
+
+	int fds[2];
+	ASSERT_INT_EQ(0, pipe(fds));
+
+	struct mloop_socket* socket = mloop_socket_new(mloop);
+	mloop_socket_set_fd(socket, fds[0]);
+	mloop_socket_set_callback(socket, on_readable);
+	ASSERT_INT_EQ(0, mloop_socket_start(socket));
+
+	n_reads = 0;
+	read_limit = 100;
+	ASSERT_INT_EQ(5, write(fds[1], "hello", 5));
+
+	run_for(mloop, 30);
+	ASSERT_INT_EQ(5, n_reads);
+
+	/* Nothing is delivered once the socket is stopped */
+	ASSERT_INT_EQ(0, mloop_socket_stop(socket));
+	ASSERT_INT_EQ(3, write(fds[1], "abc", 3));
+	run_for(mloop, 20);
+	ASSERT_INT_EQ(5, n_reads);
+
+	/* ...and the rest comes in when it is started again */
+	ASSERT_INT_EQ(0, mloop_socket_start(socket));
+	run_for(mloop, 20);
+	ASSERT_INT_EQ(8, n_reads);
+
+	mloop_socket_stop(socket);
+	mloop_socket_unref(socket);
+	close(fds[1]);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int n_timeouts;
+
+static void on_timeout(struct mloop_timer* timer)
+{
+	(void)timer;
+	++n_timeouts;
+}
+
+static int test_timer()
+{
+	struct mloop* mloop = new_uring_mloop();
+	ASSERT_TRUE(mloop);
+
+	struct mloop_timer* timer = mloop_timer_new(mloop);
+	mloop_timer_set_type(timer, MLOOP_TIMER_PERIODIC);
+	mloop_timer_set_time(timer, 10000000ULL);
+	mloop_timer_set_callback(timer, on_timeout);
+
+	n_timeouts = 0;
+	ASSERT_INT_EQ(0, mloop_timer_start(timer));
+	run_for(mloop, 55);
+	ASSERT_INT_EQ(5, n_timeouts);
+
+	mloop_timer_stop(timer);
+	mloop_timer_unref(timer);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int last_signo;
+
+static void on_signal(struct mloop_signal* sig, int signo)
+{
+	(void)sig;
+	last_signo = signo;
+}
+
+static int test_signal()
+{
+	struct mloop* mloop = new_uring_mloop();
+	ASSERT_TRUE(mloop);
+
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	struct mloop_signal* sig = mloop_signal_new(mloop);
+	mloop_signal_set_signals(sig, &sigset);
+	mloop_signal_set_callback(sig, on_signal);
+	ASSERT_INT_EQ(0, mloop_signal_start(sig));
+
+	last_signo = 0;
+	kill(getpid(), SIGUSR1);
+	run_for(mloop, 20);
+	ASSERT_INT_EQ(SIGUSR1, last_signo);
+
+	mloop_signal_stop(sig);
+	mloop_signal_unref(sig);
+	mloop_free(mloop);
+	return 0;
+}
+
+static int n_posted;
+
+static void on_posted(struct mloop_async* async)
+{
+	(void)async;
+	if (++n_posted == 2)
+		mloop_exit(mloop_async_get_context(async));
+}
+
+static void* post_from_thread(void* context)
+{
+	usleep(10000);
+	mloop_post(context, on_posted, context, NULL);
+	return NULL;
+}
+
+/* A loop sleeping in io_uring_enter() is woken up from other threads */
+static int test_post_from_thread()
+{
+	struct mloop* mloop = new_uring_mloop();
+	ASSERT_TRUE(mloop);
+
+	n_posted = 0;
+	pthread_t threads[2];
+	pthread_create(&threads[0], NULL, post_from_thread, mloop);
+	pthread_create(&threads[1], NULL, post_from_thread, mloop);
+
+	mloop_run(mloop);
+	ASSERT_INT_EQ(2, n_posted);
+
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	mloop_free(mloop);
+	return 0;
+}
+
+/* Sockets that are still being polled for are released with the loop */
+static int test_free_with_started_socket()
+{
+	struct mloop* mloop = new_uring_mloop();
+	ASSERT_TRUE(mloop);
+
+	int fd = eventfd(0, EFD_NONBLOCK);
+	struct mloop_socket* socket = mloop_socket_new(mloop);
+	mloop_socket_set_fd(socket, fd);
+	mloop_socket_set_callback(socket, on_readable);
+	ASSERT_INT_EQ(0, mloop_socket_start(socket));
+	mloop_socket_unref(socket);
+
+	run_for(mloop, 5);
+	mloop_free(mloop);
+
+	/* The socket has closed its fd */
+	ASSERT_INT_LT(0, fcntl(fd, F_GETFD));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_fallback_to_epoll);
+	RUN_TEST(test_socket_is_level_triggered);
+	RUN_TEST(test_timer);
+	RUN_TEST(test_signal);
+	RUN_TEST(test_post_from_thread);
+	RUN_TEST(test_free_with_started_socket);
+	return r;
+}
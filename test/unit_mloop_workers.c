@@ -0,0 +1,68 @@
+#include <unistd.h>
+#include "tst.h"
+#include "mloop.h"
+
+#define N_JOBS 8
+
+static int n_run;
+
+static void on_work(struct mloop_work* work)
+{
+	(void)work;
+
+	usleep(20000);
+	__atomic_add_fetch(&n_run, 1, __ATOMIC_SEQ_CST);
+}
+
+static int wait_for_jobs(int n)
+{
+	for (int i = 0; i < 1000; ++i) {
+		if (__atomic_load_n(&n_run, __ATOMIC_SEQ_CST) >= n)
+			return 0;
+
+		usleep(1000);
+	}
+
+	return -1;
+}
+
+static int test_grow_and_shrink()
+{
+	struct mloop* mloop = mloop_new();
+	mloop_set_max_workers(4);
+	mloop_set_worker_scaling(100, 50);
+	ASSERT_INT_EQ(0, mloop_require_workers(1));
+
+	for (int i = 0; i < N_JOBS; ++i) {
+		struct mloop_work* work = mloop_work_new(mloop);
+		mloop_work_set_work_fn(work, on_work);
+		ASSERT_INT_EQ(0, mloop_work_start(work));
+		mloop_work_unref(work);
+	}
+
+	ASSERT_INT_EQ(0, wait_for_jobs(N_JOBS));
+
+	/* Jobs piled up, so workers were added, but not beyond the most */
+	struct mloop_worker_stats stats;
+	mloop_get_worker_stats(&stats);
+	ASSERT_UINT_EQ(4, stats.max_workers);
+	ASSERT_UINT_EQ(3, stats.n_started);
+	ASSERT_UINT_EQ(N_JOBS, stats.n_jobs);
+	ASSERT_TRUE(stats.max_wait_ns > 0);
+
+	/* Those that were added go again once they have been idle */
+	usleep(500000);
+	mloop_get_worker_stats(&stats);
+	ASSERT_UINT_EQ(1, stats.n_workers);
+	ASSERT_UINT_EQ(3, stats.n_retired);
+
+	mloop_free(mloop);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_grow_and_shrink);
+	return r;
+}
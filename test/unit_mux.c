@@ -0,0 +1,173 @@
+#include "tst.h"
+#include "canopen-driver.h"
+#include "canopen/master.h"
+#include "canopen/sync-cycle.h"
+#include "process-image.h"
+#include "canopen.h"
+#include "cfg.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define NODEID 5
+
+static struct co_bus bus_;
+
+static void on_sync_cycle(struct co_drv* drv,
+			  const struct co_sync_cycle* cycle)
+{
+	(void)drv;
+	(void)cycle;
+}
+
+/* The filters are read back from the socket where CAN is available, and
+ * otherwise from what was handed to it
+ */
+static int has_filter(uint32_t cob)
+{
+	static struct can_filter filters[CAN_SFF_MASK + 1];
+	struct can_filter* filter = bus_.mux_filters;
+	size_t n = CAN_SFF_MASK + 1;
+
+	socklen_t size = sizeof(filters);
+	if (getsockopt(bus_.socket.fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+		       &size) == 0) {
+		filter = filters;
+		n = size / sizeof(filters[0]);
+	}
+
+	for (size_t i = 0; i < n; ++i)
+		if (filter[i].can_id == cob)
+			return 1;
+
+	return 0;
+}
+
+static void update(struct co_master_node* node)
+{
+	memset(bus_.mux_filters, 0, sizeof(bus_.mux_filters));
+	co__mux_update(node);
+}
+
+static void init_bus(void)
+{
+	cfg_load_defaults();
+	cfg.sync_interval = 10000;
+
+	sync_cycle_init(&bus_.sync_cycle);
+	cob_table_init(&bus_.mux_table);
+
+	for (int i = CANOPEN_NODEID_MIN; i <= CANOPEN_NODEID_MAX; ++i) {
+		struct co_master_node* node = &bus_.node[i];
+
+		node->bus = &bus_;
+		node->nodeid = i;
+		node->ndrv = &bus_.drv[i];
+		bus_.drv[i].node = node;
+	}
+
+	bus_.socket.type = SOCK_TYPE_CAN;
+	bus_.socket.fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	bus_.mux_table_is_ready = 1;
+}
+
+static int test_sync_cycle_tpdos_get_through()
+{
+	struct co_master_node* node = &bus_.node[NODEID];
+	struct co_drv* drv = node->ndrv;
+
+	node->driver_type = CO_MASTER_DRIVER_NEW;
+	node->is_initialized = 1;
+	update(node);
+	ASSERT_FALSE(has_filter(R_TPDO1 + NODEID));
+
+	/* Nothing but the sync cycle wants the TPDOs */
+	memset(bus_.mux_filters, 0, sizeof(bus_.mux_filters));
+	ASSERT_INT_EQ(0, co_set_sync_cycle_fn(drv, 0x5, on_sync_cycle));
+	ASSERT_TRUE(has_filter(R_TPDO1 + NODEID));
+	ASSERT_FALSE(has_filter(R_TPDO2 + NODEID));
+	ASSERT_TRUE(has_filter(R_TPDO3 + NODEID));
+	ASSERT_FALSE(has_filter(R_TPDO1 + NODEID + 1));
+
+	memset(bus_.mux_filters, 0, sizeof(bus_.mux_filters));
+	ASSERT_INT_EQ(0, co_set_sync_cycle_fn(drv, 0, NULL));
+	ASSERT_FALSE(has_filter(R_TPDO1 + NODEID));
+
+	node->driver_type = CO_MASTER_DRIVER_NONE;
+	node->is_initialized = 0;
+	update(node);
+	return 0;
+}
+
+static int test_process_image_has_all_tpdos()
+{
+	char name[64];
+	snprintf(name, sizeof(name), "/unit_mux.%d", (int)getpid());
+	ASSERT_INT_EQ(0, process_image_create(&bus_.process_image, name));
+
+	/* No node has a driver */
+	update(&bus_.node[NODEID]);
+	ASSERT_TRUE(has_filter(R_TPDO1 + NODEID));
+	ASSERT_TRUE(has_filter(R_TPDO4 + NODEID));
+	ASSERT_TRUE(has_filter(R_TPDO1 + CANOPEN_NODEID_MAX));
+	ASSERT_FALSE(has_filter(R_TPDO1));
+
+	/* Only those of the nodes in our range are wanted */
+	cfg.range_start = 1;
+	cfg.range_stop = 10;
+	update(&bus_.node[NODEID]);
+	ASSERT_TRUE(has_filter(R_TPDO2 + 10));
+	ASSERT_FALSE(has_filter(R_TPDO2 + 11));
+	cfg.range_start = 0;
+	cfg.range_stop = 0;
+
+	process_image_destroy(&bus_.process_image);
+	memset(&bus_.process_image, 0, sizeof(bus_.process_image));
+
+	update(&bus_.node[NODEID]);
+	ASSERT_FALSE(has_filter(R_TPDO1 + NODEID));
+	return 0;
+}
+
+static int test_nothing_is_filtered_while_the_load_is_measured()
+{
+	struct co_master_node* node = &bus_.node[NODEID];
+
+	bus_.socket.meter = &bus_.meter;
+
+	node->driver_type = CO_MASTER_DRIVER_NEW;
+	node->is_initialized = 1;
+	ASSERT_INT_EQ(0, co_set_sync_cycle_fn(node->ndrv, 0x1, on_sync_cycle));
+	update(node);
+
+	/* The socket keeps letting everything through */
+	ASSERT_FALSE(has_filter(R_TPDO1 + NODEID));
+
+	bus_.socket.meter = NULL;
+	ASSERT_INT_EQ(0, co_set_sync_cycle_fn(node->ndrv, 0, NULL));
+	node->driver_type = CO_MASTER_DRIVER_NONE;
+	node->is_initialized = 0;
+	update(node);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+
+	init_bus();
+
+	RUN_TEST(test_sync_cycle_tpdos_get_through);
+	RUN_TEST(test_process_image_has_all_tpdos);
+	RUN_TEST(test_nothing_is_filtered_while_the_load_is_measured);
+
+	if (bus_.socket.fd >= 0)
+		close(bus_.socket.fd);
+
+	sync_cycle_destroy(&bus_.sync_cycle);
+	return r;
+}
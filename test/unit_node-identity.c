@@ -0,0 +1,108 @@
+#include "tst.h"
+#include "node-identity.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path_[] = "/tmp/unit_node-identity.XXXXXX";
+
+static int test_save_and_load()
+{
+	static struct node_identity_cache saved, loaded;
+
+	memset(&saved, 0, sizeof(saved));
+	saved.node[5].is_known = 1;
+	saved.node[5].vendor_id = 0x2e1;
+	saved.node[5].serial_number = 1234;
+	strcpy(saved.node[5].name, "inverter");
+	saved.is_dirty = 1;
+
+	ASSERT_INT_EQ(0, node_identity_cache_save(&saved, path_));
+	ASSERT_FALSE(saved.is_dirty);
+
+	ASSERT_INT_EQ(0, node_identity_cache_load(&loaded, path_));
+	ASSERT_TRUE(loaded.node[5].is_known);
+	ASSERT_UINT_EQ(0x2e1, loaded.node[5].vendor_id);
+	ASSERT_UINT_EQ(1234, loaded.node[5].serial_number);
+	ASSERT_STR_EQ("inverter", loaded.node[5].name);
+	ASSERT_FALSE(loaded.node[6].is_known);
+	return 0;
+}
+
+static int test_profiles()
+{
+	static struct node_identity_cache saved, loaded;
+
+	memset(&saved, 0, sizeof(saved));
+	ASSERT_TRUE(node_identity_find_profile(&saved, 0x2e1, 7) == NULL);
+	ASSERT_TRUE(node_identity_get_profile(&saved, 0, 7) == NULL);
+
+	struct node_sdo_profile* profile =
+		node_identity_get_profile(&saved, 0x2e1, 7);
+	ASSERT_TRUE(profile != NULL);
+	profile->flags = NODE_SDO_NO_BLOCK;
+	profile->n_channels = 2;
+	ASSERT_TRUE(node_identity_get_profile(&saved, 0x2e1, 7) == profile);
+	ASSERT_TRUE(node_identity_get_profile(&saved, 0x2e1, 8) != profile);
+
+	ASSERT_INT_EQ(0, node_identity_cache_save(&saved, path_));
+	ASSERT_INT_EQ(0, node_identity_cache_load(&loaded, path_));
+
+	profile = node_identity_find_profile(&loaded, 0x2e1, 7);
+	ASSERT_TRUE(profile != NULL);
+	ASSERT_UINT_EQ(NODE_SDO_NO_BLOCK, profile->flags);
+	ASSERT_UINT_EQ(2, profile->n_channels);
+	ASSERT_TRUE(node_identity_find_profile(&loaded, 0x2e1, 9) == NULL);
+	return 0;
+}
+
+static int test_full_profiles()
+{
+	static struct node_identity_cache cache;
+
+	memset(&cache, 0, sizeof(cache));
+
+	for (unsigned int i = 0; i < NODE_IDENTITY_N_PROFILES; ++i)
+		ASSERT_TRUE(node_identity_get_profile(&cache, 1, i) != NULL);
+
+	ASSERT_TRUE(node_identity_get_profile(&cache, 2, 0) == NULL);
+	ASSERT_TRUE(node_identity_find_profile(&cache, 1, 0) != NULL);
+	return 0;
+}
+
+static int test_invalid_file()
+{
+	static struct node_identity_cache cache;
+
+	FILE* file = fopen(path_, "w");
+	ASSERT_TRUE(file != NULL);
+	fputs("not a cache", file);
+	fclose(file);
+
+	ASSERT_INT_EQ(-1, node_identity_cache_load(&cache, path_));
+	ASSERT_FALSE(cache.node[5].is_known);
+
+	unlink(path_);
+	ASSERT_INT_EQ(-1, node_identity_cache_load(&cache, path_));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+
+	int fd = mkstemp(path_);
+	if (fd < 0)
+		return 1;
+	close(fd);
+
+	RUN_TEST(test_save_and_load);
+	RUN_TEST(test_profiles);
+	RUN_TEST(test_full_profiles);
+	RUN_TEST(test_invalid_file);
+
+	unlink(path_);
+	return r;
+}
@@ -0,0 +1,103 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include "tst.h"
+#include "node-info.h"
+
+#define N_THREADED_WRITES 100000
+
+static struct node_info_slot slot_;
+
+static void make_info(struct node_info* info, uint32_t i)
+{
+	memset(info, 0, sizeof(*info));
+	info->vendor_id = i;
+	info->serial_number = ~i;
+	snprintf(info->name, sizeof(info->name), "node%u", i);
+}
+
+static int test_nothing_published()
+{
+	struct node_info info;
+
+	memset(&slot_, 0, sizeof(slot_));
+	memset(&info, 0xff, sizeof(info));
+
+	ASSERT_UINT_EQ(0, node_info_read(&slot_, &info));
+	ASSERT_UINT_EQ(0, info.vendor_id);
+	ASSERT_STR_EQ("", info.name);
+	return 0;
+}
+
+static int test_latest_is_read()
+{
+	struct node_info info;
+
+	memset(&slot_, 0, sizeof(slot_));
+
+	make_info(&info, 1);
+	node_info_publish(&slot_, &info);
+	make_info(&info, 2);
+	node_info_publish(&slot_, &info);
+
+	memset(&info, 0, sizeof(info));
+	ASSERT_UINT_EQ(4, node_info_read(&slot_, &info));
+	ASSERT_UINT_EQ(2, info.vendor_id);
+	ASSERT_STR_EQ("node2", info.name);
+	return 0;
+}
+
+static void* publish(void* context)
+{
+	(void)context;
+
+	for (uint32_t i = 1; i <= N_THREADED_WRITES; ++i) {
+		struct node_info info;
+		make_info(&info, i);
+		node_info_publish(&slot_, &info);
+	}
+
+	return NULL;
+}
+
+/* Each copy that is read is whole, also with two publishers */
+static int test_threaded()
+{
+	struct node_info info;
+	pthread_t threads[2];
+
+	memset(&slot_, 0, sizeof(slot_));
+
+	for (int i = 0; i < 2; ++i)
+		pthread_create(&threads[i], NULL, publish, NULL);
+
+	uint64_t sequence = 0;
+	while (sequence < 2 * 2 * N_THREADED_WRITES) {
+		uint64_t last = sequence;
+		sequence = node_info_read(&slot_, &info);
+		ASSERT_TRUE(sequence >= last);
+		ASSERT_UINT_EQ(0, sequence & 1);
+
+		if (sequence == 0)
+			continue;
+
+		char name[64];
+		snprintf(name, sizeof(name), "node%u", info.vendor_id);
+		ASSERT_UINT_EQ(~info.vendor_id, info.serial_number);
+		ASSERT_STR_EQ(name, info.name);
+	}
+
+	for (int i = 0; i < 2; ++i)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_nothing_published);
+	RUN_TEST(test_latest_is_read);
+	RUN_TEST(test_threaded);
+	return r;
+}
@@ -0,0 +1,142 @@
+#include "tst.h"
+#include "node-stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <linux/can.h>
+
+static struct node_stats stats_[CANOPEN_NODEID_MAX + 1];
+
+static void receive(uint32_t cob, uint64_t timestamp)
+{
+	struct can_frame cf = { .can_id = cob, .can_dlc = 1 };
+	node_stats_count_frame(stats_, &cf, timestamp);
+}
+
+static int test_frames_are_counted_by_kind()
+{
+	memset(stats_, 0, sizeof(stats_));
+
+	receive(0x185, 0);
+	receive(0x485, 0);
+	receive(0x585, 0);
+	receive(0x85, 0);
+	receive(0x705, 0);
+
+	/* Requests to the node and frames that are not from it */
+	receive(0x605, 0);
+	receive(0x80, 0);
+	receive(0x185 | CAN_RTR_FLAG, 0);
+
+	const struct node_stats* s = &stats_[5];
+	ASSERT_UINT_EQ(5, s->n_frames);
+	ASSERT_UINT_EQ(2, s->n_pdos);
+	ASSERT_UINT_EQ(1, s->n_sdos);
+	ASSERT_UINT_EQ(1, s->n_emcys);
+	ASSERT_UINT_EQ(1, s->n_heartbeats);
+	ASSERT_TRUE(node_stats_is_empty(&stats_[6]));
+	return 0;
+}
+
+static int test_heartbeat_jitter()
+{
+	memset(stats_, 0, sizeof(stats_));
+
+	receive(0x70a, 1000000);
+	receive(0x70a, 1100000);
+	receive(0x70a, 1203000);
+	receive(0x70a, 1302000);
+
+	const struct node_stats_histogram* h = &stats_[10].heartbeat_jitter;
+	ASSERT_UINT_EQ(2, h->count);
+	ASSERT_UINT_EQ(4000, h->max_us);
+	ASSERT_UINT_EQ(7000, h->total_us);
+	return 0;
+}
+
+static int test_histogram_buckets()
+{
+	struct node_stats_histogram h;
+	memset(&h, 0, sizeof(h));
+
+	node_stats_histogram_add(&h, 0);
+	node_stats_histogram_add(&h, 1);
+	node_stats_histogram_add(&h, 3);
+	node_stats_histogram_add(&h, ~0ULL);
+
+	ASSERT_UINT_EQ(1, h.buckets[0]);
+	ASSERT_UINT_EQ(1, h.buckets[1]);
+	ASSERT_UINT_EQ(1, h.buckets[2]);
+	ASSERT_UINT_EQ(1, h.buckets[NODE_STATS_N_BUCKETS - 1]);
+	ASSERT_UINT_EQ(4, h.count);
+	return 0;
+}
+
+static int test_sdo_outcomes()
+{
+	struct node_stats s;
+	memset(&s, 0, sizeof(s));
+
+	node_stats_count_sdo(&s, SDO_REQ_OK, 0, 1500);
+	node_stats_count_sdo(&s, SDO_REQ_LOCAL_ABORT, SDO_ABORT_TIMEOUT, 0);
+	node_stats_count_sdo(&s, SDO_REQ_REMOTE_ABORT, SDO_ABORT_NEXIST, 0);
+
+	ASSERT_UINT_EQ(3, s.n_sdo_transfers);
+	ASSERT_UINT_EQ(1, s.n_sdo_timeouts);
+	ASSERT_UINT_EQ(1, s.n_sdo_aborts);
+	ASSERT_UINT_EQ(1, s.sdo_latency.count);
+	ASSERT_UINT_EQ(1500, s.sdo_latency.max_us);
+	return 0;
+}
+
+static int test_driver_time()
+{
+	struct node_stats s;
+	memset(&s, 0, sizeof(s));
+
+	ASSERT_UINT_EQ(0, node_stats_count_driver_call(&s, 900, 1000));
+	ASSERT_UINT_EQ(1, node_stats_count_driver_call(&s, 1500, 1000));
+	ASSERT_UINT_EQ(2, node_stats_count_driver_call(&s, 1200, 1000));
+	ASSERT_UINT_EQ(0, node_stats_count_driver_call(&s, 5000, 0));
+	ASSERT_UINT_EQ(1, node_stats_count_driver_drop(&s));
+
+	ASSERT_UINT_EQ(2, s.n_driver_overruns);
+	ASSERT_UINT_EQ(4, s.driver_time.count);
+	ASSERT_UINT_EQ(5000, s.driver_time.max_us);
+	return 0;
+}
+
+static int test_output()
+{
+	static char buffer[65536];
+
+	memset(stats_, 0, sizeof(stats_));
+	receive(0x18c, 0);
+
+	FILE* output = fmemopen(buffer, sizeof(buffer), "w");
+	node_stats_write_json(output, stats_);
+	fclose(output);
+
+	ASSERT_TRUE(strstr(buffer, "\"12\":{\"frames\":1,\"pdos\":1") != NULL);
+	ASSERT_TRUE(strstr(buffer, "\"13\"") == NULL);
+
+	output = fmemopen(buffer, sizeof(buffer), "w");
+	node_stats_write_prometheus(output, "can0", stats_);
+	fclose(output);
+
+	ASSERT_TRUE(strstr(buffer, "canopen_node_pdos_total{iface=\"can0\",node=\"12\"} 1\n") != NULL);
+	ASSERT_TRUE(strstr(buffer, "node=\"13\"") == NULL);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_frames_are_counted_by_kind);
+	RUN_TEST(test_heartbeat_jitter);
+	RUN_TEST(test_histogram_buckets);
+	RUN_TEST(test_sdo_outcomes);
+	RUN_TEST(test_driver_time);
+	RUN_TEST(test_output);
+	return r;
+}
@@ -0,0 +1,202 @@
+#include "tst.h"
+#include "pcapng.h"
+#include "trace-buffer.h"
+
+#include "socketcan.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define SHB_SIZE 28
+#define EPB_SIZE(mtu) (32 + (mtu))
+
+static uint32_t get32(const char* data, size_t offset)
+{
+	uint32_t value;
+	memcpy(&value, data + offset, sizeof(value));
+	return value;
+}
+
+static uint16_t get16(const char* data, size_t offset)
+{
+	uint16_t value;
+	memcpy(&value, data + offset, sizeof(value));
+	return value;
+}
+
+static size_t write_header(char** data, const char* iface)
+{
+	size_t size;
+	FILE* stream = open_memstream(data, &size);
+
+	pcapng_write_header(stream, iface);
+	fclose(stream);
+
+	return size;
+}
+
+int test_section_header(void)
+{
+	char* data;
+	size_t size = write_header(&data, NULL);
+
+	ASSERT_TRUE(size > SHB_SIZE);
+	ASSERT_UINT_EQ(0x0a0d0d0a, get32(data, 0));
+	ASSERT_UINT_EQ(SHB_SIZE, get32(data, 4));
+	ASSERT_UINT_EQ(0x1a2b3c4d, get32(data, 8));
+	ASSERT_UINT_EQ(1, get16(data, 12));
+	ASSERT_UINT_EQ(0, get16(data, 14));
+	ASSERT_UINT_EQ(SHB_SIZE, get32(data, SHB_SIZE - 4));
+
+	free(data);
+	return 0;
+}
+
+int test_interface_with_name(void)
+{
+	char* data;
+	size_t size = write_header(&data, "can0");
+	const char* idb = data + SHB_SIZE;
+	uint32_t idb_size = get32(idb, 4);
+
+	ASSERT_UINT_EQ(SHB_SIZE + idb_size, size);
+	ASSERT_UINT_EQ(1, get32(idb, 0));
+	ASSERT_UINT_EQ(idb_size, get32(idb, idb_size - 4));
+	ASSERT_UINT_EQ(PCAPNG_LINKTYPE_CAN_SOCKETCAN, get16(idb, 8));
+	ASSERT_UINT_EQ(CANFD_MTU, get32(idb, 12));
+
+	/* if_name, padded to 4 bytes */
+	ASSERT_UINT_EQ(2, get16(idb, 16));
+	ASSERT_UINT_EQ(4, get16(idb, 18));
+	ASSERT_TRUE(memcmp(idb + 20, "can0", 4) == 0);
+
+	/* if_tsresol */
+	ASSERT_UINT_EQ(9, get16(idb, 24));
+	ASSERT_UINT_EQ(1, get16(idb, 26));
+	ASSERT_INT_EQ(PCAPNG_TSRESOL_US, idb[28]);
+
+	/* opt_endofopt */
+	ASSERT_UINT_EQ(0, get32(idb, 32));
+	ASSERT_UINT_EQ(40, idb_size);
+
+	free(data);
+	return 0;
+}
+
+int test_interface_without_name(void)
+{
+	char* data;
+	write_header(&data, NULL);
+	const char* idb = data + SHB_SIZE;
+
+	ASSERT_UINT_EQ(9, get16(idb, 16));
+	ASSERT_UINT_EQ(32, get32(idb, 4));
+
+	free(data);
+	return 0;
+}
+
+int test_classic_frame(void)
+{
+	struct tb_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.timestamp = 0x123456789abcULL;
+	frame.cf.can_id = 0x185;
+	frame.cf.can_dlc = 3;
+	frame.cf.data[0] = 1;
+	frame.cf.data[1] = 2;
+	frame.cf.data[2] = 3;
+
+	char* data;
+	size_t size;
+	FILE* stream = open_memstream(&data, &size);
+	ASSERT_UINT_EQ(1, pcapng_write_frames(stream, &frame, 1));
+	fclose(stream);
+
+	ASSERT_UINT_EQ(EPB_SIZE(CAN_MTU), size);
+	ASSERT_UINT_EQ(6, get32(data, 0));
+	ASSERT_UINT_EQ(EPB_SIZE(CAN_MTU), get32(data, 4));
+	ASSERT_UINT_EQ(0, get32(data, 8));
+	ASSERT_UINT_EQ(0x1234, get32(data, 12));
+	ASSERT_UINT_EQ(0x56789abc, get32(data, 16));
+	ASSERT_UINT_EQ(CAN_MTU, get32(data, 20));
+	ASSERT_UINT_EQ(CAN_MTU, get32(data, 24));
+
+	ASSERT_UINT_EQ(0x185, ntohl(get32(data, 28)));
+	ASSERT_INT_EQ(3, data[32]);
+	ASSERT_INT_EQ(0, data[33]);
+	ASSERT_INT_EQ(1, data[36]);
+	ASSERT_INT_EQ(3, data[38]);
+	ASSERT_INT_EQ(0, data[39]);
+
+	ASSERT_UINT_EQ(EPB_SIZE(CAN_MTU), get32(data, size - 4));
+
+	free(data);
+	return 0;
+}
+
+int test_fd_frame(void)
+{
+	struct tb_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.cfd.can_id = 0x285;
+	frame.cfd.len = 64;
+	frame.cfd.flags = CANFD_FDF;
+	frame.cfd.data[63] = 42;
+
+	char* data;
+	size_t size;
+	FILE* stream = open_memstream(&data, &size);
+	ASSERT_UINT_EQ(1, pcapng_write_frames(stream, &frame, 1));
+	fclose(stream);
+
+	ASSERT_UINT_EQ(EPB_SIZE(CANFD_MTU), size);
+	ASSERT_UINT_EQ(CANFD_MTU, get32(data, 20));
+	ASSERT_UINT_EQ(0x285, ntohl(get32(data, 28)));
+	ASSERT_INT_EQ(64, data[32]);
+	ASSERT_INT_EQ(CANFD_FDF, data[33]);
+	ASSERT_INT_EQ(42, data[36 + 63]);
+
+	free(data);
+	return 0;
+}
+
+int test_more_than_a_batch(void)
+{
+	size_t n = PCAPNG_BATCH_SIZE * 2 + 3;
+	struct tb_frame* frames = calloc(n, sizeof(*frames));
+
+	for (size_t i = 0; i < n; ++i) {
+		frames[i].cf.can_id = i;
+		frames[i].cf.can_dlc = 8;
+	}
+
+	char* data;
+	size_t size;
+	FILE* stream = open_memstream(&data, &size);
+	ASSERT_UINT_EQ(n, pcapng_write_frames(stream, frames, n));
+	fclose(stream);
+
+	ASSERT_UINT_EQ(n * EPB_SIZE(CAN_MTU), size);
+
+	for (size_t i = 0; i < n; ++i)
+		ASSERT_UINT_EQ(i, ntohl(get32(data, i * EPB_SIZE(CAN_MTU) + 28)));
+
+	free(data);
+	free(frames);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_section_header);
+	RUN_TEST(test_interface_with_name);
+	RUN_TEST(test_interface_without_name);
+	RUN_TEST(test_classic_frame);
+	RUN_TEST(test_fd_frame);
+	RUN_TEST(test_more_than_a_batch);
+	return r;
+}
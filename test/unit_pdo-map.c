@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include "tst.h"
+#include "canopen/pdo-map.h"
+
+#define MAP(index, subindex, bits) \
+	(((uint32_t)(index) << 16) | ((subindex) << 8) | (bits))
+
+static int test_aligned()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	ASSERT_INT_EQ(0, pdo_map_add(&map, MAP(0x6041, 0, 16), 0));
+	ASSERT_INT_EQ(0, pdo_map_add(&map, MAP(0x6064, 0, 32), 1));
+	ASSERT_INT_EQ(0, pdo_map_add(&map, MAP(0x6061, 0, 8), 1));
+	ASSERT_UINT_EQ(3, map.length);
+	ASSERT_UINT_EQ(7, map.size);
+
+	const uint8_t data[] = { 0x37, 0x12, 0xfe, 0xff, 0xff, 0xff, 0x80 };
+	uint64_t values[3];
+	ASSERT_INT_EQ(0, pdo_map_unpack(&map, values, data, sizeof(data)));
+
+	ASSERT_UINT_EQ(0x1237, values[0]);
+	ASSERT_INT_EQ(-2, (int64_t)values[1]);
+	ASSERT_INT_EQ(-128, (int64_t)values[2]);
+
+	return 0;
+}
+
+static int test_bit_fields()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	pdo_map_add(&map, MAP(0x2000, 1, 1), 0);
+	pdo_map_add(&map, MAP(0x2000, 2, 3), 1);
+	pdo_map_add(&map, MAP(0x2000, 3, 12), 0);
+	ASSERT_UINT_EQ(2, map.size);
+
+	/* 1, -3 (0b101) and 0xabc */
+	const uint8_t data[] = { 0x1 | 0x5 << 1 | 0xc << 4, 0xab };
+	uint64_t values[3];
+	ASSERT_INT_EQ(0, pdo_map_unpack(&map, values, data, sizeof(data)));
+
+	ASSERT_UINT_EQ(1, values[0]);
+	ASSERT_INT_EQ(-3, (int64_t)values[1]);
+	ASSERT_UINT_EQ(0xabc, values[2]);
+
+	return 0;
+}
+
+static int test_unaligned_64_bits()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	pdo_map_add(&map, MAP(0x0001, 0, 4), 0);
+	pdo_map_add(&map, MAP(0x2001, 0, 64), 0);
+	ASSERT_UINT_EQ(9, map.size);
+
+	uint64_t in[2] = { 0x5, 0x8877665544332211ULL };
+	uint8_t data[9];
+	ASSERT_UINT_EQ(9, pdo_map_pack(&map, data, in));
+	ASSERT_UINT_EQ(0x15, data[0]);
+	ASSERT_UINT_EQ(0x88 >> 4, data[8]);
+
+	uint64_t out[2];
+	ASSERT_INT_EQ(0, pdo_map_unpack(&map, out, data, sizeof(data)));
+	ASSERT_TRUE(in[0] == out[0]);
+	ASSERT_TRUE(in[1] == out[1]);
+
+	return 0;
+}
+
+static int test_pack_round_trip()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	pdo_map_add(&map, MAP(0x6040, 0, 16), 0);
+	pdo_map_add(&map, MAP(0x607a, 0, 32), 1);
+	pdo_map_add(&map, MAP(0x2002, 0, 5), 1);
+	pdo_map_add(&map, MAP(0x2003, 0, 11), 0);
+
+	uint64_t in[4] = { 0x000f, (uint64_t)-100000, (uint64_t)-7, 0x7ff };
+	uint8_t data[PDO_MAP_MAX_SIZE];
+	ASSERT_UINT_EQ(8, pdo_map_pack(&map, data, in));
+
+	uint64_t out[4];
+	ASSERT_INT_EQ(0, pdo_map_unpack(&map, out, data, 8));
+	for (int i = 0; i < 4; ++i)
+		ASSERT_TRUE(in[i] == out[i]);
+
+	return 0;
+}
+
+static int test_short_payload()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	pdo_map_add(&map, MAP(0x6041, 0, 16), 0);
+	pdo_map_add(&map, MAP(0x6061, 0, 8), 0);
+
+	const uint8_t data[2] = { 0 };
+	uint64_t values[2];
+	ASSERT_INT_LT(0, pdo_map_unpack(&map, values, data, sizeof(data)));
+
+	return 0;
+}
+
+static int test_invalid_entries()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	ASSERT_INT_LT(0, pdo_map_add(&map, MAP(0x6041, 0, 0), 0));
+	ASSERT_INT_LT(0, pdo_map_add(&map, MAP(0x6041, 0, 65), 0));
+
+	for (int i = 0; i < 8; ++i)
+		ASSERT_INT_EQ(0, pdo_map_add(&map, MAP(0x2000, i, 64), 0));
+
+	ASSERT_INT_LT(0, pdo_map_add(&map, MAP(0x2000, 8, 1), 0));
+	ASSERT_UINT_EQ(8, map.length);
+
+	return 0;
+}
+
+static int test_find()
+{
+	struct pdo_map map;
+	pdo_map_init(&map);
+
+	pdo_map_add(&map, MAP(0x6041, 0, 16), 0);
+	pdo_map_add(&map, MAP(0x6064, 0, 32), 1);
+
+	ASSERT_INT_EQ(1, pdo_map_find(&map, 0x6064, 0));
+	ASSERT_INT_EQ(-1, pdo_map_find(&map, 0x6064, 1));
+
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_aligned);
+	RUN_TEST(test_bit_fields);
+	RUN_TEST(test_unaligned_64_bits);
+	RUN_TEST(test_pack_round_trip);
+	RUN_TEST(test_short_payload);
+	RUN_TEST(test_invalid_entries);
+	RUN_TEST(test_find);
+	return r;
+}
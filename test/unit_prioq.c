@@ -0,0 +1,159 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "tst.h"
+#include "prioq.h"
+
+static void* pop(struct prioq* queue)
+{
+	struct prioq_elem elem;
+	if (prioq_pop(queue, &elem, 0) < 0)
+		return NULL;
+
+	return elem.data;
+}
+
+static int test_priority_then_fifo()
+{
+	struct prioq queue;
+	ASSERT_INT_EQ(0, prioq_init(&queue, 2));
+
+	int jobs[5];
+	ASSERT_INT_EQ(0, prioq_insert(&queue, 2, &jobs[0]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 1, 100, &jobs[1]));
+	ASSERT_INT_EQ(0, prioq_insert(&queue, 0, &jobs[2]));
+	ASSERT_INT_EQ(0, prioq_insert(&queue, 1, &jobs[3]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 2, 50, &jobs[4]));
+
+	/* Deadlines are ignored unless the queue is in the EDF mode */
+	ASSERT_PTR_EQ(&jobs[2], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[1], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[3], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[0], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[4], pop(&queue));
+	ASSERT_PTR_EQ(NULL, pop(&queue));
+
+	prioq_destroy(&queue);
+	return 0;
+}
+
+static int test_earliest_deadline_first()
+{
+	struct prioq queue;
+	ASSERT_INT_EQ(0, prioq_init(&queue, 4));
+	prioq_set_mode(&queue, PRIOQ_EDF);
+
+	int jobs[6];
+	ASSERT_INT_EQ(0, prioq_insert(&queue, 0, &jobs[0]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 1000, 300, &jobs[1]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 5, 100, &jobs[2]));
+	ASSERT_INT_EQ(0, prioq_insert(&queue, ULONG_MAX, &jobs[3]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 1, 100, &jobs[4]));
+	ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, 0, 200, &jobs[5]));
+
+	/* Equal deadlines go by priority, and no deadline comes last */
+	ASSERT_PTR_EQ(&jobs[4], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[2], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[5], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[1], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[0], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[3], pop(&queue));
+
+	prioq_destroy(&queue);
+	return 0;
+}
+
+static int test_mode_change_reorders()
+{
+	struct prioq queue;
+	ASSERT_INT_EQ(0, prioq_init(&queue, 16));
+
+	int jobs[10];
+	for (int i = 0; i < 10; ++i)
+		ASSERT_INT_EQ(0, prioq_insert_deadline(&queue, i, 1000 - i,
+						       &jobs[i]));
+
+	prioq_set_mode(&queue, PRIOQ_EDF);
+	ASSERT_PTR_EQ(&jobs[9], pop(&queue));
+	ASSERT_PTR_EQ(&jobs[8], pop(&queue));
+
+	prioq_set_mode(&queue, PRIOQ_PRIORITY);
+	for (int i = 0; i < 8; ++i)
+		ASSERT_PTR_EQ(&jobs[i], pop(&queue));
+
+	prioq_destroy(&queue);
+	return 0;
+}
+
+#define N_RANDOM 10000
+
+static int test_random_order()
+{
+	struct prioq queue;
+	ASSERT_INT_EQ(0, prioq_init(&queue, 1));
+
+	srand(1);
+	for (int i = 0; i < N_RANDOM; ++i) {
+		unsigned long priority = rand() % 100;
+		ASSERT_INT_EQ(0, prioq_insert(&queue, priority,
+					      (void*)(uintptr_t)i));
+	}
+
+	/* Siblings share cache lines */
+	unsigned int misalignment = (uintptr_t)&queue.head[1] % PRIOQ_ALIGNMENT;
+	if (sizeof(struct prioq_elem) == 32)
+		ASSERT_UINT_EQ(0, misalignment);
+
+	struct prioq_elem last = { 0 }, elem;
+	for (int i = 0; i < N_RANDOM; ++i) {
+		ASSERT_INT_EQ(1, prioq_pop(&queue, &elem, 0));
+		ASSERT_TRUE(elem.priority > last.priority
+			    || (elem.priority == last.priority
+				&& elem.sequence_ >= last.sequence_));
+		last = elem;
+	}
+
+	ASSERT_INT_LT(0, prioq_pop(&queue, &elem, 0));
+
+	prioq_destroy(&queue);
+	return 0;
+}
+
+static int test_batches()
+{
+	struct prioq queue;
+	ASSERT_INT_EQ(0, prioq_init(&queue, 4));
+
+	struct prioq_elem in[100], out[64];
+	for (int i = 0; i < 100; ++i) {
+		in[i].priority = 99 - i;
+		in[i].deadline = 0;
+		in[i].data = &in[i];
+	}
+
+	ASSERT_INT_EQ(0, prioq_insert_many(&queue, in, 100));
+	ASSERT_UINT_EQ(100, queue.index);
+
+	ASSERT_INT_EQ(64, prioq_pop_many(&queue, out, 64, 0));
+	for (int i = 0; i < 64; ++i)
+		ASSERT_PTR_EQ(&in[99 - i], out[i].data);
+
+	ASSERT_INT_EQ(36, prioq_pop_many(&queue, out, 64, 0));
+	ASSERT_PTR_EQ(&in[0], out[35].data);
+
+	ASSERT_INT_LT(0, prioq_pop_many(&queue, out, 64, 0));
+
+	prioq_destroy(&queue);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_priority_then_fifo);
+	RUN_TEST(test_earliest_deadline_first);
+	RUN_TEST(test_mode_change_reorders);
+	RUN_TEST(test_random_order);
+	RUN_TEST(test_batches);
+	return r;
+}
@@ -0,0 +1,184 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "tst.h"
+#include "process-image.h"
+
+#define N_THREADED_WRITES 100000
+
+static char name_[64];
+
+static int make_image(struct process_image* writer,
+		      struct process_image* reader)
+{
+	snprintf(name_, sizeof(name_), "/unit_process-image.%d", getpid());
+
+	ASSERT_INT_EQ(0, process_image_create(writer, name_));
+	ASSERT_INT_EQ(0, process_image_open(reader, name_));
+	return 0;
+}
+
+static int test_open_missing()
+{
+	struct process_image reader;
+	ASSERT_INT_EQ(-1, process_image_open(&reader,
+					     "/unit_process-image.missing"));
+	return 0;
+}
+
+static int test_empty_slot()
+{
+	struct process_image writer, reader;
+	struct process_image_value value;
+
+	ASSERT_INT_EQ(0, make_image(&writer, &reader));
+
+	ASSERT_INT_EQ(-1, process_image_read(&reader, 5, 1, &value));
+	ASSERT_INT_EQ(-1, process_image_read(&reader, 0, 1, &value));
+	ASSERT_INT_EQ(-1, process_image_read(&reader, 5, 5, &value));
+
+	process_image_destroy(&reader);
+	process_image_destroy(&writer);
+	return 0;
+}
+
+static int test_latest_value_is_read()
+{
+	struct process_image writer, reader;
+	struct process_image_value value;
+	uint8_t first[] = { 1, 2, 3 };
+	uint8_t second[] = { 4, 5 };
+
+	ASSERT_INT_EQ(0, make_image(&writer, &reader));
+
+	process_image_write(&writer, 5, 2, first, sizeof(first), 1000);
+	process_image_write(&writer, 5, 2, second, sizeof(second), 2000);
+	process_image_write(&writer, 6, 2, first, sizeof(first), 3000);
+
+	ASSERT_INT_EQ(0, process_image_read(&reader, 5, 2, &value));
+	ASSERT_UINT_EQ(4, value.sequence);
+	ASSERT_UINT_EQ(2000, value.timestamp);
+	ASSERT_UINT_EQ(2, value.size);
+	ASSERT_INT_EQ(0, memcmp(second, value.data, sizeof(second)));
+
+	ASSERT_INT_EQ(0, process_image_read(&reader, 6, 2, &value));
+	ASSERT_UINT_EQ(2, value.sequence);
+	ASSERT_UINT_EQ(3, value.size);
+
+	ASSERT_INT_EQ(-1, process_image_read(&reader, 5, 1, &value));
+
+	process_image_destroy(&reader);
+	process_image_destroy(&writer);
+	return 0;
+}
+
+static int test_adopted_image_is_kept()
+{
+	struct process_image writer, reader, adopter;
+	struct process_image_value value;
+	uint8_t first[] = { 1, 2, 3 };
+	uint8_t second[] = { 4, 5 };
+
+	ASSERT_INT_EQ(0, make_image(&writer, &reader));
+
+	process_image_write(&writer, 5, 1, first, sizeof(first), 1000);
+
+	int fd = shm_open(name_, O_RDWR | O_CLOEXEC, 0);
+	ASSERT_TRUE(fd >= 0);
+	ASSERT_INT_EQ(0, process_image_adopt(&adopter, name_, fd));
+
+	writer.is_owner = 0;
+	process_image_destroy(&writer);
+
+	ASSERT_INT_EQ(0, process_image_read(&adopter, 5, 1, &value));
+	ASSERT_UINT_EQ(2, value.sequence);
+
+	process_image_write(&adopter, 5, 1, second, sizeof(second), 2000);
+
+	ASSERT_INT_EQ(0, process_image_read(&reader, 5, 1, &value));
+	ASSERT_UINT_EQ(4, value.sequence);
+	ASSERT_UINT_EQ(2, value.size);
+
+	process_image_destroy(&adopter);
+	process_image_destroy(&reader);
+	return 0;
+}
+
+static int test_long_data_is_cut()
+{
+	struct process_image writer, reader;
+	struct process_image_value value;
+	uint8_t data[PROCESS_IMAGE_DATA_SIZE + 8];
+
+	memset(data, 0x55, sizeof(data));
+
+	ASSERT_INT_EQ(0, make_image(&writer, &reader));
+
+	process_image_write(&writer, 127, 4, data, sizeof(data), 0);
+	ASSERT_INT_EQ(0, process_image_read(&reader, 127, 4, &value));
+	ASSERT_UINT_EQ(PROCESS_IMAGE_DATA_SIZE, value.size);
+
+	process_image_destroy(&reader);
+	process_image_destroy(&writer);
+	return 0;
+}
+
+static void* write_values(void* context)
+{
+	struct process_image* writer = context;
+
+	for (uint32_t i = 1; i <= N_THREADED_WRITES; ++i) {
+		uint32_t data[2] = { i, ~i };
+		process_image_write(writer, 1, 1, data, sizeof(data), i);
+	}
+
+	return NULL;
+}
+
+/* Each copy that is read is whole: the data matches the timestamp */
+static int test_threaded()
+{
+	struct process_image writer, reader;
+	struct process_image_value value;
+
+	ASSERT_INT_EQ(0, make_image(&writer, &reader));
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, write_values, &writer);
+
+	uint64_t last = 0;
+	while (last < N_THREADED_WRITES) {
+		if (process_image_read(&reader, 1, 1, &value) < 0)
+			continue;
+
+		uint32_t data[2];
+		memcpy(data, value.data, sizeof(data));
+
+		ASSERT_UINT_EQ(value.timestamp, data[0]);
+		ASSERT_UINT_EQ(~data[0], data[1]);
+		ASSERT_UINT_EQ(value.timestamp * 2, value.sequence);
+		ASSERT_TRUE(value.timestamp >= last);
+		last = value.timestamp;
+	}
+
+	pthread_join(thread, NULL);
+
+	process_image_destroy(&reader);
+	process_image_destroy(&writer);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_open_missing);
+	RUN_TEST(test_empty_slot);
+	RUN_TEST(test_latest_value_is_read);
+	RUN_TEST(test_adopted_image_is_kept);
+	RUN_TEST(test_long_data_is_cut);
+	RUN_TEST(test_threaded);
+	return r;
+}
@@ -0,0 +1,111 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include "tst.h"
+#include "mloop.h"
+#include "reactor.h"
+#include "co_atomic.h"
+
+#define N_POSTS 1000
+
+static pthread_t posted_thread;
+static int n_posted;
+
+static void on_posted(struct mloop_async* async)
+{
+	int* count = mloop_async_get_context(async);
+
+	posted_thread = pthread_self();
+	co_atomic_add_fetch(count, 1);
+}
+
+static int test_pin()
+{
+	ASSERT_INT_EQ(0, reactor_init(2));
+	ASSERT_UINT_EQ(2, reactor_count());
+
+	ASSERT_TRUE(reactor_is_default(REACTOR_CAN));
+	ASSERT_INT_EQ(0, reactor_pin(REACTOR_CAN, 1));
+	ASSERT_FALSE(reactor_is_default(REACTOR_CAN));
+	ASSERT_TRUE(reactor_is_default(REACTOR_REST));
+
+	ASSERT_INT_LT(0, reactor_pin(REACTOR_REST, 2));
+	ASSERT_INT_EQ(EINVAL, errno);
+
+	reactor_cleanup();
+	ASSERT_TRUE(reactor_is_default(REACTOR_CAN));
+	return 0;
+}
+
+static int test_pin_range()
+{
+	ASSERT_INT_EQ(0, reactor_init(4));
+	ASSERT_UINT_EQ(1, reactor_span(REACTOR_REST));
+
+	ASSERT_INT_EQ(0, reactor_pin_range(REACTOR_REST, 1, 3));
+	ASSERT_UINT_EQ(3, reactor_span(REACTOR_REST));
+	ASSERT_PTR_EQ(reactor_get(REACTOR_REST), reactor_get_nth(REACTOR_REST, 0));
+
+	for (unsigned int i = 1; i < 3; ++i) {
+		ASSERT_FALSE(reactor_get_nth(REACTOR_REST, i) == mloop_default());
+		ASSERT_FALSE(reactor_get_nth(REACTOR_REST, i)
+			     == reactor_get_nth(REACTOR_REST, i - 1));
+	}
+
+	ASSERT_INT_LT(0, reactor_pin_range(REACTOR_REST, 2, 3));
+	ASSERT_INT_EQ(EINVAL, errno);
+	ASSERT_INT_LT(0, reactor_pin_range(REACTOR_REST, 0, 0));
+
+	/* The default loop may be one of them */
+	ASSERT_INT_EQ(0, reactor_pin_range(REACTOR_REST, 0, 2));
+	ASSERT_TRUE(reactor_is_default(REACTOR_REST));
+	ASSERT_FALSE(reactor_get_nth(REACTOR_REST, 1) == mloop_default());
+
+	reactor_cleanup();
+	ASSERT_UINT_EQ(1, reactor_span(REACTOR_REST));
+	return 0;
+}
+
+static int test_post_to_reactor()
+{
+	ASSERT_INT_EQ(0, reactor_init(2));
+	ASSERT_INT_EQ(0, reactor_pin(REACTOR_TRACE, 1));
+	ASSERT_INT_EQ(0, reactor_run());
+
+	struct mloop* mloop = reactor_get(REACTOR_TRACE);
+	n_posted = 0;
+
+	for (int i = 0; i < N_POSTS; ++i)
+		ASSERT_INT_EQ(0, mloop_post(mloop, on_posted, &n_posted, NULL));
+
+	while (co_atomic_load(&n_posted) < N_POSTS)
+		sched_yield();
+
+	ASSERT_FALSE(pthread_equal(pthread_self(), posted_thread));
+
+	reactor_cleanup();
+	return 0;
+}
+
+static int test_stop_before_thread_runs()
+{
+	struct mloop* mloop = mloop_new();
+	ASSERT_TRUE(mloop);
+
+	ASSERT_INT_EQ(0, mloop_start_thread(mloop, -1));
+	ASSERT_INT_LT(0, mloop_start_thread(mloop, -1));
+	mloop_stop_thread(mloop);
+
+	mloop_unref(mloop);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_pin);
+	RUN_TEST(test_pin_range);
+	RUN_TEST(test_post_to_reactor);
+	RUN_TEST(test_stop_before_thread_runs);
+	return r;
+}
@@ -1,6 +1,9 @@
 #include <string.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <mloop.h>
 
 #include "tst.h"
 #include "fff.h"
@@ -10,11 +13,12 @@
 DEFINE_FFF_GLOBALS;
 
 FAKE_VALUE_FUNC(int, socket, int, int, int);
-FAKE_VALUE_FUNC(int, bind, int, const struct sockaddr*, size_t);
+FAKE_VALUE_FUNC(int, bind, int, const struct sockaddr*, socklen_t);
 FAKE_VALUE_FUNC(int, listen, int, int);
 FAKE_VALUE_FUNC(int, close, int);
 FAKE_VALUE_FUNC(int, net_dont_block, int);
 FAKE_VALUE_FUNC(int, net_reuse_addr, int);
+FAKE_VALUE_FUNC(int, net_reuse_port, int);
 FAKE_VALUE_FUNC(ssize_t, read, int, void*, size_t);
 
 static void reset_fakes(void)
@@ -25,6 +29,7 @@ static void reset_fakes(void)
 	RESET_FAKE(close);
 	RESET_FAKE(net_dont_block);
 	RESET_FAKE(net_reuse_addr);
+	RESET_FAKE(net_reuse_port);
 	RESET_FAKE(read);
 }
 
@@ -132,6 +137,45 @@ static int test_find_service_one(void)
 	return r;
 }
 
+static int test_find_service_many(void)
+{
+	static const char* paths[] = {
+		"sdo", "sync", "sdo-rtt", "bus-load", "stats", "emcy",
+		"bootup", "firmware", "mloop", "timeline", "events", "config",
+	};
+	size_t n_paths = sizeof(paths) / sizeof(paths[0]);
+
+	rest__init_service_list();
+
+	for (size_t i = 0; i < n_paths; ++i)
+		ASSERT_INT_EQ(0, rest_register_service(HTTP_GET, paths[i],
+						       (rest_fn)(i + 1)));
+
+	for (size_t i = 0; i < n_paths; ++i) {
+		struct rest_service* service = find_service(HTTP_GET, paths[i]);
+		ASSERT_TRUE(service);
+		ASSERT_STR_EQ(paths[i], service->path);
+		ASSERT_PTR_EQ((void*)(i + 1), service->fn);
+	}
+
+	ASSERT_STR_EQ("bus-load", find_service(HTTP_GET, "BUS-LOAD")->path);
+	ASSERT_PTR_EQ(NULL, find_service(HTTP_PUT, "stats"));
+	ASSERT_PTR_EQ(NULL, find_service(HTTP_GET, "sdo-"));
+	ASSERT_INT_EQ(0, try_missing_services());
+
+	/* The last one that is registered for a method wins */
+	ASSERT_INT_EQ(0, rest_register_service(HTTP_GET, "stats",
+					       (rest_fn)0xdeadbeef));
+	ASSERT_INT_EQ(0, rest_register_service(HTTP_PUT, "stats",
+					       (rest_fn)0xcafe));
+	ASSERT_PTR_EQ((void*)0xdeadbeef, find_service(HTTP_GET, "stats")->fn);
+	ASSERT_PTR_EQ((void*)0xcafe, find_service(HTTP_PUT, "stats")->fn);
+
+	rest_cleanup();
+	ASSERT_PTR_EQ(NULL, find_service(HTTP_GET, "sdo"));
+	return 0;
+}
+
 static int test_open_server__socket_failure(void)
 {
 	reset_fakes();
@@ -223,7 +267,9 @@ static int test_read__empty(void)
 	read_fake.return_val = -1;
 	errno = EAGAIN;
 	struct vector vec;
+	vector_init(&vec, 16);
 	ASSERT_INT_LT(0, rest__read(&vec, 42));
+	vector_destroy(&vec);
 	return 0;
 }
 
@@ -232,7 +278,9 @@ static int test_read__closed(void)
 	reset_fakes();
 	read_fake.return_val = 0;
 	struct vector vec;
+	vector_init(&vec, 16);
 	ASSERT_INT_EQ(-1, rest__read(&vec, 42));
+	vector_destroy(&vec);
 	return 0;
 }
 
@@ -261,12 +309,175 @@ static int test_read__twice(void)
 	return 0;
 }
 
+static int test_chunked(void)
+{
+	char* buffer = NULL;
+	size_t size = 0;
+
+	FILE* output = open_memstream(&buffer, &size);
+	ASSERT_TRUE(output);
+
+	FILE* chunked = rest_open_chunked(output);
+	ASSERT_TRUE(chunked);
+
+	for (int i = 0; i < REST_CHUNK_SIZE + 10; ++i)
+		fputc('x', chunked);
+
+	ASSERT_INT_EQ(0, fclose(chunked));
+	fclose(output);
+
+	const char* p = buffer;
+	ASSERT_INT_EQ(0, strncmp(p, "1000\r\n", 6));
+	p += 6 + REST_CHUNK_SIZE;
+	ASSERT_STR_EQ("\r\na\r\nxxxxxxxxxx\r\n0\r\n\r\n", p);
+
+	free(buffer);
+	return 0;
+}
+
+static int test_response_head(void)
+{
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "text/plain",
+		.content_length = 5,
+		.etag = "\"1234\"",
+	};
+
+	struct rest_response response;
+	rest_response_init(&response);
+	rest_response_header(&response, &reply);
+	rest_response_add_header(&response, "Allow: GET\r\n");
+	ASSERT_INT_EQ(0, rest_response_add(&response, "hello", 5));
+	ASSERT_INT_EQ(2, response.n_segments);
+
+	response.head[response.head_length] = '\0';
+	ASSERT_INT_EQ(0, strncmp(response.head, "HTTP/1.1 200 OK\r\n", 17));
+	ASSERT_TRUE(strstr(response.head, "Content-Length: 5\r\n"));
+	ASSERT_TRUE(strstr(response.head, "ETag: \"1234\"\r\n"));
+
+	const char* end = response.head + response.head_length - 14;
+	ASSERT_STR_EQ("Allow: GET\r\n\r\n", end);
+	ASSERT_UINT_EQ(response.head_length, response.segment[0].iov_len);
+	return 0;
+}
+
+static int test_response_too_many_segments(void)
+{
+	struct rest_response response;
+	rest_response_init(&response);
+
+	for (int i = 1; i < REST_RESPONSE_MAX_SEGMENTS; ++i)
+		ASSERT_INT_EQ(0, rest_response_add(&response, "x", 1));
+
+	ASSERT_INT_EQ(-1, rest_response_add(&response, "x", 1));
+	ASSERT_INT_EQ(-1, rest_response_send(&response, NULL));
+	ASSERT_INT_EQ(EMSGSIZE, errno);
+	return 0;
+}
+
+static int init_client(struct rest_client* client, int fd)
+{
+	memset(client, 0, sizeof(*client));
+	pthread_mutex_init(&client->output_lock, NULL);
+	pthread_cond_init(&client->output_drained, NULL);
+	vector_init(&client->unsent, 0);
+
+	client->socket = mloop_socket_new(mloop_default());
+	ASSERT_TRUE(client->socket);
+	ASSERT_INT_EQ(0, rest__init_output(client, fd));
+	return 0;
+}
+
+static void destroy_client(struct rest_client* client)
+{
+	rest__destroy_output(client);
+	mloop_socket_unref(client->socket);
+	vector_destroy(&client->unsent);
+	pthread_cond_destroy(&client->output_drained);
+	pthread_mutex_destroy(&client->output_lock);
+}
+
+static int test_reply_is_sent_at_once(void)
+{
+	int fds[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+	struct rest_client client;
+	ASSERT_INT_EQ(0, init_client(&client, fds[0]));
+
+	struct rest_reply_data reply = {
+		.status_code = "404 Not Found",
+		.content_type = "text/plain",
+		.content_length = 6,
+		.content = "nope\r\n",
+	};
+
+	ASSERT_INT_EQ(0, rest_client_reply(&client, &reply));
+	ASSERT_TRUE(rest_client_is_flushed(&client));
+
+	char buffer[1024];
+	ssize_t n = recv(fds[1], buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+	ASSERT_INT_GE(0, n);
+	buffer[n] = '\0';
+
+	ASSERT_INT_EQ(0, strncmp(buffer, "HTTP/1.1 404 Not Found\r\n", 24));
+	ASSERT_STR_EQ("\r\n\r\nnope\r\n", buffer + n - 10);
+
+	destroy_client(&client);
+	close(fds[1]);
+	return 0;
+}
+
+/* What the socket does not take is kept, and what follows goes behind it */
+static int test_remainder_is_queued(void)
+{
+	int fds[2];
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+	struct rest_client client;
+	ASSERT_INT_EQ(0, init_client(&client, fds[0]));
+
+	size_t size = 1 << 22;
+	char* content = malloc(size);
+	ASSERT_TRUE(content);
+	memset(content, 'x', size);
+
+	struct rest_reply_data reply = {
+		.status_code = "200 OK",
+		.content_type = "text/plain",
+		.content_length = size,
+		.content = content,
+	};
+
+	ASSERT_INT_EQ(0, rest_client_reply(&client, &reply));
+	ASSERT_FALSE(rest_client_is_flushed(&client));
+
+	size_t n_unsent = client.unsent.index;
+	ASSERT_TRUE(n_unsent > 0 && n_unsent <= size);
+
+	/* Nothing of the second reply is sent before the first */
+	ASSERT_INT_EQ(0, rest_client_reply(&client, &reply));
+	ASSERT_TRUE(client.unsent.index > n_unsent + size);
+
+	char buffer[64];
+	ssize_t n = recv(fds[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+	ASSERT_INT_GE(0, n);
+	ASSERT_INT_EQ(0, strncmp(buffer, "HTTP/1.1 200 OK\r\n", 17));
+
+	free(content);
+	destroy_client(&client);
+	close(fds[1]);
+	return 0;
+}
+
 int main()
 {
 	int r = 0;
 	RUN_TEST(test_find_service_empty);
 	RUN_TEST(test_service_is_match);
 	RUN_TEST(test_find_service_one);
+	RUN_TEST(test_find_service_many);
 	RUN_TEST(test_open_server__socket_failure);
 	RUN_TEST(test_open_server__bind_failure);
 	RUN_TEST(test_open_server__listen_failure);
@@ -274,5 +485,10 @@ int main()
 	RUN_TEST(test_read__empty);
 	RUN_TEST(test_read__closed);
 	RUN_TEST(test_read__twice);
+	RUN_TEST(test_chunked);
+	RUN_TEST(test_response_head);
+	RUN_TEST(test_response_too_many_segments);
+	RUN_TEST(test_reply_is_sent_at_once);
+	RUN_TEST(test_remainder_is_queued);
 	return r;
 }
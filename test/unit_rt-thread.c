@@ -0,0 +1,69 @@
+#include <sched.h>
+#include "tst.h"
+#include "rt-thread.h"
+
+static int has_cpu(const struct rt_thread_sched* sched, int cpu)
+{
+	return CPU_ISSET(cpu, &sched->cpus);
+}
+
+static int test_parse_policy_and_priority()
+{
+	struct rt_thread_sched sched;
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, "fifo:80"));
+	ASSERT_INT_EQ(SCHED_FIFO, sched.policy);
+	ASSERT_INT_EQ(80, sched.priority);
+	ASSERT_INT_EQ(0, CPU_COUNT(&sched.cpus));
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, "other:10"));
+	ASSERT_INT_EQ(SCHED_OTHER, sched.policy);
+	ASSERT_INT_EQ(10, sched.priority);
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, "idle"));
+	ASSERT_INT_EQ(SCHED_IDLE, sched.policy);
+	ASSERT_INT_EQ(0, sched.priority);
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, ""));
+	ASSERT_INT_EQ(-1, sched.policy);
+	return 0;
+}
+
+static int test_parse_cpus()
+{
+	struct rt_thread_sched sched;
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, "rr:10@0,2-3"));
+	ASSERT_INT_EQ(SCHED_RR, sched.policy);
+	ASSERT_INT_EQ(3, CPU_COUNT(&sched.cpus));
+	ASSERT_TRUE(has_cpu(&sched, 0));
+	ASSERT_FALSE(has_cpu(&sched, 1));
+	ASSERT_TRUE(has_cpu(&sched, 3));
+
+	ASSERT_INT_EQ(0, rt_thread_parse_sched(&sched, "@1"));
+	ASSERT_INT_EQ(-1, sched.policy);
+	ASSERT_INT_EQ(1, CPU_COUNT(&sched.cpus));
+	return 0;
+}
+
+static int test_parse_invalid()
+{
+	struct rt_thread_sched sched;
+
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, "deadline"));
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, "fifo:0"));
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, "fifo:x"));
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, ":10"));
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, "fifo@"));
+	ASSERT_INT_EQ(-1, rt_thread_parse_sched(&sched, "fifo@3-1"));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_parse_policy_and_priority);
+	RUN_TEST(test_parse_cpus);
+	RUN_TEST(test_parse_invalid);
+	return r;
+}
@@ -0,0 +1,102 @@
+#include "tst.h"
+#include "sdo-gateway.h"
+
+static struct sdo_gateway_command command;
+
+static int parse(const char* str)
+{
+	static char line[256];
+	strcpy(line, str);
+	return sdo_gateway_parse(&command, line);
+}
+
+static int test_read()
+{
+	ASSERT_INT_EQ(0, parse("[1] 5 r 0x1017 0 u16"));
+	ASSERT_INT_EQ(SDO_GATEWAY_READ, command.type);
+	ASSERT_TRUE(command.has_sequence);
+	ASSERT_UINT_EQ(1, command.sequence);
+	ASSERT_INT_EQ(-1, command.net);
+	ASSERT_INT_EQ(5, command.node);
+	ASSERT_INT_EQ(0x1017, command.index);
+	ASSERT_INT_EQ(0, command.subindex);
+	ASSERT_INT_EQ(CANOPEN_UNSIGNED16, command.datatype);
+
+	ASSERT_INT_EQ(0, parse("  read 4096 1 i32\r"));
+	ASSERT_INT_EQ(SDO_GATEWAY_READ, command.type);
+	ASSERT_TRUE(!command.has_sequence);
+	ASSERT_INT_EQ(-1, command.node);
+	ASSERT_INT_EQ(0x1000, command.index);
+	ASSERT_INT_EQ(1, command.subindex);
+	ASSERT_INT_EQ(CANOPEN_INTEGER32, command.datatype);
+	return 0;
+}
+
+static int test_write()
+{
+	ASSERT_INT_EQ(0, parse("[7] 2 12 w 0x1017 0 u16 1000"));
+	ASSERT_INT_EQ(SDO_GATEWAY_WRITE, command.type);
+	ASSERT_UINT_EQ(7, command.sequence);
+	ASSERT_INT_EQ(2, command.net);
+	ASSERT_INT_EQ(12, command.node);
+	ASSERT_STR_EQ("1000", command.value);
+	return 0;
+}
+
+static int test_quoted_string()
+{
+	ASSERT_INT_EQ(0, parse("[8] 3 write 0x2000 1 vs \"say \"\"hi\"\" now\""));
+	ASSERT_INT_EQ(CANOPEN_VISIBLE_STRING, command.datatype);
+	ASSERT_STR_EQ("say \"hi\" now", command.value);
+
+	ASSERT_INT_EQ(0, parse("[9] 3 w 0x2000 1 vs \"\""));
+	ASSERT_STR_EQ("", command.value);
+
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX,
+		      parse("[10] 3 w 0x2000 1 vs \"open"));
+	ASSERT_UINT_EQ(10, command.sequence);
+	return 0;
+}
+
+static int test_set()
+{
+	ASSERT_INT_EQ(0, parse("[1] set network 2"));
+	ASSERT_INT_EQ(SDO_GATEWAY_SET_NET, command.type);
+	ASSERT_INT_EQ(2, command.net);
+
+	ASSERT_INT_EQ(0, parse("[2] set node 0x7f"));
+	ASSERT_INT_EQ(SDO_GATEWAY_SET_NODE, command.type);
+	ASSERT_INT_EQ(127, command.node);
+
+	ASSERT_INT_EQ(SDO_GATEWAY_E_UNSUPPORTED, parse("[3] set sdo_timeout 5"));
+	return 0;
+}
+
+/* The sequence number is kept so that the error can be replied to */
+static int test_errors()
+{
+	ASSERT_INT_EQ(SDO_GATEWAY_E_UNSUPPORTED, parse("[4] 5 start"));
+	ASSERT_TRUE(command.has_sequence);
+	ASSERT_UINT_EQ(4, command.sequence);
+
+	ASSERT_INT_EQ(SDO_GATEWAY_E_UNSUPPORTED, parse("[5] 5 r 0x1000 0 os"));
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[6] 5 r 0x1000 0"));
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[7] 5 r 0x10000 0 u8"));
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[8] 5 r 0x1000 256 u8"));
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[9] 5"));
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[x] 5 r 0x1000 0 u8"));
+	ASSERT_TRUE(!command.has_sequence);
+	ASSERT_INT_EQ(SDO_GATEWAY_E_SYNTAX, parse("[1 5 r 0x1000 0 u8"));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_read);
+	RUN_TEST(test_write);
+	RUN_TEST(test_quoted_string);
+	RUN_TEST(test_set);
+	RUN_TEST(test_errors);
+	return r;
+}
@@ -0,0 +1,177 @@
+#include "tst.h"
+#include "sdo-poll.h"
+#include "canopen/sdo.h"
+#include "canopen.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static char* format(uint32_t* gen, int* n_events)
+{
+	static char buffer[16384];
+	char nodes[CANOPEN_NODEID_MAX + 1];
+
+	memset(nodes, 1, sizeof(nodes));
+
+	FILE* output = fmemopen(buffer, sizeof(buffer), "w");
+	*n_events = sdo_poll_format_events(output, gen, -1, nodes);
+	fclose(output);
+
+	return buffer;
+}
+
+static char* write_json(const struct sdo_poll_group* group)
+{
+	static char buffer[16384];
+
+	FILE* output = fmemopen(buffer, sizeof(buffer), "w");
+	sdo_poll_write_json(output, group);
+	fclose(output);
+
+	return buffer;
+}
+
+static int test_parse_object()
+{
+	struct sdo_poll_object object;
+
+	ASSERT_INT_EQ(0, sdo_poll_parse_object(&object, "5/0x6000/1"));
+	ASSERT_INT_EQ(0, object.bus);
+	ASSERT_INT_EQ(5, object.nodeid);
+	ASSERT_INT_EQ(0x6000, object.index);
+	ASSERT_INT_EQ(1, object.subindex);
+	ASSERT_INT_EQ(CANOPEN_UNKNOWN, object.type);
+
+	ASSERT_INT_EQ(0, sdo_poll_parse_object(&object,
+					       "127/0x1001/0/unsigned8"));
+	ASSERT_INT_EQ(127, object.nodeid);
+	ASSERT_INT_EQ(CANOPEN_UNSIGNED8, object.type);
+
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "0/0x6000/1"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "128/0x6000/1"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "5/0x100/1"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "5/0x6000/256"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "5/0x6000"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "5/0x6000/1/u16"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "5/0x6000/1/unsigned16/x"));
+	ASSERT_INT_EQ(-1, sdo_poll_parse_object(&object, "nosuchbus#5/0x6000/1"));
+	return 0;
+}
+
+static int test_group_new()
+{
+	struct sdo_poll_group* group = sdo_poll_group_new("temps", 1000,
+		" 5/0x6000/1,6/0x6000/1\n7/0x1001/0/unsigned8 ");
+	ASSERT_TRUE(group != NULL);
+	ASSERT_STR_EQ("temps", group->name);
+	ASSERT_UINT_EQ(1000, group->period);
+	ASSERT_UINT_EQ(3, group->n_objects);
+	ASSERT_INT_EQ(6, group->object[1].nodeid);
+	ASSERT_PTR_EQ(group, group->object[2].group);
+	sdo_poll_group_unref(group);
+
+	ASSERT_PTR_EQ(NULL, sdo_poll_group_new("temps", 1000, ""));
+	ASSERT_INT_EQ(EINVAL, errno);
+	ASSERT_PTR_EQ(NULL, sdo_poll_group_new("temps", 10, "5/0x6000/1"));
+	ASSERT_PTR_EQ(NULL, sdo_poll_group_new("a b", 1000, "5/0x6000/1"));
+	ASSERT_PTR_EQ(NULL, sdo_poll_group_new("", 1000, "5/0x6000/1"));
+	ASSERT_PTR_EQ(NULL, sdo_poll_group_new("temps", 1000,
+					       "5/0x6000/1 5/x"));
+	return 0;
+}
+
+static int test_add_and_remove()
+{
+	struct sdo_poll_group* group = sdo_poll_group_new("a", 1000,
+							  "5/0x6000/1");
+	ASSERT_INT_EQ(0, sdo_poll_add(group));
+	ASSERT_PTR_EQ(group, sdo_poll_find("a"));
+
+	/* The same name replaces the group */
+	struct sdo_poll_group* other = sdo_poll_group_new("a", 500,
+							  "6/0x6000/1");
+	ASSERT_INT_EQ(0, sdo_poll_add(other));
+	ASSERT_PTR_EQ(other, sdo_poll_find("a"));
+
+	ASSERT_INT_EQ(0, sdo_poll_remove("a"));
+	ASSERT_PTR_EQ(NULL, sdo_poll_find("a"));
+	ASSERT_INT_EQ(-1, sdo_poll_remove("a"));
+	return 0;
+}
+
+static int test_values_are_cached()
+{
+	struct sdo_poll_group* group = sdo_poll_group_new("values", 1000,
+		"5/0x6000/1/unsigned16 6/0x1008/0/visible_string");
+	ASSERT_INT_EQ(0, sdo_poll_add(group));
+
+	char* json = write_json(group);
+	ASSERT_TRUE(strstr(json, "\"node\": 5, \"index\": \"0x6000\", \"subindex\": 1, \"value\": null, \"timestamp\": 0") != NULL);
+
+	uint8_t value[] = { 0x34, 0x12 };
+	sdo_poll__record(&group->object[0], SDO_REQ_OK, 0, value,
+			 sizeof(value), 0, 1234);
+	sdo_poll__record(&group->object[1], SDO_REQ_OK, 0, "drive", 5, 0,
+			 1235);
+
+	json = write_json(group);
+	ASSERT_TRUE(strstr(json, "\"value\": \"4660\", \"timestamp\": 1234") != NULL);
+	ASSERT_TRUE(strstr(json, "\"value\": \"drive\", \"timestamp\": 1235") != NULL);
+	ASSERT_TRUE(strstr(json, "error") == NULL);
+
+	/* The last good value is kept when a read fails */
+	sdo_poll__record(&group->object[0], SDO_REQ_REMOTE_ABORT,
+			 SDO_ABORT_NEXIST, NULL, 0, 0, 0);
+
+	json = write_json(group);
+	ASSERT_TRUE(strstr(json, "\"value\": \"4660\", \"timestamp\": 1234, \"error\": ") != NULL);
+
+	sdo_poll_remove("values");
+	return 0;
+}
+
+static int test_only_changes_are_events()
+{
+	struct sdo_poll_group* group = sdo_poll_group_new("events", 1000,
+		"5/0x6000/1/unsigned8 6/0x6000/1/unsigned8");
+	ASSERT_INT_EQ(0, sdo_poll_add(group));
+
+	uint32_t gen = 0;
+	int n_events = 0;
+	uint8_t value = 7;
+
+	sdo_poll__record(&group->object[0], SDO_REQ_OK, 0, &value, 1, 0, 1);
+	sdo_poll__record(&group->object[1], SDO_REQ_OK, 0, &value, 1, 0, 1);
+
+	char* output = format(&gen, &n_events);
+	ASSERT_INT_EQ(2, n_events);
+	ASSERT_TRUE(strstr(output, "event: poll\ndata: {\"group\": \"events\", ") != NULL);
+
+	/* A new timestamp alone is no change */
+	sdo_poll__record(&group->object[0], SDO_REQ_OK, 0, &value, 1, 0, 2);
+	format(&gen, &n_events);
+	ASSERT_INT_EQ(0, n_events);
+
+	value = 8;
+	sdo_poll__record(&group->object[1], SDO_REQ_OK, 0, &value, 1, 0, 3);
+	output = format(&gen, &n_events);
+	ASSERT_INT_EQ(1, n_events);
+	ASSERT_TRUE(strstr(output, "\"node\": 6") != NULL);
+	ASSERT_TRUE(strstr(output, "\"value\": \"8\"") != NULL);
+
+	sdo_poll_remove("events");
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_parse_object);
+	RUN_TEST(test_group_new);
+	RUN_TEST(test_add_and_remove);
+	RUN_TEST(test_values_are_cached);
+	RUN_TEST(test_only_changes_are_events);
+	return r;
+}
@@ -0,0 +1,261 @@
+#include "tst.h"
+#include "sdo-trace.h"
+#include "canopen/sdo.h"
+
+#include <string.h>
+
+static struct sdo_tracker tracker_;
+static struct st_transaction transaction_;
+static uint64_t now_;
+
+static struct can_frame make_frame(uint32_t can_id, int cs)
+{
+	struct can_frame cf;
+	memset(&cf, 0, sizeof(cf));
+
+	cf.can_id = can_id;
+	cf.can_dlc = 8;
+	sdo_set_cs(&cf, cs);
+	return cf;
+}
+
+static struct can_frame make_init(uint32_t can_id, int cs, int index,
+				  int subindex)
+{
+	struct can_frame cf = make_frame(can_id, cs);
+	sdo_set_index(&cf, index);
+	sdo_set_subindex(&cf, subindex);
+	return cf;
+}
+
+/* Each frame comes 1 ms after the last one */
+static int feed(struct can_frame cf)
+{
+	now_ += 1000;
+	return st_feed(&tracker_, &cf, now_, &transaction_);
+}
+
+static void reset(void)
+{
+	st_init(&tracker_);
+	memset(&transaction_, 0, sizeof(transaction_));
+	now_ = 1000000;
+}
+
+static int test_expediated_upload()
+{
+	reset();
+
+	ASSERT_INT_EQ(0, feed(make_init(0x605, SDO_CCS_UL_INIT_REQ, 0x1018,
+					1)));
+
+	struct can_frame res = make_init(0x585, SDO_SCS_UL_INIT_RES, 0x1018, 1);
+	sdo_expediate(&res);
+	sdo_indicate_size(&res);
+	sdo_set_expediated_size(&res, 4);
+	ASSERT_INT_EQ(1, feed(res));
+
+	ASSERT_INT_EQ(5, transaction_.node);
+	ASSERT_INT_EQ(ST_UPLOAD, transaction_.type);
+	ASSERT_INT_EQ(ST_DONE, transaction_.result);
+	ASSERT_INT_EQ(0x1018, transaction_.index);
+	ASSERT_INT_EQ(1, transaction_.subindex);
+	ASSERT_UINT_EQ(4, transaction_.size);
+	ASSERT_UINT_EQ(0, transaction_.n_segments);
+	ASSERT_TRUE(transaction_.end - transaction_.start == 1000);
+
+	const struct st_stats* stats = &tracker_.stats[5];
+	ASSERT_TRUE(stats->n_transactions == 1);
+	ASSERT_TRUE(stats->response.count == 1);
+	ASSERT_TRUE(stats->response.max == 1000);
+	ASSERT_TRUE(stats->duration.max == 1000);
+	return 0;
+}
+
+static int test_segmented_download()
+{
+	reset();
+
+	struct can_frame init = make_init(0x60a, SDO_CCS_DL_INIT_REQ, 0x2000, 0);
+	sdo_indicate_size(&init);
+	sdo_set_indicated_size(&init, 10);
+	ASSERT_INT_EQ(0, feed(init));
+	ASSERT_INT_EQ(0, feed(make_init(0x58a, SDO_SCS_DL_INIT_RES, 0x2000, 0)));
+
+	struct can_frame seg = make_frame(0x60a, SDO_CCS_DL_SEG_REQ);
+	sdo_set_segment_size(&seg, 7);
+	ASSERT_INT_EQ(0, feed(seg));
+	ASSERT_INT_EQ(0, feed(make_frame(0x58a, SDO_SCS_DL_SEG_RES)));
+
+	seg = make_frame(0x60a, SDO_CCS_DL_SEG_REQ);
+	sdo_toggle(&seg);
+	sdo_set_segment_size(&seg, 3);
+	sdo_end_segment(&seg);
+	ASSERT_INT_EQ(0, feed(seg));
+
+	ASSERT_INT_EQ(1, feed(make_frame(0x58a, SDO_SCS_DL_SEG_RES)));
+	ASSERT_INT_EQ(ST_DOWNLOAD, transaction_.type);
+	ASSERT_INT_EQ(ST_DONE, transaction_.result);
+	ASSERT_UINT_EQ(10, transaction_.size);
+	ASSERT_UINT_EQ(2, transaction_.n_segments);
+	ASSERT_TRUE(transaction_.end - transaction_.start == 5000);
+	ASSERT_TRUE(tracker_.stats[10].response.count == 3);
+	return 0;
+}
+
+static int test_abort()
+{
+	reset();
+
+	ASSERT_INT_EQ(0, feed(make_init(0x605, SDO_CCS_UL_INIT_REQ, 0x1234,
+					5)));
+
+	struct can_frame abort = make_init(0x585, SDO_SCS_ABORT, 0x1234, 5);
+	sdo_set_abort_code(&abort, SDO_ABORT_NEXIST);
+	ASSERT_INT_EQ(1, feed(abort));
+
+	ASSERT_INT_EQ(ST_ABORTED, transaction_.result);
+	ASSERT_UINT_EQ(SDO_ABORT_NEXIST, transaction_.abort_code);
+	ASSERT_TRUE(tracker_.stats[5].n_aborts == 1);
+	ASSERT_TRUE(tracker_.stats[5].response.count == 1);
+
+	/* Only completed transactions go into the duration histogram */
+	ASSERT_TRUE(tracker_.stats[5].duration.count == 0);
+	return 0;
+}
+
+static int test_interrupted_and_unexpected_frames()
+{
+	reset();
+
+	/* The start of this one was missed */
+	ASSERT_INT_EQ(0, feed(make_frame(0x585, SDO_SCS_UL_SEG_RES)));
+	ASSERT_INT_EQ(0, feed(make_frame(0x605, SDO_CCS_UL_SEG_REQ)));
+
+	ASSERT_INT_EQ(0, feed(make_init(0x605, SDO_CCS_UL_INIT_REQ, 0x1000,
+					0)));
+	ASSERT_INT_EQ(1, feed(make_init(0x605, SDO_CCS_UL_INIT_REQ, 0x1001,
+					0)));
+
+	ASSERT_INT_EQ(ST_INTERRUPTED, transaction_.result);
+	ASSERT_INT_EQ(0x1000, transaction_.index);
+	ASSERT_TRUE(tracker_.stats[5].response.count == 0);
+	return 0;
+}
+
+static int test_block_download()
+{
+	reset();
+
+	ASSERT_INT_EQ(0, feed(make_init(0x605, SDO_CCS_BLK_DL_REQ, 0x1f50, 1)));
+
+	struct can_frame res = make_init(0x585, SDO_SCS_BLK_DL_RES, 0x1f50, 1);
+	sdo_set_block_cs(&res, SDO_BLOCK_INIT);
+	ASSERT_INT_EQ(0, feed(res));
+
+	for (int i = 1; i <= 3; ++i) {
+		struct can_frame seg;
+		memset(&seg, 0, sizeof(seg));
+		seg.can_id = 0x605;
+		seg.can_dlc = 8;
+		sdo_set_block_seqno(&seg, i);
+		if (i == 3)
+			sdo_end_block_segment(&seg);
+		ASSERT_INT_EQ(0, feed(seg));
+	}
+
+	struct can_frame ack = make_frame(0x585, SDO_SCS_BLK_DL_RES);
+	sdo_set_block_cs(&ack, SDO_BLOCK_ACK);
+	ASSERT_INT_EQ(0, feed(ack));
+
+	struct can_frame end = make_frame(0x605, SDO_CCS_BLK_DL_REQ);
+	sdo_set_block_cs(&end, SDO_BLOCK_END);
+	sdo_set_block_unused_size(&end, 4);
+	ASSERT_INT_EQ(0, feed(end));
+
+	struct can_frame end_res = make_frame(0x585, SDO_SCS_BLK_DL_RES);
+	sdo_set_block_cs(&end_res, SDO_BLOCK_END);
+	ASSERT_INT_EQ(1, feed(end_res));
+
+	ASSERT_INT_EQ(ST_BLOCK_DOWNLOAD, transaction_.type);
+	ASSERT_INT_EQ(ST_DONE, transaction_.result);
+	ASSERT_INT_EQ(0x1f50, transaction_.index);
+	ASSERT_UINT_EQ(17, transaction_.size);
+	ASSERT_UINT_EQ(3, transaction_.n_segments);
+	ASSERT_TRUE(tracker_.stats[5].response.count == 3);
+	return 0;
+}
+
+static int test_block_upload()
+{
+	reset();
+
+	ASSERT_INT_EQ(0, feed(make_init(0x605, SDO_CCS_BLK_UL_REQ, 0x1f50, 1)));
+	ASSERT_INT_EQ(0, feed(make_init(0x585, SDO_SCS_BLK_UL_RES, 0x1f50, 1)));
+
+	struct can_frame start = make_frame(0x605, SDO_CCS_BLK_UL_REQ);
+	sdo_set_block_cs(&start, SDO_BLOCK_START);
+	ASSERT_INT_EQ(0, feed(start));
+
+	for (int i = 1; i <= 2; ++i) {
+		struct can_frame seg;
+		memset(&seg, 0, sizeof(seg));
+		seg.can_id = 0x585;
+		seg.can_dlc = 8;
+		sdo_set_block_seqno(&seg, i);
+		if (i == 2)
+			sdo_end_block_segment(&seg);
+		ASSERT_INT_EQ(0, feed(seg));
+	}
+
+	struct can_frame ack = make_frame(0x605, SDO_CCS_BLK_UL_REQ);
+	sdo_set_block_cs(&ack, SDO_BLOCK_ACK);
+	ASSERT_INT_EQ(0, feed(ack));
+
+	struct can_frame end = make_frame(0x585, SDO_SCS_BLK_UL_RES);
+	end.data[0] |= 1;
+	sdo_set_block_unused_size(&end, 2);
+	ASSERT_INT_EQ(0, feed(end));
+
+	struct can_frame end_res = make_frame(0x605, SDO_CCS_BLK_UL_REQ);
+	sdo_set_block_cs(&end_res, SDO_BLOCK_END);
+	ASSERT_INT_EQ(1, feed(end_res));
+
+	ASSERT_INT_EQ(ST_BLOCK_UPLOAD, transaction_.type);
+	ASSERT_INT_EQ(ST_DONE, transaction_.result);
+	ASSERT_UINT_EQ(12, transaction_.size);
+	ASSERT_UINT_EQ(2, transaction_.n_segments);
+
+	/* The server answered the init, the start and the ack */
+	ASSERT_TRUE(tracker_.stats[5].response.count == 3);
+	return 0;
+}
+
+static int test_print_stats()
+{
+	char* text = NULL;
+	size_t size = 0;
+
+	test_expediated_upload();
+
+	FILE* stream = open_memstream(&text, &size);
+	st_print_stats(&tracker_, stream);
+	fclose(stream);
+
+	ASSERT_TRUE(strstr(text, "     5        1        0 ") != NULL);
+	free(text);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_expediated_upload);
+	RUN_TEST(test_segmented_download);
+	RUN_TEST(test_abort);
+	RUN_TEST(test_interrupted_and_unexpected_frames);
+	RUN_TEST(test_block_download);
+	RUN_TEST(test_block_upload);
+	RUN_TEST(test_print_stats);
+	return r;
+}
@@ -33,6 +33,8 @@ FAKE_VOID_FUNC(mloop_timer_set_callback, struct mloop_timer*, mloop_timer_fn);
 FAKE_VALUE_FUNC(void*, mloop_timer_get_context, const struct mloop_timer*);
 FAKE_VOID_FUNC(on_done, struct sdo_async*);
 
+void sdo_async__on_timeout(struct mloop_timer* timer);
+
 struct mloop_timer timer;
 
 static struct sdo_srv server;
@@ -44,6 +46,14 @@ static char srv_data[4096];
 static size_t srv_size;
 static int srv_index, srv_subindex;
 
+static int use_block;
+
+/* Frames with these numbers are lost on the way */
+static int n_client_frames, drop_client_frame = -1;
+static int n_server_frames, drop_server_frame = -1;
+
+static char big_data[3000];
+
 static const char loremipsum[] = " \
 Lorem ipsum dolor sit amet, consectetur adipiscing elit. Ut in mi faucibus, \
 lacinia lectus vel, feugiat diam. Etiam nec placerat sem, at luctus arcu. \
@@ -144,11 +154,16 @@ static int feed_server(struct can_frame* cf);
 static int push_to_server()
 {
 	struct can_frame out = { 0 };
-	ssize_t size = recv(crfd, &out, sizeof(out), MSG_DONTWAIT);
-	if (size != sizeof(out))
-		return 0;
 
-	return feed_server(&out);
+	while (recv(crfd, &out, sizeof(out), MSG_DONTWAIT) == sizeof(out)) {
+		if (n_client_frames++ == drop_client_frame)
+			continue;
+
+		if (feed_server(&out) < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
 static int feed_client(struct can_frame* cf)
@@ -162,11 +177,16 @@ static int feed_client(struct can_frame* cf)
 static int push_to_client()
 {
 	struct can_frame out = { 0 };
-	ssize_t size = recv(srfd, &out, sizeof(out), MSG_DONTWAIT);
-	if (size != sizeof(out))
-		return 0;
 
-	return feed_client(&out);
+	while (recv(srfd, &out, sizeof(out), MSG_DONTWAIT) == sizeof(out)) {
+		if (n_server_frames++ == drop_server_frame)
+			continue;
+
+		if (feed_client(&out) < 0)
+			return -1;
+	}
+
+	return 0;
 }
 
 static int feed_server(struct can_frame* cf)
@@ -188,10 +208,13 @@ static int download(const char* str)
 		.timeout = 1000,
 		.data = str,
 		.size = size,
-		.on_done = on_done
+		.on_done = on_done,
+		.use_block = use_block,
 	};
 
 	RESET_FAKE(on_done);
+	n_client_frames = 0;
+	n_server_frames = 0;
 
 	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
 	reset_srv_data();
@@ -201,6 +224,7 @@ static int download(const char* str)
 	ASSERT_INT_EQ(0x1234, srv_index);
 	ASSERT_INT_EQ(42, srv_subindex);
 	ASSERT_INT_EQ(1, on_done_fake.call_count);
+	ASSERT_INT_EQ(SDO_REQ_OK, client.status);
 
 	return 0;
 }
@@ -213,9 +237,12 @@ static int upload(const char* str)
 		.subindex = 42,
 		.timeout = 1000,
 		.on_done = on_done,
+		.use_block = use_block,
 	};
 
 	RESET_FAKE(on_done);
+	n_client_frames = 0;
+	n_server_frames = 0;
 
 	set_srv_data(str);
 	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
@@ -263,14 +290,366 @@ static int test_upload_big()
 	return upload(loremipsum);
 }
 
+static int test_crc16()
+{
+	ASSERT_UINT_EQ(0x31c3, sdo_crc16(0, "123456789", 9));
+	ASSERT_UINT_EQ(0x31c3, sdo_crc16(sdo_crc16(0, "1234", 4), "56789", 5));
+	return 0;
+}
+
+static int test_block_download()
+{
+	use_block = 1;
+	int r = download("foobarx")
+	     || download("foobarxy")
+	     || download("foobarxyzzy")
+	     || download("foobarxyzzy01")
+	     || download(loremipsum)
+	     || download(big_data);
+	use_block = 0;
+	ASSERT_FALSE(client.is_block_unsupported);
+
+	/* Only the initiation, one acknowledgement per block and the end */
+	ASSERT_INT_LT(10, n_server_frames);
+	return r;
+}
+
+static int test_block_upload()
+{
+	use_block = 1;
+	int r = upload("")
+	     || upload("foo")
+	     || upload("foobarx")
+	     || upload("foobarxy")
+	     || upload("foobarxyzzy01")
+	     || upload(loremipsum)
+	     || upload(big_data);
+	use_block = 0;
+	ASSERT_FALSE(client.is_block_unsupported);
+	return r;
+}
+
+static int test_block_download_with_lost_segment()
+{
+	use_block = 1;
+	drop_client_frame = 3;
+	int r = download(big_data);
+	drop_client_frame = -1;
+	use_block = 0;
+	return r;
+}
+
+static int test_block_upload_with_lost_segment()
+{
+	use_block = 1;
+	drop_server_frame = 3;
+	int r = upload(big_data);
+	drop_server_frame = -1;
+	use_block = 0;
+	return r;
+}
+
+static int test_block_fallback()
+{
+	struct sdo_async_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.index = 0x1234,
+		.subindex = 42,
+		.timeout = 1000,
+		.data = loremipsum,
+		.size = sizeof(loremipsum),
+		.on_done = on_done,
+		.use_block = 1,
+	};
+
+	RESET_FAKE(on_done);
+	reset_srv_data();
+
+	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
+
+	/* Answer the initiation like a server without block support */
+	struct can_frame cf = { 0 };
+	ASSERT_INT_EQ(sizeof(cf), recv(crfd, &cf, sizeof(cf), MSG_DONTWAIT));
+	ASSERT_INT_EQ(SDO_CCS_BLK_DL_REQ, sdo_get_cs(&cf));
+
+	sdo_clear_frame(&cf);
+	cf.can_id = R_TSDO + 42;
+	sdo_abort(&cf, SDO_ABORT_INVALID_CS, 0x1234, 42);
+	ASSERT_INT_EQ(0, feed_client(&cf));
+
+	ASSERT_STR_EQ(loremipsum, srv_data);
+	ASSERT_INT_EQ(1, on_done_fake.call_count);
+	ASSERT_INT_EQ(SDO_REQ_OK, client.status);
+	ASSERT_TRUE(client.is_block_unsupported);
+
+	/* The next transfer goes straight to segmented mode */
+	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
+	ASSERT_INT_EQ(sizeof(cf), recv(crfd, &cf, sizeof(cf), MSG_DONTWAIT));
+	ASSERT_INT_EQ(SDO_CCS_DL_INIT_REQ, sdo_get_cs(&cf));
+	sdo_async_stop(&client);
+
+	client.is_block_unsupported = 0;
+	return 0;
+}
+
+static int test_round_trips_are_measured()
+{
+	struct sdo_rtt rtt;
+	sdo_rtt_init(&rtt);
+	client.rtt = &rtt;
+
+	/* Two segments after the initiation */
+	int rc = upload("foobarx");
+	client.rtt = NULL;
+	if (rc)
+		return rc;
+
+	ASSERT_INT_EQ(3, rtt.n_samples);
+	ASSERT_INT_EQ(0, rtt.n_timeouts);
+	return 0;
+}
+
+static int start_upload(void)
+{
+	struct sdo_async_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = 0x1234,
+		.subindex = 42,
+		.timeout = 1000,
+		.on_done = on_done,
+	};
+
+	RESET_FAKE(on_done);
+	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
+
+	struct can_frame cf = { 0 };
+	ASSERT_INT_EQ(sizeof(cf), recv(crfd, &cf, sizeof(cf), MSG_DONTWAIT));
+	return 0;
+}
+
+/* Answers an expedited upload of 0x1234:42 as if 0x1235:42 had been asked */
+static int upload_from_other_object(void)
+{
+	ASSERT_INT_EQ(0, start_upload());
+
+	struct can_frame cf = { 0 };
+	cf.can_id = R_TSDO + 42;
+	sdo_set_cs(&cf, SDO_SCS_UL_INIT_RES);
+	sdo_expediate(&cf);
+	sdo_indicate_size(&cf);
+	sdo_set_expediated_size(&cf, 1);
+	sdo_set_index(&cf, 0x1235);
+	sdo_set_subindex(&cf, 42);
+	cf.data[SDO_EXPEDIATED_DATA_IDX] = 'x';
+	cf.can_dlc = CAN_MAX_DLC;
+	sdo_async_feed(&client, &cf);
+
+	/* The abort, if there is one */
+	recv(crfd, &cf, sizeof(cf), MSG_DONTWAIT);
+
+	ASSERT_INT_EQ(1, on_done_fake.call_count);
+	return 0;
+}
+
+static int test_multiplexer_mismatch_is_seen()
+{
+	memset(&client.seen, 0, sizeof(client.seen));
+
+	ASSERT_INT_EQ(0, upload_from_other_object());
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, client.status);
+	ASSERT_INT_EQ(1, client.seen.n_mux_mismatches);
+	ASSERT_TRUE(sdo_async_is_multiplexer_mixed_up(&client.seen));
+
+	client.quirks = SDO_ASYNC_QUIRK_IGNORE_MULTIPLEXER;
+	int rc = upload_from_other_object();
+	client.quirks = SDO_ASYNC_QUIRK_NONE;
+	if (rc)
+		return rc;
+
+	ASSERT_INT_EQ(SDO_REQ_OK, client.status);
+	ASSERT_INT_EQ(2, client.seen.n_mux_mismatches);
+	ASSERT_INT_EQ(2, client.seen.n_responses);
+	ASSERT_INT_EQ(0, client.seen.n_timeouts);
+	return 0;
+}
+
+static int test_late_response_is_not_a_mismatch()
+{
+	memset(&client.seen, 0, sizeof(client.seen));
+
+	/* The server does not answer in time */
+	ASSERT_INT_EQ(0, start_upload());
+	mloop_timer_get_context_fake.return_val = &client;
+	sdo_async__on_timeout(&timer);
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, client.status);
+
+	struct can_frame cf;
+	ASSERT_INT_EQ(sizeof(cf), recv(crfd, &cf, sizeof(cf), MSG_DONTWAIT));
+
+	/* Its answer comes in while the next upload is running */
+	ASSERT_INT_EQ(0, upload_from_other_object());
+	ASSERT_INT_EQ(0, client.seen.n_mux_mismatches);
+	ASSERT_INT_EQ(1, client.seen.n_timeouts);
+
+	ASSERT_INT_EQ(0, upload("foo"));
+	ASSERT_INT_EQ(1, client.seen.n_mux_matches);
+	ASSERT_FALSE(sdo_async_is_multiplexer_mixed_up(&client.seen));
+
+	/* Only the first response after the timeout is let off */
+	ASSERT_INT_EQ(0, upload_from_other_object());
+	ASSERT_INT_EQ(1, client.seen.n_mux_mismatches);
+	ASSERT_FALSE(sdo_async_is_multiplexer_mixed_up(&client.seen));
+	return 0;
+}
+
+static struct vector streamed;
+static int n_chunks, pause_at_chunk = -1, abort_at_chunk = -1;
+
+static int on_data(struct sdo_async* async, const void* data, size_t size)
+{
+	(void)async;
+
+	vector_append(&streamed, data, size);
+
+	int n = n_chunks++;
+	if (n == abort_at_chunk)
+		return -1;
+
+	return n == pause_at_chunk;
+}
+
+static int stream_upload(const char* str)
+{
+	struct sdo_async_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = 0x1234,
+		.subindex = 42,
+		.timeout = 1000,
+		.on_done = on_done,
+		.use_block = use_block,
+		.on_data = on_data,
+		.chunk_size = 64,
+	};
+
+	RESET_FAKE(on_done);
+	n_client_frames = 0;
+	n_server_frames = 0;
+	n_chunks = 0;
+	vector_clear(&streamed);
+
+	set_srv_data(str);
+	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
+	push_to_server();
+
+	if (client.is_paused) {
+		ASSERT_INT_EQ(0, on_done_fake.call_count);
+		ASSERT_INT_EQ(0, sdo_async_resume(&client));
+		push_to_server();
+	}
+
+	ASSERT_INT_EQ(1, on_done_fake.call_count);
+	ASSERT_INT_EQ(SDO_REQ_OK, client.status);
+	ASSERT_UINT_EQ(strlen(str) + 1, streamed.index);
+	ASSERT_STR_EQ(str, streamed.data);
+	ASSERT_UINT_EQ(0, client.buffer.index);
+
+	/* Only about one chunk and one block is ever buffered */
+	ASSERT_UINT_GE(2 * (64 + SDO_BLOCK_MAX_SIZE * SDO_SEGMENT_MAX_SIZE),
+		       client.buffer.size);
+
+	return 0;
+}
+
+static int test_streamed_upload()
+{
+	vector_init(&streamed, 64);
+
+	int r = stream_upload("foo")
+	     || stream_upload(loremipsum)
+	     || stream_upload(big_data);
+	ASSERT_INT_GT(10, n_chunks);
+
+	use_block = 1;
+	r = r || stream_upload("foo")
+	      || stream_upload(loremipsum)
+	      || stream_upload(big_data);
+	use_block = 0;
+
+	vector_destroy(&streamed);
+	return r;
+}
+
+static int test_streamed_upload_is_paused()
+{
+	vector_init(&streamed, 64);
+	pause_at_chunk = 0;
+
+	int r = stream_upload(big_data);
+
+	use_block = 1;
+	r = r || stream_upload(big_data);
+	use_block = 0;
+
+	pause_at_chunk = -1;
+	vector_destroy(&streamed);
+	return r;
+}
+
+static int test_streamed_upload_is_aborted()
+{
+	struct sdo_async_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = 0x1234,
+		.subindex = 42,
+		.timeout = 1000,
+		.on_done = on_done,
+		.on_data = on_data,
+		.chunk_size = 64,
+	};
+
+	vector_init(&streamed, 64);
+	RESET_FAKE(on_done);
+	n_chunks = 0;
+	abort_at_chunk = 0;
+
+	set_srv_data(big_data);
+	ASSERT_INT_EQ(0, sdo_async_start(&client, &info));
+	push_to_server();
+
+	ASSERT_INT_EQ(1, on_done_fake.call_count);
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, client.status);
+	ASSERT_INT_EQ(SDO_ABORT_GENERAL, client.abort_code);
+	ASSERT_INT_EQ(1, n_chunks);
+	ASSERT_INT_LT(0, sdo_async_resume(&client));
+
+	abort_at_chunk = -1;
+	vector_destroy(&streamed);
+	return 0;
+}
+
 int main()
 {
 	int r = 0;
 	initialize();
+
+	for (size_t i = 0; i < sizeof(big_data) - 1; ++i)
+		big_data[i] = 'a' + i % 26;
 	RUN_TEST(test_download);
 	RUN_TEST(test_download_big);
 	RUN_TEST(test_upload);
 	RUN_TEST(test_upload_big);
+	RUN_TEST(test_crc16);
+	RUN_TEST(test_block_download);
+	RUN_TEST(test_block_upload);
+	RUN_TEST(test_block_download_with_lost_segment);
+	RUN_TEST(test_block_upload_with_lost_segment);
+	RUN_TEST(test_block_fallback);
+	RUN_TEST(test_round_trips_are_measured);
+	RUN_TEST(test_multiplexer_mismatch_is_seen);
+	RUN_TEST(test_late_response_is_not_a_mismatch);
+	RUN_TEST(test_streamed_upload);
+	RUN_TEST(test_streamed_upload_is_paused);
+	RUN_TEST(test_streamed_upload_is_aborted);
 	cleanup();
 	return r;
 }
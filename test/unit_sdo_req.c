@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 #include "tst.h"
 #include "fff.h"
 #include "canopen/sdo_req.h"
@@ -10,6 +14,9 @@ FAKE_VALUE_FUNC(struct mloop*, mloop_default);
 FAKE_VALUE_FUNC(struct mloop_idle*, mloop_idle_new, struct mloop*);
 FAKE_VALUE_FUNC(int, mloop_idle_start, struct mloop_idle*);
 FAKE_VALUE_FUNC(int, mloop_idle_unref, struct mloop_idle*);
+FAKE_VALUE_FUNC(int, mloop_idle_stop, struct mloop_idle*);
+FAKE_VALUE_FUNC(int, mloop_idle_notify, struct mloop_idle*);
+FAKE_VALUE_FUNC(int, mloop_is_current, const struct mloop*);
 FAKE_VOID_FUNC(mloop_idle_set_context, struct mloop_idle*, void*,
 	       mloop_free_fn);
 FAKE_VALUE_FUNC(void*, mloop_idle_get_context, const struct mloop_idle*);
@@ -19,6 +26,7 @@ FAKE_VOID_FUNC(mloop_idle_set_priority, struct mloop_idle*, unsigned long);
 FAKE_VALUE_FUNC(int, sdo_async_init, struct sdo_async*, const struct sock*,
 		int);
 FAKE_VALUE_FUNC(int, sdo_async_stop, struct sdo_async*);
+FAKE_VALUE_FUNC(int, sdo_async_abort, struct sdo_async*, enum sdo_abort_code);
 FAKE_VOID_FUNC(sdo_async_destroy, struct sdo_async*);
 FAKE_VALUE_FUNC(int, sdo_async_start, struct sdo_async*,
 		const struct sdo_async_info*);
@@ -50,6 +58,82 @@ static int test_req_new_free()
 	return 0;
 }
 
+static int test_req_inline_data()
+{
+	uint32_t small = 42;
+	char big[64] = { 0 };
+
+	struct sdo_req_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.dl_data = &small,
+		.dl_size = sizeof(small),
+	};
+
+	struct sdo_req* req = sdo_req_new(&info);
+	ASSERT_PTR_EQ(req->inline_data, req->data.data);
+	sdo_req_free(req);
+
+	info.dl_data = big;
+	info.dl_size = sizeof(big);
+
+	req = sdo_req_new(&info);
+	ASSERT_TRUE(req->data.data != req->inline_data);
+	ASSERT_UINT_EQ(sizeof(big), req->data.index);
+	sdo_req_free(req);
+
+	info.type = SDO_REQ_UPLOAD;
+	req = sdo_req_new(&info);
+	ASSERT_PTR_EQ(req->inline_data, req->data.data);
+	ASSERT_UINT_EQ(0, req->data.index);
+	sdo_req_free(req);
+
+	return 0;
+}
+
+static int test_req_is_reused()
+{
+	struct sdo_req_info info = { .type = SDO_REQ_UPLOAD };
+
+	struct sdo_req* req = sdo_req_new(&info);
+	struct sdo_req* old = req;
+	sdo_req_unref(req);
+
+	req = sdo_req_new(&info);
+	ASSERT_PTR_EQ(old, req);
+	ASSERT_INT_EQ(1, req->ref);
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+	ASSERT_PTR_EQ(NULL, req->parent);
+	sdo_req_unref(req);
+
+	return 0;
+}
+
+static int test_req_reserve()
+{
+	struct sdo_req_info info = { .type = SDO_REQ_UPLOAD };
+	struct sdo_req_alloc_stats reqs, buffers;
+	struct sdo_req* req[300];
+
+	ASSERT_INT_EQ(0, sdo_req_reserve(300));
+	sdo_req_get_alloc_stats(&reqs, &buffers);
+	ASSERT_UINT_EQ(300, reqs.n_cached);
+	ASSERT_TRUE(buffers.n_cached > 0);
+
+	uint64_t n_from_heap = reqs.n_allocated - reqs.n_reused;
+
+	for (int i = 0; i < 300; ++i)
+		req[i] = sdo_req_new(&info);
+
+	for (int i = 0; i < 300; ++i)
+		sdo_req_unref(req[i]);
+
+	sdo_req_get_alloc_stats(&reqs, &buffers);
+	ASSERT_UINT_EQ(n_from_heap, reqs.n_allocated - reqs.n_reused);
+	ASSERT_UINT_EQ(300, reqs.n_cached);
+
+	return 0;
+}
+
 static int test_req_queue_init_destroy()
 {
 	RESET_FAKE(sdo_async_init);
@@ -75,6 +159,37 @@ static int test_req_queue_init_destroy()
 	return 0;
 }
 
+static int test_req_queue_is_activated_on_first_use()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	RESET_FAKE(mloop_idle_new);
+	mloop_idle_new_fake.return_val = (void*)0xdeadbeef;
+
+	struct sock sock = { .fd = 4, .type = SOCK_TYPE_CAN };
+
+	static struct sdo_req_queue queues[128];
+	ASSERT_INT_EQ(0, sdo_req_queues_init(queues, &sock, 10, 0));
+	ASSERT_INT_EQ(0, sdo_async_init_fake.call_count);
+	ASSERT_INT_EQ(0, mloop_idle_new_fake.call_count);
+
+	struct sdo_req_queue* queue = &queues[42];
+	ASSERT_INT_EQ(0, queue->n_channels);
+
+	ASSERT_INT_EQ(0, sdo_req_queue_activate(queue));
+	ASSERT_INT_EQ(0, sdo_req_queue_activate(queue));
+	ASSERT_INT_EQ(1, sdo_async_init_fake.call_count);
+	ASSERT_INT_EQ(1, mloop_idle_new_fake.call_count);
+	ASSERT_INT_EQ(1, queue->n_channels);
+	ASSERT_INT_EQ(4, sdo_async_init_fake.arg1_val->fd);
+	ASSERT_INT_EQ(42, sdo_async_init_fake.arg2_val);
+
+	sdo_req_queues_cleanup(queues);
+
+	return 0;
+}
+
 static int test_req_queue_enqueue_dequeue()
 {
 	RESET_FAKE(sdo_async_init);
@@ -86,7 +201,12 @@ static int test_req_queue_enqueue_dequeue()
 	struct sdo_req req[4];
 	memset(req, 0, sizeof(req));
 
+	RESET_FAKE(mloop_idle_notify);
+
 	ASSERT_INT_EQ(0, sdo_req_queue__enqueue(&queue, &req[0]));
+	ASSERT_INT_EQ(1, mloop_idle_notify_fake.call_count);
+	ASSERT_PTR_EQ(queue.idle, mloop_idle_notify_fake.arg0_val);
+
 	ASSERT_INT_EQ(0, sdo_req_queue__enqueue(&queue, &req[1]));
 	ASSERT_INT_EQ(0, sdo_req_queue__enqueue(&queue, &req[2]));
 	ASSERT_INT_LT(0, sdo_req_queue__enqueue(&queue, &req[3]));
@@ -105,10 +225,1094 @@ static int test_req_queue_enqueue_dequeue()
 	return 0;
 }
 
-static int test_req_queue_from_async()
+#define N_PRODUCERS 4
+#define N_PRODUCED 10000
+
+struct producer {
+	pthread_t thread;
+	int id;
+	struct sdo_req_queue* queue;
+	struct sdo_req req[N_PRODUCED];
+};
+
+static void* produce(void* context)
+{
+	struct producer* self = context;
+
+	for (int i = 0; i < N_PRODUCED; ) {
+		self->req[i].index = i;
+		self->req[i].subindex = self->id;
+		if (sdo_req_queue__enqueue(self->queue, &self->req[i]) == 0)
+			++i;
+		else
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static int test_req_queue_threaded_enqueue()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 0, 16, 0);
+
+	struct producer* producer = calloc(N_PRODUCERS, sizeof(*producer));
+	ASSERT_TRUE(producer);
+
+	for (int i = 0; i < N_PRODUCERS; ++i) {
+		producer[i].id = i;
+		producer[i].queue = &queue;
+		pthread_create(&producer[i].thread, NULL, produce, &producer[i]);
+	}
+
+	/* Each producer's requests come out in the order that they went in */
+	int next[N_PRODUCERS] = { 0 };
+
+	for (int n = 0; n < N_PRODUCERS * N_PRODUCED; ) {
+		struct sdo_req* req = sdo_req_queue__dequeue(&queue);
+		if (!req) {
+			sched_yield();
+			continue;
+		}
+
+		ASSERT_INT_EQ(next[req->subindex]++, req->index);
+		++n;
+	}
+
+	for (int i = 0; i < N_PRODUCERS; ++i)
+		pthread_join(producer[i].thread, NULL);
+
+	ASSERT_PTR_EQ(NULL, sdo_req_queue__dequeue(&queue));
+	ASSERT_UINT_EQ(0, queue.size);
+
+	free(producer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_queue_priorities()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 0, 10, 0);
+
+	struct sdo_req req[4];
+	memset(req, 0, sizeof(req));
+	req[0].priority = SDO_REQ_PRIO_BACKGROUND;
+	req[1].priority = SDO_REQ_PRIO_BACKGROUND;
+	req[2].priority = SDO_REQ_PRIO_NORMAL;
+	req[3].priority = SDO_REQ_PRIO_HIGH;
+
+	for (int i = 0; i < 4; ++i)
+		sdo_req_queue__enqueue(&queue, &req[i]);
+
+	ASSERT_PTR_EQ(&req[3], sdo_req_queue__dequeue(&queue));
+	ASSERT_PTR_EQ(&req[2], sdo_req_queue__dequeue(&queue));
+	ASSERT_PTR_EQ(&req[0], sdo_req_queue__dequeue(&queue));
+	ASSERT_PTR_EQ(&req[1], sdo_req_queue__dequeue(&queue));
+	ASSERT_PTR_EQ(NULL, sdo_req_queue__dequeue(&queue));
+
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_queue_background_is_not_starved()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 0, 10, 0);
+
+	struct sdo_req background, normal[2];
+	memset(&background, 0, sizeof(background));
+	memset(normal, 0, sizeof(normal));
+	background.priority = SDO_REQ_PRIO_BACKGROUND;
+
+	sdo_req_queue__enqueue(&queue, &background);
+
+	/* Keep the normal list busy */
+	sdo_req_queue__enqueue(&queue, &normal[0]);
+	for (int i = 0; i < SDO_REQ_MAX_PASSED_OVER; ++i) {
+		struct sdo_req* expected = &normal[i % 2];
+		struct sdo_req* req = sdo_req_queue__dequeue(&queue);
+		ASSERT_PTR_EQ(expected, req);
+		req->parent = NULL;
+		sdo_req_queue__enqueue(&queue, &normal[(i + 1) % 2]);
+	}
+
+	ASSERT_PTR_EQ(&background, sdo_req_queue__dequeue(&queue));
+
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_queue_channels()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	queue.sdo_client[0].response_cob = 0x580 + 42;
+
+	ASSERT_INT_EQ(0, sdo_req_queue_add_channel(&queue, 0x640, 0x5c0));
+	ASSERT_UINT_EQ(2, queue.n_channels);
+	ASSERT_UINT_EQ(0x640, queue.sdo_client[1].request_cob);
+
+	ASSERT_PTR_EQ(&queue.sdo_client[0],
+		      sdo_req_queue_find_channel(&queue, 0x580 + 42));
+	ASSERT_PTR_EQ(&queue.sdo_client[1],
+		      sdo_req_queue_find_channel(&queue, 0x5c0));
+	ASSERT_PTR_EQ(NULL, sdo_req_queue_find_channel(&queue, 0x5c1));
+
+	for (size_t i = 2; i < SDO_REQ_MAX_CHANNELS; ++i)
+		ASSERT_INT_EQ(0, sdo_req_queue_add_channel(&queue, 0, 0));
+
+	ASSERT_INT_LT(0, sdo_req_queue_add_channel(&queue, 0, 0));
+
+	sdo_req_queue_remove_channels(&queue);
+	ASSERT_UINT_EQ(1, queue.n_channels);
+	ASSERT_PTR_EQ(NULL, sdo_req_queue_find_channel(&queue, 0x5c0));
+
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+void sdo_req__process_queue(struct mloop_idle* idle);
+
+static int start_and_run(struct sdo_async* async,
+			 const struct sdo_async_info* info)
+{
+	(void)info;
+	async->is_running = 1;
+	return 0;
+}
+
+static int test_req_queue_dispatch_to_idle_channels()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_and_run;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	sdo_req_queue_add_channel(&queue, 0x640, 0x5c0);
+
+	queue.sdo_client[0].is_running = 0;
+	queue.sdo_client[1].is_running = 0;
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	struct sdo_req req[3];
+	memset(req, 0, sizeof(req));
+
+	for (int i = 0; i < 3; ++i)
+		sdo_req_queue__enqueue(&queue, &req[i]);
+
+	sdo_req__process_queue(queue.idle);
+
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(&queue.sdo_client[0], sdo_async_start_fake.arg0_history[0]);
+	ASSERT_PTR_EQ(&queue.sdo_client[1], sdo_async_start_fake.arg0_history[1]);
+	ASSERT_PTR_EQ(&req[2], TAILQ_FIRST(&queue.list[SDO_REQ_PRIO_NORMAL]));
+
+	/* Nothing else is started until a channel becomes idle */
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+
+	queue.sdo_client[1].is_running = 0;
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(3, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(&queue.sdo_client[1], sdo_async_start_fake.arg0_history[2]);
+	ASSERT_TRUE(TAILQ_EMPTY(&queue.list[SDO_REQ_PRIO_NORMAL]));
+
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_queue_starts_at_once_when_idle()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	RESET_FAKE(mloop_idle_notify);
+	RESET_FAKE(mloop_is_current);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_and_run;
+	mloop_is_current_fake.return_val = 1;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+
+	struct sdo_req req[2];
+	memset(req, 0, sizeof(req));
+
+	ASSERT_INT_EQ(0, sdo_req_queue__enqueue(&queue, &req[0]));
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(&queue.sdo_client[0], sdo_async_start_fake.arg0_val);
+	ASSERT_INT_EQ(0, mloop_idle_notify_fake.call_count);
+	ASSERT_UINT_EQ(0, queue.size);
+
+	/* The only channel is busy now */
+	ASSERT_INT_EQ(0, sdo_req_queue__enqueue(&queue, &req[1]));
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(1, mloop_idle_notify_fake.call_count);
+
+	mloop_is_current_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_queue_does_not_overtake()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	RESET_FAKE(mloop_is_current);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_and_run;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	sdo_req_queue_add_channel(&queue, 0x640, 0x5c0);
+
+	RESET_FAKE(mloop_idle_get_context);
+	RESET_FAKE(mloop_idle_notify);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	struct sdo_req req[2];
+	memset(req, 0, sizeof(req));
+
+	/* From another thread */
+	sdo_req_queue__enqueue(&queue, &req[0]);
+
+	mloop_is_current_fake.return_val = 1;
+	sdo_req_queue__enqueue(&queue, &req[1]);
+	ASSERT_INT_EQ(0, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(2, mloop_idle_notify_fake.call_count);
+
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(&queue.sdo_client[0], req[0].channel);
+	ASSERT_PTR_EQ(&queue.sdo_client[1], req[1].channel);
+
+	mloop_is_current_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int start_transfer(struct sdo_async* async,
+			  const struct sdo_async_info* info)
+{
+	async->is_running = 1;
+	async->type = info->type;
+	async->index = info->index;
+	async->subindex = info->subindex;
+	async->on_done = info->on_done;
+	async->context = info->context;
+	async->free_fn = info->free_fn;
+	vector_assign(&async->buffer, info->data, info->size);
+	return 0;
+}
+
+/* Does the same as sdo_async__on_done() */
+static void finish_transfer(struct sdo_async* async,
+			    enum sdo_req_status status, const char* data)
+{
+	void* context = async->context;
+	sdo_async_free_fn free_fn = async->free_fn;
+
+	async->is_running = 0;
+	async->status = status;
+	async->abort_code = status == SDO_REQ_OK ? 0 : SDO_ABORT_NEXIST;
+	async->is_size_indicated = 1;
+	if (data)
+		vector_assign(&async->buffer, data, strlen(data));
+
+	async->on_done(async);
+	free_fn(context);
+}
+
+static int n_batch_done = 0;
+
+static void on_batch_done(struct sdo_req* req)
+{
+	(void)req;
+	++n_batch_done;
+}
+
+static int test_batch_runs_items_in_order()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	n_batch_done = 0;
+	struct sdo_batch* batch = sdo_batch_new(on_batch_done, NULL);
+
+	ASSERT_INT_LT(0, sdo_batch_start(batch, &queue));
+	ASSERT_INT_EQ(EINVAL, errno);
+
+	ASSERT_INT_EQ(0, sdo_batch_add_upload(batch, 0x1000, 0));
+	ASSERT_INT_EQ(0, sdo_batch_add_download(batch, 0x2000, 1, "abc", 3));
+	ASSERT_INT_EQ(0, sdo_batch_add_upload(batch, 0x1018, 1));
+	ASSERT_UINT_EQ(3, sdo_batch_length(batch));
+
+	ASSERT_INT_EQ(0, sdo_batch_start(batch, &queue));
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(0x1000, channel->index);
+
+	/* The queue holds a single entry for the whole batch */
+	ASSERT_TRUE(TAILQ_EMPTY(&queue.list[SDO_REQ_PRIO_NORMAL]));
+
+	finish_transfer(channel, SDO_REQ_OK, "xyz");
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(SDO_REQ_DOWNLOAD, channel->type);
+	ASSERT_INT_EQ(0x2000, channel->index);
+	ASSERT_UINT_EQ(3, channel->buffer.index);
+	ASSERT_INT_EQ(0, n_batch_done);
+
+	finish_transfer(channel, SDO_REQ_REMOTE_ABORT, NULL);
+	ASSERT_INT_EQ(3, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(0x1018, channel->index);
+	ASSERT_INT_EQ(1, channel->subindex);
+
+	RESET_FAKE(mloop_idle_notify);
+	finish_transfer(channel, SDO_REQ_OK, "1234");
+	ASSERT_INT_EQ(3, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(1, n_batch_done);
+
+	/* The channel has become idle */
+	ASSERT_INT_EQ(1, mloop_idle_notify_fake.call_count);
+
+	ASSERT_INT_EQ(SDO_REQ_REMOTE_ABORT, batch->req.status);
+
+	struct sdo_batch_item* item = sdo_batch_get_item(batch, 0);
+	ASSERT_INT_EQ(SDO_REQ_OK, item->status);
+	ASSERT_UINT_EQ(3, item->data.index);
+	ASSERT_INT_EQ(0, memcmp("xyz", item->data.data, 3));
+
+	item = sdo_batch_get_item(batch, 1);
+	ASSERT_INT_EQ(SDO_REQ_REMOTE_ABORT, item->status);
+	ASSERT_INT_EQ(SDO_ABORT_NEXIST, item->abort_code);
+
+	item = sdo_batch_get_item(batch, 2);
+	ASSERT_INT_EQ(SDO_REQ_OK, item->status);
+	ASSERT_UINT_EQ(4, item->data.index);
+
+	ASSERT_INT_EQ(1, batch->req.ref);
+	sdo_req_unref(&batch->req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_batch_is_cancelled()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	n_batch_done = 0;
+	struct sdo_batch* batch = sdo_batch_new(on_batch_done, NULL);
+	sdo_batch_add_upload(batch, 0x1000, 0);
+	sdo_batch_add_upload(batch, 0x1001, 0);
+	sdo_batch_add_upload(batch, 0x1002, 0);
+
+	sdo_batch_start(batch, &queue);
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "x");
+	ASSERT_INT_EQ(0x1001, channel->index);
+
+	/* Does the same as sdo_async_stop() */
+	channel->free_fn(channel->context);
+	channel->is_running = 0;
+
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, batch->req.status);
+	ASSERT_INT_EQ(0, n_batch_done);
+	ASSERT_INT_EQ(SDO_REQ_OK, sdo_batch_get_item(batch, 0)->status);
+	ASSERT_INT_EQ(SDO_REQ_PENDING, sdo_batch_get_item(batch, 1)->status);
+	ASSERT_INT_EQ(1, batch->req.ref);
+	sdo_req_unref(&batch->req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_batch_stops_on_failure()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	n_batch_done = 0;
+	struct sdo_batch* batch = sdo_batch_new(on_batch_done, NULL);
+	sdo_batch_add_download(batch, 0x2000, 0, "a", 1);
+	sdo_batch_get_item(batch, 0)->policy = SDO_BATCH_IGNORE;
+	sdo_batch_add_download(batch, 0x2001, 0, "b", 1);
+	sdo_batch_get_item(batch, 1)->policy = SDO_BATCH_STOP;
+	sdo_batch_add_download(batch, 0x2002, 0, "c", 1);
+	sdo_batch_add_download(batch, 0x2003, 0, "d", 1);
+
+	sdo_batch_start(batch, &queue);
+	sdo_req__process_queue(queue.idle);
+
+	finish_transfer(channel, SDO_REQ_REMOTE_ABORT, NULL);
+	ASSERT_INT_EQ(0x2001, channel->index);
+
+	finish_transfer(channel, SDO_REQ_LOCAL_ABORT, NULL);
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(1, n_batch_done);
+
+	/* The ignored failure does not count */
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, batch->req.status);
+	ASSERT_INT_EQ(SDO_REQ_REMOTE_ABORT, sdo_batch_get_item(batch, 0)->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, sdo_batch_get_item(batch, 2)->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, sdo_batch_get_item(batch, 3)->status);
+
+	ASSERT_INT_EQ(1, batch->req.ref);
+	sdo_req_unref(&batch->req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_batch_checks_values()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	n_batch_done = 0;
+	struct sdo_batch* batch = sdo_batch_new(on_batch_done, NULL);
+	ASSERT_INT_LT(0, sdo_batch_add_check(batch, 0x1000, 0, 9, 0, ~0ULL));
+	ASSERT_INT_EQ(0, sdo_batch_add_check(batch, 0x1000, 0, 2, 0x6261,
+					     ~0ULL));
+	ASSERT_INT_EQ(0, sdo_batch_add_check(batch, 0x1001, 0, 2, 0x6200,
+					     0xff00));
+	ASSERT_INT_EQ(0, sdo_batch_add_check(batch, 0x1002, 0, 2, 0x6261,
+					     ~0ULL));
+	ASSERT_INT_EQ(0, sdo_batch_add_check(batch, 0x1003, 0, 2, 0x6261,
+					     ~0ULL));
+
+	sdo_batch_start(batch, &queue);
+	sdo_req__process_queue(queue.idle);
+
+	finish_transfer(channel, SDO_REQ_OK, "ab");
+	finish_transfer(channel, SDO_REQ_OK, "xb");
+	finish_transfer(channel, SDO_REQ_OK, "ba");
+	finish_transfer(channel, SDO_REQ_OK, "abc");
+	ASSERT_INT_EQ(1, n_batch_done);
+
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, batch->req.status);
+	ASSERT_INT_EQ(SDO_REQ_OK, sdo_batch_get_item(batch, 0)->status);
+	ASSERT_INT_EQ(SDO_REQ_OK, sdo_batch_get_item(batch, 1)->status);
+
+	struct sdo_batch_item* item = sdo_batch_get_item(batch, 2);
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, item->status);
+	ASSERT_INT_EQ(SDO_ABORT_NVAL, item->abort_code);
+
+	/* The size must match too */
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT,
+		      sdo_batch_get_item(batch, 3)->status);
+
+	sdo_req_unref(&batch->req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static struct sdo_req* new_cached_upload(int max_age)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = 0x1008,
+		.subindex = 0,
+		.cache_max_age = max_age,
+	};
+
+	return sdo_req_new(&info);
+}
+
+static int test_upload_buffer_is_handed_over()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	ASSERT_INT_GE(0, vector_reserve(&channel->buffer, 64));
+	void* buffer = channel->buffer.data;
+
+	struct sdo_req* req = new_cached_upload(0);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "0123456789abcdef");
+	ASSERT_INT_EQ(SDO_REQ_OK, req->status);
+	ASSERT_PTR_EQ(buffer, req->data.data);
+	ASSERT_UINT_EQ(16, req->data.index);
+	ASSERT_TRUE(channel->buffer.data);
+	ASSERT_TRUE(channel->buffer.data != buffer);
+	ASSERT_UINT_EQ(0, channel->buffer.index);
+	sdo_req_unref(req);
+
+	/* Small uploads go into the inline buffer */
+	req = new_cached_upload(0);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "abc");
+	ASSERT_PTR_EQ(req->inline_data, req->data.data);
+	ASSERT_INT_EQ(0, memcmp("abc", req->data.data, 3));
+	sdo_req_unref(req);
+
+	vector_destroy(&channel->buffer);
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_cache()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	struct sdo_req* req = new_cached_upload(SDO_REQ_CACHE_FOREVER);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "hello");
+	ASSERT_INT_EQ(SDO_REQ_OK, req->status);
+	sdo_req_unref(req);
+
+	/* Answered without going to the queue */
+	req = new_cached_upload(SDO_REQ_CACHE_FOREVER);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(SDO_REQ_OK, req->status);
+	ASSERT_UINT_EQ(5, req->data.index);
+	ASSERT_INT_EQ(0, memcmp("hello", req->data.data, 5));
+	ASSERT_INT_EQ(1, req->ref);
+	ASSERT_TRUE(TAILQ_EMPTY(&queue.list[SDO_REQ_PRIO_NORMAL]));
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+	sdo_req_unref(req);
+
+	/* Too old */
+	queue.cache[0].time -= 2000000000ULL;
+	req = new_cached_upload(1000);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+	ASSERT_PTR_EQ(req, queue.intake);
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "world");
+	sdo_req_unref(req);
+
+	/* Not asked for */
+	req = new_cached_upload(0);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+	sdo_req_queue_flush(&queue);
+	sdo_req_unref(req);
+
+	req = new_cached_upload(1000);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(0, memcmp("world", req->data.data, 5));
+	sdo_req_unref(req);
+
+	sdo_req_queue_clear_cache(&queue);
+	req = new_cached_upload(SDO_REQ_CACHE_FOREVER);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+	sdo_req_queue_flush(&queue);
+	sdo_req_unref(req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_cache_is_dropped_on_download()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	struct sdo_req* req = new_cached_upload(SDO_REQ_CACHE_FOREVER);
+	sdo_req_start(req, &queue);
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "hello");
+	sdo_req_unref(req);
+
+	struct sdo_req_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.index = 0x1008,
+		.subindex = 0,
+		.dl_data = "bye",
+		.dl_size = 3,
+	};
+
+	struct sdo_req* dl = sdo_req_new(&info);
+	ASSERT_INT_EQ(0, sdo_req_start(dl, &queue));
+
+	req = new_cached_upload(SDO_REQ_CACHE_FOREVER);
+	ASSERT_INT_EQ(0, sdo_req_start(req, &queue));
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+
+	sdo_req_queue_flush(&queue);
+	sdo_req_unref(req);
+	sdo_req_unref(dl);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+void sdo_req__on_stop(void* ptr);
+
+static struct sdo_req* new_upload_req(void)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = 0x1000,
+		.subindex = 0,
+	};
+
+	return sdo_req_new(&info);
+}
+
+static int test_req_queue_flush()
+{
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 0, 2, 0);
+
+	struct sdo_req* req[2];
+	for (int i = 0; i < 2; ++i) {
+		req[i] = new_upload_req();
+		ASSERT_INT_EQ(0, sdo_req_start(req[i], &queue));
+	}
+
+	/* Both are still in the intake */
+	sdo_req_queue_flush(&queue);
+	ASSERT_UINT_EQ(0, queue.size);
+
+	for (int i = 0; i < 2; ++i) {
+		ASSERT_INT_EQ(SDO_REQ_CANCELLED, req[i]->status);
+		ASSERT_INT_EQ(1, req[i]->ref);
+		sdo_req_unref(req[i]);
+	}
+
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_req_wait_timeout()
+{
+	struct sdo_req* req = new_upload_req();
+
+	errno = 0;
+	ASSERT_INT_LT(0, sdo_req_wait_timeout(req, 10));
+	ASSERT_INT_EQ(ETIMEDOUT, errno);
+	ASSERT_INT_EQ(SDO_REQ_PENDING, req->status);
+
+	/* A waiter that gave up no longer needs to be woken */
+	ASSERT_INT_EQ(0, req->n_waiters);
+
+	sdo_req_unref(req);
+	return 0;
+}
+
+static void* stop_req_later(void* context)
+{
+	usleep(20000);
+	sdo_req__on_stop(context);
+	return NULL;
+}
+
+static int test_req_wait_is_woken()
+{
+	struct sdo_req* req = new_upload_req();
+	sdo_req_ref(req);
+
+	pthread_t thread;
+	ASSERT_INT_EQ(0, pthread_create(&thread, NULL, stop_req_later, req));
+
+	ASSERT_INT_EQ(0, sdo_req_wait_timeout(req, 5000));
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, req->status);
+	ASSERT_INT_EQ(0, req->n_waiters);
+
+	pthread_join(thread, NULL);
+	sdo_req_unref(req);
+	return 0;
+}
+
+static int n_uploads_done = 0;
+
+static void on_upload_done(struct sdo_req* req)
+{
+	(void)req;
+	++n_uploads_done;
+}
+
+static struct sdo_req* new_followed_upload(int index,
+					   enum sdo_req_priority priority)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = index,
+		.subindex = 0,
+		.on_done = on_upload_done,
+		.priority = priority,
+	};
+
+	return sdo_req_new(&info);
+}
+
+static int test_identical_uploads_are_coalesced()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+	n_uploads_done = 0;
+
+	struct sdo_req* req[4];
+	req[0] = new_followed_upload(0x1000, SDO_REQ_PRIO_NORMAL);
+	req[1] = new_followed_upload(0x1000, SDO_REQ_PRIO_NORMAL);
+	req[2] = new_followed_upload(0x1001, SDO_REQ_PRIO_NORMAL);
+	for (int i = 0; i < 3; ++i)
+		ASSERT_INT_EQ(0, sdo_req_start(req[i], &queue));
+
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(req[0], channel->context);
+	ASSERT_UINT_EQ(1, queue.size);
+
+	/* One that comes in while the other is running follows it as well */
+	req[3] = new_followed_upload(0x1000, SDO_REQ_PRIO_NORMAL);
+	ASSERT_INT_EQ(0, sdo_req_start(req[3], &queue));
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(1, sdo_async_start_fake.call_count);
+
+	finish_transfer(channel, SDO_REQ_OK, "hello");
+	sdo_req__process_queue(queue.idle);
+	ASSERT_INT_EQ(3, n_uploads_done);
+
+	int followed[] = { 0, 1, 3 };
+	for (int i = 0; i < 3; ++i) {
+		struct sdo_req* r = req[followed[i]];
+		ASSERT_INT_EQ(SDO_REQ_OK, r->status);
+		ASSERT_UINT_EQ(5, r->data.index);
+		ASSERT_INT_EQ(0, memcmp("hello", r->data.data, 5));
+		ASSERT_INT_EQ(1, r->ref);
+	}
+
+	/* The other object is read on its own */
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_PTR_EQ(req[2], channel->context);
+	finish_transfer(channel, SDO_REQ_REMOTE_ABORT, NULL);
+	ASSERT_INT_EQ(SDO_REQ_REMOTE_ABORT, req[2]->status);
+	ASSERT_UINT_EQ(0, queue.size);
+
+	for (int i = 0; i < 4; ++i)
+		sdo_req_unref(req[i]);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_urgent_follower_moves_upload_up()
 {
+	RESET_FAKE(sdo_async_init);
+	sdo_async_init_fake.return_val = 0;
+
 	struct sdo_req_queue queue;
-	ASSERT_PTR_EQ(&queue, sdo_req_queue__from_async(&queue.sdo_client));
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	n_uploads_done = 0;
+
+	struct sdo_req* slow = new_followed_upload(0x1000,
+						   SDO_REQ_PRIO_BACKGROUND);
+	struct sdo_req* fast = new_followed_upload(0x1000, SDO_REQ_PRIO_HIGH);
+	ASSERT_INT_EQ(0, sdo_req_start(slow, &queue));
+	ASSERT_INT_EQ(0, sdo_req_start(fast, &queue));
+
+	/* Cancelled along with the one that it follows */
+	sdo_req_queue_flush(&queue);
+	ASSERT_TRUE(TAILQ_EMPTY(&queue.list[SDO_REQ_PRIO_BACKGROUND]));
+	ASSERT_INT_EQ(SDO_REQ_PRIO_HIGH, slow->priority);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, slow->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, fast->status);
+	ASSERT_INT_EQ(1, fast->ref);
+	ASSERT_INT_EQ(0, n_uploads_done);
+	ASSERT_UINT_EQ(0, queue.size);
+
+	sdo_req_unref(slow);
+	sdo_req_unref(fast);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_uploads_are_not_coalesced_across_download()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	struct sdo_req_info info = {
+		.type = SDO_REQ_DOWNLOAD,
+		.index = 0x1000,
+		.subindex = 0,
+		.dl_data = "new",
+		.dl_size = 3,
+	};
+
+	struct sdo_req* before = new_followed_upload(0x1000,
+						     SDO_REQ_PRIO_NORMAL);
+	struct sdo_req* dl = sdo_req_new(&info);
+	struct sdo_req* after = new_followed_upload(0x1000,
+						    SDO_REQ_PRIO_NORMAL);
+	ASSERT_INT_EQ(0, sdo_req_start(before, &queue));
+	ASSERT_INT_EQ(0, sdo_req_start(dl, &queue));
+	ASSERT_INT_EQ(0, sdo_req_start(after, &queue));
+
+	sdo_req__process_queue(queue.idle);
+	ASSERT_UINT_EQ(2, queue.size);
+
+	finish_transfer(channel, SDO_REQ_OK, "old");
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, NULL);
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "new");
+	ASSERT_INT_EQ(3, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(0, memcmp("old", before->data.data, 3));
+	ASSERT_INT_EQ(0, memcmp("new", after->data.data, 3));
+
+	sdo_req_unref(before);
+	sdo_req_unref(dl);
+	sdo_req_unref(after);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int abort_transfer(struct sdo_async* async, enum sdo_abort_code code)
+{
+	(void)code;
+	finish_transfer(async, SDO_REQ_LOCAL_ABORT, NULL);
+	return 0;
+}
+
+static struct sdo_req* new_owned_upload(int index, const void* owner)
+{
+	struct sdo_req_info info = {
+		.type = SDO_REQ_UPLOAD,
+		.index = index,
+		.subindex = 0,
+		.on_done = on_upload_done,
+		.owner = owner,
+	};
+
+	return sdo_req_new(&info);
+}
+
+static int test_owner_is_cancelled()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	RESET_FAKE(sdo_async_abort);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+	sdo_async_abort_fake.custom_fake = abort_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+	n_uploads_done = 0;
+
+	int a, b;
+	struct sdo_req* req[5];
+	req[0] = new_owned_upload(0x1000, &a);
+	req[1] = new_owned_upload(0x1001, &a);
+	req[2] = new_owned_upload(0x1001, &b);
+	req[3] = new_owned_upload(0x1001, &a);
+	req[4] = new_owned_upload(0x1002, &a);
+	for (int i = 0; i < 5; ++i)
+		ASSERT_INT_EQ(0, sdo_req_start(req[i], &queue));
+
+	sdo_req__process_queue(queue.idle);
+	ASSERT_PTR_EQ(req[0], channel->context);
+	ASSERT_UINT_EQ(2, queue.size);
+
+	/* The one that b follows is kept */
+	ASSERT_UINT_EQ(3, sdo_req_queue_cancel(&queue, &a));
+	ASSERT_INT_EQ(1, sdo_async_abort_fake.call_count);
+	ASSERT_PTR_EQ(channel, sdo_async_abort_fake.arg0_val);
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, req[0]->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, req[3]->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, req[4]->status);
+	ASSERT_INT_EQ(3, n_uploads_done);
+	ASSERT_UINT_EQ(1, queue.size);
+
+	sdo_req__process_queue(queue.idle);
+	ASSERT_PTR_EQ(req[1], channel->context);
+	finish_transfer(channel, SDO_REQ_OK, "hi");
+	ASSERT_INT_EQ(SDO_REQ_OK, req[2]->status);
+	ASSERT_INT_EQ(5, n_uploads_done);
+
+	ASSERT_UINT_EQ(0, sdo_req_queue_cancel(&queue, &a));
+	ASSERT_UINT_EQ(0, queue.size);
+
+	for (int i = 0; i < 5; ++i) {
+		ASSERT_INT_EQ(1, req[i]->ref);
+		sdo_req_unref(req[i]);
+	}
+
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_async_abort_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
+	return 0;
+}
+
+static int test_cancelled_batch_stops()
+{
+	RESET_FAKE(sdo_async_init);
+	RESET_FAKE(sdo_async_start);
+	RESET_FAKE(sdo_async_abort);
+	sdo_async_init_fake.return_val = 0;
+	sdo_async_start_fake.custom_fake = start_transfer;
+	sdo_async_abort_fake.custom_fake = abort_transfer;
+
+	struct sdo_req_queue queue;
+	sdo_req__queue_init(&queue, 0, 42, 10, 0);
+	struct sdo_async* channel = &queue.sdo_client[0];
+
+	RESET_FAKE(mloop_idle_get_context);
+	mloop_idle_get_context_fake.return_val = &queue;
+
+	int owner;
+	n_batch_done = 0;
+	struct sdo_batch* batch = sdo_batch_new(on_batch_done, NULL);
+	batch->req.owner = &owner;
+	sdo_batch_add_upload(batch, 0x2000, 0);
+	sdo_batch_add_upload(batch, 0x2001, 0);
+	sdo_batch_add_upload(batch, 0x2002, 0);
+
+	sdo_batch_start(batch, &queue);
+	sdo_req__process_queue(queue.idle);
+	finish_transfer(channel, SDO_REQ_OK, "a");
+
+	ASSERT_UINT_EQ(1, sdo_req_queue_cancel(&queue, &owner));
+	ASSERT_INT_EQ(2, sdo_async_start_fake.call_count);
+	ASSERT_INT_EQ(1, n_batch_done);
+	ASSERT_INT_EQ(SDO_REQ_OK, sdo_batch_get_item(batch, 0)->status);
+	ASSERT_INT_EQ(SDO_REQ_LOCAL_ABORT, sdo_batch_get_item(batch, 1)->status);
+	ASSERT_INT_EQ(SDO_REQ_CANCELLED, sdo_batch_get_item(batch, 2)->status);
+
+	ASSERT_INT_EQ(1, batch->req.ref);
+	sdo_req_unref(&batch->req);
+
+	sdo_async_start_fake.custom_fake = NULL;
+	sdo_async_abort_fake.custom_fake = NULL;
+	vector_destroy(&channel->buffer);
+	sdo_req__queue_destroy(&queue);
 	return 0;
 }
 
@@ -116,8 +1320,33 @@ int main()
 {
 	int r = 0;
 	RUN_TEST(test_req_new_free);
+	RUN_TEST(test_req_inline_data);
+	RUN_TEST(test_req_is_reused);
+	RUN_TEST(test_req_reserve);
 	RUN_TEST(test_req_queue_init_destroy);
+	RUN_TEST(test_req_queue_is_activated_on_first_use);
 	RUN_TEST(test_req_queue_enqueue_dequeue);
-	RUN_TEST(test_req_queue_from_async);
+	RUN_TEST(test_req_queue_threaded_enqueue);
+	RUN_TEST(test_req_queue_flush);
+	RUN_TEST(test_req_queue_priorities);
+	RUN_TEST(test_req_queue_background_is_not_starved);
+	RUN_TEST(test_req_queue_channels);
+	RUN_TEST(test_req_queue_dispatch_to_idle_channels);
+	RUN_TEST(test_req_queue_starts_at_once_when_idle);
+	RUN_TEST(test_req_queue_does_not_overtake);
+	RUN_TEST(test_req_wait_timeout);
+	RUN_TEST(test_req_wait_is_woken);
+	RUN_TEST(test_batch_runs_items_in_order);
+	RUN_TEST(test_batch_is_cancelled);
+	RUN_TEST(test_batch_stops_on_failure);
+	RUN_TEST(test_batch_checks_values);
+	RUN_TEST(test_upload_buffer_is_handed_over);
+	RUN_TEST(test_req_cache);
+	RUN_TEST(test_req_cache_is_dropped_on_download);
+	RUN_TEST(test_identical_uploads_are_coalesced);
+	RUN_TEST(test_urgent_follower_moves_upload_up);
+	RUN_TEST(test_uploads_are_not_coalesced_across_download);
+	RUN_TEST(test_owner_is_cancelled);
+	RUN_TEST(test_cancelled_batch_stops);
 	return r;
 }
@@ -0,0 +1,70 @@
+#include "tst.h"
+#include "canopen/sdo_rtt.h"
+
+static int test_no_samples()
+{
+	struct sdo_rtt rtt;
+	sdo_rtt_init(&rtt);
+	ASSERT_UINT_EQ(1000, sdo_rtt_get_timeout(&rtt, 10, 1000));
+	return 0;
+}
+
+static int test_first_sample()
+{
+	struct sdo_rtt rtt;
+	sdo_rtt_init(&rtt);
+	sdo_rtt_add_sample(&rtt, 4000);
+	ASSERT_UINT_EQ(4000, rtt.srtt);
+	ASSERT_UINT_EQ(2000, rtt.rttvar);
+
+	/* 4 ms + 4 * 2 ms */
+	ASSERT_UINT_EQ(12, sdo_rtt_get_timeout(&rtt, 1, 1000));
+	return 0;
+}
+
+static int test_converges()
+{
+	struct sdo_rtt rtt;
+	sdo_rtt_init(&rtt);
+
+	for (int i = 0; i < 100; ++i)
+		sdo_rtt_add_sample(&rtt, 2000);
+
+	ASSERT_UINT_EQ(2000, rtt.srtt);
+	ASSERT_UINT_EQ(0, rtt.rttvar);
+	ASSERT_UINT_EQ(3, sdo_rtt_get_timeout(&rtt, 1, 1000));
+	ASSERT_UINT_EQ(10, sdo_rtt_get_timeout(&rtt, 10, 1000));
+	return 0;
+}
+
+static int test_backoff()
+{
+	struct sdo_rtt rtt;
+	sdo_rtt_init(&rtt);
+	sdo_rtt_add_sample(&rtt, 4000);
+
+	sdo_rtt_on_timeout(&rtt);
+	ASSERT_UINT_EQ(24, sdo_rtt_get_timeout(&rtt, 1, 1000));
+
+	for (int i = 0; i < 10; ++i)
+		sdo_rtt_on_timeout(&rtt);
+
+	ASSERT_UINT_EQ(11, rtt.n_timeouts);
+	ASSERT_UINT_EQ(12 << SDO_RTT_MAX_BACKOFF,
+		       sdo_rtt_get_timeout(&rtt, 1, 1000));
+	ASSERT_UINT_EQ(100, sdo_rtt_get_timeout(&rtt, 1, 100));
+
+	sdo_rtt_add_sample(&rtt, 4000);
+	ASSERT_UINT_EQ(0, rtt.backoff);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_no_samples);
+	RUN_TEST(test_first_sample);
+	RUN_TEST(test_converges);
+	RUN_TEST(test_backoff);
+	return r;
+}
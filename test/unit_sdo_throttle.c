@@ -0,0 +1,168 @@
+#include <poll.h>
+#include <mloop.h>
+#include "tst.h"
+#include "bus-load.h"
+#include "canopen/sdo_throttle.h"
+
+#define BITRATE 100000
+#define CEILING 500 /* per mille */
+
+static int n_woken;
+
+static void on_idle(struct mloop_idle* idle)
+{
+	(void)idle;
+	++n_woken;
+}
+
+static void load_bus(struct bl_meter* meter, unsigned int n_frames)
+{
+	struct can_frame cf = { .can_id = 0x181, .can_dlc = 8 };
+
+	for (unsigned int i = 0; i < n_frames; ++i)
+		bl_meter_count(meter, &cf);
+}
+
+static int test_no_ceiling()
+{
+	struct bl_meter meter;
+	struct sdo_throttle throttle;
+
+	bl_meter_init(&meter, BITRATE);
+	ASSERT_INT_EQ(0, sdo_throttle_init(&throttle, &meter, 0));
+
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 1000, 100000,
+						    NULL));
+
+	sdo_throttle_destroy(&throttle);
+	bl_meter_destroy(&meter);
+	return 0;
+}
+
+static int test_bucket_is_paid_off()
+{
+	struct bl_meter meter;
+	struct sdo_throttle throttle;
+
+	bl_meter_init(&meter, BITRATE);
+	ASSERT_INT_EQ(0, sdo_throttle_init(&throttle, &meter, CEILING));
+
+	/* 10 ms at the ceiling fit into the bucket, and it may go into debt
+	 * once
+	 */
+	ASSERT_INT_EQ(500, throttle.depth);
+	ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 1000, 270, NULL));
+	ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 1000, 270, NULL));
+	ASSERT_INT_EQ(-40, throttle.tokens);
+
+	struct mloop_idle* idle = mloop_idle_new(mloop_default());
+	mloop_idle_set_idle_fn(idle, on_idle);
+	mloop_idle_start(idle);
+
+	n_woken = 0;
+	ASSERT_INT_EQ(-1, sdo_throttle_admit(&throttle, 1000, 270, idle));
+	ASSERT_UINT_EQ(1, throttle.n_deferred);
+	ASSERT_UINT_EQ(1, throttle.n_waiting);
+
+	/* The bus is idle, so the bucket fills at half the bit rate */
+	ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 3000, 270, idle));
+	ASSERT_INT_EQ(-210, throttle.tokens);
+	ASSERT_UINT_EQ(3, throttle.n_admitted);
+
+	/* The queue is woken up to ask again */
+	struct pollfd pfd = {
+		.fd = mloop_get_pollfd(mloop_default()),
+		.events = POLLIN,
+	};
+
+	for (int i = 0; i < 100 && n_woken == 0; ++i) {
+		poll(&pfd, 1, 10);
+		mloop_run_once(mloop_default());
+	}
+	ASSERT_INT_EQ(1, n_woken);
+	ASSERT_UINT_EQ(0, throttle.n_waiting);
+
+	mloop_idle_stop(idle);
+	mloop_idle_unref(idle);
+	sdo_throttle_destroy(&throttle);
+	bl_meter_destroy(&meter);
+	return 0;
+}
+
+static int test_busy_bus()
+{
+	struct bl_meter meter;
+	struct sdo_throttle throttle;
+
+	bl_meter_init(&meter, BITRATE);
+	ASSERT_INT_EQ(0, sdo_throttle_init(&throttle, &meter, CEILING));
+
+	ASSERT_UINT_EQ(0, bl_meter_update(&meter, 1000));
+
+	/* 100 ms with 60 frames of 135 bits each is 81% of the bit rate */
+	load_bus(&meter, 60);
+	ASSERT_UINT_EQ(810, bl_meter_update(&meter, 101000));
+
+	/* Nothing is left to spare, so only what is in the bucket goes */
+	ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 101000, 270, NULL));
+	ASSERT_INT_EQ(-1, sdo_throttle_admit(&throttle, 101000, 270, NULL));
+	ASSERT_INT_EQ(230, throttle.tokens);
+
+	sdo_throttle_destroy(&throttle);
+	bl_meter_destroy(&meter);
+	return 0;
+}
+
+static int test_hold()
+{
+	struct bl_meter meter;
+	struct sdo_throttle throttle;
+
+	bl_meter_init(&meter, BITRATE);
+	ASSERT_INT_EQ(0, sdo_throttle_init(&throttle, &meter, 0));
+
+	struct mloop_idle* idle = mloop_idle_new(mloop_default());
+	mloop_idle_set_idle_fn(idle, on_idle);
+	mloop_idle_start(idle);
+
+	/* Even without a ceiling */
+	sdo_throttle_hold(&throttle, 1);
+	ASSERT_INT_EQ(-1, sdo_throttle_admit(&throttle, 1000, 270, idle));
+	ASSERT_INT_EQ(-1, sdo_throttle_admit(&throttle, 1000, 270, idle));
+	ASSERT_UINT_EQ(2, throttle.n_deferred);
+	ASSERT_UINT_EQ(1, throttle.n_waiting);
+
+	n_woken = 0;
+	sdo_throttle_hold(&throttle, 0);
+	ASSERT_UINT_EQ(0, throttle.n_waiting);
+
+	struct pollfd pfd = {
+		.fd = mloop_get_pollfd(mloop_default()),
+		.events = POLLIN,
+	};
+
+	for (int i = 0; i < 100 && n_woken == 0; ++i) {
+		poll(&pfd, 1, 10);
+		mloop_run_once(mloop_default());
+	}
+	ASSERT_INT_EQ(1, n_woken);
+
+	ASSERT_INT_EQ(0, sdo_throttle_admit(&throttle, 1000, 270, idle));
+
+	mloop_idle_stop(idle);
+	mloop_idle_unref(idle);
+	sdo_throttle_destroy(&throttle);
+	bl_meter_destroy(&meter);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_no_ceiling);
+	RUN_TEST(test_bucket_is_paid_off);
+	RUN_TEST(test_busy_bus);
+	RUN_TEST(test_hold);
+	return r;
+}
@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "tst.h"
+#include "shm-ring.h"
+
+#define N_THREADED_FRAMES 100000
+
+static char name_[64];
+
+static int make_ring(struct shm_ring* writer, struct shm_ring* reader,
+		     size_t length)
+{
+	snprintf(name_, sizeof(name_), "/unit_shm-ring.%d", getpid());
+
+	ASSERT_INT_EQ(0, shm_ring_create(writer, name_, length));
+	ASSERT_INT_EQ(0, shm_ring_open(reader, name_));
+	return 0;
+}
+
+static void write_frames(struct shm_ring* ring, uint32_t first, size_t n)
+{
+	for (size_t i = 0; i < n; ++i) {
+		struct can_frame cf = { .can_id = first + i, .can_dlc = 1 };
+		shm_ring_write(ring, &cf, 1000 + first + i);
+	}
+}
+
+static int test_create_rounds_up()
+{
+	struct shm_ring writer, reader;
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 5));
+	ASSERT_UINT_EQ(8, writer.length);
+	ASSERT_UINT_EQ(8, reader.length);
+	shm_ring_destroy(&reader);
+	shm_ring_destroy(&writer);
+	return 0;
+}
+
+static int test_open_missing()
+{
+	struct shm_ring reader;
+	ASSERT_INT_EQ(-1, shm_ring_open(&reader, "/unit_shm-ring.missing"));
+	return 0;
+}
+
+static int test_frames_are_seen_once_published()
+{
+	struct shm_ring writer, reader;
+	struct can_frame cfs[8];
+	uint64_t timestamps[8];
+
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 8));
+
+	write_frames(&writer, 0x181, 3);
+	ASSERT_UINT_EQ(0, shm_ring_read(&reader, cfs, timestamps, 8));
+
+	shm_ring_publish(&writer);
+	ASSERT_UINT_EQ(2, shm_ring_read(&reader, cfs, timestamps, 2));
+	ASSERT_UINT_EQ(0x181, cfs[0].can_id);
+	ASSERT_UINT_EQ(0x182, cfs[1].can_id);
+	ASSERT_UINT_EQ(1000 + 0x182, timestamps[1]);
+
+	ASSERT_UINT_EQ(1, shm_ring_read(&reader, cfs, timestamps, 8));
+	ASSERT_UINT_EQ(0x183, cfs[0].can_id);
+	ASSERT_UINT_EQ(0, shm_ring_get_n_lost(&reader));
+
+	shm_ring_destroy(&reader);
+	shm_ring_destroy(&writer);
+	return 0;
+}
+
+static int test_lapped_reader_skips_ahead()
+{
+	struct shm_ring writer, reader;
+	struct can_frame cfs[8];
+	uint64_t timestamps[8];
+
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 8));
+
+	write_frames(&writer, 0, 20);
+	shm_ring_publish(&writer);
+
+	/* Half a lap behind the writer */
+	ASSERT_UINT_EQ(4, shm_ring_read(&reader, cfs, timestamps, 8));
+	ASSERT_UINT_EQ(16, cfs[0].can_id);
+	ASSERT_UINT_EQ(19, cfs[3].can_id);
+	ASSERT_UINT_EQ(16, shm_ring_get_n_lost(&reader));
+
+	shm_ring_destroy(&reader);
+	shm_ring_destroy(&writer);
+	return 0;
+}
+
+static int test_adopted_ring_carries_on()
+{
+	struct shm_ring writer, reader, adopter;
+	struct can_frame cfs[8];
+	uint64_t timestamps[8];
+
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 8));
+
+	write_frames(&writer, 0x181, 2);
+	shm_ring_publish(&writer);
+
+	int fd = shm_open(name_, O_RDWR | O_CLOEXEC, 0);
+	ASSERT_TRUE(fd >= 0);
+	ASSERT_INT_EQ(0, shm_ring_adopt(&adopter, name_, fd));
+	ASSERT_UINT_EQ(2, adopter.position);
+
+	/* The old writer lets go without removing it */
+	writer.is_owner = 0;
+	shm_ring_destroy(&writer);
+
+	write_frames(&adopter, 0x183, 1);
+	shm_ring_publish(&adopter);
+
+	ASSERT_UINT_EQ(3, shm_ring_read(&reader, cfs, timestamps, 8));
+	ASSERT_UINT_EQ(0x181, cfs[0].can_id);
+	ASSERT_UINT_EQ(0x183, cfs[2].can_id);
+	ASSERT_UINT_EQ(0, shm_ring_get_n_lost(&reader));
+
+	shm_ring_destroy(&adopter);
+	ASSERT_INT_EQ(-1, shm_open(name_, O_RDONLY, 0));
+
+	shm_ring_destroy(&reader);
+	return 0;
+}
+
+static int test_wait_times_out()
+{
+	struct shm_ring writer, reader;
+
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 8));
+	ASSERT_INT_EQ(0, shm_ring_wait(&reader, 10));
+
+	write_frames(&writer, 0, 1);
+	shm_ring_publish(&writer);
+	ASSERT_INT_EQ(1, shm_ring_wait(&reader, 10));
+
+	shm_ring_destroy(&reader);
+	shm_ring_destroy(&writer);
+	return 0;
+}
+
+static void* run_writer(void* context)
+{
+	struct shm_ring* writer = context;
+
+	for (uint32_t i = 0; i < N_THREADED_FRAMES; i += 100) {
+		write_frames(writer, i, 100);
+		shm_ring_publish(writer);
+	}
+
+	return NULL;
+}
+
+/* Frames are either read in order or counted as lost, never torn */
+static int test_threaded()
+{
+	struct shm_ring writer, reader;
+	struct can_frame cfs[64];
+	uint64_t timestamps[64];
+	pthread_t thread;
+
+	ASSERT_INT_EQ(0, make_ring(&writer, &reader, 1024));
+	ASSERT_INT_EQ(0, pthread_create(&thread, NULL, run_writer, &writer));
+
+	uint64_t n_read = 0;
+	int64_t last = -1;
+
+	while (n_read + shm_ring_get_n_lost(&reader) < N_THREADED_FRAMES) {
+		ASSERT_INT_EQ(1, shm_ring_wait(&reader, 1000));
+
+		size_t n = shm_ring_read(&reader, cfs, timestamps, 64);
+
+		for (size_t i = 0; i < n; ++i) {
+			ASSERT_TRUE((int64_t)cfs[i].can_id > last);
+			ASSERT_UINT_EQ(1000 + cfs[i].can_id, timestamps[i]);
+			last = cfs[i].can_id;
+		}
+
+		n_read += n;
+	}
+
+	ASSERT_UINT_EQ(N_THREADED_FRAMES, n_read + shm_ring_get_n_lost(&reader));
+	ASSERT_INT_EQ(N_THREADED_FRAMES - 1, last);
+
+	pthread_join(thread, NULL);
+
+	shm_ring_destroy(&reader);
+	shm_ring_destroy(&writer);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_create_rounds_up);
+	RUN_TEST(test_open_missing);
+	RUN_TEST(test_frames_are_seen_once_published);
+	RUN_TEST(test_lapped_reader_skips_ahead);
+	RUN_TEST(test_adopted_ring_carries_on);
+	RUN_TEST(test_wait_times_out);
+	RUN_TEST(test_threaded);
+	return r;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include "tst.h"
+#include "sock.h"
+#include "sock-loop.h"
+
+static int is_readable(const struct sock* sock)
+{
+	struct pollfd pollfd = { .fd = sock->fd, .events = POLLIN };
+	return poll(&pollfd, 1, 0) == 1;
+}
+
+static int test_frames_reach_others_but_not_sender()
+{
+	struct sock a, b, c;
+	struct can_frame cf = { .can_id = 0x181, .can_dlc = 1 };
+	struct can_frame cfs[4];
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&c, SOCK_TYPE_LOOP, "other", NULL) >= 0);
+
+	ASSERT_INT_EQ(sizeof(cf), sock_send(&a, &cf, 0));
+
+	ASSERT_INT_EQ(1, sock_recv_batch(&b, cfs, NULL, 4, MSG_DONTWAIT));
+	ASSERT_UINT_EQ(0x181, cfs[0].can_id);
+
+	ASSERT_INT_EQ(-1, sock_recv_batch(&a, cfs, NULL, 4, MSG_DONTWAIT));
+	ASSERT_INT_EQ(-1, sock_recv_batch(&c, cfs, NULL, 4, MSG_DONTWAIT));
+
+	sock_close(&c);
+	sock_close(&b);
+	sock_close(&a);
+	return 0;
+}
+
+static int test_staged_frames_keep_their_order()
+{
+	struct sock a, b;
+	struct can_frame cfs[8];
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_INT_EQ(0, sock_txq_init(&a, 8));
+
+	for (int i = 0; i < 5; ++i) {
+		struct can_frame cf = { .can_id = 0x200 + i };
+		ASSERT_INT_EQ(0, sock_stage(&a, &cf));
+	}
+
+	ASSERT_INT_EQ(-1, sock_recv_batch(&b, cfs, NULL, 8, MSG_DONTWAIT));
+	ASSERT_INT_EQ(0, sock_flush(&a));
+
+	ASSERT_INT_EQ(5, sock_recv_batch(&b, cfs, NULL, 8, MSG_DONTWAIT));
+	for (unsigned int i = 0; i < 5; ++i)
+		ASSERT_UINT_EQ(0x200 + i, cfs[i].can_id);
+
+	sock_close(&b);
+	sock_close(&a);
+	return 0;
+}
+
+static int test_fd_is_readable_while_frames_wait()
+{
+	struct sock a, b;
+	struct can_frame cf = { .can_id = 0x701 };
+	struct can_frame cfs[2];
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+
+	ASSERT_INT_EQ(0, is_readable(&b));
+
+	for (int i = 0; i < 3; ++i)
+		sock_send(&a, &cf, 0);
+
+	ASSERT_INT_EQ(1, is_readable(&b));
+	ASSERT_INT_EQ(2, sock_recv_batch(&b, cfs, NULL, 2, 0));
+	ASSERT_INT_EQ(1, is_readable(&b));
+	ASSERT_INT_EQ(1, sock_recv_batch(&b, cfs, NULL, 2, 0));
+	ASSERT_INT_EQ(0, is_readable(&b));
+
+	sock_close(&b);
+	sock_close(&a);
+	return 0;
+}
+
+static int test_overflow_is_counted_as_lost()
+{
+	struct sock a, b;
+	struct can_frame cf = { .can_id = 0x181 };
+	struct can_frame cfs[16];
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+
+	for (int i = 0; i < SOCK_LOOP_QUEUE_LENGTH + 10; ++i)
+		sock_send(&a, &cf, 0);
+
+	ASSERT_UINT_EQ(10, sock_get_n_lost(&b));
+	ASSERT_UINT_EQ(0, sock_get_n_lost(&a));
+
+	size_t total = 0;
+	ssize_t n;
+	while ((n = sock_recv_batch(&b, cfs, NULL, 16, MSG_DONTWAIT)) > 0)
+		total += n;
+
+	ASSERT_UINT_EQ(SOCK_LOOP_QUEUE_LENGTH, total);
+
+	sock_close(&b);
+	sock_close(&a);
+	return 0;
+}
+
+static int test_virtual_time_stamps_frames()
+{
+	struct sock a, b;
+	struct can_frame cf = { .can_id = 0x181 };
+	struct can_frame cfs[2];
+	uint64_t timestamps[2];
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+
+	sock_loop_set_time(a.loop, 1000);
+	sock_send(&a, &cf, 0);
+	sock_loop_set_time(b.loop, 2500);
+	sock_send(&b, &cf, 0);
+	sock_send(&a, &cf, 0);
+
+	ASSERT_UINT_EQ(2500, sock_loop_get_time(a.loop));
+
+	ASSERT_INT_EQ(2, sock_recv_batch(&b, cfs, timestamps, 2, 0));
+	ASSERT_UINT_EQ(1000, timestamps[0]);
+	ASSERT_UINT_EQ(2500, timestamps[1]);
+
+	ASSERT_INT_EQ(1, sock_recv_batch(&a, cfs, timestamps, 2, 0));
+	ASSERT_UINT_EQ(2500, timestamps[0]);
+
+	sock_close(&b);
+	sock_close(&a);
+	return 0;
+}
+
+static int test_bus_is_fresh_once_everyone_left()
+{
+	struct sock a, b;
+
+	ASSERT_TRUE(sock_open(&a, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	sock_loop_set_time(a.loop, 1000);
+	sock_close(&a);
+
+	ASSERT_TRUE(sock_open(&b, SOCK_TYPE_LOOP, "test", NULL) >= 0);
+	ASSERT_TRUE(sock_loop_get_time(b.loop) != 1000);
+	sock_close(&b);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_frames_reach_others_but_not_sender);
+	RUN_TEST(test_staged_frames_keep_their_order);
+	RUN_TEST(test_fd_is_readable_while_frames_wait);
+	RUN_TEST(test_overflow_is_counted_as_lost);
+	RUN_TEST(test_virtual_time_stamps_frames);
+	RUN_TEST(test_bus_is_fresh_once_everyone_left);
+	return r;
+}
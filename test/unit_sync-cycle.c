@@ -0,0 +1,123 @@
+#include <string.h>
+#include "tst.h"
+#include "canopen/sync-cycle.h"
+
+static struct sync_cycle cycle_;
+static struct sync_cycle_snapshot snapshot_;
+
+static int test_nothing_before_first_sync()
+{
+	ASSERT_INT_EQ(0, sync_cycle_init(&cycle_));
+
+	sync_cycle_set_expected(&cycle_, 5, 0x1);
+	ASSERT_INT_EQ(-1, sync_cycle_read(&cycle_, &snapshot_));
+
+	sync_cycle_destroy(&cycle_);
+	return 0;
+}
+
+static int test_cycle_is_collected()
+{
+	uint8_t first[] = { 1, 2, 3 };
+	uint8_t second[] = { 4, 5 };
+
+	ASSERT_INT_EQ(0, sync_cycle_init(&cycle_));
+
+	sync_cycle_set_expected(&cycle_, 5, 0x3);
+	ASSERT_TRUE(sync_cycle_is_expected(&cycle_, 5, 1));
+	ASSERT_TRUE(sync_cycle_is_expected(&cycle_, 5, 2));
+	ASSERT_FALSE(sync_cycle_is_expected(&cycle_, 5, 3));
+	ASSERT_FALSE(sync_cycle_is_expected(&cycle_, 6, 1));
+
+	sync_cycle_add(&cycle_, 5, 1, first, sizeof(first), 1000);
+	sync_cycle_add(&cycle_, 5, 2, second, sizeof(second), 1001);
+
+	ASSERT_INT_EQ(1, sync_cycle_end(&cycle_, 7, 2000));
+	ASSERT_INT_EQ(0, sync_cycle_read(&cycle_, &snapshot_));
+
+	ASSERT_UINT_EQ(7, snapshot_.sync_count);
+	ASSERT_UINT_EQ(2000, snapshot_.end);
+	ASSERT_UINT_EQ(0x3, snapshot_.expected[5]);
+	ASSERT_UINT_EQ(0x3, snapshot_.received[5]);
+	ASSERT_UINT_EQ(0, snapshot_.n_missing);
+	ASSERT_FALSE(sync_cycle_is_node_missing(&snapshot_, 5));
+
+	ASSERT_UINT_EQ(1000, snapshot_.pdo[5][0].timestamp);
+	ASSERT_UINT_EQ(3, snapshot_.pdo[5][0].size);
+	ASSERT_INT_EQ(0, memcmp(first, snapshot_.pdo[5][0].data, 3));
+	ASSERT_UINT_EQ(2, snapshot_.pdo[5][1].size);
+	ASSERT_INT_EQ(0, memcmp(second, snapshot_.pdo[5][1].data, 2));
+
+	/* The next cycle starts out empty */
+	ASSERT_INT_EQ(1, sync_cycle_end(&cycle_, 8, 3000));
+	ASSERT_INT_EQ(0, sync_cycle_read(&cycle_, &snapshot_));
+	ASSERT_UINT_EQ(8, snapshot_.sync_count);
+	ASSERT_UINT_EQ(2000, snapshot_.start);
+	ASSERT_UINT_EQ(0, snapshot_.received[5]);
+
+	sync_cycle_destroy(&cycle_);
+	return 0;
+}
+
+static int test_missing_nodes()
+{
+	uint8_t data[] = { 1 };
+
+	ASSERT_INT_EQ(0, sync_cycle_init(&cycle_));
+
+	sync_cycle_set_expected(&cycle_, 5, 0x1);
+	sync_cycle_set_expected(&cycle_, 70, 0x5);
+	sync_cycle_set_expected(&cycle_, 100, 0x1);
+
+	sync_cycle_add(&cycle_, 5, 1, data, sizeof(data), 1000);
+	sync_cycle_add(&cycle_, 70, 1, data, sizeof(data), 1000);
+
+	ASSERT_INT_EQ(3, sync_cycle_end(&cycle_, 0, 2000));
+	ASSERT_INT_EQ(0, sync_cycle_read(&cycle_, &snapshot_));
+
+	ASSERT_UINT_EQ(2, snapshot_.n_missing);
+	ASSERT_FALSE(sync_cycle_is_node_missing(&snapshot_, 5));
+	ASSERT_TRUE(sync_cycle_is_node_missing(&snapshot_, 70));
+	ASSERT_TRUE(sync_cycle_is_node_missing(&snapshot_, 100));
+
+	uint64_t n_cycles, n_incomplete;
+	sync_cycle_get_counts(&cycle_, &n_cycles, &n_incomplete);
+	ASSERT_UINT_EQ(1, n_cycles);
+	ASSERT_UINT_EQ(1, n_incomplete);
+
+	sync_cycle_destroy(&cycle_);
+	return 0;
+}
+
+static int test_later_tpdo_replaces_earlier()
+{
+	uint8_t first[] = { 1, 2, 3 };
+	uint8_t second[SYNC_CYCLE_DATA_SIZE + 4] = { 4, 5 };
+
+	ASSERT_INT_EQ(0, sync_cycle_init(&cycle_));
+
+	sync_cycle_set_expected(&cycle_, 5, 0x1);
+
+	sync_cycle_add(&cycle_, 5, 1, first, sizeof(first), 1000);
+	sync_cycle_add(&cycle_, 5, 1, second, sizeof(second), 1500);
+
+	sync_cycle_end(&cycle_, 0, 2000);
+	ASSERT_INT_EQ(0, sync_cycle_read(&cycle_, &snapshot_));
+
+	ASSERT_UINT_EQ(1500, snapshot_.pdo[5][0].timestamp);
+	ASSERT_UINT_EQ(SYNC_CYCLE_DATA_SIZE, snapshot_.pdo[5][0].size);
+	ASSERT_UINT_EQ(4, snapshot_.pdo[5][0].data[0]);
+
+	sync_cycle_destroy(&cycle_);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_nothing_before_first_sync);
+	RUN_TEST(test_cycle_is_collected);
+	RUN_TEST(test_missing_nodes);
+	RUN_TEST(test_later_tpdo_replaces_earlier);
+	return r;
+}
@@ -0,0 +1,86 @@
+#include "tst.h"
+#include "canopen.h"
+#include "canopen/sync-producer.h"
+
+static int test_bucket()
+{
+	ASSERT_UINT_EQ(0, sync_stats_bucket(0));
+	ASSERT_UINT_EQ(1, sync_stats_bucket(1));
+	ASSERT_UINT_EQ(2, sync_stats_bucket(2));
+	ASSERT_UINT_EQ(2, sync_stats_bucket(3));
+	ASSERT_UINT_EQ(3, sync_stats_bucket(4));
+	ASSERT_UINT_EQ(11, sync_stats_bucket(1500));
+	ASSERT_UINT_EQ(SYNC_HISTOGRAM_LENGTH - 1,
+		       sync_stats_bucket(UINT64_MAX));
+	return 0;
+}
+
+static int test_stats_add()
+{
+	struct sync_stats stats = { 0 };
+
+	sync_stats_add(&stats, 0, 0);
+	sync_stats_add(&stats, 3, 0);
+	sync_stats_add(&stats, 2500, 2);
+
+	ASSERT_UINT_EQ(3, stats.n_cycles);
+	ASSERT_UINT_EQ(2, stats.n_skipped);
+	ASSERT_UINT_EQ(2500, stats.max_lateness);
+	ASSERT_UINT_EQ(1, stats.histogram[0]);
+	ASSERT_UINT_EQ(1, stats.histogram[2]);
+	ASSERT_UINT_EQ(1, stats.histogram[12]);
+
+	return 0;
+}
+
+static int test_frame_without_counter()
+{
+	struct sync_producer producer;
+	ASSERT_INT_EQ(0, sync_producer_init(&producer, NULL, 1000));
+
+	struct can_frame cf;
+	sync_producer_make_frame(&producer, &cf);
+	ASSERT_INT_EQ(R_SYNC, cf.can_id);
+	ASSERT_INT_EQ(0, cf.can_dlc);
+
+	sync_producer_destroy(&producer);
+	return 0;
+}
+
+static int test_frame_with_counter()
+{
+	struct sync_producer producer;
+	ASSERT_INT_EQ(0, sync_producer_init(&producer, NULL, 1000));
+	sync_producer_set_counter_overflow(&producer, 3);
+
+	struct can_frame cf;
+	const int expected[] = { 1, 2, 3, 1, 2 };
+
+	for (int i = 0; i < 5; ++i) {
+		sync_producer_make_frame(&producer, &cf);
+		ASSERT_INT_EQ(R_SYNC, cf.can_id);
+		ASSERT_INT_EQ(1, cf.can_dlc);
+		ASSERT_INT_EQ(expected[i], cf.data[0]);
+	}
+
+	sync_producer_destroy(&producer);
+	return 0;
+}
+
+static int test_zero_period()
+{
+	struct sync_producer producer;
+	ASSERT_INT_LT(0, sync_producer_init(&producer, NULL, 0));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_bucket);
+	RUN_TEST(test_stats_add);
+	RUN_TEST(test_frame_without_counter);
+	RUN_TEST(test_frame_with_counter);
+	RUN_TEST(test_zero_period);
+	return r;
+}
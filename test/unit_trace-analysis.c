@@ -0,0 +1,202 @@
+#include "tst.h"
+#include "trace-analysis.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_FRAMES 1024
+
+static struct tb_frame frames_[MAX_FRAMES];
+static size_t n_frames_;
+
+static void add_frame(uint64_t timestamp, uint32_t can_id, uint8_t dlc,
+		      uint8_t b0, uint8_t b1, uint8_t b2)
+{
+	struct tb_frame* frame = &frames_[n_frames_++];
+	memset(frame, 0, sizeof(*frame));
+
+	frame->timestamp = timestamp;
+	frame->cf.can_id = can_id;
+	frame->cf.can_dlc = dlc;
+	frame->cf.data[0] = b0;
+	frame->cf.data[1] = b1;
+	frame->cf.data[2] = b2;
+}
+
+/* One second of node 5 sending TPDO1 every 10 ms and heartbeats every 100 ms,
+ * except for one that is 400 ms late, and answering an SDO request every 50 ms
+ * after 2 ms. Node 7 sends two EMCYs.
+ */
+static void make_trace(void)
+{
+	const uint64_t t0 = 1000000000ULL;
+	n_frames_ = 0;
+
+	for (uint64_t ms = 0; ms < 1000; ++ms) {
+		uint64_t t = t0 + ms * 1000ULL;
+
+		if (ms % 10 == 0)
+			add_frame(t, 0x185, 8, 0, 0, 0);
+
+		if (ms % 100 == 0 && (ms < 500 || ms > 800))
+			add_frame(t, 0x705, 1, 5, 0, 0);
+
+		if (ms == 800)
+			add_frame(t + 1, 0x705, 1, 5, 0, 0);
+
+		if (ms % 50 == 0)
+			add_frame(t, 0x605, 8, 0x40, 0x00, 0x10);
+
+		if (ms % 50 == 2)
+			add_frame(t, 0x585, 8, ms == 952 ? 0x80 : 0x43, 0, 0x10);
+
+		if (ms == 300 || ms == 100)
+			add_frame(t, 0x87, 8, 0x10, 0x81, 0x11);
+	}
+}
+
+static int write_trace(char* path)
+{
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+
+	struct tb_dump_header header;
+	tb_dump_header_init(&header);
+	ASSERT_TRUE(write(fd, &header, sizeof(header)) == sizeof(header));
+
+	size_t size = n_frames_ * sizeof(frames_[0]);
+	ASSERT_TRUE(write(fd, frames_, size) == (ssize_t)size);
+
+	close(fd);
+	return 0;
+}
+
+static int check_report(const struct ta_report* report)
+{
+	ASSERT_TRUE(report->n_frames == n_frames_);
+	ASSERT_TRUE(report->n_node_frames[5] == n_frames_ - 2);
+	ASSERT_TRUE(report->n_node_frames[7] == 2);
+
+	const struct ta_rate* pdo = &report->pdos[0x185];
+	ASSERT_TRUE(pdo->count == 100);
+	ASSERT_TRUE(pdo->last - pdo->first == 990000);
+
+	ASSERT_TRUE(report->sdo_latency.count == 20);
+	ASSERT_TRUE(report->sdo_latency.min == 2000);
+	ASSERT_TRUE(report->sdo_latency.max == 2000);
+	ASSERT_TRUE(report->node_sdo_latency[5].count == 20);
+	ASSERT_TRUE(report->n_sdo_aborts == 1);
+	ASSERT_TRUE(ta_histogram_get_percentile(&report->sdo_latency, 99)
+		    == 2000);
+
+	const struct ta_heartbeats* hb = &report->heartbeats[5];
+	ASSERT_TRUE(hb->count == 7);
+	ASSERT_TRUE(hb->max_gap == 400001);
+	ASSERT_TRUE(hb->max_gap_end == 1000000000ULL + 800001ULL);
+
+	ASSERT_UINT_EQ(2 * sizeof(struct ta_emcy), report->emcys.index);
+	const struct ta_emcy* emcys = report->emcys.data;
+	ASSERT_TRUE(emcys[0].timestamp < emcys[1].timestamp);
+	ASSERT_INT_EQ(7, emcys[0].node);
+	ASSERT_INT_EQ(0x8110, emcys[0].code);
+	ASSERT_INT_EQ(0x11, emcys[0].reg);
+	return 0;
+}
+
+static int analyze(const char* path, unsigned int n_threads,
+		   size_t chunk_length)
+{
+	struct ta_config config = {
+		.n_threads = n_threads,
+		.chunk_length = chunk_length,
+	};
+
+	struct ta_report report;
+	int rc = ta_analyze(path, NULL, &config, &report);
+	if (rc == 0)
+		rc = check_report(&report);
+
+	ta_report_destroy(&report);
+	return rc;
+}
+
+static int test_one_thread()
+{
+	char path[] = "/tmp/unit_trace-analysis.XXXXXX";
+	make_trace();
+	ASSERT_INT_EQ(0, write_trace(path));
+
+	ASSERT_INT_EQ(0, analyze(path, 1, 0));
+
+	unlink(path);
+	return 0;
+}
+
+/* Chunks of a few frames split most SDO transfers and heartbeat gaps */
+static int test_chunk_boundaries()
+{
+	char path[] = "/tmp/unit_trace-analysis.XXXXXX";
+	make_trace();
+	ASSERT_INT_EQ(0, write_trace(path));
+
+	ASSERT_INT_EQ(0, analyze(path, 1, 1));
+	ASSERT_INT_EQ(0, analyze(path, 4, 1));
+	ASSERT_INT_EQ(0, analyze(path, 4, 3));
+	ASSERT_INT_EQ(0, analyze(path, 3, 64));
+	ASSERT_INT_EQ(0, analyze(path, 0, 0));
+
+	unlink(path);
+	return 0;
+}
+
+static int test_filter()
+{
+	char path[] = "/tmp/unit_trace-analysis.XXXXXX";
+	make_trace();
+	ASSERT_INT_EQ(0, write_trace(path));
+
+	struct tr_filter filter = { 0 };
+	tr_filter_add_node(&filter, 7);
+
+	struct ta_config config = { .n_threads = 2, .chunk_length = 5 };
+	struct ta_report report;
+	ASSERT_INT_EQ(0, ta_analyze(path, &filter, &config, &report));
+
+	ASSERT_TRUE(report.n_frames == 2);
+	ASSERT_TRUE(report.sdo_latency.count == 0);
+	ASSERT_TRUE(report.heartbeats[5].count == 0);
+
+	ta_report_destroy(&report);
+	unlink(path);
+	return 0;
+}
+
+static int test_empty_file()
+{
+	char path[] = "/tmp/unit_trace-analysis.XXXXXX";
+	n_frames_ = 0;
+	ASSERT_INT_EQ(0, write_trace(path));
+
+	struct ta_report report;
+	ASSERT_INT_EQ(0, ta_analyze(path, NULL, NULL, &report));
+	ASSERT_TRUE(report.n_frames == 0);
+
+	FILE* stream = fopen("/dev/null", "w");
+	ta_report_print(&report, stream);
+	fclose(stream);
+
+	ta_report_destroy(&report);
+	unlink(path);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_one_thread);
+	RUN_TEST(test_chunk_boundaries);
+	RUN_TEST(test_filter);
+	RUN_TEST(test_empty_file);
+	return r;
+}
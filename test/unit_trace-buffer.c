@@ -4,6 +4,33 @@
 #include "socketcan.h"
 
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define N_WRITERS 4
+#define N_WRITES 200000
+
+/* Raw dumps have a header in front of the frames */
+static const struct tb_frame* dump_frames(const char* dump)
+{
+	const struct tb_dump_header* header = (const void*)dump;
+	if (header->magic != TB_DUMP_MAGIC
+	 || header->record_size != sizeof(struct tb_frame))
+		return NULL;
+
+	return (const void*)(dump + sizeof(*header));
+}
+
+static size_t dump_size(size_t n_frames)
+{
+	return sizeof(struct tb_dump_header) + n_frames * sizeof(struct tb_frame);
+}
+
+static size_t dump_length(size_t size)
+{
+	return (size - sizeof(struct tb_dump_header)) / sizeof(struct tb_frame);
+}
 
 int test_incomplete_buffer(void)
 {
@@ -18,14 +45,15 @@ int test_incomplete_buffer(void)
 	cf.can_id = 2;
 	tb_append(&tb, &cf);
 
-	struct tb_frame* buffer;
+	char* buffer;
 	size_t size;
-	FILE* stream = open_memstream((char**)&buffer, &size);
+	FILE* stream = open_memstream(&buffer, &size);
 
 	tb_dump(&tb, stream);
 
-	ASSERT_INT_EQ(1, buffer[0].cf.can_id);
-	ASSERT_INT_EQ(2, buffer[1].cf.can_id);
+	const struct tb_frame* frames = dump_frames(buffer);
+	ASSERT_INT_EQ(1, frames[0].cf.can_id);
+	ASSERT_INT_EQ(2, frames[1].cf.can_id);
 
 	fclose(stream);
 	free(buffer);
@@ -50,15 +78,256 @@ int test_full_buffer(void)
 		tb_append(&tb, &cf);
 	}
 
-	struct tb_frame* buffer;
+	char* buffer;
+	size_t size;
+	FILE* stream = open_memstream(&buffer, &size);
+
+	tb_dump(&tb, stream);
+
+	const struct tb_frame* frames = dump_frames(buffer);
+	ASSERT_INT_EQ(1, frames[0].cf.can_id);
+	ASSERT_INT_EQ(2, frames[1].cf.can_id);
+	ASSERT_INT_EQ(3, frames[2].cf.can_id);
+
+	fclose(stream);
+	free(buffer);
+	tb_destroy(&tb);
+	return 0;
+}
+
+int test_fd_frame(void)
+{
+	struct tracebuffer tb;
+
+	ASSERT_INT_GE(0, tb_init(&tb, 3 * sizeof(struct tb_frame)));
+
+	struct canfd_frame cfd = { .can_id = 0x181, .len = 64 };
+	for (int i = 0; i < 64; ++i)
+		cfd.data[i] = i;
+
+	tb_append_fd_ts(&tb, &cfd, 42);
+
+	struct can_frame cf = { .can_id = 0x182, .can_dlc = 1 };
+	tb_append_ts(&tb, &cf, 43);
+
+	char* buffer;
 	size_t size;
-	FILE* stream = open_memstream((char**)&buffer, &size);
+	FILE* stream = open_memstream(&buffer, &size);
 
 	tb_dump(&tb, stream);
+	fflush(stream);
+
+	const struct tb_frame* frames = dump_frames(buffer);
+	ASSERT_UINT_EQ(dump_size(2), size);
+	ASSERT_INT_EQ(42, frames[0].timestamp);
+	ASSERT_INT_EQ(0x181, frames[0].cfd.can_id);
+	ASSERT_INT_EQ(64, frames[0].cfd.len);
+	ASSERT_INT_EQ(63, frames[0].cfd.data[63]);
+	ASSERT_INT_EQ(0x182, frames[1].cf.can_id);
+	ASSERT_INT_EQ(0, frames[1].cfd.flags);
+
+	fclose(stream);
+	free(buffer);
+	tb_destroy(&tb);
+	return 0;
+}
+
+static struct tracebuffer shared_tb_;
+
+static void* write_frames(void* context)
+{
+	struct can_frame cf = { .can_id = (uintptr_t)context, .can_dlc = 8 };
+
+	for (uint64_t i = 1; i <= N_WRITES; ++i) {
+		for (int j = 0; j < 8; ++j)
+			cf.data[j] = i + j;
+
+		tb_append_ts(&shared_tb_, &cf, i);
+	}
+
+	return NULL;
+}
+
+/* Every frame in a dump is whole and the frames of each writer are in order */
+static int check_dump(const struct tb_frame* frames, size_t n)
+{
+	uint64_t last[N_WRITERS] = { 0 };
+
+	for (size_t i = 0; i < n; ++i) {
+		const struct tb_frame* frame = &frames[i];
+		ASSERT_INT_LT(N_WRITERS, frame->cf.can_id);
+
+		for (int j = 0; j < 8; ++j)
+			ASSERT_INT_EQ((uint8_t)(frame->timestamp + j),
+				      frame->cf.data[j]);
+
+		ASSERT_TRUE(frame->timestamp > last[frame->cf.can_id]);
+		last[frame->cf.can_id] = frame->timestamp;
+	}
+
+	return 0;
+}
+
+int test_dump_while_writing(void)
+{
+	ASSERT_INT_GE(0, tb_init(&shared_tb_, 1024 * sizeof(struct tb_frame)));
+
+	pthread_t threads[N_WRITERS];
+	for (uintptr_t i = 0; i < N_WRITERS; ++i)
+		pthread_create(&threads[i], NULL, write_frames, (void*)i);
+
+	size_t n_dumped = 0;
+
+	while (tb_get_head(&shared_tb_) < N_WRITERS * N_WRITES) {
+		char* buffer = NULL;
+		size_t size = 0;
+		FILE* stream = open_memstream(&buffer, &size);
+
+		tb_dump(&shared_tb_, stream);
+
+		n_dumped += dump_length(size);
+		int rc = check_dump(dump_frames(buffer), dump_length(size));
+
+		fclose(stream);
+		free(buffer);
+
+		if (rc != 0)
+			return rc;
+	}
+
+	for (int i = 0; i < N_WRITERS; ++i)
+		pthread_join(threads[i], NULL);
+
+	ASSERT_TRUE(n_dumped > 0);
+
+	/* Once the writers are done, nothing more goes missing. Only the last
+	 * frames that writers had to drop can leave holes.
+	 */
+	uint64_t n_dropped = tb_get_n_dropped(&shared_tb_);
+
+	char* buffer = NULL;
+	size_t size = 0;
+	FILE* stream = open_memstream(&buffer, &size);
+	tb_dump(&shared_tb_, stream);
+
+	size_t n = dump_length(size);
+	ASSERT_TRUE(n <= 1024 && n + n_dropped >= 1024);
+	ASSERT_TRUE(tb_get_n_dropped(&shared_tb_) == n_dropped);
+	ASSERT_INT_EQ(0, check_dump(dump_frames(buffer), n));
+
+	fclose(stream);
+	free(buffer);
+	tb_destroy(&shared_tb_);
+	return 0;
+}
+
+static void append_ids(struct tracebuffer* tb, int first, int n)
+{
+	struct can_frame cf = { 0 };
+
+	for (int i = first; i < first + n; ++i) {
+		cf.can_id = i;
+		tb_append(tb, &cf);
+	}
+}
+
+/* The child dies while it is writing its 11th frame */
+static void crash_while_writing(const char* path)
+{
+	struct tracebuffer tb;
+
+	if (tb_init_mapped(&tb, 16 * sizeof(struct tb_frame), path) < 0)
+		_exit(1);
+
+	append_ids(&tb, 1, 10);
+
+	tb.header->head = 11;
+	tb.slots[10].sequence = 2 * 10 + 1;
+	_exit(0);
+}
+
+int test_mapped_buffer_survives_crash(void)
+{
+	char path[] = "/tmp/unit_trace-buffer.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+	close(fd);
+
+	pid_t pid = fork();
+	ASSERT_INT_GE(0, pid);
+	if (pid == 0)
+		crash_while_writing(path);
+
+	int status;
+	ASSERT_INT_EQ(pid, waitpid(pid, &status, 0));
+	ASSERT_INT_EQ(0, WEXITSTATUS(status));
+
+	struct tracebuffer tb;
+	ASSERT_INT_EQ(0, tb_init_mapped(&tb, 16 * sizeof(struct tb_frame),
+					path));
+	ASSERT_UINT_EQ(11, tb.n_recovered);
+
+	/* Only one process may have it */
+	struct tracebuffer other;
+	ASSERT_INT_LT(0, tb_init_mapped(&other, 16 * sizeof(struct tb_frame),
+					path));
+
+	struct tb_frame frames[16];
+	ASSERT_UINT_EQ(10, tb_snapshot(&tb, frames));
+	ASSERT_INT_EQ(1, frames[0].cf.can_id);
+	ASSERT_INT_EQ(10, frames[9].cf.can_id);
+
+	/* The slot that was left half written is taken again on the next lap */
+	append_ids(&tb, 100, 16);
+	ASSERT_UINT_EQ(16, tb_snapshot(&tb, frames));
+	ASSERT_INT_EQ(100, frames[0].cf.can_id);
+	ASSERT_INT_EQ(115, frames[15].cf.can_id);
+	ASSERT_TRUE(tb_get_n_dropped(&tb) == 0);
+
+	ASSERT_INT_EQ(0, tb_sync(&tb));
+	tb_destroy(&tb);
+
+	/* It was closed this time */
+	ASSERT_INT_EQ(0, tb_init_mapped(&tb, 16 * sizeof(struct tb_frame),
+					path));
+	ASSERT_UINT_EQ(0, tb.n_recovered);
+	ASSERT_UINT_EQ(16, tb_snapshot(&tb, frames));
+	tb_destroy(&tb);
+
+	/* A buffer of another size starts out empty */
+	ASSERT_INT_EQ(0, tb_init_mapped(&tb, 32 * sizeof(struct tb_frame),
+					path));
+	ASSERT_UINT_EQ(0, tb_snapshot(&tb, frames));
+	tb_destroy(&tb);
+
+	unlink(path);
+	return 0;
+}
+
+int test_dump_pcapng(void)
+{
+	struct tracebuffer tb;
+	enum tb_format format;
+
+	ASSERT_INT_EQ(0, tb_parse_format(&format, "pcapng"));
+	ASSERT_INT_EQ(TB_FORMAT_PCAPNG, format);
+	ASSERT_INT_LT(0, tb_parse_format(&format, "pcap"));
+	ASSERT_STR_EQ(".pcapng", tb_format_extension(format));
+
+	ASSERT_INT_GE(0, tb_init(&tb, 4 * sizeof(struct tb_frame)));
+
+	struct can_frame cf = { 0 };
+	tb_append(&tb, &cf);
+	tb_append(&tb, &cf);
+
+	char* buffer;
+	size_t size;
+	FILE* stream = open_memstream(&buffer, &size);
+
+	tb_dump_as(&tb, stream, TB_FORMAT_PCAPNG, NULL);
 
-	ASSERT_INT_EQ(1, buffer[0].cf.can_id);
-	ASSERT_INT_EQ(2, buffer[1].cf.can_id);
-	ASSERT_INT_EQ(3, buffer[2].cf.can_id);
+	/* The section, the interface and a block of 32 + CAN_MTU per frame */
+	ASSERT_UINT_EQ(28 + 32 + 2 * (32 + CAN_MTU), size);
 
 	fclose(stream);
 	free(buffer);
@@ -71,5 +340,9 @@ int main()
 	int r = 0;
 	RUN_TEST(test_incomplete_buffer);
 	RUN_TEST(test_full_buffer);
+	RUN_TEST(test_fd_frame);
+	RUN_TEST(test_dump_while_writing);
+	RUN_TEST(test_mapped_buffer_survives_crash);
+	RUN_TEST(test_dump_pcapng);
 	return r;
 }
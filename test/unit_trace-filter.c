@@ -0,0 +1,139 @@
+#include "tst.h"
+#include "trace-filter.h"
+#include "trace-buffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+static struct trace_filter filter_;
+
+static int count_matches(uint32_t can_id, int n)
+{
+	int count = 0;
+
+	for (int i = 0; i < n; ++i)
+		count += tf_match(&filter_, can_id);
+
+	return count;
+}
+
+static int test_everything_is_kept_by_default()
+{
+	tf_init(&filter_);
+	ASSERT_INT_EQ(0, tf_parse(&filter_, ""));
+
+	ASSERT_TRUE(tf_match(&filter_, 0x000));
+	ASSERT_TRUE(tf_match(&filter_, 0x185));
+	ASSERT_TRUE(tf_match(&filter_, 0x12345 | CAN_EFF_FLAG));
+	return 0;
+}
+
+static int test_objects_and_nodes()
+{
+	tf_init(&filter_);
+	ASSERT_INT_EQ(0, tf_parse(&filter_, "-pdo tpdo1@5, rpdo2@10-12"));
+
+	ASSERT_TRUE(tf_match(&filter_, 0x185)); /* TPDO1 of node 5 */
+	ASSERT_FALSE(tf_match(&filter_, 0x186));
+	ASSERT_FALSE(tf_match(&filter_, 0x285)); /* TPDO2 of node 5 */
+	ASSERT_FALSE(tf_match(&filter_, 0x309));
+	ASSERT_TRUE(tf_match(&filter_, 0x30a));
+	ASSERT_TRUE(tf_match(&filter_, 0x30c));
+	ASSERT_FALSE(tf_match(&filter_, 0x30d));
+
+	/* Everything else is left as it was */
+	ASSERT_TRUE(tf_match(&filter_, 0x000));
+	ASSERT_TRUE(tf_match(&filter_, 0x080));
+	ASSERT_TRUE(tf_match(&filter_, 0x585));
+	ASSERT_TRUE(tf_match(&filter_, 0x705));
+	return 0;
+}
+
+static int test_cob_id_ranges()
+{
+	tf_init(&filter_);
+	ASSERT_INT_EQ(0, tf_parse(&filter_, "-* +0x700-0x7ff -0x701"));
+
+	ASSERT_FALSE(tf_match(&filter_, 0x000));
+	ASSERT_FALSE(tf_match(&filter_, 0x12345 | CAN_EFF_FLAG));
+	ASSERT_FALSE(tf_match(&filter_, 0x701));
+	ASSERT_TRUE(tf_match(&filter_, 0x700));
+	ASSERT_TRUE(tf_match(&filter_, 0x77f));
+	ASSERT_TRUE(tf_match(&filter_, 0x7ff));
+	return 0;
+}
+
+static int test_sampling()
+{
+	tf_init(&filter_);
+	ASSERT_INT_EQ(0, tf_parse(&filter_, "PDO/10 tpdo1@1/3"));
+
+	ASSERT_INT_EQ(10, count_matches(0x281, 100));
+	ASSERT_INT_EQ(34, count_matches(0x181, 100));
+
+	/* Each COB-ID is sampled on its own */
+	ASSERT_INT_EQ(1, count_matches(0x282, 1));
+	ASSERT_INT_EQ(100, count_matches(0x581, 100));
+	return 0;
+}
+
+static int test_invalid_rules()
+{
+	static const char* rules[] = {
+		"pdx", "-sdo/4", "0x800", "0x200-0x100", "pdo@128", "pdo/0",
+		"*@5", "0x180@5", "sync/x", "pdo@", "-", "pdo/70000",
+	};
+
+	tf_init(&filter_);
+
+	for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); ++i) {
+		ASSERT_INT_LT(0, tf_parse(&filter_, rules[i]));
+		ASSERT_INT_EQ(EINVAL, errno);
+	}
+
+	/* Nothing is applied if one of the rules is bad */
+	ASSERT_INT_LT(0, tf_parse(&filter_, "-* pdx"));
+	ASSERT_TRUE(tf_match(&filter_, 0x000));
+	return 0;
+}
+
+static int test_trace_buffer()
+{
+	struct tracebuffer tb;
+	ASSERT_INT_GE(0, tb_init(&tb, 64 * sizeof(struct tb_frame)));
+
+	tf_init(&filter_);
+	ASSERT_INT_EQ(0, tf_parse(&filter_, "-pdo"));
+	tb_set_filter(&tb, &filter_);
+
+	struct can_frame cf = { 0 };
+
+	for (int i = 0; i < 100; ++i) {
+		cf.can_id = 0x181;
+		tb_append(&tb, &cf);
+	}
+
+	cf.can_id = 0x081;
+	tb_append(&tb, &cf);
+
+	struct tb_frame frames[64];
+	ASSERT_UINT_EQ(1, tb_snapshot(&tb, frames));
+	ASSERT_INT_EQ(0x081, frames[0].cf.can_id);
+	ASSERT_TRUE(tb_get_n_filtered(&tb) == 100);
+	ASSERT_TRUE(tb_get_n_dropped(&tb) == 0);
+
+	tb_destroy(&tb);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_everything_is_kept_by_default);
+	RUN_TEST(test_objects_and_nodes);
+	RUN_TEST(test_cob_id_ranges);
+	RUN_TEST(test_sampling);
+	RUN_TEST(test_invalid_rules);
+	RUN_TEST(test_trace_buffer);
+	return r;
+}
@@ -0,0 +1,471 @@
+#include "tst.h"
+#include "trace-record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define N_FRAMES 1000
+
+static struct tb_frame frames_[N_FRAMES];
+static struct tb_frame read_[N_FRAMES];
+static size_t n_read_;
+
+static void make_frames(void)
+{
+	for (int i = 0; i < N_FRAMES; ++i) {
+		struct tb_frame* frame = &frames_[i];
+		memset(frame, 0, sizeof(*frame));
+
+		frame->timestamp = 1000000ULL + i * 250ULL;
+
+		switch (i % 4) {
+		case 0: /* SYNC */
+			frame->cf.can_id = 0x80;
+			break;
+		case 1: /* A PDO that does not change */
+			frame->cf.can_id = 0x181;
+			frame->cf.can_dlc = 8;
+			memset(frame->cf.data, 0x55, 8);
+			break;
+		case 2: /* An FD PDO that does */
+			frame->cfd.can_id = 0x282;
+			frame->cfd.len = 64;
+			frame->cfd.flags = CANFD_FDF;
+			frame->cfd.data[i % 64] = i;
+			break;
+		case 3: /* Extended frames, which may be out of order */
+			frame->cf.can_id = (0x1000 + i) | CAN_EFF_FLAG;
+			frame->cf.can_dlc = 2;
+			frame->cf.data[0] = i;
+			frame->timestamp -= 1000;
+			break;
+		}
+	}
+}
+
+static int compare_frames(const struct tb_frame* a, const struct tb_frame* b)
+{
+	ASSERT_TRUE(a->timestamp == b->timestamp);
+	ASSERT_UINT_EQ(a->cfd.can_id, b->cfd.can_id);
+	ASSERT_INT_EQ(a->cfd.len, b->cfd.len);
+	ASSERT_INT_EQ(a->cfd.flags, b->cfd.flags);
+	ASSERT_INT_EQ(0, memcmp(a->cfd.data, b->cfd.data, a->cfd.len));
+	return 0;
+}
+
+static int test_codec()
+{
+	static uint8_t data[N_FRAMES * TR_MAX_FRAME_SIZE];
+	struct tr_codec encoder, decoder;
+	size_t size = 0;
+
+	make_frames();
+	tr_codec_reset(&encoder, frames_[0].timestamp);
+
+	for (int i = 0; i < N_FRAMES; ++i) {
+		size_t n = tr_encode(&encoder, data + size, &frames_[i]);
+		ASSERT_UINT_LE(TR_MAX_FRAME_SIZE, n);
+		size += n;
+	}
+
+	/* Repeated IDs and payloads take only a few bytes */
+	ASSERT_UINT_LT(N_FRAMES * sizeof(struct tb_frame) / 3, size);
+
+	tr_codec_reset(&decoder, frames_[0].timestamp);
+
+	size_t offset = 0;
+	for (int i = 0; i < N_FRAMES; ++i) {
+		struct tb_frame frame;
+		ssize_t n = tr_decode(&decoder, data + offset, size - offset,
+				      &frame);
+		ASSERT_INT_GT(0, n);
+		ASSERT_INT_EQ(0, compare_frames(&frames_[i], &frame));
+		offset += n;
+	}
+
+	ASSERT_UINT_EQ(size, offset);
+
+	/* Frames that are cut short are not decoded */
+	struct tb_frame frame;
+	tr_codec_reset(&decoder, frames_[0].timestamp);
+	ASSERT_INT_LT(0, tr_decode(&decoder, data, 3, &frame));
+	return 0;
+}
+
+static void on_frame(const struct tb_frame* frame, void* context)
+{
+	(void)context;
+
+	if (n_read_ < N_FRAMES)
+		read_[n_read_] = *frame;
+
+	++n_read_;
+}
+
+static int read_recording(const char* path, const struct tr_filter* filter)
+{
+	n_read_ = 0;
+	return tr_read_path(path, filter, on_frame, NULL);
+}
+
+static size_t list_recordings(const char* directory, glob_t* files)
+{
+	char pattern[256];
+	snprintf(pattern, sizeof(pattern), "%s/test-*.ctr", directory);
+
+	if (glob(pattern, 0, NULL, files) != 0)
+		return 0;
+
+	return files->gl_pathc;
+}
+
+static void remove_recordings(const char* directory)
+{
+	glob_t files;
+	if (list_recordings(directory, &files) > 0) {
+		for (size_t i = 0; i < files.gl_pathc; ++i)
+			unlink(files.gl_pathv[i]);
+		globfree(&files);
+	}
+
+	rmdir(directory);
+}
+
+static int test_rotation()
+{
+	char directory[] = "/tmp/unit_trace-record.XXXXXX";
+	ASSERT_TRUE(mkdtemp(directory));
+
+	struct tracebuffer tb;
+	ASSERT_INT_GE(0, tb_init(&tb, 256 * sizeof(struct tb_frame)));
+
+	struct tr_recorder recorder;
+	ASSERT_INT_EQ(0, tr_recorder_init(&recorder, &tb, directory, "test"));
+
+	/* Every block goes into a file of its own */
+	tr_recorder_set_rotation(&recorder, 1, 0, 3);
+	make_frames();
+
+	for (int i = 0; i < 5; ++i) {
+		for (int j = 0; j < 100; ++j)
+			tb_append_fd_ts(&tb, &frames_[i * 100 + j].cfd,
+					frames_[i * 100 + j].timestamp);
+
+		ASSERT_INT_EQ(0, tr_recorder_poll(&recorder, 1));
+	}
+
+	struct tr_stats stats;
+	tr_recorder_get_stats(&recorder, &stats);
+	ASSERT_UINT_EQ(500, stats.n_frames);
+	ASSERT_UINT_EQ(0, stats.n_lost);
+	ASSERT_UINT_EQ(5, stats.n_files);
+	ASSERT_TRUE(stats.n_bytes < stats.n_raw_bytes);
+
+	tr_recorder_destroy(&recorder);
+
+	/* Only the newest files are kept */
+	glob_t files;
+	ASSERT_UINT_EQ(3, list_recordings(directory, &files));
+	ASSERT_INT_EQ(0, read_recording(files.gl_pathv[2], NULL));
+	globfree(&files);
+
+	ASSERT_UINT_EQ(100, n_read_);
+	for (int i = 0; i < 100; ++i)
+		ASSERT_INT_EQ(0, compare_frames(&frames_[400 + i], &read_[i]));
+
+	tb_destroy(&tb);
+	remove_recordings(directory);
+	return 0;
+}
+
+static int test_thread_and_lost_frames()
+{
+	char directory[] = "/tmp/unit_trace-record.XXXXXX";
+	ASSERT_TRUE(mkdtemp(directory));
+
+	struct tracebuffer tb;
+	ASSERT_INT_GE(0, tb_init(&tb, 64 * sizeof(struct tb_frame)));
+
+	struct tr_recorder recorder;
+	ASSERT_INT_EQ(0, tr_recorder_init(&recorder, &tb, directory, "test"));
+	ASSERT_INT_EQ(0, tr_recorder_start(&recorder));
+	make_frames();
+
+	/* More than the ring holds gets overwritten before the thread is
+	 * woken up.
+	 */
+	for (int i = 0; i < 200; ++i)
+		tb_append_fd_ts(&tb, &frames_[i].cfd, frames_[i].timestamp);
+
+	tr_recorder_stop(&recorder);
+
+	struct tr_stats stats;
+	tr_recorder_get_stats(&recorder, &stats);
+	ASSERT_UINT_EQ(200, stats.n_frames + stats.n_lost);
+	ASSERT_UINT_EQ(1, stats.n_files);
+
+	tr_recorder_destroy(&recorder);
+
+	glob_t files;
+	ASSERT_UINT_EQ(1, list_recordings(directory, &files));
+	ASSERT_INT_EQ(0, read_recording(files.gl_pathv[0], NULL));
+	globfree(&files);
+
+	ASSERT_UINT_EQ(stats.n_frames, n_read_);
+	ASSERT_INT_EQ(0, compare_frames(&frames_[199], &read_[n_read_ - 1]));
+
+	tb_destroy(&tb);
+	remove_recordings(directory);
+	return 0;
+}
+
+static int record_blocks(const char* directory, int n_blocks)
+{
+	struct tracebuffer tb;
+	ASSERT_INT_GE(0, tb_init(&tb, 256 * sizeof(struct tb_frame)));
+
+	struct tr_recorder recorder;
+	ASSERT_INT_EQ(0, tr_recorder_init(&recorder, &tb, directory, "test"));
+	make_frames();
+
+	for (int i = 0; i < n_blocks; ++i) {
+		for (int j = 0; j < 100; ++j)
+			tb_append_fd_ts(&tb, &frames_[i * 100 + j].cfd,
+					frames_[i * 100 + j].timestamp);
+
+		ASSERT_INT_EQ(0, tr_recorder_poll(&recorder, 1));
+	}
+
+	tr_recorder_destroy(&recorder);
+	tb_destroy(&tb);
+	return 0;
+}
+
+static int check_selection(const char* path)
+{
+	struct tr_filter filter = {
+		.from = frames_[250].timestamp,
+		.to = frames_[349].timestamp,
+	};
+
+	/* Frames 251, 255, ... are ahead of their place in time */
+	ASSERT_INT_EQ(0, read_recording(path, &filter));
+	ASSERT_UINT_EQ(100, n_read_);
+	for (size_t i = 0; i < n_read_; ++i)
+		ASSERT_TRUE(read_[i].timestamp >= filter.from
+			 && read_[i].timestamp <= filter.to);
+
+	/* Node 1 sends every 4th frame */
+	memset(&filter, 0, sizeof(filter));
+	tr_filter_add_node(&filter, 1);
+	ASSERT_INT_EQ(0, read_recording(path, &filter));
+	ASSERT_UINT_EQ(N_FRAMES / 4, n_read_);
+	ASSERT_INT_EQ(0, compare_frames(&frames_[N_FRAMES - 3],
+					&read_[n_read_ - 1]));
+
+	/* No block has frames from node 9 */
+	memset(&filter, 0, sizeof(filter));
+	tr_filter_add_node(&filter, 9);
+	ASSERT_INT_EQ(0, read_recording(path, &filter));
+	ASSERT_UINT_EQ(0, n_read_);
+	return 0;
+}
+
+/* An index entry that points far past the end is refused rather than read */
+static int check_damaged_index(const char* path)
+{
+	int fd = open(path, O_RDWR);
+	ASSERT_INT_GE(0, fd);
+
+	struct stat st;
+	ASSERT_INT_EQ(0, fstat(fd, &st));
+
+	struct tr_trailer trailer;
+	off_t trailer_offset = st.st_size - sizeof(trailer);
+	ASSERT_INT_EQ(sizeof(trailer),
+		      pread(fd, &trailer, sizeof(trailer), trailer_offset));
+
+	off_t entry_offset = trailer.index_offset
+			   + sizeof(struct tr_index_header);
+	struct tr_index_entry entry, damaged;
+	ASSERT_INT_EQ(sizeof(entry),
+		      pread(fd, &entry, sizeof(entry), entry_offset));
+
+	damaged = entry;
+	damaged.offset = UINT64_MAX - 8;
+	ASSERT_INT_EQ(sizeof(damaged),
+		      pwrite(fd, &damaged, sizeof(damaged), entry_offset));
+
+	ASSERT_INT_LT(0, read_recording(path, NULL));
+	ASSERT_INT_EQ(EBADMSG, errno);
+
+	ASSERT_INT_EQ(sizeof(entry),
+		      pwrite(fd, &entry, sizeof(entry), entry_offset));
+	close(fd);
+	return 0;
+}
+
+static int test_index()
+{
+	char directory[] = "/tmp/unit_trace-record.XXXXXX";
+	ASSERT_TRUE(mkdtemp(directory));
+	ASSERT_INT_EQ(0, record_blocks(directory, N_FRAMES / 100));
+
+	glob_t files;
+	ASSERT_UINT_EQ(1, list_recordings(directory, &files));
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s", files.gl_pathv[0]);
+	globfree(&files);
+
+	ASSERT_INT_EQ(0, check_selection(path));
+	ASSERT_INT_EQ(0, check_damaged_index(path));
+
+	/* Without the index, the blocks are found one header at a time */
+	struct stat st;
+	ASSERT_INT_EQ(0, stat(path, &st));
+	ASSERT_INT_EQ(0, truncate(path, st.st_size - 2));
+	ASSERT_INT_EQ(0, read_recording(path, NULL));
+	ASSERT_UINT_EQ(N_FRAMES, n_read_);
+	ASSERT_INT_EQ(0, check_selection(path));
+
+	remove_recordings(directory);
+	return 0;
+}
+
+static int test_other_versions_are_refused()
+{
+	char path[] = "/tmp/unit_trace-record.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+
+	struct tr_file_header header = {
+		.magic = TR_FILE_MAGIC,
+		.version = TR_VERSION + 1,
+		.header_size = sizeof(header),
+	};
+
+	ASSERT_INT_EQ(sizeof(header), write(fd, &header, sizeof(header)));
+	close(fd);
+
+	ASSERT_INT_LT(0, read_recording(path, NULL));
+	ASSERT_INT_EQ(ENOTSUP, errno);
+
+	unlink(path);
+	return 0;
+}
+
+static int test_raw_dump()
+{
+	char path[] = "/tmp/unit_trace-record.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+
+	struct tb_dump_header header;
+	tb_dump_header_init(&header);
+	ASSERT_INT_EQ(sizeof(header), write(fd, &header, sizeof(header)));
+
+	make_frames();
+	ASSERT_INT_EQ(10 * sizeof(frames_[0]),
+		      write(fd, frames_, 10 * sizeof(frames_[0])));
+	close(fd);
+
+	ASSERT_INT_EQ(0, read_recording(path, NULL));
+	ASSERT_UINT_EQ(10, n_read_);
+	ASSERT_INT_EQ(0, compare_frames(&frames_[9], &read_[9]));
+
+	struct tr_filter filter = { 0 };
+	tr_filter_add_node(&filter, 2);
+	ASSERT_INT_EQ(0, read_recording(path, &filter));
+	ASSERT_UINT_EQ(2, n_read_);
+
+	unlink(path);
+	return 0;
+}
+
+/* Dumps from before the header was added hold classic frames in 24 bytes */
+static int test_legacy_dump()
+{
+	char path[] = "/tmp/unit_trace-record.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+
+	for (int i = 0; i < 3; ++i) {
+		uint8_t record[TB_LEGACY_RECORD_SIZE];
+		uint64_t timestamp = 1000 + i;
+		struct can_frame cf = { .can_id = 0x181 + i, .can_dlc = 1 };
+		cf.data[0] = i;
+
+		memcpy(record, &timestamp, sizeof(timestamp));
+		memcpy(record + sizeof(timestamp), &cf, sizeof(cf));
+		ASSERT_INT_EQ(sizeof(record), write(fd, record, sizeof(record)));
+	}
+
+	ASSERT_INT_EQ(0, read_recording(path, NULL));
+	ASSERT_UINT_EQ(3, n_read_);
+	ASSERT_UINT_EQ(1002, read_[2].timestamp);
+	ASSERT_UINT_EQ(0x183, read_[2].cf.can_id);
+	ASSERT_UINT_EQ(1, read_[2].cf.can_dlc);
+	ASSERT_UINT_EQ(2, read_[2].cf.data[0]);
+	ASSERT_UINT_EQ(0, read_[2].cfd.flags);
+
+	/* Anything that is not made of whole records is refused */
+	ASSERT_INT_EQ(1, write(fd, "", 1));
+	close(fd);
+
+	ASSERT_INT_LT(0, read_recording(path, NULL));
+	ASSERT_INT_EQ(EBADMSG, errno);
+
+	unlink(path);
+	return 0;
+}
+
+static int test_mapped_buffer()
+{
+	char path[] = "/tmp/unit_trace-record.XXXXXX";
+	int fd = mkstemp(path);
+	ASSERT_INT_GE(0, fd);
+	close(fd);
+
+	struct tracebuffer tb;
+	ASSERT_INT_EQ(0, tb_init_mapped(&tb, 64 * sizeof(struct tb_frame),
+					path));
+
+	make_frames();
+	for (int i = 0; i < 100; ++i)
+		tb_append_fd_ts(&tb, &frames_[i].cfd, frames_[i].timestamp);
+
+	/* It can be read while it is still open */
+	ASSERT_INT_EQ(0, read_recording(path, NULL));
+	ASSERT_UINT_EQ(64, n_read_);
+	ASSERT_INT_EQ(0, compare_frames(&frames_[36], &read_[0]));
+	ASSERT_INT_EQ(0, compare_frames(&frames_[99], &read_[63]));
+
+	struct tr_filter filter = { 0 };
+	tr_filter_add_node(&filter, 1);
+	ASSERT_INT_EQ(0, read_recording(path, &filter));
+	ASSERT_UINT_EQ(16, n_read_);
+
+	tb_destroy(&tb);
+	unlink(path);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_codec);
+	RUN_TEST(test_rotation);
+	RUN_TEST(test_thread_and_lost_frames);
+	RUN_TEST(test_index);
+	RUN_TEST(test_other_versions_are_refused);
+	RUN_TEST(test_raw_dump);
+	RUN_TEST(test_legacy_dump);
+	RUN_TEST(test_mapped_buffer);
+	return r;
+}
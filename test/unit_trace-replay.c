@@ -0,0 +1,168 @@
+#include "tst.h"
+#include "trace-replay.h"
+#include "trace-buffer.h"
+#include "time-utils.h"
+#include "sock.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+
+static struct sock sock_;
+static int peer_;
+
+static void setup(void)
+{
+	int fds[2];
+	socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, fds);
+	sock_init(&sock_, SOCK_TYPE_CAN, fds[0], NULL);
+	peer_ = fds[1];
+}
+
+static void cleanup(void)
+{
+	sock_close(&sock_);
+	close(peer_);
+}
+
+static void feed(struct trace_replay* replay, uint32_t can_id,
+		 uint64_t timestamp)
+{
+	struct tb_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.timestamp = timestamp;
+	frame.cf.can_id = can_id;
+	frame.cf.can_dlc = 1;
+	frame.cf.data[0] = can_id;
+	trace_replay_frame(replay, &frame);
+}
+
+static int receive(uint32_t* can_id)
+{
+	struct can_frame cf;
+	ssize_t n = recv(peer_, &cf, sizeof(cf), MSG_DONTWAIT);
+	if (n != sizeof(cf))
+		return -1;
+
+	*can_id = cf.can_id;
+	return 0;
+}
+
+static int test_frames_from_slaves()
+{
+	ASSERT_TRUE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x185 }));
+	ASSERT_TRUE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x585 }));
+	ASSERT_TRUE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x85 }));
+	ASSERT_TRUE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x705 }));
+
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0 }));
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x80 }));
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x205 }));
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x605 }));
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x705 | CAN_RTR_FLAG }));
+	ASSERT_FALSE(trace_replay_is_from_slave(&(struct can_frame){ .can_id = 0x185 | CAN_EFF_FLAG }));
+	return 0;
+}
+
+static int test_only_one_side_is_replayed()
+{
+	struct trace_replay replay;
+	uint32_t can_id;
+
+	setup();
+
+	trace_replay_init(&replay, &sock_, 0, TRACE_REPLAY_SLAVES);
+	feed(&replay, 0x000, 1000);
+	feed(&replay, 0x605, 1000);
+	feed(&replay, 0x585, 1000);
+	feed(&replay, 0x185, 1000);
+	trace_replay_flush(&replay);
+
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_UINT_EQ(0x585, can_id);
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_UINT_EQ(0x185, can_id);
+	ASSERT_INT_EQ(-1, receive(&can_id));
+	ASSERT_TRUE(replay.stats.n_frames == 2);
+	ASSERT_TRUE(replay.stats.n_skipped == 2);
+
+	trace_replay_init(&replay, &sock_, 0, TRACE_REPLAY_MASTER);
+	feed(&replay, 0x000, 1000);
+	feed(&replay, 0x585, 1000);
+	feed(&replay, 0x605, 1000);
+	trace_replay_flush(&replay);
+
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_UINT_EQ(0x000, can_id);
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_UINT_EQ(0x605, can_id);
+	ASSERT_INT_EQ(-1, receive(&can_id));
+
+	cleanup();
+	return 0;
+}
+
+static int test_timing_is_scaled()
+{
+	struct trace_replay replay;
+	uint32_t can_id;
+
+	setup();
+
+	/* 200 ms of trace at 10 times the speed */
+	trace_replay_init(&replay, &sock_, 10, TRACE_REPLAY_SLAVES);
+
+	uint64_t start = gettime_us(CLOCK_MONOTONIC);
+	feed(&replay, 0x181, 5000000);
+	feed(&replay, 0x182, 5100000);
+	feed(&replay, 0x183, 5200000);
+	trace_replay_flush(&replay);
+	uint64_t elapsed = gettime_us(CLOCK_MONOTONIC) - start;
+
+	ASSERT_TRUE(elapsed >= 20000);
+	ASSERT_TRUE(elapsed < 200000);
+
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_INT_EQ(0, receive(&can_id));
+	ASSERT_UINT_EQ(0x183, can_id);
+
+	/* Going back in time */
+	start = gettime_us(CLOCK_MONOTONIC);
+	feed(&replay, 0x184, 1000);
+	ASSERT_TRUE(gettime_us(CLOCK_MONOTONIC) - start < 10000);
+
+	cleanup();
+	return 0;
+}
+
+static int test_stop_flag()
+{
+	struct trace_replay replay;
+	volatile sig_atomic_t is_stopping = 1;
+	uint32_t can_id;
+
+	setup();
+
+	trace_replay_init(&replay, &sock_, 1, TRACE_REPLAY_ALL);
+	trace_replay_set_stop_flag(&replay, &is_stopping);
+	feed(&replay, 0x181, 0);
+	trace_replay_flush(&replay);
+
+	ASSERT_INT_EQ(-1, receive(&can_id));
+
+	cleanup();
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_frames_from_slaves);
+	RUN_TEST(test_only_one_side_is_replayed);
+	RUN_TEST(test_timing_is_scaled);
+	RUN_TEST(test_stop_flag);
+	return r;
+}
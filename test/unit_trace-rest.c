@@ -0,0 +1,267 @@
+#include "tst.h"
+#include "trace-rest.h"
+#include "trace-buffer.h"
+#include "rest.h"
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <mloop.h>
+
+static int fds_[2];
+static struct rest_client client_;
+static struct tracebuffer tb_;
+
+static int init(const char* request)
+{
+	ASSERT_INT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds_));
+
+	memset(&client_, 0, sizeof(client_));
+	pthread_mutex_init(&client_.output_lock, NULL);
+	pthread_cond_init(&client_.output_drained, NULL);
+	vector_init(&client_.unsent, 0);
+
+	/* Replies are made from within the handler, as far as the client
+	 * knows, so nothing needs to be resumed
+	 */
+	client_.ref = 1;
+	client_.is_handling = 1;
+	client_.state = REST_CLIENT_SERVICING;
+
+	client_.socket = mloop_socket_new(mloop_default());
+	ASSERT_TRUE(client_.socket);
+	ASSERT_INT_EQ(0, rest__init_output(&client_, fds_[0]));
+	ASSERT_INT_EQ(0, http_req_parse(&client_.req, request));
+
+	ASSERT_INT_EQ(0, tb_init(&tb_, 16 * sizeof(struct tb_frame)));
+	return 0;
+}
+
+static void cleanup(void)
+{
+	trace_rest_cleanup();
+	tb_destroy(&tb_);
+
+	http_req_free(&client_.req);
+	rest__destroy_output(&client_);
+	mloop_socket_unref(client_.socket);
+	vector_destroy(&client_.unsent);
+	pthread_cond_destroy(&client_.output_drained);
+	pthread_mutex_destroy(&client_.output_lock);
+	close(fds_[1]);
+}
+
+static void append(canid_t can_id)
+{
+	struct can_frame cf = { 0 };
+	cf.can_id = can_id;
+	cf.can_dlc = 1;
+	tb_append(&tb_, &cf);
+}
+
+/* Waits for the next tick of the streams */
+static void run_once(void)
+{
+	struct pollfd pfd = {
+		.fd = mloop_get_pollfd(mloop_default()),
+		.events = POLLIN
+	};
+
+	poll(&pfd, 1, 2 * TRACE_REST_INTERVAL);
+	mloop_run_once(mloop_default());
+}
+
+/* Reads what has been sent so far */
+static size_t receive(char* buffer, size_t size)
+{
+	ssize_t n = recv(fds_[1], buffer, size - 1, MSG_DONTWAIT);
+	if (n < 0)
+		return 0;
+
+	buffer[n] = '\0';
+	return n;
+}
+
+static const char* skip_head(const char* reply)
+{
+	const char* end = strstr(reply, "\r\n\r\n");
+	return end ? end + 4 : NULL;
+}
+
+static int test_raw_snapshot(void)
+{
+	ASSERT_INT_EQ(0, init("GET /trace HTTP/1.1\r\n\r\n"));
+
+	append(1);
+	append(2);
+	append(3);
+
+	trace_rest_serve(&client_, &tb_, "can0");
+
+	char buffer[4096];
+	size_t n = receive(buffer, sizeof(buffer));
+	ASSERT_TRUE(n > 0);
+	ASSERT_INT_EQ(0, strncmp(buffer, "HTTP/1.1 200 OK\r\n", 17));
+	ASSERT_TRUE(strstr(buffer, "Transfer-Encoding: chunked\r\n"));
+	ASSERT_TRUE(strstr(buffer, "application/octet-stream"));
+
+	const char* body = skip_head(buffer);
+	ASSERT_TRUE(body);
+
+	/* The header of the dump comes first, in a chunk of its own */
+	char size[16];
+	snprintf(size, sizeof(size), "%zx\r\n", sizeof(struct tb_dump_header));
+	ASSERT_INT_EQ(0, strncmp(body, size, strlen(size)));
+
+	struct tb_dump_header header;
+	memcpy(&header, body + strlen(size), sizeof(header));
+	ASSERT_UINT_EQ(TB_DUMP_MAGIC, header.magic);
+	ASSERT_UINT_EQ(sizeof(struct tb_frame), header.record_size);
+	body += strlen(size) + sizeof(header) + 2;
+
+	snprintf(size, sizeof(size), "%zx\r\n", 3 * sizeof(struct tb_frame));
+	ASSERT_INT_EQ(0, strncmp(body, size, strlen(size)));
+
+	const char* data = body + strlen(size);
+	struct tb_frame frames[3];
+	memcpy(frames, data, sizeof(frames));
+	ASSERT_UINT_EQ(1, frames[0].cf.can_id);
+	ASSERT_UINT_EQ(3, frames[2].cf.can_id);
+
+	/* The last chunk is empty */
+	const char* end = data + sizeof(frames);
+	ASSERT_INT_EQ(0, memcmp(end, "\r\n0\r\n\r\n", 7));
+	ASSERT_UINT_EQ(n, end + 7 - buffer);
+
+	ASSERT_INT_EQ(REST_CLIENT_DONE, client_.state);
+	ASSERT_INT_EQ(1, client_.ref);
+
+	cleanup();
+	return 0;
+}
+
+static int test_pcapng_snapshot(void)
+{
+	ASSERT_INT_EQ(0, init("GET /trace?format=pcapng HTTP/1.1\r\n\r\n"));
+
+	append(1);
+	append(2);
+
+	trace_rest_serve(&client_, &tb_, "can0");
+
+	char buffer[4096];
+	size_t n = receive(buffer, sizeof(buffer));
+	ASSERT_TRUE(n > 0);
+	ASSERT_TRUE(strstr(buffer, "application/x-pcapng"));
+
+	const char* body = skip_head(buffer);
+	ASSERT_TRUE(body);
+
+	/* The section and the interface named can0, then a block per frame */
+	size_t size = 28 + 40 + 2 * (32 + CAN_MTU);
+	char head[16];
+	snprintf(head, sizeof(head), "%zx\r\n", size);
+	ASSERT_INT_EQ(0, strncmp(body, head, strlen(head)));
+
+	uint32_t magic;
+	memcpy(&magic, body + strlen(head), sizeof(magic));
+	ASSERT_UINT_EQ(0x0a0d0d0a, magic);
+
+	ASSERT_INT_EQ(REST_CLIENT_DONE, client_.state);
+
+	cleanup();
+	return 0;
+}
+
+static int test_empty_pcapng_has_header(void)
+{
+	ASSERT_INT_EQ(0, init("GET /trace?format=pcapng HTTP/1.1\r\n\r\n"));
+
+	trace_rest_serve(&client_, &tb_, NULL);
+
+	char buffer[4096];
+	ASSERT_TRUE(receive(buffer, sizeof(buffer)) > 0);
+
+	const char* body = skip_head(buffer);
+	ASSERT_TRUE(body);
+	ASSERT_INT_EQ(0, strncmp(body, "3c\r\n", 4));
+	ASSERT_INT_EQ(REST_CLIENT_DONE, client_.state);
+
+	cleanup();
+	return 0;
+}
+
+static int test_invalid_format(void)
+{
+	ASSERT_INT_EQ(0, init("GET /trace?format=csv HTTP/1.1\r\n\r\n"));
+
+	trace_rest_serve(&client_, &tb_, NULL);
+
+	char buffer[4096];
+	ASSERT_TRUE(receive(buffer, sizeof(buffer)) > 0);
+	ASSERT_INT_EQ(0, strncmp(buffer, "HTTP/1.1 400 Bad Request\r\n", 26));
+	ASSERT_INT_EQ(REST_CLIENT_DONE, client_.state);
+	ASSERT_INT_EQ(1, client_.ref);
+
+	cleanup();
+	return 0;
+}
+
+/* Frames that are traced after the request follow the snapshot */
+static int test_follow(void)
+{
+	ASSERT_INT_EQ(0, init("GET /trace?follow=1 HTTP/1.1\r\n\r\n"));
+
+	append(1);
+
+	trace_rest_serve(&client_, &tb_, NULL);
+
+	char buffer[4096];
+	ASSERT_TRUE(receive(buffer, sizeof(buffer)) > 0);
+	ASSERT_INT_EQ(REST_CLIENT_SERVICING, client_.state);
+	ASSERT_INT_EQ(2, client_.ref);
+
+	append(2);
+	append(3);
+
+	size_t n = 0;
+	for (int i = 0; i < 10 && n == 0; ++i) {
+		run_once();
+		n = receive(buffer, sizeof(buffer));
+	}
+
+	char size[16];
+	snprintf(size, sizeof(size), "%zx\r\n", 2 * sizeof(struct tb_frame));
+	ASSERT_INT_EQ(0, strncmp(buffer, size, strlen(size)));
+
+	struct tb_frame frame;
+	memcpy(&frame, buffer + strlen(size), sizeof(frame));
+	ASSERT_UINT_EQ(2, frame.cf.can_id);
+
+	ASSERT_INT_EQ(REST_CLIENT_SERVICING, client_.state);
+
+	/* The stream lets go of the client when it goes away */
+	client_.state = REST_CLIENT_DISCONNECTED;
+	for (int i = 0; i < 10 && client_.ref > 1; ++i)
+		run_once();
+
+	ASSERT_INT_EQ(1, client_.ref);
+
+	cleanup();
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_raw_snapshot);
+	RUN_TEST(test_pcapng_snapshot);
+	RUN_TEST(test_empty_pcapng_has_header);
+	RUN_TEST(test_invalid_format);
+	RUN_TEST(test_follow);
+	return r;
+}
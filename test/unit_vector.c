@@ -112,6 +112,36 @@ static int test_vector_fill()
 	return 0;
 }
 
+static int test_inline()
+{
+	char buffer[4];
+	struct vector vector;
+	vector_init_inline(&vector, buffer, sizeof(buffer));
+	ASSERT_UINT_EQ(4, vector.size);
+
+	vector_assign(&vector, "abcd", 4);
+	ASSERT_PTR_EQ(buffer, vector.data);
+
+	vector_append(&vector, "efgh", 5);
+	ASSERT_TRUE(vector.data != buffer);
+	ASSERT_UINT_EQ(9, vector.index);
+	ASSERT_STR_EQ("abcdefgh", vector.data);
+
+	vector_destroy(&vector);
+	return 0;
+}
+
+static int test_inline_destroy()
+{
+	char buffer[4];
+	struct vector vector;
+	vector_init_inline(&vector, buffer, sizeof(buffer));
+	vector_append(&vector, "a", 1);
+	vector_destroy(&vector);
+	ASSERT_PTR_EQ(NULL, vector.data);
+	return 0;
+}
+
 int main()
 {
 	int r = 0;
@@ -124,5 +154,7 @@ int main()
 	RUN_TEST(test_vector_assign_once);
 	RUN_TEST(test_vector_assign_twice);
 	RUN_TEST(test_vector_fill);
+	RUN_TEST(test_inline);
+	RUN_TEST(test_inline_destroy);
 	return r;
 }
@@ -0,0 +1,159 @@
+#include "tst.h"
+#include "vnode-od.h"
+#include "ini_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+static int compile(struct vnode_od* od, const char* text)
+{
+	static char buffer[4096];
+	struct ini_file ini;
+
+	strcpy(buffer, text);
+	if (ini_parse_buffer(&ini, buffer, strlen(buffer)) < 0)
+		return -2;
+
+	int rc = vnode_od_compile(od, &ini);
+	ini_destroy(&ini);
+	return rc;
+}
+
+static const char* config_ =
+	"[device]\n"
+	"heartbeat=yes\n"
+	"[1008sub0]\n"
+	"type=VISIBLE_STRING\n"
+	"value=MCV14\n"
+	"[1000sub0]\n"
+	"type=UNSIGNED32\n"
+	"value=0x401\n"
+	"access=ro\n"
+	"[2001sub1a]\n"
+	"type=INTEGER16\n"
+	"value=-2\n"
+	"[2001sub2]\n"
+	"type=NOSUCHTYPE\n"
+	"value=1\n"
+	"[2001sub3]\n"
+	"type=UNSIGNED8\n";
+
+static int test_objects_are_compiled()
+{
+	struct vnode_od od;
+	ASSERT_INT_EQ(0, compile(&od, config_));
+	ASSERT_UINT_EQ(3, od.n_entries);
+
+	const struct vnode_od_entry* entry = vnode_od_find(&od, 0x1000, 0);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(CANOPEN_UNSIGNED32, entry->type);
+	ASSERT_UINT_EQ(4, entry->size);
+	ASSERT_TRUE(entry->is_read_only);
+	ASSERT_INT_EQ(0, memcmp("\x01\x04\0\0", vnode_od_get_data(&od, entry), 4));
+
+	entry = vnode_od_find(&od, 0x1008, 0);
+	ASSERT_TRUE(entry);
+	ASSERT_UINT_EQ(5, entry->size);
+	ASSERT_UINT_EQ(VNODE_OD_MIN_STRING_CAPACITY, entry->capacity);
+	ASSERT_FALSE(entry->is_read_only);
+	ASSERT_INT_EQ(0, memcmp("MCV14", vnode_od_get_data(&od, entry), 5));
+
+	entry = vnode_od_find(&od, 0x2001, 0x1a);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(0, memcmp("\xfe\xff", vnode_od_get_data(&od, entry), 2));
+
+	/* Without a known type or a value */
+	ASSERT_FALSE(vnode_od_find(&od, 0x2001, 2));
+	ASSERT_FALSE(vnode_od_find(&od, 0x2001, 3));
+	ASSERT_FALSE(vnode_od_find(&od, 0x1001, 0));
+
+	vnode_od_destroy(&od);
+	return 0;
+}
+
+static int test_last_section_wins()
+{
+	struct vnode_od od;
+	ASSERT_INT_EQ(0, compile(&od,
+		"[1017sub0]\ntype=UNSIGNED16\nvalue=1\n"
+		"[1017sub0]\ntype=UNSIGNED16\nvalue=2\n"));
+	ASSERT_UINT_EQ(1, od.n_entries);
+
+	const struct vnode_od_entry* entry = vnode_od_find(&od, 0x1017, 0);
+	ASSERT_TRUE(entry);
+	ASSERT_INT_EQ(2, *(const uint8_t*)vnode_od_get_data(&od, entry));
+
+	vnode_od_destroy(&od);
+	return 0;
+}
+
+static int test_bad_value_fails()
+{
+	struct vnode_od od;
+	ASSERT_INT_EQ(-1, compile(&od, "[1000sub0]\ntype=UNSIGNED8\nvalue=x\n"));
+	ASSERT_INT_EQ(EINVAL, errno);
+	return 0;
+}
+
+static int test_writes_are_in_place()
+{
+	struct vnode_od od, copy;
+	ASSERT_INT_EQ(0, compile(&od, config_));
+	ASSERT_INT_EQ(0, vnode_od_copy(&copy, &od));
+
+	ASSERT_INT_EQ(0, vnode_od_write(&copy, 0x2001, 0x1a, "\x10\x00", 2));
+	const struct vnode_od_entry* entry = vnode_od_find(&copy, 0x2001, 0x1a);
+	ASSERT_INT_EQ(0, memcmp("\x10\x00", vnode_od_get_data(&copy, entry), 2));
+
+	/* The original is left as it was */
+	entry = vnode_od_find(&od, 0x2001, 0x1a);
+	ASSERT_INT_EQ(0, memcmp("\xfe\xff", vnode_od_get_data(&od, entry), 2));
+
+	ASSERT_INT_EQ(0, vnode_od_write(&copy, 0x1008, 0, "longer name", 11));
+	entry = vnode_od_find(&copy, 0x1008, 0);
+	ASSERT_UINT_EQ(11, entry->size);
+	ASSERT_INT_EQ(0, memcmp("longer name", vnode_od_get_data(&copy, entry),
+				11));
+
+	char big[VNODE_OD_MIN_STRING_CAPACITY + 1] = { 0 };
+	ASSERT_INT_EQ(-1, vnode_od_write(&copy, 0x1008, 0, big, sizeof(big)));
+	ASSERT_INT_EQ(EMSGSIZE, errno);
+
+	ASSERT_INT_EQ(-1, vnode_od_write(&copy, 0x2001, 0x1a, "\x01", 1));
+	ASSERT_INT_EQ(ERANGE, errno);
+
+	ASSERT_INT_EQ(-1, vnode_od_write(&copy, 0x1000, 0, "\0\0\0\0", 4));
+	ASSERT_INT_EQ(EACCES, errno);
+
+	ASSERT_INT_EQ(-1, vnode_od_write(&copy, 0x1001, 0, "\0", 1));
+	ASSERT_INT_EQ(ENOENT, errno);
+
+	vnode_od_destroy(&copy);
+	vnode_od_destroy(&od);
+	return 0;
+}
+
+static int test_empty_config()
+{
+	struct vnode_od od, copy;
+	ASSERT_INT_EQ(0, compile(&od, "[device]\nheartbeat=yes\n"));
+	ASSERT_UINT_EQ(0, od.n_entries);
+	ASSERT_FALSE(vnode_od_find(&od, 0x1000, 0));
+	ASSERT_INT_EQ(0, vnode_od_copy(&copy, &od));
+	vnode_od_destroy(&copy);
+	vnode_od_destroy(&od);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_objects_are_compiled);
+	RUN_TEST(test_last_section_wins);
+	RUN_TEST(test_bad_value_fails);
+	RUN_TEST(test_writes_are_in_place);
+	RUN_TEST(test_empty_config);
+	return r;
+}
@@ -0,0 +1,221 @@
+#include "tst.h"
+#include "vnode-traffic.h"
+#include "ini_parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int load(struct vnode_traffic* traffic, const char* text, int nodeid)
+{
+	static char buffer[4096];
+	struct ini_file ini;
+
+	strcpy(buffer, text);
+	if (ini_parse_buffer(&ini, buffer, strlen(buffer)) < 0)
+		return -2;
+
+	int rc = vnode_traffic_load(traffic, &ini, nodeid);
+	ini_destroy(&ini);
+	return rc;
+}
+
+static int test_timed_frames_do_not_drift()
+{
+	struct vnode_traffic traffic;
+	ASSERT_INT_EQ(0, load(&traffic, "[tpdo1]\nperiod=1000\n", 5));
+
+	struct vnode_traffic_gen* gen = &traffic.tpdo[0];
+	ASSERT_TRUE(vnode_traffic_is_timed(&traffic));
+	ASSERT_FALSE(vnode_traffic_is_synchronous(&traffic));
+	ASSERT_UINT_EQ(0x185, gen->cob_id);
+
+	vnode_traffic_start(&traffic, 10000);
+	ASSERT_TRUE(vnode_traffic_next_deadline(&traffic) == 11000);
+
+	ASSERT_UINT_EQ(0, vnode_traffic_due(gen, 10999));
+	ASSERT_UINT_EQ(1, vnode_traffic_due(gen, 11300));
+	ASSERT_UINT_EQ(2, vnode_traffic_due(gen, 13000));
+	ASSERT_TRUE(vnode_traffic_next_deadline(&traffic) == 14000);
+
+	/* Far behind */
+	ASSERT_UINT_EQ(VNODE_TRAFFIC_MAX_CATCH_UP,
+		       vnode_traffic_due(gen, 14000 + 99 * 1000));
+	ASSERT_UINT_EQ(100 - VNODE_TRAFFIC_MAX_CATCH_UP, gen->n_skipped);
+
+	vnode_traffic_destroy(&traffic);
+	return 0;
+}
+
+static int test_synchronous_frames()
+{
+	struct vnode_traffic traffic;
+	ASSERT_INT_EQ(0, load(&traffic, "[tpdo2]\nsync=2\nburst=3\n", 1));
+
+	struct vnode_traffic_gen* gen = &traffic.tpdo[1];
+	ASSERT_FALSE(vnode_traffic_is_timed(&traffic));
+	ASSERT_TRUE(vnode_traffic_is_synchronous(&traffic));
+	ASSERT_UINT_EQ(0x281, gen->cob_id);
+
+	ASSERT_UINT_EQ(0, vnode_traffic_on_sync(gen));
+	ASSERT_UINT_EQ(3, vnode_traffic_on_sync(gen));
+	ASSERT_UINT_EQ(0, vnode_traffic_on_sync(gen));
+	ASSERT_UINT_EQ(3, vnode_traffic_on_sync(gen));
+	ASSERT_UINT_EQ(0, vnode_traffic_on_sync(&traffic.tpdo[0]));
+
+	vnode_traffic_destroy(&traffic);
+	return 0;
+}
+
+static int test_counter_pattern()
+{
+	struct vnode_traffic traffic;
+	struct vnode_traffic_frame frame;
+
+	ASSERT_INT_EQ(0, load(&traffic, "[tpdo1]\nperiod=10\nsize=3\n"
+				"pattern=counter\ndata=fe00\n", 1));
+
+	struct vnode_traffic_gen* gen = &traffic.tpdo[0];
+
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(3, frame.size);
+	ASSERT_UINT_EQ(0xfe, frame.data[0]);
+
+	vnode_traffic_next_frame(gen, &frame);
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(0x00, frame.data[0]);
+	ASSERT_UINT_EQ(0x01, frame.data[1]);
+	ASSERT_UINT_EQ(0x00, frame.data[2]);
+	ASSERT_TRUE(gen->n_frames == 3);
+
+	vnode_traffic_destroy(&traffic);
+	return 0;
+}
+
+static int test_random_pattern_is_repeatable()
+{
+	struct vnode_traffic a, b, c;
+	struct vnode_traffic_frame fa, fb, fc;
+	const char* text = "[tpdo1]\nperiod=10\nsize=6\npattern=random\n";
+
+	ASSERT_INT_EQ(0, load(&a, text, 7));
+	ASSERT_INT_EQ(0, load(&b, text, 7));
+	ASSERT_INT_EQ(0, load(&c, text, 8));
+
+	vnode_traffic_next_frame(&a.tpdo[0], &fa);
+	vnode_traffic_next_frame(&b.tpdo[0], &fb);
+	vnode_traffic_next_frame(&c.tpdo[0], &fc);
+
+	ASSERT_UINT_EQ(6, fa.size);
+	ASSERT_INT_EQ(0, memcmp(fa.data, fb.data, 6));
+	ASSERT_TRUE(memcmp(fa.data, fc.data, 6) != 0);
+
+	vnode_traffic_destroy(&a);
+	vnode_traffic_destroy(&b);
+	vnode_traffic_destroy(&c);
+	return 0;
+}
+
+static int test_replay_pattern()
+{
+	char path[] = "/tmp/unit_vnode-traffic-XXXXXX";
+	char text[256];
+	struct vnode_traffic traffic;
+	struct vnode_traffic_frame frame;
+
+	int fd = mkstemp(path);
+	ASSERT_TRUE(fd >= 0);
+	FILE* stream = fdopen(fd, "w");
+	fprintf(stream, "# payloads\n01 02 03\n\nffee\n");
+	fclose(stream);
+
+	snprintf(text, sizeof(text),
+		 "[tpdo4]\nperiod=10\npattern=replay\nfile=%s\n", path);
+	ASSERT_INT_EQ(0, load(&traffic, text, 1));
+
+	struct vnode_traffic_gen* gen = &traffic.tpdo[3];
+	ASSERT_UINT_EQ(0x481, gen->cob_id);
+
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(3, frame.size);
+	ASSERT_UINT_EQ(0x03, frame.data[2]);
+
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(2, frame.size);
+	ASSERT_UINT_EQ(0xee, frame.data[1]);
+
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(3, frame.size);
+	ASSERT_UINT_EQ(0x01, frame.data[0]);
+
+	vnode_traffic_destroy(&traffic);
+
+	stream = fopen(path, "w");
+	fprintf(stream, "0102\n010\n");
+	fclose(stream);
+
+	struct vnode_traffic_frame* frames;
+	size_t n;
+	ASSERT_INT_EQ(-2, vnode_traffic_load_replay(&frames, &n, path));
+
+	unlink(path);
+	return 0;
+}
+
+static int test_emcy_bursts()
+{
+	struct vnode_traffic traffic;
+	struct vnode_traffic_frame frame;
+
+	ASSERT_INT_EQ(0, load(&traffic, "[emcy]\nperiod=100000\nburst=10\n"
+				"code=0x8130\nregister=0x11\n", 9));
+
+	struct vnode_traffic_gen* gen = &traffic.emcy;
+	ASSERT_UINT_EQ(0x89, gen->cob_id);
+
+	vnode_traffic_start(&traffic, 0);
+	ASSERT_UINT_EQ(10, vnode_traffic_due(gen, 100000));
+
+	vnode_traffic_next_frame(gen, &frame);
+	vnode_traffic_next_frame(gen, &frame);
+	ASSERT_UINT_EQ(8, frame.size);
+	ASSERT_UINT_EQ(0x30, frame.data[0]);
+	ASSERT_UINT_EQ(0x81, frame.data[1]);
+	ASSERT_UINT_EQ(0x11, frame.data[2]);
+	ASSERT_UINT_EQ(0x01, frame.data[3]);
+
+	vnode_traffic_destroy(&traffic);
+	return 0;
+}
+
+static int test_invalid_configs()
+{
+	struct vnode_traffic traffic;
+
+	ASSERT_INT_EQ(0, load(&traffic, "[device]\nheartbeat=no\n", 1));
+	ASSERT_FALSE(vnode_traffic_is_timed(&traffic));
+
+	ASSERT_INT_EQ(-1, load(&traffic, "[tpdo1]\nsize=8\n", 1));
+	ASSERT_INT_EQ(-1, load(&traffic, "[tpdo1]\nperiod=1\nsync=1\n", 1));
+	ASSERT_INT_EQ(-1, load(&traffic, "[tpdo1]\nperiod=1\nsize=9\n", 1));
+	ASSERT_INT_EQ(-1, load(&traffic, "[tpdo1]\nperiod=1\nsize=1\n"
+				 "data=0102\n", 1));
+	ASSERT_INT_EQ(-1, load(&traffic, "[tpdo1]\nperiod=1\n"
+				 "pattern=sawtooth\n", 1));
+	ASSERT_INT_EQ(-1, load(&traffic, "[emcy]\nsync=1\n", 1));
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_timed_frames_do_not_drift);
+	RUN_TEST(test_synchronous_frames);
+	RUN_TEST(test_counter_pattern);
+	RUN_TEST(test_random_pattern_is_repeatable);
+	RUN_TEST(test_replay_pattern);
+	RUN_TEST(test_emcy_bursts);
+	RUN_TEST(test_invalid_configs);
+	return r;
+}
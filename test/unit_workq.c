@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "tst.h"
+#include "workq.h"
+
+#define N_WORKERS 4
+#define N_THREADED_JOBS 100000
+
+static struct workq queue_;
+static uint8_t done_[N_THREADED_JOBS];
+
+static int test_bands_then_fifo()
+{
+	struct workq queue;
+	ASSERT_INT_EQ(0, workq_init(&queue, 4));
+	workq_set_n_workers(&queue, 2);
+
+	int jobs[6];
+	ASSERT_INT_EQ(0, workq_push(&queue, ULONG_MAX, &jobs[0]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 1, &jobs[1]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[2]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 1, &jobs[3]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[4]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 1000, &jobs[5]));
+
+	/* Jobs are handed out in turn, and a worker steals from the others
+	 * before it goes on to a lower band of its own.
+	 */
+	ASSERT_PTR_EQ(&jobs[2], workq_pop(&queue, 1));
+	ASSERT_PTR_EQ(&jobs[4], workq_pop(&queue, 0));
+	ASSERT_PTR_EQ(&jobs[1], workq_pop(&queue, 0));
+	ASSERT_PTR_EQ(&jobs[3], workq_pop(&queue, 1));
+	ASSERT_PTR_EQ(&jobs[5], workq_pop(&queue, 1));
+	ASSERT_PTR_EQ(&jobs[0], workq_pop(&queue, 1));
+
+	workq_stop(&queue);
+	ASSERT_PTR_EQ(NULL, workq_pop(&queue, 0));
+
+	workq_destroy(&queue);
+	return 0;
+}
+
+static int test_grow()
+{
+	struct workq queue;
+	ASSERT_INT_EQ(0, workq_init(&queue, 4));
+	workq_set_n_workers(&queue, 1);
+
+	static int jobs[1000];
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[i]));
+
+	for (int i = 0; i < 1000; ++i)
+		ASSERT_PTR_EQ(&jobs[i], workq_pop(&queue, 0));
+
+	workq_destroy(&queue);
+	return 0;
+}
+
+static int test_shrink_and_time_out()
+{
+	struct workq queue;
+	ASSERT_INT_EQ(0, workq_init(&queue, 4));
+	workq_set_n_workers(&queue, 2);
+
+	int jobs[2];
+	ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[0]));
+	ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[1]));
+
+	/* What was left to the worker that went is taken by the others */
+	workq_set_n_workers(&queue, 1);
+	ASSERT_INT_EQ(2, workq_get_length(&queue));
+	ASSERT_PTR_EQ(&jobs[0], workq_timed_pop(&queue, 0, 10));
+	ASSERT_PTR_EQ(&jobs[1], workq_timed_pop(&queue, 0, 10));
+
+	errno = 0;
+	ASSERT_PTR_EQ(NULL, workq_timed_pop(&queue, 0, 10));
+	ASSERT_INT_EQ(ETIMEDOUT, errno);
+
+	/* A push after a timeout is not lost */
+	ASSERT_INT_EQ(0, workq_push(&queue, 0, &jobs[0]));
+	ASSERT_PTR_EQ(&jobs[0], workq_timed_pop(&queue, 0, 10));
+
+	workq_stop(&queue);
+	errno = 0;
+	ASSERT_PTR_EQ(NULL, workq_timed_pop(&queue, 0, 10));
+	ASSERT_INT_EQ(0, errno);
+
+	workq_destroy(&queue);
+	return 0;
+}
+
+static void* worker(void* context)
+{
+	size_t index = (size_t)context;
+	uint8_t* job;
+
+	while ((job = workq_pop(&queue_, index)))
+		__atomic_add_fetch(job, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+static int test_threaded()
+{
+	ASSERT_INT_EQ(0, workq_init(&queue_, 64));
+	workq_set_n_workers(&queue_, N_WORKERS);
+
+	pthread_t threads[N_WORKERS];
+	for (size_t i = 0; i < N_WORKERS; ++i)
+		ASSERT_INT_EQ(0, pthread_create(&threads[i], NULL, worker,
+						(void*)i));
+
+	for (int i = 0; i < N_THREADED_JOBS; ++i) {
+		unsigned long priority = i % 5;
+		ASSERT_INT_EQ(0, workq_push(&queue_, priority, &done_[i]));
+	}
+
+	int is_done = 0;
+	while (!is_done) {
+		is_done = 1;
+		for (int i = 0; i < N_THREADED_JOBS && is_done; ++i)
+			if (__atomic_load_n(&done_[i], __ATOMIC_RELAXED) == 0)
+				is_done = 0;
+	}
+
+	workq_stop(&queue_);
+	for (size_t i = 0; i < N_WORKERS; ++i)
+		pthread_join(threads[i], NULL);
+
+	for (int i = 0; i < N_THREADED_JOBS; ++i)
+		ASSERT_UINT_EQ(1, done_[i]);
+
+	workq_destroy(&queue_);
+	return 0;
+}
+
+int main()
+{
+	int r = 0;
+	RUN_TEST(test_bands_then_fifo);
+	RUN_TEST(test_grow);
+	RUN_TEST(test_shrink_and_time_out);
+	RUN_TEST(test_threaded);
+	return r;
+}